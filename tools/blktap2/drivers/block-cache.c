@@ -27,10 +27,15 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
+#include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
@@ -58,6 +63,24 @@
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
+/*
+ * the optional ssd tier: a file per parent image, named after the
+ * image's vhd uuid, in the directory given by BLOCK_CACHE_DIR_ENV.
+ * it holds whole blocks of BLOCK_CACHE_SSD_SIZE and is indexed by
+ * block number, so it outlives tapdisk and is shared between every
+ * tapdisk reading the same golden image.
+ */
+#define BLOCK_CACHE_DIR_ENV             "TAPDISK_BLOCK_CACHE_DIR"
+#define BLOCK_CACHE_SSD_MAGIC           0x74646263 /* "tdbc" */
+#define BLOCK_CACHE_SSD_VERSION         1
+#define BLOCK_CACHE_SSD_SHIFT           16 /* 64K blocks */
+#define BLOCK_CACHE_SSD_SIZE            (1 << BLOCK_CACHE_SSD_SHIFT)
+#define BLOCK_CACHE_SSD_SECS            (BLOCK_CACHE_SSD_SIZE >> RADIX_TREE_NODE_SHIFT)
+#define BLOCK_CACHE_SSD_MAX_SIZE        (4ULL << 30) /* 4GB per image */
+#define BLOCK_CACHE_SSD_HDR_SIZE        RADIX_TREE_PAGE_SIZE
+#define BLOCK_CACHE_SSD_FILLS           16
+#define BLOCK_CACHE_SSD_ID_SIZE         40
+
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
@@ -67,6 +90,8 @@ typedef struct radix_tree_page          radix_tree_page_t;
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
+typedef struct block_cache_ssd          block_cache_ssd_t;
+typedef struct block_cache_ssd_header   block_cache_ssd_header_t;
 
 struct radix_tree_page {
 	char                           *buf;
@@ -108,6 +133,11 @@ struct block_cache_request {
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
+
+	/* ssd tier */
+	uint64_t                        blk;
+	int                             fill;
+	struct tiocb                    tiocb;
 };
 
 struct block_cache_stats {
@@ -115,6 +145,43 @@ struct block_cache_stats {
 	uint64_t                        hits;
 	uint64_t                        misses;
 	uint64_t                        prunes;
+	uint64_t                        ssd_hits;
+	uint64_t                        ssd_fills;
+};
+
+/*
+ * on-disk header of an ssd cache file.  the index of blocks follows it,
+ * one uint32_t per block of the image holding the slot + 1 caching it,
+ * then the slots themselves.  the contents can be trusted if the file
+ * was closed cleanly, or if it has been in use since the host booted:
+ * only a host crash can lose writes that the index already points at.
+ */
+struct block_cache_ssd_header {
+	uint32_t                        magic;
+	uint32_t                        version;
+	uint32_t                        block_shift;
+	uint32_t                        clean;
+	uint64_t                        sectors;
+	uint32_t                        slots;
+	uint32_t                        used;
+	char                            uuid[BLOCK_CACHE_SSD_ID_SIZE];
+	char                            boot_id[BLOCK_CACHE_SSD_ID_SIZE];
+};
+
+struct block_cache_ssd {
+	int                             fd;
+	int                             writer;
+	char                           *path;
+
+	void                           *map;
+	size_t                          map_size;
+	block_cache_ssd_header_t       *hdr;
+	uint32_t                       *index;
+	uint64_t                        blocks;
+	uint64_t                        data_off;
+
+	/* blocks being read from the parent and written out, + 1 */
+	uint64_t                        fills[BLOCK_CACHE_SSD_FILLS];
 };
 
 struct block_cache {
@@ -130,7 +197,9 @@ struct block_cache {
 	event_id_t                      timeout_id;
 
 	radix_tree_t                    tree;
+	block_cache_ssd_t               ssd;
 
+	td_driver_t                    *driver;
 	block_cache_stats_t             stats;
 };
 
@@ -516,6 +585,212 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+static void
+block_cache_ssd_boot_id(char *id, size_t size)
+{
+	FILE *f;
+
+	memset(id, 0, size);
+
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!f)
+		return;
+
+	if (fgets(id, size, f))
+		id[strcspn(id, "\n")] = '\0';
+	else
+		memset(id, 0, size);
+
+	fclose(f);
+}
+
+static int
+block_cache_ssd_image_id(block_cache_t *cache, char *id, size_t size)
+{
+	int err;
+	vhd_context_t vhd;
+
+	err = vhd_open(&vhd, cache->name, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	vhd_uuid_to_string(&vhd.footer.uuid, id, size);
+	vhd_close(&vhd);
+
+	return 0;
+}
+
+static int
+block_cache_ssd_valid(block_cache_t *cache, block_cache_ssd_header_t *hdr,
+		      uint32_t slots, const char *uuid, const char *boot_id)
+{
+	if (hdr->magic != BLOCK_CACHE_SSD_MAGIC ||
+	    hdr->version != BLOCK_CACHE_SSD_VERSION ||
+	    hdr->block_shift != BLOCK_CACHE_SSD_SHIFT ||
+	    hdr->sectors != cache->sectors ||
+	    hdr->slots != slots || hdr->used > slots ||
+	    strncmp(hdr->uuid, uuid, sizeof(hdr->uuid)))
+		return 0;
+
+	if (hdr->clean)
+		return 1;
+
+	return (boot_id[0] &&
+		!strncmp(hdr->boot_id, boot_id, sizeof(hdr->boot_id)));
+}
+
+/*
+ * the first tapdisk to lock the file fills it; any others opening the
+ * same image while it runs only read what it has published.  slots are
+ * never reused, so a published block stays valid for as long as the
+ * file does, and a full file simply stops admitting blocks.  a failure
+ * anywhere here leaves the cache in ram only.
+ */
+static void
+block_cache_ssd_open(block_cache_t *cache)
+{
+	int fd, prot;
+	void *map;
+	struct stat st;
+	const char *dir;
+	uint64_t slots, size;
+	block_cache_ssd_t *ssd;
+	block_cache_ssd_header_t hdr;
+	char uuid[BLOCK_CACHE_SSD_ID_SIZE], boot_id[BLOCK_CACHE_SSD_ID_SIZE];
+
+	ssd     = &cache->ssd;
+	ssd->fd = -1;
+	fd      = -1;
+
+	dir = getenv(BLOCK_CACHE_DIR_ENV);
+	if (!dir || !*dir)
+		return;
+
+	if (block_cache_ssd_image_id(cache, uuid, sizeof(uuid))) {
+		DPRINTF("%s: not a vhd, no ssd cache\n", cache->name);
+		return;
+	}
+
+	block_cache_ssd_boot_id(boot_id, sizeof(boot_id));
+
+	if (asprintf(&ssd->path, "%s/%s.cache", dir, uuid) == -1) {
+		ssd->path = NULL;
+		return;
+	}
+
+	ssd->blocks   = (cache->sectors + BLOCK_CACHE_SSD_SECS - 1) /
+		BLOCK_CACHE_SSD_SECS;
+	ssd->data_off = BLOCK_CACHE_SSD_HDR_SIZE +
+		ssd->blocks * sizeof(uint32_t);
+	ssd->data_off = (ssd->data_off + BLOCK_CACHE_SSD_SIZE - 1) &
+		~((uint64_t)BLOCK_CACHE_SSD_SIZE - 1);
+
+	slots = MIN(ssd->blocks,
+		    BLOCK_CACHE_SSD_MAX_SIZE >> BLOCK_CACHE_SSD_SHIFT);
+	size  = ssd->data_off + (slots << BLOCK_CACHE_SSD_SHIFT);
+
+	fd = open(ssd->path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		goto fail;
+
+	if (!flock(fd, LOCK_EX | LOCK_NB))
+		ssd->writer = 1;
+	else if (errno != EWOULDBLOCK)
+		goto fail;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    fstat(fd, &st) || st.st_size < size ||
+	    !block_cache_ssd_valid(cache, &hdr, slots, uuid, boot_id)) {
+		if (!ssd->writer)
+			goto fail;
+
+		DPRINTF("%s: resetting ssd cache %s\n",
+			cache->name, ssd->path);
+
+		/* nobody else trusts an invalid file, so it is ours to clear */
+		if (ftruncate(fd, 0) || ftruncate(fd, size))
+			goto fail;
+
+		memset(&hdr, 0, sizeof(hdr));
+	}
+
+	prot = PROT_READ | (ssd->writer ? PROT_WRITE : 0);
+	map  = mmap(NULL, ssd->data_off, prot, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	ssd->fd       = fd;
+	ssd->map      = map;
+	ssd->map_size = ssd->data_off;
+	ssd->hdr      = map;
+	ssd->index    = (uint32_t *)((char *)map + BLOCK_CACHE_SSD_HDR_SIZE);
+
+	if (ssd->writer) {
+		ssd->hdr->clean = 0;
+		strncpy(ssd->hdr->boot_id, boot_id, sizeof(ssd->hdr->boot_id));
+
+		if (ssd->hdr->magic != BLOCK_CACHE_SSD_MAGIC) {
+			ssd->hdr->version     = BLOCK_CACHE_SSD_VERSION;
+			ssd->hdr->block_shift = BLOCK_CACHE_SSD_SHIFT;
+			ssd->hdr->sectors     = cache->sectors;
+			ssd->hdr->slots       = slots;
+			ssd->hdr->used        = 0;
+			strncpy(ssd->hdr->uuid, uuid, sizeof(ssd->hdr->uuid));
+			__sync_synchronize();
+			ssd->hdr->magic       = BLOCK_CACHE_SSD_MAGIC;
+		}
+
+		/* no index entry may reach the disk ahead of the dirty mark */
+		if (msync(ssd->hdr, BLOCK_CACHE_SSD_HDR_SIZE, MS_SYNC)) {
+			munmap(ssd->map, ssd->map_size);
+			ssd->fd = -1;
+			goto fail;
+		}
+	}
+
+	DPRINTF("%s: ssd cache %s, %s, %u of %u blocks\n",
+		cache->name, ssd->path, (ssd->writer ? "filling" : "shared"),
+		ssd->hdr->used, ssd->hdr->slots);
+
+	return;
+
+fail:
+	DPRINTF("%s: no ssd cache: %d\n", cache->name, -errno);
+	if (fd != -1)
+		close(fd);
+	free(ssd->path);
+	ssd->path   = NULL;
+	ssd->writer = 0;
+}
+
+static void
+block_cache_ssd_close(block_cache_t *cache)
+{
+	block_cache_ssd_t *ssd;
+
+	ssd = &cache->ssd;
+	if (ssd->fd == -1)
+		return;
+
+	if (ssd->writer) {
+		if (!msync(ssd->map, ssd->map_size, MS_SYNC) &&
+		    !fdatasync(ssd->fd)) {
+			ssd->hdr->clean = 1;
+			msync(ssd->hdr, BLOCK_CACHE_SSD_HDR_SIZE, MS_SYNC);
+		}
+
+		DPRINTF("%s: ssd cache %s holds %u of %u blocks\n",
+			cache->name, ssd->path,
+			ssd->hdr->used, ssd->hdr->slots);
+	}
+
+	munmap(ssd->map, ssd->map_size);
+	close(ssd->fd);
+	free(ssd->path);
+	ssd->fd = -1;
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
@@ -535,6 +810,7 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		return -ENOMEM;
 
 	cache->sectors = driver->info.size;
+	cache->driver  = driver;
 
 	tree = &cache->tree;
 	err  = radix_tree_initialize(tree, cache->sectors);
@@ -554,6 +830,8 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	if (cache->timeout_id < 0)
 		goto fail;
 
+	block_cache_ssd_open(cache);
+
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
@@ -581,6 +859,7 @@ block_cache_close(td_driver_t *driver)
 	DPRINTF("closing cache for %s\n", cache->name);
 
 	tapdisk_server_unregister_event(cache->timeout_id);
+	block_cache_ssd_close(cache);
 	radix_tree_free(tree);
 	free(cache->name);
 
@@ -663,6 +942,203 @@ out:
 	block_cache_put_request(cache, breq);
 }
 
+static inline uint64_t
+block_cache_ssd_offset(block_cache_ssd_t *ssd, uint32_t slot)
+{
+	return ssd->data_off + ((uint64_t)slot << BLOCK_CACHE_SSD_SHIFT);
+}
+
+static void
+block_cache_ssd_read_done(void *arg, struct tiocb *tiocb, int err)
+{
+	td_request_t treq;
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq  = (block_cache_request_t *)arg;
+	cache = breq->cache;
+	treq  = breq->treq;
+
+	block_cache_put_request(cache, breq);
+
+	if (err) {
+		WARN("%s: ssd cache read of sec 0x%08"PRIx64" failed: %d\n",
+		     cache->name, treq.sec, err);
+		return td_forward_request(treq);
+	}
+
+	cache->stats.ssd_hits += treq.secs;
+	td_complete_request(treq, 0);
+}
+
+/*
+ * the file is not opened O_DIRECT, so this is a copy into the page
+ * cache; doing it synchronously means no fill outlives its request.
+ */
+static void
+block_cache_ssd_write(block_cache_t *cache, block_cache_request_t *breq)
+{
+	uint32_t slot;
+	block_cache_ssd_t *ssd;
+
+	ssd  = &cache->ssd;
+	slot = ssd->hdr->used;
+
+	if (slot >= ssd->hdr->slots)
+		return;
+
+	if (pwrite(ssd->fd, breq->buf, BLOCK_CACHE_SSD_SIZE,
+		   block_cache_ssd_offset(ssd, slot)) != BLOCK_CACHE_SSD_SIZE) {
+		WARN("%s: ssd cache write of block %"PRIu64" failed: %d\n",
+		     cache->name, breq->blk, -errno);
+		return;
+	}
+
+	ssd->hdr->used++;
+	ssd->index[breq->blk] = slot + 1;
+	cache->stats.ssd_fills++;
+}
+
+static void
+block_cache_ssd_fill_done(td_request_t clone, int err)
+{
+	char *buf;
+	off_t off;
+	size_t size;
+	td_request_t treq;
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		return;
+
+	treq = breq->treq;
+	off  = (treq.sec - breq->blk * BLOCK_CACHE_SSD_SECS) <<
+		RADIX_TREE_NODE_SHIFT;
+	size = treq.secs << RADIX_TREE_NODE_SHIFT;
+
+	if (!breq->err)
+		memcpy(treq.buf, breq->buf + off, size);
+
+	td_complete_request(treq, breq->err);
+
+	if (!breq->err) {
+		block_cache_ssd_write(cache, breq);
+
+		if (radix_tree_size(&cache->tree) + size < BLOCK_CACHE_MAX_SIZE &&
+		    !posix_memalign((void **)&buf, RADIX_TREE_NODE_SIZE, size)) {
+			memcpy(buf, breq->buf + off, size);
+			if (radix_tree_add_leaves(&cache->tree, buf,
+						  treq.sec, treq.secs))
+				free(buf);
+		}
+	}
+
+	cache->ssd.fills[breq->fill] = 0;
+	free(breq->buf);
+	block_cache_put_request(cache, breq);
+}
+
+/*
+ * serve a ram miss from the ssd tier: a published block is read from
+ * the file, anything else is read whole from the parent and, by the
+ * tapdisk filling the file, admitted.  returns 0 if it took @treq.
+ */
+static int
+block_cache_ssd_queue_read(block_cache_t *cache, td_request_t treq)
+{
+	int i, fill;
+	char *buf;
+	uint32_t slot;
+	uint64_t blk, secs;
+	td_request_t clone;
+	block_cache_ssd_t *ssd;
+	block_cache_request_t *breq;
+
+	ssd = &cache->ssd;
+	if (ssd->fd == -1)
+		return -1;
+
+	blk = treq.sec / BLOCK_CACHE_SSD_SECS;
+	if (blk >= ssd->blocks ||
+	    blk != (treq.sec + treq.secs - 1) / BLOCK_CACHE_SSD_SECS)
+		return -1;
+
+	slot = ssd->index[blk];
+	if (slot) {
+		breq = block_cache_get_request(cache);
+		if (!breq)
+			return -1;
+
+		breq->treq  = treq;
+		breq->cache = cache;
+
+		td_prep_read(&breq->tiocb, ssd->fd, treq.buf,
+			     treq.secs << RADIX_TREE_NODE_SHIFT,
+			     block_cache_ssd_offset(ssd, slot - 1) +
+			     ((treq.sec % BLOCK_CACHE_SSD_SECS) <<
+			      RADIX_TREE_NODE_SHIFT),
+			     block_cache_ssd_read_done, breq);
+		td_queue_tiocb(cache->driver, &breq->tiocb);
+		return 0;
+	}
+
+	if (!ssd->writer || ssd->hdr->used >= ssd->hdr->slots)
+		return -1;
+
+	fill = -1;
+	for (i = 0; i < BLOCK_CACHE_SSD_FILLS; i++) {
+		if (ssd->fills[i] == blk + 1)
+			return -1;
+		if (!ssd->fills[i] && fill == -1)
+			fill = i;
+	}
+
+	if (fill == -1)
+		return -1;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		return -1;
+
+	if (posix_memalign((void **)&buf,
+			   RADIX_TREE_PAGE_SIZE, BLOCK_CACHE_SSD_SIZE)) {
+		block_cache_put_request(cache, breq);
+		return -1;
+	}
+
+	secs = MIN(BLOCK_CACHE_SSD_SECS,
+		   cache->sectors - blk * BLOCK_CACHE_SSD_SECS);
+	if (secs < BLOCK_CACHE_SSD_SECS)
+		memset(buf + (secs << RADIX_TREE_NODE_SHIFT), 0,
+		       BLOCK_CACHE_SSD_SIZE - (secs << RADIX_TREE_NODE_SHIFT));
+
+	ssd->fills[fill] = blk + 1;
+
+	breq->treq    = treq;
+	breq->secs    = secs;
+	breq->err     = 0;
+	breq->buf     = buf;
+	breq->cache   = cache;
+	breq->blk     = blk;
+	breq->fill    = fill;
+
+	clone         = treq;
+	clone.sec     = blk * BLOCK_CACHE_SSD_SECS;
+	clone.secs    = secs;
+	clone.buf     = buf;
+	clone.cb      = block_cache_ssd_fill_done;
+	clone.cb_data = breq;
+
+	td_forward_request(clone);
+	return 0;
+}
+
 static void
 block_cache_miss(block_cache_t *cache, td_request_t treq)
 {
@@ -680,6 +1156,9 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 
 	cache->stats.misses += treq.secs;
 
+	if (!block_cache_ssd_queue_read(cache, treq))
+		return;
+
 	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
 		goto out;
 
@@ -771,6 +1250,12 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	if (cache->ssd.fd != -1)
+		WARN("ssd cache %s (%s): hits: %"PRIu64", fills: %"PRIu64", "
+		     "blocks: %u of %u\n", cache->ssd.path,
+		     (cache->ssd.writer ? "filling" : "shared"),
+		     stats->ssd_hits, stats->ssd_fills,
+		     cache->ssd.hdr->used, cache->ssd.hdr->slots);
 }
 
 struct tap_disk tapdisk_block_cache = {
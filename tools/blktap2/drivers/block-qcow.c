@@ -79,7 +79,26 @@ struct qcow_request {
 	struct tdqcow_state  *state;
 };
 
+/* a request parked until the L2 table it needs is read in */
+struct qcow_waiter {
+	td_request_t         treq;
+	struct qcow_waiter  *next;
+};
+
+struct qcow_l2_slot {
+	uint64_t             offset;     /* table cached, 0 if none */
+	int                  l1_index;
+	int                  prev, next; /* LRU ring, most recent first */
+	int                  loading;
+	struct tdqcow_state *state;
+	td_driver_t         *driver;
+	struct tiocb         tiocb;
+	struct qcow_waiter  *waiters, *tail;
+};
+
 static int decompress_cluster(struct tdqcow_state *s, uint64_t cluster_offset);
+void tdqcow_queue_read(td_driver_t *driver, td_request_t treq);
+void tdqcow_queue_write(td_driver_t *driver, td_request_t treq);
 
 uint32_t gen_cksum(char *ptr, int len)
 {
@@ -364,6 +383,304 @@ int qtruncate(int fd, off_t length, int sparse)
 	return 0;
 }
 
+/*
+ * L2 cache.  Slots are kept on a ring in LRU order, and found through
+ * l2_slot_of, indexed by L1 entry.  Slots being read in asynchronously
+ * are never evicted.
+ */
+static inline uint64_t *l2_table_of(struct tdqcow_state *s, int i)
+{
+	return s->l2_cache + ((size_t)i << s->l2_bits);
+}
+
+static void l2_lru_unlink(struct tdqcow_state *s, int i)
+{
+	struct qcow_l2_slot *slot = &s->l2_slots[i];
+
+	s->l2_slots[slot->prev].next = slot->next;
+	s->l2_slots[slot->next].prev = slot->prev;
+	if (s->l2_lru == i)
+		s->l2_lru = slot->next;
+}
+
+static void l2_lru_push(struct tdqcow_state *s, int i)
+{
+	struct qcow_l2_slot *slot = &s->l2_slots[i];
+	int head = s->l2_lru;
+
+	slot->next = head;
+	slot->prev = s->l2_slots[head].prev;
+	s->l2_slots[slot->prev].next = i;
+	s->l2_slots[head].prev = i;
+	s->l2_lru = i;
+}
+
+static void l2_touch(struct tdqcow_state *s, int i)
+{
+	if (s->l2_lru == i)
+		return;
+	l2_lru_unlink(s, i);
+	l2_lru_push(s, i);
+}
+
+static void l2_cache_reset(struct tdqcow_state *s)
+{
+	int i;
+
+	memset(s->l2_cache, 0,
+	       (size_t)s->l2_cache_size * s->l2_size * sizeof(uint64_t));
+	for (i = 0; i < s->l1_size; i++)
+		s->l2_slot_of[i] = -1;
+	for (i = 0; i < s->l2_cache_size; i++) {
+		s->l2_slots[i].offset = 0;
+		s->l2_slots[i].state  = s;
+		s->l2_slots[i].prev   = (i + s->l2_cache_size - 1) %
+			s->l2_cache_size;
+		s->l2_slots[i].next   = (i + 1) % s->l2_cache_size;
+	}
+	s->l2_lru    = 0;
+	s->l2_ndirty = 0;
+}
+
+/*
+ * Enough slots for every L2 table of the image, up to
+ * L2_CACHE_ENV (default L2_CACHE_MAX_MB) MB.
+ */
+static int l2_cache_init(struct tdqcow_state *s)
+{
+	size_t table = s->l2_size * sizeof(uint64_t);
+	uint64_t max = L2_CACHE_MAX_MB;
+	char *env;
+	int n;
+
+	env = getenv(L2_CACHE_ENV);
+	if (env && *env)
+		max = strtoull(env, NULL, 10);
+
+	n = s->l1_size;
+	if ((uint64_t)n * table > (max << 20))
+		n = (max << 20) / table;
+	if (n < L2_CACHE_SIZE)
+		n = L2_CACHE_SIZE;
+
+	s->l2_cache_size = n;
+	if (posix_memalign((void **)&s->l2_cache, 4096, (size_t)n * table))
+		return -1;
+	s->l2_slots   = calloc(n, sizeof(struct qcow_l2_slot));
+	s->l2_slot_of = calloc(s->l1_size, sizeof(int));
+	if (!s->l2_slots || !s->l2_slot_of)
+		return -1;
+
+	l2_cache_reset(s);
+
+	DPRINTF("L2 cache: %d of %d tables\n", n, s->l1_size);
+	return 0;
+}
+
+static void l2_cache_free(struct tdqcow_state *s)
+{
+	free(s->l2_cache);
+	free(s->l2_slots);
+	free(s->l2_slot_of);
+	s->l2_cache   = NULL;
+	s->l2_slots   = NULL;
+	s->l2_slot_of = NULL;
+}
+
+static void l2_forget(struct tdqcow_state *s, int i)
+{
+	struct qcow_l2_slot *slot = &s->l2_slots[i];
+
+	if (slot->offset)
+		s->l2_slot_of[slot->l1_index] = -1;
+	slot->offset = 0;
+}
+
+static inline int l2_loading(struct tdqcow_state *s, uint64_t sector)
+{
+	int i = s->l2_slot_of[(sector << 9) >> (s->l2_bits + s->cluster_bits)];
+
+	return i >= 0 && s->l2_slots[i].loading;
+}
+
+/* Write one 4K sector of a cached L2 table (for O_DIRECT). */
+static int l2_write(struct tdqcow_state *s, int i, int l2_sector)
+{
+	char *l2_ptr, *tmp_ptr;
+	int err = 0;
+
+	l2_ptr = (char *)l2_table_of(s, i) + (l2_sector << 12);
+
+	if (posix_memalign((void **)&tmp_ptr, 4096, 4096) != 0) {
+		DPRINTF("ERROR allocating memory for L2 table\n");
+		return -1;
+	}
+	memcpy(tmp_ptr, l2_ptr, 4096);
+	lseek(s->fd, s->l2_slots[i].offset + (l2_sector << 12), SEEK_SET);
+	if (write(s->fd, tmp_ptr, 4096) != 4096)
+		err = -1;
+	free(tmp_ptr);
+
+	return err;
+}
+
+static int l2_flush(struct tdqcow_state *s)
+{
+	int i, err = 0;
+
+	for (i = 0; i < s->l2_ndirty; i++)
+		if (l2_write(s, s->l2_dirty_slot[i], s->l2_dirty_sector[i]))
+			err = -1;
+	s->l2_ndirty = 0;
+
+	return err;
+}
+
+/* Note an L2 sector updated in memory, to be written by l2_flush. */
+static int l2_defer(struct tdqcow_state *s, int i, int l2_sector)
+{
+	int j;
+
+	for (j = 0; j < s->l2_ndirty; j++)
+		if (s->l2_dirty_slot[j] == i &&
+		    s->l2_dirty_sector[j] == l2_sector)
+			return 0;
+
+	if (s->l2_ndirty == L2_DIRTY_MAX && l2_flush(s))
+		return -1;
+
+	s->l2_dirty_slot[s->l2_ndirty]   = i;
+	s->l2_dirty_sector[s->l2_ndirty] = l2_sector;
+	s->l2_ndirty++;
+
+	return 0;
+}
+
+/*
+ * Give the least recently used slot that is not being read in to the
+ * table at l2_offset.  Deferred L2 writes go out first, as they may be
+ * to the table evicted.
+ */
+static int l2_evict(struct tdqcow_state *s, int l1_index, uint64_t l2_offset)
+{
+	struct qcow_l2_slot *slot;
+	int i, n;
+
+	if (s->l2_ndirty && l2_flush(s))
+		return -1;
+
+	i = s->l2_slots[s->l2_lru].prev;
+	for (n = 0; n < s->l2_cache_size; n++) {
+		if (!s->l2_slots[i].loading)
+			break;
+		i = s->l2_slots[i].prev;
+	}
+	if (n == s->l2_cache_size)
+		return -1;
+
+	l2_forget(s, i);
+
+	slot = &s->l2_slots[i];
+	slot->offset   = l2_offset;
+	slot->l1_index = l1_index;
+	s->l2_slot_of[l1_index] = i;
+	l2_touch(s, i);
+
+	return i;
+}
+
+static void l2_load_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow_l2_slot *slot = (struct qcow_l2_slot *)arg;
+	struct tdqcow_state *s = slot->state;
+	struct qcow_waiter *w, *next;
+
+	slot->loading = 0;
+	s->l2_loading--;
+
+	w = slot->waiters;
+	slot->waiters = slot->tail = NULL;
+
+	if (err) {
+		DPRINTF("ERROR reading L2 table at %"PRIu64": %d\n",
+			slot->offset, err);
+		l2_forget(s, slot - s->l2_slots);
+	}
+
+	/* in order, so that no request overtakes one parked before it */
+	for (; w; w = next) {
+		next = w->next;
+		if (err)
+			td_complete_request(w->treq, err);
+		else if (w->treq.op == TD_OP_WRITE)
+			tdqcow_queue_write(slot->driver, w->treq);
+		else
+			tdqcow_queue_read(slot->driver, w->treq);
+		free(w);
+	}
+}
+
+/*
+ * Make sure the L2 table for sector is cached before treq goes on.  If
+ * it is not, park treq on it, reading it in asynchronously unless it
+ * already is, and return 1: treq is requeued once the table is in.
+ * Tables not worth the wait are left to get_cluster_offset to read.
+ */
+static int l2_wait(td_driver_t *driver, td_request_t treq, uint64_t sector)
+{
+	struct tdqcow_state *s = (struct tdqcow_state *)driver->data;
+	struct qcow_l2_slot *slot;
+	struct qcow_waiter *w;
+	uint64_t l2_offset;
+	int i, l1_index;
+
+	l1_index  = (sector << 9) >> (s->l2_bits + s->cluster_bits);
+	l2_offset = s->l1_table[l1_index];
+	if (!l2_offset || s->min_cluster_alloc == s->l2_size)
+		return 0;
+
+	i = s->l2_slot_of[l1_index];
+	if (i >= 0 && !s->l2_slots[i].loading)
+		return 0;
+
+	if (i < 0 && s->l2_loading >= s->l2_cache_size / 2)
+		return 0;
+
+	if (!(w = malloc(sizeof(*w)))) {
+		td_complete_request(treq, -EBUSY);
+		return 1;
+	}
+	w->treq = treq;
+	w->next = NULL;
+
+	if (i < 0) {
+		i = l2_evict(s, l1_index, l2_offset);
+		if (i < 0) {
+			free(w);
+			return 0;
+		}
+
+		slot = &s->l2_slots[i];
+		slot->loading = 1;
+		slot->driver  = driver;
+		s->l2_loading++;
+
+		td_prep_read(&slot->tiocb, s->fd, (char *)l2_table_of(s, i),
+			     s->l2_size * sizeof(uint64_t), l2_offset,
+			     l2_load_done, slot);
+		td_queue_tiocb(driver, &slot->tiocb);
+	}
+
+	slot = &s->l2_slots[i];
+	if (slot->tail)
+		slot->tail->next = w;
+	else
+		slot->waiters = w;
+	slot->tail = w;
+
+	return 1;
+}
+
 /* 'allocate' is:
  *
  * 0 to not allocate.
@@ -382,11 +699,10 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
                                    int compressed_size,
                                    int n_start, int n_end)
 {
-	int min_index, i, j, l1_index, l2_index, l2_sector, l1_sector;
-	char *tmp_ptr2, *l2_ptr, *l1_ptr;
+	int slot, i, l1_index, l2_index, l2_sector, l1_sector;
+	char *l1_ptr;
 	uint64_t *tmp_ptr;
 	uint64_t l2_offset, *l2_table, cluster_offset, tmp;
-	uint32_t min_count;
 	int new_l2_table;
 
 	/*Check L1 table for the extent offset*/
@@ -457,30 +773,22 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 	}
 
 	/*Check to see if L2 entry is already cached*/
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			/* increment the hit count */
-			if (++s->l2_cache_counts[i] == 0xffffffff) {
-				for (j = 0; j < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			goto found;
-		}
+	slot = s->l2_slot_of[l1_index];
+	if (slot >= 0) {
+		/* the request path waits for tables being read in */
+		if (s->l2_slots[slot].loading)
+			return 0;
+		l2_touch(s, slot);
+		l2_table = l2_table_of(s, slot);
+		goto found;
 	}
 
 cache_miss:
-	/* not found: load a new entry in the least used one */
-	min_index = 0;
-	min_count = 0xffffffff;
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
-	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
+	/* not found: load a new entry in the least recently used one */
+	slot = l2_evict(s, l1_index, l2_offset);
+	if (slot < 0)
+		return 0;
+	l2_table = l2_table_of(s, slot);
 
 	/*If extent pre-allocated, read table from disk, 
 	 *otherwise write new table to disk*/
@@ -495,6 +803,7 @@ cache_miss:
 				  (s->cluster_size * s->l2_size), 
 				      s->sparse) != 0) {
 				DPRINTF("ERROR truncating file\n");
+				l2_forget(s, slot);
 				return 0;
 			}
 			s->fd_end = cluster_offset + 
@@ -507,18 +816,18 @@ cache_miss:
 
 		lseek(s->fd, l2_offset, SEEK_SET);
 		if (write(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) !=
-		   s->l2_size * sizeof(uint64_t))
+		   s->l2_size * sizeof(uint64_t)) {
+			l2_forget(s, slot);
 			return 0;
+		}
 	} else {
 		lseek(s->fd, l2_offset, SEEK_SET);
 		if (read(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) != 
-		    s->l2_size * sizeof(uint64_t))
+		    s->l2_size * sizeof(uint64_t)) {
+			l2_forget(s, slot);
 			return 0;
+		}
 	}
-	
-	/*Update the cache entries*/ 
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
 
 found:
 	/*The extent is split into 's->l2_size' blocks of 
@@ -596,18 +905,11 @@ found:
 
 		/*For IO_DIRECT we write 4KByte blocks*/
 		l2_sector = (l2_index * sizeof(uint64_t)) >> 12;
-		l2_ptr = (char *)l2_table + (l2_sector << 12);
-		
-		if (posix_memalign((void **)&tmp_ptr2, 4096, 4096) != 0) {
-			DPRINTF("ERROR allocating memory for L1 table\n");
-		}
-		memcpy(tmp_ptr2, l2_ptr, 4096);
-		lseek(s->fd, l2_offset + (l2_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr2, 4096) != 4096) {
-			free(tmp_ptr2);
+		if (s->l2_batch) {
+			if (l2_defer(s, slot, l2_sector))
+				return -1;
+		} else if (l2_write(s, slot, l2_sector))
 			return -1;
-		}
-		free(tmp_ptr2);
 	}
 	return cluster_offset;
 }
@@ -928,9 +1230,8 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 		goto fail;
 
 	/* alloc L2 cache */
-	size = s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t);
-	ret = posix_memalign((void **)&s->l2_cache, 4096, size);
-	if(ret != 0) goto fail;
+	if (l2_cache_init(s))
+		goto fail;
 
 	size = s->cluster_size;
 	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
@@ -972,7 +1273,7 @@ fail:
 
 	free_aio_state(s);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_free(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(fd);
@@ -993,6 +1294,12 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 
 	/*We store a local record of the request*/
 	while (nb_sectors > 0) {
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = nb_sectors;
+		if (l2_wait(driver, clone, sector))
+			return;
+
 		cluster_offset = 
 			get_cluster_offset(s, sector << 9, 0, 0, 0, 0);
 		index_in_cluster = sector & (s->cluster_sectors - 1);
@@ -1009,7 +1316,8 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
             int i;
             /* Forward entire request if possible. */
             for(i=0; i<nb_sectors; i++)
-                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0))
+                if(l2_loading(s, sector+i) ||
+                   get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0))
                     goto coalesce_failed;
             treq.buf  = buf;
             treq.sec  = sector;
@@ -1058,6 +1366,41 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 	char* buf = treq.buf;
 	td_request_t clone=treq;
 
+	/*
+	 * Allocate the request's clusters first, so that their L2 updates
+	 * go out once per L2 sector, before any of the data.
+	 */
+	s->l2_batch = 1;
+	for (sector = treq.sec, nb_sectors = treq.secs; nb_sectors > 0;
+	     sector += n, nb_sectors -= n) {
+		index_in_cluster = sector & (s->cluster_sectors - 1);
+		n = s->cluster_sectors - index_in_cluster;
+		if (n > nb_sectors)
+			n = nb_sectors;
+
+		if (l2_wait(driver, treq, sector))
+			break;
+
+		if (!get_cluster_offset(s, sector << 9, 1, 0,
+					index_in_cluster,
+					index_in_cluster + n)) {
+			ret = -EIO;
+			break;
+		}
+	}
+	s->l2_batch = 0;
+
+	if (l2_flush(s) && !ret)
+		ret = -EIO;
+	if (ret || nb_sectors > 0) {
+		/* parked, unless it failed */
+		if (ret) {
+			DPRINTF("Ooops, no write cluster offset!\n");
+			td_complete_request(treq, ret);
+		}
+		return;
+	}
+
 	sector     = treq.sec;
 	nb_sectors = treq.secs;
 		   
@@ -1167,7 +1510,7 @@ int tdqcow_close(td_driver_t *driver)
 	free_aio_state(s);
 	free(s->name);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_free(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(s->fd);	
@@ -1330,9 +1673,7 @@ static int qcow_make_empty(struct tdqcow_state *s)
 		return -1;
 	}
 
-	memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+	l2_cache_reset(s);
 
 	return 0;
 }
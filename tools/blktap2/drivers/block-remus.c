@@ -29,6 +29,18 @@
  * After a commit request, the client must wait for a competion message:
  * 4. completion
  *    "done"      4
+ * 5. compressed write batch
+ *    "zreq"      4
+ *    raw_len     4
+ *    zlen        4
+ *    buffer      zlen bytes, which zlib inflates to raw_len bytes of
+ *                write requests, each num_sectors, sector and data as in 1.
+ *
+ * The client stages writes and sends them as compressed batches, with a
+ * batch sealed whenever it grows to REMUS_BATCH_SIZE and at each commit.
+ * Batches go out from a write event on the stream, so the guest runs
+ * while they are sent; writes are held back while the data staged and not
+ * yet sent, over all remus disks in the process, is at REMUS_STAGE_MAX.
  */
 
 /* due to architectural choices in tapdisk, block-buffer is forced to
@@ -57,11 +69,25 @@
 #include <sys/sysctl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <zlib.h>
 
 /* timeout for reads and writes in ms */
 #define HEARTBEAT_MS 1000
 #define RAMDISK_HASHSIZE 128
 
+/* seconds a batch may make no progress before the backup is given up */
+#define REMUS_SEND_TIMEOUT 2
+
+/* replicated writes are compressed and sent in batches of about this */
+#define REMUS_BATCH_SIZE (256 << 10)
+/* a batch, and room for the write that takes it over REMUS_BATCH_SIZE */
+#define REMUS_STAGE_SIZE (2 * REMUS_BATCH_SIZE)
+/* staged and unsent replication data, over all remus disks */
+#define REMUS_STAGE_MAX (32 << 20)
+
+/* num_sectors and sector, ahead of the data of each write request */
+#define REMUS_RECORD_HDR (sizeof(uint32_t) + sizeof(uint64_t))
+
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
 
@@ -142,6 +168,20 @@ struct ramdisk_write_cbdata {
 	char* buf;
 };
 
+/* a message queued for the backup */
+struct remus_batch {
+	struct list_head next;
+	size_t len;
+	size_t sent;
+	char buf[0];
+};
+
+/* a write held back until there is room to stage it */
+struct remus_waiter {
+	struct list_head next;
+	td_request_t treq;
+};
+
 typedef void (*queue_rw_t) (td_driver_t *driver, td_request_t treq);
 
 /* poll_fd type for blktap2 fd system. taken from block_log.c */
@@ -172,6 +212,18 @@ struct tdremus_state {
 	/* queue write requests, batch-replicate at submit */
 	struct req_ring write_ring;
 
+	/* writes staged for the next batch */
+	char*     stage;
+	size_t    stage_len;
+	/* batches and messages to send, and the event sending them */
+	struct list_head send_queue;
+	event_id_t send_id;
+	/* writes waiting for room, and our link on remus_blocked */
+	struct list_head waiters;
+	struct list_head blocked;
+	/* commits sent and not yet acknowledged */
+	int       commits;
+
 	/* ramdisk data*/
 	struct ramdisk ramdisk;
 
@@ -191,6 +243,7 @@ typedef struct tdremus_wire {
 #define TDREMUS_WRITE "wreq"
 #define TDREMUS_SUBMIT "sreq"
 #define TDREMUS_COMMIT "creq"
+#define TDREMUS_ZWRITE "zreq"
 #define TDREMUS_DONE "done"
 #define TDREMUS_FAIL "fail"
 
@@ -729,8 +782,48 @@ static int mwrite(int fd, void* buf, size_t len)
 }
 
 
+/* bytes staged or queued to send, over all remus disks */
+static size_t remus_staged;
+/* disks with writes waiting for remus_staged to drop */
+static LIST_HEAD(remus_blocked);
+
+/* drop everything not yet sent, and send the waiting writes back */
+static void remus_drop_stream(struct tdremus_state *s)
+{
+	struct remus_batch *b, *tb;
+	struct remus_waiter *w, *tw;
+
+	if (s->send_id >= 0) {
+		tapdisk_server_unregister_event(s->send_id);
+		s->send_id = -1;
+	}
+
+	list_for_each_entry_safe(b, tb, &s->send_queue, next) {
+		remus_staged -= b->len - b->sent;
+		list_del(&b->next);
+		free(b);
+	}
+	remus_staged -= s->stage_len;
+	s->stage_len = 0;
+
+	/* tapdisk retries them in whatever mode we are in by then */
+	list_for_each_entry_safe(w, tw, &s->waiters, next) {
+		list_del(&w->next);
+		td_complete_request(w->treq, -EBUSY);
+		free(w);
+	}
+	list_del_init(&s->blocked);
+
+	if (s->commits) {
+		ctl_respond(s, TDREMUS_FAIL);
+		s->commits = 0;
+	}
+}
+
 static void inline close_stream_fd(struct tdremus_state *s)
 {
+	remus_drop_stream(s);
+
 	/* XXX: -2 is magic. replace with macro perhaps? */
 	tapdisk_server_unregister_event(s->stream_fd.id);
 	close(s->stream_fd.fd);
@@ -835,20 +928,212 @@ static void primary_queue_read(td_driver_t *driver, td_request_t treq)
 	td_forward_request(treq);
 }
 
-/* TODO:
- * The primary uses mwrite() to write the contents of a write request to the
- * backup. This effectively blocks until all data has been copied into a system
- * buffer or a timeout has occured. We may wish to instead use tapdisk's
- * nonblocking i/o interface, tapdisk_server_register_event(), to set timeouts
- * and write data in an asynchronous fashion.
+static void remus_send_event(event_id_t id, char mode, void *private);
+
+static int remus_queue(struct tdremus_state *s, struct remus_batch *b)
+{
+	event_id_t id;
+
+	list_add_tail(&b->next, &s->send_queue);
+	remus_staged += b->len;
+
+	if (s->send_id >= 0)
+		return 0;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD |
+					   SCHEDULER_POLL_TIMEOUT,
+					   s->stream_fd.fd, REMUS_SEND_TIMEOUT,
+					   remus_send_event, s);
+	if (id < 0) {
+		RPRINTF("error registering send event handler: %s\n",
+			strerror(-id));
+		return -1;
+	}
+	s->send_id = id;
+
+	return 0;
+}
+
+static int remus_queue_msg(struct tdremus_state *s, const char *msg)
+{
+	struct remus_batch *b;
+
+	if (!(b = malloc(sizeof(*b) + strlen(msg))))
+		return -1;
+
+	memcpy(b->buf, msg, strlen(msg));
+	b->len = strlen(msg);
+	b->sent = 0;
+
+	return remus_queue(s, b);
+}
+
+/* compress the staged writes into a batch and queue it */
+static int remus_seal(struct tdremus_state *s)
+{
+	struct remus_batch *b;
+	uint32_t hdr[2];
+	uLongf zlen;
+	size_t off;
+
+	if (!s->stage_len)
+		return 0;
+
+	off = strlen(TDREMUS_ZWRITE) + sizeof(hdr);
+	zlen = compressBound(s->stage_len);
+	if (!(b = malloc(sizeof(*b) + off + zlen)))
+		return -1;
+
+	if (compress2((Bytef *)b->buf + off, &zlen, (Bytef *)s->stage,
+		      s->stage_len, Z_BEST_SPEED) != Z_OK) {
+		RPRINTF("error compressing write batch\n");
+		free(b);
+		return -1;
+	}
+
+	hdr[0] = s->stage_len;
+	hdr[1] = zlen;
+	memcpy(b->buf, TDREMUS_ZWRITE, strlen(TDREMUS_ZWRITE));
+	memcpy(b->buf + strlen(TDREMUS_ZWRITE), hdr, sizeof(hdr));
+	b->len = off + zlen;
+	b->sent = 0;
+
+	remus_staged -= s->stage_len;
+	s->stage_len = 0;
+
+	return remus_queue(s, b);
+}
+
+/* copy a write into the current batch */
+static int remus_stage(struct tdremus_state *s, td_request_t treq)
+{
+	size_t len = treq.secs * s->tdremus_driver->info.sector_size;
+	uint32_t secs = treq.secs;
+	uint64_t sec = treq.sec;
+	char *p;
+
+	if (!s->stage && !(s->stage = malloc(REMUS_STAGE_SIZE)))
+		return -1;
+
+	if (REMUS_RECORD_HDR + len > REMUS_STAGE_SIZE - s->stage_len &&
+	    remus_seal(s))
+		return -1;
+
+	p = s->stage + s->stage_len;
+	memcpy(p, &secs, sizeof(secs));
+	memcpy(p + sizeof(secs), &sec, sizeof(sec));
+	memcpy(p + REMUS_RECORD_HDR, treq.buf, len);
+
+	s->stage_len += REMUS_RECORD_HDR + len;
+	remus_staged += REMUS_RECORD_HDR + len;
+
+	if (s->stage_len >= REMUS_BATCH_SIZE)
+		return remus_seal(s);
+
+	return 0;
+}
+
+static inline int remus_has_room(struct tdremus_state *s, td_request_t treq)
+{
+	size_t len = REMUS_RECORD_HDR +
+		treq.secs * s->tdremus_driver->info.sector_size;
+
+	return !remus_staged || remus_staged + len <= REMUS_STAGE_MAX;
+}
+
+/* stage a write and pass it down, or fall back to unprotected mode */
+static void primary_replicate(struct tdremus_state *s, td_request_t treq)
+{
+	if (s->stream_fd.fd < 0 || remus_stage(s, treq)) {
+		/* switch to unprotected mode and tell tapdisk to retry */
+		RPRINTF("write request replication failed, "
+			"switching to unprotected mode\n");
+		switch_mode(s->tdremus_driver, mode_unprotected);
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	td_forward_request(treq);
+}
+
+/* let waiting writes through, in order, as far as there is room */
+static void remus_kick_waiters(void)
+{
+	struct tdremus_state *s, *ts;
+	struct remus_waiter *w;
+	td_request_t treq;
+
+	list_for_each_entry_safe(s, ts, &remus_blocked, blocked) {
+		while (!list_empty(&s->waiters)) {
+			w = list_entry(s->waiters.next,
+				       struct remus_waiter, next);
+			if (!remus_has_room(s, w->treq))
+				return;
+
+			list_del(&w->next);
+			treq = w->treq;
+			free(w);
+
+			primary_replicate(s, treq);
+		}
+		list_del_init(&s->blocked);
+	}
+}
+
+/* send queued messages as far as the socket takes them */
+static void remus_send_event(event_id_t id, char mode, void *private)
+{
+	struct tdremus_state *s = (struct tdremus_state *)private;
+	struct remus_batch *b;
+	ssize_t rc;
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		RPRINTF("time out sending to backup\n");
+		goto fail;
+	}
+
+	while (!list_empty(&s->send_queue)) {
+		b = list_entry(s->send_queue.next, struct remus_batch, next);
+
+		rc = write(s->stream_fd.fd, b->buf + b->sent, b->len - b->sent);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			RPRINTF("error sending to backup: %s\n", strerror(errno));
+			goto fail;
+		}
+
+		b->sent += rc;
+		remus_staged -= rc;
+		if (b->sent < b->len)
+			break;
+
+		list_del(&b->next);
+		free(b);
+	}
+
+	if (list_empty(&s->send_queue)) {
+		tapdisk_server_unregister_event(s->send_id);
+		s->send_id = -1;
+	}
+
+	remus_kick_waiters();
+	return;
+
+ fail:
+	switch_mode(s->tdremus_driver, mode_unprotected);
+	remus_kick_waiters();
+}
+
+/*
+ * The primary stages writes and passes them down at once; they reach the
+ * backup in compressed batches, sent asynchronously.  While the staging
+ * budget is spent, writes wait (in order) for batches to drain instead.
  */
 static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-
-	char header[sizeof(uint32_t) + sizeof(uint64_t)];
-	uint32_t *sectors = (uint32_t *)header;
-	uint64_t *sector = (uint64_t *)(header + sizeof(uint32_t));
+	struct remus_waiter *w;
 
 	// RPRINTF("write: stream_fd.fd: %d\n", s->stream_fd.fd);
 
@@ -858,24 +1143,30 @@ static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 		primary_blocking_connect(s);
 	}
 
-	*sectors = treq.secs;
-	*sector = treq.sec;
-
-	if (mwrite(s->stream_fd.fd, TDREMUS_WRITE, strlen(TDREMUS_WRITE)) < 0)
-		goto fail;
-	if (mwrite(s->stream_fd.fd, header, sizeof(header)) < 0)
-		goto fail;
-
-	if (mwrite(s->stream_fd.fd, treq.buf, treq.secs * driver->info.sector_size) < 0)
-		goto fail;
+	if (s->stream_fd.fd >= 0 &&
+	    (!list_empty(&s->waiters) || !remus_has_room(s, treq))) {
+		if (!(w = malloc(sizeof(*w))))
+			goto fail;
+		w->treq = treq;
+		list_add_tail(&w->next, &s->waiters);
+		if (list_empty(&s->blocked))
+			list_add_tail(&s->blocked, &remus_blocked);
+
+		/* have what we staged sent, so that room is made */
+		if (remus_seal(s))
+			goto fail_seal;
+		return;
+	}
 
-	td_forward_request(treq);
+	primary_replicate(s, treq);
+	return;
 
+ fail_seal:
+	/* the waiters, this write with them, are retried */
+	switch_mode(s->tdremus_driver, mode_unprotected);
 	return;
 
  fail:
-	/* switch to unprotected mode and tell tapdisk to retry */
-	RPRINTF("write request replication failed, switching to unprotected mode");
 	switch_mode(s->tdremus_driver, mode_unprotected);
 	td_complete_request(treq, -EBUSY);
 }
@@ -891,9 +1182,12 @@ static int client_flush(td_driver_t *driver)
 		/* connection not yet established, nothing to flush */
 		return 0;
 
-	if (mwrite(s->stream_fd.fd, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT)) < 0) {
+	/* the commit goes out behind the rest of the epoch's writes */
+	if (s->stream_fd.fd < 0 || remus_seal(s) ||
+	    remus_queue_msg(s, TDREMUS_COMMIT)) {
 		RPRINTF("error flushing output");
-		close_stream_fd(s);
+		if (s->stream_fd.fd >= 0)
+			close_stream_fd(s);
 		return -1;
 	}
 
@@ -922,6 +1216,7 @@ static int primary_start(td_driver_t *driver)
 	tapdisk_remus.td_queue_write = primary_queue_write;
 	s->queue_flush = client_flush;
 
+	remus_drop_stream(s);
 	s->stream_fd.fd = -1;
 	s->stream_fd.id = -1;
 
@@ -1039,10 +1334,12 @@ static void remus_client_event(event_id_t id, char mode, void *private)
 
 	req[4] = '\0';
 
-	if (!strcmp(req, TDREMUS_DONE))
+	if (!strcmp(req, TDREMUS_DONE)) {
 		/* checkpoint committed, inform msg_fd */
+		if (s->commits)
+			s->commits--;
 		ctl_respond(s, TDREMUS_DONE);
-	else {
+	} else {
 		RPRINTF("received unknown message: %s\n", req);
 		close_stream_fd(s);
 	}
@@ -1238,6 +1535,70 @@ static int server_do_wreq(td_driver_t *driver)
 	return -1;
 }
 
+static int server_do_zreq(td_driver_t *driver)
+{
+	struct tdremus_state *s = (struct tdremus_state *)driver->data;
+	size_t sector_size = driver->info.sector_size;
+	char *zbuf = NULL, *raw = NULL;
+	uint32_t hdr[2], secs;
+	uint64_t sec;
+	uLongf len;
+	size_t off, n;
+
+	if (mread(s->stream_fd.fd, hdr, sizeof(hdr)) < 0)
+		goto err;
+
+	if (hdr[0] > REMUS_STAGE_SIZE || hdr[1] > compressBound(hdr[0])) {
+		RPRINTF("write batch too large: %u/%u\n", hdr[0], hdr[1]);
+		goto err;
+	}
+
+	zbuf = malloc(hdr[1]);
+	raw = malloc(hdr[0]);
+	if (!zbuf || !raw)
+		goto err;
+
+	if (mread(s->stream_fd.fd, zbuf, hdr[1]) < 0)
+		goto err;
+
+	len = hdr[0];
+	if (uncompress((Bytef *)raw, &len, (Bytef *)zbuf, hdr[1]) != Z_OK ||
+	    len != hdr[0]) {
+		RPRINTF("corrupt write batch\n");
+		goto err;
+	}
+
+	for (off = 0; off < len; off += REMUS_RECORD_HDR + n) {
+		if (len - off < REMUS_RECORD_HDR)
+			goto bad;
+		memcpy(&secs, raw + off, sizeof(secs));
+		memcpy(&sec, raw + off + sizeof(secs), sizeof(sec));
+
+		n = secs * sector_size;
+		if (len - off - REMUS_RECORD_HDR < n)
+			goto bad;
+
+		if (ramdisk_write(&s->ramdisk, sec, secs,
+				  raw + off + REMUS_RECORD_HDR) < 0)
+			goto err;
+	}
+
+	free(zbuf);
+	free(raw);
+	return 0;
+
+ bad:
+	RPRINTF("truncated write request in batch\n");
+ err:
+	/* should start failover */
+	RPRINTF("backup write batch error\n");
+	free(zbuf);
+	free(raw);
+	close_stream_fd(s);
+
+	return -1;
+}
+
 static int server_do_sreq(td_driver_t *driver)
 {
 	/*
@@ -1287,6 +1648,8 @@ static void remus_server_event(event_id_t id, char mode, void *private)
 
 	if (!strcmp(req, TDREMUS_WRITE))
 		server_do_wreq(driver);
+	else if (!strcmp(req, TDREMUS_ZWRITE))
+		server_do_zreq(driver);
 	else if (!strcmp(req, TDREMUS_SUBMIT))
 		server_do_sreq(driver);
 	else if (!strcmp(req, TDREMUS_COMMIT))
@@ -1509,11 +1872,14 @@ static void ctl_request(event_id_t id, char mode, void *private)
 	/* TODO: need to get driver somehow */
 	msg[rc] = '\0';
 	if (!strncmp(msg, "flush", 5)) {
-		if (s->queue_flush)
+		if (s->queue_flush) {
 			if ((rc = s->queue_flush(driver))) {
 				RPRINTF("error passing flush request to backup");
 				ctl_respond(s, TDREMUS_FAIL);
-			}
+			} else if (s->mode == mode_primary)
+				/* answered when the backup acknowledges it */
+				s->commits++;
+		}
 	} else {
 		RPRINTF("unknown command: %s\n", msg);
 	}
@@ -1651,6 +2017,10 @@ static int tdremus_open(td_driver_t *driver, const char *name,
 	s->stream_fd.fd = -1;
 	s->ctl_fd.fd = -1;
 	s->msg_fd.fd = -1;
+	s->send_id = -1;
+	INIT_LIST_HEAD(&s->send_queue);
+	INIT_LIST_HEAD(&s->waiters);
+	INIT_LIST_HEAD(&s->blocked);
 
 	/* TODO: this is only needed so that the server can send writes down
 	 * the driver stack from the stream_fd event handler */
@@ -1702,6 +2072,8 @@ static int tdremus_close(td_driver_t *driver)
 	}
 	if (s->stream_fd.fd >= 0)
 		close_stream_fd(s);
+	free(s->stage);
+	s->stage = NULL;
 
 	ctl_close(driver);
 
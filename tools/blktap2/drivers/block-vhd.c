@@ -109,10 +109,22 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
+/*
+ * The bitmap cache starts at VHD_CACHE_SIZE bitmaps, and grows by as many
+ * whenever a block is missed soon after its bitmap was evicted, up to
+ * VHD_CACHE_MAX.  VHD_CACHE_GHOSTS recently evicted blocks are remembered
+ * for this.
+ */
 #define VHD_CACHE_SIZE               32
+#define VHD_CACHE_MAX                1024
+#define VHD_CACHE_HASH               256
+#define VHD_CACHE_GHOSTS             (2 * VHD_CACHE_SIZE)
+
+/* bitmaps read ahead of a sequential read stream */
+#define VHD_PREFETCH                 2
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
+#define VHD_REQS_META                (VHD_CACHE_MAX + 2)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
@@ -196,6 +208,7 @@ struct vhd_bat_state {
 struct vhd_bitmap {
 	u32                       blk;
 	u64                       seqno;       /* lru sequence number */
+	struct vhd_bitmap        *hnext;       /* in bm_hash chain */
 	vhd_flag_t                status;
 
 	char                     *map;         /* map should only be modified
@@ -229,11 +242,19 @@ struct vhd_state {
 
 	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	struct vhd_bitmap        *bitmap[VHD_CACHE_MAX];
+	struct vhd_bitmap        *bm_hash[VHD_CACHE_HASH];
 
+	int                       bm_size;     /* bitmaps the cache may hold */
+	int                       bm_count;    /* bitmaps allocated so far */
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap        *bitmap_free[VHD_CACHE_MAX];
+	struct vhd_bitmap        *bitmap_list[VHD_CACHE_MAX];
+
+	u32                       bm_ghost[VHD_CACHE_GHOSTS];
+	int                       bm_ghost_next;
+
+	u64                       read_next;   /* sector after last read */
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -450,52 +471,89 @@ fail:
 	return err;
 }
 
+static void
+vhd_free_bitmap(struct vhd_bitmap *bm)
+{
+	free(bm->map);
+	free(bm->shadow);
+	free(bm);
+}
+
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
 	int i;
-	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
+	for (i = 0; i < s->bm_count; i++) {
+		vhd_free_bitmap(s->bitmap_list[i]);
+		s->bitmap_list[i] = NULL;
 		s->bitmap_free[i] = NULL;
+		s->bitmap[i]      = NULL;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	memset(s->bm_hash, 0, sizeof(s->bm_hash));
+	s->bm_count      = 0;
+	s->bm_free_count = 0;
 }
 
+/* add a bitmap to the cache's free list, if it may grow that far */
 static int
-vhd_initialize_bitmap_cache(struct vhd_state *s)
+vhd_grow_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int err, map_size;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	if (s->bm_count >= s->bm_size)
+		return -ENOSPC;
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	bm = calloc(1, sizeof(struct vhd_bitmap));
+	if (!bm)
+		return -ENOMEM;
 
-		err = posix_memalign((void **)&bm->map, 512, map_size);
-		if (err) {
-			bm->map = NULL;
-			goto fail;
-		}
+	err = posix_memalign((void **)&bm->map, 512, map_size);
+	if (err) {
+		bm->map = NULL;
+		goto fail;
+	}
 
-		err = posix_memalign((void **)&bm->shadow, 512, map_size);
-		if (err) {
-			bm->shadow = NULL;
-			goto fail;
-		}
+	err = posix_memalign((void **)&bm->shadow, 512, map_size);
+	if (err) {
+		bm->shadow = NULL;
+		goto fail;
+	}
+
+	memset(bm->map, 0, map_size);
+	memset(bm->shadow, 0, map_size);
+
+	s->bitmap_list[s->bm_count++] = bm;
+	s->bitmap_free[s->bm_free_count++] = bm;
+
+	return 0;
+
+fail:
+	vhd_free_bitmap(bm);
+	return -err;
+}
+
+static int
+vhd_initialize_bitmap_cache(struct vhd_state *s)
+{
+	int i, err;
+
+	s->bm_lru        = 0;
+	s->bm_size       = VHD_CACHE_SIZE;
+	s->bm_count      = 0;
+	s->bm_free_count = 0;
+
+	for (i = 0; i < VHD_CACHE_GHOSTS; i++)
+		s->bm_ghost[i] = DD_BLK_UNUSED;
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+		err = vhd_grow_bitmap_cache(s);
+		if (err)
+			goto fail;
 	}
 
 	return 0;
@@ -971,18 +1029,57 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = s->bm_hash[block % VHD_CACHE_HASH]; bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **p = &s->bm_hash[bm->blk % VHD_CACHE_HASH];
+
+	while (*p != bm)
+		p = &(*p)->hnext;
+	*p = bm->hnext;
+	bm->hnext = NULL;
+}
+
+static void
+remember_evicted_bitmap(struct vhd_state *s, uint32_t blk)
+{
+	s->bm_ghost[s->bm_ghost_next] = blk;
+	s->bm_ghost_next = (s->bm_ghost_next + 1) % VHD_CACHE_GHOSTS;
+}
+
+/*
+ * A miss on a recently evicted block means the working set is larger
+ * than the cache: let it grow.
+ */
+static void
+check_bitmap_miss(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+
+	if (s->bm_size >= VHD_CACHE_MAX)
+		return;
+
+	for (i = 0; i < VHD_CACHE_GHOSTS; i++)
+		if (s->bm_ghost[i] == blk)
+			break;
+	if (i == VHD_CACHE_GHOSTS)
+		return;
+
+	s->bm_ghost[i] = DD_BLK_UNUSED;
+	s->bm_size = MIN(s->bm_size + VHD_CACHE_SIZE, VHD_CACHE_MAX);
+	DBG(TLOG_INFO, "%s: bitmap cache grows to %d\n",
+	    s->vhd.file, s->bm_size);
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1037,7 +1134,7 @@ remove_lru_bitmap(struct vhd_state *s)
 	u64 seq = s->bm_lru;
 	struct vhd_bitmap *bm, *lru = NULL;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_count; i++) {
 		bm = s->bitmap[i];
 		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
 			idx = i;
@@ -1048,6 +1145,8 @@ remove_lru_bitmap(struct vhd_state *s)
 
 	if (lru) {
 		s->bitmap[idx] = NULL;
+		unhash_bitmap(s, lru);
+		remember_evicted_bitmap(s, lru->blk);
 		ASSERT(!bitmap_in_use(lru));
 	}
 
@@ -1061,6 +1160,9 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	
 	*bitmap = NULL;
 
+	if (!s->bm_free_count)
+		vhd_grow_bitmap_cache(s);
+
 	if (s->bm_free_count > 0) {
 		bm = s->bitmap_free[--s->bm_free_count];
 	} else {
@@ -1084,7 +1186,7 @@ __bitmap_lru_seqno(struct vhd_state *s)
 
 	if (s->bm_lru == 0xffffffff) {
 		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
+		for (i = 0; i < s->bm_count; i++) {
 			bm = s->bitmap[i];
 			if (bm) {
 				bm->seqno >>= 1;
@@ -1107,10 +1209,12 @@ static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_count; i++) {
 		if (!s->bitmap[i]) {
 			touch_bitmap(s, bm);
 			s->bitmap[i] = bm;
+			bm->hnext = s->bm_hash[bm->blk % VHD_CACHE_HASH];
+			s->bm_hash[bm->blk % VHD_CACHE_HASH] = bm;
 			return;
 		}
 	}
@@ -1123,15 +1227,16 @@ free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int i;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
+	for (i = 0; i < s->bm_count; i++)
 		if (s->bitmap[i] == bm)
 			break;
 
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(i < s->bm_count);
 
 	s->bitmap[i] = NULL;
+	unhash_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
@@ -1567,6 +1672,8 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 
 	offset = vhd_sectors_to_bytes(offset);
 
+	check_bitmap_miss(s, blk);
+
 	err = alloc_vhd_bitmap(s, &bm, blk);
 	if (err)
 		return err;
@@ -1670,11 +1777,30 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+/*
+ * Read the bitmaps of the blocks after blk, ahead of a sequential read
+ * stream reaching them.  This is best effort: nothing waits on them.
+ */
 static void
-vhd_queue_read(td_driver_t *driver, td_request_t treq)
+prefetch_bitmaps(struct vhd_state *s, uint32_t blk)
 {
-	struct vhd_state *s = (struct vhd_state *)driver->data;
+	uint32_t b;
+
+	for (b = blk + 1; b <= blk + VHD_PREFETCH; b++) {
+		if (b >= s->bat.bat.entries)
+			break;
+		if (bat_entry(s, b) == DD_BLK_UNUSED || test_batmap(s, b) ||
+		    get_bitmap(s, b))
+			continue;
+		if (schedule_bitmap_read(s, b))
+			break;
+		DBG(TLOG_DBG, "%s: prefetching blk: 0x%04x\n", s->vhd.file, b);
+	}
+}
 
+static void
+__vhd_queue_read(struct vhd_state *s, td_request_t treq, int sequential)
+{
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
@@ -1716,6 +1842,9 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 			err = __vhd_queue_request(s, VHD_OP_DATA_READ, clone);
 			if (err)
 				goto fail;
+
+			if (sequential)
+				prefetch_bitmaps(s, clone.sec / s->spb);
 			break;
 
 		case VHD_BM_READ_PENDING:
@@ -1743,6 +1872,16 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+vhd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	int sequential = (treq.sec == s->read_next);
+
+	s->read_next = treq.sec + treq.secs;
+	__vhd_queue_read(s, treq, sequential);
+}
+
 static void
 vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -2093,7 +2232,7 @@ finish_bitmap_read(struct vhd_request *req)
 			       tmp.op == VHD_OP_DATA_WRITE);
 
 			if (tmp.op == VHD_OP_DATA_READ)
-				vhd_queue_read(s->driver, tmp.treq);
+				__vhd_queue_read(s, tmp.treq, 0);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
 
@@ -2261,8 +2400,8 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%d of %d)\n", s->bm_count, s->bm_size);
+	for (i = 0; i < s->bm_count; i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
 		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
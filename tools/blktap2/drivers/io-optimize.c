@@ -111,9 +111,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->aio_lio_opcode = op->opcode;
+	io->data           = op->data;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
 }
 
 static inline int
@@ -129,12 +130,20 @@ iocb_optimized(struct opioctx *ctx, struct iocb *io)
 static inline int
 contiguous_sectors(struct iocb *l, struct iocb *r)
 {
-	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
+	return (l->u.c.offset + iocb_bytes(l) == r->u.c.offset);
 }
 
 static inline int
 contiguous_buffers(struct iocb *l, struct iocb *r)
 {
+	struct opio *op;
+
+	if (iocb_vectored(l)) {
+		op = (struct opio *)l->data;
+		return ((char *)op->iov[op->iovcnt - 1].iov_base +
+			op->iov[op->iovcnt - 1].iov_len == r->u.c.buf);
+	}
+
 	return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
 }
 
@@ -142,8 +151,8 @@ static inline int
 contiguous_iocbs(struct iocb *l, struct iocb *r)
 {
 	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+		(iocb_write(l) == iocb_write(r)) &&
+		contiguous_sectors(l, r));
 }
 
 static inline void
@@ -164,6 +173,7 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->buf    = io->u.c.buf;
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
+	op->opcode = io->aio_lio_opcode;
 	op->data   = io->data;
 	op->iocb   = io;
 	io->data   = op;
@@ -196,22 +206,109 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 		return -ENOMEM;
 
 	opio->head        = ophead;
-	head->u.c.nbytes += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
+
+	if (iocb_vectored(head)) {
+		ophead->iov[ophead->iovcnt - 1].iov_len += io->u.c.nbytes;
+		ophead->bytes += io->u.c.nbytes;
+	} else
+		head->u.c.nbytes += io->u.c.nbytes;
 	
 	return 0;
 }
 
+/*
+ * merge a request whose buffer does not follow on from the head's, by
+ * turning the head into a vectored iocb with a segment per buffer
+ */
 static int
-merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+merge_vector(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
-	if (head->aio_lio_opcode != io->aio_lio_opcode)
+	struct opio *ophead, *opio;
+
+	if (iocb_vectored(head) &&
+	    ((struct opio *)head->data)->iovcnt == OPIO_MAX_IOVS)
 		return -EINVAL;
 
+	ophead = opio_get(ctx, head);
+	if (!ophead)
+		return -ENOMEM;
+
+	opio = opio_get(ctx, io);
+	if (!opio)
+		return -ENOMEM;
+
+	if (!iocb_vectored(head)) {
+		ophead->iov[0].iov_base = head->u.c.buf;
+		ophead->iov[0].iov_len  = head->u.c.nbytes;
+		ophead->iovcnt          = 1;
+		ophead->bytes           = head->u.c.nbytes;
+
+		head->aio_lio_opcode = (iocb_write(head) ?
+					IO_CMD_PWRITEV : IO_CMD_PREADV);
+		head->u.c.buf        = (void *)ophead->iov;
+	}
+
+	ophead->iov[ophead->iovcnt].iov_base = io->u.c.buf;
+	ophead->iov[ophead->iovcnt].iov_len  = io->u.c.nbytes;
+	ophead->iovcnt++;
+	ophead->bytes    += io->u.c.nbytes;
+	head->u.c.nbytes  = ophead->iovcnt;
+
+	opio->head        = ophead;
+	ophead->list.tail = ophead->list.tail->next = opio;
+
+	return 0;
+}
+
+static int
+merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+{
 	if (!contiguous_iocbs(head, io))
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	if (contiguous_buffers(head, io))
+		return merge_tail(ctx, head, io);
+
+	return merge_vector(ctx, head, io);
+}
+
+static inline int
+iocb_before(struct iocb *l, struct iocb *r)
+{
+	if (l->aio_fildes != r->aio_fildes)
+		return l->aio_fildes < r->aio_fildes;
+	return l->u.c.offset < r->u.c.offset;
+}
+
+/*
+ * order a batch by file and offset, so that requests issued close to
+ * sorted become adjacent.  insertion sort is stable and cheap on the
+ * nearly sorted batches guests issue.  fails, leaving q unordered, if
+ * requests overlap: their order is kept as it was queued.
+ */
+static int
+sort_iocbs(struct iocb **q, int num)
+{
+	int i, j;
+	long long end;
+	struct iocb *io;
+
+	for (i = 1; i < num; i++) {
+		io = q[i];
+		for (j = i; j > 0 && iocb_before(io, q[j - 1]); j--)
+			q[j] = q[j - 1];
+		q[j] = io;
+	}
+
+	for (i = 1, end = q[0]->u.c.offset + q[0]->u.c.nbytes; i < num; i++) {
+		if (q[i]->aio_fildes == q[i - 1]->aio_fildes &&
+		    q[i]->u.c.offset < end)
+			return -EINVAL;
+		end = q[i]->u.c.offset + q[i]->u.c.nbytes;
+	}
+
+	return 0;
 }
 
 int
@@ -228,6 +325,12 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	q = ctx->iocb_queue;
 	memcpy(q, queue, num * sizeof(struct iocb *));
 
+	if (sort_iocbs(q, num)) {
+		DBG(ctx, "overlapping iocbs, not reordering\n");
+		memcpy(q, queue, num * sizeof(struct iocb *));
+	}
+	queue[0] = q[0];
+
 	for (i = 1; i < num; i++) {
 		io = q[i];
 		if (merge(ctx, queue[on_queue], io) != 0)
@@ -297,7 +400,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == iocb_bytes(io))
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -350,10 +453,10 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	char *type;
 
-	type = (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write");
+	type = (iocb_write(io) ? "write" : "read");
 
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
-	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
+	    " optimized: %d\n", prefix, io->u.c.offset, iocb_bytes(io), 
 	    io->u.c.buf, type, (unsigned long)io->data, 
 	    iocb_optimized(ctx, io));
 }
@@ -531,7 +634,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+		ep->res = (random() % 10 < 8 ? iocb_bytes(io) : 0);
 	}
 
 	return done;
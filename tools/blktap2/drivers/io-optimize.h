@@ -30,6 +30,10 @@
 #define __IO_OPTIMIZE_H__
 
 #include <libaio.h>
+#include <sys/uio.h>
+
+/* segments in a vectored iocb made of requests with scattered buffers */
+#define OPIO_MAX_IOVS       16
 
 struct opio;
 
@@ -42,12 +46,18 @@ struct opio {
 	char               *buf;
 	unsigned long       nbytes;
 	long long           offset;
+	short               opcode;
 	void               *data;
 	struct iocb        *iocb;
 	struct io_event     event;
 	struct opio        *head;
 	struct opio        *next;
 	struct opio_list    list;
+
+	/* set on the head of a vectored iocb */
+	unsigned long       bytes;
+	int                 iovcnt;
+	struct iovec        iov[OPIO_MAX_IOVS];
 };
 
 struct opioctx {
@@ -65,4 +75,27 @@ int io_merge(struct opioctx *ctx, struct iocb **queue, int num);
 int io_split(struct opioctx *ctx, struct io_event *events, int num);
 int io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num);
 
+static inline int
+iocb_vectored(struct iocb *io)
+{
+	return (io->aio_lio_opcode == IO_CMD_PREADV ||
+		io->aio_lio_opcode == IO_CMD_PWRITEV);
+}
+
+static inline int
+iocb_write(struct iocb *io)
+{
+	return (io->aio_lio_opcode == IO_CMD_PWRITE ||
+		io->aio_lio_opcode == IO_CMD_PWRITEV);
+}
+
+/* bytes an iocb transfers: nbytes is the segment count when vectored */
+static inline unsigned long
+iocb_bytes(struct iocb *io)
+{
+	if (iocb_vectored(io))
+		return ((struct opio *)io->data)->bytes;
+	return io->u.c.nbytes;
+}
+
 #endif
@@ -79,7 +79,12 @@ uint32_t gen_cksum(char *ptr, int len);
 int get_filesize(char *filename, uint64_t *size, struct stat *st);
 int qtruncate(int fd, off_t length, int sparse);
 
-#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu*/
+#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu, now a minimum*/
+#define L2_CACHE_MAX_MB 32 /*Cap on the cache, unless overridden by*/
+#define L2_CACHE_ENV "TAPDISK_QCOW_L2_CACHE_MB"
+#define L2_DIRTY_MAX 16   /*L2 sectors updated in memory, not on disk*/
+
+struct qcow_l2_slot;
 
 struct tdqcow_state {
         int fd;                        /*Main Qcow file descriptor */
@@ -104,10 +109,19 @@ struct tdqcow_state {
 	uint64_t l1_table_offset;      /*L1 table offset from beginning of 
 					*file*/
 	uint64_t *l1_table;            /*L1 table entries*/
-	uint64_t *l2_cache;            /*We maintain a cache of size 
-					*L2_CACHE_SIZE of most read entries*/
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];     /*L2 cache entries*/
-	uint32_t l2_cache_counts[L2_CACHE_SIZE];      /*Cache access record*/
+	uint64_t *l2_cache;            /*We maintain an LRU cache of
+					*l2_cache_size L2 tables, sized from
+					*the image geometry*/
+	int l2_cache_size;
+	struct qcow_l2_slot *l2_slots; /*Cache entries*/
+	int *l2_slot_of;               /*Slot holding each L1 entry's table,
+					*or -1*/
+	int l2_lru;                    /*Most recently used slot*/
+	int l2_loading;                /*Tables being read asynchronously*/
+	int l2_batch;                  /*Defer L2 writes to l2_dirty*/
+	int l2_ndirty;
+	int l2_dirty_slot[L2_DIRTY_MAX];
+	int l2_dirty_sector[L2_DIRTY_MAX];
 	uint8_t *cluster_cache;          
 	uint8_t *cluster_data;
 	uint64_t cluster_cache_offset; /**/
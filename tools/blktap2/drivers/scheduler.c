@@ -26,10 +26,12 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include "scheduler.h"
 #include "tapdisk-log.h"
@@ -37,6 +39,7 @@
 #define DBG(_f, _a...)               tlog_write(TLOG_DBG, _f, ##_a)
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_EVENTS         64
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -47,13 +50,24 @@
 #define scheduler_for_each_event(s, event, tmp)	\
 	list_for_each_entry_safe(event, tmp, &(s)->events, next)
 
+/*
+ * fd events stay registered with epoll from register to unregister, and
+ * timeouts are kept in a heap ordered by deadline, so a wakeup costs the
+ * events that are ready rather than all of them.  an event unregistered
+ * while events are being run is only freed once they all have, as it may
+ * still be among those ready.
+ */
 typedef struct event {
 	char                         mode;
+	char                         dead;
 	event_id_t                   id;
 
 	int                          fd;
+	int                          epoll_fd;
 	int                          timeout;
 	int                          deadline;
+	int                          heap;
+	int                          run;
 
 	event_cb_t                   cb;
 	void                        *private;
@@ -61,102 +75,259 @@ typedef struct event {
 	struct list_head             next;
 } event_t;
 
+static inline void
+scheduler_heap_set(scheduler_t *s, int i, event_t *event)
+{
+	s->heap[i]  = event;
+	event->heap = i;
+}
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_heap_up(scheduler_t *s, int i)
 {
-	int diff;
-	struct timeval now;
-	event_t *event, *tmp;
+	event_t *event = s->heap[i];
+	int parent;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (s->heap[parent]->deadline <= event->deadline)
+			break;
+		scheduler_heap_set(s, i, s->heap[parent]);
+		i = parent;
+	}
 
-	s->max_fd  = 0;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	scheduler_heap_set(s, i, event);
+}
 
-	gettimeofday(&now, NULL);
+static void
+scheduler_heap_down(scheduler_t *s, int i)
+{
+	event_t *event = s->heap[i];
+	int child;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= s->heap_size)
+			break;
+		if (child + 1 < s->heap_size &&
+		    s->heap[child + 1]->deadline < s->heap[child]->deadline)
+			child++;
+		if (event->deadline <= s->heap[child]->deadline)
+			break;
+		scheduler_heap_set(s, i, s->heap[child]);
+		i = child;
+	}
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	scheduler_heap_set(s, i, event);
+}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static int
+scheduler_heap_insert(scheduler_t *s, event_t *event)
+{
+	if (s->heap_size == s->heap_max) {
+		int max = s->heap_max ? s->heap_max * 2 : 16;
+		event_t **heap;
+
+		heap = realloc(s->expired, max * sizeof(event_t *));
+		if (!heap)
+			return -ENOMEM;
+		s->expired = heap;
+
+		heap = realloc(s->heap, max * sizeof(event_t *));
+		if (!heap)
+			return -ENOMEM;
+
+		s->heap     = heap;
+		s->heap_max = max;
+	}
+
+	scheduler_heap_set(s, s->heap_size++, event);
+	scheduler_heap_up(s, event->heap);
+
+	return 0;
+}
+
+static void
+scheduler_heap_remove(scheduler_t *s, event_t *event)
+{
+	int i = event->heap;
+
+	if (i < 0)
+		return;
+
+	event->heap = -1;
+	if (--s->heap_size == i)
+		return;
+
+	scheduler_heap_set(s, i, s->heap[s->heap_size]);
+	scheduler_heap_up(s, i);
+	scheduler_heap_down(s, s->heap[i]->heap);
+}
+
+static void
+scheduler_heap_update(scheduler_t *s, event_t *event)
+{
+	if (event->heap < 0)
+		return;
+
+	scheduler_heap_up(s, event->heap);
+	scheduler_heap_down(s, event->heap);
+}
+
+/*
+ * gather the expired events, pruning the heap at the first deadline
+ * still to come down each branch.
+ */
+static int
+scheduler_heap_expired(scheduler_t *s, int i, int now, int n)
+{
+	if (i >= s->heap_size || s->heap[i]->deadline > now)
+		return n;
+
+	s->expired[n++] = s->heap[i];
+	n = scheduler_heap_expired(s, 2 * i + 1, now, n);
+	n = scheduler_heap_expired(s, 2 * i + 2, now, n);
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
+	return n;
+}
+
+static int
+scheduler_epoll_add(scheduler_t *s, event_t *event)
+{
+	struct epoll_event ev;
+	int err;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = event;
+	if (event->mode & SCHEDULER_POLL_READ_FD)
+		ev.events |= EPOLLIN;
+	if (event->mode & SCHEDULER_POLL_WRITE_FD)
+		ev.events |= EPOLLOUT;
+	if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+		ev.events |= EPOLLPRI;
+
+	event->epoll_fd = event->fd;
+
+	err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, event->epoll_fd, &ev);
+	if (err && errno == EEXIST) {
+		/*
+		 * epoll takes each fd once; a second event on the
+		 * same file gets a duplicate of it to register.
+		 */
+		event->epoll_fd = dup(event->fd);
+		if (event->epoll_fd == -1)
+			return -errno;
+
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD,
+				event->epoll_fd, &ev);
+		if (err) {
+			err = -errno;
+			close(event->epoll_fd);
+			return err;
 		}
 	}
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+	return err ? -errno : 0;
+}
+
+static void
+scheduler_epoll_del(scheduler_t *s, event_t *event)
+{
+	struct epoll_event ev;
+
+	/* the fd may be closed already, taking the registration with it */
+	epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, event->epoll_fd, &ev);
+
+	if (event->epoll_fd != event->fd)
+		close(event->epoll_fd);
+}
+
+static int
+scheduler_prepare_events(scheduler_t *s)
+{
+	int diff, timeout;
+	struct timeval now;
+
+	timeout = SCHEDULER_MAX_TIMEOUT;
+
+	if (s->heap_size) {
+		gettimeofday(&now, NULL);
+		diff    = s->heap[0]->deadline - now.tv_sec;
+		timeout = MIN(timeout, MAX(diff, 0));
+	}
+
+	return MIN(timeout, s->max_timeout);
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
 	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
 		struct timeval now;
 		gettimeofday(&now, NULL);
 		event->deadline = now.tv_sec + event->timeout;
+		scheduler_heap_update(s, event);
 	}
 
+	event->run = s->run;
 	event->cb(event->id, mode, event->private);
 }
 
+static char
+scheduler_ready_mode(event_t *event, uint32_t events)
+{
+	if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+	    (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return SCHEDULER_POLL_READ_FD;
+
+	if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+	    (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+		return SCHEDULER_POLL_WRITE_FD;
+
+	if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+	    (events & (EPOLLPRI | EPOLLERR)))
+		return SCHEDULER_POLL_EXCEPT_FD;
+
+	return 0;
+}
+
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_run_events(scheduler_t *s, struct epoll_event *ready, int n)
 {
+	int i, expired;
+	char mode;
 	struct timeval now;
 	event_t *event, *tmp;
 
-	gettimeofday(&now, NULL);
-
- again:
-	s->restart = 0;
+	s->run++;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
-		}
+	for (i = 0; i < n; i++) {
+		event = ready[i].data.ptr;
+		if (event->dead)
+			continue;
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
-		}
+		mode = scheduler_ready_mode(event, ready[i].events);
+		if (mode)
+			scheduler_event_callback(s, event, mode);
+	}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
-		}
+	/*
+	 * each event runs at most once a pass, so a timeout is skipped
+	 * for an event just run for its fd, which has a fresh deadline.
+	 */
+	gettimeofday(&now, NULL);
+	expired = scheduler_heap_expired(s, 0, now.tv_sec, 0);
 
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+	for (i = 0; i < expired; i++) {
+		event = s->expired[i];
+		if (!event->dead && event->run != s->run)
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_TIMEOUT);
+	}
 
-	next:
-		if (s->restart)
-			goto again;
+	list_for_each_entry_safe(event, tmp, &s->dead, next) {
+		list_del(&event->next);
+		free(event);
 	}
 }
 
@@ -166,6 +337,7 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 {
 	event_t *event;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -183,18 +355,39 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 
 	event->mode     = mode;
 	event->fd       = fd;
+	event->epoll_fd = -1;
 	event->timeout  = timeout;
 	event->deadline = now.tv_sec + timeout;
+	event->heap     = -1;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
 
+	if (mode & SCHEDULER_POLL_FD) {
+		err = scheduler_epoll_add(s, event);
+		if (err)
+			goto fail;
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		err = scheduler_heap_insert(s, event);
+		if (err) {
+			if (mode & SCHEDULER_POLL_FD)
+				scheduler_epoll_del(s, event);
+			goto fail;
+		}
+	}
+
+	event->id = s->uuid++;
 	if (!s->uuid)
 		s->uuid++;
 
 	list_add_tail(&event->next, &s->events);
 
 	return event->id;
+
+fail:
+	free(event);
+	return err;
 }
 
 void
@@ -207,9 +400,13 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 
 	scheduler_for_each_event(s, event, tmp)
 		if (event->id == id) {
+			if (event->mode & SCHEDULER_POLL_FD)
+				scheduler_epoll_del(s, event);
+			scheduler_heap_remove(s, event);
+
+			event->dead = 1;
 			list_del(&event->next);
-			free(event);
-			s->restart = 1;
+			list_add(&event->next, &s->dead);
 			break;
 		}
 }
@@ -224,42 +421,43 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
-	int ret;
-	struct timeval tv;
+	int ret, timeout;
+	struct epoll_event ready[SCHEDULER_MAX_EVENTS];
 
-	scheduler_prepare_events(s);
-
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
+	timeout = scheduler_prepare_events(s);
 
 	DBG("timeout: %d, max_timeout: %d\n",
-	    s->timeout, s->max_timeout);
+	    timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	ret = epoll_wait(s->epoll_fd, ready, SCHEDULER_MAX_EVENTS,
+			 timeout * 1000);
 
-	s->restart     = 0;
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	if (ret < 0)
-		return ret;
+		return -errno;
 
-	scheduler_run_events(s);
+	scheduler_run_events(s, ready, ret);
 
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
 	memset(s, 0, sizeof(scheduler_t));
 
-	s->uuid = 1;
-
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->uuid        = 1;
+	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->dead);
+
+	s->epoll_fd = epoll_create(SCHEDULER_MAX_EVENTS);
+	if (s->epoll_fd == -1)
+		return -errno;
+
+	fcntl(s->epoll_fd, F_SETFD, FD_CLOEXEC);
+
+	return 0;
 }
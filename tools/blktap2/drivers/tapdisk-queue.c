@@ -28,11 +28,18 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <libaio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -160,6 +167,9 @@ cancel_tiocbs(struct tqueue *queue, int err)
 static int
 fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 {
+	int i;
+	struct tiocb *tiocb;
+
 	ERR(err, "io_submit error: %d of %d failed",
 	    total - succeeded, total);
 
@@ -168,6 +178,13 @@ fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 	queue->queued = io_expand_iocbs(&queue->opioctx,
 					queue->iocbs, succeeded, total);
 
+	/* io_merge may have reordered them: relink them as they now are */
+	for (i = 0; i < queue->queued; i++) {
+		tiocb = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < queue->queued ?
+			       queue->iocbs[i + 1]->data : NULL);
+	}
+
 	return cancel_tiocbs(queue, err);
 }
 
@@ -204,22 +221,33 @@ tapdisk_rwio_setup(struct tqueue *queue, int size)
 }
 
 static inline ssize_t
-tapdisk_rwio_rw(const struct iocb *iocb)
+tapdisk_rwio_rw(struct iocb *iocb)
 {
-	int fd        = iocb->aio_fildes;
-	char *buf     = iocb->u.c.buf;
+	int i, fd     = iocb->aio_fildes;
 	long long off = iocb->u.c.offset;
-	size_t size   = iocb->u.c.nbytes;
+	const struct iovec *iov, one = {
+		.iov_base = iocb->u.c.buf,
+		.iov_len  = iocb->u.c.nbytes,
+	};
+	int iovcnt    = 1;
 	ssize_t (*func)(int, void *, size_t) = 
-		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+		(iocb_write(iocb) ? vwrite : read);
+
+	iov = &one;
+	if (iocb_vectored(iocb)) {
+		iov    = (const struct iovec *)iocb->u.c.buf;
+		iovcnt = iocb->u.c.nbytes;
+	}
 
 	if (lseek(fd, off, SEEK_SET) == (off_t)-1)
 		return -errno;
 
-	if (atomicio(func, fd, buf, size) != size)
-		return -errno;
+	for (i = 0; i < iovcnt; i++)
+		if (atomicio(func, fd, iov[i].iov_base,
+			     iov[i].iov_len) != iov[i].iov_len)
+			return -errno;
 
-	return size;
+	return iocb_bytes(iocb);
 }
 
 static int
@@ -272,6 +300,38 @@ static const struct tio td_tio_rwio = {
  * libaio
  */
 
+/*
+ * io_submit() does the block layer's work in the caller's context, so a
+ * busy disk keeps the event loop's core to itself.  With TAPDISK_IO_QUEUES
+ * set to N, merged batches are spread round robin over the event loop and
+ * N - 1 submission threads.  Each thread has its own aio context and
+ * eventfd, and its completions are reaped from the loop as their own
+ * event; submissions a thread could not make come back the same way, as
+ * failed events.
+ */
+#define LIO_QUEUES_ENV          "TAPDISK_IO_QUEUES"
+#define LIO_MAX_QUEUES          16
+
+struct lio_worker {
+	struct tqueue   *queue;
+
+	io_context_t     aio_ctx;
+	int              event_fd;
+	int              event_id;
+
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	int              running;
+
+	/* handed over by the loop, being submitted, and failed */
+	struct iocb    **iocbs;
+	int              queued;
+	struct iocb    **batch;
+	struct io_event *failed;
+	int              nr_failed;
+};
+
 struct lio {
 	io_context_t     aio_ctx;
 	struct io_event *aio_events;
@@ -280,6 +340,10 @@ struct lio {
 	int              event_id;
 
 	int              flags;
+
+	struct lio_worker *workers;
+	int              nr_workers;
+	int              next_queue;
 };
 
 #define LIO_FLAG_EVENTFD        (1<<0)
@@ -396,6 +460,37 @@ fail_rsv:
 }
 
 
+static void
+tapdisk_lio_destroy_workers(struct tqueue *queue)
+{
+	struct lio *lio = queue->tio_data;
+	struct lio_worker *w;
+	int i;
+
+	for (i = 0; i < lio->nr_workers; i++) {
+		w = lio->workers + i;
+
+		pthread_mutex_lock(&w->lock);
+		w->running = 0;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		tapdisk_server_unregister_event(w->event_id);
+		io_destroy(w->aio_ctx);
+		close(w->event_fd);
+		free(w->iocbs);
+		free(w->batch);
+		free(w->failed);
+	}
+
+	free(lio->workers);
+	lio->workers    = NULL;
+	lio->nr_workers = 0;
+}
+
 static void
 tapdisk_lio_destroy(struct tqueue *queue)
 {
@@ -404,6 +499,8 @@ tapdisk_lio_destroy(struct tqueue *queue)
 	if (!lio)
 		return;
 
+	tapdisk_lio_destroy_workers(queue);
+
 	if (lio->event_id >= 0) {
 		tapdisk_server_unregister_event(lio->event_id);
 		lio->event_id = -1;
@@ -439,20 +536,14 @@ tapdisk_lio_ack_event(struct tqueue *queue)
 }
 
 static void
-tapdisk_lio_event(event_id_t id, char mode, void *private)
+tapdisk_lio_complete(struct tqueue *queue, int ret)
 {
-	struct tqueue *queue = private;
-	struct lio *lio;
-	int i, ret, split;
+	struct lio *lio = queue->tio_data;
+	int i, split;
 	struct iocb *iocb;
 	struct tiocb *tiocb;
 	struct io_event *ep;
 
-	tapdisk_lio_ack_event(queue);
-
-	lio   = queue->tio_data;
-	ret   = io_getevents(lio->aio_ctx, 0,
-			     queue->size, lio->aio_events, NULL);
 	split = io_split(&queue->opioctx, lio->aio_events, ret);
 	tapdisk_filter_events(queue->filter, lio->aio_events, split);
 
@@ -470,6 +561,205 @@ tapdisk_lio_event(event_id_t id, char mode, void *private)
 	queue_deferred_tiocbs(queue);
 }
 
+static void
+tapdisk_lio_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct lio *lio = queue->tio_data;
+	int ret;
+
+	tapdisk_lio_ack_event(queue);
+
+	ret = io_getevents(lio->aio_ctx, 0,
+			   queue->size, lio->aio_events, NULL);
+	if (ret > 0)
+		tapdisk_lio_complete(queue, ret);
+}
+
+static void
+tapdisk_lio_worker_event(event_id_t id, char mode, void *private)
+{
+	struct lio_worker *w = private;
+	struct tqueue *queue = w->queue;
+	struct lio *lio = queue->tio_data;
+	int ret, failed;
+	uint64_t val;
+
+	read_exact(w->event_fd, &val, sizeof(val));
+
+	pthread_mutex_lock(&w->lock);
+	failed = w->nr_failed;
+	memcpy(lio->aio_events, w->failed, failed * sizeof(struct io_event));
+	w->nr_failed = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	if (failed)
+		ERR((int)lio->aio_events[0].res,
+		    "io_submit error: %d failed", failed);
+
+	ret = io_getevents(w->aio_ctx, 0, queue->size - failed,
+			   lio->aio_events + failed, NULL);
+	if (ret < 0)
+		ret = 0;
+
+	if (failed + ret)
+		tapdisk_lio_complete(queue, failed + ret);
+}
+
+static void *
+tapdisk_lio_worker(void *private)
+{
+	struct lio_worker *w = private;
+	struct io_event *ep;
+	int i, n, ret;
+	uint64_t val = 1;
+
+	pthread_mutex_lock(&w->lock);
+
+	for (;;) {
+		while (!w->queued && w->running)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		if (!w->queued)
+			break;
+
+		n = w->queued;
+		memcpy(w->batch, w->iocbs, n * sizeof(struct iocb *));
+		w->queued = 0;
+
+		pthread_mutex_unlock(&w->lock);
+
+		for (i = 0; i < n; i += ret) {
+			ret = io_submit(w->aio_ctx, n - i, w->batch + i);
+			if (ret > 0)
+				continue;
+
+			/* fail the iocb refused, then carry on */
+			pthread_mutex_lock(&w->lock);
+			ep      = w->failed + w->nr_failed++;
+			ep->obj = w->batch[i];
+			ep->res = (ret < 0 ? ret : -EIO);
+			pthread_mutex_unlock(&w->lock);
+
+			write_exact(w->event_fd, &val, sizeof(val));
+			ret = 1;
+		}
+
+		pthread_mutex_lock(&w->lock);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+static int
+tapdisk_lio_setup_worker(struct tqueue *queue, struct lio_worker *w, int qlen)
+{
+	int err;
+
+	w->queue    = queue;
+	w->event_id = -1;
+	w->event_fd = -1;
+
+	err = io_setup(qlen, &w->aio_ctx);
+	if (err < 0) {
+		w->aio_ctx = 0;
+		return err;
+	}
+
+	w->event_fd = tapdisk_sys_eventfd(0);
+	if (w->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	w->iocbs  = calloc(qlen, sizeof(struct iocb *));
+	w->batch  = calloc(qlen, sizeof(struct iocb *));
+	w->failed = calloc(qlen, sizeof(struct io_event));
+	if (!w->iocbs || !w->batch || !w->failed) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	w->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      w->event_fd, 0,
+					      tapdisk_lio_worker_event,
+					      w);
+	if (w->event_id < 0) {
+		err = w->event_id;
+		goto fail;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->running = 1;
+
+	err = pthread_create(&w->thread, NULL, tapdisk_lio_worker, w);
+	if (err) {
+		err = -err;
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (w->event_id >= 0)
+		tapdisk_server_unregister_event(w->event_id);
+	if (w->event_fd >= 0)
+		close(w->event_fd);
+	io_destroy(w->aio_ctx);
+	free(w->iocbs);
+	free(w->batch);
+	free(w->failed);
+	return err;
+}
+
+/*
+ * a worker that fails to start leaves the queue with fewer threads,
+ * not without one: submission always falls back to the event loop.
+ */
+static void
+tapdisk_lio_setup_workers(struct tqueue *queue, int qlen)
+{
+	struct lio *lio = queue->tio_data;
+	const char *env;
+	int i, n, err;
+
+	env = getenv(LIO_QUEUES_ENV);
+	if (!env)
+		return;
+
+	n = atoi(env);
+	if (n > LIO_MAX_QUEUES)
+		n = LIO_MAX_QUEUES;
+	if (--n <= 0)
+		return;
+
+	if (!(lio->flags & LIO_FLAG_EVENTFD)) {
+		DPRINTF("no eventfd support, not using %d io queues\n", n + 1);
+		return;
+	}
+
+	lio->workers = calloc(n, sizeof(struct lio_worker));
+	if (!lio->workers)
+		return;
+
+	for (i = 0; i < n; i++) {
+		err = tapdisk_lio_setup_worker(queue, lio->workers + i, qlen);
+		if (err) {
+			DPRINTF("failed to start io queue %d: %d\n", i + 1, err);
+			break;
+		}
+	}
+
+	lio->nr_workers = i;
+	DPRINTF("using %d io queues\n", lio->nr_workers + 1);
+}
+
 static int
 tapdisk_lio_setup(struct tqueue *queue, int qlen)
 {
@@ -498,6 +788,8 @@ tapdisk_lio_setup(struct tqueue *queue, int qlen)
 		goto fail;
 	}
 
+	tapdisk_lio_setup_workers(queue, qlen);
+
 	return 0;
 
 fail:
@@ -505,6 +797,30 @@ fail:
 	return err;
 }
 
+static int
+tapdisk_lio_hand_over(struct tqueue *queue, struct lio_worker *w, int merged)
+{
+	int i;
+
+	for (i = 0; i < merged; ++i)
+		__io_set_eventfd(queue->iocbs[i], w->event_fd);
+
+	pthread_mutex_lock(&w->lock);
+	memcpy(w->iocbs + w->queued, queue->iocbs,
+	       merged * sizeof(struct iocb *));
+	w->queued += merged;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	DBG("queued: %d, merged: %d, handed over\n", queue->queued, merged);
+
+	queue->iocbs_pending  += merged;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	return merged;
+}
+
 static int
 tapdisk_lio_submit(struct tqueue *queue)
 {
@@ -516,6 +832,14 @@ tapdisk_lio_submit(struct tqueue *queue)
 
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
 	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	if (lio->nr_workers) {
+		lio->next_queue = (lio->next_queue + 1) % (lio->nr_workers + 1);
+		if (lio->next_queue)
+			return tapdisk_lio_hand_over(queue,
+				lio->workers + lio->next_queue - 1, merged);
+	}
+
 	tapdisk_lio_set_eventfd(queue, merged, queue->iocbs);
 	submitted = io_submit(lio->aio_ctx, merged, queue->iocbs);
 
@@ -547,6 +871,302 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef HAVE_IO_URING
+/*
+ * io_uring
+ *
+ * Requests are written to the submission ring and passed to the kernel
+ * with one io_uring_enter per batch, whether or not the files are
+ * opened O_DIRECT.  Completions are read straight off the completion
+ * ring: on the eventfd registered with the ring, and by
+ * tapdisk_complete_tiocbs between scheduler iterations, which takes no
+ * syscall at all.
+ */
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#define __NR_io_uring_enter     426
+#define __NR_io_uring_register  427
+#endif
+
+struct uring {
+	int                  ring_fd;
+	void                *ring;
+	size_t               ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t               sqes_sz;
+
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_event     *aio_events;
+
+	int                  event_fd;
+	int                  event_id;
+};
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+
+	if (!ur)
+		return;
+
+	if (ur->event_id >= 0) {
+		tapdisk_server_unregister_event(ur->event_id);
+		ur->event_id = -1;
+	}
+
+	if (ur->event_fd >= 0) {
+		close(ur->event_fd);
+		ur->event_fd = -1;
+	}
+
+	if (ur->sqes) {
+		munmap(ur->sqes, ur->sqes_sz);
+		ur->sqes = NULL;
+	}
+
+	if (ur->ring) {
+		munmap(ur->ring, ur->ring_sz);
+		ur->ring = NULL;
+	}
+
+	if (ur->ring_fd >= 0) {
+		close(ur->ring_fd);
+		ur->ring_fd = -1;
+	}
+
+	free(ur->aio_events);
+	ur->aio_events = NULL;
+}
+
+static int
+tapdisk_uring_reap(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_event *ep;
+	struct tiocb *tiocb;
+	struct iocb *iocb;
+	unsigned head, tail;
+	int i, n, split;
+
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+
+	for (n = 0; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+
+		ur->aio_events[n].obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ur->aio_events[n].res = cqe->res;
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	split = io_split(&queue->opioctx, ur->aio_events, n);
+	tapdisk_filter_events(queue->filter, ur->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", n, split);
+
+	queue->iocbs_pending  -= n;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = ur->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+
+	return split;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *ur = queue->tio_data;
+	uint64_t val;
+
+	read_exact(ur->event_fd, &val, sizeof(val));
+	tapdisk_uring_reap(queue);
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	ur->ring_fd  = -1;
+	ur->event_fd = -1;
+	ur->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	ur->ring_fd = syscall(__NR_io_uring_setup, qlen, &p);
+	if (ur->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* IORING_OP_READ and _WRITE came in the same release. */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_FAST_POLL)) {
+		err = -ENOSYS;
+		goto fail;
+	}
+
+	ur->ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (ur->ring_sz < p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe))
+		ur->ring_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+
+	ur->ring = mmap(NULL, ur->ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+			IORING_OFF_SQ_RING);
+	if (ur->ring == MAP_FAILED) {
+		ur->ring = NULL;
+		err = -errno;
+		goto fail;
+	}
+
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+			IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		err = -errno;
+		goto fail;
+	}
+
+	ur->sq_tail  = (unsigned *)((char *)ur->ring + p.sq_off.tail);
+	ur->sq_mask  = (unsigned *)((char *)ur->ring + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)((char *)ur->ring + p.sq_off.array);
+	ur->cq_head  = (unsigned *)((char *)ur->ring + p.cq_off.head);
+	ur->cq_tail  = (unsigned *)((char *)ur->ring + p.cq_off.tail);
+	ur->cq_mask  = (unsigned *)((char *)ur->ring + p.cq_off.ring_mask);
+	ur->cqes     = (struct io_uring_cqe *)
+		((char *)ur->ring + p.cq_off.cqes);
+
+	ur->event_fd = tapdisk_sys_eventfd(0);
+	if (ur->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = syscall(__NR_io_uring_register, ur->ring_fd,
+		      IORING_REGISTER_EVENTFD, &ur->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	ur->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      ur->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = ur->event_id;
+	if (err < 0)
+		goto fail;
+
+	ur->aio_events = calloc(p.cq_entries, sizeof(struct io_event));
+	if (!ur->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned tail;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tail = *ur->sq_tail;
+	for (i = 0; i < merged; i++) {
+		struct iocb *iocb = queue->iocbs[i];
+		unsigned idx = (tail + i) & *ur->sq_mask;
+		struct io_uring_sqe *sqe = &ur->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		if (iocb_vectored(iocb))
+			sqe->opcode = (iocb_write(iocb) ?
+				       IORING_OP_WRITEV : IORING_OP_READV);
+		else
+			sqe->opcode = (iocb_write(iocb) ?
+				       IORING_OP_WRITE : IORING_OP_READ);
+		sqe->fd        = iocb->aio_fildes;
+		sqe->addr      = (uintptr_t)iocb->u.c.buf;
+		sqe->len       = iocb->u.c.nbytes;
+		sqe->off       = iocb->u.c.offset;
+		sqe->user_data = (uintptr_t)iocb;
+		ur->sq_array[idx] = idx;
+	}
+	__atomic_store_n(ur->sq_tail, tail + merged, __ATOMIC_RELEASE);
+
+	submitted = syscall(__NR_io_uring_enter, ur->ring_fd, merged, 0, 0,
+			    NULL, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/* Take back what the kernel did not, before failing it. */
+	if (submitted < merged)
+		__atomic_store_n(ur->sq_tail, tail + submitted,
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name         = "uring",
+	.data_size    = sizeof(struct uring),
+	.tio_setup    = tapdisk_uring_setup,
+	.tio_destroy  = tapdisk_uring_destroy,
+	.tio_submit   = tapdisk_uring_submit,
+	.tio_complete = tapdisk_uring_reap,
+};
+#endif
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1195,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef HAVE_IO_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -730,6 +1355,18 @@ tapdisk_cancel_tiocbs(struct tqueue *queue)
 	return cancel_tiocbs(queue, -EIO);
 }
 
+/*
+ * complete_tiocbs may queue more tiocbs
+ */
+int
+tapdisk_complete_tiocbs(struct tqueue *queue)
+{
+	if (!queue->tio || !queue->tio->tio_complete)
+		return 0;
+
+	return queue->tio->tio_complete(queue);
+}
+
 int
 tapdisk_cancel_all_tiocbs(struct tqueue *queue)
 {
@@ -208,8 +208,15 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	int err;
+
+	err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+				 TIO_DRV_URING, NULL);
+	if (err)
+		err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+
+	return err;
 }
 
 static void
@@ -239,6 +246,11 @@ tapdisk_server_iterate(void)
 
 	tapdisk_server_check_vbds();
 	tapdisk_server_submit_tiocbs();
+
+	/* Take completions that came in meanwhile, without waiting. */
+	if (tapdisk_complete_tiocbs(&server.aio_queue))
+		tapdisk_server_submit_tiocbs();
+
 	tapdisk_server_kick_responses();
 }
 
@@ -283,9 +295,7 @@ tapdisk_server_init(void)
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
 
-	scheduler_initialize(&server.scheduler);
-
-	return 0;
+	return scheduler_initialize(&server.scheduler);
 }
 
 int
@@ -311,7 +321,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
@@ -29,122 +29,545 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 
+/*
+ * Blocks are read from the child by a number of threads, each with its
+ * own context on the child and each taking a run of COALESCE_CHUNK
+ * blocks at a time, so that they read mostly sequentially and apart.
+ * A raw parent is written by the readers themselves.  A vhd parent is
+ * written by the main thread only, as allocating in it is not safe to
+ * share: each block costs it a single bitmap update, and its BAT is
+ * written every COALESCE_BAT_BATCH allocations rather than after each.
+ */
+#define COALESCE_CHUNK          32
+#define COALESCE_QUEUE          4       /* blocks queued per reader */
+#define COALESCE_BAT_BATCH      64
+#define COALESCE_MAX_THREADS    64
+
+typedef struct coalesce_block {
+	uint32_t                block;
+	char                   *buf;
+	char                   *map;   /* NULL if the block is full */
+	struct coalesce_block  *next;
+} coalesce_block_t;
+
+typedef struct coalesce {
+	vhd_context_t          *vhd;
+	vhd_context_t          *parent;        /* NULL if raw */
+	int                     parent_fd;
+	int                     direct;        /* write the vhd parent directly */
+
+	uint32_t                next;
+	int                     err;
+
+	pthread_mutex_t         lock;
+	pthread_cond_t          cond;
+	coalesce_block_t       *ready;
+	int                     nr_ready;
+	int                     max_ready;
+	int                     readers;
+
+	/* rate limit, in bytes per second; 0 for none */
+	uint64_t                rate;
+	uint64_t                bytes;
+	struct timeval          start;
+
+	/* vhd parent */
+	off_t                   eod;           /* in sectors */
+	char                   *zeros;
+	size_t                  zeros_size;
+	int                     allocated;
+	int                     batmap_dirty;
+} coalesce_t;
+
+static void
+coalesce_error(coalesce_t *c, int err)
+{
+	pthread_mutex_lock(&c->lock);
+	if (!c->err)
+		c->err = err;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void
+coalesce_throttle(coalesce_t *c, uint64_t bytes)
+{
+	uint64_t total, due, elapsed;
+	struct timeval now;
+
+	if (!c->rate)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	c->bytes += bytes;
+	total     = c->bytes;
+	pthread_mutex_unlock(&c->lock);
+
+	due = (total / c->rate) * 1000000 +
+		(total % c->rate) * 1000000 / c->rate;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - c->start.tv_sec) * 1000000ULL +
+		now.tv_usec - c->start.tv_usec;
+
+	if (due > elapsed)
+		usleep(due - elapsed);
+}
+
+static void
+coalesce_free_block(coalesce_block_t *b)
+{
+	if (!b)
+		return;
+
+	free(b->buf);
+	free(b->map);
+	free(b);
+}
+
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 {
-	off_t off;
-	size_t ret;
+	ssize_t ret;
 
 	errno = 0;
-	off = lseek(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
-	}
-
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
+	ret = pwrite(fd, buf, vhd_sectors_to_bytes(secs),
+		     vhd_sectors_to_bytes(sec));
 	if (ret == vhd_sectors_to_bytes(secs))
 		return 0;
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
+	printf("raw parent: write of 0x%"PRIx64" at 0x%08"PRIx64" returned "
+	       "%zd, errno: %d\n", vhd_sectors_to_bytes(secs),
+	       vhd_sectors_to_bytes(sec), ret, -errno);
 	return (errno ? -errno : -EIO);
 }
 
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * Write each run of sectors of @b that the child holds to the parent.
+ */
+static int
+coalesce_write_runs(coalesce_t *c, coalesce_block_t *b, uint64_t data)
+{
+	int err;
+	char *buf;
+	uint32_t i, secs, spb;
+	uint64_t sec;
+
+	spb = c->vhd->spb;
+
+	for (i = 0; i < spb; i++) {
+		if (b->map && !vhd_bitmap_test(c->vhd, b->map, i))
+			continue;
+
+		for (secs = 0; i + secs < spb; secs++)
+			if (b->map && !vhd_bitmap_test(c->vhd, b->map, i + secs))
+				break;
+
+		buf = b->buf + vhd_sectors_to_bytes(i);
+		sec = (uint64_t)b->block * spb + i;
+
+		if (!c->parent)
+			err = __raw_io_write(c->parent_fd, buf, sec, secs);
+		else if (!c->direct)
+			err = vhd_io_write(c->parent, buf, sec, secs);
+		else
+			err = __raw_io_write(c->parent->fd, buf,
+					     data + i, secs);
+		if (err)
+			return err;
+
+		i += secs;
+	}
+
+	return 0;
+}
+
+/*
+ * Like the allocation in vhd_io_write(), but leaving the BAT to be
+ * written in batches and keeping the end of data to hand.
  */
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+coalesce_allocate_block(coalesce_t *c, uint32_t block)
+{
+	int err, gap, spp;
+	vhd_context_t *parent;
+	size_t size;
+	off_t off;
+
+	parent = c->parent;
+	spp    = getpagesize() >> VHD_SECTOR_SHIFT;
+	off    = c->eod;
+	gap    = 0;
+
+	/* data region of segment should begin on page boundary */
+	if ((off + parent->bm_secs) % spp)
+		gap = (spp - ((off + parent->bm_secs) % spp));
+
+	size = vhd_sectors_to_bytes(parent->spb + parent->bm_secs + gap);
+	err  = __raw_io_write(parent->fd, c->zeros, off,
+			      parent->spb + parent->bm_secs + gap);
+	if (err)
+		return err;
+
+	parent->bat.bat[block] = off + gap;
+	c->eod = off + gap + parent->bm_secs + parent->spb;
+
+	if (++c->allocated < COALESCE_BAT_BATCH)
+		return 0;
+
+	c->allocated = 0;
+	return vhd_write_bat(parent, &parent->bat);
+}
+
+static int
+coalesce_write_vhd(coalesce_t *c, coalesce_block_t *b)
 {
 	int i, err;
-	char *buf, *map;
-	uint64_t sec, secs;
+	char *map;
+	vhd_context_t *parent;
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	parent = c->parent;
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+	if (!c->direct)
+		return coalesce_write_runs(c, b, 0);
+
+	if (parent->bat.bat[b->block] == DD_BLK_UNUSED) {
+		err = coalesce_allocate_block(c, b->block);
+		if (err)
+			return err;
+	}
+
+	err = coalesce_write_runs(c, b,
+				  parent->bat.bat[b->block] + parent->bm_secs);
+	if (err)
+		return err;
+
+	if (vhd_has_batmap(parent) &&
+	    vhd_batmap_test(parent, &parent->batmap, b->block))
 		return 0;
 
-	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
+	err = vhd_read_bitmap(parent, b->block, &map);
 	if (err)
-		return -err;
+		return err;
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
+	for (i = 0; i < parent->spb; i++)
+		if (!b->map || vhd_bitmap_test(c->vhd, b->map, i))
+			vhd_bitmap_set(parent, map, i);
+
+	err = vhd_write_bitmap(parent, b->block, map);
 	if (err)
-		goto done;
+		goto out;
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+	if (vhd_has_batmap(parent)) {
+		for (i = 0; i < parent->spb; i++)
+			if (!vhd_bitmap_test(parent, map, i))
+				goto out;
+
+		vhd_batmap_set(parent, &parent->batmap, b->block);
+		c->batmap_dirty = 1;
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
+out:
+	free(map);
+	return err;
+}
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+static int
+coalesce_read_block(coalesce_t *c, vhd_context_t *vhd,
+		    uint32_t block, coalesce_block_t **bp)
+{
+	int err;
+	coalesce_block_t *b;
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
-				break;
+	*bp = NULL;
 
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+
+	b->block = block;
+
+	err = posix_memalign((void **)&b->buf, 4096, vhd->header.block_size);
+	if (err) {
+		b->buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	coalesce_throttle(c, vhd->header.block_size);
+
+	err = vhd_io_read(vhd, b->buf, (uint64_t)block * vhd->spb, vhd->spb);
+	if (err)
+		goto fail;
+
+	if (!vhd_has_batmap(vhd) || !vhd_batmap_test(vhd, &vhd->batmap, block)) {
+		err = vhd_read_bitmap(vhd, block, &b->map);
 		if (err)
-			goto done;
+			goto fail;
+	}
 
-		i += secs;
+	*bp = b;
+	return 0;
+
+fail:
+	coalesce_free_block(b);
+	return err;
+}
+
+static void *
+coalesce_reader(void *private)
+{
+	coalesce_t *c = private;
+	coalesce_block_t *b;
+	vhd_context_t vhd;
+	uint32_t i, end;
+	int err;
+
+	err = vhd_open(&vhd, c->vhd->file, VHD_OPEN_RDONLY);
+	if (err)
+		goto out;
+
+	err = vhd_get_bat(&vhd);
+	if (!err && vhd_has_batmap(&vhd))
+		err = vhd_get_batmap(&vhd);
+	if (err)
+		goto close;
+
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		i       = c->next;
+		end     = MIN(i + COALESCE_CHUNK, vhd.bat.entries);
+		c->next = end;
+		err     = c->err;
+		pthread_mutex_unlock(&c->lock);
+
+		if (err || i >= end)
+			break;
+
+		for (; i < end; i++) {
+			if (vhd.bat.bat[i] == DD_BLK_UNUSED)
+				continue;
+
+			err = coalesce_read_block(c, &vhd, i, &b);
+			if (err)
+				goto close;
+
+			if (!c->parent) {
+				err = coalesce_write_runs(c, b, 0);
+				coalesce_free_block(b);
+				if (err)
+					goto close;
+				continue;
+			}
+
+			pthread_mutex_lock(&c->lock);
+			while (c->nr_ready >= c->max_ready && !c->err)
+				pthread_cond_wait(&c->cond, &c->lock);
+			if (c->err) {
+				pthread_mutex_unlock(&c->lock);
+				coalesce_free_block(b);
+				goto close;
+			}
+			b->next  = c->ready;
+			c->ready = b;
+			c->nr_ready++;
+			pthread_cond_broadcast(&c->cond);
+			pthread_mutex_unlock(&c->lock);
+		}
+	}
+
+close:
+	vhd_close(&vhd);
+out:
+	if (err) {
+		printf("error coalescing %s: %d\n", c->vhd->file, err);
+		coalesce_error(c, err);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	c->readers--;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+/*
+ * Write the blocks the readers queue to the vhd parent until they are
+ * done, then what was left to batch.
+ */
+static int
+coalesce_write_parent(coalesce_t *c)
+{
+	int err;
+	coalesce_block_t *b;
+	vhd_context_t *parent;
+
+	parent = c->parent;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (!c->ready && c->readers)
+			pthread_cond_wait(&c->cond, &c->lock);
+
+		b = c->ready;
+		if (!b)
+			break;
+
+		c->ready = b->next;
+		c->nr_ready--;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+
+		err = c->err ? 0 : coalesce_write_vhd(c, b);
+		if (err) {
+			printf("error writing block %u to %s: %d\n",
+			       b->block, parent->file, err);
+			coalesce_error(c, err);
+		}
+		coalesce_free_block(b);
+
+		pthread_mutex_lock(&c->lock);
+	}
+	err = c->err;
+	pthread_mutex_unlock(&c->lock);
+
+	if (!c->direct)
+		return err;
+
+	if (c->allocated) {
+		int ret = vhd_write_bat(parent, &parent->bat);
+		err = (err ? : ret);
+	}
+
+	if (c->batmap_dirty) {
+		int ret = vhd_write_batmap(parent, &parent->batmap);
+		err = (err ? : ret);
+	}
+
+	if (c->allocated || c->batmap_dirty) {
+		int ret = vhd_write_footer(parent, &parent->footer);
+		err = (err ? : ret);
+	}
+
+	return err;
+}
+
+static int
+coalesce_setup_parent(coalesce_t *c)
+{
+	int err, spp;
+	off_t eod;
+	vhd_context_t *parent = c->parent;
+
+	if (!vhd_type_dynamic(parent) || parent->spb != c->vhd->spb)
+		return 0;
+
+	err = vhd_get_bat(parent);
+	if (!err && vhd_has_batmap(parent))
+		err = vhd_get_batmap(parent);
+	if (!err)
+		err = vhd_end_of_data(parent, &eod);
+	if (err)
+		return err;
+
+	spp = getpagesize() >> VHD_SECTOR_SHIFT;
+
+	c->eod        = eod >> VHD_SECTOR_SHIFT;
+	c->zeros_size = vhd_sectors_to_bytes(parent->spb + parent->bm_secs + spp);
+	c->zeros      = mmap(0, c->zeros_size, PROT_READ,
+			     MAP_SHARED | MAP_ANON, -1, 0);
+	if (c->zeros == MAP_FAILED) {
+		c->zeros = NULL;
+		return -errno;
+	}
+
+	c->direct = 1;
+	return 0;
+}
+
+static int
+vhd_util_coalesce_run(coalesce_t *c, int threads)
+{
+	pthread_t tids[COALESCE_MAX_THREADS];
+	int i, err, started;
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	c->max_ready = threads * COALESCE_QUEUE;
+	gettimeofday(&c->start, NULL);
+
+	for (started = 0; started < threads; started++) {
+		pthread_mutex_lock(&c->lock);
+		c->readers++;
+		pthread_mutex_unlock(&c->lock);
+
+		err = pthread_create(&tids[started], NULL, coalesce_reader, c);
+		if (err) {
+			printf("failed to start reader %d: %d\n", started, -err);
+			pthread_mutex_lock(&c->lock);
+			c->readers--;
+			pthread_mutex_unlock(&c->lock);
+			if (!started)
+				c->err = -err;
+			break;
+		}
 	}
 
 	err = 0;
+	if (c->parent)
+		err = coalesce_write_parent(c);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	if (!err)
+		err = c->err;
+
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->lock);
 
-done:
-	free(buf);
-	free(map);
 	return err;
 }
 
 int
 vhd_util_coalesce(int argc, char **argv)
 {
-	int err, c;
-	uint64_t i;
+	int err, c, threads;
 	char *name, *pname;
 	vhd_context_t vhd, parent;
+	coalesce_t co;
 	int parent_fd = -1;
 
-	name  = NULL;
-	pname = NULL;
+	name    = NULL;
+	pname   = NULL;
+	threads = 1;
 	parent.file = NULL;
+	memset(&co, 0, sizeof(co));
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:t:r:h")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
 			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > COALESCE_MAX_THREADS)
+				goto usage;
+			break;
+		case 'r':
+			co.rate = strtoull(optarg, NULL, 10) << 20;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -172,6 +595,7 @@ vhd_util_coalesce(int argc, char **argv)
 		if (parent_fd == -1) {
 			err = -errno;
 			printf("failed to open parent %s: %d\n", pname, err);
+			free(pname);
 			vhd_close(&vhd);
 			return err;
 		}
@@ -185,25 +609,21 @@ vhd_util_coalesce(int argc, char **argv)
 		}
 	}
 
-	err = vhd_get_bat(&vhd);
-	if (err)
-		goto done;
-
-	if (vhd_has_batmap(&vhd)) {
-		err = vhd_get_batmap(&vhd);
-		if (err)
-			goto done;
-	}
+	co.vhd       = &vhd;
+	co.parent    = (parent.file ? &parent : NULL);
+	co.parent_fd = parent_fd;
 
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
+	if (co.parent) {
+		err = coalesce_setup_parent(&co);
 		if (err)
 			goto done;
 	}
 
-	err = 0;
+	err = vhd_util_coalesce_run(&co, threads);
 
  done:
+	if (co.zeros)
+		munmap(co.zeros, co.zeros_size);
 	free(pname);
 	vhd_close(&vhd);
 	if (parent.file)
@@ -213,6 +633,7 @@ vhd_util_coalesce(int argc, char **argv)
 	return err;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-t threads] [-r rate limit, MB/s] "
+	       "[-h help]\n");
 	return -EINVAL;
 }
@@ -37,6 +37,12 @@
 #include <sys/mman.h>
 #include <time.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
 #if defined(__NetBSD__) || defined(__OpenBSD__)
 #include <util.h>
 #elif defined(__linux__)
@@ -56,6 +62,14 @@
 /* Duration of each time period in ms */
 #define RATE_LIMIT_PERIOD 200
 
+/* Size of the output buffer of a domain without a console/limit */
+#define BUFFER_DEFAULT_CAPACITY (64 * 1024)
+/* Smallest output buffer, whatever console/limit says */
+#define BUFFER_MIN_CAPACITY 4096
+
+/* Most iovecs handed to one writev() of a log */
+#define LOG_IOV_BATCH 64
+
 extern int log_reload;
 extern int log_guest;
 extern int log_hv;
@@ -70,24 +84,52 @@ static int log_hv_fd = -1;
 
 static xc_gnttab *xcg_handle = NULL;
 
+/*
+ * A file descriptor handle_io() waits on.  Each time round its loop, the
+ * events wanted are set on every watch (none to stop waiting on it), and
+ * once woken it looks at revents.  With epoll the kernel keeps the set
+ * between loops and is only told of changes; elsewhere the pollfd array is
+ * rebuilt every loop.
+ */
+struct watch {
+	int fd;
+	short events;
+	short revents;
+};
+
+#ifdef USE_EPOLL
+/* Most events taken from the kernel by one epoll_wait() */
+#define WATCH_BATCH 64
+
+static int epoll_fd = -1;
+#else
 static struct pollfd  *fds;
+static struct watch **fd_watches;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
 
 #define ROUNDUP(_x,_w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
+#endif
 
+/*
+ * Output of a domain waiting to be written to its tty, in a ring of fixed
+ * capacity.  consumed and produced are free running.  If the ring fills, the
+ * oldest output is discarded (and counted in dropped), or, if keeping
+ * overflowed data, the rest is left in the domain's ring until there is room.
+ */
 struct buffer {
 	char *data;
 	size_t consumed;
-	size_t size;
+	size_t produced;
 	size_t capacity;
 	size_t max_capacity;
+	unsigned long long dropped;
 };
 
 struct domain {
 	int domid;
 	int master_fd;
-	int master_pollfd_idx;
+	struct watch master_watch;
 	int slave_fd;
 	int log_fd;
 	bool is_dead;
@@ -99,7 +141,7 @@ struct domain {
 	evtchn_port_or_error_t local_port;
 	evtchn_port_or_error_t remote_port;
 	xc_evtchn *xce_handle;
-	int xce_pollfd_idx;
+	struct watch xce_watch;
 	struct xencons_interface *interface;
 	int event_count;
 	long long next_period;
@@ -107,6 +149,14 @@ struct domain {
 
 static struct domain *dom_head;
 
+/* To be called when the fd of a watch is closed, taking it out of the set. */
+static void forget_watch(struct watch *w)
+{
+	w->fd = -1;
+	w->events = 0;
+	w->revents = 0;
+}
+
 static int write_all(int fd, const char* buf, size_t len)
 {
 	while (len) {
@@ -122,6 +172,28 @@ static int write_all(int fd, const char* buf, size_t len)
 	return 0;
 }
 
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t ret = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (ret) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
 static int write_with_timestamp(int fd, const char *data, size_t sz,
 				int *needts)
 {
@@ -130,16 +202,27 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 	const struct tm *tmnow = localtime(&now);
 	size_t tslen = strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", tmnow);
 	const char *last_byte = data + sz - 1;
+	struct iovec iov[LOG_IOV_BATCH];
+	int n = 0;
 
+	/* Gather the lines and their timestamps into as few writes as we can */
 	while (data <= last_byte) {
 		const char *nl = memchr(data, '\n', last_byte + 1 - data);
 		int found_nl = (nl != NULL);
 		if (!found_nl)
 			nl = last_byte;
 
-		if ((*needts && write_all(fd, ts, tslen))
-		    || write_all(fd, data, nl + 1 - data))
-			return -1;
+		if (n > LOG_IOV_BATCH - 2) {
+			if (writev_all(fd, iov, n))
+				return -1;
+			n = 0;
+		}
+		if (*needts) {
+			iov[n].iov_base = ts;
+			iov[n++].iov_len = tslen;
+		}
+		iov[n].iov_base = (char *)data;
+		iov[n++].iov_len = nl + 1 - data;
 
 		*needts = found_nl;
 		data = nl + 1;
@@ -150,7 +233,17 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		}
 	}
 
-	return 0;
+	return n ? writev_all(fd, iov, n) : 0;
+}
+
+static size_t buffer_size(struct buffer *buffer)
+{
+	return buffer->produced - buffer->consumed;
+}
+
+static bool buffer_full(struct buffer *buffer)
+{
+	return buffer->data && buffer_size(buffer) == buffer->capacity;
 }
 
 static void buffer_append(struct domain *dom)
@@ -158,6 +251,8 @@ static void buffer_append(struct domain *dom)
 	struct buffer *buffer = &dom->buffer;
 	XENCONS_RING_IDX cons, prod, size;
 	struct xencons_interface *intf = dom->interface;
+	char data[sizeof(intf->out)];
+	size_t i, space, off, len;
 
 	cons = intf->out_cons;
 	prod = intf->out_prod;
@@ -167,18 +262,25 @@ static void buffer_append(struct domain *dom)
 	if ((size == 0) || (size > sizeof(intf->out)))
 		return;
 
-	if ((buffer->capacity - buffer->size) < size) {
-		buffer->capacity += (size + 1024);
-		buffer->data = realloc(buffer->data, buffer->capacity);
+	if (buffer->data == NULL) {
+		buffer->capacity = buffer->max_capacity ?
+			MAX(buffer->max_capacity, BUFFER_MIN_CAPACITY) :
+			BUFFER_DEFAULT_CAPACITY;
+		buffer->data = malloc(buffer->capacity);
 		if (buffer->data == NULL) {
 			dolog(LOG_ERR, "Memory allocation failed");
 			exit(ENOMEM);
 		}
 	}
 
-	while (cons != prod)
-		buffer->data[buffer->size++] = intf->out[
-			MASK_XENCONS_IDX(cons++, intf->out)];
+	space = buffer->capacity - buffer_size(buffer);
+	if (!discard_overflowed_data && size > space)
+		size = space;
+	if (size == 0)
+		return;
+
+	for (i = 0; i < size; i++)
+		data[i] = intf->out[MASK_XENCONS_IDX(cons++, intf->out)];
 
 	xen_mb();
 	intf->out_cons = cons;
@@ -192,14 +294,10 @@ static void buffer_append(struct domain *dom)
 		int logret;
 		if (log_time_guest) {
 			logret = write_with_timestamp(
-				dom->log_fd,
-				buffer->data + buffer->size - size,
-				size, &log_time_guest_needts);
+				dom->log_fd, data, size,
+				&log_time_guest_needts);
 		} else {
-			logret = write_all(
-				dom->log_fd,
-				buffer->data + buffer->size - size,
-				size);
+			logret = write_all(dom->log_fd, data, size);
 		}
 		if (logret < 0)
 			dolog(LOG_ERR, "Write to log failed "
@@ -207,45 +305,33 @@ static void buffer_append(struct domain *dom)
 			      dom->domid, errno, strerror(errno));
 	}
 
-	if (discard_overflowed_data && buffer->max_capacity &&
-	    buffer->size > 5 * buffer->max_capacity / 4) {
-		if (buffer->consumed > buffer->max_capacity / 4) {
-			/* Move data up in buffer, since beginning has
-			 * been output.  Only needed because buffer is
-			 * not a ring buffer *sigh* */
-			memmove(buffer->data,
-				buffer->data + buffer->consumed,
-				buffer->size - buffer->consumed);
-			buffer->size -= buffer->consumed;
-			buffer->consumed = 0;
-		} else {
-			/* Discard the middle of the data. */
-			size_t over = buffer->size - buffer->max_capacity;
-
-			memmove(buffer->data + buffer->max_capacity / 2,
-				buffer->data + buffer->max_capacity,
-				over);
-			buffer->size = buffer->max_capacity / 2 + over;
-		}
+	if (size > space) {
+		buffer->consumed += size - space;
+		buffer->dropped += size - space;
 	}
+
+	off = buffer->produced % buffer->capacity;
+	len = MIN(size, buffer->capacity - off);
+	memcpy(buffer->data + off, data, len);
+	memcpy(buffer->data, data + len, size - len);
+	buffer->produced += size;
 }
 
 static bool buffer_empty(struct buffer *buffer)
 {
-	return buffer->size == 0;
+	return buffer_size(buffer) == 0;
 }
 
-static void buffer_advance(struct buffer *buffer, size_t len)
+static void buffer_advance(struct domain *dom, size_t len)
 {
+	struct buffer *buffer = &dom->buffer;
+
 	buffer->consumed += len;
-	if (buffer->consumed == buffer->size) {
-		buffer->consumed = 0;
-		buffer->size = 0;
-		if (buffer->max_capacity &&
-		    buffer->capacity > buffer->max_capacity) {
-			buffer->data = realloc(buffer->data, buffer->max_capacity);
-			buffer->capacity = buffer->max_capacity;
-		}
+	if (buffer_empty(buffer) && buffer->dropped) {
+		dolog(LOG_INFO, "Discarded %llu bytes of output from "
+		      "domain %d: no one was reading its console",
+		      buffer->dropped, dom->domid);
+		buffer->dropped = 0;
 	}
 }
 
@@ -332,6 +418,7 @@ static int create_domain_log(struct domain *dom)
 static void domain_close_tty(struct domain *dom)
 {
 	if (dom->master_fd != -1) {
+		forget_watch(&dom->master_watch);
 		close(dom->master_fd);
 		dom->master_fd = -1;
 	}
@@ -578,8 +665,10 @@ static int domain_create_ring(struct domain *dom)
 
 	dom->local_port = -1;
 	dom->remote_port = -1;
-	if (dom->xce_handle != NULL)
+	if (dom->xce_handle != NULL) {
+		forget_watch(&dom->xce_watch);
 		xc_evtchn_close(dom->xce_handle);
+	}
 
 	/* Opening evtchn independently for each console is a bit
 	 * wasteful, but that's how the code is structured... */
@@ -669,10 +758,10 @@ static struct domain *create_domain(int domid)
 	strcat(dom->conspath, "/console");
 
 	dom->master_fd = -1;
-	dom->master_pollfd_idx = -1;
+	forget_watch(&dom->master_watch);
 	dom->slave_fd = -1;
 	dom->log_fd = -1;
-	dom->xce_pollfd_idx = -1;
+	forget_watch(&dom->xce_watch);
 
 	dom->next_period = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + RATE_LIMIT_PERIOD;
 
@@ -729,6 +818,10 @@ static void cleanup_domain(struct domain *d)
 		d->log_fd = -1;
 	}
 
+	if (d->buffer.dropped)
+		dolog(LOG_INFO, "Discarded %llu bytes of output from "
+		      "domain %d: no one was reading its console",
+		      d->buffer.dropped, d->domid);
 	free(d->buffer.data);
 	d->buffer.data = NULL;
 
@@ -743,8 +836,10 @@ static void shutdown_domain(struct domain *d)
 	d->is_dead = true;
 	watch_domain(d, false);
 	domain_unmap_interface(d);
-	if (d->xce_handle != NULL)
+	if (d->xce_handle != NULL) {
+		forget_watch(&d->xce_watch);
 		xc_evtchn_close(d->xce_handle);
+	}
 	d->xce_handle = NULL;
 }
 
@@ -843,19 +938,30 @@ static void handle_tty_read(struct domain *dom)
 
 static void handle_tty_write(struct domain *dom)
 {
+	struct buffer *buffer = &dom->buffer;
+	struct iovec iov[2];
+	size_t off;
 	ssize_t len;
 
 	if (dom->is_dead)
 		return;
 
-	len = write(dom->master_fd, dom->buffer.data + dom->buffer.consumed,
-		    dom->buffer.size - dom->buffer.consumed);
+	off = buffer->consumed % buffer->capacity;
+	iov[0].iov_base = buffer->data + off;
+	iov[0].iov_len = MIN(buffer_size(buffer), buffer->capacity - off);
+	iov[1].iov_base = buffer->data;
+	iov[1].iov_len = buffer_size(buffer) - iov[0].iov_len;
+
+	len = writev(dom->master_fd, iov, iov[1].iov_len ? 2 : 1);
  	if (len < 1) {
 		dolog(LOG_DEBUG, "Write failed on domain %d: %zd, %d\n",
 		      dom->domid, len, errno);
 		domain_handle_broken_tty(dom, domain_is_valid(dom->domid));
 	} else {
-		buffer_advance(&dom->buffer, len);
+		buffer_advance(dom, len);
+		/* Take in what was left in the ring for want of room */
+		if (!discard_overflowed_data && dom->interface)
+			buffer_append(dom);
 	}
 }
 
@@ -946,12 +1052,92 @@ static void handle_log_reload(void)
 	}
 }
 
-/* Returns index inside fds array if succees, -1 if fail */
-static int set_fds(int fd, short events)
+#ifdef USE_EPOLL
+static int init_watches(void)
 {
-	int ret;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		dolog(LOG_ERR, "Failed to create epoll instance: %d (%s)",
+		      errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void fini_watches(void)
+{
+	close(epoll_fd);
+	epoll_fd = -1;
+}
+
+/* The poll and epoll event bits have the same values on Linux. */
+static void set_watch(struct watch *w, int fd, short events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = w };
+	int op;
+
+	w->revents = 0;
+	if (fd != w->fd)
+		forget_watch(w);
+	w->fd = fd;
+	if (fd == -1 || events == w->events)
+		return;
+
+	op = !events ? EPOLL_CTL_DEL :
+		w->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(epoll_fd, op, fd, &ev) == -1) {
+		/* The fd may have been closed and reopened under us */
+		if (op == EPOLL_CTL_MOD && errno == ENOENT)
+			op = EPOLL_CTL_ADD;
+		else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+			op = EPOLL_CTL_MOD;
+		else
+			op = -1;
+		if (op == -1 || epoll_ctl(epoll_fd, op, fd, &ev) == -1) {
+			if (events)
+				dolog(LOG_ERR, "epoll_ctl failed, ignoring "
+				      "fd %d: %d (%s)", fd, errno,
+				      strerror(errno));
+			events = 0;
+		}
+	}
+	w->events = events;
+}
+
+static int wait_watches(int timeout)
+{
+	struct epoll_event ev[WATCH_BATCH];
+	int i, ret;
+
+	ret = epoll_wait(epoll_fd, ev, WATCH_BATCH, timeout);
+	for (i = 0; i < ret; i++)
+		((struct watch *)ev[i].data.ptr)->revents = ev[i].events;
+	return ret;
+}
+#else
+static int init_watches(void)
+{
+	return 0;
+}
+
+static void fini_watches(void)
+{
+	free(fds);
+	free(fd_watches);
+	current_array_size = 0;
+}
+
+static void set_watch(struct watch *w, int fd, short events)
+{
+	w->fd = fd;
+	w->events = events;
+	w->revents = 0;
+	if (fd == -1 || !events)
+		return;
+
 	if (current_array_size < nr_fds + 1) {
 		struct pollfd  *new_fds = NULL;
+		struct watch **new_watches = NULL;
 		unsigned long newsize;
 
 		/* Round up to 2^8 boundary, in practice this just
@@ -963,6 +1149,10 @@ static int set_fds(int fd, short events)
 		if (!new_fds)
 			goto fail;
 		fds = new_fds;
+		new_watches = realloc(fd_watches, sizeof(*fd_watches)*newsize);
+		if (!new_watches)
+			goto fail;
+		fd_watches = new_watches;
 
 		memset(&fds[0] + current_array_size, 0,
 		       sizeof(struct pollfd) * (newsize-current_array_size));
@@ -971,30 +1161,45 @@ static int set_fds(int fd, short events)
 
 	fds[nr_fds].fd = fd;
 	fds[nr_fds].events = events;
-	ret = nr_fds;
+	fds[nr_fds].revents = 0;
+	fd_watches[nr_fds] = w;
 	nr_fds++;
 
-	return ret;
+	return;
 fail:
 	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
 }
 
-static void reset_fds(void)
+static int wait_watches(int timeout)
 {
+	unsigned int i;
+	int ret;
+
+	ret = poll(fds, nr_fds, timeout);
+	for (i = 0; i < nr_fds; i++)
+		fd_watches[i]->revents = fds[i].revents;
 	nr_fds = 0;
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
+	return ret;
+}
+#endif
+
+/* True if the watch saw an error, hangup or the like */
+static bool watch_failed(struct watch *w)
+{
+	return w->revents & ~(POLLIN|POLLOUT|POLLPRI);
 }
 
 void handle_io(void)
 {
 	int ret;
 	evtchn_port_or_error_t log_hv_evtchn = -1;
-	int xce_pollfd_idx = -1;
-	int xs_pollfd_idx = -1;
+	struct watch xce_watch = { .fd = -1 };
+	struct watch xs_watch = { .fd = -1 };
 	xc_evtchn *xce_handle = NULL;
 
+	if (init_watches())
+		return;
+
 	if (log_hv) {
 		xce_handle = xc_evtchn_open(NULL, 0);
 		if (xce_handle == NULL) {
@@ -1027,13 +1232,11 @@ void handle_io(void)
 		struct timespec ts;
 		long long now, next_timeout = 0;
 
-		reset_fds();
-
-		xs_pollfd_idx = set_fds(xs_fileno(xs), POLLIN|POLLPRI);
+		set_watch(&xs_watch, xs_fileno(xs), POLLIN|POLLPRI);
 
 		if (log_hv)
-			xce_pollfd_idx = set_fds(xc_evtchn_fd(xce_handle),
-						 POLLIN|POLLPRI);
+			set_watch(&xce_watch, xc_evtchn_fd(xce_handle),
+				  POLLIN|POLLPRI);
 
 		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
 			return;
@@ -1058,6 +1261,8 @@ void handle_io(void)
 		}
 
 		for (d = dom_head; d; d = d->next) {
+			short events = 0;
+
 			if (d->event_count >= RATE_LIMIT_ALLOWANCE) {
 				/* Determine if we're going to be the next time slice to expire */
 				if (!next_timeout ||
@@ -1065,16 +1270,14 @@ void handle_io(void)
 					next_timeout = d->next_period;
 			} else if (d->xce_handle != NULL) {
 				if (discard_overflowed_data ||
-				    !d->buffer.max_capacity ||
-				    d->buffer.size < d->buffer.max_capacity) {
-					int evtchn_fd = xc_evtchn_fd(d->xce_handle);
-					d->xce_pollfd_idx = set_fds(evtchn_fd,
-								    POLLIN|POLLPRI);
-				}
+				    !buffer_full(&d->buffer))
+					events = POLLIN|POLLPRI;
 			}
+			set_watch(&d->xce_watch, d->xce_handle ?
+				  xc_evtchn_fd(d->xce_handle) : -1, events);
 
+			events = 0;
 			if (d->master_fd != -1) {
-				short events = 0;
 				if (!d->is_dead && ring_free_bytes(d))
 					events |= POLLIN;
 
@@ -1082,10 +1285,9 @@ void handle_io(void)
 					events |= POLLOUT;
 
 				if (events)
-					d->master_pollfd_idx =
-						set_fds(d->master_fd,
-							events|POLLPRI);
+					events |= POLLPRI;
 			}
+			set_watch(&d->master_watch, d->master_fd, events);
 		}
 
 		/* If any domain has been rate limited, we need to work
@@ -1097,7 +1299,7 @@ void handle_io(void)
 			poll_timeout = (int)duration;
 		}
 
-		ret = poll(fds, nr_fds, next_timeout ? poll_timeout : -1);
+		ret = wait_watches(next_timeout ? poll_timeout : -1);
 
 		if (log_reload) {
 			handle_log_reload();
@@ -1114,61 +1316,51 @@ void handle_io(void)
 			break;
 		}
 
-		if (log_hv && xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+		if (log_hv) {
+			if (watch_failed(&xce_watch)) {
 				dolog(LOG_ERR,
 				      "Failure in poll xce_handle: %d (%s)",
 				      errno, strerror(errno));
 				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN)
+			} else if (xce_watch.revents & POLLIN)
 				handle_hv_logs(xce_handle);
-
-			xce_pollfd_idx = -1;
 		}
 
 		if (ret <= 0)
 			continue;
 
-		if (xs_pollfd_idx != -1) {
-			if (fds[xs_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xs_handle: %d (%s)",
-				      errno, strerror(errno));
-				break;
-			} else if (fds[xs_pollfd_idx].revents & POLLIN)
-				handle_xs();
-
-			xs_pollfd_idx = -1;
-		}
+		if (watch_failed(&xs_watch)) {
+			dolog(LOG_ERR,
+			      "Failure in poll xs_handle: %d (%s)",
+			      errno, strerror(errno));
+			break;
+		} else if (xs_watch.revents & POLLIN)
+			handle_xs();
 
 		for (d = dom_head; d; d = n) {
 			n = d->next;
 			if (d->event_count < RATE_LIMIT_ALLOWANCE) {
 				if (d->xce_handle != NULL &&
-				    d->xce_pollfd_idx != -1 &&
-				    !(fds[d->xce_pollfd_idx].revents &
-				      ~(POLLIN|POLLOUT|POLLPRI)) &&
-				      (fds[d->xce_pollfd_idx].revents &
-				       POLLIN))
+				    !watch_failed(&d->xce_watch) &&
+				    (d->xce_watch.revents & POLLIN))
 				    handle_ring_read(d);
 			}
 
-			if (d->master_fd != -1 && d->master_pollfd_idx != -1) {
-				if (fds[d->master_pollfd_idx].revents &
-				    ~(POLLIN|POLLOUT|POLLPRI))
+			if (d->master_fd != -1) {
+				if (watch_failed(&d->master_watch))
 					domain_handle_broken_tty(d,
 						   domain_is_valid(d->domid));
 				else {
-					if (fds[d->master_pollfd_idx].revents &
+					if (d->master_watch.revents &
 					    POLLIN)
 						handle_tty_read(d);
-					if (fds[d->master_pollfd_idx].revents &
+					if (d->master_watch.revents &
 					    POLLOUT)
 						handle_tty_write(d);
 				}
 			}
 
-			d->xce_pollfd_idx = d->master_pollfd_idx = -1;
+			d->xce_watch.revents = d->master_watch.revents = 0;
 
 			if (d->last_seen != enum_pass)
 				shutdown_domain(d);
@@ -1178,10 +1370,8 @@ void handle_io(void)
 		}
 	}
 
-	free(fds);
-	current_array_size = 0;
-
  out:
+	fini_watches();
 	if (log_hv_fd != -1) {
 		close(log_hv_fd);
 		log_hv_fd = -1;
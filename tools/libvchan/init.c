@@ -62,20 +62,78 @@
 #define MAX_LARGE_RING (1 << LARGE_RING_SHIFT)
 #define LARGE_RING_OFFSET 2048
 
-// if you go over this size, you'll have too many grants to fit in the shared page.
-#define MAX_RING_SHIFT 20
+// if you go over this size, you'll have too many grants to fit in the shared
+// page, so the grants of larger rings are listed in pages of their own.
+#define MAX_DIRECT_RING_SHIFT 20
+#define MAX_RING_SHIFT 24
 #define MAX_RING_SIZE (1 << MAX_RING_SHIFT)
 
+#define GRANTS_PER_PAGE (PAGE_SIZE / sizeof(uint32_t))
+
 #ifndef offsetof
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
 #endif
 
 #define max(a,b) ((a > b) ? a : b)
 
+/* Number of entries of the shared page's grant list a ring takes up. */
+static int ring_grants(int order)
+{
+	int pages = order >= PAGE_SHIFT ? 1 << (order - PAGE_SHIFT) : 0;
+	if (order <= MAX_DIRECT_RING_SHIFT)
+		return pages;
+	return (pages + GRANTS_PER_PAGE - 1) / GRANTS_PER_PAGE;
+}
+
+static void *share_ring(struct libxenvchan *ctrl, struct libxenvchan_ring *ring,
+			int domain, uint32_t *grants)
+{
+	int pages = 1 << (ring->order - PAGE_SHIFT);
+	void *buffer;
+
+	if (ring->order <= MAX_DIRECT_RING_SHIFT)
+		return xc_gntshr_share_pages(ctrl->gntshr, domain, pages, grants, 1);
+
+	ring->glist_pages = ring_grants(ring->order);
+	ring->glist = xc_gntshr_share_pages(ctrl->gntshr, domain,
+		ring->glist_pages, grants, 0);
+	if (!ring->glist)
+		return NULL;
+	buffer = xc_gntshr_share_pages(ctrl->gntshr, domain, pages, ring->glist, 1);
+	if (!buffer) {
+		xc_gntshr_munmap(ctrl->gntshr, ring->glist,
+				 ring->glist_pages * PAGE_SIZE);
+		ring->glist = NULL;
+	}
+	return buffer;
+}
+
+static void *map_ring(struct libxenvchan *ctrl, int order, int domain,
+		      uint32_t *grants, int prot)
+{
+	int pages = 1 << (order - PAGE_SHIFT);
+	int glist_pages = ring_grants(order);
+	uint32_t *glist;
+	void *buffer;
+
+	if (order <= MAX_DIRECT_RING_SHIFT)
+		return xc_gnttab_map_domain_grant_refs(ctrl->gnttab,
+			pages, domain, grants, prot);
+
+	glist = xc_gnttab_map_domain_grant_refs(ctrl->gnttab,
+		glist_pages, domain, grants, PROT_READ);
+	if (!glist)
+		return NULL;
+	buffer = xc_gnttab_map_domain_grant_refs(ctrl->gnttab,
+		pages, domain, glist, prot);
+	xc_gnttab_munmap(ctrl->gnttab, glist, glist_pages);
+	return buffer;
+}
+
 static int init_gnt_srv(struct libxenvchan *ctrl, int domain)
 {
 	int pages_left = ctrl->read.order >= PAGE_SHIFT ? 1 << (ctrl->read.order - PAGE_SHIFT) : 0;
-	int pages_right = ctrl->write.order >= PAGE_SHIFT ? 1 << (ctrl->write.order - PAGE_SHIFT) : 0;
+	int grants_left = ring_grants(ctrl->read.order);
 	uint32_t ring_ref = -1;
 	void *ring;
 
@@ -105,8 +163,8 @@ static int init_gnt_srv(struct libxenvchan *ctrl, int domain)
 		ctrl->read.buffer = ((void*)ctrl->ring) + LARGE_RING_OFFSET;
 		break;
 	default:
-		ctrl->read.buffer = xc_gntshr_share_pages(ctrl->gntshr, domain,
-			pages_left, ctrl->ring->grants, 1);
+		ctrl->read.buffer = share_ring(ctrl, &ctrl->read, domain,
+			ctrl->ring->grants);
 		if (!ctrl->read.buffer)
 			goto out_ring;
 	}
@@ -119,8 +177,8 @@ static int init_gnt_srv(struct libxenvchan *ctrl, int domain)
 		ctrl->write.buffer = ((void*)ctrl->ring) + LARGE_RING_OFFSET;
 		break;
 	default:
-		ctrl->write.buffer = xc_gntshr_share_pages(ctrl->gntshr, domain,
-			pages_right, ctrl->ring->grants + pages_left, 1);
+		ctrl->write.buffer = share_ring(ctrl, &ctrl->write, domain,
+			ctrl->ring->grants + grants_left);
 		if (!ctrl->write.buffer)
 			goto out_unmap_left;
 	}
@@ -130,6 +188,10 @@ out:
 out_unmap_left:
 	if (pages_left)
 		xc_gntshr_munmap(ctrl->gntshr, ctrl->read.buffer, pages_left * PAGE_SIZE);
+	if (ctrl->read.glist)
+		xc_gntshr_munmap(ctrl->gntshr, ctrl->read.glist,
+				 ctrl->read.glist_pages * PAGE_SIZE);
+	ctrl->read.glist = NULL;
 out_ring:
 	xc_gntshr_munmap(ctrl->gntshr, ring, PAGE_SIZE);
 	ring_ref = -1;
@@ -172,12 +234,11 @@ static int init_gnt_cli(struct libxenvchan *ctrl, int domain, uint32_t ring_ref)
 		break;
 	default:
 		{
-			int pages_left = 1 << (ctrl->write.order - PAGE_SHIFT);
-			ctrl->write.buffer = xc_gnttab_map_domain_grant_refs(ctrl->gnttab,
-				pages_left, domain, grants, PROT_READ|PROT_WRITE);
+			ctrl->write.buffer = map_ring(ctrl, ctrl->write.order,
+				domain, grants, PROT_READ|PROT_WRITE);
 			if (!ctrl->write.buffer)
 				goto out_unmap_ring;
-			grants += pages_left;
+			grants += ring_grants(ctrl->write.order);
 		}
 	}
 
@@ -190,9 +251,8 @@ static int init_gnt_cli(struct libxenvchan *ctrl, int domain, uint32_t ring_ref)
 		break;
 	default:
 		{
-			int pages_right = 1 << (ctrl->read.order - PAGE_SHIFT);
-			ctrl->read.buffer = xc_gnttab_map_domain_grant_refs(ctrl->gnttab,
-				pages_right, domain, grants, PROT_READ);
+			ctrl->read.buffer = map_ring(ctrl, ctrl->read.order,
+				domain, grants, PROT_READ);
 			if (!ctrl->read.buffer)
 				goto out_unmap_left;
 		}
@@ -301,7 +361,7 @@ struct libxenvchan *libxenvchan_server_init(xentoollog_logger *logger, int domai
 	if (left_min > MAX_RING_SIZE || right_min > MAX_RING_SIZE)
 		return 0;
 
-	ctrl = malloc(sizeof(*ctrl));
+	ctrl = calloc(1, sizeof(*ctrl));
 	if (!ctrl)
 		return 0;
 
@@ -375,7 +435,7 @@ fail:
 
 struct libxenvchan *libxenvchan_client_init(xentoollog_logger *logger, int domain, const char* xs_path)
 {
-	struct libxenvchan *ctrl = malloc(sizeof(struct libxenvchan));
+	struct libxenvchan *ctrl = calloc(1, sizeof(struct libxenvchan));
 	struct xs_handle *xs = NULL;
 	char buf[64];
 	char *ref;
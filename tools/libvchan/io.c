@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <xenctrl.h>
@@ -111,6 +112,92 @@ static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
 		return 0;
 }
 
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Notify the peer of size bytes written (VCHAN_NOTIFY_WRITE) or consumed
+ * (VCHAN_NOTIFY_READ), or defer it while batching and the peer asked to be
+ * notified of fewer than the batch since we last did.
+ */
+static int batch_notify(struct libxenvchan *ctrl, uint8_t bit, size_t size)
+{
+	int idx = bit == VCHAN_NOTIFY_WRITE ? 0 : 1;
+	size_t batch = ctrl->notify_batch;
+	size_t half = (idx ? rd_ring_size(ctrl) : wr_ring_size(ctrl)) / 2;
+	uint8_t *notify;
+	uint64_t now;
+
+	if (!batch)
+		return send_notify(ctrl, bit);
+
+	xen_mb(); /* caller updates indexes /before/ we decode to notify */
+	notify = ctrl->is_server ? &ctrl->ring->srv_notify : &ctrl->ring->cli_notify;
+	if (!(*notify & bit)) {
+		/* it rereads the indexes after asking, so owed nothing yet */
+		ctrl->deferred[idx] = 0;
+		return 0;
+	}
+
+	now = now_ms();
+	if (!ctrl->deferred[idx])
+		ctrl->deferred_since[idx] = now;
+	ctrl->deferred[idx] += size;
+	if (batch > half)
+		batch = half;
+	if (ctrl->deferred[idx] < batch &&
+	    now - ctrl->deferred_since[idx] < ctrl->notify_timeout)
+		return 0;
+
+	ctrl->deferred[idx] = 0;
+	return send_notify(ctrl, bit);
+}
+
+int libxenvchan_set_notify_batch(struct libxenvchan *ctrl, size_t bytes, int timeout_ms)
+{
+	if (timeout_ms < 0)
+		return -1;
+	ctrl->notify_batch = bytes;
+	ctrl->notify_timeout = timeout_ms;
+	return bytes ? 0 : libxenvchan_flush(ctrl);
+}
+
+int libxenvchan_flush(struct libxenvchan *ctrl)
+{
+	int ret = 0;
+
+	if (ctrl->deferred[0]) {
+		ctrl->deferred[0] = 0;
+		if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+			ret = -1;
+	}
+	if (ctrl->deferred[1]) {
+		ctrl->deferred[1] = 0;
+		if (send_notify(ctrl, VCHAN_NOTIFY_READ))
+			ret = -1;
+	}
+	return ret;
+}
+
+int libxenvchan_notify_timeout(struct libxenvchan *ctrl)
+{
+	uint64_t now, due = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (ctrl->deferred[i] &&
+		    ctrl->deferred_since[i] + ctrl->notify_timeout < due)
+			due = ctrl->deferred_since[i] + ctrl->notify_timeout;
+	if (due == UINT64_MAX)
+		return -1;
+	now = now_ms();
+	return due > now ? due - now : 0;
+}
+
 /**
  * Get the amount of buffer space available and enable notifications if needed.
  */
@@ -167,7 +254,11 @@ int libxenvchan_buffer_space(struct libxenvchan *ctrl)
 
 int libxenvchan_wait(struct libxenvchan *ctrl)
 {
-	int ret = xc_evtchn_pending(ctrl->event);
+	int ret;
+	/* the peer may be waiting on us in turn */
+	if (libxenvchan_flush(ctrl))
+		return -1;
+	ret = xc_evtchn_pending(ctrl->event);
 	if (ret < 0)
 		return -1;
 	xc_evtchn_unmask(ctrl->event, ret);
@@ -175,24 +266,72 @@ int libxenvchan_wait(struct libxenvchan *ctrl)
 }
 
 /**
- * returns -1 on error, or size on success
+ * Copy size bytes between data and the ring, starting at index idx.
  */
-static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+static void ring_copy(void *ring, uint32_t ring_size, uint32_t idx,
+		      void *data, size_t size, int to_ring)
 {
-	int real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
-	int avail_contig = wr_ring_size(ctrl) - real_idx;
+	int real_idx = idx & (ring_size - 1);
+	int avail_contig = ring_size - real_idx;
 	if (avail_contig > size)
 		avail_contig = size;
-	xen_mb(); /* read indexes /then/ write data */
-	memcpy(wr_ring(ctrl) + real_idx, data, avail_contig);
+	if (to_ring)
+		memcpy(ring + real_idx, data, avail_contig);
+	else
+		memcpy(data, ring + real_idx, avail_contig);
 	if (avail_contig < size)
 	{
 		// we rolled across the end of the ring
-		memcpy(wr_ring(ctrl), data + avail_contig, size - avail_contig);
+		if (to_ring)
+			memcpy(ring, data + avail_contig, size - avail_contig);
+		else
+			memcpy(data + avail_contig, ring, size - avail_contig);
+	}
+}
+
+/**
+ * Copy size bytes between the ring and iov, after its first skip bytes.
+ */
+static void ring_copyv(void *ring, uint32_t ring_size, uint32_t idx,
+		       const struct iovec *iov, size_t skip, size_t size,
+		       int to_ring)
+{
+	for (; size; iov++) {
+		size_t len = iov->iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		len -= skip;
+		if (len > size)
+			len = size;
+		ring_copy(ring, ring_size, idx, iov->iov_base + skip, len, to_ring);
+		idx += len;
+		size -= len;
+		skip = 0;
 	}
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t size = 0;
+	while (iovcnt--)
+		size += iov++->iov_len;
+	return size;
+}
+
+/**
+ * returns -1 on error, or size on success
+ */
+static int do_send(struct libxenvchan *ctrl, const struct iovec *iov,
+		   size_t skip, size_t size)
+{
+	xen_mb(); /* read indexes /then/ write data */
+	ring_copyv(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl),
+		   iov, skip, size, 1);
 	xen_wmb(); /* write data /then/ notify */
 	wr_prod(ctrl) += size;
-	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+	if (batch_notify(ctrl, VCHAN_NOTIFY_WRITE, size))
 		return -1;
 	return size;
 }
@@ -202,13 +341,14 @@ static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
  */
 int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size)
 {
+	struct iovec iov = { (void *)data, size };
 	int avail;
 	while (1) {
 		if (!libxenvchan_is_open(ctrl))
 			return -1;
 		avail = fast_get_buffer_space(ctrl, size);
 		if (size <= avail)
-			return do_send(ctrl, data, size);
+			return do_send(ctrl, &iov, 0, size);
 		if (!ctrl->blocking)
 			return 0;
 		if (size > wr_ring_size(ctrl))
@@ -218,8 +358,9 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size)
 	}
 }
 
-int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
 {
+	size_t size = iov_length(iov, iovcnt);
 	int avail;
 	if (!libxenvchan_is_open(ctrl))
 		return -1;
@@ -230,7 +371,7 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 			if (pos + avail > size)
 				avail = size - pos;
 			if (avail)
-				pos += do_send(ctrl, data + pos, avail);
+				pos += do_send(ctrl, iov, pos, avail);
 			if (pos == size)
 				return pos;
 			if (libxenvchan_wait(ctrl))
@@ -244,26 +385,25 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 			size = avail;
 		if (size == 0)
 			return 0;
-		return do_send(ctrl, data, size);
+		return do_send(ctrl, iov, 0, size);
 	}
 }
 
-static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
+int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+	struct iovec iov = { (void *)data, size };
+	return libxenvchan_writev(ctrl, &iov, 1);
+}
+
+static int do_recv(struct libxenvchan *ctrl, const struct iovec *iov,
+		   size_t size)
 {
-	int real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
-	int avail_contig = rd_ring_size(ctrl) - real_idx;
-	if (avail_contig > size)
-		avail_contig = size;
 	xen_rmb(); /* data read must happen /after/ rd_cons read */
-	memcpy(data, rd_ring(ctrl) + real_idx, avail_contig);
-	if (avail_contig < size)
-	{
-		// we rolled across the end of the ring
-		memcpy(data + avail_contig, rd_ring(ctrl), size - avail_contig);
-	}
+	ring_copyv((void *)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl),
+		   iov, 0, size, 0);
 	xen_mb(); /* consume /then/ notify */
 	rd_cons(ctrl) += size;
-	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
+	if (batch_notify(ctrl, VCHAN_NOTIFY_READ, size))
 		return -1;
 	return size;
 }
@@ -274,10 +414,11 @@ static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
  */
 int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 {
+	struct iovec iov = { data, size };
 	while (1) {
 		int avail = fast_get_data_ready(ctrl, size);
 		if (size <= avail)
-			return do_recv(ctrl, data, size);
+			return do_recv(ctrl, &iov, size);
 		if (!libxenvchan_is_open(ctrl))
 			return -1;
 		if (!ctrl->blocking)
@@ -289,21 +430,98 @@ int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 }
 
-int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
 {
+	size_t size = iov_length(iov, iovcnt);
 	while (1) {
 		int avail = fast_get_data_ready(ctrl, size);
 		if (avail && size > avail)
 			size = avail;
 		if (avail)
-			return do_recv(ctrl, data, size);
+			return do_recv(ctrl, iov, size);
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
+{
+	struct iovec iov = { data, size };
+	return libxenvchan_readv(ctrl, &iov, 1);
+}
+
+int libxenvchan_write_acquire(struct libxenvchan *ctrl, void **buf, size_t size)
+{
+	int real_idx, avail;
+	while (1) {
 		if (!libxenvchan_is_open(ctrl))
 			return -1;
+		avail = fast_get_buffer_space(ctrl, 1);
+		if (avail)
+			break;
 		if (!ctrl->blocking)
 			return 0;
 		if (libxenvchan_wait(ctrl))
 			return -1;
 	}
+	real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
+	if (avail > wr_ring_size(ctrl) - real_idx)
+		avail = wr_ring_size(ctrl) - real_idx;
+	if (avail > size)
+		avail = size;
+	xen_mb(); /* read indexes /then/ let the caller write data */
+	*buf = wr_ring(ctrl) + real_idx;
+	return avail;
+}
+
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > wr_ring_size(ctrl) - (wr_prod(ctrl) - wr_cons(ctrl)))
+		return -1;
+	xen_wmb(); /* write data /then/ notify */
+	wr_prod(ctrl) += size;
+	if (batch_notify(ctrl, VCHAN_NOTIFY_WRITE, size))
+		return -1;
+	return size;
+}
+
+int libxenvchan_read_acquire(struct libxenvchan *ctrl, const void **buf, size_t size)
+{
+	int real_idx, avail;
+	while (1) {
+		avail = fast_get_data_ready(ctrl, 1);
+		if (avail)
+			break;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+	real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
+	if (avail > rd_ring_size(ctrl) - real_idx)
+		avail = rd_ring_size(ctrl) - real_idx;
+	if (avail > size)
+		avail = size;
+	xen_rmb(); /* data read must happen /after/ rd_cons read */
+	*buf = rd_ring(ctrl) + real_idx;
+	return avail;
+}
+
+int libxenvchan_read_release(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > rd_prod(ctrl) - rd_cons(ctrl))
+		return -1;
+	xen_mb(); /* consume /then/ notify */
+	rd_cons(ctrl) += size;
+	if (batch_notify(ctrl, VCHAN_NOTIFY_READ, size))
+		return -1;
+	return size;
 }
 
 int libxenvchan_is_open(struct libxenvchan* ctrl)
@@ -327,6 +545,10 @@ void libxenvchan_close(struct libxenvchan *ctrl)
 		munmap(ctrl->read.buffer, 1 << ctrl->read.order);
 	if (ctrl->write.order >= PAGE_SHIFT)
 		munmap(ctrl->write.buffer, 1 << ctrl->write.order);
+	if (ctrl->read.glist)
+		munmap(ctrl->read.glist, ctrl->read.glist_pages * PAGE_SIZE);
+	if (ctrl->write.glist)
+		munmap(ctrl->write.glist, ctrl->write.glist_pages * PAGE_SIZE);
 	if (ctrl->ring) {
 		if (ctrl->is_server) {
 			ctrl->ring->srv_live = 0;
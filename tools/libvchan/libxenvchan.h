@@ -43,6 +43,7 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#include <sys/uio.h>
 #include <xen/io/libxenvchan.h>
 #include <xen/sys/evtchn.h>
 #include <xenctrl.h>
@@ -58,6 +59,10 @@ struct libxenvchan_ring {
 	 * in the shared page to remain constant.
 	 */
 	int order;
+	/* [server only] pages holding the grant list of a ring too large
+	 * for its grants to fit in the shared page */
+	uint32_t *glist;
+	int glist_pages;
 };
 
 /**
@@ -82,10 +87,19 @@ struct libxenvchan {
 	int blocking:1;
 	/* communication rings */
 	struct libxenvchan_ring read, write;
+	/* notification batching: see libxenvchan_set_notify_batch() */
+	size_t notify_batch;
+	int notify_timeout;
+	/* bytes written [0] and consumed [1] that the peer asked to be, but
+	 * has not yet been, notified of; and since when (in ms) */
+	size_t deferred[2];
+	uint64_t deferred_since[2];
 };
 
 /**
- * Set up a vchan, including granting pages
+ * Set up a vchan, including granting pages.  Rings may be up to 16MB; rings
+ * over 1MB need more grants than the gntalloc and gntdev drivers allow a
+ * process by default, see their "limit" parameters.
  * @param logger Logger for libxc errors
  * @param domain The peer domain that will be connecting
  * @param xs_path Base xenstore path for storing ring/event data
@@ -147,9 +161,73 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size);
  */
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
 /**
- * Waits for reads or writes to unblock, or for a close
+ * Stream-based scatter/gather receive: fills the buffers in order with as
+ * much data as possible.
+ * @return -1 on error, otherwise the amount of data read (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Stream-based scatter/gather send: sends as much of the buffers, in order,
+ * as possible.
+ * @return -1 on error, otherwise the amount of data sent (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * In-place send: point $buf at up to $size bytes of free space in the send
+ * ring, contiguous but possibly fewer than the ring has free, so the caller
+ * can build its data there.  Nothing is sent until it is committed.
+ * @return -1 on error, 0 if nonblocking and the ring is full, or the number
+ *         of bytes at $buf
+ */
+int libxenvchan_write_acquire(struct libxenvchan *ctrl, void **buf, size_t size);
+/**
+ * Send the first $size bytes of the space last acquired.
+ * @return -1 on error, or $size
+ */
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size);
+/**
+ * In-place receive: point $buf at up to $size bytes of data in the receive
+ * ring, contiguous but possibly fewer than the ring holds.  The data is shared
+ * with the peer, which may still change it: copy anything that is checked
+ * before it is used.  It stays in the ring until released.
+ * @return -1 on error, 0 if nonblocking and no data is available, or the
+ *         number of bytes at $buf
+ */
+int libxenvchan_read_acquire(struct libxenvchan *ctrl, const void **buf, size_t size);
+/**
+ * Release the first $size bytes of the data last acquired, making room for
+ * the peer to send more.
+ * @return -1 on error, or $size
+ */
+int libxenvchan_read_release(struct libxenvchan *ctrl, size_t size);
+/**
+ * Waits for reads or writes to unblock, or for a close.  Sends any deferred
+ * notification first.
  */
 int libxenvchan_wait(struct libxenvchan *ctrl);
+/**
+ * Batch notifications to the peer: rather than notifying it of every write
+ * (or read) it waits on, only do so once the bytes written (or consumed)
+ * since the last notification reach $bytes, or half the ring if smaller,
+ * or once the oldest of them is $timeout_ms old.  The timeout is only
+ * checked when the vchan is used, so callers that select() on the vchan
+ * must call libxenvchan_flush() before sleeping, and wake up after
+ * libxenvchan_notify_timeout().  $bytes of 0 (the default) notifies at once.
+ * @return -1 on error, or 0
+ */
+int libxenvchan_set_notify_batch(struct libxenvchan *ctrl, size_t bytes, int timeout_ms);
+/**
+ * Sends any deferred notification.
+ * @return -1 on error, or 0
+ */
+int libxenvchan_flush(struct libxenvchan *ctrl);
+/**
+ * Time until a deferred notification is due, for use as a select() timeout.
+ * @return milliseconds (0 if overdue), or -1 if none is deferred
+ */
+int libxenvchan_notify_timeout(struct libxenvchan *ctrl);
 /**
  * Returns the event file descriptor for this vchan. When this FD is readable,
  * libxenvchan_wait() will not block, and the state of the vchan has changed since
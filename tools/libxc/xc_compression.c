@@ -8,6 +8,8 @@
  * to the receiver. The cache is then updated with the newer copy of guest page.
  * - The receiver will XOR the non-zero sections against its copy of the guest
  * page, thereby bringing the guest page up-to-date with the sender side.
+ * - Pages are delta compressed by several threads, a chunk at a time, and
+ * the result may be packed further with LZ4 (xc_compression_pack).
  *
  * Copyright (c) 2011 Shriram Rajagopalan (rshriram@cs.ubc.ca).
  *
@@ -33,6 +35,7 @@
 #include <sys/types.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <pthread.h>
 #include "xc_private.h"
 #include "xenctrl.h"
 #include "xg_save_restore.h"
@@ -47,14 +50,47 @@
  */
 #define PAGE_BUFFER_SIZE (XC_PAGE_SIZE * 8192)
 
+/*
+ * Pages are looked up in the cache in order, a chunk at a time, then delta
+ * compressed in parallel.  Each page of a chunk has a cache page of its
+ * own: a chunk is much smaller than the cache, so nothing looked up for it
+ * gets evicted before it is done with.
+ */
+#define COMP_CHUNK        256
+#define COMP_MAX_THREADS  8
+
+/* Chunks not to try packing after one that wasn't worth it */
+#define PACK_BACKOFF      8
+#define PACK_MIN          256
+
 struct cache_page
 {
     char *page;
     xen_pfn_t pfn;
+    unsigned int chunk;     /* last chunk it was looked up for */
     struct cache_page *next;
     struct cache_page *prev;
 };
 
+struct comp_job
+{
+    char *page;
+    char *cache_page;       /* NULL for a pagetable page */
+    int israw;
+    int len;
+    char *out;              /* WORST_COMP_PAGE_SIZE bytes */
+};
+
+struct comp_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond, done;
+    unsigned int nr_threads;
+    pthread_t threads[COMP_MAX_THREADS];
+    unsigned int next, nr, busy;
+    int stop;
+};
+
 struct compression_ctx
 {
     /* compression buffer - holds compressed data */
@@ -76,6 +112,18 @@ struct compression_ctx
     struct cache_page *page_list_head;
     struct cache_page *page_list_tail;
     unsigned long dom_pfnlist_size;
+
+    /* The chunk being compressed, and how much of it is output */
+    struct comp_job *jobs;
+    char *jobs_out;
+    unsigned int chunk, chunk_nr, chunk_pos;
+    struct comp_pool *pool;
+
+    /* LZ4 state */
+    uint32_t *pack_table;
+    char *packbuf;
+    unsigned long packbuf_size;
+    unsigned int pack_skip;
 };
 
 #define RUNFLAG 0
@@ -116,93 +164,227 @@ struct compression_ctx
  *  cache_page points to a free page slot in the cache where
  *  this new page can be copied to.
  */
-static int add_full_page(comp_ctx *ctx, char *srcpage, char *cache_page)
+static int add_full_page(char *dest, char *srcpage, char *cache_page)
 {
-    char *dest = (ctx->compbuf + ctx->compbuf_pos);
-
-    if ( (ctx->compbuf_pos + FULL_PAGE_SIZE) > ctx->compbuf_size)
-        return -1;
-
     if (cache_page)
         memcpy(cache_page, srcpage, XC_PAGE_SIZE);
     dest[0] = FULL_PAGE;
     memcpy(&dest[1], srcpage, XC_PAGE_SIZE);
-    ctx->compbuf_pos += FULL_PAGE_SIZE;
 
     return FULL_PAGE_SIZE;
 }
 
-static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
+/*
+ * First word at or after off where the pages differ, or MAX_DELTAS.
+ * Unchanged stretches are compared a cache line at a time, with wide
+ * XORs the compiler can vectorise.
+ */
+static unsigned int next_delta(const uint32_t *old, const uint32_t *new,
+                               unsigned int off)
 {
-    char *dest = (ctx->compbuf + ctx->compbuf_pos);
-    uint32_t *new, *old;
+    for ( ; off < MAX_DELTAS && (off & 15); off++ )
+        if ( old[off] != new[off] )
+            return off;
+
+    for ( ; off < MAX_DELTAS; off += 16 )
+    {
+        const uint64_t *o = (const uint64_t *)&old[off];
+        const uint64_t *n = (const uint64_t *)&new[off];
 
-    int off, runptr = 0;
-    int wascopying = 0, copying = 0, bytes_skipped = 0;
-    int complen = 0, pageoff = 0, runbytes = 0;
+        if ( (o[0] ^ n[0]) | (o[1] ^ n[1]) | (o[2] ^ n[2]) | (o[3] ^ n[3]) |
+             (o[4] ^ n[4]) | (o[5] ^ n[5]) | (o[6] ^ n[6]) | (o[7] ^ n[7]) )
+            break;
+    }
 
-    char runlen = 0;
+    for ( ; off < MAX_DELTAS; off++ )
+        if ( old[off] != new[off] )
+            break;
 
-    if ( (ctx->compbuf_pos + WORST_COMP_PAGE_SIZE) > ctx->compbuf_size)
-        return -1;
+    return off;
+}
 
+/* First word at or after off where the pages agree, or MAX_DELTAS. */
+static unsigned int next_same(const uint32_t *old, const uint32_t *new,
+                              unsigned int off)
+{
+    for ( ; off < MAX_DELTAS; off++ )
+        if ( old[off] == new[off] )
+            break;
+
+    return off;
+}
+
+/*
+ * Delta compress srcpage against cache_page into dest, which has room for
+ * WORST_COMP_PAGE_SIZE bytes, and bring cache_page up to date.
+ */
+static int compress_page(char *dest, char *srcpage, char *cache_page)
+{
     /*
      * There are no alignment issues here since srcpage is
      * domU's page passed from xc_domain_save and cache_page is
      * a ptr to cache page (cache is page aligned).
      */
-    new = (uint32_t*)srcpage;
-    old = (uint32_t*)cache_page;
+    const uint32_t *new = (uint32_t *)srcpage;
+    const uint32_t *old = (uint32_t *)cache_page;
+    unsigned int off = 0, end, n, pageoff, runbytes;
+    int complen = 0;
 
-    for (off = 0; off <= MAX_DELTAS; off++)
+    while ( off < MAX_DELTAS )
     {
-        /*
-         * At (off == MAX_DELTAS), we are processing the last run
-         * in the page. Since there is no XORing, make wascopying != copying
-         * to satisfy the if-block below.
-         */
-        copying = ((off < MAX_DELTAS) ? (old[off] != new[off]) : !wascopying);
-
-        if (runlen)
+        /* Unchanged words: skip runs */
+        end = next_delta(old, new, off);
+        if ( off == 0 && end == MAX_DELTAS )
         {
-            /* switching between run types or current run is full */
-            if ( (wascopying != copying) || (runlen == LENMASK) )
-            {
-                runbytes = runlen * sizeof(uint32_t);
-                runlen |= (wascopying ? RUNFLAG : SKIPFLAG);
-                dest[complen++] = runlen;
-
-                if (wascopying) /* RUNFLAG */
-                {
-                    pageoff = runptr * sizeof(uint32_t);
-                    memcpy(dest + complen, srcpage + pageoff, runbytes);
-                    memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
-                    complen += runbytes;
-                }
-                else /* SKIPFLAG */
-                {
-                    bytes_skipped += runbytes;
-                }
+            dest[0] = EMPTY_PAGE;
+            return 1;
+        }
+        for ( ; off < end; off += n )
+        {
+            n = end - off < LENMASK ? end - off : LENMASK;
+            dest[complen++] = n | SKIPFLAG;
+        }
 
-                runlen = 0;
-                runptr = off;
-            }
+        /* Changed words: copy runs */
+        end = next_same(old, new, off);
+        for ( ; off < end; off += n )
+        {
+            n = end - off < LENMASK ? end - off : LENMASK;
+            runbytes = n * sizeof(uint32_t);
+            pageoff = off * sizeof(uint32_t);
+            dest[complen++] = n | RUNFLAG;
+            memcpy(dest + complen, srcpage + pageoff, runbytes);
+            memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
+            complen += runbytes;
         }
-        runlen++;
-        wascopying = copying;
     }
 
-    /*
-     * Check for empty page.
-     */
-    if (bytes_skipped == XC_PAGE_SIZE)
+    return complen;
+}
+
+static void compress_job(struct comp_job *job)
+{
+    if (job->israw)
+        job->len = add_full_page(job->out, job->page, job->cache_page);
+    else
+        job->len = compress_page(job->out, job->page, job->cache_page);
+}
+
+/* Take jobs off the current chunk until there are none left. */
+static void comp_pool_run(struct comp_pool *pool, struct comp_job *jobs)
+{
+    unsigned int i;
+
+    while ( pool->next < pool->nr )
     {
-        complen = 1;
-        dest[0] = EMPTY_PAGE;
+        i = pool->next++;
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        compress_job(&jobs[i]);
+
+        pthread_mutex_lock(&pool->lock);
+        if ( !--pool->busy && pool->next == pool->nr )
+            pthread_cond_signal(&pool->done);
     }
-    ctx->compbuf_pos += complen;
+}
 
-    return complen;
+static void *comp_pool_worker(void *arg)
+{
+    comp_ctx *ctx = arg;
+    struct comp_pool *pool = ctx->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while ( !pool->stop )
+    {
+        comp_pool_run(pool, ctx->jobs);
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* Compress the jobs of the current chunk. */
+static void compress_chunk(comp_ctx *ctx)
+{
+    struct comp_pool *pool = ctx->pool;
+    unsigned int i;
+
+    if ( !pool )
+    {
+        for ( i = 0; i < ctx->chunk_nr; i++ )
+            compress_job(&ctx->jobs[i]);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->next = 0;
+    pool->nr = ctx->chunk_nr;
+    pthread_cond_broadcast(&pool->cond);
+    comp_pool_run(pool, ctx->jobs);
+    while ( pool->busy )
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void comp_pool_stop(comp_ctx *ctx)
+{
+    struct comp_pool *pool = ctx->pool;
+    unsigned int i;
+
+    if ( !pool )
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for ( i = 0; i < pool->nr_threads; i++ )
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    ctx->pool = NULL;
+}
+
+/*
+ * XG_COMPRESS_THREADS in the environment sets the number of threads
+ * helping to compress, 0 for none.  The default is one fewer than the
+ * online cpus, up to COMP_MAX_THREADS.
+ */
+static void comp_pool_start(xc_interface *xch, comp_ctx *ctx)
+{
+    struct comp_pool *pool;
+    const char *env = getenv("XG_COMPRESS_THREADS");
+    long n;
+
+    n = env ? strtol(env, NULL, 0) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if ( n <= 0 )
+        return;
+    if ( n > COMP_MAX_THREADS )
+        n = COMP_MAX_THREADS;
+
+    pool = calloc(1, sizeof(*pool));
+    if ( !pool )
+        return;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    ctx->pool = pool;
+
+    for ( ; pool->nr_threads < n; pool->nr_threads++ )
+        if ( pthread_create(&pool->threads[pool->nr_threads], NULL,
+                            comp_pool_worker, ctx) )
+            break;
+
+    if ( !pool->nr_threads )
+        comp_pool_stop(ctx);
+    else
+        DPRINTF("Compressing with %u extra threads\n", pool->nr_threads);
 }
 
 static
@@ -309,15 +491,54 @@ int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx,
     return 0;
 }
 
+/*
+ * Look up the cache pages for the next chunk of the page buffer.  A pfn
+ * seen twice ends the chunk early, as the second copy has to be compressed
+ * against the first.
+ */
+static void prepare_chunk(comp_ctx *ctx)
+{
+    struct comp_job *job;
+    struct cache_page *item;
+    xen_pfn_t pfn;
+    unsigned int i;
+
+    ctx->chunk++;
+    for ( i = 0; i < COMP_CHUNK && ctx->pfns_index + i < ctx->pfns_len; i++ )
+    {
+        job = &ctx->jobs[i];
+        job->page = ctx->inputbuf + (ctx->pfns_index + i) * XC_PAGE_SIZE;
+        job->israw = 0;
+        job->cache_page = NULL;
+
+        pfn = ctx->sendbuf_pfns[ctx->pfns_index + i];
+        if (pfn == INVALID_P2M_ENTRY)
+            job->israw = 1;
+        else
+        {
+            item = ctx->pfn2cache[pfn];
+            if ( item && item->chunk == ctx->chunk )
+                break;
+            job->cache_page = get_cache_page(ctx, pfn, &job->israw);
+            ctx->page_list_head->chunk = ctx->chunk;
+        }
+    }
+
+    ctx->chunk_nr = i;
+    ctx->chunk_pos = 0;
+}
+
 int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
                                   char *compbuf, unsigned long compbuf_size,
                                   unsigned long *compbuf_len)
 {
-    char *cache_copy = NULL, *current_page = NULL;
-    int israw, rc = 1;
+    struct comp_job *job;
+    int rc = 1;
 
-    if (!ctx->pfns_len || (ctx->pfns_index == ctx->pfns_len)) {
+    if ( ctx->chunk_pos == ctx->chunk_nr &&
+         (!ctx->pfns_len || (ctx->pfns_index == ctx->pfns_len)) ) {
         ctx->pfns_len = ctx->pfns_index = 0;
+        ctx->chunk_nr = ctx->chunk_pos = 0;
         return 0;
     }
 
@@ -325,31 +546,31 @@ int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
     ctx->compbuf = compbuf;
     ctx->compbuf_size = compbuf_size;
 
-    for (; ctx->pfns_index < ctx->pfns_len; ctx->pfns_index++)
+    for (;;)
     {
-        israw = 0;
-        cache_copy = NULL;
-        current_page = ctx->inputbuf + ctx->pfns_index * XC_PAGE_SIZE;
-
-        if (ctx->sendbuf_pfns[ctx->pfns_index] == INVALID_P2M_ENTRY)
-            israw = 1;
-        else
-            cache_copy = get_cache_page(ctx,
-                                        ctx->sendbuf_pfns[ctx->pfns_index],
-                                        &israw);
-
-        if (israw)
-            rc = (add_full_page(ctx, current_page, cache_copy) >= 0);
-        else
-            rc = (compress_page(ctx, current_page, cache_copy) >= 0);
-
-        if ( !rc )
+        /* Output what is left of the current chunk */
+        for ( ; ctx->chunk_pos < ctx->chunk_nr; ctx->chunk_pos++ )
         {
-            /* Out of space in outbuf! flush and come back */
-            rc = -1;
-            break;
+            job = &ctx->jobs[ctx->chunk_pos];
+            if ( ctx->compbuf_pos + job->len > ctx->compbuf_size )
+            {
+                /* Out of space in outbuf! flush and come back */
+                rc = -1;
+                goto out;
+            }
+            memcpy(ctx->compbuf + ctx->compbuf_pos, job->out, job->len);
+            ctx->compbuf_pos += job->len;
         }
+
+        if ( ctx->pfns_index == ctx->pfns_len )
+            break;
+
+        prepare_chunk(ctx);
+        compress_chunk(ctx);
+        ctx->pfns_index += ctx->chunk_nr;
     }
+
+ out:
     if (compbuf_len)
         *compbuf_len = ctx->compbuf_pos;
 
@@ -360,6 +581,7 @@ inline
 void xc_compression_reset_pagebuf(xc_interface *xch, comp_ctx *ctx)
 {
     ctx->pfns_index = ctx->pfns_len = 0;
+    ctx->chunk_nr = ctx->chunk_pos = 0;
 }
 
 int xc_compression_uncompress_page(xc_interface *xch, char *compbuf,
@@ -453,10 +675,256 @@ int xc_compression_uncompress_page(xc_interface *xch, char *compbuf,
     return 0;
 }
 
+/*
+ * LZ4 block format (see lz4.github.io/lz4): sequences of a token, literal
+ * length, literals, match offset and match length.  The compressor is the
+ * plain greedy one with a single hash table; the decompressor checks every
+ * length against both buffers.
+ */
+#define LZ4_HASH_LOG      12
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT       12
+#define LZ4_MAX_OFFSET    65535
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t lz4_read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_put_len(uint8_t *op, unsigned long len)
+{
+    for ( ; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+/* Worst case output for a sequence with lit literals and match length */
+#define LZ4_SEQ_MAX(lit, mlen) (1 + (lit) / 255 + 1 + (lit) + 2 + (mlen) / 255 + 1)
+
+/* Returns the compressed length, or 0 if it won't fit in dst_size. */
+static unsigned long lz4_compress(const uint8_t *src, unsigned long len,
+                                  uint8_t *dst, unsigned long dst_size,
+                                  uint32_t *table)
+{
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    const uint8_t *mflimit = end - LZ4_MFLIMIT;
+    const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+    uint8_t *op = dst, *oend = dst + dst_size, *token;
+    unsigned long lit, mlen;
+    unsigned int misses = 0;
+
+    memset(table, 0, sizeof(*table) << LZ4_HASH_LOG);
+
+    while ( len > LZ4_MFLIMIT && ip < mflimit )
+    {
+        uint32_t seq = lz4_read32(ip);
+        unsigned int h = lz4_hash(seq);
+        const uint8_t *ref = src + table[h], *mp, *mr;
+
+        table[h] = ip - src;
+        if ( ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq )
+        {
+            /* Incompressible data: look less and less closely */
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        while ( ip > anchor && ref > src && ip[-1] == ref[-1] )
+        {
+            ip--;
+            ref--;
+        }
+
+        mp = ip + LZ4_MIN_MATCH;
+        mr = ref + LZ4_MIN_MATCH;
+        while ( mp + 8 <= matchlimit && lz4_read64(mp) == lz4_read64(mr) )
+        {
+            mp += 8;
+            mr += 8;
+        }
+        while ( mp < matchlimit && *mp == *mr )
+        {
+            mp++;
+            mr++;
+        }
+
+        lit = ip - anchor;
+        mlen = mp - ip - LZ4_MIN_MATCH;
+        if ( LZ4_SEQ_MAX(lit, mlen) > (unsigned long)(oend - op) )
+            return 0;
+
+        token = op++;
+        *token = (lit < 15 ? lit : 15) << 4;
+        if ( lit >= 15 )
+            op = lz4_put_len(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        *token |= mlen < 15 ? mlen : 15;
+        if ( mlen >= 15 )
+            op = lz4_put_len(op, mlen - 15);
+
+        ip = anchor = mp;
+    }
+
+    lit = end - anchor;
+    if ( LZ4_SEQ_MAX(lit, 0) > (unsigned long)(oend - op) )
+        return 0;
+    token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if ( lit >= 15 )
+        op = lz4_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+static int lz4_get_len(const uint8_t **ip, const uint8_t *iend,
+                       unsigned long *len)
+{
+    uint8_t b;
+
+    do {
+        if ( *ip >= iend )
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while ( b == 255 );
+
+    return 0;
+}
+
+/* Returns 0 if src decompresses to exactly dst_len bytes. */
+static int lz4_decompress(const uint8_t *src, unsigned long len,
+                          uint8_t *dst, unsigned long dst_len)
+{
+    const uint8_t *ip = src, *iend = src + len, *ref;
+    uint8_t *op = dst, *oend = dst + dst_len;
+    unsigned long lit, mlen, off;
+    uint8_t token;
+
+    while ( ip < iend )
+    {
+        token = *ip++;
+
+        lit = token >> 4;
+        if ( lit == 15 && lz4_get_len(&ip, iend, &lit) )
+            return -1;
+        if ( lit > (unsigned long)(iend - ip) ||
+             lit > (unsigned long)(oend - op) )
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        /* The last sequence has literals only */
+        if ( ip == iend )
+            break;
+
+        if ( iend - ip < 2 )
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ( !off || off > (unsigned long)(op - dst) )
+            return -1;
+
+        mlen = token & 15;
+        if ( mlen == 15 && lz4_get_len(&ip, iend, &mlen) )
+            return -1;
+        mlen += LZ4_MIN_MATCH;
+        if ( mlen > (unsigned long)(oend - op) )
+            return -1;
+
+        /* Matches may overlap what they produce: byte at a time */
+        for ( ref = op - off; mlen--; )
+            *op++ = *ref++;
+    }
+
+    return op == oend ? 0 : -1;
+}
+
+unsigned long xc_compression_pack(xc_interface *xch, comp_ctx *ctx,
+                                  const char *buf, unsigned long len,
+                                  const char **packed)
+{
+    unsigned long plen;
+    char *p;
+
+    if ( len < PACK_MIN )
+        return 0;
+    if ( ctx->pack_skip )
+    {
+        ctx->pack_skip--;
+        return 0;
+    }
+
+    if ( ctx->packbuf_size < len )
+    {
+        if ( !(p = realloc(ctx->packbuf, len)) )
+            return 0;
+        ctx->packbuf = p;
+        ctx->packbuf_size = len;
+    }
+
+    /* Only worth it if it saves an eighth */
+    plen = lz4_compress((const uint8_t *)buf, len, (uint8_t *)ctx->packbuf,
+                        len - len / 8, ctx->pack_table);
+    if ( !plen )
+    {
+        ctx->pack_skip = PACK_BACKOFF;
+        return 0;
+    }
+
+    *packed = ctx->packbuf;
+    return plen;
+}
+
+int xc_compression_unpack(xc_interface *xch, const char *src,
+                          unsigned long src_len, char *dest,
+                          unsigned long dest_len)
+{
+    if ( lz4_decompress((const uint8_t *)src, src_len,
+                        (uint8_t *)dest, dest_len) )
+    {
+        ERROR("Corrupt packed compression chunk (%lu bytes, to %lu)",
+              src_len, dest_len);
+        return -1;
+    }
+
+    return 0;
+}
+
 void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx)
 {
     if (!ctx) return;
 
+    comp_pool_stop(ctx);
+    free(ctx->jobs);
+    free(ctx->jobs_out);
+    free(ctx->pack_table);
+    free(ctx->packbuf);
     free(ctx->inputbuf);
     free(ctx->sendbuf_pfns);
     free(ctx->cache_base);
@@ -521,6 +989,7 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
     for (i = 0; i < num_cache_pages; i++)
     {
         ctx->cache[i].pfn = INVALID_P2M_ENTRY;
+        ctx->cache[i].chunk = 0;
         ctx->cache[i].page = ctx->cache_base + i * XC_PAGE_SIZE;
         ctx->cache[i].prev = (i == 0) ? NULL : &(ctx->cache[i - 1]);
         ctx->cache[i].next = ((i+1) == num_cache_pages)? NULL :
@@ -530,6 +999,19 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
     ctx->page_list_tail = &(ctx->cache[num_cache_pages -1]);
     ctx->dom_pfnlist_size = p2m_size;
 
+    ctx->jobs = calloc(COMP_CHUNK, sizeof(*ctx->jobs));
+    ctx->jobs_out = malloc(COMP_CHUNK * WORST_COMP_PAGE_SIZE);
+    ctx->pack_table = malloc(sizeof(*ctx->pack_table) << LZ4_HASH_LOG);
+    if (!ctx->jobs || !ctx->jobs_out || !ctx->pack_table)
+    {
+        ERROR("Could not alloc compression work area\n");
+        goto error;
+    }
+    for (i = 0; i < COMP_CHUNK; i++)
+        ctx->jobs[i].out = ctx->jobs_out + i * WORST_COMP_PAGE_SIZE;
+
+    comp_pool_start(xch, ctx);
+
     return ctx;
 error:
     xc_compression_free_context(xch, ctx);
@@ -66,10 +66,34 @@
 #include "xc_dom.h"
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 /* number of pages to write at a time */
 #define DUMP_INCREMENT (4 * 1024)
 
+/*
+ * Guest pages are read a batch at a time, mapped with one bulk call.  The
+ * next batch is read on a thread while the previous one is written out.
+ */
+struct dump_batch {
+    xc_interface *xch;
+    uint32_t domid;
+    unsigned long nr;               /* pages asked for */
+    unsigned long nr_read;          /* pages copied into buf */
+    uint64_t pfn[DUMP_INCREMENT];
+    xen_pfn_t gmfn[DUMP_INCREMENT];
+    int err[DUMP_INCREMENT];
+    char *buf;
+};
+
+struct dump_pages {
+    struct dump_batch *batch[2];
+    struct dump_batch *fill;        /* collecting pages to read */
+    struct dump_batch *reading;     /* being read, or NULL */
+    pthread_t thread;
+    int threaded;
+};
+
 /* string table */
 struct xc_core_strtab {
     char       *strings;
@@ -417,6 +441,152 @@ elfnote_dump_format_version(xc_interface *xch,
     return dump_rtn(xch, args, (char*)&format_version, sizeof(format_version));
 }
 
+static void *dump_batch_read(void *arg)
+{
+    struct dump_batch *b = arg;
+    unsigned long k;
+    char *vaddr;
+
+    b->nr_read = 0;
+    if ( b->nr == 0 )
+        return NULL;
+
+    vaddr = xc_map_foreign_bulk(b->xch, b->domid, PROT_READ,
+                                b->gmfn, b->err, b->nr);
+    if ( vaddr == NULL )
+        return NULL;
+
+    /* Skip pages which could not be mapped, as before */
+    for ( k = 0; k < b->nr; k++ )
+    {
+        if ( b->err[k] )
+            continue;
+        b->pfn[b->nr_read] = b->pfn[k];
+        b->gmfn[b->nr_read] = b->gmfn[k];
+        memcpy(b->buf + b->nr_read * PAGE_SIZE, vaddr + k * PAGE_SIZE,
+               PAGE_SIZE);
+        b->nr_read++;
+    }
+    munmap(vaddr, b->nr * PAGE_SIZE);
+
+    return NULL;
+}
+
+static struct dump_pages *dump_pages_init(xc_interface *xch, uint32_t domid)
+{
+    struct dump_pages *dp = calloc(1, sizeof(*dp));
+    int i;
+
+    if ( dp == NULL )
+        return NULL;
+
+    for ( i = 0; i < 2; i++ )
+    {
+        dp->batch[i] = calloc(1, sizeof(*dp->batch[i]));
+        if ( dp->batch[i] == NULL ||
+             (dp->batch[i]->buf = malloc(DUMP_INCREMENT * PAGE_SIZE)) == NULL )
+            goto err;
+        dp->batch[i]->xch = xch;
+        dp->batch[i]->domid = domid;
+    }
+    dp->fill = dp->batch[0];
+
+    return dp;
+
+ err:
+    for ( i = 0; i < 2; i++ )
+        if ( dp->batch[i] )
+        {
+            free(dp->batch[i]->buf);
+            free(dp->batch[i]);
+        }
+    free(dp);
+    return NULL;
+}
+
+/* Wait for the batch being read, and return it. */
+static struct dump_batch *dump_pages_finish(struct dump_pages *dp)
+{
+    struct dump_batch *b = dp->reading;
+
+    if ( b && dp->threaded )
+        pthread_join(dp->thread, NULL);
+    dp->reading = NULL;
+
+    return b;
+}
+
+/* Start reading the pages collected, and collect into the other batch. */
+static void dump_pages_start(struct dump_pages *dp)
+{
+    dp->reading = dp->fill;
+    dp->fill = dp->fill == dp->batch[0] ? dp->batch[1] : dp->batch[0];
+    dp->fill->nr = 0;
+
+    dp->threaded = pthread_create(&dp->thread, NULL, dump_batch_read,
+                                  dp->reading) == 0;
+    if ( !dp->threaded )
+        dump_batch_read(dp->reading);
+}
+
+static void dump_pages_free(struct dump_pages *dp)
+{
+    int i;
+
+    if ( dp == NULL )
+        return;
+
+    dump_pages_finish(dp);
+    for ( i = 0; i < 2; i++ )
+    {
+        free(dp->batch[i]->buf);
+        free(dp->batch[i]);
+    }
+    free(dp);
+}
+
+/*
+ * Write out the pages of a batch, and account them in the p2m/pfn table.
+ * Returns 1 if more pages were read than there is room for.
+ */
+static int dump_batch_write(xc_interface *xch, struct dump_batch *b,
+                            void *args, dumpcore_rtn_t dump_rtn,
+                            int auto_translated_physmap,
+                            struct xen_dumpcore_p2m *p2m_array,
+                            uint64_t *pfn_array,
+                            unsigned long *j, unsigned long nr_pages)
+{
+    unsigned long k;
+    int sts;
+
+    for ( k = 0; k < b->nr_read && *j < nr_pages; k++, (*j)++ )
+    {
+        if ( !auto_translated_physmap )
+        {
+            p2m_array[*j].pfn = b->pfn[k];
+            p2m_array[*j].gmfn = b->gmfn[k];
+        }
+        else
+            pfn_array[*j] = b->pfn[k];
+    }
+
+    sts = dump_rtn(xch, args, b->buf, k * PAGE_SIZE);
+    if ( sts != 0 )
+        return sts;
+
+    if ( k < b->nr_read )
+    {
+        /*
+         * When live dump-mode (-L option) is specified,
+         * guest domain may increase memory.
+         */
+        IPRINTF("exceeded nr_pages (%ld) losing pages", nr_pages);
+        return 1;
+    }
+
+    return 0;
+}
+
 int
 xc_domain_dumpcore_via_callback(xc_interface *xch,
                                 uint32_t domid,
@@ -429,7 +599,9 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     struct domain_info_context *dinfo = &_dinfo;
 
     int nr_vcpus = 0;
-    char *dump_mem, *dump_mem_start = NULL;
+    char *dump_mem_start = NULL;
+    struct dump_pages *dp = NULL;
+    struct dump_batch *done;
     vcpu_guest_context_any_t *ctxt = NULL;
     struct xc_core_arch_context arch_ctxt;
     char dummy[PAGE_SIZE];
@@ -467,11 +639,16 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     }
 
     xc_core_arch_context_init(&arch_ctxt);
-    if ( (dump_mem_start = malloc(DUMP_INCREMENT*PAGE_SIZE)) == NULL )
+    if ( (dump_mem_start = malloc(PAGE_SIZE)) == NULL )
     {
         PERROR("Could not allocate dump_mem");
         goto out;
     }
+    if ( (dp = dump_pages_init(xch, domid)) == NULL )
+    {
+        PERROR("Could not allocate page batches");
+        goto out;
+    }
 
     if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 )
     {
@@ -778,7 +955,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
 
     /* dump pages: .xen_pages */
     j = 0;
-    dump_mem = dump_mem_start;
     for ( map_idx = 0; map_idx < nr_memory_map; map_idx++ )
     {
         uint64_t pfn_start;
@@ -789,17 +965,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         for ( i = pfn_start; i < pfn_end; i++ )
         {
             uint64_t gmfn;
-            void *vaddr;
-            
-            if ( j >= nr_pages )
-            {
-                /*
-                 * When live dump-mode (-L option) is specified,
-                 * guest domain may increase memory.
-                 */
-                IPRINTF("exceeded nr_pages (%ld) losing pages", nr_pages);
-                goto copy_done;
-            }
 
             if ( !auto_translated_physmap )
             {
@@ -818,9 +983,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     if ( gmfn == (uint32_t)INVALID_P2M_ENTRY )
                        continue;
                 }
-
-                p2m_array[j].pfn = i;
-                p2m_array[j].gmfn = gmfn;
             }
             else
             {
@@ -828,33 +990,47 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     continue;
 
                 gmfn = i;
-                pfn_array[j] = i;
             }
 
-            vaddr = xc_map_foreign_range(
-                xch, domid, PAGE_SIZE, PROT_READ, gmfn);
-            if ( vaddr == NULL )
+            dp->fill->pfn[dp->fill->nr] = i;
+            dp->fill->gmfn[dp->fill->nr] = gmfn;
+            if ( ++dp->fill->nr < DUMP_INCREMENT )
                 continue;
-            memcpy(dump_mem, vaddr, PAGE_SIZE);
-            munmap(vaddr, PAGE_SIZE);
-            dump_mem += PAGE_SIZE;
-            if ( (j + 1) % DUMP_INCREMENT == 0 )
-            {
-                sts = dump_rtn(
-                    xch, args, dump_mem_start, dump_mem - dump_mem_start);
-                if ( sts != 0 )
-                    goto out;
-                dump_mem = dump_mem_start;
-            }
 
-            j++;
+            /* Read this batch while writing the previous one */
+            done = dump_pages_finish(dp);
+            dump_pages_start(dp);
+            if ( done == NULL )
+                continue;
+            sts = dump_batch_write(xch, done, args, dump_rtn,
+                                   auto_translated_physmap, p2m_array,
+                                   pfn_array, &j, nr_pages);
+            if ( sts < 0 )
+                goto out;
+            if ( sts > 0 )
+                goto copy_done;
         }
     }
 
-copy_done:
-    sts = dump_rtn(xch, args, dump_mem_start, dump_mem - dump_mem_start);
-    if ( sts != 0 )
+    done = dump_pages_finish(dp);
+    dump_pages_start(dp);
+    if ( done != NULL )
+    {
+        sts = dump_batch_write(xch, done, args, dump_rtn,
+                               auto_translated_physmap, p2m_array,
+                               pfn_array, &j, nr_pages);
+        if ( sts < 0 )
+            goto out;
+        if ( sts > 0 )
+            goto copy_done;
+    }
+    sts = dump_batch_write(xch, dump_pages_finish(dp), args, dump_rtn,
+                           auto_translated_physmap, p2m_array,
+                           pfn_array, &j, nr_pages);
+    if ( sts < 0 )
         goto out;
+
+copy_done:
     if ( j < nr_pages )
     {
         /* When live dump-mode (-L option) is specified,
@@ -910,6 +1086,7 @@ out:
         free(ctxt);
     if ( dump_mem_start != NULL )
         free(dump_mem_start);
+    dump_pages_free(dp);
     if ( live_shinfo != NULL )
         munmap(live_shinfo, PAGE_SIZE);
     xc_core_arch_context_free(&arch_ctxt);
@@ -920,18 +1097,62 @@ out:
 /* Callback args for writing to a local dump file. */
 struct dump_args {
     int     fd;
+    int     no_holes;
 };
 
-/* Callback routine for writing to a local dump file. */
+static int page_is_zero(const char *page)
+{
+    const unsigned long *p = (const unsigned long *)page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        if ( p[i] )
+            return 0;
+
+    return 1;
+}
+
+/*
+ * Callback routine for writing to a local dump file.
+ *
+ * Whole pages of zeroes, the bulk of a mostly idle guest, are skipped over
+ * so that they become holes in the file: they read back as zeroes, and
+ * take no disk space or write bandwidth.
+ */
 static int local_file_dump(xc_interface *xch,
                            void *args, char *buffer, unsigned int length)
 {
     struct dump_args *da = args;
+    unsigned int done, len;
 
-    if ( write_exact(da->fd, buffer, length) == -1 )
+    for ( done = 0; done < length; done += len )
     {
-        PERROR("Failed to write buffer");
-        return -errno;
+        len = 0;
+        while ( !da->no_holes && length - done - len >= PAGE_SIZE &&
+                page_is_zero(buffer + done + len) )
+            len += PAGE_SIZE;
+
+        if ( len != 0 )
+        {
+            if ( lseek(da->fd, len, SEEK_CUR) != (off_t)-1 )
+                continue;
+            /* Not seekable: write the zeroes out after all */
+            da->no_holes = 1;
+        }
+        else
+        {
+            while ( done + len < length &&
+                    (da->no_holes || length - done - len < PAGE_SIZE ||
+                     !page_is_zero(buffer + done + len)) )
+                len += length - done - len < PAGE_SIZE ?
+                       length - done - len : PAGE_SIZE;
+        }
+
+        if ( write_exact(da->fd, buffer + done, len) == -1 )
+        {
+            PERROR("Failed to write buffer");
+            return -errno;
+        }
     }
 
     if ( length >= (DUMP_INCREMENT * PAGE_SIZE) )
@@ -949,7 +1170,8 @@ xc_domain_dumpcore(xc_interface *xch,
                    uint32_t domid,
                    const char *corename)
 {
-    struct dump_args da;
+    struct dump_args da = { .no_holes = 0 };
+    off_t end;
     int sts;
 
     if ( (da.fd = open(corename, O_CREAT|O_RDWR|O_TRUNC, S_IWUSR|S_IRUSR)) < 0 )
@@ -961,6 +1183,15 @@ xc_domain_dumpcore(xc_interface *xch,
     sts = xc_domain_dumpcore_via_callback(
         xch, domid, &da, &local_file_dump);
 
+    /* A hole at the very end has to be given a size */
+    if ( sts == 0 && !da.no_holes &&
+         (end = lseek(da.fd, 0, SEEK_CUR)) != (off_t)-1 &&
+         ftruncate(da.fd, end) != 0 )
+    {
+        PERROR("Could not extend corefile %s", corename);
+        sts = -errno;
+    }
+
     /* flush and discard any remaining portion of the file from cache */
     discard_file_cache(xch, da.fd, 1/* flush first*/);
 
@@ -21,6 +21,7 @@
  */
 
 #include <stdlib.h>
+#include <pthread.h>
 #include "xc_private.h"
 #include "xc_cpufeature.h"
 #include <xen/hvm/params.h>
@@ -33,6 +34,16 @@
 #define DEF_MAX_INTELEXT  0x80000008u
 #define DEF_MAX_AMDEXT    0x8000001cu
 
+/* What a domain's policy depends on, beyond the host's own cpuid. */
+struct cpuid_domain_info
+{
+    int hvm;
+    int xen_64bit;
+    int pae, nestedhvm;         /* HVM */
+    int guest_64bit;            /* PV */
+    uint64_t xfeature_mask;
+};
+
 static int hypervisor_is_64bit(xc_interface *xch)
 {
     xen_capabilities_info_t xen_caps = "";
@@ -77,10 +88,11 @@ static void xc_cpuid_brand_get(char *str)
 }
 
 static void amd_xc_cpuid_policy(
-    xc_interface *xch, domid_t domid,
-    const unsigned int *input, unsigned int *regs,
-    int is_pae, int is_nestedhvm)
+    const struct cpuid_domain_info *info,
+    const unsigned int *input, unsigned int *regs)
 {
+    int is_pae = info->pae, is_nestedhvm = info->nestedhvm;
+
     switch ( input[0] )
     {
     case 0x00000002:
@@ -94,7 +106,7 @@ static void amd_xc_cpuid_policy(
         break;
 
     case 0x80000001: {
-        int is_64bit = hypervisor_is_64bit(xch) && is_pae;
+        int is_64bit = info->xen_64bit && is_pae;
 
         if ( !is_pae )
             clear_bit(X86_FEATURE_PAE, regs[3]);
@@ -165,10 +177,11 @@ static void amd_xc_cpuid_policy(
 }
 
 static void intel_xc_cpuid_policy(
-    xc_interface *xch, domid_t domid,
-    const unsigned int *input, unsigned int *regs,
-    int is_pae, int is_nestedhvm)
+    const struct cpuid_domain_info *info,
+    const unsigned int *input, unsigned int *regs)
 {
+    int is_pae = info->pae, is_nestedhvm = info->nestedhvm;
+
     switch ( input[0] )
     {
     case 0x00000001:
@@ -193,7 +206,7 @@ static void intel_xc_cpuid_policy(
         break;
 
     case 0x80000001: {
-        int is_64bit = hypervisor_is_64bit(xch) && is_pae;
+        int is_64bit = info->xen_64bit && is_pae;
 
         /* Only a few features are advertised in Intel's 0x80000001. */
         regs[2] &= (is_64bit ? bitmaskof(X86_FEATURE_LAHF_LM) : 0) |
@@ -219,8 +232,7 @@ static void intel_xc_cpuid_policy(
 #define XSAVEOPT        (1 << 0)
 /* Configure extended state enumeration leaves (0x0000000D for xsave) */
 static void xc_cpuid_config_xsave(
-    xc_interface *xch, domid_t domid, uint64_t xfeature_mask,
-    const unsigned int *input, unsigned int *regs)
+    uint64_t xfeature_mask, const unsigned int *input, unsigned int *regs)
 {
     if ( xfeature_mask == 0 )
     {
@@ -269,28 +281,11 @@ static void xc_cpuid_config_xsave(
 }
 
 static void xc_cpuid_hvm_policy(
-    xc_interface *xch, domid_t domid,
+    const struct cpuid_domain_info *info,
     const unsigned int *input, unsigned int *regs)
 {
-    DECLARE_DOMCTL;
     char brand[13];
-    unsigned long nestedhvm;
-    unsigned long pae;
-    int is_pae, is_nestedhvm;
-    uint64_t xfeature_mask;
-
-    xc_get_hvm_param(xch, domid, HVM_PARAM_PAE_ENABLED, &pae);
-    is_pae = !!pae;
-
-    /* Detecting Xen's atitude towards XSAVE */
-    memset(&domctl, 0, sizeof(domctl));
-    domctl.cmd = XEN_DOMCTL_getvcpuextstate;
-    domctl.domain = domid;
-    do_domctl(xch, &domctl);
-    xfeature_mask = domctl.u.vcpuextstate.xfeature_mask;
-
-    xc_get_hvm_param(xch, domid, HVM_PARAM_NESTEDHVM, &nestedhvm);
-    is_nestedhvm = !!nestedhvm;
+    int is_pae = info->pae;
 
     switch ( input[0] )
     {
@@ -319,7 +314,7 @@ static void xc_cpuid_hvm_policy(
                     bitmaskof(X86_FEATURE_AES) |
                     bitmaskof(X86_FEATURE_F16C) |
                     bitmaskof(X86_FEATURE_RDRAND) |
-                    ((xfeature_mask != 0) ?
+                    ((info->xfeature_mask != 0) ?
                      (bitmaskof(X86_FEATURE_AVX) |
                       bitmaskof(X86_FEATURE_XSAVE)) : 0));
 
@@ -378,7 +373,7 @@ static void xc_cpuid_hvm_policy(
         break;
 
     case 0x0000000d:
-        xc_cpuid_config_xsave(xch, domid, xfeature_mask, input, regs);
+        xc_cpuid_config_xsave(info->xfeature_mask, input, regs);
         break;
 
     case 0x80000000:
@@ -425,34 +420,21 @@ static void xc_cpuid_hvm_policy(
 
     xc_cpuid_brand_get(brand);
     if ( strstr(brand, "AMD") )
-        amd_xc_cpuid_policy(xch, domid, input, regs, is_pae, is_nestedhvm);
+        amd_xc_cpuid_policy(info, input, regs);
     else
-        intel_xc_cpuid_policy(xch, domid, input, regs, is_pae, is_nestedhvm);
+        intel_xc_cpuid_policy(info, input, regs);
 
 }
 
 static void xc_cpuid_pv_policy(
-    xc_interface *xch, domid_t domid,
+    const struct cpuid_domain_info *info,
     const unsigned int *input, unsigned int *regs)
 {
-    DECLARE_DOMCTL;
-    unsigned int guest_width;
-    int guest_64bit, xen_64bit = hypervisor_is_64bit(xch);
+    int guest_64bit = info->guest_64bit;
     char brand[13];
-    uint64_t xfeature_mask;
 
     xc_cpuid_brand_get(brand);
 
-    xc_domain_get_guest_width(xch, domid, &guest_width);
-    guest_64bit = (guest_width == 8);
-
-    /* Detecting Xen's atitude towards XSAVE */
-    memset(&domctl, 0, sizeof(domctl));
-    domctl.cmd = XEN_DOMCTL_getvcpuextstate;
-    domctl.domain = domid;
-    do_domctl(xch, &domctl);
-    xfeature_mask = domctl.u.vcpuextstate.xfeature_mask;
-
     if ( (input[0] & 0x7fffffff) == 0x00000001 )
     {
         clear_bit(X86_FEATURE_VME, regs[3]);
@@ -467,7 +449,7 @@ static void xc_cpuid_pv_policy(
     switch ( input[0] )
     {
     case 0x00000001:
-        if ( !xen_64bit || strstr(brand, "AMD") )
+        if ( !info->xen_64bit || strstr(brand, "AMD") )
             clear_bit(X86_FEATURE_SEP, regs[3]);
         clear_bit(X86_FEATURE_DS, regs[3]);
         clear_bit(X86_FEATURE_ACC, regs[3]);
@@ -482,7 +464,7 @@ static void xc_cpuid_pv_policy(
         clear_bit(X86_FEATURE_TM2, regs[2]);
         if ( !guest_64bit )
             clear_bit(X86_FEATURE_CX16, regs[2]);
-        if ( xfeature_mask == 0 )
+        if ( info->xfeature_mask == 0 )
         {
             clear_bit(X86_FEATURE_XSAVE, regs[2]);
             clear_bit(X86_FEATURE_AVX, regs[2]);
@@ -509,7 +491,7 @@ static void xc_cpuid_pv_policy(
         break;
 
     case 0x0000000d:
-        xc_cpuid_config_xsave(xch, domid, xfeature_mask, input, regs);
+        xc_cpuid_config_xsave(info->xfeature_mask, input, regs);
         break;
 
     case 0x80000001:
@@ -549,23 +531,56 @@ static void xc_cpuid_pv_policy(
     }
 }
 
-static int xc_cpuid_policy(
-    xc_interface *xch, domid_t domid,
-    const unsigned int *input, unsigned int *regs)
+/* Gather what the policy of a domain depends on, in one go. */
+static int get_cpuid_domain_info(
+    xc_interface *xch, domid_t domid, struct cpuid_domain_info *info)
 {
-    xc_dominfo_t        info;
+    DECLARE_DOMCTL;
+    xc_dominfo_t di;
+    unsigned long pae, nestedhvm;
+    unsigned int guest_width;
+
+    memset(info, 0, sizeof(*info));
 
-    if ( xc_domain_getinfo(xch, domid, 1, &info) == 0 )
+    if ( xc_domain_getinfo(xch, domid, 1, &di) == 0 )
         return -EINVAL;
 
-    if ( info.hvm )
-        xc_cpuid_hvm_policy(xch, domid, input, regs);
+    info->hvm = di.hvm;
+    info->xen_64bit = hypervisor_is_64bit(xch);
+
+    /* Detecting Xen's atitude towards XSAVE */
+    memset(&domctl, 0, sizeof(domctl));
+    domctl.cmd = XEN_DOMCTL_getvcpuextstate;
+    domctl.domain = domid;
+    do_domctl(xch, &domctl);
+    info->xfeature_mask = domctl.u.vcpuextstate.xfeature_mask;
+
+    if ( info->hvm )
+    {
+        xc_get_hvm_param(xch, domid, HVM_PARAM_PAE_ENABLED, &pae);
+        info->pae = !!pae;
+        xc_get_hvm_param(xch, domid, HVM_PARAM_NESTEDHVM, &nestedhvm);
+        info->nestedhvm = !!nestedhvm;
+    }
     else
-        xc_cpuid_pv_policy(xch, domid, input, regs);
+    {
+        xc_domain_get_guest_width(xch, domid, &guest_width);
+        info->guest_64bit = (guest_width == 8);
+    }
 
     return 0;
 }
 
+static void xc_cpuid_policy(
+    const struct cpuid_domain_info *info,
+    const unsigned int *input, unsigned int *regs)
+{
+    if ( info->hvm )
+        xc_cpuid_hvm_policy(info, input, regs);
+    else
+        xc_cpuid_pv_policy(info, input, regs);
+}
+
 static int xc_cpuid_do_domctl(
     xc_interface *xch, domid_t domid,
     const unsigned int *input, const unsigned int *regs)
@@ -608,13 +623,32 @@ void xc_cpuid_to_str(const unsigned int *regs, char **strs)
     }
 }
 
-int xc_cpuid_apply_policy(xc_interface *xch, domid_t domid)
+/*
+ * A computed policy: the leaves to set for domains of one configuration.
+ * Only the domain's configuration and the host's cpuid go into it, so
+ * the last few computed are cached for the life of the process.
+ */
+#define CPUID_POLICY_MAX_LEAVES 128
+#define CPUID_POLICY_CACHE      8
+
+struct cpuid_policy
+{
+    struct cpuid_domain_info info;
+    unsigned int nr;
+    xen_domctl_cpuid_t leaves[CPUID_POLICY_MAX_LEAVES];
+};
+
+static struct cpuid_policy policy_cache[CPUID_POLICY_CACHE];
+static unsigned int policy_cache_nr, policy_cache_next;
+static pthread_mutex_t policy_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cpuid_policy_compute(struct cpuid_policy *pol)
 {
     unsigned int input[2] = { 0, 0 }, regs[4];
     unsigned int base_max, ext_max;
     char brand[13];
-    int rc;
 
+    pol->nr = 0;
 
     cpuid(input, regs);
     base_max = (regs[0] <= DEF_MAX_BASE) ? regs[0] : DEF_MAX_BASE;
@@ -632,13 +666,21 @@ int xc_cpuid_apply_policy(xc_interface *xch, domid_t domid)
     for ( ; ; )
     {
         cpuid(input, regs);
-        xc_cpuid_policy(xch, domid, input, regs);
+        xc_cpuid_policy(&pol->info, input, regs);
 
         if ( regs[0] || regs[1] || regs[2] || regs[3] )
         {
-            rc = xc_cpuid_do_domctl(xch, domid, input, regs);
-            if ( rc )
-                return rc;
+            xen_domctl_cpuid_t *leaf = &pol->leaves[pol->nr];
+
+            if ( pol->nr == CPUID_POLICY_MAX_LEAVES )
+                return -E2BIG;
+            leaf->input[0] = input[0];
+            leaf->input[1] = input[1];
+            leaf->eax = regs[0];
+            leaf->ebx = regs[1];
+            leaf->ecx = regs[2];
+            leaf->edx = regs[3];
+            pol->nr++;
         }
 
         /* Intel cache descriptor leaves. */
@@ -669,6 +711,88 @@ int xc_cpuid_apply_policy(xc_interface *xch, domid_t domid)
     return 0;
 }
 
+/* Fill in pol for pol->info, from the cache if it can be. */
+static int cpuid_policy_get(struct cpuid_policy *pol)
+{
+    unsigned int i;
+    int rc;
+
+    pthread_mutex_lock(&policy_cache_lock);
+    for ( i = 0; i < policy_cache_nr; i++ )
+        if ( !memcmp(&policy_cache[i].info, &pol->info, sizeof(pol->info)) )
+        {
+            *pol = policy_cache[i];
+            pthread_mutex_unlock(&policy_cache_lock);
+            return 0;
+        }
+    pthread_mutex_unlock(&policy_cache_lock);
+
+    if ( (rc = cpuid_policy_compute(pol)) )
+        return rc;
+
+    pthread_mutex_lock(&policy_cache_lock);
+    policy_cache[policy_cache_next] = *pol;
+    policy_cache_next = (policy_cache_next + 1) % CPUID_POLICY_CACHE;
+    if ( policy_cache_nr < CPUID_POLICY_CACHE )
+        policy_cache_nr++;
+    pthread_mutex_unlock(&policy_cache_lock);
+
+    return 0;
+}
+
+static int xc_cpuid_set_policy(
+    xc_interface *xch, domid_t domid, struct cpuid_policy *pol)
+{
+    DECLARE_DOMCTL;
+    DECLARE_NAMED_HYPERCALL_BOUNCE(leaves, pol->leaves,
+                                   pol->nr * sizeof(*pol->leaves),
+                                   XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    unsigned int i;
+    int rc;
+
+    if ( xc_hypercall_bounce_pre(xch, leaves) )
+    {
+        PERROR("Could not bounce cpuid policy");
+        return -1;
+    }
+
+    memset(&domctl, 0, sizeof(domctl));
+    domctl.cmd = XEN_DOMCTL_set_cpuid_policy;
+    domctl.domain = domid;
+    domctl.u.cpuid_policy.nr_leaves = pol->nr;
+    set_xen_guest_handle(domctl.u.cpuid_policy.leaves, leaves);
+    rc = do_domctl(xch, &domctl);
+
+    xc_hypercall_bounce_post(xch, leaves);
+
+    /* Older Xen: a leaf at a time */
+    if ( rc < 0 && errno == ENOSYS )
+        for ( i = 0, rc = 0; i < pol->nr && rc == 0; i++ )
+            rc = xc_cpuid_do_domctl(xch, domid, pol->leaves[i].input,
+                                    &pol->leaves[i].eax);
+
+    return rc;
+}
+
+int xc_cpuid_apply_policy(xc_interface *xch, domid_t domid)
+{
+    struct cpuid_policy *pol;
+    int rc;
+
+    /* Too big for the stack of some callers */
+    if ( (pol = malloc(sizeof(*pol))) == NULL )
+        return -ENOMEM;
+
+    rc = get_cpuid_domain_info(xch, domid, &pol->info);
+    if ( rc == 0 )
+        rc = cpuid_policy_get(pol);
+    if ( rc == 0 )
+        rc = xc_cpuid_set_policy(xch, domid, pol);
+
+    free(pol);
+    return rc;
+}
+
 /*
  * Check whether a VM is allowed to launch on this host's processor type.
  *
@@ -749,15 +873,20 @@ int xc_cpuid_set(
     xc_interface *xch, domid_t domid, const unsigned int *input,
     const char **config, char **config_transformed)
 {
+    struct cpuid_domain_info info;
     int rc;
     unsigned int i, j, regs[4], polregs[4];
 
     memset(config_transformed, 0, 4 * sizeof(*config_transformed));
 
+    rc = get_cpuid_domain_info(xch, domid, &info);
+    if ( rc )
+        return rc;
+
     cpuid(input, regs);
 
     memcpy(polregs, regs, sizeof(regs));
-    xc_cpuid_policy(xch, domid, input, polregs);
+    xc_cpuid_policy(&info, input, polregs);
 
     for ( i = 0; i < 4; i++ )
     {
@@ -109,6 +109,7 @@ xc_cpupoolinfo_t *xc_cpupool_getinfo(xc_interface *xch,
     info->cpupool_id = sysctl.u.cpupool_op.cpupool_id;
     info->sched_id = sysctl.u.cpupool_op.sched_id;
     info->n_dom = sysctl.u.cpupool_op.n_dom;
+    info->epp = sysctl.u.cpupool_op.epp;
     memcpy(info->cpumap, local, local_size);
 
 out:
@@ -201,3 +202,16 @@ out:
     xc_hypercall_buffer_free(xch, local);
     return cpumap;
 }
+
+int xc_cpupool_set_epp(xc_interface *xch,
+                       uint32_t poolid,
+                       uint32_t epp)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_cpupool_op;
+    sysctl.u.cpupool_op.op = XEN_SYSCTL_CPUPOOL_OP_SETEPP;
+    sysctl.u.cpupool_op.cpupool_id = poolid;
+    sysctl.u.cpupool_op.epp = epp;
+    return do_sysctl_save(xch, &sysctl);
+}
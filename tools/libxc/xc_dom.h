@@ -58,6 +58,11 @@ struct xc_dom_image {
     size_t max_kernel_size;
     size_t max_ramdisk_size;
 
+    /* identity of the kernel file, if loaded from one (else all zero) */
+    struct {
+        uint64_t dev, ino, size, mtime;
+    } kernel_id;
+
     /* arguments and parameters */
     char *cmdline;
     uint32_t f_requested[XENFEAT_NR_SUBMAPS];
@@ -90,6 +95,9 @@ struct xc_dom_image {
     unsigned int extra_pages;
     xen_vaddr_t virt_pgtab_end;
 
+    /* ramdisk being unpacked into guest memory in the background */
+    struct xc_dom_ramdisk_job *ramdisk_job;
+
     /* other state info */
     uint32_t f_active[XENFEAT_NR_SUBMAPS];
     /*
@@ -232,6 +240,7 @@ int xc_dom_ramdisk_mem(struct xc_dom_image *dom, const void *mem,
 int xc_dom_parse_image(struct xc_dom_image *dom);
 struct xc_dom_arch *xc_dom_find_arch_hooks(xc_interface *xch, char *guest_type);
 int xc_dom_build_image(struct xc_dom_image *dom);
+int xc_dom_ramdisk_wait(struct xc_dom_image *dom);
 int xc_dom_update_guest_p2m(struct xc_dom_image *dom);
 
 int xc_dom_boot_xen_init(struct xc_dom_image *dom, xc_interface *xch,
@@ -26,6 +26,9 @@
 #include "xc_dom.h"
 
 #define NR_MAGIC_PAGES 2
+#define SUPERPAGE_2MB_SHIFT   9
+#define SUPERPAGE_1GB_SHIFT   18
+#define SUPERPAGE_BATCH_SIZE  512
 #define CONSOLE_PFN_OFFSET 0
 #define XENSTORE_PFN_OFFSET 1
 
@@ -162,10 +165,47 @@ static void __init register_arch_hooks(void)
     xc_dom_register_arch_hooks(&xc_dom_32);
 }
 
+/*
+ * Populate as many extents of 1 << pfn_shift pages as fit, aligned, from
+ * base_pfn, stopping at the next boundary of the size above so that it
+ * can be used from there.  Returns the number of pages populated (0 if
+ * none fit, or Xen couldn't find memory of this size), or -1 on error.
+ */
+static long populate_one_size(struct xc_dom_image *dom, unsigned int pfn_shift,
+                              xen_pfn_t base_pfn, xen_pfn_t nr_pfns)
+{
+    xen_pfn_t extents[SUPERPAGE_BATCH_SIZE];
+    xen_pfn_t mask = ((xen_pfn_t)1 << pfn_shift) - 1;
+    xen_pfn_t next = ((xen_pfn_t)1 << (pfn_shift + 9)) - 1;
+    xen_pfn_t end = base_pfn + nr_pfns, i, count;
+    int nr;
+
+    if ( base_pfn & mask )
+        return 0;
+    if ( (base_pfn & next) && end > (base_pfn | next) + 1 )
+        end = (base_pfn | next) + 1;
+
+    count = (end - base_pfn) >> pfn_shift;
+    if ( count > SUPERPAGE_BATCH_SIZE )
+        count = SUPERPAGE_BATCH_SIZE;
+    if ( !count )
+        return 0;
+
+    for ( i = 0; i < count; i++ )
+        extents[i] = base_pfn + (i << pfn_shift);
+
+    nr = xc_domain_populate_physmap(dom->xch, dom->guest_domid, count,
+                                    pfn_shift, 0, extents);
+    if ( nr < 0 )
+        return -1;
+
+    return (long)nr << pfn_shift;
+}
+
 int arch_setup_meminit(struct xc_dom_image *dom)
 {
-    int rc;
-    xen_pfn_t pfn, allocsz, i;
+    xen_pfn_t pfn;
+    long done;
 
     dom->shadow_enabled = 1;
 
@@ -177,18 +217,29 @@ int arch_setup_meminit(struct xc_dom_image *dom)
     for ( pfn = 0; pfn < dom->total_pages; pfn++ )
         dom->p2m_host[pfn] = pfn + dom->rambase_pfn;
 
-    /* allocate guest memory */
-    for ( i = rc = allocsz = 0;
-          (i < dom->total_pages) && !rc;
-          i += allocsz )
+    /*
+     * allocate guest memory, in 1GB and 2MB extents where aligned so
+     * that Xen can map them with stage-2 blocks
+     */
+    for ( pfn = 0; pfn < dom->total_pages; pfn += done )
     {
-        allocsz = dom->total_pages - i;
-        if ( allocsz > 1024*1024 )
-            allocsz = 1024*1024;
-
-        rc = xc_domain_populate_physmap_exact(
-            dom->xch, dom->guest_domid, allocsz,
-            0, 0, &dom->p2m_host[i]);
+        done = populate_one_size(dom, SUPERPAGE_1GB_SHIFT,
+                                 dom->rambase_pfn + pfn,
+                                 dom->total_pages - pfn);
+        if ( !done )
+            done = populate_one_size(dom, SUPERPAGE_2MB_SHIFT,
+                                     dom->rambase_pfn + pfn,
+                                     dom->total_pages - pfn);
+        if ( !done )
+            done = populate_one_size(dom, 0, dom->rambase_pfn + pfn,
+                                     dom->total_pages - pfn);
+        if ( done <= 0 )
+        {
+            xc_dom_panic(dom->xch, XC_OUT_OF_MEMORY,
+                         "%s: failed to populate pfn %#"PRI_xen_pfn,
+                         __FUNCTION__, dom->rambase_pfn + pfn);
+            return -1;
+        }
     }
 
     return 0;
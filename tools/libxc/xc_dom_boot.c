@@ -252,6 +252,10 @@ int xc_dom_boot_image(struct xc_dom_image *dom)
     /* hypercall page */
     if ( (rc = setup_hypercall_page(dom)) != 0 )
         return rc;
+
+    /* ramdisk */
+    if ( (rc = xc_dom_ramdisk_wait(dom)) != 0 )
+        return rc;
     xc_dom_log_memory_footprint(dom);
 
     /* misc x86 stuff */
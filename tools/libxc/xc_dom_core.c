@@ -31,6 +31,7 @@
 #include <inttypes.h>
 #include <zlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xc_dom.h"
@@ -649,6 +650,7 @@ struct xc_dom_arch *xc_dom_find_arch_hooks(xc_interface *xch, char *guest_type)
 void xc_dom_release(struct xc_dom_image *dom)
 {
     DOMPRINTF_CALLED(dom->xch);
+    xc_dom_ramdisk_wait(dom);
     if ( dom->phys_pages )
         xc_dom_unmap_all(dom);
     xc_dom_free_all(dom);
@@ -708,7 +710,16 @@ int xc_dom_ramdisk_max_size(struct xc_dom_image *dom, size_t sz)
 
 int xc_dom_kernel_file(struct xc_dom_image *dom, const char *filename)
 {
+    struct stat st;
+
     DOMPRINTF("%s: filename=\"%s\"", __FUNCTION__, filename);
+    if ( stat(filename, &st) == 0 )
+    {
+        dom->kernel_id.dev = st.st_dev;
+        dom->kernel_id.ino = st.st_ino;
+        dom->kernel_id.size = st.st_size;
+        dom->kernel_id.mtime = st.st_mtime;
+    }
     dom->kernel_blob = xc_dom_malloc_filemap(dom, filename, &dom->kernel_size,
                                              dom->max_kernel_size);
     if ( dom->kernel_blob == NULL )
@@ -851,6 +862,80 @@ int xc_dom_update_guest_p2m(struct xc_dom_image *dom)
     return 0;
 }
 
+/*
+ * The ramdisk is usually the largest thing copied into a new guest, and
+ * gunzipping it the most expensive part of the build.  Nothing else in
+ * the build reads it, so it is unpacked on a thread while the kernel is
+ * loaded and the page tables set up, and waited for before the guest's
+ * memory is unmapped.
+ */
+struct xc_dom_ramdisk_job {
+    xc_interface *xch;
+    pthread_t thread;
+    void *src, *dst;
+    size_t src_len, dst_len;
+    int unzip;
+    int rc;
+};
+
+static void *ramdisk_unpack(void *arg)
+{
+    struct xc_dom_ramdisk_job *job = arg;
+
+    if ( job->unzip )
+        job->rc = xc_dom_do_gunzip(job->xch, job->src, job->src_len,
+                                   job->dst, job->dst_len);
+    else
+        memcpy(job->dst, job->src, job->src_len);
+
+    return NULL;
+}
+
+static int ramdisk_unpack_start(struct xc_dom_image *dom, void *dst,
+                                size_t dst_len, int unzip)
+{
+    struct xc_dom_ramdisk_job *job;
+
+    job = xc_dom_malloc(dom, sizeof(*job));
+    if ( job == NULL )
+        return -1;
+    memset(job, 0, sizeof(*job));
+    job->xch = dom->xch;
+    job->src = dom->ramdisk_blob;
+    job->src_len = dom->ramdisk_size;
+    job->dst = dst;
+    job->dst_len = dst_len;
+    job->unzip = unzip;
+
+    if ( pthread_create(&job->thread, NULL, ramdisk_unpack, job) != 0 )
+    {
+        /* No thread: unpack it here */
+        ramdisk_unpack(job);
+        return job->rc;
+    }
+
+    dom->ramdisk_job = job;
+    return 0;
+}
+
+int xc_dom_ramdisk_wait(struct xc_dom_image *dom)
+{
+    struct xc_dom_ramdisk_job *job = dom->ramdisk_job;
+
+    if ( job == NULL )
+        return 0;
+
+    pthread_join(job->thread, NULL);
+    dom->ramdisk_job = NULL;
+    if ( job->rc != 0 )
+    {
+        xc_dom_panic(dom->xch, XC_INVALID_KERNEL,
+                     "%s: failed to unpack ramdisk", __FUNCTION__);
+        return -1;
+    }
+    return 0;
+}
+
 int xc_dom_build_image(struct xc_dom_image *dom)
 {
     unsigned int page_size;
@@ -872,10 +957,8 @@ int xc_dom_build_image(struct xc_dom_image *dom)
                               dom->kernel_seg.vend -
                               dom->kernel_seg.vstart) != 0 )
         goto err;
-    if ( dom->kernel_loader->loader(dom) != 0 )
-        goto err;
 
-    /* load ramdisk */
+    /* load ramdisk, in the background */
     if ( dom->ramdisk_blob )
     {
         size_t unziplen, ramdisklen;
@@ -897,17 +980,14 @@ int xc_dom_build_image(struct xc_dom_image *dom)
                       __FUNCTION__);
             goto err;
         }
-        if ( unziplen )
-        {
-            if ( xc_dom_do_gunzip(dom->xch,
-                                  dom->ramdisk_blob, dom->ramdisk_size,
-                                  ramdiskmap, ramdisklen) == -1 )
-                goto err;
-        }
-        else
-            memcpy(ramdiskmap, dom->ramdisk_blob, dom->ramdisk_size);
+        if ( ramdisk_unpack_start(dom, ramdiskmap, ramdisklen,
+                                  unziplen != 0) != 0 )
+            goto err;
     }
 
+    if ( dom->kernel_loader->loader(dom) != 0 )
+        goto err;
+
     /* allocate other pages */
     if ( dom->arch_hooks->alloc_magic_pages(dom) != 0 )
         goto err;
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xc_dom.h"
@@ -313,6 +314,137 @@ static elf_errorstatus xc_dom_load_elf_symtab(struct xc_dom_image *dom,
     return 0;
 }
 
+/* ------------------------------------------------------------------------ */
+/* parse cache                                                              */
+
+/*
+ * A toolstack building many guests from one kernel parses it again for
+ * each of them: its Xen notes, and its section headers if it wants a BSD
+ * symbol table.  So the results are kept, keyed by the identity of the
+ * kernel file, and checked against the size and ELF header of the image.
+ * The pointers into the image in struct elf_dom_parms are kept as
+ * offsets, and rebased onto the image at hand.
+ */
+#define ELF_PARSE_CACHE_SIZE 4
+
+struct elf_parse_cache_entry {
+    bool valid;
+    uint64_t dev, ino, file_size, mtime;
+    size_t kernel_size;
+    unsigned char ehdr[sizeof(Elf64_Ehdr)];
+    struct elf_dom_parms parms;
+    char *guest_type;
+    xen_vaddr_t kernel_vend;
+    xen_vaddr_t bsd_symtab_start;
+};
+
+static struct elf_parse_cache_entry elf_parse_cache[ELF_PARSE_CACHE_SIZE];
+static unsigned int elf_parse_cache_next;
+static pthread_mutex_t elf_parse_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void elf_parms_rebase(struct elf_dom_parms *parms,
+                             elf_ptrval from, elf_ptrval to)
+{
+    unsigned i;
+
+#define REBASE(p) ((p) ? (p) - from + to : 0)
+    parms->guest_info = REBASE(parms->guest_info);
+    parms->elf_note_start = REBASE(parms->elf_note_start);
+    parms->elf_note_end = REBASE(parms->elf_note_end);
+    for ( i = 0; i <= XEN_ELFNOTE_MAX; i++ )
+        if ( parms->elf_notes[i].type == XEN_ENT_STR )
+            parms->elf_notes[i].data.str =
+                (const char *)REBASE((elf_ptrval)parms->elf_notes[i].data.str);
+#undef REBASE
+}
+
+static size_t elf_parse_cache_ehdr_size(struct xc_dom_image *dom)
+{
+    return dom->kernel_size < sizeof(Elf64_Ehdr) ? dom->kernel_size
+                                                 : sizeof(Elf64_Ehdr);
+}
+
+static struct elf_parse_cache_entry *
+elf_parse_cache_find(struct xc_dom_image *dom)
+{
+    struct elf_parse_cache_entry *e;
+    unsigned i;
+
+    for ( i = 0; i < ELF_PARSE_CACHE_SIZE; i++ )
+    {
+        e = &elf_parse_cache[i];
+        if ( e->valid &&
+             e->dev == dom->kernel_id.dev && e->ino == dom->kernel_id.ino &&
+             e->file_size == dom->kernel_id.size &&
+             e->mtime == dom->kernel_id.mtime &&
+             e->kernel_size == dom->kernel_size &&
+             !memcmp(e->ehdr, dom->kernel_blob,
+                     elf_parse_cache_ehdr_size(dom)) )
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Returns true if @dom has been filled in from the cache. */
+static bool elf_parse_cache_lookup(struct xc_dom_image *dom)
+{
+    struct elf_parse_cache_entry *e;
+    bool found = false;
+
+    if ( !dom->kernel_id.ino )
+        return false;
+
+    pthread_mutex_lock(&elf_parse_cache_lock);
+    e = elf_parse_cache_find(dom);
+    if ( e )
+    {
+        dom->parms = e->parms;
+        elf_parms_rebase(&dom->parms, 0, (elf_ptrval)dom->kernel_blob);
+        dom->guest_type = e->guest_type;
+        dom->kernel_seg.vstart = dom->parms.virt_kstart;
+        dom->kernel_seg.vend = e->kernel_vend;
+        dom->bsd_symtab_start = e->bsd_symtab_start;
+        found = true;
+    }
+    pthread_mutex_unlock(&elf_parse_cache_lock);
+
+    return found;
+}
+
+static void elf_parse_cache_insert(struct xc_dom_image *dom)
+{
+    struct elf_parse_cache_entry *e;
+
+    if ( !dom->kernel_id.ino )
+        return;
+
+    pthread_mutex_lock(&elf_parse_cache_lock);
+    if ( elf_parse_cache_find(dom) == NULL )
+    {
+        e = &elf_parse_cache[elf_parse_cache_next];
+        elf_parse_cache_next = (elf_parse_cache_next + 1) %
+                               ELF_PARSE_CACHE_SIZE;
+
+        memset(e, 0, sizeof(*e));
+        e->dev = dom->kernel_id.dev;
+        e->ino = dom->kernel_id.ino;
+        e->file_size = dom->kernel_id.size;
+        e->mtime = dom->kernel_id.mtime;
+        e->kernel_size = dom->kernel_size;
+        memcpy(e->ehdr, dom->kernel_blob, elf_parse_cache_ehdr_size(dom));
+        e->parms = dom->parms;
+        elf_parms_rebase(&e->parms, (elf_ptrval)dom->kernel_blob, 0);
+        e->guest_type = dom->guest_type;
+        e->kernel_vend = dom->kernel_seg.vend;
+        e->bsd_symtab_start = dom->bsd_symtab_start;
+        e->valid = true;
+    }
+    pthread_mutex_unlock(&elf_parse_cache_lock);
+}
+
+/* ------------------------------------------------------------------------ */
+
 static elf_errorstatus xc_dom_parse_elf_kernel(struct xc_dom_image *dom)
     /*
      * This function sometimes returns -1 for error and sometimes
@@ -350,6 +482,14 @@ static elf_errorstatus xc_dom_parse_elf_kernel(struct xc_dom_image *dom)
 
     /* parse binary and get xen meta info */
     elf_parse_binary(elf);
+    if ( elf_parse_cache_lookup(dom) )
+    {
+        DOMPRINTF("%s: %s: 0x%" PRIx64 " -> 0x%" PRIx64 " (cached)",
+                  __FUNCTION__, dom->guest_type,
+                  dom->kernel_seg.vstart, dom->kernel_seg.vend);
+        return 0;
+    }
+
     if ( (rc = elf_xen_parse(elf, &dom->parms)) != 0 )
     {
         goto out;
@@ -374,6 +514,8 @@ static elf_errorstatus xc_dom_parse_elf_kernel(struct xc_dom_image *dom)
     DOMPRINTF("%s: %s: 0x%" PRIx64 " -> 0x%" PRIx64 "",
               __FUNCTION__, dom->guest_type,
               dom->kernel_seg.vstart, dom->kernel_seg.vend);
+    if ( !elf_check_broken(elf) )
+        elf_parse_cache_insert(dom);
     rc = 0;
 out:
     if ( elf_check_broken(elf) )
@@ -289,6 +289,45 @@ int xc_domain_get_guest_width(xc_interface *xch, uint32_t domid,
     return 0;
 }
 
+void xc_dominfo_from_domctl(xc_dominfo_t *info,
+                            const struct xen_domctl *domctl)
+{
+    info->domid      = (uint16_t)domctl->domain;
+
+    info->dying    = !!(domctl->u.getdomaininfo.flags&XEN_DOMINF_dying);
+    info->shutdown = !!(domctl->u.getdomaininfo.flags&XEN_DOMINF_shutdown);
+    info->paused   = !!(domctl->u.getdomaininfo.flags&XEN_DOMINF_paused);
+    info->blocked  = !!(domctl->u.getdomaininfo.flags&XEN_DOMINF_blocked);
+    info->running  = !!(domctl->u.getdomaininfo.flags&XEN_DOMINF_running);
+    info->hvm      = !!(domctl->u.getdomaininfo.flags&XEN_DOMINF_hvm_guest);
+    info->debugged = !!(domctl->u.getdomaininfo.flags&XEN_DOMINF_debugged);
+
+    info->shutdown_reason =
+        (domctl->u.getdomaininfo.flags>>XEN_DOMINF_shutdownshift) &
+        XEN_DOMINF_shutdownmask;
+
+    if ( info->shutdown && (info->shutdown_reason == SHUTDOWN_crash) )
+    {
+        info->shutdown = 0;
+        info->crashed  = 1;
+    }
+
+    info->ssidref  = domctl->u.getdomaininfo.ssidref;
+    info->nr_pages = domctl->u.getdomaininfo.tot_pages;
+    info->nr_outstanding_pages = domctl->u.getdomaininfo.outstanding_pages;
+    info->nr_shared_pages = domctl->u.getdomaininfo.shr_pages;
+    info->nr_paged_pages = domctl->u.getdomaininfo.paged_pages;
+    info->max_memkb = domctl->u.getdomaininfo.max_pages << (PAGE_SHIFT-10);
+    info->shared_info_frame = domctl->u.getdomaininfo.shared_info_frame;
+    info->cpu_time = domctl->u.getdomaininfo.cpu_time;
+    info->nr_online_vcpus = domctl->u.getdomaininfo.nr_online_vcpus;
+    info->max_vcpu_id = domctl->u.getdomaininfo.max_vcpu_id;
+    info->cpupool = domctl->u.getdomaininfo.cpupool;
+
+    memcpy(info->handle, domctl->u.getdomaininfo.handle,
+           sizeof(xen_domain_handle_t));
+}
+
 int xc_domain_getinfo(xc_interface *xch,
                       uint32_t first_domid,
                       unsigned int max_doms,
@@ -307,40 +346,7 @@ int xc_domain_getinfo(xc_interface *xch,
         domctl.domain = (domid_t)next_domid;
         if ( (rc = do_domctl(xch, &domctl)) < 0 )
             break;
-        info->domid      = (uint16_t)domctl.domain;
-
-        info->dying    = !!(domctl.u.getdomaininfo.flags&XEN_DOMINF_dying);
-        info->shutdown = !!(domctl.u.getdomaininfo.flags&XEN_DOMINF_shutdown);
-        info->paused   = !!(domctl.u.getdomaininfo.flags&XEN_DOMINF_paused);
-        info->blocked  = !!(domctl.u.getdomaininfo.flags&XEN_DOMINF_blocked);
-        info->running  = !!(domctl.u.getdomaininfo.flags&XEN_DOMINF_running);
-        info->hvm      = !!(domctl.u.getdomaininfo.flags&XEN_DOMINF_hvm_guest);
-        info->debugged = !!(domctl.u.getdomaininfo.flags&XEN_DOMINF_debugged);
-
-        info->shutdown_reason =
-            (domctl.u.getdomaininfo.flags>>XEN_DOMINF_shutdownshift) &
-            XEN_DOMINF_shutdownmask;
-
-        if ( info->shutdown && (info->shutdown_reason == SHUTDOWN_crash) )
-        {
-            info->shutdown = 0;
-            info->crashed  = 1;
-        }
-
-        info->ssidref  = domctl.u.getdomaininfo.ssidref;
-        info->nr_pages = domctl.u.getdomaininfo.tot_pages;
-        info->nr_outstanding_pages = domctl.u.getdomaininfo.outstanding_pages;
-        info->nr_shared_pages = domctl.u.getdomaininfo.shr_pages;
-        info->nr_paged_pages = domctl.u.getdomaininfo.paged_pages;
-        info->max_memkb = domctl.u.getdomaininfo.max_pages << (PAGE_SHIFT-10);
-        info->shared_info_frame = domctl.u.getdomaininfo.shared_info_frame;
-        info->cpu_time = domctl.u.getdomaininfo.cpu_time;
-        info->nr_online_vcpus = domctl.u.getdomaininfo.nr_online_vcpus;
-        info->max_vcpu_id = domctl.u.getdomaininfo.max_vcpu_id;
-        info->cpupool = domctl.u.getdomaininfo.cpupool;
-
-        memcpy(info->handle, domctl.u.getdomaininfo.handle,
-               sizeof(xen_domain_handle_t));
+        xc_dominfo_from_domctl(info, &domctl);
 
         next_domid = (uint16_t)domctl.domain + 1;
         info++;
@@ -379,6 +385,48 @@ int xc_domain_getinfolist(xc_interface *xch,
     return ret;
 }
 
+int xc_domain_changes(xc_interface *xch, uint64_t since,
+                      unsigned int max_domains, xc_domaininfo_t *info,
+                      unsigned int max_gone, uint16_t *gone,
+                      xc_domain_changes_t *changes)
+{
+    int ret = 0;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(info, max_domains*sizeof(*info), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    DECLARE_HYPERCALL_BOUNCE(gone, max_gone*sizeof(*gone), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, info) )
+        return -1;
+    if ( xc_hypercall_bounce_pre(xch, gone) )
+    {
+        xc_hypercall_bounce_post(xch, info);
+        return -1;
+    }
+
+    sysctl.cmd = XEN_SYSCTL_domain_changes;
+    sysctl.u.domain_changes.since = since;
+    sysctl.u.domain_changes.max_domains = max_domains;
+    sysctl.u.domain_changes.max_gone = max_gone;
+    set_xen_guest_handle(sysctl.u.domain_changes.buffer, info);
+    set_xen_guest_handle(sysctl.u.domain_changes.gone, gone);
+
+    if ( xc_sysctl(xch, &sysctl) < 0 )
+        ret = -1;
+    else
+    {
+        changes->generation = sysctl.u.domain_changes.generation;
+        changes->num_domains = sysctl.u.domain_changes.num_domains;
+        changes->num_gone = sysctl.u.domain_changes.num_gone;
+        changes->all = !!(sysctl.u.domain_changes.flags &
+                          XEN_SYSCTL_DOMAIN_CHANGES_all);
+    }
+
+    xc_hypercall_bounce_post(xch, info);
+    xc_hypercall_bounce_post(xch, gone);
+
+    return ret;
+}
+
 /* set broken page p2m */
 int xc_set_broken_page_p2m(xc_interface *xch,
                            uint32_t domid,
@@ -565,6 +613,49 @@ int xc_shadow_control(xc_interface *xch,
     return (rc == 0) ? domctl.u.shadow_op.pages : rc;
 }
 
+int xc_logdirty_ring_enable(xc_interface *xch,
+                            uint32_t domid,
+                            unsigned long entries)
+{
+    DECLARE_DOMCTL;
+
+    memset(&domctl, 0, sizeof(domctl));
+
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = (domid_t)domid;
+    domctl.u.shadow_op.op    = XEN_DOMCTL_SHADOW_OP_RING_ENABLE;
+    domctl.u.shadow_op.pages = entries;
+
+    return do_domctl(xch, &domctl);
+}
+
+int xc_logdirty_ring_drain(xc_interface *xch,
+                           uint32_t domid,
+                           xc_hypercall_buffer_t *pfns,
+                           unsigned long entries,
+                           xc_shadow_op_stats_t *stats)
+{
+    int rc;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(pfns);
+
+    memset(&domctl, 0, sizeof(domctl));
+
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = (domid_t)domid;
+    domctl.u.shadow_op.op    = XEN_DOMCTL_SHADOW_OP_RING_DRAIN;
+    domctl.u.shadow_op.pages = entries;
+    set_xen_guest_handle(domctl.u.shadow_op.dirty_ring, pfns);
+
+    rc = do_domctl(xch, &domctl);
+
+    if ( stats )
+        memcpy(stats, &domctl.u.shadow_op.stats,
+               sizeof(xc_shadow_op_stats_t));
+
+    return (rc == 0) ? domctl.u.shadow_op.pages : rc;
+}
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         unsigned int max_memkb)
@@ -1755,6 +1846,78 @@ int xc_domain_set_access_required(xc_interface *xch,
     return do_domctl(xch, &domctl);
 }
 
+int xc_domain_harvest_accessed(xc_interface *xch,
+                               uint32_t domid,
+                               unsigned long start_pfn,
+                               unsigned long nr_pfns,
+                               unsigned long *bitmap)
+{
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(bitmap, (nr_pfns + 7) / 8,
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    unsigned long done = 0;
+    int ret = 0;
+
+    if ( xc_hypercall_bounce_pre(xch, bitmap) )
+        return -1;
+
+    /* Xen may stop early (on a byte boundary) to allow preemption. */
+    while ( done < nr_pfns )
+    {
+        domctl.cmd = XEN_DOMCTL_harvest_accessed;
+        domctl.domain = (domid_t)domid;
+        domctl.u.harvest_accessed.start_pfn = start_pfn + done;
+        domctl.u.harvest_accessed.nr_pfns = nr_pfns - done;
+        set_xen_guest_handle_raw(domctl.u.harvest_accessed.bitmap,
+            (uint8_t *)HYPERCALL_BUFFER_AS_ARG(bitmap) + done / 8);
+
+        ret = do_domctl(xch, &domctl);
+        if ( ret < 0 )
+            break;
+        done += domctl.u.harvest_accessed.nr_pfns;
+    }
+
+    xc_hypercall_bounce_post(xch, bitmap);
+
+    return ret < 0 ? -1 : 0;
+}
+
+int xc_domain_migrate_memory(xc_interface *xch,
+                             uint32_t domid,
+                             unsigned int node,
+                             unsigned long start_pfn,
+                             unsigned long *nr_pfns,
+                             unsigned long max_migrate,
+                             unsigned long *nr_migrated)
+{
+    DECLARE_DOMCTL;
+    unsigned long done = 0, moved = 0;
+    int ret = 0;
+
+    /* Xen may stop early to allow preemption. */
+    while ( done < *nr_pfns && (!max_migrate || moved < max_migrate) )
+    {
+        domctl.cmd = XEN_DOMCTL_migrate_memory;
+        domctl.domain = (domid_t)domid;
+        domctl.u.migrate_memory.node = node;
+        domctl.u.migrate_memory.start_pfn = start_pfn + done;
+        domctl.u.migrate_memory.nr_pfns = *nr_pfns - done;
+        domctl.u.migrate_memory.max_migrate =
+            max_migrate ? max_migrate - moved : 0;
+
+        ret = do_domctl(xch, &domctl);
+        if ( ret < 0 )
+            break;
+        done += domctl.u.migrate_memory.nr_pfns;
+        moved += domctl.u.migrate_memory.nr_migrated;
+    }
+
+    *nr_pfns = done;
+    *nr_migrated = moved;
+
+    return ret < 0 ? -1 : 0;
+}
+
 int xc_domain_set_virq_handler(xc_interface *xch, uint32_t domid, int virq)
 {
     DECLARE_DOMCTL;
@@ -0,0 +1,253 @@
+/******************************************************************************
+ * xc_domain_clone.c
+ *
+ * Clone a paused HVM domain into a new, empty one.  The clone's memory is
+ * the parent's, shared copy-on-write through mem_sharing, so it costs
+ * next to nothing until the clone writes to it, and the clone carries on
+ * from where the parent was paused.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "xc_private.h"
+#include "xg_private.h"
+#include "xenguest.h"
+
+#include <xen/hvm/params.h>
+
+/* Parameters the clone inherits, in the order they have to be set */
+static const int clone_params[] = {
+    HVM_PARAM_CALLBACK_IRQ, HVM_PARAM_PAE_ENABLED, HVM_PARAM_VIRIDIAN,
+    HVM_PARAM_TIMER_MODE, HVM_PARAM_HPET_ENABLED, HVM_PARAM_IDENT_PT,
+    HVM_PARAM_VM86_TSS, HVM_PARAM_VPT_ALIGN, HVM_PARAM_ACPI_IOPORTS_LOCATION,
+    HVM_PARAM_NESTEDHVM, HVM_PARAM_TRIPLE_FAULT_REASON,
+    HVM_PARAM_BUFIOREQ_NR_PAGES, HVM_PARAM_IOREQ_PFN, HVM_PARAM_BUFIOREQ_PFN,
+    HVM_PARAM_STORE_PFN, HVM_PARAM_CONSOLE_PFN,
+};
+#define NR_CLONE_PARAMS (sizeof(clone_params) / sizeof(clone_params[0]))
+
+/*
+ * Give the clone its own copy of a page, for the pages it shares with its
+ * device model, xenstored and xenconsoled rather than with its parent.
+ */
+static int clone_private_page(xc_interface *xch, uint32_t parent,
+                              uint32_t clone, xen_pfn_t pfn)
+{
+    void *src = NULL, *dst = NULL;
+    int rc = -1;
+
+    if ( xc_domain_populate_physmap_exact(xch, clone, 1, 0, 0, &pfn) )
+    {
+        PERROR("Could not populate pfn %#"PRI_xen_pfn" of the clone", pfn);
+        return -1;
+    }
+
+    src = xc_map_foreign_range(xch, parent, PAGE_SIZE, PROT_READ, pfn);
+    dst = xc_map_foreign_range(xch, clone, PAGE_SIZE, PROT_WRITE, pfn);
+    if ( !src || !dst )
+    {
+        PERROR("Could not map pfn %#"PRI_xen_pfn, pfn);
+        goto out;
+    }
+    memcpy(dst, src, PAGE_SIZE);
+    rc = 0;
+
+ out:
+    if ( src )
+        munmap(src, PAGE_SIZE);
+    if ( dst )
+        munmap(dst, PAGE_SIZE);
+    return rc;
+}
+
+int xc_domain_clone(xc_interface *xch, uint32_t parent, uint32_t clone,
+                    unsigned int store_evtchn, unsigned long *store_pfn,
+                    unsigned int console_evtchn, unsigned long *console_pfn)
+{
+    xc_dominfo_t pinfo, cinfo;
+    unsigned long params[NR_CLONE_PARAMS], nr_bufioreq = 1;
+    uint32_t tsc_mode, gtsc_khz, incarnation;
+    uint64_t elapsed_nsec, nr_shared;
+    uint8_t *hvm_buf = NULL;
+    unsigned int i;
+    int hvm_len, max_gpfn;
+    int rc = -1;
+
+    if ( xc_domain_getinfo(xch, parent, 1, &pinfo) != 1 ||
+         pinfo.domid != parent ||
+         xc_domain_getinfo(xch, clone, 1, &cinfo) != 1 ||
+         cinfo.domid != clone )
+    {
+        PERROR("Could not get domain info");
+        return -1;
+    }
+    if ( !pinfo.hvm || !cinfo.hvm )
+    {
+        ERROR("Only HVM domains can be cloned");
+        errno = EINVAL;
+        return -1;
+    }
+    if ( !pinfo.paused )
+    {
+        ERROR("Domain %u must be paused to be cloned", parent);
+        errno = EBUSY;
+        return -1;
+    }
+    if ( cinfo.max_vcpu_id < pinfo.max_vcpu_id )
+    {
+        ERROR("Clone has %u vcpus, needs %u", cinfo.max_vcpu_id + 1,
+              pinfo.max_vcpu_id + 1);
+        errno = EINVAL;
+        return -1;
+    }
+
+    max_gpfn = xc_domain_maximum_gpfn(xch, parent);
+    if ( max_gpfn < 0 )
+    {
+        PERROR("Could not get the maximum gpfn of domain %u", parent);
+        return -1;
+    }
+
+    for ( i = 0; i < NR_CLONE_PARAMS; i++ )
+    {
+        if ( xc_get_hvm_param(xch, parent, clone_params[i], &params[i]) )
+        {
+            PERROR("Could not get HVM parameter %d", clone_params[i]);
+            return -1;
+        }
+        if ( clone_params[i] == HVM_PARAM_BUFIOREQ_NR_PAGES && params[i] )
+            nr_bufioreq = params[i];
+    }
+
+    if ( xc_domain_setmaxmem(xch, clone, pinfo.max_memkb) )
+    {
+        PERROR("Could not set the clone's maximum memory");
+        return -1;
+    }
+
+    if ( xc_memshr_control(xch, parent, 1) ||
+         xc_memshr_control(xch, clone, 1) )
+    {
+        PERROR("Could not enable memory sharing");
+        return -1;
+    }
+
+    /*
+     * Private pages first, so that sharing passes them by: they are holes
+     * in the clone no longer.
+     */
+    for ( i = 0; i < NR_CLONE_PARAMS; i++ )
+    {
+        unsigned long n, nr = 0;
+
+        switch ( clone_params[i] )
+        {
+        case HVM_PARAM_IOREQ_PFN:
+        case HVM_PARAM_STORE_PFN:
+        case HVM_PARAM_CONSOLE_PFN:
+            nr = 1;
+            break;
+        case HVM_PARAM_BUFIOREQ_PFN:
+            nr = nr_bufioreq;
+            break;
+        }
+        for ( n = 0; params[i] && n < nr; n++ )
+            if ( clone_private_page(xch, parent, clone, params[i] + n) )
+                return -1;
+    }
+
+    if ( xc_memshr_fork_range(xch, parent, clone, 0, max_gpfn, &nr_shared) )
+    {
+        PERROR("Could not share memory of domain %u", parent);
+        return -1;
+    }
+    DPRINTF("Cloned domain %u into %u, %"PRIu64" pages shared\n",
+            parent, clone, nr_shared);
+
+    for ( i = 0; i < NR_CLONE_PARAMS; i++ )
+    {
+        if ( params[i] &&
+             xc_set_hvm_param(xch, clone, clone_params[i], params[i]) )
+        {
+            PERROR("Could not set HVM parameter %d", clone_params[i]);
+            return -1;
+        }
+        if ( clone_params[i] == HVM_PARAM_STORE_PFN )
+            *store_pfn = params[i];
+        else if ( clone_params[i] == HVM_PARAM_CONSOLE_PFN )
+            *console_pfn = params[i];
+    }
+
+    if ( xc_set_hvm_param(xch, clone, HVM_PARAM_STORE_EVTCHN, store_evtchn) ||
+         xc_set_hvm_param(xch, clone, HVM_PARAM_CONSOLE_EVTCHN,
+                          console_evtchn) )
+    {
+        PERROR("Could not set the clone's event channels");
+        return -1;
+    }
+
+    if ( xc_domain_get_tsc_info(xch, parent, &tsc_mode, &elapsed_nsec,
+                                &gtsc_khz, &incarnation) ||
+         xc_domain_set_tsc_info(xch, clone, tsc_mode, elapsed_nsec,
+                                gtsc_khz, incarnation) )
+    {
+        PERROR("Could not copy TSC information");
+        return -1;
+    }
+
+    /* Last, vcpu and platform state, with the memory in place */
+    hvm_len = xc_domain_hvm_getcontext(xch, parent, NULL, 0);
+    if ( hvm_len <= 0 )
+    {
+        PERROR("Could not get the HVM context size of domain %u", parent);
+        return -1;
+    }
+    if ( (hvm_buf = malloc(hvm_len)) == NULL )
+    {
+        PERROR("Could not allocate the HVM context buffer");
+        return -1;
+    }
+    hvm_len = xc_domain_hvm_getcontext(xch, parent, hvm_buf, hvm_len);
+    if ( hvm_len <= 0 )
+    {
+        PERROR("Could not get the HVM context of domain %u", parent);
+        goto out;
+    }
+    if ( xc_domain_hvm_setcontext(xch, clone, hvm_buf, hvm_len) )
+    {
+        PERROR("Could not set the HVM context of domain %u", clone);
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    free(hvm_buf);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
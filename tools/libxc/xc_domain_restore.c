@@ -38,9 +38,11 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
+#include "xc_bitops.h"
 #include "xc_dom.h"
 
 #include <xen/hvm/ioreq.h>
@@ -60,6 +62,16 @@ struct restore_ctx {
     int completed; /* Set when a consistent image is available */
     int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
     int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
+    const int *page_fds; /* Extra streams that page batches may come on */
+    unsigned int nr_page_fds;
+    struct page_stream *streams; /* Those in use, once announced */
+    unsigned int nr_streams;
+    uint64_t *postcopy_pfns; /* Pages to fetch after resuming the guest */
+    unsigned long nr_postcopy;
+    unsigned long *layout; /* 2M extents the sender has fully populated */
+    unsigned long *layout_1g; /* 1G extents already tried whole */
+    unsigned long nr_layout;
+    int same_host_dom; /* Guest ELIDED_SAME_HOST pages are copied from, or -1 */
     struct domain_info_context dinfo;
 };
 
@@ -157,6 +169,85 @@ static int alloc_superpage_mfns(
     }
     return 0;
 }
+/*
+** With the layout the sender gives for an HVM guest, memory is populated
+** a whole extent at a time, when the first page of an extent fully
+** populated at the sender arrives: 1G if all of its 2M extents are, else
+** 2M.  Only pages in extents with holes, or whose allocation failed, are
+** left to be populated one by one.  Returns 1 if pfn got allocated.
+*/
+#define SUPERPAGE_1GB_SHIFT  18
+#define SUPERPAGE_1GB_NR_PFNS (1UL << SUPERPAGE_1GB_SHIFT)
+
+static int layout_extent_free(struct restore_ctx *ctx, unsigned long base,
+                              unsigned long nr)
+{
+    unsigned long i;
+
+    for ( i = 0; i < nr; i++ )
+        if ( ctx->p2m[base + i] != INVALID_P2M_ENTRY )
+            return 0;
+    return 1;
+}
+
+static int alloc_layout_extent(xc_interface *xch, uint32_t dom,
+                               struct restore_ctx *ctx, unsigned long pfn)
+{
+    unsigned long sp = pfn >> SUPERPAGE_PFN_SHIFT;
+    unsigned long gb = pfn >> SUPERPAGE_1GB_SHIFT;
+    unsigned long base, nr, i;
+    unsigned int order;
+    xen_pfn_t mfn;
+
+    if ( sp >= ctx->nr_layout || !test_bit(sp, ctx->layout) )
+        return 0;
+
+    order = SUPERPAGE_PFN_SHIFT;
+    if ( !test_and_set_bit(gb, ctx->layout_1g) &&
+         ((gb + 1) << (SUPERPAGE_1GB_SHIFT - SUPERPAGE_PFN_SHIFT)) <=
+         ctx->nr_layout )
+    {
+        unsigned long first = gb << (SUPERPAGE_1GB_SHIFT - SUPERPAGE_PFN_SHIFT);
+
+        for ( i = 0; i < SUPERPAGE_1GB_NR_PFNS / SUPERPAGE_NR_PFNS; i++ )
+            if ( !test_bit(first + i, ctx->layout) )
+                break;
+        if ( i == SUPERPAGE_1GB_NR_PFNS / SUPERPAGE_NR_PFNS &&
+             layout_extent_free(ctx, gb << SUPERPAGE_1GB_SHIFT,
+                                SUPERPAGE_1GB_NR_PFNS) )
+            order = SUPERPAGE_1GB_SHIFT;
+    }
+
+    for ( ; ; )
+    {
+        nr = 1UL << order;
+        base = pfn & ~(nr - 1);
+        mfn = base;
+        if ( order == SUPERPAGE_1GB_SHIFT ||
+             layout_extent_free(ctx, base, nr) )
+        {
+            if ( !xc_domain_populate_physmap_exact(xch, dom, 1, order,
+                                                   0, &mfn) )
+                break;
+            DPRINTF("No %s page available for pfn 0x%lx\n",
+                    order == SUPERPAGE_1GB_SHIFT ? "1G" : "2M", base);
+        }
+        if ( order == SUPERPAGE_PFN_SHIFT )
+        {
+            /* Leave it to 4K pages */
+            clear_bit(sp, ctx->layout);
+            return 0;
+        }
+        order = SUPERPAGE_PFN_SHIFT;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        ctx->p2m[base + i] = mfn + i;
+    ctx->nr_pfns += nr;
+
+    return 1;
+}
+
 /*
 ** In the state file (or during transfer), all page-table pages are
 ** converted into a 'canonical' form where references to actual mfns
@@ -720,6 +811,12 @@ struct toolstack_data_t {
     uint32_t len;
 };
 
+/* A page left out of the buffer, by its index in pfn_types */
+struct elided_buf {
+    unsigned int idx;
+    uint64_t src;
+};
+
 typedef struct {
     void* pages;
     /* pages is of length nr_physpages, pfn_types is of length nr_pages */
@@ -732,6 +829,12 @@ typedef struct {
     /* Types of the pfns in the current region */
     unsigned long* pfn_types;
 
+    /* Pages left out of the region, and listed for the next batch */
+    struct elided_buf *elided;
+    unsigned int nr_elided;
+    struct xc_elided_page *elide_next;
+    unsigned int nr_elide_next;
+
     int verify;
 
     int new_ctxt_format;
@@ -770,6 +873,362 @@ static void pagebuf_free(pagebuf_t* buf)
         free(buf->pfn_types);
         buf->pfn_types = NULL;
     }
+    free(buf->elided);
+    buf->elided = NULL;
+    free(buf->elide_next);
+    buf->elide_next = NULL;
+    buf->nr_elided = buf->nr_elide_next = 0;
+}
+
+/*
+ * Match the pages listed as left out of the batch just added at first
+ * against its allocate-only pages, which they must be among, in order.
+ */
+static int pagebuf_elide(xc_interface *xch, pagebuf_t *buf, unsigned int first)
+{
+    unsigned int i, n = 0;
+    void *ptmp;
+
+    if ( !buf->nr_elide_next )
+        return 0;
+
+    ptmp = realloc(buf->elided, (buf->nr_elided + buf->nr_elide_next) *
+                   sizeof(*buf->elided));
+    if ( !ptmp )
+    {
+        ERROR("Could not reallocate elided page buffer");
+        return -1;
+    }
+    buf->elided = ptmp;
+
+    for ( i = first; i < buf->nr_pages && n < buf->nr_elide_next; i++ )
+    {
+        if ( (buf->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+             XEN_DOMCTL_PFINFO_XALLOC ||
+             (buf->pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+             buf->elide_next[n].pfn )
+            continue;
+        buf->elided[buf->nr_elided].idx = i;
+        buf->elided[buf->nr_elided++].src = buf->elide_next[n++].src;
+    }
+
+    if ( n != buf->nr_elide_next )
+    {
+        ERROR("Elided page pfn %llx not in its batch",
+              (unsigned long long)buf->elide_next[n].pfn);
+        errno = EINVAL;
+        return -1;
+    }
+    buf->nr_elide_next = 0;
+
+    return 0;
+}
+
+/*
+ * Page streams.  Each has a thread reading batches off it ahead of the
+ * main loop, which takes them in the order the main stream refers to
+ * them, so the streams are received in parallel.
+ */
+#define PAGE_STREAM_DEPTH 4
+
+struct stream_batch {
+    int count, countpages;
+    unsigned long *pfn_types;
+    void *pages;
+};
+
+struct page_stream {
+    xc_interface *xch;
+    int fd;
+    pthread_t thread;
+    int started;
+
+    /* Everything below is protected by lock. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct stream_batch q[PAGE_STREAM_DEPTH];
+    unsigned int head, nr;
+    int eof, err, stop;
+};
+
+/* Read one batch into sb.  Returns its count, 0 at the end, -1 on error. */
+static int page_stream_read(struct page_stream *ps, struct stream_batch *sb)
+{
+    xc_interface *xch = ps->xch;
+    int count, countpages, i, rc;
+    void *ptmp;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    rc = read_exact(ps->fd, &count, sizeof(count));
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if ( rc )
+    {
+        PERROR("Error when reading batch size from page stream");
+        return -1;
+    }
+    if ( !count )
+        return 0;
+    if ( (count > MAX_BATCH_SIZE) || (count < 0) )
+    {
+        ERROR("Max batch size exceeded (%d) on page stream", count);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if ( !(ptmp = realloc(sb->pfn_types, count * sizeof(*sb->pfn_types))) )
+    {
+        ERROR("Could not allocate PFN type buffer");
+        return -1;
+    }
+    sb->pfn_types = ptmp;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    rc = read_exact(ps->fd, sb->pfn_types, count * sizeof(*sb->pfn_types));
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if ( rc )
+    {
+        PERROR("Error when reading region pfn types from page stream");
+        return -1;
+    }
+
+    countpages = count;
+    for ( i = 0; i < count; i++ )
+    {
+        unsigned long pagetype = sb->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB ||
+             pagetype == XEN_DOMCTL_PFINFO_BROKEN ||
+             pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            --countpages;
+    }
+
+    if ( countpages )
+    {
+        if ( !(ptmp = realloc(sb->pages, countpages * PAGE_SIZE)) )
+        {
+            ERROR("Could not allocate page buffer");
+            return -1;
+        }
+        sb->pages = ptmp;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        rc = read_exact(ps->fd, sb->pages, countpages * PAGE_SIZE);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if ( rc )
+        {
+            PERROR("Error when reading pages from page stream");
+            return -1;
+        }
+    }
+
+    sb->count = count;
+    sb->countpages = countpages;
+    return count;
+}
+
+static void *page_stream_reader(void *arg)
+{
+    struct page_stream *ps = arg;
+    struct stream_batch *sb;
+    int rc;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&ps->lock);
+        while ( ps->nr == PAGE_STREAM_DEPTH && !ps->stop )
+            pthread_cond_wait(&ps->cond, &ps->lock);
+        sb = &ps->q[(ps->head + ps->nr) % PAGE_STREAM_DEPTH];
+        rc = ps->stop ? 0 : 1;
+        pthread_mutex_unlock(&ps->lock);
+
+        if ( rc )
+            rc = page_stream_read(ps, sb);
+
+        pthread_mutex_lock(&ps->lock);
+        if ( rc > 0 )
+            ps->nr++;
+        else if ( rc == 0 )
+            ps->eof = 1;
+        else
+            ps->err = 1;
+        pthread_cond_broadcast(&ps->cond);
+        pthread_mutex_unlock(&ps->lock);
+
+        if ( rc <= 0 )
+            break;
+    }
+
+    return NULL;
+}
+
+static void page_streams_stop(struct restore_ctx *ctx)
+{
+    unsigned int i, j;
+
+    if ( !ctx->streams )
+        return;
+
+    for ( i = 0; i < ctx->nr_streams; i++ )
+    {
+        struct page_stream *ps = &ctx->streams[i];
+
+        if ( ps->started )
+        {
+            pthread_mutex_lock(&ps->lock);
+            ps->stop = 1;
+            pthread_cond_broadcast(&ps->cond);
+            pthread_mutex_unlock(&ps->lock);
+            /* It may be blocked reading from a sender that has gone away. */
+            pthread_cancel(ps->thread);
+            pthread_join(ps->thread, NULL);
+        }
+        for ( j = 0; j < PAGE_STREAM_DEPTH; j++ )
+        {
+            free(ps->q[j].pfn_types);
+            free(ps->q[j].pages);
+        }
+        pthread_cond_destroy(&ps->cond);
+        pthread_mutex_destroy(&ps->lock);
+    }
+
+    free(ctx->streams);
+    ctx->streams = NULL;
+    ctx->nr_streams = 0;
+}
+
+static int page_streams_start(xc_interface *xch, struct restore_ctx *ctx,
+                              uint32_t nr)
+{
+    unsigned int i;
+
+    if ( ctx->streams )
+    {
+        ERROR("Page streams announced twice");
+        return -1;
+    }
+    if ( nr > ctx->nr_page_fds || nr > MAX_PAGE_STREAMS )
+    {
+        ERROR("Sender uses %u page streams, only %u provided",
+              nr, ctx->nr_page_fds);
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->streams = calloc(nr, sizeof(*ctx->streams));
+    if ( !ctx->streams )
+    {
+        ERROR("Could not allocate page streams");
+        return -1;
+    }
+    ctx->nr_streams = nr;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct page_stream *ps = &ctx->streams[i];
+
+        ps->xch = xch;
+        ps->fd = ctx->page_fds[i];
+        pthread_mutex_init(&ps->lock, NULL);
+        pthread_cond_init(&ps->cond, NULL);
+        if ( pthread_create(&ps->thread, NULL, page_stream_reader, ps) )
+        {
+            PERROR("Could not start page stream reader");
+            return -1;
+        }
+        ps->started = 1;
+    }
+
+    DPRINTF("Receiving page batches on %u extra streams\n", nr);
+    return 0;
+}
+
+static void unlock_mutex(void *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+/* Take the next batch off page stream s, into buf. */
+static int pagebuf_get_stream(xc_interface *xch, struct restore_ctx *ctx,
+                              pagebuf_t *buf, uint32_t s)
+{
+    struct page_stream *ps;
+    struct stream_batch *sb;
+    void *ptmp;
+    int count;
+
+    if ( s >= ctx->nr_streams )
+    {
+        ERROR("Batch on page stream %u, of %u", s, ctx->nr_streams);
+        errno = EINVAL;
+        return -1;
+    }
+    ps = &ctx->streams[s];
+
+    /* The read-ahead thread may be cancelled while it waits here. */
+    pthread_mutex_lock(&ps->lock);
+    pthread_cleanup_push(unlock_mutex, &ps->lock);
+    while ( !ps->nr && !ps->eof && !ps->err )
+        pthread_cond_wait(&ps->cond, &ps->lock);
+    sb = ps->nr ? &ps->q[ps->head] : NULL;
+    pthread_cleanup_pop(1);
+
+    if ( !sb )
+    {
+        ERROR("Page stream %u ended early", s);
+        return -1;
+    }
+
+    if ( !buf->nr_pages && !buf->nr_physpages )
+    {
+        /* The usual case: just trade buffers. */
+        ptmp = buf->pfn_types;
+        buf->pfn_types = sb->pfn_types;
+        sb->pfn_types = ptmp;
+        ptmp = buf->pages;
+        buf->pages = sb->pages;
+        sb->pages = ptmp;
+    }
+    else
+    {
+        if ( !(ptmp = realloc(buf->pfn_types, (buf->nr_pages + sb->count) *
+                              sizeof(*buf->pfn_types))) )
+        {
+            ERROR("Could not reallocate PFN type buffer");
+            return -1;
+        }
+        buf->pfn_types = ptmp;
+        memcpy(buf->pfn_types + buf->nr_pages, sb->pfn_types,
+               sb->count * sizeof(*buf->pfn_types));
+
+        if ( sb->countpages )
+        {
+            if ( !(ptmp = realloc(buf->pages, (buf->nr_physpages +
+                                               sb->countpages) * PAGE_SIZE)) )
+            {
+                ERROR("Could not reallocate page buffer");
+                return -1;
+            }
+            buf->pages = ptmp;
+            memcpy(buf->pages + buf->nr_physpages * PAGE_SIZE, sb->pages,
+                   sb->countpages * PAGE_SIZE);
+        }
+    }
+    buf->nr_pages += sb->count;
+    buf->nr_physpages += sb->countpages;
+    count = sb->count;
+
+    pthread_mutex_lock(&ps->lock);
+    ps->head = (ps->head + 1) % PAGE_STREAM_DEPTH;
+    ps->nr--;
+    pthread_cond_broadcast(&ps->cond);
+    pthread_mutex_unlock(&ps->lock);
+
+    if ( pagebuf_elide(xch, buf, buf->nr_pages - count) )
+        return -1;
+
+    return count;
 }
 
 static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
@@ -985,6 +1444,56 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         }
         return compbuf_size;
 
+    case XC_SAVE_ID_COMPRESSED_PACKED:
+    {
+        unsigned long packed_size;
+        char *packed;
+        int err;
+
+        if ( RDEXACT(fd, &packed_size, sizeof(packed_size)) ||
+             RDEXACT(fd, &compbuf_size, sizeof(compbuf_size)) )
+        {
+            PERROR("Error when reading packed chunk sizes");
+            return -1;
+        }
+        /* LZ4 can't expand more than 255 times */
+        if ( !compbuf_size || !packed_size ||
+             compbuf_size / 256 > packed_size )
+        {
+            ERROR("Bad packed chunk size %lu to %lu",
+                  packed_size, compbuf_size);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ( !(packed = malloc(packed_size)) )
+        {
+            ERROR("Could not allocate packed chunk buffer");
+            return -1;
+        }
+        if ( RDEXACT(fd, packed, packed_size) )
+        {
+            PERROR("Error when reading packed chunk");
+            free(packed);
+            return -1;
+        }
+
+        buf->compbuf_size += compbuf_size;
+        if (!(ptmp = realloc(buf->pages, buf->compbuf_size))) {
+            ERROR("Could not (re)allocate compression buffer");
+            free(packed);
+            return -1;
+        }
+        buf->pages = ptmp;
+
+        err = xc_compression_unpack(xch, packed, packed_size,
+                                    buf->pages + (buf->compbuf_size -
+                                                  compbuf_size),
+                                    compbuf_size);
+        free(packed);
+        return err ? -1 : compbuf_size;
+    }
+
     case XC_SAVE_ID_HVM_GENERATION_ID_ADDR:
         /* Skip padding 4 bytes then read the generation id buffer location. */
         if ( RDEXACT(fd, &buf->vm_generationid_addr, sizeof(uint32_t)) ||
@@ -996,6 +1505,147 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         DPRINTF("read generation id buffer address");
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
+    case XC_SAVE_ID_PAGE_STREAMS:
+    {
+        uint32_t nr;
+
+        if ( RDEXACT(fd, &nr, sizeof(nr)) )
+        {
+            PERROR("error reading the number of page streams");
+            return -1;
+        }
+        if ( page_streams_start(xch, ctx, nr) )
+            return -1;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+    }
+
+    case XC_SAVE_ID_STREAM_BATCH:
+    {
+        uint32_t stream;
+
+        if ( RDEXACT(fd, &stream, sizeof(stream)) )
+        {
+            PERROR("error reading the page stream of a batch");
+            return -1;
+        }
+        return pagebuf_get_stream(xch, ctx, buf, stream);
+    }
+
+    case XC_SAVE_ID_PFN_LAYOUT:
+    {
+        uint32_t nr;
+
+        if ( RDEXACT(fd, &nr, sizeof(nr)) )
+        {
+            PERROR("error reading the PFN layout size");
+            return -1;
+        }
+        if ( nr > (ctx->dinfo.p2m_size >> SUPERPAGE_PFN_SHIFT) )
+        {
+            ERROR("PFN layout of %u extents for %lu pages", nr,
+                  ctx->dinfo.p2m_size);
+            errno = EINVAL;
+            return -1;
+        }
+        free(ctx->layout);
+        free(ctx->layout_1g);
+        ctx->nr_layout = 0;
+        ctx->layout = bitmap_alloc(nr + 1);
+        ctx->layout_1g = bitmap_alloc(
+            (nr >> (SUPERPAGE_1GB_SHIFT - SUPERPAGE_PFN_SHIFT)) + 1);
+        if ( !ctx->layout || !ctx->layout_1g )
+        {
+            ERROR("Could not allocate PFN layout");
+            return -1;
+        }
+        if ( RDEXACT(fd, ctx->layout, (nr + 7) / 8) )
+        {
+            PERROR("error reading the PFN layout");
+            return -1;
+        }
+        ctx->nr_layout = nr;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+    }
+
+    case XC_SAVE_ID_SAME_HOST:
+    {
+        uint32_t src_dom;
+
+        if ( RDEXACT(fd, &src_dom, sizeof(src_dom)) )
+        {
+            PERROR("error reading the same host domain");
+            return -1;
+        }
+        if ( !ctx->hvm || src_dom == dom || src_dom >= DOMID_FIRST_RESERVED )
+        {
+            ERROR("Bad same host domain %u", src_dom);
+            errno = EINVAL;
+            return -1;
+        }
+        DPRINTF("Copying pages from domain %u\n", src_dom);
+        ctx->same_host_dom = src_dom;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+    }
+
+    case XC_SAVE_ID_ELIDED_PAGES:
+    {
+        uint32_t nr;
+
+        if ( RDEXACT(fd, &nr, sizeof(nr)) )
+        {
+            PERROR("error reading the number of elided pages");
+            return -1;
+        }
+        if ( nr > MAX_BATCH_SIZE )
+        {
+            ERROR("Too many elided pages (%u)", nr);
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if ( !buf->elide_next &&
+             !(buf->elide_next = malloc(MAX_BATCH_SIZE *
+                                        sizeof(*buf->elide_next))) )
+        {
+            ERROR("Could not allocate elided page buffer");
+            return -1;
+        }
+        if ( RDEXACT(fd, buf->elide_next, nr * sizeof(*buf->elide_next)) )
+        {
+            PERROR("error reading the elided pages");
+            return -1;
+        }
+        buf->nr_elide_next = nr;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+    }
+
+    case XC_SAVE_ID_POSTCOPY:
+    {
+        uint32_t nr;
+
+        if ( RDEXACT(fd, &nr, sizeof(nr)) )
+        {
+            PERROR("error reading the number of post-copy pages");
+            return -1;
+        }
+        free(ctx->postcopy_pfns);
+        ctx->nr_postcopy = 0;
+        ctx->postcopy_pfns = malloc(nr * sizeof(*ctx->postcopy_pfns));
+        if ( !ctx->postcopy_pfns )
+        {
+            ERROR("Could not allocate post-copy PFN buffer");
+            return -1;
+        }
+        if ( RDEXACT(fd, ctx->postcopy_pfns,
+                     nr * sizeof(*ctx->postcopy_pfns)) )
+        {
+            PERROR("error reading the post-copy pages");
+            return -1;
+        }
+        ctx->nr_postcopy = nr;
+        DPRINTF("%u pages left for post-copy\n", nr);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+    }
+
     default:
         if ( (count > MAX_BATCH_SIZE) || (count < 0) ) {
             ERROR("Max batch size exceeded (%d). Giving up.", count);
@@ -1023,6 +1673,8 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         PERROR("Error when reading region pfn types");
         return -1;
     }
+    if ( pagebuf_elide(xch, buf, oldcount) )
+        return -1;
 
     countpages = count;
     for (i = oldcount; i < buf->nr_pages; ++i)
@@ -1073,7 +1725,7 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
 {
     int rc;
 
-    buf->nr_physpages = buf->nr_pages = 0;
+    buf->nr_physpages = buf->nr_pages = buf->nr_elided = 0;
     buf->compbuf_pos = buf->compbuf_size = 0;
 
     do {
@@ -1086,6 +1738,325 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
     return rc;
 }
 
+/*
+ * Read-ahead.  For the first pass over memory, a thread reads batches off
+ * the stream into a ring of page buffers while the main loop applies the
+ * ones before, so waiting for the sender and writing guest memory overlap.
+ * The thread keeps a pagebuf of its own for everything else the stream
+ * says, which the main loop takes over at the end of the pages.  It stops
+ * there, never reading anything the main loop would not have.
+ *
+ * Unless allocating superpages, the main loop also populates memory for
+ * all the batches read ahead in one go, rather than a batch at a time.
+ */
+#define READAHEAD_DEPTH 4
+
+struct readahead {
+    xc_interface *xch;
+    struct restore_ctx *ctx;
+    int fd;
+    uint32_t dom;
+    pthread_t thread;
+    pagebuf_t rbuf;             /* the thread's own */
+    xen_pfn_t *pfns, *extents;  /* for populating */
+    unsigned int populated;     /* batches at the head populated */
+
+    /* Everything below is protected by lock. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pagebuf_t ring[READAHEAD_DEPTH];
+    unsigned int head, nr;
+    int eof, err, stop;
+};
+
+/* Trade the pages held by a and b, and nothing else. */
+static void pagebuf_swap_pages(pagebuf_t *a, pagebuf_t *b)
+{
+    pagebuf_t t = *a;
+
+    a->pages = b->pages;
+    a->pfn_types = b->pfn_types;
+    a->nr_physpages = b->nr_physpages;
+    a->nr_pages = b->nr_pages;
+    a->elided = b->elided;
+    a->nr_elided = b->nr_elided;
+    a->compbuf_pos = b->compbuf_pos;
+    a->compbuf_size = b->compbuf_size;
+
+    b->pages = t.pages;
+    b->pfn_types = t.pfn_types;
+    b->nr_physpages = t.nr_physpages;
+    b->nr_pages = t.nr_pages;
+    b->elided = t.elided;
+    b->nr_elided = t.nr_elided;
+    b->compbuf_pos = t.compbuf_pos;
+    b->compbuf_size = t.compbuf_size;
+}
+
+static void *readahead_reader(void *arg)
+{
+    struct readahead *ra = arg;
+    pagebuf_t *slot;
+    int rc;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&ra->lock);
+        while ( ra->nr == READAHEAD_DEPTH && !ra->stop )
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        slot = &ra->ring[(ra->head + ra->nr) % READAHEAD_DEPTH];
+        rc = ra->stop ? -1 : 1;
+        pthread_mutex_unlock(&ra->lock);
+
+        if ( rc > 0 )
+        {
+            ra->rbuf.nr_physpages = ra->rbuf.nr_pages = ra->rbuf.nr_elided = 0;
+            ra->rbuf.compbuf_pos = ra->rbuf.compbuf_size = 0;
+
+            /* It may be blocked reading from a sender that has gone away. */
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            rc = pagebuf_get_one(ra->xch, ra->ctx, &ra->rbuf, ra->fd, ra->dom);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+            if ( rc > 0 )
+            {
+                pagebuf_swap_pages(&ra->rbuf, slot);
+                slot->verify = ra->rbuf.verify;
+            }
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        if ( rc > 0 )
+            ra->nr++;
+        else if ( rc == 0 )
+            ra->eof = 1;
+        else
+            ra->err = 1;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+
+        if ( rc <= 0 )
+            break;
+    }
+
+    return NULL;
+}
+
+static struct readahead *readahead_start(xc_interface *xch,
+                                         struct restore_ctx *ctx,
+                                         int fd, uint32_t dom)
+{
+    struct readahead *ra = calloc(1, sizeof(*ra));
+
+    if ( !ra )
+        return NULL;
+
+    ra->xch = xch;
+    ra->ctx = ctx;
+    ra->fd = fd;
+    ra->dom = dom;
+    ra->pfns = malloc(READAHEAD_DEPTH * MAX_BATCH_SIZE * sizeof(*ra->pfns));
+    ra->extents = malloc(READAHEAD_DEPTH * MAX_BATCH_SIZE *
+                         sizeof(*ra->extents));
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    if ( !ra->pfns || !ra->extents ||
+         pthread_create(&ra->thread, NULL, readahead_reader, ra) )
+    {
+        free(ra->pfns);
+        free(ra->extents);
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        free(ra);
+        DPRINTF("No read-ahead, reading batches as they are applied\n");
+        return NULL;
+    }
+
+    return ra;
+}
+
+static void readahead_stop(struct readahead *ra)
+{
+    unsigned int i;
+
+    if ( !ra )
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    if ( !ra->eof && !ra->err )
+        pthread_cancel(ra->thread);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    for ( i = 0; i < READAHEAD_DEPTH; i++ )
+        pagebuf_free(&ra->ring[i]);
+    pagebuf_free(&ra->rbuf);
+    free(ra->pfns);
+    free(ra->extents);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+}
+
+/* Populate whatever the batches read ahead need, in one call. */
+static int readahead_populate(xc_interface *xch, uint32_t dom,
+                              struct restore_ctx *ctx, struct readahead *ra,
+                              unsigned int ready)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    unsigned int b, i, nr = 0;
+
+    for ( b = ra->populated; b < ready; b++ )
+    {
+        pagebuf_t *slot = &ra->ring[(ra->head + b) % READAHEAD_DEPTH];
+
+        for ( i = 0; i < slot->nr_pages; i++ )
+        {
+            unsigned long pfn = slot->pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+            if ( (slot->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) ==
+                 XEN_DOMCTL_PFINFO_XTAB || pfn >= dinfo->p2m_size ||
+                 ctx->p2m[pfn] != INVALID_P2M_ENTRY )
+                continue;
+
+            /* Mark it, so it's only taken once */
+            ctx->p2m[pfn] = INVALID_P2M_ENTRY - 1;
+            ra->pfns[nr] = ra->extents[nr] = pfn;
+            nr++;
+        }
+    }
+    ra->populated = ready;
+
+    if ( !nr )
+        return 0;
+
+    if ( xc_domain_populate_physmap_exact(xch, dom, nr, 0, 0, ra->extents) )
+    {
+        ERROR("Failed to allocate memory for %u pages", nr);
+        for ( i = 0; i < nr; i++ )
+            ctx->p2m[ra->pfns[i]] = INVALID_P2M_ENTRY;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        ctx->p2m[ra->pfns[i]] = ra->extents[i];
+    ctx->nr_pfns += nr;
+
+    return 0;
+}
+
+/*
+ * Take the next batch read ahead into buf, as pagebuf_get_one() would
+ * have read it.  At the end, buf takes over all the thread read.
+ */
+static int readahead_get(xc_interface *xch, uint32_t dom,
+                         struct restore_ctx *ctx, struct readahead *ra,
+                         pagebuf_t *buf)
+{
+    pagebuf_t *slot, t;
+    unsigned int ready;
+
+    pthread_mutex_lock(&ra->lock);
+    while ( !ra->nr && !ra->eof && !ra->err )
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    ready = ra->nr;
+    pthread_mutex_unlock(&ra->lock);
+
+    if ( !ready )
+    {
+        if ( !ra->eof )
+            return -1;
+        t = *buf;
+        *buf = ra->rbuf;
+        ra->rbuf = t;
+        return 0;
+    }
+
+    if ( !ctx->superpages &&
+         readahead_populate(xch, dom, ctx, ra, ready) )
+        return -1;
+
+    slot = &ra->ring[ra->head];
+    pagebuf_swap_pages(buf, slot);
+    buf->verify = slot->verify;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->head = (ra->head + 1) % READAHEAD_DEPTH;
+    ra->nr--;
+    if ( ra->populated )
+        ra->populated--;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    return buf->nr_pages;
+}
+
+/* Fill in a page left out of the stream, from the page it is a copy of. */
+static int fill_elided_page(xc_interface *xch, uint32_t dom,
+                            struct restore_ctx *ctx, uint64_t src, void *page)
+{
+    void *from;
+
+    /*
+     * Zero pages are cleared all the same: memory isn't scrubbed when a
+     * domain frees it, so newly populated pages may hold anything.
+     */
+    if ( src == ELIDED_ZERO )
+    {
+        memset(page, 0, PAGE_SIZE);
+        return 0;
+    }
+
+    /*
+     * The guest being saved may have ballooned the page out since.  It
+     * is dirty if so, and sent again (or as absent) in a later round.
+     */
+    if ( src & ELIDED_SAME_HOST )
+    {
+        src &= ~ELIDED_SAME_HOST;
+        if ( ctx->same_host_dom < 0 )
+        {
+            ERROR("Same host page %llx with no domain to copy it from",
+                  (unsigned long long)src);
+            return -1;
+        }
+        from = xc_map_foreign_range(xch, ctx->same_host_dom, PAGE_SIZE,
+                                    PROT_READ, src);
+        if ( from == NULL )
+        {
+            memset(page, 0, PAGE_SIZE);
+            return 0;
+        }
+        memcpy(page, from, PAGE_SIZE);
+        munmap(from, PAGE_SIZE);
+        return 0;
+    }
+
+    if ( src >= ctx->dinfo.p2m_size || ctx->p2m[src] == INVALID_P2M_ENTRY )
+    {
+        ERROR("Elided page copies absent pfn %llx", (unsigned long long)src);
+        return -1;
+    }
+
+    from = xc_map_foreign_range(xch, dom, PAGE_SIZE, PROT_READ,
+                                ctx->hvm ? src : ctx->p2m[src]);
+    if ( from == NULL )
+    {
+        PERROR("failed to map pfn %llx to copy", (unsigned long long)src);
+        return -1;
+    }
+    memcpy(page, from, PAGE_SIZE);
+    munmap(from, PAGE_SIZE);
+
+    return 0;
+}
+
 static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                        xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
                        struct xc_mmu* mmu,
@@ -1104,6 +2075,10 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     struct domain_info_context *dinfo = &ctx->dinfo;
     int* pfn_err = NULL;
     int rc = -1;
+    /* Pages of this batch left out of the stream, in order */
+    struct elided_buf *elided = pagebuf->elided, *e;
+    struct elided_buf *elided_end = elided + pagebuf->nr_elided;
+    int is_elided;
 
     unsigned long mfn, pfn, pagetype;
 
@@ -1111,6 +2086,9 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     if (j > MAX_BATCH_SIZE)
         j = MAX_BATCH_SIZE;
 
+    while ( elided < elided_end && elided->idx < curbatch )
+        elided++;
+
     /* First pass for this batch: work out how much memory to alloc, and detect superpages */
     nr_mfns = scount = 0;
     for ( i = 0; i < j; i++ )
@@ -1125,6 +2103,11 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         {
             /* Have a live PFN which hasn't had an MFN allocated */
 
+            /* Is it in an extent to allocate whole? */
+            if ( ctx->hvm && ctx->superpages && ctx->layout &&
+                 alloc_layout_extent(xch, dom, ctx, pfn) )
+                continue;
+
             /* Logic if we're in the middle of detecting a candidate superpage */
             if ( superpage_start != INVALID_P2M_ENTRY )
             {
@@ -1231,12 +2214,19 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
 
     /* Second pass for this batch: update p2m[] and region_mfn[] */
     nr_mfns = 0; 
-    for ( i = 0; i < j; i++ )
+    for ( i = 0, e = elided; i < j; i++ )
     {
         unsigned long pfn, pagetype;
         pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
         pagetype = pagebuf->pfn_types[i + curbatch] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
 
+        /* Elided pages get written after all: map them */
+        if ( e < elided_end && e->idx == i + curbatch )
+        {
+            pagetype = XEN_DOMCTL_PFINFO_NOTAB;
+            e++;
+        }
+
         if ( pagetype != XEN_DOMCTL_PFINFO_XTAB
              && ctx->p2m[pfn] == (INVALID_P2M_ENTRY-1) )
         {
@@ -1271,11 +2261,15 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         return -1;
     }
 
-    for ( i = 0, curpage = -1; i < j; i++ )
+    for ( i = 0, curpage = -1, e = elided; i < j; i++ )
     {
         pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
         pagetype = pagebuf->pfn_types[i + curbatch] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
 
+        is_elided = e < elided_end && e->idx == i + curbatch;
+        if ( is_elided )
+            pagetype = XEN_DOMCTL_PFINFO_NOTAB;
+
         if ( pagetype == XEN_DOMCTL_PFINFO_XTAB 
              || pagetype == XEN_DOMCTL_PFINFO_XALLOC)
             /* a bogus/unmapped/allocate-only page: skip it */
@@ -1299,7 +2293,8 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             goto err_mapped;
         }
 
-        ++curpage;
+        if ( !is_elided )
+            ++curpage;
 
         if ( pfn > dinfo->p2m_size )
         {
@@ -1314,8 +2309,13 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         /* In verify mode, we use a copy; otherwise we work in place */
         page = pagebuf->verify ? (void *)buf : (region_base + i*PAGE_SIZE);
 
+        if ( is_elided )
+        {
+            if ( fill_elided_page(xch, dom, ctx, (e++)->src, page) )
+                goto err_mapped;
+        }
         /* Remus - page decompression */
-        if (pagebuf->compressing)
+        else if (pagebuf->compressing)
         {
             if (xc_compression_uncompress_page(xch, pagebuf->pages,
                                                pagebuf->compbuf_size,
@@ -1417,6 +2417,27 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       int no_incr_generationid, int checkpointed_stream,
                       unsigned long *vm_generationid_addr,
                       struct restore_callbacks *callbacks)
+{
+    return xc_domain_restore_streams(xch, io_fd, NULL, 0, dom, store_evtchn,
+                                     store_mfn, store_domid, console_evtchn,
+                                     console_mfn, console_domid, hvm, pae,
+                                     superpages, no_incr_generationid,
+                                     checkpointed_stream,
+                                     vm_generationid_addr, callbacks);
+}
+
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *page_fds, unsigned int nr_page_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, domid_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_mfn,
+                              domid_t console_domid, unsigned int hvm,
+                              unsigned int pae, int superpages,
+                              int no_incr_generationid,
+                              int checkpointed_stream,
+                              unsigned long *vm_generationid_addr,
+                              struct restore_callbacks *callbacks)
 {
     DECLARE_DOMCTL;
     xc_dominfo_t info;
@@ -1464,6 +2485,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     int new_ctxt_format = 0;
 
     pagebuf_t pagebuf;
+    struct readahead *ra = NULL;
     tailbuf_t tailbuf, tmptail;
     struct toolstack_data_t tdata, tdatatmp;
     void* vcpup;
@@ -1486,7 +2508,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
     ctx->superpages = superpages;
     ctx->hvm = hvm;
+    ctx->same_host_dom = -1;
     ctx->last_checkpoint = !checkpointed_stream;
+    ctx->page_fds = page_fds;
+    ctx->nr_page_fds = nr_page_fds;
 
     ctxt = xc_hypercall_buffer_alloc(xch, ctxt, sizeof(*ctxt));
 
@@ -1602,6 +2627,9 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
      * We uncanonicalise page tables as we go.
      */
 
+    if ( !ctx->completed )
+        ra = readahead_start(xch, ctx, io_fd, dom);
+
     n = m = 0;
  loadpages:
     for ( ; ; )
@@ -1611,9 +2639,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         xc_report_progress_step(xch, n, dinfo->p2m_size);
 
         if ( !ctx->completed ) {
-            pagebuf.nr_physpages = pagebuf.nr_pages = 0;
+            pagebuf.nr_physpages = pagebuf.nr_pages = pagebuf.nr_elided = 0;
             pagebuf.compbuf_pos = pagebuf.compbuf_size = 0;
-            if ( pagebuf_get_one(xch, ctx, &pagebuf, io_fd, dom) < 0 ) {
+            if ( (ra ? readahead_get(xch, dom, ctx, ra, &pagebuf)
+                     : pagebuf_get_one(xch, ctx, &pagebuf, io_fd, dom)) < 0 ) {
                 PERROR("Error when reading batch");
                 goto out;
             }
@@ -1698,7 +2727,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             curbatch += MAX_BATCH_SIZE;
         }
 
-        pagebuf.nr_physpages = pagebuf.nr_pages = 0;
+        pagebuf.nr_physpages = pagebuf.nr_pages = pagebuf.nr_elided = 0;
         pagebuf.compbuf_pos = pagebuf.compbuf_size = 0;
 
         n += j; /* crude stats */
@@ -1715,6 +2744,9 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         }
     }
 
+    readahead_stop(ra);
+    ra = NULL;
+
     /*
      * Ensure we flush all machphys updates before potential PAE-specific
      * reallocations below.
@@ -2334,6 +3366,18 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
+    /* Fetch the pages the sender left behind, if any */
+    if ( ctx->nr_postcopy &&
+         xc_postcopy_receive(xch, io_fd, dom, ctx->postcopy_pfns,
+                             ctx->nr_postcopy, dinfo->p2m_size,
+                             callbacks ? callbacks->postcopy_resume : NULL,
+                             callbacks ? callbacks->data : NULL) )
+    {
+        ERROR("error fetching the post-copy pages");
+        rc = -1;
+        goto out;
+    }
+
     /* HVM success! */
     rc = 0;
 
@@ -2346,6 +3390,11 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     free(pfn_type);
     free(region_mfn);
     free(ctx->p2m_batch);
+    readahead_stop(ra);
+    page_streams_stop(ctx);
+    free(ctx->postcopy_pfns);
+    free(ctx->layout);
+    free(ctx->layout_1g);
     pagebuf_free(&pagebuf);
     tailbuf_free(&tailbuf);
 
@@ -24,6 +24,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 #include "xc_private.h"
@@ -43,6 +44,16 @@
 */
 #define DEF_MAX_ITERS   29   /* limit us to 30 times round loop   */
 #define DEF_MAX_FACTOR   3   /* never send more than 3x p2m_size  */
+#define DEF_MAX_DOWNTIME_MS 300 /* stop once the rest should take this */
+
+/* Post-copy: pre-copy iterations, and fewest dirty pages worth leaving */
+#define POSTCOPY_MAX_ITERS  3
+#define POSTCOPY_MIN_PAGES  1024
+
+/* Log-dirty ring sizing: a fraction of p2m_size, within bounds. */
+#define DIRTY_RING_RATIO 32
+#define DIRTY_RING_MIN   (1UL << 10)
+#define DIRTY_RING_MAX   (1UL << 18)
 
 struct save_ctx {
     unsigned long hvirt_start; /* virtual starting address of the hypervisor */
@@ -231,7 +242,9 @@ static int write_compressed(xc_interface *xch, comp_ctx *compress_ctx,
     int rc = 0;
     int header = sizeof(int) + sizeof(unsigned long);
     int marker = XC_SAVE_ID_COMPRESSED_DATA;
-    unsigned long compbuf_len = 0;
+    int pmarker = XC_SAVE_ID_COMPRESSED_PACKED;
+    unsigned long compbuf_len = 0, packed_len;
+    const char *packed;
 
     for(;;)
     {
@@ -252,19 +265,41 @@ static int write_compressed(xc_interface *xch, comp_ctx *compress_ctx,
         if (!rc)
             break;
 
-        if (outbuf_hardwrite(xch, ob, fd, &marker, sizeof(marker)) < 0)
+        /* Packing saves at least an eighth: enough for the longer header */
+        packed_len = xc_compression_pack(xch, compress_ctx,
+                                         ob->buf + ob->pos + header,
+                                         compbuf_len, &packed);
+        if (packed_len)
         {
-            PERROR("Error when writing marker (errno %d)", errno);
-            return -1;
+            if (outbuf_hardwrite(xch, ob, fd, &pmarker, sizeof(pmarker)) < 0 ||
+                outbuf_hardwrite(xch, ob, fd, &packed_len,
+                                 sizeof(packed_len)) < 0 ||
+                outbuf_hardwrite(xch, ob, fd, &compbuf_len,
+                                 sizeof(compbuf_len)) < 0)
+            {
+                PERROR("Error when writing packed header (errno %d)", errno);
+                return -1;
+            }
+            memcpy(ob->buf + ob->pos, packed, packed_len);
+            ob->pos += (size_t) packed_len;
         }
-
-        if (outbuf_hardwrite(xch, ob, fd, &compbuf_len, sizeof(compbuf_len)) < 0)
+        else
         {
-            PERROR("Error when writing compbuf_len (errno %d)", errno);
-            return -1;
-        }
+            if (outbuf_hardwrite(xch, ob, fd, &marker, sizeof(marker)) < 0)
+            {
+                PERROR("Error when writing marker (errno %d)", errno);
+                return -1;
+            }
+
+            if (outbuf_hardwrite(xch, ob, fd, &compbuf_len,
+                                 sizeof(compbuf_len)) < 0)
+            {
+                PERROR("Error when writing compbuf_len (errno %d)", errno);
+                return -1;
+            }
 
-        ob->pos += (size_t) compbuf_len;
+            ob->pos += (size_t) compbuf_len;
+        }
         if (!dobuf && outbuf_flush(xch, ob, fd) < 0)
         {
             ERROR("Error when writing compressed chunk");
@@ -355,6 +390,185 @@ static int analysis_phase(xc_interface *xch, uint32_t domid, struct save_ctx *ct
     return -1;
 }
 
+/*
+ * Convergence control.
+ *
+ * Each pre-copy iteration measures the rate pages go out at, and how many
+ * the guest dirtied meanwhile.  Pre-copy stops as soon as sending what is
+ * dirty would take no longer than the downtime target, which
+ * XG_SAVE_DOWNTIME_MS in the environment sets (default
+ * DEF_MAX_DOWNTIME_MS).  It also stops when the guest dirties pages as
+ * fast as they are sent for a couple of iterations, as more iterations
+ * would only add to the traffic.  With XCFLAGS_AUTO_CONVERGE the guest is
+ * instead slowed down, by lowering its credit scheduler cap a step at a
+ * time, until it converges or reaches the floor.  The cap is put back
+ * once the guest is suspended.
+ *
+ * max_iters and max_factor still bound the number of iterations.
+ */
+#define THROTTLE_STEP   20      /* % of the current cap taken away per step */
+#define THROTTLE_MIN    10      /* lowest cap, % of a cpu per vcpu */
+#define STALL_ITERS     2       /* iterations without progress to give up */
+
+struct converge {
+    uint64_t target_us;
+    uint64_t iter_start;
+    uint64_t rate;              /* pages/s sent, smoothed */
+    unsigned long last_dirty;
+    unsigned int stalls;
+    int throttle;               /* XCFLAGS_AUTO_CONVERGE */
+    int throttled;              /* saved holds the original parameters */
+    unsigned int nr_vcpus, cap;
+    struct xen_domctl_sched_credit saved;
+};
+
+static void converge_init(struct converge *c, uint32_t flags,
+                          unsigned int nr_vcpus)
+{
+    const char *env = getenv("XG_SAVE_DOWNTIME_MS");
+
+    memset(c, 0, sizeof(*c));
+    c->target_us = (env ? strtoul(env, NULL, 0) : DEF_MAX_DOWNTIME_MS) * 1000;
+    c->throttle = !!(flags & XCFLAGS_AUTO_CONVERGE);
+    c->nr_vcpus = nr_vcpus ? : 1;
+    c->iter_start = llgettimeofday();
+}
+
+/* Slow the guest down a step.  Returns 0 if it couldn't be any further. */
+static int converge_throttle(xc_interface *xch, uint32_t dom,
+                             struct converge *c)
+{
+    struct xen_domctl_sched_credit sdom;
+    unsigned int floor = THROTTLE_MIN * c->nr_vcpus;
+
+    if ( !c->throttled )
+    {
+        if ( xc_sched_credit_domain_get(xch, dom, &c->saved) )
+        {
+            DPRINTF("Can't throttle without the credit scheduler (%d)\n",
+                    errno);
+            c->throttle = 0;
+            return 0;
+        }
+        c->cap = c->saved.cap ? : 100 * c->nr_vcpus;
+    }
+
+    if ( c->cap <= floor )
+        return 0;
+
+    sdom = c->saved;
+    sdom.cap = c->cap * (100 - THROTTLE_STEP) / 100;
+    if ( sdom.cap < floor )
+        sdom.cap = floor;
+    if ( xc_sched_credit_domain_set(xch, dom, &sdom) )
+    {
+        PERROR("Failed to throttle the guest");
+        c->throttle = 0;
+        return 0;
+    }
+
+    c->throttled = 1;
+    c->cap = sdom.cap;
+    DPRINTF("Throttled the guest to %u%% of a cpu\n", c->cap);
+    return 1;
+}
+
+/* Put back the scheduler parameters the guest had. */
+static void converge_done(xc_interface *xch, uint32_t dom, struct converge *c)
+{
+    if ( !c->throttled )
+        return;
+    if ( xc_sched_credit_domain_set(xch, dom, &c->saved) )
+        PERROR("Failed to restore the guest's cap of %u", c->saved.cap);
+    else
+        DPRINTF("Guest cap restored to %u\n", c->saved.cap);
+    c->throttled = 0;
+}
+
+/*
+ * An iteration sending sent pages is over, and dirty pages are waiting.
+ * Returns 1 if pre-copy should stop.
+ */
+static int converge_check(xc_interface *xch, uint32_t dom,
+                          struct converge *c, unsigned long sent,
+                          unsigned long dirty)
+{
+    uint64_t now = llgettimeofday(), elapsed = now - c->iter_start;
+    uint64_t rate, downtime;
+
+    c->iter_start = now;
+    if ( !elapsed )
+        elapsed = 1;
+
+    /* Smooth out the odd slow or fast iteration */
+    rate = (uint64_t)sent * 1000000 / elapsed;
+    c->rate = c->rate ? (c->rate + rate) / 2 : rate;
+    downtime = c->rate ? (uint64_t)dirty * 1000000 / c->rate : ~0ULL;
+
+    DPRINTF("Sent %lu pages at %"PRIu64"/s, %lu dirtied at %"PRIu64"/s, "
+            "downtime %"PRIu64"ms\n", sent, rate, dirty,
+            (uint64_t)dirty * 1000000 / elapsed, downtime / 1000);
+
+    if ( downtime <= c->target_us )
+        return 1;
+
+    /* Progress means at least a tenth fewer pages left to send. */
+    if ( c->last_dirty && dirty >= c->last_dirty - c->last_dirty / 10 )
+        c->stalls++;
+    else
+        c->stalls = 0;
+    c->last_dirty = dirty;
+
+    if ( c->stalls < STALL_ITERS )
+        return 0;
+
+    c->stalls = 0;
+    if ( c->throttle && converge_throttle(xch, dom, c) )
+        return 0;
+
+    DPRINTF("Not converging\n");
+    return 1;
+}
+
+/*
+ * Fetch the pages dirtied since the previous round into to_send, from the
+ * log-dirty ring if there is one and it hasn't overflowed, else from the
+ * bitmap.
+ */
+static int clean_dirty_pages(xc_interface *xch, uint32_t domid,
+                             unsigned long p2m_size,
+                             xc_hypercall_buffer_t *to_send_hbuf,
+                             unsigned long *to_send,
+                             xc_hypercall_buffer_t *ring_hbuf,
+                             const uint64_t *ring, unsigned long ring_size,
+                             xc_shadow_op_stats_t *stats)
+{
+    int i, nr;
+
+    if ( ring )
+    {
+        nr = xc_logdirty_ring_drain(xch, domid, ring_hbuf, ring_size, stats);
+        if ( nr >= 0 )
+        {
+            memset(to_send, 0, bitmap_size(p2m_size));
+            for ( i = 0; i < nr; i++ )
+                if ( ring[i] < p2m_size )
+                    set_bit(ring[i], to_send);
+            return 0;
+        }
+        if ( errno != ENOBUFS )
+            return -1;
+        DPRINTF("Log-dirty ring overflowed, using the bitmap\n");
+    }
+
+    if ( xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                           to_send_hbuf, p2m_size,
+                           NULL, 0, stats) != p2m_size )
+        return -1;
+
+    return 0;
+}
+
 static int suspend_and_state(int (*suspend)(void*), void* data,
                              xc_interface *xch, int io_fd, int dom,
                              xc_dominfo_t *info)
@@ -697,104 +911,1014 @@ static xen_pfn_t *map_and_save_p2m_table(xc_interface *xch,
         p2m_frame_list[i/FPP] = mfn_to_pfn(p2m_frame_list[i/FPP]);
     }
 
-    if ( xc_vcpu_getcontext(xch, dom, 0, &ctxt) )
-    {
-        PERROR("Could not get vcpu context");
-        goto out;
-    }
+    if ( xc_vcpu_getcontext(xch, dom, 0, &ctxt) )
+    {
+        PERROR("Could not get vcpu context");
+        goto out;
+    }
+
+    /*
+     * Write an extended-info structure to inform the restore code that
+     * a PAE guest understands extended CR3 (PDPTs above 4GB). Turns off
+     * slow paths in the restore code.
+     */
+    {
+        unsigned long signature = ~0UL;
+        uint32_t chunk1_sz = ((dinfo->guest_width==8) 
+                              ? sizeof(ctxt.x64) 
+                              : sizeof(ctxt.x32));
+        uint32_t chunk2_sz = 0;
+        uint32_t chunk3_sz = 4;
+        uint32_t xcnt_size = 0;
+        uint32_t tot_sz;
+        DECLARE_DOMCTL;
+
+        domctl.cmd = XEN_DOMCTL_getvcpuextstate;
+        domctl.domain = dom;
+        domctl.u.vcpuextstate.vcpu = 0;
+        domctl.u.vcpuextstate.size = 0;
+        domctl.u.vcpuextstate.xfeature_mask = 0;
+        if ( xc_domctl(xch, &domctl) < 0 )
+        {
+            PERROR("No extended context for VCPU%d", i);
+            goto out;
+        }
+        xcnt_size = domctl.u.vcpuextstate.size + 2 * sizeof(uint64_t);
+
+        tot_sz = (chunk1_sz + 8) + (chunk2_sz + 8);
+        if ( domctl.u.vcpuextstate.xfeature_mask )
+            tot_sz += chunk3_sz + 8;
+
+        if ( write_exact(io_fd, &signature, sizeof(signature)) ||
+             write_exact(io_fd, &tot_sz, sizeof(tot_sz)) ||
+             write_exact(io_fd, "vcpu", 4) ||
+             write_exact(io_fd, &chunk1_sz, sizeof(chunk1_sz)) ||
+             write_exact(io_fd, &ctxt, chunk1_sz) ||
+             write_exact(io_fd, "extv", 4) ||
+             write_exact(io_fd, &chunk2_sz, sizeof(chunk2_sz)) ||
+             (domctl.u.vcpuextstate.xfeature_mask) ?
+                (write_exact(io_fd, "xcnt", 4) ||
+                write_exact(io_fd, &chunk3_sz, sizeof(chunk3_sz)) ||
+                write_exact(io_fd, &xcnt_size, 4)) :
+                0 )
+        {
+            PERROR("write: extended info");
+            goto out;
+        }
+    }
+
+    if ( write_exact(io_fd, p2m_frame_list, 
+                     P2M_FL_ENTRIES * sizeof(xen_pfn_t)) )
+    {
+        PERROR("write: p2m_frame_list");
+        goto out;
+    }
+
+    success = 1;
+
+ out:
+    
+    if ( !success && p2m )
+        munmap(p2m, P2M_FL_ENTRIES * PAGE_SIZE);
+
+    if ( live_p2m_frame_list_list )
+        munmap(live_p2m_frame_list_list, PAGE_SIZE);
+
+    if ( live_p2m_frame_list )
+        munmap(live_p2m_frame_list, P2M_FLL_ENTRIES * PAGE_SIZE);
+
+    free(p2m_frame_list_list);
+
+    free(p2m_frame_list);
+
+    return success ? p2m : NULL;
+}
+
+/*
+ * Move the pages in to_send over to postcopy, to be fetched by the
+ * receiver after it has resumed the guest, if there are enough of them to
+ * be worth it.  Pages the restore rewrites, or that its pager needs, stay
+ * behind in to_send.  Returns the number of pages moved.
+ */
+static unsigned long postcopy_split(xc_interface *xch, uint32_t dom,
+                                    unsigned long *to_send,
+                                    unsigned long *postcopy,
+                                    unsigned long p2m_size,
+                                    unsigned long vm_generationid_addr)
+{
+    static const int params[] = {
+        HVM_PARAM_IOREQ_PFN, HVM_PARAM_BUFIOREQ_PFN, HVM_PARAM_STORE_PFN,
+        HVM_PARAM_CONSOLE_PFN, HVM_PARAM_PAGING_RING_PFN,
+        HVM_PARAM_ACCESS_RING_PFN, HVM_PARAM_SHARING_RING_PFN,
+    };
+    unsigned long pfn, nr = 0;
+    int i;
+
+    for ( pfn = 0; pfn < p2m_size; pfn++ )
+        if ( test_bit(pfn, to_send) )
+            nr++;
+    if ( nr < POSTCOPY_MIN_PAGES )
+        return 0;
+
+    memcpy(postcopy, to_send, bitmap_size(p2m_size));
+    memset(to_send, 0, bitmap_size(p2m_size));
+
+    for ( i = 0; i <= sizeof(params) / sizeof(params[0]); i++ )
+    {
+        if ( i == sizeof(params) / sizeof(params[0]) )
+            pfn = vm_generationid_addr >> PAGE_SHIFT;
+        else if ( xc_get_hvm_param(xch, dom, params[i], &pfn) )
+            continue;
+
+        if ( pfn && pfn < p2m_size && test_bit(pfn, postcopy) )
+        {
+            clear_bit(pfn, postcopy);
+            set_bit(pfn, to_send);
+            nr--;
+        }
+    }
+
+    return nr;
+}
+
+/* must be done AFTER suspend_and_state() */
+static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
+{
+    int marker = XC_SAVE_ID_TSC_INFO;
+    uint32_t tsc_mode, khz, incarn;
+    uint64_t nsec;
+
+    if ( xc_domain_get_tsc_info(xch, dom, &tsc_mode,
+                                &nsec, &khz, &incarn) < 0  ||
+         write_exact(io_fd, &marker, sizeof(marker)) ||
+         write_exact(io_fd, &tsc_mode, sizeof(tsc_mode)) ||
+         write_exact(io_fd, &nsec, sizeof(nsec)) ||
+         write_exact(io_fd, &khz, sizeof(khz)) ||
+         write_exact(io_fd, &incarn, sizeof(incarn)) )
+        return -1;
+    return 0;
+}
+
+/*
+ * Tell the receiver which 2M extents of an HVM guest are fully populated,
+ * so that it can allocate them whole rather than page by page as they
+ * happen to arrive.
+ */
+static int send_pfn_layout(xc_interface *xch, uint32_t dom, int io_fd,
+                           unsigned long p2m_size)
+{
+    int marker = XC_SAVE_ID_PFN_LAYOUT;
+    uint32_t nr = p2m_size >> SUPERPAGE_PFN_SHIFT;
+    xen_pfn_t *types = NULL;
+    unsigned long *layout = NULL;
+    unsigned long pfn, i;
+    int rc = -1;
+
+    if ( !nr )
+        return 0;
+
+    types = malloc(SUPERPAGE_NR_PFNS * sizeof(*types));
+    layout = bitmap_alloc(nr);
+    if ( !types || !layout )
+    {
+        ERROR("Could not allocate PFN layout");
+        goto out;
+    }
+
+    for ( pfn = 0; pfn < (unsigned long)nr << SUPERPAGE_PFN_SHIFT;
+          pfn += SUPERPAGE_NR_PFNS )
+    {
+        for ( i = 0; i < SUPERPAGE_NR_PFNS; i++ )
+            types[i] = pfn + i;
+        if ( xc_get_pfn_type_batch(xch, dom, SUPERPAGE_NR_PFNS, types) )
+        {
+            PERROR("get_pfn_type_batch failed");
+            goto out;
+        }
+        for ( i = 0; i < SUPERPAGE_NR_PFNS; i++ )
+            if ( types[i] == XEN_DOMCTL_PFINFO_XTAB ||
+                 types[i] == XEN_DOMCTL_PFINFO_BROKEN )
+                break;
+        if ( i == SUPERPAGE_NR_PFNS )
+            set_bit(pfn >> SUPERPAGE_PFN_SHIFT, layout);
+    }
+
+    if ( write_exact(io_fd, &marker, sizeof(marker)) ||
+         write_exact(io_fd, &nr, sizeof(nr)) ||
+         write_exact(io_fd, layout, (nr + 7) / 8) )
+    {
+        PERROR("Error when writing to state file (pfn layout)");
+        goto out;
+    }
+    rc = 0;
+
+ out:
+    free(layout);
+    free(types);
+    return rc;
+}
+
+/*
+ * Page elision.
+ *
+ * Pages that are all zero aren't sent, only listed, and the receiver
+ * clears them.  Optionally, so aren't pages whose contents the receiver
+ * already holds at another pfn, found through a cache of recently sent
+ * pages indexed by a hash of their contents.  An entry only stands for as
+ * long as its pfn hasn't been sent again, as tracked by a generation
+ * count per pfn, and the contents are compared in full before relying on
+ * it.  Lookups must be made in the order pages are sent.
+ *
+ * XG_SAVE_DEDUP_PAGES in the environment sets the number of pages cached,
+ * rounded down to a power of two; 0, the default, disables the cache.
+ */
+struct dedup_entry {
+    uint64_t hash;
+    unsigned long pfn;
+    uint32_t gen;
+    int valid;
+};
+
+/* The XC_SAVE_ID_ELIDED_PAGES chunk for a batch */
+struct elided_rec {
+    int id;
+    uint32_t nr;
+    struct xc_elided_page e[MAX_BATCH_SIZE];
+};
+
+#define ELIDED_REC_LEN(r) \
+    (offsetof(struct elided_rec, e) + (r)->nr * sizeof((r)->e[0]))
+
+struct page_dedup {
+    unsigned int nr;
+    struct dedup_entry *e;
+    char *data;
+    uint32_t *gen;              /* per pfn, bumped each time it is sent */
+    unsigned long p2m_size;
+    unsigned long zero, dup;    /* pages elided */
+    unsigned long local;        /* pages left for a same host receiver */
+    int same_host;              /* XCFLAGS_SAME_HOST, for an HVM guest */
+    struct elided_rec rec;      /* for the serial loop */
+};
+
+static int page_is_zero(const void *page)
+{
+    const unsigned long *p = page;
+    unsigned int i;
+
+    /* A cache line at a time: wide ORs, and no branch per word */
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 8 )
+        if ( p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+             p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7] )
+            return 0;
+
+    return 1;
+}
+
+static uint64_t page_hash(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t h0 = 0x9e3779b97f4a7c15ULL, h1 = 0xc2b2ae3d27d4eb4fULL;
+    unsigned int i;
+
+    /* Two independent lanes, so the multiplies overlap */
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 2 )
+    {
+        h0 = (h0 ^ p[i]) * 0x100000001b3ULL;
+        h1 = (h1 ^ p[i + 1]) * 0x100000001b3ULL;
+        h0 ^= h0 >> 29;
+        h1 ^= h1 >> 31;
+    }
+
+    return h0 ^ (h1 * 0x9e3779b97f4a7c15ULL);
+}
+
+static struct page_dedup *page_dedup_init(xc_interface *xch,
+                                          unsigned long p2m_size)
+{
+    struct page_dedup *d;
+    const char *env = getenv("XG_SAVE_DEDUP_PAGES");
+    unsigned long n = env ? strtoul(env, NULL, 0) : 0;
+
+    d = calloc(1, sizeof(*d));
+    if ( !d )
+        return NULL;
+    d->p2m_size = p2m_size;
+
+    if ( n )
+    {
+        for ( d->nr = 1; d->nr <= n / 2 && d->nr < (1U << 20); d->nr <<= 1 )
+            ;
+        d->e = calloc(d->nr, sizeof(*d->e));
+        d->data = malloc((size_t)d->nr * PAGE_SIZE);
+        d->gen = calloc(p2m_size, sizeof(*d->gen));
+        if ( !d->e || !d->data || !d->gen )
+        {
+            DPRINTF("No memory for a cache of %u sent pages\n", d->nr);
+            free(d->e);
+            free(d->data);
+            free(d->gen);
+            d->e = NULL;
+            d->nr = 0;
+        }
+        else
+            DPRINTF("Caching %u sent pages to elide duplicates\n", d->nr);
+    }
+
+    return d;
+}
+
+static void page_dedup_free(struct page_dedup *d)
+{
+    if ( !d )
+        return;
+    free(d->e);
+    free(d->data);
+    free(d->gen);
+    free(d);
+}
+
+/* pfn is being sent again, whatever with: entries for it are stale. */
+static void page_dedup_sent(struct page_dedup *d, unsigned long pfn)
+{
+    if ( d->nr && pfn < d->p2m_size )
+        d->gen[pfn]++;
+}
+
+/*
+ * pfn is being sent with the contents at page, which hash to hash.
+ * Returns a pfn the receiver already has them at, or -1 having cached
+ * them under pfn.
+ */
+static long page_dedup_find(struct page_dedup *d, unsigned long pfn,
+                            const void *page, uint64_t hash)
+{
+    unsigned int i = hash & (d->nr - 1);
+    struct dedup_entry *e = &d->e[i];
+    char *data = d->data + (size_t)i * PAGE_SIZE;
+
+    page_dedup_sent(d, pfn);
+
+    if ( e->valid && e->hash == hash && e->gen == d->gen[e->pfn] &&
+         !memcmp(data, page, PAGE_SIZE) )
+        return e->pfn;
+
+    e->hash = hash;
+    e->pfn = pfn;
+    e->gen = d->gen[pfn];
+    e->valid = 1;
+    memcpy(data, page, PAGE_SIZE);
+    return -1;
+}
+
+/*
+ * Pipelined page saving.
+ *
+ * Left to itself, the main loop maps a batch, canonicalises it and writes
+ * it out before looking at the next one, so a big guest saves at whatever
+ * rate one core manages to map and copy pages, however fast the link is.
+ * With a pipeline, the main loop only picks batches.  Each one then goes
+ * through three stages, run by a small pool of threads:
+ *
+ *  - map: map the batch and get its page types;
+ *  - transform: lay the batch record out in a buffer of its own, page
+ *    tables canonicalised, and unmap it;
+ *  - write: send the record.
+ *
+ * Any thread takes work from whichever stage has some, later stages
+ * first.  Only one thread writes at a time, and batches are written in
+ * the order they were picked, so the stream is exactly what the serial
+ * loop would produce.  There is a fixed number of batches; once they are
+ * all in flight, picking the next one waits for a write to complete.
+ *
+ * The pipeline is drained at the end of every iteration, and whenever the
+ * stream is written to directly.
+ *
+ * With extra page streams, the write stage only puts a marker on the main
+ * stream, then sends the batch on stream (seq % nr_streams) in turn.  The
+ * markers are written in order and each stream takes its batches in
+ * order, but different streams are written concurrently.
+ *
+ * XG_SAVE_THREADS in the environment sets the number of threads, 0 for the
+ * serial loop.  The default is one fewer than the online cpus, up to
+ * SAVE_PIPE_MAX_THREADS.
+ */
+#define SAVE_PIPE_MAX_THREADS 16
+
+struct save_batch {
+    unsigned int seq, nr;
+    int dobuf;                  /* write through the outbuf (last_iter) */
+    xen_pfn_t pfn_type[MAX_BATCH_SIZE];
+    unsigned long pfn_batch[MAX_BATCH_SIZE];
+    int pfn_err[MAX_BATCH_SIZE];
+    /* Pages to mark XEN_DOMCTL_PFINFO_XALLOC, if valid */
+    unsigned long xalloc[MAX_BATCH_SIZE / BITS_PER_LONG];
+    void *region;
+    char *out;                  /* record: count, pfn types, pages */
+    size_t len;                 /* bytes of it to write, 0 for none */
+    unsigned int sent;          /* pages in the record */
+    /* Pages found to be zero, and hashes of the other data pages */
+    unsigned long zero[MAX_BATCH_SIZE / BITS_PER_LONG];
+    uint64_t hash[MAX_BATCH_SIZE];
+    struct elided_rec elided;
+};
+
+#define SAVE_BATCH_OUT_SIZE \
+    (sizeof(unsigned int) + MAX_BATCH_SIZE * (sizeof(unsigned long) + PAGE_SIZE))
+
+struct batch_ring {
+    struct save_batch **b;
+    unsigned int head, nr;
+};
+
+struct save_pipe {
+    xc_interface *xch;
+    uint32_t dom;
+    int io_fd, hvm, live;
+    struct save_ctx *ctx;
+    struct outbuf *ob;
+    struct page_dedup *dedup;   /* used by the write stage only */
+
+    unsigned int nr_threads, depth;
+    pthread_t threads[SAVE_PIPE_MAX_THREADS];
+    struct save_batch *batches;
+
+    const int *page_fds;
+    unsigned int nr_streams;
+
+    /* Everything below is protected by lock. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct batch_ring free, map, xform;
+    struct save_batch **done;   /* transformed, indexed by seq % depth */
+    unsigned int submitted, next_write, completed;
+    unsigned int *stream_next;  /* seq of each stream's next batch */
+    int writing, stop, err;
+    unsigned long sent;         /* since the last drain */
+};
+
+static void ring_push(struct save_pipe *p, struct batch_ring *r,
+                      struct save_batch *b)
+{
+    r->b[(r->head + r->nr++) % p->depth] = b;
+}
+
+static struct save_batch *ring_pop(struct save_pipe *p, struct batch_ring *r)
+{
+    struct save_batch *b;
+
+    if ( !r->nr )
+        return NULL;
+    b = r->b[r->head];
+    r->head = (r->head + 1) % p->depth;
+    r->nr--;
+    return b;
+}
+
+static int save_pipe_map(struct save_pipe *p, struct save_batch *b)
+{
+    xc_interface *xch = p->xch;
+    struct save_ctx *ctx = p->ctx;
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    unsigned int j, run;
+
+    b->region = xc_map_foreign_bulk(xch, p->dom, PROT_READ, b->pfn_type,
+                                    b->pfn_err, b->nr);
+    if ( b->region == NULL )
+    {
+        PERROR("map batch failed");
+        return -1;
+    }
+
+    if ( xc_get_pfn_type_batch(xch, p->dom, b->nr, b->pfn_type) )
+    {
+        PERROR("get_pfn_type_batch failed");
+        munmap(b->region, b->nr * PAGE_SIZE);
+        b->region = NULL;
+        return -1;
+    }
+
+    for ( run = j = 0; j < b->nr; j++ )
+    {
+        unsigned long gmfn = b->pfn_batch[j];
+
+        if ( !p->hvm )
+            gmfn = pfn_to_mfn(gmfn);
+
+        if ( b->pfn_type[j] == XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            b->pfn_type[j] |= b->pfn_batch[j];
+            ++run;
+            continue;
+        }
+
+        if ( b->pfn_err[j] )
+        {
+            if ( b->pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+                continue;
+
+            DPRINTF("map fail: page %i mfn %08lx err %d\n",
+                    j, gmfn, b->pfn_err[j]);
+            b->pfn_type[j] = XEN_DOMCTL_PFINFO_XTAB;
+            continue;
+        }
+
+        if ( b->pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+        {
+            DPRINTF("type fail: page %i mfn %08lx\n", j, gmfn);
+            continue;
+        }
+
+        if ( test_bit(j, b->xalloc) )
+            b->pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC;
+
+        /* canonicalise mfn->pfn */
+        b->pfn_type[j] |= b->pfn_batch[j];
+        ++run;
+    }
+
+    /* No valid pages: nothing to send. */
+    if ( !run )
+    {
+        munmap(b->region, b->nr * PAGE_SIZE);
+        b->region = NULL;
+    }
+
+    return 0;
+}
+
+static int save_pipe_transform(struct save_pipe *p, struct save_batch *b)
+{
+    xc_interface *xch = p->xch;
+    char *o = b->out;
+    unsigned long *types;
+    unsigned int j;
+    int rc = 0;
+
+    b->len = b->sent = 0;
+    memset(b->zero, 0, sizeof(b->zero));
+    if ( !b->region )
+        return 0;
+
+    memcpy(o, &b->nr, sizeof(b->nr));
+    o += sizeof(b->nr);
+    types = (unsigned long *)o;
+    for ( j = 0; j < b->nr; j++ )
+        types[j] = b->pfn_type[j];
+    o += b->nr * sizeof(*types);
+
+    for ( j = 0; j < b->nr; j++ )
+    {
+        unsigned long pfn, pagetype;
+        void *spage = (char *)b->region + (PAGE_SIZE*j);
+
+        pfn      = b->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = b->pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+             || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+             || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+             (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
+        {
+            if ( canonicalize_pagetable(p->ctx, pagetype, pfn,
+                                        spage, o) && !p->live )
+            {
+                ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn, pagetype);
+                rc = -1;
+                break;
+            }
+        }
+        else if ( p->dedup && page_is_zero(spage) )
+        {
+            types[j] = XEN_DOMCTL_PFINFO_XALLOC | pfn;
+            set_bit(j, b->zero);
+            continue;
+        }
+        else
+        {
+            memcpy(o, spage, PAGE_SIZE);
+            if ( p->dedup && p->dedup->nr )
+                b->hash[j] = page_hash(o);
+        }
+        o += PAGE_SIZE;
+    }
+
+    munmap(b->region, b->nr * PAGE_SIZE);
+    b->region = NULL;
+
+    if ( !rc )
+    {
+        b->len = o - b->out;
+        b->sent = b->nr;
+    }
+    return rc;
+}
+
+/*
+ * List the batch's zero pages, and look the rest up among the pages sent
+ * before, dropping those found from the record.  This has to be done in
+ * the order batches are sent, so here rather than in the transform stage.
+ */
+static void save_pipe_elide(struct save_pipe *p, struct save_batch *b)
+{
+    struct page_dedup *d = p->dedup;
+    unsigned long *types = (unsigned long *)(b->out + sizeof(b->nr));
+    char *rd, *wr;
+    unsigned int j;
+
+    b->elided.nr = 0;
+    rd = wr = (char *)(types + b->nr);
+
+    for ( j = 0; j < b->nr; j++ )
+    {
+        unsigned long pfn, pagetype;
+        long src;
+
+        pfn      = b->pfn_batch[j];
+        pagetype = types[j] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( test_bit(j, b->zero) )
+        {
+            b->elided.e[b->elided.nr].pfn = pfn;
+            b->elided.e[b->elided.nr++].src = ELIDED_ZERO;
+            d->zero++;
+        }
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+             || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+             || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+        {
+            page_dedup_sent(d, pfn);
+            continue;
+        }
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_NOTAB && d->same_host )
+        {
+            page_dedup_sent(d, pfn);
+            types[j] = XEN_DOMCTL_PFINFO_XALLOC | pfn;
+            b->elided.e[b->elided.nr].pfn = pfn;
+            b->elided.e[b->elided.nr++].src = ELIDED_SAME_HOST | pfn;
+            d->local++;
+            rd += PAGE_SIZE;
+            continue;
+        }
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_NOTAB && d->nr &&
+             (src = page_dedup_find(d, pfn, rd, b->hash[j])) >= 0 )
+        {
+            types[j] = XEN_DOMCTL_PFINFO_XALLOC | pfn;
+            b->elided.e[b->elided.nr].pfn = pfn;
+            b->elided.e[b->elided.nr++].src = src;
+            d->dup++;
+            rd += PAGE_SIZE;
+            continue;
+        }
+
+        if ( pagetype != XEN_DOMCTL_PFINFO_NOTAB )
+            page_dedup_sent(d, pfn);
+        if ( wr != rd )
+            memmove(wr, rd, PAGE_SIZE);
+        rd += PAGE_SIZE;
+        wr += PAGE_SIZE;
+    }
+
+    b->len = wr - b->out;
+}
+
+/* Write to the main stream, the way the batch is written without streams */
+static int save_pipe_put(struct save_pipe *p, struct save_batch *b,
+                         void *buf, size_t len)
+{
+    xc_interface *xch = p->xch;
+
+    if ( b->dobuf )
+        return outbuf_hardwrite(xch, p->ob, p->io_fd, buf, len);
+    return noncached_write(xch, p->ob, p->io_fd, buf, len) != len ? -1 : 0;
+}
+
+static int save_pipe_write(struct save_pipe *p, struct save_batch *b)
+{
+    xc_interface *xch = p->xch;
+
+    if ( !b->len )
+        return 0;
+
+    if ( p->dedup )
+    {
+        save_pipe_elide(p, b);
+        if ( b->elided.nr &&
+             save_pipe_put(p, b, &b->elided, ELIDED_REC_LEN(&b->elided)) )
+        {
+            PERROR("Error when writing to state file (4e) (errno %d)", errno);
+            return -1;
+        }
+    }
+
+    if ( p->nr_streams )
+    {
+        struct {
+            int id;
+            uint32_t stream;
+        } marker = { XC_SAVE_ID_STREAM_BATCH, b->seq % p->nr_streams };
+
+        /*
+         * Nothing can be left buffered: the receiver may be stuck on a
+         * page stream until it sees the marker.
+         */
+        if ( (b->dobuf && outbuf_flush(xch, p->ob, p->io_fd) < 0) ||
+             write_exact(p->io_fd, &marker, sizeof(marker)) )
+        {
+            PERROR("Error when writing to state file (4m) (errno %d)", errno);
+            return -1;
+        }
+        return 0;
+    }
+
+    if ( save_pipe_put(p, b, b->out, b->len) )
+    {
+        PERROR("Error when writing to state file (4p) (errno %d)", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int save_pipe_write_stream(struct save_pipe *p, struct save_batch *b)
+{
+    xc_interface *xch = p->xch;
+    unsigned int s = b->seq % p->nr_streams;
+
+    if ( write_exact(p->page_fds[s], b->out, b->len) )
+    {
+        PERROR("Error when writing to page stream %u (errno %d)", s, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *save_pipe_worker(void *arg)
+{
+    struct save_pipe *p = arg;
+    struct save_batch *b;
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+    while ( !p->stop )
+    {
+        /* Write, if it's the next batch's turn and nobody else is. */
+        b = p->done[p->next_write % p->depth];
+        if ( !p->writing && b && b->seq == p->next_write )
+        {
+            p->done[p->next_write % p->depth] = NULL;
+            p->writing = 1;
+            pthread_mutex_unlock(&p->lock);
+
+            rc = p->err ? 0 : save_pipe_write(p, b);
+
+            pthread_mutex_lock(&p->lock);
+            if ( rc )
+                p->err = 1;
+            p->writing = 0;
+            p->next_write++;
+
+            if ( p->nr_streams )
+            {
+                unsigned int s = b->seq % p->nr_streams;
+
+                /* The marker is out: now the batch, after its stream's last. */
+                pthread_cond_broadcast(&p->cond);
+                while ( p->stream_next[s] != b->seq )
+                    pthread_cond_wait(&p->cond, &p->lock);
+                pthread_mutex_unlock(&p->lock);
+
+                rc = (p->err || !b->len) ? 0 : save_pipe_write_stream(p, b);
 
-    /*
-     * Write an extended-info structure to inform the restore code that
-     * a PAE guest understands extended CR3 (PDPTs above 4GB). Turns off
-     * slow paths in the restore code.
-     */
-    {
-        unsigned long signature = ~0UL;
-        uint32_t chunk1_sz = ((dinfo->guest_width==8) 
-                              ? sizeof(ctxt.x64) 
-                              : sizeof(ctxt.x32));
-        uint32_t chunk2_sz = 0;
-        uint32_t chunk3_sz = 4;
-        uint32_t xcnt_size = 0;
-        uint32_t tot_sz;
-        DECLARE_DOMCTL;
+                pthread_mutex_lock(&p->lock);
+                if ( rc )
+                    p->err = 1;
+                p->stream_next[s] += p->nr_streams;
+            }
 
-        domctl.cmd = XEN_DOMCTL_getvcpuextstate;
-        domctl.domain = dom;
-        domctl.u.vcpuextstate.vcpu = 0;
-        domctl.u.vcpuextstate.size = 0;
-        domctl.u.vcpuextstate.xfeature_mask = 0;
-        if ( xc_domctl(xch, &domctl) < 0 )
-        {
-            PERROR("No extended context for VCPU%d", i);
-            goto out;
+            if ( !p->err )
+                p->sent += b->sent;
+            p->completed++;
+            ring_push(p, &p->free, b);
+            pthread_cond_broadcast(&p->cond);
+            continue;
         }
-        xcnt_size = domctl.u.vcpuextstate.size + 2 * sizeof(uint64_t);
 
-        tot_sz = (chunk1_sz + 8) + (chunk2_sz + 8);
-        if ( domctl.u.vcpuextstate.xfeature_mask )
-            tot_sz += chunk3_sz + 8;
+        if ( (b = ring_pop(p, &p->xform)) != NULL )
+        {
+            pthread_mutex_unlock(&p->lock);
 
-        if ( write_exact(io_fd, &signature, sizeof(signature)) ||
-             write_exact(io_fd, &tot_sz, sizeof(tot_sz)) ||
-             write_exact(io_fd, "vcpu", 4) ||
-             write_exact(io_fd, &chunk1_sz, sizeof(chunk1_sz)) ||
-             write_exact(io_fd, &ctxt, chunk1_sz) ||
-             write_exact(io_fd, "extv", 4) ||
-             write_exact(io_fd, &chunk2_sz, sizeof(chunk2_sz)) ||
-             (domctl.u.vcpuextstate.xfeature_mask) ?
-                (write_exact(io_fd, "xcnt", 4) ||
-                write_exact(io_fd, &chunk3_sz, sizeof(chunk3_sz)) ||
-                write_exact(io_fd, &xcnt_size, 4)) :
-                0 )
+            rc = p->err ? 0 : save_pipe_transform(p, b);
+            if ( p->err && b->region )
+            {
+                munmap(b->region, b->nr * PAGE_SIZE);
+                b->region = NULL;
+                b->len = 0;
+            }
+
+            pthread_mutex_lock(&p->lock);
+            if ( rc )
+                p->err = 1;
+            p->done[b->seq % p->depth] = b;
+            pthread_cond_broadcast(&p->cond);
+            continue;
+        }
+
+        if ( (b = ring_pop(p, &p->map)) != NULL )
         {
-            PERROR("write: extended info");
-            goto out;
+            pthread_mutex_unlock(&p->lock);
+
+            b->region = NULL;
+            rc = p->err ? 0 : save_pipe_map(p, b);
+
+            pthread_mutex_lock(&p->lock);
+            if ( rc )
+                p->err = 1;
+            ring_push(p, &p->xform, b);
+            pthread_cond_broadcast(&p->cond);
+            continue;
         }
+
+        pthread_cond_wait(&p->cond, &p->lock);
     }
+    pthread_mutex_unlock(&p->lock);
 
-    if ( write_exact(io_fd, p2m_frame_list, 
-                     P2M_FL_ENTRIES * sizeof(xen_pfn_t)) )
+    return NULL;
+}
+
+static void save_pipe_stop(struct save_pipe *p)
+{
+    unsigned int i;
+
+    if ( !p )
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for ( i = 0; i < p->nr_threads; i++ )
+        pthread_join(p->threads[i], NULL);
+
+    if ( p->batches )
+        for ( i = 0; i < p->depth; i++ )
+            free(p->batches[i].out);
+    free(p->batches);
+    free(p->free.b);
+    free(p->map.b);
+    free(p->xform.b);
+    free(p->done);
+    free(p->stream_next);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+static struct save_pipe *save_pipe_start(xc_interface *xch, uint32_t dom,
+                                         int io_fd, int hvm, int live,
+                                         struct save_ctx *ctx,
+                                         struct outbuf *ob,
+                                         const int *page_fds,
+                                         unsigned int nr_page_fds)
+{
+    struct save_pipe *p;
+    const char *env = getenv("XG_SAVE_THREADS");
+    long n;
+    unsigned int i;
+
+    n = env ? strtol(env, NULL, 0) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if ( n <= 0 )
+        return NULL;
+    /* Enough threads to keep every page stream busy */
+    if ( n <= nr_page_fds )
+        n = nr_page_fds + 1;
+    if ( n > SAVE_PIPE_MAX_THREADS )
+        n = SAVE_PIPE_MAX_THREADS;
+
+    p = calloc(1, sizeof(*p));
+    if ( !p )
+        return NULL;
+
+    p->xch = xch;
+    p->dom = dom;
+    p->io_fd = io_fd;
+    p->hvm = hvm;
+    p->live = live;
+    p->ctx = ctx;
+    p->ob = ob;
+    p->page_fds = page_fds;
+    p->nr_streams = nr_page_fds;
+    p->depth = 2 * n + 2;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    p->batches = calloc(p->depth, sizeof(*p->batches));
+    p->free.b = calloc(p->depth, sizeof(*p->free.b));
+    p->map.b = calloc(p->depth, sizeof(*p->map.b));
+    p->xform.b = calloc(p->depth, sizeof(*p->xform.b));
+    p->done = calloc(p->depth, sizeof(*p->done));
+    p->stream_next = calloc(nr_page_fds + 1, sizeof(*p->stream_next));
+    if ( !p->batches || !p->free.b || !p->map.b || !p->xform.b || !p->done ||
+         !p->stream_next )
+        goto err;
+    for ( i = 0; i < nr_page_fds; i++ )
+        p->stream_next[i] = i;
+
+    for ( i = 0; i < p->depth; i++ )
     {
-        PERROR("write: p2m_frame_list");
-        goto out;
+        p->batches[i].out = malloc(SAVE_BATCH_OUT_SIZE);
+        if ( !p->batches[i].out )
+            goto err;
+        p->batches[i].elided.id = XC_SAVE_ID_ELIDED_PAGES;
+        ring_push(p, &p->free, &p->batches[i]);
     }
 
-    success = 1;
+    for ( ; p->nr_threads < n; p->nr_threads++ )
+        if ( pthread_create(&p->threads[p->nr_threads], NULL,
+                            save_pipe_worker, p) )
+            break;
+    if ( !p->nr_threads )
+        goto err;
 
- out:
-    
-    if ( !success && p2m )
-        munmap(p2m, P2M_FL_ENTRIES * PAGE_SIZE);
+    DPRINTF("Saving pages with %u threads, %u batches in flight, "
+            "%u page streams\n", p->nr_threads, p->depth, p->nr_streams);
+    return p;
 
-    if ( live_p2m_frame_list_list )
-        munmap(live_p2m_frame_list_list, PAGE_SIZE);
+ err:
+    DPRINTF("No save pipeline, saving pages serially\n");
+    save_pipe_stop(p);
+    return NULL;
+}
 
-    if ( live_p2m_frame_list )
-        munmap(live_p2m_frame_list, P2M_FLL_ENTRIES * PAGE_SIZE);
+/* Get a batch to fill in.  NULL if the pipeline has failed. */
+static struct save_batch *save_pipe_get(struct save_pipe *p)
+{
+    struct save_batch *b;
 
-    free(p2m_frame_list_list);
+    pthread_mutex_lock(&p->lock);
+    while ( !(b = ring_pop(p, &p->free)) && !p->err )
+        pthread_cond_wait(&p->cond, &p->lock);
+    if ( p->err && b )
+    {
+        ring_push(p, &p->free, b);
+        b = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
 
-    free(p2m_frame_list);
+    return b;
+}
 
-    return success ? p2m : NULL;
+static void save_pipe_submit(struct save_pipe *p, struct save_batch *b)
+{
+    pthread_mutex_lock(&p->lock);
+    b->seq = p->submitted++;
+    ring_push(p, &p->map, b);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
 }
 
-/* must be done AFTER suspend_and_state() */
-static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
+/*
+ * Wait for all submitted batches to be written.  Returns the number of
+ * pages sent since the last drain, or -1 if anything failed.
+ */
+static long save_pipe_drain(struct save_pipe *p)
 {
-    int marker = XC_SAVE_ID_TSC_INFO;
-    uint32_t tsc_mode, khz, incarn;
-    uint64_t nsec;
+    long sent;
+
+    pthread_mutex_lock(&p->lock);
+    while ( p->completed != p->submitted )
+        pthread_cond_wait(&p->cond, &p->lock);
+    sent = p->err ? -1 : p->sent;
+    p->sent = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    return sent;
+}
+
+/* Tell the receiver the page streams are done with. */
+static int save_pipe_end_streams(struct save_pipe *p)
+{
+    xc_interface *xch = p->xch;
+    unsigned int s;
+    int end = 0;
+
+    for ( s = 0; s < p->nr_streams; s++ )
+        if ( write_exact(p->page_fds[s], &end, sizeof(end)) )
+        {
+            PERROR("Error when ending page stream %u", s);
+            return -1;
+        }
 
-    if ( xc_domain_get_tsc_info(xch, dom, &tsc_mode,
-                                &nsec, &khz, &incarn) < 0  ||
-         write_exact(io_fd, &marker, sizeof(marker)) ||
-         write_exact(io_fd, &tsc_mode, sizeof(tsc_mode)) ||
-         write_exact(io_fd, &nsec, sizeof(nsec)) ||
-         write_exact(io_fd, &khz, sizeof(khz)) ||
-         write_exact(io_fd, &incarn, sizeof(incarn)) )
-        return -1;
     return 0;
 }
 
@@ -802,6 +1926,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                    uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
                    unsigned long vm_generationid_addr)
+{
+    return xc_domain_save_streams(xch, io_fd, NULL, 0, dom, max_iters,
+                                  max_factor, flags, callbacks, hvm,
+                                  vm_generationid_addr);
+}
+
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *page_fds, unsigned int nr_page_fds,
+                           uint32_t dom, uint32_t max_iters,
+                           uint32_t max_factor, uint32_t flags,
+                           struct save_callbacks* callbacks, int hvm,
+                           unsigned long vm_generationid_addr)
 {
     xc_dominfo_t info;
     DECLARE_DOMCTL;
@@ -845,6 +1981,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     DECLARE_HYPERCALL_BUFFER(unsigned long, to_send);
     unsigned long *to_fix = NULL;
 
+    /* pfns drained from the log-dirty ring, if Xen provides one */
+    DECLARE_HYPERCALL_BUFFER(uint64_t, dirty_ring);
+    unsigned long dirty_ring_size = 0;
+
     struct time_stats time_stats;
     xc_shadow_op_stats_t shadow_stats;
 
@@ -891,6 +2031,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
      */
     int compressing = 0;
 
+    /* Map/transform/write pipeline, if there is one */
+    struct save_pipe *pipe = NULL;
+    struct page_dedup *dedup = NULL;
+    struct converge converge = { 0 };
+
+    /* Pages left for the receiver to fetch after resuming the guest */
+    int postcopy = (flags & XCFLAGS_POSTCOPY);
+    /* Checkpoint pages copied while the guest still runs (Remus) */
+    int precopy_pass = 0;
+    unsigned long *postcopy_pfns = NULL;
+    unsigned long nr_postcopy = 0;
+
     int completed = 0;
 
     DPRINTF("%s: starting save of domid %u", __func__, dom);
@@ -910,6 +2062,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     max_iters  = max_iters  ? : DEF_MAX_ITERS;
     max_factor = max_factor ? : DEF_MAX_FACTOR;
 
+    if ( postcopy && (!live || !hvm || callbacks->checkpoint) )
+    {
+        DPRINTF("Post-copy is only for live saves of HVM guests, ignored\n");
+        postcopy = 0;
+    }
+    if ( postcopy && max_iters > POSTCOPY_MAX_ITERS )
+        max_iters = POSTCOPY_MAX_ITERS;
+
     if ( !get_platform_info(xch, dom,
                             &ctx->max_mfn, &ctx->hvirt_start, &ctx->pt_levels, &dinfo->guest_width) )
     {
@@ -1001,6 +2161,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     }
 
     last_iter = !live;
+    converge_init(&converge, flags, info.max_vcpu_id + 1);
 
     /* pretend we sent all the pages last iteration */
     sent_last_iter = dinfo->p2m_size;
@@ -1018,6 +2179,36 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     memset(to_send, 0xff, bitmap_size(dinfo->p2m_size));
 
+    /*
+     * Track dirtied pages in a ring as well, so that each round costs in
+     * proportion to the pages dirtied rather than to the guest's size.
+     * Without one (e.g. an older Xen) the bitmap does it all.
+     */
+    if ( live )
+    {
+        dirty_ring_size = dinfo->p2m_size / DIRTY_RING_RATIO;
+        if ( dirty_ring_size < DIRTY_RING_MIN )
+            dirty_ring_size = DIRTY_RING_MIN;
+        if ( dirty_ring_size > DIRTY_RING_MAX )
+            dirty_ring_size = DIRTY_RING_MAX;
+
+        dirty_ring = xc_hypercall_buffer_alloc_pages(
+            xch, dirty_ring,
+            NRPAGES(dirty_ring_size * sizeof(*dirty_ring)));
+        if ( dirty_ring &&
+             xc_logdirty_ring_enable(xch, dom, dirty_ring_size) )
+        {
+            DPRINTF("No log-dirty ring (errno %d), using the bitmap\n",
+                    errno);
+            xc_hypercall_buffer_free_pages(
+                xch, dirty_ring,
+                NRPAGES(dirty_ring_size * sizeof(*dirty_ring)));
+            dirty_ring = NULL;
+        }
+        else if ( dirty_ring )
+            memset(to_skip, 0, bitmap_size(dinfo->p2m_size));
+    }
+
     if ( hvm )
     {
         /* Need another buffer for HVM context */
@@ -1049,6 +2240,59 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     memset(pfn_type, 0,
            ROUNDUP(MAX_BATCH_SIZE * sizeof(*pfn_type), PAGE_SHIFT));
 
+    if ( nr_page_fds > MAX_PAGE_STREAMS )
+    {
+        ERROR("Too many page streams (%u)", nr_page_fds);
+        errno = EINVAL;
+        goto out;
+    }
+
+    dedup = page_dedup_init(xch, dinfo->p2m_size);
+    if ( !dedup )
+    {
+        ERROR("failed to alloc memory for page elision");
+        errno = ENOMEM;
+        goto out;
+    }
+    dedup->rec.id = XC_SAVE_ID_ELIDED_PAGES;
+
+    if ( (flags & XCFLAGS_SAME_HOST) && !hvm )
+        DPRINTF("Same host pages are only for HVM guests, ignored\n");
+    else if ( flags & XCFLAGS_SAME_HOST )
+    {
+        struct {
+            int id;
+            uint32_t dom;
+        } chunk = { XC_SAVE_ID_SAME_HOST, dom };
+
+        if ( write_exact(io_fd, &chunk, sizeof(chunk)) )
+        {
+            PERROR("Error when writing to state file (same host)");
+            goto out;
+        }
+        dedup->same_host = 1;
+    }
+
+    pipe = save_pipe_start(xch, dom, io_fd, hvm, live, ctx, &ob_pagebuf,
+                           page_fds, nr_page_fds);
+    if ( pipe )
+        pipe->dedup = dedup;
+    if ( nr_page_fds && !pipe )
+        DPRINTF("Not using page streams: no save pipeline\n");
+    else if ( nr_page_fds )
+    {
+        struct {
+            int id;
+            uint32_t nr;
+        } chunk = { XC_SAVE_ID_PAGE_STREAMS, nr_page_fds };
+
+        if ( write_exact(io_fd, &chunk, sizeof(chunk)) )
+        {
+            PERROR("Error when writing to state file (page streams)");
+            goto out;
+        }
+    }
+
     /* Setup the mfn_to_pfn table mapping */
     if ( !(ctx->live_m2p = xc_map_m2p(xch, ctx->max_mfn, PROT_READ, &ctx->m2p_mfn0)) )
     {
@@ -1107,6 +2351,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto out;
     }
 
+    if ( hvm && send_pfn_layout(xch, dom, io_fd, dinfo->p2m_size) )
+        goto out;
+
   copypages:
 #define wrexact(fd, buf, len) write_buffer(xch, last_iter, ob, (fd), (buf), (len))
 #define wruncached(fd, live, buf, len) write_uncached(xch, last_iter, ob, (fd), (buf), (len))
@@ -1134,7 +2381,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         {
             xc_report_progress_step(xch, N, dinfo->p2m_size);
 
-            if ( !last_iter )
+            /* With the ring, don't undo its gains by scanning the bitmap. */
+            if ( !last_iter && !dirty_ring )
             {
                 /* Slightly wasteful to peek the whole array every time,
                    but this is fast enough for the moment. */
@@ -1253,6 +2501,32 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( batch == 0 )
                 goto skip; /* vanishingly unlikely... */
 
+            if ( pipe && !compressing && !debug )
+            {
+                struct save_batch *b = save_pipe_get(pipe);
+
+                if ( !b )
+                {
+                    ERROR("Error in page save pipeline");
+                    goto out;
+                }
+
+                b->nr = batch;
+                b->dobuf = last_iter;
+                memcpy(b->pfn_batch, pfn_batch, batch * sizeof(*pfn_batch));
+                memcpy(b->pfn_type, pfn_type, batch * sizeof(*pfn_type));
+                memset(b->xalloc, 0, sizeof(b->xalloc));
+                if ( superpages && iter == 1 )
+                    for ( j = 0; j < batch; j++ )
+                        if ( test_bit(hvm ? pfn_batch[j]
+                                          : pfn_to_mfn(pfn_batch[j]),
+                                      to_skip) )
+                            set_bit(j, b->xalloc);
+
+                save_pipe_submit(pipe, b);
+                continue;
+            }
+
             region_base = xc_map_foreign_bulk(
                 xch, dom, PROT_READ, pfn_type, pfn_err, batch);
             if ( region_base == NULL )
@@ -1330,6 +2604,55 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 continue; /* bail on this batch: no valid pages */
             }
 
+            /* Leave out zero and already sent pages, unless compressing */
+            dedup->rec.nr = 0;
+            for ( j = 0; j < batch; j++ )
+            {
+                unsigned long pfn = pfn_batch[j];
+                void *spage = (char *)region_base + (PAGE_SIZE*j);
+                long src;
+
+                if ( compressing || debug ||
+                     (pfn_type[j] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+                     XEN_DOMCTL_PFINFO_NOTAB )
+                {
+                    page_dedup_sent(dedup, pfn);
+                    continue;
+                }
+
+                if ( page_is_zero(spage) )
+                {
+                    page_dedup_sent(dedup, pfn);
+                    dedup->rec.e[dedup->rec.nr].src = ELIDED_ZERO;
+                    dedup->zero++;
+                }
+                else if ( dedup->same_host )
+                {
+                    page_dedup_sent(dedup, pfn);
+                    dedup->rec.e[dedup->rec.nr].src = ELIDED_SAME_HOST | pfn;
+                    dedup->local++;
+                }
+                else if ( dedup->nr &&
+                          (src = page_dedup_find(dedup, pfn, spage,
+                                                 page_hash(spage))) >= 0 )
+                {
+                    dedup->rec.e[dedup->rec.nr].src = src;
+                    dedup->dup++;
+                }
+                else
+                    continue;
+
+                pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC | pfn;
+                dedup->rec.e[dedup->rec.nr++].pfn = pfn;
+            }
+
+            if ( dedup->rec.nr &&
+                 wrexact(io_fd, &dedup->rec, ELIDED_REC_LEN(&dedup->rec)) )
+            {
+                PERROR("Error when writing to state file (2e)");
+                goto out;
+            }
+
             if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
             {
                 PERROR("Error when writing to state file (2)");
@@ -1497,6 +2820,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
       skip:
 
+        if ( pipe )
+        {
+            long sent = save_pipe_drain(pipe);
+
+            if ( sent < 0 )
+            {
+                ERROR("Error in page save pipeline");
+                goto out;
+            }
+            sent_this_iter += sent;
+        }
+
         xc_report_progress_step(xch, dinfo->p2m_size, dinfo->p2m_size);
 
         total_sent += sent_this_iter;
@@ -1532,11 +2867,28 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
         if ( live )
         {
-            if ( (iter >= max_iters) ||
+            xc_shadow_op_stats_t peek = { 0 };
+
+            if ( xc_shadow_control(xch, dom, XEN_DOMCTL_SHADOW_OP_PEEK,
+                                   NULL, 0, NULL, 0, &peek) < 0 )
+                peek.dirty_count = dinfo->p2m_size;
+
+            if ( precopy_pass ||
+                 converge_check(xch, dom, &converge, sent_this_iter,
+                                peek.dirty_count) ||
+                 (iter >= max_iters) ||
                  (sent_this_iter+skip_this_iter < 50) ||
                  (total_sent > dinfo->p2m_size*max_factor) )
             {
                 DPRINTF("Start last iteration\n");
+
+                /* Free the compression buffer while the guest still runs */
+                if ( precopy_pass && compressing && wrcompressed(io_fd) < 0 )
+                {
+                    ERROR("Error when writing compressed data (pre-copy)");
+                    goto out;
+                }
+                precopy_pass = 0;
                 last_iter = 1;
 
                 if ( suspend_and_state(callbacks->suspend, callbacks->data,
@@ -1545,6 +2897,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     ERROR("Domain appears not to have suspended");
                     goto out;
                 }
+                converge_done(xch, dom, &converge);
 
                 DPRINTF("SUSPEND shinfo %08lx\n", info.shared_info_frame);
                 if ( (tmem_saved > 0) &&
@@ -1563,14 +2916,29 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
             }
 
-            if ( xc_shadow_control(xch, dom,
-                                   XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(to_send),
-                                   dinfo->p2m_size, NULL, 0, &shadow_stats) != dinfo->p2m_size )
+            if ( clean_dirty_pages(xch, dom, dinfo->p2m_size,
+                                   HYPERCALL_BUFFER(to_send), to_send,
+                                   HYPERCALL_BUFFER(dirty_ring), dirty_ring,
+                                   dirty_ring_size, &shadow_stats) )
             {
                 PERROR("Error flushing shadow PT");
                 goto out;
             }
 
+            if ( last_iter && postcopy )
+            {
+                postcopy_pfns = bitmap_alloc(dinfo->p2m_size);
+                if ( !postcopy_pfns )
+                {
+                    ERROR("Failed to allocate post-copy bitmap");
+                    goto out;
+                }
+                nr_postcopy = postcopy_split(xch, dom, to_send, postcopy_pfns,
+                                             dinfo->p2m_size,
+                                             vm_generationid_addr);
+                DPRINTF("Leaving %lu pages for post-copy\n", nr_postcopy);
+            }
+
             sent_last_iter = sent_this_iter;
 
             print_stats(xch, dom, sent_this_iter, &time_stats, &shadow_stats, 1);
@@ -1589,6 +2957,27 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         ob->pos = 0;
     }
 
+    if ( nr_postcopy )
+    {
+        int id = XC_SAVE_ID_POSTCOPY;
+        uint32_t nr = nr_postcopy;
+        uint64_t pfn;
+
+        if ( wrexact(io_fd, &id, sizeof(id)) ||
+             wrexact(io_fd, &nr, sizeof(nr)) )
+        {
+            PERROR("Error when writing to state file (post-copy)");
+            goto out;
+        }
+        for ( pfn = 0; pfn < dinfo->p2m_size; pfn++ )
+            if ( test_bit(pfn, postcopy_pfns) &&
+                 wrexact(io_fd, &pfn, sizeof(pfn)) )
+            {
+                PERROR("Error when writing to state file (post-copy)");
+                goto out;
+            }
+    }
+
     {
         struct chunk {
             int id;
@@ -2026,12 +3415,29 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto out;
     }
 
+    /* The receiver resumes the guest, then fetches what was left behind */
+    if ( nr_postcopy )
+    {
+        if ( outbuf_flush(xch, ob, io_fd) < 0 )
+        {
+            PERROR("Error when flushing output buffer");
+            goto out;
+        }
+        if ( xc_postcopy_send(xch, io_fd, dom, postcopy_pfns,
+                              dinfo->p2m_size) )
+            goto out;
+    }
+
     /* Success! */
     rc = 0;
 
  out:
     completed = 1;
 
+    /* Nothing else may write to the stream while batches are in flight. */
+    if ( pipe && save_pipe_drain(pipe) < 0 )
+        rc = 1;
+
     if ( !rc && callbacks->postcopy )
         callbacks->postcopy(callbacks->data);
 
@@ -2075,6 +3481,27 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         print_stats(xch, dom, 0, &time_stats, &shadow_stats, 0);
 
         rc = 1;
+
+        /*
+         * Copy out what was dirtied since the last checkpoint before
+         * suspending, and while suspended only what is dirtied again
+         * meanwhile.  It all goes in this checkpoint, which the receiver
+         * applies in order, and only commits whole.
+         */
+        if ( flags & XCFLAGS_CHECKPOINT_PRECOPY )
+        {
+            if ( xc_shadow_control(xch, dom,
+                                   XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(to_send),
+                                   dinfo->p2m_size, NULL, 0, &shadow_stats) != dinfo->p2m_size )
+            {
+                PERROR("Error flushing shadow PT");
+                goto out;
+            }
+            precopy_pass = 1;
+            last_iter = 0;
+            goto copypages;
+        }
+
         /* last_iter = 1; */
         if ( suspend_and_state(callbacks->suspend, callbacks->data, xch,
                                io_fd, dom, &info) )
@@ -2095,6 +3522,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto copypages;
     }
 
+    if ( !rc && pipe && save_pipe_end_streams(pipe) )
+        rc = 1;
+
     if ( tmem_saved != 0 && live )
         xc_tmem_save_done(xch, dom);
 
@@ -2108,6 +3538,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Warning - couldn't disable qemu log-dirty mode");
     }
 
+    converge_done(xch, dom, &converge);
+    save_pipe_stop(pipe);
+    if ( dedup )
+    {
+        DPRINTF("Elided %lu zero and %lu duplicate pages\n",
+                dedup->zero, dedup->dup);
+        if ( dedup->same_host )
+            DPRINTF("Left %lu pages for the receiver to copy\n",
+                    dedup->local);
+        page_dedup_free(dedup);
+    }
+
     if (compress_ctx)
         xc_compression_free_context(xch, compress_ctx);
 
@@ -2122,11 +3564,15 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     xc_hypercall_buffer_free_pages(xch, to_send, NRPAGES(bitmap_size(dinfo->p2m_size)));
     xc_hypercall_buffer_free_pages(xch, to_skip, NRPAGES(bitmap_size(dinfo->p2m_size)));
+    if ( dirty_ring )
+        xc_hypercall_buffer_free_pages(
+            xch, dirty_ring, NRPAGES(dirty_ring_size * sizeof(*dirty_ring)));
 
     free(pfn_type);
     free(pfn_batch);
     free(pfn_err);
     free(to_fix);
+    free(postcopy_pfns);
     free(hvm_buf);
     outbuf_free(&ob_pagebuf);
 
@@ -45,10 +45,144 @@ static void hypercall_buffer_cache_unlock(xc_interface *xch)
     pthread_mutex_unlock(&hypercall_buffer_cache_mutex);
 }
 
+/*
+ * Buffers of up to 1 << (HYPERCALL_BUFFER_CACHE_ORDERS - 1) pages are
+ * allocated rounded up to a power of two, so that they can be cached by
+ * size class.  Returns the class, or -1 for buffers too big to cache.
+ */
+static int hypercall_buffer_order(int nr_pages)
+{
+    int order = 0;
+
+    while ( (1 << order) < nr_pages )
+        if ( ++order == HYPERCALL_BUFFER_CACHE_ORDERS )
+            return -1;
+
+    return order;
+}
+
+static int hypercall_buffer_pages(int nr_pages)
+{
+    int order = hypercall_buffer_order(nr_pages);
+
+    return order < 0 ? nr_pages : 1 << order;
+}
+
+/*
+ * A thread keeps a few single page buffers for one handle to itself, to
+ * hand them out without taking the lock.  The handle hands out a thread's
+ * buffers when closed, and a thread those left when it exits.
+ */
+#define HYPERCALL_THREAD_CACHE_SIZE 4
+
+struct hypercall_thread_cache {
+    xc_interface *xch;          /* NULL once the handle is closed */
+    int nr;
+    void *cache[HYPERCALL_THREAD_CACHE_SIZE];
+    int allocations, releases;  /* through this cache, not yet counted */
+    struct hypercall_thread_cache *next;
+};
+
+static pthread_key_t thread_cache_pkey;
+static pthread_once_t thread_cache_pkey_once = PTHREAD_ONCE_INIT;
+
+static int hypercall_buffer_cache_put(xc_interface *xch, void *p, int nr_pages);
+
+/* Called with the lock held */
+static void thread_cache_drop(struct hypercall_thread_cache *tc)
+{
+    xc_interface *xch = tc->xch;
+    struct hypercall_thread_cache **pp;
+
+    for ( pp = &xch->hypercall_thread_caches; *pp; pp = &(*pp)->next )
+        if ( *pp == tc )
+        {
+            *pp = tc->next;
+            break;
+        }
+
+    while ( tc->nr > 0 )
+    {
+        void *p = tc->cache[--tc->nr];
+
+        if ( !hypercall_buffer_cache_put(xch, p, 1) )
+            xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                      p, 1);
+    }
+    xch->hypercall_buffer_total_allocations += tc->allocations;
+    xch->hypercall_buffer_total_releases += tc->releases;
+    xch->hypercall_buffer_current_allocations += tc->allocations - tc->releases;
+    xch->hypercall_buffer_cache_hits += tc->allocations;
+    tc->allocations = tc->releases = 0;
+    tc->xch = NULL;
+}
+
+static void thread_cache_exit(void *arg)
+{
+    struct hypercall_thread_cache *tc = arg;
+
+    pthread_mutex_lock(&hypercall_buffer_cache_mutex);
+    if ( tc->xch )
+        thread_cache_drop(tc);
+    pthread_mutex_unlock(&hypercall_buffer_cache_mutex);
+    free(tc);
+}
+
+static void thread_cache_init(void)
+{
+    pthread_key_create(&thread_cache_pkey, thread_cache_exit);
+}
+
+static struct hypercall_thread_cache *thread_cache(xc_interface *xch,
+                                                   int claim)
+{
+    struct hypercall_thread_cache *tc;
+
+    if ( xch->flags & XC_OPENFLAG_NON_REENTRANT )
+        return NULL;
+
+    pthread_once(&thread_cache_pkey_once, thread_cache_init);
+    tc = pthread_getspecific(thread_cache_pkey);
+    if ( (tc && tc->xch == xch) || !claim )
+        return tc && tc->xch == xch ? tc : NULL;
+
+    if ( !tc )
+    {
+        tc = calloc(1, sizeof(*tc));
+        if ( !tc )
+            return NULL;
+        if ( pthread_setspecific(thread_cache_pkey, tc) )
+        {
+            free(tc);
+            return NULL;
+        }
+    }
+
+    /* Only claimed by the handle it was last used with once that closes */
+    pthread_mutex_lock(&hypercall_buffer_cache_mutex);
+    if ( !tc->xch )
+    {
+        tc->xch = xch;
+        tc->next = xch->hypercall_thread_caches;
+        xch->hypercall_thread_caches = tc;
+    }
+    pthread_mutex_unlock(&hypercall_buffer_cache_mutex);
+
+    return tc->xch == xch ? tc : NULL;
+}
+
 static void *hypercall_buffer_cache_alloc(xc_interface *xch, int nr_pages)
 {
+    struct hypercall_thread_cache *tc;
+    int order = hypercall_buffer_order(nr_pages);
     void *p = NULL;
 
+    if ( nr_pages == 1 && (tc = thread_cache(xch, 0)) && tc->nr > 0 )
+    {
+        tc->allocations++;
+        return tc->cache[--tc->nr];
+    }
+
     hypercall_buffer_cache_lock(xch);
 
     xch->hypercall_buffer_total_allocations++;
@@ -56,13 +190,13 @@ static void *hypercall_buffer_cache_alloc(xc_interface *xch, int nr_pages)
     if ( xch->hypercall_buffer_current_allocations > xch->hypercall_buffer_maximum_allocations )
         xch->hypercall_buffer_maximum_allocations = xch->hypercall_buffer_current_allocations;
 
-    if ( nr_pages > 1 )
+    if ( order < 0 )
     {
         xch->hypercall_buffer_cache_toobig++;
     }
-    else if ( xch->hypercall_buffer_cache_nr > 0 )
+    else if ( xch->hypercall_buffer_cache_nr[order] > 0 )
     {
-        p = xch->hypercall_buffer_cache[--xch->hypercall_buffer_cache_nr];
+        p = xch->hypercall_buffer_cache[order][--xch->hypercall_buffer_cache_nr[order]];
         xch->hypercall_buffer_cache_hits++;
     }
     else
@@ -75,20 +209,38 @@ static void *hypercall_buffer_cache_alloc(xc_interface *xch, int nr_pages)
     return p;
 }
 
+/* Called with the lock held */
+static int hypercall_buffer_cache_put(xc_interface *xch, void *p, int nr_pages)
+{
+    int order = hypercall_buffer_order(nr_pages);
+
+    if ( order < 0 ||
+         xch->hypercall_buffer_cache_nr[order] >= HYPERCALL_BUFFER_CACHE_SIZE )
+        return 0;
+
+    xch->hypercall_buffer_cache[order][xch->hypercall_buffer_cache_nr[order]++] = p;
+    return 1;
+}
+
 static int hypercall_buffer_cache_free(xc_interface *xch, void *p, int nr_pages)
 {
-    int rc = 0;
+    struct hypercall_thread_cache *tc;
+    int rc;
+
+    if ( nr_pages == 1 && (tc = thread_cache(xch, 1)) &&
+         tc->nr < HYPERCALL_THREAD_CACHE_SIZE )
+    {
+        tc->cache[tc->nr++] = p;
+        tc->releases++;
+        return 1;
+    }
 
     hypercall_buffer_cache_lock(xch);
 
     xch->hypercall_buffer_total_releases++;
     xch->hypercall_buffer_current_allocations--;
 
-    if ( nr_pages == 1 && xch->hypercall_buffer_cache_nr < HYPERCALL_BUFFER_CACHE_SIZE )
-    {
-        xch->hypercall_buffer_cache[xch->hypercall_buffer_cache_nr++] = p;
-        rc = 1;
-    }
+    rc = hypercall_buffer_cache_put(xch, p, nr_pages);
 
     hypercall_buffer_cache_unlock(xch);
 
@@ -98,9 +250,13 @@ static int hypercall_buffer_cache_free(xc_interface *xch, void *p, int nr_pages)
 void xc__hypercall_buffer_cache_release(xc_interface *xch)
 {
     void *p;
+    int order;
 
     hypercall_buffer_cache_lock(xch);
 
+    while ( xch->hypercall_thread_caches )
+        thread_cache_drop(xch->hypercall_thread_caches);
+
     DBGPRINTF("hypercall buffer: total allocations:%d total releases:%d",
               xch->hypercall_buffer_total_allocations,
               xch->hypercall_buffer_total_releases);
@@ -108,17 +264,19 @@ void xc__hypercall_buffer_cache_release(xc_interface *xch)
               xch->hypercall_buffer_current_allocations,
               xch->hypercall_buffer_maximum_allocations);
     DBGPRINTF("hypercall buffer: cache current size:%d",
-              xch->hypercall_buffer_cache_nr);
+              xch->hypercall_buffer_cache_nr[0]);
     DBGPRINTF("hypercall buffer: cache hits:%d misses:%d toobig:%d",
               xch->hypercall_buffer_cache_hits,
               xch->hypercall_buffer_cache_misses,
               xch->hypercall_buffer_cache_toobig);
 
-    while ( xch->hypercall_buffer_cache_nr > 0 )
-    {
-        p = xch->hypercall_buffer_cache[--xch->hypercall_buffer_cache_nr];
-        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, p, 1);
-    }
+    for ( order = 0; order < HYPERCALL_BUFFER_CACHE_ORDERS; order++ )
+        while ( xch->hypercall_buffer_cache_nr[order] > 0 )
+        {
+            p = xch->hypercall_buffer_cache[order][--xch->hypercall_buffer_cache_nr[order]];
+            xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                      p, 1 << order);
+        }
 
     hypercall_buffer_cache_unlock(xch);
 }
@@ -128,7 +286,8 @@ void *xc__hypercall_buffer_alloc_pages(xc_interface *xch, xc_hypercall_buffer_t
     void *p = hypercall_buffer_cache_alloc(xch, nr_pages);
 
     if ( !p )
-        p = xch->ops->u.privcmd.alloc_hypercall_buffer(xch, xch->ops_handle, nr_pages);
+        p = xch->ops->u.privcmd.alloc_hypercall_buffer(
+            xch, xch->ops_handle, hypercall_buffer_pages(nr_pages));
 
     if (!p)
         return NULL;
@@ -146,7 +305,8 @@ void xc__hypercall_buffer_free_pages(xc_interface *xch, xc_hypercall_buffer_t *b
         return;
 
     if ( !hypercall_buffer_cache_free(xch, b->hbuf, nr_pages) )
-        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, b->hbuf, nr_pages);
+        xch->ops->u.privcmd.free_hypercall_buffer(
+            xch, xch->ops_handle, b->hbuf, hypercall_buffer_pages(nr_pages));
 }
 
 struct allocation_header {
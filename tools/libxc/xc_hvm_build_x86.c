@@ -20,6 +20,7 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #include "xg_private.h"
@@ -38,6 +39,15 @@
 #define SUPERPAGE_1GB_SHIFT   18
 #define SUPERPAGE_1GB_NR_PFNS (1UL << SUPERPAGE_1GB_SHIFT)
 
+/* Extents per populate_physmap call */
+#define SUPERPAGE_1GB_BATCH   64
+#define SUPERPAGE_2MB_BATCH   SUPERPAGE_2MB_NR_PFNS
+#define NORMAL_PAGE_BATCH     SUPERPAGE_1GB_NR_PFNS
+
+/* Populate big guests from up to this many threads, 4GB or more each */
+#define POPULATE_MAX_THREADS  8
+#define POPULATE_MIN_PFNS     (4UL << SUPERPAGE_1GB_SHIFT)
+
 #define SPECIALPAGE_PAGING   0
 #define SPECIALPAGE_ACCESS   1
 #define SPECIALPAGE_SHARING  2
@@ -234,6 +244,225 @@ static int check_mmio_hole(uint64_t start, uint64_t memsize,
         return 1;
 }
 
+/*
+ * Collect the first pfns of up to max_extents extents of 2^shift pages
+ * starting at page_array[cur_pages], stopping at the first extent which is
+ * misaligned, runs past the end of memory or overlaps the MMIO hole.
+ */
+static unsigned long collect_extents(const xen_pfn_t *page_array,
+                                     unsigned long cur_pages,
+                                     unsigned long nr_pages,
+                                     unsigned int shift,
+                                     unsigned long max_extents,
+                                     uint64_t mmio_start, uint64_t mmio_size,
+                                     xen_pfn_t *extents)
+{
+    unsigned long i, idx, nr = 1UL << shift;
+    xen_pfn_t pfn;
+
+    for ( i = 0; i < max_extents; i++ )
+    {
+        idx = cur_pages + (i << shift);
+        if ( nr_pages - idx < nr )
+            break;
+        pfn = page_array[idx];
+        if ( (pfn & (nr - 1)) != 0 ||
+             check_mmio_hole((uint64_t)pfn << PAGE_SHIFT,
+                             (uint64_t)nr << PAGE_SHIFT,
+                             mmio_start, mmio_size) )
+            break;
+        extents[i] = pfn;
+    }
+
+    return i;
+}
+
+/*
+ * Populating a range of a guest's memory, page_array[start, end), with
+ * the largest pages that fit.  The ranges of a big guest are populated
+ * concurrently, each on a thread of its own.
+ */
+struct populate_job {
+    xc_interface *xch;
+    uint32_t dom;
+    xen_pfn_t *page_array;
+    unsigned long start, end;
+    uint64_t mmio_start, mmio_size;
+    int pod_mode;
+    unsigned long stat_normal_pages, stat_2mb_pages, stat_1gb_pages;
+    int rc;
+    int threaded;
+    pthread_t thread;
+};
+
+static void *populate_range(void *arg)
+{
+    struct populate_job *job = arg;
+    xc_interface *xch = job->xch;
+    xen_pfn_t *page_array = job->page_array;
+    unsigned long cur_pages = job->start, nr_pages = job->end, cur_pfn;
+    int use_1gb = 1, use_2mb = 1;
+    int rc = 0;
+
+    /*
+     * We attempt to allocate 1GB pages if possible. It falls back on 2MB
+     * pages if 1GB allocation fails. 4KB pages will be used eventually if
+     * both fail.  Once Xen has run out of pages of one size we stop asking
+     * for them.
+     *
+     * Extents are populated in large batches: the hypercall is preemptible
+     * so dom0 stays responsive, and a big guest takes few round trips.
+     */
+    while ( (rc == 0) && (nr_pages > cur_pages) )
+    {
+        xen_pfn_t sp_extents[SUPERPAGE_2MB_BATCH];
+        unsigned long count, nr_extents, max_extents;
+        long done;
+
+        cur_pfn = page_array[cur_pages];
+
+        if ( use_1gb &&
+             (nr_extents = collect_extents(page_array, cur_pages, nr_pages,
+                                           SUPERPAGE_1GB_SHIFT,
+                                           SUPERPAGE_1GB_BATCH,
+                                           job->mmio_start, job->mmio_size,
+                                           sp_extents)) != 0 )
+        {
+            done = xc_domain_populate_physmap(xch, job->dom, nr_extents,
+                                              SUPERPAGE_1GB_SHIFT,
+                                              job->pod_mode, sp_extents);
+            if ( done != nr_extents )
+                use_1gb = 0;
+            if ( done > 0 )
+            {
+                job->stat_1gb_pages += done;
+                cur_pages += done << SUPERPAGE_1GB_SHIFT;
+                continue;
+            }
+        }
+
+        /* Stop at the next 1GB boundary if 1GB pages may fit there. */
+        max_extents = SUPERPAGE_2MB_BATCH;
+        if ( use_1gb && (cur_pfn & (SUPERPAGE_1GB_NR_PFNS - 1)) )
+            max_extents = (SUPERPAGE_1GB_NR_PFNS -
+                           (cur_pfn & (SUPERPAGE_1GB_NR_PFNS - 1))) >>
+                          SUPERPAGE_2MB_SHIFT;
+
+        if ( use_2mb &&
+             (nr_extents = collect_extents(page_array, cur_pages, nr_pages,
+                                           SUPERPAGE_2MB_SHIFT, max_extents,
+                                           job->mmio_start, job->mmio_size,
+                                           sp_extents)) != 0 )
+        {
+            done = xc_domain_populate_physmap(xch, job->dom, nr_extents,
+                                              SUPERPAGE_2MB_SHIFT,
+                                              job->pod_mode, sp_extents);
+            if ( done != nr_extents )
+                use_1gb = use_2mb = 0;
+            if ( done > 0 )
+            {
+                job->stat_2mb_pages += done;
+                cur_pages += done << SUPERPAGE_2MB_SHIFT;
+                continue;
+            }
+        }
+
+        /* Fall back to 4kB extents, up to where a superpage may fit. */
+        count = nr_pages - cur_pages;
+        if ( count > NORMAL_PAGE_BATCH )
+            count = NORMAL_PAGE_BATCH;
+        if ( use_2mb &&
+             count > SUPERPAGE_2MB_NR_PFNS -
+                     (cur_pfn & (SUPERPAGE_2MB_NR_PFNS - 1)) )
+            count = SUPERPAGE_2MB_NR_PFNS -
+                    (cur_pfn & (SUPERPAGE_2MB_NR_PFNS - 1));
+
+        rc = xc_domain_populate_physmap_exact(
+            xch, job->dom, count, 0, job->pod_mode, &page_array[cur_pages]);
+        cur_pages += count;
+        job->stat_normal_pages += count;
+    }
+
+    if ( rc != 0 )
+        PERROR("Could not allocate memory for HVM guest.");
+    job->rc = rc;
+
+    return NULL;
+}
+
+static void populate_start(struct populate_job *job)
+{
+    job->threaded = !pthread_create(&job->thread, NULL, populate_range, job);
+    if ( !job->threaded )
+        populate_range(job);
+}
+
+static void populate_wait(struct populate_job *job)
+{
+    if ( job->threaded )
+        pthread_join(job->thread, NULL);
+    job->threaded = 0;
+}
+
+/* The index of the first page at or above pfn in page_array. */
+static unsigned long pfn_to_index(xen_pfn_t pfn,
+                                  uint64_t mmio_start, uint64_t mmio_size)
+{
+    xen_pfn_t hole = mmio_start >> PAGE_SHIFT;
+    xen_pfn_t hole_end = (mmio_start + mmio_size) >> PAGE_SHIFT;
+
+    if ( pfn < hole )
+        return pfn;
+    if ( pfn < hole_end )
+        return hole;
+    return pfn - (hole_end - hole);
+}
+
+/*
+ * Split page_array[start, nr_pages) into up to POPULATE_MAX_THREADS jobs,
+ * at 1GB boundaries so that no superpage is lost to the split.
+ */
+static unsigned int populate_split(struct populate_job *jobs,
+                                   const struct populate_job *tmpl,
+                                   unsigned long start, unsigned long nr_pages)
+{
+    unsigned long nr_jobs, i, idx, prev = start;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    xen_pfn_t pfn;
+    unsigned int n = 0;
+
+    nr_jobs = (nr_pages - start) / POPULATE_MIN_PFNS;
+    if ( cpus > 0 && nr_jobs > cpus )
+        nr_jobs = cpus;
+    if ( nr_jobs > POPULATE_MAX_THREADS )
+        nr_jobs = POPULATE_MAX_THREADS;
+    if ( nr_jobs == 0 )
+        nr_jobs = 1;
+
+    for ( i = 1; i <= nr_jobs; i++ )
+    {
+        idx = nr_pages;
+        if ( i < nr_jobs )
+        {
+            pfn = tmpl->page_array[start + i * (nr_pages - start) / nr_jobs];
+            pfn = (pfn + SUPERPAGE_1GB_NR_PFNS - 1) &
+                  ~(xen_pfn_t)(SUPERPAGE_1GB_NR_PFNS - 1);
+            idx = pfn_to_index(pfn, tmpl->mmio_start, tmpl->mmio_size);
+            if ( idx > nr_pages )
+                idx = nr_pages;
+        }
+        if ( idx <= prev && i < nr_jobs )
+            continue;
+        jobs[n] = *tmpl;
+        jobs[n].start = prev;
+        jobs[n].end = idx;
+        n++;
+        prev = idx;
+    }
+
+    return n;
+}
+
 static int setup_guest(xc_interface *xch,
                        uint32_t dom, struct xc_hvm_build_args *args,
                        char *image, unsigned long image_size)
@@ -243,7 +472,9 @@ static int setup_guest(xc_interface *xch,
     unsigned long target_pages = args->mem_target >> PAGE_SHIFT;
     uint64_t mmio_start = (1ull << 32) - args->mmio_size;
     uint64_t mmio_size = args->mmio_size;
-    unsigned long entry_eip, cur_pages, cur_pfn;
+    unsigned long entry_eip, load_end;
+    struct populate_job job = { 0 }, jobs[POPULATE_MAX_THREADS];
+    unsigned int nr_jobs;
     void *hvm_info_page;
     uint32_t *ident_pt;
     struct elf_binary elf;
@@ -318,142 +549,76 @@ static int setup_guest(xc_interface *xch,
         }
     }
 
-    /*
-     * Allocate memory for HVM guest, skipping VGA hole 0xA0000-0xC0000.
-     *
-     * We attempt to allocate 1GB pages if possible. It falls back on 2MB
-     * pages if 1GB allocation fails. 4KB pages will be used eventually if
-     * both fail.
-     * 
-     * Under 2MB mode, we allocate pages in batches of no more than 8MB to 
-     * ensure that we can be preempted and hence dom0 remains responsive.
-     */
+    /* Allocate memory for HVM guest, skipping VGA hole 0xA0000-0xC0000. */
     rc = xc_domain_populate_physmap_exact(
         xch, dom, 0xa0, 0, pod_mode, &page_array[0x00]);
-    cur_pages = 0xc0;
     stat_normal_pages = 0xc0;
 
-    /* try to claim pages for early warning of insufficient memory available */
-    if ( claim_enabled ) {
-        rc = xc_domain_claim_pages(xch, dom, nr_pages - cur_pages);
+    /*
+     * Claim the memory up front, so that we fail early if there is not
+     * enough, and so that domains built concurrently cannot take it from
+     * us halfway through.  Under PoD, setting the target has already
+     * allocated all the memory the guest will be backed with.
+     */
+    if ( rc == 0 && claim_enabled && !pod_mode )
+    {
+        rc = xc_domain_claim_pages(xch, dom, nr_pages - 0xc0);
         if ( rc != 0 )
         {
             PERROR("Could not allocate memory for HVM guest as we cannot claim memory!");
             goto error_out;
         }
     }
-    while ( (rc == 0) && (nr_pages > cur_pages) )
-    {
-        /* Clip count to maximum 1GB extent. */
-        unsigned long count = nr_pages - cur_pages;
-        unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
-
-        if ( count > max_pages )
-            count = max_pages;
-
-        cur_pfn = page_array[cur_pages];
-
-        /* Take care the corner cases of super page tails */
-        if ( ((cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
-             (count > (-cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1))) )
-            count = -cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1);
-        else if ( ((count & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
-                  (count > SUPERPAGE_1GB_NR_PFNS) )
-            count &= ~(SUPERPAGE_1GB_NR_PFNS - 1);
-
-        /* Attemp to allocate 1GB super page. Because in each pass we only
-         * allocate at most 1GB, we don't have to clip super page boundaries.
-         */
-        if ( ((count | cur_pfn) & (SUPERPAGE_1GB_NR_PFNS - 1)) == 0 &&
-             /* Check if there exists MMIO hole in the 1GB memory range */
-             !check_mmio_hole(cur_pfn << PAGE_SHIFT,
-                              SUPERPAGE_1GB_NR_PFNS << PAGE_SHIFT,
-                              mmio_start, mmio_size) )
-        {
-            long done;
-            unsigned long nr_extents = count >> SUPERPAGE_1GB_SHIFT;
-            xen_pfn_t sp_extents[nr_extents];
-
-            for ( i = 0; i < nr_extents; i++ )
-                sp_extents[i] = page_array[cur_pages+(i<<SUPERPAGE_1GB_SHIFT)];
-
-            done = xc_domain_populate_physmap(xch, dom, nr_extents, SUPERPAGE_1GB_SHIFT,
-                                              pod_mode, sp_extents);
-
-            if ( done > 0 )
-            {
-                stat_1gb_pages += done;
-                done <<= SUPERPAGE_1GB_SHIFT;
-                cur_pages += done;
-                count -= done;
-            }
-        }
-
-        if ( count != 0 )
-        {
-            /* Clip count to maximum 8MB extent. */
-            max_pages = SUPERPAGE_2MB_NR_PFNS * 4;
-            if ( count > max_pages )
-                count = max_pages;
-            
-            /* Clip partial superpage extents to superpage boundaries. */
-            if ( ((cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
-                 (count > (-cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1))) )
-                count = -cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1);
-            else if ( ((count & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
-                      (count > SUPERPAGE_2MB_NR_PFNS) )
-                count &= ~(SUPERPAGE_2MB_NR_PFNS - 1); /* clip non-s.p. tail */
-
-            /* Attempt to allocate superpage extents. */
-            if ( ((count | cur_pfn) & (SUPERPAGE_2MB_NR_PFNS - 1)) == 0 )
-            {
-                long done;
-                unsigned long nr_extents = count >> SUPERPAGE_2MB_SHIFT;
-                xen_pfn_t sp_extents[nr_extents];
-
-                for ( i = 0; i < nr_extents; i++ )
-                    sp_extents[i] = page_array[cur_pages+(i<<SUPERPAGE_2MB_SHIFT)];
-
-                done = xc_domain_populate_physmap(xch, dom, nr_extents, SUPERPAGE_2MB_SHIFT,
-                                                  pod_mode, sp_extents);
-
-                if ( done > 0 )
-                {
-                    stat_2mb_pages += done;
-                    done <<= SUPERPAGE_2MB_SHIFT;
-                    cur_pages += done;
-                    count -= done;
-                }
-            }
-        }
-
-        /* Fall back to 4kB extents. */
-        if ( count != 0 )
-        {
-            rc = xc_domain_populate_physmap_exact(
-                xch, dom, count, 0, pod_mode, &page_array[cur_pages]);
-            cur_pages += count;
-            stat_normal_pages += count;
-        }
-    }
-
     if ( rc != 0 )
     {
         PERROR("Could not allocate memory for HVM guest.");
         goto error_out;
     }
 
-    DPRINTF("PHYSICAL MEMORY ALLOCATION:\n"
+    /*
+     * The rest is populated in ranges, all but the first on threads of
+     * their own.  The first holds the loader and modules, so they are
+     * loaded while the others are still populating.
+     */
+    job.xch = xch;
+    job.dom = dom;
+    job.page_array = page_array;
+    job.mmio_start = mmio_start;
+    job.mmio_size = mmio_size;
+    job.pod_mode = pod_mode;
+    nr_jobs = populate_split(jobs, &job, 0xc0, nr_pages);
+    for ( i = 1; i < nr_jobs; i++ )
+        populate_start(&jobs[i]);
+    populate_range(&jobs[0]);
+
+    load_end = ((elf.pend > m_end ? elf.pend : m_end) + PAGE_SIZE - 1) >>
+               PAGE_SHIFT;
+    if ( jobs[0].rc == 0 && load_end > page_array[jobs[0].end - 1] + 1 )
+        for ( i = 1; i < nr_jobs; i++ )
+            populate_wait(&jobs[i]);
+
+    if ( jobs[0].rc == 0 &&
+         (loadelfimage(xch, &elf, dom, page_array) != 0 ||
+          loadmodules(xch, args, m_start, m_end, dom, page_array) != 0) )
+        jobs[0].rc = -1;
+
+    for ( i = 0; i < nr_jobs; i++ )
+    {
+        populate_wait(&jobs[i]);
+        if ( jobs[i].rc )
+            rc = jobs[i].rc;
+        stat_normal_pages += jobs[i].stat_normal_pages;
+        stat_2mb_pages += jobs[i].stat_2mb_pages;
+        stat_1gb_pages += jobs[i].stat_1gb_pages;
+    }
+    if ( rc != 0 )
+        goto error_out;
+
+    DPRINTF("PHYSICAL MEMORY ALLOCATION (%u threads):\n"
             "  4KB PAGES: 0x%016lx\n"
             "  2MB PAGES: 0x%016lx\n"
             "  1GB PAGES: 0x%016lx\n",
-            stat_normal_pages, stat_2mb_pages, stat_1gb_pages);
-    
-    if ( loadelfimage(xch, &elf, dom, page_array) != 0 )
-        goto error_out;
-
-    if ( loadmodules(xch, args, m_start, m_end, dom, page_array) != 0 )
-        goto error_out;    
+            nr_jobs, stat_normal_pages, stat_2mb_pages, stat_1gb_pages);
 
     if ( (hvm_info_page = xc_map_foreign_range(
               xch, dom, PAGE_SIZE, PROT_READ | PROT_WRITE,
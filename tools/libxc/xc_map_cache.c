@@ -0,0 +1,197 @@
+/******************************************************************************
+ * xc_map_cache.c
+ *
+ * A cache of mappings of foreign domains' memory, so that tools going
+ * back to the same guest memory over and over map it once rather than on
+ * each access.
+ *
+ * Memory is mapped in aligned chunks of XC_MAP_CACHE_CHUNK pages, and
+ * chunks are unmapped least recently used first once there are too many.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "xc_private.h"
+
+#define MAP_CACHE_HASH      64
+#define MAP_CACHE_DEFAULT   64      /* chunks, or 16MB */
+
+struct map_chunk {
+    uint32_t dom;
+    xen_pfn_t base;                 /* first gfn, chunk aligned */
+    int prot;
+    void *addr;
+    int err[XC_MAP_CACHE_CHUNK];    /* as from xc_map_foreign_bulk() */
+    struct map_chunk *hnext;        /* hash chain */
+    struct map_chunk *prev, *next;  /* most recently used first */
+};
+
+struct xc_map_cache {
+    xc_interface *xch;
+    unsigned int nr, max;
+    struct map_chunk *hash[MAP_CACHE_HASH];
+    struct map_chunk lru;
+    unsigned long hits, misses;
+};
+
+static unsigned int chunk_hash(uint32_t dom, xen_pfn_t base)
+{
+    return (dom ^ (base / XC_MAP_CACHE_CHUNK)) % MAP_CACHE_HASH;
+}
+
+static void lru_unlink(struct map_chunk *c)
+{
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+}
+
+static void lru_push(xc_map_cache_t *mc, struct map_chunk *c)
+{
+    c->prev = &mc->lru;
+    c->next = mc->lru.next;
+    c->next->prev = c;
+    mc->lru.next = c;
+}
+
+static void chunk_drop(xc_map_cache_t *mc, struct map_chunk *c)
+{
+    struct map_chunk **pp = &mc->hash[chunk_hash(c->dom, c->base)];
+
+    while ( *pp != c )
+        pp = &(*pp)->hnext;
+    *pp = c->hnext;
+
+    lru_unlink(c);
+    munmap(c->addr, XC_MAP_CACHE_CHUNK << XC_PAGE_SHIFT);
+    free(c);
+    mc->nr--;
+}
+
+xc_map_cache_t *xc_map_cache_create(xc_interface *xch,
+                                    unsigned int max_chunks)
+{
+    xc_map_cache_t *mc = calloc(1, sizeof(*mc));
+
+    if ( !mc )
+        return NULL;
+
+    mc->xch = xch;
+    mc->max = max_chunks ? max_chunks : MAP_CACHE_DEFAULT;
+    mc->lru.prev = mc->lru.next = &mc->lru;
+
+    return mc;
+}
+
+void xc_map_cache_destroy(xc_map_cache_t *mc)
+{
+    xc_interface *xch;
+
+    if ( !mc )
+        return;
+
+    xch = mc->xch;
+    DPRINTF("map cache: %lu hits, %lu misses\n", mc->hits, mc->misses);
+
+    while ( mc->lru.next != &mc->lru )
+        chunk_drop(mc, mc->lru.next);
+    free(mc);
+}
+
+void *xc_map_cache_get(xc_map_cache_t *mc, uint32_t dom, xen_pfn_t gfn,
+                       int prot)
+{
+    xen_pfn_t base = gfn & ~(xen_pfn_t)(XC_MAP_CACHE_CHUNK - 1);
+    unsigned int h = chunk_hash(dom, base), i;
+    xen_pfn_t pfns[XC_MAP_CACHE_CHUNK];
+    struct map_chunk *c;
+
+    for ( c = mc->hash[h]; c; c = c->hnext )
+        if ( c->dom == dom && c->base == base )
+            break;
+
+    /* Mapped, but not for writing, or not this page: map it again */
+    if ( c && ((prot & ~c->prot) || c->err[gfn - base]) )
+    {
+        prot |= c->prot;
+        chunk_drop(mc, c);
+        c = NULL;
+    }
+
+    if ( c )
+    {
+        mc->hits++;
+        lru_unlink(c);
+        lru_push(mc, c);
+    }
+    else
+    {
+        mc->misses++;
+        if ( mc->nr >= mc->max )
+            chunk_drop(mc, mc->lru.prev);
+
+        c = malloc(sizeof(*c));
+        if ( !c )
+            return NULL;
+        for ( i = 0; i < XC_MAP_CACHE_CHUNK; i++ )
+            pfns[i] = base + i;
+        c->addr = xc_map_foreign_bulk(mc->xch, dom, prot, pfns, c->err,
+                                      XC_MAP_CACHE_CHUNK);
+        if ( !c->addr )
+        {
+            free(c);
+            return NULL;
+        }
+        c->dom = dom;
+        c->base = base;
+        c->prot = prot;
+        c->hnext = mc->hash[h];
+        mc->hash[h] = c;
+        lru_push(mc, c);
+        mc->nr++;
+    }
+
+    i = gfn - base;
+    if ( c->err[i] )
+    {
+        errno = -c->err[i];
+        return NULL;
+    }
+
+    return c->addr + ((unsigned long)i << XC_PAGE_SHIFT);
+}
+
+void xc_map_cache_invalidate(xc_map_cache_t *mc, uint32_t dom,
+                             xen_pfn_t gfn, unsigned long nr)
+{
+    struct map_chunk *c, *next;
+
+    for ( c = mc->lru.next; c != &mc->lru; c = next )
+    {
+        next = c->next;
+        if ( c->dom == dom && c->base + XC_MAP_CACHE_CHUNK > gfn &&
+             (c->base <= gfn || c->base - gfn < nr) )
+            chunk_drop(mc, c);
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -26,6 +26,13 @@
 
 int xc_mem_access_enable(xc_interface *xch, domid_t domain_id,
                          uint32_t *port)
+{
+    return xc_mem_access_enable_ring(xch, domain_id, 1, 0, port);
+}
+
+int xc_mem_access_enable_ring(xc_interface *xch, domid_t domain_id,
+                              unsigned int ring_pages, unsigned int flags,
+                              uint32_t *port)
 {
     if ( !port )
     {
@@ -36,7 +43,7 @@ int xc_mem_access_enable(xc_interface *xch, domid_t domain_id,
     return xc_mem_event_control(xch, domain_id,
                                 XEN_DOMCTL_MEM_EVENT_OP_ACCESS_ENABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_ACCESS,
-                                port);
+                                ring_pages, flags, port);
 }
 
 int xc_mem_access_disable(xc_interface *xch, domid_t domain_id)
@@ -44,7 +51,7 @@ int xc_mem_access_disable(xc_interface *xch, domid_t domain_id)
     return xc_mem_event_control(xch, domain_id,
                                 XEN_DOMCTL_MEM_EVENT_OP_ACCESS_DISABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_ACCESS,
-                                NULL);
+                                0, 0, NULL);
 }
 
 int xc_mem_access_resume(xc_interface *xch, domid_t domain_id, unsigned long gfn)
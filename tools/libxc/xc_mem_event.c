@@ -24,7 +24,8 @@
 #include "xc_private.h"
 
 int xc_mem_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
-                         unsigned int mode, uint32_t *port)
+                         unsigned int mode, unsigned int ring_pages,
+                         unsigned int flags, uint32_t *port)
 {
     DECLARE_DOMCTL;
     int rc;
@@ -33,6 +34,8 @@ int xc_mem_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
     domctl.domain = domain_id;
     domctl.u.mem_event_op.op = op;
     domctl.u.mem_event_op.mode = mode;
+    domctl.u.mem_event_op.ring_pages = ring_pages;
+    domctl.u.mem_event_op.flags = flags;
     
     rc = do_domctl(xch, &domctl);
     if ( !rc && port )
@@ -56,3 +59,65 @@ int xc_mem_event_memop(xc_interface *xch, domid_t domain_id,
     return do_memory_op(xch, mode, &meo, sizeof(meo));
 }
 
+void *xc_mem_event_map_ring(xc_interface *xch, domid_t domain_id, int param,
+                            unsigned int ring_pages, xen_pfn_t *ring_pfn)
+{
+    unsigned long pfn;
+    xen_pfn_t *pfns;
+    void *ring = NULL;
+    unsigned int i;
+    int rc;
+
+    if ( ring_pages > 1 )
+    {
+        /*
+         * The domain builder only sets aside a page per ring.  Nothing
+         * above the guest's highest gfn is in use, so put bigger rings
+         * there instead.
+         */
+        rc = xc_domain_maximum_gpfn(xch, domain_id);
+        if ( rc < 0 )
+            return NULL;
+        pfn = rc + 1;
+        if ( xc_set_hvm_param(xch, domain_id, param, pfn) )
+            return NULL;
+    }
+    else if ( xc_get_hvm_param(xch, domain_id, param, &pfn) )
+        return NULL;
+
+    pfns = malloc(ring_pages * sizeof(*pfns));
+    if ( !pfns )
+        return NULL;
+
+    for ( i = 0; i < ring_pages; i++ )
+        pfns[i] = pfn + i;
+    ring = xc_map_foreign_pages(xch, domain_id, PROT_READ | PROT_WRITE,
+                                pfns, ring_pages);
+    if ( !ring )
+    {
+        /* Map failed, populate the ring pages */
+        rc = xc_domain_populate_physmap_exact(xch, domain_id, ring_pages,
+                                              0, 0, pfns);
+        if ( rc != 0 )
+        {
+            PERROR("Failed to populate ring gfns");
+            goto out;
+        }
+
+        for ( i = 0; i < ring_pages; i++ )
+            pfns[i] = pfn + i;
+        ring = xc_map_foreign_pages(xch, domain_id, PROT_READ | PROT_WRITE,
+                                    pfns, ring_pages);
+        if ( !ring )
+        {
+            PERROR("Could not map the ring pages");
+            goto out;
+        }
+    }
+
+    *ring_pfn = pfn;
+
+ out:
+    free(pfns);
+    return ring;
+}
@@ -26,6 +26,13 @@
 
 int xc_mem_paging_enable(xc_interface *xch, domid_t domain_id,
                          uint32_t *port)
+{
+    return xc_mem_paging_enable_ring(xch, domain_id, 1, 0, port);
+}
+
+int xc_mem_paging_enable_ring(xc_interface *xch, domid_t domain_id,
+                              unsigned int ring_pages, unsigned int flags,
+                              uint32_t *port)
 {
     if ( !port )
     {
@@ -36,7 +43,7 @@ int xc_mem_paging_enable(xc_interface *xch, domid_t domain_id,
     return xc_mem_event_control(xch, domain_id,
                                 XEN_DOMCTL_MEM_EVENT_OP_PAGING_ENABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_PAGING,
-                                port);
+                                ring_pages, flags, port);
 }
 
 int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id)
@@ -44,7 +51,7 @@ int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id)
     return xc_mem_event_control(xch, domain_id,
                                 XEN_DOMCTL_MEM_EVENT_OP_PAGING_DISABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_PAGING,
-                                NULL);
+                                0, 0, NULL);
 }
 
 int xc_mem_paging_nominate(xc_interface *xch, domid_t domain_id, unsigned long gfn)
@@ -63,6 +70,48 @@ int xc_mem_paging_evict(xc_interface *xch, domid_t domain_id, unsigned long gfn)
                                 gfn, NULL);
 }
 
+static int mem_paging_batch(xc_interface *xch, domid_t domain_id,
+                            unsigned int op, xen_mem_paging_batch_t *batch,
+                            unsigned int nr)
+{
+    DECLARE_HYPERCALL_BOUNCE(batch, nr * sizeof(*batch),
+                             XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+    int rc;
+
+    if ( nr > XENMEM_PAGING_BATCH_MAX )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( xc_hypercall_bounce_pre(xch, batch) )
+        return -1;
+
+    /* The count travels in the gfn field. */
+    rc = xc_mem_event_memop(xch, domain_id, op, XENMEM_paging_op, nr,
+                            (void *)HYPERCALL_BUFFER_AS_ARG(batch));
+
+    xc_hypercall_bounce_post(xch, batch);
+
+    return rc;
+}
+
+int xc_mem_paging_nominate_batch(xc_interface *xch, domid_t domain_id,
+                                 xen_mem_paging_batch_t *batch,
+                                 unsigned int nr)
+{
+    return mem_paging_batch(xch, domain_id, XENMEM_paging_op_nominate_batch,
+                            batch, nr);
+}
+
+int xc_mem_paging_evict_batch(xc_interface *xch, domid_t domain_id,
+                              xen_mem_paging_batch_t *batch,
+                              unsigned int nr)
+{
+    return mem_paging_batch(xch, domain_id, XENMEM_paging_op_evict_batch,
+                            batch, nr);
+}
+
 int xc_mem_paging_prep(xc_interface *xch, domid_t domain_id, unsigned long gfn)
 {
     return xc_mem_event_memop(xch, domain_id,
@@ -55,7 +55,7 @@ int xc_memshr_ring_enable(xc_interface *xch,
     return xc_mem_event_control(xch, domid,
                                 XEN_DOMCTL_MEM_EVENT_OP_SHARING_ENABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_SHARING,
-                                port);
+                                1, 0, port);
 }
 
 int xc_memshr_ring_disable(xc_interface *xch, 
@@ -64,7 +64,7 @@ int xc_memshr_ring_disable(xc_interface *xch,
     return xc_mem_event_control(xch, domid,
                                 XEN_DOMCTL_MEM_EVENT_OP_SHARING_DISABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_SHARING,
-                                NULL);
+                                0, 0, NULL);
 }
 
 static int xc_memshr_memop(xc_interface *xch, domid_t domid, 
@@ -222,6 +222,76 @@ int xc_memshr_debug_gref(xc_interface *xch,
     return xc_memshr_memop(xch, domid, &mso);
 }
 
+int xc_memshr_hash_range(xc_interface *xch,
+                         domid_t domid,
+                         uint64_t *first_gfn,
+                         uint64_t last_gfn,
+                         xen_mem_sharing_hash_t *hashes,
+                         uint32_t *nr_hashes)
+{
+    int rc;
+    xen_mem_sharing_op_t mso;
+    DECLARE_HYPERCALL_BOUNCE(hashes, *nr_hashes * sizeof(*hashes),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, hashes) )
+        return -1;
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_hash_range;
+    mso.u.hash_range.first_gfn = *first_gfn;
+    mso.u.hash_range.last_gfn = last_gfn;
+    mso.u.hash_range.nr_hashes = *nr_hashes;
+    set_xen_guest_handle(mso.u.hash_range.hashes, hashes);
+
+    rc = xc_memshr_memop(xch, domid, &mso);
+
+    xc_hypercall_bounce_post(xch, hashes);
+
+    if ( !rc )
+    {
+        *first_gfn = mso.u.hash_range.first_gfn;
+        *nr_hashes = mso.u.hash_range.nr_hashes;
+    }
+
+    return rc;
+}
+
+int xc_memshr_fork_range(xc_interface *xch,
+                         domid_t source_domain,
+                         domid_t client_domain,
+                         uint64_t first_gfn,
+                         uint64_t last_gfn,
+                         uint64_t *nr_shared)
+{
+    xen_mem_sharing_op_t mso;
+    int rc;
+
+    if ( nr_shared )
+        *nr_shared = 0;
+
+    do {
+        memset(&mso, 0, sizeof(mso));
+
+        mso.op = XENMEM_sharing_op_fork_range;
+        mso.u.fork_range.first_gfn = first_gfn;
+        mso.u.fork_range.last_gfn = last_gfn;
+        mso.u.fork_range.client_domain = client_domain;
+
+        rc = xc_memshr_memop(xch, source_domain, &mso);
+        if ( rc )
+            return rc;
+
+        first_gfn = mso.u.fork_range.first_gfn;
+        last_gfn = mso.u.fork_range.last_gfn;
+        if ( nr_shared )
+            *nr_shared += mso.u.fork_range.nr_shared;
+    } while ( first_gfn <= last_gfn );
+
+    return 0;
+}
+
 int xc_memshr_audit(xc_interface *xch)
 {
     xen_mem_sharing_op_t mso;
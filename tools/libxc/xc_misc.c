@@ -285,6 +285,7 @@ int xc_lockprof_reset(xc_interface *xch)
     sysctl.cmd = XEN_SYSCTL_lockprof_op;
     sysctl.u.lockprof_op.cmd = XEN_SYSCTL_LOCKPROF_reset;
     set_xen_guest_handle(sysctl.u.lockprof_op.data, HYPERCALL_BUFFER_NULL);
+    set_xen_guest_handle(sysctl.u.lockprof_op.cpu_data, HYPERCALL_BUFFER_NULL);
 
     return do_sysctl(xch, &sysctl);
 }
@@ -298,6 +299,7 @@ int xc_lockprof_query_number(xc_interface *xch,
     sysctl.cmd = XEN_SYSCTL_lockprof_op;
     sysctl.u.lockprof_op.cmd = XEN_SYSCTL_LOCKPROF_query;
     set_xen_guest_handle(sysctl.u.lockprof_op.data, HYPERCALL_BUFFER_NULL);
+    set_xen_guest_handle(sysctl.u.lockprof_op.cpu_data, HYPERCALL_BUFFER_NULL);
 
     rc = do_sysctl(xch, &sysctl);
 
@@ -319,6 +321,7 @@ int xc_lockprof_query(xc_interface *xch,
     sysctl.u.lockprof_op.cmd = XEN_SYSCTL_LOCKPROF_query;
     sysctl.u.lockprof_op.max_elem = *n_elems;
     set_xen_guest_handle(sysctl.u.lockprof_op.data, data);
+    set_xen_guest_handle(sysctl.u.lockprof_op.cpu_data, HYPERCALL_BUFFER_NULL);
 
     rc = do_sysctl(xch, &sysctl);
 
@@ -327,6 +330,43 @@ int xc_lockprof_query(xc_interface *xch,
     return rc;
 }
 
+int xc_lockprof_query_cpus(xc_interface *xch,
+                           uint32_t *n_cpus,
+                           uint32_t *sample,
+                           struct xc_hypercall_buffer *data)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(data);
+
+    sysctl.cmd = XEN_SYSCTL_lockprof_op;
+    sysctl.u.lockprof_op.cmd = XEN_SYSCTL_LOCKPROF_query;
+    sysctl.u.lockprof_op.max_elem = 0;
+    sysctl.u.lockprof_op.max_cpu = *n_cpus;
+    set_xen_guest_handle(sysctl.u.lockprof_op.data, HYPERCALL_BUFFER_NULL);
+    set_xen_guest_handle(sysctl.u.lockprof_op.cpu_data, data);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    *n_cpus = sysctl.u.lockprof_op.max_cpu;
+    *sample = sysctl.u.lockprof_op.sample;
+
+    return rc;
+}
+
+int xc_lockprof_set_sample(xc_interface *xch, uint32_t sample)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_lockprof_op;
+    sysctl.u.lockprof_op.cmd = XEN_SYSCTL_LOCKPROF_sample;
+    sysctl.u.lockprof_op.sample = sample;
+    set_xen_guest_handle(sysctl.u.lockprof_op.data, HYPERCALL_BUFFER_NULL);
+    set_xen_guest_handle(sysctl.u.lockprof_op.cpu_data, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
 int xc_getcpuinfo(xc_interface *xch, int max_cpus,
                   xc_cpuinfo_t *info, int *nr_cpus)
 {
@@ -351,6 +391,226 @@ int xc_getcpuinfo(xc_interface *xch, int max_cpus,
     return rc;
 }
 
+int xc_sched_hist_get(xc_interface *xch, uint32_t type, uint32_t domid,
+                      uint32_t id, int reset, xc_sched_hist_t *hist)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(hist, sizeof(*hist), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, hist) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_sched_hist;
+    sysctl.u.sched_hist.type = type;
+    sysctl.u.sched_hist.id = id;
+    sysctl.u.sched_hist.domid = domid;
+    sysctl.u.sched_hist.reset = !!reset;
+    set_xen_guest_handle(sysctl.u.sched_hist.data, hist);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, hist);
+
+    return rc;
+}
+
+int xc_hypercall_stats_get(xc_interface *xch, xc_hypercall_stats_t *stats,
+                           unsigned int nr, int *enabled)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(stats, nr * sizeof(*stats),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, stats) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_hypercall_stats;
+    sysctl.u.hypercall_stats.cmd = XEN_SYSCTL_HYPERCALL_STATS_get;
+    sysctl.u.hypercall_stats.nr_hypercalls = nr;
+    set_xen_guest_handle(sysctl.u.hypercall_stats.buffer, stats);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, stats);
+
+    if ( rc )
+        return -1;
+
+    if ( enabled )
+        *enabled = sysctl.u.hypercall_stats.enabled;
+
+    return sysctl.u.hypercall_stats.nr_hypercalls;
+}
+
+int xc_hypercall_stats_control(xc_interface *xch, uint32_t cmd)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_hypercall_stats;
+    sysctl.u.hypercall_stats.cmd = cmd;
+    sysctl.u.hypercall_stats.nr_hypercalls = 0;
+    set_xen_guest_handle(sysctl.u.hypercall_stats.buffer,
+                         HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+static int livepatch_set_name(xc_interface *xch, struct xen_sysctl *sysctl,
+                              uint32_t cmd, const char *name)
+{
+    sysctl->cmd = XEN_SYSCTL_livepatch_op;
+    memset(&sysctl->u.livepatch_op, 0, sizeof(sysctl->u.livepatch_op));
+    sysctl->u.livepatch_op.cmd = cmd;
+
+    if ( !name )
+        return 0;
+
+    if ( strlen(name) >= sizeof(sysctl->u.livepatch_op.name) )
+    {
+        ERROR("Live patch name too long: %s", name);
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(sysctl->u.livepatch_op.name, name);
+
+    return 0;
+}
+
+int xc_livepatch_upload(xc_interface *xch, const char *name,
+                        const void *payload, size_t size)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_NAMED_HYPERCALL_BOUNCE(buf, (void *)payload, size,
+                                   XC_HYPERCALL_BUFFER_BOUNCE_IN);
+
+    if ( livepatch_set_name(xch, &sysctl, XEN_SYSCTL_LIVEPATCH_upload, name) )
+        return -1;
+
+    if ( xc_hypercall_bounce_pre(xch, buf) )
+        return -1;
+
+    sysctl.u.livepatch_op.u.upload.size = size;
+    set_xen_guest_handle(sysctl.u.livepatch_op.u.upload.payload, buf);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, buf);
+
+    return rc;
+}
+
+int xc_livepatch_get(xc_interface *xch, const char *name,
+                     uint32_t *state, int32_t *rc)
+{
+    DECLARE_SYSCTL;
+
+    if ( livepatch_set_name(xch, &sysctl, XEN_SYSCTL_LIVEPATCH_get, name) ||
+         do_sysctl(xch, &sysctl) )
+        return -1;
+
+    *state = sysctl.u.livepatch_op.u.get.state;
+    *rc = sysctl.u.livepatch_op.u.get.rc;
+
+    return 0;
+}
+
+int xc_livepatch_list(xc_interface *xch, unsigned int idx, unsigned int nr,
+                      xc_livepatch_status_t *status, unsigned int *total)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(status, nr * sizeof(*status),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    livepatch_set_name(xch, &sysctl, XEN_SYSCTL_LIVEPATCH_list, NULL);
+
+    if ( xc_hypercall_bounce_pre(xch, status) )
+        return -1;
+
+    sysctl.u.livepatch_op.u.list.idx = idx;
+    sysctl.u.livepatch_op.u.list.nr = nr;
+    set_xen_guest_handle(sysctl.u.livepatch_op.u.list.status, status);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, status);
+
+    if ( rc )
+        return -1;
+
+    if ( total )
+        *total = sysctl.u.livepatch_op.u.list.total;
+
+    return sysctl.u.livepatch_op.u.list.nr;
+}
+
+int xc_livepatch_action(xc_interface *xch, const char *name,
+                        uint32_t action)
+{
+    DECLARE_SYSCTL;
+
+    if ( livepatch_set_name(xch, &sysctl, XEN_SYSCTL_LIVEPATCH_action, name) )
+        return -1;
+
+    sysctl.u.livepatch_op.u.action.action = action;
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_domain_perf_get(xc_interface *xch, uint32_t domid, uint32_t vcpu,
+                       int reset, xc_domain_perf_t *perf)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(perf, sizeof(*perf), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, perf) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_domain_perf;
+    sysctl.u.domain_perf.domid = domid;
+    sysctl.u.domain_perf.vcpu = vcpu;
+    sysctl.u.domain_perf.reset = !!reset;
+    set_xen_guest_handle(sysctl.u.domain_perf.data, perf);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, perf);
+
+    return rc;
+}
+
+int xc_vcpu_sched_stats(xc_interface *xch, uint32_t first_domain,
+                        unsigned int max_vcpus, xc_vcpu_sched_stats_t *stats,
+                        uint32_t *next_domain)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(stats, max_vcpus * sizeof(*stats),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, stats) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_vcpu_sched_stats;
+    sysctl.u.vcpu_sched_stats.first_domain = first_domain;
+    sysctl.u.vcpu_sched_stats.max_vcpus = max_vcpus;
+    set_xen_guest_handle(sysctl.u.vcpu_sched_stats.buffer, stats);
+
+    rc = do_sysctl(xch, &sysctl);
+    if ( rc == 0 )
+    {
+        rc = sysctl.u.vcpu_sched_stats.num_vcpus;
+        *next_domain = sysctl.u.vcpu_sched_stats.next_domain;
+    }
+
+    xc_hypercall_bounce_post(xch, stats);
+
+    return rc;
+}
 
 int xc_hvm_set_pci_intx_level(
     xc_interface *xch, domid_t dom,
@@ -475,6 +735,171 @@ int xc_hvm_inject_msi(
     return rc;
 }
 
+static int xc_hvm_fast_io_op(
+    xc_interface *xch, unsigned long op, domid_t dom, uint8_t space,
+    uint8_t mode, uint64_t start, uint64_t size, uint64_t *value,
+    evtchn_port_t *port)
+{
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BUFFER(struct xen_hvm_fast_io, arg);
+    int rc;
+
+    arg = xc_hypercall_buffer_alloc(xch, arg, sizeof(*arg));
+    if ( arg == NULL )
+    {
+        PERROR("Could not allocate memory for fast I/O hypercall");
+        return -1;
+    }
+
+    hypercall.op     = __HYPERVISOR_hvm_op;
+    hypercall.arg[0] = op;
+    hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
+
+    arg->domid = dom;
+    arg->space = space;
+    arg->mode  = mode;
+    arg->start = start;
+    arg->size  = size;
+    arg->value = value ? *value : 0;
+
+    rc = do_xen_hypercall(xch, &hypercall);
+
+    if ( !rc )
+    {
+        if ( port )
+            *port = arg->port;
+        if ( value )
+            *value = arg->value;
+    }
+
+    xc_hypercall_buffer_free(xch, arg);
+
+    return rc;
+}
+
+int xc_hvm_set_fast_io(
+    xc_interface *xch, domid_t dom, uint8_t space, uint8_t mode,
+    uint64_t start, uint64_t size, uint64_t value, evtchn_port_t *port)
+{
+    return xc_hvm_fast_io_op(xch, HVMOP_set_fast_io, dom, space, mode,
+                             start, size, &value, port);
+}
+
+int xc_hvm_get_fast_io(
+    xc_interface *xch, domid_t dom, uint8_t space,
+    uint64_t start, uint64_t size, uint64_t *value)
+{
+    return xc_hvm_fast_io_op(xch, HVMOP_get_fast_io, dom, space, 0,
+                             start, size, value, NULL);
+}
+
+int xc_hvm_create_ioreq_server(
+    xc_interface *xch, domid_t dom, uint64_t ioreq_pfn, ioservid_t *id)
+{
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BUFFER(xen_hvm_create_ioreq_server_t, arg);
+    int rc;
+
+    arg = xc_hypercall_buffer_alloc(xch, arg, sizeof(*arg));
+    if ( arg == NULL )
+    {
+        PERROR("Could not allocate memory for create_ioreq_server hypercall");
+        return -1;
+    }
+
+    hypercall.op     = __HYPERVISOR_hvm_op;
+    hypercall.arg[0] = HVMOP_create_ioreq_server;
+    hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
+
+    arg->domid     = dom;
+    arg->ioreq_pfn = ioreq_pfn;
+
+    rc = do_xen_hypercall(xch, &hypercall);
+
+    if ( !rc )
+        *id = arg->id;
+
+    xc_hypercall_buffer_free(xch, arg);
+
+    return rc;
+}
+
+static int xc_hvm_io_range_op(
+    xc_interface *xch, unsigned long op, domid_t dom, ioservid_t id,
+    uint32_t type, uint64_t start, uint64_t end)
+{
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BUFFER(xen_hvm_io_range_t, arg);
+    int rc;
+
+    arg = xc_hypercall_buffer_alloc(xch, arg, sizeof(*arg));
+    if ( arg == NULL )
+    {
+        PERROR("Could not allocate memory for ioreq server range hypercall");
+        return -1;
+    }
+
+    hypercall.op     = __HYPERVISOR_hvm_op;
+    hypercall.arg[0] = op;
+    hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
+
+    arg->domid = dom;
+    arg->id    = id;
+    arg->type  = type;
+    arg->start = start;
+    arg->end   = end;
+
+    rc = do_xen_hypercall(xch, &hypercall);
+
+    xc_hypercall_buffer_free(xch, arg);
+
+    return rc;
+}
+
+int xc_hvm_map_io_range_to_ioreq_server(
+    xc_interface *xch, domid_t dom, ioservid_t id,
+    uint32_t type, uint64_t start, uint64_t end)
+{
+    return xc_hvm_io_range_op(xch, HVMOP_map_io_range_to_ioreq_server,
+                              dom, id, type, start, end);
+}
+
+int xc_hvm_unmap_io_range_from_ioreq_server(
+    xc_interface *xch, domid_t dom, ioservid_t id,
+    uint32_t type, uint64_t start, uint64_t end)
+{
+    return xc_hvm_io_range_op(xch, HVMOP_unmap_io_range_from_ioreq_server,
+                              dom, id, type, start, end);
+}
+
+int xc_hvm_destroy_ioreq_server(
+    xc_interface *xch, domid_t dom, ioservid_t id)
+{
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BUFFER(xen_hvm_destroy_ioreq_server_t, arg);
+    int rc;
+
+    arg = xc_hypercall_buffer_alloc(xch, arg, sizeof(*arg));
+    if ( arg == NULL )
+    {
+        PERROR("Could not allocate memory for destroy_ioreq_server hypercall");
+        return -1;
+    }
+
+    hypercall.op     = __HYPERVISOR_hvm_op;
+    hypercall.arg[0] = HVMOP_destroy_ioreq_server;
+    hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
+
+    arg->domid = dom;
+    arg->id    = id;
+
+    rc = do_xen_hypercall(xch, &hypercall);
+
+    xc_hypercall_buffer_free(xch, arg);
+
+    return rc;
+}
+
 int xc_hvm_track_dirty_vram(
     xc_interface *xch, domid_t dom,
     uint64_t first_pfn, uint64_t nr,
@@ -0,0 +1,394 @@
+/******************************************************************************
+ * xc_multicall.c
+ *
+ * Batch hypercalls into one __HYPERVISOR_multicall, so that a tool asking
+ * many small questions of Xen pays for one trip rather than one each.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "xc_private.h"
+
+/*
+ * A call queued.  Argument data given to xc_multicall_add_buffer() is
+ * copied into the hypercall buffer at [off, off + len) when the batch is
+ * executed, its address passed as the first argument, and copied back
+ * to the caller afterwards.
+ */
+struct multicall_call {
+    unsigned long op;
+    unsigned long args[6];
+    void *data;
+    size_t len, off;
+    long result;
+};
+
+struct xc_multicall {
+    xc_interface *xch;
+    unsigned int nr, max;
+    size_t data_len;
+    struct multicall_call *calls;
+};
+
+/* Keep argument data aligned as the hypervisor expects */
+#define MULTICALL_DATA_ALIGN 8
+
+xc_multicall_t *xc_multicall_create(xc_interface *xch)
+{
+    xc_multicall_t *mc = calloc(1, sizeof(*mc));
+
+    if ( mc == NULL )
+        return NULL;
+    mc->xch = xch;
+
+    return mc;
+}
+
+void xc_multicall_destroy(xc_multicall_t *mc)
+{
+    if ( mc == NULL )
+        return;
+    free(mc->calls);
+    free(mc);
+}
+
+void xc_multicall_reset(xc_multicall_t *mc)
+{
+    mc->nr = 0;
+    mc->data_len = 0;
+}
+
+static struct multicall_call *multicall_new(xc_multicall_t *mc)
+{
+    xc_interface *xch = mc->xch;
+    struct multicall_call *calls;
+
+    if ( mc->nr == mc->max )
+    {
+        unsigned int max = mc->max ? mc->max * 2 : 16;
+
+        calls = realloc(mc->calls, max * sizeof(*calls));
+        if ( calls == NULL )
+        {
+            PERROR("Could not grow multicall batch");
+            return NULL;
+        }
+        mc->calls = calls;
+        mc->max = max;
+    }
+
+    calls = &mc->calls[mc->nr];
+    memset(calls, 0, sizeof(*calls));
+    calls->result = -ENODATA;
+
+    return calls;
+}
+
+int xc_multicall_add(xc_multicall_t *mc, unsigned long op,
+                     unsigned long arg0, unsigned long arg1,
+                     unsigned long arg2, unsigned long arg3,
+                     unsigned long arg4)
+{
+    struct multicall_call *call = multicall_new(mc);
+
+    if ( call == NULL )
+        return -1;
+
+    call->op = op;
+    call->args[0] = arg0;
+    call->args[1] = arg1;
+    call->args[2] = arg2;
+    call->args[3] = arg3;
+    call->args[4] = arg4;
+
+    return mc->nr++;
+}
+
+int xc_multicall_add_buffer(xc_multicall_t *mc, unsigned long op,
+                            void *data, size_t len,
+                            unsigned long arg1, unsigned long arg2)
+{
+    struct multicall_call *call = multicall_new(mc);
+
+    if ( call == NULL )
+        return -1;
+
+    call->op = op;
+    call->args[1] = arg1;
+    call->args[2] = arg2;
+    call->data = data;
+    call->len = len;
+    call->off = mc->data_len;
+    mc->data_len += (len + MULTICALL_DATA_ALIGN - 1) &
+                    ~(size_t)(MULTICALL_DATA_ALIGN - 1);
+
+    return mc->nr++;
+}
+
+int xc_multicall_add_domctl(xc_multicall_t *mc, struct xen_domctl *domctl)
+{
+    domctl->interface_version = XEN_DOMCTL_INTERFACE_VERSION;
+    return xc_multicall_add_buffer(mc, __HYPERVISOR_domctl,
+                                   domctl, sizeof(*domctl), 0, 0);
+}
+
+int xc_multicall_add_sysctl(xc_multicall_t *mc, struct xen_sysctl *sysctl)
+{
+    sysctl->interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    return xc_multicall_add_buffer(mc, __HYPERVISOR_sysctl,
+                                   sysctl, sizeof(*sysctl), 0, 0);
+}
+
+int xc_multicall_execute(xc_multicall_t *mc)
+{
+    xc_interface *xch = mc->xch;
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BUFFER(multicall_entry_t, entries);
+    DECLARE_HYPERCALL_BUFFER(uint8_t, data);
+    unsigned int i;
+    int rc = -1;
+
+    if ( mc->nr == 0 )
+        return 0;
+
+    entries = xc_hypercall_buffer_alloc(xch, entries,
+                                        mc->nr * sizeof(*entries));
+    if ( entries == NULL )
+    {
+        PERROR("Could not allocate multicall entries");
+        return -1;
+    }
+    if ( mc->data_len )
+    {
+        data = xc_hypercall_buffer_alloc(xch, data, mc->data_len);
+        if ( data == NULL )
+        {
+            PERROR("Could not allocate multicall data");
+            goto out;
+        }
+    }
+
+    for ( i = 0; i < mc->nr; i++ )
+    {
+        struct multicall_call *call = &mc->calls[i];
+
+        entries[i].op = call->op;
+        entries[i].result = 0;
+        memcpy(entries[i].args, call->args, sizeof(entries[i].args));
+        if ( call->data )
+        {
+            memcpy(data + call->off, call->data, call->len);
+            entries[i].args[0] = (unsigned long)(data + call->off);
+        }
+    }
+
+    hypercall.op     = __HYPERVISOR_multicall;
+    hypercall.arg[0] = HYPERCALL_BUFFER_AS_ARG(entries);
+    hypercall.arg[1] = mc->nr;
+    if ( (rc = do_xen_hypercall(xch, &hypercall)) < 0 )
+    {
+        PERROR("multicall of %u calls failed", mc->nr);
+        goto out;
+    }
+
+    for ( i = 0; i < mc->nr; i++ )
+    {
+        struct multicall_call *call = &mc->calls[i];
+
+        call->result = (long)entries[i].result;
+        if ( call->data )
+            memcpy(call->data, data + call->off, call->len);
+    }
+    rc = 0;
+
+ out:
+    xc_hypercall_buffer_free(xch, data);
+    xc_hypercall_buffer_free(xch, entries);
+    return rc;
+}
+
+long xc_multicall_result(xc_multicall_t *mc, unsigned int idx)
+{
+    if ( idx >= mc->nr )
+        return -EINVAL;
+    return mc->calls[idx].result;
+}
+
+/*
+ * Batched forms of common queries.  Each takes one trip into Xen for all
+ * of its domains, and reports per-domain failures in err[] (as errno
+ * values, 0 for success) if given, or fails the whole call if not.
+ */
+
+static int multicall_errors(xc_multicall_t *mc, const int *idx,
+                            unsigned int nr, int *err)
+{
+    unsigned int i;
+    long res;
+    int rc = 0;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        res = xc_multicall_result(mc, idx[i]);
+        if ( err )
+            err[i] = -res;
+        else if ( res && !rc )
+        {
+            errno = -res;
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+int xc_domain_getinfo_batch(xc_interface *xch, const uint32_t *domids,
+                            unsigned int nr, xc_dominfo_t *info, int *err)
+{
+    xc_multicall_t *mc = xc_multicall_create(xch);
+    struct xen_domctl *domctls = calloc(nr, sizeof(*domctls));
+    int *idx = calloc(nr, sizeof(*idx));
+    unsigned int i;
+    int rc = -1;
+
+    if ( mc == NULL || domctls == NULL || idx == NULL )
+    {
+        PERROR("Could not allocate batch of %u domains", nr);
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        domctls[i].cmd = XEN_DOMCTL_getdomaininfo;
+        domctls[i].domain = (domid_t)domids[i];
+        if ( (idx[i] = xc_multicall_add_domctl(mc, &domctls[i])) < 0 )
+            goto out;
+    }
+
+    if ( xc_multicall_execute(mc) )
+        goto out;
+
+    memset(info, 0, nr * sizeof(*info));
+    for ( i = 0; i < nr; i++ )
+    {
+        /* getdomaininfo returns the next domain up if this one is gone */
+        if ( xc_multicall_result(mc, idx[i]) == 0 &&
+             domctls[i].domain != (domid_t)domids[i] )
+            mc->calls[idx[i]].result = -ESRCH;
+        if ( xc_multicall_result(mc, idx[i]) == 0 )
+            xc_dominfo_from_domctl(&info[i], &domctls[i]);
+    }
+
+    rc = multicall_errors(mc, idx, nr, err);
+
+ out:
+    free(idx);
+    free(domctls);
+    xc_multicall_destroy(mc);
+    return rc;
+}
+
+int xc_vcpu_getinfo_batch(xc_interface *xch, const uint32_t *domids,
+                          const uint32_t *vcpus, unsigned int nr,
+                          xc_vcpuinfo_t *info, int *err)
+{
+    xc_multicall_t *mc = xc_multicall_create(xch);
+    struct xen_domctl *domctls = calloc(nr, sizeof(*domctls));
+    int *idx = calloc(nr, sizeof(*idx));
+    unsigned int i;
+    int rc = -1;
+
+    if ( mc == NULL || domctls == NULL || idx == NULL )
+    {
+        PERROR("Could not allocate batch of %u vcpus", nr);
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        domctls[i].cmd = XEN_DOMCTL_getvcpuinfo;
+        domctls[i].domain = (domid_t)domids[i];
+        domctls[i].u.getvcpuinfo.vcpu = (uint16_t)vcpus[i];
+        if ( (idx[i] = xc_multicall_add_domctl(mc, &domctls[i])) < 0 )
+            goto out;
+    }
+
+    if ( xc_multicall_execute(mc) )
+        goto out;
+
+    for ( i = 0; i < nr; i++ )
+        memcpy(&info[i], &domctls[i].u.getvcpuinfo, sizeof(info[i]));
+
+    rc = multicall_errors(mc, idx, nr, err);
+
+ out:
+    free(idx);
+    free(domctls);
+    xc_multicall_destroy(mc);
+    return rc;
+}
+
+int xc_sched_credit_domain_get_batch(xc_interface *xch,
+                                     const uint32_t *domids, unsigned int nr,
+                                     struct xen_domctl_sched_credit *sdom,
+                                     int *err)
+{
+    xc_multicall_t *mc = xc_multicall_create(xch);
+    struct xen_domctl *domctls = calloc(nr, sizeof(*domctls));
+    int *idx = calloc(nr, sizeof(*idx));
+    unsigned int i;
+    int rc = -1;
+
+    if ( mc == NULL || domctls == NULL || idx == NULL )
+    {
+        PERROR("Could not allocate batch of %u domains", nr);
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        domctls[i].cmd = XEN_DOMCTL_scheduler_op;
+        domctls[i].domain = (domid_t)domids[i];
+        domctls[i].u.scheduler_op.sched_id = XEN_SCHEDULER_CREDIT;
+        domctls[i].u.scheduler_op.cmd = XEN_DOMCTL_SCHEDOP_getinfo;
+        if ( (idx[i] = xc_multicall_add_domctl(mc, &domctls[i])) < 0 )
+            goto out;
+    }
+
+    if ( xc_multicall_execute(mc) )
+        goto out;
+
+    for ( i = 0; i < nr; i++ )
+        if ( xc_multicall_result(mc, idx[i]) == 0 )
+            sdom[i] = domctls[i].u.scheduler_op.u.credit;
+
+    rc = multicall_errors(mc, idx, nr, err);
+
+ out:
+    free(idx);
+    free(domctls);
+    xc_multicall_destroy(mc);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
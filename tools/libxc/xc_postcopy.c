@@ -0,0 +1,735 @@
+/******************************************************************************
+ * xc_postcopy.c
+ *
+ * Post-copy phase of live migration (HVM guests only).
+ *
+ * The sender stops pre-copy early, leaving the pages dirtied last behind,
+ * and the receiver resumes the guest with those pages paged out through
+ * mem_paging.  Pages the guest faults on are then fetched from the sender
+ * on demand, much as xenpaging reads them back from its pagefile, while the
+ * sender pushes all the others in the background.  See xg_save_restore.h
+ * for the stream format.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "xc_private.h"
+#include "xc_bitops.h"
+#include "xg_private.h"
+#include "xg_save_restore.h"
+
+#include <xen/mem_event.h>
+#include <xen/hvm/params.h>
+
+/* Pages per post-copy batch: small, so that faults don't queue for long */
+#define POSTCOPY_BATCH      64
+
+/* Neighbours of a faulting page sent along with it */
+#define POSTCOPY_PREFETCH   15
+
+/* Faults that may be waiting for their page at the receiver */
+#define POSTCOPY_MAX_WAITING 1024
+
+/* Page requests taken off the stream at a time by the sender */
+#define POSTCOPY_REQUESTS   256
+
+/*
+ * Sender side.
+ */
+
+/* Add pfn and the pending pages following it to the batch. */
+static int postcopy_take(unsigned long *pending, unsigned long p2m_size,
+                         unsigned long pfn, unsigned int nr_max,
+                         uint64_t *batch, int nr)
+{
+    for ( ; nr < POSTCOPY_BATCH && nr_max && pfn < p2m_size; pfn++ )
+    {
+        if ( !test_and_clear_bit(pfn, pending) )
+            break;
+        batch[nr++] = pfn;
+        nr_max--;
+    }
+
+    return nr;
+}
+
+static int postcopy_send_batch(xc_interface *xch, int io_fd, uint32_t dom,
+                               uint64_t *batch, int nr)
+{
+    xen_pfn_t pfns[POSTCOPY_BATCH];
+    int errs[POSTCOPY_BATCH];
+    uint32_t count = nr;
+    char *region;
+    int i;
+
+    for ( i = 0; i < nr; i++ )
+        pfns[i] = batch[i];
+
+    region = xc_map_foreign_bulk(xch, dom, PROT_READ, pfns, errs, nr);
+    if ( region == NULL )
+    {
+        PERROR("Failed to map post-copy pages");
+        return -1;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        if ( errs[i] )
+            batch[i] |= POSTCOPY_PFN_ABSENT;
+
+    if ( write_exact(io_fd, &count, sizeof(count)) ||
+         write_exact(io_fd, batch, nr * sizeof(*batch)) )
+        goto err;
+
+    for ( i = 0; i < nr; i++ )
+        if ( !errs[i] &&
+             write_exact(io_fd, region + i * PAGE_SIZE, PAGE_SIZE) )
+            goto err;
+
+    munmap(region, nr * PAGE_SIZE);
+    return 0;
+
+ err:
+    PERROR("Error when writing post-copy pages");
+    munmap(region, nr * PAGE_SIZE);
+    return -1;
+}
+
+/*
+ * Serve the pages set in pending to the receiver, from the suspended
+ * domain: those asked for first, along with a few neighbours, and the
+ * others in pfn order from the last page asked for.  Clears pending.
+ */
+int xc_postcopy_send(xc_interface *xch, int io_fd, uint32_t dom,
+                     unsigned long *pending, unsigned long p2m_size)
+{
+    uint64_t requests[POSTCOPY_REQUESTS], batch[POSTCOPY_BATCH];
+    unsigned long pfn, next = 0, scanned, nr_pending = 0, nr_demand = 0;
+    size_t have = 0;
+    struct pollfd pfd = { .fd = io_fd, .events = POLLIN };
+    uint32_t count = 0;
+    ssize_t len;
+    int i, nr;
+
+    for ( pfn = 0; pfn < p2m_size; pfn++ )
+        if ( test_bit(pfn, pending) )
+            nr_pending++;
+
+    DPRINTF("Post-copy: serving %lu pages\n", nr_pending);
+
+    while ( nr_pending )
+    {
+        nr = 0;
+
+        /* Pages asked for go first */
+        while ( nr < POSTCOPY_BATCH && poll(&pfd, 1, 0) > 0 )
+        {
+            len = read(io_fd, (char *)requests + have,
+                       sizeof(requests) - have);
+            if ( len < 0 && (errno == EINTR || errno == EAGAIN) )
+                continue;
+            if ( len <= 0 )
+            {
+                if ( len == 0 )
+                    errno = ECONNRESET;
+                PERROR("Error reading post-copy page requests");
+                return -1;
+            }
+            have += len;
+
+            for ( i = 0; i < have / sizeof(*requests); i++ )
+            {
+                pfn = requests[i];
+                if ( pfn >= p2m_size || !test_bit(pfn, pending) )
+                    continue;
+                nr = postcopy_take(pending, p2m_size, pfn,
+                                   1 + POSTCOPY_PREFETCH, batch, nr);
+                next = pfn;
+                nr_demand++;
+            }
+            memmove(requests, (char *)requests + i * sizeof(*requests),
+                    have - i * sizeof(*requests));
+            have -= i * sizeof(*requests);
+        }
+
+        /* Fill up with pages not asked for, going on from the last one */
+        for ( scanned = 0; nr < POSTCOPY_BATCH && scanned < p2m_size;
+              scanned++, next++ )
+        {
+            if ( next >= p2m_size )
+                next = 0;
+            if ( test_bit(next, pending) )
+                nr = postcopy_take(pending, p2m_size, next,
+                                   POSTCOPY_BATCH, batch, nr);
+        }
+
+        if ( postcopy_send_batch(xch, io_fd, dom, batch, nr) )
+            return -1;
+        nr_pending -= nr;
+    }
+
+    if ( write_exact(io_fd, &count, sizeof(count)) )
+    {
+        PERROR("Error when ending post-copy");
+        return -1;
+    }
+
+    /* Swallow the requests still in flight, up to the receiver's end */
+    for ( ; ; )
+    {
+        for ( i = 0; i < have / sizeof(*requests); i++ )
+            if ( requests[i] == POSTCOPY_REQ_DONE )
+                goto done;
+        memmove(requests, (char *)requests + i * sizeof(*requests),
+                have - i * sizeof(*requests));
+        have -= i * sizeof(*requests);
+
+        len = read(io_fd, (char *)requests + have, sizeof(requests) - have);
+        if ( len < 0 && (errno == EINTR || errno == EAGAIN) )
+            continue;
+        if ( len <= 0 )
+        {
+            if ( len == 0 )
+                errno = ECONNRESET;
+            PERROR("Error reading the end of post-copy");
+            return -1;
+        }
+        have += len;
+    }
+
+ done:
+    DPRINTF("Post-copy: done, %lu pages asked for\n", nr_demand);
+
+    return 0;
+}
+
+/*
+ * Receiver side.
+ */
+
+struct postcopy_recv {
+    xc_interface *xch;
+    uint32_t dom;
+    int io_fd;
+    unsigned long p2m_size;
+
+    unsigned long *pending;   /* not arrived yet */
+    unsigned long *paged;     /* paged out, waiting for mem_paging load */
+    unsigned long *requested; /* asked the sender for */
+    unsigned long nr_pending;
+    unsigned long nr_resident; /* pending, but stale copy still in place */
+    int done;                 /* sender has sent everything */
+
+    /* The paging ring, while the guest runs */
+    int paging;
+    void *ring_page;
+    xc_evtchn *xce;
+    evtchn_port_t port;
+    mem_event_back_ring_t back_ring;
+
+    /* Faults waiting for their page */
+    mem_event_request_t waiting[POSTCOPY_MAX_WAITING];
+    unsigned int nr_waiting;
+
+    uint64_t batch[POSTCOPY_BATCH];
+    char *pages;
+};
+
+static int postcopy_paging_enable(struct postcopy_recv *r)
+{
+    xc_interface *xch = r->xch;
+    xen_pfn_t ring_pfn;
+    uint32_t port;
+    int rc;
+
+    r->ring_page = xc_mem_event_map_ring(xch, r->dom,
+                                         HVM_PARAM_PAGING_RING_PFN,
+                                         1, &ring_pfn);
+    if ( r->ring_page == NULL )
+    {
+        PERROR("Post-copy: could not map the paging ring");
+        return -1;
+    }
+
+    if ( xc_mem_paging_enable_ring(xch, r->dom, 1, XEN_MEM_EVENT_LAZY_KICK,
+                                   &port) )
+    {
+        PERROR("Post-copy: could not enable paging");
+        munmap(r->ring_page, PAGE_SIZE);
+        r->ring_page = NULL;
+        return -1;
+    }
+    r->paging = 1;
+
+    r->xce = xc_evtchn_open(NULL, 0);
+    if ( r->xce == NULL )
+    {
+        PERROR("Post-copy: failed to open event channel");
+        return -1;
+    }
+
+    rc = xc_evtchn_bind_interdomain(r->xce, r->dom, port);
+    if ( rc < 0 )
+    {
+        PERROR("Post-copy: failed to bind event channel");
+        return -1;
+    }
+    r->port = rc;
+
+    SHARED_RING_INIT((mem_event_sring_t *)r->ring_page);
+    BACK_RING_INIT(&r->back_ring, (mem_event_sring_t *)r->ring_page,
+                   PAGE_SIZE);
+
+    /* As xenpaging does, keep the ring out of the guest's reach */
+    if ( xc_domain_decrease_reservation_exact(xch, r->dom, 1, 0, &ring_pfn) )
+        PERROR("Post-copy: failed to remove ring from guest physmap");
+
+    return 0;
+}
+
+static void postcopy_paging_disable(struct postcopy_recv *r)
+{
+    xc_interface *xch = r->xch;
+
+    if ( r->paging && xc_mem_paging_disable(xch, r->dom) )
+        PERROR("Post-copy: failed to disable paging");
+    if ( r->xce )
+    {
+        if ( r->port )
+            xc_evtchn_unbind(r->xce, r->port);
+        xc_evtchn_close(r->xce);
+    }
+    if ( r->ring_page )
+        munmap(r->ring_page, PAGE_SIZE);
+}
+
+/*
+ * Page out the post-copy pages, so that the guest faults on them instead
+ * of running on their stale copies.  Pages that can't be paged out are
+ * left resident, and have to arrive before the guest may run.
+ */
+static int postcopy_evict(struct postcopy_recv *r)
+{
+    xc_interface *xch = r->xch;
+    xen_mem_paging_batch_t batch[XENMEM_PAGING_BATCH_MAX];
+    unsigned long pfn = 0;
+    int i, j, nr;
+
+    while ( pfn < r->p2m_size )
+    {
+        for ( nr = 0; nr < XENMEM_PAGING_BATCH_MAX && pfn < r->p2m_size;
+              pfn++ )
+        {
+            if ( !test_bit(pfn, r->pending) )
+                continue;
+            batch[nr].gfn = pfn;
+            batch[nr].status = 0;
+            nr++;
+        }
+        if ( !nr )
+            break;
+
+        if ( xc_mem_paging_nominate_batch(xch, r->dom, batch, nr) < 0 )
+        {
+            PERROR("Post-copy: error nominating pages");
+            return -1;
+        }
+        for ( i = j = 0; i < nr; i++ )
+        {
+            if ( batch[i].status )
+                continue;
+            batch[j].gfn = batch[i].gfn;
+            batch[j].status = 0;
+            j++;
+        }
+        if ( !j )
+            continue;
+
+        if ( xc_mem_paging_evict_batch(xch, r->dom, batch, j) < 0 )
+        {
+            PERROR("Post-copy: error evicting pages");
+            return -1;
+        }
+        for ( i = 0; i < j; i++ )
+        {
+            if ( batch[i].status )
+                continue;
+            set_bit(batch[i].gfn, r->paged);
+            r->nr_resident--;
+        }
+    }
+
+    DPRINTF("Post-copy: %lu pages paged out, %lu to fetch now\n",
+            r->nr_pending - r->nr_resident, r->nr_resident);
+
+    return 0;
+}
+
+static int postcopy_request(struct postcopy_recv *r, unsigned long pfn)
+{
+    xc_interface *xch = r->xch;
+    uint64_t req = pfn;
+
+    if ( test_and_set_bit(pfn, r->requested) )
+        return 0;
+    if ( write_exact(r->io_fd, &req, sizeof(req)) )
+    {
+        PERROR("Post-copy: error asking for page %lx", pfn);
+        return -1;
+    }
+    return 0;
+}
+
+/* Put a page where it belongs, whether it was paged out or not. */
+static int postcopy_place(struct postcopy_recv *r, unsigned long pfn,
+                          char *page)
+{
+    xc_interface *xch = r->xch;
+    xen_pfn_t gfn = pfn;
+    void *dst;
+    int tries;
+
+    if ( page == NULL )
+    {
+        /* Gone at the sender: drop it here too */
+        if ( xc_domain_decrease_reservation_exact(xch, r->dom, 1, 0, &gfn) )
+            DPRINTF("Post-copy: could not drop page %lx\n", pfn);
+        return 0;
+    }
+
+    if ( test_bit(pfn, r->paged) )
+    {
+        for ( tries = 0; xc_mem_paging_load(xch, r->dom, pfn, page); tries++ )
+        {
+            if ( errno != ENOMEM || tries > 10 )
+            {
+                PERROR("Post-copy: error loading page %lx", pfn);
+                return -1;
+            }
+            sleep(1);
+        }
+        return 0;
+    }
+
+    /* Still resident, possibly half way out: retry while it comes back */
+    for ( tries = 0; ; tries++ )
+    {
+        dst = xc_map_foreign_range(xch, r->dom, PAGE_SIZE,
+                                   PROT_WRITE, pfn);
+        if ( dst != NULL )
+            break;
+        if ( errno != ENOENT || tries > 100 )
+        {
+            PERROR("Post-copy: error writing page %lx", pfn);
+            return -1;
+        }
+        usleep(1000);
+    }
+    memcpy(dst, page, PAGE_SIZE);
+    munmap(dst, PAGE_SIZE);
+    return 0;
+}
+
+/* Receive one batch of pages from the sender. */
+static int postcopy_recv_batch(struct postcopy_recv *r)
+{
+    xc_interface *xch = r->xch;
+    uint32_t count;
+    unsigned long pfn;
+    int i, nr_pages = 0;
+
+    if ( read_exact(r->io_fd, &count, sizeof(count)) )
+    {
+        PERROR("Post-copy: error reading batch size");
+        return -1;
+    }
+    if ( count == 0 )
+    {
+        r->done = 1;
+        return 0;
+    }
+    if ( count > POSTCOPY_BATCH )
+    {
+        ERROR("Post-copy: batch of %u pages is too large", count);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if ( read_exact(r->io_fd, r->batch, count * sizeof(*r->batch)) )
+    {
+        PERROR("Post-copy: error reading batch pfns");
+        return -1;
+    }
+    for ( i = 0; i < count; i++ )
+        if ( !(r->batch[i] & POSTCOPY_PFN_ABSENT) )
+            nr_pages++;
+    if ( read_exact(r->io_fd, r->pages, nr_pages * PAGE_SIZE) )
+    {
+        PERROR("Post-copy: error reading batch pages");
+        return -1;
+    }
+
+    for ( i = nr_pages = 0; i < count; i++ )
+    {
+        char *page = NULL;
+
+        pfn = r->batch[i] & ~POSTCOPY_PFN_ABSENT;
+        if ( !(r->batch[i] & POSTCOPY_PFN_ABSENT) )
+            page = r->pages + nr_pages++ * PAGE_SIZE;
+
+        if ( pfn >= r->p2m_size || !test_bit(pfn, r->pending) )
+            continue;
+
+        if ( postcopy_place(r, pfn, page) )
+            return -1;
+
+        clear_bit(pfn, r->pending);
+        r->nr_pending--;
+        if ( !test_and_clear_bit(pfn, r->paged) )
+            r->nr_resident--;
+    }
+
+    return 0;
+}
+
+/* Answer the faults whose pages have arrived. */
+static int postcopy_resume_waiting(struct postcopy_recv *r)
+{
+    xc_interface *xch = r->xch;
+    mem_event_response_t rsp;
+    unsigned int i, j, responses = 0;
+
+    for ( i = j = 0; i < r->nr_waiting; i++ )
+    {
+        mem_event_request_t *req = &r->waiting[i];
+
+        if ( req->gfn < r->p2m_size && test_bit(req->gfn, r->pending) )
+        {
+            r->waiting[j++] = *req;
+            continue;
+        }
+
+        rsp.gfn = req->gfn;
+        rsp.vcpu_id = req->vcpu_id;
+        rsp.flags = req->flags;
+        memcpy(RING_GET_RESPONSE(&r->back_ring, r->back_ring.rsp_prod_pvt),
+               &rsp, sizeof(rsp));
+        r->back_ring.rsp_prod_pvt++;
+        responses++;
+    }
+    r->nr_waiting = j;
+
+    if ( !responses )
+        return 0;
+
+    RING_PUSH_RESPONSES(&r->back_ring);
+    if ( xc_evtchn_notify(r->xce, r->port) < 0 )
+    {
+        PERROR("Post-copy: error resuming vcpus");
+        return -1;
+    }
+    return 0;
+}
+
+/* Take the guest's faults off the ring, asking for their pages. */
+static int postcopy_faults(struct postcopy_recv *r)
+{
+    xc_interface *xch = r->xch;
+    mem_event_request_t req;
+    evtchn_port_or_error_t port;
+    int more;
+
+    port = xc_evtchn_pending(r->xce);
+    if ( port < 0 )
+    {
+        PERROR("Post-copy: failed to read event channel");
+        return -1;
+    }
+    if ( xc_evtchn_unmask(r->xce, port) < 0 )
+    {
+        PERROR("Post-copy: failed to unmask event channel");
+        return -1;
+    }
+
+    /* Xen only kicks us once we have asked for it, when the ring is empty */
+    for ( ; ; )
+    {
+        RING_FINAL_CHECK_FOR_REQUESTS(&r->back_ring, more);
+        if ( !more )
+            break;
+
+        memcpy(&req, RING_GET_REQUEST(&r->back_ring, r->back_ring.req_cons),
+               sizeof(req));
+        r->back_ring.req_cons++;
+
+        if ( req.gfn < r->p2m_size && test_bit(req.gfn, r->pending) )
+        {
+            if ( req.flags & MEM_EVENT_FLAG_DROP_PAGE )
+            {
+                /* The guest gave it up: what the sender has is stale */
+                clear_bit(req.gfn, r->pending);
+                clear_bit(req.gfn, r->paged);
+                r->nr_pending--;
+                continue;
+            }
+            if ( postcopy_request(r, req.gfn) )
+                return -1;
+        }
+
+        if ( !(req.flags & (MEM_EVENT_FLAG_VCPU_PAUSED |
+                            MEM_EVENT_FLAG_EVICT_FAIL)) )
+            continue;
+
+        if ( r->nr_waiting == POSTCOPY_MAX_WAITING )
+        {
+            ERROR("Post-copy: too many faults waiting");
+            return -1;
+        }
+        r->waiting[r->nr_waiting++] = req;
+    }
+
+    return 0;
+}
+
+/*
+ * Bring in the nr pages in pfns, left behind by the sender: page them out,
+ * have the guest resumed, and fetch them as the guest touches them or the
+ * sender pushes them.  Without resume, or where paging can't be used, the
+ * pages are all fetched first and the guest is resumed by the caller as
+ * usual once this returns.
+ */
+int xc_postcopy_receive(xc_interface *xch, int io_fd, uint32_t dom,
+                        const uint64_t *pfns, unsigned long nr,
+                        unsigned long p2m_size,
+                        int (*resume)(uint32_t domid, void *data),
+                        void *data)
+{
+    struct postcopy_recv *r;
+    struct pollfd pfd[2];
+    uint64_t done = POSTCOPY_REQ_DONE;
+    unsigned long i;
+    int lazy, rc = -1;
+
+    r = calloc(1, sizeof(*r));
+    if ( r == NULL )
+    {
+        ERROR("Post-copy: out of memory");
+        return -1;
+    }
+    r->xch = xch;
+    r->dom = dom;
+    r->io_fd = io_fd;
+    r->p2m_size = p2m_size;
+    r->pending = bitmap_alloc(p2m_size);
+    r->paged = bitmap_alloc(p2m_size);
+    r->requested = bitmap_alloc(p2m_size);
+    r->pages = xc_memalign(xch, PAGE_SIZE, POSTCOPY_BATCH * PAGE_SIZE);
+    if ( !r->pending || !r->paged || !r->requested || !r->pages )
+    {
+        ERROR("Post-copy: out of memory");
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( pfns[i] >= p2m_size || test_and_set_bit(pfns[i], r->pending) )
+            continue;
+        r->nr_pending++;
+    }
+    r->nr_resident = r->nr_pending;
+
+    lazy = resume != NULL;
+    if ( lazy && (postcopy_paging_enable(r) || postcopy_evict(r)) )
+    {
+        DPRINTF("Post-copy: no paging, fetching all pages first\n");
+        lazy = 0;
+    }
+
+    /* What is not paged out must be current before the guest runs */
+    while ( (!lazy || r->nr_resident) && !r->done )
+        if ( postcopy_recv_batch(r) )
+            goto out;
+
+    if ( lazy && !r->done )
+    {
+        if ( resume(dom, data) < 0 )
+        {
+            ERROR("Post-copy: error resuming the domain");
+            goto out;
+        }
+
+        pfd[0].fd = io_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = xc_evtchn_fd(r->xce);
+        pfd[1].events = POLLIN;
+
+        while ( !r->done )
+        {
+            if ( poll(pfd, 2, -1) < 0 )
+            {
+                if ( errno == EINTR )
+                    continue;
+                PERROR("Post-copy: poll failed");
+                goto out;
+            }
+            if ( (pfd[1].revents & POLLIN) && postcopy_faults(r) )
+                goto out;
+            if ( (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                 postcopy_recv_batch(r) )
+                goto out;
+            if ( postcopy_resume_waiting(r) )
+                goto out;
+        }
+    }
+
+    if ( write_exact(io_fd, &done, sizeof(done)) )
+    {
+        PERROR("Post-copy: error ending page requests");
+        goto out;
+    }
+
+    if ( r->nr_pending )
+    {
+        ERROR("Post-copy: %lu pages never arrived", r->nr_pending);
+        goto out;
+    }
+
+    DPRINTF("Post-copy: all pages in\n");
+    rc = 0;
+
+ out:
+    postcopy_paging_disable(r);
+    free(r->pending);
+    free(r->paged);
+    free(r->requested);
+    free(r->pages);
+    free(r);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
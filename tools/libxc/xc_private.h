@@ -78,13 +78,16 @@ struct xc_interface_core {
     const char *currently_progress_reporting;
 
     /*
-     * A simple cache of unused, single page, hypercall buffers
+     * Caches of unused hypercall buffers, by size: 1, 2, 4 and 8 pages.
+     * Besides, threads each keep a few single page buffers of their own.
      *
      * Protected by a global lock.
      */
 #define HYPERCALL_BUFFER_CACHE_SIZE 4
-    int hypercall_buffer_cache_nr;
-    void *hypercall_buffer_cache[HYPERCALL_BUFFER_CACHE_SIZE];
+#define HYPERCALL_BUFFER_CACHE_ORDERS 4
+    int hypercall_buffer_cache_nr[HYPERCALL_BUFFER_CACHE_ORDERS];
+    void *hypercall_buffer_cache[HYPERCALL_BUFFER_CACHE_ORDERS][HYPERCALL_BUFFER_CACHE_SIZE];
+    struct hypercall_thread_cache *hypercall_thread_caches;
 
     /*
      * Hypercall buffer statistics. All protected by the global
@@ -301,6 +304,10 @@ int xc_get_pfn_type_batch(xc_interface *xch, uint32_t dom,
 void bitmap_64_to_byte(uint8_t *bp, const uint64_t *lp, int nbits);
 void bitmap_byte_to_64(uint64_t *lp, const uint8_t *bp, int nbits);
 
+/* Fill in an xc_dominfo_t from the result of XEN_DOMCTL_getdomaininfo */
+void xc_dominfo_from_domctl(xc_dominfo_t *info,
+                            const struct xen_domctl *domctl);
+
 /* Optionally flush file to disk and discard page cache */
 void discard_file_cache(xc_interface *xch, int fd, int flush);
 
@@ -0,0 +1,343 @@
+/******************************************************************************
+ * xc_tbuf_reader.c
+ *
+ * Read records out of Xen's trace buffers as they are written.  The
+ * buffers are mapped once, records are decoded into a fixed form with
+ * their timestamps filled in, and those of all cpus are handed out
+ * merged into one stream in time order.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <poll.h>
+#include "xc_private.h"
+#include <xen/trace.h>
+
+struct tbuf_cpu {
+    struct t_buf *meta;             /* NULL if the cpu has no buffer */
+    unsigned char *data;
+    uint32_t cons, prod;            /* as last read, modulo 2 * data_size */
+    uint64_t last_tsc;              /* for records without one */
+    int pending;                    /* rec holds the next record */
+    xc_tbuf_rec_t rec;
+};
+
+struct xc_tbuf_reader {
+    xc_interface *xch;
+    struct t_info *t_info;
+    unsigned long t_info_size;
+    unsigned int nr_cpus;
+    uint32_t data_size;
+    uint32_t cpu_khz;
+    struct tbuf_cpu *cpus;
+    xc_evtchn *xce;
+    int no_virq;                    /* VIRQ_TBUF unavailable: just sleep */
+};
+
+static uint64_t tsc_to_ns(xc_tbuf_reader_t *tr, uint64_t tsc)
+{
+    if ( tr->cpu_khz == 0 )
+        return 0;
+    return (tsc / tr->cpu_khz) * 1000000ULL +
+           (tsc % tr->cpu_khz) * 1000000ULL / tr->cpu_khz;
+}
+
+xc_tbuf_reader_t *xc_tbuf_reader_open(xc_interface *xch, unsigned long pages)
+{
+    xc_tbuf_reader_t *tr;
+    xc_physinfo_t physinfo = { 0 };
+    unsigned long mfn;
+    xen_pfn_t *pfns = NULL;
+    unsigned int cpu, i, nr_pages;
+
+    if ( (tr = calloc(1, sizeof(*tr))) == NULL )
+    {
+        PERROR("Could not allocate trace buffer reader");
+        return NULL;
+    }
+    tr->xch = xch;
+
+    if ( xc_physinfo(xch, &physinfo) )
+    {
+        PERROR("Could not get physical cpu information");
+        goto err;
+    }
+    tr->nr_cpus = physinfo.max_cpu_id + 1;
+    tr->cpu_khz = physinfo.cpu_khz;
+
+    if ( xc_tbuf_enable(xch, pages, &mfn, &tr->t_info_size) )
+    {
+        PERROR("Could not enable trace buffers");
+        goto err;
+    }
+
+    tr->t_info = xc_map_foreign_range(xch, DOMID_XEN, tr->t_info_size,
+                                      PROT_READ, mfn);
+    if ( tr->t_info == NULL )
+    {
+        PERROR("Could not map trace buffer metadata");
+        goto err;
+    }
+    nr_pages = tr->t_info->tbuf_size;
+    if ( nr_pages == 0 )
+    {
+        ERROR("Trace buffers have no size");
+        errno = EINVAL;
+        goto err;
+    }
+    tr->data_size = nr_pages * XC_PAGE_SIZE - sizeof(struct t_buf);
+
+    tr->cpus = calloc(tr->nr_cpus, sizeof(*tr->cpus));
+    pfns = malloc(nr_pages * sizeof(*pfns));
+    if ( tr->cpus == NULL || pfns == NULL )
+    {
+        PERROR("Could not allocate per-cpu trace buffer state");
+        goto err;
+    }
+
+    for ( cpu = 0; cpu < tr->nr_cpus; cpu++ )
+    {
+        const uint32_t *mfn_list;
+
+        /* Offset 0 is the header itself: cpus offline at enable have none */
+        if ( tr->t_info->mfn_offset[cpu] == 0 )
+            continue;
+
+        mfn_list = (const uint32_t *)tr->t_info + tr->t_info->mfn_offset[cpu];
+        for ( i = 0; i < nr_pages; i++ )
+            pfns[i] = mfn_list[i];
+
+        tr->cpus[cpu].meta = xc_map_foreign_batch(xch, DOMID_XEN,
+                                                  PROT_READ | PROT_WRITE,
+                                                  pfns, nr_pages);
+        if ( tr->cpus[cpu].meta == NULL )
+        {
+            PERROR("Could not map the trace buffer of cpu %u", cpu);
+            goto err;
+        }
+        tr->cpus[cpu].data = (unsigned char *)(tr->cpus[cpu].meta + 1);
+        tr->cpus[cpu].cons = tr->cpus[cpu].prod = tr->cpus[cpu].meta->cons;
+    }
+
+    free(pfns);
+    return tr;
+
+ err:
+    free(pfns);
+    xc_tbuf_reader_close(tr);
+    return NULL;
+}
+
+void xc_tbuf_reader_close(xc_tbuf_reader_t *tr)
+{
+    unsigned int cpu;
+
+    if ( tr == NULL )
+        return;
+
+    if ( tr->xce )
+        xc_evtchn_close(tr->xce);
+    for ( cpu = 0; tr->cpus && cpu < tr->nr_cpus; cpu++ )
+        if ( tr->cpus[cpu].meta )
+            munmap(tr->cpus[cpu].meta, tr->t_info->tbuf_size * XC_PAGE_SIZE);
+    free(tr->cpus);
+    if ( tr->t_info )
+        munmap(tr->t_info, tr->t_info_size);
+    free(tr);
+}
+
+unsigned int xc_tbuf_reader_nr_cpus(xc_tbuf_reader_t *tr)
+{
+    return tr->nr_cpus;
+}
+
+/*
+ * Decode the next record of a cpu into c->rec, if one has been written.
+ * Its space is handed back to Xen at once, since the record is copied.
+ * Returns 1 with a record pending, 0 with none, or -1 if the buffer is
+ * not making sense.
+ */
+static int tbuf_cpu_peek(xc_tbuf_reader_t *tr, unsigned int cpu)
+{
+    xc_interface *xch = tr->xch;
+    struct tbuf_cpu *c = &tr->cpus[cpu];
+    const struct t_rec *rec;
+    xc_tbuf_rec_t *out = &c->rec;
+    uint32_t off, size;
+
+    if ( c->meta == NULL )
+        return 0;
+
+    while ( !c->pending )
+    {
+        if ( c->cons == c->prod )
+        {
+            c->prod = c->meta->prod;
+            xen_rmb(); /* read prod, then read item. */
+            if ( c->cons == c->prod )
+                return 0;
+        }
+
+        off = c->cons >= tr->data_size ? c->cons - tr->data_size : c->cons;
+        rec = (const struct t_rec *)(c->data + off);
+        size = 4 + (rec->cycles_included ? 8 : 0) + rec->extra_u32 * 4;
+        /* Xen pads with a wrap record rather than split one at the end */
+        if ( size > tr->data_size - off )
+        {
+            ERROR("Record of %u bytes at %u overruns the buffer of cpu %u",
+                  size, off, cpu);
+            errno = EIO;
+            return -1;
+        }
+
+        if ( rec->event != TRC_TRACE_WRAP_BUFFER )
+        {
+            out->cpu = cpu;
+            out->event = rec->event;
+            out->nr_extra = rec->extra_u32;
+            out->has_tsc = rec->cycles_included;
+            if ( rec->cycles_included )
+            {
+                c->last_tsc = ((uint64_t)rec->u.cycles.cycles_hi << 32) |
+                              rec->u.cycles.cycles_lo;
+                memcpy(out->extra, rec->u.cycles.extra_u32,
+                       rec->extra_u32 * sizeof(uint32_t));
+            }
+            else
+                memcpy(out->extra, rec->u.nocycles.extra_u32,
+                       rec->extra_u32 * sizeof(uint32_t));
+            out->tsc = c->last_tsc;
+            out->ns = tsc_to_ns(tr, out->tsc);
+            c->pending = 1;
+        }
+
+        c->cons += size;
+        if ( c->cons >= 2 * tr->data_size )
+            c->cons -= 2 * tr->data_size;
+        xen_mb(); /* read item, then update cons. */
+        c->meta->cons = c->cons;
+    }
+
+    return 1;
+}
+
+int xc_tbuf_reader_next(xc_tbuf_reader_t *tr, xc_tbuf_rec_t *rec)
+{
+    struct tbuf_cpu *first = NULL;
+    unsigned int cpu;
+    int rc;
+
+    for ( cpu = 0; cpu < tr->nr_cpus; cpu++ )
+    {
+        if ( (rc = tbuf_cpu_peek(tr, cpu)) < 0 )
+            return -1;
+        if ( rc && (first == NULL || tr->cpus[cpu].rec.tsc < first->rec.tsc) )
+            first = &tr->cpus[cpu];
+    }
+
+    if ( first == NULL )
+        return 0;
+
+    *rec = first->rec;
+    first->pending = 0;
+    return 1;
+}
+
+int xc_tbuf_reader_next_cpu(xc_tbuf_reader_t *tr, unsigned int cpu,
+                            xc_tbuf_rec_t *rec)
+{
+    int rc;
+
+    if ( cpu >= tr->nr_cpus )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( (rc = tbuf_cpu_peek(tr, cpu)) <= 0 )
+        return rc;
+
+    *rec = tr->cpus[cpu].rec;
+    tr->cpus[cpu].pending = 0;
+    return 1;
+}
+
+int xc_tbuf_reader_drain(xc_tbuf_reader_t *tr,
+                         int (*fn)(const xc_tbuf_rec_t *rec, void *arg),
+                         void *arg)
+{
+    xc_tbuf_rec_t rec;
+    int rc, nr = 0;
+
+    while ( (rc = xc_tbuf_reader_next(tr, &rec)) > 0 )
+    {
+        nr++;
+        if ( (rc = fn(&rec, arg)) != 0 )
+            return rc < 0 ? rc : nr;
+    }
+
+    return rc < 0 ? rc : nr;
+}
+
+int xc_tbuf_reader_wait(xc_tbuf_reader_t *tr, int timeout_ms)
+{
+    xc_interface *xch = tr->xch;
+    struct pollfd pfd;
+    evtchn_port_or_error_t port;
+    int rc;
+
+    if ( tr->xce == NULL && !tr->no_virq )
+    {
+        tr->xce = xc_evtchn_open(NULL, 0);
+        /* Someone else may have the virq, so fall back to polling */
+        if ( tr->xce && xc_evtchn_bind_virq(tr->xce, VIRQ_TBUF) < 0 )
+        {
+            xc_evtchn_close(tr->xce);
+            tr->xce = NULL;
+        }
+        if ( tr->xce == NULL )
+        {
+            DPRINTF("Could not bind VIRQ_TBUF, polling trace buffers\n");
+            tr->no_virq = 1;
+        }
+    }
+    if ( tr->xce == NULL )
+        return poll(NULL, 0, timeout_ms);
+
+    pfd.fd = xc_evtchn_fd(tr->xce);
+    pfd.events = POLLIN;
+    rc = poll(&pfd, 1, timeout_ms);
+    if ( rc <= 0 )
+        return rc;
+
+    if ( (port = xc_evtchn_pending(tr->xce)) < 0 ||
+         xc_evtchn_unmask(tr->xce, port) < 0 )
+    {
+        PERROR("Could not acknowledge the trace buffer event");
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -625,6 +625,34 @@ int xc_domain_getinfolist(xc_interface *xch,
                           unsigned int max_domains,
                           xc_domaininfo_t *info);
 
+/**
+ * This function returns the domains which changed (were created, or were
+ * paused, unpaused, shut down, resumed or killed) after domain list
+ * generation <since>, and the ids of the domains destroyed since then, in
+ * a single hypercall.  See XEN_SYSCTL_domain_changes.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm since 0, or the generation returned by an earlier call
+ * @parm max_domains the number of elements in info
+ * @parm info an array which will contain the changed domains
+ * @parm max_gone the number of elements in gone
+ * @parm gone an array which will contain the destroyed domains' ids
+ * @parm changes the generation to pass next time, how many domains
+ *       changed and were destroyed (which may be more than fitted), and
+ *       whether all domains were returned instead
+ * @return 0 on success, -1 on error
+ */
+typedef struct xc_domain_changes {
+    uint64_t generation;
+    unsigned int num_domains;
+    unsigned int num_gone;
+    int all;
+} xc_domain_changes_t;
+int xc_domain_changes(xc_interface *xch, uint64_t since,
+                      unsigned int max_domains, xc_domaininfo_t *info,
+                      unsigned int max_gone, uint16_t *gone,
+                      xc_domain_changes_t *changes);
+
 /**
  * This function set p2m for broken page
  * &parm xch a handle to an open hypervisor interface
@@ -732,6 +760,23 @@ int xc_shadow_control(xc_interface *xch,
                       uint32_t mode,
                       xc_shadow_op_stats_t *stats);
 
+/*
+ * Log-dirty ring: alongside the bitmap, have Xen record the pfns of pages
+ * as they get dirtied, so that they can be fetched without scanning the
+ * whole bitmap.  Setting up the ring (entries != 0) cleans the bitmap.
+ * Draining returns the number of pfns placed in 'pfns' (which may
+ * repeat), or -1 with errno set to ENOBUFS if the ring overflowed, in
+ * which case XEN_DOMCTL_SHADOW_OP_CLEAN must be used for this round.
+ */
+int xc_logdirty_ring_enable(xc_interface *xch,
+                            uint32_t domid,
+                            unsigned long entries);
+int xc_logdirty_ring_drain(xc_interface *xch,
+                           uint32_t domid,
+                           xc_hypercall_buffer_t *pfns,
+                           unsigned long entries,
+                           xc_shadow_op_stats_t *stats);
+
 int xc_sedf_domain_set(xc_interface *xch,
                        uint32_t domid,
                        uint64_t period, uint64_t slice,
@@ -764,6 +809,19 @@ int xc_sched_credit2_domain_set(xc_interface *xch,
 int xc_sched_credit2_domain_get(xc_interface *xch,
                                uint32_t domid,
                                struct xen_domctl_sched_credit2 *sdom);
+int xc_sched_credit2_params_set(xc_interface *xch,
+                                uint32_t cpupool_id,
+                                struct xen_sysctl_credit2_schedule *schedule);
+int xc_sched_credit2_params_get(xc_interface *xch,
+                                uint32_t cpupool_id,
+                                struct xen_sysctl_credit2_schedule *schedule);
+
+int xc_sched_rtds_domain_set(xc_interface *xch,
+                            uint32_t domid,
+                            struct xen_domctl_sched_rtds *sdom);
+int xc_sched_rtds_domain_get(xc_interface *xch,
+                            uint32_t domid,
+                            struct xen_domctl_sched_rtds *sdom);
 
 int
 xc_sched_arinc653_schedule_set(
@@ -837,6 +895,47 @@ int xc_domain_p2m_audit(xc_interface *xch,
 int xc_domain_set_access_required(xc_interface *xch,
 				  uint32_t domid,
 				  unsigned int required);
+
+/**
+ * This function collects, and clears, the accessed bits the hardware keeps
+ * for a range of the domain's pfns.  Requires "ept_ad" on the Xen command
+ * line; fails with errno EOPNOTSUPP otherwise.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain id
+ * @parm start_pfn first pfn of the range
+ * @parm nr_pfns number of pfns in the range
+ * @parm bitmap nr_pfns bits, set for the pfns accessed since the last call
+ * return 0 on success, -1 on failure
+ */
+int xc_domain_harvest_accessed(xc_interface *xch,
+                               uint32_t domid,
+                               unsigned long start_pfn,
+                               unsigned long nr_pfns,
+                               unsigned long *bitmap);
+
+/**
+ * This function moves the RAM behind a range of an HVM domain's pfns to a
+ * NUMA node, pausing the domain meanwhile.  It stops once max_migrate
+ * pages (if non-zero) have been moved, so that a caller can rate limit
+ * migration by calling it repeatedly.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain id
+ * @parm node the node to move memory to
+ * @parm start_pfn first pfn of the range
+ * @parm nr_pfns number of pfns in the range; on return, the number done
+ * @parm max_migrate number of pages to stop after, or 0
+ * @parm nr_migrated on return, the number of pages moved
+ * return 0 on success, -1 on failure
+ */
+int xc_domain_migrate_memory(xc_interface *xch,
+                             uint32_t domid,
+                             unsigned int node,
+                             unsigned long start_pfn,
+                             unsigned long *nr_pfns,
+                             unsigned long max_migrate,
+                             unsigned long *nr_migrated);
 /**
  * This function sets the handler of global VIRQs sent by the hypervisor
  *
@@ -867,6 +966,7 @@ typedef struct xc_cpupoolinfo {
     uint32_t cpupool_id;
     uint32_t sched_id;
     uint32_t n_dom;
+    uint32_t epp;
     xc_cpumap_t cpumap;
 } xc_cpupoolinfo_t;
 
@@ -954,6 +1054,19 @@ int xc_cpupool_movedomain(xc_interface *xch,
  */
 xc_cpumap_t xc_cpupool_freeinfo(xc_interface *xch);
 
+/**
+ * Set the energy/performance preference of the cpus of a cpupool.
+ * Requires hardware managed P-states (cpufreq=hwp).
+ *
+ * @parm xc_handle a handle to an open hypervisor interface
+ * @parm poolid id of the cpupool
+ * @parm epp preference, from 0 (performance) to 255 (power saving)
+ * return 0 on success, -1 on failure
+ */
+int xc_cpupool_set_epp(xc_interface *xch,
+                       uint32_t poolid,
+                       uint32_t epp);
+
 
 /*
  * EVENT CHANNEL FUNCTIONS
@@ -1100,6 +1213,34 @@ typedef xen_sysctl_cpuinfo_t xc_cpuinfo_t;
 int xc_getcpuinfo(xc_interface *xch, int max_cpus,
                   xc_cpuinfo_t *info, int *nr_cpus); 
 
+/*
+ * Scheduling latency histograms of pCPU <id>, or of vCPU <id> of <domid>
+ * (type XEN_SYSCTL_SCHED_HIST_*); <reset> clears them once read.
+ */
+typedef xen_sysctl_sched_hist_data_t xc_sched_hist_t;
+int xc_sched_hist_get(xc_interface *xch, uint32_t type, uint32_t domid,
+                      uint32_t id, int reset, xc_sched_hist_t *hist);
+
+/*
+ * Activity counters (hypercalls, VM exits, grant ops...) of vCPU <vcpu> of
+ * <domid>, or summed over its vCPUs for XEN_SYSCTL_DOMAIN_PERF_ALL_VCPUS;
+ * <reset> clears them once read.
+ */
+typedef xen_sysctl_domain_perf_data_t xc_domain_perf_t;
+int xc_domain_perf_get(xc_interface *xch, uint32_t domid, uint32_t vcpu,
+                       int reset, xc_domain_perf_t *perf);
+
+/*
+ * Runstate times and latency histograms of all vCPUs of the domains from
+ * <first_domain> on, whole domains at a time, in up to <max_vcpus> entries.
+ * Returns the number of entries filled in, or -1 on error; *next_domain is
+ * where to carry on from, DOMID_INVALID once done.
+ */
+typedef xen_sysctl_vcpu_sched_stats_data_t xc_vcpu_sched_stats_t;
+int xc_vcpu_sched_stats(xc_interface *xch, uint32_t first_domain,
+                        unsigned int max_vcpus, xc_vcpu_sched_stats_t *stats,
+                        uint32_t *next_domain);
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         unsigned int max_memkb);
@@ -1264,6 +1405,34 @@ int xc_perfc_query(xc_interface *xch,
                    xc_hypercall_buffer_t *desc,
                    xc_hypercall_buffer_t *val);
 
+/*
+ * Latency histograms per hypercall number (XEN_SYSCTL_hypercall_stats).
+ * xc_hypercall_stats_get() fills up to <nr> entries of <stats>, returning
+ * the number of hypercalls (or -1), and sets *enabled if collection is on.
+ * <cmd> is XEN_SYSCTL_HYPERCALL_STATS_{enable,disable,reset}.
+ */
+typedef xen_sysctl_hypercall_stats_data_t xc_hypercall_stats_t;
+int xc_hypercall_stats_get(xc_interface *xch, xc_hypercall_stats_t *stats,
+                           unsigned int nr, int *enabled);
+int xc_hypercall_stats_control(xc_interface *xch, uint32_t cmd);
+
+/*
+ * Live patching of the hypervisor (XEN_SYSCTL_livepatch_op), see
+ * docs/misc/livepatch.markdown.  Payloads are named by the caller.
+ * xc_livepatch_list() fills up to <nr> entries of <status>, starting at
+ * payload <idx>, returning the number filled (or -1), and sets *total.
+ * <action> is XEN_LIVEPATCH_ACTION_{apply,revert,unload}.
+ */
+typedef xen_livepatch_status_t xc_livepatch_status_t;
+int xc_livepatch_upload(xc_interface *xch, const char *name,
+                        const void *payload, size_t size);
+int xc_livepatch_get(xc_interface *xch, const char *name,
+                     uint32_t *state, int32_t *rc);
+int xc_livepatch_list(xc_interface *xch, unsigned int idx, unsigned int nr,
+                      xc_livepatch_status_t *status, unsigned int *total);
+int xc_livepatch_action(xc_interface *xch, const char *name,
+                        uint32_t action);
+
 typedef xen_sysctl_lockprof_data_t xc_lockprof_data_t;
 int xc_lockprof_reset(xc_interface *xch);
 int xc_lockprof_query_number(xc_interface *xch,
@@ -1272,6 +1441,14 @@ int xc_lockprof_query(xc_interface *xch,
                       uint32_t *n_elems,
                       uint64_t *time,
                       xc_hypercall_buffer_t *data);
+typedef xen_sysctl_lockprof_cpu_t xc_lockprof_cpu_t;
+/* On input *n_cpus is the size of @data, on output the number of cpus. */
+int xc_lockprof_query_cpus(xc_interface *xch,
+                           uint32_t *n_cpus,
+                           uint32_t *sample,
+                           xc_hypercall_buffer_t *data);
+/* Profile one in @sample lock acquisitions. */
+int xc_lockprof_set_sample(xc_interface *xch, uint32_t sample);
 
 void *xc_memalign(xc_interface *xch, size_t alignment, size_t size);
 
@@ -1311,6 +1488,88 @@ void *xc_map_foreign_batch(xc_interface *xch, uint32_t dom, int prot,
 void *xc_map_foreign_bulk(xc_interface *xch, uint32_t dom, int prot,
                           const xen_pfn_t *arr, int *err, unsigned int num);
 
+/*
+ * A cache of foreign mappings, for tools going back to the same guest
+ * memory over and over.  Memory is mapped XC_MAP_CACHE_CHUNK pages at a
+ * time, and kept mapped until the cache holds more than max_chunks (0 for
+ * a default) and the chunk is the least recently used, or until
+ * invalidated.
+ *
+ * xc_map_cache_get() returns the address of gfn mapped with at least
+ * prot, or NULL with errno set.  It stays valid until the next call on
+ * the cache, unless more chunks are allowed than are ever in use at once.
+ *
+ * The cache doesn't know when a domain's memory changes hands, e.g. on
+ * ballooning, paging or sharing, or when it dies: the caller has to
+ * invalidate the gfns affected when it learns of it.  A cache isn't
+ * thread safe.
+ */
+#define XC_MAP_CACHE_CHUNK 64
+typedef struct xc_map_cache xc_map_cache_t;
+
+xc_map_cache_t *xc_map_cache_create(xc_interface *xch,
+                                    unsigned int max_chunks);
+void xc_map_cache_destroy(xc_map_cache_t *mc);
+void *xc_map_cache_get(xc_map_cache_t *mc, uint32_t dom, xen_pfn_t gfn,
+                       int prot);
+void xc_map_cache_invalidate(xc_map_cache_t *mc, uint32_t dom,
+                             xen_pfn_t gfn, unsigned long nr);
+
+/*
+ * Batching hypercalls.
+ *
+ * Calls are queued on an xc_multicall_t and issued together, in order,
+ * by xc_multicall_execute() as a single __HYPERVISOR_multicall.  Each
+ * xc_multicall_add*() returns the index of the call in the batch, or -1.
+ *
+ * xc_multicall_add() passes its arguments through as they are, so any
+ * pointers among them must be to hypercall buffers.
+ *
+ * xc_multicall_add_buffer() passes a pointer to a copy of data[len] as
+ * the first argument.  It is copied into a hypercall buffer on execute and
+ * back out afterwards, so it has to stay valid until then.  The
+ * xc_multicall_add_domctl() and xc_multicall_add_sysctl() forms use it.
+ * Guest handles embedded in them must still point at hypercall buffers.
+ *
+ * xc_multicall_execute() returns -1 if the multicall itself failed, 0
+ * otherwise.  Whether each call succeeded is then given by
+ * xc_multicall_result(), as the hypercall's return value: 0 or more on
+ * success, a negative errno value on failure.  xc_multicall_reset()
+ * empties the batch for reuse.
+ */
+typedef struct xc_multicall xc_multicall_t;
+
+xc_multicall_t *xc_multicall_create(xc_interface *xch);
+void xc_multicall_destroy(xc_multicall_t *mc);
+void xc_multicall_reset(xc_multicall_t *mc);
+int xc_multicall_add(xc_multicall_t *mc, unsigned long op,
+                     unsigned long arg0, unsigned long arg1,
+                     unsigned long arg2, unsigned long arg3,
+                     unsigned long arg4);
+int xc_multicall_add_buffer(xc_multicall_t *mc, unsigned long op,
+                            void *data, size_t len,
+                            unsigned long arg1, unsigned long arg2);
+int xc_multicall_add_domctl(xc_multicall_t *mc, struct xen_domctl *domctl);
+int xc_multicall_add_sysctl(xc_multicall_t *mc, struct xen_sysctl *sysctl);
+int xc_multicall_execute(xc_multicall_t *mc);
+long xc_multicall_result(xc_multicall_t *mc, unsigned int idx);
+
+/*
+ * Batched forms of common queries, for nr domains (or vcpus) in a single
+ * trip into Xen.  If err is not NULL, err[i] is set to 0 or the errno
+ * value for element i, and only a failure of the batch as a whole fails
+ * the call.  If err is NULL, any failing element fails the call.
+ */
+int xc_domain_getinfo_batch(xc_interface *xch, const uint32_t *domids,
+                            unsigned int nr, xc_dominfo_t *info, int *err);
+int xc_vcpu_getinfo_batch(xc_interface *xch, const uint32_t *domids,
+                          const uint32_t *vcpus, unsigned int nr,
+                          xc_vcpuinfo_t *info, int *err);
+int xc_sched_credit_domain_get_batch(xc_interface *xch,
+                                     const uint32_t *domids, unsigned int nr,
+                                     struct xen_domctl_sched_credit *sdom,
+                                     int *err);
+
 /**
  * Translates a virtual address in the context of a given domain and
  * vcpu returning the GFN containing the address (that is, an MFN for 
@@ -1411,6 +1670,51 @@ int xc_tbuf_set_cpu_mask(xc_interface *xch, uint32_t mask);
 
 int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask);
 
+/*
+ * Trace buffer reader
+ *
+ * xc_tbuf_reader_open() enables tracing (as xc_tbuf_enable()) and maps
+ * the buffers of all cpus.  Records are then taken out one at a time by
+ * xc_tbuf_reader_next(), or all those written so far by
+ * xc_tbuf_reader_drain(), merged across cpus in timestamp order.  Both
+ * return 0 once the buffers are empty, when xc_tbuf_reader_wait() waits
+ * up to timeout_ms (-1 for ever) for Xen to signal more.
+ *
+ * Records without a timestamp of their own carry that of the last record
+ * on their cpu, and ns is the timestamp converted using the cpu
+ * frequency.  Buffer wrap padding is skipped; lost records are passed on
+ * as TRC_LOST_RECORDS.
+ */
+typedef struct xc_tbuf_rec {
+    unsigned int cpu;
+    uint32_t event;
+    unsigned int nr_extra;
+    uint32_t extra[7];
+    int has_tsc;
+    uint64_t tsc;
+    uint64_t ns;
+} xc_tbuf_rec_t;
+
+typedef struct xc_tbuf_reader xc_tbuf_reader_t;
+
+xc_tbuf_reader_t *xc_tbuf_reader_open(xc_interface *xch, unsigned long pages);
+void xc_tbuf_reader_close(xc_tbuf_reader_t *tr);
+unsigned int xc_tbuf_reader_nr_cpus(xc_tbuf_reader_t *tr);
+int xc_tbuf_reader_next(xc_tbuf_reader_t *tr, xc_tbuf_rec_t *rec);
+/* Returns the number of records, or fn's result if negative */
+int xc_tbuf_reader_drain(xc_tbuf_reader_t *tr,
+                         int (*fn)(const xc_tbuf_rec_t *rec, void *arg),
+                         void *arg);
+/*
+ * Take the next record of one cpu, without merging with the others.  It
+ * may be called concurrently for different cpus, so that each cpu's
+ * records can be consumed by a thread of its own.
+ */
+int xc_tbuf_reader_next_cpu(xc_tbuf_reader_t *tr, unsigned int cpu,
+                            xc_tbuf_rec_t *rec);
+/* Returns 1 if signalled, 0 on timeout */
+int xc_tbuf_reader_wait(xc_tbuf_reader_t *tr, int timeout_ms);
+
 int xc_domctl(xc_interface *xch, struct xen_domctl *domctl);
 int xc_sysctl(xc_interface *xch, struct xen_sysctl *sysctl);
 
@@ -1639,6 +1943,38 @@ int xc_hvm_set_pci_link_route(
 int xc_hvm_inject_msi(
     xc_interface *xch, domid_t dom, uint64_t addr, uint32_t data);
 
+/*
+ * Register, update or (with HVMOP_FAST_IO_remove) drop an I/O range that Xen
+ * completes itself; see HVMOP_set_fast_io. For notifying modes *port is set
+ * to the guest side event channel to bind to.
+ */
+int xc_hvm_set_fast_io(
+    xc_interface *xch, domid_t dom, uint8_t space, uint8_t mode,
+    uint64_t start, uint64_t size, uint64_t value, evtchn_port_t *port);
+
+/* Read back the latched value of a fast I/O range. */
+int xc_hvm_get_fast_io(
+    xc_interface *xch, domid_t dom, uint8_t space,
+    uint64_t start, uint64_t size, uint64_t *value);
+
+/*
+ * Create an additional ioreq server for dom, served by the caller through
+ * the ioreq page at ioreq_pfn; see HVMOP_create_ioreq_server.
+ */
+int xc_hvm_create_ioreq_server(
+    xc_interface *xch, domid_t dom, uint64_t ioreq_pfn, ioservid_t *id);
+
+/* Claim or release an inclusive HVMOP_IO_RANGE_* range for ioreq server id. */
+int xc_hvm_map_io_range_to_ioreq_server(
+    xc_interface *xch, domid_t dom, ioservid_t id,
+    uint32_t type, uint64_t start, uint64_t end);
+int xc_hvm_unmap_io_range_from_ioreq_server(
+    xc_interface *xch, domid_t dom, ioservid_t id,
+    uint32_t type, uint64_t start, uint64_t end);
+
+int xc_hvm_destroy_ioreq_server(
+    xc_interface *xch, domid_t dom, ioservid_t id);
+
 /*
  * Track dirty bit changes in the VRAM area
  *
@@ -1976,10 +2312,19 @@ int xc_tmem_restore_extra(xc_interface *xch, int dom, int fd);
  * mem_event operations. Internal use only.
  */
 int xc_mem_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
-                         unsigned int mode, uint32_t *port);
+                         unsigned int mode, unsigned int ring_pages,
+                         unsigned int flags, uint32_t *port);
 int xc_mem_event_memop(xc_interface *xch, domid_t domain_id, 
                         unsigned int op, unsigned int mode,
                         uint64_t gfn, void *buffer);
+/*
+ * Map the ring_pages pages of the mem_event ring whose first gfn is in HVM
+ * param, populating them if need be.  Multi-page rings are moved to gfns
+ * above the guest's highest one, and param is updated to match.  Returns
+ * the mapping, with the first gfn in *ring_pfn, or NULL on error.
+ */
+void *xc_mem_event_map_ring(xc_interface *xch, domid_t domain_id, int param,
+                            unsigned int ring_pages, xen_pfn_t *ring_pfn);
 
 /** 
  * Mem paging operations.
@@ -1988,6 +2333,13 @@ int xc_mem_event_memop(xc_interface *xch, domid_t domain_id,
  * support is considered experimental.
  */
 int xc_mem_paging_enable(xc_interface *xch, domid_t domain_id, uint32_t *port);
+/*
+ * ring_pages: power of two, at most XEN_MEM_EVENT_RING_PAGES_MAX
+ * flags: XEN_MEM_EVENT_*, e.g. XEN_MEM_EVENT_LAZY_KICK
+ */
+int xc_mem_paging_enable_ring(xc_interface *xch, domid_t domain_id,
+                              unsigned int ring_pages, unsigned int flags,
+                              uint32_t *port);
 int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id);
 int xc_mem_paging_nominate(xc_interface *xch, domid_t domain_id,
                            unsigned long gfn);
@@ -1995,12 +2347,25 @@ int xc_mem_paging_evict(xc_interface *xch, domid_t domain_id, unsigned long gfn)
 int xc_mem_paging_prep(xc_interface *xch, domid_t domain_id, unsigned long gfn);
 int xc_mem_paging_load(xc_interface *xch, domid_t domain_id, 
                         unsigned long gfn, void *buffer);
+/*
+ * Nominate, or evict, up to XENMEM_PAGING_BATCH_MAX gfns in one hypercall.
+ * The per gfn result (0 or -errno) is left in each entry's status.
+ */
+int xc_mem_paging_nominate_batch(xc_interface *xch, domid_t domain_id,
+                                 xen_mem_paging_batch_t *batch,
+                                 unsigned int nr);
+int xc_mem_paging_evict_batch(xc_interface *xch, domid_t domain_id,
+                              xen_mem_paging_batch_t *batch,
+                              unsigned int nr);
 
 /** 
  * Access tracking operations.
  * Supported only on Intel EPT 64 bit processors.
  */
 int xc_mem_access_enable(xc_interface *xch, domid_t domain_id, uint32_t *port);
+int xc_mem_access_enable_ring(xc_interface *xch, domid_t domain_id,
+                              unsigned int ring_pages, unsigned int flags,
+                              uint32_t *port);
 int xc_mem_access_disable(xc_interface *xch, domid_t domain_id);
 int xc_mem_access_resume(xc_interface *xch, domid_t domain_id,
                          unsigned long gfn);
@@ -2173,6 +2538,37 @@ int xc_memshr_debug_gref(xc_interface *xch,
                          domid_t domid,
                          grant_ref_t gref);
 
+/* Hash the sharable pages of gfns [*first_gfn, last_gfn] of a domain, so
+ * that sharing candidates can be found without mapping every guest page.
+ *
+ * On entry *nr_hashes is the size of the hashes array; on return it holds
+ * the number of records written and *first_gfn the next gfn to scan. The
+ * hypervisor stops early when the array is full or it needs to preempt, so
+ * callers loop until *first_gfn is past last_gfn (which is clipped to the
+ * domain's maximum gfn). Records of a batch are sorted by hash; the hash is
+ * not cryptographic, so page contents must be compared before sharing.
+ */
+int xc_memshr_hash_range(xc_interface *xch,
+                         domid_t domid,
+                         uint64_t *first_gfn,
+                         uint64_t last_gfn,
+                         xen_mem_sharing_hash_t *hashes,
+                         uint32_t *nr_hashes);
+
+/* Back every hole of the client domain in gfns [first_gfn, last_gfn] with
+ * the source domain's page at the same gfn, shared copy-on-write. Pages
+ * which cannot be shared, e.g. because they are mapped by a device model,
+ * are copied instead. Both domains must have sharing enabled.
+ *
+ * If nr_shared is not NULL it returns the number of pages shared.
+ */
+int xc_memshr_fork_range(xc_interface *xch,
+                         domid_t source_domain,
+                         domid_t client_domain,
+                         uint64_t first_gfn,
+                         uint64_t last_gfn,
+                         uint64_t *nr_shared);
+
 /* Audits the share subsystem. 
  * 
  * Returns ENOSYS if not supported (may not be compiled into the hypervisor). 
@@ -2313,4 +2709,25 @@ int xc_compression_uncompress_page(xc_interface *xch, char *compbuf,
 				   unsigned long compbuf_size,
 				   unsigned long *compbuf_pos, char *dest);
 
+/**
+ * Pack len bytes of compressed data at buf further, with LZ4.
+ *
+ * returns the packed length, and points packed at the packed data (valid
+ *  until the next call), if that saves enough to be worth it.
+ * returns 0 otherwise.
+ */
+unsigned long xc_compression_pack(xc_interface *xch, comp_ctx *ctx,
+				  const char *buf, unsigned long len,
+				  const char **packed);
+
+/**
+ * Unpack src_len bytes from xc_compression_pack into dest, which they must
+ * fill exactly (dest_len bytes).
+ *
+ * returns 0 on success, -1 if the data is corrupt.
+ */
+int xc_compression_unpack(xc_interface *xch, const char *src,
+			  unsigned long src_len, char *dest,
+			  unsigned long dest_len);
+
 #endif /* XENCTRL_H */
@@ -28,6 +28,11 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+#define XCFLAGS_POSTCOPY  (1 << 5)
+#define XCFLAGS_AUTO_CONVERGE (1 << 6)
+#define XCFLAGS_CHECKPOINT_PRECOPY (1 << 7)
+/* The receiver runs on the same host: see XC_SAVE_ID_SAME_HOST */
+#define XCFLAGS_SAME_HOST (1 << 8)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -83,12 +88,44 @@ struct save_callbacks {
  * @parm fd the file descriptor to save a domain to
  * @parm dom the id of the domain
  * @return 0 on success, -1 on failure
+ *
+ * With XCFLAGS_POSTCOPY, a live save of an HVM guest ends pre-copy early
+ * and serves the pages still dirty to the receiver after it has resumed
+ * the guest.  fd must then be readable as well, e.g. a socket, as page
+ * requests come back on it.
+ *
+ * A live save ends pre-copy once the pages left should take no longer to
+ * send than XG_SAVE_DOWNTIME_MS (in the environment, default 300), or when
+ * it stops making progress.  With XCFLAGS_AUTO_CONVERGE it lowers the
+ * guest's credit scheduler cap rather than give up, for as long as it
+ * can.
+ *
+ * With XCFLAGS_CHECKPOINT_PRECOPY, each checkpoint after the first (see
+ * callbacks->checkpoint) first sends the pages dirtied since the last one
+ * while the guest keeps running, and only suspends it to copy the pages
+ * dirtied again meanwhile.
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags /* XCFLAGS_xxx */,
                    struct save_callbacks* callbacks, int hvm,
                    unsigned long vm_generationid_addr);
 
+/**
+ * As xc_domain_save(), spreading page batches over extra streams to the
+ * same receiver, which must restore with xc_domain_restore_streams() and
+ * at least as many page streams.  Everything else, and the order of the
+ * batches, stays on io_fd.
+ *
+ * @parm page_fds file descriptors of the extra streams
+ * @parm nr_page_fds number of them, 0 for the same as xc_domain_save()
+ */
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *page_fds, unsigned int nr_page_fds,
+                           uint32_t dom, uint32_t max_iters,
+                           uint32_t max_factor, uint32_t flags,
+                           struct save_callbacks* callbacks, int hvm,
+                           unsigned long vm_generationid_addr);
+
 
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
@@ -96,6 +133,15 @@ struct restore_callbacks {
     int (*toolstack_restore)(uint32_t domid, const uint8_t *buf,
             uint32_t size, void* data);
 
+    /* Called when the sender left pages to be fetched after resuming the
+     * guest (XCFLAGS_POSTCOPY), once the domain is restored but for them.
+     * The callee finishes setting up the domain and unpauses it; the
+     * missing pages are then fetched as the guest touches them, and
+     * xc_domain_restore returns once they have all arrived.  Without this
+     * callback they are all fetched before returning instead.
+     * returns 0 on success, < 0 to fail the restore */
+    int (*postcopy_resume)(uint32_t domid, void *data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -128,6 +174,51 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       int no_incr_generationid, int checkpointed_stream,
                       unsigned long *vm_generationid_addr,
                       struct restore_callbacks *callbacks);
+
+/**
+ * As xc_domain_restore(), for a stream saved by xc_domain_save_streams().
+ *
+ * @parm page_fds file descriptors of the extra streams, in the same order
+ *       as the sender's
+ * @parm nr_page_fds number of them
+ */
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *page_fds, unsigned int nr_page_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, domid_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_mfn,
+                              domid_t console_domid, unsigned int hvm,
+                              unsigned int pae, int superpages,
+                              int no_incr_generationid,
+                              int checkpointed_stream,
+                              unsigned long *vm_generationid_addr,
+                              struct restore_callbacks *callbacks);
+
+/**
+ * This function clones a paused HVM domain.  The clone shares all of the
+ * parent's memory copy-on-write, and gets its vcpu and platform state, so
+ * that when unpaused it carries on from where the parent was paused.
+ *
+ * The clone must be a newly created HVM domain, with no memory and at
+ * least as many vcpus as the parent.  The parent's device model state is
+ * not cloned: the toolstack saves it and starts the clone's device model
+ * from it, as on restore.  Neither are event channels, so the guest's PV
+ * drivers have to reconnect as after a restore.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm parent the paused domain to clone
+ * @parm clone the new domain
+ * @parm store_evtchn the clone's xenstore event channel
+ * @parm store_pfn returned with the gfn of the clone's xenstore ring
+ * @parm console_evtchn the clone's console event channel
+ * @parm console_pfn returned with the gfn of the clone's console ring
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_clone(xc_interface *xch, uint32_t parent, uint32_t clone,
+                    unsigned int store_evtchn, unsigned long *store_pfn,
+                    unsigned int console_evtchn, unsigned long *console_pfn);
+
 /**
  * xc_domain_restore writes a file to disk that contains the device
  * model saved state.
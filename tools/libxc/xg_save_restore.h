@@ -87,6 +87,72 @@
  *
  * If chunk type is 0 then body phase is complete.
  *
+ * Page batches may be carried by extra page streams (sockets or other fds
+ * alongside the main one) rather than the main stream itself.  The main
+ * stream then announces them once, with XC_SAVE_ID_PAGE_STREAMS:
+ *
+ *     uint32_t         : number of page streams
+ *
+ * and stands in for each batch sent elsewhere with XC_SAVE_ID_STREAM_BATCH:
+ *
+ *     uint32_t         : page stream the batch was sent on
+ *
+ * The page streams carry nothing but batches in the format above, in the
+ * order they are referred to from the main stream, and each is ended by a
+ * chunk type of 0 once the save is complete.  Everything else stays on the
+ * main stream, so it still orders the image as a whole.
+ *
+ * Before the first batch of an HVM guest, XC_SAVE_ID_PFN_LAYOUT says
+ * which 2M extents of it are fully populated:
+ *
+ *     uint32_t         : number of 2M extents, from PFN 0
+ *     uint8_t[]        : bitmap of those fully populated, bit i of byte
+ *                        i / 8 standing for PFNs i * 512 to i * 512 + 511
+ *
+ * Pages may be left out of a batch, when they are all zero or the receiver
+ * already holds a copy of them at another PFN.  They are then marked
+ * XEN_DOMCTL_PFINFO_XALLOC in the batch, and listed, in batch order, by an
+ * XC_SAVE_ID_ELIDED_PAGES chunk on the main stream just before it (or
+ * before its XC_SAVE_ID_STREAM_BATCH):
+ *
+ *     uint32_t         : number of pages left out
+ *     struct xc_elided_page[] : PFN of each, and ELIDED_ZERO or the PFN
+ *                        whose contents to copy into it
+ *
+ * When the receiver is on the same host, the sender of an HVM guest may
+ * leave every data page out that way, for the receiver to copy straight
+ * from the guest's memory rather than from the stream.  It says so before
+ * the first batch with XC_SAVE_ID_SAME_HOST:
+ *
+ *     uint32_t         : the domid of the guest being saved
+ *
+ * after which the source of an elided page may be ELIDED_SAME_HOST | PFN,
+ * the PFN of the guest being saved to copy it from.  The receiver copies
+ * the page when it gets to its batch; any later change to the page makes
+ * it dirty, so it is sent again, and the guest being saved must survive
+ * until the receiver has the whole image.
+ *
+ * A live save of an HVM guest may leave the pages dirtied last for the
+ * receiver to fetch after resuming the guest (post-copy).  The body then
+ * ends with XC_SAVE_ID_POSTCOPY:
+ *
+ *     uint32_t         : number of pages left behind
+ *     uint64_t[]       : their PFNs
+ *
+ * and the trailer is followed by a post-copy phase, in which the main
+ * stream carries traffic both ways.  The receiver asks for the pages its
+ * guest faults on:
+ *
+ *     uint64_t         : PFN wanted, POSTCOPY_REQ_DONE once all are in
+ *
+ * while the sender answers those first and pushes the others behind them,
+ * in batches of:
+ *
+ *     uint32_t         : number of pages, 0 once all have been sent
+ *     uint64_t[]       : PFN array, POSTCOPY_PFN_ABSENT set for pages the
+ *                        guest no longer has
+ *     page data        : PAGE_SIZE bytes for each page not absent
+ *
  *
  * BODY PHASE - Format B (for Remus with compression)
  * ----------
@@ -129,6 +195,13 @@
  *    If marker contains SKIPFLAG, then the offset_ptr is advanced
  *   by RUNLEN * sizeof(WORD).
  *
+ * A chunk of compressed data may instead come packed further, with LZ4
+ * (block format), as XC_SAVE_ID_COMPRESSED_PACKED:
+ *
+ *     unsigned long        : Size of the packed data to follow
+ *     unsigned long        : Size of the compressed data it unpacks to
+ *     packed data
+ *
  * If chunk type is 0 then body phase is complete.
  *
  * There can be one or more chunks with type XC_SAVE_ID_COMPRESSED_DATA,
@@ -259,6 +332,35 @@
 #define XC_SAVE_ID_HVM_ACCESS_RING_PFN  -16
 #define XC_SAVE_ID_HVM_SHARING_RING_PFN -17
 #define XC_SAVE_ID_TOOLSTACK          -18 /* Optional toolstack specific info */
+#define XC_SAVE_ID_PAGE_STREAMS       -19 /* Page batches on extra streams */
+#define XC_SAVE_ID_STREAM_BATCH       -20 /* Next batch is on a page stream */
+#define XC_SAVE_ID_POSTCOPY           -21 /* Pages fetched after resuming */
+#define XC_SAVE_ID_ELIDED_PAGES       -22 /* Pages left out of next batch */
+#define XC_SAVE_ID_COMPRESSED_PACKED  -23 /* LZ4 packed compressed data */
+#define XC_SAVE_ID_PFN_LAYOUT         -24 /* (HVM-only) Populated 2M extents */
+#define XC_SAVE_ID_SAME_HOST          -25 /* (HVM-only) Pages copied locally */
+
+/* Most page streams that may be used besides the main one */
+#define MAX_PAGE_STREAMS 16
+
+struct xc_elided_page {
+    uint64_t pfn;
+    uint64_t src;       /* ELIDED_ZERO, or PFN holding the same contents */
+};
+#define ELIDED_ZERO (~0ULL)
+#define ELIDED_SAME_HOST (1ULL << 62)
+
+/* Post-copy phase, in xc_postcopy.c */
+#define POSTCOPY_PFN_ABSENT (1ULL << 63)
+#define POSTCOPY_REQ_DONE   (~0ULL)
+
+int xc_postcopy_send(xc_interface *xch, int io_fd, uint32_t dom,
+                     unsigned long *pending, unsigned long p2m_size);
+int xc_postcopy_receive(xc_interface *xch, int io_fd, uint32_t dom,
+                        const uint64_t *pfns, unsigned long nr,
+                        unsigned long p2m_size,
+                        int (*resume)(uint32_t domid, void *data),
+                        void *data);
 
 /*
 ** We process save/restore/migrate in batches of pages; the below
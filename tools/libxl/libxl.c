@@ -52,7 +52,11 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
     LIBXL_LIST_INIT(&ctx->pollers_idle);
 
     LIBXL_LIST_INIT(&ctx->efds);
-    LIBXL_TAILQ_INIT(&ctx->etimes);
+    ctx->etimes = NULL;
+    ctx->etimes_used = ctx->etimes_allocd = 0;
+    ctx->etimes_seq = 0;
+    ctx->epfd = -1;
+    ctx->epoll_pass = 0;
 
     ctx->watch_slots = 0;
     LIBXL_SLIST_INIT(&ctx->watch_freeslots);
@@ -66,6 +70,15 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
         
     ctx->sigchld_selfpipe[0] = -1;
 
+    ctx->hotplug_max = 0;
+    ctx->hotplug_running = 0;
+    LIBXL_TAILQ_INIT(&ctx->hotplug_waiting);
+
+    LIBXL_LIST_INIT(&ctx->qmp_handlers);
+
+    ctx->numa_tinfo = NULL;
+    ctx->numa_nr_cpus = 0;
+
     /* The mutex is special because we can't idempotently destroy it */
 
     if (libxl__init_recursive_mutex(ctx, &ctx->lock) < 0) {
@@ -82,6 +95,9 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
     rc = libxl__poller_init(ctx, &ctx->poller_app);
     if (rc) goto out;
 
+    if (flags & LIBXL_CTX_EPOLL)
+        libxl__epoll_init(ctx);
+
     if ( stat(XENSTORE_PID_FILE, &stat_buf) != 0 ) {
         LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "Is xenstore daemon running?\n"
                      "failed to stat %s", XENSTORE_PID_FILE);
@@ -150,7 +166,9 @@ int libxl_ctx_free(libxl_ctx *ctx)
     /* Now there should be no more events requested from the application: */
 
     assert(LIBXL_LIST_EMPTY(&ctx->efds));
-    assert(LIBXL_TAILQ_EMPTY(&ctx->etimes));
+    assert(!ctx->etimes_used);
+    free(ctx->etimes);
+    if (ctx->epfd >= 0) close(ctx->epfd);
 
     if (ctx->xch) xc_interface_close(ctx->xch);
     libxl_version_info_dispose(&ctx->version_info);
@@ -166,6 +184,11 @@ int libxl_ctx_free(libxl_ctx *ctx)
 
     free(ctx->watch_slots);
 
+    libxl__qmp_close_all(ctx);
+
+    if (ctx->numa_tinfo)
+        libxl_cputopology_list_free(ctx->numa_tinfo, ctx->numa_nr_cpus);
+
     discard_events(&ctx->occurred);
 
     /* If we have outstanding children, then the application inherits
@@ -185,6 +208,36 @@ int libxl_ctx_free(libxl_ctx *ctx)
     return 0;
 }
 
+int libxl_set_hotplug_parallelism(libxl_ctx *ctx, int max)
+{
+    GC_INIT(ctx);
+
+    if (max < 0) {
+        LOG(ERROR, "invalid hotplug parallelism %d", max);
+        GC_FREE;
+        return ERROR_INVAL;
+    }
+
+    CTX_LOCK;
+    CTX->hotplug_max = max;
+    CTX_UNLOCK;
+
+    GC_FREE;
+    return 0;
+}
+
+void libxl_set_phase_timing_callback(libxl_ctx *ctx,
+                                     libxl_phase_timing_callback *callback,
+                                     void *user)
+{
+    GC_INIT(ctx);
+    CTX_LOCK;
+    CTX->timing_callback = callback;
+    CTX->timing_callback_user = user;
+    CTX_UNLOCK;
+    GC_FREE;
+}
+
 void libxl_string_list_dispose(libxl_string_list *psl)
 {
     int i;
@@ -571,6 +624,58 @@ libxl_dominfo * libxl_list_domain(libxl_ctx *ctx, int *nb_domain_out)
     return ptr;
 }
 
+int libxl_list_domain_changes(libxl_ctx *ctx, uint64_t *generation,
+                              libxl_dominfo **changed_r, int *nb_changed_r,
+                              uint32_t **gone_r, int *nb_gone_r, bool *all_r)
+{
+    GC_INIT(ctx);
+    xc_domaininfo_t *info = NULL;
+    uint16_t *gone = NULL;
+    xc_domain_changes_t changes;
+    unsigned int max_domains = 64, max_gone = 32, i;
+    libxl_dominfo *changed;
+    uint32_t *gone_out;
+    int rc;
+
+    /* Retry with larger buffers if more changed than they could hold */
+    for (;;) {
+        info = libxl__realloc(gc, info, max_domains * sizeof(*info));
+        gone = libxl__realloc(gc, gone, max_gone * sizeof(*gone));
+        if (xc_domain_changes(CTX->xch, *generation, max_domains, info,
+                              max_gone, gone, &changes)) {
+            LOGE(ERROR, "getting domain list changes");
+            rc = ERROR_FAIL;
+            goto out;
+        }
+        if (changes.num_domains <= max_domains &&
+            changes.num_gone <= max_gone)
+            break;
+        if (changes.num_domains > max_domains)
+            max_domains = changes.num_domains + 16;
+        if (changes.num_gone > max_gone)
+            max_gone = changes.num_gone + 16;
+    }
+
+    changed = libxl__calloc(NOGC, changes.num_domains ?: 1, sizeof(*changed));
+    for (i = 0; i < changes.num_domains; i++)
+        xcinfo2xlinfo(&info[i], &changed[i]);
+    gone_out = libxl__calloc(NOGC, changes.num_gone ?: 1, sizeof(*gone_out));
+    for (i = 0; i < changes.num_gone; i++)
+        gone_out[i] = gone[i];
+
+    *generation = changes.generation;
+    *changed_r = changed;
+    *nb_changed_r = changes.num_domains;
+    *gone_r = gone_out;
+    *nb_gone_r = changes.num_gone;
+    *all_r = changes.all;
+    rc = 0;
+
+ out:
+    GC_FREE;
+    return rc;
+}
+
 int libxl_domain_info(libxl_ctx *ctx, libxl_dominfo *info_r,
                       uint32_t domid) {
     xc_domaininfo_t xcinfo;
@@ -786,6 +891,7 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->same_host = flags & LIBXL_SUSPEND_SAME_HOST;
 
     libxl__domain_suspend(egc, dss);
     return AO_INPROGRESS;
@@ -1376,6 +1482,8 @@ void libxl__destroy_domid(libxl__egc *egc, libxl__destroy_domid_state *dis)
     char *pid;
     int rc, dm_present;
 
+    libxl__timing_start(gc, &dis->timing, "destroy", "pci");
+
     rc = libxl_domain_info(ctx, NULL, domid);
     switch(rc) {
     case 0:
@@ -1417,11 +1525,13 @@ void libxl__destroy_domid(libxl__egc *egc, libxl__destroy_domid_state *dis)
         LIBXL__LOG_ERRNOVAL(ctx, LIBXL__LOG_ERROR, rc, "xc_domain_pause failed for %d", domid);
     }
     if (dm_present) {
+        libxl__timing_phase(gc, &dis->timing, "device model");
         if (libxl__destroy_device_model(gc, domid) < 0)
             LIBXL__LOG(ctx, LIBXL__LOG_ERROR, "libxl__destroy_device_model failed for %d", domid);
 
         libxl__qmp_cleanup(gc, domid);
     }
+    libxl__timing_phase(gc, &dis->timing, "devices");
     dis->drs.ao = ao;
     dis->drs.domid = domid;
     dis->drs.callback = devices_destroy_cb;
@@ -1431,6 +1541,7 @@ void libxl__destroy_domid(libxl__egc *egc, libxl__destroy_domid_state *dis)
 
 out:
     assert(rc);
+    libxl__timing_finish(gc, &dis->timing, domid, rc);
     dis->callback(egc, dis, rc);
     return;
 }
@@ -1446,6 +1557,8 @@ static void devices_destroy_cb(libxl__egc *egc,
     char *dom_path;
     char *vm_path;
 
+    libxl__timing_phase(gc, &dis->timing, "domain");
+
     dom_path = libxl__xs_get_dompath(gc, domid);
     if (!dom_path) {
         rc = ERROR_FAIL;
@@ -1481,6 +1594,7 @@ static void devices_destroy_cb(libxl__egc *egc,
     rc = 0;
 
 out:
+    libxl__timing_finish(gc, &dis->timing, domid, rc);
     dis->callback(egc, dis, rc);
     return;
 }
@@ -4507,6 +4621,7 @@ static int sched_credit2_domain_get(libxl__gc *gc, uint32_t domid,
     libxl_domain_sched_params_init(scinfo);
     scinfo->sched = LIBXL_SCHEDULER_CREDIT2;
     scinfo->weight = sdom.weight;
+    scinfo->gang = sdom.gang;
 
     return 0;
 }
@@ -4532,6 +4647,9 @@ static int sched_credit2_domain_set(libxl__gc *gc, uint32_t domid,
         sdom.weight = scinfo->weight;
     }
 
+    if (scinfo->gang != LIBXL_DOMAIN_SCHED_PARAM_GANG_DEFAULT)
+        sdom.gang = !!scinfo->gang;
+
     rc = xc_sched_credit2_domain_set(CTX->xch, domid, &sdom);
     if ( rc < 0 ) {
         LOGE(ERROR, "setting domain sched credit2");
@@ -369,6 +369,57 @@
  */
 #define LIBXL_HAVE_DOMAIN_CREATE_RESTORE_PARAMS 1
 
+/*
+ * LIBXL_HAVE_SCHED_CREDIT2_GANG 1
+ *
+ * If this is defined, libxl_domain_sched_params has a "gang" field,
+ * honoured by the credit2 scheduler: a domain with gang set to 1 only
+ * shares cores (SMT siblings) with its own vcpus.
+ */
+#define LIBXL_HAVE_SCHED_CREDIT2_GANG 1
+
+/*
+ * LIBXL_HAVE_HOTPLUG_PARALLELISM 1
+ *
+ * If this is defined, libxl_set_hotplug_parallelism() is available.
+ */
+#define LIBXL_HAVE_HOTPLUG_PARALLELISM 1
+
+/*
+ * LIBXL_HAVE_CTX_EPOLL 1
+ *
+ * If this is defined, libxl_ctx_alloc() accepts the LIBXL_CTX_EPOLL flag.
+ */
+#define LIBXL_HAVE_CTX_EPOLL 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_CREATE_MANY 1
+ *
+ * If this is defined, libxl_domain_create_many() is available.
+ */
+#define LIBXL_HAVE_DOMAIN_CREATE_MANY 1
+
+/*
+ * LIBXL_HAVE_PHASE_TIMING 1
+ *
+ * If this is defined, libxl_set_phase_timing_callback() is available.
+ */
+#define LIBXL_HAVE_PHASE_TIMING 1
+
+/*
+ * LIBXL_HAVE_LIST_DOMAIN_CHANGES 1
+ *
+ * If this is defined, libxl_list_domain_changes() is available.
+ */
+#define LIBXL_HAVE_LIST_DOMAIN_CHANGES 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_SAME_HOST 1
+ *
+ * If this is defined, libxl_domain_suspend() takes LIBXL_SUSPEND_SAME_HOST.
+ */
+#define LIBXL_HAVE_SUSPEND_SAME_HOST 1
+
 /* Functions annotated with LIBXL_EXTERNAL_CALLERS_ONLY may not be
  * called from within libxl itself. Callers outside libxl, who
  * do not #include libxl_internal.h, are fine. */
@@ -560,11 +611,57 @@ typedef struct {
 #define LIBXL_VERSION 0
 
 /* context functions */
+
+/*
+ * With LIBXL_CTX_EPOLL, libxl's own event loop (libxl_event_wait, and
+ * synchronous calls of asynchronous operations) keeps the fds it waits
+ * on registered with epoll, rather than polling all of them on every
+ * pass, which helps a ctx with many domains and operations in flight.
+ * It has no effect on libxl_osevent_beforepoll, or where epoll is not
+ * available.
+ */
+#define LIBXL_CTX_EPOLL (1U << 0)
+
 int libxl_ctx_alloc(libxl_ctx **pctx, int version,
-                    unsigned flags /* none currently defined */,
+                    unsigned flags /* LIBXL_CTX_* */,
                     xentoollog_logger *lg);
 int libxl_ctx_free(libxl_ctx *ctx /* 0 is OK */);
 
+/*
+ * Limits how many hotplug scripts the ctx runs at once, across all its
+ * operations; 0, the default, means no limit.  The scripts of devices
+ * beyond the limit wait, in order, for others to finish.  A new limit
+ * applies to the scripts started after it is set.
+ */
+int libxl_set_hotplug_parallelism(libxl_ctx *ctx, int max);
+
+/*
+ * Timings of domain creation (op "create"), destruction ("destroy",
+ * reported separately for a stub domain), save ("save") and restore
+ * ("restore"), phase by phase.  Times are in microseconds, start_us
+ * from the beginning of the operation.  The phase names are for
+ * humans and may change.
+ */
+typedef struct {
+    const char *name;
+    uint64_t start_us;
+    uint64_t duration_us;
+} libxl_phase_timing;
+
+/*
+ * Called, if set, as each such operation completes, with rc 0 or the
+ * error it failed with.  phases and the strings are valid only during
+ * the call.  The callback is made with libxl's internal lock held, so
+ * it must not call libxl.  NULL stops the calls.
+ */
+typedef void libxl_phase_timing_callback(void *user, const char *op,
+                                         uint32_t domid, int rc,
+                                         const libxl_phase_timing *phases,
+                                         int nr_phases, uint64_t total_us);
+void libxl_set_phase_timing_callback(libxl_ctx *ctx,
+                                     libxl_phase_timing_callback *callback,
+                                     void *user);
+
 /* domain related functions */
 
 int libxl_domain_create_new(libxl_ctx *ctx, libxl_domain_config *d_config,
@@ -579,6 +676,25 @@ int libxl_domain_create_restore(libxl_ctx *ctx, libxl_domain_config *d_config,
                                 const libxl_asyncprogress_how *aop_console_how)
                                 LIBXL_EXTERNAL_CALLERS_ONLY;
 
+/*
+ * Creates nr domains, as libxl_domain_create_new would each of
+ * d_configs[], with at most max_parallel (0 means all) of them being
+ * created at once.  The domains are started in order and left paused.
+ *
+ * On completion domids[i] is the new domain's id, or ~0U, and
+ * rcs[i] is 0 or the error which creating it failed with.  The
+ * operation as a whole fails with ERROR_FAIL if any domain could not
+ * be created; the others are kept regardless.
+ *
+ * Since the domains are built one after another by the same ctx, NUMA
+ * placement of each domain takes into account those before it.
+ */
+int libxl_domain_create_many(libxl_ctx *ctx, int nr,
+                             libxl_domain_config *d_configs,
+                             uint32_t *domids, int *rcs, int max_parallel,
+                             const libxl_asyncop_how *ao_how)
+                             LIBXL_EXTERNAL_CALLERS_ONLY;
+
 #if defined(LIBXL_API_VERSION) && LIBXL_API_VERSION < 0x040400
 
 int static inline libxl_domain_create_restore_0x040200(
@@ -613,6 +729,10 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+/* The fd leads to a restore on this host, which reads the data pages of
+ * an HVM guest from its memory rather than from fd.  The guest must not be
+ * destroyed until the restore has finished. */
+#define LIBXL_SUSPEND_SAME_HOST 4
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
@@ -714,6 +834,24 @@ int libxl_domain_info(libxl_ctx*, libxl_dominfo *info_r,
 libxl_dominfo * libxl_list_domain(libxl_ctx*, int *nb_domain_out);
 void libxl_dominfo_list_free(libxl_dominfo *list, int nb_domain);
 
+/*
+ * For pollers of the domain list: the domains which changed since
+ * *generation, which is 0 the first time, and is updated for the next
+ * call.  A domain counts as changed when it is created, paused or
+ * unpaused by the toolstack, shut down, resumed or killed; not when its
+ * cpu time or memory change.
+ *
+ * *changed_r (free with libxl_dominfo_list_free) lists the domains which
+ * changed, and *gone_r (free with free) the domids of those destroyed.
+ * If *all_r is set then *changed_r is instead every domain, and the
+ * caller should replace its list with it: this happens the first time,
+ * and if *generation is too old for Xen to know what was destroyed since.
+ * A domain may be reported as changed more than once.
+ */
+int libxl_list_domain_changes(libxl_ctx *ctx, uint64_t *generation,
+                              libxl_dominfo **changed_r, int *nb_changed_r,
+                              uint32_t **gone_r, int *nb_gone_r, bool *all_r);
+
 libxl_cpupoolinfo * libxl_list_cpupool(libxl_ctx*, int *nb_pool_out);
 void libxl_cpupoolinfo_list_free(libxl_cpupoolinfo *list, int nb_pool);
 
@@ -989,6 +1127,7 @@ int libxl_sched_credit_params_set(libxl_ctx *ctx, uint32_t poolid,
 #define LIBXL_DOMAIN_SCHED_PARAM_SLICE_DEFAULT     -1
 #define LIBXL_DOMAIN_SCHED_PARAM_LATENCY_DEFAULT   -1
 #define LIBXL_DOMAIN_SCHED_PARAM_EXTRATIME_DEFAULT -1
+#define LIBXL_DOMAIN_SCHED_PARAM_GANG_DEFAULT      -1
 
 int libxl_domain_sched_params_get(libxl_ctx *ctx, uint32_t domid,
                                   libxl_domain_sched_params *params);
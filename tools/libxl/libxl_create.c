@@ -202,7 +202,7 @@ int libxl__domain_build_info_setdefault(libxl__gc *gc,
     if (b_info->target_memkb == LIBXL_MEMKB_DEFAULT)
         b_info->target_memkb = b_info->max_memkb;
 
-    libxl_defbool_setdefault(&b_info->claim_mode, false);
+    libxl_defbool_setdefault(&b_info->claim_mode, true);
 
     libxl_defbool_setdefault(&b_info->localtime, false);
 
@@ -632,8 +632,6 @@ static void domcreate_bootloader_done(libxl__egc *egc,
 static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *aodevs,
                                 int ret);
 
-static void domcreate_attach_vtpms(libxl__egc *egc, libxl__multidev *multidev,
-                                   int ret);
 static void domcreate_attach_pci(libxl__egc *egc, libxl__multidev *aodevs,
                                  int ret);
 
@@ -669,6 +667,9 @@ static void initiate_domain_create(libxl__egc *egc,
     const int restore_fd = dcs->restore_fd;
     memset(&dcs->build_state, 0, sizeof(dcs->build_state));
 
+    libxl__timing_start(gc, &dcs->timing,
+                        restore_fd >= 0 ? "restore" : "create", "make");
+
     domid = 0;
 
     ret = libxl__domain_create_info_setdefault(gc, &d_config->c_info);
@@ -708,6 +709,7 @@ static void initiate_domain_create(libxl__egc *egc,
         domcreate_bootloader_done(egc, &dcs->bl, 0);
     } else  {
         LOG(DEBUG, "running bootloader");
+        libxl__timing_phase(gc, &dcs->timing, "bootloader");
         dcs->bl.callback = domcreate_bootloader_done;
         dcs->bl.console_available = domcreate_bootloader_console_available;
         dcs->bl.info = &d_config->b_info;
@@ -778,6 +780,7 @@ static void domcreate_bootloader_done(libxl__egc *egc,
     dcs->dmss.callback = domcreate_devmodel_started;
 
     if ( restore_fd < 0 ) {
+        libxl__timing_phase(gc, &dcs->timing, "build");
         rc = libxl__domain_build(gc, d_config, domid, state);
         domcreate_rebuild_done(egc, dcs, rc);
         return;
@@ -785,6 +788,7 @@ static void domcreate_bootloader_done(libxl__egc *egc,
 
     /* Restore */
 
+    libxl__timing_phase(gc, &dcs->timing, "restore memory");
     rc = libxl__build_pre(gc, domid, d_config, state);
     if (rc)
         goto out;
@@ -938,10 +942,20 @@ static void domcreate_rebuild_done(libxl__egc *egc,
     }
 
     store_libxl_entry(gc, domid, &d_config->b_info);
+    libxl__timing_phase(gc, &dcs->timing, "devices");
 
+    /*
+     * Attach all the devices which don't need the device model at once,
+     * so that their hotplug scripts run concurrently, and wait for them
+     * all before starting it.  HVM nics are added once the device model
+     * has started, since the script for their emulated half needs it.
+     */
     libxl__multidev_begin(ao, &dcs->multidev);
     dcs->multidev.callback = domcreate_launch_dm;
     libxl__add_disks(egc, ao, domid, d_config, &dcs->multidev);
+    if (d_config->c_info.type == LIBXL_DOMAIN_TYPE_PV)
+        libxl__add_nics(egc, ao, domid, d_config, &dcs->multidev);
+    libxl__add_vtpms(egc, ao, domid, d_config, &dcs->multidev);
     libxl__multidev_prepared(egc, &dcs->multidev, 0);
 
     return;
@@ -964,10 +978,12 @@ static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *multidev,
     libxl__domain_build_state *const state = &dcs->build_state;
 
     if (ret) {
-        LOG(ERROR, "unable to add disk devices");
+        LOG(ERROR, "unable to add devices");
         goto error_out;
     }
 
+    libxl__timing_phase(gc, &dcs->timing, "device model");
+
     for (i = 0; i < d_config->b_info.num_ioports; i++) {
         libxl_ioport_range *io = &d_config->b_info.ioports[i];
 
@@ -1118,17 +1134,19 @@ static void domcreate_devmodel_started(libxl__egc *egc,
         }
     }
 
-    /* Plug nic interfaces */
-    if (d_config->num_nics > 0) {
+    /* Plug HVM nic interfaces */
+    if (d_config->c_info.type == LIBXL_DOMAIN_TYPE_HVM &&
+        d_config->num_nics > 0) {
         /* Attach nics */
+        libxl__timing_phase(gc, &dcs->timing, "nics");
         libxl__multidev_begin(ao, &dcs->multidev);
-        dcs->multidev.callback = domcreate_attach_vtpms;
+        dcs->multidev.callback = domcreate_attach_pci;
         libxl__add_nics(egc, ao, domid, d_config, &dcs->multidev);
         libxl__multidev_prepared(egc, &dcs->multidev, 0);
         return;
     }
 
-    domcreate_attach_vtpms(egc, &dcs->multidev, 0);
+    domcreate_attach_pci(egc, &dcs->multidev, 0);
     return;
 
 error_out:
@@ -1136,39 +1154,6 @@ error_out:
     domcreate_complete(egc, dcs, ret);
 }
 
-static void domcreate_attach_vtpms(libxl__egc *egc,
-                                   libxl__multidev *multidev,
-                                   int ret)
-{
-   libxl__domain_create_state *dcs = CONTAINER_OF(multidev, *dcs, multidev);
-   STATE_AO_GC(dcs->ao);
-   int domid = dcs->guest_domid;
-
-   libxl_domain_config* const d_config = dcs->guest_config;
-
-   if(ret) {
-       LOG(ERROR, "unable to add nic devices");
-       goto error_out;
-   }
-
-    /* Plug vtpm devices */
-   if (d_config->num_vtpms > 0) {
-       /* Attach vtpms */
-       libxl__multidev_begin(ao, &dcs->multidev);
-       dcs->multidev.callback = domcreate_attach_pci;
-       libxl__add_vtpms(egc, ao, domid, d_config, &dcs->multidev);
-       libxl__multidev_prepared(egc, &dcs->multidev, 0);
-       return;
-   }
-
-   domcreate_attach_pci(egc, multidev, 0);
-   return;
-
-error_out:
-   assert(ret);
-   domcreate_complete(egc, dcs, ret);
-}
-
 static void domcreate_attach_pci(libxl__egc *egc, libxl__multidev *multidev,
                                  int ret)
 {
@@ -1182,10 +1167,13 @@ static void domcreate_attach_pci(libxl__egc *egc, libxl__multidev *multidev,
     libxl_domain_config *const d_config = dcs->guest_config;
 
     if (ret) {
-        LOG(ERROR, "unable to add vtpm devices");
+        LOG(ERROR, "unable to add nic devices");
         goto error_out;
     }
 
+    if (d_config->num_pcidevs)
+        libxl__timing_phase(gc, &dcs->timing, "pci");
+
     for (i = 0; i < d_config->num_pcidevs; i++)
         libxl__device_pci_add(gc, domid, &d_config->pcidevs[i], 1);
 
@@ -1221,6 +1209,7 @@ static void domcreate_complete(libxl__egc *egc,
 
     if (rc) {
         if (dcs->guest_domid) {
+            libxl__timing_phase(gc, &dcs->timing, "destroy");
             dcs->dds.ao = ao;
             dcs->dds.domid = dcs->guest_domid;
             dcs->dds.callback = domcreate_destruction_cb;
@@ -1229,6 +1218,7 @@ static void domcreate_complete(libxl__egc *egc,
         }
         dcs->guest_domid = -1;
     }
+    libxl__timing_finish(gc, &dcs->timing, dcs->guest_domid, rc);
     dcs->callback(egc, dcs, rc, dcs->guest_domid);
 }
 
@@ -1243,6 +1233,7 @@ static void domcreate_destruction_cb(libxl__egc *egc,
         LOG(ERROR, "unable to destroy domain %u following failed creation",
                    dds->domid);
 
+    libxl__timing_finish(gc, &dcs->timing, dcs->guest_domid, ERROR_FAIL);
     dcs->callback(egc, dcs, ERROR_FAIL, dcs->guest_domid);
 }
 
@@ -1312,6 +1303,123 @@ int libxl_domain_create_restore(libxl_ctx *ctx, libxl_domain_config *d_config,
                             params->checkpointed_stream, ao_how, aop_console_how);
 }
 
+/*----- creating many domains in one operation -----*/
+
+typedef struct libxl__domain_create_many_state
+    libxl__domain_create_many_state;
+
+typedef struct {
+    libxl__domain_create_state dcs;
+    libxl__domain_create_many_state *cms;
+} libxl__domain_create_many_one;
+
+struct libxl__domain_create_many_state {
+    libxl__ao *ao;
+    uint32_t *domids;
+    int *rcs;
+    int nr, max_parallel;
+    /* private */
+    libxl__domain_create_many_one *ones; /* [nr] */
+    int next, running, failed;
+    bool starting;
+};
+
+static void create_many_one_done(libxl__egc *egc,
+                                 libxl__domain_create_state *dcs,
+                                 int rc, uint32_t domid);
+
+/* Starts creating domains until max_parallel are in progress, or
+ * completes the ao once they are all done. */
+static void create_many_next(libxl__egc *egc,
+                             libxl__domain_create_many_state *cms)
+{
+    STATE_AO_GC(cms->ao);
+
+    /* A creation may fail straight away, calling us back from within
+     * initiate_domain_create: the outer call carries on. */
+    if (cms->starting)
+        return;
+
+    cms->starting = 1;
+    while (cms->next < cms->nr &&
+           (!cms->max_parallel || cms->running < cms->max_parallel)) {
+        libxl__domain_create_many_one *one = &cms->ones[cms->next++];
+
+        cms->running++;
+        initiate_domain_create(egc, &one->dcs);
+    }
+    cms->starting = 0;
+
+    if (cms->running)
+        return;
+
+    if (cms->failed)
+        LOG(ERROR, "failed to create %d of %d domains", cms->failed, cms->nr);
+    libxl__ao_complete(egc, ao, cms->failed ? ERROR_FAIL : 0);
+}
+
+static void create_many_one_done(libxl__egc *egc,
+                                 libxl__domain_create_state *dcs,
+                                 int rc, uint32_t domid)
+{
+    libxl__domain_create_many_one *one = CONTAINER_OF(dcs, *one, dcs);
+    libxl__domain_create_many_state *cms = one->cms;
+    int i = one - cms->ones;
+
+    cms->running--;
+    cms->rcs[i] = rc;
+    if (rc) {
+        cms->domids[i] = ~0U;
+        cms->failed++;
+    } else {
+        cms->domids[i] = domid;
+    }
+
+    create_many_next(egc, cms);
+}
+
+int libxl_domain_create_many(libxl_ctx *ctx, int nr,
+                             libxl_domain_config *d_configs,
+                             uint32_t *domids, int *rcs, int max_parallel,
+                             const libxl_asyncop_how *ao_how)
+{
+    AO_CREATE(ctx, 0, ao_how);
+    libxl__domain_create_many_state *cms;
+    int i;
+
+    if (nr < 0 || max_parallel < 0) {
+        LOG(ERROR, "invalid domain count %d or parallelism %d",
+            nr, max_parallel);
+        return AO_ABORT(ERROR_INVAL);
+    }
+
+    GCNEW(cms);
+    cms->ao = ao;
+    cms->domids = domids;
+    cms->rcs = rcs;
+    cms->nr = nr;
+    cms->max_parallel = max_parallel;
+    GCNEW_ARRAY(cms->ones, nr);
+
+    for (i = 0; i < nr; i++) {
+        libxl__domain_create_many_one *one = &cms->ones[i];
+
+        one->cms = cms;
+        one->dcs.ao = ao;
+        one->dcs.guest_config = &d_configs[i];
+        one->dcs.restore_fd = -1;
+        one->dcs.callback = create_many_one_done;
+        one->dcs.checkpointed_stream = 0;
+        libxl__ao_progress_gethow(&one->dcs.aop_console_how, NULL);
+        domids[i] = ~0U;
+        rcs[i] = 0;
+    }
+
+    create_many_next(egc, cms);
+
+    return AO_INPROGRESS;
+}
+
 /*
  * Local variables:
  * mode: C
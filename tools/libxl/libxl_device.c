@@ -926,6 +926,13 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
         goto out;
     }
 
+    /* Wait for a running script to finish if there are already enough */
+    if (CTX->hotplug_max && CTX->hotplug_running >= CTX->hotplug_max) {
+        LOG(DEBUG, "queueing hotplug script for device %s", be_path);
+        LIBXL_TAILQ_INSERT_TAIL(&CTX->hotplug_waiting, aodev, hotplug_entry);
+        return;
+    }
+
     /* Set hotplug timeout */
     rc = libxl__ev_time_register_rel(gc, &aodev->timeout,
                                      device_hotplug_timeout_cb,
@@ -954,6 +961,7 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
     }
 
     assert(libxl__ev_child_inuse(&aodev->child));
+    CTX->hotplug_running++;
 
     return;
 
@@ -989,9 +997,18 @@ static void device_hotplug_child_death_cb(libxl__egc *egc,
     STATE_AO_GC(aodev->ao);
     char *be_path = libxl__device_backend_path(gc, aodev->dev);
     char *hotplug_error;
+    libxl__ao_device *waiting;
 
     device_hotplug_clean(gc, aodev);
 
+    /* Start scripts queued by device_hotplug, of any ao, in order */
+    CTX->hotplug_running--;
+    while ((waiting = LIBXL_TAILQ_FIRST(&CTX->hotplug_waiting)) &&
+           (!CTX->hotplug_max || CTX->hotplug_running < CTX->hotplug_max)) {
+        LIBXL_TAILQ_REMOVE(&CTX->hotplug_waiting, waiting, hotplug_entry);
+        device_hotplug(egc, waiting);
+    }
+
     if (status) {
         libxl_report_child_exitstatus(CTX, LIBXL__LOG_ERROR,
                                       aodev->what, pid, status);
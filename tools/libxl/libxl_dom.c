@@ -128,6 +128,98 @@ static int numa_cmpf(const libxl__numa_candidate *c1,
     return c2->free_memkb - c1->free_memkb;
 }
 
+/*
+ * If the host has been split in per-node cpupools (by "xl cpupool-numa-split"
+ * or the cpupool_numa_split boot option), placing a domain on a node means
+ * putting it in that node's pool too.  This is only done for domains that
+ * were left in Pool-0, and only if every pool spans exactly one node.
+ * *placed tells whether the domain has been placed; if not, the caller
+ * falls back to placement within the domain's current cpupool.
+ */
+static int numa_place_domain_split(libxl__gc *gc, uint32_t domid,
+                                   libxl_domain_build_info *info,
+                                   uint32_t memkb, bool *placed)
+{
+    libxl__numa_candidate candidate;
+    libxl_cpupoolinfo *poolinfo;
+    libxl_bitmap nodemap, split_cpumap;
+    int nr_pools, nr_nodes, *node_pool;
+    int i, p, node, found, rc;
+
+    *placed = false;
+    libxl__numa_candidate_init(&candidate);
+    libxl_bitmap_init(&nodemap);
+    libxl_bitmap_init(&split_cpumap);
+
+    poolinfo = libxl_list_cpupool(CTX, &nr_pools);
+    if (!poolinfo)
+        return ERROR_FAIL;
+
+    nr_nodes = libxl_get_max_nodes(CTX);
+    if (nr_nodes <= 0) {
+        rc = ERROR_FAIL;
+        goto out;
+    }
+    GCNEW_ARRAY(node_pool, nr_nodes);
+    for (node = 0; node < nr_nodes; node++)
+        node_pool[node] = -1;
+
+    if (libxl_node_bitmap_alloc(CTX, &nodemap, 0) ||
+        libxl_cpu_bitmap_alloc(CTX, &split_cpumap, 0)) {
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = 0;
+    if (nr_pools < 2)
+        goto out;
+
+    for (p = 0; p < nr_pools; p++) {
+        rc = libxl_cpumap_to_nodemap(CTX, &poolinfo[p].cpumap, &nodemap);
+        if (rc)
+            goto out;
+        if (libxl_bitmap_count_set(&nodemap) != 1)
+            goto out;
+        libxl_for_each_set_bit(node, nodemap)
+            break;
+        if (node >= nr_nodes || node_pool[node] != -1)
+            goto out;
+        node_pool[node] = poolinfo[p].poolid;
+
+        libxl_for_each_set_bit(i, poolinfo[p].cpumap)
+            libxl_bitmap_set(&split_cpumap, i);
+    }
+
+    /* Single node candidates only: each of them maps to exactly one pool */
+    rc = libxl__get_numa_candidate(gc, memkb, info->max_vcpus, 1, 1,
+                                   &split_cpumap, numa_cmpf,
+                                   &candidate, &found);
+    if (rc || found == 0)
+        goto out;
+
+    libxl__numa_candidate_get_nodemap(gc, &candidate, &info->nodemap);
+    libxl_for_each_set_bit(node, info->nodemap)
+        break;
+
+    if (node_pool[node] != 0) {
+        rc = libxl_cpupool_movedomain(CTX, node_pool[node], domid);
+        if (rc)
+            goto out;
+    }
+    *placed = true;
+
+    LOG(DETAIL, "NUMA placement on node %d (cpupool %d), with %d cpus and "
+                "%"PRIu32" KB free", node, node_pool[node],
+                candidate.nr_cpus, candidate.free_memkb / 1024);
+
+ out:
+    libxl__numa_candidate_dispose(&candidate);
+    libxl_bitmap_dispose(&split_cpumap);
+    libxl_bitmap_dispose(&nodemap);
+    libxl_cpupoolinfo_list_free(poolinfo, nr_pools);
+    return rc;
+}
+
 /* The actual automatic NUMA placement routine */
 static int numa_place_domain(libxl__gc *gc, uint32_t domid,
                              libxl_domain_build_info *info)
@@ -138,6 +230,7 @@ static int numa_place_domain(libxl__gc *gc, uint32_t domid,
     libxl_cpupoolinfo cpupool_info;
     int i, cpupool, rc = 0;
     uint32_t memkb;
+    bool placed;
 
     libxl__numa_candidate_init(&candidate);
     libxl_bitmap_init(&cpupool_nodemap);
@@ -162,6 +255,12 @@ static int numa_place_domain(libxl__gc *gc, uint32_t domid,
         goto out;
     }
 
+    if (cpupool == 0) {
+        rc = numa_place_domain_split(gc, domid, info, memkb, &placed);
+        if (rc || placed)
+            goto out;
+    }
+
     /* Find the best candidate with enough free memory and at least
      * as much pcpus as the domain has vcpus.  */
     rc = libxl__get_numa_candidate(gc, memkb, info->max_vcpus,
@@ -1296,6 +1395,7 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
         &dss->shs.callbacks.save.a;
 
     logdirty_init(&dss->logdirty);
+    libxl__timing_start(gc, &dss->timing, "save", "prepare");
 
     switch (type) {
     case LIBXL_DOMAIN_TYPE_HVM: {
@@ -1320,7 +1420,8 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
-          | (dss->hvm ? XCFLAGS_HVM : 0);
+          | (dss->hvm ? XCFLAGS_HVM : 0)
+          | (dss->same_host ? XCFLAGS_SAME_HOST : 0);
 
     dss->suspend_eventchn = -1;
     dss->guest_responded = 0;
@@ -1359,6 +1460,7 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
     callbacks->switch_qemu_logdirty = libxl__domain_suspend_common_switch_qemu_logdirty;
     dss->shs.callbacks.save.toolstack_save = libxl__toolstack_save;
 
+    libxl__timing_phase(gc, &dss->timing, "memory");
     libxl__xc_domain_save(egc, dss, vm_generationid_addr);
     return;
 
@@ -1391,6 +1493,7 @@ void libxl__xc_domain_save_done(libxl__egc *egc, void *dss_void,
     }
 
     if (type == LIBXL_DOMAIN_TYPE_HVM) {
+        libxl__timing_phase(gc, &dss->timing, "device model");
         rc = libxl__domain_suspend_device_model(gc, dss);
         if (rc) goto out;
 
@@ -1509,6 +1612,7 @@ static void domain_suspend_done(libxl__egc *egc,
     if (dss->xce != NULL)
         xc_evtchn_close(dss->xce);
 
+    libxl__timing_finish(gc, &dss->timing, domid, rc);
     dss->callback(egc, dss, rc);
 }
 
@@ -19,6 +19,10 @@
 
 #include "libxl_internal.h"
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 
 //#define DEBUG 1
 
@@ -166,8 +170,94 @@ static void osevent_hook_failed_noop(libxl__gc *gc, void *ev,
 
 /*
  * fd events
+ *
+ * With LIBXL_CTX_EPOLL, each libxl__ev_fd with nonzero events is also
+ * registered with CTX->epfd, for eventloop_iteration.  Should epoll ever
+ * refuse an fd we give up on it, and go back to polling all of them.
  */
 
+#ifdef HAVE_EPOLL
+
+void libxl__epoll_init(libxl_ctx *ctx)
+{
+    ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epfd < 0)
+        LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_WARNING,
+                         "epoll_create1 failed, using poll");
+}
+
+static uint32_t epoll_events(short events)
+{
+    return (events & POLLIN  ? EPOLLIN  : 0) |
+           (events & POLLPRI ? EPOLLPRI : 0) |
+           (events & POLLOUT ? EPOLLOUT : 0);
+}
+
+static short epoll_revents(uint32_t events)
+{
+    return (events & EPOLLIN  ? POLLIN  : 0) |
+           (events & EPOLLPRI ? POLLPRI : 0) |
+           (events & EPOLLOUT ? POLLOUT : 0) |
+           (events & EPOLLERR ? POLLERR : 0) |
+           (events & EPOLLHUP ? POLLHUP : 0);
+}
+
+static void epoll_give_up(libxl__gc *gc)
+{
+    libxl__ev_fd *efd;
+
+    close(CTX->epfd);
+    CTX->epfd = -1;
+    LIBXL_LIST_FOREACH(efd, &CTX->efds, entry)
+        efd->in_epoll = 0;
+}
+
+/* Makes ev's registration with CTX->epfd match ev->events */
+static void efd_epoll_update(libxl__gc *gc, libxl__ev_fd *ev)
+{
+    struct epoll_event ee;
+    int op, r;
+
+    if (CTX->epfd < 0)
+        return;
+
+    if (!ev->events) {
+        if (!ev->in_epoll)
+            return;
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = ev->in_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    }
+
+    memset(&ee, 0, sizeof(ee));
+    ee.events = epoll_events(ev->events);
+    ee.data.ptr = ev;
+    r = epoll_ctl(CTX->epfd, op, ev->fd, &ee);
+    if (r) {
+        LOGE(WARN, "epoll_ctl on fd %d failed, using poll", ev->fd);
+        epoll_give_up(gc);
+        return;
+    }
+    ev->in_epoll = op != EPOLL_CTL_DEL;
+}
+
+static void efd_epoll_remove(libxl__gc *gc, libxl__ev_fd *ev)
+{
+    if (!ev->in_epoll)
+        return;
+    /* If the fd has already been closed epoll has forgotten it anyway */
+    epoll_ctl(CTX->epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+    ev->in_epoll = 0;
+}
+
+#else /* !HAVE_EPOLL */
+
+void libxl__epoll_init(libxl_ctx *ctx) { }
+static void efd_epoll_update(libxl__gc *gc, libxl__ev_fd *ev) { }
+static void efd_epoll_remove(libxl__gc *gc, libxl__ev_fd *ev) { }
+
+#endif /* !HAVE_EPOLL */
+
 int libxl__ev_fd_register(libxl__gc *gc, libxl__ev_fd *ev,
                           libxl__ev_fd_callback *func,
                           int fd, short events)
@@ -187,8 +277,11 @@ int libxl__ev_fd_register(libxl__gc *gc, libxl__ev_fd *ev,
     ev->fd = fd;
     ev->events = events;
     ev->func = func;
+    ev->in_epoll = 0;
+    ev->epoll_pass = 0;
 
     LIBXL_LIST_INSERT_HEAD(&CTX->efds, ev, entry);
+    efd_epoll_update(gc, ev);
 
     rc = 0;
 
@@ -210,6 +303,7 @@ int libxl__ev_fd_modify(libxl__gc *gc, libxl__ev_fd *ev, short events)
     if (rc) goto out;
 
     ev->events = events;
+    efd_epoll_update(gc, ev);
 
     rc = 0;
  out:
@@ -229,6 +323,7 @@ void libxl__ev_fd_deregister(libxl__gc *gc, libxl__ev_fd *ev)
     DBG("ev_fd=%p deregister fd=%d", ev, ev->fd);
 
     OSEVENT_HOOK_VOID(fd,deregister, release, ev->fd, ev->nexus->for_app_reg);
+    efd_epoll_remove(gc, ev);
     LIBXL_LIST_REMOVE(ev, entry);
     ev->fd = -1;
 
@@ -267,11 +362,97 @@ static int time_rel_to_abs(libxl__gc *gc, int ms, struct timeval *abs_out)
     return 0;
 }
 
+/*
+ * The finite timeouts are kept in a binary heap, CTX->etimes, ordered by
+ * expiry and then by when they were registered; so CTX->etimes[0] is the
+ * next to expire, and registering or deregistering one is O(log n).
+ */
+
+static bool etime_before(const libxl__ev_time *a, const libxl__ev_time *b)
+{
+    if (timercmp(&a->abs, &b->abs, !=))
+        return timercmp(&a->abs, &b->abs, <);
+    return a->seq < b->seq;
+}
+
+static void etimes_set(libxl__gc *gc, int i, libxl__ev_time *ev)
+{
+    CTX->etimes[i] = ev;
+    ev->heap_index = i;
+}
+
+static void etimes_sift_up(libxl__gc *gc, int i)
+{
+    libxl__ev_time *ev = CTX->etimes[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!etime_before(ev, CTX->etimes[parent]))
+            break;
+        etimes_set(gc, i, CTX->etimes[parent]);
+        i = parent;
+    }
+    etimes_set(gc, i, ev);
+}
+
+static void etimes_sift_down(libxl__gc *gc, int i)
+{
+    libxl__ev_time *ev = CTX->etimes[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= CTX->etimes_used)
+            break;
+        if (child + 1 < CTX->etimes_used &&
+            etime_before(CTX->etimes[child + 1], CTX->etimes[child]))
+            child++;
+        if (!etime_before(CTX->etimes[child], ev))
+            break;
+        etimes_set(gc, i, CTX->etimes[child]);
+        i = child;
+    }
+    etimes_set(gc, i, ev);
+}
+
+static void etimes_insert(libxl__gc *gc, libxl__ev_time *ev)
+{
+    if (CTX->etimes_used == CTX->etimes_allocd) {
+        int allocd = CTX->etimes_allocd ? CTX->etimes_allocd * 2 : 16;
+
+        assert(ARRAY_SIZE_OK(CTX->etimes, allocd));
+        CTX->etimes = libxl__realloc(NOGC, CTX->etimes,
+                                     allocd * sizeof(*CTX->etimes));
+        CTX->etimes_allocd = allocd;
+    }
+
+    ev->seq = CTX->etimes_seq++;
+    etimes_set(gc, CTX->etimes_used++, ev);
+    etimes_sift_up(gc, ev->heap_index);
+}
+
+static void etimes_remove(libxl__gc *gc, libxl__ev_time *ev)
+{
+    int i = ev->heap_index;
+    libxl__ev_time *last = CTX->etimes[--CTX->etimes_used];
+
+    if (last == ev)
+        return;
+    etimes_set(gc, i, last);
+    etimes_sift_up(gc, i);
+    etimes_sift_down(gc, last->heap_index);
+}
+
+static libxl__ev_time *etimes_first(libxl__gc *gc)
+{
+    return CTX->etimes_used ? CTX->etimes[0] : NULL;
+}
+
 static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
                                 struct timeval absolute)
 {
     int rc;
-    libxl__ev_time *evsearch;
 
     rc = OSEVENT_HOOK(timeout,register, alloc, &ev->nexus->for_app_reg,
                       absolute, ev->nexus);
@@ -279,8 +460,7 @@ static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
 
     ev->infinite = 0;
     ev->abs = absolute;
-    LIBXL_TAILQ_INSERT_SORTED(&CTX->etimes, entry, ev, evsearch, /*empty*/,
-                              timercmp(&ev->abs, &evsearch->abs, >));
+    etimes_insert(gc, ev);
 
     return 0;
 }
@@ -294,7 +474,7 @@ static void time_deregister(libxl__gc *gc, libxl__ev_time *ev)
         OSEVENT_HOOK_VOID(timeout,modify,
                           noop /* release nexus in _occurred_ */,
                           &ev->nexus->for_app_reg, right_away);
-        LIBXL_TAILQ_REMOVE(&CTX->etimes, ev, entry);
+        etimes_remove(gc, ev);
     }
 }
 
@@ -739,6 +919,30 @@ int libxl__domaindeathcheck_start(libxl__gc *gc,
  * osevent poll
  */
 
+/* Reduces *timeout_upd (as for poll) to when the next timeout expires */
+static void beforepoll_timeout(libxl__gc *gc, int *timeout_upd,
+                               struct timeval now)
+{
+    libxl__ev_time *etime = etimes_first(gc);
+    if (etime) {
+        int our_timeout;
+        struct timeval rel;
+        static struct timeval zero;
+
+        timersub(&etime->abs, &now, &rel);
+
+        if (timercmp(&rel, &zero, <)) {
+            our_timeout = 0;
+        } else if (rel.tv_sec >= 2000000) {
+            our_timeout = 2000000000;
+        } else {
+            our_timeout = rel.tv_sec * 1000 + (rel.tv_usec + 999) / 1000;
+        }
+        if (*timeout_upd < 0 || our_timeout < *timeout_upd)
+            *timeout_upd = our_timeout;
+    }
+}
+
 static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
                                int *nfds_io, struct pollfd *fds,
                                int *timeout_upd, struct timeval now)
@@ -847,24 +1051,7 @@ static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
 
     *nfds_io = used;
 
-    libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
-    if (etime) {
-        int our_timeout;
-        struct timeval rel;
-        static struct timeval zero;
-
-        timersub(&etime->abs, &now, &rel);
-
-        if (timercmp(&rel, &zero, <)) {
-            our_timeout = 0;
-        } else if (rel.tv_sec >= 2000000) {
-            our_timeout = 2000000000;
-        } else {
-            our_timeout = rel.tv_sec * 1000 + (rel.tv_usec + 999) / 1000;
-        }
-        if (*timeout_upd < 0 || our_timeout < *timeout_upd)
-            *timeout_upd = our_timeout;
-    }
+    beforepoll_timeout(gc, timeout_upd, now);
 
     return rc;
 }
@@ -926,6 +1113,8 @@ static int afterpoll_check_fd(libxl__poller *poller,
     return revents;
 }
 
+static void afterpoll_timeouts(libxl__egc *egc, struct timeval now);
+
 static void afterpoll_internal(libxl__egc *egc, libxl__poller *poller,
                                int nfds, const struct pollfd *fds,
                                struct timeval now)
@@ -1007,8 +1196,16 @@ static void afterpoll_internal(libxl__egc *egc, libxl__poller *poller,
         libxl__fork_selfpipe_woken(egc);
     }
 
+    afterpoll_timeouts(egc, now);
+}
+
+/* Calls back the timeouts which have expired by now */
+static void afterpoll_timeouts(libxl__egc *egc, struct timeval now)
+{
+    EGC_GC;
+
     for (;;) {
-        libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
+        libxl__ev_time *etime = etimes_first(gc);
         if (!etime)
             break;
 
@@ -1103,7 +1300,7 @@ void libxl_osevent_occurred_timeout(libxl_ctx *ctx, void *for_libxl)
     if (!ev) goto out;
     assert(!ev->infinite);
 
-    LIBXL_TAILQ_REMOVE(&CTX->etimes, ev, entry);
+    etimes_remove(gc, ev);
     ev->func(egc, ev, &ev->abs);
 
  out:
@@ -1393,6 +1590,109 @@ int libxl__self_pipe_eatall(int fd)
  * Main event loop iteration
  */
 
+#ifdef HAVE_EPOLL
+
+/*
+ * With CTX->epfd, the registered fds are not polled one by one: they
+ * are waited for all together through the epoll fd, along with the
+ * poller's wakeup pipe and the SIGCHLD self-pipe.  Nothing needs to be
+ * rebuilt on each pass, whatever the number of fds.
+ */
+static int eventloop_iteration_epoll(libxl__egc *egc,
+                                     libxl__poller *poller)
+{
+    EGC_GC;
+    struct pollfd fds[3];
+    struct epoll_event ee;
+    struct timeval now;
+    int nfds = 0, timeout = -1, pass, r, rc;
+    int epfd = CTX->epfd, selfpipe = libxl__fork_selfpipe_active(CTX);
+
+    rc = libxl__gettimeofday(gc, &now);
+    if (rc) return rc;
+    beforepoll_timeout(gc, &timeout, now);
+
+    fds[nfds].fd = epfd;
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = poller->wakeup_pipe[0];
+    fds[nfds++].events = POLLIN;
+    if (selfpipe >= 0) {
+        fds[nfds].fd = selfpipe;
+        fds[nfds++].events = POLLIN;
+    }
+
+    CTX_UNLOCK;
+    r = poll(fds, nfds, timeout);
+    CTX_LOCK;
+
+    if (r < 0) {
+        if (errno == EINTR)
+            return 0; /* will go round again if caller requires */
+
+        LIBXL__LOG_ERRNOVAL(CTX, LIBXL__LOG_ERROR, errno, "poll failed");
+        return ERROR_FAIL;
+    }
+
+    rc = libxl__gettimeofday(gc, &now);
+    if (rc) return rc;
+
+    /*
+     * Take the ready fds one at a time, since each callback may
+     * deregister others; and, as with poll, call each back at most
+     * once per pass.  (epoll hands out the ready fds in turn, so the
+     * ones left over come first next time.)  Another thread may have
+     * given up on epoll while we were polling.
+     */
+    pass = ++CTX->epoll_pass;
+    while ((fds[0].revents & POLLIN) && CTX->epfd == epfd) {
+        libxl__ev_fd *efd;
+        short revents;
+
+        r = epoll_wait(epfd, &ee, 1, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            LIBXL__EVENT_DISASTER(egc, "epoll_wait failed", errno, 0);
+            return ERROR_FAIL;
+        }
+        if (r == 0)
+            break;
+
+        efd = ee.data.ptr;
+        if (efd->epoll_pass == pass)
+            break;
+        efd->epoll_pass = pass;
+
+        revents = epoll_revents(ee.events) &
+                  (efd->events | POLLERR | POLLHUP);
+        if (!revents)
+            continue;
+
+        DBG("ev_fd=%p occurs fd=%d events=%x revents=%x",
+            efd, efd->fd, efd->events, revents);
+
+        efd->func(egc, efd, efd->fd, efd->events, revents);
+    }
+
+    if (fds[1].revents) {
+        int e = libxl__self_pipe_eatall(poller->wakeup_pipe[0]);
+        if (e) LIBXL__EVENT_DISASTER(egc, "read wakeup", e, 0);
+    }
+
+    if (nfds > 2 && fds[2].revents &&
+        libxl__fork_selfpipe_active(CTX) == selfpipe) {
+        int e = libxl__self_pipe_eatall(selfpipe);
+        if (e) LIBXL__EVENT_DISASTER(egc, "read sigchld pipe", e, 0);
+        libxl__fork_selfpipe_woken(egc);
+    }
+
+    afterpoll_timeouts(egc, now);
+
+    return 0;
+}
+
+#endif /* HAVE_EPOLL */
+
 static int eventloop_iteration(libxl__egc *egc, libxl__poller *poller) {
     /* The CTX must be locked EXACTLY ONCE so that this function
      * can unlock it when it polls.
@@ -1400,7 +1700,12 @@ static int eventloop_iteration(libxl__egc *egc, libxl__poller *poller) {
     EGC_GC;
     int rc;
     struct timeval now;
-    
+
+#ifdef HAVE_EPOLL
+    if (CTX->epfd >= 0)
+        return eventloop_iteration_epoll(egc, poller);
+#endif
+
     rc = libxl__gettimeofday(gc, &now);
     if (rc) goto out;
 
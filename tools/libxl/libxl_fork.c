@@ -351,6 +351,8 @@ pid_t libxl__ev_child_fork(libxl__gc *gc, libxl__ev_child *ch,
             xs_daemon_destroy_postfork(CTX->xsh);
             CTX->xsh = NULL; /* turns mistakes into crashes */
         }
+        /* The parent's QMP connections are not ours to use. */
+        libxl__qmp_close_all(CTX);
         /* Yes, CTX is left locked in the child. */
         return 0;
     }
@@ -30,84 +30,163 @@ void libxl__alloc_failed(libxl_ctx *ctx, const char *func,
 #undef L
 }
 
-void libxl__ptr_add(libxl__gc *gc, void *ptr)
+/*
+ * Small allocations from a real gc are carved out of blocks, which are
+ * all freed at once by libxl__free_all, rather than each being malloc'd
+ * and recorded in alloc_ptrs.  Each is preceded by its size, for
+ * libxl__realloc.  Blocks are zeroed when allocated, and the space in
+ * them is never reused, so these allocations come ready zeroed.
+ */
+#define GC_ALIGN            16
+#define GC_ROUNDUP(n)       (((n) + GC_ALIGN - 1) & ~(size_t)(GC_ALIGN - 1))
+#define GC_BLOCK_SIZE       4096            /* data bytes in each block */
+#define GC_SMALL_MAX        (GC_BLOCK_SIZE / 4)
+
+struct libxl__gc_block {
+    libxl__gc_block *next;
+    size_t used;
+    /* data follows, from GC_BLOCK_DATA */
+};
+
+#define GC_BLOCK_HDR        GC_ROUNDUP(sizeof(libxl__gc_block))
+#define GC_BLOCK_DATA(b)    ((char *)(b) + GC_BLOCK_HDR)
+#define GC_SIZE_HDR         GC_ROUNDUP(sizeof(size_t))
+#define GC_SIZE(ptr)        (*(size_t *)((char *)(ptr) - GC_SIZE_HDR))
+
+static void *gc_block_alloc(libxl__gc *gc, size_t bytes)
 {
-    int i;
+    libxl__gc_block *b = gc->blocks;
+    size_t need = GC_SIZE_HDR + GC_ROUNDUP(bytes);
+    char *ptr;
+
+    if (!b || GC_BLOCK_SIZE - b->used < need) {
+        b = calloc(1, GC_BLOCK_HDR + GC_BLOCK_SIZE);
+        if (!b) libxl__alloc_failed(CTX, __func__, GC_BLOCK_SIZE, 1);
+        b->next = gc->blocks;
+        gc->blocks = b;
+    }
+
+    ptr = GC_BLOCK_DATA(b) + b->used + GC_SIZE_HDR;
+    b->used += need;
+    GC_SIZE(ptr) = bytes;
+    return ptr;
+}
+
+static libxl__gc_block *gc_block_of(libxl__gc *gc, const void *ptr)
+{
+    libxl__gc_block *b;
+
+    for (b = gc->blocks; b; b = b->next)
+        if ((const char *)ptr >= GC_BLOCK_DATA(b) &&
+            (const char *)ptr < GC_BLOCK_DATA(b) + GC_BLOCK_SIZE)
+            return b;
+    return NULL;
+}
+
+/* Allocate and zero @bytes, from a block if small enough. */
+static void *gc_alloc(libxl__gc *gc, size_t bytes)
+{
+    void *ptr;
+
+    if (libxl__gc_is_real(gc) && bytes <= GC_SMALL_MAX)
+        return gc_block_alloc(gc, bytes);
+
+    ptr = calloc(bytes, 1);
+    if (!ptr) libxl__alloc_failed(CTX, __func__, bytes, 1);
 
+    libxl__ptr_add(gc, ptr);
+    return ptr;
+}
+
+void libxl__ptr_add(libxl__gc *gc, void *ptr)
+{
     if (!libxl__gc_is_real(gc))
         return;
 
     if (!ptr)
         return;
 
-    /* fast case: we have space in the array for storing the pointer */
-    for (i = 0; i < gc->alloc_maxsize; i++) {
-        if (!gc->alloc_ptrs[i]) {
-            gc->alloc_ptrs[i] = ptr;
-            return;
-        }
+    if (gc->alloc_nr == gc->alloc_maxsize) {
+        int new_maxsize = gc->alloc_maxsize * 2 + 25;
+        assert(new_maxsize < INT_MAX / sizeof(void*) / 2);
+        gc->alloc_ptrs = realloc(gc->alloc_ptrs,
+                                 new_maxsize * sizeof(void *));
+        if (!gc->alloc_ptrs)
+            libxl__alloc_failed(CTX, __func__, new_maxsize, sizeof(void*));
+        gc->alloc_maxsize = new_maxsize;
     }
-    int new_maxsize = gc->alloc_maxsize * 2 + 25;
-    assert(new_maxsize < INT_MAX / sizeof(void*) / 2);
-    gc->alloc_ptrs = realloc(gc->alloc_ptrs, new_maxsize * sizeof(void *));
-    if (!gc->alloc_ptrs)
-        libxl__alloc_failed(CTX, __func__, new_maxsize, sizeof(void*));
-
-    gc->alloc_ptrs[gc->alloc_maxsize++] = ptr;
-
-    while (gc->alloc_maxsize < new_maxsize)
-        gc->alloc_ptrs[gc->alloc_maxsize++] = 0;
 
-    return;
+    gc->alloc_ptrs[gc->alloc_nr++] = ptr;
 }
 
 void libxl__free_all(libxl__gc *gc)
 {
-    void *ptr;
+    libxl__gc_block *b;
     int i;
 
     assert(libxl__gc_is_real(gc));
 
-    for (i = 0; i < gc->alloc_maxsize; i++) {
-        ptr = gc->alloc_ptrs[i];
-        gc->alloc_ptrs[i] = NULL;
-        free(ptr);
-    }
+    for (i = 0; i < gc->alloc_nr; i++)
+        free(gc->alloc_ptrs[i]);
     free(gc->alloc_ptrs);
     gc->alloc_ptrs = 0;
     gc->alloc_maxsize = 0;
+    gc->alloc_nr = 0;
+
+    while ((b = gc->blocks)) {
+        gc->blocks = b->next;
+        free(b);
+    }
 }
 
 void *libxl__zalloc(libxl__gc *gc, int bytes)
 {
-    void *ptr = calloc(bytes, 1);
-    if (!ptr) libxl__alloc_failed(CTX, __func__, bytes, 1);
-
-    libxl__ptr_add(gc, ptr);
-    return ptr;
+    return gc_alloc(gc, bytes);
 }
 
 void *libxl__calloc(libxl__gc *gc, size_t nmemb, size_t size)
 {
-    void *ptr = calloc(nmemb, size);
-    if (!ptr) libxl__alloc_failed(CTX, __func__, nmemb, size);
+    if (size && nmemb > SIZE_MAX / size)
+        libxl__alloc_failed(CTX, __func__, nmemb, size);
 
-    libxl__ptr_add(gc, ptr);
-    return ptr;
+    return gc_alloc(gc, nmemb * size);
 }
 
 void *libxl__realloc(libxl__gc *gc, void *ptr, size_t new_size)
 {
-    void *new_ptr = realloc(ptr, new_size);
+    libxl__gc_block *b;
+    void *new_ptr;
+    size_t old_size, off;
     int i = 0;
 
+    if (ptr == NULL)
+        return gc_alloc(gc, new_size);
+
+    if (libxl__gc_is_real(gc) && (b = gc_block_of(gc, ptr))) {
+        old_size = GC_SIZE(ptr);
+        if (new_size <= old_size)
+            return ptr;
+
+        /* The last allocation in a block may grow into the rest of it. */
+        off = (char *)ptr - GC_BLOCK_DATA(b);
+        if (off + GC_ROUNDUP(old_size) == b->used &&
+            off + GC_ROUNDUP(new_size) <= GC_BLOCK_SIZE) {
+            b->used = off + GC_ROUNDUP(new_size);
+            GC_SIZE(ptr) = new_size;
+            return ptr;
+        }
+
+        new_ptr = gc_alloc(gc, new_size);
+        memcpy(new_ptr, ptr, old_size);
+        return new_ptr;
+    }
+
+    new_ptr = realloc(ptr, new_size);
     if (new_ptr == NULL && new_size != 0)
         libxl__alloc_failed(CTX, __func__, new_size, 1);
 
-    if (ptr == NULL) {
-        libxl__ptr_add(gc, new_ptr);
-    } else if (new_ptr != ptr && libxl__gc_is_real(gc)) {
-        for (i = 0; i < gc->alloc_maxsize; i++) {
+    if (new_ptr != ptr && libxl__gc_is_real(gc)) {
+        for (i = 0; i < gc->alloc_nr; i++) {
             if (gc->alloc_ptrs[i] == ptr) {
                 gc->alloc_ptrs[i] = new_ptr;
                 break;
@@ -140,21 +219,19 @@ char *libxl__sprintf(libxl__gc *gc, const char *fmt, ...)
 
 char *libxl__strdup(libxl__gc *gc, const char *c)
 {
-    char *s = strdup(c);
-
-    if (!s) libxl__alloc_failed(CTX, __func__, strlen(c), 1);
-
-    libxl__ptr_add(gc, s);
+    size_t len = strlen(c);
+    char *s = gc_alloc(gc, len + 1);
 
+    memcpy(s, c, len);
     return s;
 }
 
 char *libxl__strndup(libxl__gc *gc, const char *c, size_t n)
 {
-    char *s = strndup(c, n);
-
-    if (!s) libxl__alloc_failed(CTX, __func__, n, 1);
+    size_t len = strnlen(c, n);
+    char *s = gc_alloc(gc, len + 1);
 
+    memcpy(s, c, len);
     return s;
 }
 
@@ -347,6 +424,86 @@ int libxl__device_model_version_running(libxl__gc *gc, uint32_t domid)
     return value;
 }
 
+static uint64_t timing_us_since(const struct timeval *start,
+                                const struct timeval *now)
+{
+    struct timeval rel;
+
+    timersub(now, start, &rel);
+    if (rel.tv_sec < 0)
+        return 0;
+    return (uint64_t)rel.tv_sec * 1000000 + rel.tv_usec;
+}
+
+void libxl__timing_start(libxl__gc *gc, libxl__op_timing *t,
+                         const char *op, const char *phase)
+{
+    t->op = NULL;
+    t->phases = NULL;
+    t->nr_phases = 0;
+    if (libxl__gettimeofday(gc, &t->start))
+        return;
+    t->op = op;
+    libxl__timing_phase(gc, t, phase);
+}
+
+void libxl__timing_phase(libxl__gc *gc, libxl__op_timing *t,
+                         const char *phase)
+{
+    struct timeval now;
+    libxl_phase_timing *p;
+    uint64_t at;
+
+    if (!t->op || libxl__gettimeofday(gc, &now))
+        return;
+    at = timing_us_since(&t->start, &now);
+
+    if (t->nr_phases) {
+        p = &t->phases[t->nr_phases - 1];
+        p->duration_us = at - p->start_us;
+    }
+
+    t->phases = libxl__realloc(gc, t->phases,
+                               (t->nr_phases + 1) * sizeof(*t->phases));
+    p = &t->phases[t->nr_phases++];
+    p->name = phase;
+    p->start_us = at;
+    p->duration_us = 0;
+}
+
+void libxl__timing_finish(libxl__gc *gc, libxl__op_timing *t,
+                          uint32_t domid, int rc)
+{
+    struct timeval now;
+    uint64_t total;
+    char *msg = "";
+    int i;
+
+    if (!t->op || libxl__gettimeofday(gc, &now))
+        return;
+    total = timing_us_since(&t->start, &now);
+
+    if (t->nr_phases) {
+        libxl_phase_timing *p = &t->phases[t->nr_phases - 1];
+        p->duration_us = total - p->start_us;
+    }
+
+    for (i = 0; i < t->nr_phases; i++)
+        msg = GCSPRINTF("%s%s %s %"PRIu64".%06"PRIu64"s", msg,
+                        i ? "," : ":", t->phases[i].name,
+                        t->phases[i].duration_us / 1000000,
+                        t->phases[i].duration_us % 1000000);
+    LOG(DEBUG, "domain %u %s %s in %"PRIu64".%06"PRIu64"s%s",
+        domid, t->op, rc ? "failed" : "done",
+        total / 1000000, total % 1000000, msg);
+
+    if (CTX->timing_callback)
+        CTX->timing_callback(CTX->timing_callback_user, t->op, domid, rc,
+                             t->phases, t->nr_phases, total);
+
+    t->op = NULL;
+}
+
 int libxl__hotplug_settings(libxl__gc *gc, xs_transaction_t t)
 {
     int rc = 0;
@@ -167,6 +167,8 @@ struct libxl__ev_fd {
     /* remainder is private for libxl__ev_fd... */
     LIBXL_LIST_ENTRY(libxl__ev_fd) entry;
     libxl__osevent_hook_nexus *nexus;
+    bool in_epoll; /* registered with CTX->epfd */
+    int epoll_pass; /* last CTX->epoll_pass it was dispatched in */
 };
 
 
@@ -178,8 +180,9 @@ struct libxl__ev_time {
     /* read-only for caller, who may read only when registered: */
     libxl__ev_time_callback *func;
     /* remainder is private for libxl__ev_time... */
-    int infinite; /* not registered in list or with app if infinite */
-    LIBXL_TAILQ_ENTRY(libxl__ev_time) entry;
+    int infinite; /* not registered in heap or with app if infinite */
+    int heap_index; /* in CTX->etimes */
+    uint64_t seq; /* orders timeouts with the same abs */
     struct timeval abs;
     libxl__osevent_hook_nexus *nexus;
 };
@@ -292,10 +295,14 @@ struct libxl__poller {
     int wakeup_pipe[2]; /* 0 means no fd allocated */
 };
 
+typedef struct libxl__gc_block libxl__gc_block; /* see libxl_internal.c */
+
 struct libxl__gc {
     /* mini-GC */
     int alloc_maxsize; /* -1 means this is the dummy non-gc gc */
-    void **alloc_ptrs;
+    int alloc_nr;
+    void **alloc_ptrs; /* malloc'd memory: large allocations, ptr_add */
+    libxl__gc_block *blocks; /* small allocations, newest block first */
     libxl_ctx *owner;
 };
 
@@ -335,7 +342,14 @@ struct libxl__ctx {
     LIBXL_SLIST_HEAD(libxl__osevent_hook_nexi, libxl__osevent_hook_nexus)
         hook_fd_nexi_idle, hook_timeout_nexi_idle;
     LIBXL_LIST_HEAD(, libxl__ev_fd) efds;
-    LIBXL_TAILQ_HEAD(, libxl__ev_time) etimes;
+    /* binary heap of the finite timeouts, see libxl_event.c */
+    struct libxl__ev_time **etimes;
+    int etimes_used, etimes_allocd;
+    uint64_t etimes_seq;
+
+    /* with LIBXL_CTX_EPOLL, the efds with events, else -1 */
+    int epfd;
+    int epoll_pass;
 
     libxl__ev_watch_slot *watch_slots;
     int watch_nslots;
@@ -355,6 +369,21 @@ struct libxl__ctx {
     int sigchld_selfpipe[2]; /* [0]==-1 means handler not installed */
     LIBXL_LIST_HEAD(, libxl__ev_child) children;
 
+    /* hotplug scripts: no limit on how many run at once if max is 0 */
+    int hotplug_max, hotplug_running;
+    LIBXL_TAILQ_HEAD(, struct libxl__ao_device) hotplug_waiting;
+
+    /* QMP connections, kept between operations on the same domain */
+    LIBXL_LIST_HEAD(, struct libxl__qmp_handler) qmp_handlers;
+
+    /* cpu topology for NUMA placement, fetched when first needed */
+    libxl_cputopology *numa_tinfo;
+    int numa_nr_cpus;
+
+    /* libxl_set_phase_timing_callback */
+    libxl_phase_timing_callback *timing_callback;
+    void *timing_callback_user;
+
     libxl_version_info version_info;
 };
 
@@ -439,7 +468,9 @@ struct libxl__ao {
 
 #define LIBXL_INIT_GC(gc,ctx) do{               \
         (gc).alloc_maxsize = 0;                 \
+        (gc).alloc_nr = 0;                      \
         (gc).alloc_ptrs = 0;                    \
+        (gc).blocks = 0;                        \
         (gc).owner = (ctx);                     \
     } while(0)
     /* NB, also, a gc struct ctx->nogc_gc is initialised in libxl_ctx_alloc */
@@ -836,6 +867,10 @@ _hidden void libxl__poller_put(libxl_ctx*, libxl__poller *p /* may be NULL */);
  * ctx must be locked. */
 _hidden void libxl__poller_wakeup(libxl__egc *egc, libxl__poller *p);
 
+/* Sets up CTX->epfd, for LIBXL_CTX_EPOLL; if it can't, the poll based
+ * event loop is used. */
+_hidden void libxl__epoll_init(libxl_ctx *ctx);
+
 /* Internal to fork and child reaping machinery */
 extern const libxl_childproc_hooks libxl__childproc_default_hooks;
 int libxl__sigchld_installhandler(libxl_ctx *ctx); /* non-reentrant;logs errs */
@@ -1395,6 +1430,30 @@ _hidden int libxl__init_recursive_mutex(libxl_ctx *ctx, pthread_mutex_t *lock);
 
 _hidden int libxl__gettimeofday(libxl__gc *gc, struct timeval *now_r);
 
+/*
+ * Timing of the phases of a long-running operation, such as domain
+ * creation.  _start begins the operation's first phase, each _phase
+ * ends the current phase and begins the next, and _finish ends the
+ * last one, logs the timings (at debug level) and reports them to the
+ * application's libxl_phase_timing_callback, if any.  The phases are
+ * allocated from gc, which should be the ao's.  op and the phase names
+ * must be string literals.  _phase and _finish do nothing unless
+ * _start was called, and _finish can be called more than once.
+ */
+typedef struct {
+    const char *op;
+    struct timeval start;
+    libxl_phase_timing *phases;
+    int nr_phases;
+} libxl__op_timing;
+
+_hidden void libxl__timing_start(libxl__gc *gc, libxl__op_timing *t,
+                                 const char *op, const char *phase);
+_hidden void libxl__timing_phase(libxl__gc *gc, libxl__op_timing *t,
+                                 const char *phase);
+_hidden void libxl__timing_finish(libxl__gc *gc, libxl__op_timing *t,
+                                  uint32_t domid, int rc);
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 
@@ -1424,10 +1483,13 @@ _hidden int libxl__qmp_set_global_dirty_log(libxl__gc *gc, int domid, bool enabl
 _hidden int libxl__qmp_insert_cdrom(libxl__gc *gc, int domid, const libxl_device_disk *disk);
 /* Add a virtual CPU */
 _hidden int libxl__qmp_cpu_add(libxl__gc *gc, int domid, int index);
-/* close and free the QMP handler */
+/* release the QMP handler; the connection is kept, for later operations
+ * on the same domain, unless something went wrong with it */
 _hidden void libxl__qmp_close(libxl__qmp_handler *qmp);
-/* remove the socket file, if the file has already been removed,
- * nothing happen */
+/* close all the connections kept by the ctx */
+_hidden void libxl__qmp_close_all(libxl_ctx *ctx);
+/* forget the domain's connections and remove the socket file, if the file
+ * has already been removed, nothing happen */
 _hidden void libxl__qmp_cleanup(libxl__gc *gc, uint32_t domid);
 
 /* this helper calls qmp_initialize, query_serial and qmp_close */
@@ -1888,6 +1950,8 @@ struct libxl__ao_device {
     const char *what;
     int num_exec;
     libxl__ev_child child;
+    /* on CTX->hotplug_waiting, if its script is waiting to run */
+    LIBXL_TAILQ_ENTRY(libxl__ao_device) hotplug_entry;
 };
 
 /*
@@ -2257,6 +2321,7 @@ struct libxl__domain_suspend_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int same_host;
     const libxl_domain_remus_info *remus;
     /* private */
     xc_evtchn *xce; /* event channel handle */
@@ -2271,6 +2336,7 @@ struct libxl__domain_suspend_state {
     /* private for libxl__domain_save_device_model */
     libxl__save_device_model_cb *save_dm_callback;
     libxl__datacopier_state save_dm_datacopier;
+    libxl__op_timing timing;
 };
 
 
@@ -2409,6 +2475,7 @@ struct libxl__destroy_domid_state {
     libxl__domid_destroy_cb *callback;
     /* private to implementation */
     libxl__devices_remove_state drs;
+    libxl__op_timing timing;
 };
 
 struct libxl__domain_destroy_state {
@@ -2529,6 +2596,7 @@ struct libxl__domain_create_state {
     /* necessary if the domain creation failed and we have to destroy it */
     libxl__domain_destroy_state dds;
     libxl__multidev multidev;
+    libxl__op_timing timing;
 };
 
 /*----- Domain suspend (save) functions -----*/
@@ -61,6 +61,18 @@ static inline yajl_gen libxl_yajl_gen_alloc(const yajl_alloc_funcs *allocFuncs)
     return g;
 }
 
+static inline yajl_gen libxl_yajl_gen_alloc_print(yajl_print_t print,
+                                                  void *ctx)
+{
+    yajl_gen g;
+    g = yajl_gen_alloc(NULL);
+    if (g) {
+        yajl_gen_config(g, yajl_gen_beautify, 1);
+        yajl_gen_config(g, yajl_gen_print_callback, print, ctx);
+    }
+    return g;
+}
+
 #else /* !HAVE_YAJL_V2 */
 
 #define yajl_complete_parse yajl_parse_complete
@@ -84,8 +96,22 @@ static inline yajl_gen libxl_yajl_gen_alloc(const yajl_alloc_funcs *allocFuncs)
     return yajl_gen_alloc(&conf, allocFuncs);
 }
 
+static inline yajl_gen libxl_yajl_gen_alloc_print(yajl_print_t print,
+                                                  void *ctx)
+{
+    yajl_gen_config conf = { 1, "    " };
+    return yajl_gen_alloc2(print, &conf, NULL, ctx);
+}
+
 #endif /* !HAVE_YAJL_V2 */
 
+/*
+ * libxl_yajl_gen_alloc_print returns a generator which hands its output
+ * to print as it is generated, rather than keeping all of it in a buffer
+ * for yajl_gen_get_buf. With the _gen_json functions, this serialises
+ * even the largest objects without holding their JSON in memory.
+ */
+
 yajl_gen_status libxl_domain_config_gen_json(yajl_gen hand,
                                              libxl_domain_config *p);
 
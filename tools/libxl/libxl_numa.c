@@ -19,162 +19,25 @@
 
 #include "libxl_internal.h"
 
-/*
- * What follows are helpers for generating all the k-combinations
- * without repetitions of a set S with n elements in it. Formally
- * speaking, they are subsets of k distinct elements of S and, if
- * S is n elements big, the number of k-combinations is equal to the
- * binomial coefficient C(n k)=n!/(k! * (n - k)!).
- *
- * The various subset are generated one after the other by calling
- * comb_init() first, and, after that, comb_next()
- * C(n k)-1 times. An iterator is used to store the current status
- * of the whole generation operation (i.e., basically, the last
- * combination that has been generated). As soon as all combinations
- * have been generated, comb_next() will start returning 0 instead of
- * 1. The same instance of the iterator and the same values for
- * n and k _must_ be used for each call (if that doesn't happen, the
- * result is unspecified).
- *
- * The algorithm is a well known one (see, for example, D. Knuth's "The
- * Art of Computer Programming - Volume 4, Fascicle 3" and it produces
- * the combinations in such a way that they (well, more precisely, their
- * indexes it the array/map representing the set) come with lexicographic
- * ordering.
- *
- * For example, with n = 5 and k = 3, calling comb_init()
- * will generate { 0, 1, 2 }, while subsequent valid calls to
- * comb_next() will produce the following:
- * { { 0, 1, 3 }, { 0, 1, 4 },
- *   { 0, 2, 3 }, { 0, 2, 4 }, { 0, 3, 4 },
- *   { 1, 2, 3 }, { 1, 2, 4 }, { 1, 3, 4 },
- *   { 2, 3, 4 } }
- *
- * This is used by the automatic NUMA placement logic below.
- */
-typedef int* comb_iter_t;
-
-static int comb_init(libxl__gc *gc, comb_iter_t *it, int n, int k)
-{
-    comb_iter_t new_iter;
-    int i;
-
-    if (n < k)
-        return 0;
-
-    /* First set is always { 0, 1, 2, ..., k-1 } */
-    GCNEW_ARRAY(new_iter, k);
-    for (i = 0; i < k; i++)
-        new_iter[i] = i;
-
-    *it = new_iter;
-    return 1;
-}
-
-static int comb_next(comb_iter_t it, int n, int k)
-{
-    int i;
-
-    /*
-     * The idea here is to find the leftmost element from where
-     * we should start incrementing the indexes of the iterator.
-     * This means looking for the highest index that can be increased
-     * while still producing value smaller than n-1. In the example
-     * above, when dealing with { 0, 1, 4 }, such an element is the
-     * second one, as the third is already equal to 4 (which actually
-     * is n-1).
-     * Once we found from where to start, we increment that element
-     * and override the right-hand rest of the iterator with its
-     * successors, thus achieving lexicographic ordering.
-     *
-     * Regarding the termination of the generation process, when we
-     * manage in bringing n-k at the very first position of the iterator,
-     * we know that is the last valid combination ( { 2, 3, 4 }, with
-     * n - k = 5 - 2 = 2, in the example above), and thus we start
-     * returning 0 as soon as we cross that border.
-     */
-    for (i = k - 1; it[i] == n - k + i; i--) {
-        if (i <= 0)
-            return 0;
-    }
-    for (it[i]++, i++; i < k; i++)
-        it[i] = it[i - 1] + 1;
-    return 1;
-}
-
 /* NUMA automatic placement (see libxl_internal.h for details) */
 
 /*
- * This function turns a k-combination iterator into a node map,
- * given another map, telling us which nodes should be considered.
- *
- * This means the bits that are set in suitable_nodemap and that
- * corresponds to the indexes of the given combination are the ones
- * that will be set in nodemap.
- *
- * For example, given a fully set suitable_nodemap, if the iterator
- * represents the combination { 0, 2, 4}, nodmeap will have bits #0,
- * #2 and #4 set.
- * On the other hand, if, say,  suitable_nodemap=01011011, the same
- * iterator will cause bits #1, #4 and #7 of nodemap to be set.
+ * The host's cpu topology, fetched once per ctx: it does not change while
+ * the host is up, unlike the free memory of the nodes, which has to be
+ * fetched again each time.  The array belongs to the ctx.
  */
-static void comb_get_nodemap(comb_iter_t it, libxl_bitmap *suitable_nodemap,
-                             libxl_bitmap *nodemap, int k)
+static libxl_cputopology *numa_cpu_topology(libxl__gc *gc, int *nr_cpus)
 {
-    int i, m = 0, n = 0;
-
-    libxl_bitmap_set_none(nodemap);
-    libxl_for_each_set_bit(i, *suitable_nodemap) {
-        /* Check wether the n-th set bit of suitable_nodemap
-         * matches with the m-th element of the iterator (and,
-         * only if it does, advance to the next one) */
-        if (m < k && n == it[m]) {
-            libxl_bitmap_set(nodemap, i);
-            m++;
-        }
-        n++;
-    }
-}
-
-/* Retrieve the number of cpus that the nodes that are part of the nodemap
- * span and are also set in suitable_cpumap. */
-static int nodemap_to_nr_cpus(libxl_cputopology *tinfo, int nr_cpus,
-                              const libxl_bitmap *suitable_cpumap,
-                              const libxl_bitmap *nodemap)
-{
-    int i, nodes_cpus = 0;
-
-    for (i = 0; i < nr_cpus; i++) {
-        if (libxl_bitmap_test(suitable_cpumap, i) &&
-            libxl_bitmap_test(nodemap, tinfo[i].node))
-            nodes_cpus++;
-    }
-    return nodes_cpus;
-}
-
-/* Retrieve the amount of free memory within the nodemap */
-static uint32_t nodemap_to_free_memkb(libxl_numainfo *ninfo,
-                                      libxl_bitmap *nodemap)
-{
-    uint32_t free_memkb = 0;
-    int i;
+    libxl_cputopology *tinfo;
 
-    libxl_for_each_set_bit(i, *nodemap)
-        free_memkb += ninfo[i].free / 1024;
+    CTX_LOCK;
+    if (!CTX->numa_tinfo)
+        CTX->numa_tinfo = libxl_get_cpu_topology(CTX, &CTX->numa_nr_cpus);
+    tinfo = CTX->numa_tinfo;
+    *nr_cpus = CTX->numa_nr_cpus;
+    CTX_UNLOCK;
 
-    return free_memkb;
-}
-
-/* Retrieve the number of vcpus able to run on the nodes in nodemap */
-static int nodemap_to_nr_vcpus(libxl__gc *gc, int vcpus_on_node[],
-                               const libxl_bitmap *nodemap)
-{
-    int i, nr_vcpus = 0;
-
-    libxl_for_each_set_bit(i, *nodemap)
-        nr_vcpus += vcpus_on_node[i];
-
-    return nr_vcpus;
+    return tinfo;
 }
 
 /* Number of vcpus able to run on the cpus of the various nodes
@@ -276,6 +139,144 @@ static int count_cpus_per_node(libxl_cputopology *tinfo, int nr_cpus,
     return cpus_per_node;
 }
 
+/* What the placement search needs to know about each suitable node */
+typedef struct {
+    int node;
+    uint32_t free_memkb;
+    int nr_cpus;    /* cpus in suitable_cpumap */
+    int nr_vcpus;   /* vcpus able to run on it */
+} placement_node;
+
+/*
+ * The search for the best candidate with k nodes, out of the nr suitable
+ * ones.  It is a depth first search over the subsets of nodes, which
+ * visits them in lexicographic order of their indexes in nodes[].  Each
+ * branch is abandoned as soon as not even the best choice of the nodes
+ * still to be added could give it enough free memory or cpus.
+ */
+typedef struct {
+    libxl__gc *gc;
+    const placement_node *nodes;
+    int nr, k;
+    uint32_t min_free_memkb;
+    int min_cpus;
+    /*
+     * The most free memory (and cpus) r more nodes, picked among nodes[i]
+     * and the following ones, could add: element [i * (nr + 1) + r].
+     */
+    const uint32_t *memkb_bound, *cpus_bound;
+    libxl__numa_candidate_cmpf numa_cmpf;
+    libxl_bitmap *nodemap;
+    libxl__numa_candidate *new_cndt, *cndt_out;
+    int *cndt_found;
+} placement_search;
+
+/*
+ * Fill bound[i * (nr + 1) + r] with the sum of the r largest values among
+ * val[i], ..., val[nr - 1].  nr is small, so a plain insertion sort of
+ * each suffix does.
+ */
+static void placement_bounds(libxl__gc *gc, int nr, const uint32_t *val,
+                             uint32_t *bound)
+{
+    uint32_t *sorted;
+    int i, j, r;
+
+    GCNEW_ARRAY(sorted, nr);
+    for (i = nr - 1; i >= 0; i--) {
+        /* sorted[0 .. nr-i-1] is val[i ..] in decreasing order */
+        for (j = nr - i - 1; j > 0 && sorted[j - 1] < val[i]; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = val[i];
+
+        bound[i * (nr + 1)] = 0;
+        for (r = 1; r <= nr - i; r++)
+            bound[i * (nr + 1) + r] = bound[i * (nr + 1) + r - 1] +
+                                      sorted[r - 1];
+    }
+}
+
+/* Compare the candidate in ps->nodemap with the best one found so far */
+static void placement_consider(placement_search *ps, uint32_t free_memkb,
+                               int nr_cpus, int nr_vcpus)
+{
+    libxl__gc *gc = ps->gc;
+    libxl__numa_candidate *new_cndt = ps->new_cndt;
+    libxl__numa_candidate *cndt_out = ps->cndt_out;
+
+    libxl__numa_candidate_put_nodemap(gc, new_cndt, ps->nodemap);
+    new_cndt->nr_vcpus = nr_vcpus;
+    new_cndt->free_memkb = free_memkb;
+    new_cndt->nr_nodes = ps->k;
+    new_cndt->nr_cpus = nr_cpus;
+
+    /*
+     * Check if the new candidate we is better the what we found up
+     * to now by means of the comparison function. If no comparison
+     * function is provided, just return as soon as we find our first
+     * candidate.
+     */
+    if (*ps->cndt_found == 0 || ps->numa_cmpf(new_cndt, cndt_out) < 0) {
+        *ps->cndt_found = 1;
+
+        LOG(DEBUG, "New best NUMA placement candidate found: "
+                   "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
+                   "free_memkb=%"PRIu32"", new_cndt->nr_nodes,
+                   new_cndt->nr_cpus, new_cndt->nr_vcpus,
+                   new_cndt->free_memkb / 1024);
+
+        libxl__numa_candidate_put_nodemap(gc, cndt_out, ps->nodemap);
+        cndt_out->nr_vcpus = new_cndt->nr_vcpus;
+        cndt_out->free_memkb = new_cndt->free_memkb;
+        cndt_out->nr_nodes = new_cndt->nr_nodes;
+        cndt_out->nr_cpus = new_cndt->nr_cpus;
+    }
+}
+
+/*
+ * Extend the subset in ps->nodemap, of the given size and totals, with
+ * nodes from nodes[i] onwards.
+ */
+static void placement_search_from(placement_search *ps, int i, int size,
+                                  uint32_t free_memkb, int nr_cpus,
+                                  int nr_vcpus)
+{
+    int r = ps->k - size, b;
+
+    if (r == 0) {
+        if ((!ps->min_free_memkb || free_memkb >= ps->min_free_memkb) &&
+            (!ps->min_cpus || nr_cpus >= ps->min_cpus))
+            placement_consider(ps, free_memkb, nr_cpus, nr_vcpus);
+        return;
+    }
+
+    for (; i <= ps->nr - r; i++) {
+        const placement_node *n = &ps->nodes[i];
+
+        if (ps->numa_cmpf == NULL && *ps->cndt_found)
+            return;
+
+        /*
+         * The bounds only shrink as i grows, so if this branch can't meet
+         * the constraints, neither can any of the following ones.
+         */
+        b = i * (ps->nr + 1) + r;
+        if (ps->min_free_memkb &&
+            free_memkb + ps->memkb_bound[b] < ps->min_free_memkb)
+            return;
+        if (ps->min_cpus &&
+            nr_cpus + (int)ps->cpus_bound[b] < ps->min_cpus)
+            return;
+
+        libxl_bitmap_set(ps->nodemap, n->node);
+        placement_search_from(ps, i + 1, size + 1,
+                              free_memkb + n->free_memkb,
+                              nr_cpus + n->nr_cpus,
+                              nr_vcpus + n->nr_vcpus);
+        libxl_bitmap_reset(ps->nodemap, n->node);
+    }
+}
+
 /*
  * Looks for the placement candidates that satisfyies some specific
  * conditions and return the best one according to the provided
@@ -290,11 +291,15 @@ int libxl__get_numa_candidate(libxl__gc *gc,
                               int *cndt_found)
 {
     libxl__numa_candidate new_cndt;
-    libxl_cputopology *tinfo = NULL;
+    libxl_cputopology *tinfo;
     libxl_numainfo *ninfo = NULL;
     int nr_nodes = 0, nr_suit_nodes, nr_cpus = 0;
     libxl_bitmap suitable_nodemap, nodemap;
-    int *vcpus_on_node, rc = 0;
+    int *vcpus_on_node, *node_cpus, rc = 0;
+    placement_node *nodes;
+    placement_search ps;
+    uint32_t *val, *memkb_bound, *cpus_bound;
+    int i, n;
 
     libxl_bitmap_init(&nodemap);
     libxl_bitmap_init(&suitable_nodemap);
@@ -306,6 +311,7 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         return ERROR_FAIL;
 
     GCNEW_ARRAY(vcpus_on_node, nr_nodes);
+    GCNEW_ARRAY(node_cpus, nr_nodes);
 
     /*
      * The good thing about this solution is that it is based on heuristics
@@ -313,14 +319,13 @@ int libxl__get_numa_candidate(libxl__gc *gc,
      * all the possible placement candidates. That can happen because the
      * number of nodes present in current NUMA systems is quite small.
      * In fact, even if a sum of binomials is involved, if the system has
-     * up to 16 nodes it "only" takes 65535 steps. This is fine, as the
-     * number of nodes the biggest NUMA systems provide at the time of this
-     * writing is 8 (and it will probably continue to be so for a while).
-     * However, computanional complexity would explode on systems bigger
-     * than that, and it's really important we avoid trying to run this
-     * on monsters with 32, 64 or more nodes (if they ever pop into being).
-     * Therefore, here it comes a safety catch that disables the algorithm
-     * for the cases when it wouldn't work well.
+     * up to 16 nodes it "only" takes 65535 steps, and the candidates that
+     * can't satisfy the memory and cpu constraints are pruned early, by
+     * whole subtrees. However, computanional complexity would still explode
+     * on systems much bigger than that, and it's really important we avoid
+     * trying to run this on monsters with 32, 64 or more nodes (if they
+     * ever pop into being). Therefore, here it comes a safety catch that
+     * disables the algorithm for the cases when it wouldn't work well.
      */
     if (nr_nodes > 16) {
         /* Log we did nothing and return 0, as no real error occurred */
@@ -333,7 +338,7 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         goto out;
     }
 
-    tinfo = libxl_get_cpu_topology(CTX, &nr_cpus);
+    tinfo = numa_cpu_topology(gc, &nr_cpus);
     if (tinfo == NULL) {
         rc = ERROR_FAIL;
         goto out;
@@ -362,12 +367,43 @@ int libxl__get_numa_candidate(libxl__gc *gc,
      * their affinities. So, instead of doing that for each candidate,
      * let's count here the number of vcpus runnable on each node, so that
      * all we have to do later is summing up the right elements of the
-     * vcpus_on_node array.
+     * vcpus_on_node array.  The same goes for the suitable cpus of each
+     * node, and its free memory.
      */
     rc = nr_vcpus_on_nodes(gc, tinfo, suitable_cpumap, vcpus_on_node);
     if (rc)
         goto out;
 
+    for (i = 0; i < nr_cpus; i++) {
+        if (libxl_bitmap_test(suitable_cpumap, i) &&
+            tinfo[i].node < nr_nodes)
+            node_cpus[tinfo[i].node]++;
+    }
+
+    nr_suit_nodes = libxl_bitmap_count_set(&suitable_nodemap);
+    GCNEW_ARRAY(nodes, nr_suit_nodes);
+    n = 0;
+    libxl_for_each_set_bit(i, suitable_nodemap) {
+        if (i >= nr_nodes)
+            break;
+        nodes[n].node = i;
+        nodes[n].free_memkb = ninfo[i].free / 1024;
+        nodes[n].nr_cpus = node_cpus[i];
+        nodes[n].nr_vcpus = vcpus_on_node[i];
+        n++;
+    }
+    nr_suit_nodes = n;
+
+    GCNEW_ARRAY(val, nr_suit_nodes);
+    GCNEW_ARRAY(memkb_bound, nr_suit_nodes * (nr_suit_nodes + 1));
+    GCNEW_ARRAY(cpus_bound, nr_suit_nodes * (nr_suit_nodes + 1));
+    for (i = 0; i < nr_suit_nodes; i++)
+        val[i] = nodes[i].free_memkb;
+    placement_bounds(gc, nr_suit_nodes, val, memkb_bound);
+    for (i = 0; i < nr_suit_nodes; i++)
+        val[i] = nodes[i].nr_cpus;
+    placement_bounds(gc, nr_suit_nodes, val, cpus_bound);
+
     /*
      * If the minimum number of NUMA nodes is not explicitly specified
      * (i.e., min_nodes == 0), we try to figure out a sensible number of nodes
@@ -387,8 +423,6 @@ int libxl__get_numa_candidate(libxl__gc *gc,
     }
     /* We also need to be sure we do not exceed the number of
      * nodes we are allowed to use. */
-    nr_suit_nodes = libxl_bitmap_count_set(&suitable_nodemap);
-
     if (min_nodes > nr_suit_nodes)
         min_nodes = nr_suit_nodes;
     if (!max_nodes || max_nodes > nr_suit_nodes)
@@ -404,88 +438,31 @@ int libxl__get_numa_candidate(libxl__gc *gc,
     if (rc)
         goto out;
 
+    ps.gc = gc;
+    ps.nodes = nodes;
+    ps.nr = nr_suit_nodes;
+    ps.min_free_memkb = min_free_memkb;
+    ps.min_cpus = min_cpus;
+    ps.memkb_bound = memkb_bound;
+    ps.cpus_bound = cpus_bound;
+    ps.numa_cmpf = numa_cmpf;
+    ps.nodemap = &nodemap;
+    ps.new_cndt = &new_cndt;
+    ps.cndt_out = cndt_out;
+    ps.cndt_found = cndt_found;
+
     /*
-     * Consider all the combinations with sizes in [min_nodes, max_nodes]
-     * (see comb_init() and comb_next()). Note that, since the fewer the
-     * number of nodes the better, it is guaranteed that any candidate
-     * found during the i-eth step will be better than any other one we
-     * could find during the (i+1)-eth and all the subsequent steps (they
-     * all will have more nodes). It's thus pointless to keep going if
-     * we already found something.
+     * Consider all the subsets with sizes in [min_nodes, max_nodes]. Note
+     * that, since the fewer the number of nodes the better, it is
+     * guaranteed that any candidate found during the i-eth step will be
+     * better than any other one we could find during the (i+1)-eth and all
+     * the subsequent steps (they all will have more nodes). It's thus
+     * pointless to keep going if we already found something.
      */
     *cndt_found = 0;
-    while (min_nodes <= max_nodes && *cndt_found == 0) {
-        comb_iter_t comb_iter;
-        int comb_ok;
-
-        /*
-         * And here it is. Each step of this cycle generates a combination of
-         * nodes as big as min_nodes mandates.  Each of these combinations is
-         * checked against the constraints provided by the caller (namely,
-         * amount of free memory and number of cpus) and it can concur to
-         * become our best placement iff it passes the check.
-         */
-        for (comb_ok = comb_init(gc, &comb_iter, nr_suit_nodes, min_nodes);
-             comb_ok;
-             comb_ok = comb_next(comb_iter, nr_suit_nodes, min_nodes)) {
-            uint32_t nodes_free_memkb;
-            int nodes_cpus;
-
-            /* Get the nodemap for the combination, only considering
-             * suitable nodes. */
-            comb_get_nodemap(comb_iter, &suitable_nodemap,
-                             &nodemap, min_nodes);
-
-            /* If there is not enough memory in this combination, skip it
-             * and go generating the next one... */
-            nodes_free_memkb = nodemap_to_free_memkb(ninfo, &nodemap);
-            if (min_free_memkb && nodes_free_memkb < min_free_memkb)
-                continue;
-
-            /* And the same applies if this combination is short in cpus */
-            nodes_cpus = nodemap_to_nr_cpus(tinfo, nr_cpus, suitable_cpumap,
-                                            &nodemap);
-            if (min_cpus && nodes_cpus < min_cpus)
-                continue;
-
-            /*
-             * Conditions are met, we can compare this candidate with the
-             * current best one (if any).
-             */
-            libxl__numa_candidate_put_nodemap(gc, &new_cndt, &nodemap);
-            new_cndt.nr_vcpus = nodemap_to_nr_vcpus(gc, vcpus_on_node,
-                                                    &nodemap);
-            new_cndt.free_memkb = nodes_free_memkb;
-            new_cndt.nr_nodes = libxl_bitmap_count_set(&nodemap);
-            new_cndt.nr_cpus = nodes_cpus;
-
-            /*
-             * Check if the new candidate we is better the what we found up
-             * to now by means of the comparison function. If no comparison
-             * function is provided, just return as soon as we find our first
-             * candidate.
-             */
-            if (*cndt_found == 0 || numa_cmpf(&new_cndt, cndt_out) < 0) {
-                *cndt_found = 1;
-
-                LOG(DEBUG, "New best NUMA placement candidate found: "
-                           "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
-                           "free_memkb=%"PRIu32"", new_cndt.nr_nodes,
-                           new_cndt.nr_cpus, new_cndt.nr_vcpus,
-                           new_cndt.free_memkb / 1024);
-
-                libxl__numa_candidate_put_nodemap(gc, cndt_out, &nodemap);
-                cndt_out->nr_vcpus = new_cndt.nr_vcpus;
-                cndt_out->free_memkb = new_cndt.free_memkb;
-                cndt_out->nr_nodes = new_cndt.nr_nodes;
-                cndt_out->nr_cpus = new_cndt.nr_cpus;
-
-                if (numa_cmpf == NULL)
-                    break;
-            }
-        }
-        min_nodes++;
-    }
+    libxl_bitmap_set_none(&nodemap);
+    for (ps.k = min_nodes; ps.k <= max_nodes && *cndt_found == 0; ps.k++)
+        placement_search_from(&ps, 0, 0, 0, 0, 0);
 
     if (*cndt_found == 0)
         LOG(NOTICE, "NUMA placement failed, performance might be affected");
@@ -495,7 +472,6 @@ int libxl__get_numa_candidate(libxl__gc *gc,
     libxl_bitmap_dispose(&suitable_nodemap);
     libxl__numa_candidate_dispose(&new_cndt);
     libxl_numainfo_list_free(ninfo, nr_nodes);
-    libxl_cputopology_list_free(tinfo, nr_cpus);
     return rc;
 }
 
@@ -32,6 +32,7 @@
 #elif defined(__linux__)
 #define SYSFS_PCI_DEV          "/sys/bus/pci/devices"
 #define SYSFS_PCIBACK_DRIVER   "/sys/bus/pci/drivers/pciback"
+#define HAVE_EPOLL             1
 #include <pty.h>
 #elif defined(__sun__)
 #include <stropts.h>
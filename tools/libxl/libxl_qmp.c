@@ -51,6 +51,13 @@ typedef struct qmp_request_context {
     int rc;
 } qmp_request_context;
 
+typedef struct qmp_pipelined_command {
+    const char *cmd;
+    libxl__json_object *args;
+    qmp_callback_t callback;
+    void *opaque;
+} qmp_pipelined_command;
+
 typedef struct callback_id_pair {
     int id;
     qmp_callback_t callback;
@@ -75,6 +82,13 @@ struct libxl__qmp_handler {
 
     int last_id_used;
     LIBXL_STAILQ_HEAD(callback_list, callback_id_pair) callback_list;
+
+    /* On CTX->qmp_handlers, to be reused by later operations on domid */
+    LIBXL_LIST_ENTRY(libxl__qmp_handler) entry;
+    /* Between libxl__qmp_initialize and libxl__qmp_close */
+    bool in_use;
+    /* A reply may be lost or still to come: the handler can't be reused */
+    bool broken;
 };
 
 static int qmp_send(libxl__qmp_handler *qmp,
@@ -260,7 +274,8 @@ static callback_id_pair *qmp_get_callback_from_id(libxl__qmp_handler *qmp,
     return NULL;
 }
 
-static void qmp_handle_error_response(libxl__qmp_handler *qmp,
+/* Returns whether the error answers a command we sent */
+static bool qmp_handle_error_response(libxl__qmp_handler *qmp,
                                       const libxl__json_object *resp)
 {
     callback_id_pair *pp = qmp_get_callback_from_id(qmp, resp);
@@ -270,10 +285,10 @@ static void qmp_handle_error_response(libxl__qmp_handler *qmp,
 
     if (pp) {
         if (pp->callback) {
-            int rc = pp->callback(qmp, NULL, pp->opaque);
-            if (pp->context) {
-                pp->context->rc = rc;
-            }
+            pp->callback(qmp, NULL, pp->opaque);
+        }
+        if (pp->context) {
+            pp->context->rc = -1;
         }
         if (pp->id == qmp->wait_for_id) {
             /* tell that the id have been processed */
@@ -286,6 +301,8 @@ static void qmp_handle_error_response(libxl__qmp_handler *qmp,
     LIBXL__LOG(qmp->ctx, LIBXL__LOG_ERROR,
                "received an error message from QMP server: %s",
                libxl__json_object_get_string(resp));
+
+    return pp != NULL;
 }
 
 static int qmp_handle_response(libxl__qmp_handler *qmp,
@@ -324,8 +341,11 @@ static int qmp_handle_response(libxl__qmp_handler *qmp,
         return 0;
     }
     case LIBXL__QMP_MESSAGE_TYPE_ERROR:
-        qmp_handle_error_response(qmp, resp);
-        return -1;
+        /*
+         * The failure of a command is reported to whoever sent it, through
+         * its context; the connection itself is still fine.
+         */
+        return qmp_handle_error_response(qmp, resp) ? 0 : -1;
     case LIBXL__QMP_MESSAGE_TYPE_EVENT:
         return 0;
     case LIBXL__QMP_MESSAGE_TYPE_INVALID:
@@ -594,12 +614,15 @@ static int qmp_synchronous_send(libxl__qmp_handler *qmp, const char *cmd,
 
     id = qmp_send(qmp, cmd, args, callback, opaque, &context);
     if (id <= 0) {
-        return -1;
+        qmp->broken = true;
+        ret = -1;
+        goto out;
     }
     qmp->wait_for_id = id;
 
     while (qmp->wait_for_id == id) {
         if ((ret = qmp_next(gc, qmp)) < 0) {
+            qmp->broken = true;
             break;
         }
     }
@@ -608,16 +631,105 @@ static int qmp_synchronous_send(libxl__qmp_handler *qmp, const char *cmd,
         ret = context.rc;
     }
 
+out:
     GC_FREE;
 
     return ret;
 }
 
+/*
+ * Send all the commands before waiting for any reply, rather than paying
+ * a round trip for each. QEMU runs them, and replies, in order, so once
+ * the last one is answered all are. Returns the first error.
+ */
+static int qmp_pipelined_send(libxl__qmp_handler *qmp,
+                              const qmp_pipelined_command *cmds, int nr)
+{
+    int i, id = 0;
+    int ret = 0;
+    GC_INIT(qmp->ctx);
+    qmp_request_context *contexts;
+
+    GCNEW_ARRAY(contexts, nr);
+
+    for (i = 0; i < nr; i++) {
+        id = qmp_send(qmp, cmds[i].cmd, cmds[i].args, cmds[i].callback,
+                      cmds[i].opaque, &contexts[i]);
+        if (id <= 0) {
+            qmp->broken = true;
+            ret = -1;
+            goto out;
+        }
+    }
+    qmp->wait_for_id = id;
+
+    while (qmp->wait_for_id == id) {
+        if ((ret = qmp_next(gc, qmp)) < 0) {
+            qmp->broken = true;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nr && !ret; i++)
+        ret = contexts[i].rc;
+
+out:
+    GC_FREE;
+    return ret;
+}
+
 static void qmp_free_handler(libxl__qmp_handler *qmp)
 {
     free(qmp);
 }
 
+/*
+ * Look for a connection to the domain's QEMU left by an earlier operation,
+ * and take it if it is still usable.
+ */
+static libxl__qmp_handler *qmp_reuse_handler(libxl__gc *gc, uint32_t domid)
+{
+    libxl__qmp_handler *qmp;
+    struct pollfd pfd;
+    int r;
+
+    CTX_LOCK;
+    LIBXL_LIST_FOREACH(qmp, &CTX->qmp_handlers, entry) {
+        if (qmp->domid == domid && !qmp->in_use && !qmp->broken)
+            break;
+    }
+    if (qmp)
+        qmp->in_use = true;
+    CTX_UNLOCK;
+
+    if (!qmp)
+        return NULL;
+
+    /*
+     * Deal with whatever QEMU sent since, which can only be events or the
+     * end of the connection, if it has gone away.
+     */
+    for (;;) {
+        pfd.fd = qmp->qmp_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        r = poll(&pfd, 1, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r == 0)
+            break;
+        if (r < 0 || (pfd.revents & ~POLLIN) || qmp_next(gc, qmp) < 0) {
+            LOG(DEBUG, "dropping QMP connection to domain %"PRIu32, domid);
+            qmp->broken = true;
+            libxl__qmp_close(qmp);
+            return NULL;
+        }
+    }
+
+    LOG(DEBUG, "reusing QMP connection to domain %"PRIu32, domid);
+    return qmp;
+}
+
 /*
  * QMP Parameters Helpers
  */
@@ -689,7 +801,13 @@ libxl__qmp_handler *libxl__qmp_initialize(libxl__gc *gc, uint32_t domid)
     libxl__qmp_handler *qmp = NULL;
     char *qmp_socket;
 
+    qmp = qmp_reuse_handler(gc, domid);
+    if (qmp)
+        return qmp;
+
     qmp = qmp_init_handler(gc, domid);
+    if (!qmp)
+        return NULL;
 
     qmp_socket = libxl__sprintf(gc, "%s/qmp-libxl-%d",
                                 libxl__run_dir_path(), domid);
@@ -710,25 +828,74 @@ libxl__qmp_handler *libxl__qmp_initialize(libxl__gc *gc, uint32_t domid)
 
     if (!qmp->connected) {
         LOG(ERROR, "Failed to connect to QMP");
-        libxl__qmp_close(qmp);
+        qmp_close(qmp);
+        qmp_free_handler(qmp);
         return NULL;
     }
+
+    qmp->in_use = true;
+    CTX_LOCK;
+    LIBXL_LIST_INSERT_HEAD(&CTX->qmp_handlers, qmp, entry);
+    CTX_UNLOCK;
     return qmp;
 }
 
 void libxl__qmp_close(libxl__qmp_handler *qmp)
 {
+    libxl_ctx *ctx;
+
     if (!qmp)
         return;
+    ctx = qmp->ctx;
+
+    /* Keep the connection for the next operation on the domain */
+    libxl__ctx_lock(ctx);
+    qmp->in_use = false;
+    if (!qmp->broken) {
+        libxl__ctx_unlock(ctx);
+        return;
+    }
+    LIBXL_LIST_REMOVE(qmp, entry);
+    libxl__ctx_unlock(ctx);
+
     qmp_close(qmp);
     qmp_free_handler(qmp);
 }
 
+void libxl__qmp_close_all(libxl_ctx *ctx)
+{
+    libxl__qmp_handler *qmp, *tmp;
+
+    libxl__ctx_lock(ctx);
+    LIBXL_LIST_FOREACH_SAFE(qmp, &ctx->qmp_handlers, entry, tmp) {
+        LIBXL_LIST_REMOVE(qmp, entry);
+        qmp_close(qmp);
+        qmp_free_handler(qmp);
+    }
+    libxl__ctx_unlock(ctx);
+}
+
 void libxl__qmp_cleanup(libxl__gc *gc, uint32_t domid)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
+    libxl__qmp_handler *qmp, *tmp;
     char *qmp_socket;
 
+    /* QEMU is gone, and the domid may be reused: forget its connections */
+    CTX_LOCK;
+    LIBXL_LIST_FOREACH_SAFE(qmp, &CTX->qmp_handlers, entry, tmp) {
+        if (qmp->domid != domid)
+            continue;
+        if (qmp->in_use) {
+            qmp->broken = true;
+            continue;
+        }
+        LIBXL_LIST_REMOVE(qmp, entry);
+        qmp_close(qmp);
+        qmp_free_handler(qmp);
+    }
+    CTX_UNLOCK;
+
     qmp_socket = libxl__sprintf(gc, "%s/qmp-libxl-%d",
                                 libxl__run_dir_path(), domid);
     if (unlink(qmp_socket) == -1) {
@@ -747,13 +914,6 @@ int libxl__qmp_query_serial(libxl__qmp_handler *qmp)
                                 NULL, qmp->timeout);
 }
 
-static int qmp_query_vnc(libxl__qmp_handler *qmp)
-{
-    return qmp_synchronous_send(qmp, "query-vnc", NULL,
-                                qmp_register_vnc_callback,
-                                NULL, qmp->timeout);
-}
-
 static int pci_add_callback(libxl__qmp_handler *qmp,
                             const libxl__json_object *response, void *opaque)
 {
@@ -844,12 +1004,13 @@ int libxl__qmp_pci_add(libxl__gc *gc, int domid, libxl_device_pci *pcidev)
                                PCI_SLOT(pcidev->vdevfn), PCI_FUNC(pcidev->vdevfn));
     }
 
-    rc = qmp_synchronous_send(qmp, "device_add", args,
-                              NULL, NULL, qmp->timeout);
-    if (rc == 0) {
-        rc = qmp_synchronous_send(qmp, "query-pci", NULL,
-                                  pci_add_callback, pcidev, qmp->timeout);
-    }
+    /* query-pci only finds the device if device_add succeeded */
+    qmp_pipelined_command cmds[] = {
+        { "device_add", args, NULL, NULL },
+        { "query-pci", NULL, pci_add_callback, pcidev },
+    };
+
+    rc = qmp_pipelined_send(qmp, cmds, ARRAY_SIZE(cmds));
 
     libxl__qmp_close(qmp);
     return rc;
@@ -887,24 +1048,6 @@ int libxl__qmp_save(libxl__gc *gc, int domid, const char *filename)
                            NULL, NULL);
 }
 
-static int qmp_change(libxl__gc *gc, libxl__qmp_handler *qmp,
-                      char *device, char *target, char *arg)
-{
-    libxl__json_object *args = NULL;
-    int rc = 0;
-
-    qmp_parameters_add_string(gc, &args, "device", device);
-    qmp_parameters_add_string(gc, &args, "target", target);
-    if (arg) {
-        qmp_parameters_add_string(gc, &args, "arg", arg);
-    }
-
-    rc = qmp_synchronous_send(qmp, "change", args,
-                              NULL, NULL, qmp->timeout);
-
-    return rc;
-}
-
 int libxl__qmp_stop(libxl__gc *gc, int domid)
 {
     return qmp_run_command(gc, domid, "stop", NULL, NULL, NULL);
@@ -955,19 +1098,33 @@ int libxl__qmp_initializations(libxl__gc *gc, uint32_t domid,
 {
     const libxl_vnc_info *vnc = libxl__dm_vnc(guest_config);
     libxl__qmp_handler *qmp = NULL;
+    qmp_pipelined_command cmds[3];
+    int nr = 0;
     int ret = 0;
 
     qmp = libxl__qmp_initialize(gc, domid);
     if (!qmp)
         return -1;
-    ret = libxl__qmp_query_serial(qmp);
-    if (!ret && vnc && vnc->passwd) {
-        ret = qmp_change(gc, qmp, "vnc", "password", vnc->passwd);
-        qmp_write_domain_console_item(gc, domid, "vnc-pass", vnc->passwd);
-    }
-    if (!ret) {
-        ret = qmp_query_vnc(qmp);
+
+    cmds[nr++] = (qmp_pipelined_command) {
+        "query-chardev", NULL, register_serials_chardev_callback, NULL
+    };
+    if (vnc && vnc->passwd) {
+        libxl__json_object *args = NULL;
+
+        qmp_parameters_add_string(gc, &args, "device", "vnc");
+        qmp_parameters_add_string(gc, &args, "target", "password");
+        qmp_parameters_add_string(gc, &args, "arg", vnc->passwd);
+        cmds[nr++] = (qmp_pipelined_command) { "change", args, NULL, NULL };
     }
+    cmds[nr++] = (qmp_pipelined_command) {
+        "query-vnc", NULL, qmp_register_vnc_callback, NULL
+    };
+
+    ret = qmp_pipelined_send(qmp, cmds, nr);
+    if (!ret && vnc && vnc->passwd)
+        qmp_write_domain_console_item(gc, domid, "vnc-pass", vnc->passwd);
+
     libxl__qmp_close(qmp);
     return ret;
 }
@@ -119,6 +119,17 @@ char *libxl_cpupoolid_to_name(libxl_ctx *ctx, uint32_t poolid)
     s = xs_read(ctx->xsh, XBT_NULL, path, &len);
     if (!s && (poolid == 0))
         return strdup("Pool-0");
+    if (!s) {
+        /* Pools created by the hypervisor at boot have no name yet. */
+        xc_cpupoolinfo_t *info = xc_cpupool_getinfo(ctx->xch, poolid);
+
+        if (info) {
+            if (info->cpupool_id == poolid &&
+                asprintf(&s, "Pool-%u", poolid) < 0)
+                s = NULL;
+            xc_cpupool_infofree(ctx->xch, info);
+        }
+    }
     return s;
 }
 
@@ -41,18 +41,57 @@ char **libxl__xs_kvs_of_flexarray(libxl__gc *gc, flexarray_t *array, int length)
     return kvs;
 }
 
+/* All of kvs as one batch, or NULL if it could not be built. */
+static struct xs_multi *xs_writev_batch(libxl__gc *gc, const char *dir,
+                                        char *kvs[],
+                                        struct xs_permissions *perms,
+                                        unsigned int num_perms)
+{
+    struct xs_multi *m;
+    char *path;
+    int i;
+
+    m = xs_multi_new();
+    if (!m)
+        return NULL;
+
+    for (i = 0; kvs[i] != NULL; i += 2) {
+        path = libxl__sprintf(gc, "%s/%s", dir, kvs[i]);
+        if (!path || !kvs[i + 1])
+            continue;
+        if (!xs_multi_write(m, path, kvs[i + 1], strlen(kvs[i + 1])) ||
+            (perms && !xs_multi_set_permissions(m, path, perms, num_perms))) {
+            xs_multi_free(m);
+            return NULL;
+        }
+    }
+    return m;
+}
+
 int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
                            const char *dir, char *kvs[],
                            struct xs_permissions *perms,
                            unsigned int num_perms)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
+    struct xs_multi *m;
     char *path;
     int i;
 
     if (!kvs)
         return 0;
 
+    /* Everything in one round trip, if it all succeeds. */
+    m = xs_writev_batch(gc, dir, kvs, perms, num_perms);
+    if (m && xs_multi_execute(ctx->xsh, t, m)) {
+        xs_multi_free(m);
+        return 0;
+    }
+    if (m)
+        LOGE(DEBUG, "batched write to %s failed, writing keys singly", dir);
+    xs_multi_free(m);
+
+    /* Otherwise write each key on its own, skipping those which fail. */
     for (i = 0; kvs[i] != NULL; i += 2) {
         path = libxl__sprintf(gc, "%s/%s", dir, kvs[i]);
         if (path && kvs[i + 1]) {
@@ -41,6 +41,7 @@ int force_execution;
 int autoballoon = -1;
 char *blkdev_start;
 int run_hotplug_scripts = 1;
+int max_parallel_hotplug = 0;
 char *lockfile;
 char *default_vifscript = NULL;
 char *default_bridge = NULL;
@@ -111,6 +112,15 @@ static void parse_global_config(const char *configfile,
     if (!xlu_cfg_get_long (config, "run_hotplug_scripts", &l, 0))
         run_hotplug_scripts = l;
 
+    if (!xlu_cfg_get_long (config, "max_parallel_hotplug", &l, 0)) {
+        if (l < 0)
+            fprintf(stderr, "invalid max_parallel_hotplug option\n");
+        else {
+            max_parallel_hotplug = l;
+            libxl_set_hotplug_parallelism(ctx, max_parallel_hotplug);
+        }
+    }
+
     if (!xlu_cfg_get_string (config, "lockfile", &buf, 0))
         lockfile = strdup(buf);
     else {
@@ -257,6 +267,23 @@ static const libxl_childproc_hooks childproc_hooks = {
     .reaped_callback = xl_reaped_callback,
 };
 
+/* With -v, the timings of each domain operation, as a line of JSON */
+static void xl_phase_timing(void *user, const char *op, uint32_t domid,
+                            int rc, const libxl_phase_timing *phases,
+                            int nr_phases, uint64_t total_us)
+{
+    int i;
+
+    fprintf(stderr, "{\"timing\": {\"op\": \"%s\", \"domid\": %u, "
+            "\"rc\": %d, \"total_us\": %"PRIu64", \"phases\": [",
+            op, domid, rc, total_us);
+    for (i = 0; i < nr_phases; i++)
+        fprintf(stderr, "%s{\"name\": \"%s\", \"start_us\": %"PRIu64", "
+                "\"duration_us\": %"PRIu64"}", i ? ", " : "",
+                phases[i].name, phases[i].start_us, phases[i].duration_us);
+    fprintf(stderr, "]}}\n");
+}
+
 void xl_ctx_alloc(void) {
     if (libxl_ctx_alloc(&ctx, LIBXL_VERSION, 0, (xentoollog_logger*)logger)) {
         fprintf(stderr, "cannot init xl context\n");
@@ -264,6 +291,9 @@ void xl_ctx_alloc(void) {
     }
 
     libxl_childproc_setmode(ctx, &childproc_hooks, 0);
+    libxl_set_hotplug_parallelism(ctx, max_parallel_hotplug);
+    if (minmsglevel < XTL_PROGRESS)
+        libxl_set_phase_timing_callback(ctx, xl_phase_timing, NULL);
 }
 
 static void xl_ctx_free(void)
@@ -56,6 +56,7 @@ int main_reboot(int argc, char **argv);
 int main_list(int argc, char **argv);
 int main_vm_list(int argc, char **argv);
 int main_create(int argc, char **argv);
+int main_create_many(int argc, char **argv);
 int main_config_update(int argc, char **argv);
 int main_button_press(int argc, char **argv);
 int main_vcpupin(int argc, char **argv);
@@ -145,6 +146,7 @@ int xl_child_pid(xlchildnum); /* returns 0 if child struct is not in use */
 /* global options */
 extern int autoballoon;
 extern int run_hotplug_scripts;
+extern int max_parallel_hotplug;
 extern int dryrun_only;
 extern int claim_mode;
 extern char *lockfile;
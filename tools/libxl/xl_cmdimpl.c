@@ -329,6 +329,13 @@ static void dolog(const char *file, int line, const char *func, char *fmt, ...)
     free(s);
 }
 
+/* Write JSON straight to stdout, as it is generated. */
+static void json_print_stdout(void *unused, const char *str,
+                              libxl_yajl_length len)
+{
+    fwrite(str, 1, len, stdout);
+}
+
 static yajl_gen_status printf_info_one_json(yajl_gen hand, int domid,
                                             libxl_domain_config *d_config)
 {
@@ -371,12 +378,10 @@ static void printf_info(enum output_format output_format,
     if (output_format == OUTPUT_FORMAT_SXP)
         return printf_info_sexp(domid, d_config);
 
-    const char *buf;
-    libxl_yajl_length len = 0;
     yajl_gen_status s;
     yajl_gen hand;
 
-    hand = libxl_yajl_gen_alloc(NULL);
+    hand = libxl_yajl_gen_alloc_print(json_print_stdout, NULL);
     if (!hand) {
         fprintf(stderr, "unable to allocate JSON generator\n");
         return;
@@ -386,11 +391,7 @@ static void printf_info(enum output_format output_format,
     if (s != yajl_gen_status_ok)
         goto out;
 
-    s = yajl_gen_get_buf(hand, (const unsigned char **)&buf, &len);
-    if (s != yajl_gen_status_ok)
-        goto out;
-
-    puts(buf);
+    putchar('\n');
 
 out:
     yajl_gen_free(hand);
@@ -687,6 +688,8 @@ static void parse_config_data(const char *config_source,
         b_info->sched_params.latency = l;
     if (!xlu_cfg_get_long (config, "extratime", &l, 0))
         b_info->sched_params.extratime = l;
+    if (!xlu_cfg_get_long (config, "gang", &l, 0))
+        b_info->sched_params.gang = l;
 
     if (!xlu_cfg_get_long (config, "vcpus", &l, 0)) {
         b_info->max_vcpus = l;
@@ -1759,18 +1762,14 @@ static int preserve_domain(uint32_t *r_domid, libxl_event *event,
     return rc == 0 ? 1 : 0;
 }
 
-static int freemem(uint32_t domid, libxl_domain_build_info *b_info)
+static int freemem_kb(uint32_t domid, uint32_t need_memkb)
 {
     int rc, retries = 3;
-    uint32_t need_memkb, free_memkb;
+    uint32_t free_memkb;
 
     if (!autoballoon)
         return 0;
 
-    rc = libxl_domain_need_memory(ctx, b_info, &need_memkb);
-    if (rc < 0)
-        return rc;
-
     do {
         rc = libxl_get_free_memory(ctx, &free_memkb);
         if (rc < 0)
@@ -1801,6 +1800,50 @@ static int freemem(uint32_t domid, libxl_domain_build_info *b_info)
     return ERROR_NOMEM;
 }
 
+static int freemem(uint32_t domid, libxl_domain_build_info *b_info)
+{
+    int rc;
+    uint32_t need_memkb;
+
+    if (!autoballoon)
+        return 0;
+
+    rc = libxl_domain_need_memory(ctx, b_info, &need_memkb);
+    if (rc < 0)
+        return rc;
+
+    return freemem_kb(domid, need_memkb);
+}
+
+/* Honours the single vcpu to pcpu mapping parse_config_data made, if any */
+static int pin_vcpus(uint32_t domid, int max_vcpus, const int *map)
+{
+    libxl_bitmap vcpu_cpumap;
+    int i, rc;
+
+    if (!map)
+        return 0;
+
+    rc = libxl_cpu_bitmap_alloc(ctx, &vcpu_cpumap, 0);
+    if (rc)
+        return rc;
+    for (i = 0; i < max_vcpus; i++) {
+        if (map[i] != -1) {
+            libxl_bitmap_set_none(&vcpu_cpumap);
+            libxl_bitmap_set(&vcpu_cpumap, map[i]);
+        } else {
+            libxl_bitmap_set_any(&vcpu_cpumap);
+        }
+        if (libxl_set_vcpuaffinity(ctx, domid, i, &vcpu_cpumap)) {
+            fprintf(stderr, "setting affinity failed on vcpu `%d'.\n", i);
+            rc = ERROR_FAIL;
+            break;
+        }
+    }
+    libxl_bitmap_dispose(&vcpu_cpumap);
+    return rc;
+}
+
 static void console_child_report(void)
 {
     if (xl_child_pid(child_console)) {
@@ -2090,32 +2133,10 @@ start:
     if ( ret )
         goto error_out;
 
-    /* If single vcpu to pcpu mapping was requested, honour it */
-    if (vcpu_to_pcpu) {
-        libxl_bitmap vcpu_cpumap;
-
-        ret = libxl_cpu_bitmap_alloc(ctx, &vcpu_cpumap, 0);
-        if (ret)
-            goto error_out;
-        for (i = 0; i < d_config.b_info.max_vcpus; i++) {
-
-            if (vcpu_to_pcpu[i] != -1) {
-                libxl_bitmap_set_none(&vcpu_cpumap);
-                libxl_bitmap_set(&vcpu_cpumap, vcpu_to_pcpu[i]);
-            } else {
-                libxl_bitmap_set_any(&vcpu_cpumap);
-            }
-            if (libxl_set_vcpuaffinity(ctx, domid, i, &vcpu_cpumap)) {
-                fprintf(stderr, "setting affinity failed on vcpu `%d'.\n", i);
-                libxl_bitmap_dispose(&vcpu_cpumap);
-                free(vcpu_to_pcpu);
-                ret = ERROR_FAIL;
-                goto error_out;
-            }
-        }
-        libxl_bitmap_dispose(&vcpu_cpumap);
-        free(vcpu_to_pcpu); vcpu_to_pcpu = NULL;
-    }
+    ret = pin_vcpus(domid, d_config.b_info.max_vcpus, vcpu_to_pcpu);
+    free(vcpu_to_pcpu); vcpu_to_pcpu = NULL;
+    if (ret)
+        goto error_out;
 
     ret = libxl_userdata_store(ctx, domid, "xl",
                                     config_data, config_len);
@@ -3042,11 +3063,10 @@ static void list_domains_details(const libxl_dominfo *info, int nb_domain)
 
     yajl_gen hand = NULL;
     yajl_gen_status s;
-    const char *buf;
-    libxl_yajl_length yajl_len = 0;
 
     if (default_output_format == OUTPUT_FORMAT_JSON) {
-        hand = libxl_yajl_gen_alloc(NULL);
+        /* Print each domain as it comes, not all of them at the end */
+        hand = libxl_yajl_gen_alloc_print(json_print_stdout, NULL);
         if (!hand) {
             fprintf(stderr, "unable to allocate JSON generator\n");
             return;
@@ -3084,11 +3104,7 @@ static void list_domains_details(const libxl_dominfo *info, int nb_domain)
         if (s != yajl_gen_status_ok)
             goto out;
 
-        s = yajl_gen_get_buf(hand, (const unsigned char **)&buf, &yajl_len);
-        if (s != yajl_gen_status_ok)
-            goto out;
-
-        puts(buf);
+        putchar('\n');
     }
 
 out:
@@ -3513,7 +3529,7 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
-                           const char *override_config_file)
+                           int same_host, const char *override_config_file)
 {
     pid_t child = -1;
     int rc;
@@ -3541,6 +3557,8 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
+    if (same_host)
+        flags |= LIBXL_SUSPEND_SAME_HOST;
     rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
@@ -3938,9 +3956,10 @@ int main_migrate(int argc, char **argv)
     const char *ssh_command = "ssh";
     char *rune = NULL;
     char *host;
-    int opt, daemonize = 1, monitor = 1, debug = 0;
+    int opt, daemonize = 1, monitor = 1, debug = 0, same_host = 0;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
+        {"same-host", 0, 0, 0x101},
         COMMON_LONG_OPTS,
         {0, 0, 0, 0}
     };
@@ -3962,6 +3981,9 @@ int main_migrate(int argc, char **argv)
     case 0x100:
         debug = 1;
         break;
+    case 0x101:
+        same_host = 1;
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -3977,7 +3999,7 @@ int main_migrate(int argc, char **argv)
             return 1;
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, same_host, config_filename);
     return 0;
 }
 
@@ -4287,6 +4309,142 @@ int main_create(int argc, char **argv)
     return 0;
 }
 
+/*
+ * Creates all the domains in one go, sharing this process's ctx, rather
+ * than each with an xl create of its own.  Like xl create -e, nothing
+ * then waits for the domains to die, to reboot or destroy them.
+ */
+int main_create_many(int argc, char **argv)
+{
+    int opt, i, n, nr, rc, ret = 0, paused = 0, quiet = 0, parallel = 8;
+    libxl_domain_config *d_configs;
+    char **config_datas;
+    int *config_lens, **vcpu_maps, *rcs;
+    uint32_t *domids, need_memkb, total_memkb = 0;
+    static struct option opts[] = {
+        {"quiet", 0, 0, 'q'},
+        {"parallel", 1, 0, 'j'},
+        COMMON_LONG_OPTS,
+        {0, 0, 0, 0}
+    };
+
+    SWITCH_FOREACH_OPT(opt, "pqj:", opts, "create-many", 1) {
+    case 'p':
+        paused = 1;
+        break;
+    case 'q':
+        quiet = 1;
+        break;
+    case 'j':
+        parallel = strtol(optarg, NULL, 10);
+        if (parallel < 0) {
+            fprintf(stderr, "Invalid parallelism %s\n", optarg);
+            return 2;
+        }
+        break;
+    }
+
+    nr = argc - optind;
+    d_configs = xmalloc(sizeof(*d_configs) * nr);
+    config_datas = xmalloc(sizeof(*config_datas) * nr);
+    config_lens = xmalloc(sizeof(*config_lens) * nr);
+    vcpu_maps = xmalloc(sizeof(*vcpu_maps) * nr);
+    domids = xmalloc(sizeof(*domids) * nr);
+    rcs = xmalloc(sizeof(*rcs) * nr);
+
+    for (i = 0; i < nr; i++) {
+        const char *filename = argv[optind + i];
+
+        libxl_domain_config_init(&d_configs[i]);
+        if (libxl_read_file_contents(ctx, filename, (void **)&config_datas[i],
+                                     &config_lens[i])) {
+            fprintf(stderr, "Failed to read config file: %s: %s\n",
+                    filename, strerror(errno));
+            ret = 1;
+            goto out;
+        }
+        if (!quiet)
+            printf("Parsing config from %s\n", filename);
+        parse_config_data(filename, config_datas[i], config_lens[i],
+                          &d_configs[i], NULL);
+        vcpu_maps[i] = vcpu_to_pcpu;
+        vcpu_to_pcpu = NULL;
+
+        rc = libxl_domain_need_memory(ctx, &d_configs[i].b_info, &need_memkb);
+        if (rc) {
+            ret = 1;
+            i++;
+            goto out;
+        }
+        total_memkb += need_memkb;
+    }
+
+    if (dryrun_only) {
+        for (i = 0; i < nr; i++)
+            printf_info(default_output_format, -1, &d_configs[i]);
+        goto out;
+    }
+
+    /* Balloon dom0 down once, for the whole batch */
+    if (acquire_lock() < 0) {
+        ret = 1;
+        goto out;
+    }
+    rc = freemem_kb(INVALID_DOMID, total_memkb);
+    if (rc < 0) {
+        fprintf(stderr, "failed to free memory for the domains\n");
+        release_lock();
+        ret = 1;
+        goto out;
+    }
+
+    libxl_domain_create_many(ctx, nr, d_configs, domids, rcs, parallel, 0);
+    release_lock();
+
+    for (n = 0; n < nr; n++) {
+        const char *filename = argv[optind + n];
+
+        if (rcs[n]) {
+            fprintf(stderr, "%s: failed to create domain\n", filename);
+            ret = 1;
+            continue;
+        }
+
+        if (pin_vcpus(domids[n], d_configs[n].b_info.max_vcpus,
+                      vcpu_maps[n]) ||
+            libxl_userdata_store(ctx, domids[n], "xl",
+                                 (uint8_t *)config_datas[n],
+                                 config_lens[n])) {
+            fprintf(stderr, "%s: failed to set up domain %u\n",
+                    filename, domids[n]);
+            libxl_domain_destroy(ctx, domids[n], 0);
+            ret = 1;
+            continue;
+        }
+
+        if (!paused)
+            libxl_domain_unpause(ctx, domids[n]);
+        if (!quiet)
+            printf("Created domain %s (domid %u)\n",
+                   d_configs[n].c_info.name, domids[n]);
+    }
+
+    i = nr;
+ out:
+    while (i-- > 0) {
+        libxl_domain_config_dispose(&d_configs[i]);
+        free(config_datas[i]);
+        free(vcpu_maps[i]);
+    }
+    free(d_configs);
+    free(config_datas);
+    free(config_lens);
+    free(vcpu_maps);
+    free(domids);
+    free(rcs);
+    return ret;
+}
+
 int main_config_update(int argc, char **argv)
 {
     uint32_t domid;
@@ -4995,17 +5153,18 @@ static int sched_credit2_domain_output(
     int rc;
 
     if (domid < 0) {
-        printf("%-33s %4s %6s\n", "Name", "ID", "Weight");
+        printf("%-33s %4s %6s %4s\n", "Name", "ID", "Weight", "Gang");
         return 0;
     }
     rc = sched_domain_get(LIBXL_SCHEDULER_CREDIT2, domid, &scinfo);
     if (rc)
         return rc;
     domname = libxl_domid_to_name(ctx, domid);
-    printf("%-33s %4d %6d\n",
+    printf("%-33s %4d %6d %4d\n",
         domname,
         domid,
-        scinfo.weight);
+        scinfo.weight,
+        scinfo.gang);
     free(domname);
     libxl_domain_sched_params_dispose(&scinfo);
     return 0;
@@ -5237,16 +5396,18 @@ int main_sched_credit2(int argc, char **argv)
     const char *dom = NULL;
     const char *cpupool = NULL;
     int weight = 256, opt_w = 0;
+    int gang = 0, opt_g = 0;
     int opt, rc;
     static struct option opts[] = {
         {"domain", 1, 0, 'd'},
         {"weight", 1, 0, 'w'},
+        {"gang", 1, 0, 'g'},
         {"cpupool", 1, 0, 'p'},
         COMMON_LONG_OPTS,
         {0, 0, 0, 0}
     };
 
-    SWITCH_FOREACH_OPT(opt, "d:w:p:h", opts, "sched-credit2", 0) {
+    SWITCH_FOREACH_OPT(opt, "d:w:g:p:h", opts, "sched-credit2", 0) {
     case 'd':
         dom = optarg;
         break;
@@ -5254,17 +5415,21 @@ int main_sched_credit2(int argc, char **argv)
         weight = strtol(optarg, NULL, 10);
         opt_w = 1;
         break;
+    case 'g':
+        gang = strtol(optarg, NULL, 10);
+        opt_g = 1;
+        break;
     case 'p':
         cpupool = optarg;
         break;
     }
 
-    if (cpupool && (dom || opt_w)) {
+    if (cpupool && (dom || opt_w || opt_g)) {
         fprintf(stderr, "Specifying a cpupool is not allowed with other "
                 "options.\n");
         return 1;
     }
-    if (!dom && opt_w) {
+    if (!dom && (opt_w || opt_g)) {
         fprintf(stderr, "Must specify a domain.\n");
         return 1;
     }
@@ -5277,7 +5442,7 @@ int main_sched_credit2(int argc, char **argv)
     } else {
         uint32_t domid = find_domain(dom);
 
-        if (!opt_w) { /* output credit2 scheduler info */
+        if (!opt_w && !opt_g) { /* output credit2 scheduler info */
             sched_credit2_domain_output(-1);
             return -sched_credit2_domain_output(domid);
         } else { /* set credit2 scheduler paramaters */
@@ -5286,6 +5451,8 @@ int main_sched_credit2(int argc, char **argv)
             scinfo.sched = LIBXL_SCHEDULER_CREDIT2;
             if (opt_w)
                 scinfo.weight = weight;
+            if (opt_g)
+                scinfo.gang = gang;
             rc = sched_domain_set(domid, &scinfo);
             libxl_domain_sched_params_dispose(&scinfo);
             if (rc)
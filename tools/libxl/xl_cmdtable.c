@@ -35,6 +35,18 @@ struct cmd_spec cmd_table[] = {
       "-A, --vncviewer-autopass\n"
       "                        Pass VNC password to viewer via stdin."
     },
+    { "create-many",
+      &main_create_many, 1, 1,
+      "Create several domains at once, from config files <filename>...",
+      "[options] <ConfigFile>...",
+      "-h                      Print this help.\n"
+      "-p                      Leave the domains paused after they are created.\n"
+      "-q, --quiet             Quiet.\n"
+      "-j N, --parallel=N      Create at most N domains at a time\n"
+      "                         (default 8, 0 for all at once).\n"
+      "Domains created this way are not waited for in the background,\n"
+      "as with xl create -e."
+    },
     { "config-update",
       &main_config_update, 1, 1,
       "Update a running domain's saved configuration, used when rebuilding "
@@ -156,7 +168,9 @@ struct cmd_spec cmd_table[] = {
       "                migrate-receive [-d -e]\n"
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
-      "--debug         Print huge (!) amount of debug during the migration process."
+      "--debug         Print huge (!) amount of debug during the migration process.\n"
+      "--same-host     <host> is this host: an HVM domain's memory is copied\n"
+      "                directly rather than sent."
     },
     { "dump-core",
       &main_dump_core, 0, 1,
@@ -251,9 +265,10 @@ struct cmd_spec cmd_table[] = {
     { "sched-credit2",
       &main_sched_credit2, 0, 1,
       "Get/set credit2 scheduler parameters",
-      "[-d <Domain> [-w[=WEIGHT]]] [-p CPUPOOL]",
+      "[-d <Domain> [-w[=WEIGHT]|-g[=GANG]]] [-p CPUPOOL]",
       "-d DOMAIN, --domain=DOMAIN     Domain to modify\n"
       "-w WEIGHT, --weight=WEIGHT     Weight (int)\n"
+      "-g GANG, --gang=GANG           Gang mode (0 or 1)\n"
       "-p CPUPOOL, --cpupool=CPUPOOL  Restrict output to CPUPOOL"
     },
     { "sched-sedf",
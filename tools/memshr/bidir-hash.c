@@ -49,6 +49,9 @@ static const float hash_min_load_fact = 0.10;
 #define BUCKET_LOCK                                                            \
     pthread_rwlock_t bucket_lock
 
+#define RESIZE_LOCK                                                            \
+    pthread_mutex_t resize_lock
+
 struct hash_entry
 {
     __k_t key;
@@ -84,6 +87,25 @@ struct __hash
     uint16_t size_idx;                    /* table size index             */
     uint32_t max_load;                    /* # entries before rehash      */
     uint32_t min_load;                    /* # entries before rehash      */
+
+    /* Resizing is incremental: after a resize the previous tables are   */
+    /* drained into the current ones a lock stripe at a time by inserts */
+    /* and removals. Entries only ever move from old to new tables.     */
+    struct bucket *old_key_tab;
+    struct bucket *old_value_tab;
+    struct bucket_lock *old_key_lock_tab;
+    struct bucket_lock *old_value_lock_tab;
+    uint32_t old_tab_size;                /* 0 when no resize in progress */
+    uint32_t migrate_lock;                /* next old lock stripe to move */
+
+    RESIZE_LOCK;                          /* protects:
+                                           * next_*, starting a resize
+                                           */
+    struct bucket *next_key_tab;          /* tables allocated for a       */
+    struct bucket *next_value_tab;        /* resize which could not yet   */
+    struct bucket_lock *next_key_lock_tab;/* switch to them               */
+    struct bucket_lock *next_value_lock_tab;
+    uint32_t next_tab_size;
 };
 
 struct __hash *__hash_init   (struct __hash *h, uint32_t min_size);
@@ -99,6 +121,7 @@ int            __hash_iterator(struct __hash *h,
                         int (*entry_consumer)(__k_t k, __v_t v, void *p),
                         void *d);
 static void      hash_resize(struct __hash *h);
+static void      hash_resize_finish(struct __hash *h);
 
 #if defined(__arm__)
 static inline void atomic_inc(uint32_t *v)
@@ -616,49 +639,45 @@ static int max_entries(struct __hash *h)
     pthread_rwlock_unlock(&(_lock)->bucket_lock);                              \
 })
 
-#define TWO_BUCKETS_LOCK_WRLOCK(_h, _blt1, _idx1, _blt2, _idx2)  ({            \
+#define RESIZE_LOCK_INIT(_h) ({                                                \
     int _ret;                                                                  \
-    pthread_rwlock_t *_l1, *_l2;                                               \
-    struct timespec _ts;                                                       \
-    struct bucket_lock *_bl1 = &(_blt1)[(_idx1) / BUCKETS_PER_LOCK];           \
-    struct bucket_lock *_bl2 = &(_blt2)[(_idx2) / BUCKETS_PER_LOCK];           \
+    pthread_mutexattr_t _attr;                                                 \
                                                                                \
-    assert((_bl1) != (_bl2));                                                  \
-    if((_bl1) < (_bl2))                                                        \
-    {                                                                          \
-        _l1 = &(_bl1)->bucket_lock;                                            \
-        _l2 = &(_bl2)->bucket_lock;                                            \
-    }                                                                          \
-    else                                                                       \
-    {                                                                          \
-        _l1 = &(_bl2)->bucket_lock;                                            \
-        _l2 = &(_bl1)->bucket_lock;                                            \
-    }                                                                          \
-    _ts.tv_sec = time(NULL) + 10;                                              \
-    _ts.tv_nsec = 0;                                                           \
-    _ret = pthread_rwlock_timedwrlock(_l1, &_ts);                              \
-    _ts.tv_sec = time(NULL) + 10;                                              \
-    _ts.tv_nsec = 0;                                                           \
+    _ret = pthread_mutexattr_init(&_attr);                                     \
     if(_ret == 0)                                                              \
-        _ret = pthread_rwlock_timedwrlock(_l2, &_ts);                          \
-    if(_ret == ETIMEDOUT) (_h)->lock_alive = 0;                                \
+        _ret = pthread_mutexattr_setpshared(&_attr, PTHREAD_PROCESS_SHARED);   \
+    if(_ret == 0)                                                              \
+        _ret = pthread_mutex_init(&(_h)->resize_lock, &_attr);                 \
+    if(_ret == 0)                                                              \
+        _ret = pthread_mutexattr_destroy(&_attr);                              \
                                                                                \
     _ret;                                                                      \
 })
 
-#define TWO_BUCKETS_LOCK_WRUNLOCK(_h, _blt1, _idx1, _blt2, _idx2) ({           \
-    int _ret;                                                                  \
-    struct bucket_lock *_bl1 = &(_blt1)[(_idx1) / BUCKETS_PER_LOCK];           \
-    struct bucket_lock *_bl2 = &(_blt2)[(_idx2) / BUCKETS_PER_LOCK];           \
-                                                                               \
-    _ret = pthread_rwlock_unlock(&(_bl1)->bucket_lock);                        \
-    if(_ret == 0)                                                              \
-        _ret = pthread_rwlock_unlock(&(_bl2)->bucket_lock);                    \
-                                                                               \
+#define RESIZE_LOCK_TRYLOCK(_h) ({                                             \
+    int _ret = ((_h)->lock_alive ?                                             \
+                    pthread_mutex_trylock(&(_h)->resize_lock) :                \
+                    ENOLCK);                                                   \
     _ret;                                                                      \
 })
 
+#define RESIZE_LOCK_UNLOCK(_h)                                                 \
+    pthread_mutex_unlock(&(_h)->resize_lock)
+
 
+#define KEY_TAB     0
+#define VALUE_TAB   1
+
+/* Bucket locks covering every bucket an entry may be linked from. They
+ * are always taken in the same order: key table stripes (old, then
+ * current) before value table stripes (old, then current). Draining an
+ * old table only ever takes an old stripe and then a current stripe of
+ * the same kind, so this can't deadlock against it. */
+struct entry_locks
+{
+    int nr;
+    pthread_rwlock_t *locks[4];
+};
 
 
 static uint32_t hash_to_idx(struct __hash *h, uint32_t hash)
@@ -666,6 +685,109 @@ static uint32_t hash_to_idx(struct __hash *h, uint32_t hash)
     return (hash % h->tab_size);
 }
 
+/* Bucket for hash in the current (or old, while resizing) key or value
+ * table. Must be called with the hash lock held. */
+static struct bucket *get_bucket(struct __hash *h,
+                                 int tab,
+                                 int old,
+                                 uint32_t hash,
+                                 uint32_t *idx,
+                                 struct bucket_lock **blt)
+{
+    struct bucket *t;
+
+    if(old)
+    {
+        *idx = hash % h->old_tab_size;
+        t    = (tab == KEY_TAB ? h->old_key_tab : h->old_value_tab);
+        *blt = C2L(h, (tab == KEY_TAB ? h->old_key_lock_tab :
+                                        h->old_value_lock_tab));
+    }
+    else
+    {
+        *idx = hash_to_idx(h, hash);
+        t    = (tab == KEY_TAB ? h->key_tab : h->value_tab);
+        *blt = C2L(h, (tab == KEY_TAB ? h->key_lock_tab :
+                                        h->value_lock_tab));
+    }
+
+    return C2L(h, &t[*idx]);
+}
+
+static struct hash_entry **entry_next(struct hash_entry *e, int tab)
+{
+    return (tab == KEY_TAB ? &e->key_next : &e->value_next);
+}
+
+/* Find the link pointing to entry es in bucket b (NULL if not there) */
+static struct hash_entry **find_link(struct __hash *h,
+                                     struct bucket *b,
+                                     struct hash_entry *es,
+                                     int tab)
+{
+    struct hash_entry *e, **pe;
+
+    pe = &b->hash_entry;
+    while((e = *pe) != NULL)
+    {
+        e = C2L(h, e);
+        if(e == es)
+            return pe;
+        pe = entry_next(e, tab);
+    }
+
+    return NULL;
+}
+
+/* Write lock the buckets of an entry, given the hash of its tab side
+ * (key or value) and of the other side. Old table buckets are only
+ * locked if with_old is set. */
+static int entry_lock(struct __hash *h,
+                      int tab,
+                      uint32_t hash,
+                      uint32_t other_hash,
+                      int with_old,
+                      struct entry_locks *el)
+{
+    struct bucket_lock *blt;
+    struct timespec ts;
+    uint32_t idx, hashes[2];
+    int t, old, i, ret;
+
+    hashes[tab] = hash;
+    hashes[!tab] = other_hash;
+
+    el->nr = 0;
+    for(t = KEY_TAB; t <= VALUE_TAB; t++)
+        for(old = (with_old && h->old_tab_size); old >= 0; old--)
+        {
+            get_bucket(h, t, old, hashes[t], &idx, &blt);
+            el->locks[el->nr++] = &blt[idx / BUCKETS_PER_LOCK].bucket_lock;
+        }
+
+    for(i = 0; i < el->nr; i++)
+    {
+        ts.tv_sec = time(NULL) + 10;
+        ts.tv_nsec = 0;
+        ret = pthread_rwlock_timedwrlock(el->locks[i], &ts);
+        if(ret != 0)
+        {
+            if(ret == ETIMEDOUT) h->lock_alive = 0;
+            while(i-- > 0)
+                pthread_rwlock_unlock(el->locks[i]);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void entry_unlock(struct entry_locks *el)
+{
+    while(el->nr-- > 0)
+        pthread_rwlock_unlock(el->locks[el->nr]);
+}
+
 static void alloc_tab(struct __hash *h,
                       int size,
                       struct bucket **buckets_tab,
@@ -690,6 +812,19 @@ error_out:
     return;
 }
 
+static void free_next_tabs(struct __hash *h)
+{
+    if(!h->next_tab_size)
+        return;
+    free_buckets(h, C2L(h, h->next_key_tab), C2L(h, h->next_key_lock_tab));
+    free_buckets(h, C2L(h, h->next_value_tab), C2L(h, h->next_value_lock_tab));
+    h->next_key_tab        = NULL;
+    h->next_key_lock_tab   = NULL;
+    h->next_value_tab      = NULL;
+    h->next_value_lock_tab = NULL;
+    h->next_tab_size       = 0;
+}
+
 
 struct __hash *__hash_init(struct __hash *h, uint32_t min_size)
 {
@@ -717,11 +852,23 @@ struct __hash *__hash_init(struct __hash *h, uint32_t min_size)
     h->value_lock_tab  = L2C(h, bucket_locks);
     /* Init all h variables */
     if(HASH_LOCK_INIT(h) != 0) goto alloc_fail;
+    if(RESIZE_LOCK_INIT(h) != 0) goto alloc_fail;
     h->nr_ent = 0;
     h->tab_size = size;
     h->size_idx = size_idx;
     h->max_load = (uint32_t)ceilf(hash_max_load_fact * size);
     h->min_load = (uint32_t)ceilf(hash_min_load_fact * size);
+    h->old_key_tab         = NULL;
+    h->old_key_lock_tab    = NULL;
+    h->old_value_tab       = NULL;
+    h->old_value_lock_tab  = NULL;
+    h->old_tab_size        = 0;
+    h->migrate_lock        = 0;
+    h->next_key_tab        = NULL;
+    h->next_key_lock_tab   = NULL;
+    h->next_value_tab      = NULL;
+    h->next_value_lock_tab = NULL;
+    h->next_tab_size       = 0;
 
     return h;
 
@@ -731,10 +878,79 @@ alloc_fail:
     return NULL;
 }
 
+
+/* Move the entries of one lock stripe of an old table into the current
+ * one. The old stripe stays locked throughout, and each entry is linked
+ * into its new bucket before that lock is dropped, so a reader that
+ * doesn't find an entry in the old table will find it in the new. */
+static int migrate_stripe(struct __hash *h, int tab, uint32_t stripe)
+{
+    struct hash_entry *e, **pn;
+    struct bucket *ob, *nb;
+    struct bucket_lock *oblt, *nblt;
+    uint32_t i, first, last, idx, nidx, hash;
+
+    first = stripe * BUCKETS_PER_LOCK;
+    last  = first + BUCKETS_PER_LOCK;
+    if(last > h->old_tab_size)
+        last = h->old_tab_size;
+
+    get_bucket(h, tab, 1, first, &idx, &oblt);
+    if(BUCKET_LOCK_WRLOCK(h, oblt, first) != 0) return -ENOLCK;
+    for(i = first; i < last; i++)
+    {
+        ob = get_bucket(h, tab, 1, i, &idx, &oblt);
+        while((e = ob->hash_entry) != NULL)
+        {
+            e = C2L(h, e);
+            hash = (tab == KEY_TAB ? __key_hash(e->key) :
+                                     __value_hash(e->value));
+            nb = get_bucket(h, tab, 0, hash, &nidx, &nblt);
+            if(BUCKET_LOCK_WRLOCK(h, nblt, nidx) != 0)
+            {
+                BUCKET_LOCK_WRUNLOCK(h, oblt, first);
+                return -ENOLCK;
+            }
+            pn = entry_next(e, tab);
+            ob->hash_entry = *pn;
+            *pn = nb->hash_entry;
+            nb->hash_entry = L2C(h, e);
+            BUCKET_LOCK_WRUNLOCK(h, nblt, nidx);
+        }
+    }
+    BUCKET_LOCK_WRUNLOCK(h, oblt, first);
+
+    return 0;
+}
+
+/* Drain the next stripe of the old tables, if a resize is in progress.
+ * Must be called with the hash read lock held. Returns 1 once the old
+ * tables are empty and can be freed by hash_resize_finish(). */
+static int hash_migrate(struct __hash *h)
+{
+    uint32_t stripe;
+
+    if(!h->old_tab_size)
+        return 0;
+
+    /* Racing callers may drain the same stripe twice, which is harmless,
+     * and may move migrate_lock backwards, but never past a stripe which
+     * hasn't been drained yet. */
+    stripe = h->migrate_lock;
+    if(stripe < nr_locks(h->old_tab_size))
+    {
+        if(migrate_stripe(h, KEY_TAB, stripe) != 0 ||
+           migrate_stripe(h, VALUE_TAB, stripe) != 0)
+            return -ENOLCK;
+        h->migrate_lock = ++stripe;
+    }
+
+    return (stripe >= nr_locks(h->old_tab_size));
+}
+
 #undef __prim
 #undef __prim_t
-#undef __prim_tab
-#undef __prim_lock_tab
+#undef __prim_tab_id
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
@@ -743,8 +959,7 @@ alloc_fail:
 
 #define __prim             key
 #define __prim_t         __k_t
-#define __prim_tab         key_tab
-#define __prim_lock_tab    key_lock_tab
+#define __prim_tab_id      KEY_TAB
 #define __prim_hash      __key_hash
 #define __prim_cmp       __key_cmp
 #define __prim_next        key_next
@@ -755,28 +970,37 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
     struct hash_entry *entry;
     struct bucket *b;
     struct bucket_lock *blt;
-    uint32_t idx;
+    uint32_t hash, idx;
+    int old;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
-    idx = hash_to_idx(h, __prim_hash(k));
-    b = C2L(h, &h->__prim_tab[idx]);
-    blt = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0) return -ENOLCK;
-    entry = b->hash_entry;
-    while(entry != NULL)
+    hash = __prim_hash(k);
+    /* While resizing, look in the old table first: entries only move from
+     * it to the current one, never the other way round */
+    for(old = !!h->old_tab_size; old >= 0; old--)
     {
-        entry = C2L(h, entry);
-        if(__prim_cmp(k, entry->__prim))
+        b = get_bucket(h, __prim_tab_id, old, hash, &idx, &blt);
+        if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0)
         {
-            /* Unlock here */
-            *vp = entry->__sec;
-            BUCKET_LOCK_RDUNLOCK(h, blt, idx);
             HASH_LOCK_RDUNLOCK(h);
-            return 1;
+            return -ENOLCK;
+        }
+        entry = b->hash_entry;
+        while(entry != NULL)
+        {
+            entry = C2L(h, entry);
+            if(__prim_cmp(k, entry->__prim))
+            {
+                /* Unlock here */
+                *vp = entry->__sec;
+                BUCKET_LOCK_RDUNLOCK(h, blt, idx);
+                HASH_LOCK_RDUNLOCK(h);
+                return 1;
+            }
+            entry = entry->__prim_next;
         }
-        entry = entry->__prim_next;
+        BUCKET_LOCK_RDUNLOCK(h, blt, idx);
     }
-    BUCKET_LOCK_RDUNLOCK(h, blt, idx);
     HASH_LOCK_RDUNLOCK(h);
     return 0;
 }
@@ -784,8 +1008,7 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
 /* value lookup is an almost exact copy of key lookup */
 #undef __prim
 #undef __prim_t
-#undef __prim_tab
-#undef __prim_lock_tab
+#undef __prim_tab_id
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
@@ -794,8 +1017,7 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
 
 #define __prim             value
 #define __prim_t         __v_t
-#define __prim_tab         value_tab
-#define __prim_lock_tab    value_lock_tab
+#define __prim_tab_id      VALUE_TAB
 #define __prim_hash      __value_hash
 #define __prim_cmp       __value_cmp
 #define __prim_next        value_next
@@ -806,28 +1028,37 @@ int __value_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
     struct hash_entry *entry;
     struct bucket *b;
     struct bucket_lock *blt;
-    uint32_t idx;
+    uint32_t hash, idx;
+    int old;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
-    idx = hash_to_idx(h, __prim_hash(k));
-    b = C2L(h, &h->__prim_tab[idx]);
-    blt = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0) return -ENOLCK;
-    entry = b->hash_entry;
-    while(entry != NULL)
+    hash = __prim_hash(k);
+    /* While resizing, look in the old table first: entries only move from
+     * it to the current one, never the other way round */
+    for(old = !!h->old_tab_size; old >= 0; old--)
     {
-        entry = C2L(h, entry);
-        if(__prim_cmp(k, entry->__prim))
+        b = get_bucket(h, __prim_tab_id, old, hash, &idx, &blt);
+        if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0)
         {
-            /* Unlock here */
-            *vp = entry->__sec;
-            BUCKET_LOCK_RDUNLOCK(h, blt, idx);
             HASH_LOCK_RDUNLOCK(h);
-            return 1;
+            return -ENOLCK;
+        }
+        entry = b->hash_entry;
+        while(entry != NULL)
+        {
+            entry = C2L(h, entry);
+            if(__prim_cmp(k, entry->__prim))
+            {
+                /* Unlock here */
+                *vp = entry->__sec;
+                BUCKET_LOCK_RDUNLOCK(h, blt, idx);
+                HASH_LOCK_RDUNLOCK(h);
+                return 1;
+            }
+            entry = entry->__prim_next;
         }
-        entry = entry->__prim_next;
+        BUCKET_LOCK_RDUNLOCK(h, blt, idx);
     }
-    BUCKET_LOCK_RDUNLOCK(h, blt, idx);
     HASH_LOCK_RDUNLOCK(h);
     return 0;
 }
@@ -838,6 +1069,8 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
     struct hash_entry *entry;
     struct bucket *bk, *bv;
     struct bucket_lock *bltk, *bltv;
+    struct entry_locks el;
+    int drained;
 
     /* Allocate new entry before any locks (in case it fails) */
     entry = (struct hash_entry*)
@@ -846,9 +1079,10 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
     /* Read from nr_ent is atomic(TODO check), no need for fancy accessors */
-    if(h->nr_ent+1 > h->max_load)
+    if(h->nr_ent+1 > h->max_load && !h->old_tab_size)
     {
-        /* Resize needs the write lock, drop read lock temporarily */
+        /* Switching tables needs the write lock, drop read lock
+         * temporarily */
         HASH_LOCK_RDUNLOCK(h);
         hash_resize(h);
         if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
@@ -858,328 +1092,315 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
     entry->key = k;
     entry->value = v;
 
-    /* Work out the indicies */
-    k_idx = hash_to_idx(h, __key_hash(k));
-    v_idx = hash_to_idx(h, __value_hash(v));
-
-    /* Insert */
-    bk   = C2L(h, &h->key_tab[k_idx]);
-    bv   = C2L(h, &h->value_tab[v_idx]);
-    bltk = C2L(h, h->key_lock_tab);
-    bltv = C2L(h, h->value_lock_tab);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, k_idx, bltv, v_idx) != 0)
+    /* New entries always go to the current tables */
+    bk = get_bucket(h, KEY_TAB, 0, __key_hash(k), &k_idx, &bltk);
+    bv = get_bucket(h, VALUE_TAB, 0, __value_hash(v), &v_idx, &bltv);
+    if(entry_lock(h, KEY_TAB, __key_hash(k), __value_hash(v), 0, &el) != 0)
+    {
+        HASH_LOCK_RDUNLOCK(h);
         return -ENOLCK;
+    }
     entry->key_next = bk->hash_entry;
     bk->hash_entry = L2C(h, entry);
     entry->value_next = bv->hash_entry;
     bv->hash_entry = L2C(h, entry);
-    TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, k_idx, bltv, v_idx);
+    entry_unlock(&el);
 
     /* Book keeping */
     atomic_inc(&h->nr_ent);
+    drained = hash_migrate(h);
 
     HASH_LOCK_RDUNLOCK(h);
 
+    if(drained > 0)
+        hash_resize_finish(h);
+
     return 1;
 }
 
 
 #undef __prim
 #undef __prim_t
-#undef __prim_tab
-#undef __prim_lock_tab
+#undef __prim_tab_id
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
 #undef __sec
 #undef __sec_t
-#undef __sec_tab
-#undef __sec_lock_tab
+#undef __sec_tab_id
 #undef __sec_hash
 #undef __sec_next
 
 #define __prim             key
 #define __prim_t         __k_t
-#define __prim_tab         key_tab
-#define __prim_lock_tab    key_lock_tab
+#define __prim_tab_id      KEY_TAB
 #define __prim_hash      __key_hash
 #define __prim_cmp       __key_cmp
 #define __prim_next        key_next
 #define __sec              value
 #define __sec_t          __v_t
-#define __sec_tab          value_tab
-#define __sec_lock_tab     value_lock_tab
+#define __sec_tab_id       VALUE_TAB
 #define __sec_hash       __value_hash
 #define __sec_next         value_next
 
 int __key_remove(struct __hash *h, __prim_t k, __sec_t *vp)
 {
     struct hash_entry *e, *es, **pek, **pev;
-    struct bucket *bk, *bv;
-    struct bucket_lock *bltk, *bltv;
-    uint32_t old_kidx, kidx, vidx, min_load, nr_ent;
+    struct bucket *b;
+    struct bucket_lock *blt;
+    struct entry_locks el;
+    uint32_t idx, min_load, nr_ent;
+    int old, drained;
     __prim_t ks;
     __sec_t vs;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
 
 again:
-    old_kidx = kidx = hash_to_idx(h, __prim_hash(k));
-    bk = C2L(h, &h->__prim_tab[kidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, bltk, kidx) != 0) return -ENOLCK;
-    pek = &(bk->hash_entry);
-    e = *pek;
-    while(e != NULL)
+    es = NULL;
+    for(old = !!h->old_tab_size; old >= 0 && es == NULL; old--)
     {
-        e = C2L(h, e);
-        if(__prim_cmp(k, e->__prim))
+        b = get_bucket(h, __prim_tab_id, old, __prim_hash(k), &idx, &blt);
+        if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0)
+        {
+            HASH_LOCK_RDUNLOCK(h);
+            return -ENOLCK;
+        }
+        e = b->hash_entry;
+        while(e != NULL)
         {
-            goto found;
+            e = C2L(h, e);
+            if(__prim_cmp(k, e->__prim))
+            {
+                /*
+                 * Make local copy of key and value.
+                 */
+                es = e;
+                ks = e->__prim;
+                vs = e->__sec;
+                break;
+            }
+            e = e->__prim_next;
         }
-        pek = &(e->__prim_next);
-        e = *pek;
+        BUCKET_LOCK_RDUNLOCK(h, blt, idx);
     }
 
-    BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    HASH_LOCK_RDUNLOCK(h);
-
-    return 0;
+    if(es == NULL)
+    {
+        HASH_LOCK_RDUNLOCK(h);
+        return 0;
+    }
 
-found:
-    /*
-     * Make local copy of key and value.
-     */
-    es = e;
-    ks = e->__prim;
-    vs = e->__sec;
-    kidx = hash_to_idx(h, __prim_hash(ks));
-    /* Being paranoid: check if kidx has not changed, so that we unlock the
-     * right bucket */
-    assert(old_kidx == kidx);
-    vidx = hash_to_idx(h, __sec_hash(vs));
-    bk   = C2L(h, &h->__prim_tab[kidx]);
-    bv   = C2L(h, &h->__sec_tab[vidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    bltv = C2L(h, h->__sec_lock_tab);
-    BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, kidx, bltv, vidx) != 0) return -ENOLCK;
-    pek = &(bk->hash_entry);
-    pev = &(bv->hash_entry);
+    /* Lock every bucket the entry may be in, old tables included; that
+     * also stops it from being moved out of them under our feet */
+    if(entry_lock(h, __prim_tab_id, __prim_hash(ks), __sec_hash(vs), 1,
+                  &el) != 0)
+    {
+        HASH_LOCK_RDUNLOCK(h);
+        return -ENOLCK;
+    }
 
     /* Find the entry in both tables */
-    e = *pek;
-    while(e != NULL)
+    pek = pev = NULL;
+    for(old = !!h->old_tab_size; old >= 0 && pek == NULL; old--)
     {
-        e = C2L(h, e);
-        if(e == es)
-        {
-            /* Being paranoid: make sure that the key and value are
-             * still the same. This is still not 100%, because, in
-             * principle, the entry could have got deleted, when we
-             * didn't hold the locks for a little while, and exactly
-             * the same entry reinserted. If the __k_t & __v_t are
-             * simple types than it probably doesn't matter, but if
-             * either is a pointer type, the actual structure might
-             * now be different. The chances that happens are very
-             * slim, but still, if that's a problem, the user needs to
-             * pay attention to the structure re-allocation */
-            if((memcmp(&(e->__prim), &ks, sizeof(__prim_t))) ||
-               (memcmp(&(e->__sec), &vs, sizeof(__sec_t))))
-                break;
-            goto found_again;
-        }
-        pek = &(e->__prim_next);
-        e = *pek;
+        b = get_bucket(h, __prim_tab_id, old, __prim_hash(ks), &idx, &blt);
+        pek = find_link(h, b, es, __prim_tab_id);
+    }
+    /* Being paranoid: make sure that the key and value are still the
+     * same. This is still not 100%, because, in principle, the entry
+     * could have got deleted, when we didn't hold the locks for a little
+     * while, and exactly the same entry reinserted. If the __k_t & __v_t
+     * are simple types than it probably doesn't matter, but if either is
+     * a pointer type, the actual structure might now be different. The
+     * chances that happens are very slim, but still, if that's a problem,
+     * the user needs to pay attention to the structure re-allocation */
+    if(pek == NULL ||
+       (memcmp(&(es->__prim), &ks, sizeof(__prim_t))) ||
+       (memcmp(&(es->__sec), &vs, sizeof(__sec_t))))
+    {
+        entry_unlock(&el);
+        /* Entry got removed in the meantime, try again */
+        goto again;
     }
 
-    TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, kidx, bltv, vidx);
-
-    /* Entry got removed in the meantime, try again */
-    goto again;
-
-found_again:
     /* We are now comitted to the removal */
-    e = *pev;
-    while(e != NULL)
+    for(old = !!h->old_tab_size; old >= 0 && pev == NULL; old--)
     {
-        e = C2L(h, e);
-        if(e == es)
-        {
-            /* Both pek and pev are pointing to the right place, remove */
-            *pek = e->__prim_next;
-            *pev = e->__sec_next;
+        b = get_bucket(h, __sec_tab_id, old, __sec_hash(vs), &idx, &blt);
+        pev = find_link(h, b, es, __sec_tab_id);
+    }
+    if(pev == NULL)
+    {
+        /* We should never get here! */
+        entry_unlock(&el);
+        HASH_LOCK_RDUNLOCK(h);
+        return -ENOLCK;
+    }
 
-            atomic_dec(&h->nr_ent);
-            nr_ent = h->nr_ent;
-            /* read min_load still under the hash lock! */
-            min_load = h->min_load;
+    /* Both pek and pev are pointing to the right place, remove */
+    *pek = es->__prim_next;
+    *pev = es->__sec_next;
 
-            TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, kidx, bltv, vidx);
-            HASH_LOCK_RDUNLOCK(h);
+    atomic_dec(&h->nr_ent);
+    nr_ent = h->nr_ent;
+    /* read min_load still under the hash lock! */
+    min_load = h->min_load;
 
-            if(nr_ent < min_load)
-                hash_resize(h);
-            if(vp != NULL)
-                *vp = e->__sec;
-            free_entry(h, e);
-            return 1;
-        }
-        pev = &(e->__sec_next);
-        e = *pev;
-    }
+    entry_unlock(&el);
+    drained = hash_migrate(h);
+    HASH_LOCK_RDUNLOCK(h);
 
-    /* We should never get here!, no need to unlock anything */
-    return -ENOLCK;
+    if(drained > 0)
+        hash_resize_finish(h);
+    else if(nr_ent < min_load)
+        hash_resize(h);
+    if(vp != NULL)
+        *vp = es->__sec;
+    free_entry(h, es);
+    return 1;
 }
 
 #undef __prim
 #undef __prim_t
-#undef __prim_tab
-#undef __prim_lock_tab
+#undef __prim_tab_id
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
 #undef __sec
 #undef __sec_t
-#undef __sec_tab
-#undef __sec_lock_tab
+#undef __sec_tab_id
 #undef __sec_hash
 #undef __sec_next
 
 #define __prim             value
 #define __prim_t         __v_t
-#define __prim_tab         value_tab
-#define __prim_lock_tab    value_lock_tab
+#define __prim_tab_id      VALUE_TAB
 #define __prim_hash      __value_hash
 #define __prim_cmp       __value_cmp
 #define __prim_next        value_next
 #define __sec              key
 #define __sec_t          __k_t
-#define __sec_tab          key_tab
-#define __sec_lock_tab     key_lock_tab
+#define __sec_tab_id       KEY_TAB
 #define __sec_hash       __key_hash
 #define __sec_next         key_next
 
 int __value_remove(struct __hash *h, __prim_t k, __sec_t *vp)
 {
     struct hash_entry *e, *es, **pek, **pev;
-    struct bucket *bk, *bv;
-    struct bucket_lock *bltk, *bltv;
-    uint32_t old_kidx, kidx, vidx, min_load, nr_ent;
+    struct bucket *b;
+    struct bucket_lock *blt;
+    struct entry_locks el;
+    uint32_t idx, min_load, nr_ent;
+    int old, drained;
     __prim_t ks;
     __sec_t vs;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
 
 again:
-    old_kidx = kidx = hash_to_idx(h, __prim_hash(k));
-    bk = C2L(h, &h->__prim_tab[kidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, bltk, kidx) != 0) return -ENOLCK;
-    pek = &(bk->hash_entry);
-    e = *pek;
-    while(e != NULL)
+    es = NULL;
+    for(old = !!h->old_tab_size; old >= 0 && es == NULL; old--)
     {
-        e = C2L(h, e);
-        if(__prim_cmp(k, e->__prim))
+        b = get_bucket(h, __prim_tab_id, old, __prim_hash(k), &idx, &blt);
+        if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0)
+        {
+            HASH_LOCK_RDUNLOCK(h);
+            return -ENOLCK;
+        }
+        e = b->hash_entry;
+        while(e != NULL)
         {
-            goto found;
+            e = C2L(h, e);
+            if(__prim_cmp(k, e->__prim))
+            {
+                /*
+                 * Make local copy of key and value.
+                 */
+                es = e;
+                ks = e->__prim;
+                vs = e->__sec;
+                break;
+            }
+            e = e->__prim_next;
         }
-        pek = &(e->__prim_next);
-        e = *pek;
+        BUCKET_LOCK_RDUNLOCK(h, blt, idx);
     }
 
-    BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    HASH_LOCK_RDUNLOCK(h);
-
-    return 0;
+    if(es == NULL)
+    {
+        HASH_LOCK_RDUNLOCK(h);
+        return 0;
+    }
 
-found:
-    /*
-     * Make local copy of key and value.
-     */
-    es = e;
-    ks = e->__prim;
-    vs = e->__sec;
-    kidx = hash_to_idx(h, __prim_hash(ks));
-    /* Being paranoid: check if kidx has not changed, so that we unlock the
-     * right bucket */
-    assert(old_kidx == kidx);
-    vidx = hash_to_idx(h, __sec_hash(vs));
-    bk   = C2L(h, &h->__prim_tab[kidx]);
-    bv   = C2L(h, &h->__sec_tab[vidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    bltv = C2L(h, h->__sec_lock_tab);
-    BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, kidx, bltv, vidx) != 0) return -ENOLCK;
-    pek = &(bk->hash_entry);
-    pev = &(bv->hash_entry);
+    /* Lock every bucket the entry may be in, old tables included; that
+     * also stops it from being moved out of them under our feet */
+    if(entry_lock(h, __prim_tab_id, __prim_hash(ks), __sec_hash(vs), 1,
+                  &el) != 0)
+    {
+        HASH_LOCK_RDUNLOCK(h);
+        return -ENOLCK;
+    }
 
     /* Find the entry in both tables */
-    e = *pek;
-    while(e != NULL)
+    pek = pev = NULL;
+    for(old = !!h->old_tab_size; old >= 0 && pek == NULL; old--)
     {
-        e = C2L(h, e);
-        if(e == es)
-        {
-            /* Being paranoid: make sure that the key and value are
-             * still the same. This is still not 100%, because, in
-             * principle, the entry could have got deleted, when we
-             * didn't hold the locks for a little while, and exactly
-             * the same entry reinserted. If the __k_t & __v_t are
-             * simple types than it probably doesn't matter, but if
-             * either is a pointer type, the actual structure might
-             * now be different. The chances that happens are very
-             * slim, but still, if that's a problem, the user needs to
-             * pay attention to the structure re-allocation */
-            if((memcmp(&(e->__prim), &ks, sizeof(__prim_t))) ||
-               (memcmp(&(e->__sec), &vs, sizeof(__sec_t))))
-                break;
-            goto found_again;
-        }
-        pek = &(e->__prim_next);
-        e = *pek;
+        b = get_bucket(h, __prim_tab_id, old, __prim_hash(ks), &idx, &blt);
+        pek = find_link(h, b, es, __prim_tab_id);
+    }
+    /* Being paranoid: make sure that the key and value are still the
+     * same. This is still not 100%, because, in principle, the entry
+     * could have got deleted, when we didn't hold the locks for a little
+     * while, and exactly the same entry reinserted. If the __k_t & __v_t
+     * are simple types than it probably doesn't matter, but if either is
+     * a pointer type, the actual structure might now be different. The
+     * chances that happens are very slim, but still, if that's a problem,
+     * the user needs to pay attention to the structure re-allocation */
+    if(pek == NULL ||
+       (memcmp(&(es->__prim), &ks, sizeof(__prim_t))) ||
+       (memcmp(&(es->__sec), &vs, sizeof(__sec_t))))
+    {
+        entry_unlock(&el);
+        /* Entry got removed in the meantime, try again */
+        goto again;
     }
 
-    TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, kidx, bltv, vidx);
-
-    /* Entry got removed in the meantime, try again */
-    goto again;
-
-found_again:
     /* We are now comitted to the removal */
-    e = *pev;
-    while(e != NULL)
+    for(old = !!h->old_tab_size; old >= 0 && pev == NULL; old--)
     {
-        e = C2L(h, e);
-        if(e == es)
-        {
-            /* Both pek and pev are pointing to the right place, remove */
-            *pek = e->__prim_next;
-            *pev = e->__sec_next;
+        b = get_bucket(h, __sec_tab_id, old, __sec_hash(vs), &idx, &blt);
+        pev = find_link(h, b, es, __sec_tab_id);
+    }
+    if(pev == NULL)
+    {
+        /* We should never get here! */
+        entry_unlock(&el);
+        HASH_LOCK_RDUNLOCK(h);
+        return -ENOLCK;
+    }
 
-            atomic_dec(&h->nr_ent);
-            nr_ent = h->nr_ent;
-            /* read min_load still under the hash lock! */
-            min_load = h->min_load;
+    /* Both pek and pev are pointing to the right place, remove */
+    *pek = es->__prim_next;
+    *pev = es->__sec_next;
 
-            TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, kidx, bltv, vidx);
-            HASH_LOCK_RDUNLOCK(h);
+    atomic_dec(&h->nr_ent);
+    nr_ent = h->nr_ent;
+    /* read min_load still under the hash lock! */
+    min_load = h->min_load;
 
-            if(nr_ent < min_load)
-                hash_resize(h);
-            if(vp != NULL)
-                *vp = e->__sec;
-            free_entry(h, e);
-            return 1;
-        }
-        pev = &(e->__sec_next);
-        e = *pev;
-    }
+    entry_unlock(&el);
+    drained = hash_migrate(h);
+    HASH_LOCK_RDUNLOCK(h);
 
-    /* We should never get here!, no need to unlock anything */
-    return -ENOLCK;
+    if(drained > 0)
+        hash_resize_finish(h);
+    else if(nr_ent < min_load)
+        hash_resize(h);
+    if(vp != NULL)
+        *vp = es->__sec;
+    free_entry(h, es);
+    return 1;
 }
 
 
@@ -1189,27 +1410,41 @@ int __hash_destroy(struct __hash *h,
 {
     struct hash_entry *e, *n;
     struct bucket *b;
-    int i;
+    struct bucket_lock *blt;
+    uint32_t i, idx, size;
+    int old;
 
     if(HASH_LOCK_WRLOCK(h) != 0) return -ENOLCK;
 
     /* No need to lock individual buckets, with hash write lock  */
-    for(i=0; i < h->tab_size; i++)
+    for(old = !!h->old_tab_size; old >= 0; old--)
     {
-        b = C2L(h, &h->key_tab[i]);
-        e = b->hash_entry;
-        while(e != NULL)
+        size = (old ? h->old_tab_size : h->tab_size);
+        for(i=0; i < size; i++)
         {
-            e = C2L(h, e);
-            n = e->key_next;
-            if(entry_consumer)
-                entry_consumer(e->key, e->value, d);
-            free_entry(h, e);
-            e = n;
+            b = get_bucket(h, KEY_TAB, old, i, &idx, &blt);
+            e = b->hash_entry;
+            while(e != NULL)
+            {
+                e = C2L(h, e);
+                n = e->key_next;
+                if(entry_consumer)
+                    entry_consumer(e->key, e->value, d);
+                free_entry(h, e);
+                e = n;
+            }
         }
     }
     free_buckets(h, C2L(h, h->key_tab), C2L(h, h->key_lock_tab));
     free_buckets(h, C2L(h, h->value_tab), C2L(h, h->value_lock_tab));
+    if(h->old_tab_size)
+    {
+        free_buckets(h, C2L(h, h->old_key_tab), C2L(h, h->old_key_lock_tab));
+        free_buckets(h, C2L(h, h->old_value_tab),
+                        C2L(h, h->old_value_lock_tab));
+        h->old_tab_size = 0;
+    }
+    free_next_tabs(h);
 
     HASH_LOCK_WRUNLOCK(h);
     h->lock_alive = 0;
@@ -1217,18 +1452,24 @@ int __hash_destroy(struct __hash *h,
     return 0;
 }
 
+/* Start a resize: switch to new, empty tables and leave the entries in
+ * the old ones to be moved over by hash_migrate(). Only the switch itself
+ * is done under the hash write lock; readers are never held up for
+ * longer than that. */
 static void hash_resize(struct __hash *h)
 {
-    int new_size_idx, i, lock_ret;
-    uint32_t size, old_size, kidx, vidx;
-    struct bucket *t1, *t2, *b;
+    int new_size_idx;
+    uint32_t size;
+    struct bucket *t1, *t2;
     struct bucket_lock *l1, *l2;
-    struct hash_entry *e, *n;
 
-    /* We may fail to allocate the lock, if the resize is triggered while
-       we are iterating (under read lock) */
-    lock_ret = HASH_LOCK_TRYWRLOCK(h);
-    if(lock_ret != 0) return;
+    /* One resize at a time. This also keeps the table size and load
+     * limits from changing until we switch tables */
+    if(RESIZE_LOCK_TRYLOCK(h) != 0) return;
+
+    /* The previous resize must have been drained */
+    if(h->old_tab_size)
+        goto out;
 
     new_size_idx = h->size_idx;
     /* Work out the new size */
@@ -1239,69 +1480,107 @@ static void hash_resize(struct __hash *h)
     if((new_size_idx == h->size_idx) ||
        (new_size_idx >= hash_sizes_len) ||
        (new_size_idx < 0))
-    {
-        HASH_LOCK_WRUNLOCK(h);
-        return;
-    }
+        goto out;
 
     size = hash_sizes[new_size_idx];
 
-    /* Allocate the new sizes */
+    /* Allocate the new tables without holding the hash lock. An earlier
+     * attempt may have left them ready for us. */
     t1 = t2 = NULL;
     l1 = l2 = NULL;
-    alloc_tab(h, size, &t1, &l1);
-    if(!t1 || !l1) goto alloc_fail;
-    alloc_tab(h, size, &t2, &l2);
-    if(!t2 || !l2) goto alloc_fail;
-
-    old_size = h->tab_size;
-    h->tab_size = size;
-    h->size_idx = new_size_idx;
-    h->max_load = (uint32_t)ceilf(hash_max_load_fact * size);
-    h->min_load = (uint32_t)ceilf(hash_min_load_fact * size);
-
-    /* Move the entries */
-    for(i=0; i < old_size; i++)
+    if(h->next_tab_size != size)
     {
-        b = C2L(h, &h->key_tab[i]);
-        e = b->hash_entry;
-        while(e != NULL)
-        {
-            e = C2L(h, e);
-            n = e->key_next;
-            kidx =hash_to_idx(h, __key_hash(e->key));
-            vidx =hash_to_idx(h, __value_hash(e->value));
-            /* Move to the correct bucket */
-            e->key_next = t1[kidx].hash_entry;
-            t1[kidx].hash_entry = L2C(h, e);
-            e->value_next = t2[vidx].hash_entry;
-            t2[vidx].hash_entry = L2C(h, e);
-            e = n;
-        }
+        free_next_tabs(h);
+        alloc_tab(h, size, &t1, &l1);
+        if(!t1 || !l1) goto alloc_fail;
+        alloc_tab(h, size, &t2, &l2);
+        if(!t2 || !l2) goto alloc_fail;
+        h->next_key_tab        = L2C(h, t1);
+        h->next_key_lock_tab   = L2C(h, l1);
+        h->next_value_tab      = L2C(h, t2);
+        h->next_value_lock_tab = L2C(h, l2);
+        h->next_tab_size       = size;
     }
-    free_buckets(h, C2L(h, h->key_tab), C2L(h, h->key_lock_tab));
-    free_buckets(h, C2L(h, h->value_tab), C2L(h, h->value_lock_tab));
-    h->key_tab         = L2C(h, t1);
-    h->key_lock_tab    = L2C(h, l1);
-    h->value_tab       = L2C(h, t2);
-    h->value_lock_tab  = L2C(h, l2);
+
+    /* We may fail to get the lock, if the resize is triggered while
+       we are iterating (under read lock), or there are readers about.
+       Keep the new tables for a later insert or remove to switch to. */
+    if(HASH_LOCK_TRYWRLOCK(h) != 0)
+        goto out;
+
+    h->old_key_tab         = h->key_tab;
+    h->old_key_lock_tab    = h->key_lock_tab;
+    h->old_value_tab       = h->value_tab;
+    h->old_value_lock_tab  = h->value_lock_tab;
+    h->old_tab_size        = h->tab_size;
+    h->migrate_lock        = 0;
+
+    h->key_tab             = h->next_key_tab;
+    h->key_lock_tab        = h->next_key_lock_tab;
+    h->value_tab           = h->next_value_tab;
+    h->value_lock_tab      = h->next_value_lock_tab;
+    h->tab_size            = size;
+    h->size_idx            = new_size_idx;
+    h->max_load            = (uint32_t)ceilf(hash_max_load_fact * size);
+    h->min_load            = (uint32_t)ceilf(hash_min_load_fact * size);
+
+    h->next_key_tab        = NULL;
+    h->next_key_lock_tab   = NULL;
+    h->next_value_tab      = NULL;
+    h->next_value_lock_tab = NULL;
+    h->next_tab_size       = 0;
 
     HASH_LOCK_WRUNLOCK(h);
 
+out:
+    RESIZE_LOCK_UNLOCK(h);
     return;
 
 alloc_fail:
-    /* If we failed to resize, adjust max/min load. This will stop us from
-     * retrying resize too frequently */ 
-    if(new_size_idx > h->size_idx)
-        h->max_load = (h->max_load + 2 * h->tab_size) / 2 + 1;
-    else 
-    if (new_size_idx < h->size_idx)
-        h->min_load = h->min_load / 2;
-    HASH_LOCK_WRUNLOCK(h);
     if(t1 || l1) free_buckets(h, t1, l1);
     if(t2 || l2) free_buckets(h, t2, l2);
-    return;
+    /* If we failed to resize, adjust max/min load. This will stop us from
+     * retrying resize too frequently */
+    if(HASH_LOCK_TRYWRLOCK(h) == 0)
+    {
+        if(new_size_idx > h->size_idx)
+            h->max_load = (h->max_load + 2 * h->tab_size) / 2 + 1;
+        else
+        if (new_size_idx < h->size_idx)
+            h->min_load = h->min_load / 2;
+        HASH_LOCK_WRUNLOCK(h);
+    }
+    goto out;
+}
+
+/* Free the old tables once hash_migrate() has drained them */
+static void hash_resize_finish(struct __hash *h)
+{
+    struct bucket *kt, *vt;
+    struct bucket_lock *klt, *vlt;
+
+    /* Nobody can be looking at the old tables while we hold the write
+     * lock. If we can't get it, the next insert or remove will retry. */
+    if(HASH_LOCK_TRYWRLOCK(h) != 0) return;
+    if(!h->old_tab_size ||
+       h->migrate_lock < nr_locks(h->old_tab_size))
+    {
+        HASH_LOCK_WRUNLOCK(h);
+        return;
+    }
+    kt  = C2L(h, h->old_key_tab);
+    klt = C2L(h, h->old_key_lock_tab);
+    vt  = C2L(h, h->old_value_tab);
+    vlt = C2L(h, h->old_value_lock_tab);
+    h->old_key_tab        = NULL;
+    h->old_key_lock_tab   = NULL;
+    h->old_value_tab      = NULL;
+    h->old_value_lock_tab = NULL;
+    h->old_tab_size       = 0;
+    HASH_LOCK_WRUNLOCK(h);
+
+    free_buckets(h, kt, klt);
+    free_buckets(h, vt, vlt);
 }
 
 int __hash_iterator(struct __hash *h,
@@ -1311,10 +1590,20 @@ int __hash_iterator(struct __hash *h,
     struct hash_entry *e, *n;
     struct bucket *b;
     struct bucket_lock *blt;
-    int i, brk_early;
+    int i, brk_early, ret = 0;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
 
+    /* Drain any resize in progress first, so that every entry is seen
+     * exactly once. No new resize can start while we hold the read lock. */
+    while(h->old_tab_size && (ret = hash_migrate(h)) == 0)
+        ;
+    if(ret < 0)
+    {
+        HASH_LOCK_RDUNLOCK(h);
+        return -ENOLCK;
+    }
+
     for(i=0; i < h->tab_size; i++)
     {
         b = C2L(h, &h->key_tab[i]);
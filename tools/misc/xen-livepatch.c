@@ -0,0 +1,148 @@
+/*
+ * xen-livepatch: load, apply and revert live patches of the hypervisor.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include <xenctrl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static xc_interface *xch;
+
+static const char *state_name(uint32_t state)
+{
+    switch ( state )
+    {
+    case XEN_LIVEPATCH_STATE_CHECKED:
+        return "checked";
+    case XEN_LIVEPATCH_STATE_APPLIED:
+        return "applied";
+    default:
+        return "unknown";
+    }
+}
+
+static void do_upload(const char *name, const char *file)
+{
+    struct stat st;
+    void *payload;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if ( fd < 0 )
+        err(1, "opening %s", file);
+    if ( fstat(fd, &st) )
+        err(1, "reading %s", file);
+
+    payload = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ( payload == MAP_FAILED )
+        err(1, "mapping %s", file);
+
+    if ( xc_livepatch_upload(xch, name, payload, st.st_size) )
+        err(1, "uploading %s", name);
+
+    munmap(payload, st.st_size);
+    close(fd);
+}
+
+static void do_action(const char *name, uint32_t action)
+{
+    if ( xc_livepatch_action(xch, name, action) )
+        err(1, "%s", name);
+}
+
+static void do_list(void)
+{
+    xc_livepatch_status_t status[16];
+    unsigned int idx = 0, total;
+    int i, nr;
+
+    printf("%-*s %-8s %s\n", XEN_LIVEPATCH_NAME_SIZE / 2, "Name", "State",
+           "Result");
+
+    do {
+        nr = xc_livepatch_list(xch, idx, sizeof(status) / sizeof(*status),
+                               status, &total);
+        if ( nr < 0 )
+            err(1, "listing payloads");
+
+        for ( i = 0; i < nr; i++ )
+            printf("%-*s %-8s %s\n", XEN_LIVEPATCH_NAME_SIZE / 2,
+                   status[i].name, state_name(status[i].state),
+                   status[i].rc ? strerror(-status[i].rc) : "ok");
+
+        idx += nr;
+    } while ( nr && idx < total );
+}
+
+static void usage(int exit_code)
+{
+    FILE *out = exit_code ? stderr : stdout;
+
+    fprintf(out, "Usage: xen-livepatch <command> [args]\n"
+            "Commands:\n"
+            "  upload <name> <file>  load a payload, and check it\n"
+            "  apply <name>          switch to the payload's functions\n"
+            "  revert <name>         switch back to the original functions\n"
+            "  unload <name>         discard a payload that isn't applied\n"
+            "  list                  list the loaded payloads\n");
+    exit(exit_code);
+}
+
+int main(int argc, char **argv)
+{
+    if ( argc < 2 )
+        usage(1);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+        err(1, "opening interface");
+
+    if ( !strcmp(argv[1], "upload") && argc == 4 )
+        do_upload(argv[2], argv[3]);
+    else if ( !strcmp(argv[1], "apply") && argc == 3 )
+        do_action(argv[2], XEN_LIVEPATCH_ACTION_apply);
+    else if ( !strcmp(argv[1], "revert") && argc == 3 )
+        do_action(argv[2], XEN_LIVEPATCH_ACTION_revert);
+    else if ( !strcmp(argv[1], "unload") && argc == 3 )
+        do_action(argv[2], XEN_LIVEPATCH_ACTION_unload);
+    else if ( !strcmp(argv[1], "list") && argc == 2 )
+        do_list();
+    else if ( !strcmp(argv[1], "help") )
+        usage(0);
+    else
+        usage(1);
+
+    xc_interface_close(xch);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
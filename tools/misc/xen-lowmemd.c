@@ -1,6 +1,23 @@
 /*
- * xen-lowmemd: demo VIRQ_ENOMEM
+ * xen-lowmemd: keep host memory from running out by moving it between
+ * guests through their balloon targets.
  * Andres Lagar-Cavilla (GridCentric Inc.)
+ *
+ * Every few seconds, and straight away when Xen raises VIRQ_ENOMEM, the
+ * host is sampled: free memory, freeable tmem and outstanding claims,
+ * and for every domain its allocation, balloon target and
+ * populate-on-demand state.  Memory that is claimed, or that guests are
+ * still ballooning up towards, is counted as gone already, so the daemon
+ * acts before the host is actually exhausted.
+ *
+ * Below the low watermark, the targets of donors (guests that have
+ * settled on their target) are lowered towards their floor.  Above the
+ * high watermark, guests under pressure (failing to balloon down, or
+ * with more PoD entries than cache to back them) get some of it back,
+ * up to their static maximum.  Memory handed to a guest is claimed on
+ * its behalf first, so that it can't be taken by anyone else meanwhile;
+ * conversely, the reserve kept above the watermarks is never handed out,
+ * so the claim made when building a new domain can always be met.
  */
 
 #include <stdio.h>
@@ -8,6 +25,9 @@
 #include <xenstore.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
 
 static evtchn_port_t virq_port      = -1;
 static xc_evtchn *xce_handle        = NULL;
@@ -26,76 +46,420 @@ void cleanup(void)
         xs_daemon_close(xs_handle);
 }
 
+#define MB_PG(mb)       ((unsigned long long)(mb) << (20 - XC_PAGE_SHIFT))
+#define PG_KB(pg)       ((unsigned long long)(pg) << (XC_PAGE_SHIFT - 10))
+#define KB_PG(kb)       ((unsigned long long)(kb) >> (XC_PAGE_SHIFT - 10))
+
 /* Never shrink dom0 below 1 GiB */
-#define DOM0_FLOOR  (1 << 30)
-#define DOM0_FLOOR_PG   ((DOM0_FLOOR) >> 12)
+#define DOM0_FLOOR_PG   MB_PG(1024)
+
+/* Domains whose allocation is this close to target have settled on it */
+#define SETTLED_PG      MB_PG(2)
 
-/* Act if free memory is less than 92 MiB */
-#define THRESHOLD   (92 << 20)
-#define THRESHOLD_PG    ((THRESHOLD) >> 12)
+/* Passes a claim made for a guest is left to be used up */
+#define CLAIM_PASSES    4
+
+#define MAX_DOMS        1024
 
 #define BUFSZ 512
-void handle_low_mem(void)
+
+static struct {
+    unsigned int interval;      /* seconds between passes */
+    unsigned long low_mb;       /* act below this much available memory */
+    unsigned long high_mb;      /* reclaim up to / hand out above this */
+    unsigned long reserve_mb;   /* kept for building new domains */
+    unsigned int min_pct;       /* floor, as percentage of static-max */
+    unsigned int step_pct;      /* most a target moves in one pass */
+    int dry_run, verbose;
+} opts = {
+    .interval   = 5,
+    .low_mb     = 92,
+    .high_mb    = 256,
+    .reserve_mb = 0,
+    .min_pct    = 25,
+    .step_pct   = 10,
+};
+
+#define DPRINTF(fmt, args...) \
+    do { if (opts.verbose) printf(fmt, ## args); } while (0)
+
+struct dom {
+    uint32_t domid;
+    int hvm;
+    unsigned long long tot, target, max, floor;     /* in pages */
+    unsigned long long outstanding;
+    unsigned long long need;    /* pages it is short of */
+    int donor;
+};
+
+static struct dom doms[MAX_DOMS];
+static unsigned int nr_doms;
+
+/* Claims this daemon has staked for guests, and how long ago */
+static struct {
+    uint32_t domid;
+    unsigned int age;
+} claims[MAX_DOMS];
+static unsigned int nr_claims;
+
+static int xs_read_kb(uint32_t domid, const char *node,
+                      unsigned long long *kb)
 {
-    xc_dominfo_t  dom0_info;
-    xc_physinfo_t info;
-    unsigned long long free_pages, dom0_pages, diff, dom0_target;
-    char data[BUFSZ], error[BUFSZ];
+    char path[BUFSZ], *val, *end;
+    unsigned int len;
 
-    if (xc_physinfo(xch, &info) < 0)
+    snprintf(path, BUFSZ, "/local/domain/%u/memory/%s", domid, node);
+    val = xs_read(xs_handle, XBT_NULL, path, &len);
+    if (!val)
+        return -1;
+
+    *kb = strtoull(val, &end, 10);
+    if (*end != '\0')
     {
-        perror("Getting physinfo failed");
-        return;
+        free(val);
+        return -1;
+    }
+    free(val);
+    return 0;
+}
+
+static int set_target(struct dom *d, unsigned long long target)
+{
+    char path[BUFSZ], data[BUFSZ];
+
+    printf("dom%u: target %llu -> %llu KiB (has %llu KiB)\n", d->domid,
+           PG_KB(d->target), PG_KB(target), PG_KB(d->tot));
+    if (opts.dry_run)
+        return 0;
+
+    /* As libxl_set_memory_target(): the PoD target is the balloon target */
+    if (d->hvm &&
+        xc_domain_set_pod_target(xch, d->domid, target, NULL, NULL, NULL))
+    {
+        snprintf(data, BUFSZ, "dom%u: failed to set PoD target", d->domid);
+        perror(data);
+        return -1;
     }
 
-    free_pages = (unsigned long long) info.free_pages;
-    printf("Available free pages: 0x%llx:%llux\n",
-            free_pages, free_pages);
+    snprintf(path, BUFSZ, "/local/domain/%u/memory/target", d->domid);
+    snprintf(data, BUFSZ, "%llu", PG_KB(target));
+    if (!xs_write(xs_handle, XBT_NULL, path, data, strlen(data)))
+    {
+        snprintf(path, BUFSZ, "Failed to write target %s to xenstore", data);
+        perror(path);
+        return -1;
+    }
 
-    /* Don't do anything if we have more than the threshold free */
-    if ( free_pages >= THRESHOLD_PG )
-        return;
-    diff = THRESHOLD_PG - free_pages; 
+    d->target = target;
+    return 0;
+}
 
-    if (xc_domain_getinfo(xch, 0, 1, &dom0_info) < 1)
+/* Give back claims that guests did not use up in time. */
+static void age_claims(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < nr_claims; )
     {
-        perror("Failed to get dom0 info");
-        return;
+        struct dom *d = NULL;
+
+        for (j = 0; j < nr_doms; j++)
+            if (doms[j].domid == claims[i].domid)
+                d = &doms[j];
+
+        if (d && d->outstanding && ++claims[i].age < CLAIM_PASSES)
+        {
+            i++;
+            continue;
+        }
+
+        if (d && d->outstanding && !opts.dry_run)
+        {
+            DPRINTF("dom%u: dropping %llu unused claimed pages\n",
+                    d->domid, d->outstanding);
+            xc_domain_claim_pages(xch, d->domid, 0);
+        }
+        claims[i] = claims[--nr_claims];
+    }
+}
+
+static int has_claim(uint32_t domid)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_claims; i++)
+        if (claims[i].domid == domid)
+            return 1;
+    return 0;
+}
+
+/*
+ * Take a census of the domains.  Returns the pages they are still owed:
+ * the part of their targets they have yet to allocate.
+ */
+static unsigned long long scan_domains(void)
+{
+    static xc_domaininfo_t info[MAX_DOMS];
+    unsigned long long owed = 0, static_max;
+    int i, n;
+
+    nr_doms = 0;
+    n = xc_domain_getinfolist(xch, 0, MAX_DOMS, info);
+    if (n < 0)
+    {
+        perror("Failed to list domains");
+        return 0;
     }
 
-    dom0_pages = (unsigned long long) dom0_info.nr_pages;
-    printf("Dom0 pages: 0x%llx:%llu\n", dom0_pages, dom0_pages);
-    dom0_target = dom0_pages - diff;
-    if (dom0_target <= DOM0_FLOOR_PG)
+    for (i = 0; i < n; i++)
+    {
+        struct dom *d = &doms[nr_doms];
+        unsigned long long target_kb;
+        uint64_t pod_tot, pod_cache = 0, pod_entries = 0;
+
+        if (info[i].flags & (XEN_DOMINF_dying | XEN_DOMINF_shutdown))
+            continue;
+
+        memset(d, 0, sizeof(*d));
+        d->domid = info[i].domain;
+        d->hvm = !!(info[i].flags & XEN_DOMINF_hvm_guest);
+        d->tot = info[i].tot_pages;
+        d->outstanding = info[i].outstanding_pages;
+
+        /* Only guests with a balloon target can be rebalanced. */
+        if (xs_read_kb(d->domid, "target", &target_kb))
+            continue;
+        d->target = KB_PG(target_kb);
+        if (xs_read_kb(d->domid, "static-max", &static_max))
+            d->max = d->target;
+        else
+            d->max = KB_PG(static_max);
+
+        d->floor = d->max * opts.min_pct / 100;
+        if (d->domid == 0 && d->floor < DOM0_FLOOR_PG)
+            d->floor = DOM0_FLOOR_PG;
+
+        if (d->hvm)
+            xc_domain_get_pod_target(xch, d->domid, &pod_tot,
+                                     &pod_cache, &pod_entries);
+
+        if (d->tot + SETTLED_PG < d->target)
+        {
+            /* Still ballooning up: the host owes it what isn't claimed. */
+            if (d->target > d->tot + d->outstanding)
+                owed += d->target - d->tot - d->outstanding;
+        }
+        else if (d->tot > d->target + SETTLED_PG)
+            /* Can't get down to target: it needs what it has. */
+            d->need = d->tot - d->target;
+        else
+            d->donor = d->target > d->floor;
+
+        /* Entries without cache to back them are PoD misses waiting. */
+        if (pod_entries > pod_cache)
+        {
+            d->need += pod_entries - pod_cache;
+            d->donor = 0;
+        }
+
+        nr_doms++;
+    }
+
+    return owed;
+}
+
+/* Lower donor targets, in proportion to what they could give, by want. */
+static void reclaim(unsigned long long want)
+{
+    unsigned long long spare = 0, take;
+    unsigned int i;
+
+    for (i = 0; i < nr_doms; i++)
+        if (doms[i].donor)
+            spare += doms[i].target - doms[i].floor;
+    if (!spare)
+    {
+        printf("Short of %llu KiB, and no guest can give any\n",
+               PG_KB(want));
         return;
+    }
+
+    for (i = 0; i < nr_doms; i++)
+    {
+        struct dom *d = &doms[i];
+
+        if (!d->donor)
+            continue;
+
+        take = want >= spare ? d->target - d->floor :
+            (d->target - d->floor) * want / spare + 1;
+        if (take > d->target * opts.step_pct / 100)
+            take = d->target * opts.step_pct / 100;
+        if (take > d->target - d->floor)
+            take = d->target - d->floor;
+        if (take)
+            set_target(d, d->target - take);
+    }
+}
 
-    printf("Shooting for dom0 target 0x%llx:%llu\n", 
-            dom0_target, dom0_target);
+/* Hand up to spare pages to guests under pressure, most needy first. */
+static void distribute(unsigned long long spare)
+{
+    unsigned int i;
 
-    snprintf(data, BUFSZ, "%llu", dom0_target);
-    if (!xs_write(xs_handle, XBT_NULL, 
-            "/local/domain/0/memory/target", data, strlen(data)))
+    while (spare)
     {
-        snprintf(error, BUFSZ,"Failed to write target %s to xenstore", data);
-        perror(error);
+        struct dom *d = NULL;
+        unsigned long long give;
+
+        for (i = 0; i < nr_doms; i++)
+            if (doms[i].need && doms[i].target < doms[i].max &&
+                !has_claim(doms[i].domid) &&
+                (!d || doms[i].need > d->need))
+                d = &doms[i];
+        if (!d)
+            break;
+
+        give = d->need;
+        if (give > d->max - d->target)
+            give = d->max - d->target;
+        if (give > d->target * opts.step_pct / 100 + 1)
+            give = d->target * opts.step_pct / 100 + 1;
+        if (give > spare)
+            give = spare;
+        d->need = 0;
+
+        /*
+         * Stake a claim first, for whatever is beyond the current
+         * allocation, so the memory is still there when the guest
+         * balloons up.
+         */
+        if (d->target + give > d->tot && !opts.dry_run)
+        {
+            if (xc_domain_claim_pages(xch, d->domid, d->target + give))
+            {
+                DPRINTF("dom%u: claim for %llu pages failed (%d)\n",
+                        d->domid, d->target + give, errno);
+                continue;
+            }
+            claims[nr_claims].domid = d->domid;
+            claims[nr_claims++].age = 0;
+        }
+
+        if (set_target(d, d->target + give))
+        {
+            if (has_claim(d->domid))
+                xc_domain_claim_pages(xch, d->domid, 0);
+            continue;
+        }
+        spare -= give;
     }
 }
 
+void rebalance(void)
+{
+    xc_physinfo_t info;
+    long long avail;
+    unsigned long long owed;
+    int freeable_mb;
+
+    if (xc_physinfo(xch, &info) < 0)
+    {
+        perror("Getting physinfo failed");
+        return;
+    }
+
+    /* Ephemeral tmem pages are given up whenever the heap needs them. */
+    freeable_mb = xc_tmem_control(xch, -1, TMEMC_QUERY_FREEABLE_MB,
+                                  -1, 0, 0, 0, NULL);
+    if (freeable_mb < 0)
+        freeable_mb = 0;
+
+    owed = scan_domains();
+    age_claims();
+
+    avail = (long long)info.free_pages + MB_PG(freeable_mb) -
+        info.outstanding_pages - owed - MB_PG(opts.reserve_mb);
+
+    DPRINTF("free %llu, tmem freeable %llu, claimed %llu, owed %llu: "
+            "available %lld KiB\n", PG_KB(info.free_pages),
+            PG_KB(MB_PG(freeable_mb)), PG_KB(info.outstanding_pages),
+            PG_KB(owed), avail * 4);
+
+    if (avail < (long long)MB_PG(opts.low_mb))
+        reclaim(MB_PG(opts.high_mb) - avail);
+    else if (avail > (long long)MB_PG(opts.high_mb))
+        distribute(avail - MB_PG(opts.high_mb));
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+           "  -i, --interval=SECS   seconds between passes (%u)\n"
+           "  -l, --low=MB          reclaim below this much free (%lu)\n"
+           "  -H, --high=MB         reclaim up to, give away above (%lu)\n"
+           "  -r, --reserve=MB      keep for new domains (%lu)\n"
+           "  -m, --min=PCT         never go below PCT%% of static-max (%u)\n"
+           "  -s, --step=PCT        move targets by at most PCT%% a pass (%u)\n"
+           "  -n, --dry-run         only report what would be done\n"
+           "  -v, --verbose\n",
+           prog, opts.interval, opts.low_mb, opts.high_mb, opts.reserve_mb,
+           opts.min_pct, opts.step_pct);
+}
+
 int main(int argc, char *argv[])
 {
-    int rc;
+    static const struct option lopts[] = {
+        { "interval", 1, NULL, 'i' },
+        { "low",      1, NULL, 'l' },
+        { "high",     1, NULL, 'H' },
+        { "reserve",  1, NULL, 'r' },
+        { "min",      1, NULL, 'm' },
+        { "step",     1, NULL, 's' },
+        { "dry-run",  0, NULL, 'n' },
+        { "verbose",  0, NULL, 'v' },
+        { "help",     0, NULL, 'h' },
+        { NULL,       0, NULL, 0 }
+    };
+    struct pollfd pfd;
+    int rc, ch;
+
+    while ((ch = getopt_long(argc, argv, "i:l:H:r:m:s:nvh", lopts, NULL)) != -1)
+    {
+        switch (ch)
+        {
+        case 'i': opts.interval = strtoul(optarg, NULL, 0); break;
+        case 'l': opts.low_mb = strtoul(optarg, NULL, 0); break;
+        case 'H': opts.high_mb = strtoul(optarg, NULL, 0); break;
+        case 'r': opts.reserve_mb = strtoul(optarg, NULL, 0); break;
+        case 'm': opts.min_pct = strtoul(optarg, NULL, 0); break;
+        case 's': opts.step_pct = strtoul(optarg, NULL, 0); break;
+        case 'n': opts.dry_run = 1; break;
+        case 'v': opts.verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!opts.interval || opts.high_mb < opts.low_mb ||
+        opts.min_pct > 100 || !opts.step_pct || opts.step_pct > 100)
+    {
+        usage(argv[0]);
+        return 1;
+    }
 
     atexit(cleanup);
 
-	xch = xc_interface_open(NULL, NULL, 0);
-	if (xch == NULL)
+    xch = xc_interface_open(NULL, NULL, 0);
+    if (xch == NULL)
     {
         perror("Failed to open xc interface");
         return 1;
     }
 
-	xce_handle = xc_evtchn_open(NULL, 0);
-	if (xce_handle == NULL)
+    xce_handle = xc_evtchn_open(NULL, 0);
+    if (xce_handle == NULL)
     {
         perror("Failed to open evtchn device");
         return 2;
@@ -108,40 +472,55 @@ int main(int argc, char *argv[])
         return 3;
     }
 
-	if ((rc = xc_evtchn_bind_virq(xce_handle, VIRQ_ENOMEM)) == -1)
+    if ((rc = xc_evtchn_bind_virq(xce_handle, VIRQ_ENOMEM)) == -1)
     {
         perror("Failed to bind to domain exception virq port");
         return 4;
     }
 
     virq_port = rc;
-    
+
+    pfd.fd = xc_evtchn_fd(xce_handle);
+    pfd.events = POLLIN;
+
     while(1)
     {
         evtchn_port_t port;
 
-        if ((port = xc_evtchn_pending(xce_handle)) == -1)
+        rc = poll(&pfd, 1, opts.interval * 1000);
+        if (rc < 0 && errno != EINTR)
         {
-            perror("Failed to listen for pending event channel");
+            perror("Failed to poll event channel");
             return 5;
         }
 
-        if (port != virq_port)
+        if (rc > 0)
         {
-            char data[BUFSZ];
-            snprintf(data, BUFSZ, "Wrong port, got %d expected %d", port, virq_port);
-            perror(data);
-            return 6;
-        }
+            if ((port = xc_evtchn_pending(xce_handle)) == -1)
+            {
+                perror("Failed to listen for pending event channel");
+                return 5;
+            }
 
-        if (xc_evtchn_unmask(xce_handle, port) == -1)
-        {
-            perror("Failed to unmask port");
-            return 7;
+            if (port != virq_port)
+            {
+                char data[BUFSZ];
+                snprintf(data, BUFSZ, "Wrong port, got %d expected %d", port, virq_port);
+                perror(data);
+                return 6;
+            }
+
+            if (xc_evtchn_unmask(xce_handle, port) == -1)
+            {
+                perror("Failed to unmask port");
+                return 7;
+            }
+
+            printf("Got a virq kick, time to get work\n");
         }
 
-        printf("Got a virq kick, time to get work\n");
-        handle_low_mem();
+        rebalance();
+        fflush(stdout);
     }
 
     return 0;
@@ -17,21 +17,116 @@
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+
+static void usage(const char *prog)
+{
+    printf("%s: [-r | -s RATE | [-H] [-c]]\n", prog);
+    printf("no args: print lock profile data\n");
+    printf("    -r : reset profile data\n");
+    printf("    -s : profile one in RATE lock acquisitions\n");
+    printf("    -H : also print the longest hold and latency histograms\n");
+    printf("    -c : also print per-cpu totals\n");
+}
+
+static void print_hist(const char *what, const uint32_t *hist)
+{
+    unsigned int b;
+
+    printf("    %s:", what);
+    for ( b = 0; b < LOCKPROF_HIST_BUCKETS; b++ )
+        printf(" %"PRIu32, hist[b]);
+    printf("\n");
+}
+
+static int print_cpus(xc_interface *xc_handle)
+{
+    uint32_t n = 0, sample, i;
+    DECLARE_HYPERCALL_BUFFER(xc_lockprof_cpu_t, cpus);
+
+    if ( xc_lockprof_query_cpus(xc_handle, &n, &sample,
+                                HYPERCALL_BUFFER(HYPERCALL_BUFFER_NULL)) != 0 )
+    {
+        fprintf(stderr, "Error getting number of cpus: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    cpus = xc_hypercall_buffer_alloc(xc_handle, cpus, sizeof(*cpus) * n);
+    if ( cpus == NULL )
+    {
+        fprintf(stderr, "Could not allocate buffers: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    if ( xc_lockprof_query_cpus(xc_handle, &n, &sample,
+                                HYPERCALL_BUFFER(cpus)) != 0 )
+    {
+        fprintf(stderr, "Error getting per-cpu records: %d (%s)\n",
+                errno, strerror(errno));
+        xc_hypercall_buffer_free(xc_handle, cpus);
+        return 1;
+    }
+
+    printf("\n");
+    for ( i = 0; i < n; i++ )
+    {
+        if ( !cpus[i].lock_cnt && !cpus[i].block_cnt )
+            continue;
+        printf("cpu %-46u: lock:%12"PRId64"(%20.9fs), "
+               "block:%12"PRId64"(%20.9fs)\n", i,
+               cpus[i].lock_cnt, (double)cpus[i].lock_time / 1E+09,
+               cpus[i].block_cnt, (double)cpus[i].block_time / 1E+09);
+    }
+
+    xc_hypercall_buffer_free(xc_handle, cpus);
+
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
     xc_interface      *xc_handle;
-    uint32_t           i, j, n;
+    uint32_t           i, j, n, sample = 1;
     uint64_t           time;
     double             l, b, sl, sb;
     char               name[60];
+    int                opt, reset = 0, hist = 0, percpu = 0, rc = 0;
+    unsigned long      rate = 0;
     DECLARE_HYPERCALL_BUFFER(xc_lockprof_data_t, data);
 
-    if ( (argc > 2) || ((argc == 2) && (strcmp(argv[1], "-r") != 0)) )
+    while ( (opt = getopt(argc, argv, "rs:Hc")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'r':
+            reset = 1;
+            break;
+        case 's':
+            rate = strtoul(optarg, NULL, 0);
+            if ( rate == 0 || rate > UINT32_MAX )
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'H':
+            hist = 1;
+            break;
+        case 'c':
+            percpu = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( optind != argc || (reset && rate) ||
+         ((reset || rate) && (hist || percpu)) )
     {
-        printf("%s: [-r]\n", argv[0]);
-        printf("no args: print lock profile data\n");
-        printf("    -r : reset profile data\n");
+        usage(argv[0]);
         return 1;
     }
 
@@ -42,7 +137,7 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if ( argc > 1 )
+    if ( reset )
     {
         if ( xc_lockprof_reset(xc_handle) != 0 )
         {
@@ -53,6 +148,17 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if ( rate )
+    {
+        if ( xc_lockprof_set_sample(xc_handle, rate) != 0 )
+        {
+            fprintf(stderr, "Error setting sampling rate: %d (%s)\n",
+                    errno, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
     n = 0;
     if ( xc_lockprof_query_number(xc_handle, &n) != 0 )
     {
@@ -84,6 +190,10 @@ int main(int argc, char *argv[])
         i = n;
     }
 
+    j = 0;
+    xc_lockprof_query_cpus(xc_handle, &j, &sample,
+                           HYPERCALL_BUFFER(HYPERCALL_BUFFER_NULL));
+
     sl = 0;
     sb = 0;
     for ( j = 0; j < i; j++ )
@@ -108,13 +218,29 @@ int main(int argc, char *argv[])
         printf("%-50s: lock:%12"PRId64"(%20.9fs), "
                "block:%12"PRId64"(%20.9fs)\n",
                name, data[j].lock_cnt, l, data[j].block_cnt, b);
+        if ( hist && data[j].lock_cnt )
+        {
+            printf("    max hold: %"PRIu64"ns from %#"PRIx64"\n",
+                   data[j].max_hold, data[j].max_holder);
+            print_hist("hold ", data[j].hold_hist);
+            if ( data[j].block_cnt )
+                print_hist("block", data[j].block_hist);
+        }
     }
     l = (double)time / 1E+09;
     printf("total profiling time: %20.9fs\n", l);
     printf("total locked time:    %20.9fs\n", sl);
     printf("total blocked time:   %20.9fs\n", sb);
+    if ( sample > 1 )
+        printf("(sampling one in %"PRIu32" acquisitions)\n", sample);
+    if ( hist )
+        printf("histogram buckets: <%uns, then doubling\n",
+               1u << LOCKPROF_HIST_SHIFT);
 
     xc_hypercall_buffer_free(xc_handle, data);
 
-    return 0;
+    if ( percpu )
+        rc = print_cpus(xc_handle);
+
+    return rc;
 }
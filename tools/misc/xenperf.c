@@ -16,6 +16,7 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <string.h>
+#include <inttypes.h>
 
 #define X(name) [__HYPERVISOR_##name] = #name
 const char *hypercall_name_table[64] =
@@ -68,6 +69,87 @@ const char *hypercall_name_table[64] =
 };
 #undef X
 
+/* Upper bound of a latency bucket, as e.g. "512n", "16u" or "4m". */
+static const char *bucket_name(unsigned int b, char *buf, size_t len)
+{
+    unsigned long ns = 256UL << b;
+
+    if ( b == XEN_SYSCTL_HYPERCALL_HIST_BUCKETS - 1 )
+        snprintf(buf, len, "inf");
+    else if ( ns < 1000 )
+        snprintf(buf, len, "%lun", ns);
+    else if ( ns < 1000000 )
+        snprintf(buf, len, "%luu", ns / 1000);
+    else
+        snprintf(buf, len, "%lum", ns / 1000000);
+
+    return buf;
+}
+
+static int print_hypercall_stats(xc_interface *xc_handle)
+{
+    xc_hypercall_stats_t stats[64];
+    char name[36], bound[8];
+    int nr, enabled, i, b;
+
+    nr = xc_hypercall_stats_get(xc_handle, stats, 64, &enabled);
+    if ( nr < 0 )
+    {
+        fprintf(stderr, "Error getting hypercall statistics: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    printf("hypercall latency collection is %s\n\n",
+           enabled ? "enabled" : "disabled");
+    printf("%-30s %10s %8s %9s %9s\n",
+           "hypercall", "calls", "contd", "avg ns", "max ns");
+    for ( i = 0; i < nr && i < 64; i++ )
+    {
+        if ( !stats[i].count )
+            continue;
+        if ( hypercall_name_table[i] )
+            snprintf(name, sizeof(name), "%s", hypercall_name_table[i]);
+        else
+            snprintf(name, sizeof(name), "[%d]", i);
+        printf("%-30s %10"PRIu64" %8"PRIu64" %9"PRIu64" %9"PRIu64"\n", name,
+               stats[i].count, stats[i].continued,
+               stats[i].total_ns / stats[i].count, stats[i].max_ns);
+    }
+
+    printf("\n%-22s", "latency <");
+    for ( b = 0; b < XEN_SYSCTL_HYPERCALL_HIST_BUCKETS; b++ )
+        printf(" %7s", bucket_name(b, bound, sizeof(bound)));
+    printf("\n");
+    for ( i = 0; i < nr && i < 64; i++ )
+    {
+        if ( !stats[i].count )
+            continue;
+        if ( hypercall_name_table[i] )
+            snprintf(name, sizeof(name), "%s", hypercall_name_table[i]);
+        else
+            snprintf(name, sizeof(name), "[%d]", i);
+        printf("%-22.22s", name);
+        for ( b = 0; b < XEN_SYSCTL_HYPERCALL_HIST_BUCKETS; b++ )
+            printf(" %7"PRIu64, stats[i].latency[b]);
+        printf("\n");
+    }
+
+    return 0;
+}
+
+static int control_hypercall_stats(xc_interface *xc_handle, uint32_t cmd)
+{
+    if ( xc_hypercall_stats_control(xc_handle, cmd) != 0 )
+    {
+        fprintf(stderr, "Error controlling hypercall statistics: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int              i, j;
@@ -77,6 +159,7 @@ int main(int argc, char *argv[])
     xc_perfc_val_t  *val;
     int num_desc, num_val;
     unsigned int    sum, reset = 0, full = 0, pretty = 0;
+    int             hcall_cmd = -1;
     char hypercall_name[36];
 
     if ( argc > 1 )
@@ -96,6 +179,18 @@ int main(int argc, char *argv[])
             case 'r':
                 reset = 1;
                 break;
+            case 'l':
+                hcall_cmd = XEN_SYSCTL_HYPERCALL_STATS_get;
+                break;
+            case 'e':
+                hcall_cmd = XEN_SYSCTL_HYPERCALL_STATS_enable;
+                break;
+            case 'd':
+                hcall_cmd = XEN_SYSCTL_HYPERCALL_STATS_disable;
+                break;
+            case 'R':
+                hcall_cmd = XEN_SYSCTL_HYPERCALL_STATS_reset;
+                break;
             default:
                 goto error;
             }
@@ -108,6 +203,10 @@ int main(int argc, char *argv[])
             printf("    -f : print full arrays/histograms\n");
             printf("    -p : print full arrays/histograms in pretty format\n");
             printf("    -r : reset counters\n");
+            printf("    -l : print hypercall latency histograms\n");
+            printf("    -e : enable hypercall latency collection\n");
+            printf("    -d : disable hypercall latency collection\n");
+            printf("    -R : reset hypercall latency histograms\n");
             return 0;
         }
     }   
@@ -118,6 +217,11 @@ int main(int argc, char *argv[])
                 errno, strerror(errno));
         return 1;
     }
+
+    if ( hcall_cmd == XEN_SYSCTL_HYPERCALL_STATS_get )
+        return print_hypercall_stats(xc_handle);
+    if ( hcall_cmd >= 0 )
+        return control_hypercall_stats(xc_handle, hcall_cmd);
     
     if ( reset )
     {
@@ -61,6 +61,11 @@ void show_help(void)
             " set-vcpu-migration-delay      <num> set scheduler vcpu migration delay in us\n"
             " get-vcpu-migration-delay            get scheduler vcpu migration delay\n"
             " set-max-cstate        <num>         set the C-State limitation (<num> >= 0)\n"
+            " set-cpupool-epp <poolid> <epp>      set the energy/performance preference of\n"
+            "                                     cpupool <poolid>, as 0..255 or\n"
+            "                                     performance/balance/powersave (cpufreq=hwp)\n"
+            " get-sched-latency     [cpuid]       list scheduling latency histograms of\n"
+            "                                     CPU <cpuid> or all\n"
             " start [seconds]                     start collect Cx/Px statistics,\n"
             "                                     output after CTRL-C or SIGINT or several seconds.\n"
             " enable-turbo-mode     [cpuid]       enable Turbo Mode for processors that support it.\n"
@@ -1069,6 +1074,35 @@ void set_max_cstate_func(int argc, char *argv[])
                 value, errno, strerror(errno));
 }
 
+void set_cpupool_epp_func(int argc, char *argv[])
+{
+    int poolid, epp;
+
+    if ( argc != 2 || sscanf(argv[0], "%d", &poolid) != 1 || poolid < 0 )
+    {
+        fprintf(stderr, "Missing or invalid argument(s)\n");
+        exit(EINVAL);
+    }
+
+    if ( !strcmp(argv[1], "performance") )
+        epp = 0;
+    else if ( !strcmp(argv[1], "balance") )
+        epp = 128;
+    else if ( !strcmp(argv[1], "powersave") )
+        epp = 255;
+    else if ( sscanf(argv[1], "%d", &epp) != 1 || epp < 0 || epp > 255 )
+    {
+        fprintf(stderr, "Invalid energy/performance preference %s\n", argv[1]);
+        exit(EINVAL);
+    }
+
+    if ( !xc_cpupool_set_epp(xc_handle, poolid, epp) )
+        printf("set cpupool %d preference to %d succeeded\n", poolid, epp);
+    else
+        fprintf(stderr, "set cpupool %d preference to %d failed (%d - %s)\n",
+                poolid, epp, errno, strerror(errno));
+}
+
 void enable_turbo_mode(int argc, char *argv[])
 {
     int cpuid = -1;
@@ -1115,6 +1149,62 @@ void disable_turbo_mode(int argc, char *argv[])
                 errno, strerror(errno));
 }
 
+static void print_sched_hist_row(const char *name, const uint64_t *hist)
+{
+    int i;
+
+    printf("%-14s", name);
+    for ( i = 0; i < XEN_SYSCTL_SCHED_HIST_BUCKETS; i++ )
+        printf(" %8"PRIu64, hist[i]);
+    printf("\n");
+}
+
+static void print_sched_hist(int cpuid)
+{
+    xc_sched_hist_t hist;
+    int i;
+
+    if ( xc_sched_hist_get(xc_handle, XEN_SYSCTL_SCHED_HIST_pcpu, 0,
+                           cpuid, 0, &hist) )
+    {
+        fprintf(stderr, "[CPU%d] failed to get scheduling latency (%d - %s)\n",
+                cpuid, errno, strerror(errno));
+        return;
+    }
+
+    printf("cpu id               : %d\n", cpuid);
+    printf("%-14s", "us <");
+    for ( i = 0; i < XEN_SYSCTL_SCHED_HIST_BUCKETS - 1; i++ )
+        printf(" %8u", 1u << i);
+    printf(" %8s\n", "inf");
+    print_sched_hist_row("wake latency", hist.wake_latency);
+    print_sched_hist_row("runnable wait", hist.runnable_wait);
+    print_sched_hist_row("timeslice", hist.timeslice);
+    printf("%-14s", "runq depth");
+    for ( i = 0; i < XEN_SYSCTL_SCHED_HIST_BUCKETS - 1; i++ )
+        printf(" %8d", i);
+    printf(" %7d+\n", i);
+    print_sched_hist_row("", hist.runq_depth);
+    printf("\n");
+}
+
+void sched_latency_func(int argc, char *argv[])
+{
+    int cpuid = -1;
+
+    if ( argc > 0 )
+        parse_cpuid(argv[0], &cpuid);
+
+    if ( cpuid < 0 )
+    {
+        int i;
+        for ( i = 0; i < max_cpu_nr; i++ )
+            print_sched_hist(i);
+    }
+    else
+        print_sched_hist(cpuid);
+}
+
 struct {
     const char *name;
     void (*function)(int argc, char *argv[]);
@@ -1135,6 +1225,8 @@ struct {
     { "get-vcpu-migration-delay", get_vcpu_migration_delay_func},
     { "set-vcpu-migration-delay", set_vcpu_migration_delay_func},
     { "set-max-cstate", set_max_cstate_func},
+    { "set-cpupool-epp", set_cpupool_epp_func},
+    { "get-sched-latency", sched_latency_func},
     { "enable-turbo-mode", enable_turbo_mode },
     { "disable-turbo-mode", disable_turbo_mode },
 };
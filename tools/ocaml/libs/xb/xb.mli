@@ -23,6 +23,9 @@ module Op :
       | Resume
       | Set_target
       | Restrict
+      | Reset_watches
+      | Multi
+      | Read_subtree
       | Invalid (* Not a valid wire operation *)
     val operation_c_mapping : operation array
     val size : int
@@ -234,6 +234,9 @@ let string_of_access_type = function
 	| Xenbus.Xb.Op.Setperms          -> "setperms "
 	| Xenbus.Xb.Op.Restrict          -> "restrict "
 	| Xenbus.Xb.Op.Set_target        -> "settarget"
+	| Xenbus.Xb.Op.Reset_watches     -> "rst watch"
+	| Xenbus.Xb.Op.Multi             -> "multi    "
+	| Xenbus.Xb.Op.Read_subtree      -> "subtree  "
 
 	| Xenbus.Xb.Op.Error             -> "error    "
 	| Xenbus.Xb.Op.Watchevent        -> "w event  "
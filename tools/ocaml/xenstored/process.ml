@@ -303,6 +303,169 @@ let reply_none fct ty con t rid doms cons data =
 	(* let the function reply *)
 	fct con t rid doms cons data
 
+let errno_of_exn = function
+	| Define.Invalid_path          -> "EINVAL"
+	| Define.Already_exist         -> "EEXIST"
+	| Define.Doesnt_exist          -> "ENOENT"
+	| Define.Lookup_Doesnt_exist s -> "ENOENT"
+	| Define.Permission_denied     -> "EACCES"
+	| Not_found                    -> "ENOENT"
+	| Invalid_Cmd_Args             -> "EINVAL"
+	| Invalid_argument i           -> "EINVAL"
+	| Transaction_again            -> "EAGAIN"
+	| Transaction_nested           -> "EBUSY"
+	| Domain_not_match             -> "EINVAL"
+	| Quota.Limit_reached          -> "EQUOTA"
+	| Quota.Data_too_big           -> "E2BIG"
+	| Quota.Transaction_opened     -> "EQUOTA"
+	| (Failure "int_of_string")    -> "EINVAL"
+	| Define.Unknown_operation     -> "ENOSYS"
+	| e                            -> raise e
+
+(* The headers of XS_MULTI operations are struct xsd_multi_op: two 32-bit
+   integers, little-endian on all the architectures xen runs on. *)
+let get_u32 s off =
+	(Char.code s.[off]) lor ((Char.code s.[off + 1]) lsl 8) lor
+	((Char.code s.[off + 2]) lsl 16) lor ((Char.code s.[off + 3]) lsl 24)
+
+let add_u32 buf v =
+	for i = 0 to 3 do
+		Buffer.add_char buf (Char.chr ((v lsr (8 * i)) land 0xff))
+	done
+
+let multi_ops data =
+	let len = String.length data in
+	let rec parse off acc =
+		if off = len then
+			List.rev acc
+		else if len - off < 8 then
+			raise Invalid_Cmd_Args
+		else (
+			let ty = Xenbus.Xb.Op.of_cval (get_u32 data off) in
+			let oplen = get_u32 data (off + 4) in
+			if oplen > len - off - 8 then
+				raise Invalid_Cmd_Args;
+			let opdata = String.sub data (off + 8) oplen in
+			parse (off + 8 + oplen) ((ty, opdata) :: acc)
+		)
+		in
+	parse 0 []
+
+let multi_op con t doms cons ty data =
+	let ack fct = fct con t doms cons data; "OK\000" in
+	match ty with
+	| Xenbus.Xb.Op.Directory         -> do_directory con t doms cons data
+	| Xenbus.Xb.Op.Read              -> do_read con t doms cons data
+	| Xenbus.Xb.Op.Getperms          -> do_getperms con t doms cons data
+	| Xenbus.Xb.Op.Write             -> ack do_write
+	| Xenbus.Xb.Op.Mkdir             -> ack do_mkdir
+	| Xenbus.Xb.Op.Rm                -> ack do_rm
+	| Xenbus.Xb.Op.Setperms          -> ack do_setperms
+	| _                              -> raise Invalid_Cmd_Args
+
+(* Carry out each operation in turn, stopping at the first to fail.  Outside
+   a transaction they get one of their own, committed only if all succeed. *)
+let do_multi con t rid doms cons data =
+	let ops = multi_ops data in
+	let valid (ty, _) = match ty with
+		| Xenbus.Xb.Op.Directory | Xenbus.Xb.Op.Read | Xenbus.Xb.Op.Getperms
+		| Xenbus.Xb.Op.Write | Xenbus.Xb.Op.Mkdir | Xenbus.Xb.Op.Rm
+		| Xenbus.Xb.Op.Setperms -> true
+		| _ -> false in
+	if not (List.for_all valid ops) then
+		raise Invalid_Cmd_Args;
+	let own = Transaction.get_id t = Transaction.none in
+	let mt =
+		if own then Transaction.make (-1) (Transaction.get_store t) else t in
+	let buf = Buffer.create 128 in
+	let add ty s =
+		add_u32 buf (Xenbus.Xb.Op.to_cval ty);
+		add_u32 buf (String.length s);
+		Buffer.add_string buf s in
+	let rec run = function
+		| [] -> true
+		| (ty, opdata) :: rest ->
+			let reply =
+				try Some (multi_op con mt doms cons ty opdata)
+				with e -> add Xenbus.Xb.Op.Error (errno_of_exn e ^ "\000"); None
+				in
+			match reply with
+			| Some s -> add ty s; run rest
+			| None   -> false
+		in
+	let ok = run ops in
+	if Buffer.length buf > Connection.xenstore_payload_max then
+		raise Quota.Data_too_big;
+	if own && ok then (
+		if not (Transaction.commit ~con:(Connection.get_domstr con) mt) then
+			raise Transaction_again;
+		process_watch (Transaction.get_ops mt) cons
+	);
+	Connection.send_reply con (Transaction.get_id t) rid Xenbus.Xb.Op.Multi
+		(Buffer.contents buf)
+
+(* The end marker and the too-long value of struct xsd_subtree_node, spelt
+   out as they don't fit in the int of a 32-bit build. *)
+let subtree_none = "\255\255\255\255"
+
+(* The nodes of a subtree, depth first, each a struct xsd_subtree_node
+   followed by its path relative to the top and its value, as many as fit
+   in a reply.  Given the path of a node returned before, carry on after
+   it, skipping the subtrees wholly before it. *)
+let do_read_subtree con t domains cons data =
+	if not (Connection.is_dom0 con) then
+		raise Define.Permission_denied;
+	let path, after =
+		match split None '\000' data with
+		| [ path; "" ]        -> path, None
+		| [ path; after; "" ] -> path, Some after
+		| _                   -> raise Invalid_Cmd_Args
+		in
+	let path = Store.Path.create path (Connection.get_path con) in
+	let top = Transaction.read_subtree t (Connection.get_perm con) path in
+	let max = Connection.xenstore_payload_max in
+	let buf = Buffer.create 1024 in
+	let after = ref after in
+	let add rel node =
+		let value = Store.Node.get_value node in
+		let toobig = 8 + String.length rel + String.length value > max in
+		let value = if toobig then "" else value in
+		if 8 + String.length rel + String.length value > max - Buffer.length buf then
+			false
+		else (
+			add_u32 buf (String.length rel);
+			if toobig then
+				Buffer.add_string buf subtree_none
+			else
+				add_u32 buf (String.length value);
+			Buffer.add_string buf rel;
+			Buffer.add_string buf value;
+			true
+		) in
+	let within rel a = a = rel || String.startswith (rel ^ "/") a in
+	let rec walk rel node =
+		let added = match !after with
+			| None   -> add rel node
+			| Some a -> if a = rel then after := None; true
+			in
+		added && List.for_all (fun child ->
+			let name = Store.Node.get_name child in
+			let crel = if rel = "" then name else rel ^ "/" ^ name in
+			match !after with
+			| Some a when not (within crel a) -> true
+			| _ ->
+				let more = walk crel child in
+				(* whatever follows the subtree holding it comes after it *)
+				after := None;
+				more
+		) (List.rev (Store.Node.get_children node))
+		in
+	if walk "" top && Buffer.length buf + 8 <= max then (
+		Buffer.add_string buf subtree_none;
+		add_u32 buf 0
+	);
+	Buffer.contents buf
+
 let function_of_type ty =
 	match ty with
 	| Xenbus.Xb.Op.Debug             -> reply_data_or_ack do_debug
@@ -324,31 +487,16 @@ let function_of_type ty =
 	| Xenbus.Xb.Op.Resume            -> reply_ack do_resume
 	| Xenbus.Xb.Op.Set_target        -> reply_ack do_set_target
 	| Xenbus.Xb.Op.Restrict          -> reply_ack do_restrict
+	| Xenbus.Xb.Op.Multi             -> reply_none do_multi
+	| Xenbus.Xb.Op.Read_subtree      -> reply_data do_read_subtree
 	| Xenbus.Xb.Op.Invalid           -> reply_ack do_error
 	| _                              -> reply_ack do_error
 
 let input_handle_error ~cons ~doms ~fct ~ty ~con ~t ~rid ~data =
-	let reply_error e =
-		Connection.send_error con (Transaction.get_id t) rid e in
 	try
 		fct ty con t rid doms cons data
-	with
-	| Define.Invalid_path          -> reply_error "EINVAL"
-	| Define.Already_exist         -> reply_error "EEXIST"
-	| Define.Doesnt_exist          -> reply_error "ENOENT"
-	| Define.Lookup_Doesnt_exist s -> reply_error "ENOENT"
-	| Define.Permission_denied     -> reply_error "EACCES"
-	| Not_found                    -> reply_error "ENOENT"
-	| Invalid_Cmd_Args             -> reply_error "EINVAL"
-	| Invalid_argument i           -> reply_error "EINVAL"
-	| Transaction_again            -> reply_error "EAGAIN"
-	| Transaction_nested           -> reply_error "EBUSY"
-	| Domain_not_match             -> reply_error "EINVAL"
-	| Quota.Limit_reached          -> reply_error "EQUOTA"
-	| Quota.Data_too_big           -> reply_error "E2BIG"
-	| Quota.Transaction_opened     -> reply_error "EQUOTA"
-	| (Failure "int_of_string")    -> reply_error "EINVAL"
-	| Define.Unknown_operation     -> reply_error "ENOSYS"
+	with e ->
+		Connection.send_error con (Transaction.get_id t) rid (errno_of_exn e)
 
 (**
  * Nothrow guarantee.
@@ -380,6 +380,34 @@ let set_node store path node =
 	store.root <- root;
 	Quota.add store.quota quota_diff
 
+(* give a node the value and permissions of nnode, leaving its children
+   alone, or add nnode without its children if the node doesn't exist *)
+let set_node_shallow store path nnode =
+	let owner = Node.get_owner nnode in
+	match Path.get_node store.root path with
+	| Some node ->
+		let merged = { node with Node.value = nnode.Node.value; Node.perms = nnode.Node.perms } in
+		if path = [] then
+			store.root <- merged
+		else
+			store.root <- Path.apply_modify store.root path (fun pnode _ -> Node.replace_child pnode node merged);
+		if Node.get_owner node <> owner then (
+			Quota.del_entry store.quota (Node.get_owner node);
+			Quota.add_entry store.quota owner
+		)
+	| None ->
+		let nnode = Node.del_all_children nnode in
+		store.root <- Path.apply_modify store.root path (fun pnode _ -> Node.add_child pnode nnode);
+		Quota.add_entry store.quota owner
+
+(* remove a node and everything below it, if it exists *)
+let del_node store path =
+	match Path.get_node store.root path with
+	| None -> ()
+	| Some node ->
+		store.root <- Path.apply_modify store.root path Node.del_childname;
+		Node.recurse (fun node -> Quota.del_entry store.quota (Node.get_owner node)) node
+
 let write store perm path value =
 	let node, existing = get_deepest_existing_node store path in
 	let owner = Node.get_owner node in
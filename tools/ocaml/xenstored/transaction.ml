@@ -20,54 +20,45 @@ let none = 0
 let test_eagain = ref false
 let do_coalesce = ref true
 
-let check_parents_perms_identical root1 root2 path =
-	let hierarch = Store.Path.get_hierarchy path in
-	let permdiff = List.fold_left (fun acc path ->
-		let n1 = Store.Path.get_node root1 path
-		and n2 = Store.Path.get_node root2 path in
-		match n1, n2 with
-		| Some n1, Some n2 ->
-			not (Perms.equiv (Store.Node.get_perms n1) (Store.Node.get_perms n2)) || acc
-		| _ ->
-			true || acc
-	) false hierarch in
-	(not permdiff)
-
-let get_lowest path1 path2 =
-	match path2 with
-	| None       -> Some path1
-	| Some path2 -> Some (Store.Path.get_common_prefix path1 path2)
-
-let test_coalesce oldroot currentroot optpath =
-	match optpath with
-	| None      -> true
-	| Some path ->
-		let oldnode = Store.Path.get_node oldroot path
-		and currentnode = Store.Path.get_node currentroot path in
-		
-		match oldnode, currentnode with
-		| (Some oldnode), (Some currentnode) ->
-			if oldnode == currentnode then (
-				check_parents_perms_identical oldroot currentroot path
-			) else (
-				false
-			)
-		| None, None -> (
-			(* ok then it doesn't exists in the old version and the current version,
-			   just sneak it in as a child of the parent node if it exists, or else fail *)
-			let pnode = Store.Path.get_node currentroot (Store.Path.get_parent path) in
-			match pnode with
-			| None       -> false (* ok it doesn't exists, just bail out. *)
-			| Some pnode -> true
-			)
-		| _ ->
-			false
+(* what a transaction depended on, or replaced, at a path *)
+type access =
+	| Node     (* the value and permissions of the node *)
+	| Children (* those, and the names of its children *)
+	| Subtree  (* the node and everything below it *)
+
+(* a path missing half-way down is as missing as one missing at the end *)
+let get_node root path =
+	try Store.Path.get_node root path with Not_found -> None
+
+(* check that what was accessed at path is the same in both trees. As the
+   trees share every subtree nobody modified, that is mostly a pointer
+   comparison. *)
+let node_unchanged oldroot currentroot (access, path) =
+	match get_node oldroot path, get_node currentroot path with
+	| None, None -> true
+	| Some oldnode, Some currentnode when oldnode == currentnode -> true
+	| Some oldnode, Some currentnode ->
+		let names n = List.map Store.Node.get_name (Store.Node.get_children n) in
+		access <> Subtree
+		&& Store.Node.get_value oldnode = Store.Node.get_value currentnode
+		&& Perms.equiv (Store.Node.get_perms oldnode) (Store.Node.get_perms currentnode)
+		&& (access <> Children || names oldnode = names currentnode)
+	| _ ->
+		false
 
-let can_coalesce oldroot currentroot path =
-	if !do_coalesce then
-		try test_coalesce oldroot currentroot path with _ -> false
+(* creating a node needs the permission of its parent, so check that hasn't
+   changed either *)
+let parent_unchanged oldroot currentroot (_, path) =
+	if path = [] then
+		true
 	else
-		false
+		let parent = Store.Path.get_parent path in
+		match get_node oldroot parent, get_node currentroot parent with
+		| None, None -> true (* the transaction created it too *)
+		| Some oldnode, Some currentnode ->
+			oldnode == currentnode
+			|| Perms.equiv (Store.Node.get_perms oldnode) (Store.Node.get_perms currentnode)
+		| _ -> false
 
 type ty = No | Full of (int * Store.Node.t * Store.t)
 
@@ -75,8 +66,8 @@ type t = {
 	ty: ty;
 	store: Store.t;
 	mutable ops: (Xenbus.Xb.Op.operation * Store.Path.t) list;
-	mutable read_lowpath: Store.Path.t option;
-	mutable write_lowpath: Store.Path.t option;
+	mutable reads: (access * Store.Path.t) list;
+	mutable writes: (access * Store.Path.t) list;
 }
 
 let make id store =
@@ -85,8 +76,8 @@ let make id store =
 		ty = ty;
 		store = if id = none then store else Store.copy store;
 		ops = [];
-		read_lowpath = None;
-		write_lowpath = None;
+		reads = [];
+		writes = [];
 	}
 
 let get_id t = match t.ty with No -> none | Full (id, _, _) -> id
@@ -94,49 +85,90 @@ let get_store t = t.store
 let get_ops t = t.ops
 
 let add_wop t ty path = t.ops <- (ty, path) :: t.ops
-let set_read_lowpath t path = t.read_lowpath <- get_lowest path t.read_lowpath
-let set_write_lowpath t path = t.write_lowpath <- get_lowest path t.write_lowpath
+
+(* only transactions need to remember what they accessed *)
+let add_access t l access path =
+	match t.ty with
+	| No -> l
+	| Full _ -> if List.mem (access, path) l then l else (access, path) :: l
+let add_read t access path = t.reads <- add_access t t.reads access path
+let add_write t access path = t.writes <- add_access t t.writes access path
 
 let path_exists t path = Store.path_exists t.store path
 
+(* a failed modification still depends on what made it fail *)
 let write t perm path value =
-	let path_exists = path_exists t path in
+	add_read t Node path;
 	Store.write t.store perm path value;
-	if path_exists
-	then set_write_lowpath t path
-	else set_write_lowpath t (Store.Path.get_parent path);
+	add_write t Node path;
 	add_wop t Xenbus.Xb.Op.Write path
 
 let mkdir ?(with_watch=true) t perm path =
+	add_read t Node path;
 	Store.mkdir t.store perm path;
-	set_write_lowpath t path;
+	add_write t Node path;
 	if with_watch then
 		add_wop t Xenbus.Xb.Op.Mkdir path
 
 let setperms t perm path perms =
+	add_read t Node path;
 	Store.setperms t.store perm path perms;
-	set_write_lowpath t path;
+	add_write t Node path;
 	add_wop t Xenbus.Xb.Op.Setperms path
 
 let rm t perm path =
+	add_read t Node path;
 	Store.rm t.store perm path;
-	set_write_lowpath t (Store.Path.get_parent path);
+	add_write t Subtree path;
 	add_wop t Xenbus.Xb.Op.Rm path
 
-let ls t perm path =	
-	let r = Store.ls t.store perm path in
-	set_read_lowpath t path;
-	r
+let ls t perm path =
+	add_read t Children path;
+	Store.ls t.store perm path
 
 let read t perm path =
-	let r = Store.read t.store perm path in
-	set_read_lowpath t path;
-	r
+	add_read t Node path;
+	Store.read t.store perm path
 
 let getperms t perm path =
-	let r = Store.getperms t.store perm path in
-	set_read_lowpath t path;
-	r
+	add_read t Node path;
+	Store.getperms t.store perm path
+
+let read_subtree t perm path =
+	add_read t Subtree path;
+	ignore (Store.read t.store perm path);
+	match Store.get_node t.store path with
+	| Some node -> node
+	| None      -> raise Define.Doesnt_exist
+
+let can_coalesce oldroot currentroot t =
+	if !do_coalesce then
+		try
+			List.for_all (node_unchanged oldroot currentroot) t.reads
+			&& List.for_all (node_unchanged oldroot currentroot) t.writes
+			&& List.for_all (parent_unchanged oldroot currentroot) t.writes
+		with _ -> false
+	else
+		false
+
+(* replay the writes of the transaction, parents first, onto a copy of the
+   current store. Each takes only what it wrote from the transaction's
+   store, so modifications others made around it are kept. *)
+let merge_writes t cstore =
+	let mstore = Store.copy cstore in
+	let troot = Store.get_root t.store in
+	let depth (_, path) = List.length path in
+	let writes = List.stable_sort (fun w1 w2 -> compare (depth w1) (depth w2)) (List.rev t.writes) in
+	try
+		List.iter (fun (access, path) ->
+			match access, get_node troot path with
+			| Subtree, Some node -> Store.set_node mstore path node
+			| Subtree, None      -> Store.del_node mstore path
+			| _, Some node       -> Store.set_node_shallow mstore path node
+			| _, None            -> () (* removed afterwards, with its parent *)
+		) writes;
+		Some mstore
+	with _ -> None
 
 let commit ~con t =
 	let has_write_ops = List.length t.ops > 0 in
@@ -146,30 +178,30 @@ let commit ~con t =
 	| No                         -> true
 	| Full (id, oldroot, cstore) ->
 		let commit_partial oldroot cstore store =
-			(* get the lowest path of the query and verify that it hasn't
-			   been modified by others transactions. *)
-			if can_coalesce oldroot (Store.get_root cstore) t.read_lowpath
-			&& can_coalesce oldroot (Store.get_root cstore) t.write_lowpath then (
-				maybe (fun p ->
-					let n = Store.get_node store p in
-
-					(* it has to be in the store, otherwise it means bugs
-					   in the lowpath registration. we don't need to handle none. *)
-					maybe (fun n -> Store.set_node cstore p n) n;
-					Logging.write_coalesce ~tid:(get_id t) ~con (Store.Path.to_string p);
-				) t.write_lowpath;
-				maybe (fun p ->
+			(* verify that nothing the transaction looked at or modified
+			   has been modified by other transactions since. *)
+			let merged =
+				if can_coalesce oldroot (Store.get_root cstore) t
+				then merge_writes t cstore
+				else None in
+			match merged with
+			| Some mstore ->
+				Store.set_root cstore (Store.get_root mstore);
+				Store.set_quota cstore (Store.get_quota mstore);
+				List.iter (fun (_, p) ->
+					Logging.write_coalesce ~tid:(get_id t) ~con (Store.Path.to_string p)
+				) t.writes;
+				List.iter (fun (_, p) ->
 					Logging.read_coalesce ~tid:(get_id t) ~con (Store.Path.to_string p)
-					) t.read_lowpath;
+				) t.reads;
 				has_coalesced := true;
 				Store.incr_transaction_coalesce cstore;
 				true
-			) else (
+			| None ->
 				(* cannot do anything simple, just discard the queries,
 				   and the client need to redo it later *)
 				Store.incr_transaction_abort cstore;
 				false
-			)
 			in
 		let try_commit oldroot cstore store =
 			if oldroot == Store.get_root cstore then (
@@ -190,7 +222,7 @@ let commit ~con t =
 			try_commit oldroot cstore t.store
 		in
 	if has_commited && has_write_ops then
-		Disk.write t.store;
+		Disk.write (match t.ty with No -> t.store | Full (_, _, cstore) -> cstore);
 	if not has_commited 
 	then Logging.conflict ~tid:(get_id t) ~con
 	else if not !has_coalesced 
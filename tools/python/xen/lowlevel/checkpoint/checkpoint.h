@@ -41,6 +41,7 @@ typedef struct {
 } checkpoint_state;
 
 #define CHECKPOINT_FLAGS_COMPRESSION 1
+#define CHECKPOINT_FLAGS_PRECOPY 2
 char* checkpoint_error(checkpoint_state* s);
 
 void checkpoint_init(checkpoint_state* s);
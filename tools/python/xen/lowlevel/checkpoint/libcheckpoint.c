@@ -203,6 +203,8 @@ int checkpoint_start(checkpoint_state* s, int fd,
     }
     if (remus_flags & CHECKPOINT_FLAGS_COMPRESSION)
       flags |= XCFLAGS_CHECKPOINT_COMPRESS;
+    if (remus_flags & CHECKPOINT_FLAGS_PRECOPY)
+      flags |= XCFLAGS_CHECKPOINT_PRECOPY;
 
     callbacks->switch_qemu_logdirty = noop_switch_logdirty;
 
@@ -1596,6 +1596,10 @@ static PyObject *pyxc_sched_credit2_domain_set(XcObject *self,
                                      &domid, &weight) )
         return NULL;
 
+    /* Preserve the parameters (e.g., gang mode) xend doesn't know about. */
+    if ( xc_sched_credit2_domain_get(self->xc_handle, domid, &sdom) != 0 )
+        return pyxc_error_to_exception(self->xc_handle);
+
     sdom.weight = weight;
 
     if ( xc_sched_credit2_domain_set(self->xc_handle, domid, &sdom) != 0 )
@@ -0,0 +1,721 @@
+/*
+ * migrate-bench.c
+ *
+ * Measures xc_domain_save()/xc_domain_restore() on this host, without a
+ * guest or a network.  A synthetic HVM domain is built with memory but no
+ * code to run, a thread dirties its memory in a chosen pattern while it is
+ * live-saved, and the stream is restored into a second empty domain over
+ * a pipe, a socket pair or loopback TCP.  A relay between the two ends
+ * counts the bytes going across.
+ *
+ * Reported are the stream's throughput, the time spent in pre-copy, with
+ * the domain suspended and in restore after the last byte was sent, and
+ * the downtime a real guest would have seen: from suspending it on the
+ * sender to having it ready to run on the receiver.
+ *
+ * Dirty patterns are:
+ *   uniform        pages picked at random
+ *   hotspot        nine writes in ten to a tenth of memory
+ *   sweep          pages in order, wrapping around
+ *   replay:FILE    as recorded in FILE, lines of "<ms> <pfn> [<count>]",
+ *                  dirtying count pages from pfn, ms after the start
+ *
+ * Must be run in dom0, as root.  Post-copy (XCFLAGS_POSTCOPY) needs the
+ * stream to carry traffic both ways and isn't supported.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+
+#define SP_SHIFT        9       /* memory is populated 2M at a time */
+#define SP_PAGES        (1UL << SP_SHIFT)
+#define DIRTY_TICK_MS   10
+#define RELAY_BUF       (1 << 20)
+
+enum pattern { PAT_UNIFORM, PAT_HOTSPOT, PAT_SWEEP, PAT_REPLAY };
+
+struct bench {
+    xc_interface *xch;
+    uint32_t src, dst;
+    unsigned long nr_pages;
+    unsigned char *mem;             /* the source's memory */
+
+    /* Dirtying */
+    enum pattern pattern;
+    unsigned long rate;             /* pages per second */
+    FILE *trace;
+    pthread_t dirtier;
+    int dirtying;
+    volatile int stop_dirtying;
+    unsigned long dirtied;
+
+    /* Saving */
+    uint32_t max_iters, max_factor, flags;
+    int save_fd;
+    int save_rc;
+
+    /* The relay, and what went through it */
+    int relay_in, relay_out;
+    pthread_mutex_t lock;
+    uint64_t bytes, bytes_at_suspend;
+
+    /* Timestamps, in us */
+    uint64_t t_start, t_suspend, t_save_done, t_restore_done;
+};
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -m MB        guest memory (default 256)\n"
+            "  -p PATTERN   uniform, hotspot, sweep or replay:FILE\n"
+            "               (default uniform)\n"
+            "  -r RATE      pages dirtied per second (default 10000)\n"
+            "  -t TRANSPORT pipe, unix or tcp (default pipe)\n"
+            "  -z PERCENT   pages left all zero (default 25)\n"
+            "  -d PERCENT   pages duplicating another (default 0)\n"
+            "  -i ITERS     most pre-copy iterations (default libxc's)\n"
+            "  -f FACTOR    most memory sent, times its size (default "
+            "libxc's)\n"
+            "  -F FLAGS     extra XCFLAGS_* for xc_domain_save\n"
+            "  -s           restore with superpages\n"
+            "  -n           non-live save\n"
+            "  -v           compare memory once restored\n", prog);
+}
+
+/*
+ * Domains.  Each has one vcpu, never started, and memory from pfn 0 up,
+ * populated 2M at a time.
+ */
+static int create_domain(struct bench *b, int populate, uint32_t *domid)
+{
+    xen_domain_handle_t handle = { 0 };
+    xen_pfn_t *extents;
+    unsigned long i, nr = b->nr_pages >> SP_SHIFT;
+    uint32_t d = 0;
+    int rc;
+
+    if ( xc_domain_create(b->xch, 0, handle,
+                          XEN_DOMCTL_CDF_hvm_guest | XEN_DOMCTL_CDF_hap,
+                          &d) )
+    {
+        perror("xc_domain_create");
+        return -1;
+    }
+    *domid = d;
+
+    if ( xc_domain_max_vcpus(b->xch, *domid, 1) ||
+         xc_domain_setmaxmem(b->xch, *domid,
+                             (b->nr_pages + SP_PAGES) <<
+                             (XC_PAGE_SHIFT - 10)) )
+    {
+        perror("setting up domain");
+        return -1;
+    }
+
+    if ( !populate )
+        return 0;
+
+    extents = malloc(nr * sizeof(*extents));
+    if ( !extents )
+        return -1;
+    for ( i = 0; i < nr; i++ )
+        extents[i] = i << SP_SHIFT;
+    rc = xc_domain_populate_physmap_exact(b->xch, *domid, nr, SP_SHIFT, 0,
+                                          extents);
+    free(extents);
+    if ( rc )
+    {
+        perror("populating domain memory");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int map_memory(struct bench *b, uint32_t domid, unsigned char **mem)
+{
+    xen_pfn_t *pfns = malloc(b->nr_pages * sizeof(*pfns));
+    int *errs = malloc(b->nr_pages * sizeof(*errs));
+    unsigned long i;
+
+    *mem = NULL;
+    if ( pfns && errs )
+    {
+        for ( i = 0; i < b->nr_pages; i++ )
+            pfns[i] = i;
+        *mem = xc_map_foreign_bulk(b->xch, domid, PROT_READ | PROT_WRITE,
+                                   pfns, errs, b->nr_pages);
+        for ( i = 0; *mem && i < b->nr_pages; i++ )
+            if ( errs[i] )
+            {
+                fprintf(stderr, "pfn %lx of d%u not mapped: %d\n",
+                        i, domid, errs[i]);
+                munmap(*mem, b->nr_pages << XC_PAGE_SHIFT);
+                *mem = NULL;
+            }
+    }
+    free(pfns);
+    free(errs);
+
+    return *mem ? 0 : -1;
+}
+
+/* Some pages left zero, some copies of others, the rest random. */
+static void fill_memory(struct bench *b, unsigned int zero_pct,
+                        unsigned int dup_pct)
+{
+    unsigned long i, j;
+    uint32_t *p;
+
+    for ( i = 0; i < b->nr_pages; i++ )
+    {
+        unsigned int r = random() % 100;
+
+        p = (uint32_t *)(b->mem + (i << XC_PAGE_SHIFT));
+        if ( r < zero_pct )
+            memset(p, 0, XC_PAGE_SIZE);
+        else if ( r < zero_pct + dup_pct && i )
+            memcpy(p, b->mem + ((random() % i) << XC_PAGE_SHIFT),
+                   XC_PAGE_SIZE);
+        else
+            for ( j = 0; j < XC_PAGE_SIZE / sizeof(*p); j++ )
+                p[j] = random();
+    }
+}
+
+/*
+ * Dirtying.  Writes through a foreign mapping aren't logged, so each page
+ * written is reported as the device model would.
+ */
+static void dirty_pages(struct bench *b, unsigned long pfn,
+                        unsigned long nr)
+{
+    unsigned long i;
+
+    if ( pfn >= b->nr_pages )
+        return;
+    if ( nr > b->nr_pages - pfn )
+        nr = b->nr_pages - pfn;
+
+    for ( i = 0; i < nr; i++ )
+        ((uint64_t *)(b->mem + ((pfn + i) << XC_PAGE_SHIFT)))
+            [random() % (XC_PAGE_SIZE / sizeof(uint64_t))] = random();
+
+    if ( xc_hvm_modified_memory(b->xch, b->src, pfn, nr) )
+        perror("xc_hvm_modified_memory");
+    b->dirtied += nr;
+}
+
+/* Next line of the trace, or -1 at its end */
+static int replay_next(struct bench *b, uint64_t *ms, unsigned long *pfn,
+                       unsigned long *nr)
+{
+    char line[128];
+    unsigned long long t;
+    int n;
+
+    while ( fgets(line, sizeof(line), b->trace) )
+    {
+        *nr = 1;
+        n = sscanf(line, "%llu %lx %lu", &t, pfn, nr);
+        if ( n < 2 )
+            continue;
+        *ms = t;
+        return 0;
+    }
+
+    return -1;
+}
+
+static void *dirtier(void *arg)
+{
+    struct bench *b = arg;
+    unsigned long per_tick = b->rate * DIRTY_TICK_MS / 1000;
+    unsigned long hot = b->nr_pages / 10 ? b->nr_pages / 10 : 1;
+    unsigned long sweep = 0, i, pfn = 0, nr = 0;
+    uint64_t ms = 0, tick = b->t_start;
+    int have = 0;
+
+    if ( !per_tick )
+        per_tick = 1;
+
+    while ( !b->stop_dirtying )
+    {
+        switch ( b->pattern )
+        {
+        case PAT_UNIFORM:
+            for ( i = 0; i < per_tick; i++ )
+                dirty_pages(b, random() % b->nr_pages, 1);
+            break;
+
+        case PAT_HOTSPOT:
+            for ( i = 0; i < per_tick; i++ )
+                dirty_pages(b, random() % 10 ? b->nr_pages / 2 +
+                                               random() % hot - hot / 2
+                                             : random() % b->nr_pages, 1);
+            break;
+
+        case PAT_SWEEP:
+            if ( sweep >= b->nr_pages )
+                sweep = 0;
+            dirty_pages(b, sweep, per_tick);
+            sweep += per_tick;
+            break;
+
+        case PAT_REPLAY:
+            for ( ; ; )
+            {
+                if ( !have && replay_next(b, &ms, &pfn, &nr) )
+                    return NULL;
+                have = 1;
+                if ( b->t_start + ms * 1000 > now_us() )
+                    break;
+                dirty_pages(b, pfn, nr);
+                have = 0;
+            }
+            break;
+        }
+
+        tick += DIRTY_TICK_MS * 1000;
+        if ( tick > now_us() )
+            usleep(tick - now_us());
+    }
+
+    return NULL;
+}
+
+static void stop_dirtier(struct bench *b)
+{
+    if ( !b->dirtying )
+        return;
+    b->stop_dirtying = 1;
+    pthread_join(b->dirtier, NULL);
+    b->dirtying = 0;
+}
+
+/* Save callbacks */
+static int suspend_cb(void *data)
+{
+    struct bench *b = data;
+
+    stop_dirtier(b);
+
+    pthread_mutex_lock(&b->lock);
+    b->t_suspend = now_us();
+    b->bytes_at_suspend = b->bytes;
+    pthread_mutex_unlock(&b->lock);
+
+    if ( xc_domain_shutdown(b->xch, b->src, SHUTDOWN_suspend) )
+    {
+        perror("xc_domain_shutdown");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int switch_logdirty_cb(int domid, unsigned enable, void *data)
+{
+    /* There is no device model */
+    return 0;
+}
+
+static void *saver(void *arg)
+{
+    struct bench *b = arg;
+    struct save_callbacks callbacks = {
+        .suspend = suspend_cb,
+        .switch_qemu_logdirty = switch_logdirty_cb,
+        .data = b,
+    };
+
+    b->save_rc = xc_domain_save(b->xch, b->save_fd, b->src, b->max_iters,
+                                b->max_factor, b->flags, &callbacks, 1, 0);
+    b->t_save_done = now_us();
+    close(b->save_fd);
+
+    return NULL;
+}
+
+static void *relay(void *arg)
+{
+    struct bench *b = arg;
+    char *buf = malloc(RELAY_BUF);
+    ssize_t len, off, n;
+
+    while ( buf && (len = read(b->relay_in, buf, RELAY_BUF)) != 0 )
+    {
+        if ( len < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            perror("relay read");
+            break;
+        }
+
+        for ( off = 0; off < len; off += n )
+        {
+            n = write(b->relay_out, buf + off, len - off);
+            if ( n < 0 && errno == EINTR )
+                n = 0;
+            else if ( n < 0 )
+            {
+                perror("relay write");
+                goto out;
+            }
+        }
+
+        pthread_mutex_lock(&b->lock);
+        b->bytes += len;
+        pthread_mutex_unlock(&b->lock);
+    }
+
+ out:
+    free(buf);
+    close(b->relay_out);
+    close(b->relay_in);
+
+    return NULL;
+}
+
+/* Connected pair of fds: fds[0] to write, fds[1] to read. */
+static int transport_pair(const char *transport, int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int s, sv[2];
+
+    if ( !strcmp(transport, "pipe") )
+    {
+        if ( pipe(sv) )
+            return -1;
+        fds[0] = sv[1];
+        fds[1] = sv[0];
+        return 0;
+    }
+
+    if ( !strcmp(transport, "unix") )
+    {
+        if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) )
+            return -1;
+        fds[0] = sv[0];
+        fds[1] = sv[1];
+        return 0;
+    }
+
+    if ( strcmp(transport, "tcp") )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if ( s < 0 )
+        return -1;
+    if ( bind(s, (struct sockaddr *)&addr, sizeof(addr)) ||
+         listen(s, 1) ||
+         getsockname(s, (struct sockaddr *)&addr, &len) )
+        goto err;
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if ( fds[0] < 0 )
+        goto err;
+    if ( connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) )
+    {
+        close(fds[0]);
+        goto err;
+    }
+    fds[1] = accept(s, NULL, NULL);
+    if ( fds[1] < 0 )
+    {
+        close(fds[0]);
+        goto err;
+    }
+    close(s);
+    return 0;
+
+ err:
+    close(s);
+    return -1;
+}
+
+static unsigned long compare_memory(struct bench *b)
+{
+    unsigned char *dmem;
+    unsigned long i, bad = 0;
+
+    if ( map_memory(b, b->dst, &dmem) )
+        return b->nr_pages;
+
+    for ( i = 0; i < b->nr_pages; i++ )
+        if ( memcmp(b->mem + (i << XC_PAGE_SHIFT),
+                    dmem + (i << XC_PAGE_SHIFT), XC_PAGE_SIZE) )
+        {
+            if ( !bad )
+                fprintf(stderr, "pfn %lx differs\n", i);
+            bad++;
+        }
+
+    munmap(dmem, b->nr_pages << XC_PAGE_SHIFT);
+
+    return bad;
+}
+
+static double secs(uint64_t us)
+{
+    return us / 1000000.0;
+}
+
+static void report(struct bench *b)
+{
+    uint64_t total = b->t_restore_done - b->t_start;
+    double mb = b->bytes / (1024.0 * 1024.0);
+
+    if ( !total )
+        total = 1;
+
+    printf("memory         %lu MiB, %lu pages\n",
+           b->nr_pages >> (20 - XC_PAGE_SHIFT), b->nr_pages);
+    printf("dirtied        %lu pages\n", b->dirtied);
+    printf("stream         %.1f MiB, %.1f MiB/s, %.0f pages/s\n",
+           mb, mb / secs(total),
+           b->bytes / (double)XC_PAGE_SIZE / secs(total));
+    printf("pre-copy       %.3f s, %.1f MiB\n",
+           secs(b->t_suspend - b->t_start),
+           b->bytes_at_suspend / (1024.0 * 1024.0));
+    printf("stop-and-copy  %.3f s, %.1f MiB\n",
+           secs(b->t_save_done - b->t_suspend),
+           (b->bytes - b->bytes_at_suspend) / (1024.0 * 1024.0));
+    printf("restore tail   %.3f s\n",
+           secs(b->t_restore_done - b->t_save_done));
+    printf("downtime       %.3f s\n",
+           secs(b->t_restore_done - b->t_suspend));
+}
+
+int main(int argc, char **argv)
+{
+    struct bench bench = { 0 }, *b = &bench;
+    const char *transport = "pipe";
+    unsigned long mb = 256, store_mfn = 0, console_mfn = 0, genid = 0;
+    unsigned int zero_pct = 25, dup_pct = 0;
+    int superpages = 0, verify = 0, restore_rc, out[2], in[2];
+    pthread_t save_thr, relay_thr;
+    int opt, rc = 1;
+
+    b->pattern = PAT_UNIFORM;
+    b->rate = 10000;
+    b->flags = XCFLAGS_LIVE | XCFLAGS_HVM;
+    b->src = b->dst = ~0U;
+    pthread_mutex_init(&b->lock, NULL);
+
+    while ( (opt = getopt(argc, argv, "m:p:r:t:z:d:i:f:F:snvh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'm':
+            mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            if ( !strcmp(optarg, "uniform") )
+                b->pattern = PAT_UNIFORM;
+            else if ( !strcmp(optarg, "hotspot") )
+                b->pattern = PAT_HOTSPOT;
+            else if ( !strcmp(optarg, "sweep") )
+                b->pattern = PAT_SWEEP;
+            else if ( !strncmp(optarg, "replay:", 7) )
+            {
+                b->pattern = PAT_REPLAY;
+                b->trace = fopen(optarg + 7, "r");
+                if ( !b->trace )
+                {
+                    perror(optarg + 7);
+                    return 1;
+                }
+            }
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            b->rate = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            transport = optarg;
+            break;
+        case 'z':
+            zero_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            dup_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            b->max_iters = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            b->max_factor = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            b->flags |= strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            superpages = 1;
+            break;
+        case 'n':
+            b->flags &= ~XCFLAGS_LIVE;
+            break;
+        case 'v':
+            verify = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( b->flags & XCFLAGS_POSTCOPY )
+    {
+        fprintf(stderr, "Post-copy is not supported\n");
+        return 1;
+    }
+
+    b->nr_pages = (mb << (20 - XC_PAGE_SHIFT)) & ~(SP_PAGES - 1);
+    if ( !b->nr_pages || zero_pct + dup_pct > 100 )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    b->xch = xc_interface_open(NULL, NULL, 0);
+    if ( !b->xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    if ( create_domain(b, 1, &b->src) ||
+         create_domain(b, 0, &b->dst) ||
+         map_memory(b, b->src, &b->mem) )
+        goto out;
+
+    fill_memory(b, zero_pct, dup_pct);
+
+    if ( transport_pair(transport, out) || transport_pair(transport, in) )
+    {
+        perror(transport);
+        goto out;
+    }
+    b->save_fd = out[0];
+    b->relay_in = out[1];
+    b->relay_out = in[0];
+
+    /* A failing end shouldn't take the whole program with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    b->t_start = now_us();
+
+    if ( pthread_create(&relay_thr, NULL, relay, b) )
+        goto out;
+    if ( (b->flags & XCFLAGS_LIVE) && b->rate &&
+         !pthread_create(&b->dirtier, NULL, dirtier, b) )
+        b->dirtying = 1;
+    if ( pthread_create(&save_thr, NULL, saver, b) )
+    {
+        stop_dirtier(b);
+        close(b->save_fd);
+        pthread_join(relay_thr, NULL);
+        goto out;
+    }
+
+    restore_rc = xc_domain_restore(b->xch, in[1], b->dst, 0, &store_mfn, 0,
+                                   0, &console_mfn, 0, 1, 1, superpages, 1,
+                                   0, &genid, NULL);
+    b->t_restore_done = now_us();
+    close(in[1]);
+
+    pthread_join(save_thr, NULL);
+    pthread_join(relay_thr, NULL);
+    stop_dirtier(b);
+
+    if ( b->save_rc || restore_rc )
+    {
+        fprintf(stderr, "save %s, restore %s\n",
+                b->save_rc ? "failed" : "succeeded",
+                restore_rc ? "failed" : "succeeded");
+        goto out;
+    }
+
+    report(b);
+    rc = 0;
+
+    if ( verify )
+    {
+        unsigned long bad = compare_memory(b);
+
+        printf("verify         %lu pages differ\n", bad);
+        if ( bad )
+            rc = 1;
+    }
+
+ out:
+    if ( b->mem )
+        munmap(b->mem, b->nr_pages << XC_PAGE_SHIFT);
+    if ( b->src != ~0U )
+        xc_domain_destroy(b->xch, b->src);
+    if ( b->dst != ~0U )
+        xc_domain_destroy(b->xch, b->dst);
+    if ( b->trace )
+        fclose(b->trace);
+    xc_interface_close(b->xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,109 @@
+/*
+ * Just enough of the hypervisor's environment to build
+ * xen/common/radix-tree.c, and include <xen/radix-tree.h>, as a user
+ * program.
+ */
+#ifndef __RADIX_TREE_HARNESS_H__
+#define __RADIX_TREE_HARNESS_H__
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Keep out the hypervisor's own headers. */
+#define __XEN_CONFIG_H__
+#define _LINUX_INIT_H
+#define _LINUX_BITOPS_H
+#define _I386_ERRNO_H
+#define __TYPES_H__
+#define __LIB_H__
+#define __XEN_RCUPDATE_H
+
+typedef char bool_t;
+
+#define BITS_PER_LONG (CHAR_BIT * sizeof(long))
+#define BITS_TO_LONGS(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#define min(x, y) ((x) < (y) ? (x) : (y))
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define BUG() abort()
+#define BUG_ON(p) do { if ( p ) BUG(); } while ( 0 )
+#define ASSERT assert
+
+#define __init
+#define __read_mostly
+#define EXPORT_SYMBOL(sym)
+/* The test calls radix_tree_setup() itself. */
+#define presmp_initcall(fn) int radix_tree_test_setup(void) { return fn(); }
+
+static inline void __set_bit(unsigned int nr, unsigned long *addr)
+{
+    addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void __clear_bit(unsigned int nr, unsigned long *addr)
+{
+    addr[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+static inline int test_bit(unsigned int nr, const unsigned long *addr)
+{
+    return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+/* Single threaded: RCU is trivial. */
+#define __rcu
+#define rcu_dereference(p) (p)
+#define rcu_assign_pointer(p, v) ((p) = (v))
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+static inline void call_rcu(struct rcu_head *head,
+                            void (*func)(struct rcu_head *head))
+{
+    func(head);
+}
+
+/* A cache of one object size is plain malloc(). */
+struct xmem_cache {
+    unsigned long size;
+};
+
+static inline struct xmem_cache *xmem_cache_create(
+    const char *name, unsigned long size, unsigned long align)
+{
+    struct xmem_cache *cache = malloc(sizeof(*cache));
+
+    if ( cache )
+        cache->size = size;
+    return cache;
+}
+#define xmem_cache_create_type(_name, _type) \
+    xmem_cache_create(_name, sizeof(_type), __alignof__(_type))
+
+static inline void *xmem_cache_alloc(struct xmem_cache *cache)
+{
+    return malloc(cache->size);
+}
+
+static inline void xmem_cache_free(struct xmem_cache *cache, void *obj)
+{
+    free(obj);
+}
+
+int radix_tree_test_setup(void);
+
+#endif /* __RADIX_TREE_HARNESS_H__ */
@@ -0,0 +1,3 @@
+#include "harness.h"
+
+#include "xen-radix-tree.c"
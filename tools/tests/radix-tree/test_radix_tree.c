@@ -0,0 +1,225 @@
+#include <stdio.h>
+
+#include "harness.h"
+#include <xen/radix-tree.h>
+
+/* Never NULL, and never looks like an indirect pointer. */
+#define ITEM(i) ((void *)(((unsigned long)(i) << 2) | 8))
+
+static unsigned long live_nodes;
+static long allocs_left = -1;
+
+static struct radix_tree_node *node_alloc(void *arg)
+{
+    struct radix_tree_node *node;
+
+    if ( allocs_left == 0 )
+        return NULL;
+    if ( allocs_left > 0 )
+        allocs_left--;
+
+    node = calloc(1, sizeof(*node));
+    if ( node )
+        live_nodes++;
+    return node;
+}
+
+static void node_free(struct radix_tree_node *node, void *arg)
+{
+    live_nodes--;
+    free(node);
+}
+
+static unsigned long freed;
+
+static void slot_free(void *item)
+{
+    freed++;
+}
+
+static void init(struct radix_tree_root *root)
+{
+    radix_tree_init(root);
+    radix_tree_set_alloc_callbacks(root, node_alloc, node_free, NULL);
+}
+
+/* Is exactly [first, first + nr) present, plus @extra (if not ~0)? */
+static int check_range(struct radix_tree_root *root, unsigned long first,
+                       unsigned long nr, unsigned long extra)
+{
+    unsigned long i;
+
+    for ( i = first > 64 ? first - 64 : 0; i < first + nr + 64; i++ )
+    {
+        void *item = radix_tree_lookup(root, i);
+
+        if ( (i >= first && i < first + nr) || i == extra )
+        {
+            if ( item != ITEM(i) )
+                return 0;
+        }
+        else if ( item )
+            return 0;
+    }
+
+    return 1;
+}
+
+static void *items[10000];
+
+static void **range_items(unsigned long first, unsigned long nr)
+{
+    unsigned long i;
+
+    for ( i = 0; i < nr; i++ )
+        items[i] = ITEM(first + i);
+    return items;
+}
+
+int main(int argc, char **argv)
+{
+    struct radix_tree_root root;
+    struct radix_tree_iter iter;
+    unsigned long nodes, i, n;
+    unsigned int height;
+    void *results[64];
+    void **slot;
+
+    radix_tree_test_setup();
+
+    printf("%-40s", "Testing insert_range...");
+    init(&root);
+    if ( radix_tree_insert_range(&root, 10, 5000, range_items(10, 5000)) ||
+         !check_range(&root, 10, 5000, ~0UL) ||
+         radix_tree_gang_lookup(&root, results, 5000, 64) != 10 ||
+         results[0] != ITEM(5000) )
+        goto fail;
+    printf("okay\n");
+
+    printf("%-40s", "Testing delete_range...");
+    freed = 0;
+    if ( radix_tree_delete_range(&root, 0, ~0UL, slot_free) != 5000 ||
+         freed != 5000 || root.rnode || live_nodes )
+        goto fail;
+    printf("okay\n");
+
+    printf("%-40s", "Testing insert_range over an item...");
+    init(&root);
+    if ( radix_tree_insert(&root, 100, ITEM(100)) )
+        goto fail;
+    nodes = live_nodes;
+    height = root.height;
+    if ( radix_tree_insert_range(&root, 50, 100, range_items(50, 100)) !=
+         -EEXIST ||
+         !check_range(&root, 100, 1, ~0UL) ||
+         live_nodes != nodes || root.height != height )
+        goto fail;
+    radix_tree_destroy(&root, NULL);
+    printf("okay\n");
+
+    printf("%-40s", "Testing insert_range unwinds growth...");
+    init(&root);
+    if ( radix_tree_insert(&root, 0, ITEM(0)) ||
+         radix_tree_insert(&root, 3, ITEM(3)) )
+        goto fail;
+    nodes = live_nodes;
+    height = root.height;
+    if ( radix_tree_insert_range(&root, 1, 10000, range_items(1, 10000)) !=
+         -EEXIST ||
+         !check_range(&root, 0, 1, 3) ||
+         live_nodes != nodes || root.height != height )
+        goto fail;
+    radix_tree_destroy(&root, NULL);
+    init(&root);
+    if ( radix_tree_insert(&root, 0, ITEM(0)) ||
+         radix_tree_insert_range(&root, 0, 5000, range_items(0, 5000)) !=
+         -EEXIST ||
+         !check_range(&root, 0, 1, ~0UL) ||
+         live_nodes || root.height )
+        goto fail;
+    radix_tree_destroy(&root, NULL);
+    printf("okay\n");
+
+    printf("%-40s", "Testing insert_range out of memory...");
+    init(&root);
+    if ( radix_tree_insert(&root, 7000, ITEM(7000)) )
+        goto fail;
+    nodes = live_nodes;
+    height = root.height;
+    allocs_left = 3;
+    if ( radix_tree_insert_range(&root, 0, 5000, range_items(0, 5000)) !=
+         -ENOMEM )
+        goto fail;
+    allocs_left = -1;
+    if ( !check_range(&root, 7000, 1, ~0UL) ||
+         live_nodes != nodes || root.height != height )
+        goto fail;
+    radix_tree_destroy(&root, NULL);
+    printf("okay\n");
+
+    printf("%-40s", "Testing tags...");
+    init(&root);
+    if ( radix_tree_insert_range(&root, 0, 300, range_items(0, 300)) ||
+         radix_tree_tagged(&root, 0) ||
+         radix_tree_tag_set(&root, 1000, 0) )
+        goto fail;
+    for ( i = 0; i < 300; i += 7 )
+        if ( radix_tree_tag_set(&root, i, 0) != ITEM(i) )
+            goto fail;
+    if ( !radix_tree_tagged(&root, 0) || radix_tree_tagged(&root, 1) ||
+         !radix_tree_tag_get(&root, 294, 0) ||
+         radix_tree_tag_get(&root, 295, 0) )
+        goto fail;
+    radix_tree_delete(&root, 7);
+    n = radix_tree_gang_lookup_tag(&root, results, 0, 64, 0);
+    if ( n != 42 || results[0] != ITEM(0) || results[1] != ITEM(14) ||
+         results[41] != ITEM(294) )
+        goto fail;
+    for ( i = 0; i < 300; i += 7 )
+        radix_tree_tag_clear(&root, i, 0);
+    if ( radix_tree_tagged(&root, 0) ||
+         radix_tree_gang_lookup_tag(&root, results, 0, 64, 0) )
+        goto fail;
+    radix_tree_destroy(&root, NULL);
+    printf("okay\n");
+
+    printf("%-40s", "Testing iterators...");
+    {
+        static const unsigned long idx[] = {
+            0, 63, 64, 4095, 4096, 1UL << 20, ~0UL
+        };
+
+        init(&root);
+        for ( i = 0; i < ARRAY_SIZE(idx); i++ )
+            if ( radix_tree_insert(&root, idx[i], ITEM(idx[i])) )
+                goto fail;
+        radix_tree_tag_set(&root, 64, 1);
+        radix_tree_tag_set(&root, ~0UL, 1);
+
+        n = 0;
+        radix_tree_for_each_slot ( slot, &root, &iter, 0 )
+            if ( n >= ARRAY_SIZE(idx) || iter.index != idx[n] ||
+                 *slot != ITEM(idx[n++]) )
+                goto fail;
+        if ( n != ARRAY_SIZE(idx) )
+            goto fail;
+
+        n = 0;
+        radix_tree_for_each_tagged ( slot, &root, &iter, 65, 1 )
+            if ( iter.index != ~0UL || n++ )
+                goto fail;
+        if ( n != 1 )
+            goto fail;
+
+        radix_tree_destroy(&root, NULL);
+        if ( live_nodes )
+            goto fail;
+    }
+    printf("okay\n");
+
+    return 0;
+
+ fail:
+    printf("failed!\n");
+    return 1;
+}
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #include <xen/xen.h>
 #include <sys/mman.h>
 
@@ -161,6 +162,295 @@ static struct x86_emulate_ops emulops = {
     .get_fpu    = get_fpu,
 };
 
+/*
+ * Benchmark mode: run representative instructions through the emulator,
+ * with ops standing in for the HVM ones, and report the cost of each.
+ * Accesses to the MMIO window and to I/O ports go to a device that takes
+ * no time, so what is measured is the emulator itself.
+ */
+
+#define BENCH_ITERS   1000000UL
+#define BENCH_MMIO    0xfee00000UL   /* never dereferenced */
+#define BENCH_REPS    64
+
+static uint32_t mmio_reg;
+
+static int bench_read(
+    unsigned int seg,
+    unsigned long offset,
+    void *p_data,
+    unsigned int bytes,
+    struct x86_emulate_ctxt *ctxt)
+{
+    if ( (offset & ~0xfffUL) == BENCH_MMIO )
+        memcpy(p_data, &mmio_reg, bytes > 4 ? 4 : bytes);
+    else
+        memcpy(p_data, (void *)offset, bytes);
+    return X86EMUL_OKAY;
+}
+
+static int bench_write(
+    unsigned int seg,
+    unsigned long offset,
+    void *p_data,
+    unsigned int bytes,
+    struct x86_emulate_ctxt *ctxt)
+{
+    if ( (offset & ~0xfffUL) == BENCH_MMIO )
+        memcpy(&mmio_reg, p_data, bytes > 4 ? 4 : bytes);
+    else
+        memcpy((void *)offset, p_data, bytes);
+    return X86EMUL_OKAY;
+}
+
+static int bench_cmpxchg(
+    unsigned int seg,
+    unsigned long offset,
+    void *old,
+    void *new,
+    unsigned int bytes,
+    struct x86_emulate_ctxt *ctxt)
+{
+    if ( memcmp((void *)offset, old, bytes) )
+    {
+        memcpy(old, (void *)offset, bytes);
+        return X86EMUL_OKAY;
+    }
+    memcpy((void *)offset, new, bytes);
+    return X86EMUL_OKAY;
+}
+
+static int bench_rep_ins(
+    uint16_t src_port,
+    enum x86_segment dst_seg,
+    unsigned long dst_offset,
+    unsigned int bytes_per_rep,
+    unsigned long *reps,
+    struct x86_emulate_ctxt *ctxt)
+{
+    memset((void *)dst_offset, 0xff, *reps * bytes_per_rep);
+    return X86EMUL_OKAY;
+}
+
+static int bench_rep_outs(
+    enum x86_segment src_seg,
+    unsigned long src_offset,
+    uint16_t dst_port,
+    unsigned int bytes_per_rep,
+    unsigned long *reps,
+    struct x86_emulate_ctxt *ctxt)
+{
+    return X86EMUL_OKAY;
+}
+
+static int bench_rep_movs(
+    enum x86_segment src_seg,
+    unsigned long src_offset,
+    enum x86_segment dst_seg,
+    unsigned long dst_offset,
+    unsigned int bytes_per_rep,
+    unsigned long *reps,
+    struct x86_emulate_ctxt *ctxt)
+{
+    memmove((void *)dst_offset, (void *)src_offset, *reps * bytes_per_rep);
+    return X86EMUL_OKAY;
+}
+
+static int bench_read_segment(
+    enum x86_segment seg,
+    struct segment_register *reg,
+    struct x86_emulate_ctxt *ctxt)
+{
+    /* Flat ring 0 segments, so port accesses need no TSS bitmap check. */
+    memset(reg, 0, sizeof(*reg));
+    reg->limit = ~0U;
+    reg->attr.fields.p = 1;
+    return X86EMUL_OKAY;
+}
+
+static int bench_read_io(
+    unsigned int port,
+    unsigned int bytes,
+    unsigned long *val,
+    struct x86_emulate_ctxt *ctxt)
+{
+    *val = ~0UL;
+    return X86EMUL_OKAY;
+}
+
+static int bench_write_io(
+    unsigned int port,
+    unsigned int bytes,
+    unsigned long val,
+    struct x86_emulate_ctxt *ctxt)
+{
+    return X86EMUL_OKAY;
+}
+
+/*
+ * CPUID is expensive when virtualised, and HVM guests see a policy which
+ * Xen computed up front, so answer from values read once.
+ */
+#define BENCH_CPUID_LEAVES 8
+static unsigned int cpuid_cache[BENCH_CPUID_LEAVES][4];
+
+static int bench_cpuid(
+    unsigned int *eax,
+    unsigned int *ebx,
+    unsigned int *ecx,
+    unsigned int *edx,
+    struct x86_emulate_ctxt *ctxt)
+{
+    if ( *eax >= BENCH_CPUID_LEAVES || *ecx )
+        return cpuid(eax, ebx, ecx, edx, ctxt);
+
+    *ebx = cpuid_cache[*eax][1];
+    *ecx = cpuid_cache[*eax][2];
+    *edx = cpuid_cache[*eax][3];
+    *eax = cpuid_cache[*eax][0];
+    return X86EMUL_OKAY;
+}
+
+static bool bench_has_mmx, bench_has_sse, bench_has_avx;
+
+static int bench_get_fpu(
+    void (*exception_callback)(void *, struct cpu_user_regs *),
+    void *exception_callback_arg,
+    enum x86_emulate_fpu_type type,
+    struct x86_emulate_ctxt *ctxt)
+{
+    switch ( type )
+    {
+    case X86EMUL_FPU_fpu:
+        return X86EMUL_OKAY;
+    case X86EMUL_FPU_mmx:
+        return bench_has_mmx ? X86EMUL_OKAY : X86EMUL_UNHANDLEABLE;
+    case X86EMUL_FPU_xmm:
+        return bench_has_sse ? X86EMUL_OKAY : X86EMUL_UNHANDLEABLE;
+    case X86EMUL_FPU_ymm:
+        return bench_has_avx ? X86EMUL_OKAY : X86EMUL_UNHANDLEABLE;
+    default:
+        return X86EMUL_UNHANDLEABLE;
+    }
+}
+
+static struct x86_emulate_ops bench_ops = {
+    .read         = bench_read,
+    .insn_fetch   = fetch,
+    .write        = bench_write,
+    .cmpxchg      = bench_cmpxchg,
+    .rep_ins      = bench_rep_ins,
+    .rep_outs     = bench_rep_outs,
+    .rep_movs     = bench_rep_movs,
+    .read_segment = bench_read_segment,
+    .read_io      = bench_read_io,
+    .write_io     = bench_write_io,
+    .cpuid        = bench_cpuid,
+    .get_fpu      = bench_get_fpu,
+};
+
+struct bench {
+    const char *name;
+    unsigned char insn[8];
+    unsigned int len;
+    unsigned int reps;      /* %ecx, for string instructions */
+    bool needs_sse2;        /* executed via a stub on the stack */
+};
+
+static const struct bench benches[] = {
+    { "movl %ecx,(%eax) [mmio]",        { 0x89, 0x08 }, 2 },
+    { "movl (%eax),%ecx [mmio]",        { 0x8b, 0x08 }, 2 },
+    { "movl %ecx,(%ebx) [ram]",         { 0x89, 0x0b }, 2 },
+    { "addl %ecx,(%ebx) [ram]",         { 0x01, 0x0b }, 2 },
+    { "lock cmpxchgl %ecx,(%ebx)",      { 0xf0, 0x0f, 0xb1, 0x0b }, 4 },
+    { "rep movsl [64 reps]",            { 0xf3, 0xa5 }, 2, BENCH_REPS },
+    { "rep movsb [64 reps]",            { 0xf3, 0xa4 }, 2, BENCH_REPS },
+    { "rep stosl [64 reps]",            { 0xf3, 0xab }, 2, BENCH_REPS },
+    { "outb %al,%dx",                   { 0xee }, 1 },
+    { "inl %dx,%eax",                   { 0xed }, 1 },
+    { "rep outsb [64 reps]",            { 0xf3, 0x6e }, 2, BENCH_REPS },
+    { "rep insl [64 reps]",             { 0xf3, 0x6d }, 2, BENCH_REPS },
+    { "movdqu %xmm0,(%ebx)",            { 0xf3, 0x0f, 0x7f, 0x03 }, 4, 0, 1 },
+    { "movdqu (%ebx),%xmm0",            { 0xf3, 0x0f, 0x6f, 0x03 }, 4, 0, 1 },
+    { "movdqu %xmm0,(%eax) [mmio]",     { 0xf3, 0x0f, 0x7f, 0x00 }, 4, 0, 1 },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Emulate each instruction iters times, to completion: a REP string
+ * instruction which the ops cannot do in one go takes several calls.
+ */
+static int run_bench(struct x86_emulate_ctxt *ctxt, char *instr,
+                     unsigned int *res, bool stack_exec, unsigned long iters)
+{
+    struct cpu_user_regs *regs = ctxt->regs;
+    unsigned long i, calls;
+    unsigned int b;
+    uint64_t t;
+    int rc;
+
+    for ( b = 0; b < BENCH_CPUID_LEAVES; b++ )
+    {
+        cpuid_cache[b][0] = b;
+        cpuid_cache[b][2] = 0;
+        cpuid(&cpuid_cache[b][0], &cpuid_cache[b][1],
+              &cpuid_cache[b][2], &cpuid_cache[b][3], NULL);
+    }
+    bench_has_mmx = cpu_has_mmx;
+    bench_has_sse = cpu_has_sse;
+    bench_has_avx = cpu_has_avx;
+
+    printf("%-36s %12s %10s\n", "Instruction", "ns/insn", "calls/insn");
+
+    for ( b = 0; b < sizeof(benches) / sizeof(benches[0]); b++ )
+    {
+        const struct bench *bench = &benches[b];
+
+        printf("%-36s ", bench->name);
+        if ( bench->needs_sse2 && !(stack_exec && cpu_has_sse2) )
+        {
+            printf("%12s\n", "skipped");
+            continue;
+        }
+
+        memcpy(instr, bench->insn, bench->len);
+        calls = 0;
+        t = now_ns();
+        for ( i = 0; i < iters; i++ )
+        {
+            regs->eflags = 0x200;
+            regs->eip    = (unsigned long)instr;
+            regs->eax    = BENCH_MMIO;
+            regs->ebx    = (unsigned long)res;
+            regs->ecx    = bench->reps;
+            regs->edx    = 0x80;
+            regs->esi    = (unsigned long)res;
+            regs->edi    = (unsigned long)res + MMAP_SZ / 2;
+            do {
+                rc = x86_emulate(ctxt, &bench_ops);
+                calls++;
+                if ( rc != X86EMUL_OKAY )
+                {
+                    printf("failed (%d)\n", rc);
+                    return 1;
+                }
+            } while ( regs->eip == (unsigned long)instr );
+        }
+        t = now_ns() - t;
+
+        printf("%12.1f %10.1f\n", (double)t / iters, (double)calls / iters);
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     struct x86_emulate_ctxt ctxt;
@@ -168,12 +458,20 @@ int main(int argc, char **argv)
     char *instr;
     unsigned int *res, i, j;
     unsigned long sp;
-    bool stack_exec;
+    bool stack_exec, bench = false;
+    unsigned long iters = BENCH_ITERS;
     int rc;
 #ifndef __x86_64__
     unsigned int bcdres_native, bcdres_emul;
 #endif
 
+    if ( argc > 1 && !strcmp(argv[1], "--bench") )
+    {
+        bench = true;
+        if ( argc > 2 )
+            iters = strtoul(argv[2], NULL, 0) ?: BENCH_ITERS;
+    }
+
     ctxt.regs = &regs;
     ctxt.force_writeback = 0;
     ctxt.addr_size = 8 * sizeof(void *);
@@ -198,6 +496,9 @@ int main(int argc, char **argv)
     if ( !stack_exec )
         printf("Warning: Stack could not be made executable (%d).\n", errno);
 
+    if ( bench )
+        return run_bench(&ctxt, instr, res, stack_exec, iters);
+
     printf("%-40s", "Testing addl %%ecx,(%%eax)...");
     instr[0] = 0x01; instr[1] = 0x08;
     regs.eflags = 0x200;
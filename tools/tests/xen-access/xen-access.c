@@ -284,8 +284,10 @@ xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
     }
 
     /* Initialise Xen */
-    rc = xc_mem_access_enable(xenaccess->xc_handle, xenaccess->mem_event.domain_id,
-                             &xenaccess->mem_event.evtchn_port);
+    rc = xc_mem_access_enable_ring(xenaccess->xc_handle,
+                                   xenaccess->mem_event.domain_id, 1,
+                                   XEN_MEM_EVENT_LAZY_KICK,
+                                   &xenaccess->mem_event.evtchn_port);
     if ( rc != 0 )
     {
         switch ( errno ) {
@@ -397,7 +399,6 @@ int get_request(mem_event_t *mem_event, mem_event_request_t *req)
 
     /* Update ring */
     back_ring->req_cons = req_cons;
-    back_ring->sring->req_event = req_cons + 1;
 
     mem_event_ring_unlock(mem_event);
 
@@ -465,7 +466,7 @@ int main(int argc, char *argv[])
     mem_event_request_t req;
     mem_event_response_t rsp;
     int rc = -1;
-    int rc1;
+    int rc1, more;
     xc_interface *xch;
     hvmmem_access_t default_access = HVMMEM_access_rwx;
     hvmmem_access_t after_first_access = HVMMEM_access_rwx;
@@ -600,10 +601,17 @@ int main(int argc, char *argv[])
             DPRINTF("Got event from Xen\n");
         }
 
-        while ( RING_HAS_UNCONSUMED_REQUESTS(&xenaccess->mem_event.back_ring) )
+        /* Xen only kicks us once we have asked for it, when the ring is
+         * empty */
+        for ( ; ; )
         {
             hvmmem_access_t access;
 
+            RING_FINAL_CHECK_FOR_REQUESTS(&xenaccess->mem_event.back_ring,
+                                          more);
+            if ( !more )
+                break;
+
             rc = get_request(&xenaccess->mem_event, &req);
             if ( rc != 0 )
             {
@@ -0,0 +1,585 @@
+/*
+ * xen-bench.c
+ *
+ * Micro-benchmarks of hypervisor primitives, for comparing Xen builds on
+ * the same hardware.  Each benchmark is run for a number of samples after
+ * a warm up, and reported as the minimum, median, mean, 99th percentile,
+ * maximum and standard deviation of a sample.
+ *
+ * Benchmarks are:
+ *   gnttab     a page granted to this domain, mapped and unmapped through
+ *              gntdev (GNTTABOP_map_grant_ref, then unmap)
+ *   evtchn     round trip between two event channel ports, bound to each
+ *              other and serviced by two threads
+ *   wake       one way latency from xc_evtchn_notify() until the thread
+ *              blocked on the other port runs, sent every -w us so that
+ *              the receiving vCPU has gone idle
+ *   map        xc_map_foreign_bulk() of a domain's memory, and munmap()
+ *   populate   XENMEM_populate_physmap of 4k pages into a domain, each
+ *              sample followed by XENMEM_decrease_reservation
+ *
+ * This domain plays both ends of the grant and event channel benchmarks,
+ * so no test guest is needed.  map and populate use an empty PV domain,
+ * created for the purpose and never started.
+ *
+ * Must be run as root, in dom0 or a domain allowed to create domains.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+
+struct bench {
+    xc_interface *xch;
+    uint32_t self;                  /* this domain's id */
+    uint32_t domid;                 /* the empty domain, or ~0 */
+    unsigned int samples, warmup;
+    unsigned long pages;            /* per map/populate sample */
+    unsigned int wake_us;
+
+    /* Event channels */
+    xc_evtchn *xce[2];
+    evtchn_port_t port[2];
+    pthread_t peer;
+    volatile int stop;
+    volatile uint64_t sent_ns;
+    uint64_t *wake_ns;
+    unsigned int nr_wake;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] [benchmark...]\n"
+            "  benchmarks: gnttab evtchn wake map populate (default all)\n"
+            "  -n SAMPLES   samples per benchmark (default 1000)\n"
+            "  -W SAMPLES   warm up samples, not reported (default 100)\n"
+            "  -m MB        memory per map/populate sample (default 64)\n"
+            "  -w US        interval between wake samples (default 1000)\n"
+            "  -D DOMID     this domain's id (default 0)\n", prog);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Statistics of the samples, in ns.  If units is non-zero, each sample
+ * also did that many units of work, and the median rate is added.
+ */
+static void report(const char *name, uint64_t *ns, unsigned int nr,
+                   unsigned long units, const char *unit)
+{
+    double mean = 0, var = 0;
+    unsigned int i;
+
+    if ( !nr )
+    {
+        printf("%-10s no samples\n", name);
+        return;
+    }
+
+    qsort(ns, nr, sizeof(*ns), cmp_u64);
+    for ( i = 0; i < nr; i++ )
+        mean += ns[i];
+    mean /= nr;
+    for ( i = 0; i < nr; i++ )
+        var += (ns[i] - mean) * (ns[i] - mean);
+    var /= nr;
+
+    printf("%-10s n=%u min %"PRIu64" med %"PRIu64" mean %.0f p99 %"PRIu64
+           " max %"PRIu64" sd %.0f ns", name, nr, ns[0], ns[nr / 2], mean,
+           ns[(nr * 99) / 100], ns[nr - 1], sqrt(var));
+    if ( units && ns[nr / 2] )
+        printf("  (%.0f %s/s)", units * 1e9 / ns[nr / 2], unit);
+    printf("\n");
+}
+
+/* Grant mapping */
+static int bench_gnttab(struct bench *b)
+{
+    xc_gntshr *gs = xc_gntshr_open(NULL, 0);
+    xc_gnttab *gt = xc_gnttab_open(NULL, 0);
+    uint64_t *ns = calloc(b->samples, sizeof(*ns));
+    unsigned int i;
+    uint32_t ref;
+    void *shared = NULL, *p;
+    uint64_t t;
+    int rc = -1;
+
+    if ( !gs || !gt || !ns )
+    {
+        perror("opening gntshr/gntdev");
+        goto out;
+    }
+
+    shared = xc_gntshr_share_pages(gs, b->self, 1, &ref, 1);
+    if ( !shared )
+    {
+        perror("xc_gntshr_share_pages");
+        goto out;
+    }
+
+    for ( i = 0; i < b->warmup + b->samples; i++ )
+    {
+        t = now_ns();
+        p = xc_gnttab_map_grant_ref(gt, b->self, ref, PROT_READ | PROT_WRITE);
+        if ( !p )
+        {
+            perror("xc_gnttab_map_grant_ref");
+            goto out;
+        }
+        xc_gnttab_munmap(gt, p, 1);
+        if ( i >= b->warmup )
+            ns[i - b->warmup] = now_ns() - t;
+    }
+
+    report("gnttab", ns, b->samples, 0, NULL);
+    rc = 0;
+
+ out:
+    if ( shared )
+        xc_gntshr_munmap(gs, shared, 1);
+    if ( gt )
+        xc_gnttab_close(gt);
+    if ( gs )
+        xc_gntshr_close(gs);
+    free(ns);
+    return rc;
+}
+
+/* Event channels: port[0] on xce[0] is bound to port[1] on xce[1]. */
+static int evtchn_open(struct bench *b)
+{
+    evtchn_port_or_error_t port;
+    int i;
+
+    for ( i = 0; i < 2; i++ )
+    {
+        b->xce[i] = xc_evtchn_open(NULL, 0);
+        if ( !b->xce[i] )
+        {
+            perror("xc_evtchn_open");
+            return -1;
+        }
+    }
+
+    port = xc_evtchn_bind_unbound_port(b->xce[0], b->self);
+    if ( port < 0 )
+    {
+        perror("xc_evtchn_bind_unbound_port");
+        return -1;
+    }
+    b->port[0] = port;
+
+    port = xc_evtchn_bind_interdomain(b->xce[1], b->self, b->port[0]);
+    if ( port < 0 )
+    {
+        perror("xc_evtchn_bind_interdomain");
+        return -1;
+    }
+    b->port[1] = port;
+
+    return 0;
+}
+
+static void evtchn_close(struct bench *b)
+{
+    int i;
+
+    for ( i = 0; i < 2; i++ )
+        if ( b->xce[i] )
+        {
+            xc_evtchn_close(b->xce[i]);
+            b->xce[i] = NULL;
+        }
+}
+
+/* Wait for an event on end i, and re-arm it. */
+static int evtchn_wait(struct bench *b, int i)
+{
+    evtchn_port_or_error_t port = xc_evtchn_pending(b->xce[i]);
+
+    if ( port < 0 )
+        return -1;
+    return xc_evtchn_unmask(b->xce[i], port);
+}
+
+/* The far end of the round trips: bounce each event back. */
+static void *evtchn_echo(void *arg)
+{
+    struct bench *b = arg;
+
+    while ( !evtchn_wait(b, 1) && !b->stop )
+        if ( xc_evtchn_notify(b->xce[1], b->port[1]) )
+            break;
+
+    return NULL;
+}
+
+static int bench_evtchn(struct bench *b)
+{
+    uint64_t *ns = calloc(b->samples, sizeof(*ns));
+    unsigned int i;
+    uint64_t t;
+    int rc = -1;
+
+    if ( !ns || evtchn_open(b) )
+        goto out;
+
+    b->stop = 0;
+    if ( pthread_create(&b->peer, NULL, evtchn_echo, b) )
+        goto out;
+
+    for ( i = 0; i < b->warmup + b->samples; i++ )
+    {
+        t = now_ns();
+        if ( xc_evtchn_notify(b->xce[0], b->port[0]) || evtchn_wait(b, 0) )
+        {
+            perror("event channel round trip");
+            break;
+        }
+        if ( i >= b->warmup )
+            ns[i - b->warmup] = now_ns() - t;
+    }
+
+    b->stop = 1;
+    xc_evtchn_notify(b->xce[0], b->port[0]);
+    pthread_join(b->peer, NULL);
+
+    if ( i == b->warmup + b->samples )
+    {
+        report("evtchn", ns, b->samples, 0, NULL);
+        rc = 0;
+    }
+
+ out:
+    evtchn_close(b);
+    free(ns);
+    return rc;
+}
+
+/* The receiving end of the wake samples: time from notify to running. */
+static void *evtchn_wake(void *arg)
+{
+    struct bench *b = arg;
+    uint64_t t;
+
+    while ( !evtchn_wait(b, 1) && !b->stop )
+    {
+        t = now_ns();
+        if ( b->nr_wake < b->warmup + b->samples )
+            b->wake_ns[b->nr_wake++] = t - b->sent_ns;
+        /* Acknowledge, so the next sample isn't sent too early. */
+        if ( xc_evtchn_notify(b->xce[1], b->port[1]) )
+            break;
+    }
+
+    return NULL;
+}
+
+static int bench_wake(struct bench *b)
+{
+    unsigned int i;
+    int rc = -1;
+
+    b->wake_ns = calloc(b->warmup + b->samples, sizeof(*b->wake_ns));
+    b->nr_wake = 0;
+    if ( !b->wake_ns || evtchn_open(b) )
+        goto out;
+
+    b->stop = 0;
+    if ( pthread_create(&b->peer, NULL, evtchn_wake, b) )
+        goto out;
+
+    for ( i = 0; i < b->warmup + b->samples; i++ )
+    {
+        usleep(b->wake_us);
+        b->sent_ns = now_ns();
+        if ( xc_evtchn_notify(b->xce[0], b->port[0]) || evtchn_wait(b, 0) )
+        {
+            perror("event channel wake");
+            break;
+        }
+    }
+
+    b->stop = 1;
+    xc_evtchn_notify(b->xce[0], b->port[0]);
+    pthread_join(b->peer, NULL);
+
+    if ( i == b->warmup + b->samples && b->nr_wake > b->warmup )
+    {
+        report("wake", b->wake_ns + b->warmup, b->nr_wake - b->warmup,
+               0, NULL);
+        rc = 0;
+    }
+
+ out:
+    evtchn_close(b);
+    free(b->wake_ns);
+    b->wake_ns = NULL;
+    return rc;
+}
+
+/* An empty PV domain, with room for b->pages of memory. */
+static int create_domain(struct bench *b)
+{
+    xen_domain_handle_t handle = { 0 };
+    uint32_t d = 0;
+
+    if ( b->domid != ~0U )
+        return 0;
+
+    if ( xc_domain_create(b->xch, 0, handle, 0, &d) )
+    {
+        perror("xc_domain_create");
+        return -1;
+    }
+    b->domid = d;
+
+    if ( xc_domain_max_vcpus(b->xch, b->domid, 1) ||
+         xc_domain_setmaxmem(b->xch, b->domid,
+                             b->pages << (XC_PAGE_SHIFT - 10)) )
+    {
+        perror("setting up domain");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int populate(struct bench *b, xen_pfn_t *pfns)
+{
+    unsigned long i;
+
+    for ( i = 0; i < b->pages; i++ )
+        pfns[i] = i;
+    if ( xc_domain_populate_physmap_exact(b->xch, b->domid, b->pages, 0, 0,
+                                          pfns) )
+    {
+        perror("xc_domain_populate_physmap_exact");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int depopulate(struct bench *b, xen_pfn_t *pfns)
+{
+    unsigned long i;
+
+    for ( i = 0; i < b->pages; i++ )
+        pfns[i] = i;
+    if ( xc_domain_decrease_reservation_exact(b->xch, b->domid, b->pages, 0,
+                                              pfns) )
+    {
+        perror("xc_domain_decrease_reservation_exact");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int bench_populate(struct bench *b)
+{
+    uint64_t *ns = calloc(b->samples, sizeof(*ns));
+    xen_pfn_t *pfns = malloc(b->pages * sizeof(*pfns));
+    unsigned int i;
+    uint64_t t;
+    int rc = -1;
+
+    if ( !ns || !pfns || create_domain(b) )
+        goto out;
+
+    for ( i = 0; i < b->warmup + b->samples; i++ )
+    {
+        t = now_ns();
+        if ( populate(b, pfns) )
+            goto out;
+        if ( i >= b->warmup )
+            ns[i - b->warmup] = now_ns() - t;
+        if ( depopulate(b, pfns) )
+            goto out;
+    }
+
+    report("populate", ns, b->samples, b->pages, "pages");
+    rc = 0;
+
+ out:
+    free(pfns);
+    free(ns);
+    return rc;
+}
+
+static int bench_map(struct bench *b)
+{
+    uint64_t *ns = calloc(b->samples, sizeof(*ns));
+    xen_pfn_t *pfns = malloc(b->pages * sizeof(*pfns));
+    int *errs = malloc(b->pages * sizeof(*errs));
+    unsigned long j;
+    unsigned int i;
+    void *p;
+    uint64_t t;
+    int rc = -1, populated = 0;
+
+    if ( !ns || !pfns || !errs || create_domain(b) || populate(b, pfns) )
+        goto out;
+    populated = 1;
+
+    for ( i = 0; i < b->warmup + b->samples; i++ )
+    {
+        for ( j = 0; j < b->pages; j++ )
+            pfns[j] = j;
+
+        t = now_ns();
+        p = xc_map_foreign_bulk(b->xch, b->domid, PROT_READ, pfns, errs,
+                                b->pages);
+        if ( !p )
+        {
+            perror("xc_map_foreign_bulk");
+            goto out;
+        }
+        munmap(p, b->pages << XC_PAGE_SHIFT);
+        if ( i >= b->warmup )
+            ns[i - b->warmup] = now_ns() - t;
+
+        for ( j = 0; j < b->pages; j++ )
+            if ( errs[j] )
+            {
+                fprintf(stderr, "pfn %lx not mapped: %d\n", j, errs[j]);
+                goto out;
+            }
+    }
+
+    report("map", ns, b->samples, b->pages, "pages");
+    rc = 0;
+
+ out:
+    if ( populated )
+        depopulate(b, pfns);
+    free(errs);
+    free(pfns);
+    free(ns);
+    return rc;
+}
+
+static const struct {
+    const char *name;
+    int (*fn)(struct bench *b);
+} benchmarks[] = {
+    { "gnttab",   bench_gnttab },
+    { "evtchn",   bench_evtchn },
+    { "wake",     bench_wake },
+    { "map",      bench_map },
+    { "populate", bench_populate },
+};
+#define NR_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv)
+{
+    struct bench bench = { 0 }, *b = &bench;
+    unsigned long mb = 64;
+    unsigned int i;
+    int run[NR_BENCHMARKS] = { 0 }, any = 0, opt, rc = 0;
+
+    b->samples = 1000;
+    b->warmup = 100;
+    b->wake_us = 1000;
+    b->domid = ~0U;
+
+    while ( (opt = getopt(argc, argv, "n:W:m:w:D:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            b->samples = strtoul(optarg, NULL, 0);
+            break;
+        case 'W':
+            b->warmup = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            b->wake_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            b->self = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for ( ; optind < argc; optind++ )
+    {
+        for ( i = 0; i < NR_BENCHMARKS; i++ )
+            if ( !strcmp(argv[optind], benchmarks[i].name) )
+                break;
+        if ( i == NR_BENCHMARKS )
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        run[i] = any = 1;
+    }
+
+    b->pages = mb << (20 - XC_PAGE_SHIFT);
+    if ( !b->samples || !b->pages )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    b->xch = xc_interface_open(NULL, NULL, 0);
+    if ( !b->xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    for ( i = 0; i < NR_BENCHMARKS; i++ )
+        if ( (!any || run[i]) && benchmarks[i].fn(b) )
+        {
+            fprintf(stderr, "%s failed\n", benchmarks[i].name);
+            rc = 1;
+        }
+
+    if ( b->domid != ~0U )
+        xc_domain_destroy(b->xch, b->domid);
+    xc_interface_close(b->xch);
+
+    return rc;
+}
@@ -0,0 +1,550 @@
+/*
+ * xenstore-bench.c
+ *
+ * Puts a xenstore daemon, C xenstored or oxenstored alike, under the kind
+ * of load creating many domains does, and measures how it copes.  Each of
+ * N simulated domains is a thread with its own connection, going round:
+ *
+ *   setup      a transaction writing the backend and frontend directories
+ *              of a few devices, much as the toolstack does, retried while
+ *              it fails with EAGAIN, then removing them again
+ *   poll       a backend reading the frontend's state, a number of times
+ *              per round
+ *   watch      every domain watching the backend directory of all the
+ *              others, so each write fires N watches, and the events are
+ *              drained every round
+ *
+ * Reported are the operations done per second, the 50th and 99th
+ * percentile latencies of single operations and of whole transactions,
+ * how often transactions had to be retried, the watch events delivered,
+ * and the daemon's resident memory before and after.
+ *
+ * Everything is done under /bench, which is removed at the end.  The
+ * daemon is reached through its socket, or through the xenbus device, and
+ * so the ring, when given -t ring.  Must be run in dom0, as root.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <xenstore.h>
+
+#define ROOT            "/bench"
+#define PIDFILE         "/var/run/xenstored.pid"
+
+#define MIX_SETUP       (1 << 0)
+#define MIX_POLL        (1 << 1)
+#define MIX_WATCH       (1 << 2)
+
+/* Latencies, in us */
+struct samples {
+    uint32_t *us;
+    unsigned long nr, max;
+};
+
+struct bench;
+
+struct domain {
+    struct bench *b;
+    unsigned int id;
+    pthread_t thread;
+    struct xs_handle *xsh;
+    int failed;
+
+    unsigned long ops, txns, retries, events;
+    struct samples op_lat, txn_lat;
+};
+
+struct bench {
+    unsigned int nr_domains, nr_devices, nr_polls, mix;
+    int ring;
+    uint64_t duration;              /* us */
+    volatile int stop;
+    struct domain *domains;
+};
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n DOMAINS   simulated domains (default 16)\n"
+            "  -v DEVICES   devices each sets up per round (default 2)\n"
+            "  -p POLLS     frontend state reads per round (default 4)\n"
+            "  -m MIX       any of s(etup), p(oll) and w(atch) "
+            "(default spw)\n"
+            "  -d SECONDS   how long to run (default 10)\n"
+            "  -t TRANSPORT socket or ring (default socket)\n"
+            "  -P PID       the daemon's, for its memory (default from "
+            PIDFILE ")\n", prog);
+}
+
+static struct xs_handle *open_store(struct bench *b)
+{
+    return b->ring ? xs_domain_open() : xs_open(XS_OPEN_SOCKETONLY);
+}
+
+static void record(struct samples *s, uint64_t start)
+{
+    uint32_t *us;
+
+    if ( s->nr == s->max )
+    {
+        us = realloc(s->us, (s->max ? s->max * 2 : 4096) * sizeof(*us));
+        if ( !us )
+            return;
+        s->us = us;
+        s->max = s->max ? s->max * 2 : 4096;
+    }
+    s->us[s->nr++] = now_us() - start;
+}
+
+/* Operations that fail, other than by a transaction conflicting, end it. */
+static int write_key(struct domain *d, xs_transaction_t t, const char *dir,
+                     const char *key, const char *value)
+{
+    char path[256];
+    uint64_t start = now_us();
+
+    snprintf(path, sizeof(path), "%s/%s", dir, key);
+    if ( !xs_write(d->xsh, t, path, value, strlen(value)) )
+        return -1;
+    record(&d->op_lat, start);
+    d->ops++;
+    return 0;
+}
+
+static int setup_devices(struct domain *d, unsigned int round)
+{
+    struct bench *b = d->b;
+    char be[128], fe[128], val[64];
+    xs_transaction_t t;
+    uint64_t start = now_us();
+    unsigned int dev;
+    int rc;
+
+ again:
+    t = xs_transaction_start(d->xsh);
+    if ( t == XBT_NULL )
+        return -1;
+
+    for ( dev = 0; dev < b->nr_devices; dev++ )
+    {
+        snprintf(be, sizeof(be), ROOT "/backend/vif/%u/%u", d->id, dev);
+        snprintf(fe, sizeof(fe), ROOT "/domain/%u/device/vif/%u",
+                 d->id, dev);
+        snprintf(val, sizeof(val), "00:16:3e:%02x:%02x:%02x",
+                 d->id & 0xff, dev & 0xff, round & 0xff);
+
+        rc = write_key(d, t, be, "frontend", fe) ||
+             write_key(d, t, be, "frontend-id", "1") ||
+             write_key(d, t, be, "online", "1") ||
+             write_key(d, t, be, "state", "1") ||
+             write_key(d, t, be, "script", "/etc/xen/scripts/vif-bridge") ||
+             write_key(d, t, be, "mac", val) ||
+             write_key(d, t, be, "bridge", "xenbr0") ||
+             write_key(d, t, be, "handle", "0") ||
+             write_key(d, t, fe, "backend", be) ||
+             write_key(d, t, fe, "backend-id", "0") ||
+             write_key(d, t, fe, "state", "1") ||
+             write_key(d, t, fe, "handle", "0") ||
+             write_key(d, t, fe, "mac", val);
+        if ( rc )
+        {
+            xs_transaction_end(d->xsh, t, true);
+            return -1;
+        }
+    }
+
+    if ( !xs_transaction_end(d->xsh, t, false) )
+    {
+        if ( errno != EAGAIN )
+            return -1;
+        d->retries++;
+        goto again;
+    }
+    record(&d->txn_lat, start);
+    d->txns++;
+
+    return 0;
+}
+
+static int poll_state(struct domain *d)
+{
+    char path[128];
+    unsigned int i, len;
+    uint64_t start;
+    void *val;
+
+    snprintf(path, sizeof(path), ROOT "/domain/%u/device/vif/0/state",
+             d->id);
+    for ( i = 0; i < d->b->nr_polls; i++ )
+    {
+        start = now_us();
+        val = xs_read(d->xsh, XBT_NULL, path, &len);
+        /* Not there between a teardown and the next setup */
+        if ( !val && errno != ENOENT )
+            return -1;
+        free(val);
+        record(&d->op_lat, start);
+        d->ops++;
+    }
+
+    return 0;
+}
+
+static int teardown_devices(struct domain *d)
+{
+    char path[128];
+    uint64_t start;
+
+    snprintf(path, sizeof(path), ROOT "/backend/vif/%u", d->id);
+    start = now_us();
+    if ( !xs_rm(d->xsh, XBT_NULL, path) )
+        return -1;
+    record(&d->op_lat, start);
+
+    snprintf(path, sizeof(path), ROOT "/domain/%u", d->id);
+    start = now_us();
+    if ( !xs_rm(d->xsh, XBT_NULL, path) )
+        return -1;
+    record(&d->op_lat, start);
+
+    d->ops += 2;
+    return 0;
+}
+
+static void drain_watches(struct domain *d)
+{
+    char **vec;
+
+    while ( (vec = xs_check_watch(d->xsh)) != NULL )
+    {
+        free(vec);
+        d->events++;
+    }
+}
+
+static void *domain_thread(void *arg)
+{
+    struct domain *d = arg;
+    struct bench *b = d->b;
+    unsigned int round;
+
+    for ( round = 0; !b->stop; round++ )
+    {
+        if ( (b->mix & MIX_SETUP) && setup_devices(d, round) )
+            goto fail;
+        if ( (b->mix & MIX_POLL) && poll_state(d) )
+            goto fail;
+        if ( (b->mix & MIX_SETUP) && teardown_devices(d) )
+            goto fail;
+        if ( b->mix & MIX_WATCH )
+            drain_watches(d);
+    }
+
+    return NULL;
+
+ fail:
+    fprintf(stderr, "domain %u: %s\n", d->id, strerror(errno));
+    d->failed = 1;
+    return NULL;
+}
+
+/* The resident and peak resident memory of a process, in kB. */
+static int daemon_memory(pid_t pid, unsigned long *rss, unsigned long *hwm)
+{
+    char path[64], line[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ( pid <= 0 || (f = fopen(path, "r")) == NULL )
+        return -1;
+
+    *rss = *hwm = 0;
+    while ( fgets(line, sizeof(line), f) )
+    {
+        sscanf(line, "VmRSS: %lu", rss);
+        sscanf(line, "VmHWM: %lu", hwm);
+    }
+    fclose(f);
+
+    return 0;
+}
+
+static pid_t daemon_pid(void)
+{
+    FILE *f = fopen(PIDFILE, "r");
+    int pid = 0;
+
+    if ( f )
+    {
+        if ( fscanf(f, "%d", &pid) != 1 )
+            pid = 0;
+        fclose(f);
+    }
+
+    return pid;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static struct samples *samples_of(struct domain *d, int txn)
+{
+    return txn ? &d->txn_lat : &d->op_lat;
+}
+
+/* Merge the samples of all domains into the first's, sorted. */
+static struct samples *merge(struct bench *b, int txn)
+{
+    struct samples *all = samples_of(&b->domains[0], txn), *s;
+    unsigned long nr = 0;
+    uint32_t *us;
+    unsigned int i;
+
+    for ( i = 0; i < b->nr_domains; i++ )
+        nr += samples_of(&b->domains[i], txn)->nr;
+    us = realloc(all->us, (nr ? nr : 1) * sizeof(*us));
+    if ( !us )
+        return NULL;
+    all->us = us;
+    all->max = nr;
+
+    for ( i = 1; i < b->nr_domains; i++ )
+    {
+        s = samples_of(&b->domains[i], txn);
+        memcpy(all->us + all->nr, s->us, s->nr * sizeof(*us));
+        all->nr += s->nr;
+        free(s->us);
+        s->us = NULL;
+        s->nr = s->max = 0;
+    }
+    qsort(all->us, all->nr, sizeof(*us), cmp_u32);
+
+    return all;
+}
+
+static void report_latency(const char *what, struct samples *s)
+{
+    if ( !s || !s->nr )
+    {
+        printf("%-14s none\n", what);
+        return;
+    }
+    printf("%-14s p50 %" PRIu32 " us, p99 %" PRIu32 " us, max %" PRIu32
+           " us\n", what, s->us[s->nr / 2], s->us[s->nr * 99 / 100],
+           s->us[s->nr - 1]);
+}
+
+static void report(struct bench *b, uint64_t elapsed)
+{
+    unsigned long ops = 0, txns = 0, retries = 0, events = 0;
+    double secs = elapsed / 1000000.0;
+    unsigned int i;
+
+    for ( i = 0; i < b->nr_domains; i++ )
+    {
+        ops += b->domains[i].ops;
+        txns += b->domains[i].txns;
+        retries += b->domains[i].retries;
+        events += b->domains[i].events;
+    }
+
+    printf("domains        %u, for %.1f s\n", b->nr_domains, secs);
+    printf("operations     %lu, %.0f/s\n", ops, ops / secs);
+    report_latency("op latency", merge(b, 0));
+    printf("transactions   %lu, %.0f/s, %lu retries (%.1f%%)\n",
+           txns, txns / secs, retries,
+           txns + retries ? 100.0 * retries / (txns + retries) : 0.0);
+    report_latency("txn latency", merge(b, 1));
+    if ( b->mix & MIX_WATCH )
+        printf("watch events   %lu, %.0f/s\n", events, events / secs);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench bench = { 0 }, *b = &bench;
+    struct xs_handle *xsh;
+    unsigned long rss0, hwm0, rss1, hwm1;
+    uint64_t start;
+    unsigned int i, started = 0;
+    pid_t pid = 0;
+    char *m;
+    int opt, mem, rc = 1;
+
+    b->nr_domains = 16;
+    b->nr_devices = 2;
+    b->nr_polls = 4;
+    b->mix = MIX_SETUP | MIX_POLL | MIX_WATCH;
+    b->duration = 10 * 1000000ULL;
+
+    while ( (opt = getopt(argc, argv, "n:v:p:m:d:t:P:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            b->nr_domains = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            b->nr_devices = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            b->nr_polls = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            b->mix = 0;
+            for ( m = optarg; *m; m++ )
+            {
+                if ( *m == 's' )
+                    b->mix |= MIX_SETUP;
+                else if ( *m == 'p' )
+                    b->mix |= MIX_POLL;
+                else if ( *m == 'w' )
+                    b->mix |= MIX_WATCH;
+                else
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+            }
+            break;
+        case 'd':
+            b->duration = strtoull(optarg, NULL, 0) * 1000000ULL;
+            break;
+        case 't':
+            if ( !strcmp(optarg, "ring") )
+                b->ring = 1;
+            else if ( strcmp(optarg, "socket") )
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'P':
+            pid = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !b->nr_domains || !b->duration || !b->mix ||
+         ((b->mix & MIX_SETUP) && !b->nr_devices) )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if ( !pid )
+        pid = daemon_pid();
+    mem = daemon_memory(pid, &rss0, &hwm0);
+
+    b->domains = calloc(b->nr_domains, sizeof(*b->domains));
+    if ( !b->domains )
+        return 1;
+
+    /* Set up every connection before any starts generating load */
+    for ( i = 0; i < b->nr_domains; i++ )
+    {
+        struct domain *d = &b->domains[i];
+
+        d->b = b;
+        d->id = i + 1;
+        d->xsh = open_store(b);
+        if ( !d->xsh )
+        {
+            perror("opening xenstore");
+            goto out;
+        }
+        if ( (b->mix & MIX_WATCH) &&
+             !xs_watch(d->xsh, ROOT "/backend", "bench") )
+        {
+            perror("xs_watch");
+            goto out;
+        }
+    }
+
+    start = now_us();
+    for ( ; started < b->nr_domains; started++ )
+        if ( pthread_create(&b->domains[started].thread, NULL,
+                            domain_thread, &b->domains[started]) )
+        {
+            perror("pthread_create");
+            break;
+        }
+
+    while ( started == b->nr_domains && now_us() - start < b->duration )
+        sleep(1);
+    b->stop = 1;
+    for ( i = 0; i < started; i++ )
+        pthread_join(b->domains[i].thread, NULL);
+
+    if ( started == b->nr_domains )
+    {
+        rc = 0;
+        for ( i = 0; i < b->nr_domains; i++ )
+            if ( b->domains[i].failed )
+                rc = 1;
+        report(b, now_us() - start);
+        if ( mem == 0 && daemon_memory(pid, &rss1, &hwm1) == 0 )
+            printf("daemon memory  %lu kB resident, was %lu kB; "
+                   "peak %lu kB, was %lu kB\n", rss1, rss0, hwm1, hwm0);
+        else
+            printf("daemon memory  unknown, give -P\n");
+    }
+
+ out:
+    xsh = b->domains[0].xsh;
+    if ( xsh )
+        xs_rm(xsh, XBT_NULL, ROOT);
+    for ( i = 0; i < b->nr_domains; i++ )
+    {
+        if ( b->domains[i].xsh )
+            xs_close(b->domains[i].xsh);
+        free(b->domains[i].op_lat.us);
+        free(b->domains[i].txn_lat.us);
+    }
+    free(b->domains);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
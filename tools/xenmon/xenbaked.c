@@ -41,8 +41,8 @@
 #include <xenctrl.h>
 #include <xen/xen.h>
 #include <string.h>
-#include <sys/select.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #define PERROR(_m, _a...)                                       \
 do {                                                            \
@@ -74,6 +74,9 @@ typedef struct { int counter; } atomic_t;
 #define MHZ
 #define CPU_FREQ 2660 MHZ
 
+/* records taken from one cpu's buffer before moving on to the next */
+#define AGGREGATE_BATCH 256
+
 /***** The code **************************************************************/
 
 typedef struct settings_st {
@@ -81,27 +84,26 @@ typedef struct settings_st {
     unsigned long new_data_thresh;
     unsigned long ms_per_sample;
     double cpu_freq;
+    unsigned int nr_threads;
+    int count_io;
 } settings_t;
 
-struct t_struct {
-    const struct t_info *t_info; /* Structure with information about individual buffers */
-    struct t_buf **meta;    /* Pointers to trace buffer metadata */
-    unsigned char **data;   /* Pointers to trace buffer data areas */
-};
-
 settings_t opts;
 
-int interrupted = 0; /* gets set if we get a SIGHUP */
-int rec_count = 0;
+volatile int interrupted = 0; /* gets set if we get a SIGHUP */
 int wakeups = 0;
 time_t start_time;
 int dom0_flips = 0;
 
-_new_qos_data *new_qos;
 _new_qos_data **cpu_qos_data;
 
-int global_cpu;
-uint64_t global_now;
+/*
+ * Each cpu's records are processed by one aggregation thread, which alone
+ * writes that cpu's qos page; these refer to the record in hand.
+ */
+static __thread _new_qos_data *new_qos;
+static __thread int global_cpu;
+static __thread uint64_t global_now;
 
 // array of currently running domains, indexed by cpu
 int *running = NULL;
@@ -111,8 +113,9 @@ int NCPU = 0;
 
 
 static void advance_next_datapoint(uint64_t);
+static void sync_slot(int cpu, int idx);
 static void alloc_qos_data(int ncpu);
-static int process_record(int, struct t_rec *);
+static void process_record(const xc_tbuf_rec_t *);
 static void qos_kill_thread(int domid);
 
 
@@ -184,7 +187,7 @@ typedef struct
     char *text;
 } stat_map_t;
 
-stat_map_t stat_map[] = {
+static stat_map_t stat_map[] = {
     { 0,       0, 	    "Other" },
     { 0, TRC_SCHED_DOM_ADD, "Add Domain" },
     { 0, TRC_SCHED_DOM_REM, "Remove Domain" },
@@ -201,6 +204,45 @@ stat_map_t stat_map[] = {
     { 0,      0, 		 0  }
 };
 
+#define NR_STATS (sizeof(stat_map) / sizeof(stat_map[0]))
+
+/* An aggregation thread, which processes cpus first_cpu, first_cpu +
+ * nr_aggregators and so on, and counts what it saw of its own */
+typedef struct aggregator_st {
+    pthread_t thread;
+    unsigned int first_cpu;
+    int rec_count;
+    int event_count[NR_STATS];
+} aggregator_t;
+
+static aggregator_t *aggregators;
+static unsigned int nr_aggregators;
+static __thread aggregator_t *self;
+
+static xc_tbuf_reader_t *tr;
+
+/* Bumped, under wake_lock, each time the aggregators should look again */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int wake_gen;
+
+/*
+ * A domain has the same slot in the domain_info and qdata arrays of every
+ * cpu's page.  Slots are handed out under slots_lock and published with a
+ * sequence count (odd while being changed), which each aggregation thread
+ * checks against the one it last saw when it starts a new sample.
+ */
+static struct {
+    unsigned int seq;
+    int domid;
+    int in_use;
+} slots[NDOMAINS];
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int (*cpu_slot_seq)[NDOMAINS];
+
+/* Page flips counted for each cpu by the others, to be folded into its page */
+static unsigned int (*io_pending)[NDOMAINS];
+
 
 static void check_gotten_sum(void)
 {
@@ -230,9 +272,17 @@ static void dump_stats(void)
 {
     stat_map_t *smt = stat_map;
     time_t end_time, run_time;
+    int rec_count = 0;
+    unsigned int i, j;
 
     time(&end_time);
 
+    for (i = 0; i < nr_aggregators; i++) {
+        rec_count += aggregators[i].rec_count;
+        for (j = 0; j < NR_STATS; j++)
+            stat_map[j].event_count += aggregators[i].event_count[j];
+    }
+
     run_time = end_time - start_time;
 
     printf("Event counts:\n");
@@ -252,203 +302,102 @@ static void dump_stats(void)
 
 static void log_event(int event_id) 
 {
-    stat_map_t *smt = stat_map;
-
-    //  printf("event_id = 0x%x\n", event_id);
+    int i;
 
-    while (smt->text != NULL) {
-        if (smt->event_id == event_id) {
-            smt->event_count++;
+    for (i = 1; stat_map[i].text != NULL; i++) {
+        if (stat_map[i].event_id == event_id) {
+            self->event_count[i]++;
             return;
         }
-        smt++;
     }
-    if (smt->text == NULL)
-        stat_map[0].event_count++;	// other
-}
-
-int virq_port;
-xc_evtchn *xce_handle = NULL;
-
-/* Returns the event channel handle. */
-/* Stolen from xenstore code */
-static int eventchn_init(void)
-{
-    int rc;
-  
-    // to revert to old way:
-    if (0)
-        return -1;
-  
-    xce_handle = xc_evtchn_open(NULL, 0);
-
-    if (xce_handle == NULL)
-        perror("Failed to open evtchn device");
-  
-    if ((rc = xc_evtchn_bind_virq(xce_handle, VIRQ_TBUF)) == -1)
-        perror("Failed to bind to domain exception virq port");
-    virq_port = rc;
-  
-    return xce_handle == NULL ? -1 : 0;
-}
-
-static void wait_for_event(void)
-{
-    int ret;
-    fd_set inset;
-    evtchn_port_t port;
-    struct timeval tv;
-    int evtchn_fd;
-  
-    if (xce_handle == NULL) {
-        nanosleep(&opts.poll_sleep, NULL);
-        return;
-    }
-
-    evtchn_fd = xc_evtchn_fd(xce_handle);
-
-    FD_ZERO(&inset);
-    FD_SET(evtchn_fd, &inset);
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    // tv = millis_to_timespec(&opts.poll_sleep);
-    ret = select(evtchn_fd+1, &inset, NULL, NULL, &tv);
-  
-    if ( (ret == 1) && FD_ISSET(evtchn_fd, &inset)) {
-        if ((port = xc_evtchn_pending(xce_handle)) == -1)
-            perror("Failed to read from event fd");
-    
-        //    if (port == virq_port)
-        //      printf("got the event I was looking for\r\n");
-
-        if (xc_evtchn_unmask(xce_handle, port) == -1)
-            perror("Failed to write to event fd");
-    }
-}
-
-static void get_tbufs(unsigned long *mfn, unsigned long *size)
-{
-    xc_interface *xc_handle = xc_interface_open(0,0,0);
-    int ret;
-
-    if ( !xc_handle ) 
-    {
-        exit(EXIT_FAILURE);
-    }
-
-    ret = xc_tbuf_enable(xc_handle, DEFAULT_TBUF_SIZE, mfn, size);
-
-    if ( ret != 0 )
-    {
-        perror("Couldn't enable trace buffers");
-        exit(1);
-    }
-
-    xc_interface_close(xc_handle);
+    self->event_count[0]++;	// other
 }
 
 static void disable_tracing(void)
 {
     xc_interface *xc_handle = xc_interface_open(0,0,0);
     xc_tbuf_disable(xc_handle);  
+    xc_tbuf_set_evt_mask(xc_handle, TRC_ALL);
     xc_interface_close(xc_handle);
 }
 
 /**
- * map_tbufs - memory map Xen trace buffers into user space
- * @tbufs_mfn: mfn of the trace buffers
- * @num:       number of trace buffers to map
- * @size:      size of each trace buffer
- *
- * Maps the Xen trace buffers them into process address space.
+ * get_num_cpus - get the number of logical CPUs
  */
-static struct t_struct *map_tbufs(unsigned long tbufs_mfn, unsigned int num,
-                                  unsigned long tinfo_size)
+static unsigned int get_num_cpus(void)
 {
-    xc_interface *xc_handle;
-    static struct t_struct tbufs = { 0 };
-    int i;
-
-    xc_handle = xc_interface_open(0,0,0);
-    if ( !xc_handle ) 
-    {
-        exit(EXIT_FAILURE);
-    }
-
-    /* Map t_info metadata structure */
-    tbufs.t_info = xc_map_foreign_range(xc_handle, DOMID_XEN, tinfo_size,
-                                        PROT_READ, tbufs_mfn);
-
-    if ( tbufs.t_info == 0 ) 
-    {
-        PERROR("Failed to mmap trace buffers");
-        exit(EXIT_FAILURE);
-    }
+    xc_physinfo_t physinfo = { 0 };
+    xc_interface *xc_handle = xc_interface_open(0,0,0);
+    int ret;
 
-    if ( tbufs.t_info->tbuf_size == 0 )
-    {
-        fprintf(stderr, "%s: tbuf_size 0!\n", __func__);
-        exit(EXIT_FAILURE);
-    }
+    ret = xc_physinfo(xc_handle, &physinfo);
 
-    /* Map per-cpu buffers */
-    tbufs.meta = (struct t_buf **)calloc(num, sizeof(struct t_buf *));
-    tbufs.data = (unsigned char **)calloc(num, sizeof(unsigned char *));
-    if ( tbufs.meta == NULL || tbufs.data == NULL )
+    if ( ret != 0 )
     {
-        PERROR( "Failed to allocate memory for buffer pointers\n");
+        PERROR("Failure to get logical CPU count from Xen");
         exit(EXIT_FAILURE);
     }
 
-    for(i=0; i<num; i++)
-    {
-        
-        const uint32_t *mfn_list = (const uint32_t *)tbufs.t_info
-                                   + tbufs.t_info->mfn_offset[i];
-        int j;
-        xen_pfn_t pfn_list[tbufs.t_info->tbuf_size];
-
-        for ( j=0; j<tbufs.t_info->tbuf_size; j++)
-            pfn_list[j] = (xen_pfn_t)mfn_list[j];
-
-        tbufs.meta[i] = xc_map_foreign_batch(xc_handle, DOMID_XEN,
-                                             PROT_READ | PROT_WRITE,
-                                             pfn_list,
-                                             tbufs.t_info->tbuf_size);
-        if ( tbufs.meta[i] == NULL )
-        {
-            PERROR("Failed to map cpu buffer!");
-            exit(EXIT_FAILURE);
-        }
-        tbufs.data[i] = (unsigned char *)(tbufs.meta[i]+1);
-    }
-
     xc_interface_close(xc_handle);
+    opts.cpu_freq = (double)physinfo.cpu_khz/1000.0;
 
-    return &tbufs;
+    return physinfo.max_cpu_id + 1;
 }
 
 /**
- * get_num_cpus - get the number of logical CPUs
+ * aggregate - process the records of an aggregator's cpus as they come
+ * @arg:       the aggregator
  */
-static unsigned int get_num_cpus(void)
+static void *aggregate(void *arg)
 {
-    xc_physinfo_t physinfo = { 0 };
-    xc_interface *xc_handle = xc_interface_open(0,0,0);
-    int ret;
+    aggregator_t *agg = arg;
+    xc_tbuf_rec_t rec;
+    unsigned int cpu, gen, n;
+    int rc, busy;
 
-    ret = xc_physinfo(xc_handle, &physinfo);
+    self = agg;
 
-    if ( ret != 0 )
+    while ( !interrupted )
     {
-        PERROR("Failure to get logical CPU count from Xen");
-        exit(EXIT_FAILURE);
+        pthread_mutex_lock(&wake_lock);
+        gen = wake_gen;
+        pthread_mutex_unlock(&wake_lock);
+
+        /* Take turns at our cpus' buffers until all are empty */
+        do {
+            busy = 0;
+            for ( cpu = agg->first_cpu; cpu < NCPU; cpu += nr_aggregators )
+            {
+                rc = 0;
+                for ( n = 0; n < AGGREGATE_BATCH && !interrupted &&
+                          (rc = xc_tbuf_reader_next_cpu(tr, cpu, &rec)) > 0;
+                      n++ )
+                    process_record(&rec);
+                if ( rc < 0 )
+                {
+                    PERROR("Failed to read the trace buffer of cpu %u", cpu);
+                    interrupted = 1;
+                }
+                if ( n == AGGREGATE_BATCH )
+                    busy = 1;
+            }
+        } while ( busy && !interrupted );
+
+        pthread_mutex_lock(&wake_lock);
+        while ( !interrupted && wake_gen == gen )
+            pthread_cond_wait(&wake_cond, &wake_lock);
+        pthread_mutex_unlock(&wake_lock);
     }
 
-    xc_interface_close(xc_handle);
-    opts.cpu_freq = (double)physinfo.cpu_khz/1000.0;
+    return NULL;
+}
 
-    return physinfo.nr_cpus;
+static void wake_aggregators(void)
+{
+    pthread_mutex_lock(&wake_lock);
+    wake_gen++;
+    pthread_cond_broadcast(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
 }
 
 /**
@@ -456,18 +405,13 @@ static unsigned int get_num_cpus(void)
  */
 static int monitor_tbufs(void)
 {
-    int i;
-
-    struct t_struct *tbufs;      /* Pointer to hypervisor maps */
-    struct t_buf **meta;         /* pointers to the trace buffer metadata    */
-    unsigned char **data;        /* pointers to the trace buffer data areas
-                                  * where they are mapped into user space.   */
-    unsigned long tbufs_mfn;     /* mfn of the tbufs                         */
+    xc_interface *xc_handle;
     unsigned int  num;           /* number of trace buffers / logical CPUS   */
-    unsigned long tinfo_size;    /* size of t_info metadata map              */
-    unsigned long size;          /* size of a single trace buffer            */
-
-    unsigned long data_size, rec_size;
+    unsigned int  i;
+    uint32_t evt_mask;
+    sigset_t all, old;
+    long online;
+    int timeout;
 
     /* get number of logical CPUs (and therefore number of trace buffers) */
     num = get_num_cpus();
@@ -478,65 +422,78 @@ static int monitor_tbufs(void)
     printf("CPU Frequency = %7.2f\n", opts.cpu_freq);
     
     /* setup access to trace buffers */
-    get_tbufs(&tbufs_mfn, &tinfo_size);
-    tbufs = map_tbufs(tbufs_mfn, num, tinfo_size);
-
-    size = tbufs->t_info->tbuf_size * XC_PAGE_SIZE;
-
-    data_size = size - sizeof(struct t_buf);
+    xc_handle = xc_interface_open(0,0,0);
+    if ( !xc_handle )
+        exit(EXIT_FAILURE);
 
-    meta = tbufs->meta;
-    data = tbufs->data;
+    tr = xc_tbuf_reader_open(xc_handle, DEFAULT_TBUF_SIZE);
+    if ( tr == NULL )
+    {
+        perror("Couldn't enable trace buffers");
+        exit(1);
+    }
 
-    if ( eventchn_init() < 0 )
-        fprintf(stderr, "Failed to initialize event channel; "
-                "Using POLL method\r\n");
+    /*
+     * Have Xen only write the records we use: the scheduler's verbose
+     * subclass, which has the domain switches, sleeps and wakes but not the
+     * far busier runstate and scheduler-specific records.  Counting page
+     * flips needs TRC_MEM, whose subclass bits let all of TRC_SCHED in too.
+     */
+    evt_mask = TRC_SCHED_VERBOSE;
+    if ( opts.count_io )
+        evt_mask |= TRC_MEM;
+    if ( xc_tbuf_set_evt_mask(xc_handle, evt_mask) )
+        PERROR("Failed to set the trace event mask");
+
+    /* One aggregation thread per cpu, unless we have fewer to run them */
+    nr_aggregators = opts.nr_threads;
+    if ( nr_aggregators == 0 )
+    {
+        online = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_aggregators = online > 0 ? online : 1;
+    }
+    if ( nr_aggregators > num )
+        nr_aggregators = num;
+    aggregators = calloc(nr_aggregators, sizeof(*aggregators));
+    if ( aggregators == NULL )
+    {
+        PERROR("Failed to allocate aggregation threads");
+        exit(EXIT_FAILURE);
+    }
 
-    /* now, scan buffers for events */
-    while ( !interrupted )
+    /* Signals are for the main thread, which is the one to wake the rest */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for ( i = 0; i < nr_aggregators; i++ )
     {
-        for ( i = 0; (i < num) && !interrupted; i++ )
+        aggregators[i].first_cpu = i;
+        if ( pthread_create(&aggregators[i].thread, NULL, aggregate,
+                            &aggregators[i]) )
         {
-            unsigned long start_offset, end_offset, cons, prod;
-
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
-                continue;
-
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
-
-            if ( start_offset >= end_offset )
-            {
-                while ( start_offset != data_size )
-                {
-                    rec_size = process_record(
-                        i, (struct t_rec *)(data[i] + start_offset));
-                    start_offset += rec_size;
-                }
-                start_offset = 0;
-            }
-            while ( start_offset != end_offset )
-            {
-                rec_size = process_record(
-                    i, (struct t_rec *)(data[i] + start_offset));
-                start_offset += rec_size;
-            }
-            xen_mb(); /* read item, then update cons. */
-            meta[i]->cons = prod;
+            PERROR("Failed to start aggregation thread %u", i);
+            exit(EXIT_FAILURE);
         }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    timeout = opts.poll_sleep.tv_sec * 1000 +
+              opts.poll_sleep.tv_nsec / 1000000;
 
-	wait_for_event();
-	wakeups++;
+    /* now, wait for Xen to tell us there are records, and pass it on */
+    while ( !interrupted )
+    {
+        xc_tbuf_reader_wait(tr, timeout);
+        wakeups++;
+        wake_aggregators();
     }
 
+    wake_aggregators();
+    for ( i = 0; i < nr_aggregators; i++ )
+        pthread_join(aggregators[i].thread, NULL);
+
     /* cleanup */
-    free(meta);
-    free(data);
-    /* don't need to munmap - cleanup is automatic */
+    xc_tbuf_reader_close(tr);
+    xc_interface_close(xc_handle);
 
     return 0;
 }
@@ -566,6 +523,10 @@ static void usage(void)
 "  -t, --log-thresh=l         Set number, l, of new records required to\n" \
 "                             trigger a write to output (default " \
                               xstr(NEW_DATA_THRESH) ").\n" \
+"  -T, --threads=n            Process the trace buffers with n threads\n" \
+"                             (default: one per cpu, up to those online).\n" \
+"  -i, --io-count             Count page flips, which means having Xen\n" \
+"                             trace all scheduler and memory events.\n" \
 "  -?, --help                 Show this message\n" \
 " -V, --version              Print program version\n" \
 "\n" \
@@ -607,12 +568,14 @@ static void parse_args(int argc, char **argv)
         { "log-thresh",    required_argument, 0, 't' },
         { "poll-sleep",    required_argument, 0, 's' },
         { "ms_per_sample", required_argument, 0, 'm' },
+        { "threads",       required_argument, 0, 'T' },
+        { "io-count",      no_argument,       0, 'i' },
         { "help",          no_argument,       0, '?' },
         { "version",       no_argument,       0, 'V' },
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "m:s:t:?V",
+    while ( (option = getopt_long(argc, argv, "m:s:t:T:i?V",
                     long_options, NULL)) != -1)
     {
         switch ( option )
@@ -629,6 +592,14 @@ static void parse_args(int argc, char **argv)
                 opts.ms_per_sample = argtol(optarg, 0);
                 break;
 
+            case 'T': /* set number of aggregation threads */
+                opts.nr_threads = argtol(optarg, 0);
+                break;
+
+            case 'i': /* count page flips */
+                opts.count_io = 1;
+                break;
+
             case 'V': /* print program version */
                 printf("%s\n", program_version);
                 exit(EXIT_SUCCESS);
@@ -653,6 +624,12 @@ static void alloc_qos_data(int ncpu)
     int qos_fd;
 
     cpu_qos_data = (_new_qos_data **) calloc(ncpu, sizeof(_new_qos_data *));
+    cpu_slot_seq = calloc(ncpu, sizeof(*cpu_slot_seq));
+    io_pending = calloc(ncpu, sizeof(*io_pending));
+    if (cpu_qos_data == NULL || cpu_slot_seq == NULL || io_pending == NULL) {
+        PERROR("calloc");
+        exit(2);
+    }
 
 
     qos_fd = open(SHARED_MEM_FILE, O_RDWR|O_CREAT|O_TRUNC, 0777);
@@ -694,7 +671,7 @@ static void alloc_qos_data(int ncpu)
 
 int main(int argc, char **argv)
 {
-    int ret;
+    int ret, cpu;
     struct sigaction act;
 
     time(&start_time);
@@ -718,7 +695,8 @@ int main(int argc, char **argv)
     ret = monitor_tbufs();
 
     dump_stats();
-    msync(new_qos, sizeof(_new_qos_data), MS_SYNC);
+    for (cpu = 0; cpu < NCPU; cpu++)
+        msync(cpu_qos_data[cpu], sizeof(_new_qos_data), MS_SYNC);
     disable_tracing();
 
     return ret;
@@ -754,41 +732,74 @@ static void qos_init_domain(int domid, int idx)
     }
 }
 
-static void global_init_domain(int domid, int idx) 
+/* Change a slot, with slots_lock held */
+static void slot_set_locked(int idx, int domid, int in_use)
 {
-    int cpu;
-    _new_qos_data *saved_qos;
-  
-    saved_qos = new_qos;
-  
-    for (cpu=0; cpu<NCPU; cpu++) {
-        new_qos = cpu_qos_data[cpu];
+    slots[idx].seq++;
+    __sync_synchronize();
+    slots[idx].domid = domid;
+    slots[idx].in_use = in_use;
+    __sync_synchronize();
+    slots[idx].seq++;
+}
+
+/* Read a slot without the lock, returning its sequence count */
+static unsigned int slot_read(int idx, int *domid, int *in_use)
+{
+    unsigned int seq;
+
+    do {
+        seq = *(volatile unsigned int *)&slots[idx].seq;
+        __sync_synchronize();
+        *domid = slots[idx].domid;
+        *in_use = slots[idx].in_use;
+        __sync_synchronize();
+    } while ((seq & 1) || seq != *(volatile unsigned int *)&slots[idx].seq);
+
+    return seq;
+}
+
+// bring a slot of this cpu's page up to date with the slot table
+static void sync_slot(int cpu, int idx)
+{
+    int domid, in_use;
+    unsigned int seq = slot_read(idx, &domid, &in_use);
+
+    if (seq == cpu_slot_seq[cpu][idx])
+        return;
+    cpu_slot_seq[cpu][idx] = seq;
+
+    if (!in_use)
+        new_qos->domain_info[idx].in_use = 0;
+    else if (!new_qos->domain_info[idx].in_use ||
+             new_qos->domain_info[idx].id != domid)
         qos_init_domain(domid, idx);
-    }
-    new_qos = saved_qos;
 }
 
-// give index of this domain in the qos data array
-static int indexof(int domid)
+// pick up the domains the other cpus' threads added or removed
+static void sync_slots(int cpu)
+{
+    int idx;
+
+    for (idx = 0; idx < NDOMAINS; idx++)
+        sync_slot(cpu, idx);
+}
+
+// give a slot to a domain which has none, with slots_lock held
+static int slot_alloc_locked(int domid)
 {
     int idx;
     xc_dominfo_t dominfo[NDOMAINS];
     xc_interface *xc_handle;
     int ndomains;
-  
-    if (domid < 0) {	// shouldn't happen
-        printf("bad domain id: %d\r\n", domid);
-        return 0;
-    }
 
     for (idx=0; idx<NDOMAINS; idx++)
-        if ( (new_qos->domain_info[idx].id == domid) && new_qos->domain_info[idx].in_use)
+        if (slots[idx].in_use && slots[idx].domid == domid)
             return idx;
 
-    // not found, make a new entry
     for (idx=0; idx<NDOMAINS; idx++)
-        if (new_qos->domain_info[idx].in_use == 0) {
-            global_init_domain(domid, idx);
+        if (!slots[idx].in_use) {
+            slot_set_locked(idx, domid, 1);
             return idx;
         }
 
@@ -801,7 +812,7 @@ static int indexof(int domid)
     // and purge the domain's data from our state if it does not exist in the
     // dominfo structure
     for (idx=0; idx<NDOMAINS; idx++) {
-        int domid = new_qos->domain_info[idx].id;
+        int domid = slots[idx].domid;
         int jdx;
     
         for (jdx=0; jdx<ndomains; jdx++) {
@@ -811,13 +822,13 @@ static int indexof(int domid)
         if (jdx == ndomains)        // we didn't find domid in the dominfo struct
             if (domid != IDLE_DOMAIN_ID) // exception for idle domain, which is not
                 // contained in dominfo
-                qos_kill_thread(domid);	// purge our stale data
+                slot_set_locked(idx, domid, 0);	// purge our stale data
     }
   
     // look again for a free slot
     for (idx=0; idx<NDOMAINS; idx++)
-        if (new_qos->domain_info[idx].in_use == 0) {
-            global_init_domain(domid, idx);
+        if (!slots[idx].in_use) {
+            slot_set_locked(idx, domid, 1);
             return idx;
         }
 
@@ -826,6 +837,29 @@ static int indexof(int domid)
     exit(2);
 }
 
+// give index of this domain in the qos data array
+static int indexof(int domid)
+{
+    int idx;
+  
+    if (domid < 0) {	// shouldn't happen
+        printf("bad domain id: %d\r\n", domid);
+        return 0;
+    }
+
+    for (idx=0; idx<NDOMAINS; idx++)
+        if ( (new_qos->domain_info[idx].id == domid) && new_qos->domain_info[idx].in_use)
+            return idx;
+
+    // not found on this cpu, find or make an entry for all of them
+    pthread_mutex_lock(&slots_lock);
+    idx = slot_alloc_locked(domid);
+    pthread_mutex_unlock(&slots_lock);
+
+    sync_slot(global_cpu, idx);
+    return idx;
+}
+
 static int domain_runnable(int domid)
 {
     return new_qos->domain_info[indexof(domid)].runnable;
@@ -966,11 +1000,28 @@ static void qos_update_all(uint64_t now, int cpu)
 }
 
 
+// fold in the page flips counted for this cpu by the other threads
+static void fold_io_counts(int cpu)
+{
+    int n = new_qos->next_datapoint, didx;
+    unsigned int count;
+
+    for (didx = 0; didx < NDOMAINS; didx++) {
+        if (io_pending[cpu][didx] == 0)
+            continue;
+        count = __sync_lock_test_and_set(&io_pending[cpu][didx], 0);
+        if (new_qos->domain_info[didx].in_use)
+            new_qos->qdata[n].io_count[didx] += count;
+    }
+}
+
 static void qos_update_thread_stats(int cpu, int domid, uint64_t now)
 {
     if (new_qos->qdata[new_qos->next_datapoint].ns_passed > (million*opts.ms_per_sample)) {
         qos_update_all(now, cpu);
+        fold_io_counts(cpu);
         advance_next_datapoint(now);
+        sync_slots(cpu);
         return;
     }
     qos_update_thread(cpu, domid, now);
@@ -1057,15 +1108,20 @@ static void qos_state_sleeping(int cpu, int domid, uint64_t now)
 
 
 
-// domain died, presume it's dead on all cpu's, not just mostly dead
+// domain died, presume it's dead on all cpu's, not just mostly dead: the
+// other cpus' threads find out when they next start a sample
 static void qos_kill_thread(int domid)
 {
-    int cpu;
-  
-    for (cpu=0; cpu<NCPU; cpu++) {
-        cpu_qos_data[cpu]->domain_info[indexof(domid)].in_use = 0;
-    }
-  
+    int idx;
+
+    pthread_mutex_lock(&slots_lock);
+    for (idx=0; idx<NDOMAINS; idx++)
+        if (slots[idx].in_use && slots[idx].domid == domid)
+            slot_set_locked(idx, domid, 0);
+    pthread_mutex_unlock(&slots_lock);
+
+    for (idx=0; idx<NDOMAINS; idx++)
+        sync_slot(global_cpu, idx);
 }
 
 
@@ -1094,35 +1150,25 @@ static void qos_state_runnable(int cpu, int domid, uint64_t now)
 static void qos_count_packets(domid_t domid, uint64_t now)
 {
     int i, idx = indexof(domid);
-    _new_qos_data *cpu_data;
 
-    for (i=0; i<NCPU; i++) {
-        cpu_data = cpu_qos_data[i];
-        if (cpu_data->domain_info[idx].in_use) {
-            cpu_data->qdata[cpu_data->next_datapoint].io_count[idx]++;
-        }
-    }
+    // each cpu's own thread adds these in at the end of its sample
+    for (i=0; i<NCPU; i++)
+        __sync_fetch_and_add(&io_pending[i][idx], 1);
 
     new_qos->qdata[new_qos->next_datapoint].io_count[0]++;
-    dom0_flips++;
+    __sync_fetch_and_add(&dom0_flips, 1);
 }
 
 
-static int process_record(int cpu, struct t_rec *r)
+static void process_record(const xc_tbuf_rec_t *r)
 {
-    uint64_t now = 0;
-    uint32_t *extra_u32 = r->u.nocycles.extra_u32;
+    int cpu = r->cpu;
+    uint64_t now = r->ns;
+    const uint32_t *extra_u32 = r->extra;
 
     new_qos = cpu_qos_data[cpu];
 
-    rec_count++;
-
-    if ( r->cycles_included )
-    {
-        now = ((uint64_t)r->u.cycles.cycles_hi << 32) | r->u.cycles.cycles_lo;
-        now = ((double)now) / (opts.cpu_freq / 1000.0);
-        extra_u32 = r->u.cycles.extra_u32;
-    }
+    self->rec_count++;
 
     global_now = now;
     global_cpu = cpu;
@@ -1172,6 +1218,4 @@ static int process_record(int cpu, struct t_rec *r)
     }
 
     new_qos = NULL;
-
-    return 4 + (r->cycles_included ? 8 : 0) + (r->extra_u32 * 4);
 }
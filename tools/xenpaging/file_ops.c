@@ -20,23 +20,24 @@
  */
 
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <xc_private.h>
 
-static int file_op(int fd, void *page, int i,
-                   ssize_t (*fn)(int, void *, size_t))
-{
-    off_t offset = i;
-    int total = 0;
-    int bytes;
+#include "file_ops.h"
 
-    offset = lseek(fd, offset << PAGE_SHIFT, SEEK_SET);
-    if ( offset == (off_t)-1 )
-        return -1;
+/* Transfer nr pages between buf and nr consecutive slots from slot on */
+static int file_op(int fd, void *buf, int slot, int nr,
+                   ssize_t (*fn)(int, void *, size_t, off_t))
+{
+    off_t offset = (off_t)slot << PAGE_SHIFT;
+    size_t len = (size_t)nr << PAGE_SHIFT;
+    size_t total = 0;
+    ssize_t bytes;
 
-    while ( total < PAGE_SIZE )
+    while ( total < len )
     {
-        bytes = fn(fd, page + total, PAGE_SIZE - total);
+        bytes = fn(fd, buf + total, len - total, offset + total);
         if ( bytes <= 0 )
             return -1;
 
@@ -46,19 +47,26 @@ static int file_op(int fd, void *page, int i,
     return 0;
 }
 
-static ssize_t my_write(int fd, void *buf, size_t count)
+static ssize_t my_pwrite(int fd, void *buf, size_t count, off_t offset)
+{
+    return pwrite(fd, buf, count, offset);
+}
+
+int read_pages(int fd, void *buf, int slot, int nr)
 {
-    return write(fd, buf, count);
+    return file_op(fd, buf, slot, nr, &pread);
 }
 
-int read_page(int fd, void *page, int i)
+int write_pages(int fd, void *buf, int slot, int nr)
 {
-    return file_op(fd, page, i, &read);
+    return file_op(fd, buf, slot, nr, &my_pwrite);
 }
 
-int write_page(int fd, void *page, int i)
+/* Start reading slots in the background, ahead of read_pages() */
+void prefetch_pages(int fd, int slot, int nr)
 {
-    return file_op(fd, page, i, &my_write);
+    posix_fadvise(fd, (off_t)slot << PAGE_SHIFT, (off_t)nr << PAGE_SHIFT,
+                  POSIX_FADV_WILLNEED);
 }
 
 
@@ -25,8 +25,9 @@
 #define __FILE_OPS_H__
 
 
-int read_page(int fd, void *page, int i);
-int write_page(int fd, void *page, int i);
+int read_pages(int fd, void *buf, int slot, int nr);
+int write_pages(int fd, void *buf, int slot, int nr);
+void prefetch_pages(int fd, int slot, int nr);
 
 
 #endif
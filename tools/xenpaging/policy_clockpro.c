@@ -0,0 +1,340 @@
+/******************************************************************************
+ *
+ * Xen domain paging CLOCK-Pro policy.
+ *
+ * Victims are chosen by a clock hand sweeping over all gfns, following
+ * Jiang, Chen & Zhang, "CLOCK-Pro: An Effective Improvement of the CLOCK
+ * Replacement", USENIX 2005.  Resident pages are hot or cold, and only
+ * cold pages are evicted.  A cold page that is referenced again during
+ * its test period, either while still resident or by faulting back in,
+ * becomes hot.  The split between hot and cold pages adapts: refaults of
+ * pages in their test period grow the cold target, test periods that
+ * expire without one shrink it.
+ *
+ * References come from the accessed bits the hypervisor keeps in the p2m,
+ * harvested in bulk for a window of gfns just before the hand enters it.
+ * Without them (no "ept_ad" in Xen) nothing is ever seen referenced, and
+ * this degenerates to the default policy plus protection of refaulted
+ * pages.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "xc_bitops.h"
+#include "policy.h"
+
+
+#define DEFAULT_MRU_SIZE (1024 * 16)
+
+/* gfns whose accessed bits are harvested at a time */
+#define HARVEST_WINDOW   (1UL << 15)
+
+/* Per gfn state */
+#define PG_HOT   0x1    /* resident and hot */
+#define PG_REF   0x2    /* referenced since the hand last passed */
+#define PG_TEST  0x4    /* cold (resident or not) in its test period */
+#define PG_OUT   0x8    /* paged out */
+
+
+static unsigned long *mru;
+static unsigned int i_mru;
+static unsigned int mru_size;
+static unsigned long *bitmap;
+static unsigned long *unconsumed;
+static unsigned int unconsumed_cleared;
+static unsigned long current_gfn;
+static unsigned long max_pages;
+
+static unsigned char *state;
+static unsigned long nr_hot, nr_out;
+static unsigned long cold_target, cold_target_min;
+
+static int have_accessed_bits = 1;
+static unsigned long *accessed;
+static unsigned long harvested_window = ~0UL;
+
+
+int policy_init(struct xenpaging *paging)
+{
+    int i;
+    int rc = -ENOMEM;
+
+    max_pages = paging->max_pages;
+
+    /* Allocate bitmap for pages not to page out */
+    bitmap = bitmap_alloc(max_pages);
+    if ( !bitmap )
+        goto out;
+    /* Allocate bitmap to track unusable pages */
+    unconsumed = bitmap_alloc(max_pages);
+    if ( !unconsumed )
+        goto out;
+    accessed = bitmap_alloc(HARVEST_WINDOW);
+    if ( !accessed )
+        goto out;
+    state = calloc(max_pages, sizeof(*state));
+    if ( !state )
+        goto out;
+
+    /* Initialise MRU list of paged in pages */
+    if ( paging->policy_mru_size > 0 )
+        mru_size = paging->policy_mru_size;
+    else
+        mru_size = paging->policy_mru_size = DEFAULT_MRU_SIZE;
+
+    mru = malloc(sizeof(*mru) * mru_size);
+    if ( mru == NULL )
+        goto out;
+
+    for ( i = 0; i < mru_size; i++ )
+        mru[i] = INVALID_MFN;
+
+    /* Don't page out page 0 */
+    set_bit(0, bitmap);
+
+    /* Everything starts out cold; hot pages have to earn their place. */
+    cold_target_min = max_pages / 100 + 1;
+    cold_target = max_pages / 2;
+
+    /* Start in the middle to avoid paging during BIOS startup */
+    current_gfn = max_pages / 2;
+
+    rc = 0;
+ out:
+    return rc;
+}
+
+/* Fold the accessed bits of the window around gfn into the page state. */
+static void harvest_window(struct xenpaging *paging, unsigned long gfn)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long start = gfn & ~(HARVEST_WINDOW - 1), nr, i;
+
+    harvested_window = gfn / HARVEST_WINDOW;
+    if ( !have_accessed_bits )
+        return;
+
+    nr = max_pages - start;
+    if ( nr > HARVEST_WINDOW )
+        nr = HARVEST_WINDOW;
+
+    if ( xc_domain_harvest_accessed(xch, paging->mem_event.domain_id,
+                                    start, nr, accessed) < 0 )
+    {
+        DPRINTF("no accessed bits (%d), using reference-less clock\n", errno);
+        have_accessed_bits = 0;
+        return;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        if ( test_bit(i, accessed) )
+            state[start + i] |= PG_REF;
+}
+
+static unsigned long hot_target(void)
+{
+    unsigned long resident = max_pages - nr_out;
+
+    return resident > cold_target ? resident - cold_target : 0;
+}
+
+/* A test period ran out without the page being used again. */
+static void test_expired(unsigned long gfn)
+{
+    state[gfn] &= ~PG_TEST;
+    if ( cold_target > cold_target_min )
+        cold_target--;
+}
+
+/* Advance the hand over one resident page: is it a victim? */
+static int clock_hand(unsigned long gfn)
+{
+    unsigned char s = state[gfn];
+
+    if ( s & PG_REF )
+    {
+        s &= ~PG_REF;
+        if ( s & PG_HOT )
+        {
+            /* Still hot, unless there are too many hot pages. */
+            if ( nr_hot > hot_target() )
+            {
+                s &= ~PG_HOT;
+                nr_hot--;
+            }
+        }
+        else if ( (s & PG_TEST) && nr_hot < hot_target() )
+        {
+            /* Reused within its test period. */
+            s = (s & ~PG_TEST) | PG_HOT;
+            nr_hot++;
+        }
+        else
+            s |= PG_TEST;
+        state[gfn] = s;
+        return 0;
+    }
+
+    if ( s & PG_HOT )
+    {
+        /* Unused for a whole revolution: demote. */
+        state[gfn] = s & ~PG_HOT;
+        nr_hot--;
+        return 0;
+    }
+
+    /* Cold and unused.  A page in its test period stays in it once out. */
+    return 1;
+}
+
+unsigned long policy_choose_victim(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long i;
+
+    /* Up to two revolutions: the first may only clear reference bits */
+    for ( i = 0; i < 2 * max_pages; i++ )
+    {
+        /* Try next gfn */
+        current_gfn++;
+
+        /* Restart on wrap */
+        if ( current_gfn >= max_pages )
+            current_gfn = 0;
+
+        if ( current_gfn / HARVEST_WINDOW != harvested_window )
+            harvest_window(paging, current_gfn);
+
+        /* Paged out: let the test period run out */
+        if ( state[current_gfn] & PG_OUT )
+        {
+            if ( state[current_gfn] & PG_TEST )
+                test_expired(current_gfn);
+            continue;
+        }
+
+        /* gfn busy */
+        if ( test_bit(current_gfn, bitmap) )
+            continue;
+
+        /* gfn already tested */
+        if ( test_bit(current_gfn, unconsumed) )
+            continue;
+
+        /* gfn found */
+        if ( clock_hand(current_gfn) )
+            break;
+    }
+
+    /* Could not nominate any gfn */
+    if ( i >= 2 * max_pages )
+    {
+        /* No more pages, wait in poll */
+        paging->use_poll_timeout = 1;
+        /* Count wrap arounds */
+        unconsumed_cleared++;
+        /* Force retry every few seconds (depends on poll() timeout) */
+        if ( unconsumed_cleared > 123)
+        {
+            /* Force retry of unconsumed gfns on next call */
+            bitmap_clear(unconsumed, max_pages);
+            unconsumed_cleared = 0;
+            DPRINTF("clearing unconsumed, current_gfn %lx", current_gfn);
+        }
+        return INVALID_MFN;
+    }
+
+    set_bit(current_gfn, unconsumed);
+    return current_gfn;
+}
+
+void policy_notify_paged_out(unsigned long gfn)
+{
+    set_bit(gfn, bitmap);
+    clear_bit(gfn, unconsumed);
+
+    if ( state[gfn] & PG_HOT )
+        nr_hot--;
+    state[gfn] = (state[gfn] & PG_TEST) | PG_OUT;
+    nr_out++;
+}
+
+static void policy_handle_paged_in(unsigned long gfn, int do_mru)
+{
+    unsigned long old_gfn = mru[i_mru & (mru_size - 1)];
+
+    if ( old_gfn != INVALID_MFN )
+        clear_bit(old_gfn, bitmap);
+
+    if (do_mru) {
+        mru[i_mru & (mru_size - 1)] = gfn;
+    } else {
+        clear_bit(gfn, bitmap);
+        mru[i_mru & (mru_size - 1)] = INVALID_MFN;
+    }
+
+    i_mru++;
+
+    if ( !(state[gfn] & PG_OUT) )
+        return;
+    nr_out--;
+
+    if ( (state[gfn] & PG_TEST) )
+    {
+        /* Refault within the test period: the cold set is too small. */
+        if ( cold_target < max_pages - nr_out )
+            cold_target++;
+        if ( nr_hot < hot_target() )
+        {
+            state[gfn] = PG_HOT;
+            nr_hot++;
+            return;
+        }
+    }
+
+    /* Back in, cold, on probation */
+    state[gfn] = PG_TEST;
+}
+
+void policy_notify_paged_in(unsigned long gfn)
+{
+    policy_handle_paged_in(gfn, 1);
+}
+
+void policy_notify_paged_in_nomru(unsigned long gfn)
+{
+    policy_handle_paged_in(gfn, 0);
+}
+
+void policy_notify_dropped(unsigned long gfn)
+{
+    clear_bit(gfn, bitmap);
+
+    if ( state[gfn] & PG_OUT )
+        nr_out--;
+    state[gfn] = 0;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,176 @@
+/******************************************************************************
+ *
+ * Xen domain paging: prefetch along fault streams.
+ *
+ * Faults on paged-out gfns are matched against a few streams, each with
+ * a fixed stride (1 for sequential access).  Once a second fault confirms
+ * a stride, the next few gfns along the stream which are paged out get
+ * loaded in the same batch as the faulting one.  Every further fault just
+ * past the prefetched range doubles the window, up to the configured cap.
+ *
+ * Whether a prefetched page was used can't be seen directly, as the guest
+ * no longer faults on it.  A fault just past the prefetched range means
+ * the guest walked over it, which counts the prefetched pages as used;
+ * pages still pending when their stream is recycled count as wasted.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xc_bitops.h"
+#include "prefetch.h"
+
+
+#define PREFETCH_STREAMS     8
+#define PREFETCH_MAX_STRIDE  16
+#define PREFETCH_MIN_WINDOW  4
+
+struct stream {
+    unsigned long ahead;    /* last gfn covered, by a fault or a prefetch */
+    long stride;            /* 0 until a second fault gives one */
+    unsigned int window;    /* gfns to prefetch on the next fault */
+    unsigned int pending;   /* prefetched, not known to be used yet */
+    unsigned long lru;      /* 0 if the stream is unused */
+};
+
+static struct stream streams[PREFETCH_STREAMS];
+static unsigned long lru_clock;
+static unsigned int max_window;
+
+static unsigned long nr_prefetched, nr_used, nr_wasted;
+
+
+void prefetch_init(struct xenpaging *paging)
+{
+    max_window = paging->prefetch_max;
+    if ( max_window > XENPAGING_PREFETCH_MAX )
+        max_window = XENPAGING_PREFETCH_MAX;
+}
+
+/* Find the stream a fault belongs to, or recycle the oldest one for it */
+static struct stream *find_stream(unsigned long gfn, int *confirmed)
+{
+    struct stream *s, *oldest = &streams[0];
+    long delta;
+    int i;
+
+    *confirmed = 0;
+
+    /* Faults right past what was covered continue a stream */
+    for ( i = 0; i < PREFETCH_STREAMS; i++ )
+    {
+        s = &streams[i];
+        if ( s->lru && s->stride && gfn == s->ahead + s->stride )
+        {
+            *confirmed = 1;
+            return s;
+        }
+        if ( s->lru < oldest->lru )
+            oldest = s;
+    }
+
+    /* A second fault close to the first gives a stream its stride */
+    for ( i = 0; i < PREFETCH_STREAMS; i++ )
+    {
+        s = &streams[i];
+        delta = gfn - s->ahead;
+        if ( s->lru && !s->stride && delta &&
+             labs(delta) <= PREFETCH_MAX_STRIDE )
+        {
+            s->stride = delta;
+            s->window = PREFETCH_MIN_WINDOW;
+            return s;
+        }
+    }
+
+    nr_wasted += oldest->pending;
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->ahead = gfn;
+    oldest->lru = ++lru_clock;
+
+    return NULL;
+}
+
+/* Account a fault on gfn, and pick up to max paged-out gfns to load along
+ * with it.  They are taken out of paging->bitmap, the caller must load them.
+ * Returns the number of gfns put into gfns[]
+ */
+int prefetch_fault(struct xenpaging *paging, unsigned long gfn,
+                   unsigned long *gfns, int max)
+{
+    struct stream *s;
+    unsigned long next;
+    unsigned int i;
+    int confirmed, num = 0;
+
+    if ( !max_window )
+        return 0;
+
+    s = find_stream(gfn, &confirmed);
+    if ( !s )
+        return 0;
+
+    if ( confirmed )
+    {
+        /* The guest walked over everything prefetched so far */
+        nr_used += s->pending;
+        s->pending = 0;
+        s->window *= 2;
+    }
+    if ( s->window > max_window )
+        s->window = max_window;
+
+    s->lru = ++lru_clock;
+    s->ahead = gfn;
+
+    for ( i = 1; i <= s->window && num < max; i++ )
+    {
+        /* Negative strides wrap to large values, and stop here too */
+        next = gfn + i * s->stride;
+        if ( next == 0 || next >= paging->max_pages )
+            break;
+
+        s->ahead = next;
+        if ( test_and_clear_bit(next, paging->bitmap) )
+            gfns[num++] = next;
+    }
+
+    s->pending += num;
+    nr_prefetched += num;
+
+    return num;
+}
+
+void prefetch_stats(unsigned long *prefetched, unsigned long *used,
+                    unsigned long *wasted)
+{
+    *prefetched = nr_prefetched;
+    *used = nr_used;
+    *wasted = nr_wasted;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -35,6 +35,7 @@
 #include "xc_bitops.h"
 #include "file_ops.h"
 #include "policy.h"
+#include "prefetch.h"
 #include "xenpaging.h"
 
 /* Defines number of mfns a guest should use at a time, in KiB */
@@ -180,17 +181,20 @@ static int xenpaging_get_tot_pages(struct xenpaging *paging)
     return domain_info.tot_pages;
 }
 
-static void *init_page(void)
+/* Pages loaded per batch: those asked for, and those prefetched */
+#define PAGING_BUFFER_PAGES (XENPAGING_BATCH_SIZE + XENPAGING_PREFETCH_MAX)
+
+static void *init_buffer(size_t size)
 {
     void *buffer;
 
     /* Allocated page memory */
-    errno = posix_memalign(&buffer, PAGE_SIZE, PAGE_SIZE);
+    errno = posix_memalign(&buffer, PAGE_SIZE, size);
     if ( errno != 0 )
         return NULL;
 
     /* Lock buffer in memory so it can't be paged out */
-    if ( mlock(buffer, PAGE_SIZE) < 0 )
+    if ( mlock(buffer, size) < 0 )
     {
         free(buffer);
         buffer = NULL;
@@ -210,6 +214,9 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -p <num>       --prefetch=<num>         most pages to read ahead on sequential faults (0 to disable).\n");
+    printf(" -R <num>       --ring_pages=<num>       size of the request ring in pages (power of 2, up to %d).\n",
+           XEN_MEM_EVENT_RING_PAGES_MAX);
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -217,13 +224,15 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:p:R:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"prefetch", 1, NULL, 'p'},
+        {"ring_pages", 1, NULL, 'R'},
         { }
     };
 
@@ -243,6 +252,12 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 'p':
+            paging->prefetch_max = atoi(optarg);
+            break;
+        case 'R':
+            paging->mem_event.ring_pages = atoi(optarg);
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -281,13 +296,17 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     xentoollog_logger *dbg = NULL;
     char *p;
     int rc;
-    unsigned long ring_pfn, mmap_pfn;
+    unsigned int i;
+    xen_pfn_t ring_pfn, pfn;
 
     /* Allocate memory */
     paging = calloc(1, sizeof(struct xenpaging));
     if ( !paging )
         goto err;
 
+    paging->prefetch_max = XENPAGING_PREFETCH_DEFAULT;
+    paging->mem_event.ring_pages = 1;
+
     /* Get cmdline options and domain_id */
     if ( xenpaging_getopts(paging, argc, argv) )
         goto err;
@@ -338,39 +357,30 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
-    /* Map the ring page */
-    xc_get_hvm_param(xch, paging->mem_event.domain_id, 
-                        HVM_PARAM_PAGING_RING_PFN, &ring_pfn);
-    mmap_pfn = ring_pfn;
-    paging->mem_event.ring_page = 
-        xc_map_foreign_batch(xch, paging->mem_event.domain_id, 
-                                PROT_READ | PROT_WRITE, &mmap_pfn, 1);
-    if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+    /* Map the ring pages */
+    if ( paging->mem_event.ring_pages < 1 ||
+         paging->mem_event.ring_pages > XEN_MEM_EVENT_RING_PAGES_MAX ||
+         (paging->mem_event.ring_pages & (paging->mem_event.ring_pages - 1)) )
     {
-        /* Map failed, populate ring page */
-        rc = xc_domain_populate_physmap_exact(paging->xc_handle, 
-                                              paging->mem_event.domain_id,
-                                              1, 0, 0, &ring_pfn);
-        if ( rc != 0 )
-        {
-            PERROR("Failed to populate ring gfn\n");
-            goto err;
-        }
-
-        mmap_pfn = ring_pfn;
-        paging->mem_event.ring_page = 
-            xc_map_foreign_batch(xch, paging->mem_event.domain_id, 
-                                    PROT_READ | PROT_WRITE, &mmap_pfn, 1);
-        if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
-        {
-            PERROR("Could not map the ring page\n");
-            goto err;
-        }
+        ERROR("Ring size must be a power of 2, up to %d pages",
+              XEN_MEM_EVENT_RING_PAGES_MAX);
+        goto err;
     }
-    
+    paging->mem_event.ring_page =
+        xc_mem_event_map_ring(xch, paging->mem_event.domain_id,
+                              HVM_PARAM_PAGING_RING_PFN,
+                              paging->mem_event.ring_pages, &ring_pfn);
+    if ( paging->mem_event.ring_page == NULL )
+    {
+        PERROR("Could not map the ring\n");
+        goto err;
+    }
+
     /* Initialise Xen */
-    rc = xc_mem_paging_enable(xch, paging->mem_event.domain_id,
-                             &paging->mem_event.evtchn_port);
+    rc = xc_mem_paging_enable_ring(xch, paging->mem_event.domain_id,
+                                   paging->mem_event.ring_pages,
+                                   XEN_MEM_EVENT_LAZY_KICK,
+                                   &paging->mem_event.evtchn_port);
     if ( rc != 0 )
     {
         switch ( errno ) {
@@ -417,12 +427,16 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     SHARED_RING_INIT((mem_event_sring_t *)paging->mem_event.ring_page);
     BACK_RING_INIT(&paging->mem_event.back_ring,
                    (mem_event_sring_t *)paging->mem_event.ring_page,
-                   PAGE_SIZE);
+                   paging->mem_event.ring_pages * PAGE_SIZE);
 
     /* Now that the ring is set, remove it from the guest's physmap */
-    if ( xc_domain_decrease_reservation_exact(xch, 
-                    paging->mem_event.domain_id, 1, 0, &ring_pfn) )
-        PERROR("Failed to remove ring from guest physmap");
+    for ( i = 0; i < paging->mem_event.ring_pages; i++ )
+    {
+        pfn = ring_pfn + i;
+        if ( xc_domain_decrease_reservation_exact(xch,
+                        paging->mem_event.domain_id, 1, 0, &pfn) )
+            PERROR("Failed to remove ring from guest physmap");
+    }
 
     /* Get max_pages from guest if not provided via cmdline */
     if ( !paging->max_pages )
@@ -454,11 +468,6 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     if ( !paging->slot_to_gfn || !paging->gfn_to_slot )
         goto err;
 
-    /* Allocate stack for known free slots in pagefile */
-    paging->free_slot_stack = calloc(paging->max_pages, sizeof(*paging->free_slot_stack));
-    if ( !paging->free_slot_stack )
-        goto err;
-
     /* Initialise policy */
     rc = policy_init(paging);
     if ( rc != 0 )
@@ -467,7 +476,9 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
-    paging->paging_buffer = init_page();
+    prefetch_init(paging);
+
+    paging->paging_buffer = init_buffer(PAGING_BUFFER_PAGES * PAGE_SIZE);
     if ( !paging->paging_buffer )
     {
         PERROR("Creating page aligned load buffer");
@@ -493,18 +504,18 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
             xc_interface_close(xch);
         if ( paging->paging_buffer )
         {
-            munlock(paging->paging_buffer, PAGE_SIZE);
+            munlock(paging->paging_buffer, PAGING_BUFFER_PAGES * PAGE_SIZE);
             free(paging->paging_buffer);
         }
 
         if ( paging->mem_event.ring_page )
         {
-            munmap(paging->mem_event.ring_page, PAGE_SIZE);
+            munmap(paging->mem_event.ring_page,
+                   paging->mem_event.ring_pages * PAGE_SIZE);
         }
 
         free(dom_path);
         free(watch_target_tot_pages);
-        free(paging->free_slot_stack);
         free(paging->slot_to_gfn);
         free(paging->gfn_to_slot);
         free(paging->bitmap);
@@ -524,7 +535,8 @@ static void xenpaging_teardown(struct xenpaging *paging)
 
     paging->xc_handle = NULL;
     /* Tear down domain paging in Xen */
-    munmap(paging->mem_event.ring_page, PAGE_SIZE);
+    munmap(paging->mem_event.ring_page,
+           paging->mem_event.ring_pages * PAGE_SIZE);
     rc = xc_mem_paging_disable(xch, paging->mem_event.domain_id);
     if ( rc != 0 )
     {
@@ -572,7 +584,6 @@ static void get_request(struct mem_event *mem_event, mem_event_request_t *req)
 
     /* Update ring */
     back_ring->req_cons = req_cons;
-    back_ring->sring->req_event = req_cons + 1;
 }
 
 static void put_response(struct mem_event *mem_event, mem_event_response_t *rsp)
@@ -587,94 +598,221 @@ static void put_response(struct mem_event *mem_event, mem_event_response_t *rsp)
     memcpy(RING_GET_RESPONSE(back_ring, rsp_prod), rsp, sizeof(*rsp));
     rsp_prod++;
 
-    /* Update ring */
+    /* Update ring, Xen sees the response after push_responses() */
     back_ring->rsp_prod_pvt = rsp_prod;
-    RING_PUSH_RESPONSES(back_ring);
 }
 
-/* Evict a given gfn
+/* Publish the queued responses, and tell Xen about all of them at once */
+static int push_responses(struct mem_event *mem_event)
+{
+    RING_PUSH_RESPONSES(&mem_event->back_ring);
+
+    return xc_evtchn_notify(mem_event->xce_handle, mem_event->port);
+}
+
+/* Find up to nr free pagefile slots, going on from the log head so that
+ * pages evicted together land in consecutive slots.
+ * Returns the number of slots found
+ */
+static int alloc_slots(struct xenpaging *paging, int *slots, int nr)
+{
+    int i, slot, num = 0;
+
+    for ( i = 0; i < paging->max_pages && num < nr; i++ )
+    {
+        slot = paging->log_head;
+        if ( ++paging->log_head >= paging->max_pages )
+            paging->log_head = 0;
+
+        /* Slot is allocated */
+        if ( paging->slot_to_gfn[slot] )
+            continue;
+
+        slots[num++] = slot;
+    }
+
+    return num;
+}
+
+/* Number of slots, from the first on, which follow each other */
+static int slot_run(const int *slots, int nr)
+{
+    int run = 1;
+
+    while ( run < nr && slots[run] == slots[0] + run )
+        run++;
+
+    return run;
+}
+
+/* Ask the policy for up to nr victims
+ * Returns the number of victims found
+ */
+static int choose_victims(struct xenpaging *paging,
+                          xen_mem_paging_batch_t *batch, int nr)
+{
+    xc_interface *xch = paging->xc_handle;
+    static int num_paged_out;
+    unsigned long gfn;
+    int num;
+
+    for ( num = 0; num < nr && !interrupted; num++ )
+    {
+        gfn = policy_choose_victim(paging);
+        if ( gfn == INVALID_MFN )
+        {
+            /* If the number did not change after last flush command then
+             * the command did not reach qemu yet, or qemu still processes
+             * the command, or qemu has nothing to release.
+             * Right now there is no need to issue the command again.
+             */
+            if ( num_paged_out != paging->num_paged_out )
+            {
+                DPRINTF("Flushing qemu cache\n");
+                xenpaging_mem_paging_flush_ioemu_cache(paging);
+                num_paged_out = paging->num_paged_out;
+            }
+            break;
+        }
+
+        batch[num].gfn = gfn;
+        batch[num].status = 0;
+    }
+
+    return num;
+}
+
+/* Evict a batch of up to nr victims: nominate them with one hypercall,
+ * append them to the pagefile with as few writes as possible and evict
+ * them with another hypercall.  Pages which can't be evicted are skipped.
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if gfn can not be evicted
+ * Returns the number of victims tried, 0 if there are none left
  */
-static int xenpaging_evict_page(struct xenpaging *paging, unsigned long gfn, int slot)
+static int evict_batch(struct xenpaging *paging, int nr, int *evicted)
 {
     xc_interface *xch = paging->xc_handle;
-    void *page;
-    xen_pfn_t victim = gfn;
-    int ret;
+    domid_t domain_id = paging->mem_event.domain_id;
+    xen_mem_paging_batch_t batch[XENPAGING_BATCH_SIZE];
+    xen_pfn_t gfns[XENPAGING_BATCH_SIZE];
+    int slots[XENPAGING_BATCH_SIZE];
+    unsigned long gfn;
+    void *pages;
+    int i, run, num;
 
-    DECLARE_DOMCTL;
+    nr = choose_victims(paging, batch, nr);
+    if ( !nr )
+        return 0;
 
-    /* Nominate page */
-    ret = xc_mem_paging_nominate(xch, paging->mem_event.domain_id, gfn);
-    if ( ret < 0 )
+    /* Nominate pages */
+    if ( xc_mem_paging_nominate_batch(xch, domain_id, batch, nr) < 0 )
+    {
+        PERROR("Error nominating pages");
+        return -1;
+    }
+
+    for ( i = num = 0; i < nr; i++ )
     {
         /* unpageable gfn is indicated by EBUSY */
-        if ( errno == EBUSY )
-            ret = 1;
-        else
-            PERROR("Error nominating page %lx", gfn);
-        goto out;
+        if ( batch[i].status == -EBUSY )
+            continue;
+        if ( batch[i].status < 0 )
+        {
+            errno = -batch[i].status;
+            PERROR("Error nominating page %"PRIx64, batch[i].gfn);
+            return -1;
+        }
+        gfns[num++] = batch[i].gfn;
     }
+    if ( !num )
+        return nr;
 
-    /* Map page */
-    page = xc_map_foreign_pages(xch, paging->mem_event.domain_id, PROT_READ, &victim, 1);
-    if ( page == NULL )
+    /* Nominated pages left over are given back on their next access */
+    num = alloc_slots(paging, slots, num);
+
+    /* Map pages */
+    pages = xc_map_foreign_pages(xch, domain_id, PROT_READ, gfns, num);
+    if ( pages == NULL )
     {
-        PERROR("Error mapping page %lx", gfn);
-        ret = -1;
-        goto out;
+        PERROR("Error mapping pages");
+        return -1;
     }
 
-    /* Copy page */
-    ret = write_page(paging->fd, page, slot);
-    if ( ret < 0 )
+    /* Copy pages, a run of consecutive slots at a time */
+    for ( i = 0; i < num; i += run )
     {
-        PERROR("Error copying page %lx", gfn);
-        munmap(page, PAGE_SIZE);
-        ret = -1;
-        goto out;
+        run = slot_run(slots + i, num - i);
+        if ( write_pages(paging->fd, pages + i * PAGE_SIZE, slots[i], run) < 0 )
+        {
+            PERROR("Error copying pages to slots %d-%d",
+                   slots[i], slots[i] + run - 1);
+            munmap(pages, num * PAGE_SIZE);
+            return -1;
+        }
     }
 
-    /* Release page */
-    munmap(page, PAGE_SIZE);
+    /* Release pages */
+    munmap(pages, num * PAGE_SIZE);
 
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(xch, paging->mem_event.domain_id, gfn);
-    if ( ret < 0 )
+    /* Tell Xen to evict pages */
+    for ( i = 0; i < num; i++ )
     {
+        batch[i].gfn = gfns[i];
+        batch[i].status = 0;
+    }
+    if ( xc_mem_paging_evict_batch(xch, domain_id, batch, num) < 0 )
+    {
+        PERROR("Error evicting pages");
+        return -1;
+    }
+
+    for ( i = 0; i < num; i++ )
+    {
+        gfn = gfns[i];
+
         /* A gfn in use is indicated by EBUSY */
-        if ( errno == EBUSY )
+        if ( batch[i].status == -EBUSY )
+        {
+            DPRINTF("Nominated page %lx busy", gfn);
+            continue;
+        }
+        if ( batch[i].status < 0 )
         {
-                ret = 1;
-                DPRINTF("Nominated page %lx busy", gfn);
-        } else
+            errno = -batch[i].status;
             PERROR("Error evicting page %lx", gfn);
-        goto out;
-    }
+            return -1;
+        }
 
-    DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
-    /* Notify policy of page being paged out */
-    policy_notify_paged_out(gfn);
+        DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slots[i]);
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(gfn);
 
-    /* Update index */
-    paging->slot_to_gfn[slot] = gfn;
-    paging->gfn_to_slot[gfn] = slot;
+        /* Update index */
+        paging->slot_to_gfn[slots[i]] = gfn;
+        paging->gfn_to_slot[gfn] = slots[i];
 
-    /* Record number of evicted pages */
-    paging->num_paged_out++;
+        /* Record number of evicted pages */
+        paging->num_paged_out++;
 
-    ret = 0;
+        if ( test_and_set_bit(gfn, paging->bitmap) )
+            ERROR("Page %lx has been evicted before", gfn);
 
- out:
-    return ret;
+        (*evicted)++;
+    }
+
+    return nr;
 }
 
-static int xenpaging_resume_page(struct xenpaging *paging, mem_event_response_t *rsp, int notify_policy)
+static void xenpaging_resume_page(struct xenpaging *paging, mem_event_request_t *req, int notify_policy)
 {
+    mem_event_response_t rsp;
+
+    /* Prepare the response */
+    rsp.gfn = req->gfn;
+    rsp.vcpu_id = req->vcpu_id;
+    rsp.flags = req->flags;
+
     /* Put the page info on the ring */
-    put_response(&paging->mem_event, rsp);
+    put_response(&paging->mem_event, &rsp);
 
     /* Notify policy of page being paged in */
     if ( notify_policy )
@@ -684,172 +822,270 @@ static int xenpaging_resume_page(struct xenpaging *paging, mem_event_response_t
          * This allows page-out of these gfns if the target grows again.
          */
         if (paging->num_paged_out > paging->policy_mru_size)
-            policy_notify_paged_in(rsp->gfn);
+            policy_notify_paged_in(rsp.gfn);
         else
-            policy_notify_paged_in_nomru(rsp->gfn);
+            policy_notify_paged_in_nomru(rsp.gfn);
 
        /* Record number of resumed pages */
        paging->num_paged_out--;
     }
-
-    /* Tell Xen page is ready */
-    return xc_evtchn_notify(paging->mem_event.xce_handle, paging->mem_event.port);
 }
 
-static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn, int i)
+/* Page in the gfns in slots[], into consecutive pages of the paging buffer */
+static int xenpaging_populate_pages(struct xenpaging *paging, unsigned long *gfns, int *slots, int nr)
 {
     xc_interface *xch = paging->xc_handle;
-    int ret;
+    void *buffer = paging->paging_buffer;
+    int i, run, ret = 0;
     unsigned char oom = 0;
 
-    DPRINTF("populate_page < gfn %lx pageslot %d\n", gfn, i);
+    /* Get all the reads going before waiting for the first one */
+    for ( i = 0; i < nr; i += run )
+    {
+        run = slot_run(slots + i, nr - i);
+        prefetch_pages(paging->fd, slots[i], run);
+    }
 
-    /* Read page */
-    ret = read_page(paging->fd, paging->paging_buffer, i);
-    if ( ret != 0 )
+    /* Read pages */
+    for ( i = 0; i < nr; i += run )
     {
-        PERROR("Error reading page");
-        goto out;
+        run = slot_run(slots + i, nr - i);
+        DPRINTF("populate_pages < pageslots %d-%d\n", slots[i], slots[i] + run - 1);
+        if ( read_pages(paging->fd, buffer + i * PAGE_SIZE, slots[i], run) < 0 )
+        {
+            PERROR("Error reading pages");
+            return -1;
+        }
     }
 
-    do
+    for ( i = 0; i < nr && !ret; i++ )
     {
-        /* Tell Xen to allocate a page for the domain */
-        ret = xc_mem_paging_load(xch, paging->mem_event.domain_id, gfn, paging->paging_buffer);
-        if ( ret < 0 )
+        do
         {
-            if ( errno == ENOMEM )
+            /* Tell Xen to allocate a page for the domain */
+            ret = xc_mem_paging_load(xch, paging->mem_event.domain_id, gfns[i],
+                                     buffer + i * PAGE_SIZE);
+            if ( ret < 0 )
             {
-                if ( oom++ == 0 )
-                    DPRINTF("ENOMEM while preparing gfn %lx\n", gfn);
-                sleep(1);
-                continue;
+                if ( errno == ENOMEM )
+                {
+                    if ( oom++ == 0 )
+                        DPRINTF("ENOMEM while preparing gfn %lx\n", gfns[i]);
+                    sleep(1);
+                    continue;
+                }
+                PERROR("Error loading %lx during page-in", gfns[i]);
+                ret = -1;
+                break;
             }
-            PERROR("Error loading %lx during page-in", gfn);
-            ret = -1;
-            break;
         }
+        while ( ret && !interrupted );
     }
-    while ( ret && !interrupted );
-
 
- out:
     return ret;
 }
 
-/* Trigger a page-in for a batch of pages */
-static void resume_pages(struct xenpaging *paging, int num_pages)
+struct pagein {
+    int slot;
+    unsigned long gfn;
+    int prefetched;
+};
+
+/* Sort page-ins by pagefile slot */
+static int pagein_cmp(const void *a, const void *b)
 {
-    xc_interface *xch = paging->xc_handle;
-    int i, num = 0;
+    const struct pagein *pa = a, *pb = b;
 
-    for ( i = 0; i < paging->max_pages && num < num_pages; i++ )
-    {
-        if ( test_bit(i, paging->bitmap) )
-        {
-            paging->pagein_queue[num] = i;
-            num++;
-            if ( num == XENPAGING_PAGEIN_QUEUE_SIZE )
-                break;
-        }
-    }
-    /* num may be less than num_pages, caller has to try again */
-    if ( num )
-        page_in_trigger();
+    return pa->slot - pb->slot;
 }
 
-/* Evict one gfn and write it to the given slot
+/* Handle the requests on the ring, a batch at a time: read and load all
+ * pages needed by the batch, and those prefetched along with them, in slot
+ * order, then answer all requests with a single notification.
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if no gfn can be evicted
  */
-static int evict_victim(struct xenpaging *paging, int slot)
+static int process_requests(struct xenpaging *paging)
 {
     xc_interface *xch = paging->xc_handle;
-    unsigned long gfn;
-    static int num_paged_out;
-    int ret;
-
-    do
+    mem_event_request_t reqs[XENPAGING_BATCH_SIZE], *req;
+    unsigned char paged[XENPAGING_BATCH_SIZE];
+    struct pagein pagein[PAGING_BUFFER_PAGES];
+    unsigned long gfns[PAGING_BUFFER_PAGES];
+    int slots[PAGING_BUFFER_PAGES];
+    int i, j, nr, nr_in, nr_ahead, responses, slot, more;
+
+    /* Xen only kicks us once we have asked for it, when the ring is empty */
+    for ( ; ; )
     {
-        gfn = policy_choose_victim(paging);
-        if ( gfn == INVALID_MFN )
+        RING_FINAL_CHECK_FOR_REQUESTS(&paging->mem_event.back_ring, more);
+        if ( !more )
+            break;
+
+        nr_in = nr_ahead = 0;
+        for ( nr = 0; nr < XENPAGING_BATCH_SIZE &&
+                      RING_HAS_UNCONSUMED_REQUESTS(&paging->mem_event.back_ring); nr++ )
         {
-            /* If the number did not change after last flush command then
-             * the command did not reach qemu yet, or qemu still processes
-             * the command, or qemu has nothing to release.
-             * Right now there is no need to issue the command again.
-             */
-            if ( num_paged_out != paging->num_paged_out )
+            req = &reqs[nr];
+            get_request(&paging->mem_event, req);
+
+            if ( req->gfn > paging->max_pages )
             {
-                DPRINTF("Flushing qemu cache\n");
-                xenpaging_mem_paging_flush_ioemu_cache(paging);
-                num_paged_out = paging->num_paged_out;
+                ERROR("Requested gfn %"PRIx64" higher than max_pages %lx\n", req->gfn, paging->max_pages);
+                return -1;
             }
-            ret = ENOSPC;
-            goto out;
+
+            /* Check if the page has already been paged in */
+            paged[nr] = test_and_clear_bit(req->gfn, paging->bitmap);
+            if ( !paged[nr] )
+                continue;
+
+            /* Find where in the paging file to read from */
+            slot = paging->gfn_to_slot[req->gfn];
+
+            /* Sanity check */
+            if ( paging->slot_to_gfn[slot] != req->gfn )
+            {
+                ERROR("Expected gfn %"PRIx64" in slot %d, but found gfn %lx\n", req->gfn, slot, paging->slot_to_gfn[slot]);
+                return -1;
+            }
+
+            if ( req->flags & MEM_EVENT_FLAG_DROP_PAGE )
+            {
+                DPRINTF("drop_page ^ gfn %"PRIx64" pageslot %d\n", req->gfn, slot);
+                /* Notify policy of page being dropped */
+                policy_notify_dropped(req->gfn);
+                continue;
+            }
+
+            pagein[nr_in].slot = slot;
+            pagein[nr_in].gfn = req->gfn;
+            pagein[nr_in].prefetched = 0;
+            nr_in++;
+
+            /* Bring in neighbours if the guest is walking through memory */
+            j = prefetch_fault(paging, req->gfn, gfns,
+                               XENPAGING_PREFETCH_MAX - nr_ahead);
+            for ( i = 0; i < j; i++ )
+            {
+                pagein[nr_in].slot = paging->gfn_to_slot[gfns[i]];
+                pagein[nr_in].gfn = gfns[i];
+                pagein[nr_in].prefetched = 1;
+                nr_in++;
+            }
+            nr_ahead += j;
         }
 
-        if ( interrupted )
+        /* Populate the pages */
+        if ( nr_in )
         {
-            ret = EINTR;
-            goto out;
+            qsort(pagein, nr_in, sizeof(pagein[0]), pagein_cmp);
+            for ( i = 0; i < nr_in; i++ )
+            {
+                slots[i] = pagein[i].slot;
+                gfns[i] = pagein[i].gfn;
+            }
+            if ( xenpaging_populate_pages(paging, gfns, slots, nr_in) < 0 )
+            {
+                ERROR("Error populating pages");
+                return -1;
+            }
         }
 
-        ret = xenpaging_evict_page(paging, gfn, slot);
-        if ( ret < 0 )
-            goto out;
-    }
-    while ( ret );
+        /* Prefetched pages have no request to answer */
+        for ( i = 0; i < nr_in; i++ )
+        {
+            if ( !pagein[i].prefetched )
+                continue;
 
-    if ( test_and_set_bit(gfn, paging->bitmap) )
-        ERROR("Page %lx has been evicted before", gfn);
+            DPRINTF("prefetch_page < gfn %lx pageslot %d\n", pagein[i].gfn, pagein[i].slot);
+            policy_notify_paged_in_nomru(pagein[i].gfn);
+            paging->num_paged_out--;
+            paging->slot_to_gfn[pagein[i].slot] = 0;
+        }
 
-    ret = 0;
+        for ( i = responses = 0; i < nr; i++ )
+        {
+            req = &reqs[i];
 
- out:
-    return ret;
+            if ( paged[i] )
+            {
+                xenpaging_resume_page(paging, req, 1);
+                responses++;
+
+                /* Clear this pagefile slot */
+                paging->slot_to_gfn[paging->gfn_to_slot[req->gfn]] = 0;
+                continue;
+            }
+
+            DPRINTF("page %s populated (domain = %d; vcpu = %d;"
+                    " gfn = %"PRIx64"; paused = %d; evict_fail = %d)\n",
+                    req->flags & MEM_EVENT_FLAG_EVICT_FAIL ? "not" : "already",
+                    paging->mem_event.domain_id, req->vcpu_id, req->gfn,
+                    !!(req->flags & MEM_EVENT_FLAG_VCPU_PAUSED) ,
+                    !!(req->flags & MEM_EVENT_FLAG_EVICT_FAIL) );
+
+            /* Tell Xen to resume the vcpu */
+            if (( req->flags & MEM_EVENT_FLAG_VCPU_PAUSED ) || ( req->flags & MEM_EVENT_FLAG_EVICT_FAIL ))
+            {
+                xenpaging_resume_page(paging, req, 0);
+                responses++;
+            }
+        }
+
+        /* Tell Xen pages are ready */
+        if ( responses && push_responses(&paging->mem_event) < 0 )
+        {
+            PERROR("Error resuming pages");
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
-/* Evict a batch of pages and write them to a free slot in the paging file
- * Returns < 0 on fatal error
- * Returns 0 if no gfn can be evicted
- * Returns > 0 on successful evict
- */
-static int evict_pages(struct xenpaging *paging, int num_pages)
+/* Trigger a page-in for a batch of pages */
+static void resume_pages(struct xenpaging *paging, int num_pages)
 {
     xc_interface *xch = paging->xc_handle;
-    int rc, slot, num = 0;
+    int i, num = 0;
 
-    /* Reuse known free slots */
-    while ( paging->stack_count > 0 && num < num_pages )
+    for ( i = 0; i < paging->max_pages && num < num_pages; i++ )
     {
-        slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        if ( test_bit(i, paging->bitmap) )
         {
-            num = rc < 0 ? -1 : num;
-            return num;
+            paging->pagein_queue[num] = i;
+            num++;
+            if ( num == XENPAGING_PAGEIN_QUEUE_SIZE )
+                break;
         }
-        num++;
     }
+    /* num may be less than num_pages, caller has to try again */
+    if ( num )
+        page_in_trigger();
+}
+
+/* Evict pages, a batch at a time, until num_pages are out or the policy
+ * has no more victims
+ * Returns < 0 on fatal error
+ * Returns the number of pages evicted otherwise
+ */
+static int evict_pages(struct xenpaging *paging, int num_pages)
+{
+    int rc, nr, num = 0;
 
-    /* Scan all slots slots for remainders */
-    for ( slot = 0; slot < paging->max_pages && num < num_pages; slot++ )
+    while ( num < num_pages && !interrupted )
     {
-        /* Slot is allocated */
-        if ( paging->slot_to_gfn[slot] )
-            continue;
+        nr = num_pages - num;
+        if ( nr > XENPAGING_BATCH_SIZE )
+            nr = XENPAGING_BATCH_SIZE;
 
-        rc = evict_victim(paging, slot);
-        if ( rc )
-        {
-            num = rc < 0 ? -1 : num;
+        rc = evict_batch(paging, nr, &num);
+        if ( rc < 0 )
+            return -1;
+        if ( rc == 0 )
             break;
-        }
-
-        num++;
     }
+
     return num;
 }
 
@@ -857,10 +1093,8 @@ int main(int argc, char *argv[])
 {
     struct sigaction act;
     struct xenpaging *paging;
-    mem_event_request_t req;
-    mem_event_response_t rsp;
     int num, prev_num = 0;
-    int slot;
+    unsigned long prefetched, used, wasted;
     int tot_pages;
     int rc;
     xc_interface *xch;
@@ -903,90 +1137,12 @@ int main(int argc, char *argv[])
             DPRINTF("Got event from Xen\n");
         }
 
-        while ( RING_HAS_UNCONSUMED_REQUESTS(&paging->mem_event.back_ring) )
-        {
-            /* Indicate possible error */
-            rc = 1;
-
-            get_request(&paging->mem_event, &req);
-
-            if ( req.gfn > paging->max_pages )
-            {
-                ERROR("Requested gfn %"PRIx64" higher than max_pages %lx\n", req.gfn, paging->max_pages);
-                goto out;
-            }
-
-            /* Check if the page has already been paged in */
-            if ( test_and_clear_bit(req.gfn, paging->bitmap) )
-            {
-                /* Find where in the paging file to read from */
-                slot = paging->gfn_to_slot[req.gfn];
-
-                /* Sanity check */
-                if ( paging->slot_to_gfn[slot] != req.gfn )
-                {
-                    ERROR("Expected gfn %"PRIx64" in slot %d, but found gfn %lx\n", req.gfn, slot, paging->slot_to_gfn[slot]);
-                    goto out;
-                }
-
-                if ( req.flags & MEM_EVENT_FLAG_DROP_PAGE )
-                {
-                    DPRINTF("drop_page ^ gfn %"PRIx64" pageslot %d\n", req.gfn, slot);
-                    /* Notify policy of page being dropped */
-                    policy_notify_dropped(req.gfn);
-                }
-                else
-                {
-                    /* Populate the page */
-                    if ( xenpaging_populate_page(paging, req.gfn, slot) < 0 )
-                    {
-                        ERROR("Error populating page %"PRIx64"", req.gfn);
-                        goto out;
-                    }
-                }
-
-                /* Prepare the response */
-                rsp.gfn = req.gfn;
-                rsp.vcpu_id = req.vcpu_id;
-                rsp.flags = req.flags;
-
-                if ( xenpaging_resume_page(paging, &rsp, 1) < 0 )
-                {
-                    PERROR("Error resuming page %"PRIx64"", req.gfn);
-                    goto out;
-                }
-
-                /* Clear this pagefile slot */
-                paging->slot_to_gfn[slot] = 0;
-
-                /* Record this free slot */
-                paging->free_slot_stack[paging->stack_count++] = slot;
-            }
-            else
-            {
-                DPRINTF("page %s populated (domain = %d; vcpu = %d;"
-                        " gfn = %"PRIx64"; paused = %d; evict_fail = %d)\n",
-                        req.flags & MEM_EVENT_FLAG_EVICT_FAIL ? "not" : "already",
-                        paging->mem_event.domain_id, req.vcpu_id, req.gfn,
-                        !!(req.flags & MEM_EVENT_FLAG_VCPU_PAUSED) ,
-                        !!(req.flags & MEM_EVENT_FLAG_EVICT_FAIL) );
-
-                /* Tell Xen to resume the vcpu */
-                if (( req.flags & MEM_EVENT_FLAG_VCPU_PAUSED ) || ( req.flags & MEM_EVENT_FLAG_EVICT_FAIL ))
-                {
-                    /* Prepare the response */
-                    rsp.gfn = req.gfn;
-                    rsp.vcpu_id = req.vcpu_id;
-                    rsp.flags = req.flags;
+        /* Indicate possible error */
+        rc = 1;
 
-                    if ( xenpaging_resume_page(paging, &rsp, 0) < 0 )
-                    {
-                        PERROR("Error resuming page %"PRIx64"", req.gfn);
-                        goto out;
-                    }
-                }
-            }
-        }
+        /* Page in, or otherwise answer, what Xen asked for */
+        if ( process_requests(paging) < 0 )
+            goto out;
 
         /* If interrupted, write all pages back into the guest */
         if ( interrupted == SIGTERM || interrupted == SIGINT )
@@ -1030,10 +1186,10 @@ int main(int argc, char *argv[])
                 prev_num = num;
             }
             /* Limit the number of evicts to be able to process page-in requests */
-            if ( num > 42 )
+            if ( num > XENPAGING_BATCH_SIZE )
             {
                 paging->use_poll_timeout = 0;
-                num = 42;
+                num = XENPAGING_BATCH_SIZE;
             }
             if ( evict_pages(paging, num) < 0 )
                 goto out;
@@ -1062,6 +1218,11 @@ int main(int argc, char *argv[])
 
     DPRINTF("xenpaging got signal %d\n", interrupted);
 
+    prefetch_stats(&prefetched, &used, &wasted);
+    DPRINTF("prefetched %lu pages: %lu used, %lu wasted, %lu%% hit rate\n",
+            prefetched, used, wasted,
+            used + wasted ? used * 100 / (used + wasted) : 0);
+
  out:
     close(paging->fd);
     unlink_pagefile();
@@ -31,6 +31,13 @@
 
 #define XENPAGING_PAGEIN_QUEUE_SIZE 64
 
+/* Pages evicted, or paged in, per round trip to Xen and the pagefile */
+#define XENPAGING_BATCH_SIZE 64
+
+/* Cap, and default, for pages prefetched per fault (and per batch) */
+#define XENPAGING_PREFETCH_MAX     64
+#define XENPAGING_PREFETCH_DEFAULT 32
+
 struct mem_event {
     domid_t domain_id;
     xc_evtchn *xce_handle;
@@ -38,6 +45,7 @@ struct mem_event {
     mem_event_back_ring_t back_ring;
     uint32_t evtchn_port;
     void *ring_page;
+    unsigned int ring_pages;
 };
 
 struct xenpaging {
@@ -58,10 +66,11 @@ struct xenpaging {
     int num_paged_out;
     int target_tot_pages;
     int policy_mru_size;
+    int prefetch_max;
     int use_poll_timeout;
     int debug;
-    int stack_count;
-    int *free_slot_stack;
+    /* pagefile slot to try next: evictions are appended at the head */
+    int log_head;
     unsigned long pagein_queue[XENPAGING_PAGEIN_QUEUE_SIZE];
 };
 
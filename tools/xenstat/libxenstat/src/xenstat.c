@@ -54,12 +54,16 @@ typedef struct xenstat_collector {
 
 static int  xenstat_collect_vcpus(xenstat_node * node);
 static int  xenstat_collect_xen_version(xenstat_node * node);
+static int  xenstat_collect_tmem(xenstat_node * node);
+static int  xenstat_collect_perf(xenstat_node * node);
 static void xenstat_free_vcpus(xenstat_node * node);
 static void xenstat_free_networks(xenstat_node * node);
 static void xenstat_free_xen_version(xenstat_node * node);
 static void xenstat_free_vbds(xenstat_node * node);
+static void xenstat_free_nothing(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
+static void xenstat_uninit_nothing(xenstat_handle * handle);
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
 
@@ -71,7 +75,11 @@ static xenstat_collector collectors[] = {
 	{ XENSTAT_XEN_VERSION, xenstat_collect_xen_version,
 	  xenstat_free_xen_version, xenstat_uninit_xen_version },
 	{ XENSTAT_VBD, xenstat_collect_vbds,
-	  xenstat_free_vbds, xenstat_uninit_vbds }
+	  xenstat_free_vbds, xenstat_uninit_vbds },
+	{ XENSTAT_TMEM, xenstat_collect_tmem,
+	  xenstat_free_nothing, xenstat_uninit_nothing },
+	{ XENSTAT_PERF, xenstat_collect_perf,
+	  xenstat_free_nothing, xenstat_uninit_nothing }
 };
 
 #define NUM_COLLECTORS (sizeof(collectors)/sizeof(xenstat_collector))
@@ -124,6 +132,9 @@ void xenstat_uninit(xenstat_handle * handle)
 	if (handle) {
 		for (i = 0; i < NUM_COLLECTORS; i++)
 			collectors[i].uninit(handle);
+		for (i = 0; i < handle->num_names; i++)
+			free(handle->names[i].name);
+		free(handle->names);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
 		free(handle->priv);
@@ -158,13 +169,60 @@ void domain_get_tmem_stats(xenstat_handle * handle, xenstat_domain * domain)
 	domain->tmem_stats.succ_pers_gets = parse(buffer,"Gp");
 }
 
+static void domain_get_perf_stats(xenstat_handle * handle, xenstat_domain * domain)
+{
+	xc_domain_perf_get(handle->xc_handle, domain->id,
+			   XEN_SYSCTL_DOMAIN_PERF_ALL_VCPUS, 0,
+			   &domain->perf_stats.counters);
+}
+
+/* Find the cached name of a domain, if it is still fresh.  Domains are
+ * looked up in id order, so the cache is searched onwards from *pos. */
+static struct xenstat_domain_name *
+xenstat_cached_name(xenstat_handle * handle, unsigned int *pos,
+		    xc_domaininfo_t * info, time_t now)
+{
+	struct xenstat_domain_name *entry;
+
+	while (*pos < handle->num_names &&
+	       handle->names[*pos].id < info->domain)
+		(*pos)++;
+	if (*pos == handle->num_names)
+		return NULL;
+
+	entry = &handle->names[*pos];
+	if (entry->id != info->domain || entry->name == NULL ||
+	    memcmp(entry->uuid, info->handle, sizeof(entry->uuid)) != 0 ||
+	    now - entry->read >= NAME_CACHE_TTL)
+		return NULL;
+	return entry;
+}
+
+/* Replace the name cache with the names of the latest node */
+static void xenstat_set_names(xenstat_handle * handle,
+			      struct xenstat_domain_name *names,
+			      unsigned int num_names)
+{
+	unsigned int i;
+
+	for (i = 0; i < handle->num_names; i++)
+		free(handle->names[i].name);
+	free(handle->names);
+	handle->names = names;
+	handle->num_names = num_names;
+}
+
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 {
 #define DOMAIN_CHUNK_SIZE 256
 	xenstat_node *node;
 	xc_physinfo_t physinfo = { 0 };
 	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
-	unsigned int new_domains;
+	struct xenstat_domain_name *names = NULL;
+	unsigned int num_names = 0, pos = 0;
+	unsigned int next_domid = 0;
+	time_t now = time(NULL);
+	int new_domains;
 	unsigned int i;
 
 	/* Create the node */
@@ -203,13 +261,16 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	node->num_domains = 0;
 	do {
 		xenstat_domain *domain, *tmp;
+		struct xenstat_domain_name *tmp_names;
 
 		new_domains = xc_domain_getinfolist(handle->xc_handle,
-						    node->num_domains, 
+						    next_domid,
 						    DOMAIN_CHUNK_SIZE, 
 						    domaininfo);
 		if (new_domains < 0)
 			goto err;
+		if (new_domains > 0)
+			next_domid = domaininfo[new_domains - 1].domain + 1;
 
 		tmp = realloc(node->domains,
 			      (node->num_domains + new_domains)
@@ -219,29 +280,56 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 		node->domains = tmp;
 
+		/* one spare, as realloc of 0 bytes may fail */
+		tmp_names = realloc(names, (num_names + new_domains + 1)
+				    * sizeof(*names));
+		if (tmp_names == NULL)
+			goto err;
+
+		names = tmp_names;
+
 		domain = node->domains + node->num_domains;
 
 		/* zero out newly allocated memory in case error occurs below */
 		memset(domain, 0, new_domains * sizeof(xenstat_domain));
 
 		for (i = 0; i < new_domains; i++) {
+			struct xenstat_domain_name *name = &names[num_names];
+			struct xenstat_domain_name *cached;
+
 			/* Fill in domain using domaininfo[i] */
 			domain->id = domaininfo[i].domain;
-			domain->name = xenstat_get_domain_name(handle, 
-							       domain->id);
-			if (domain->name == NULL) {
-				if (errno == ENOMEM) {
-					/* fatal error */
-					xenstat_free_node(node);
-					return NULL;
-				}
-				else {
-					/* failed to get name -- this means the
-					   domain is being destroyed so simply
-					   ignore this entry */
-					continue;
+			cached = xenstat_cached_name(handle, &pos,
+						     &domaininfo[i], now);
+			if (cached) {
+				*name = *cached;
+				cached->name = NULL;
+			} else {
+				name->name = xenstat_get_domain_name(handle,
+								     domain->id);
+				if (name->name == NULL) {
+					if (errno == ENOMEM) {
+						/* fatal error */
+						goto err_free;
+					}
+					else {
+						/* failed to get name -- this
+						   means the domain is being
+						   destroyed so simply ignore
+						   this entry */
+						continue;
+					}
 				}
+				name->id = domain->id;
+				memcpy(name->uuid, domaininfo[i].handle,
+				       sizeof(name->uuid));
+				name->read = now;
 			}
+			num_names++;
+
+			domain->name = strdup(name->name);
+			if (domain->name == NULL)
+				goto err_free;
 			domain->state = domaininfo[i].flags;
 			domain->cpu_ns = domaininfo[i].cpu_time;
 			domain->num_vcpus = (domaininfo[i].max_vcpu_id+1);
@@ -259,7 +347,6 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->networks = NULL;
 			domain->num_vbds = 0;
 			domain->vbds = NULL;
-			domain_get_tmem_stats(handle,domain);
 
 			domain++;
 			node->num_domains++;
@@ -267,6 +354,8 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	} while (new_domains == DOMAIN_CHUNK_SIZE);
 
 
+	xenstat_set_names(handle, names, num_names);
+
 	/* Run all the extra data collectors requested */
 	node->flags = 0;
 	for (i = 0; i < NUM_COLLECTORS; i++) {
@@ -280,7 +369,14 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	}
 
 	return node;
+err_free:
+	xenstat_set_names(handle, names, num_names);
+	xenstat_free_node(node);
+	return NULL;
 err:
+	xenstat_set_names(handle, names, num_names);
+	for (i = 0; i < node->num_domains; i++)
+		free(node->domains[i].name);
 	free(node->domains);
 	free(node);
 	return NULL;
@@ -307,13 +403,19 @@ void xenstat_free_node(xenstat_node * node)
 
 xenstat_domain *xenstat_node_domain(xenstat_node * node, unsigned int domid)
 {
-	unsigned int i;
+	unsigned int lo = 0, hi = node->num_domains;
 
-	/* FIXME: binary search */
-	/* Find the appropriate domain entry in the node struct. */
-	for (i = 0; i < node->num_domains; i++) {
-		if (node->domains[i].id == domid)
-			return &(node->domains[i]);
+	/* Find the appropriate domain entry in the node struct: the domains
+	 * are in id order. */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (node->domains[mid].id == domid)
+			return &(node->domains[mid]);
+		if (node->domains[mid].id < domid)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 	return NULL;
 }
@@ -479,22 +581,110 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /*
  * VCPU functions
  */
+/* Number of VCPUs to fetch scheduling statistics of at once */
+#define VCPU_SCHED_BATCH 256
+
+/* Collect the information about all VCPUs with XEN_SYSCTL_vcpu_sched_stats,
+ * pruning the domains that have gone.  Returns -1 if Xen lacks it. */
+static int xenstat_collect_vcpu_sched(xenstat_node * node)
+{
+	xc_vcpu_sched_stats_t *stats;
+	unsigned int max = VCPU_SCHED_BATCH, i, j;
+	uint32_t first = 0, next;
+	unsigned char *seen;
+	int num, ret = 0;
+
+	seen = calloc(node->num_domains + 1, 1);
+	stats = malloc(max * sizeof(*stats));
+	if (seen == NULL || stats == NULL) {
+		free(seen);
+		free(stats);
+		return 0;
+	}
+
+	do {
+		num = xc_vcpu_sched_stats(node->handle->xc_handle, first,
+					  max, stats, &next);
+		if (num < 0 && errno == ENOBUFS) {
+			/* A domain with more VCPUs than fit */
+			xc_vcpu_sched_stats_t *tmp;
+			tmp = realloc(stats, 2 * max * sizeof(*stats));
+			if (tmp == NULL)
+				goto out;
+			stats = tmp;
+			max *= 2;
+			continue;
+		}
+		if (num < 0) {
+			ret = first == 0 ? -1 : 0;
+			goto out;
+		}
+
+		for (i = 0; i < num; i++) {
+			xenstat_domain *domain;
+			xenstat_vcpu *vcpu;
+
+			domain = xenstat_node_domain(node, stats[i].domid);
+			if (domain == NULL || stats[i].vcpu >= domain->num_vcpus)
+				continue;
+			seen[domain - node->domains] = 1;
+
+			vcpu = &domain->vcpus[stats[i].vcpu];
+			vcpu->online = !!(stats[i].flags &
+					  XEN_SYSCTL_VCPU_SCHED_online);
+			vcpu->ns = stats[i].time[RUNSTATE_running];
+			for (j = 0; j < 4; j++)
+				vcpu->runstate_ns[j] = stats[i].time[j];
+			for (j = 0; j < XENSTAT_SCHED_HIST_BUCKETS; j++) {
+				vcpu->latency[XENSTAT_LATENCY_WAKE][j] =
+					stats[i].wake_latency[j];
+				vcpu->latency[XENSTAT_LATENCY_WAIT][j] =
+					stats[i].runnable_wait[j];
+			}
+		}
+		first = next;
+	} while (first != DOMID_INVALID);
+
+	/* Domains Xen no longer knows about are in transition - remove
+	   them from the list */
+	for (i = node->num_domains; i-- > 0; ) {
+		if (seen[i])
+			continue;
+		free(node->domains[i].name);
+		free(node->domains[i].vcpus);
+		xenstat_prune_domain(node, i);
+	}
+	ret = 1;
+
+ out:
+	free(seen);
+	free(stats);
+	return ret;
+}
+
 /* Collect information about VCPUs */
 static int xenstat_collect_vcpus(xenstat_node * node)
 {
 	unsigned int i, vcpu, inc_index;
+	int ret;
+
+	for (i = 0; i < node->num_domains; i++) {
+		node->domains[i].vcpus = calloc(node->domains[i].num_vcpus,
+						sizeof(xenstat_vcpu));
+		if (node->domains[i].vcpus == NULL)
+			return 0;
+	}
+
+	/* All VCPUs of all domains in one go, if we can */
+	ret = xenstat_collect_vcpu_sched(node);
+	if (ret >= 0)
+		return ret;
 
 	/* Fill in VCPU information */
 	for (i = 0; i < node->num_domains; i+=inc_index) {
 		inc_index = 1; /* default is to increment to next domain */
 
-		node->domains[i].vcpus = malloc(node->domains[i].num_vcpus
-						* sizeof(xenstat_vcpu));
-		if (node->domains[i].vcpus == NULL)
-			return 0;
-	
 		for (vcpu = 0; vcpu < node->domains[i].num_vcpus; vcpu++) {
-			/* FIXME: need to be using a more efficient mechanism*/
 			xc_vcpuinfo_t info;
 
 			if (xc_vcpu_getinfo(node->handle->xc_handle,
@@ -506,6 +696,8 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 				else {
 					/* domain is in transition - remove
 					   from list */
+					free(node->domains[i].name);
+					free(node->domains[i].vcpus);
 					xenstat_prune_domain(node, i);
 
 					/* remember not to increment index! */
@@ -516,6 +708,8 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 			else {
 				node->domains[i].vcpus[vcpu].online = info.online;
 				node->domains[i].vcpus[vcpu].ns = info.cpu_time;
+				node->domains[i].vcpus[vcpu].runstate_ns[RUNSTATE_running] =
+					info.cpu_time;
 			}
 		}
 	}
@@ -547,6 +741,65 @@ unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu)
 	return vcpu->ns;
 }
 
+/* Get VCPU steal time */
+unsigned long long xenstat_vcpu_runnable_ns(xenstat_vcpu * vcpu)
+{
+	return vcpu->runstate_ns[RUNSTATE_runnable];
+}
+
+/* Get VCPU blocked time */
+unsigned long long xenstat_vcpu_blocked_ns(xenstat_vcpu * vcpu)
+{
+	return vcpu->runstate_ns[RUNSTATE_blocked];
+}
+
+/* Get VCPU offline time */
+unsigned long long xenstat_vcpu_offline_ns(xenstat_vcpu * vcpu)
+{
+	return vcpu->runstate_ns[RUNSTATE_offline];
+}
+
+/* Get a bucket of a VCPU latency histogram */
+unsigned long long xenstat_vcpu_latency_hist(xenstat_vcpu * vcpu,
+					     unsigned int type,
+					     unsigned int bucket)
+{
+	if (type > XENSTAT_LATENCY_WAIT || bucket >= XENSTAT_SCHED_HIST_BUCKETS)
+		return 0;
+	return vcpu->latency[type][bucket];
+}
+
+/* Get a VCPU latency percentile, from the histogram since old */
+unsigned long long xenstat_vcpu_latency_pct(xenstat_vcpu * vcpu,
+					    xenstat_vcpu * old,
+					    unsigned int type,
+					    unsigned int pct)
+{
+	unsigned long long delta[XENSTAT_SCHED_HIST_BUCKETS];
+	unsigned long long total = 0, sum = 0;
+	unsigned int i;
+
+	if (type > XENSTAT_LATENCY_WAIT)
+		return 0;
+
+	for (i = 0; i < XENSTAT_SCHED_HIST_BUCKETS; i++) {
+		delta[i] = vcpu->latency[type][i];
+		/* The histograms may have been reset since */
+		if (old != NULL && old->latency[type][i] <= delta[i])
+			delta[i] -= old->latency[type][i];
+		total += delta[i];
+	}
+	if (total == 0)
+		return 0;
+
+	for (i = 0; i < XENSTAT_SCHED_HIST_BUCKETS - 1; i++) {
+		sum += delta[i];
+		if (sum * 100 >= total * pct)
+			break;
+	}
+	return 1ULL << i;
+}
+
 /*
  * Network functions
  */
@@ -653,6 +906,15 @@ static void xenstat_uninit_xen_version(xenstat_handle * handle)
 {
 }
 
+/* For collectors that keep nothing in the node or handle */
+static void xenstat_free_nothing(xenstat_node * node)
+{
+}
+
+static void xenstat_uninit_nothing(xenstat_handle * handle)
+{
+}
+
 /*
  * VBD functions
  */
@@ -711,6 +973,16 @@ unsigned long long xenstat_vbd_wr_sects(xenstat_vbd * vbd)
  * Tmem functions
  */
 
+/* Collect tmem information */
+static int xenstat_collect_tmem(xenstat_node * node)
+{
+	unsigned int i;
+
+	for (i = 0; i < node->num_domains; i++)
+		domain_get_tmem_stats(node->handle, &node->domains[i]);
+	return 1;
+}
+
 xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain)
 {
 	return &domain->tmem_stats;
@@ -740,6 +1012,92 @@ unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem)
 	return tmem->succ_pers_gets;
 }
 
+/*
+ * Perf functions
+ */
+
+/* Collect hypervisor activity counters */
+static int xenstat_collect_perf(xenstat_node * node)
+{
+	unsigned int i;
+
+	for (i = 0; i < node->num_domains; i++)
+		domain_get_perf_stats(node->handle, &node->domains[i]);
+	return 1;
+}
+
+xenstat_perf *xenstat_domain_perf(xenstat_domain * domain)
+{
+	return &domain->perf_stats;
+}
+
+static unsigned long long sum_counters(const uint64_t *ctr, unsigned int nr)
+{
+	unsigned long long sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		sum += ctr[i];
+	return sum;
+}
+
+#define NR_COUNTERS(perf, ctr) \
+	(sizeof((perf)->counters.ctr) / sizeof((perf)->counters.ctr[0]))
+
+/* Get the total number of hypercalls */
+unsigned long long xenstat_perf_hypercalls(xenstat_perf *perf)
+{
+	return sum_counters(perf->counters.hypercalls,
+			    NR_COUNTERS(perf, hypercalls));
+}
+
+/* Get the number of hypercalls of a given number */
+unsigned long long xenstat_perf_hypercall(xenstat_perf *perf, unsigned int nr)
+{
+	return nr < NR_COUNTERS(perf, hypercalls)
+		? perf->counters.hypercalls[nr] : 0;
+}
+
+/* Get the total number of VM exits */
+unsigned long long xenstat_perf_vmexits(xenstat_perf *perf)
+{
+	return sum_counters(perf->counters.vmexits,
+			    NR_COUNTERS(perf, vmexits));
+}
+
+/* Get the number of VM exits for a given (VMX or SVM) exit reason */
+unsigned long long xenstat_perf_vmexit(xenstat_perf *perf, unsigned int reason)
+{
+	return reason < NR_COUNTERS(perf, vmexits)
+		? perf->counters.vmexits[reason] : 0;
+}
+
+/* Get the total number of grant table operations */
+unsigned long long xenstat_perf_grant_ops(xenstat_perf *perf)
+{
+	return sum_counters(perf->counters.grant_ops,
+			    NR_COUNTERS(perf, grant_ops));
+}
+
+/* Get the number of grant table operations of a given GNTTABOP_* command */
+unsigned long long xenstat_perf_grant_op(xenstat_perf *perf, unsigned int cmd)
+{
+	return cmd < NR_COUNTERS(perf, grant_ops)
+		? perf->counters.grant_ops[cmd] : 0;
+}
+
+/* Get the number of event channel notifications sent */
+unsigned long long xenstat_perf_evtchn_sends(xenstat_perf *perf)
+{
+	return perf->counters.evtchn_sends;
+}
+
+/* Get the number of instructions the hypervisor emulated */
+unsigned long long xenstat_perf_emulations(xenstat_perf *perf)
+{
+	return perf->counters.emulations;
+}
+
 
 static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain_id)
 {
@@ -28,6 +28,7 @@ typedef struct xenstat_vcpu xenstat_vcpu;
 typedef struct xenstat_network xenstat_network;
 typedef struct xenstat_vbd xenstat_vbd;
 typedef struct xenstat_tmem xenstat_tmem;
+typedef struct xenstat_perf xenstat_perf;
 
 /* Initialize the xenstat library.  Returns a handle to be used with
  * subsequent calls to the xenstat library, or NULL if an error occurs. */
@@ -36,14 +37,19 @@ xenstat_handle *xenstat_init(void);
 /* Release the handle to libxc, free resources, etc. */
 void xenstat_uninit(xenstat_handle * handle);
 
-/* Flags for types of information to collect in xenstat_get_node */
+/* Flags for types of information to collect in xenstat_get_node.  Each
+ * costs a pass over the domains, so only ask for what will be used. */
 #define XENSTAT_VCPU 0x1
 #define XENSTAT_NETWORK 0x2
 #define XENSTAT_XEN_VERSION 0x4
 #define XENSTAT_VBD 0x8
-#define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD)
+#define XENSTAT_TMEM 0x10
+#define XENSTAT_PERF 0x20
+#define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD|\
+		     XENSTAT_TMEM|XENSTAT_PERF)
 
-/* Get all available information about a node */
+/* Get all available information about a node.  Domain names are cached in
+ * the handle, and re-read from xenstore every few seconds. */
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
 
 /* Free the information */
@@ -136,6 +142,9 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /* Get the tmem information for a given domain */
 xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 
+/* Get the hypervisor activity counters of a given domain */
+xenstat_perf *xenstat_domain_perf(xenstat_domain * domain);
+
 /*
  * VCPU functions - extract information from a xenstat_vcpu
  */
@@ -144,6 +153,32 @@ xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 unsigned int xenstat_vcpu_online(xenstat_vcpu * vcpu);
 unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu);
 
+/* Get the time, in ns, the VCPU has spent runnable but not running
+ * (steal time), blocked, and offline or paused */
+unsigned long long xenstat_vcpu_runnable_ns(xenstat_vcpu * vcpu);
+unsigned long long xenstat_vcpu_blocked_ns(xenstat_vcpu * vcpu);
+unsigned long long xenstat_vcpu_offline_ns(xenstat_vcpu * vcpu);
+
+/* Scheduling latencies: from wakeup to running, and from any runnable
+ * state (including preemption) to running */
+#define XENSTAT_LATENCY_WAKE 0
+#define XENSTAT_LATENCY_WAIT 1
+
+/* Latency histograms have log2 buckets: bucket 0 counts latencies under
+ * 1us, bucket i those in [2^(i-1), 2^i) us; the last is open ended */
+#define XENSTAT_SCHED_HIST_BUCKETS 16
+unsigned long long xenstat_vcpu_latency_hist(xenstat_vcpu * vcpu,
+					     unsigned int type,
+					     unsigned int bucket);
+
+/* Get the pct-th percentile of the latencies of a VCPU, in us rounded up to
+ * a bucket boundary, counting only those since the sample old of the same
+ * VCPU (or all of them if old is NULL).  Returns 0 if there were none. */
+unsigned long long xenstat_vcpu_latency_pct(xenstat_vcpu * vcpu,
+					    xenstat_vcpu * old,
+					    unsigned int type,
+					    unsigned int pct);
+
 
 /*
  * Network functions - extract information from a xenstat_network
@@ -201,4 +236,17 @@ unsigned long long xenstat_tmem_succ_eph_gets(xenstat_tmem *tmem);
 unsigned long long xenstat_tmem_succ_pers_puts(xenstat_tmem *tmem);
 unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem);
 
+/*
+ * Perf functions - extract hypervisor activity counters, cumulative over
+ * the domain's lifetime.  Counts by index return 0 for an unknown index.
+ */
+unsigned long long xenstat_perf_hypercalls(xenstat_perf *perf);
+unsigned long long xenstat_perf_hypercall(xenstat_perf *perf, unsigned int nr);
+unsigned long long xenstat_perf_vmexits(xenstat_perf *perf);
+unsigned long long xenstat_perf_vmexit(xenstat_perf *perf, unsigned int reason);
+unsigned long long xenstat_perf_grant_ops(xenstat_perf *perf);
+unsigned long long xenstat_perf_grant_op(xenstat_perf *perf, unsigned int cmd);
+unsigned long long xenstat_perf_evtchn_sends(xenstat_perf *perf);
+unsigned long long xenstat_perf_emulations(xenstat_perf *perf);
+
 #endif /* XENSTAT_H */
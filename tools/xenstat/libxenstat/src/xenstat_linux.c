@@ -20,10 +20,16 @@
  * Use is subject to license terms.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,9 +40,39 @@
 
 #define SYSFS_VBD_PATH "/sys/bus/xen-backend/devices"
 
+/* A network interface and its stats, as dumped by rtnetlink */
+struct netdev {
+	char name[IFNAMSIZ];
+	int bridge;
+	xenstat_network stats;
+};
+
+/* The statistics files of a VBD, kept open from one sample to the next */
+#define NUM_VBD_STATS 5
+static const char *vbd_stats[NUM_VBD_STATS] = {
+	"statistics/oo_req", "statistics/rd_req", "statistics/wr_req",
+	"statistics/rd_sect", "statistics/wr_sect",
+};
+
+struct vbd_files {
+	char *name;			/* Directory in SYSFS_VBD_PATH */
+	int fd[NUM_VBD_STATS];
+};
+
+/* Most statistics files kept open, to leave the caller fds of its own */
+#define MAX_VBD_FDS 512
+
 struct priv_data {
 	FILE *procnetdev;
 	DIR *sysfsvbd;
+	int netlink;			/* rtnetlink socket, or -1 */
+	unsigned int netlink_seq;
+	struct netdev *netdevs;		/* Interfaces of the last dump */
+	unsigned int num_netdevs;
+	unsigned int max_netdevs;
+	struct vbd_files *vbds;		/* VBDs of the last sample */
+	unsigned int num_vbds;
+	unsigned int vbd_fds;		/* Statistics files open */
 };
 
 static struct priv_data *
@@ -45,12 +81,11 @@ get_priv_data(xenstat_handle *handle)
 	if (handle->priv != NULL)
 		return handle->priv;
 
-	handle->priv = malloc(sizeof(struct priv_data));
+	handle->priv = calloc(1, sizeof(struct priv_data));
 	if (handle->priv == NULL)
 		return (NULL);
 
-	((struct priv_data *)handle->priv)->procnetdev = NULL;
-	((struct priv_data *)handle->priv)->sysfsvbd = NULL;
+	((struct priv_data *)handle->priv)->netlink = -1;
 
 	return handle->priv;
 }
@@ -235,21 +270,215 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	return 0;
 }
 
-/* Collect information about networks */
-int xenstat_collect_networks(xenstat_node * node)
+/* Add the stats of an interface to its domain: those of a vif to the
+ * domain it belongs to, those of the bridge to dom0 if we are most likely
+ * bonding (the bridge is given as devBridge, or NULL if unknown) */
+static int xenstat_add_network(xenstat_node * node, const char *iface,
+			       xenstat_network * net, const char *devBridge,
+			       const char *devNoBridge)
 {
-	/* Helper variables for parseNetDevLine() function defined above */
+	xenstat_domain *domain;
+	unsigned int domid;
 	int i;
-	char line[512] = { 0 }, iface[16] = { 0 }, devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
-	unsigned long long rxBytes, rxPackets, rxErrs, rxDrops, txBytes, txPackets, txErrs, txDrops;
 
-	struct priv_data *priv = get_priv_data(node->handle);
+	/* If the device is the network bridge and both tx & rx bytes of
+	 * dom0 are zero, we are most likely using bonding so we alter the
+	 * configuration for dom0 to have bridge stats */
+	if (devBridge != NULL &&
+	    (strstr(iface, devBridge) != NULL) &&
+	    (strstr(iface, devNoBridge) == NULL) &&
+	    ((domain = xenstat_node_domain(node, 0)) != NULL)) {
+		for (i = 0; i < domain->num_networks; i++) {
+			if ((domain->networks[i].id != 0) ||
+			    (domain->networks[i].tbytes != 0) ||
+			    (domain->networks[i].rbytes != 0))
+				continue;
+			net->id = 0;
+			domain->networks[i] = *net;
+		}
+		return 1;
+	}
 
-	if (priv == NULL) {
-		perror("Allocation error");
+	/* Otherwise we need to preserve old behaviour */
+	if (strstr(iface, "vif") == NULL ||
+	    sscanf(iface, "vif%u.%u", &domid, &net->id) != 2)
+		return 1;
+
+	domain = xenstat_node_domain(node, domid);
+	if (domain == NULL) {
+		fprintf(stderr,
+			"Found interface vif%u.%u but domain %u"
+			" does not exist.\n", domid, net->id,
+			domid);
+		return 1;
+	}
+	if (domain->networks == NULL) {
+		domain->num_networks = 1;
+		domain->networks = malloc(sizeof(xenstat_network));
+	} else {
+		struct xenstat_network *tmp;
+		domain->num_networks++;
+		tmp = realloc(domain->networks,
+			      domain->num_networks *
+			      sizeof(xenstat_network));
+		if (tmp == NULL)
+			free(domain->networks);
+		domain->networks = tmp;
+	}
+	if (domain->networks == NULL)
 		return 0;
+	domain->networks[domain->num_networks - 1] = *net;
+	return 1;
+}
+
+/* Record an interface from an RTM_NEWLINK message */
+static int add_netdev(struct priv_data *priv, struct nlmsghdr *nlh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+	struct rtattr *rta;
+	struct netdev *dev;
+
+	if (len < 0)
+		return 1;
+
+	if (priv->num_netdevs == priv->max_netdevs) {
+		unsigned int max = priv->max_netdevs ? 2 * priv->max_netdevs : 64;
+		dev = realloc(priv->netdevs, max * sizeof(*dev));
+		if (dev == NULL)
+			return 0;
+		priv->netdevs = dev;
+		priv->max_netdevs = max;
 	}
 
+	dev = &priv->netdevs[priv->num_netdevs];
+	memset(dev, 0, sizeof(*dev));
+
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len);
+	     rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			snprintf(dev->name, sizeof(dev->name), "%s",
+				 (char *)RTA_DATA(rta));
+			break;
+		case IFLA_STATS:
+			/* Only used if the kernel has no IFLA_STATS64 */
+			if (dev->stats.rpackets == 0 && dev->stats.tpackets == 0 &&
+			    RTA_PAYLOAD(rta) >= sizeof(struct rtnl_link_stats)) {
+				struct rtnl_link_stats *s = RTA_DATA(rta);
+				dev->stats.rbytes = s->rx_bytes;
+				dev->stats.rpackets = s->rx_packets;
+				dev->stats.rerrs = s->rx_errors;
+				dev->stats.rdrop = s->rx_dropped;
+				dev->stats.tbytes = s->tx_bytes;
+				dev->stats.tpackets = s->tx_packets;
+				dev->stats.terrs = s->tx_errors;
+				dev->stats.tdrop = s->tx_dropped;
+			}
+			break;
+		case IFLA_STATS64:
+			if (RTA_PAYLOAD(rta) >= sizeof(struct rtnl_link_stats64)) {
+				struct rtnl_link_stats64 s;
+				/* The attribute is only 4 byte aligned */
+				memcpy(&s, RTA_DATA(rta), sizeof(s));
+				dev->stats.rbytes = s.rx_bytes;
+				dev->stats.rpackets = s.rx_packets;
+				dev->stats.rerrs = s.rx_errors;
+				dev->stats.rdrop = s.rx_dropped;
+				dev->stats.tbytes = s.tx_bytes;
+				dev->stats.tpackets = s.tx_packets;
+				dev->stats.terrs = s.tx_errors;
+				dev->stats.tdrop = s.tx_dropped;
+			}
+			break;
+		case IFLA_LINKINFO: {
+			struct rtattr *info = RTA_DATA(rta);
+			int info_len = RTA_PAYLOAD(rta);
+
+			for (; RTA_OK(info, info_len);
+			     info = RTA_NEXT(info, info_len))
+				if (info->rta_type == IFLA_INFO_KIND &&
+				    strcmp(RTA_DATA(info), "bridge") == 0)
+					dev->bridge = 1;
+			break;
+		}
+		}
+	}
+
+	if (dev->name[0] != '\0')
+		priv->num_netdevs++;
+	return 1;
+}
+
+/* Dump the interfaces and their stats with a single rtnetlink request,
+ * rather than have the kernel format /proc/net/dev for us to parse */
+static int read_netdevs(struct priv_data *priv)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct ifinfomsg ifi;
+	} req;
+	static char buf[32768] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct sockaddr_nl addr;
+
+	if (priv->netlink == -1) {
+		priv->netlink = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+				       NETLINK_ROUTE);
+		if (priv->netlink == -1)
+			return -1;
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		if (bind(priv->netlink, (struct sockaddr *)&addr,
+			 sizeof(addr)) == -1) {
+			close(priv->netlink);
+			priv->netlink = -1;
+			return -1;
+		}
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nlh.nlmsg_type = RTM_GETLINK;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = ++priv->netlink_seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+	if (send(priv->netlink, &req, req.nlh.nlmsg_len, 0) == -1)
+		return -1;
+
+	priv->num_netdevs = 0;
+	for (;;) {
+		struct nlmsghdr *nlh;
+		ssize_t len = recv(priv->netlink, buf, sizeof(buf), 0);
+
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return -1;
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			/* Left over from a dump we gave up on */
+			if (nlh->nlmsg_seq != priv->netlink_seq)
+				continue;
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				return -1;
+			if (nlh->nlmsg_type == RTM_NEWLINK &&
+			    !add_netdev(priv, nlh))
+				return -1;
+		}
+	}
+}
+
+/* Collect information about networks from /proc/net/dev */
+static int collect_networks_procnetdev(xenstat_node * node,
+				       struct priv_data *priv)
+{
+	/* Helper variables for parseNetDevLine() function defined above */
+	char line[512] = { 0 }, iface[16] = { 0 }, devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
+	unsigned long long rxBytes, rxPackets, rxErrs, rxDrops, txBytes, txPackets, txErrs, txDrops;
+
 	/* Open and validate /proc/net/dev if we haven't already */
 	if (priv->procnetdev == NULL) {
 		char header[sizeof(PROCNETDEV_HEADER)];
@@ -274,7 +503,6 @@ int xenstat_collect_networks(xenstat_node * node)
 	}
 
 	/* Fill in networks */
-	/* FIXME: optimize this */
 	fseek(priv->procnetdev, sizeof(PROCNETDEV_HEADER) - 1,
 	      SEEK_SET);
 
@@ -283,73 +511,58 @@ int xenstat_collect_networks(xenstat_node * node)
 	snprintf(devNoBridge, 16, "p%s", devBridge);
 
 	while (fgets(line, 512, priv->procnetdev)) {
-		xenstat_domain *domain;
 		xenstat_network net;
-		unsigned int domid;
 
 		parseNetDevLine(line, iface, &rxBytes, &rxPackets, &rxErrs, &rxDrops, NULL, NULL, NULL,
 				NULL, &txBytes, &txPackets, &txErrs, &txDrops, NULL, NULL, NULL, NULL);
 
-		/* If the device parsed is network bridge and both tx & rx packets are zero, we are most */
-		/* likely using bonding so we alter the configuration for dom0 to have bridge stats */
-		if ((strstr(iface, devBridge) != NULL) &&
-		    (strstr(iface, devNoBridge) == NULL) &&
-		    ((domain = xenstat_node_domain(node, 0)) != NULL)) {
-			for (i = 0; i < domain->num_networks; i++) {
-				if ((domain->networks[i].id != 0) ||
-				    (domain->networks[i].tbytes != 0) ||
-				    (domain->networks[i].rbytes != 0))
-					continue;
-				domain->networks[i].tbytes = txBytes;
-				domain->networks[i].tpackets = txPackets;
-				domain->networks[i].terrs = txErrs;
-				domain->networks[i].tdrop = txDrops;
-				domain->networks[i].rbytes = rxBytes;
-				domain->networks[i].rpackets = rxPackets;
-				domain->networks[i].rerrs = rxErrs;
-				domain->networks[i].rdrop = rxDrops;
-			}
-		}
-		else /* Otherwise we need to preserve old behaviour */
-		if (strstr(iface, "vif") != NULL) {
-			sscanf(iface, "vif%u.%u", &domid, &net.id);
-
-			net.tbytes = txBytes;
-			net.tpackets = txPackets;
-			net.terrs = txErrs;
-			net.tdrop = txDrops;
-			net.rbytes = rxBytes;
-			net.rpackets = rxPackets;
-			net.rerrs = rxErrs;
-			net.rdrop = rxDrops;
-
-		/* FIXME: this does a search for the domid */
-		  domain = xenstat_node_domain(node, domid);
-		  if (domain == NULL) {
-			fprintf(stderr,
-				"Found interface vif%u.%u but domain %u"
-				" does not exist.\n", domid, net.id,
-				domid);
-			continue;
-		  }
-		  if (domain->networks == NULL) {
-			domain->num_networks = 1;
-			domain->networks = malloc(sizeof(xenstat_network));
-		  } else {
-			struct xenstat_network *tmp;
-			domain->num_networks++;
-			tmp = realloc(domain->networks,
-				      domain->num_networks *
-				      sizeof(xenstat_network));
-			if (tmp == NULL)
-				free(domain->networks);
-			domain->networks = tmp;
-		  }
-		  if (domain->networks == NULL)
+		net.tbytes = txBytes;
+		net.tpackets = txPackets;
+		net.terrs = txErrs;
+		net.tdrop = txDrops;
+		net.rbytes = rxBytes;
+		net.rpackets = rxPackets;
+		net.rerrs = rxErrs;
+		net.rdrop = rxDrops;
+
+		if (!xenstat_add_network(node, iface, &net, devBridge,
+					 devNoBridge))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Collect information about networks */
+int xenstat_collect_networks(xenstat_node * node)
+{
+	char devNoBridge[IFNAMSIZ + 1];
+	const char *devBridge = NULL;
+	unsigned int i;
+
+	struct priv_data *priv = get_priv_data(node->handle);
+
+	if (priv == NULL) {
+		perror("Allocation error");
+		return 0;
+	}
+
+	if (read_netdevs(priv) != 0)
+		return collect_networks_procnetdev(node, priv);
+
+	/* The bridge to use with bonding: as getBridge("vir") would pick */
+	for (i = 0; i < priv->num_netdevs; i++)
+		if (priv->netdevs[i].bridge &&
+		    strstr(priv->netdevs[i].name, "vir") == NULL)
+			devBridge = priv->netdevs[i].name;
+	if (devBridge != NULL)
+		snprintf(devNoBridge, sizeof(devNoBridge), "p%s", devBridge);
+
+	for (i = 0; i < priv->num_netdevs; i++)
+		if (!xenstat_add_network(node, priv->netdevs[i].name,
+					 &priv->netdevs[i].stats, devBridge,
+					 devNoBridge))
 			return 0;
-		  domain->networks[domain->num_networks - 1] = net;
-          }
-        }
 
 	return 1;
 }
@@ -360,29 +573,95 @@ void xenstat_uninit_networks(xenstat_handle * handle)
 	struct priv_data *priv = get_priv_data(handle);
 	if (priv != NULL && priv->procnetdev != NULL)
 		fclose(priv->procnetdev);
+	if (priv != NULL && priv->netlink != -1)
+		close(priv->netlink);
+	if (priv != NULL)
+		free(priv->netdevs);
 }
 
-static int read_attributes_vbd(const char *vbd_directory, const char *what, char *ret, int cap)
+/* Read statistic i of a VBD, through the file kept open for it if we can */
+static int read_attributes_vbd(struct priv_data *priv, struct vbd_files *files,
+			       int i, char *ret, int cap)
 {
 	static char file_name[80];
-	int fd, num_read;
-
-	snprintf(file_name, sizeof(file_name), "%s/%s/%s",
-		SYSFS_VBD_PATH, vbd_directory, what);
-	fd = open(file_name, O_RDONLY, 0);
-	if (fd==-1) return -1;
-	num_read = read(fd, ret, cap - 1);
-	close(fd);
-	if (num_read<=0) return -1;
+	int fd = files->fd[i], num_read;
+
+	if (fd == -1) {
+		snprintf(file_name, sizeof(file_name), "%s/%s/%s",
+			SYSFS_VBD_PATH, files->name, vbd_stats[i]);
+		fd = open(file_name, O_RDONLY | O_CLOEXEC, 0);
+		if (fd == -1)
+			return -1;
+	}
+	num_read = pread(fd, ret, cap - 1, 0);
+	if (num_read <= 0 || (files->fd[i] == -1 &&
+			      priv->vbd_fds >= MAX_VBD_FDS)) {
+		close(fd);
+		if (files->fd[i] != -1)
+			priv->vbd_fds--;
+		files->fd[i] = -1;
+	} else if (files->fd[i] == -1) {
+		files->fd[i] = fd;
+		priv->vbd_fds++;
+	}
+	if (num_read <= 0)
+		return -1;
 	ret[num_read] = '\0';
 	return num_read;
 }
 
+/* Take the files of a VBD from the list of the last sample, in which it is
+ * most likely found just after the VBD looked up before it. */
+static int take_vbd_files(struct priv_data *priv, const char *name,
+			  unsigned int *hint, struct vbd_files *files)
+{
+	unsigned int i, j, n = priv->num_vbds;
+
+	for (i = 0; i < n; i++) {
+		struct vbd_files *old = &priv->vbds[(*hint + i) % n];
+		if (old->name != NULL && strcmp(old->name, name) == 0) {
+			*files = *old;
+			old->name = NULL;
+			*hint = (*hint + i + 1) % n;
+			return 1;
+		}
+	}
+
+	files->name = strdup(name);
+	if (files->name == NULL)
+		return 0;
+	for (j = 0; j < NUM_VBD_STATS; j++)
+		files->fd[j] = -1;
+	return 1;
+}
+
+static void free_vbd_files(struct priv_data *priv, struct vbd_files *vbds,
+			   unsigned int num_vbds)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < num_vbds; i++) {
+		if (vbds[i].name == NULL)
+			continue;
+		for (j = 0; j < NUM_VBD_STATS; j++) {
+			if (vbds[i].fd[j] != -1) {
+				close(vbds[i].fd[j]);
+				priv->vbd_fds--;
+			}
+		}
+		free(vbds[i].name);
+	}
+	free(vbds);
+}
+
 /* Collect information about VBDs */
 int xenstat_collect_vbds(xenstat_node * node)
 {
 	struct dirent *dp;
 	struct priv_data *priv = get_priv_data(node->handle);
+	struct vbd_files *vbds = NULL;
+	unsigned int num_vbds = 0, max_vbds = 0, hint = 0;
+	int ok = 0;
 
 	if (priv == NULL) {
 		perror("Allocation error");
@@ -403,7 +682,12 @@ int xenstat_collect_vbds(xenstat_node * node)
 	    dp = readdir(priv->sysfsvbd)) {
 		xenstat_domain *domain;
 		xenstat_vbd vbd;
-		unsigned int domid;
+		struct vbd_files *files;
+		unsigned long long *stats[NUM_VBD_STATS] = {
+			&vbd.oo_reqs, &vbd.rd_reqs, &vbd.wr_reqs,
+			&vbd.rd_sects, &vbd.wr_sects,
+		};
+		unsigned int domid, k;
 		int ret;
 		char buf[256];
 
@@ -427,35 +711,26 @@ int xenstat_collect_vbds(xenstat_node * node)
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/oo_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.oo_reqs)) != 1))
-		{
-			continue;
+		/* Keep the statistics files of the VBD open for next time */
+		if (num_vbds == max_vbds) {
+			unsigned int max = max_vbds ? 2 * max_vbds : 16;
+			files = realloc(vbds, max * sizeof(*files));
+			if (files == NULL)
+				goto out;
+			vbds = files;
+			max_vbds = max;
 		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.rd_reqs)) != 1))
-		{
+		files = &vbds[num_vbds];
+		if (!take_vbd_files(priv, dp->d_name, &hint, files))
+			goto out;
+		num_vbds++;
+
+		for (k = 0; k < NUM_VBD_STATS; k++)
+			if((read_attributes_vbd(priv, files, k, buf, 256)<=0)
+			   || ((ret = sscanf(buf, "%llu", stats[k])) != 1))
+				break;
+		if (k != NUM_VBD_STATS)
 			continue;
-		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.wr_reqs)) != 1))
-		{
-			continue;
-		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_sect", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.rd_sects)) != 1))
-		{
-			continue;
-		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_sect", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.wr_sects)) != 1))
-		{
-			continue;
-		}
 
 		if (domain->vbds == NULL) {
 			domain->num_vbds = 1;
@@ -467,11 +742,17 @@ int xenstat_collect_vbds(xenstat_node * node)
 					       sizeof(xenstat_vbd));
 		}
 		if (domain->vbds == NULL)
-			return 0;
+			goto out;
 		domain->vbds[domain->num_vbds - 1] = vbd;
 	}
-
-	return 1;	
+	ok = 1;
+
+ out:
+	/* Close the files of VBDs which have gone away */
+	free_vbd_files(priv, priv->vbds, priv->num_vbds);
+	priv->vbds = vbds;
+	priv->num_vbds = num_vbds;
+	return ok;
 }
 
 /* Free VBD information in handle */
@@ -480,4 +761,9 @@ void xenstat_uninit_vbds(xenstat_handle * handle)
 	struct priv_data *priv = get_priv_data(handle);
 	if (priv != NULL && priv->sysfsvbd != NULL)
 		closedir(priv->sysfsvbd);
+	if (priv != NULL) {
+		free_vbd_files(priv, priv->vbds, priv->num_vbds);
+		priv->vbds = NULL;
+		priv->num_vbds = 0;
+	}
 }
@@ -24,20 +24,35 @@
 #define XENSTAT_PRIV_H
 
 #include <sys/types.h>
+#include <time.h>
 #include <xenstore.h>
 #include "xenstat.h"
 
 #include "xenctrl.h"
+#include <xen/vcpu.h>
 
 #define SHORT_ASC_LEN 5                 /* length of 65535 */
 #define VERSION_SIZE (2 * SHORT_ASC_LEN + 1 + sizeof(xen_extraversion_t) + 1)
 
+/* Seconds a domain name read from xenstore is trusted for */
+#define NAME_CACHE_TTL 5
+
+/* The name of a domain, as last read from xenstore */
+struct xenstat_domain_name {
+	unsigned int id;
+	xen_domain_handle_t uuid;	/* Tells a new domain with the same id */
+	char *name;
+	time_t read;			/* When it was read */
+};
+
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	struct xenstat_domain_name *names; /* Of the last node, sorted by id */
+	unsigned int num_names;
 };
 
 struct xenstat_node {
@@ -59,6 +74,10 @@ struct xenstat_tmem {
 	unsigned long long succ_pers_gets;
 };
 
+struct xenstat_perf {
+	xc_domain_perf_t counters;
+};
+
 struct xenstat_domain {
 	unsigned int id;
 	char *name;
@@ -74,11 +93,16 @@ struct xenstat_domain {
 	unsigned int num_vbds;
 	xenstat_vbd *vbds;
 	xenstat_tmem tmem_stats;
+	xenstat_perf perf_stats;
 };
 
 struct xenstat_vcpu {
 	unsigned int online;
 	unsigned long long ns;
+	/* Time in each RUNSTATE_*, and latency histograms, if Xen has
+	 * XEN_SYSCTL_vcpu_sched_stats */
+	unsigned long long runstate_ns[4];
+	unsigned long long latency[2][XENSTAT_SCHED_HIST_BUCKETS];
 };
 
 struct xenstat_network {
@@ -97,6 +97,8 @@ static int compare_cpu(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_cpu(xenstat_domain *domain);
 static int compare_cpu_pct(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_cpu_pct(xenstat_domain *domain);
+static int compare_steal_pct(xenstat_domain *domain1, xenstat_domain *domain2);
+static void print_steal_pct(xenstat_domain *domain);
 static int compare_mem(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_mem(xenstat_domain *domain);
 static void print_mem_pct(xenstat_domain *domain);
@@ -127,6 +129,12 @@ static int compare_vbd_rsect(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_vbd_rsect(xenstat_domain *domain);
 static int compare_vbd_wsect(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_vbd_wsect(xenstat_domain *domain);
+static int compare_hcalls(xenstat_domain *domain1, xenstat_domain *domain2);
+static void print_hcalls(xenstat_domain *domain);
+static int compare_vmexits(xenstat_domain *domain1, xenstat_domain *domain2);
+static void print_vmexits(xenstat_domain *domain);
+static int compare_emul(xenstat_domain *domain1, xenstat_domain *domain2);
+static void print_emul(xenstat_domain *domain);
 
 
 /* Section printing functions */
@@ -146,6 +154,7 @@ typedef enum field_id {
 	FIELD_STATE,
 	FIELD_CPU,
 	FIELD_CPU_PCT,
+	FIELD_STEAL_PCT,
 	FIELD_MEM,
 	FIELD_MEM_PCT,
 	FIELD_MAXMEM,
@@ -160,6 +169,9 @@ typedef enum field_id {
 	FIELD_VBD_WR,
 	FIELD_VBD_RSECT,
 	FIELD_VBD_WSECT,
+	FIELD_HCALLS,
+	FIELD_VMEXITS,
+	FIELD_EMUL,
 	FIELD_SSID
 } field_id;
 
@@ -176,6 +188,7 @@ field fields[] = {
 	{ FIELD_STATE,     "STATE",      6, compare_state,     print_state   },
 	{ FIELD_CPU,       "CPU(sec)",  10, compare_cpu,       print_cpu     },
 	{ FIELD_CPU_PCT,   "CPU(%)",     6, compare_cpu_pct,   print_cpu_pct },
+	{ FIELD_STEAL_PCT, "STEAL(%)",   8, compare_steal_pct, print_steal_pct },
 	{ FIELD_MEM,       "MEM(k)",    10, compare_mem,       print_mem     },
 	{ FIELD_MEM_PCT,   "MEM(%)",     6, compare_mem,       print_mem_pct },
 	{ FIELD_MAXMEM,    "MAXMEM(k)", 10, compare_maxmem,    print_maxmem  },
@@ -190,6 +203,9 @@ field fields[] = {
 	{ FIELD_VBD_WR,    "VBD_WR",     8, compare_vbd_wr,    print_vbd_wr  },
 	{ FIELD_VBD_RSECT, "VBD_RSECT", 10, compare_vbd_rsect, print_vbd_rsect  },
 	{ FIELD_VBD_WSECT, "VBD_WSECT", 10, compare_vbd_wsect, print_vbd_wsect  },
+	{ FIELD_HCALLS,    "HCALL/s",    8, compare_hcalls,    print_hcalls  },
+	{ FIELD_VMEXITS,   "VMEXIT/s",   8, compare_vmexits,   print_vmexits },
+	{ FIELD_EMUL,      "EMUL/s",     8, compare_emul,      print_emul    },
 	{ FIELD_SSID,      "SSID",       4, compare_ssid,      print_ssid    }
 };
 
@@ -535,6 +551,59 @@ static void print_cpu_pct(xenstat_domain *domain)
 	print("%6.1f", get_cpu_pct(domain));
 }
 
+/* Computes the percentage of the time elapsed since the previous sample a
+ * VCPU spent in the state counted by the given function */
+static double get_vcpu_pct(xenstat_vcpu *vcpu, xenstat_vcpu *old_vcpu,
+			   unsigned long long (*ns)(xenstat_vcpu *))
+{
+	double us_elapsed;
+
+	if(old_vcpu == NULL || ns(vcpu) < ns(old_vcpu))
+		return 0.0;
+
+	us_elapsed = ((curtime.tv_sec-oldtime.tv_sec)*1000000.0
+		      +(curtime.tv_usec - oldtime.tv_usec));
+
+	return ((ns(vcpu) - ns(old_vcpu))/10.0)/us_elapsed;
+}
+
+/* Computes the steal time of a domain: the percentage of a CPU its VCPUs
+ * spent runnable but waiting for one */
+static double get_steal_pct(xenstat_domain *domain)
+{
+	xenstat_domain *old_domain;
+	unsigned int i, num_vcpus;
+	double pct = 0.0;
+
+	/* Can't calculate steal percentage without a previous sample. */
+	if(prev_node == NULL)
+		return 0.0;
+
+	old_domain = xenstat_node_domain(prev_node, xenstat_domain_id(domain));
+	if(old_domain == NULL)
+		return 0.0;
+
+	num_vcpus = xenstat_domain_num_vcpus(domain);
+	if(num_vcpus > xenstat_domain_num_vcpus(old_domain))
+		num_vcpus = xenstat_domain_num_vcpus(old_domain);
+	for (i = 0; i < num_vcpus; i++)
+		pct += get_vcpu_pct(xenstat_domain_vcpu(domain, i),
+				    xenstat_domain_vcpu(old_domain, i),
+				    xenstat_vcpu_runnable_ns);
+	return pct;
+}
+
+static int compare_steal_pct(xenstat_domain *domain1, xenstat_domain *domain2)
+{
+	return -compare(get_steal_pct(domain1), get_steal_pct(domain2));
+}
+
+/* Prints steal percentage statistic */
+static void print_steal_pct(xenstat_domain *domain)
+{
+	print("%8.1f", get_steal_pct(domain));
+}
+
 /* Compares current memory of two domains, returning -1,0,1 for <,=,> */
 static int compare_mem(xenstat_domain *domain1, xenstat_domain *domain2)
 {
@@ -793,6 +862,74 @@ static unsigned long long tot_vbd_reqs(xenstat_domain *domain, int flag)
 	return total;
 }
 
+/* Gets the per second rate of a hypervisor activity counter since the
+ * previous sample */
+static double get_perf_rate(xenstat_domain *domain,
+			    unsigned long long (*counter)(xenstat_perf *))
+{
+	xenstat_domain *old_domain;
+	unsigned long long cur, old;
+	double us_elapsed;
+
+	/* Can't calculate a rate without a previous sample. */
+	if(prev_node == NULL)
+		return 0.0;
+
+	old_domain = xenstat_node_domain(prev_node, xenstat_domain_id(domain));
+	if(old_domain == NULL)
+		return 0.0;
+
+	cur = counter(xenstat_domain_perf(domain));
+	old = counter(xenstat_domain_perf(old_domain));
+	if(cur < old)
+		return 0.0;
+
+	us_elapsed = ((curtime.tv_sec-oldtime.tv_sec)*1000000.0
+		      +(curtime.tv_usec - oldtime.tv_usec));
+
+	return (cur - old) * 1000000.0 / us_elapsed;
+}
+
+/* Compares hypercall rates of two domains, returning -1,0,1 for <,=,> */
+static int compare_hcalls(xenstat_domain *domain1, xenstat_domain *domain2)
+{
+	return -compare(get_perf_rate(domain1, xenstat_perf_hypercalls),
+			get_perf_rate(domain2, xenstat_perf_hypercalls));
+}
+
+/* Prints hypercall rate statistic */
+static void print_hcalls(xenstat_domain *domain)
+{
+	print("%8.0f", get_perf_rate(domain, xenstat_perf_hypercalls));
+}
+
+/* Compares VM exit rates of two domains, returning -1,0,1 for <,=,> */
+static int compare_vmexits(xenstat_domain *domain1, xenstat_domain *domain2)
+{
+	return -compare(get_perf_rate(domain1, xenstat_perf_vmexits),
+			get_perf_rate(domain2, xenstat_perf_vmexits));
+}
+
+/* Prints VM exit rate statistic */
+static void print_vmexits(xenstat_domain *domain)
+{
+	print("%8.0f", get_perf_rate(domain, xenstat_perf_vmexits));
+}
+
+/* Compares instruction emulation rates of two domains, returning -1,0,1 for
+ * <,=,> */
+static int compare_emul(xenstat_domain *domain1, xenstat_domain *domain2)
+{
+	return -compare(get_perf_rate(domain1, xenstat_perf_emulations),
+			get_perf_rate(domain2, xenstat_perf_emulations));
+}
+
+/* Prints instruction emulation rate statistic */
+static void print_emul(xenstat_domain *domain)
+{
+	print("%8.0f", get_perf_rate(domain, xenstat_perf_emulations));
+}
+
 /* Compares security id (ssid) of two domains, returning -1,0,1 for <,=,> */
 static int compare_ssid(xenstat_domain *domain1, xenstat_domain *domain2)
 {
@@ -948,6 +1085,7 @@ void do_vcpu(xenstat_domain *domain)
 	int i = 0;
 	unsigned num_vcpus = 0;
 	xenstat_vcpu *vcpu;
+	xenstat_domain *old_domain;
 
 	print("VCPUs(sec): ");
 
@@ -965,6 +1103,35 @@ void do_vcpu(xenstat_domain *domain)
 		}
 	}
 	print("\n");
+
+	/* Where the time went since the previous sample, and how long
+	 * the VCPUs waited for a CPU */
+	old_domain = prev_node == NULL ? NULL :
+		xenstat_node_domain(prev_node, xenstat_domain_id(domain));
+	if (old_domain == NULL)
+		return;
+
+	for (i=0; i< num_vcpus; i++) {
+		xenstat_vcpu *old_vcpu = NULL;
+
+		vcpu = xenstat_domain_vcpu(domain,i);
+		if (i < xenstat_domain_num_vcpus(old_domain))
+			old_vcpu = xenstat_domain_vcpu(old_domain,i);
+
+		print("  VCPU %2u: RUN %5.1f%%  STEAL %5.1f%%  BLOCKED %5.1f%%"
+		      "  OFFLINE %5.1f%%  WAKE(us) p50 %6llu p99 %6llu"
+		      "  WAIT(us) p99 %6llu\n", i,
+		      get_vcpu_pct(vcpu, old_vcpu, xenstat_vcpu_ns),
+		      get_vcpu_pct(vcpu, old_vcpu, xenstat_vcpu_runnable_ns),
+		      get_vcpu_pct(vcpu, old_vcpu, xenstat_vcpu_blocked_ns),
+		      get_vcpu_pct(vcpu, old_vcpu, xenstat_vcpu_offline_ns),
+		      xenstat_vcpu_latency_pct(vcpu, old_vcpu,
+					       XENSTAT_LATENCY_WAKE, 50),
+		      xenstat_vcpu_latency_pct(vcpu, old_vcpu,
+					       XENSTAT_LATENCY_WAKE, 99),
+		      xenstat_vcpu_latency_pct(vcpu, old_vcpu,
+					       XENSTAT_LATENCY_WAIT, 99));
+	}
 }
 
 /* Output all network information */
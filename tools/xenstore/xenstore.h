@@ -197,6 +197,106 @@ xs_transaction_t xs_transaction_start(struct xs_handle *h);
 bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 			bool abort);
 
+/* A batch of operations, sent to the store daemon as one request. */
+struct xs_multi;
+
+/* Create an empty batch.
+ * Returns NULL on failure.
+ */
+struct xs_multi *xs_multi_new(void);
+
+/* Free a batch, and the results of carrying it out. */
+void xs_multi_free(struct xs_multi *m);
+
+/* Add an operation to a batch: the arguments are those of the call of the
+ * same name.  Returns false on failure.
+ */
+bool xs_multi_read(struct xs_multi *m, const char *path);
+bool xs_multi_write(struct xs_multi *m, const char *path,
+		    const void *data, unsigned int len);
+bool xs_multi_mkdir(struct xs_multi *m, const char *path);
+bool xs_multi_rm(struct xs_multi *m, const char *path);
+bool xs_multi_set_permissions(struct xs_multi *m, const char *path,
+			      struct xs_permissions *perms,
+			      unsigned int num_perms);
+
+/* Carry out the operations of a batch in order, stopping at the first to
+ * fail.  Outside a transaction (t is XBT_NULL) either all of them take
+ * effect or none does.  A daemon without XS_MULTI, or a batch too big for
+ * one request, gets them one at a time (in a transaction if t is XBT_NULL).
+ * Returns false on failure, with errno set by the failed operation.
+ */
+bool xs_multi_execute(struct xs_handle *h, xs_transaction_t t,
+		      struct xs_multi *m);
+
+/* The reply to operation i of a batch carried out, nul terminated: len
+ * is its length, not including the terminator.  The reply belongs to the
+ * batch.  Returns NULL if the operation failed, or with errno ECANCELED if
+ * it was not reached.
+ */
+const void *xs_multi_result(struct xs_multi *m, unsigned int i,
+			    unsigned int *len);
+
+/* A node of a subtree read by xs_read_subtree(). */
+struct xs_subtree_node {
+	const char *path;	/* Relative to the top, "" for the top itself */
+	const void *value;	/* Nul terminated */
+	unsigned int len;	/* Not including the terminator */
+};
+
+/* Read the values of path and of every node below it, depth first, in as
+ * few requests as possible; only privileged domains may.  Outside a
+ * transaction, nodes added or removed meanwhile may be missed.  A daemon
+ * without XS_READ_SUBTREE gets directory and read requests instead.
+ * Returns a malloced array: call free() on it after use.
+ * Num indicates size.
+ */
+struct xs_subtree_node *xs_read_subtree(struct xs_handle *h,
+					xs_transaction_t t,
+					const char *path, unsigned int *num);
+
+/* Asynchronous requests.
+ *
+ * Any number of these may be in flight on a handle at once, alongside the
+ * calls above.  Each is sent at once and returns its id, or 0 on failure.
+ * When the reply arrives, xs_async_dispatch() calls cb with it: err is 0
+ * and reply is the malloced payload (nul terminated, len not including
+ * the terminator; call free() after use), or err is the errno of the
+ * failure and reply NULL.  If the connection fails, err is EBADF.
+ * Requests in flight when the handle is closed are forgotten.
+ */
+typedef void xs_async_cb_t(struct xs_handle *h, uint32_t id, void *priv,
+			   int err, void *reply, unsigned int len);
+
+/* Send any request, with its payload as for docs/misc/xenstore.txt. */
+uint32_t xs_async_request(struct xs_handle *h, xs_transaction_t t,
+			  enum xsd_sockmsg_type type,
+			  const void *data, unsigned int len,
+			  xs_async_cb_t *cb, void *priv);
+
+/* The requests of the synchronous calls of the same name. */
+uint32_t xs_async_read(struct xs_handle *h, xs_transaction_t t,
+		       const char *path, xs_async_cb_t *cb, void *priv);
+uint32_t xs_async_write(struct xs_handle *h, xs_transaction_t t,
+			const char *path, const void *data, unsigned int len,
+			xs_async_cb_t *cb, void *priv);
+uint32_t xs_async_mkdir(struct xs_handle *h, xs_transaction_t t,
+			const char *path, xs_async_cb_t *cb, void *priv);
+uint32_t xs_async_rm(struct xs_handle *h, xs_transaction_t t,
+		     const char *path, xs_async_cb_t *cb, void *priv);
+
+/* Return the FD to poll on to see if replies have arrived: it becomes
+ * readable when there is something for xs_async_dispatch() to do.
+ * Returns -1 on failure.
+ */
+int xs_async_fileno(struct xs_handle *h);
+
+/* Call the callbacks of the requests whose replies have arrived, without
+ * blocking.  Callbacks may make further requests.  Returns the number of
+ * callbacks called.
+ */
+int xs_async_dispatch(struct xs_handle *h);
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page, event channel and
  * store path associated with a domain: the domain uses these to communicate.
@@ -20,6 +20,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #ifndef NO_SOCKETS
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -49,18 +52,13 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenctrl.h"
-#include "tdb.h"
 
 #include "hashtable.h"
 
 extern xc_evtchn *xce_handle; /* in xenstored_domain.c */
-static int xce_pollfd_idx = -1;
-static struct pollfd *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
-
-#define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
+static struct loop_fd xce_loop;
 
 static bool verbose = false;
 LIST_HEAD(connections);
@@ -68,11 +66,9 @@ static int tracefd = -1;
 static bool recovery = true;
 static bool remove_local = true;
 static int reopen_log_pipe[2];
-static int reopen_log_pipe0_pollfd_idx = -1;
+static struct loop_fd reopen_log_loop;
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
 #define log(...)							\
@@ -89,22 +85,10 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+/* conn = NULL used in manual_node at setup. */
+static struct transaction *conn_transaction(struct connection *conn)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
+	return conn ? conn->transaction : NULL;
 }
 
 static char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -131,6 +115,8 @@ static char *sockmsg_string(enum xsd_sockmsg_type type)
 	case XS_RESUME: return "RESUME";
 	case XS_SET_TARGET: return "SET_TARGET";
 	case XS_RESET_WATCHES: return "RESET_WATCHES";
+	case XS_MULTI: return "MULTI";
+	case XS_READ_SUBTREE: return "READ_SUBTREE";
 	default:
 		return "**UNKNOWN**";
 	}
@@ -231,6 +217,187 @@ static void reopen_log(void)
 	}
 }
 
+/*
+ * The fds the main loop waits on.  Interest in each is registered when it
+ * appears and changed only when it changes, rather than being rebuilt on
+ * every iteration.  On Linux epoll hands back just the fds that are
+ * ready; elsewhere a poll() array is kept up to date instead.
+ */
+/* Most requests taken off a domain's ring in one go round the loop. */
+#define DOMAIN_BATCH 16
+
+static struct loop_fd **loop_ready;
+static unsigned int loop_nr_ready, loop_max_fds, loop_nr_fds;
+
+#ifdef __linux__
+#define LOOP_MAX_EVENTS 64
+static int loop_epoll_fd = -1;
+#else
+static struct pollfd *loop_pollfds;
+static struct loop_fd **loop_owners;
+#endif
+
+static void loop_init(void)
+{
+#ifdef __linux__
+	loop_epoll_fd = epoll_create(LOOP_MAX_EVENTS);
+	if (loop_epoll_fd < 0)
+		barf_perror("Could not create epoll fd");
+#endif
+}
+
+static void loop_add(struct loop_fd *lfd, int fd, short events)
+{
+	lfd->fd = fd;
+	lfd->events = events;
+	lfd->revents = 0;
+	lfd->ready = -1;
+
+	if (loop_nr_fds == loop_max_fds) {
+		unsigned int max = loop_max_fds ? loop_max_fds * 2 : 16;
+		struct loop_fd **ready;
+
+		ready = realloc(loop_ready, max * sizeof(*ready));
+		if (!ready)
+			barf_perror("Could not grow main loop fds");
+		loop_ready = ready;
+#ifndef __linux__
+		{
+			struct pollfd *pollfds;
+			struct loop_fd **owners;
+
+			pollfds = realloc(loop_pollfds, max * sizeof(*pollfds));
+			if (pollfds)
+				loop_pollfds = pollfds;
+			owners = realloc(loop_owners, max * sizeof(*owners));
+			if (owners)
+				loop_owners = owners;
+			if (!pollfds || !owners)
+				barf_perror("Could not grow main loop fds");
+		}
+#endif
+		loop_max_fds = max;
+	}
+
+#ifdef __linux__
+	{
+		struct epoll_event ev = { .events = events, .data.ptr = lfd };
+
+		if (epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+			barf_perror("Could not add fd %d to epoll", fd);
+	}
+#else
+	lfd->idx = loop_nr_fds;
+	loop_pollfds[lfd->idx].fd = fd;
+	loop_pollfds[lfd->idx].events = events;
+	loop_pollfds[lfd->idx].revents = 0;
+	loop_owners[lfd->idx] = lfd;
+#endif
+	loop_nr_fds++;
+}
+
+static void loop_modify(struct loop_fd *lfd, short events)
+{
+	if (lfd->events == events)
+		return;
+	lfd->events = events;
+
+#ifdef __linux__
+	{
+		struct epoll_event ev = { .events = events, .data.ptr = lfd };
+
+		if (epoll_ctl(loop_epoll_fd, EPOLL_CTL_MOD, lfd->fd, &ev) != 0)
+			barf_perror("Could not modify fd %d in epoll", lfd->fd);
+	}
+#else
+	loop_pollfds[lfd->idx].events = events;
+#endif
+}
+
+/* Before the fd is closed. */
+static void loop_del(struct loop_fd *lfd)
+{
+	if (lfd->ready != -1)
+		loop_ready[lfd->ready] = NULL;
+
+#ifdef __linux__
+	epoll_ctl(loop_epoll_fd, EPOLL_CTL_DEL, lfd->fd, NULL);
+#else
+	/* Move the last into the hole. */
+	loop_pollfds[lfd->idx] = loop_pollfds[loop_nr_fds - 1];
+	loop_owners[lfd->idx] = loop_owners[loop_nr_fds - 1];
+	loop_owners[lfd->idx]->idx = lfd->idx;
+#endif
+	loop_nr_fds--;
+}
+
+static void loop_set_ready(struct loop_fd *lfd, short revents)
+{
+	lfd->revents = revents;
+	lfd->ready = loop_nr_ready;
+	loop_ready[loop_nr_ready++] = lfd;
+}
+
+/* Wait for events, leaving them in revents of the fds concerned. */
+static int loop_wait(int timeout)
+{
+	unsigned int i;
+	int n;
+
+	for (i = 0; i < loop_nr_ready; i++) {
+		if (loop_ready[i]) {
+			loop_ready[i]->revents = 0;
+			loop_ready[i]->ready = -1;
+		}
+	}
+	loop_nr_ready = 0;
+
+#ifdef __linux__
+	{
+		struct epoll_event evs[LOOP_MAX_EVENTS];
+
+		n = epoll_wait(loop_epoll_fd, evs, LOOP_MAX_EVENTS, timeout);
+		for (i = 0; n > 0 && i < n; i++)
+			loop_set_ready(evs[i].data.ptr, evs[i].events);
+	}
+#else
+	n = poll(loop_pollfds, loop_nr_fds, timeout);
+	for (i = 0; n > 0 && i < loop_nr_fds; i++)
+		if (loop_pollfds[i].revents)
+			loop_set_ready(loop_owners[i],
+				       loop_pollfds[i].revents);
+#endif
+
+	return n;
+}
+
+/* Socket connections want POLLOUT only while they have output queued. */
+static void conn_update_events(struct connection *conn)
+{
+	short events = POLLIN|POLLPRI;
+
+	if (conn->domain || conn->fd == -1)
+		return;
+	if (!list_empty(&conn->out_list))
+		events |= POLLOUT;
+	loop_modify(&conn->loop, events);
+}
+
+/* Domains with messages to handle mean the main loop mustn't block. */
+static int loop_timeout(void)
+{
+	struct connection *conn;
+
+	list_for_each_entry(conn, &connections, list) {
+		if (conn->domain &&
+		    (domain_can_read(conn) ||
+		     (domain_can_write(conn) && !list_empty(&conn->out_list))))
+			return 0;
+	}
+
+	return -1;
+}
+
 static bool write_messages(struct connection *conn)
 {
 	int ret;
@@ -294,6 +461,7 @@ static int destroy_conn(void *_conn)
 		       && poll(&pfd, 1, 0) == 1)
 			if (!write_messages(conn))
 				break;
+		loop_del(&conn->loop);
 		close(conn->fd);
 	}
         if (conn->target)
@@ -303,79 +471,6 @@ static int destroy_conn(void *_conn)
 	return 0;
 }
 
-/* This function returns index inside the array if succeed, -1 if fail */
-static int set_fd(int fd, short events)
-{
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
-
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
-
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd ) * (newsize-current_array_size));
-		current_array_size = newsize;
-	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	syslog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
-}
-
-static void initialize_fds(int sock, int *p_sock_pollfd_idx,
-			   int ro_sock, int *p_ro_sock_pollfd_idx,
-			   int *ptimeout)
-{
-	struct connection *conn;
-
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-	nr_fds = 0;
-
-	*ptimeout = -1;
-
-	if (sock != -1)
-		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
-	if (ro_sock != -1)
-		*p_ro_sock_pollfd_idx = set_fd(ro_sock, POLLIN|POLLPRI);
-	if (reopen_log_pipe[0] != -1)
-		reopen_log_pipe0_pollfd_idx =
-			set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
-
-	if (xce_handle != NULL)
-		xce_pollfd_idx = set_fd(xc_evtchn_fd(xce_handle),
-					POLLIN|POLLPRI);
-
-	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
-		} else {
-			short events = POLLIN|POLLPRI;
-			if (!list_empty(&conn->out_list))
-				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
-		}
-	}
-}
-
 /* Is child a subnode of parent, or equal? */
 bool is_child(const char *child, const char *parent)
 {
@@ -395,39 +490,27 @@ bool is_child(const char *child, const char *parent)
 /* If it fails, returns NULL and sets errno. */
 static struct node *read_node(struct connection *conn, const char *name)
 {
-	TDB_DATA key, data;
-	uint32_t *p;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
-
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+	if (transaction_fetch(conn_transaction(conn), name, &data) != 0)
 		return NULL;
-	}
 
 	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	hdr = (void *)data.dptr;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
@@ -440,16 +523,14 @@ static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * conn_transaction copes with this.
 	 */
 
-	TDB_DATA key, data;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
 	void *p;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
@@ -457,10 +538,12 @@ static bool write_node(struct connection *conn, const struct node *node)
 		goto error;
 
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = 0;	/* Stamped by transaction_store. */
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -468,9 +551,8 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
+	if (transaction_store(conn_transaction(conn), node->name, data) != 0) {
+		corrupt(conn, "Write of %s failed", node->name);
 		goto error;
 	}
 	return true;
@@ -510,25 +592,125 @@ static char *get_parent(const char *node)
 	return talloc_asprintf(node, "%.*s", (int)(slash - node), node);
 }
 
+/*
+ * The permissions that apply to a node which does not exist are those of
+ * its nearest ancestor which does.  Clients probing for optional nodes
+ * ask this over and over, so outside transactions the answer is cached
+ * against the name asked about.  An entry holds good while the ancestor's
+ * record keeps its generation: changing its permissions, removing it, or
+ * creating anything below it (which rewrites its list of children) all
+ * write a new one.
+ */
+struct perm_cache_entry
+{
+	/* The node the permissions are those of, and its generation. */
+	const char *owner;
+	uint64_t generation;
+
+	unsigned int num_perms;
+	struct xs_permissions perms[0];
+};
+
+/* Flushed when it grows beyond this. */
+#define PERM_CACHE_MAX 4096
+
+static struct hashtable *perm_cache;
+
+static uint64_t record_generation(const TDB_DATA *rec)
+{
+	return ((const struct xs_tdb_record_hdr *)rec->dptr)->generation;
+}
+
+static struct perm_cache_entry *perm_cache_lookup(const char *name)
+{
+	struct perm_cache_entry *entry;
+	const TDB_DATA *rec;
+
+	if (!perm_cache)
+		return NULL;
+	entry = hashtable_search(perm_cache, (void *)name);
+	if (!entry)
+		return NULL;
+
+	rec = store_lookup(entry->owner);
+	if (rec && record_generation(rec) == entry->generation)
+		return entry;
+
+	free(hashtable_remove(perm_cache, (void *)name));
+	return NULL;
+}
+
+/* Failing to cache is not an error: the next lookup just misses. */
+static void perm_cache_add(const char *name, const char *owner,
+			   const TDB_DATA *rec)
+{
+	const struct xs_tdb_record_hdr *hdr = (void *)rec->dptr;
+	struct perm_cache_entry *entry;
+	size_t perms_len = hdr->num_perms * sizeof(hdr->perms[0]);
+	char *key;
+
+	if (perm_cache && hashtable_count(perm_cache) >= PERM_CACHE_MAX) {
+		hashtable_destroy(perm_cache, 1);
+		perm_cache = NULL;
+	}
+	if (!perm_cache) {
+		perm_cache = create_hashtable(64, hash_from_key_fn,
+					      keys_equal_fn);
+		if (!perm_cache)
+			return;
+	}
+
+	entry = malloc(sizeof(*entry) + perms_len + strlen(owner) + 1);
+	key = strdup(name);
+	if (!entry || !key)
+		goto fail;
+	entry->owner = strcpy((char *)entry->perms + perms_len, owner);
+	entry->generation = hdr->generation;
+	entry->num_perms = hdr->num_perms;
+	memcpy(entry->perms, hdr->perms, perms_len);
+
+	if (!hashtable_insert(perm_cache, key, entry))
+		goto fail;
+	return;
+
+ fail:
+	free(entry);
+	free(key);
+}
+
 /* What do parents say? */
 static enum xs_perm_type ask_parents(struct connection *conn, const char *name)
 {
-	struct node *node;
+	struct transaction *trans = conn_transaction(conn);
+	struct perm_cache_entry *entry;
+	struct xs_tdb_record_hdr *hdr;
+	const TDB_DATA *rec;
+	const char *parent = name;
+
+	if (!trans) {
+		entry = perm_cache_lookup(name);
+		if (entry)
+			return perm_for_conn(conn, entry->perms,
+					     entry->num_perms);
+	}
 
 	do {
-		name = get_parent(name);
-		node = read_node(conn, name);
-		if (node)
+		parent = get_parent(parent);
+		rec = transaction_peek(trans, parent);
+		if (rec)
 			break;
-	} while (!streq(name, "/"));
+	} while (!streq(parent, "/"));
 
 	/* No permission at root?  We're in trouble. */
-	if (!node) {
+	if (!rec) {
 		corrupt(conn, "No permissions file at root");
 		return XS_PERM_NONE;
 	}
 
-	return perm_for_conn(conn, node->perms, node->num_perms);
+	if (!trans)
+		perm_cache_add(name, parent, rec);
+	hdr = (void *)rec->dptr;
+	return perm_for_conn(conn, hdr->perms, hdr->num_perms);
 }
 
 /* We have a weird permissions system.  You can allow someone into a
@@ -624,6 +806,33 @@ unsigned int get_strings(struct buffered_data *data,
 	return i;
 }
 
+/* The replies to an XS_MULTI's operations, gathered as they are sent. */
+struct multi_reply
+{
+	char buffer[XENSTORE_PAYLOAD_MAX];
+	unsigned int used;
+
+	/* Type of the last reply, and whether the buffer ran out. */
+	enum xsd_sockmsg_type last;
+	bool overflow;
+};
+
+static void multi_add_reply(struct multi_reply *multi,
+			    enum xsd_sockmsg_type type,
+			    const void *data, unsigned int len)
+{
+	struct xsd_multi_op op = { .type = type, .len = len };
+
+	multi->last = type;
+	if (sizeof(op) + len > sizeof(multi->buffer) - multi->used) {
+		multi->overflow = true;
+		return;
+	}
+	memcpy(multi->buffer + multi->used, &op, sizeof(op));
+	memcpy(multi->buffer + multi->used + sizeof(op), data, len);
+	multi->used += sizeof(op) + len;
+}
+
 void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		const void *data, unsigned int len)
 {
@@ -634,6 +843,11 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		return;
 	}
 
+	if (conn->multi && type != XS_WATCH_EVENT) {
+		multi_add_reply(conn->multi, type, data, len);
+		return;
+	}
+
 	/* Message is a child of the connection context for auto-cleanup. */
 	bdata = new_buffer(conn);
 	bdata->buffer = talloc_array(bdata, char, len);
@@ -653,6 +867,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	conn_update_events(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -786,12 +1001,7 @@ static void do_read(struct connection *conn, const char *name)
 
 static void delete_node_single(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
-
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	if (transaction_delete(conn_transaction(conn), node->name) != 0) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -832,7 +1042,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -853,15 +1063,11 @@ static struct node *construct_node(struct connection *conn, const char *name)
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	transaction_delete(node->trans, node->name);
 	return 0;
 }
 
@@ -1187,22 +1393,12 @@ static void do_debug(struct connection *conn, struct buffered_data *in)
 	send_ack(conn, XS_DEBUG);
 }
 
-/* Process "in" for conn: "in" will vanish after this conversation, so
- * we can talloc off it for temporary variables.  May free "conn".
- */
-static void process_message(struct connection *conn, struct buffered_data *in)
-{
-	struct transaction *trans;
-
-	trans = transaction_lookup(conn, in->hdr.msg.tx_id);
-	if (IS_ERR(trans)) {
-		send_error(conn, -PTR_ERR(trans));
-		return;
-	}
-
-	assert(conn->transaction == NULL);
-	conn->transaction = trans;
+static void do_multi(struct connection *conn, struct buffered_data *in);
+static void do_read_subtree(struct connection *conn, struct buffered_data *in);
 
+/* Carry out the operation "in" for conn, in conn->transaction. */
+static void do_operation(struct connection *conn, struct buffered_data *in)
+{
 	switch (in->hdr.msg.type) {
 	case XS_DIRECTORY:
 		send_directory(conn, onearg(in));
@@ -1280,12 +1476,262 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		do_reset_watches(conn);
 		break;
 
+	case XS_MULTI:
+		do_multi(conn, in);
+		break;
+
+	case XS_READ_SUBTREE:
+		do_read_subtree(conn, in);
+		break;
+
 	default:
 		eprintf("Client unknown operation %i", in->hdr.msg.type);
 		send_error(conn, ENOSYS);
 		break;
 	}
 
+}
+
+/* The operations an XS_MULTI may carry. */
+static bool multi_op_valid(uint32_t type)
+{
+	switch (type) {
+	case XS_DIRECTORY:
+	case XS_READ:
+	case XS_GET_PERMS:
+	case XS_WRITE:
+	case XS_MKDIR:
+	case XS_RM:
+	case XS_SET_PERMS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Carry out each operation of an XS_MULTI in turn, stopping at the first
+ * to fail.  Outside a transaction they get one of their own, committed
+ * only if they all succeed; nothing else runs meanwhile, so it cannot
+ * conflict.
+ */
+static void do_multi(struct connection *conn, struct buffered_data *in)
+{
+	struct multi_reply *multi;
+	struct transaction *trans = NULL;
+	struct buffered_data op;
+	struct xsd_multi_op hdr;
+	unsigned int off;
+
+	/* Check the whole batch is well formed before starting on it. */
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		if (in->used - off < sizeof(hdr))
+			goto inval;
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		if (hdr.len > in->used - off - sizeof(hdr) ||
+		    !multi_op_valid(hdr.type))
+			goto inval;
+	}
+
+	multi = talloc_zero(in, struct multi_reply);
+	if (!conn->transaction)
+		trans = transaction_new(in);
+	if (!multi || (!conn->transaction && !trans)) {
+		send_error(conn, ENOMEM);
+		return;
+	}
+	if (trans)
+		conn->transaction = trans;
+
+	conn->multi = multi;
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+
+		memset(&op, 0, sizeof(op));
+		op.hdr.msg = in->hdr.msg;
+		op.hdr.msg.type = hdr.type;
+		op.hdr.msg.len = hdr.len;
+		op.buffer = in->buffer + off + sizeof(hdr);
+		op.used = hdr.len;
+
+		do_operation(conn, &op);
+		if (multi->last == XS_ERROR || multi->overflow)
+			break;
+	}
+	conn->multi = NULL;
+
+	/* Our transaction is discarded with "in" if not committed. */
+	if (trans) {
+		conn->transaction = NULL;
+		if (multi->last != XS_ERROR && !multi->overflow &&
+		    transaction_finish(conn, trans) != 0) {
+			send_error(conn, errno);
+			return;
+		}
+	}
+
+	if (multi->overflow) {
+		send_error(conn, E2BIG);
+		return;
+	}
+	send_reply(conn, XS_MULTI, multi->buffer, multi->used);
+	return;
+
+ inval:
+	send_error(conn, EINVAL);
+}
+
+/* The reply to an XS_READ_SUBTREE, filled in as the subtree is walked. */
+struct subtree_reply
+{
+	char buffer[XENSTORE_PAYLOAD_MAX];
+	unsigned int used;
+
+	/* Length of the name of the node asked for. */
+	unsigned int toplen;
+
+	/* The node to carry on after, until the walk has passed it. */
+	const char *after;
+};
+
+/* Returns false if the reply is full. */
+static bool subtree_add(struct subtree_reply *r, struct node *node)
+{
+	struct xsd_subtree_node hdr;
+	const char *path = node->name + r->toplen;
+	unsigned int datalen = node->datalen;
+
+	if (*path == '/')
+		path++;
+	hdr.pathlen = strlen(path);
+	hdr.datalen = datalen;
+
+	/* Leave out a value no reply could hold, rather than stop at it. */
+	if (sizeof(hdr) + hdr.pathlen + datalen > sizeof(r->buffer)) {
+		hdr.datalen = XS_SUBTREE_TOOBIG;
+		datalen = 0;
+	}
+	if (sizeof(hdr) + hdr.pathlen + datalen > sizeof(r->buffer) - r->used)
+		return false;
+
+	memcpy(r->buffer + r->used, &hdr, sizeof(hdr));
+	memcpy(r->buffer + r->used + sizeof(hdr), path, hdr.pathlen);
+	memcpy(r->buffer + r->used + sizeof(hdr) + hdr.pathlen, node->data,
+	       datalen);
+	r->used += sizeof(hdr) + hdr.pathlen + datalen;
+	return true;
+}
+
+/*
+ * Add node and those below it to the reply, depth first, leaving out
+ * any up to and including r->after.  Returns false if the reply is full.
+ */
+static bool walk_subtree(struct connection *conn, struct subtree_reply *r,
+			 struct node *node)
+{
+	struct node *child;
+	unsigned int off;
+	char *name;
+	bool more;
+
+	if (!r->after) {
+		if (!subtree_add(r, node))
+			return false;
+	} else if (streq(node->name, r->after))
+		r->after = NULL;
+
+	for (off = 0; off < node->childlen;
+	     off += strlen(node->children + off) + 1) {
+		name = talloc_asprintf(node, "%s/%s",
+				       streq(node->name, "/") ? "" : node->name,
+				       node->children + off);
+		if (!name)
+			return false;
+
+		/* Skip straight past those wholly before where we carry on. */
+		if (r->after && !is_child(r->after, name)) {
+			talloc_free(name);
+			continue;
+		}
+
+		child = read_node(conn, name);
+		more = !child || walk_subtree(conn, r, child);
+		talloc_free(name);
+		if (!more)
+			return false;
+
+		/* Whatever follows the subtree holding it comes after it. */
+		r->after = NULL;
+	}
+
+	return true;
+}
+
+static void do_read_subtree(struct connection *conn, struct buffered_data *in)
+{
+	struct xsd_subtree_node end = { .pathlen = XS_SUBTREE_END };
+	struct subtree_reply *r;
+	struct node *node;
+	char *vec[2];
+	unsigned int num;
+
+	if (domain_is_unprivileged(conn)) {
+		send_error(conn, EACCES);
+		return;
+	}
+
+	num = get_strings(in, vec, ARRAY_SIZE(vec));
+	if (num < 1 || num > ARRAY_SIZE(vec)) {
+		send_error(conn, EINVAL);
+		return;
+	}
+
+	node = get_node(conn, canonicalize(conn, vec[0]), XS_PERM_READ);
+	if (!node) {
+		send_error(conn, errno);
+		return;
+	}
+
+	r = talloc_zero(in, struct subtree_reply);
+	if (!r) {
+		send_error(conn, ENOMEM);
+		return;
+	}
+	r->toplen = strlen(node->name);
+	if (num == 2 && vec[1][0])
+		r->after = talloc_asprintf(r, "%s/%s",
+				streq(node->name, "/") ? "" : node->name,
+				vec[1]);
+	else if (num == 2)
+		r->after = node->name;
+
+	if (walk_subtree(conn, r, node) &&
+	    sizeof(end) <= sizeof(r->buffer) - r->used) {
+		memcpy(r->buffer + r->used, &end, sizeof(end));
+		r->used += sizeof(end);
+	}
+
+	send_reply(conn, XS_READ_SUBTREE, r->buffer, r->used);
+}
+
+/* Process "in" for conn: "in" will vanish after this conversation, so
+ * we can talloc off it for temporary variables.  May free "conn".
+ */
+static void process_message(struct connection *conn, struct buffered_data *in)
+{
+	struct transaction *trans;
+
+	trans = transaction_lookup(conn, in->hdr.msg.tx_id);
+	if (IS_ERR(trans)) {
+		send_error(conn, -PTR_ERR(trans));
+		return;
+	}
+
+	assert(conn->transaction == NULL);
+	conn->transaction = trans;
+
+	do_operation(conn, in);
+
 	conn->transaction = NULL;
 }
 
@@ -1354,6 +1800,22 @@ static void handle_output(struct connection *conn)
 {
 	if (!write_messages(conn))
 		talloc_free(conn);
+	else
+		conn_update_events(conn);
+}
+
+/*
+ * Call fn on a connection the main loop holds a reference to, returning
+ * false if that freed it.  The reference is kept otherwise.
+ */
+static bool conn_call(struct connection *conn,
+		      void (*fn)(struct connection *conn))
+{
+	fn(conn);
+	if (talloc_free(conn) == 0)
+		return false;
+	talloc_increase_ref_count(conn);
+	return true;
 }
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
@@ -1365,7 +1827,6 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 		return NULL;
 
 	new->fd = -1;
-	new->pollfd_idx = -1;
 	new->write = write;
 	new->read = read;
 	new->can_write = true;
@@ -1442,12 +1903,13 @@ static void accept_connection(int sock, bool canwrite)
 	if (conn) {
 		conn->fd = fd;
 		conn->can_write = canwrite;
+		loop_add(&conn->loop, fd, POLLIN|POLLPRI);
 	} else
 		close(fd);
 }
 #endif
 
-static int tdb_flags;
+static bool store_internal;
 
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
@@ -1470,13 +1932,13 @@ static void manual_node(const char *name, const char *child)
 
 static void setup_structure(void)
 {
-	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
+	const char *journal = store_internal ? NULL : xs_daemon_tdb();
 
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
+	if (store_open(journal, false) != 0)
+		barf_perror("Could not open store journal %s",
+			    journal ? journal : "(none)");
 
-	if (tdb_ctx) {
+	if (store_count()) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1493,6 +1955,7 @@ static void setup_structure(void)
 		*/
 		char *tlocal = talloc_strdup(NULL, "/local");
 
+		transaction_setup_generation();
 		check_store();
 
 		if (remove_local) {
@@ -1505,11 +1968,6 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
-
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
 		manual_node("/tool/xenstored", NULL);
@@ -1519,7 +1977,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1532,7 +1990,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1636,21 +2094,17 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(const char *name, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
 
-	if (!hashtable_search(reachable, name)) {
+	if (!hashtable_search(reachable, (void *)name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			store_delete(name);
 		}
 	}
 
-	talloc_free(name);
-
 	return 0;
 }
 
@@ -1661,7 +2115,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_traverse(&clean_store_, reachable);
 }
 
 
@@ -1683,7 +2137,7 @@ static void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
@@ -1807,12 +2261,11 @@ int priv_domid = 0;
 int main(int argc, char *argv[])
 {
 	int opt, *sock, *ro_sock;
-	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
+	struct loop_fd sock_loop = { .fd = -1 }, ro_sock_loop = { .fd = -1 };
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
-	int timeout;
 
 	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
 				  NULL)) != -1) {
@@ -1851,7 +2304,7 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			store_internal = true;
 			break;
 		case 'V':
 			verbose = true;
@@ -1916,8 +2369,15 @@ int main(int argc, char *argv[])
 	signal(SIGHUP, trigger_reopen_log);
 
 	/* Get ready to listen to the tools. */
-	initialize_fds(*sock, &sock_pollfd_idx, *ro_sock, &ro_sock_pollfd_idx,
-		       &timeout);
+	loop_init();
+	if (*sock != -1)
+		loop_add(&sock_loop, *sock, POLLIN|POLLPRI);
+	if (*ro_sock != -1)
+		loop_add(&ro_sock_loop, *ro_sock, POLLIN|POLLPRI);
+	if (reopen_log_pipe[0] != -1)
+		loop_add(&reopen_log_loop, reopen_log_pipe[0], POLLIN|POLLPRI);
+	if (xce_handle != NULL)
+		loop_add(&xce_loop, xc_evtchn_fd(xce_handle), POLLIN|POLLPRI);
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
@@ -1925,58 +2385,45 @@ int main(int argc, char *argv[])
 	/* Main loop. */
 	for (;;) {
 		struct connection *conn, *next;
+		unsigned int n;
 
-		if (poll(fds, nr_fds, timeout) < 0) {
+		if (loop_wait(loop_timeout()) < 0) {
 			if (errno == EINTR)
 				continue;
 			barf_perror("Poll failed");
 		}
 
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
-				close(reopen_log_pipe[0]);
-				close(reopen_log_pipe[1]);
-				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
-				char c;
-				if (read(reopen_log_pipe[0], &c, 1) != 1)
-					barf_perror("read failed");
-				reopen_log();
-			}
-			reopen_log_pipe0_pollfd_idx = -1;
+		if (reopen_log_loop.revents & ~POLLIN) {
+			loop_del(&reopen_log_loop);
+			close(reopen_log_pipe[0]);
+			close(reopen_log_pipe[1]);
+			init_pipe(reopen_log_pipe);
+			loop_add(&reopen_log_loop, reopen_log_pipe[0],
+				 POLLIN|POLLPRI);
+		} else if (reopen_log_loop.revents & POLLIN) {
+			char c;
+			if (read(reopen_log_pipe[0], &c, 1) != 1)
+				barf_perror("read failed");
+			reopen_log();
 		}
 
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("sock poll failed");
-				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*sock, true);
-				sock_pollfd_idx = -1;
-			}
-		}
+		if (sock_loop.revents & ~POLLIN) {
+			barf_perror("sock poll failed");
+			break;
+		} else if (sock_loop.revents & POLLIN)
+			accept_connection(*sock, true);
 
-		if (ro_sock_pollfd_idx != -1) {
-			if (fds[ro_sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("ro sock poll failed");
-				break;
-			} else if (fds[ro_sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*ro_sock, false);
-				ro_sock_pollfd_idx = -1;
-			}
-		}
+		if (ro_sock_loop.revents & ~POLLIN) {
+			barf_perror("ro sock poll failed");
+			break;
+		} else if (ro_sock_loop.revents & POLLIN)
+			accept_connection(*ro_sock, false);
 
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
-			}
-		}
+		if (xce_loop.revents & ~POLLIN) {
+			barf_perror("xce_handle poll failed");
+			break;
+		} else if (xce_loop.revents & POLLIN)
+			handle_event();
 
 		next = list_entry(connections.next, typeof(*conn), list);
 		if (&next->list != &connections)
@@ -1990,48 +2437,38 @@ int main(int argc, char *argv[])
 				talloc_increase_ref_count(next);
 
 			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
+				/*
+				 * Take several requests off the ring and put
+				 * as many replies as fit back on, with one
+				 * event for the lot.
+				 */
+				bool alive = true;
+
+				for (n = 0; alive && n < DOMAIN_BATCH &&
+					    domain_can_read(conn); n++)
+					alive = conn_call(conn, handle_input);
+				while (alive && domain_can_write(conn) &&
+				       !list_empty(&conn->out_list))
+					alive = conn_call(conn, handle_output);
+				if (!alive)
 					continue;
+				domain_notify(conn);
 			} else {
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLIN)
-						handle_input(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
+				short revents = conn->loop.revents;
 
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLOUT)
-						handle_output(conn);
-				}
+				if (revents & ~(POLLIN|POLLOUT))
+					talloc_free(conn);
+				else if (revents & POLLIN)
+					handle_input(conn);
 				if (talloc_free(conn) == 0)
 					continue;
 
-				conn->pollfd_idx = -1;
+				talloc_increase_ref_count(conn);
+				if (revents & POLLOUT)
+					handle_output(conn);
 			}
+			talloc_free(conn);
 		}
-
-		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
-			       &ro_sock_pollfd_idx, &timeout);
 	}
 }
 
@@ -54,14 +54,23 @@ struct connection;
 typedef int connwritefn_t(struct connection *, const void *, unsigned int);
 typedef int connreadfn_t(struct connection *, void *, unsigned int);
 
+/* An fd the main loop waits on. */
+struct loop_fd
+{
+	int fd;
+	short events;		/* POLLIN etc. wanted */
+	short revents;		/* Ready as of the last wait */
+	int idx;		/* Slot in the poll array, if used */
+	int ready;		/* Slot in the ready array, or -1 */
+};
+
 struct connection
 {
 	struct list_head list;
 
-	/* The file descriptor we came in on. */
+	/* The file descriptor we came in on, and its place in the main loop. */
 	int fd;
-	/* The index of pollfd in global pollfd array */
-	int pollfd_idx;
+	struct loop_fd loop;
 
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
@@ -78,6 +87,9 @@ struct connection
 	/* Transaction context for current request (NULL if none). */
 	struct transaction *transaction;
 
+	/* Gathering the replies to an XS_MULTI's operations (NULL if not). */
+	struct multi_reply *multi;
+
 	/* List of in-progress transactions. */
 	struct list_head transaction_list;
 	uint32_t next_transaction_id;
@@ -98,11 +110,24 @@ struct connection
 };
 extern struct list_head connections;
 
+/*
+ * A node as kept in the store: permissions, data and children follow.
+ * The generation is bumped on every write to the store, so transactions
+ * can tell whether a node they looked at has changed underneath them.
+ */
+struct xs_tdb_record_hdr {
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from (NULL for the store itself) */
+	struct transaction *trans;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -147,14 +172,12 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
-
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
+/* Report the store as corrupt, and check it. */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Hashtable functions for nul-terminated string keys */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
@@ -75,6 +75,9 @@ struct domain
 
 	/* number of watch for this domain */
 	int nbwatch;
+
+	/* Has the ring moved since we last sent an event? */
+	bool notify;
 };
 
 static LIST_HEAD(domains);
@@ -130,7 +133,7 @@ static int writechn(struct connection *conn,
 	xen_mb();
 	intf->rsp_prod += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -160,7 +163,7 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -257,6 +260,14 @@ bool domain_can_read(struct connection *conn)
 	return (intf->req_cons != intf->req_prod);
 }
 
+void domain_notify(struct connection *conn)
+{
+	if (conn->domain->notify) {
+		xc_evtchn_notify(xce_handle, conn->domain->port);
+		conn->domain->notify = false;
+	}
+}
+
 bool domain_is_unprivileged(struct connection *conn)
 {
 	return (conn && conn->domain && conn->domain->domid != 0 && conn->domain->domid != priv_domid);
@@ -301,6 +312,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	domain->remote_port = port;
 	domain->nbentry = 0;
 	domain->nbwatch = 0;
+	domain->notify = false;
 
 	return domain;
 }
@@ -55,6 +55,9 @@ void restore_existing_connections(void);
 bool domain_can_read(struct connection *conn);
 bool domain_can_write(struct connection *conn);
 
+/* Send the domain an event if its ring has moved since the last. */
+void domain_notify(struct connection *conn);
+
 bool domain_is_unprivileged(struct connection *conn);
 
 /* Quota manipulation */
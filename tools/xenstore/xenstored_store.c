@@ -0,0 +1,417 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "talloc.h"
+#include "list.h"
+#include "hashtable.h"
+#include "xenstore_lib.h"
+#include "xenstored_store.h"
+
+struct store_record
+{
+	/* List of all records, in the order created. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *name;
+
+	/* Its record. */
+	TDB_DATA data;
+};
+
+static struct hashtable *records;
+static LIST_HEAD(record_list);
+static unsigned int nr_records;
+
+/*
+ * The journal is a magic string followed by entries, each a header, the
+ * node name and (unless a deletion) its record.  An entry cut short at
+ * the end by a crash is dropped when the journal is replayed.
+ */
+#define JOURNAL_MAGIC		"xenstored journal 1\n"
+#define JOURNAL_DELETE		0xffffffffU
+
+struct journal_entry
+{
+	uint32_t namelen;
+	uint32_t datalen;	/* JOURNAL_DELETE for a deletion */
+};
+
+/* Don't bother snapshotting a journal smaller than this. */
+#define JOURNAL_MIN_SNAPSHOT	(1024 * 1024)
+
+static char *journal_name;
+static int journal_fd = -1;
+
+/* Bytes in the journal, and bytes a snapshot of the store would take. */
+static uint64_t journal_size, live_size;
+
+static unsigned int store_hash_fn(void *k)
+{
+	char *str = k;
+	unsigned int hash = 5381;
+	char c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
+
+	return hash;
+}
+
+static int store_equal_fn(void *key1, void *key2)
+{
+	return 0 == strcmp((char *)key1, (char *)key2);
+}
+
+static uint64_t entry_size(const char *name, size_t datalen)
+{
+	return sizeof(struct journal_entry) + strlen(name) + datalen;
+}
+
+static int set_record(const char *name, const void *dptr, size_t dsize)
+{
+	struct store_record *r = hashtable_search(records, (void *)name);
+	char *hkey, *copy;
+
+	copy = talloc_memdup(NULL, dptr, dsize);
+	if (!copy)
+		goto nomem;
+
+	if (!r) {
+		r = talloc_zero(NULL, struct store_record);
+		if (!r)
+			goto nomem;
+		r->name = talloc_strdup(r, name);
+		hkey = r->name ? strdup(name) : NULL;
+		if (!hkey || !hashtable_insert(records, hkey, r)) {
+			free(hkey);
+			talloc_free(r);
+			goto nomem;
+		}
+		list_add_tail(&r->list, &record_list);
+		nr_records++;
+		live_size += entry_size(name, 0);
+	}
+
+	live_size += dsize;
+	live_size -= r->data.dsize;
+	talloc_free(r->data.dptr);
+	r->data.dptr = talloc_steal(r, copy);
+	r->data.dsize = dsize;
+	return 0;
+
+ nomem:
+	talloc_free(copy);
+	errno = ENOMEM;
+	return -1;
+}
+
+static void remove_record(const char *name)
+{
+	struct store_record *r = hashtable_remove(records, (void *)name);
+
+	if (!r)
+		return;
+	live_size -= entry_size(name, r->data.dsize);
+	nr_records--;
+	list_del(&r->list);
+	talloc_free(r);
+}
+
+/* Append a write (or a deletion, if data is NULL) to the journal. */
+static int journal_append(const char *name, const TDB_DATA *data)
+{
+	struct journal_entry entry;
+	size_t len;
+	char *buf;
+
+	if (journal_fd < 0)
+		return 0;
+
+	entry.namelen = strlen(name);
+	entry.datalen = data ? data->dsize : JOURNAL_DELETE;
+	len = entry_size(name, data ? data->dsize : 0);
+
+	/* One write, so the entry is not interleaved with anything. */
+	buf = talloc_size(NULL, len);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(buf, &entry, sizeof(entry));
+	memcpy(buf + sizeof(entry), name, entry.namelen);
+	if (data)
+		memcpy(buf + sizeof(entry) + entry.namelen, data->dptr,
+		       data->dsize);
+
+	if (!xs_write_all(journal_fd, buf, len)) {
+		int saved_errno = errno;
+
+		/* Don't leave half an entry for the next to follow. */
+		if (ftruncate(journal_fd, journal_size) != 0)
+			saved_errno = EIO;
+		talloc_free(buf);
+		errno = saved_errno;
+		return -1;
+	}
+
+	talloc_free(buf);
+	journal_size += len;
+	return 0;
+}
+
+/*
+ * Rewrite the journal as a snapshot of the store, once it is mostly
+ * entries that later ones have overwritten.  Failing to is not fatal:
+ * appends carry on to the old journal.
+ */
+static void journal_snapshot(void)
+{
+	struct store_record *r;
+	char *tmp;
+	int fd;
+
+	if (journal_fd < 0 || journal_size < JOURNAL_MIN_SNAPSHOT ||
+	    journal_size < 2 * live_size)
+		return;
+
+	tmp = talloc_asprintf(NULL, "%s.new", journal_name);
+	if (!tmp)
+		return;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0640);
+	if (fd < 0)
+		goto out;
+
+	if (!xs_write_all(fd, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)))
+		goto fail;
+	list_for_each_entry(r, &record_list, list) {
+		struct journal_entry entry;
+
+		entry.namelen = strlen(r->name);
+		entry.datalen = r->data.dsize;
+		if (!xs_write_all(fd, &entry, sizeof(entry)) ||
+		    !xs_write_all(fd, r->name, entry.namelen) ||
+		    !xs_write_all(fd, r->data.dptr, r->data.dsize))
+			goto fail;
+	}
+	if (rename(tmp, journal_name) != 0)
+		goto fail;
+
+	close(journal_fd);
+	journal_fd = fd;
+	journal_size = strlen(JOURNAL_MAGIC) + live_size;
+	goto out;
+
+ fail:
+	close(fd);
+	unlink(tmp);
+ out:
+	talloc_free(tmp);
+}
+
+static int journal_replay(int fd, bool read_only)
+{
+	struct journal_entry entry;
+	struct stat st;
+	char *buf, *name;
+	size_t off, len;
+	int ret = -1;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+	len = st.st_size;
+
+	/* A new journal. */
+	if (len == 0 && !read_only) {
+		if (!xs_write_all(fd, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)))
+			return -1;
+		journal_size = strlen(JOURNAL_MAGIC);
+		return 0;
+	}
+
+	buf = talloc_size(NULL, len);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (pread(fd, buf, len, 0) != (ssize_t)len) {
+		errno = EIO;
+		goto out;
+	}
+	if (len < strlen(JOURNAL_MAGIC) ||
+	    memcmp(buf, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	off = strlen(JOURNAL_MAGIC);
+	while (len - off >= sizeof(entry)) {
+		size_t datalen;
+
+		memcpy(&entry, buf + off, sizeof(entry));
+		datalen = entry.datalen == JOURNAL_DELETE ? 0 : entry.datalen;
+		if (len - off - sizeof(entry) < (size_t)entry.namelen + datalen)
+			break;
+
+		name = talloc_strndup(buf, buf + off + sizeof(entry),
+				      entry.namelen);
+		if (!name) {
+			errno = ENOMEM;
+			goto out;
+		}
+		if (entry.datalen == JOURNAL_DELETE)
+			remove_record(name);
+		else if (set_record(name, buf + off + sizeof(entry) +
+				    entry.namelen, datalen) != 0)
+			goto out;
+		talloc_free(name);
+
+		off += sizeof(entry) + entry.namelen + datalen;
+	}
+
+	/* Drop an entry the last run didn't finish writing. */
+	if (off != len && !read_only && ftruncate(fd, off) != 0)
+		goto out;
+	journal_size = off;
+	ret = 0;
+
+ out:
+	talloc_free(buf);
+	return ret;
+}
+
+int store_open(const char *journal, bool read_only)
+{
+	records = create_hashtable(7919, store_hash_fn, store_equal_fn);
+	if (!records) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (!journal)
+		return 0;
+
+	journal_name = talloc_strdup(talloc_autofree_context(), journal);
+	journal_fd = read_only ? open(journal, O_RDONLY) :
+		open(journal, O_RDWR | O_CREAT | O_APPEND, 0640);
+	if (!journal_name || journal_fd < 0)
+		return -1;
+	if (journal_replay(journal_fd, read_only) != 0) {
+		int saved_errno = errno;
+
+		close(journal_fd);
+		journal_fd = -1;
+		errno = saved_errno;
+		return -1;
+	}
+	if (read_only) {
+		close(journal_fd);
+		journal_fd = -1;
+		return 0;
+	}
+
+	journal_snapshot();
+	return 0;
+}
+
+unsigned int store_count(void)
+{
+	return nr_records;
+}
+
+const TDB_DATA *store_lookup(const char *name)
+{
+	struct store_record *r = hashtable_search(records, (void *)name);
+
+	return r ? &r->data : NULL;
+}
+
+int store_fetch(const void *ctx, const char *name, TDB_DATA *data)
+{
+	const TDB_DATA *rec = store_lookup(name);
+
+	if (!rec) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	data->dptr = talloc_memdup(ctx, rec->dptr, rec->dsize);
+	if (!data->dptr) {
+		errno = ENOMEM;
+		return -1;
+	}
+	data->dsize = rec->dsize;
+	return 0;
+}
+
+int store_write(const char *name, TDB_DATA data)
+{
+	if (journal_append(name, &data) != 0)
+		return -1;
+	if (set_record(name, data.dptr, data.dsize) != 0)
+		return -1;
+	journal_snapshot();
+	return 0;
+}
+
+int store_delete(const char *name)
+{
+	if (!store_lookup(name)) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (journal_append(name, NULL) != 0)
+		return -1;
+	remove_record(name);
+	journal_snapshot();
+	return 0;
+}
+
+int store_traverse(int (*fn)(const char *name, TDB_DATA data, void *priv),
+		   void *priv)
+{
+	struct store_record *r, *next;
+	int ret;
+
+	list_for_each_entry_safe(r, next, &record_list, list) {
+		ret = fn(r->name, r->data, priv);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,59 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include <stdbool.h>
+#include "tdb.h"
+
+/*
+ * The store holds one record per node, keyed by its full path, in memory.
+ * If given a journal it appends each change to it, and replays it when
+ * opened; the journal is rewritten as a snapshot of the store whenever it
+ * has grown well beyond the size of one.
+ *
+ * Functions returning int return 0, or -1 with errno set.
+ */
+
+/*
+ * Open the store, replaying journal if it exists.  journal may be NULL.
+ * If read_only, the journal is only replayed: changes are not written.
+ */
+int store_open(const char *journal, bool read_only);
+
+/* Number of records in the store. */
+unsigned int store_count(void);
+
+/* The record of a node, or NULL if there is none.  Do not keep it. */
+const TDB_DATA *store_lookup(const char *name);
+
+/* A talloc'd copy of the record of a node. */
+int store_fetch(const void *ctx, const char *name, TDB_DATA *data);
+
+/* Replace the record of a node. */
+int store_write(const char *name, TDB_DATA data);
+
+/* Remove the record of a node: ENOENT if there is none. */
+int store_delete(const char *name);
+
+/* Call fn for each record until it returns non-zero; fn may delete it. */
+int store_traverse(int (*fn)(const char *name, TDB_DATA data, void *priv),
+		   void *priv);
+
+#endif /* _XENSTORED_STORE_H */
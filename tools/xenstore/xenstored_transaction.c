@@ -30,9 +30,11 @@
 #include <unistd.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
@@ -48,6 +50,29 @@ struct changed_node
 	bool recurse;
 };
 
+/*
+ * A node this transaction has looked at.  Rather than work on a copy of
+ * the whole store, a transaction records the generation of each node it
+ * reads or writes the first time it does so, and keeps its own versions
+ * of those it writes.  It can commit only if none of them has changed in
+ * the store since.
+ */
+struct accessed_node
+{
+	/* List of all accessed nodes, in the order first accessed. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Its generation when first accessed, 0 if it didn't exist. */
+	uint64_t generation;
+
+	/* Written in this transaction: data is our record, NULL if deleted. */
+	bool modified;
+	TDB_DATA data;
+};
+
 struct changed_domain
 {
 	/* List of all changed domains in the context of this transaction. */
@@ -68,12 +93,9 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
-
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* Nodes accessed, in order and indexed by name. */
+	struct list_head accessed;
+	struct hashtable *accessed_index;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,12 +105,194 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/* Stamped on each record written to the store; 0 is never used. */
+static uint64_t generation;
+
+static struct accessed_node *find_accessed(struct transaction *trans,
+					   const char *name)
+{
+	return hashtable_search(trans->accessed_index, (void *)name);
+}
+
+/* Sets errno on failure. */
+static struct accessed_node *add_accessed(struct transaction *trans,
+					  const char *name, uint64_t gen)
+{
+	struct accessed_node *a;
+	char *hkey;
+
+	a = talloc_zero(trans, struct accessed_node);
+	if (!a)
+		goto nomem;
+	a->node = talloc_strdup(a, name);
+	hkey = a->node ? strdup(name) : NULL;
+	if (!hkey)
+		goto nomem;
+	if (!hashtable_insert(trans->accessed_index, hkey, a)) {
+		free(hkey);
+		goto nomem;
+	}
+	a->generation = gen;
+	list_add_tail(&a->list, &trans->accessed);
+	return a;
+
+ nomem:
+	talloc_free(a);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Generation of a node in the store, 0 if absent. */
+static uint64_t store_generation(const char *name)
+{
+	const TDB_DATA *data = store_lookup(name);
+
+	if (!data)
+		return 0;
+	return ((const struct xs_tdb_record_hdr *)data->dptr)->generation;
+}
+
+int transaction_fetch(struct transaction *trans, const char *name,
+		      TDB_DATA *data)
+{
+	struct accessed_node *a;
+
+	if (!trans)
+		return store_fetch(NULL, name, data);
+
+	a = find_accessed(trans, name);
+	if (a && a->modified) {
+		if (!a->data.dptr) {
+			errno = ENOENT;
+			return -1;
+		}
+		data->dsize = a->data.dsize;
+		data->dptr = talloc_memdup(NULL, a->data.dptr, a->data.dsize);
+		if (!data->dptr) {
+			errno = ENOMEM;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!a && !add_accessed(trans, name, store_generation(name)))
+		return -1;
+	return store_fetch(NULL, name, data);
+}
+
+int transaction_store(struct transaction *trans, const char *name,
+		      TDB_DATA data)
 {
-	return trans->tdb;
+	struct accessed_node *a;
+	void *copy;
+
+	if (!trans) {
+		((struct xs_tdb_record_hdr *)data.dptr)->generation =
+			++generation;
+		return store_write(name, data);
+	}
+
+	a = find_accessed(trans, name);
+	if (!a) {
+		a = add_accessed(trans, name, store_generation(name));
+		if (!a)
+			return -1;
+	}
+
+	copy = talloc_memdup(a, data.dptr, data.dsize);
+	if (!copy) {
+		errno = ENOMEM;
+		return -1;
+	}
+	talloc_free(a->data.dptr);
+	a->data.dptr = copy;
+	a->data.dsize = data.dsize;
+	a->modified = true;
+	return 0;
+}
+
+int transaction_delete(struct transaction *trans, const char *name)
+{
+	struct accessed_node *a;
+
+	if (!trans)
+		return store_delete(name);
+
+	a = find_accessed(trans, name);
+	if (!a) {
+		a = add_accessed(trans, name, store_generation(name));
+		if (!a)
+			return -1;
+	}
+
+	if (a->modified ? !a->data.dptr : !a->generation) {
+		errno = ENOENT;
+		return -1;
+	}
+	talloc_free(a->data.dptr);
+	a->data.dptr = NULL;
+	a->data.dsize = 0;
+	a->modified = true;
+	return 0;
+}
+
+const TDB_DATA *transaction_peek(struct transaction *trans, const char *name)
+{
+	struct accessed_node *a = trans ? find_accessed(trans, name) : NULL;
+
+	if (a && a->modified)
+		return a->data.dptr ? &a->data : NULL;
+	return store_lookup(name);
+}
+
+static int max_generation_(const char *name, TDB_DATA val, void *private)
+{
+	const struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+
+	if (val.dsize >= sizeof(*hdr) && hdr->generation > generation)
+		generation = hdr->generation;
+	return 0;
+}
+
+void transaction_setup_generation(void)
+{
+	/* Carry on above what an existing store holds, so none is reused. */
+	store_traverse(max_generation_, NULL);
+}
+
+/*
+ * Check nothing the transaction looked at has changed, then write what it
+ * changed to the store.  Sets errno (EAGAIN on conflict) on failure.
+ */
+static int transaction_commit(struct transaction *trans)
+{
+	struct accessed_node *a;
+
+	list_for_each_entry(a, &trans->accessed, list) {
+		if (store_generation(a->node) != a->generation) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	list_for_each_entry(a, &trans->accessed, list) {
+		if (!a->modified)
+			continue;
+		if (a->data.dptr) {
+			if (transaction_store(NULL, a->node, a->data) != 0) {
+				corrupt(NULL, "Write of %s failed", a->node);
+				return -1;
+			}
+		} else if (a->generation) {
+			if (transaction_delete(NULL, a->node) != 0) {
+				corrupt(NULL, "Could not delete '%s'", a->node);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +301,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* Changes to the store itself are noticed through generations. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -118,9 +320,7 @@ static int destroy_transaction(void *_transaction)
 	struct transaction *trans = _transaction;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	hashtable_destroy(trans->accessed_index, 0);
 	return 0;
 }
 
@@ -138,6 +338,45 @@ struct transaction *transaction_lookup(struct connection *conn, uint32_t id)
 	return ERR_PTR(-ENOENT);
 }
 
+struct transaction *transaction_new(const void *ctx)
+{
+	struct transaction *trans;
+
+	trans = talloc(ctx, struct transaction);
+	if (!trans)
+		return NULL;
+	INIT_LIST_HEAD(&trans->accessed);
+	INIT_LIST_HEAD(&trans->changes);
+	INIT_LIST_HEAD(&trans->changed_domains);
+	trans->id = 0;
+	trans->accessed_index = create_hashtable(16, hash_from_key_fn,
+						 keys_equal_fn);
+	if (!trans->accessed_index) {
+		talloc_free(trans);
+		return NULL;
+	}
+	talloc_set_destructor(trans, destroy_transaction);
+	return trans;
+}
+
+int transaction_finish(struct connection *conn, struct transaction *trans)
+{
+	struct changed_node *i;
+	struct changed_domain *d;
+
+	if (transaction_commit(trans) != 0)
+		return -1;
+
+	/* fix domain entry for each changed domain */
+	list_for_each_entry(d, &trans->changed_domains, list)
+		domain_entry_fix(d->domid, d->nbentry);
+
+	/* Fire off the watches for everything that changed. */
+	list_for_each_entry(i, &trans->changes, list)
+		fire_watches(conn, i->node, i->recurse);
+	return 0;
+}
+
 void do_transaction_start(struct connection *conn, struct buffered_data *in)
 {
 	struct transaction *trans, *exists;
@@ -155,19 +394,11 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	}
 
 	/* Attach transaction to input for autofree until it's complete */
-	trans = talloc(in, struct transaction);
-	INIT_LIST_HEAD(&trans->changes);
-	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans = transaction_new(in);
+	if (!trans) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -178,7 +409,6 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
-	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
@@ -187,8 +417,6 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 void do_transaction_end(struct connection *conn, const char *arg)
 {
-	struct changed_node *i;
-	struct changed_domain *d;
 	struct transaction *trans;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F"))) {
@@ -208,27 +436,9 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	/* Attach transaction to arg for auto-cleanup */
 	talloc_steal(arg, trans);
 
-	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
-			send_error(conn, EAGAIN);
-			return;
-		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
-			return;
-		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
-
-		/* fix domain entry for each changed domain */
-		list_for_each_entry(d, &trans->changed_domains, list)
-			domain_entry_fix(d->domid, d->nbentry);
-
-		/* Fire off the watches for everything that changed. */
-		list_for_each_entry(i, &trans->changes, list)
-			fire_watches(conn, i->node, i->recurse);
-		generation++;
+	if (streq(arg, "T") && transaction_finish(conn, trans) != 0) {
+		send_error(conn, errno);
+		return;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 }
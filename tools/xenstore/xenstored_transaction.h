@@ -25,6 +25,18 @@ struct transaction;
 void do_transaction_start(struct connection *conn, struct buffered_data *node);
 void do_transaction_end(struct connection *conn, const char *arg);
 
+/*
+ * A transaction of the daemon's own, not on any connection's list, freed
+ * with ctx.  NULL if out of memory.
+ */
+struct transaction *transaction_new(const void *ctx);
+
+/*
+ * Commit trans, then fire the watches of what it changed as conn.  Sets
+ * errno (EAGAIN on conflict) on failure.  trans is left for the caller.
+ */
+int transaction_finish(struct connection *conn, struct transaction *trans);
+
 struct transaction *transaction_lookup(struct connection *conn, uint32_t id);
 
 /* inc/dec entry number local to trans while changing a node */
@@ -35,8 +47,25 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/*
+ * Access a node's record in the store, through trans if not NULL.  These
+ * return 0, or -1 with errno set.  Fetched data is the caller's to free.
+ */
+int transaction_fetch(struct transaction *trans, const char *name,
+		      TDB_DATA *data);
+int transaction_store(struct transaction *trans, const char *name,
+		      TDB_DATA data);
+int transaction_delete(struct transaction *trans, const char *name);
+
+/*
+ * A node's record as trans (if not NULL) sees it, or NULL if there is
+ * none, without counting as an access for the transaction to conflict
+ * on.  Do not keep it.
+ */
+const TDB_DATA *transaction_peek(struct transaction *trans, const char *name);
+
+/* Pick up generations from a store opened at startup. */
+void transaction_setup_generation(void);
 
 void conn_delete_all_transactions(struct connection *conn);
 
@@ -26,6 +26,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -46,8 +47,161 @@ struct watch
 
 	char *token;
 	char *node;
+
+	/* Other watches on the same path, and the connection we belong to. */
+	struct list_head node_list;
+	struct watch_node *wnode;
+	struct connection *conn;
 };
 
+/*
+ * Watches are indexed by path, in a trie with a node per path component,
+ * so that firing costs the depth of the path plus the watches matched
+ * rather than a look at every watch.  Special "@" paths are children of
+ * the root, so that watches on "/" see them as they always have.
+ */
+struct watch_node
+{
+	struct watch_node *parent;
+
+	/* Our component: also our key in parent->index, so malloc'ed. */
+	char *name;
+
+	struct list_head sibling;
+	struct list_head children;
+	struct hashtable *index;
+
+	/* Watches on exactly this path. */
+	struct list_head watches;
+};
+
+static struct watch_node *watch_root;
+
+static unsigned int watch_hash_fn(void *k)
+{
+	char *str = k;
+	unsigned int hash = 5381;
+	char c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
+
+	return hash;
+}
+
+static int watch_equal_fn(void *key1, void *key2)
+{
+	return streq(key1, key2);
+}
+
+static int destroy_watch_node(void *_node)
+{
+	struct watch_node *node = _node;
+
+	hashtable_destroy(node->index, 0);
+	return 0;
+}
+
+static struct watch_node *watch_node_new(struct watch_node *parent,
+					 const char *name)
+{
+	struct watch_node *node = talloc(NULL, struct watch_node);
+
+	if (!node)
+		return NULL;
+	node->index = create_hashtable(16, watch_hash_fn, watch_equal_fn);
+	if (!node->index) {
+		talloc_free(node);
+		return NULL;
+	}
+	talloc_set_destructor(node, destroy_watch_node);
+
+	node->parent = parent;
+	node->name = NULL;
+	INIT_LIST_HEAD(&node->children);
+	INIT_LIST_HEAD(&node->watches);
+	if (!parent)
+		return node;
+
+	node->name = strdup(name);
+	if (!node->name || !hashtable_insert(parent->index, node->name, node)) {
+		free(node->name);
+		talloc_free(node);
+		return NULL;
+	}
+	list_add_tail(&node->sibling, &parent->children);
+
+	return node;
+}
+
+/* Free nodes which no longer lead to any watch, from node upwards. */
+static void watch_node_put(struct watch_node *node)
+{
+	struct watch_node *parent;
+
+	while (node != watch_root &&
+	       list_empty(&node->watches) && list_empty(&node->children)) {
+		parent = node->parent;
+		list_del(&node->sibling);
+		/* Frees node->name, the key */
+		hashtable_remove(parent->index, node->name);
+		talloc_free(node);
+		node = parent;
+	}
+}
+
+/* Split the next component off *path, or return NULL at its end. */
+static char *next_component(char **path)
+{
+	char *c = *path, *end;
+
+	if (*c == '@') {
+		*path = c + strlen(c);
+		return c;
+	}
+
+	while (*c == '/')
+		c++;
+	if (!*c)
+		return NULL;
+
+	end = strchr(c, '/');
+	if (end) {
+		*end = '\0';
+		*path = end + 1;
+	} else
+		*path = c + strlen(c);
+
+	return c;
+}
+
+/* The node for a path, created if asked, or NULL. */
+static struct watch_node *watch_node_get(const char *name, bool create)
+{
+	struct watch_node *node, *child;
+	char *path, *p, *c;
+
+	if (!watch_root && create)
+		watch_root = watch_node_new(NULL, NULL);
+	node = watch_root;
+
+	p = path = talloc_strdup(NULL, name);
+	if (!path)
+		return NULL;
+	while (node && (c = next_component(&p))) {
+		child = hashtable_search(node->index, c);
+		if (!child && create) {
+			child = watch_node_new(node, c);
+			if (!child)
+				watch_node_put(node);
+		}
+		node = child;
+	}
+	talloc_free(path);
+
+	return node;
+}
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -86,28 +240,52 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+/* All watches below node see it go, as their own path. */
+static void fire_subtree(struct watch_node *node)
+{
+	struct watch_node *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &node->children, sibling) {
+		list_for_each_entry(watch, &child->watches, node_list)
+			add_event(watch->conn, watch, watch->node);
+		fire_subtree(child);
+	}
+}
+
 void fire_watches(struct connection *conn, const char *name, bool recurse)
 {
-	struct connection *i;
+	struct watch_node *node = watch_root;
 	struct watch *watch;
+	char *path, *p, *c;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
+	/* Create an event for each watch on name or above it. */
+	p = path = talloc_strdup(NULL, name);
+	while (node) {
+		list_for_each_entry(watch, &node->watches, node_list)
+			add_event(watch->conn, watch, name);
+		if (!(c = next_component(&p))) {
+			if (recurse)
+				fire_subtree(node);
+			break;
 		}
+		node = hashtable_search(node->index, c);
 	}
+	talloc_free(path);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	if (watch->wnode) {
+		list_del(&watch->node_list);
+		watch_node_put(watch->wnode);
+	}
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -163,6 +341,15 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 
 	INIT_LIST_HEAD(&watch->events);
 
+	watch->conn = conn;
+	watch->wnode = watch_node_get(watch->node, true);
+	if (!watch->wnode) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	list_add_tail(&watch->node_list, &watch->wnode->watches);
+
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
 	trace_create(watch, "watch");
@@ -42,6 +42,17 @@ struct xs_stored_msg {
 	char *body;
 };
 
+/* An asynchronous request, sent with its id as req_id. */
+struct xs_async_req {
+	struct list_head list;
+	uint32_t id;
+	xs_async_cb_t *cb;
+	void *priv;
+
+	/* The reply, once it has arrived: NULL if the connection failed. */
+	struct xs_stored_msg *msg;
+};
+
 #ifdef USE_PTHREAD
 
 #include <pthread.h>
@@ -82,12 +93,23 @@ struct xs_handle {
 	/* One request at a time. */
 	pthread_mutex_t request_mutex;
 
+	/*
+	 * Asynchronous requests awaiting a reply, and those whose reply
+	 * has arrived but not yet been handed to its callback.  Clients
+	 * can select() on the pipe to wait for the latter.
+	 */
+	struct list_head async_pending;
+	struct list_head async_done;
+	uint32_t async_next_id;
+	int async_pipe[2];
+
 	/* Lock discipline:
 	 *  Only holder of the request lock may write to h->fd.
 	 *  Only holder of the request lock may access read_thr_exists.
 	 *  If read_thr_exists==0, only holder of request lock may read h->fd;
 	 *  If read_thr_exists==1, only the read thread may read h->fd.
-	 *  Only holder of the reply lock may access reply_list.
+	 *  Only holder of the reply lock may access reply_list and the
+	 *  async_ fields.
 	 *  Only holder of the watch lock may access watch_list.
 	 * Lock hierarchy:
 	 *  The order in which to acquire locks is
@@ -129,6 +151,11 @@ struct xs_handle {
 	int watch_pipe[2];
 	/* Filtering watch event in unwatch function? */
 	bool unwatch_filter;
+	/* Asynchronous requests, as above: there is no pipe. */
+	struct list_head async_pending;
+	struct list_head async_done;
+	uint32_t async_next_id;
+	int async_pipe[2];
 };
 
 #define mutex_lock(m)		((void)0)
@@ -146,6 +173,33 @@ struct xs_handle {
 
 static int read_message(struct xs_handle *h, int nonblocking);
 
+/*
+ * Hand an asynchronous request its reply (NULL if the connection failed),
+ * for xs_async_dispatch() to pass on.  Call with the reply lock held.
+ */
+static void async_complete(struct xs_handle *h, struct xs_async_req *req,
+			   struct xs_stored_msg *msg)
+{
+	char c = 0;
+
+	/* Kick users out of their select() loop. */
+	if (list_empty(&h->async_done) && (h->async_pipe[1] != -1))
+		while (write(h->async_pipe[1], &c, 1) != 1)
+			continue;
+
+	req->msg = msg;
+	list_move_tail(&req->list, &h->async_done);
+}
+
+/* The connection has gone: no more replies are coming. */
+static void async_fail_all(struct xs_handle *h)
+{
+	struct xs_async_req *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &h->async_pending, list)
+		async_complete(h, req, NULL);
+}
+
 static void setnonblock(int fd, int nonblock) {
 	int esave = errno;
 	int flags = fcntl(fd, F_GETFL);
@@ -251,9 +305,13 @@ static struct xs_handle *get_handle(const char *connect_to)
 
 	INIT_LIST_HEAD(&h->reply_list);
 	INIT_LIST_HEAD(&h->watch_list);
+	INIT_LIST_HEAD(&h->async_pending);
+	INIT_LIST_HEAD(&h->async_done);
+	h->async_next_id = 1;
 
-	/* Watch pipe is allocated on demand in xs_fileno(). */
+	/* Pipes are allocated on demand in xs_fileno(), xs_async_fileno(). */
 	h->watch_pipe[0] = h->watch_pipe[1] = -1;
+	h->async_pipe[0] = h->async_pipe[1] = -1;
 
 	h->unwatch_filter = false;
 
@@ -305,6 +363,17 @@ struct xs_handle *xs_open(unsigned long flags)
 
 static void close_free_msgs(struct xs_handle *h) {
 	struct xs_stored_msg *msg, *tmsg;
+	struct xs_async_req *req, *treq;
+
+	/* Requests still in flight never see their callbacks called. */
+	list_splice_init(&h->async_pending, &h->async_done);
+	list_for_each_entry_safe(req, treq, &h->async_done, list) {
+		if (req->msg) {
+			free(req->msg->body);
+			free(req->msg);
+		}
+		free(req);
+	}
 
 	list_for_each_entry_safe(msg, tmsg, &h->reply_list, list) {
 		free(msg->body);
@@ -322,6 +391,10 @@ static void close_fds_free(struct xs_handle *h) {
 		close(h->watch_pipe[0]);
 		close(h->watch_pipe[1]);
 	}
+	if (h->async_pipe[0] != -1) {
+		close(h->async_pipe[0]);
+		close(h->async_pipe[1]);
+	}
 
         close(h->fd);
         
@@ -428,9 +501,19 @@ static void *read_reply(
 
 	read_from_thread = read_thread_exists(h);
 
-	/* Read from comms channel ourselves if there is no reader thread. */
-	if (!read_from_thread && (read_message(h, 0) == -1))
-		return NULL;
+	/* Read from comms channel ourselves if there is no reader thread.
+	 * Replies to asynchronous requests may come first. */
+	if (!read_from_thread) {
+		for (;;) {
+			mutex_lock(&h->reply_mutex);
+			if (!list_empty(&h->reply_list))
+				break;
+			mutex_unlock(&h->reply_mutex);
+			if (read_message(h, 0) == -1)
+				return NULL;
+		}
+		mutex_unlock(&h->reply_mutex);
+	}
 
 	mutex_lock(&h->reply_mutex);
 #ifdef USE_PTHREAD
@@ -713,19 +796,12 @@ bool xs_restrict(struct xs_handle *h, unsigned domid)
 	return xs_bool(xs_single(h, XBT_NULL, XS_RESTRICT, buf, NULL));
 }
 
-/* Watch a node for changes (poll on fd to detect, or call read_watch()).
- * When the node (or any child) changes, fd will become readable.
- * Token is returned when watch is read, to allow matching.
- * Returns false on failure.
- */
-bool xs_watch(struct xs_handle *h, const char *path, const char *token)
-{
-	struct iovec iov[2];
-
 #ifdef USE_PTHREAD
 #define READ_THREAD_STACKSIZE PTHREAD_STACK_MIN
 
-	/* We dynamically create a reader thread on demand. */
+/* We dynamically create a reader thread on demand. */
+static bool read_thread_start(struct xs_handle *h)
+{
 	mutex_lock(&h->request_mutex);
 	if (!h->read_thr_exists) {
 		sigset_t set, old_set;
@@ -755,6 +831,22 @@ bool xs_watch(struct xs_handle *h, const char *path, const char *token)
 		pthread_attr_destroy(&attr);
 	}
 	mutex_unlock(&h->request_mutex);
+	return true;
+}
+#endif
+
+/* Watch a node for changes (poll on fd to detect, or call read_watch()).
+ * When the node (or any child) changes, fd will become readable.
+ * Token is returned when watch is read, to allow matching.
+ * Returns false on failure.
+ */
+bool xs_watch(struct xs_handle *h, const char *path, const char *token)
+{
+	struct iovec iov[2];
+
+#ifdef USE_PTHREAD
+	if (!read_thread_start(h))
+		return false;
 #endif
 
 	iov[0].iov_base = (void *)path;
@@ -974,6 +1066,697 @@ bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 	return xs_bool(xs_single(h, t, XS_TRANSACTION_END, abortstr, NULL));
 }
 
+struct xs_multi_result
+{
+	int error;		/* errno if it failed, ECANCELED if not reached */
+	void *data;		/* The reply, nul terminated. */
+	unsigned int len;
+};
+
+struct xs_multi
+{
+	/* The payload of the XS_MULTI request. */
+	char *buffer;
+	unsigned int len;
+
+	unsigned int num_ops;
+	struct xs_multi_result *results;
+};
+
+struct xs_multi *xs_multi_new(void)
+{
+	return calloc(1, sizeof(struct xs_multi));
+}
+
+static void multi_reset_results(struct xs_multi *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->num_ops; i++) {
+		free(m->results[i].data);
+		m->results[i].data = NULL;
+		m->results[i].len = 0;
+		m->results[i].error = ECANCELED;
+	}
+}
+
+void xs_multi_free(struct xs_multi *m)
+{
+	if (!m)
+		return;
+	multi_reset_results(m);
+	free(m->results);
+	free(m->buffer);
+	free(m);
+}
+
+static bool multi_add(struct xs_multi *m, enum xsd_sockmsg_type type,
+		      const struct iovec *iovec, unsigned int num_vecs)
+{
+	struct xsd_multi_op op;
+	struct xs_multi_result *results;
+	char *buffer;
+	unsigned int i;
+
+	op.type = type;
+	op.len = 0;
+	for (i = 0; i < num_vecs; i++)
+		op.len += iovec[i].iov_len;
+
+	results = realloc(m->results, (m->num_ops + 1) * sizeof(*results));
+	if (!results)
+		return false;
+	m->results = results;
+	buffer = realloc(m->buffer, m->len + sizeof(op) + op.len);
+	if (!buffer)
+		return false;
+	m->buffer = buffer;
+
+	memcpy(m->buffer + m->len, &op, sizeof(op));
+	m->len += sizeof(op);
+	for (i = 0; i < num_vecs; i++) {
+		memcpy(m->buffer + m->len, iovec[i].iov_base, iovec[i].iov_len);
+		m->len += iovec[i].iov_len;
+	}
+
+	memset(&m->results[m->num_ops], 0, sizeof(*results));
+	m->results[m->num_ops].error = ECANCELED;
+	m->num_ops++;
+	return true;
+}
+
+static bool multi_add_path(struct xs_multi *m, enum xsd_sockmsg_type type,
+			   const char *path)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)path;
+	iovec.iov_len = strlen(path) + 1;
+	return multi_add(m, type, &iovec, 1);
+}
+
+bool xs_multi_read(struct xs_multi *m, const char *path)
+{
+	return multi_add_path(m, XS_READ, path);
+}
+
+bool xs_multi_write(struct xs_multi *m, const char *path,
+		    const void *data, unsigned int len)
+{
+	struct iovec iovec[2];
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+	iovec[1].iov_base = (void *)data;
+	iovec[1].iov_len = len;
+	return multi_add(m, XS_WRITE, iovec, ARRAY_SIZE(iovec));
+}
+
+bool xs_multi_mkdir(struct xs_multi *m, const char *path)
+{
+	return multi_add_path(m, XS_MKDIR, path);
+}
+
+bool xs_multi_rm(struct xs_multi *m, const char *path)
+{
+	return multi_add_path(m, XS_RM, path);
+}
+
+bool xs_multi_set_permissions(struct xs_multi *m, const char *path,
+			      struct xs_permissions *perms,
+			      unsigned int num_perms)
+{
+	unsigned int i;
+	struct iovec iov[1+num_perms];
+	char buffer[num_perms][MAX_STRLEN(unsigned int)+1];
+
+	iov[0].iov_base = (void *)path;
+	iov[0].iov_len = strlen(path) + 1;
+
+	for (i = 0; i < num_perms; i++) {
+		if (!xs_perm_to_string(&perms[i], buffer[i], sizeof(buffer[i])))
+			return false;
+		iov[i+1].iov_base = buffer[i];
+		iov[i+1].iov_len = strlen(buffer[i]) + 1;
+	}
+
+	return multi_add(m, XS_SET_PERMS, iov, 1+num_perms);
+}
+
+/* Set result i from its reply: data need not be nul terminated. */
+static bool multi_set_result(struct xs_multi *m, unsigned int i,
+			     uint32_t type, const char *data, unsigned int len)
+{
+	struct xs_multi_result *r = &m->results[i];
+
+	r->data = malloc(len + 1);
+	if (!r->data) {
+		r->error = ENOMEM;
+		return false;
+	}
+	memcpy(r->data, data, len);
+	((char *)r->data)[len] = '\0';
+	r->len = len;
+
+	if (type != XS_ERROR) {
+		r->error = 0;
+		return true;
+	}
+	r->error = get_error(r->data);
+	free(r->data);
+	r->data = NULL;
+	r->len = 0;
+	return false;
+}
+
+/* Fill in the results from an XS_MULTI reply.  Sets errno on failure. */
+static bool multi_parse_reply(struct xs_multi *m, const char *reply,
+			      unsigned int len)
+{
+	struct xsd_multi_op op;
+	unsigned int i, off = 0;
+
+	for (i = 0; i < m->num_ops && off < len; i++) {
+		if (len - off < sizeof(op))
+			break;
+		memcpy(&op, reply + off, sizeof(op));
+		off += sizeof(op);
+		if (op.len > len - off)
+			break;
+		if (!multi_set_result(m, i, op.type, reply + off, op.len)) {
+			errno = m->results[i].error;
+			return false;
+		}
+		off += op.len;
+	}
+
+	/* Each operation must have a reply, and there must be nothing else. */
+	if (i != m->num_ops || off != len) {
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+/* Send the operations of a batch one at a time, in transaction t. */
+static bool multi_execute_each(struct xs_handle *h, xs_transaction_t t,
+			       struct xs_multi *m)
+{
+	struct xsd_multi_op op;
+	struct iovec iovec;
+	unsigned int i, off = 0;
+	void *reply;
+
+	for (i = 0; i < m->num_ops; i++) {
+		memcpy(&op, m->buffer + off, sizeof(op));
+		off += sizeof(op);
+		iovec.iov_base = m->buffer + off;
+		iovec.iov_len = op.len;
+		off += op.len;
+
+		reply = xs_talkv(h, t, op.type, &iovec, 1, &m->results[i].len);
+		if (!reply) {
+			m->results[i].error = errno;
+			return false;
+		}
+		m->results[i].data = reply;
+		m->results[i].error = 0;
+	}
+	return true;
+}
+
+/* For daemons without XS_MULTI: a transaction of our own if not in one. */
+static bool multi_execute_fallback(struct xs_handle *h, xs_transaction_t t,
+				   struct xs_multi *m)
+{
+	xs_transaction_t own;
+
+	if (t != XBT_NULL)
+		return multi_execute_each(h, t, m);
+
+	for (;;) {
+		own = xs_transaction_start(h);
+		if (own == XBT_NULL)
+			return false;
+		if (!multi_execute_each(h, own, m)) {
+			int saved_errno = errno;
+
+			xs_transaction_end(h, own, true);
+			errno = saved_errno;
+			return false;
+		}
+		if (xs_transaction_end(h, own, false))
+			return true;
+		if (errno != EAGAIN)
+			return false;
+		multi_reset_results(m);
+	}
+}
+
+bool xs_multi_execute(struct xs_handle *h, xs_transaction_t t,
+		      struct xs_multi *m)
+{
+	struct iovec iovec;
+	unsigned int len;
+	char *reply;
+	bool ret;
+
+	multi_reset_results(m);
+
+	if (m->len <= XENSTORE_PAYLOAD_MAX) {
+		iovec.iov_base = m->buffer;
+		iovec.iov_len = m->len;
+		reply = xs_talkv(h, t, XS_MULTI, &iovec, 1, &len);
+		if (reply) {
+			ret = multi_parse_reply(m, reply, len);
+			free_no_errno(reply);
+			return ret;
+		}
+		/* An unknown request type: the daemon has done nothing. */
+		if (errno != ENOSYS)
+			return false;
+	}
+
+	return multi_execute_fallback(h, t, m);
+}
+
+const void *xs_multi_result(struct xs_multi *m, unsigned int i,
+			    unsigned int *len)
+{
+	if (i >= m->num_ops) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (m->results[i].error) {
+		errno = m->results[i].error;
+		return NULL;
+	}
+	if (len)
+		*len = m->results[i].len;
+	return m->results[i].data;
+}
+
+/* The nodes of a subtree, gathered before being handed out in one block. */
+struct subtree
+{
+	struct subtree_entry {
+		unsigned int path, value, len;	/* offsets into strings */
+	} *entries;
+	unsigned int num, max;
+
+	char *strings;
+	unsigned int used, size;
+};
+
+static bool subtree_add(struct subtree *s, const char *path,
+			unsigned int pathlen, const void *value,
+			unsigned int len)
+{
+	struct subtree_entry *e;
+	unsigned int need = pathlen + 1 + len + 1;
+	char *strings;
+
+	if (s->num == s->max) {
+		e = realloc(s->entries, (s->max * 2 + 16) * sizeof(*e));
+		if (!e)
+			return false;
+		s->entries = e;
+		s->max = s->max * 2 + 16;
+	}
+	if (need > s->size - s->used) {
+		strings = realloc(s->strings, s->size * 2 + need);
+		if (!strings)
+			return false;
+		s->strings = strings;
+		s->size = s->size * 2 + need;
+	}
+
+	e = &s->entries[s->num++];
+	e->path = s->used;
+	memcpy(s->strings + s->used, path, pathlen);
+	s->strings[s->used + pathlen] = '\0';
+	e->value = s->used + pathlen + 1;
+	e->len = len;
+	memcpy(s->strings + e->value, value, len);
+	s->strings[e->value + len] = '\0';
+	s->used += need;
+	return true;
+}
+
+/* The full path of a node, given relative to path.  Returns malloced. */
+static char *subtree_path(const char *path, const char *rel)
+{
+	char *full;
+
+	if (!*rel)
+		return strdup(path);
+	full = malloc(strlen(path) + 1 + strlen(rel) + 1);
+	if (full)
+		sprintf(full, "%s/%s", strcmp(path, "/") ? path : "", rel);
+	return full;
+}
+
+/* Add a node read on its own, unless it has gone. */
+static bool subtree_add_read(struct xs_handle *h, xs_transaction_t t,
+			     struct subtree *s, const char *path,
+			     const char *rel)
+{
+	char *full = subtree_path(path, rel);
+	unsigned int len;
+	void *value;
+	bool ret;
+
+	if (!full)
+		return false;
+	value = xs_read(h, t, full, &len);
+	free_no_errno(full);
+	if (!value)
+		return errno == ENOENT;
+	ret = subtree_add(s, rel, strlen(rel), value, len);
+	free_no_errno(value);
+	return ret;
+}
+
+/* For daemons without XS_READ_SUBTREE: a node, then those below it. */
+static bool subtree_walk(struct xs_handle *h, xs_transaction_t t,
+			 struct subtree *s, const char *path, const char *rel)
+{
+	char *full, *child, **dir;
+	unsigned int i, num;
+	bool ret = true;
+
+	if (!subtree_add_read(h, t, s, path, rel))
+		return false;
+
+	full = subtree_path(path, rel);
+	if (!full)
+		return false;
+	dir = xs_directory(h, t, full, &num);
+	free_no_errno(full);
+	if (!dir)
+		return errno == ENOENT;
+
+	for (i = 0; ret && i < num; i++) {
+		child = malloc(strlen(rel) + 1 + strlen(dir[i]) + 1);
+		if (child)
+			sprintf(child, "%s%s%s", rel, *rel ? "/" : "", dir[i]);
+		ret = child && subtree_walk(h, t, s, path, child);
+		free_no_errno(child);
+	}
+	free_no_errno(dir);
+	return ret;
+}
+
+/* Add the nodes of one XS_READ_SUBTREE reply.  Sets *done at the end. */
+static bool subtree_parse_reply(struct xs_handle *h, xs_transaction_t t,
+				struct subtree *s, const char *path,
+				const char *reply, unsigned int len,
+				bool *done)
+{
+	struct xsd_subtree_node node;
+	unsigned int off = 0, datalen, first = s->num;
+	char *rel;
+	bool ret;
+
+	while (len - off >= sizeof(node)) {
+		memcpy(&node, reply + off, sizeof(node));
+		off += sizeof(node);
+		if (node.pathlen == XS_SUBTREE_END) {
+			*done = true;
+			break;
+		}
+		datalen = node.datalen == XS_SUBTREE_TOOBIG ? 0 : node.datalen;
+		if (node.pathlen > len - off || datalen > len - off - node.pathlen)
+			break;
+
+		if (node.datalen == XS_SUBTREE_TOOBIG) {
+			rel = strndup(reply + off, node.pathlen);
+			ret = rel && subtree_add_read(h, t, s, path, rel);
+			free_no_errno(rel);
+		} else
+			ret = subtree_add(s, reply + off, node.pathlen,
+					  reply + off + node.pathlen, datalen);
+		if (!ret)
+			return false;
+		off += node.pathlen + datalen;
+	}
+
+	/* A reply must be well formed, and carry the walk forward. */
+	if (off != len || (!*done && s->num == first)) {
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+struct xs_subtree_node *xs_read_subtree(struct xs_handle *h,
+					xs_transaction_t t,
+					const char *path, unsigned int *num)
+{
+	struct subtree s = { 0 };
+	struct xs_subtree_node *ret = NULL;
+	struct iovec iovec[2];
+	unsigned int i, len, last;
+	bool done = false;
+	char *reply;
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+
+	while (!done) {
+		/* After the first reply, carry on from the last node. */
+		if (s.num) {
+			last = s.entries[s.num - 1].path;
+			iovec[1].iov_base = s.strings + last;
+			iovec[1].iov_len = strlen(s.strings + last) + 1;
+		}
+		reply = xs_talkv(h, t, XS_READ_SUBTREE, iovec, s.num ? 2 : 1,
+				 &len);
+		if (!reply) {
+			if (errno != ENOSYS || s.num ||
+			    !subtree_walk(h, t, &s, path, ""))
+				goto out;
+			/* Even the top was gone by the time it was read. */
+			if (!s.num) {
+				errno = ENOENT;
+				goto out;
+			}
+			break;
+		}
+		if (!subtree_parse_reply(h, t, &s, path, reply, len, &done)) {
+			free_no_errno(reply);
+			goto out;
+		}
+		free(reply);
+	}
+
+	/* Transfer to one big alloc for easy freeing. */
+	ret = malloc(s.num * sizeof(*ret) + s.used);
+	if (!ret)
+		goto out;
+	memcpy(&ret[s.num], s.strings, s.used);
+	for (i = 0; i < s.num; i++) {
+		ret[i].path = (char *)&ret[s.num] + s.entries[i].path;
+		ret[i].value = (char *)&ret[s.num] + s.entries[i].value;
+		ret[i].len = s.entries[i].len;
+	}
+	*num = s.num;
+
+ out:
+	free_no_errno(s.entries);
+	free_no_errno(s.strings);
+	return ret;
+}
+
+uint32_t xs_async_request(struct xs_handle *h, xs_transaction_t t,
+			  enum xsd_sockmsg_type type,
+			  const void *data, unsigned int len,
+			  xs_async_cb_t *cb, void *priv)
+{
+	struct xsd_sockmsg msg;
+	struct xs_async_req *req;
+	struct sigaction ignorepipe, oldact;
+	int saved_errno;
+
+	if (len > XENSTORE_PAYLOAD_MAX) {
+		errno = E2BIG;
+		return 0;
+	}
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		return 0;
+	req->cb = cb;
+	req->priv = priv;
+	req->msg = NULL;
+
+	msg.tx_id = t;
+	msg.type = type;
+	msg.len = len;
+
+	ignorepipe.sa_handler = SIG_IGN;
+	sigemptyset(&ignorepipe.sa_mask);
+	ignorepipe.sa_flags = 0;
+	sigaction(SIGPIPE, &ignorepipe, &oldact);
+
+	mutex_lock(&h->request_mutex);
+
+	/* Listed before it is sent, so the reply always finds it. */
+	mutex_lock(&h->reply_mutex);
+	do {
+		req->id = h->async_next_id++;
+	} while (req->id == 0);
+	list_add_tail(&req->list, &h->async_pending);
+	msg.req_id = req->id;
+	mutex_unlock(&h->reply_mutex);
+
+	if (!xs_write_all(h->fd, &msg, sizeof(msg)) ||
+	    !xs_write_all(h->fd, data, len))
+		goto fail;
+
+	mutex_unlock(&h->request_mutex);
+	sigaction(SIGPIPE, &oldact, NULL);
+
+	/* Not req->id: the reply may already have been dispatched. */
+	return msg.req_id;
+
+fail:
+	saved_errno = errno;
+	mutex_lock(&h->reply_mutex);
+	list_del(&req->list);
+	mutex_unlock(&h->reply_mutex);
+	free(req);
+
+	/* We're in a bad state, so close fd. */
+	close(h->fd);
+	h->fd = -1;
+	mutex_unlock(&h->request_mutex);
+	sigaction(SIGPIPE, &oldact, NULL);
+	errno = saved_errno;
+	return 0;
+}
+
+/* A request whose payload is a single string. */
+static uint32_t async_single(struct xs_handle *h, xs_transaction_t t,
+			     enum xsd_sockmsg_type type, const char *string,
+			     xs_async_cb_t *cb, void *priv)
+{
+	return xs_async_request(h, t, type, string, strlen(string) + 1,
+				cb, priv);
+}
+
+uint32_t xs_async_read(struct xs_handle *h, xs_transaction_t t,
+		       const char *path, xs_async_cb_t *cb, void *priv)
+{
+	return async_single(h, t, XS_READ, path, cb, priv);
+}
+
+uint32_t xs_async_write(struct xs_handle *h, xs_transaction_t t,
+			const char *path, const void *data, unsigned int len,
+			xs_async_cb_t *cb, void *priv)
+{
+	unsigned int pathlen = strlen(path) + 1;
+	uint32_t id;
+	char *buf;
+
+	buf = malloc(pathlen + len);
+	if (!buf)
+		return 0;
+	memcpy(buf, path, pathlen);
+	memcpy(buf + pathlen, data, len);
+
+	id = xs_async_request(h, t, XS_WRITE, buf, pathlen + len, cb, priv);
+	free_no_errno(buf);
+	return id;
+}
+
+uint32_t xs_async_mkdir(struct xs_handle *h, xs_transaction_t t,
+			const char *path, xs_async_cb_t *cb, void *priv)
+{
+	return async_single(h, t, XS_MKDIR, path, cb, priv);
+}
+
+uint32_t xs_async_rm(struct xs_handle *h, xs_transaction_t t,
+		     const char *path, xs_async_cb_t *cb, void *priv)
+{
+	return async_single(h, t, XS_RM, path, cb, priv);
+}
+
+int xs_async_fileno(struct xs_handle *h)
+{
+#ifdef USE_PTHREAD
+	char c = 0;
+
+	if (!read_thread_start(h))
+		return -1;
+
+	mutex_lock(&h->reply_mutex);
+	if ((h->async_pipe[0] == -1) && (pipe(h->async_pipe) != -1)) {
+		/* Kick things off if replies are already waiting. */
+		if (!list_empty(&h->async_done))
+			while (write(h->async_pipe[1], &c, 1) != 1)
+				continue;
+	}
+	mutex_unlock(&h->reply_mutex);
+
+	return h->async_pipe[0];
+#else
+	return h->fd;
+#endif
+}
+
+int xs_async_dispatch(struct xs_handle *h)
+{
+	struct xs_async_req *req, *tmp;
+	struct list_head done;
+	int err, n = 0;
+	char c;
+
+	/* Without a reader thread, read whatever has arrived ourselves. */
+	mutex_lock(&h->request_mutex);
+	if (!read_thread_exists(h) && h->fd != -1) {
+		while (read_message(h, 1) == 0)
+			continue;
+		if (errno != EAGAIN) {
+			close(h->fd);
+			h->fd = -1;
+			mutex_lock(&h->reply_mutex);
+			async_fail_all(h);
+			mutex_unlock(&h->reply_mutex);
+		}
+	}
+	mutex_unlock(&h->request_mutex);
+
+	INIT_LIST_HEAD(&done);
+	mutex_lock(&h->reply_mutex);
+	if (!list_empty(&h->async_done) && (h->async_pipe[0] != -1))
+		while (read(h->async_pipe[0], &c, 1) != 1)
+			continue;
+	list_splice_init(&h->async_done, &done);
+	mutex_unlock(&h->reply_mutex);
+
+	/* Callbacks are free to make further requests. */
+	list_for_each_entry_safe(req, tmp, &done, list) {
+		struct xs_stored_msg *msg = req->msg;
+
+		list_del(&req->list);
+		if (!msg)
+			req->cb(h, req->id, req->priv, EBADF, NULL, 0);
+		else if (msg->hdr.type == XS_ERROR) {
+			err = get_error(msg->body);
+			free(msg->body);
+			req->cb(h, req->id, req->priv, err, NULL, 0);
+		} else
+			req->cb(h, req->id, req->priv, 0, msg->body,
+				msg->hdr.len);
+		free(msg);
+		free(req);
+		n++;
+	}
+
+	return n;
+}
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page and event channel
  * associated with a domain: the domain uses these to communicate.
@@ -1172,6 +1955,28 @@ static int read_message(struct xs_handle *h, int nonblocking)
 		condvar_signal(&h->watch_condvar);
 
 		cleanup_pop(1);
+	} else if (msg->hdr.req_id != 0) {
+		struct xs_async_req *req;
+		bool found = false;
+
+		mutex_lock(&h->reply_mutex);
+		cleanup_push(pthread_mutex_unlock, &h->reply_mutex);
+
+		list_for_each_entry(req, &h->async_pending, list) {
+			if (req->id == msg->hdr.req_id) {
+				async_complete(h, req, msg); /* Cancellation point */
+				found = true;
+				break;
+			}
+		}
+
+		cleanup_pop(1);
+
+		/* A reply to nothing we asked? */
+		if (!found) {
+			saved_errno = EINVAL;
+			goto error_freebody;
+		}
 	} else {
 		mutex_lock(&h->reply_mutex);
 
@@ -1221,6 +2026,7 @@ static void *read_thread(void *arg)
 	/* wake up all waiters */
 	pthread_mutex_lock(&h->reply_mutex);
 	pthread_cond_broadcast(&h->reply_condvar);
+	async_fail_all(h);
 	pthread_mutex_unlock(&h->reply_mutex);
 
 	pthread_mutex_lock(&h->watch_mutex);
@@ -1,4 +1,4 @@
-/* Simple program to dump out all records of TDB */
+/* Simple program to dump out all records of the xenstored store journal */
 #include <stdint.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -6,11 +6,12 @@
 #include <stdarg.h>
 #include <string.h>
 #include "xenstore_lib.h"
-#include "tdb.h"
+#include "xenstored_store.h"
 #include "talloc.h"
 #include "utils.h"
 
 struct record_hdr {
+	uint64_t generation;
 	uint32_t num_perms;
 	uint32_t datalen;
 	uint32_t childlen;
@@ -32,51 +33,44 @@ static char perm_to_char(enum xs_perm_type perm)
 		'?';
 }
 
-int main(int argc, char *argv[])
+static int dump_record(const char *name, TDB_DATA data, void *priv)
 {
-	TDB_DATA key;
-	TDB_CONTEXT *tdb;
+	struct record_hdr *hdr = (void *)data.dptr;
 
-	if (argc != 2)
-		barf("Usage: xs_tdb_dump <tdbfile>");
+	if (data.dsize < sizeof(*hdr))
+		fprintf(stderr, "%s: BAD truncated\n", name);
+	else if (data.dsize != total_size(hdr))
+		fprintf(stderr, "%s: BAD length %i for %i/%i/%i (%i)\n",
+			name, (int)data.dsize, hdr->num_perms, hdr->datalen,
+			hdr->childlen, total_size(hdr));
+	else {
+		unsigned int i;
+		char *p;
 
-	tdb = tdb_open(talloc_strdup(NULL, argv[1]), 0, 0, O_RDONLY, 0);
-	if (!tdb)
-		barf_perror("Could not open %s", argv[1]);
+		printf("%s (%llu): ", name,
+		       (unsigned long long)hdr->generation);
+		for (i = 0; i < hdr->num_perms; i++)
+			printf("%s%c%i",
+			       i == 0 ? "" : ",",
+			       perm_to_char(hdr->perms[i].perms),
+			       hdr->perms[i].id);
+		p = (void *)&hdr->perms[hdr->num_perms];
+		printf(" %.*s\n", hdr->datalen, p);
+		p += hdr->datalen;
+		for (i = 0; i < hdr->childlen; i += strlen(p+i)+1)
+			printf("\t-> %s\n", p+i);
+	}
+	return 0;
+}
 
-	key = tdb_firstkey(tdb);
-	while (key.dptr) {
-		TDB_DATA data;
-		struct record_hdr *hdr;
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+		barf("Usage: xs_tdb_dump <journal>");
 
-		data = tdb_fetch(tdb, key);
-		hdr = (void *)data.dptr;
-		if (data.dsize < sizeof(*hdr))
-			fprintf(stderr, "%.*s: BAD truncated\n",
-				(int)key.dsize, key.dptr);
-		else if (data.dsize != total_size(hdr))
-			fprintf(stderr, "%.*s: BAD length %i for %i/%i/%i (%i)\n",
-				(int)key.dsize, key.dptr, (int)data.dsize,
-				hdr->num_perms, hdr->datalen,
-				hdr->childlen, total_size(hdr));
-		else {
-			unsigned int i;
-			char *p;
+	if (store_open(argv[1], true) != 0)
+		barf_perror("Could not open %s", argv[1]);
 
-			printf("%.*s: ", (int)key.dsize, key.dptr);
-			for (i = 0; i < hdr->num_perms; i++)
-				printf("%s%c%i",
-				       i == 0 ? "" : ",",
-				       perm_to_char(hdr->perms[i].perms),
-				       hdr->perms[i].id);
-			p = (void *)&hdr->perms[hdr->num_perms];
-			printf(" %.*s\n", hdr->datalen, p);
-			p += hdr->datalen;
-			for (i = 0; i < hdr->childlen; i += strlen(p+i)+1)
-				printf("\t-> %s\n", p+i);
-		}
-		key = tdb_nextkey(tdb, key);
-	}
+	store_traverse(dump_record, NULL);
 	return 0;
 }
-
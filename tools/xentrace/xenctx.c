@@ -31,6 +31,7 @@
 
 static struct xenctx {
     xc_interface *xc_handle;
+    xc_map_cache_t *map_cache;
     int domid;
     int frame_ptrs;
     int stack_trace;
@@ -585,28 +586,17 @@ static void print_ctx(vcpu_guest_context_any_t *ctx_any)
 #ifndef NO_TRANSLATION
 static void *map_page(vcpu_guest_context_any_t *ctx, int vcpu, guest_word_t virt)
 {
-    static unsigned long previous_mfn = 0;
-    static void *mapped = NULL;
-
     unsigned long mfn = xc_translate_foreign_address(xenctx.xc_handle, xenctx.domid, vcpu, virt);
     unsigned long offset = virt & ~XC_PAGE_MASK;
+    void *mapped;
 
-    if (mapped && mfn == previous_mfn)
-        goto out;
-
-    if (mapped)
-        munmap(mapped, XC_PAGE_SIZE);
-
-    previous_mfn = mfn;
-
-    mapped = xc_map_foreign_range(xenctx.xc_handle, xenctx.domid, XC_PAGE_SIZE, PROT_READ, mfn);
+    mapped = xc_map_cache_get(xenctx.map_cache, xenctx.domid, mfn, PROT_READ);
 
     if (mapped == NULL) {
         fprintf(stderr, "failed to map page.\n");
         return NULL;
     }
 
- out:
     return (void *)(mapped + offset);
 }
 
@@ -904,6 +894,12 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
+    xenctx.map_cache = xc_map_cache_create(xenctx.xc_handle, 0);
+    if (xenctx.map_cache == NULL) {
+        perror("xc_map_cache_create");
+        exit(-1);
+    }
+
     ret = xc_domain_getinfo(xenctx.xc_handle, xenctx.domid, 1, &xenctx.dominfo);
     if (ret < 0) {
         perror("xc_domain_getinfo");
@@ -932,6 +928,8 @@ int main(int argc, char **argv)
         }
     }
 
+    xc_map_cache_destroy(xenctx.map_cache);
+
     ret = xc_interface_close(xenctx.xc_handle);
     if (ret < 0) {
         perror("xc_interface_close");
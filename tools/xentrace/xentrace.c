@@ -9,6 +9,8 @@
  * Date:   February 2004
  */
 
+#define _GNU_SOURCE /* vmsplice(), splice() */
+
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -25,6 +27,9 @@
 #include <assert.h>
 #include <sys/poll.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -57,6 +62,7 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned int nr_threads;  /* sharded output: number of consumer threads */
     uint8_t discard:1,
         disable_tracing:1,
         start_disabled:1;
@@ -126,6 +132,11 @@ struct cpu_change_record {
      | (((sizeof(struct cpu_change_record)/sizeof(uint32_t)) - 1)   \
         << TRACE_EXTRA_SHIFT) )
 
+/* *BSD has no O_LARGEFILE */
+#ifndef O_LARGEFILE
+#define O_LARGEFILE	0
+#endif
+
 void membuf_alloc(unsigned long size)
 {
     membuf.buf = malloc(size);
@@ -329,6 +340,34 @@ fail:
     return;
 }
 
+/**
+ * check_disk_space - exit if writing @size bytes to @fd would eat into the
+ *                    space reserved with --reserve-disk-space
+ */
+static void check_disk_space(int fd, unsigned long size)
+{
+    struct statvfs stat;
+    unsigned long long freespace;
+
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs(fd, &stat) )
+    {
+        fprintf(stderr, "Statfs failed!\n");
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
+
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
+    freespace >>= 20; /* Convert to MB */
+
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
+    }
+}
+
 /**
  * write_buffer - write a section of the trace buffer
  * @cpu      - source buffer CPU ID
@@ -343,35 +382,10 @@ fail:
 static void write_buffer(unsigned int cpu, unsigned char *start, int size,
                          int total_size)
 {
-    struct statvfs stat;
     size_t written = 0;
     
     if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
-    {
-        unsigned long long freespace;
-
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
-
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
-
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
-
-        freespace >>= 20; /* Convert to MB */
-
-        if ( freespace <= opts.disk_rsvd )
-        {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
-        }
-    }
+        check_disk_space(outfd, total_size ? total_size : size);
 
     /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
      * windows may involve two writes, so only write the record on the
@@ -626,6 +640,437 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
 }
 
 
+/**
+ * get_window - find the unconsumed records in a trace buffer
+ * @meta:         the buffer's metadata
+ * @data_size:    size of the buffer's data area
+ * @start_offset: set to the offset of the first unconsumed byte
+ * @end_offset:   set to the offset just past the last unconsumed byte
+ * @prod:         set to the producer index, to become the new consumer index
+ *
+ * Returns the number of unconsumed bytes, which may wrap around the end of
+ * the data area.
+ */
+static unsigned long get_window(struct t_buf *meta, unsigned long data_size,
+                                unsigned long *start_offset,
+                                unsigned long *end_offset,
+                                unsigned long *prod)
+{
+    unsigned long window_size, cons;
+
+    /* Read window information only once. */
+    cons = meta->cons;
+    *prod = meta->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == *prod )
+        return 0;
+
+    assert(cons < 2*data_size);
+    assert(*prod < 2*data_size);
+
+    // NB: if (prod<cons), then (prod-cons)%data_size will not yield
+    // the correct answer because data_size is not a power of 2.
+    if ( *prod < cons )
+        window_size = (*prod + 2*data_size) - cons;
+    else
+        window_size = *prod - cons;
+    assert(window_size > 0);
+    assert(window_size <= data_size);
+
+    *start_offset = cons % data_size;
+    *end_offset = *prod % data_size;
+
+    return window_size;
+}
+
+/***** Sharded output ********************************************************
+ *
+ * With --threads, each cpu's records go to a file of their own,
+ * <dir>/cpuN, in the usual xentrace format so that any shard can be fed
+ * to xentrace_format on its own.  Next to it, <dir>/cpuN.idx holds a
+ * struct shard_idx_hdr followed by one struct shard_idx_ent per window
+ * written: the TSC of the window's first timestamped record and the
+ * offset of the window in the shard.  TSCs only grow within a cpu, so
+ * post-processing can binary-search the index and seek straight to a
+ * point in time.
+ *
+ * The cpus are split into contiguous groups, one consumer thread per
+ * group, so a stalled disk or a busy cpu only holds up its own group.
+ * Where the kernel allows it, data is moved with vmsplice()/splice()
+ * straight from the mapped trace pages instead of being copied through
+ * write(); foreign mappings often cannot be spliced, in which case the
+ * thread falls back to write().
+ */
+
+#define SHARD_IDX_MAGIC   0x78746978 /* "xitx" */
+#define SHARD_IDX_VERSION 1
+
+struct shard_idx_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cpu;
+    uint32_t entry_size;    /* sizeof(struct shard_idx_ent) */
+};
+
+struct shard_idx_ent {
+    uint64_t tsc;
+    uint64_t offset;
+};
+
+struct shard {
+    unsigned int cpu;
+    int fd, idx_fd;
+    uint64_t offset;        /* bytes written to fd so far */
+};
+
+struct consumer {
+    pthread_t thread;
+    struct t_buf **meta;
+    unsigned char **data;
+    unsigned long data_size;
+    unsigned int nr_shards;
+    struct shard *shards;
+    int use_splice;
+    int pipefd[2];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long gen;      /* bumped whenever the buffers should be read */
+    int stop;
+} consumer_sync = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void shard_write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+
+    while ( size )
+    {
+        ssize_t rc = write(fd, p, size);
+
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to write trace data");
+            exit(EXIT_FAILURE);
+        }
+        p += rc;
+        size -= rc;
+    }
+}
+
+#ifdef __linux__
+/*
+ * Move @size bytes at @start to @fd through the consumer's pipe.  Returns
+ * how much was moved, which is short if the pages cannot be spliced.
+ * Once splice() has returned the data is in the page cache, so the trace
+ * buffer may be handed back to Xen.
+ */
+static size_t shard_splice(struct consumer *c, int fd,
+                           unsigned char *start, size_t size)
+{
+    size_t done = 0;
+
+    while ( done < size )
+    {
+        struct iovec iov = { .iov_base = start + done,
+                             .iov_len = size - done };
+        ssize_t in, out, rc;
+
+        in = vmsplice(c->pipefd[1], &iov, 1, 0);
+        if ( in < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            break;
+        }
+
+        for ( out = 0; out < in; out += rc )
+        {
+            rc = splice(c->pipefd[0], NULL, fd, NULL, in - out, SPLICE_F_MOVE);
+            if ( rc < 0 )
+            {
+                if ( errno == EINTR )
+                {
+                    rc = 0;
+                    continue;
+                }
+                PERROR("Failed to splice trace data");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        done += in;
+    }
+
+    return done;
+}
+#endif
+
+static void shard_write(struct consumer *c, struct shard *sh,
+                        unsigned char *start, size_t size)
+{
+    size_t done = 0;
+
+#ifdef __linux__
+    if ( c->use_splice && size )
+    {
+        done = shard_splice(c, sh->fd, start, size);
+        if ( done < size )
+        {
+            fprintf(stderr, "cpu%u: cannot splice trace pages (%s), "
+                    "using write()\n", sh->cpu, strerror(errno));
+            c->use_splice = 0;
+        }
+    }
+#endif
+
+    shard_write_all(sh->fd, start + done, size - done);
+    sh->offset += size;
+}
+
+/* TSC of the first timestamped record in a window, or 0 if there is none. */
+static uint64_t window_tsc(const unsigned char *data, unsigned long data_size,
+                           unsigned long offset, unsigned long len)
+{
+    while ( len >= sizeof(uint32_t) )
+    {
+        const struct t_rec *rec = (const struct t_rec *)(data + offset);
+        unsigned long rec_size = sizeof(uint32_t) +
+            rec->extra_u32 * sizeof(uint32_t) +
+            (rec->cycles_included ? sizeof(uint64_t) : 0);
+
+        if ( rec->cycles_included && rec->event != TRC_TRACE_WRAP_BUFFER )
+            return ((uint64_t)rec->u.cycles.cycles_hi << 32) |
+                   rec->u.cycles.cycles_lo;
+
+        if ( rec_size > len )
+            break;
+        len -= rec_size;
+        /* Records never straddle the end of the buffer. */
+        offset += rec_size;
+        if ( offset >= data_size )
+            offset -= data_size;
+    }
+
+    return 0;
+}
+
+static void shard_consume(struct consumer *c, struct shard *sh)
+{
+    struct t_buf *meta = c->meta[sh->cpu];
+    unsigned char *data = c->data[sh->cpu];
+    unsigned long start_offset, end_offset, window_size, prod;
+    struct cpu_change_record rec;
+    struct shard_idx_ent ent;
+
+    window_size = get_window(meta, c->data_size, &start_offset,
+                             &end_offset, &prod);
+    if ( window_size == 0 )
+        return;
+
+    if ( opts.disk_rsvd != 0 )
+        check_disk_space(sh->fd, sizeof(rec) + window_size);
+
+    ent.tsc = window_tsc(data, c->data_size, start_offset, window_size);
+    ent.offset = sh->offset;
+
+    rec.header = CPU_CHANGE_HEADER;
+    rec.data.cpu = sh->cpu;
+    rec.data.window_size = window_size;
+    shard_write_all(sh->fd, &rec, sizeof(rec));
+    sh->offset += sizeof(rec);
+
+    if ( end_offset > start_offset )
+        shard_write(c, sh, data + start_offset, window_size);
+    else
+    {
+        shard_write(c, sh, data + start_offset, c->data_size - start_offset);
+        shard_write(c, sh, data, end_offset);
+    }
+
+    xen_mb(); /* read buffer, then update cons. */
+    meta->cons = prod;
+
+    /* Only index data which actually made it to the shard. */
+    if ( ent.tsc )
+        shard_write_all(sh->idx_fd, &ent, sizeof(ent));
+}
+
+static void *consumer_thread(void *arg)
+{
+    struct consumer *c = arg;
+    unsigned long gen = 0;
+    unsigned int i;
+    int last;
+
+    do {
+        pthread_mutex_lock(&consumer_sync.lock);
+        while ( consumer_sync.gen == gen && !consumer_sync.stop )
+            pthread_cond_wait(&consumer_sync.cond, &consumer_sync.lock);
+        gen = consumer_sync.gen;
+        last = consumer_sync.stop;
+        pthread_mutex_unlock(&consumer_sync.lock);
+
+        for ( i = 0; i < c->nr_shards; i++ )
+            shard_consume(c, &c->shards[i]);
+    } while ( !last );
+
+    return NULL;
+}
+
+static void kick_consumers(int stop)
+{
+    pthread_mutex_lock(&consumer_sync.lock);
+    consumer_sync.gen++;
+    consumer_sync.stop = stop;
+    pthread_cond_broadcast(&consumer_sync.cond);
+    pthread_mutex_unlock(&consumer_sync.lock);
+}
+
+static int shard_open_file(unsigned int cpu, const char *suffix)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/cpu%u%s", opts.outfile, cpu, suffix);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+    if ( fd < 0 )
+    {
+        PERROR("Could not open %s", path);
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+static void shard_open(struct shard *sh, unsigned int cpu)
+{
+    struct shard_idx_hdr hdr = {
+        .magic = SHARD_IDX_MAGIC,
+        .version = SHARD_IDX_VERSION,
+        .cpu = cpu,
+        .entry_size = sizeof(struct shard_idx_ent),
+    };
+
+    sh->cpu = cpu;
+    sh->offset = 0;
+    sh->fd = shard_open_file(cpu, "");
+    sh->idx_fd = shard_open_file(cpu, ".idx");
+    shard_write_all(sh->idx_fd, &hdr, sizeof(hdr));
+}
+
+/**
+ * monitor_shards - collect trace data into per-cpu shards
+ *
+ * Runs until interrupted, with opts.nr_threads consumer threads doing the
+ * copying while this thread waits for VIRQ_TBUF and handles signals.
+ */
+static void monitor_shards(struct t_buf **meta, unsigned char **data,
+                           unsigned int num, unsigned long data_size)
+{
+    unsigned int nr = opts.nr_threads < num ? opts.nr_threads : num;
+    unsigned int i, j, cpu = 0;
+    struct consumer *consumers;
+    sigset_t mask, old_mask;
+
+    consumers = calloc(nr, sizeof(*consumers));
+    if ( consumers == NULL )
+    {
+        PERROR("Failed to allocate consumers");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct consumer *c = &consumers[i];
+
+        c->meta = meta;
+        c->data = data;
+        c->data_size = data_size;
+        c->nr_shards = num / nr + (i < num % nr);
+        c->shards = calloc(c->nr_shards, sizeof(*c->shards));
+        if ( c->shards == NULL )
+        {
+            PERROR("Failed to allocate shards");
+            exit(EXIT_FAILURE);
+        }
+        for ( j = 0; j < c->nr_shards; j++ )
+            shard_open(&c->shards[j], cpu++);
+
+#ifdef __linux__
+        if ( pipe(c->pipefd) == 0 )
+        {
+            c->use_splice = 1;
+#ifdef F_SETPIPE_SZ
+            /* Best effort: a bigger pipe means fewer round trips. */
+            fcntl(c->pipefd[1], F_SETPIPE_SZ, data_size);
+#endif
+        }
+#endif
+    }
+
+    /* Leave signal handling to this thread. */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        errno = pthread_create(&consumers[i].thread, NULL, consumer_thread,
+                               &consumers[i]);
+        if ( errno )
+        {
+            PERROR("Failed to create consumer thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    while ( !interrupted )
+    {
+        wait_for_event_or_timeout(opts.poll_sleep);
+        kick_consumers(0);
+    }
+
+    /* Disable tracing, then have everyone read their buffers one last time */
+    if ( opts.disable_tracing )
+        disable_tbufs();
+    kick_consumers(1);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct consumer *c = &consumers[i];
+
+        pthread_join(c->thread, NULL);
+        for ( j = 0; j < c->nr_shards; j++ )
+        {
+            close(c->shards[j].fd);
+            close(c->shards[j].idx_fd);
+        }
+        free(c->shards);
+#ifdef __linux__
+        if ( c->use_splice )
+        {
+            close(c->pipefd[0]);
+            close(c->pipefd[1]);
+        }
+#endif
+    }
+
+    free(consumers);
+}
+
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
  * @logfile:       the FILE * representing the file to log to
@@ -672,35 +1117,23 @@ static int monitor_tbufs(void)
         for ( i = 0; i < num; i++ )
             meta[i]->cons = meta[i]->prod;
 
+    if ( opts.nr_threads )
+    {
+        monitor_shards(meta, data, num, data_size);
+        goto out;
+    }
+
     /* now, scan buffers for events */
     while ( 1 )
     {
         for ( i = 0; i < num; i++ )
         {
-            unsigned long start_offset, end_offset, window_size, cons, prod;
-                
-            /* Read window information only once. */
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
-                continue;
-           
-            assert(cons < 2*data_size);
-            assert(prod < 2*data_size);
-
-            // NB: if (prod<cons), then (prod-cons)%data_size will not yield
-            // the correct answer because data_size is not a power of 2.
-            if ( prod < cons )
-                window_size = (prod + 2*data_size) - cons;
-            else
-                window_size = prod - cons;
-            assert(window_size > 0);
-            assert(window_size <= data_size);
+            unsigned long start_offset, end_offset, window_size, prod;
 
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
+            window_size = get_window(meta[i], data_size, &start_offset,
+                                     &end_offset, &prod);
+            if ( window_size == 0 )
+                continue;
 
             if ( end_offset > start_offset )
             {
@@ -748,11 +1181,13 @@ static int monitor_tbufs(void)
     if ( opts.memory_buffer )
         membuf_dump();
 
+    close(outfd);
+
+ out:
     /* cleanup */
     free(meta);
     free(data);
     /* don't need to munmap - cleanup is automatic */
-    close(outfd);
 
     return 0;
 }
@@ -772,6 +1207,7 @@ static void usage(void)
 {
 #define USAGE_STR \
 "Usage: xentrace [OPTION...] [output file]\n" \
+"       xentrace [OPTION...] -j N [output directory]\n" \
 "Tool to capture Xen trace buffer data\n" \
 "\n" \
 "  -c, --cpu-mask=c        Set cpu-mask\n" \
@@ -802,6 +1238,10 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -j, --threads=N         Consume the trace buffers with N threads, each\n" \
+"                          looking after a group of cpus, and write one\n" \
+"                          file per cpu (cpuN) into the output directory,\n" \
+"                          each with an index by TSC (cpuN.idx).\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -919,6 +1359,7 @@ static void parse_args(int argc, char **argv)
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
         { "memory-buffer",  required_argument, 0, 'M' },
+        { "threads",        required_argument, 0, 'j' },
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
@@ -927,7 +1368,7 @@ static void parse_args(int argc, char **argv)
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:j:DxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -977,6 +1418,10 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'j': /* Sharded output */
+            opts.nr_threads = argtol(optarg, 0);
+            break;
+
         default:
             usage();
         }
@@ -989,11 +1434,6 @@ static void parse_args(int argc, char **argv)
     opts.outfile = argv[optind];
 }
 
-/* *BSD has no O_LARGEFILE */
-#ifndef O_LARGEFILE
-#define O_LARGEFILE	0
-#endif
-
 int main(int argc, char **argv)
 {
     int ret;
@@ -1007,6 +1447,7 @@ int main(int argc, char **argv)
     opts.disable_tracing = 1;
     opts.start_disabled = 0;
     opts.timeout = 0;
+    opts.nr_threads = 0;
 
     parse_args(argc, argv);
 
@@ -1026,21 +1467,38 @@ int main(int argc, char **argv)
     if ( opts.timeout != 0 ) 
         alarm(opts.timeout);
 
-    if ( opts.outfile )
-        outfd = open(opts.outfile,
-                     O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
-                     0644);
-
-    if ( outfd < 0 )
+    if ( opts.nr_threads )
     {
-        perror("Could not open output file");
-        exit(EXIT_FAILURE);
-    }        
+        if ( opts.memory_buffer )
+        {
+            fprintf(stderr, "Cannot use a memory buffer with --threads.\n");
+            exit(EXIT_FAILURE);
+        }
 
-    if ( isatty(outfd) )
+        if ( mkdir(opts.outfile, 0755) && errno != EEXIST )
+        {
+            perror("Could not create output directory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
     {
-        fprintf(stderr, "Cannot output to a TTY, specify a log file.\n");
-        exit(EXIT_FAILURE);
+        if ( opts.outfile )
+            outfd = open(opts.outfile,
+                         O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                         0644);
+
+        if ( outfd < 0 )
+        {
+            perror("Could not open output file");
+            exit(EXIT_FAILURE);
+        }
+
+        if ( isatty(outfd) )
+        {
+            fprintf(stderr, "Cannot output to a TTY, specify a log file.\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     if ( opts.memory_buffer > 0 )
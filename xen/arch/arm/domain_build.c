@@ -52,8 +52,8 @@ struct vcpu *__init alloc_dom0_vcpu0(void)
 {
     if ( opt_dom0_max_vcpus == 0 )
         opt_dom0_max_vcpus = num_online_cpus();
-    if ( opt_dom0_max_vcpus > MAX_VIRT_CPUS )
-        opt_dom0_max_vcpus = MAX_VIRT_CPUS;
+    if ( opt_dom0_max_vcpus > gic_max_vcpus() )
+        opt_dom0_max_vcpus = gic_max_vcpus();
 
     dom0->vcpu = xzalloc_array(struct vcpu *, opt_dom0_max_vcpus);
     if ( !dom0->vcpu )
@@ -387,6 +387,7 @@ static int make_cpus_node(const struct domain *d, void *fdt,
     const struct dt_device_node *cpus = dt_find_node_by_path("/cpus");
     const struct dt_device_node *npcpu;
     unsigned int cpu;
+    uint32_t reg;
     const void *compatible = NULL;
     u32 len;
     /* Placeholder for cpu@ + a 32-bit number + \0 */
@@ -442,9 +443,11 @@ static int make_cpus_node(const struct domain *d, void *fdt,
 
     for ( cpu = 0; cpu < d->max_vcpus; cpu++ )
     {
-        DPRINT("Create cpu@%u node\n", cpu);
+        reg = vcpuid_to_vaffinity(cpu);
 
-        snprintf(buf, sizeof(buf), "cpu@%u", cpu);
+        DPRINT("Create cpu@%x node\n", reg);
+
+        snprintf(buf, sizeof(buf), "cpu@%x", reg);
         res = fdt_begin_node(fdt, buf);
         if ( res )
             return res;
@@ -457,7 +460,7 @@ static int make_cpus_node(const struct domain *d, void *fdt,
         if ( res )
             return res;
 
-        res = fdt_property_cell(fdt, "reg", cpu);
+        res = fdt_property_cell(fdt, "reg", reg);
         if ( res )
             return res;
 
@@ -484,6 +487,7 @@ static int make_gic_node(const struct domain *d, void *fdt,
     const void *compatible = NULL;
     u32 len;
     __be32 *new_cells, *tmp;
+    paddr_t dsize;
     int res = 0;
 
     DPRINT("Create gic node\n");
@@ -518,14 +522,28 @@ static int make_gic_node(const struct domain *d, void *fdt,
     if ( new_cells == NULL )
         return -FDT_ERR_XEN(ENOMEM);
 
+    /* A GICv3 distributor takes 64K */
+    dsize = d->arch.vgic.version == GIC_V2 ? PAGE_SIZE : 0x10000;
+
     tmp = new_cells;
     DPRINT("  Set Distributor Base 0x%"PRIpaddr"-0x%"PRIpaddr"\n",
-           d->arch.vgic.dbase, d->arch.vgic.dbase + PAGE_SIZE - 1);
-    dt_set_range(&tmp, parent, d->arch.vgic.dbase, PAGE_SIZE);
+           d->arch.vgic.dbase, d->arch.vgic.dbase + dsize - 1);
+    dt_set_range(&tmp, parent, d->arch.vgic.dbase, dsize);
 
-    DPRINT("  Set Cpu Base 0x%"PRIpaddr" size = 0x%"PRIpaddr"\n",
-           d->arch.vgic.cbase, d->arch.vgic.cbase + (PAGE_SIZE * 2) - 1);
-    dt_set_range(&tmp, parent, d->arch.vgic.cbase, PAGE_SIZE * 2);
+    if ( d->arch.vgic.version == GIC_V2 )
+    {
+        DPRINT("  Set Cpu Base 0x%"PRIpaddr" size = 0x%"PRIpaddr"\n",
+               d->arch.vgic.cbase, d->arch.vgic.cbase + (PAGE_SIZE * 2) - 1);
+        dt_set_range(&tmp, parent, d->arch.vgic.cbase, PAGE_SIZE * 2);
+    }
+    else
+    {
+        DPRINT("  Set Redistributor Base 0x%"PRIpaddr"-0x%"PRIpaddr"\n",
+               d->arch.vgic.rbase,
+               d->arch.vgic.rbase + d->arch.vgic.rbase_size - 1);
+        dt_set_range(&tmp, parent, d->arch.vgic.rbase,
+                     d->arch.vgic.rbase_size);
+    }
 
     res = fdt_property(fdt, "reg", new_cells, len);
     xfree(new_cells);
@@ -533,6 +551,13 @@ static int make_gic_node(const struct domain *d, void *fdt,
     if ( res )
         return res;
 
+    if ( d->arch.vgic.version == GIC_V3 )
+    {
+        res = fdt_property_cell(fdt, "#redistributor-regions", 1);
+        if ( res )
+            return res;
+    }
+
     /*
      * The value of the property "phandle" in the property "interrupts"
      * to know on which interrupt controller the interrupt is wired.
@@ -701,6 +726,7 @@ static int handle_node(struct domain *d, struct kernel_info *kinfo,
         DT_MATCH_COMPATIBLE("arm,psci"),
         DT_MATCH_PATH("/cpus"),
         DT_MATCH_GIC,
+        DT_MATCH_GIC_V3,
         DT_MATCH_TIMER,
         { /* sentinel */ },
     };
@@ -881,7 +907,6 @@ static void initrd_load(struct kernel_info *kinfo)
     paddr_t load_addr = kinfo->initrd_paddr;
     paddr_t paddr = early_info.modules.module[MOD_INITRD].start;
     paddr_t len = early_info.modules.module[MOD_INITRD].size;
-    unsigned long offs;
     int node;
     int res;
 
@@ -906,29 +931,7 @@ static void initrd_load(struct kernel_info *kinfo)
     if ( res )
         panic("Cannot fix up \"linux,initrd-end\" property\n");
 
-    for ( offs = 0; offs < len; )
-    {
-        int rc;
-        paddr_t s, l, ma;
-        void *dst;
-
-        s = offs & ~PAGE_MASK;
-        l = min(PAGE_SIZE - s, len);
-
-        rc = gvirt_to_maddr(load_addr + offs, &ma);
-        if ( rc )
-        {
-            panic("\nUnable to translate guest address\n");
-            return;
-        }
-
-        dst = map_domain_page(ma>>PAGE_SHIFT);
-
-        copy_from_paddr(dst + s, paddr + offs, l, BUFFERABLE);
-
-        unmap_domain_page(dst);
-        offs += l;
-    }
+    copy_from_paddr_to_guest(load_addr, paddr, len, BUFFERABLE);
 }
 
 int construct_dom0(struct domain *d)
@@ -0,0 +1,782 @@
+/*
+ * xen/arch/arm/gic-v3.c
+ *
+ * ARM Generic Interrupt Controller support v3
+ *
+ * Unlike with GICv2, the CPU interface and the virtual interface control
+ * are system registers (ICC_*_EL1 and ICH_*_EL2), each CPU has its own
+ * redistributor for its SGIs and PPIs, and the distributor routes SPIs
+ * to a CPU by affinity (GICD_IROUTER<n>).  An SGI goes to any of the CPUs
+ * of a cluster at once, so there's no limit of 8 CPUs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <xen/config.h>
+#include <xen/lib.h>
+#include <xen/init.h>
+#include <xen/mm.h>
+#include <xen/irq.h>
+#include <xen/sched.h>
+#include <xen/errno.h>
+#include <xen/delay.h>
+#include <xen/time.h>
+#include <xen/device_tree.h>
+#include <asm/p2m.h>
+#include <asm/domain.h>
+#include <asm/io.h>
+
+#include <asm/gic.h>
+#include <asm/gic_v3_defs.h>
+
+/* Size of the distributor registers */
+#define GICD_SIZE   0x10000
+
+struct rdist_region {
+    paddr_t base;
+    paddr_t size;
+    volatile uint32_t *map;
+};
+
+/* Global state */
+static struct {
+    paddr_t dbase;                      /* Address of distributor registers */
+    volatile uint32_t *map_dbase;       /* ... and where they are mapped */
+    struct rdist_region *rdist_regions; /* Redistributor regions */
+    uint32_t rdist_count;
+    uint32_t rdist_stride;              /* 0: as GICR_TYPER says */
+    unsigned int nr_priorities;         /* Virtual priority bits */
+} gicv3;
+
+static struct gic_info gicv3_info;
+
+/* This CPU's redistributor, RD_base frame followed by SGI_base */
+static DEFINE_PER_CPU(volatile uint32_t *, rbase);
+
+#define GICD        (gicv3.map_dbase)
+#define GICR        (this_cpu(rbase))
+
+/* Wait for the bits of mask in *reg to clear, for a second at most */
+static int gicv3_wait_for_clear(volatile uint32_t *reg, uint32_t mask)
+{
+    s_time_t deadline = NOW() + SECONDS(1);
+
+    while ( *reg & mask )
+    {
+        if ( NOW() > deadline )
+        {
+            printk(XENLOG_ERR "GICv3: timeout waiting for %#x to clear\n",
+                   mask);
+            return -ETIMEDOUT;
+        }
+        cpu_relax();
+        udelay(1);
+    }
+
+    return 0;
+}
+
+/* Wait for writes to the distributor's, or this CPU's redistributor's,
+ * control and enable registers to take effect. */
+static void gicv3_dist_wait_for_rwp(void)
+{
+    gicv3_wait_for_clear(GICD + GICD_CTLR, GICD_CTLR_RWP);
+}
+
+static void gicv3_redist_wait_for_rwp(void)
+{
+    gicv3_wait_for_clear(GICR + GICR_CTLR, GICR_CTLR_RWP);
+}
+
+/* Affinity of a CPU, as GICD_IROUTER<n> takes it */
+static uint64_t gicv3_mpidr_to_affinity(unsigned int cpu)
+{
+    uint64_t mpidr = cpu_logical_map(cpu);
+
+    return (MPIDR_AFFINITY_LEVEL(mpidr, 2) << 16 |
+            MPIDR_AFFINITY_LEVEL(mpidr, 1) << 8  |
+            MPIDR_AFFINITY_LEVEL(mpidr, 0));
+}
+
+/*
+ * The list registers and active priority registers are system registers
+ * each, named in the instruction.
+ */
+static uint64_t gicv3_ich_read_lr(unsigned int lr)
+{
+    switch ( lr )
+    {
+    case 0: return READ_SYSREG(ICH_LR0_EL2);
+    case 1: return READ_SYSREG(ICH_LR1_EL2);
+    case 2: return READ_SYSREG(ICH_LR2_EL2);
+    case 3: return READ_SYSREG(ICH_LR3_EL2);
+    case 4: return READ_SYSREG(ICH_LR4_EL2);
+    case 5: return READ_SYSREG(ICH_LR5_EL2);
+    case 6: return READ_SYSREG(ICH_LR6_EL2);
+    case 7: return READ_SYSREG(ICH_LR7_EL2);
+    case 8: return READ_SYSREG(ICH_LR8_EL2);
+    case 9: return READ_SYSREG(ICH_LR9_EL2);
+    case 10: return READ_SYSREG(ICH_LR10_EL2);
+    case 11: return READ_SYSREG(ICH_LR11_EL2);
+    case 12: return READ_SYSREG(ICH_LR12_EL2);
+    case 13: return READ_SYSREG(ICH_LR13_EL2);
+    case 14: return READ_SYSREG(ICH_LR14_EL2);
+    case 15: return READ_SYSREG(ICH_LR15_EL2);
+    default:
+        BUG();
+    }
+}
+
+static void gicv3_ich_write_lr(unsigned int lr, uint64_t val)
+{
+    switch ( lr )
+    {
+    case 0: WRITE_SYSREG(val, ICH_LR0_EL2); break;
+    case 1: WRITE_SYSREG(val, ICH_LR1_EL2); break;
+    case 2: WRITE_SYSREG(val, ICH_LR2_EL2); break;
+    case 3: WRITE_SYSREG(val, ICH_LR3_EL2); break;
+    case 4: WRITE_SYSREG(val, ICH_LR4_EL2); break;
+    case 5: WRITE_SYSREG(val, ICH_LR5_EL2); break;
+    case 6: WRITE_SYSREG(val, ICH_LR6_EL2); break;
+    case 7: WRITE_SYSREG(val, ICH_LR7_EL2); break;
+    case 8: WRITE_SYSREG(val, ICH_LR8_EL2); break;
+    case 9: WRITE_SYSREG(val, ICH_LR9_EL2); break;
+    case 10: WRITE_SYSREG(val, ICH_LR10_EL2); break;
+    case 11: WRITE_SYSREG(val, ICH_LR11_EL2); break;
+    case 12: WRITE_SYSREG(val, ICH_LR12_EL2); break;
+    case 13: WRITE_SYSREG(val, ICH_LR13_EL2); break;
+    case 14: WRITE_SYSREG(val, ICH_LR14_EL2); break;
+    case 15: WRITE_SYSREG(val, ICH_LR15_EL2); break;
+    default:
+        BUG();
+    }
+    isb();
+}
+
+/* 5 priority bits need one active priority register, 7 four. */
+static void gicv3_save_aprs(struct vcpu *v)
+{
+    switch ( gicv3.nr_priorities )
+    {
+    case 7:
+        v->arch.gic.v3.apr0[2] = READ_SYSREG(ICH_AP0R2_EL2);
+        v->arch.gic.v3.apr1[2] = READ_SYSREG(ICH_AP1R2_EL2);
+        v->arch.gic.v3.apr0[3] = READ_SYSREG(ICH_AP0R3_EL2);
+        v->arch.gic.v3.apr1[3] = READ_SYSREG(ICH_AP1R3_EL2);
+        /* Fall through */
+    case 6:
+        v->arch.gic.v3.apr0[1] = READ_SYSREG(ICH_AP0R1_EL2);
+        v->arch.gic.v3.apr1[1] = READ_SYSREG(ICH_AP1R1_EL2);
+        /* Fall through */
+    case 5:
+        v->arch.gic.v3.apr0[0] = READ_SYSREG(ICH_AP0R0_EL2);
+        v->arch.gic.v3.apr1[0] = READ_SYSREG(ICH_AP1R0_EL2);
+        break;
+    default:
+        BUG();
+    }
+}
+
+static void gicv3_restore_aprs(const struct vcpu *v)
+{
+    switch ( gicv3.nr_priorities )
+    {
+    case 7:
+        WRITE_SYSREG(v->arch.gic.v3.apr0[2], ICH_AP0R2_EL2);
+        WRITE_SYSREG(v->arch.gic.v3.apr1[2], ICH_AP1R2_EL2);
+        WRITE_SYSREG(v->arch.gic.v3.apr0[3], ICH_AP0R3_EL2);
+        WRITE_SYSREG(v->arch.gic.v3.apr1[3], ICH_AP1R3_EL2);
+        /* Fall through */
+    case 6:
+        WRITE_SYSREG(v->arch.gic.v3.apr0[1], ICH_AP0R1_EL2);
+        WRITE_SYSREG(v->arch.gic.v3.apr1[1], ICH_AP1R1_EL2);
+        /* Fall through */
+    case 5:
+        WRITE_SYSREG(v->arch.gic.v3.apr0[0], ICH_AP0R0_EL2);
+        WRITE_SYSREG(v->arch.gic.v3.apr1[0], ICH_AP1R0_EL2);
+        break;
+    default:
+        BUG();
+    }
+}
+
+static void gicv3_save_state(struct vcpu *v)
+{
+    int i;
+
+    dsb();
+    for ( i = 0; i < gicv3_info.nr_lrs; i++ )
+        v->arch.gic.v3.lr[i] = gicv3_ich_read_lr(i);
+    gicv3_save_aprs(v);
+    v->arch.gic.v3.vmcr = READ_SYSREG(ICH_VMCR_EL2);
+    v->arch.gic.v3.sre_el1 = READ_SYSREG(ICC_SRE_EL1);
+    /* Disable until next VCPU scheduled */
+    WRITE_SYSREG(0, ICH_HCR_EL2);
+}
+
+static void gicv3_restore_state(const struct vcpu *v)
+{
+    int i;
+
+    WRITE_SYSREG(v->arch.gic.v3.sre_el1, ICC_SRE_EL1);
+    WRITE_SYSREG(v->arch.gic.v3.vmcr, ICH_VMCR_EL2);
+    gicv3_restore_aprs(v);
+    for ( i = 0; i < gicv3_info.nr_lrs; i++ )
+        gicv3_ich_write_lr(i, v->arch.gic.v3.lr[i]);
+    dsb();
+    WRITE_SYSREG(ICH_HCR_EN, ICH_HCR_EL2);
+}
+
+static void gicv3_dump_state(const struct vcpu *v)
+{
+    int i;
+
+    if ( v == current )
+    {
+        for ( i = 0; i < gicv3_info.nr_lrs; i++ )
+            printk("   HW_LR[%d]=%"PRIx64"\n", i, gicv3_ich_read_lr(i));
+    } else {
+        for ( i = 0; i < gicv3_info.nr_lrs; i++ )
+            printk("   VCPU_LR[%d]=%"PRIx64"\n", i, v->arch.gic.v3.lr[i]);
+    }
+}
+
+/*
+ * Write the bit of desc's interrupt to the enable register at reg:
+ * SGIs and PPIs are enabled in this CPU's redistributor.
+ */
+static void gicv3_poke_irq(struct irq_desc *desc, unsigned int reg)
+{
+    uint32_t mask = 1u << (desc->irq % 32);
+
+    if ( desc->irq < NR_LOCAL_IRQS )
+    {
+        GICR[GICR_SGI_BASE + reg] = mask;
+        gicv3_redist_wait_for_rwp();
+    }
+    else
+    {
+        GICD[reg + desc->irq / 32] = mask;
+        gicv3_dist_wait_for_rwp();
+    }
+}
+
+static unsigned int gicv3_irq_startup(struct irq_desc *desc)
+{
+    /* Enable routing */
+    gicv3_poke_irq(desc, GICD_ISENABLER);
+
+    return 0;
+}
+
+static void gicv3_irq_shutdown(struct irq_desc *desc)
+{
+    /* Disable routing */
+    gicv3_poke_irq(desc, GICD_ICENABLER);
+}
+
+static void gicv3_irq_enable(struct irq_desc *desc)
+{
+
+}
+
+static void gicv3_irq_disable(struct irq_desc *desc)
+{
+
+}
+
+static void gicv3_irq_ack(struct irq_desc *desc)
+{
+    /* No ACK -- reading IAR has done this for us */
+}
+
+static void gicv3_eoi_irq(unsigned int irq)
+{
+    /* Lower the priority */
+    WRITE_SYSREG(irq, ICC_EOIR1_EL1);
+    isb();
+}
+
+static void gicv3_deactivate_irq(unsigned int irq)
+{
+    WRITE_SYSREG(irq, ICC_DIR_EL1);
+    isb();
+}
+
+static void gicv3_host_irq_end(struct irq_desc *desc)
+{
+    gicv3_eoi_irq(desc->irq);
+    gicv3_deactivate_irq(desc->irq);
+}
+
+static void gicv3_guest_irq_end(struct irq_desc *desc)
+{
+    gicv3_eoi_irq(desc->irq);
+    /* Deactivation happens in maintenance interrupt / via the guest's EOI */
+}
+
+static void gicv3_irq_set_affinity(struct irq_desc *desc, const cpumask_t *mask)
+{
+    BUG();
+}
+
+static hw_irq_controller gicv3_host_irq_type = {
+    .typename = "gic-v3",
+    .startup = gicv3_irq_startup,
+    .shutdown = gicv3_irq_shutdown,
+    .enable = gicv3_irq_enable,
+    .disable = gicv3_irq_disable,
+    .ack = gicv3_irq_ack,
+    .end = gicv3_host_irq_end,
+    .set_affinity = gicv3_irq_set_affinity,
+};
+static hw_irq_controller gicv3_guest_irq_type = {
+    .typename = "gic-v3",
+    .startup = gicv3_irq_startup,
+    .shutdown = gicv3_irq_shutdown,
+    .enable = gicv3_irq_enable,
+    .disable = gicv3_irq_disable,
+    .ack = gicv3_irq_ack,
+    .end = gicv3_guest_irq_end,
+    .set_affinity = gicv3_irq_set_affinity,
+};
+
+/*
+ * - needs to be called with the GIC lock held
+ * - SPIs are routed to the first CPU of cpu_mask, SGIs and PPIs are
+ *   this CPU's
+ */
+static void gicv3_set_irq_properties(unsigned int irq, bool_t level,
+                                     const cpumask_t *cpu_mask,
+                                     unsigned int priority)
+{
+    volatile unsigned char *bytereg;
+    volatile uint32_t *base;
+    uint32_t cfg, edgebit;
+
+    base = irq < NR_LOCAL_IRQS ? GICR + GICR_SGI_BASE : GICD;
+
+    /* Set edge / level */
+    cfg = base[GICD_ICFGR + irq / 16];
+    edgebit = 2u << (2 * (irq % 16));
+    if ( level )
+        cfg &= ~edgebit;
+    else
+        cfg |= edgebit;
+    base[GICD_ICFGR + irq / 16] = cfg;
+
+    /* Set target CPU */
+    if ( irq >= NR_LOCAL_IRQS )
+        writeq_relaxed(gicv3_mpidr_to_affinity(cpumask_any(cpu_mask)),
+                       GICD + GICD_IROUTER + 2 * irq);
+
+    /* Set priority */
+    bytereg = (unsigned char *) (base + GICD_IPRIORITYR);
+    bytereg[irq] = priority;
+}
+
+static void __init gicv3_dist_init(void)
+{
+    uint32_t type;
+    uint64_t affinity;
+    int i;
+
+    /* Disable the distributor */
+    GICD[GICD_CTLR] = 0;
+    gicv3_dist_wait_for_rwp();
+
+    type = GICD[GICD_TYPER];
+    gicv3_info.nr_lines = 32 * ((type & GICD_TYPE_LINES) + 1);
+    /* Interrupt IDs 1020 to 1023 are special */
+    if ( gicv3_info.nr_lines > 1020 )
+        gicv3_info.nr_lines = 1020;
+    printk("GICv3: %d lines, (IID %8.8x).\n",
+           gicv3_info.nr_lines, GICD[GICD_IIDR]);
+
+    /* Default all global IRQs to level, active low */
+    for ( i = 32; i < gicv3_info.nr_lines; i += 16 )
+        GICD[GICD_ICFGR + i / 16] = 0x0;
+
+    /* Default priority for global interrupts */
+    for ( i = 32; i < gicv3_info.nr_lines; i += 4 )
+        GICD[GICD_IPRIORITYR + i / 4] = 0xa0a0a0a0;
+
+    /* Disable all global interrupts, and make them non-secure group 1 */
+    for ( i = 32; i < gicv3_info.nr_lines; i += 32 )
+    {
+        GICD[GICD_ICENABLER + i / 32] = (uint32_t)~0ul;
+        GICD[GICD_IGROUPR + i / 32] = (uint32_t)~0ul;
+    }
+
+    gicv3_dist_wait_for_rwp();
+
+    /* Turn on the distributor, routing by affinity */
+    GICD[GICD_CTLR] = GICD_CTLR_ARE_NS | GICD_CTLR_ENABLE_G1A |
+                      GICD_CTLR_ENABLE_G1;
+
+    /* Route all global IRQs to this CPU */
+    affinity = gicv3_mpidr_to_affinity(smp_processor_id());
+    for ( i = 32; i < gicv3_info.nr_lines; i++ )
+        writeq_relaxed(affinity, GICD + GICD_IROUTER + 2 * i);
+}
+
+/* Find this CPU's redistributor, by its affinity */
+static int __cpuinit gicv3_populate_rdist(void)
+{
+    uint64_t mpidr = cpu_logical_map(smp_processor_id());
+    uint32_t aff, reg;
+    uint64_t typer;
+    volatile uint32_t *ptr, *end;
+    int i;
+
+    aff = (MPIDR_AFFINITY_LEVEL(mpidr, 2) << 16 |
+           MPIDR_AFFINITY_LEVEL(mpidr, 1) << 8 |
+           MPIDR_AFFINITY_LEVEL(mpidr, 0));
+
+    for ( i = 0; i < gicv3.rdist_count; i++ )
+    {
+        ptr = gicv3.rdist_regions[i].map;
+        end = ptr + gicv3.rdist_regions[i].size / 4;
+
+        reg = ptr[GICR_PIDR2] & GIC_PIDR2_ARCH_MASK;
+        if ( reg != GIC_PIDR2_ARCH_GICv3 && reg != GIC_PIDR2_ARCH_GICv4 )
+        {
+            printk(XENLOG_ERR "GICv3: No redistributor at %"PRIpaddr"\n",
+                   gicv3.rdist_regions[i].base);
+            break;
+        }
+
+        do {
+            typer = readq_relaxed(ptr + GICR_TYPER);
+            if ( (typer >> GICR_TYPER_AFF_SHIFT) == aff )
+            {
+                this_cpu(rbase) = ptr;
+                printk("GICv3: CPU%d: Found redistributor in region %d\n",
+                       smp_processor_id(), i);
+                return 0;
+            }
+
+            if ( gicv3.rdist_stride )
+                ptr += gicv3.rdist_stride / 4;
+            else if ( typer & GICR_TYPER_VLPIS )
+                ptr += GICR_RD_FRAMES_SIZE_V4 / 4;
+            else
+                ptr += GICR_RD_FRAMES_SIZE / 4;
+        } while ( !(typer & GICR_TYPER_LAST) && ptr < end );
+    }
+
+    printk(XENLOG_ERR "GICv3: CPU%d: mpidr %#"PRIx64" has no redistributor\n",
+           smp_processor_id(), mpidr);
+    return -ENODEV;
+}
+
+static int __cpuinit gicv3_cpu_init(void)
+{
+    int i, rc;
+
+    rc = gicv3_populate_rdist();
+    if ( rc )
+        return rc;
+
+    /* Wake up this CPU's redistributor */
+    GICR[GICR_WAKER] &= ~GICR_WAKER_ProcessorSleep;
+    rc = gicv3_wait_for_clear(GICR + GICR_WAKER, GICR_WAKER_ChildrenAsleep);
+    if ( rc )
+        return rc;
+
+    /* The first 32 interrupts (PPI and SGI) are the redistributor's:
+     * disable all PPIs, enable all SGIs, as non-secure group 1. */
+    GICR[GICR_IGROUPR0] = (uint32_t)~0ul;
+    GICR[GICR_ICENABLER0] = 0xffff0000;
+    GICR[GICR_ISENABLER0] = 0x0000ffff;
+    /* Set PPI and SGI priorities */
+    for ( i = 0; i < 32; i += 4 )
+        GICR[GICR_IPRIORITYR0 + i / 4] = 0xa0a0a0a0;
+    gicv3_redist_wait_for_rwp();
+
+    /* Use the system register interface, and let guests use it */
+    WRITE_SYSREG(READ_SYSREG(ICC_SRE_EL2) | ICC_SRE_EL2_SRE |
+                 ICC_SRE_EL2_DFB | ICC_SRE_EL2_DIB | ICC_SRE_EL2_ENEL1,
+                 ICC_SRE_EL2);
+    isb();
+
+    /* Local settings: interface controller */
+    WRITE_SYSREG(0xff, ICC_PMR_EL1);      /* Don't mask by priority */
+    WRITE_SYSREG(0, ICC_BPR1_EL1);        /* Finest granularity of priority */
+    /* EOI drops the priority, ICC_DIR_EL1 deactivates */
+    WRITE_SYSREG(ICC_CTLR_EL1_EOImode_drop, ICC_CTLR_EL1);
+    WRITE_SYSREG(1, ICC_IGRPEN1_EL1);     /* Turn on delivery */
+    isb();
+
+    return 0;
+}
+
+static void gicv3_cpu_disable(void)
+{
+    WRITE_SYSREG(0, ICC_IGRPEN1_EL1);
+    isb();
+}
+
+static void __cpuinit gicv3_hyp_init(void)
+{
+    uint32_t vtr;
+
+    vtr = READ_SYSREG(ICH_VTR_EL2);
+    gicv3_info.nr_lrs  = (vtr & ICH_VTR_NRLRGS) + 1;
+    gicv3.nr_priorities = ((vtr >> ICH_VTR_PRIBITS_SHIFT) &
+                           ICH_VTR_PRIBITS_MASK) + 1;
+    BUG_ON(gicv3_info.nr_lrs > GICV3_NR_LRS);
+
+    WRITE_SYSREG(0, ICH_HCR_EL2);
+}
+
+static void __cpuinit gicv3_hyp_disable(void)
+{
+    WRITE_SYSREG(0, ICH_HCR_EL2);
+    isb();
+}
+
+static void __cpuinit gicv3_secondary_cpu_init(void)
+{
+    if ( gicv3_cpu_init() )
+        panic("GICv3: CPU%d: Unable to initialize the CPU interface\n",
+              smp_processor_id());
+    gicv3_hyp_init();
+}
+
+static void gicv3_disable_interface(void)
+{
+    gicv3_cpu_disable();
+    gicv3_hyp_disable();
+}
+
+/*
+ * Send an SGI to the CPUs of cpumask: one write to ICC_SGI1R_EL1 per
+ * cluster, that is set of CPUs whose affinity differs only in Aff0.
+ */
+static void gicv3_send_sgi_list(enum gic_sgi sgi, const cpumask_t *cpumask)
+{
+    cpumask_t todo;
+    unsigned int cpu;
+    uint64_t cluster, mpidr;
+    uint16_t tlist;
+
+    cpumask_and(&todo, cpumask, &cpu_online_map);
+
+    while ( !cpumask_empty(&todo) )
+    {
+        cluster = cpu_logical_map(cpumask_first(&todo)) & ~MPIDR_AFF0_MASK;
+        tlist = 0;
+
+        for_each_cpu ( cpu, &todo )
+        {
+            mpidr = cpu_logical_map(cpu);
+            if ( (mpidr & ~MPIDR_AFF0_MASK) != cluster )
+                continue;
+            /* The target list only covers Aff0 0 to 15 */
+            ASSERT(MPIDR_AFFINITY_LEVEL(mpidr, 0) < 16);
+            tlist |= 1u << MPIDR_AFFINITY_LEVEL(mpidr, 0);
+            cpumask_clear_cpu(cpu, &todo);
+        }
+
+        WRITE_SYSREG(MPIDR_AFFINITY_LEVEL(cluster, 2) << ICC_SGI1R_AFF2_SHIFT |
+                     MPIDR_AFFINITY_LEVEL(cluster, 1) << ICC_SGI1R_AFF1_SHIFT |
+                     (uint64_t)sgi << ICC_SGI1R_INTID_SHIFT |
+                     tlist,
+                     ICC_SGI1R_EL1);
+    }
+    isb();
+}
+
+static void gicv3_send_SGI(enum gic_sgi sgi, enum gic_sgi_mode mode,
+                           const cpumask_t *cpu_mask)
+{
+    switch ( mode )
+    {
+    case SGI_TARGET_OTHERS:
+        WRITE_SYSREG(ICC_SGI1R_IRM | (uint64_t)sgi << ICC_SGI1R_INTID_SHIFT,
+                     ICC_SGI1R_EL1);
+        isb();
+        break;
+    case SGI_TARGET_SELF:
+        gicv3_send_sgi_list(sgi, cpumask_of(smp_processor_id()));
+        break;
+    case SGI_TARGET_LIST:
+        gicv3_send_sgi_list(sgi, cpu_mask);
+        break;
+    default:
+        BUG();
+    }
+}
+
+static unsigned int gicv3_read_irq(void)
+{
+    unsigned int irq = READ_SYSREG(ICC_IAR1_EL1) & ICC_IA_IRQ;
+
+    dsb();
+
+    return irq;
+}
+
+/* GIC_LR_{PENDING,ACTIVE} match the state field of ICH_LR<n>_EL2. */
+static void gicv3_read_lr(unsigned int lr, struct gic_lr *lr_reg)
+{
+    uint64_t lrv = gicv3_ich_read_lr(lr);
+
+    lr_reg->virq = lrv & ICH_LR_VIRTUAL_MASK;
+    lr_reg->priority = (lrv >> ICH_LR_PRIORITY_SHIFT) & ICH_LR_PRIORITY_MASK;
+    lr_reg->state = (lrv >> ICH_LR_STATE_SHIFT) & ICH_LR_STATE_MASK;
+    lr_reg->maintenance = !!(lrv & ICH_LR_MAINTENANCE_IRQ);
+}
+
+static void gicv3_write_lr(unsigned int lr, const struct gic_lr *lr_reg)
+{
+    /* Guests only get group 1 interrupts, like Xen */
+    gicv3_ich_write_lr(lr,
+        ((uint64_t)(lr_reg->state & ICH_LR_STATE_MASK) << ICH_LR_STATE_SHIFT) |
+        ICH_LR_GRP1 |
+        (lr_reg->maintenance ? ICH_LR_MAINTENANCE_IRQ : 0) |
+        ((uint64_t)lr_reg->priority << ICH_LR_PRIORITY_SHIFT) |
+        (lr_reg->virq & ICH_LR_VIRTUAL_MASK));
+}
+
+static void gicv3_clear_lr(unsigned int lr)
+{
+    gicv3_ich_write_lr(lr, 0);
+}
+
+static uint64_t gicv3_read_eisr(void)
+{
+    return READ_SYSREG(ICH_EISR_EL2);
+}
+
+static uint64_t gicv3_read_elsr(void)
+{
+    return READ_SYSREG(ICH_ELRSR_EL2);
+}
+
+static int gicv3v_setup(struct domain *d)
+{
+    /*
+     * The domain sees the distributor and the first redistributor region
+     * where the hardware has them, as with GICv2 for now.  There's no
+     * virtual CPU interface to map: it's system registers.
+     */
+    d->arch.vgic.dbase = gicv3.dbase;
+    d->arch.vgic.rbase = gicv3.rdist_regions[0].base;
+    d->arch.vgic.rbase_size = gicv3.rdist_regions[0].size;
+
+    return 0;
+}
+
+static const struct gic_hw_operations gicv3_ops = {
+    .info                = &gicv3_info,
+    .gic_host_irq_type   = &gicv3_host_irq_type,
+    .gic_guest_irq_type  = &gicv3_guest_irq_type,
+    .secondary_init      = gicv3_secondary_cpu_init,
+    .disable_interface   = gicv3_disable_interface,
+    .save_state          = gicv3_save_state,
+    .restore_state       = gicv3_restore_state,
+    .dump_state          = gicv3_dump_state,
+    .gicv_setup          = gicv3v_setup,
+    .read_irq            = gicv3_read_irq,
+    .eoi_irq             = gicv3_eoi_irq,
+    .deactivate_irq      = gicv3_deactivate_irq,
+    .set_irq_properties  = gicv3_set_irq_properties,
+    .send_SGI            = gicv3_send_SGI,
+    .read_lr             = gicv3_read_lr,
+    .write_lr            = gicv3_write_lr,
+    .clear_lr            = gicv3_clear_lr,
+    .read_eisr           = gicv3_read_eisr,
+    .read_elsr           = gicv3_read_elsr,
+};
+
+/* Set up the GIC, called with the GIC lock held */
+int __init gicv3_init(struct dt_device_node *node)
+{
+    struct rdist_region *rdist_regs;
+    uint32_t reg;
+    int res, i;
+
+    res = dt_device_get_address(node, 0, &gicv3.dbase, NULL);
+    if ( res || !gicv3.dbase || (gicv3.dbase & ~PAGE_MASK) )
+        panic("GICv3: Cannot find a valid address for the distributor\n");
+
+    gicv3.map_dbase = ioremap_nocache(gicv3.dbase, GICD_SIZE);
+    if ( !gicv3.map_dbase )
+        panic("GICv3: Unable to map the distributor\n");
+
+    reg = GICD[GICD_PIDR2] & GIC_PIDR2_ARCH_MASK;
+    if ( reg != GIC_PIDR2_ARCH_GICv3 && reg != GIC_PIDR2_ARCH_GICv4 )
+        panic("GICv3: No distributor detected\n");
+
+    if ( !dt_property_read_u32(node, "#redistributor-regions",
+                               &gicv3.rdist_count) )
+        gicv3.rdist_count = 1;
+
+    rdist_regs = xzalloc_array(struct rdist_region, gicv3.rdist_count);
+    if ( !rdist_regs )
+        return -ENOMEM;
+
+    for ( i = 0; i < gicv3.rdist_count; i++ )
+    {
+        res = dt_device_get_address(node, 1 + i, &rdist_regs[i].base,
+                                    &rdist_regs[i].size);
+        if ( res || !rdist_regs[i].base || (rdist_regs[i].base & ~PAGE_MASK) )
+            panic("GICv3: Cannot find a valid address for redistributor region %d\n",
+                  i);
+
+        rdist_regs[i].map = ioremap_nocache(rdist_regs[i].base,
+                                            rdist_regs[i].size);
+        if ( !rdist_regs[i].map )
+            panic("GICv3: Unable to map redistributor region %d\n", i);
+    }
+    gicv3.rdist_regions = rdist_regs;
+
+    if ( !dt_property_read_u32(node, "redistributor-stride",
+                               &gicv3.rdist_stride) )
+        gicv3.rdist_stride = 0;
+
+    res = dt_device_get_irq(node, 0, &gicv3_info.maintenance);
+    if ( res )
+        panic("GICv3: Cannot find the maintenance IRQ\n");
+
+    printk("GICv3 initialization:\n"
+           "        gic_dist_addr=%"PRIpaddr"\n"
+           "        gic_maintenance_irq=%u\n"
+           "        gic_rdist_regions=%d\n",
+           gicv3.dbase, gicv3_info.maintenance.irq, gicv3.rdist_count);
+    for ( i = 0; i < gicv3.rdist_count; i++ )
+        printk("        gic_rdist[%d]=%"PRIpaddr"-%"PRIpaddr"\n", i,
+               rdist_regs[i].base, rdist_regs[i].base + rdist_regs[i].size - 1);
+
+    gicv3_info.hw_version = GIC_V3;
+
+    /* Global settings: interrupt distributor */
+    gicv3_dist_init();
+    res = gicv3_cpu_init();
+    if ( res )
+        return res;
+    gicv3_hyp_init();
+
+    register_gic_ops(&gicv3_ops);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
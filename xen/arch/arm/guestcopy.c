@@ -1,44 +1,72 @@
 #include <xen/config.h>
 #include <xen/lib.h>
+#include <xen/sched.h>
 #include <xen/domain_page.h>
 
 #include <asm/mm.h>
 #include <asm/guest_access.h>
 
-unsigned long raw_copy_to_guest(void *to, const void *from, unsigned len)
+#define COPY_from_guest     0
+#define COPY_to_guest       1
+#define COPY_clear_guest    2
+
+/*
+ * Translating a guest virtual address takes an AT instruction and PAR
+ * round trip, for each page, and hypercalls often copy many small items
+ * from, or to, the same few pages.  So the last few translations are
+ * kept in the vCPU.
+ *
+ * Guest TLB maintenance isn't trapped, so the cache is only good while
+ * the guest doesn't run: it's flushed on each return to the guest.  It's
+ * also dropped when the p2m changes under it, say when a hypercall frees
+ * the page it copies to.
+ */
+void guest_copy_flush(struct vcpu *v)
 {
-    /* XXX needs to handle faults */
-    unsigned offset = (vaddr_t)to & ~PAGE_MASK;
+    v->arch.gva_cache.nr = 0;
+}
 
-    while ( len )
+static int translate_guest_va(vaddr_t va, paddr_t *ma)
+{
+    struct vcpu *v = current;
+    unsigned long generation = v->domain->arch.p2m.generation;
+    typeof(v->arch.gva_cache) *cache = &v->arch.gva_cache;
+    unsigned int i;
+    int rc;
+
+    va &= PAGE_MASK;
+
+    if ( cache->p2m_generation != generation )
     {
-        int rc;
-        paddr_t g;
-        void *p;
-        unsigned size = min(len, (unsigned)PAGE_SIZE - offset);
+        cache->nr = 0;
+        cache->p2m_generation = generation;
+    }
 
-        rc = gvirt_to_maddr((vaddr_t) to, &g);
-        if ( rc )
-            return rc;
+    for ( i = 0; i < cache->nr; i++ )
+        if ( cache->va[i] == va )
+        {
+            *ma = cache->ma[i];
+            return 0;
+        }
 
-        p = map_domain_page(g>>PAGE_SHIFT);
-        p += offset;
-        memcpy(p, from, size);
+    rc = gvirt_to_maddr(va, ma);
+    if ( rc )
+        return rc;
 
-        unmap_domain_page(p - offset);
-        len -= size;
-        from += size;
-        to += size;
-        offset = 0;
-    }
+    cache->va[cache->next] = va;
+    cache->ma[cache->next] = *ma;
+    cache->next = (cache->next + 1) % GVA_CACHE_ENTRIES;
+    if ( cache->nr < GVA_CACHE_ENTRIES )
+        cache->nr++;
 
     return 0;
 }
 
-unsigned long raw_clear_guest(void *to, unsigned len)
+static unsigned long copy_guest(void *buf, vaddr_t addr, unsigned len,
+                                int op)
 {
     /* XXX needs to handle faults */
-    unsigned offset = (vaddr_t)to & ~PAGE_MASK;
+    unsigned offset = addr & ~PAGE_MASK;
 
     while ( len )
     {
@@ -47,49 +75,50 @@ unsigned long raw_clear_guest(void *to, unsigned len)
         void *p;
         unsigned size = min(len, (unsigned)PAGE_SIZE - offset);
 
-        rc = gvirt_to_maddr((vaddr_t) to, &g);
+        rc = translate_guest_va(addr, &g);
         if ( rc )
             return rc;
 
-        p = map_domain_page(g>>PAGE_SHIFT);
+        p = map_domain_page(g >> PAGE_SHIFT);
         p += offset;
-        memset(p, 0x00, size);
+
+        switch ( op )
+        {
+        case COPY_from_guest:
+            memcpy(buf, p, size);
+            buf += size;
+            break;
+        case COPY_to_guest:
+            memcpy(p, buf, size);
+            buf += size;
+            break;
+        case COPY_clear_guest:
+            memset(p, 0x00, size);
+            break;
+        }
 
         unmap_domain_page(p - offset);
         len -= size;
-        to += size;
+        addr += size;
         offset = 0;
     }
 
     return 0;
 }
 
-unsigned long raw_copy_from_guest(void *to, const void __user *from, unsigned len)
+unsigned long raw_copy_to_guest(void *to, const void *from, unsigned len)
 {
-    unsigned offset = (vaddr_t)from & ~PAGE_MASK;
-
-    while ( len )
-    {
-        int rc;
-        paddr_t g;
-        void *p;
-        unsigned size = min(len, (unsigned)(PAGE_SIZE - offset));
-
-        rc = gvirt_to_maddr((vaddr_t) from & PAGE_MASK, &g);
-        if ( rc )
-            return rc;
-
-        p = map_domain_page(g>>PAGE_SHIFT);
-        p += ((vaddr_t)from & (~PAGE_MASK));
+    return copy_guest((void *)from, (vaddr_t)to, len, COPY_to_guest);
+}
 
-        memcpy(to, p, size);
+unsigned long raw_clear_guest(void *to, unsigned len)
+{
+    return copy_guest(NULL, (vaddr_t)to, len, COPY_clear_guest);
+}
 
-        unmap_domain_page(p);
-        len -= size;
-        from += size;
-        to += size;
-    }
-    return 0;
+unsigned long raw_copy_from_guest(void *to, const void __user *from, unsigned len)
+{
+    return copy_guest(to, (vaddr_t)from, len, COPY_from_guest);
 }
 /*
  * Local variables:
@@ -25,6 +25,10 @@
 static const struct mmio_handler *const mmio_handlers[] =
 {
     &vgic_distr_mmio_handler,
+#ifdef CONFIG_ARM_64
+    &vgic_v3_distr_mmio_handler,
+    &vgic_v3_rdistr_mmio_handler,
+#endif
     &vuart_mmio_handler,
 };
 #define MMIO_HANDLER_NR ARRAY_SIZE(mmio_handlers)
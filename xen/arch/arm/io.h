@@ -42,6 +42,19 @@ struct mmio_handler {
 
 extern const struct mmio_handler vgic_distr_mmio_handler;
 extern const struct mmio_handler vuart_mmio_handler;
+#ifdef CONFIG_ARM_64
+extern const struct mmio_handler vgic_v3_distr_mmio_handler;
+extern const struct mmio_handler vgic_v3_rdistr_mmio_handler;
+
+/* A GICv3 guest's SGIs, through ICC_SGI1R_EL1 */
+extern int vgic_v3_emulate_sysreg(struct cpu_user_regs *regs, union hsr hsr);
+#endif
+
+/* Rank registers common to GICv2 and GICv3, see vgic.c */
+extern int vgic_rank_mmio_read(struct vcpu *v, mmio_info_t *info,
+                               int reg, int offset);
+extern int vgic_rank_mmio_write(struct vcpu *v, mmio_info_t *info,
+                                int reg, int offset);
 
 extern int handle_mmio(mmio_info_t *info);
 
@@ -10,6 +10,7 @@
 #include <xen/mm.h>
 #include <xen/domain_page.h>
 #include <xen/sched.h>
+#include <xen/vmap.h>
 #include <asm/byteorder.h>
 #include <asm/setup.h>
 #include <xen/libfdt/libfdt.h>
@@ -68,6 +69,71 @@ void copy_from_paddr(void *dst, paddr_t paddr, unsigned long len, int attrindx)
     clear_fixmap(FIXMAP_MISC);
 }
 
+/*
+ * Bulk loads are mapped this much at a time: once per chunk, rather than
+ * once per page as by copy_from_paddr(), each mapping costing a TLB flush.
+ */
+#define LOAD_CHUNK_SIZE MB(8)
+
+/**
+ * copy_from_paddr_to_guest - copy data from a physical address to dom0
+ * @gaddr: destination guest physical address
+ * @paddr: source physical address
+ * @len: length to copy
+ * @attrindx: attributes to map the source with
+ *
+ * Dom0's memory is mostly block mapped, so the destination is copied in
+ * runs of machine contiguous pages, up to 2MB each: map_domain_page()
+ * maps the whole of such a run when asked for its first page.
+ */
+void copy_from_paddr_to_guest(paddr_t gaddr, paddr_t paddr, paddr_t len,
+                              int attrindx)
+{
+    while ( len )
+    {
+        paddr_t chunk = min_t(paddr_t, len, LOAD_CHUNK_SIZE);
+        paddr_t done = 0;
+        const void *src;
+
+        src = ioremap_attr(paddr, chunk, attrindx);
+        if ( !src )
+            panic("Unable to map %"PRIpaddr" to load dom0\n", paddr);
+
+        while ( done < chunk )
+        {
+            paddr_t ma, next, l, run;
+            void *dst;
+
+            if ( gvirt_to_maddr(gaddr + done, &ma) )
+                panic("Unable to translate guest address\n");
+
+            l = min(chunk - done, SECOND_SIZE - (ma & (SECOND_SIZE - 1)));
+            for ( run = PAGE_SIZE - (ma & ~PAGE_MASK); run < l;
+                  run += PAGE_SIZE )
+            {
+                if ( gvirt_to_maddr(gaddr + done + run, &next) )
+                    panic("Unable to translate guest address\n");
+                if ( next != ma + run )
+                    break;
+            }
+            l = min(l, run);
+
+            dst = map_domain_page(ma >> PAGE_SHIFT) + (ma & ~PAGE_MASK);
+            memcpy(dst, src + done, l);
+            flush_xen_dcache_va_range(dst, l);
+            unmap_domain_page(dst);
+
+            done += l;
+        }
+
+        iounmap((void *)src);
+
+        gaddr += chunk;
+        paddr += chunk;
+        len -= chunk;
+    }
+}
+
 static void kernel_zimage_check_overlap(struct kernel_info *info)
 {
     paddr_t zimage_start = info->zimage.load_addr;
@@ -96,33 +162,11 @@ static void kernel_zimage_load(struct kernel_info *info)
     paddr_t paddr = info->zimage.kernel_addr;
     paddr_t attr = info->load_attr;
     paddr_t len = info->zimage.len;
-    unsigned long offs;
 
     printk("Loading zImage from %"PRIpaddr" to %"PRIpaddr"-%"PRIpaddr"\n",
            paddr, load_addr, load_addr + len);
-    for ( offs = 0; offs < len; )
-    {
-        int rc;
-        paddr_t s, l, ma;
-        void *dst;
-
-        s = offs & ~PAGE_MASK;
-        l = min(PAGE_SIZE - s, len);
-
-        rc = gvirt_to_maddr(load_addr + offs, &ma);
-        if ( rc )
-        {
-            panic("\nUnable to map translate guest address\n");
-            return;
-        }
 
-        dst = map_domain_page(ma>>PAGE_SHIFT);
-
-        copy_from_paddr(dst + s, paddr + offs, l, attr);
-
-        unmap_domain_page(dst);
-        offs += l;
-    }
+    copy_from_paddr_to_guest(load_addr, paddr, len, attr);
 }
 
 #ifdef CONFIG_ARM_64
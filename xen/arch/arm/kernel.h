@@ -48,6 +48,9 @@ struct kernel_info {
 int kernel_prepare(struct kernel_info *info);
 void kernel_load(struct kernel_info *info);
 
+void copy_from_paddr_to_guest(paddr_t gaddr, paddr_t paddr, paddr_t len,
+                              int attrindx);
+
 #endif /* #ifdef __ARCH_ARM_KERNEL_H__ */
 
 /*
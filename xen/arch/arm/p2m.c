@@ -41,23 +41,26 @@ paddr_t p2m_lookup(struct domain *d, paddr_t paddr)
 {
     struct p2m_domain *p2m = &d->arch.p2m;
     lpae_t pte, *first = NULL, *second = NULL, *third = NULL;
-    paddr_t maddr = INVALID_PADDR;
+    paddr_t maddr = INVALID_PADDR, mask;
 
     spin_lock(&p2m->lock);
 
     first = __map_domain_page(p2m->first_level);
 
     pte = first[first_table_offset(paddr)];
+    mask = FIRST_MASK;
     if ( !pte.p2m.valid || !pte.p2m.table )
         goto done;
 
     second = map_domain_page(pte.p2m.base);
     pte = second[second_table_offset(paddr)];
+    mask = SECOND_MASK;
     if ( !pte.p2m.valid || !pte.p2m.table )
         goto done;
 
     third = map_domain_page(pte.p2m.base);
     pte = third[third_table_offset(paddr)];
+    mask = PAGE_MASK;
 
     /* This bit must be one in the level 3 entry */
     if ( !pte.p2m.table )
@@ -65,7 +68,7 @@ paddr_t p2m_lookup(struct domain *d, paddr_t paddr)
 
 done:
     if ( pte.p2m.valid )
-        maddr = (pte.bits & PADDR_MASK & PAGE_MASK) | (paddr & ~PAGE_MASK);
+        maddr = (pte.bits & PADDR_MASK & mask) | (paddr & ~mask);
 
     if (third) unmap_domain_page(third);
     if (second) unmap_domain_page(second);
@@ -90,16 +93,21 @@ int p2m_pod_decrease_reservation(struct domain *d,
     return -ENOSYS;
 }
 
-/* Allocate a new page table page and hook it in via the given entry */
+/*
+ * Allocate a new page table page and hook it in via the given entry.  If
+ * the entry is a block mapping (at the given level, 1 or 2) the table
+ * maps the same memory, in the next level's blocks or pages.
+ */
 static int p2m_create_table(struct domain *d,
-                            lpae_t *entry)
+                            lpae_t *entry, unsigned int level)
 {
     struct p2m_domain *p2m = &d->arch.p2m;
     struct page_info *page;
-    void *p;
+    lpae_t *p;
     lpae_t pte;
+    unsigned int i;
 
-    BUG_ON(entry->p2m.valid);
+    BUG_ON(entry->p2m.valid && entry->p2m.table);
 
     page = alloc_domheap_page(NULL, 0);
     if ( page == NULL )
@@ -108,7 +116,24 @@ static int p2m_create_table(struct domain *d,
     page_list_add(page, &p2m->pages);
 
     p = __map_domain_page(page);
-    clear_page(p);
+    if ( entry->p2m.valid )
+    {
+        /* Shatter the block: entry i maps its i'th slice. */
+        for ( i = 0; i < LPAE_ENTRIES; i++ )
+        {
+            pte = *entry;
+            pte.p2m.base += i << (level == 1 ? SECOND_SHIFT - PAGE_SHIFT : 0);
+            pte.p2m.table = (level == 2);
+            p[i] = pte;
+        }
+
+        /* Break before make, as the mapping's size changes. */
+        pte.bits = 0;
+        write_pte(entry, pte);
+        flush_tlb_all_local();
+    }
+    else
+        clear_page(p);
     unmap_domain_page(p);
 
     pte = mfn_to_p2m_entry(page_to_mfn(page), MATTR_MEM);
@@ -118,12 +143,46 @@ static int p2m_create_table(struct domain *d,
     return 0;
 }
 
+/* A leaf entry at the given level: a block at 1 and 2, a page at 3. */
+static lpae_t mfn_to_p2m_leaf(unsigned long mfn, int mattr, unsigned int level)
+{
+    lpae_t pte = mfn_to_p2m_entry(mfn, mattr);
+
+    pte.p2m.table = (level == 3);
+
+    return pte;
+}
+
 enum p2m_operation {
     INSERT,
     ALLOCATE,
     REMOVE
 };
 
+static const paddr_t level_sizes[] = { 0, FIRST_SIZE, SECOND_SIZE, THIRD_SIZE };
+
+/*
+ * Can [addr, end) be mapped at *entry with a block of the given level?
+ * It can when addr (and for INSERT, maddr) is aligned to the block, the
+ * range covers it and *entry isn't already a table.  Level 3 entries are
+ * pages, always possible.
+ */
+static bool_t p2m_leaf_ok(enum p2m_operation op, unsigned int level,
+                          const lpae_t *entry, paddr_t addr, paddr_t end,
+                          paddr_t maddr)
+{
+    paddr_t size = level_sizes[level];
+
+    if ( level == 3 )
+        return 1;
+    if ( entry->p2m.valid && entry->p2m.table )
+        return 0;
+    if ( (addr & (size - 1)) || end - addr < size )
+        return 0;
+
+    return op != INSERT || !(maddr & (size - 1));
+}
+
 static int create_p2m_entries(struct domain *d,
                      enum p2m_operation op,
                      paddr_t start_gpaddr,
@@ -133,8 +192,10 @@ static int create_p2m_entries(struct domain *d,
 {
     int rc, flush;
     struct p2m_domain *p2m = &d->arch.p2m;
-    lpae_t *first = NULL, *second = NULL, *third = NULL;
+    lpae_t *first = NULL, *second = NULL, *third = NULL, *entry, pte;
+    struct page_info *page = NULL;
     paddr_t addr;
+    unsigned int level;
     unsigned long cur_first_offset = ~0, cur_second_offset = ~0;
 
     spin_lock(&p2m->lock);
@@ -145,86 +206,101 @@ static int create_p2m_entries(struct domain *d,
 
     first = __map_domain_page(p2m->first_level);
 
-    for(addr = start_gpaddr; addr < end_gpaddr; addr += PAGE_SIZE)
+    for ( addr = start_gpaddr; addr < end_gpaddr; addr += level_sizes[level] )
     {
-        if ( !first[first_table_offset(addr)].p2m.valid )
+        /*
+         * Walk down to the first level the range can be mapped at with a
+         * block (for ALLOCATE, one that memory of its size could be found
+         * for), shattering any block in the way of a smaller mapping.
+         */
+        for ( level = 1; ; level++ )
         {
-            rc = p2m_create_table(d, &first[first_table_offset(addr)]);
-            if ( rc < 0 ) {
-                printk("p2m_populate_ram: L1 failed\n");
-                goto out;
+            switch ( level )
+            {
+            case 1:
+                entry = &first[first_table_offset(addr)];
+                break;
+            case 2:
+                if ( cur_first_offset != first_table_offset(addr) )
+                {
+                    if (second) unmap_domain_page(second);
+                    second = map_domain_page(first[first_table_offset(addr)].p2m.base);
+                    cur_first_offset = first_table_offset(addr);
+                    cur_second_offset = ~0;
+                }
+                entry = &second[second_table_offset(addr)];
+                break;
+            default:
+                if ( cur_second_offset != second_table_offset(addr) )
+                {
+                    /* map third level */
+                    if (third) unmap_domain_page(third);
+                    third = map_domain_page(second[second_table_offset(addr)].p2m.base);
+                    cur_second_offset = second_table_offset(addr);
+                }
+                entry = &third[third_table_offset(addr)];
+                break;
             }
-        }
-
-        BUG_ON(!first[first_table_offset(addr)].p2m.valid);
-
-        if ( cur_first_offset != first_table_offset(addr) )
-        {
-            if (second) unmap_domain_page(second);
-            second = map_domain_page(first[first_table_offset(addr)].p2m.base);
-            cur_first_offset = first_table_offset(addr);
-        }
-        /* else: second already valid */
 
-        if ( !second[second_table_offset(addr)].p2m.valid )
-        {
-            rc = p2m_create_table(d, &second[second_table_offset(addr)]);
-            if ( rc < 0 ) {
-                printk("p2m_populate_ram: L2 failed\n");
-                goto out;
+            if ( p2m_leaf_ok(op, level, entry, addr, end_gpaddr, maddr) )
+            {
+                if ( op != ALLOCATE )
+                    break;
+                /* Allocate a new RAM page (or block) to attach */
+                page = alloc_domheap_pages(d, (3 - level) * LPAE_SHIFT, 0);
+                if ( page != NULL )
+                    break;
+                if ( level == 3 )
+                {
+                    rc = -ENOMEM;
+                    printk("p2m_populate_ram: failed to allocate page\n");
+                    goto out;
+                }
             }
-        }
-
-        BUG_ON(!second[second_table_offset(addr)].p2m.valid);
 
-        if ( cur_second_offset != second_table_offset(addr) )
-        {
-            /* map third level */
-            if (third) unmap_domain_page(third);
-            third = map_domain_page(second[second_table_offset(addr)].p2m.base);
-            cur_second_offset = second_table_offset(addr);
+            if ( !entry->p2m.valid || !entry->p2m.table )
+            {
+                /* Nothing to remove below an empty entry. */
+                if ( op == REMOVE && !entry->p2m.valid )
+                    break;
+                rc = p2m_create_table(d, entry, level);
+                if ( rc < 0 ) {
+                    printk("p2m_populate_ram: L%u failed\n", level);
+                    goto out;
+                }
+            }
         }
 
-        flush = third[third_table_offset(addr)].p2m.valid;
+        flush = entry->p2m.valid;
 
-        /* Allocate a new RAM page and attach */
         switch (op) {
             case ALLOCATE:
-                {
-                    struct page_info *page;
-                    lpae_t pte;
-
-                    rc = -ENOMEM;
-                    page = alloc_domheap_page(d, 0);
-                    if ( page == NULL ) {
-                        printk("p2m_populate_ram: failed to allocate page\n");
-                        goto out;
-                    }
-
-                    pte = mfn_to_p2m_entry(page_to_mfn(page), mattr);
-
-                    write_pte(&third[third_table_offset(addr)], pte);
-                }
+                pte = mfn_to_p2m_leaf(page_to_mfn(page), mattr, level);
+                write_pte(entry, pte);
                 break;
             case INSERT:
-                {
-                    lpae_t pte = mfn_to_p2m_entry(maddr >> PAGE_SHIFT, mattr);
-                    write_pte(&third[third_table_offset(addr)], pte);
-                    maddr += PAGE_SIZE;
-                }
+                pte = mfn_to_p2m_leaf(maddr >> PAGE_SHIFT, mattr, level);
+                write_pte(entry, pte);
+                maddr += level_sizes[level];
                 break;
             case REMOVE:
+                /* Skip the rest of an empty table or block's worth. */
+                if ( !entry->p2m.valid && level < 3 )
                 {
-                    lpae_t pte;
-                    memset(&pte, 0x00, sizeof(pte));
-                    write_pte(&third[third_table_offset(addr)], pte);
-                    maddr += PAGE_SIZE;
+                    addr &= ~(level_sizes[level] - 1);
+                    break;
                 }
+                memset(&pte, 0x00, sizeof(pte));
+                write_pte(entry, pte);
+                maddr += level_sizes[level];
                 break;
         }
 
         if ( flush )
+        {
             flush_tlb_all_local();
+            p2m->generation++;
+        }
     }
 
     rc = 0;
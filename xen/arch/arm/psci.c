@@ -18,13 +18,17 @@
 #include <asm/gic.h>
 #include <asm/psci.h>
 
-int do_psci_cpu_on(uint32_t vcpuid, register_t entry_point)
+int do_psci_cpu_on(uint32_t target_cpu, register_t entry_point)
 {
     struct vcpu *v;
     struct domain *d = current->domain;
     struct vcpu_guest_context *ctxt;
     int rc;
     int is_thumb = entry_point & 1;
+    uint32_t vcpuid = vaffinity_to_vcpuid(target_cpu);
+
+    if ( vcpuid_to_vaffinity(vcpuid) != target_cpu )
+        return PSCI_EINVAL;
 
     if ( (vcpuid < 0) || (vcpuid >= MAX_VIRT_CPUS) )
         return PSCI_EINVAL;
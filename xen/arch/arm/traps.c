@@ -29,6 +29,7 @@
 #include <xen/hypercall.h>
 #include <xen/softirq.h>
 #include <xen/domain_page.h>
+#include <xen/guest_access.h>
 #include <public/sched.h>
 #include <public/xen.h>
 #include <asm/event.h>
@@ -972,6 +973,8 @@ static void do_trap_hypercall(struct cpu_user_regs *regs, register_t *nr,
         return;
     }
 
+    vcpu_perf_incra(hypercalls, *nr);
+
     HYPERCALL_RESULT_REG(regs) = call(HYPERCALL_ARGS(regs));
 
 #ifndef NDEBUG
@@ -1242,6 +1245,14 @@ static void do_sysreg(struct cpu_user_regs *regs,
             domain_crash_synchronous();
         }
         break;
+    case HSR_SYSREG_ICC_SGI1R_EL1:
+        if ( !vgic_v3_emulate_sysreg(regs, hsr) )
+        {
+            dprintk(XENLOG_ERR,
+                    "failed emulation of ICC_SGI1R_EL1 access\n");
+            domain_crash_synchronous();
+        }
+        break;
     default:
         printk("%s %d, %d, c%d, c%d, %d %s x%d @ 0x%"PRIregister"\n",
                sysreg.read ? "mrs" : "msr",
@@ -1481,6 +1492,9 @@ asmlinkage void do_trap_fiq(struct cpu_user_regs *regs)
 
 asmlinkage void leave_hypervisor_tail(void)
 {
+    /* The guest may change its page tables once it runs */
+    guest_copy_flush(current);
+
     while (1)
     {
         local_irq_disable();
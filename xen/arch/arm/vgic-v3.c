@@ -0,0 +1,442 @@
+/*
+ * xen/arch/arm/vgic-v3.c
+ *
+ * ARM Virtual Generic Interrupt Controller support v3
+ *
+ * The distributor and the redistributors (one per vCPU, RD_base frame
+ * and SGI_base frame) are emulated; the CPU interface is the hardware's
+ * virtual one through the ICC_* system registers, but for SGIs, which
+ * trap as writes to ICC_SGI1R_EL1.
+ *
+ * Only what guests use is there: affinity routing, group 1 interrupts,
+ * no LPIs and no ITS.  SPIs are still injected into vCPU0 whatever
+ * GICD_IROUTER<n> says, as with the GICv2 emulation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <xen/bitops.h>
+#include <xen/config.h>
+#include <xen/lib.h>
+#include <xen/init.h>
+#include <xen/softirq.h>
+#include <xen/irq.h>
+#include <xen/sched.h>
+
+#include <asm/current.h>
+
+#include "io.h"
+#include <asm/gic.h>
+#include <asm/gic_v3_defs.h>
+
+#define REG(n) (n/4)
+
+/* Size of the distributor registers */
+#define GICD_SIZE   0x10000
+
+void vcpu_vgic_v3_init(struct vcpu *v)
+{
+    /* The guest uses the system register interface: there's no other */
+    v->arch.gic.v3.sre_el1 = ICC_SRE_EL1_SRE;
+}
+
+static int vgic_v3_distr_mmio_read(struct vcpu *v, mmio_info_t *info)
+{
+    struct hsr_dabt dabt = info->dabt;
+    struct cpu_user_regs *regs = guest_cpu_user_regs();
+    register_t *r = select_user_reg(regs, dabt.reg);
+    struct vgic_irq_rank *rank;
+    int offset = (int)(info->gpa - v->domain->arch.vgic.dbase);
+    int gicd_reg = REG(offset);
+    unsigned int irq;
+
+    switch ( gicd_reg )
+    {
+    case GICD_CTLR:
+        if ( dabt.size != 2 ) goto bad_width;
+        *r = v->domain->arch.vgic.ctlr | GICD_CTLR_ARE_NS;
+        return 1;
+    case GICD_TYPER:
+        if ( dabt.size != 2 ) goto bad_width;
+        /* No security, no LPIs, and 10 bits of interrupt ID */
+        *r = ((v->domain->arch.vgic.nr_lines / 32) & GICD_TYPE_LINES) |
+             (9 << GICD_TYPE_ID_BITS_SHIFT);
+        return 1;
+    case GICD_IIDR:
+        if ( dabt.size != 2 ) goto bad_width;
+        *r = 0x0000043b;
+        return 1;
+
+    case GICD_IGROUPR + 1 ... GICD_IGROUPRN:
+        if ( dabt.size != 2 ) goto bad_width;
+        /* All interrupts are group 1 */
+        *r = 0xffffffff;
+        return 1;
+
+    /* With affinity routing, SGIs and PPIs are the redistributors' */
+    case GICD_IGROUPR:
+    case GICD_ISENABLER:
+    case GICD_ICENABLER:
+    case GICD_ISPENDR:
+    case GICD_ICPENDR:
+    case GICD_ISACTIVER:
+    case GICD_ICACTIVER:
+    case GICD_IPRIORITYR ... GICD_IPRIORITYR + 7:
+    case GICD_ICFGR ... GICD_ICFGR + 1:
+        goto read_as_zero;
+
+    case GICD_ISENABLER + 1 ... GICD_ISENABLERN:
+    case GICD_ICENABLER + 1 ... GICD_ICENABLERN:
+    case GICD_ISPENDR + 1 ... GICD_ISPENDRN:
+    case GICD_ICPENDR + 1 ... GICD_ICPENDRN:
+    case GICD_ISACTIVER + 1 ... GICD_ISACTIVERN:
+    case GICD_ICACTIVER + 1 ... GICD_ICACTIVERN:
+    case GICD_IPRIORITYR + 8 ... GICD_IPRIORITYRN:
+    case GICD_ICFGR + 2 ... GICD_ICFGRN:
+        return vgic_rank_mmio_read(v, info, gicd_reg, offset);
+
+    case GICD_IROUTER32 ... GICD_IROUTERN:
+        if ( dabt.size != 3 ) goto bad_width;
+        irq = (gicd_reg - GICD_IROUTER) / 2;
+        rank = vgic_rank_irq(v, irq);
+        if ( rank == NULL ) goto read_as_zero;
+        spin_lock(&rank->lock);
+        *r = rank->irouter[irq % 32];
+        spin_unlock(&rank->lock);
+        return 1;
+
+    case GICD_PIDR2:
+        if ( dabt.size != 2 ) goto bad_width;
+        *r = GIC_PIDR2_ARCH_GICv3;
+        return 1;
+
+    /* ITARGETSR<n> (ignored with affinity routing), reserved, etc. */
+    default:
+        goto read_as_zero;
+    }
+
+bad_width:
+    printk("vGICv3: vGICD: bad read width %d r%d offset %#08x\n",
+           dabt.size, dabt.reg, offset);
+    domain_crash_synchronous();
+    return 0;
+
+read_as_zero:
+    if ( dabt.size != 2 && dabt.size != 3 ) goto bad_width;
+    *r = 0;
+    return 1;
+}
+
+static int vgic_v3_distr_mmio_write(struct vcpu *v, mmio_info_t *info)
+{
+    struct hsr_dabt dabt = info->dabt;
+    struct cpu_user_regs *regs = guest_cpu_user_regs();
+    register_t *r = select_user_reg(regs, dabt.reg);
+    struct vgic_irq_rank *rank;
+    int offset = (int)(info->gpa - v->domain->arch.vgic.dbase);
+    int gicd_reg = REG(offset);
+    unsigned int irq;
+
+    switch ( gicd_reg )
+    {
+    case GICD_CTLR:
+        if ( dabt.size != 2 ) goto bad_width;
+        /* Affinity routing is always on: ignore all but the enable bits */
+        v->domain->arch.vgic.ctlr =
+            (*r) & (GICD_CTLR_ENABLE_G1A | GICD_CTLR_ENABLE_G1);
+        return 1;
+
+    case GICD_ISENABLER + 1 ... GICD_ISENABLERN:
+    case GICD_ICENABLER + 1 ... GICD_ICENABLERN:
+    case GICD_ISPENDR + 1 ... GICD_ISPENDRN:
+    case GICD_ICPENDR + 1 ... GICD_ICPENDRN:
+    case GICD_ISACTIVER + 1 ... GICD_ISACTIVERN:
+    case GICD_ICACTIVER + 1 ... GICD_ICACTIVERN:
+    case GICD_IPRIORITYR + 8 ... GICD_IPRIORITYRN:
+    case GICD_ICFGR + 2 ... GICD_ICFGRN:
+        return vgic_rank_mmio_write(v, info, gicd_reg, offset);
+
+    case GICD_IROUTER32 ... GICD_IROUTERN:
+        if ( dabt.size != 3 ) goto bad_width;
+        irq = (gicd_reg - GICD_IROUTER) / 2;
+        rank = vgic_rank_irq(v, irq);
+        if ( rank == NULL ) goto write_ignore;
+        spin_lock(&rank->lock);
+        rank->irouter[irq % 32] = *r;
+        spin_unlock(&rank->lock);
+        return 1;
+
+    /*
+     * R/O, the redistributors' SGIs and PPIs, ITARGETSR<n> and the group
+     * registers (all is group 1), reserved, etc.
+     */
+    default:
+        goto write_ignore;
+    }
+
+bad_width:
+    printk("vGICv3: vGICD: bad write width %d r%d=%"PRIregister" offset %#08x\n",
+           dabt.size, dabt.reg, *r, offset);
+    domain_crash_synchronous();
+    return 0;
+
+write_ignore:
+    if ( dabt.size != 2 && dabt.size != 3 ) goto bad_width;
+    return 1;
+}
+
+static int vgic_v3_distr_mmio_check(struct vcpu *v, paddr_t addr)
+{
+    struct domain *d = v->domain;
+
+    if ( d->arch.vgic.version != GIC_V3 )
+        return 0;
+
+    return (addr >= d->arch.vgic.dbase) &&
+           (addr < d->arch.vgic.dbase + GICD_SIZE);
+}
+
+const struct mmio_handler vgic_v3_distr_mmio_handler = {
+    .check_handler = vgic_v3_distr_mmio_check,
+    .read_handler  = vgic_v3_distr_mmio_read,
+    .write_handler = vgic_v3_distr_mmio_write,
+};
+
+/*
+ * The redistributor an access is to, and the offset in it.  The
+ * redistributors are laid out one after the other, in vCPU order.
+ */
+static struct vcpu *vgic_v3_rdist_vcpu(struct vcpu *v, paddr_t gpa,
+                                       int *offset)
+{
+    struct domain *d = v->domain;
+    paddr_t off = gpa - d->arch.vgic.rbase;
+    unsigned int vcpuid = off / GICR_RD_FRAMES_SIZE;
+
+    *offset = off % GICR_RD_FRAMES_SIZE;
+    if ( vcpuid >= d->max_vcpus )
+        return NULL;
+
+    return d->vcpu[vcpuid];
+}
+
+static int vgic_v3_rdistr_mmio_read(struct vcpu *v, mmio_info_t *info)
+{
+    struct hsr_dabt dabt = info->dabt;
+    struct cpu_user_regs *regs = guest_cpu_user_regs();
+    register_t *r = select_user_reg(regs, dabt.reg);
+    struct vcpu *target;
+    int offset, gicr_reg;
+    uint64_t typer;
+
+    target = vgic_v3_rdist_vcpu(v, info->gpa, &offset);
+    if ( target == NULL )
+        goto read_as_zero;
+    gicr_reg = REG(offset);
+
+    switch ( gicr_reg )
+    {
+    case GICR_IIDR:
+        if ( dabt.size != 2 ) goto bad_width;
+        *r = 0x0000043b;
+        return 1;
+    case GICR_TYPER:
+        if ( dabt.size != 3 ) goto bad_width;
+        typer = ((uint64_t)vcpuid_to_vaffinity(target->vcpu_id)
+                 << GICR_TYPER_AFF_SHIFT) |
+                (target->vcpu_id << GICR_TYPER_PROC_NUM_SHIFT);
+        if ( target->vcpu_id == v->domain->max_vcpus - 1 )
+            typer |= GICR_TYPER_LAST;
+        *r = typer;
+        return 1;
+    case GICR_PIDR2:
+        if ( dabt.size != 2 ) goto bad_width;
+        *r = GIC_PIDR2_ARCH_GICv3;
+        return 1;
+
+    case GICR_IGROUPR0:
+        if ( dabt.size != 2 ) goto bad_width;
+        *r = 0xffffffff;
+        return 1;
+
+    case GICR_ISENABLER0:
+    case GICR_ICENABLER0:
+    case GICR_ISPENDR0:
+    case GICR_ICPENDR0:
+    case GICR_ISACTIVER0:
+    case GICR_ICACTIVER0:
+    case GICR_IPRIORITYR0 ... GICR_IPRIORITYR0 + 7:
+    case GICR_ICFGR0 ... GICR_ICFGR1:
+        return vgic_rank_mmio_read(target, info, gicr_reg - GICR_SGI_BASE,
+                                   offset);
+
+    /* CTLR (no LPIs, never waiting for writes), WAKER (awake), etc. */
+    default:
+        goto read_as_zero;
+    }
+
+bad_width:
+    printk("vGICv3: vGICR: bad read width %d r%d offset %#08x\n",
+           dabt.size, dabt.reg, offset);
+    domain_crash_synchronous();
+    return 0;
+
+read_as_zero:
+    if ( dabt.size != 2 && dabt.size != 3 ) goto bad_width;
+    *r = 0;
+    return 1;
+}
+
+static int vgic_v3_rdistr_mmio_write(struct vcpu *v, mmio_info_t *info)
+{
+    struct hsr_dabt dabt = info->dabt;
+    struct cpu_user_regs *regs = guest_cpu_user_regs();
+    register_t *r = select_user_reg(regs, dabt.reg);
+    struct vcpu *target;
+    int offset, gicr_reg;
+
+    target = vgic_v3_rdist_vcpu(v, info->gpa, &offset);
+    if ( target == NULL )
+        goto write_ignore;
+    gicr_reg = REG(offset);
+
+    switch ( gicr_reg )
+    {
+    case GICR_ISENABLER0:
+    case GICR_ICENABLER0:
+    case GICR_ISPENDR0:
+    case GICR_ICPENDR0:
+    case GICR_ISACTIVER0:
+    case GICR_ICACTIVER0:
+    case GICR_IPRIORITYR0 ... GICR_IPRIORITYR0 + 7:
+    case GICR_ICFGR0 ... GICR_ICFGR1:
+        return vgic_rank_mmio_write(target, info, gicr_reg - GICR_SGI_BASE,
+                                    offset);
+
+    /* R/O, CTLR, WAKER, IGROUPR0 (all is group 1), reserved, etc. */
+    default:
+        goto write_ignore;
+    }
+
+bad_width:
+    printk("vGICv3: vGICR: bad write width %d r%d=%"PRIregister" offset %#08x\n",
+           dabt.size, dabt.reg, *r, offset);
+    domain_crash_synchronous();
+    return 0;
+
+write_ignore:
+    if ( dabt.size != 2 && dabt.size != 3 ) goto bad_width;
+    return 1;
+}
+
+static int vgic_v3_rdistr_mmio_check(struct vcpu *v, paddr_t addr)
+{
+    struct domain *d = v->domain;
+
+    if ( d->arch.vgic.version != GIC_V3 )
+        return 0;
+
+    return (addr >= d->arch.vgic.rbase) &&
+           (addr < d->arch.vgic.rbase + d->arch.vgic.rbase_size);
+}
+
+const struct mmio_handler vgic_v3_rdistr_mmio_handler = {
+    .check_handler = vgic_v3_rdistr_mmio_check,
+    .read_handler  = vgic_v3_rdistr_mmio_read,
+    .write_handler = vgic_v3_rdistr_mmio_write,
+};
+
+static inline int is_vcpu_running(struct domain *d, unsigned int vcpuid)
+{
+    struct vcpu *v;
+
+    if ( vcpuid >= d->max_vcpus )
+        return 0;
+
+    v = d->vcpu[vcpuid];
+    if ( v == NULL )
+        return 0;
+    if ( test_bit(_VPF_down, &v->pause_flags) )
+        return 0;
+
+    return 1;
+}
+
+/*
+ * Send an SGI as the guest asked in ICC_SGI1R_EL1: to the vCPUs of the
+ * target list in the Aff1 cluster, or to all but itself.  vCPUs only
+ * have Aff1 and Aff0, see vcpuid_to_vaffinity().
+ */
+static void vgic_v3_to_sgi(struct vcpu *v, register_t sgir)
+{
+    struct domain *d = v->domain;
+    unsigned int virq = (sgir >> ICC_SGI1R_INTID_SHIFT) & ICC_SGI1R_INTID_MASK;
+    unsigned long tlist;
+    register_t aff1;
+    unsigned int i, vcpuid;
+
+    if ( sgir & ICC_SGI1R_IRM )
+    {
+        for ( i = 0; i < d->max_vcpus; i++ )
+            if ( i != v->vcpu_id && is_vcpu_running(d, i) )
+                vgic_vcpu_inject_irq(d->vcpu[i], virq, 1);
+        return;
+    }
+
+    if ( ((sgir >> ICC_SGI1R_AFF2_SHIFT) & ICC_SGI1R_AFF_MASK) ||
+         ((sgir >> ICC_SGI1R_AFF3_SHIFT) & ICC_SGI1R_AFF_MASK) )
+        return;
+
+    aff1 = (sgir >> ICC_SGI1R_AFF1_SHIFT) & ICC_SGI1R_AFF_MASK;
+    tlist = sgir & ICC_SGI1R_TARGET_LIST_MASK;
+    for_each_set_bit( i, &tlist, 16 )
+    {
+        vcpuid = vaffinity_to_vcpuid((aff1 << MPIDR_AFF1_SHIFT) | i);
+        if ( !is_vcpu_running(d, vcpuid) )
+        {
+            gdprintk(XENLOG_WARNING, "vGICv3: ICC_SGI1R_EL1 write %"PRIregister", vcpu%u is not running\n",
+                     sgir, vcpuid);
+            continue;
+        }
+        vgic_vcpu_inject_irq(d->vcpu[vcpuid], virq, 1);
+    }
+}
+
+int vgic_v3_emulate_sysreg(struct cpu_user_regs *regs, union hsr hsr)
+{
+    struct hsr_sysreg sysreg = hsr.sysreg;
+    register_t *x = select_user_reg(regs, sysreg.reg);
+    struct vcpu *v = current;
+
+    if ( v->domain->arch.vgic.version != GIC_V3 )
+        return 0;
+
+    switch ( hsr.bits & HSR_SYSREG_REGS_MASK )
+    {
+    case HSR_SYSREG_ICC_SGI1R_EL1:
+        /* Write only */
+        if ( sysreg.read )
+            return 0;
+        vgic_v3_to_sgi(v, *x);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
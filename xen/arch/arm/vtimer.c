@@ -21,6 +21,7 @@
 #include <xen/lib.h>
 #include <xen/timer.h>
 #include <xen/sched.h>
+#include <xen/cpu.h>
 #include <asm/irq.h>
 #include <asm/time.h>
 #include <asm/gic.h>
@@ -37,13 +38,170 @@ static void phys_timer_expired(void *data)
         vgic_vcpu_inject_irq(t->v, t->irq, 1);
 }
 
-static void virt_timer_expired(void *data)
+/*
+ * While a vCPU runs, its virtual timer fires in hardware and is injected
+ * straight from the interrupt (see vtimer_interrupt()).  When it is
+ * descheduled with the timer enabled, Xen has to fire it instead.  Rather
+ * than a Xen timer per vCPU, each pCPU keeps the virtual timers of the
+ * vCPUs it descheduled in a queue, soonest deadline first, behind a
+ * single Xen timer for the head.  So a pCPU with many idle vCPUs takes
+ * one timer event per deadline, not one per vCPU and deadline.
+ *
+ * A timer is taken off the queue when it fires, or when its vCPU is
+ * scheduled back in, on whichever pCPU that happens.
+ */
+struct vtimer_queue {
+    spinlock_t lock;
+    struct list_head list;
+    struct timer timer;
+};
+
+static DEFINE_PER_CPU(struct vtimer_queue, vtimer_queue);
+
+/* Arm the queue's Xen timer for its head.  Called with the lock held. */
+static void vtimer_queue_arm(struct vtimer_queue *q)
 {
-    struct vtimer *t = data;
-    t->ctl |= CNTx_CTL_MASK;
-    vgic_vcpu_inject_irq(t->v, t->irq, 1);
+    if ( list_empty(&q->list) )
+        stop_timer(&q->timer);
+    else
+        set_timer(&q->timer,
+                  list_entry(q->list.next, struct vtimer, queue)->deadline);
+}
+
+/* Called with the lock held. */
+static void vtimer_queue_insert(struct vtimer_queue *q, struct vtimer *t)
+{
+    struct list_head *pos;
+
+    list_for_each ( pos, &q->list )
+        if ( list_entry(pos, struct vtimer, queue)->deadline > t->deadline )
+            break;
+    list_add_tail(&t->queue, pos);
+}
+
+static void vtimer_queue_expired(void *data)
+{
+    struct vtimer_queue *q = data;
+    struct vtimer *t;
+    s_time_t now = NOW();
+    unsigned long flags;
+
+    spin_lock_irqsave(&q->lock, flags);
+
+    while ( !list_empty(&q->list) )
+    {
+        t = list_entry(q->list.next, struct vtimer, queue);
+        if ( t->deadline > now )
+            break;
+        list_del_init(&t->queue);
+        t->ctl |= CNTx_CTL_MASK;
+        vgic_vcpu_inject_irq(t->v, t->irq, 1);
+    }
+
+    vtimer_queue_arm(q);
+
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+static void vtimer_dequeue(struct vtimer *t)
+{
+    struct vtimer_queue *q;
+    unsigned int cpu;
+    unsigned long flags;
+
+    /*
+     * Only the vCPU itself queues its timer, so once off a queue it stays
+     * off.  While on one, queue_cpu may change under the lock, when the
+     * pCPU goes down.
+     */
+    if ( list_empty(&t->queue) )
+        return;
+
+    for ( ; ; )
+    {
+        cpu = read_atomic(&t->queue_cpu);
+        q = &per_cpu(vtimer_queue, cpu);
+        spin_lock_irqsave(&q->lock, flags);
+        if ( cpu == t->queue_cpu )
+            break;
+        spin_unlock_irqrestore(&q->lock, flags);
+    }
+
+    if ( !list_empty(&t->queue) )
+    {
+        bool_t head = (q->list.next == &t->queue);
+
+        list_del_init(&t->queue);
+        if ( head )
+            vtimer_queue_arm(q);
+    }
+
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/* Hand the timers queued on a dying pCPU over to another one. */
+static void vtimer_queue_migrate(unsigned int cpu)
+{
+    struct vtimer_queue *old = &per_cpu(vtimer_queue, cpu);
+    unsigned int new_cpu = cpumask_cycle(cpu, &cpu_online_map);
+    struct vtimer_queue *new = &per_cpu(vtimer_queue, new_cpu);
+    struct vtimer *t;
+    unsigned long flags;
+
+    spin_lock_irqsave(&old->lock, flags);
+    spin_lock(&new->lock);
+
+    while ( !list_empty(&old->list) )
+    {
+        t = list_entry(old->list.next, struct vtimer, queue);
+        list_del(&t->queue);
+        t->queue_cpu = new_cpu;
+        vtimer_queue_insert(new, t);
+    }
+    vtimer_queue_arm(new);
+
+    spin_unlock(&new->lock);
+    spin_unlock_irqrestore(&old->lock, flags);
+}
+
+static int cpu_vtimer_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct vtimer_queue *q = &per_cpu(vtimer_queue, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&q->lock);
+        INIT_LIST_HEAD(&q->list);
+        init_timer(&q->timer, vtimer_queue_expired, q, cpu);
+        break;
+    case CPU_DYING:
+        vtimer_queue_migrate(cpu);
+        kill_timer(&q->timer);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
 }
 
+static struct notifier_block cpu_vtimer_nfb = {
+    .notifier_call = cpu_vtimer_callback
+};
+
+static int __init vtimer_presmp_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    cpu_vtimer_callback(&cpu_vtimer_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_vtimer_nfb);
+    return 0;
+}
+presmp_initcall(vtimer_presmp_init);
+
 int vcpu_domain_init(struct domain *d)
 {
     d->arch.phys_timer_base.offset = NOW();
@@ -66,33 +224,46 @@ int vcpu_vtimer_init(struct vcpu *v)
     t->v = v;
 
     t = &v->arch.virt_timer;
-    init_timer(&t->timer, virt_timer_expired, t, v->processor);
     t->ctl = 0;
     t->irq = timer_dt_irq(TIMER_VIRT_PPI)->irq;
     t->v = v;
+    INIT_LIST_HEAD(&t->queue);
+    t->queue_cpu = v->processor;
 
     return 0;
 }
 
 void vcpu_timer_destroy(struct vcpu *v)
 {
-    kill_timer(&v->arch.virt_timer.timer);
+    vtimer_dequeue(&v->arch.virt_timer);
     kill_timer(&v->arch.phys_timer.timer);
 }
 
 int virt_timer_save(struct vcpu *v)
 {
+    struct vtimer *t = &v->arch.virt_timer;
+
     if ( is_idle_domain(v->domain) )
         return 0;
 
-    v->arch.virt_timer.ctl = READ_SYSREG32(CNTV_CTL_EL0);
-    WRITE_SYSREG32(v->arch.virt_timer.ctl & ~CNTx_CTL_ENABLE, CNTV_CTL_EL0);
-    v->arch.virt_timer.cval = READ_SYSREG64(CNTV_CVAL_EL0);
-    if ( (v->arch.virt_timer.ctl & CNTx_CTL_ENABLE) &&
-         !(v->arch.virt_timer.ctl & CNTx_CTL_MASK))
+    t->ctl = READ_SYSREG32(CNTV_CTL_EL0);
+    WRITE_SYSREG32(t->ctl & ~CNTx_CTL_ENABLE, CNTV_CTL_EL0);
+    t->cval = READ_SYSREG64(CNTV_CVAL_EL0);
+    if ( (t->ctl & CNTx_CTL_ENABLE) && !(t->ctl & CNTx_CTL_MASK) )
     {
-        set_timer(&v->arch.virt_timer.timer, ticks_to_ns(v->arch.virt_timer.cval +
-                  v->domain->arch.virt_timer_base.offset - boot_count));
+        struct vtimer_queue *q = &this_cpu(vtimer_queue);
+        unsigned long flags;
+
+        t->deadline = ticks_to_ns(t->cval +
+                                  v->domain->arch.virt_timer_base.offset -
+                                  boot_count);
+
+        spin_lock_irqsave(&q->lock, flags);
+        t->queue_cpu = smp_processor_id();
+        vtimer_queue_insert(q, t);
+        if ( q->list.next == &t->queue )
+            set_timer(&q->timer, t->deadline);
+        spin_unlock_irqrestore(&q->lock, flags);
     }
     return 0;
 }
@@ -102,8 +273,7 @@ int virt_timer_restore(struct vcpu *v)
     if ( is_idle_domain(v->domain) )
         return 0;
 
-    stop_timer(&v->arch.virt_timer.timer);
-    migrate_timer(&v->arch.virt_timer.timer, v->processor);
+    vtimer_dequeue(&v->arch.virt_timer);
     migrate_timer(&v->arch.phys_timer.timer, v->processor);
 
     WRITE_SYSREG64(v->domain->arch.virt_timer_base.offset, CNTVOFF_EL2);
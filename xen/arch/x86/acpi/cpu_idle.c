@@ -1151,6 +1151,24 @@ int pmstat_get_cx_stat(uint32_t cpuid, struct pm_cx_stat *stat)
     return 0;
 }
 
+/* Time (in ns) @cpuid has spent in C2 or deeper since boot. */
+uint64_t pmstat_get_cx_deep_residency(uint32_t cpuid)
+{
+    struct acpi_processor_power *power = processor_powers[cpuid];
+    uint64_t res = 0;
+    int i;
+
+    if ( power == NULL || pm_idle_save == NULL )
+        return 0;
+
+    spin_lock_irq(&power->stat_lock);
+    for ( i = 2; i < power->count; i++ )
+        res += tick_to_ns(power->states[i].time);
+    spin_unlock_irq(&power->stat_lock);
+
+    return res;
+}
+
 int pmstat_reset_cx_stat(uint32_t cpuid)
 {
     return 0;
@@ -649,6 +649,10 @@ static int __init cpufreq_driver_init(void)
 {
     int ret = 0;
 
+    if ((cpufreq_controller == FREQCTL_xen) && opt_cpufreq_hwp &&
+        !hwp_register_driver())
+        return 0;
+
     if ((cpufreq_controller == FREQCTL_xen) &&
         (boot_cpu_data.x86_vendor == X86_VENDOR_INTEL))
         ret = cpufreq_register_driver(&acpi_cpufreq_driver);
@@ -0,0 +1,301 @@
+/*
+ *  hwp.c - Hardware managed P-states (Intel HWP / AMD CPPC) driver
+ *
+ *  With HWP the processor picks its own operating point within the
+ *  [min, max] performance range it is given, biased by an energy/
+ *  performance preference (EPP, 0 = performance ... 255 = powersave).
+ *  Xen therefore does no load sampling at all: the "hwp" governor only
+ *  turns policy limits into the hardware request, and the EPP of each
+ *  cpu follows the cpupool it belongs to.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ */
+
+#include <xen/types.h>
+#include <xen/errno.h>
+#include <xen/init.h>
+#include <xen/cpu.h>
+#include <xen/cpumask.h>
+#include <xen/sched.h>
+#include <xen/smp.h>
+#include <asm/msr.h>
+#include <asm/processor.h>
+#include <asm/percpu.h>
+#include <acpi/cpufreq/cpufreq.h>
+#include <acpi/cpufreq/processor_perf.h>
+
+/* Intel HWP */
+#define CPUID_6_EAX_HWP             (1u << 7)
+#define CPUID_6_EAX_HWP_EPP         (1u << 10)
+#define MSR_IA32_PM_ENABLE          0x00000770
+#define MSR_IA32_HWP_CAPABILITIES   0x00000771
+#define MSR_IA32_HWP_REQUEST        0x00000774
+
+/* AMD CPPC */
+#define CPUID_80000008_EBX_CPPC     (1u << 27)
+#define MSR_AMD_CPPC_CAP1           0xc00102b0
+#define MSR_AMD_CPPC_ENABLE         0xc00102b1
+#define MSR_AMD_CPPC_REQ            0xc00102b3
+
+static bool_t __read_mostly hwp_in_use;
+static bool_t __read_mostly hwp_has_epp;
+
+struct hwp_cpu {
+    bool_t   enabled;
+    bool_t   epp_set;
+    uint8_t  lowest, guaranteed, highest;
+    uint8_t  min, max;           /* requested range */
+    uint8_t  epp;
+};
+
+static DEFINE_PER_CPU(struct hwp_cpu, hwp_cpu);
+
+static void hwp_write_request(void *unused)
+{
+    struct hwp_cpu *h = &this_cpu(hwp_cpu);
+    uint64_t req;
+
+    if ( !h->enabled )
+        return;
+
+    /* Desired performance 0 leaves the choice to the hardware. */
+    if ( boot_cpu_data.x86_vendor == X86_VENDOR_INTEL )
+    {
+        req = h->min | ((uint64_t)h->max << 8);
+        if ( hwp_has_epp )
+            req |= (uint64_t)h->epp << 24;
+        wrmsrl(MSR_IA32_HWP_REQUEST, req);
+    }
+    else
+    {
+        req = h->max | ((uint64_t)h->min << 8) | ((uint64_t)h->epp << 24);
+        wrmsrl(MSR_AMD_CPPC_REQ, req);
+    }
+}
+
+static void hwp_enable(void *unused)
+{
+    struct hwp_cpu *h = &this_cpu(hwp_cpu);
+    uint64_t caps;
+
+    if ( boot_cpu_data.x86_vendor == X86_VENDOR_INTEL )
+    {
+        wrmsrl(MSR_IA32_PM_ENABLE, 1);
+        rdmsrl(MSR_IA32_HWP_CAPABILITIES, caps);
+        h->highest = caps;
+        h->guaranteed = caps >> 8;
+        h->lowest = caps >> 24;
+    }
+    else
+    {
+        wrmsrl(MSR_AMD_CPPC_ENABLE, 1);
+        rdmsrl(MSR_AMD_CPPC_CAP1, caps);
+        h->lowest = caps;
+        h->guaranteed = caps >> 16;
+        h->highest = caps >> 24;
+    }
+
+    h->min = h->lowest;
+    h->max = h->highest;
+    if ( !h->epp_set )
+        h->epp = HWP_EPP_DEFAULT;
+    h->enabled = 1;
+
+    hwp_write_request(NULL);
+}
+
+bool_t cpufreq_hwp_enabled(void)
+{
+    return hwp_in_use;
+}
+
+/*
+ * Set @cpu's energy/performance preference.  It is recorded even if HWP
+ * isn't (yet) active, so that it applies once the cpu gets enabled.
+ */
+int cpufreq_hwp_set_epp(unsigned int cpu, unsigned int epp)
+{
+    struct hwp_cpu *h = &per_cpu(hwp_cpu, cpu);
+
+    if ( epp > HWP_EPP_POWERSAVE )
+        return -EINVAL;
+
+    h->epp = epp;
+    h->epp_set = 1;
+
+    if ( !hwp_in_use )
+        return -EOPNOTSUPP;
+
+    if ( h->enabled )
+        on_selected_cpus(cpumask_of(cpu), hwp_write_request, NULL, 1);
+
+    return 0;
+}
+
+/* Map a policy frequency (kHz) onto the cpu's performance scale. */
+static uint8_t hwp_freq_to_perf(const struct cpufreq_policy *policy,
+                                const struct hwp_cpu *h, unsigned int freq)
+{
+    unsigned int lo = policy->cpuinfo.min_freq, hi = policy->cpuinfo.max_freq;
+
+    if ( hi <= lo || freq >= hi )
+        return h->highest;
+    if ( freq <= lo )
+        return h->lowest;
+
+    return h->lowest + (freq - lo) * (h->highest - h->lowest) / (hi - lo);
+}
+
+static void hwp_set_limits(struct cpufreq_policy *policy)
+{
+    unsigned int cpu;
+
+    for_each_cpu ( cpu, policy->cpus )
+    {
+        struct hwp_cpu *h = &per_cpu(hwp_cpu, cpu);
+
+        if ( !h->enabled )
+            continue;
+        h->min = hwp_freq_to_perf(policy, h, policy->min);
+        h->max = max(h->min, hwp_freq_to_perf(policy, h, policy->max));
+    }
+
+    on_selected_cpus(policy->cpus, hwp_write_request, NULL, 1);
+}
+
+/* The hardware does the work: this governor never samples anything. */
+static int cpufreq_governor_hwp(struct cpufreq_policy *policy,
+                                unsigned int event)
+{
+    switch ( event )
+    {
+    case CPUFREQ_GOV_START:
+    case CPUFREQ_GOV_LIMITS:
+        hwp_set_limits(policy);
+        break;
+    case CPUFREQ_GOV_STOP:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static struct cpufreq_governor cpufreq_gov_hwp = {
+    .name = "hwp",
+    .governor = cpufreq_governor_hwp,
+};
+
+static int hwp_cpufreq_verify(struct cpufreq_policy *policy)
+{
+    cpufreq_verify_within_limits(policy, policy->cpuinfo.min_freq,
+                                 policy->cpuinfo.max_freq);
+    return 0;
+}
+
+static int hwp_cpufreq_target(struct cpufreq_policy *policy,
+                              unsigned int target_freq, unsigned int relation)
+{
+    /* Frequency selection is up to the hardware. */
+    return 0;
+}
+
+static int hwp_cpufreq_cpu_init(struct cpufreq_policy *policy)
+{
+    const struct processor_performance *perf =
+        &processor_pminfo[policy->cpu]->perf;
+
+    if ( !per_cpu(hwp_cpu, policy->cpu).enabled || !perf->state_count )
+        return -ENODEV;
+
+    /* _PSS lists states from the fastest to the slowest one. */
+    policy->cpuinfo.max_freq = perf->states[0].core_frequency * 1000;
+    policy->cpuinfo.min_freq =
+        perf->states[perf->state_count - 1].core_frequency * 1000;
+    policy->cpuinfo.transition_latency = 0;
+    policy->min = policy->cpuinfo.min_freq;
+    policy->max = policy->cpuinfo.max_freq;
+    policy->cur = policy->cpuinfo.max_freq;
+
+    return 0;
+}
+
+static int hwp_cpufreq_cpu_exit(struct cpufreq_policy *policy)
+{
+    return 0;
+}
+
+static struct cpufreq_driver hwp_cpufreq_driver = {
+    .name   = "hwp-cpufreq",
+    .verify = hwp_cpufreq_verify,
+    .target = hwp_cpufreq_target,
+    .init   = hwp_cpufreq_cpu_init,
+    .exit   = hwp_cpufreq_cpu_exit,
+};
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    if ( action == CPU_STARTING )
+        hwp_enable(NULL);
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+int __init hwp_register_driver(void)
+{
+    int ret;
+
+    switch ( boot_cpu_data.x86_vendor )
+    {
+    case X86_VENDOR_INTEL:
+        if ( boot_cpu_data.cpuid_level < 6 ||
+             !(cpuid_eax(6) & CPUID_6_EAX_HWP) )
+            return -ENODEV;
+        hwp_has_epp = !!(cpuid_eax(6) & CPUID_6_EAX_HWP_EPP);
+        break;
+
+    case X86_VENDOR_AMD:
+        if ( cpuid_eax(0x80000000) < 0x80000008 ||
+             !(cpuid_ebx(0x80000008) & CPUID_80000008_EBX_CPPC) )
+            return -ENODEV;
+        hwp_has_epp = 1;
+        break;
+
+    default:
+        return -ENODEV;
+    }
+
+    ret = cpufreq_register_governor(&cpufreq_gov_hwp);
+    if ( ret )
+        return ret;
+
+    ret = cpufreq_register_driver(&hwp_cpufreq_driver);
+    if ( ret )
+        return ret;
+
+    /* Nothing to sample: don't let any other governor take over. */
+    cpufreq_opt_governor = &cpufreq_gov_hwp;
+    hwp_in_use = 1;
+
+    on_each_cpu(hwp_enable, NULL, 1);
+    register_cpu_notifier(&cpu_nfb);
+
+    printk(XENLOG_INFO "cpufreq: using hardware managed P-states%s\n",
+           hwp_has_epp ? "" : " (no EPP support)");
+
+    return 0;
+}
@@ -267,6 +267,7 @@ void __cpuinit identify_cpu(struct cpuinfo_x86 *c)
 	c->phys_proc_id = BAD_APICID;
 	c->cpu_core_id = BAD_APICID;
 	c->compute_unit_id = BAD_APICID;
+	c->cpu_llc_id = BAD_APICID;
 	memset(&c->x86_capability, 0, sizeof c->x86_capability);
 
 	generic_identify(c);
@@ -295,6 +295,12 @@ unsigned int __cpuinit init_intel_cacheinfo(struct cpuinfo_x86 *c)
 		l3 = new_l3;
 	}
 
+	/* The last level cache is the L3 if there is one, else the L2. */
+	if (new_l3)
+		c->cpu_llc_id = l3_id;
+	else if (new_l2)
+		c->cpu_llc_id = l2_id;
+
 	if (opt_cpu_info) {
 		if (trace)
 			printk("CPU: Trace cache: %dK uops", trace);
@@ -116,7 +116,9 @@ static void idle_loop(void)
     {
         if ( cpu_is_offline(smp_processor_id()) )
             play_dead();
-        (*pm_idle)();
+        /* Clean up freed memory before considering going to sleep. */
+        if ( !scrub_free_pages() )
+            (*pm_idle)();
         do_tasklet();
         do_softirq();
     }
@@ -188,18 +190,23 @@ struct domain *alloc_domain_struct(void)
      * the page_info structure. Hence the MEMF_bits() restriction.
      */
     unsigned int bits = 32 + PAGE_SHIFT + pfn_pdx_hole_shift;
+    unsigned int i, order = get_order_from_bytes(sizeof(*d));
 
+    /* Lock profiling inflates every lock: only tolerate that there. */
+#ifndef LOCK_PROFILE
     BUILD_BUG_ON(sizeof(*d) > PAGE_SIZE);
-    d = alloc_xenheap_pages(0, MEMF_bits(bits));
+#endif
+    d = alloc_xenheap_pages(order, MEMF_bits(bits));
     if ( d != NULL )
-        clear_page(d);
+        for ( i = 0; i < (1u << order); i++ )
+            clear_page((void *)d + i * PAGE_SIZE);
     return d;
 }
 
 void free_domain_struct(struct domain *d)
 {
     lock_profile_deregister_struct(LOCKPROF_TYPE_PERDOM, d);
-    free_xenheap_page(d);
+    free_xenheap_pages(d, get_order_from_bytes(sizeof(*d)));
 }
 
 struct vcpu *alloc_vcpu_struct(void)
@@ -1943,6 +1950,12 @@ void arch_dump_vcpu_info(struct vcpu *v)
         vpmu_dump(v);
 }
 
+void arch_vcpu_block(struct vcpu *v)
+{
+    if ( is_hvm_vcpu(v) && hvm_funcs.vcpu_block )
+        hvm_funcs.vcpu_block(v);
+}
+
 void domain_cpuid(
     struct domain *d,
     unsigned int  input,
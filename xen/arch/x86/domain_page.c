@@ -57,10 +57,75 @@ void __init mapcache_override_current(struct vcpu *v)
 #define MAPCACHE_L1ENT(idx) \
     __linear_l1_table[l1_linear_offset(MAPCACHE_VIRT_START + pfn_to_paddr(idx))]
 
+/*
+ * Each vCPU owns MAPCACHE_VCPU_ENTRIES slots of its domain's mapcache and
+ * allocates from them without any lock: only the vCPU itself, with
+ * interrupts disabled, reaps garbage in its own range.  Reaping is done in
+ * batches, with a single local TLB flush; flushing other CPUs is never
+ * needed, as a vCPU that moves CPUs gets the old CPU's TLB flushed by the
+ * context switch.  When all of its own slots are busy, a vCPU may claim a
+ * free slot of another vCPU (claims use atomic bit operations, so they
+ * cannot collide), flushing its local TLB in case it used that slot before.
+ */
+#define MAPCACHE_NONE (~0U)
+
+static unsigned int mapcache_claim(struct mapcache_domain *dcache,
+                                   struct mapcache_vcpu *vcache,
+                                   unsigned int base)
+{
+    unsigned int i, slot = vcache->cursor;
+
+    for ( i = 0; i < MAPCACHE_VCPU_ENTRIES; i++ )
+    {
+        if ( ++slot >= MAPCACHE_VCPU_ENTRIES )
+            slot = 0;
+        if ( !test_bit(base + slot, dcache->inuse) &&
+             !test_and_set_bit(base + slot, dcache->inuse) )
+        {
+            vcache->cursor = slot;
+            return base + slot;
+        }
+    }
+
+    return MAPCACHE_NONE;
+}
+
+static unsigned int mapcache_reap(struct mapcache_domain *dcache,
+                                  unsigned int base)
+{
+    unsigned int idx, reaped = 0;
+
+    for ( idx = base; idx < base + MAPCACHE_VCPU_ENTRIES; idx++ )
+        if ( test_and_clear_bit(idx, dcache->garbage) )
+        {
+            clear_bit(idx, dcache->inuse);
+            reaped++;
+        }
+
+    return reaped;
+}
+
+static unsigned int mapcache_borrow(struct mapcache_domain *dcache,
+                                    unsigned int base)
+{
+    unsigned int idx = base + MAPCACHE_VCPU_ENTRIES, n;
+
+    for ( n = 0; n < dcache->entries; n++, idx++ )
+    {
+        if ( idx >= dcache->entries )
+            idx = 0;
+        if ( !test_bit(idx, dcache->inuse) &&
+             !test_and_set_bit(idx, dcache->inuse) )
+            return idx;
+    }
+
+    return MAPCACHE_NONE;
+}
+
 void *map_domain_page(unsigned long mfn)
 {
     unsigned long flags;
-    unsigned int idx, i;
+    unsigned int idx, i, base;
     struct vcpu *v;
     struct mapcache_domain *dcache;
     struct mapcache_vcpu *vcache;
@@ -95,35 +160,22 @@ void *map_domain_page(unsigned long mfn)
         goto out;
     }
 
-    spin_lock(&dcache->lock);
+    base = v->vcpu_id * MAPCACHE_VCPU_ENTRIES;
+    ASSERT(base + MAPCACHE_VCPU_ENTRIES <= dcache->entries);
 
-    /* Has some other CPU caused a wrap? We must flush if so. */
-    if ( unlikely(dcache->epoch != vcache->shadow_epoch) )
+    idx = mapcache_claim(dcache, vcache, base);
+    if ( unlikely(idx == MAPCACHE_NONE) && mapcache_reap(dcache, base) )
     {
-        vcache->shadow_epoch = dcache->epoch;
-        if ( NEED_FLUSH(this_cpu(tlbflush_time), dcache->tlbflush_timestamp) )
-        {
-            perfc_incr(domain_page_tlb_flush);
-            flush_tlb_local();
-        }
+        /* Zapped PTEs may still be cached: flush once for the batch. */
+        perfc_incr(domain_page_tlb_flush);
+        flush_tlb_local();
+        idx = mapcache_claim(dcache, vcache, base);
     }
 
-    idx = find_next_zero_bit(dcache->inuse, dcache->entries, dcache->cursor);
-    if ( unlikely(idx >= dcache->entries) )
+    if ( unlikely(idx == MAPCACHE_NONE) )
     {
-        unsigned long accum = 0, prev = 0;
-
-        /* /First/, clean the garbage map and update the inuse list. */
-        for ( i = 0; i < BITS_TO_LONGS(dcache->entries); i++ )
-        {
-            accum |= prev;
-            dcache->inuse[i] &= ~xchg(&dcache->garbage[i], 0);
-            prev = ~dcache->inuse[i];
-        }
-
-        if ( accum | (prev & BITMAP_LAST_WORD_MASK(dcache->entries)) )
-            idx = find_first_zero_bit(dcache->inuse, dcache->entries);
-        else
+        idx = mapcache_borrow(dcache, base);
+        if ( idx == MAPCACHE_NONE )
         {
             /* Replace a hash entry instead. */
             i = MAPHASH_HASHFN(mfn);
@@ -142,20 +194,14 @@ void *map_domain_page(unsigned long mfn)
                     i = 0;
             } while ( i != MAPHASH_HASHFN(mfn) );
         }
+        else
+            perfc_incr(domain_page_borrow);
         BUG_ON(idx >= dcache->entries);
 
-        /* /Second/, flush TLBs. */
         perfc_incr(domain_page_tlb_flush);
         flush_tlb_local();
-        vcache->shadow_epoch = ++dcache->epoch;
-        dcache->tlbflush_timestamp = tlbflush_current_time();
     }
 
-    set_bit(idx, dcache->inuse);
-    dcache->cursor = idx + 1;
-
-    spin_unlock(&dcache->lock);
-
     l1e_write(&MAPCACHE_L1ENT(idx), l1e_from_pfn(mfn, __PAGE_HYPERVISOR));
 
  out:
@@ -260,8 +306,6 @@ int mapcache_domain_init(struct domain *d)
     dcache->garbage = dcache->inuse +
                       (bitmap_pages + 1) * PAGE_SIZE / sizeof(long);
 
-    spin_lock_init(&dcache->lock);
-
     return create_perdomain_mapping(d, (unsigned long)dcache->inuse,
                                     2 * bitmap_pages + 1,
                                     NIL(l1_pgentry_t *), NULL);
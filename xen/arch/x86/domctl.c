@@ -46,6 +46,29 @@ static int gdbsx_guest_mem_io(
     return (iop->remain ? -EFAULT : 0);
 }
 
+/* The entry of a cpuid table for a leaf: its own, or a free one if none. */
+static cpuid_input_t *cpuid_slot(cpuid_input_t *cpuids,
+                                 const xen_domctl_cpuid_t *ctl)
+{
+    cpuid_input_t *cpuid;
+    int i;
+
+    for ( i = 0; i < MAX_CPUID_INPUT; i++ )
+    {
+        cpuid = &cpuids[i];
+
+        if ( cpuid->input[0] == XEN_CPUID_INPUT_UNUSED )
+            return cpuid;
+
+        if ( (cpuid->input[0] == ctl->input[0]) &&
+             ((cpuid->input[1] == XEN_CPUID_INPUT_UNUSED) ||
+              (cpuid->input[1] == ctl->input[1])) )
+            return cpuid;
+    }
+
+    return NULL;
+}
+
 long arch_do_domctl(
     struct xen_domctl *domctl, struct domain *d,
     XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
@@ -889,23 +912,9 @@ long arch_do_domctl(
     case XEN_DOMCTL_set_cpuid:
     {
         xen_domctl_cpuid_t *ctl = &domctl->u.cpuid;
-        cpuid_input_t *cpuid = NULL; 
-        int i;
+        cpuid_input_t *cpuid = cpuid_slot(d->arch.cpuids, ctl);
 
-        for ( i = 0; i < MAX_CPUID_INPUT; i++ )
-        {
-            cpuid = &d->arch.cpuids[i];
-
-            if ( cpuid->input[0] == XEN_CPUID_INPUT_UNUSED )
-                break;
-
-            if ( (cpuid->input[0] == ctl->input[0]) &&
-                 ((cpuid->input[1] == XEN_CPUID_INPUT_UNUSED) ||
-                  (cpuid->input[1] == ctl->input[1])) )
-                break;
-        }
-        
-        if ( i == MAX_CPUID_INPUT )
+        if ( cpuid == NULL )
         {
             ret = -ENOENT;
         }
@@ -917,6 +926,50 @@ long arch_do_domctl(
     }
     break;
 
+    case XEN_DOMCTL_set_cpuid_policy:
+    {
+        struct xen_domctl_cpuid_policy *pol = &domctl->u.cpuid_policy;
+        cpuid_input_t *cpuids, *cpuid, leaf;
+        unsigned int i;
+
+        ret = -E2BIG;
+        if ( pol->nr_leaves > MAX_CPUID_INPUT )
+            break;
+
+        ret = -ENOMEM;
+        cpuids = xmalloc_array(cpuid_input_t, MAX_CPUID_INPUT);
+        if ( cpuids == NULL )
+            break;
+        for ( i = 0; i < MAX_CPUID_INPUT; i++ )
+            cpuids[i].input[0] = cpuids[i].input[1] = XEN_CPUID_INPUT_UNUSED;
+
+        /* Build the new policy aside, then swap it in whole */
+        ret = 0;
+        for ( i = 0; i < pol->nr_leaves; i++ )
+        {
+            if ( copy_from_guest_offset(&leaf, pol->leaves, i, 1) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+            if ( leaf.input[0] == XEN_CPUID_INPUT_UNUSED )
+                continue;
+            cpuid = cpuid_slot(cpuids, &leaf);
+            ASSERT(cpuid != NULL);
+            *cpuid = leaf;
+        }
+
+        if ( ret == 0 )
+        {
+            domain_pause(d);
+            memcpy(d->arch.cpuids, cpuids,
+                   MAX_CPUID_INPUT * sizeof(*cpuids));
+            domain_unpause(d);
+        }
+        xfree(cpuids);
+    }
+    break;
+
     case XEN_DOMCTL_gettscinfo:
     {
         xen_guest_tsc_info_t info;
@@ -1060,6 +1113,7 @@ long arch_do_domctl(
         if ( domctl->cmd == XEN_DOMCTL_getvcpuextstate )
         {
             unsigned int size = PV_XSAVE_SIZE(v->arch.xcr0_accum);
+            void *xsave_area;
 
             if ( !evc->size && !evc->xfeature_mask )
             {
@@ -1089,13 +1143,21 @@ long arch_do_domctl(
                 goto vcpuextstate_out;
             }
             offset += sizeof(v->arch.xcr0_accum);
-            if ( copy_to_guest_offset(domctl->u.vcpuextstate.buffer,
-                                      offset, (void *)v->arch.xsave_area,
-                                      size - 2 * sizeof(uint64_t)) )
+
+            xsave_area = xmalloc_bytes(size - 2 * sizeof(uint64_t));
+            if ( !xsave_area )
             {
-                ret = -EFAULT;
+                ret = -ENOMEM;
                 goto vcpuextstate_out;
             }
+            expand_xsave_states(v, xsave_area, size - 2 * sizeof(uint64_t));
+            ret = copy_to_guest_offset(domctl->u.vcpuextstate.buffer,
+                                       offset, xsave_area,
+                                       size - 2 * sizeof(uint64_t))
+                  ? -EFAULT : 0;
+            xfree(xsave_area);
+            if ( ret )
+                goto vcpuextstate_out;
         }
         else
         {
@@ -1129,7 +1191,9 @@ long arch_do_domctl(
 
             if ( _xcr0_accum )
             {
-                if ( evc->size >= 2 * sizeof(uint64_t) + XSTATE_AREA_MIN_SIZE )
+                /* Images are always in the standard layout. */
+                if ( evc->size >= 2 * sizeof(uint64_t) + XSTATE_AREA_MIN_SIZE &&
+                     !_xsave_area->xsave_hdr.xcomp_bv )
                     ret = validate_xstate(_xcr0, _xcr0_accum,
                                           _xsave_area->xsave_hdr.xstate_bv,
                                           evc->xfeature_mask);
@@ -1209,6 +1273,93 @@ long arch_do_domctl(
     }
     break;
 
+    case XEN_DOMCTL_harvest_accessed:
+    {
+        struct xen_domctl_harvest_accessed *ha = &domctl->u.harvest_accessed;
+        unsigned long bitmap[64], start = ha->start_pfn, done = 0;
+        unsigned int n;
+
+        ret = -EINVAL;
+        if ( d == current->domain || !is_hvm_domain(d) ||
+             start + ha->nr_pfns < start )
+            break;
+
+        ret = 0;
+        while ( done < ha->nr_pfns )
+        {
+            n = min_t(uint64_t, ha->nr_pfns - done,
+                      sizeof(bitmap) * BITS_PER_BYTE);
+            memset(bitmap, 0, sizeof(bitmap));
+            ret = p2m_harvest_accessed(d, start + done, n, bitmap);
+            if ( ret )
+                break;
+            if ( copy_to_guest_offset(ha->bitmap, done / BITS_PER_BYTE,
+                                      (uint8_t *)bitmap,
+                                      DIV_ROUND_UP(n, BITS_PER_BYTE)) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+            done += n;
+            if ( done < ha->nr_pfns && hypercall_preempt_check() )
+                break;
+        }
+
+        ha->nr_pfns = done;
+        copyback = 1;
+    }
+    break;
+
+    case XEN_DOMCTL_migrate_memory:
+    {
+        struct xen_domctl_migrate_memory *mm = &domctl->u.migrate_memory;
+        unsigned long gfn = mm->start_pfn, end, done = 0, moved = 0;
+
+        ret = -EINVAL;
+        if ( d == current->domain || !is_hvm_domain(d) ||
+             mm->node >= MAX_NUMNODES || !node_online(mm->node) ||
+             gfn + mm->nr_pfns < gfn )
+            break;
+
+        ret = -EOPNOTSUPP;
+        if ( need_iommu(d) )
+            break;
+
+        end = min_t(uint64_t, gfn + mm->nr_pfns,
+                    domain_get_maximum_gpfn(d) + 1);
+
+        domain_pause(d);
+
+        ret = 0;
+        for ( ; gfn < end; gfn++ )
+        {
+            int rc = p2m_migrate_page(d, gfn, mm->node);
+
+            if ( rc < 0 )
+            {
+                ret = rc;
+                break;
+            }
+            moved += rc;
+            done = gfn + 1 - mm->start_pfn;
+            if ( mm->max_migrate && moved >= mm->max_migrate )
+                break;
+            if ( !(done & 0xff) && hypercall_preempt_check() )
+                break;
+        }
+
+        domain_unpause(d);
+
+        /* Past the domain's last pfn, there's nothing to do. */
+        if ( !ret && gfn >= end )
+            done = mm->nr_pfns;
+
+        mm->nr_pfns = done;
+        mm->nr_migrated = moved;
+        copyback = 1;
+    }
+    break;
+
     case XEN_DOMCTL_set_broken_page_p2m:
     {
         p2m_type_t pt;
@@ -24,6 +24,7 @@
 #include <xen/smp.h>
 #include <xen/percpu.h>
 #include <asm/hvm/asid.h>
+#include <asm/hvm/emulate.h>
 
 /* Xen command-line option to enable ASIDs */
 static int opt_asid_enabled = 1;
@@ -89,6 +90,7 @@ void hvm_asid_flush_vcpu_asid(struct hvm_vcpu_asid *asid)
 
 void hvm_asid_flush_vcpu(struct vcpu *v)
 {
+    hvmemul_insn_xlat_flush(v);
     hvm_asid_flush_vcpu_asid(&v->arch.hvm_vcpu.n1asid);
     hvm_asid_flush_vcpu_asid(&vcpu_nestedhvm(v).nv_n2asid);
 }
@@ -21,6 +21,7 @@
 #include <asm/hvm/hvm.h>
 #include <asm/hvm/trace.h>
 #include <asm/hvm/support.h>
+#include <asm/hvm/nestedhvm.h>
 
 static void hvmtrace_io_assist(int is_mmio, ioreq_t *p)
 {
@@ -202,6 +203,8 @@ static int hvmemul_do_io(
     {
         rc = hvm_portio_intercept(p);
     }
+    if ( rc == X86EMUL_UNHANDLEABLE )
+        rc = hvm_fast_io_intercept(p);
 
     switch ( rc )
     {
@@ -1131,6 +1134,82 @@ static const struct x86_emulate_ops hvm_emulate_ops = {
     .invlpg        = hvmemul_invlpg
 };
 
+/*
+ * The same few instructions tend to take MMIO exits over and over, so keep
+ * the translations of their code pages and fetch the bytes by guest
+ * physical address on a hit, skipping the guest page walk. The bytes are
+ * always read afresh, so writes to the code need no special treatment;
+ * only the translation is cached. It is dropped on any guest TLB flush or
+ * INVLPG Xen sees. Only supervisor code is cached, as kernel text mappings
+ * are effectively static.
+ *
+ * With HAP the guest's CR3 writes and INVLPGs aren't intercepted, so Xen
+ * can't tell when a cached translation goes stale: the cache is only used
+ * with shadow paging.
+ */
+void hvmemul_insn_xlat_flush(struct vcpu *v)
+{
+    v->arch.hvm_vcpu.hvm_io.insn_xlat_nr = 0;
+}
+
+static enum hvm_copy_result hvmemul_fetch_insn(
+    struct hvm_emulate_ctxt *hvmemul_ctxt, unsigned long addr, uint32_t pfec)
+{
+    struct vcpu *curr = current;
+    struct hvm_vcpu_io *vio = &curr->arch.hvm_vcpu.hvm_io;
+    unsigned long cr3 = curr->arch.hvm_vcpu.guest_cr[3], gfn;
+    unsigned int i, off = addr & ~PAGE_MASK;
+    const unsigned int bytes = sizeof(hvmemul_ctxt->insn_buf);
+    uint32_t walk_pfec = pfec;
+    enum hvm_copy_result rc;
+
+    if ( (pfec & PFEC_user_mode) || off > PAGE_SIZE - bytes ||
+         !hvm_paging_enabled(curr) || paging_mode_hap(curr->domain) ||
+         nestedhvm_vcpu_in_guestmode(curr) )
+        return hvm_fetch_from_guest_virt_nofault(hvmemul_ctxt->insn_buf,
+                                                 addr, bytes, pfec);
+
+    for ( i = 0; i < vio->insn_xlat_nr; i++ )
+    {
+        struct hvm_insn_xlat *x = &vio->insn_xlat[i];
+
+        if ( x->cr3 != cr3 || x->va != (addr & PAGE_MASK) )
+            continue;
+        rc = hvm_copy_from_guest_phys(hvmemul_ctxt->insn_buf,
+                                      pfn_to_paddr(x->gfn) + off, bytes);
+        if ( rc == HVMCOPY_okay )
+            return rc;
+        /* The frame changed type or went away: walk again. */
+        hvmemul_insn_xlat_flush(curr);
+        break;
+    }
+
+    if ( hvm_nx_enabled(curr) || hvm_smep_enabled(curr) )
+        walk_pfec |= PFEC_insn_fetch;
+    gfn = paging_gva_to_gfn(curr, addr, &walk_pfec);
+    if ( gfn == INVALID_GFN )
+        return hvm_fetch_from_guest_virt_nofault(hvmemul_ctxt->insn_buf,
+                                                 addr, bytes, pfec);
+
+    rc = hvm_copy_from_guest_phys(hvmemul_ctxt->insn_buf,
+                                  pfn_to_paddr(gfn) + off, bytes);
+    if ( rc == HVMCOPY_okay )
+    {
+        if ( vio->insn_xlat_nr < ARRAY_SIZE(vio->insn_xlat) )
+            i = vio->insn_xlat_nr++;
+        else
+        {
+            i = vio->insn_xlat_next;
+            vio->insn_xlat_next = (i + 1) % ARRAY_SIZE(vio->insn_xlat);
+        }
+        vio->insn_xlat[i].cr3 = cr3;
+        vio->insn_xlat[i].va = addr & PAGE_MASK;
+        vio->insn_xlat[i].gfn = gfn;
+    }
+
+    return rc;
+}
+
 int hvm_emulate_one(
     struct hvm_emulate_ctxt *hvmemul_ctxt)
 {
@@ -1169,9 +1248,7 @@ int hvm_emulate_one(
                                         hvm_access_insn_fetch,
                                         hvmemul_ctxt->ctxt.addr_size,
                                         &addr) &&
-             hvm_fetch_from_guest_virt_nofault(hvmemul_ctxt->insn_buf, addr,
-                                               sizeof(hvmemul_ctxt->insn_buf),
-                                               pfec) == HVMCOPY_okay) ?
+             hvmemul_fetch_insn(hvmemul_ctxt, addr, pfec) == HVMCOPY_okay) ?
             sizeof(hvmemul_ctxt->insn_buf) : 0;
     }
     else
@@ -1184,6 +1261,7 @@ int hvm_emulate_one(
     vio->mmio_retrying = vio->mmio_retry;
     vio->mmio_retry = 0;
 
+    vcpu_perf_incr(emulations);
     rc = x86_emulate(&hvmemul_ctxt->ctxt, &hvm_emulate_ops);
 
     if ( rc == X86EMUL_OKAY && vio->mmio_retry )
@@ -191,12 +191,36 @@ static void hpet_stop_timer(HPETState *h, unsigned int tn)
 {
     ASSERT(tn < HPET_TIMER_NUM);
     ASSERT(spin_is_locked(&h->lock));
+    __clear_bit(tn, &h->masked_timers);
     destroy_periodic_time(&h->pt[tn]);
     /* read the comparator to get it updated so a read while stopped will
      * return the expected value. */
     hpet_get_comparator(h, tn);
 }
 
+/*
+ * Is the line an HPET timer interrupt is routed to masked at both the
+ * IO-APIC and (for legacy IRQs) the PIC? Such a timer is not armed at all:
+ * its comparator is computed from guest time when read, and it is armed
+ * again from hpet_may_unmask_irq().
+ */
+static bool_t hpet_irq_masked(HPETState *h, unsigned int irq)
+{
+    struct domain *d = vhpet_domain(h);
+    unsigned int gsi = (irq < 16) ? hvm_isa_irq_to_gsi(irq) : irq;
+
+    if ( gsi >= VIOAPIC_NUM_PINS ||
+         !domain_vioapic(d)->redirtbl[gsi].fields.mask )
+        return 0;
+
+    if ( irq < 16 &&
+         !(d->arch.hvm_domain.vpic[irq >> 3].imr & (1 << (irq & 7))) &&
+         vlapic_accept_pic_intr(vhpet_vcpu(h)) )
+        return 0;
+
+    return 1;
+}
+
 /* the number of HPET tick that stands for
  * 1/(2^10) second, namely, 0.9765625 milliseconds */
 #define  HPET_TINY_TIME_SPAN  ((h->stime_freq >> 10) / STIME_PER_HPET_TICK)
@@ -217,6 +241,8 @@ static void hpet_set_timer(HPETState *h, unsigned int tn)
         pit_stop_channel0_irq(&vhpet_domain(h)->arch.vpit);
     }
 
+    __clear_bit(tn, &h->masked_timers);
+
     if ( !timer_enabled(h, tn) )
         return;
 
@@ -248,6 +274,13 @@ static void hpet_set_timer(HPETState *h, unsigned int tn)
     else
         irq = timer_int_route(h, tn);
 
+    if ( hpet_irq_masked(h, irq) )
+    {
+        __set_bit(tn, &h->masked_timers);
+        destroy_periodic_time(&h->pt[tn]);
+        return;
+    }
+
     /*
      * diff is the time from now when the timer should fire, for a periodic
      * timer we also need the period which may be different because time may
@@ -617,6 +650,28 @@ void hpet_deinit(struct domain *d)
     spin_unlock(&h->lock);
 }
 
+void hpet_may_unmask_irq(struct domain *d)
+{
+    HPETState *h = domain_vhpet(d);
+    unsigned long masked;
+    unsigned int i;
+
+    spin_lock(&h->lock);
+
+    masked = h->masked_timers;
+    while ( masked )
+    {
+        i = find_first_set_bit(masked);
+        __clear_bit(i, &masked);
+        if ( hpet_enabled(h) )
+            hpet_set_timer(h, i);
+        else
+            __clear_bit(i, &h->masked_timers);
+    }
+
+    spin_unlock(&h->lock);
+}
+
 void hpet_reset(struct domain *d)
 {
     hpet_deinit(d);
@@ -35,6 +35,8 @@
 #include <xen/paging.h>
 #include <xen/cpu.h>
 #include <xen/wait.h>
+#include <xen/rangeset.h>
+#include <xen/vmap.h>
 #include <asm/shadow.h>
 #include <asm/hap.h>
 #include <asm/current.h>
@@ -303,8 +305,12 @@ void hvm_migrate_timers(struct vcpu *v)
 {
     rtc_migrate_timers(v);
     pt_migrate(v);
+    viridian_migrate_timers(v);
 }
 
+static unsigned int __read_mostly pirq_migrate_hysteresis_ms = 10;
+integer_param("pirq_migrate_hysteresis_ms", pirq_migrate_hysteresis_ms);
+
 static int hvm_migrate_pirq(struct domain *d, struct hvm_pirq_dpci *pirq_dpci,
                             void *arg)
 {
@@ -315,11 +321,31 @@ static int hvm_migrate_pirq(struct domain *d, struct hvm_pirq_dpci *pirq_dpci,
     {
         struct irq_desc *desc =
             pirq_spin_lock_irq_desc(dpci_pirq(pirq_dpci), NULL);
+        unsigned int cpu = v->processor;
+        s_time_t now = NOW();
 
         if ( !desc )
             return 0;
         ASSERT(MSI_IRQ(desc - irq_desc));
-        irq_set_affinity(desc, cpumask_of(v->processor));
+
+        /*
+         * Posted interrupts reach the vCPU wherever the host vector is
+         * handled.  Otherwise, only hop within a node once the hysteresis
+         * period has passed since the last move.
+         */
+        if ( (desc->msi_desc && desc->msi_desc->pi_desc) ||
+             cpumask_test_cpu(cpu, desc->arch.cpu_mask) )
+            /* Nothing to do. */;
+        else if ( cpu_to_node(cpu) ==
+                  cpu_to_node(cpumask_any(desc->arch.cpu_mask)) &&
+                  now - pirq_dpci->migrated <
+                  MILLISECS(pirq_migrate_hysteresis_ms) )
+            /* Stay on the current node. */;
+        else
+        {
+            irq_set_affinity(desc, cpumask_of(cpu));
+            pirq_dpci->migrated = now;
+        }
         spin_unlock_irq(&desc->lock);
     }
 
@@ -338,6 +364,15 @@ void hvm_migrate_pirqs(struct vcpu *v)
     spin_unlock(&d->event_lock);
 }
 
+static ioreq_t *hvm_ioreq_server_slot(struct hvm_ioreq_server *s,
+                                      struct vcpu *v)
+{
+    shared_iopage_t *p = s->ioreq.va;
+
+    ASSERT(p != NULL);
+    return &p->vcpu_ioreq[v->vcpu_id];
+}
+
 void hvm_do_resume(struct vcpu *v)
 {
     ioreq_t *p;
@@ -346,6 +381,36 @@ void hvm_do_resume(struct vcpu *v)
 
     check_wakeup_from_wait();
 
+    /* Collect the response of an ioreq server into the default ioreq. */
+    while ( unlikely(v->arch.hvm_vcpu.ioreq_server != NULL) )
+    {
+        struct hvm_ioreq_server *s = v->arch.hvm_vcpu.ioreq_server;
+        ioreq_t *sp = hvm_ioreq_server_slot(s, v);
+
+        switch ( sp->state )
+        {
+        case STATE_IORESP_READY:
+            rmb();
+            p = get_ioreq(v);
+            p->data = sp->data;
+            sp->state = STATE_IOREQ_NONE;
+            v->arch.hvm_vcpu.ioreq_server = NULL;
+            p->state = STATE_IORESP_READY;
+            break;
+        case STATE_IOREQ_READY:
+        case STATE_IOREQ_INPROCESS:
+            wait_on_xen_event_channel(s->ports[v->vcpu_id],
+                                      (sp->state != STATE_IOREQ_READY) &&
+                                      (sp->state != STATE_IOREQ_INPROCESS));
+            break;
+        default:
+            gdprintk(XENLOG_ERR, "Weird ioreq server %u state %d.\n",
+                     s->id, sp->state);
+            domain_crash(v->domain);
+            return; /* bail */
+        }
+    }
+
     /* NB. Optimised for common case (p->state == STATE_IOREQ_NONE). */
     p = get_ioreq(v);
     while ( p->state != STATE_IOREQ_NONE )
@@ -409,13 +474,11 @@ static void hvm_destroy_ioreq_page(
     spin_unlock(&iorp->lock);
 }
 
-int prepare_ring_for_helper(
-    struct domain *d, unsigned long gmfn, struct page_info **_page,
-    void **_va)
+static int get_ring_page(
+    struct domain *d, unsigned long gmfn, struct page_info **_page)
 {
     struct page_info *page;
     p2m_type_t p2mt;
-    void *va;
 
     page = get_page_from_gfn(d, gmfn, &p2mt, P2M_UNSHARE);
     if ( p2m_is_paging(p2mt) )
@@ -440,6 +503,22 @@ int prepare_ring_for_helper(
         return -EINVAL;
     }
 
+    *_page = page;
+
+    return 0;
+}
+
+int prepare_ring_for_helper(
+    struct domain *d, unsigned long gmfn, struct page_info **_page,
+    void **_va)
+{
+    struct page_info *page;
+    void *va;
+    int rc;
+
+    if ( (rc = get_ring_page(d, gmfn, &page)) != 0 )
+        return rc;
+
     va = __map_domain_page_global(page);
     if ( va == NULL )
     {
@@ -453,6 +532,66 @@ int prepare_ring_for_helper(
     return 0;
 }
 
+int prepare_ring_pages_for_helper(
+    struct domain *d, unsigned long gmfn, unsigned int nr,
+    struct page_info **pages, void **_va)
+{
+    unsigned long *mfns;
+    unsigned int i;
+    void *va;
+    int rc;
+
+    if ( nr == 1 )
+        return prepare_ring_for_helper(d, gmfn, &pages[0], _va);
+
+    mfns = xmalloc_array(unsigned long, nr);
+    if ( mfns == NULL )
+        return -ENOMEM;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( (rc = get_ring_page(d, gmfn + i, &pages[i])) != 0 )
+            goto fail;
+        mfns[i] = page_to_mfn(pages[i]);
+    }
+
+    va = vmap(mfns, nr);
+    rc = -ENOMEM;
+    if ( va == NULL )
+        goto fail;
+
+    xfree(mfns);
+    *_va = va;
+
+    return 0;
+
+ fail:
+    while ( i-- )
+        put_page_and_type(pages[i]);
+    xfree(mfns);
+    return rc;
+}
+
+void destroy_ring_pages_for_helper(
+    void **_va, struct page_info **pages, unsigned int nr)
+{
+    unsigned int i;
+
+    if ( nr == 1 )
+    {
+        destroy_ring_for_helper(_va, pages[0]);
+        return;
+    }
+
+    if ( *_va != NULL )
+    {
+        vunmap(*_va);
+        for ( i = 0; i < nr; i++ )
+            put_page_and_type(pages[i]);
+        *_va = NULL;
+    }
+}
+
 static int hvm_set_ioreq_page(
     struct domain *d, struct hvm_ioreq_page *iorp, unsigned long gmfn)
 {
@@ -482,6 +621,92 @@ static int hvm_set_ioreq_page(
     return 0;
 }
 
+static int hvm_set_buf_ioreq_pages(struct domain *d, unsigned long gmfn)
+{
+    struct hvm_domain *hd = &d->arch.hvm_domain;
+    struct hvm_ioreq_page *iorp = &hd->buf_ioreq;
+    unsigned int i, nr = hd->params[HVM_PARAM_BUFIOREQ_NR_PAGES] ?: 1;
+    struct page_info *pages[IOREQ_BUFFER_MAX_PAGES];
+    unsigned long mfns[IOREQ_BUFFER_MAX_PAGES];
+    void *va;
+    int rc = 0;
+
+    if ( nr == 1 )
+    {
+        spin_lock(&iorp->lock);
+        if ( iorp->va == NULL )
+            hd->buf_ioreq_nr_pages = 1;
+        spin_unlock(&iorp->lock);
+        return hvm_set_ioreq_page(d, iorp, gmfn);
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( (rc = get_ring_page(d, gmfn + i, &pages[i])) != 0 )
+            goto fail;
+        mfns[i] = page_to_mfn(pages[i]);
+    }
+
+    rc = -ENOMEM;
+    va = vmap(mfns, nr);
+    if ( va == NULL )
+        goto fail;
+
+    spin_lock(&iorp->lock);
+
+    if ( (iorp->va != NULL) || d->is_dying )
+    {
+        spin_unlock(&iorp->lock);
+        vunmap(va);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    hd->buf_ioreq_nr_pages = nr;
+    iorp->page = pages[0];
+    iorp->va = va;
+
+    spin_unlock(&iorp->lock);
+
+    domain_unpause(d);
+
+    return 0;
+
+ fail:
+    while ( i-- )
+        put_page_and_type(pages[i]);
+    return rc;
+}
+
+static void hvm_destroy_buf_ioreq_pages(struct domain *d)
+{
+    struct hvm_domain *hd = &d->arch.hvm_domain;
+    struct hvm_ioreq_page *iorp = &hd->buf_ioreq;
+    unsigned int i;
+
+    if ( hd->buf_ioreq_nr_pages <= 1 )
+    {
+        hvm_destroy_ioreq_page(d, iorp);
+        return;
+    }
+
+    spin_lock(&iorp->lock);
+
+    ASSERT(d->is_dying);
+
+    if ( iorp->va != NULL )
+    {
+        /* The frames are found again through the mapping itself. */
+        for ( i = 0; i < hd->buf_ioreq_nr_pages; i++ )
+            put_page_and_type(mfn_to_page(domain_page_map_to_mfn(
+                iorp->va + i * PAGE_SIZE)));
+        vunmap(iorp->va);
+        iorp->va = NULL;
+    }
+
+    spin_unlock(&iorp->lock);
+}
+
 static int hvm_print_line(
     int dir, uint32_t port, uint32_t bytes, uint32_t *val)
 {
@@ -508,6 +733,312 @@ static int hvm_print_line(
     return X86EMUL_OKAY;
 }
 
+/* Snoop the PCI config address so that 0xcfc accesses can be routed. */
+static int hvm_access_cf8(
+    int dir, uint32_t port, uint32_t bytes, uint32_t *val)
+{
+    struct domain *d = current->domain;
+
+    if ( dir == IOREQ_WRITE && bytes == 4 )
+        d->arch.hvm_domain.pci_cf8 = *val;
+
+    /* The default device model still emulates the access. */
+    return X86EMUL_UNHANDLEABLE;
+}
+
+static int hvm_ioreq_server_add_vcpu(struct hvm_ioreq_server *s,
+                                     struct vcpu *v)
+{
+    int rc = alloc_unbound_xen_event_channel(v, s->domid, NULL);
+
+    if ( rc < 0 )
+        return rc;
+
+    s->ports[v->vcpu_id] = rc;
+    hvm_ioreq_server_slot(s, v)->vp_eport = rc;
+
+    return 0;
+}
+
+static void hvm_ioreq_server_remove_vcpu(struct hvm_ioreq_server *s,
+                                         struct vcpu *v)
+{
+    if ( !s->ports[v->vcpu_id] )
+        return;
+
+    free_xen_event_channel(v, s->ports[v->vcpu_id]);
+    s->ports[v->vcpu_id] = 0;
+    hvm_ioreq_server_slot(s, v)->vp_eport = 0;
+}
+
+static void hvm_ioreq_server_free(struct domain *d,
+                                  struct hvm_ioreq_server *s)
+{
+    struct vcpu *v;
+    unsigned int i;
+
+    if ( s->ports != NULL )
+        for_each_vcpu ( d, v )
+            if ( s->ports[v->vcpu_id] )
+                free_xen_event_channel(v, s->ports[v->vcpu_id]);
+
+    destroy_ring_for_helper(&s->ioreq.va, s->ioreq.page);
+
+    for ( i = 0; i < NR_IO_RANGE_TYPES; i++ )
+        if ( s->range[i] != NULL )
+            rangeset_destroy(s->range[i]);
+
+    xfree(s->ports);
+    xfree(s);
+}
+
+static int hvm_create_ioreq_server(struct domain *d, domid_t domid,
+                                   unsigned long gmfn, ioservid_t *id)
+{
+    static const char *const range_names[NR_IO_RANGE_TYPES] = {
+        [HVMOP_IO_RANGE_PORT]   = "port",
+        [HVMOP_IO_RANGE_MEMORY] = "memory",
+        [HVMOP_IO_RANGE_PCI]    = "pci",
+    };
+    struct hvm_ioreq_server *s;
+    struct vcpu *v;
+    unsigned int i;
+    int rc = -ENOMEM;
+
+    s = xzalloc(struct hvm_ioreq_server);
+    if ( s == NULL )
+        return -ENOMEM;
+
+    spin_lock_init(&s->ioreq.lock);
+    s->domid = domid;
+
+    s->ports = xzalloc_array(int, d->max_vcpus);
+    if ( s->ports == NULL )
+        goto fail;
+
+    for ( i = 0; i < NR_IO_RANGE_TYPES; i++ )
+    {
+        char name[32];
+
+        snprintf(name, sizeof(name), "ioreq server %s", range_names[i]);
+        s->range[i] = rangeset_new(d, name, RANGESETF_prettyprint_hex);
+        if ( s->range[i] == NULL )
+            goto fail;
+    }
+
+    rc = prepare_ring_for_helper(d, gmfn, &s->ioreq.page, &s->ioreq.va);
+    if ( rc )
+        goto fail;
+
+    /*
+     * vCPUs are added with the list lock held, so that one being created
+     * concurrently either sees the new server or is covered here.
+     */
+    spin_lock(&d->arch.hvm_domain.ioreq_server_lock);
+
+    rc = -ENOSPC;
+    if ( d->arch.hvm_domain.nr_ioreq_servers >= MAX_NR_IOREQ_SERVERS )
+        goto fail_unlock;
+
+    for_each_vcpu ( d, v )
+    {
+        rc = hvm_ioreq_server_add_vcpu(s, v);
+        if ( rc )
+            goto fail_unlock;
+    }
+
+    /* Id 0 stands for the default device model. */
+    if ( ++d->arch.hvm_domain.ioreq_server_id == 0 )
+        ++d->arch.hvm_domain.ioreq_server_id;
+    s->id = *id = d->arch.hvm_domain.ioreq_server_id;
+
+    list_add_tail(&s->list_entry, &d->arch.hvm_domain.ioreq_server_list);
+    d->arch.hvm_domain.nr_ioreq_servers++;
+
+    spin_unlock(&d->arch.hvm_domain.ioreq_server_lock);
+
+    return 0;
+
+ fail_unlock:
+    spin_unlock(&d->arch.hvm_domain.ioreq_server_lock);
+ fail:
+    hvm_ioreq_server_free(d, s);
+    return rc;
+}
+
+static struct hvm_ioreq_server *hvm_find_ioreq_server(struct domain *d,
+                                                      ioservid_t id)
+{
+    struct hvm_ioreq_server *s;
+
+    ASSERT(spin_is_locked(&d->arch.hvm_domain.ioreq_server_lock));
+
+    list_for_each_entry ( s, &d->arch.hvm_domain.ioreq_server_list,
+                          list_entry )
+        if ( s->id == id )
+            return s;
+
+    return NULL;
+}
+
+static int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
+                                            bool_t map, uint32_t type,
+                                            uint64_t start, uint64_t end)
+{
+    struct hvm_ioreq_server *s;
+    int rc;
+
+    if ( type >= NR_IO_RANGE_TYPES || start > end ||
+         end != (unsigned long)end )
+        return -EINVAL;
+
+    spin_lock(&d->arch.hvm_domain.ioreq_server_lock);
+
+    rc = -ENOENT;
+    s = hvm_find_ioreq_server(d, id);
+    if ( s == NULL )
+        goto out;
+
+    if ( map )
+    {
+        struct hvm_ioreq_server *o;
+
+        /* A range can only be claimed by one server. */
+        rc = -EEXIST;
+        list_for_each_entry ( o, &d->arch.hvm_domain.ioreq_server_list,
+                              list_entry )
+            if ( rangeset_overlaps_range(o->range[type], start, end) )
+                goto out;
+
+        rc = rangeset_add_range(s->range[type], start, end);
+    }
+    else
+        rc = rangeset_remove_range(s->range[type], start, end);
+
+ out:
+    spin_unlock(&d->arch.hvm_domain.ioreq_server_lock);
+    return rc;
+}
+
+static int hvm_destroy_ioreq_server(struct domain *d, ioservid_t id)
+{
+    struct hvm_ioreq_server *s;
+    struct vcpu *v;
+
+    if ( d == current->domain )
+        return -EPERM;
+
+    domain_pause(d);
+
+    spin_lock(&d->arch.hvm_domain.ioreq_server_lock);
+    s = hvm_find_ioreq_server(d, id);
+    if ( s != NULL )
+    {
+        list_del(&s->list_entry);
+        d->arch.hvm_domain.nr_ioreq_servers--;
+    }
+    spin_unlock(&d->arch.hvm_domain.ioreq_server_lock);
+
+    if ( s == NULL )
+    {
+        domain_unpause(d);
+        return -ENOENT;
+    }
+
+    /* Complete requests still outstanding as reads of unclaimed I/O. */
+    for_each_vcpu ( d, v )
+    {
+        if ( v->arch.hvm_vcpu.ioreq_server != s )
+            continue;
+
+        v->arch.hvm_vcpu.ioreq_server = NULL;
+        if ( d->arch.hvm_domain.ioreq.va != NULL )
+        {
+            ioreq_t *p = get_ioreq(v);
+
+            p->data = ~0UL;
+            p->state = STATE_IORESP_READY;
+        }
+    }
+
+    hvm_ioreq_server_free(d, s);
+
+    domain_unpause(d);
+
+    return 0;
+}
+
+static void hvm_destroy_all_ioreq_servers(struct domain *d)
+{
+    struct hvm_ioreq_server *s, *tmp;
+
+    ASSERT(d->is_dying);
+
+    list_for_each_entry_safe ( s, tmp, &d->arch.hvm_domain.ioreq_server_list,
+                               list_entry )
+    {
+        list_del(&s->list_entry);
+        hvm_ioreq_server_free(d, s);
+    }
+    d->arch.hvm_domain.nr_ioreq_servers = 0;
+}
+
+/*
+ * Pick the ioreq server claiming the access described by p, if any, and
+ * the type and address of the request it is to see.
+ */
+static struct hvm_ioreq_server *hvm_select_ioreq_server(
+    struct domain *d, const ioreq_t *p, uint8_t *type, uint64_t *addr)
+{
+    struct hvm_ioreq_server *s;
+    uint32_t cf8 = d->arch.hvm_domain.pci_cf8;
+    unsigned long start, end;
+    unsigned int range;
+
+    if ( list_empty(&d->arch.hvm_domain.ioreq_server_list) )
+        return NULL;
+
+    *type = p->type;
+    *addr = p->addr;
+
+    switch ( p->type )
+    {
+    case IOREQ_TYPE_PIO:
+        if ( (p->addr & ~3) == 0xcfc && (cf8 & 0x80000000) )
+        {
+            unsigned int bdf = (cf8 >> 8) & 0xffff;
+
+            *type = IOREQ_TYPE_PCI_CONFIG;
+            *addr = ((uint64_t)bdf << 32) | (cf8 & 0xfc) | (p->addr & 3);
+            range = HVMOP_IO_RANGE_PCI;
+            start = end = bdf;
+            break;
+        }
+        range = HVMOP_IO_RANGE_PORT;
+        start = p->addr;
+        end = p->addr + p->size - 1;
+        break;
+    case IOREQ_TYPE_COPY:
+        range = HVMOP_IO_RANGE_MEMORY;
+        start = p->addr;
+        end = p->addr + p->size - 1;
+        break;
+    default:
+        return NULL;
+    }
+
+    spin_lock(&d->arch.hvm_domain.ioreq_server_lock);
+    list_for_each_entry ( s, &d->arch.hvm_domain.ioreq_server_list,
+                          list_entry )
+        if ( rangeset_contains_range(s->range[range], start, end) )
+            goto found;
+    s = NULL;
+ found:
+    spin_unlock(&d->arch.hvm_domain.ioreq_server_lock);
+
+    return s;
+}
+
 int hvm_domain_initialise(struct domain *d)
 {
     int rc;
@@ -521,14 +1052,21 @@ int hvm_domain_initialise(struct domain *d)
 
     spin_lock_init(&d->arch.hvm_domain.irq_lock);
     spin_lock_init(&d->arch.hvm_domain.uc_lock);
+    spin_lock_init(&d->arch.hvm_domain.fast_io.lock);
+
+    spin_lock_init(&d->arch.hvm_domain.ioreq_server_lock);
+    INIT_LIST_HEAD(&d->arch.hvm_domain.ioreq_server_list);
 
     INIT_LIST_HEAD(&d->arch.hvm_domain.msixtbl_list);
     spin_lock_init(&d->arch.hvm_domain.msixtbl_list_lock);
 
     d->arch.hvm_domain.params = xzalloc_array(uint64_t, HVM_NR_PARAMS);
     d->arch.hvm_domain.io_handler = xmalloc(struct hvm_io_handler);
+    d->arch.hvm_domain.msixtbl_hash = xzalloc_array(struct hlist_head,
+                                                    MSIXTBL_HASH_SIZE);
     rc = -ENOMEM;
-    if ( !d->arch.hvm_domain.params || !d->arch.hvm_domain.io_handler )
+    if ( !d->arch.hvm_domain.params || !d->arch.hvm_domain.io_handler ||
+         !d->arch.hvm_domain.msixtbl_hash )
         goto fail0;
     d->arch.hvm_domain.io_handler->num_slot = 0;
 
@@ -555,8 +1093,10 @@ int hvm_domain_initialise(struct domain *d)
 
     hvm_init_ioreq_page(d, &d->arch.hvm_domain.ioreq);
     hvm_init_ioreq_page(d, &d->arch.hvm_domain.buf_ioreq);
+    d->arch.hvm_domain.buf_ioreq_nr_pages = 1;
 
     register_portio_handler(d, 0xe9, 1, hvm_print_line);
+    register_portio_handler(d, 0xcf8, 4, hvm_access_cf8);
 
     rc = hvm_funcs.domain_initialise(d);
     if ( rc != 0 )
@@ -571,6 +1111,7 @@ int hvm_domain_initialise(struct domain *d)
  fail1:
     hvm_destroy_cacheattr_region_list(d);
  fail0:
+    xfree(d->arch.hvm_domain.msixtbl_hash);
     xfree(d->arch.hvm_domain.io_handler);
     xfree(d->arch.hvm_domain.params);
     return rc;
@@ -578,11 +1119,14 @@ int hvm_domain_initialise(struct domain *d)
 
 void hvm_domain_relinquish_resources(struct domain *d)
 {
+    struct vcpu *v;
+
     if ( hvm_funcs.nhvm_domain_relinquish_resources )
         hvm_funcs.nhvm_domain_relinquish_resources(d);
 
     hvm_destroy_ioreq_page(d, &d->arch.hvm_domain.ioreq);
-    hvm_destroy_ioreq_page(d, &d->arch.hvm_domain.buf_ioreq);
+    hvm_destroy_buf_ioreq_pages(d);
+    hvm_destroy_all_ioreq_servers(d);
 
     msixtbl_pt_cleanup(d);
 
@@ -594,6 +1138,10 @@ void hvm_domain_relinquish_resources(struct domain *d)
         pmtimer_deinit(d);
         hpet_deinit(d);
     }
+    viridian_domain_deinit(d);
+
+    for_each_vcpu ( d, v )
+        vpmu_release_sample_page(v);
 
     xfree(d->arch.hvm_domain.io_handler);
     xfree(d->arch.hvm_domain.params);
@@ -606,6 +1154,7 @@ void hvm_domain_destroy(struct domain *d)
     stdvga_deinit(d);
     vioapic_deinit(d);
     hvm_destroy_cacheattr_region_list(d);
+    xfree(d->arch.hvm_domain.msixtbl_hash);
 }
 
 static int hvm_save_tsc_adjust(struct domain *d, hvm_domain_context_t *h)
@@ -974,8 +1523,8 @@ static int hvm_save_cpu_xsave_states(struct domain *d, hvm_domain_context_t *h)
         ctxt->xfeature_mask = xfeature_mask;
         ctxt->xcr0 = v->arch.xcr0;
         ctxt->xcr0_accum = v->arch.xcr0_accum;
-        memcpy(&ctxt->save_area, v->arch.xsave_area,
-               size - offsetof(struct hvm_hw_cpu_xsave, save_area));
+        expand_xsave_states(v, &ctxt->save_area,
+                            size - offsetof(struct hvm_hw_cpu_xsave, save_area));
     }
 
     return 0;
@@ -1041,9 +1590,13 @@ static int hvm_load_cpu_xsave_states(struct domain *d, hvm_domain_context_t *h)
     ctxt = (struct hvm_hw_cpu_xsave *)&h->data[h->cur];
     h->cur += desc->length;
 
-    err = validate_xstate(ctxt->xcr0, ctxt->xcr0_accum,
-                          ctxt->save_area.xsave_hdr.xstate_bv,
-                          ctxt->xfeature_mask);
+    /* Images are always in the standard layout: XCOMP_BV must be clear. */
+    if ( ctxt->save_area.xsave_hdr.reserved[0] )
+        err = -EINVAL;
+    else
+        err = validate_xstate(ctxt->xcr0, ctxt->xcr0_accum,
+                              ctxt->save_area.xsave_hdr.xstate_bv,
+                              ctxt->xfeature_mask);
     if ( err )
     {
         printk(XENLOG_G_WARNING
@@ -1091,6 +1644,7 @@ int hvm_vcpu_initialise(struct vcpu *v)
 {
     int rc;
     struct domain *d = v->domain;
+    struct hvm_ioreq_server *s;
     domid_t dm_domid = d->arch.hvm_domain.params[HVM_PARAM_DM_DOMAIN];
 
     hvm_asid_flush_vcpu(v);
@@ -1127,8 +1681,22 @@ int hvm_vcpu_initialise(struct vcpu *v)
         get_ioreq(v)->vp_eport = v->arch.hvm_vcpu.xen_port;
     spin_unlock(&d->arch.hvm_domain.ioreq.lock);
 
-    spin_lock_init(&v->arch.hvm_vcpu.tm_lock);
-    INIT_LIST_HEAD(&v->arch.hvm_vcpu.tm_list);
+    /* Connect to the ioreq servers already present. */
+    rc = 0;
+    spin_lock(&d->arch.hvm_domain.ioreq_server_lock);
+    list_for_each_entry ( s, &d->arch.hvm_domain.ioreq_server_list,
+                          list_entry )
+        if ( (rc = hvm_ioreq_server_add_vcpu(s, v)) != 0 )
+            break;
+    spin_unlock(&d->arch.hvm_domain.ioreq_server_lock);
+    if ( rc != 0 )
+        goto fail4;
+
+    pt_vcpu_init(v);
+
+    rc = viridian_vcpu_init(v);
+    if ( rc != 0 )
+        goto fail4;
 
     v->arch.hvm_vcpu.inject_trap.vector = -1;
 
@@ -1167,6 +1735,24 @@ int hvm_vcpu_initialise(struct vcpu *v)
  fail5:
     free_compat_arg_xlat(v);
  fail4:
+    viridian_vcpu_destroy(v);
+    spin_lock(&d->arch.hvm_domain.ioreq_server_lock);
+    list_for_each_entry ( s, &d->arch.hvm_domain.ioreq_server_list,
+                          list_entry )
+        hvm_ioreq_server_remove_vcpu(s, v);
+    spin_unlock(&d->arch.hvm_domain.ioreq_server_lock);
+    if ( v->vcpu_id == 0 &&
+         d->arch.hvm_domain.params[HVM_PARAM_BUFIOREQ_EVTCHN] )
+    {
+        free_xen_event_channel(
+            v, d->arch.hvm_domain.params[HVM_PARAM_BUFIOREQ_EVTCHN]);
+        d->arch.hvm_domain.params[HVM_PARAM_BUFIOREQ_EVTCHN] = 0;
+    }
+    if ( v->arch.hvm_vcpu.xen_port )
+    {
+        free_xen_event_channel(v, v->arch.hvm_vcpu.xen_port);
+        v->arch.hvm_vcpu.xen_port = 0;
+    }
     nestedhvm_vcpu_destroy(v);
  fail3:
     hvm_funcs.vcpu_destroy(v);
@@ -1186,6 +1772,8 @@ void hvm_vcpu_destroy(struct vcpu *v)
     hvm_vcpu_cacheattr_destroy(v);
     vlapic_destroy(v);
     hvm_funcs.vcpu_destroy(v);
+    pt_vcpu_destroy(v);
+    viridian_vcpu_destroy(v);
 
     /* Event channel is already freed by evtchn_destroy(). */
     /*free_xen_event_channel(v, v->arch.hvm_vcpu.xen_port);*/
@@ -1217,7 +1805,10 @@ void hvm_vcpu_down(struct vcpu *v)
 
 bool_t hvm_send_assist_req(struct vcpu *v)
 {
+    struct hvm_ioreq_server *s;
     ioreq_t *p;
+    uint8_t type;
+    uint64_t addr;
 
     if ( unlikely(!vcpu_start_shutdown_deferral(v)) )
         return 0; /* implicitly bins the i/o operation */
@@ -1231,6 +1822,37 @@ bool_t hvm_send_assist_req(struct vcpu *v)
         return 0;
     }
 
+    s = hvm_select_ioreq_server(v->domain, p, &type, &addr);
+    if ( s != NULL )
+    {
+        ioreq_t *sp = hvm_ioreq_server_slot(s, v);
+        int port = s->ports[v->vcpu_id];
+
+        if ( unlikely(sp->state != STATE_IOREQ_NONE) )
+        {
+            gdprintk(XENLOG_ERR, "Ioreq server %u set bad IO state %d.\n",
+                     s->id, sp->state);
+            domain_crash(v->domain);
+            return 0;
+        }
+
+        sp->addr = addr;
+        sp->data = p->data;
+        sp->count = p->count;
+        sp->size = p->size;
+        sp->dir = p->dir;
+        sp->df = p->df;
+        sp->data_is_ptr = p->data_is_ptr;
+        sp->type = type;
+        v->arch.hvm_vcpu.ioreq_server = s;
+
+        prepare_wait_on_xen_event_channel(port);
+        sp->state = STATE_IOREQ_READY;
+        notify_via_xen_event_channel(v->domain, port);
+
+        return 1;
+    }
+
     prepare_wait_on_xen_event_channel(v->arch.hvm_vcpu.xen_port);
 
     /*
@@ -3378,8 +4000,12 @@ int hvm_do_hypercall(struct cpu_user_regs *regs)
         return HVM_HCALL_completed;
     }
 
+    vcpu_perf_incra(hypercalls, eax);
     curr->arch.hvm_vcpu.hcall_preempted = 0;
 
+    if ( unlikely(hypercall_stats_enabled) )
+        hypercall_stats_start(curr, eax);
+
     if ( mode == 8 )
     {
         HVM_DBG_LOG(DBG_LEVEL_HCALL, "hcall%u(%lx, %lx, %lx, %lx, %lx, %lx)",
@@ -3413,6 +4039,9 @@ int hvm_do_hypercall(struct cpu_user_regs *regs)
     HVM_DBG_LOG(DBG_LEVEL_HCALL, "hcall%u -> %lx",
                 eax, (unsigned long)regs->eax);
 
+    if ( unlikely(hypercall_stats_enabled) )
+        hypercall_stats_end(curr, curr->arch.hvm_vcpu.hcall_preempted);
+
     if ( curr->arch.hvm_vcpu.hcall_preempted )
         return HVM_HCALL_preempted;
 
@@ -3738,6 +4367,164 @@ static int hvmop_inject_msi(
     return rc;
 }
 
+static int hvmop_fast_io(
+    unsigned long op, XEN_GUEST_HANDLE_PARAM(xen_hvm_fast_io_t) uop)
+{
+    struct xen_hvm_fast_io a;
+    struct domain *d;
+    int rc;
+
+    if ( copy_from_guest(&a, uop, 1) )
+        return -EFAULT;
+
+    rc = rcu_lock_remote_domain_by_id(a.domid, &d);
+    if ( rc != 0 )
+        return rc;
+
+    rc = -EINVAL;
+    if ( !is_hvm_domain(d) )
+        goto out;
+
+    rc = xsm_hvm_param(XSM_TARGET, d, op);
+    if ( rc )
+        goto out;
+
+    rc = (op == HVMOP_set_fast_io) ? hvm_set_fast_io(d, &a)
+                                   : hvm_get_fast_io(d, &a);
+    if ( !rc && __copy_to_guest(uop, &a, 1) )
+        rc = -EFAULT;
+
+ out:
+    rcu_unlock_domain(d);
+    return rc;
+}
+
+static int hvmop_create_ioreq_server(
+    XEN_GUEST_HANDLE_PARAM(xen_hvm_create_ioreq_server_t) uop)
+{
+    struct domain *curr_d = current->domain;
+    xen_hvm_create_ioreq_server_t op;
+    struct domain *d;
+    int rc;
+
+    if ( copy_from_guest(&op, uop, 1) )
+        return -EFAULT;
+
+    rc = rcu_lock_remote_domain_by_id(op.domid, &d);
+    if ( rc != 0 )
+        return rc;
+
+    rc = -EINVAL;
+    if ( !is_hvm_domain(d) )
+        goto out;
+
+    rc = xsm_hvm_param(XSM_TARGET, d, HVMOP_create_ioreq_server);
+    if ( rc )
+        goto out;
+
+    rc = hvm_create_ioreq_server(d, curr_d->domain_id, op.ioreq_pfn, &op.id);
+    if ( !rc && __copy_to_guest(uop, &op, 1) )
+        rc = -EFAULT;
+
+ out:
+    rcu_unlock_domain(d);
+    return rc;
+}
+
+static int hvmop_map_io_range_to_ioreq_server(
+    unsigned long op, XEN_GUEST_HANDLE_PARAM(xen_hvm_io_range_t) uop)
+{
+    xen_hvm_io_range_t a;
+    struct domain *d;
+    int rc;
+
+    if ( copy_from_guest(&a, uop, 1) )
+        return -EFAULT;
+
+    rc = rcu_lock_remote_domain_by_id(a.domid, &d);
+    if ( rc != 0 )
+        return rc;
+
+    rc = -EINVAL;
+    if ( !is_hvm_domain(d) )
+        goto out;
+
+    rc = xsm_hvm_param(XSM_TARGET, d, op);
+    if ( rc )
+        goto out;
+
+    rc = hvm_map_io_range_to_ioreq_server(
+        d, a.id, op == HVMOP_map_io_range_to_ioreq_server,
+        a.type, a.start, a.end);
+
+ out:
+    rcu_unlock_domain(d);
+    return rc;
+}
+
+static int hvmop_vpmu_sampling(
+    XEN_GUEST_HANDLE_PARAM(xen_hvm_vpmu_sampling_t) uop)
+{
+    xen_hvm_vpmu_sampling_t op;
+    struct domain *d;
+    struct vcpu *v;
+    int rc;
+
+    if ( copy_from_guest(&op, uop, 1) )
+        return -EFAULT;
+
+    d = rcu_lock_domain_by_any_id(op.domid);
+    if ( d == NULL )
+        return -ESRCH;
+
+    rc = -EINVAL;
+    if ( !is_hvm_domain(d) )
+        goto out;
+
+    rc = xsm_hvm_param(XSM_TARGET, d, HVMOP_vpmu_sampling);
+    if ( rc != 0 )
+        goto out;
+
+    rc = -ENOENT;
+    if ( op.vcpu >= d->max_vcpus || (v = d->vcpu[op.vcpu]) == NULL )
+        goto out;
+
+    rc = vpmu_set_sample_page(v, op.gfn);
+
+ out:
+    rcu_unlock_domain(d);
+    return rc;
+}
+
+static int hvmop_destroy_ioreq_server(
+    XEN_GUEST_HANDLE_PARAM(xen_hvm_destroy_ioreq_server_t) uop)
+{
+    xen_hvm_destroy_ioreq_server_t op;
+    struct domain *d;
+    int rc;
+
+    if ( copy_from_guest(&op, uop, 1) )
+        return -EFAULT;
+
+    rc = rcu_lock_remote_domain_by_id(op.domid, &d);
+    if ( rc != 0 )
+        return rc;
+
+    rc = -EINVAL;
+    if ( !is_hvm_domain(d) )
+        goto out;
+
+    rc = xsm_hvm_param(XSM_TARGET, d, HVMOP_destroy_ioreq_server);
+    if ( rc )
+        goto out;
+
+    rc = hvm_destroy_ioreq_server(d, op.id);
+
+ out:
+    rcu_unlock_domain(d);
+    return rc;
+}
+
 static int hvmop_flush_tlb_all(void)
 {
     struct domain *d = current->domain;
@@ -3846,8 +4633,17 @@ long do_hvm_op(unsigned long op, XEN_GUEST_HANDLE_PARAM(void) arg)
                 spin_unlock(&iorp->lock);
                 break;
             case HVM_PARAM_BUFIOREQ_PFN: 
-                iorp = &d->arch.hvm_domain.buf_ioreq;
-                rc = hvm_set_ioreq_page(d, iorp, a.value);
+                rc = hvm_set_buf_ioreq_pages(d, a.value);
+                break;
+            case HVM_PARAM_BUFIOREQ_NR_PAGES:
+                if ( a.value < 1 || a.value > IOREQ_BUFFER_MAX_PAGES )
+                    rc = -EINVAL;
+                else if ( d->arch.hvm_domain.buf_ioreq.va != NULL )
+                    rc = -EBUSY;
+                break;
+            case HVM_PARAM_BUFIOREQ_LAZY_KICK:
+                if ( a.value > 1 )
+                    rc = -EINVAL;
                 break;
             case HVM_PARAM_CALLBACK_IRQ:
                 hvm_set_callback_via(d, a.value);
@@ -4055,6 +4851,32 @@ long do_hvm_op(unsigned long op, XEN_GUEST_HANDLE_PARAM(void) arg)
             guest_handle_cast(arg, xen_hvm_inject_msi_t));
         break;
 
+    case HVMOP_set_fast_io:
+    case HVMOP_get_fast_io:
+        rc = hvmop_fast_io(op, guest_handle_cast(arg, xen_hvm_fast_io_t));
+        break;
+
+    case HVMOP_create_ioreq_server:
+        rc = hvmop_create_ioreq_server(
+            guest_handle_cast(arg, xen_hvm_create_ioreq_server_t));
+        break;
+
+    case HVMOP_map_io_range_to_ioreq_server:
+    case HVMOP_unmap_io_range_from_ioreq_server:
+        rc = hvmop_map_io_range_to_ioreq_server(
+            op, guest_handle_cast(arg, xen_hvm_io_range_t));
+        break;
+
+    case HVMOP_destroy_ioreq_server:
+        rc = hvmop_destroy_ioreq_server(
+            guest_handle_cast(arg, xen_hvm_destroy_ioreq_server_t));
+        break;
+
+    case HVMOP_vpmu_sampling:
+        rc = hvmop_vpmu_sampling(
+            guest_handle_cast(arg, xen_hvm_vpmu_sampling_t));
+        break;
+
     case HVMOP_set_pci_link_route:
         rc = hvmop_set_pci_link_route(
             guest_handle_cast(arg, xen_hvm_set_pci_link_route_t));
@@ -4341,6 +5163,16 @@ long do_hvm_op(unsigned long op, XEN_GUEST_HANDLE_PARAM(void) arg)
             goto param_fail5;
             
         rc = p2m_set_mem_access(d, a.first_pfn, a.nr, a.hvmmem_access);
+        if ( rc > 0 )
+        {
+            /* Preempted: carry on from where we got to */
+            a.first_pfn += rc;
+            a.nr -= rc;
+            if ( __copy_to_guest(arg, &a, 1) )
+                rc = -EFAULT;
+            else
+                rc = -EAGAIN;
+        }
 
     param_fail5:
         rcu_unlock_domain(d);
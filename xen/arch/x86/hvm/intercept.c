@@ -367,6 +367,197 @@ void relocate_io_handler(
             handler->hdl_list[i].addr = new_addr;
 }
 
+static bool_t fast_io_notifies(uint8_t mode)
+{
+    return mode == HVMOP_FAST_IO_latch || mode == HVMOP_FAST_IO_doorbell ||
+           mode == HVMOP_FAST_IO_doorbell_match;
+}
+
+/*
+ * Complete single accesses to device model registered fast-path ranges
+ * without a round trip to the device model. Notifications go out through
+ * the range's event channel once the lock is dropped.
+ */
+int hvm_fast_io_intercept(ioreq_t *p)
+{
+    struct domain *d = current->domain;
+    struct hvm_fast_io *fio = &d->arch.hvm_domain.fast_io;
+    uint8_t space = (p->type == IOREQ_TYPE_PIO) ? HVMOP_FAST_IO_PORT
+                                                : HVMOP_FAST_IO_MMIO;
+    uint64_t mask = (p->size < 8) ? (1ULL << (p->size * 8)) - 1 : ~0ULL;
+    int rc = X86EMUL_UNHANDLEABLE, port = -1;
+    unsigned int i;
+
+    if ( !fio->nr || p->data_is_ptr || p->count != 1 )
+        return X86EMUL_UNHANDLEABLE;
+
+    spin_lock(&fio->lock);
+
+    for ( i = 0; i < fio->nr; i++ )
+    {
+        struct hvm_fast_io_range *r = &fio->range[i];
+
+        if ( r->space != space || p->addr < r->start ||
+             p->addr + p->size > r->start + r->size )
+            continue;
+
+        switch ( r->mode )
+        {
+        case HVMOP_FAST_IO_const:
+            if ( p->dir == IOREQ_READ )
+                p->data = r->value & mask;
+            rc = X86EMUL_OKAY;
+            break;
+        case HVMOP_FAST_IO_latch:
+            if ( p->dir == IOREQ_READ )
+                p->data = r->value & mask;
+            else
+            {
+                r->value = p->data & mask;
+                port = r->port;
+            }
+            rc = X86EMUL_OKAY;
+            break;
+        case HVMOP_FAST_IO_doorbell_match:
+            if ( (p->data & mask) != (r->value & mask) )
+                break;
+            /* fall through */
+        case HVMOP_FAST_IO_doorbell:
+            if ( p->dir == IOREQ_WRITE )
+            {
+                port = r->port;
+                rc = X86EMUL_OKAY;
+            }
+            break;
+        }
+        break;
+    }
+
+    spin_unlock(&fio->lock);
+
+    if ( port >= 0 )
+        notify_via_xen_event_channel(d, port);
+
+    return rc;
+}
+
+static int fast_io_find(struct hvm_fast_io *fio, uint8_t space,
+                        unsigned long start, unsigned long size)
+{
+    unsigned int i;
+
+    for ( i = 0; i < fio->nr; i++ )
+        if ( fio->range[i].space == space && fio->range[i].start == start &&
+             fio->range[i].size == size )
+            return i;
+
+    return -1;
+}
+
+int hvm_set_fast_io(struct domain *d, struct xen_hvm_fast_io *op)
+{
+    struct hvm_fast_io *fio = &d->arch.hvm_domain.fast_io;
+    struct hvm_fast_io_range *r;
+    unsigned int j;
+    int i, rc = 0;
+
+    if ( op->space > HVMOP_FAST_IO_MMIO ||
+         op->mode > HVMOP_FAST_IO_doorbell_match ||
+         !op->size || op->start + op->size < op->start ||
+         (op->space == HVMOP_FAST_IO_PORT &&
+          op->start + op->size > 0x10000) ||
+         !d->vcpu || !d->vcpu[0] )
+        return -EINVAL;
+
+    spin_lock(&fio->lock);
+
+    i = fast_io_find(fio, op->space, op->start, op->size);
+
+    if ( op->mode == HVMOP_FAST_IO_remove )
+    {
+        if ( i < 0 )
+            rc = -ENOENT;
+        else
+        {
+            if ( fio->range[i].port >= 0 )
+                free_xen_event_channel(d->vcpu[0], fio->range[i].port);
+            fio->range[i] = fio->range[--fio->nr];
+        }
+        goto out;
+    }
+
+    if ( i < 0 )
+    {
+        for ( j = 0; j < fio->nr; j++ )
+            if ( fio->range[j].space == op->space &&
+                 op->start < fio->range[j].start + fio->range[j].size &&
+                 fio->range[j].start < op->start + op->size )
+            {
+                rc = -EEXIST;
+                goto out;
+            }
+
+        rc = -ENOSPC;
+        if ( fio->nr >= HVM_FAST_IO_NR )
+            goto out;
+
+        r = &fio->range[fio->nr];
+        r->space = op->space;
+        r->mode = HVMOP_FAST_IO_remove;
+        r->port = -1;
+        r->start = op->start;
+        r->size = op->size;
+    }
+    else
+        r = &fio->range[i];
+
+    if ( fast_io_notifies(op->mode) && r->port < 0 )
+    {
+        rc = alloc_unbound_xen_event_channel(d->vcpu[0],
+                                             current->domain->domain_id,
+                                             NULL);
+        if ( rc < 0 )
+            goto out;
+        r->port = rc;
+    }
+    else if ( !fast_io_notifies(op->mode) && r->port >= 0 )
+    {
+        free_xen_event_channel(d->vcpu[0], r->port);
+        r->port = -1;
+    }
+
+    r->value = op->value;
+    r->mode = op->mode;
+    if ( i < 0 )
+        fio->nr++;
+
+    op->port = (r->port >= 0) ? r->port : 0;
+    rc = 0;
+
+ out:
+    spin_unlock(&fio->lock);
+    return rc;
+}
+
+int hvm_get_fast_io(struct domain *d, struct xen_hvm_fast_io *op)
+{
+    struct hvm_fast_io *fio = &d->arch.hvm_domain.fast_io;
+    int i, rc = -ENOENT;
+
+    spin_lock(&fio->lock);
+    i = fast_io_find(fio, op->space, op->start, op->size);
+    if ( i >= 0 )
+    {
+        op->mode = fio->range[i].mode;
+        op->port = (fio->range[i].port >= 0) ? fio->range[i].port : 0;
+        op->value = fio->range[i].value;
+        rc = 0;
+    }
+    spin_unlock(&fio->lock);
+
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
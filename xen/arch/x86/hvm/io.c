@@ -49,14 +49,17 @@
 int hvm_buffered_io_send(ioreq_t *p)
 {
     struct vcpu *v = current;
-    struct hvm_ioreq_page *iorp = &v->domain->arch.hvm_domain.buf_ioreq;
+    struct hvm_domain *hd = &v->domain->arch.hvm_domain;
+    struct hvm_ioreq_page *iorp = &hd->buf_ioreq;
     buffered_iopage_t *pg = iorp->va;
+    unsigned int slots = IOREQ_BUFFER_SLOTS(hd->buf_ioreq_nr_pages);
     buf_ioreq_t bp;
     /* Timeoffset sends 64b data, but no address. Use two consecutive slots. */
     int qw = 0;
 
     /* Ensure buffered_iopage fits in a page */
     BUILD_BUG_ON(sizeof(buffered_iopage_t) > PAGE_SIZE);
+    BUILD_BUG_ON(IOREQ_BUFFER_SLOTS(1) != IOREQ_BUFFER_SLOT_NUM);
 
     /*
      * Return 0 for the cases we can't deal with:
@@ -96,21 +99,19 @@ int hvm_buffered_io_send(ioreq_t *p)
     
     spin_lock(&iorp->lock);
 
-    if ( (pg->write_pointer - pg->read_pointer) >=
-         (IOREQ_BUFFER_SLOT_NUM - qw) )
+    if ( (pg->write_pointer - pg->read_pointer) >= (slots - qw) )
     {
         /* The queue is full: send the iopacket through the normal path. */
         spin_unlock(&iorp->lock);
         return 0;
     }
     
-    memcpy(&pg->buf_ioreq[pg->write_pointer % IOREQ_BUFFER_SLOT_NUM],
-           &bp, sizeof(bp));
+    memcpy(&pg->buf_ioreq[pg->write_pointer % slots], &bp, sizeof(bp));
     
     if ( qw )
     {
         bp.data = p->data >> 32;
-        memcpy(&pg->buf_ioreq[(pg->write_pointer+1) % IOREQ_BUFFER_SLOT_NUM],
+        memcpy(&pg->buf_ioreq[(pg->write_pointer+1) % slots],
                &bp, sizeof(bp));
     }
 
@@ -118,8 +119,20 @@ int hvm_buffered_io_send(ioreq_t *p)
     wmb();
     pg->write_pointer += qw ? 2 : 1;
 
-    notify_via_xen_event_channel(v->domain,
-            v->domain->arch.hvm_domain.params[HVM_PARAM_BUFIOREQ_EVTCHN]);
+    /*
+     * A consumer which opted in to lazy kicks, and is still short of the
+     * previous one, is draining the ring and will pick this entry up too.
+     * Order the write_pointer update before sampling read_pointer, pairing
+     * with the consumer's re-check.
+     */
+    mb();
+    if ( !hd->params[HVM_PARAM_BUFIOREQ_LAZY_KICK] ||
+         (int)(pg->read_pointer - hd->buf_ioreq_kick) >= 0 )
+    {
+        hd->buf_ioreq_kick = pg->write_pointer;
+        notify_via_xen_event_channel(v->domain,
+                                     hd->params[HVM_PARAM_BUFIOREQ_EVTCHN]);
+    }
     spin_unlock(&iorp->lock);
     
     return 1;
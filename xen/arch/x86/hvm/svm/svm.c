@@ -2005,6 +2005,7 @@ static void svm_invlpg_intercept(unsigned long vaddr)
 {
     struct vcpu *curr = current;
     HVMTRACE_LONG_2D(INVLPG, 0, TRC_PAR_LONG(vaddr));
+    hvmemul_insn_xlat_flush(curr);
     paging_invlpg(curr, vaddr);
     svm_asid_g_invlpg(curr, vaddr);
 }
@@ -2172,6 +2173,7 @@ void svm_vmexit_handler(struct cpu_user_regs *regs)
     }
 
     perfc_incra(svmexits, exit_reason);
+    vcpu_perf_incra(vmexits, exit_reason);
 
     hvm_maybe_deassert_evtchn_irq();
 
@@ -36,6 +36,7 @@
 #define MAX_NUM_COUNTERS F15H_NUM_COUNTERS
 
 #define MSR_F10H_EVNTSEL_GO_SHIFT   40
+#define MSR_F10H_EVNTSEL_INT_SHIFT  20
 #define MSR_F10H_EVNTSEL_EN_SHIFT   22
 #define MSR_F10H_COUNTER_LENGTH     48
 
@@ -173,6 +174,42 @@ static int amd_vpmu_do_interrupt(struct cpu_user_regs *regs)
     return 1;
 }
 
+static int amd_vpmu_sample(struct vcpu *v, const uint64_t *reload,
+                           uint64_t *sampled)
+{
+    struct vpmu_struct *vpmu = vcpu_vpmu(v);
+    u64 ctrl, counter, done = 0;
+    unsigned int i;
+    int other = 0;
+
+    if ( !vpmu_is_set(vpmu, VPMU_CONTEXT_LOADED) )
+        return 1;
+
+    /* There is no overflow status: look for armed counters that wrapped. */
+    for ( i = 0; i < num_counters; i++ )
+    {
+        rdmsrl(ctrls[i], ctrl);
+        if ( !is_pmu_enabled(ctrl) ||
+             !(ctrl & (1ULL << MSR_F10H_EVNTSEL_INT_SHIFT)) )
+            continue;
+
+        rdmsrl(counters[i], counter);
+        if ( !is_overflowed(counter) )
+            continue;
+
+        if ( reload[i] &&
+             !wrmsr_safe(counters[i], reload[i] &
+                         ((1ULL << MSR_F10H_COUNTER_LENGTH) - 1)) )
+            done |= 1ULL << i;
+        else
+            other = 1;
+    }
+
+    *sampled = done;
+
+    return other || !done;
+}
+
 static inline void context_load(struct vcpu *v)
 {
     unsigned int i;
@@ -460,7 +497,8 @@ struct arch_vpmu_ops amd_vpmu_ops = {
     .arch_vpmu_destroy = amd_vpmu_destroy,
     .arch_vpmu_save = amd_vpmu_save,
     .arch_vpmu_load = amd_vpmu_load,
-    .arch_vpmu_dump = amd_vpmu_dump
+    .arch_vpmu_dump = amd_vpmu_dump,
+    .arch_vpmu_sample = amd_vpmu_sample
 };
 
 int svm_vpmu_initialise(struct vcpu *v, unsigned int vpmu_flags)
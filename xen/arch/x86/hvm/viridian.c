@@ -21,12 +21,23 @@
 #define VIRIDIAN_MSR_HYPERCALL                  0x40000001
 #define VIRIDIAN_MSR_VP_INDEX                   0x40000002
 #define VIRIDIAN_MSR_TIME_REF_COUNT             0x40000020
+#define VIRIDIAN_MSR_REFERENCE_TSC              0x40000021
 #define VIRIDIAN_MSR_TSC_FREQUENCY              0x40000022
 #define VIRIDIAN_MSR_APIC_FREQUENCY             0x40000023
 #define VIRIDIAN_MSR_EOI                        0x40000070
 #define VIRIDIAN_MSR_ICR                        0x40000071
 #define VIRIDIAN_MSR_TPR                        0x40000072
 #define VIRIDIAN_MSR_APIC_ASSIST                0x40000073
+#define VIRIDIAN_MSR_SCONTROL                   0x40000080
+#define VIRIDIAN_MSR_SVERSION                   0x40000081
+#define VIRIDIAN_MSR_SIEFP                      0x40000082
+#define VIRIDIAN_MSR_SIMP                       0x40000083
+#define VIRIDIAN_MSR_EOM                        0x40000084
+#define VIRIDIAN_MSR_SINT0                      0x40000090
+#define VIRIDIAN_MSR_SINT15                     0x4000009F
+#define VIRIDIAN_MSR_STIMER0_CONFIG             0x400000B0
+#define VIRIDIAN_MSR_STIMER0_COUNT              0x400000B1
+#define VIRIDIAN_MSR_STIMER3_COUNT              0x400000B7
 
 /* Viridian Hypercall Status Codes. */
 #define HV_STATUS_SUCCESS                       0x0000
@@ -37,20 +48,71 @@
 
 /* Viridian CPUID 4000003, Viridian MSR availability. */
 #define CPUID3A_MSR_REF_COUNT   (1 << 1)
+#define CPUID3A_MSR_SYNIC       (1 << 2)
+#define CPUID3A_MSR_SYNTIMER    (1 << 3)
 #define CPUID3A_MSR_APIC_ACCESS (1 << 4)
 #define CPUID3A_MSR_HYPERCALL   (1 << 5)
 #define CPUID3A_MSR_VP_INDEX    (1 << 6)
+#define CPUID3A_MSR_REF_TSC     (1 << 9)
 #define CPUID3A_MSR_FREQ        (1 << 11)
 
 /* Viridian CPUID 4000004, Implementation Recommendations. */
 #define CPUID4A_MSR_BASED_APIC  (1 << 3)
 #define CPUID4A_RELAX_TIMER_INT (1 << 5)
+#define CPUID4A_DEPRECATE_AEOI  (1 << 9)
 
 /* Viridian CPUID 4000006, Implementation HW features detected and in use. */
 #define CPUID6A_APIC_OVERLAY    (1 << 0)
 #define CPUID6A_MSR_BITMAPS     (1 << 1)
 #define CPUID6A_NESTED_PAGING   (1 << 3)
 
+/* Partition reference TSC page layout. */
+typedef struct _HV_REFERENCE_TSC_PAGE
+{
+    uint32_t TscSequence;
+    uint32_t Reserved1;
+    uint64_t TscScale;
+    int64_t  TscOffset;
+    uint64_t Reserved2[509];
+} HV_REFERENCE_TSC_PAGE;
+
+/* SynIC message slot layout: one 256 byte slot per SINT in the SIM page. */
+#define HvMessageTypeNone           0x00000000
+#define HvMessageTimerExpired       0x80000010
+
+#define HV_MESSAGE_FLAG_PENDING     (1 << 0)
+
+typedef struct _HV_MESSAGE_HEADER
+{
+    uint32_t MessageType;
+    uint8_t  PayloadSize;
+    uint8_t  MessageFlags;
+    uint8_t  Reserved[2];
+    uint64_t OriginationId;
+} HV_MESSAGE_HEADER;
+
+typedef struct _HV_TIMER_MESSAGE_PAYLOAD
+{
+    uint32_t TimerIndex;
+    uint32_t Reserved;
+    uint64_t ExpirationTime;
+    uint64_t DeliveryTime;
+} HV_TIMER_MESSAGE_PAYLOAD;
+
+typedef struct _HV_MESSAGE
+{
+    HV_MESSAGE_HEADER Header;
+    uint64_t Payload[30];
+} HV_MESSAGE;
+
+/*
+ * Periodic synthetic timers are not allowed to fire more often than every
+ * 100us, as for other emulated timers (see create_periodic_time()).
+ */
+#define STIMER_MIN_PERIOD           1000ull
+/* Longest single Xen timer deadline; later expiries re-arm on the way. */
+#define STIMER_MAX_DELTA            (1ull << 40)
+
 int cpuid_viridian_leaves(unsigned int leaf, unsigned int *eax,
                           unsigned int *ebx, unsigned int *ecx,
                           unsigned int *edx)
@@ -89,9 +151,12 @@ int cpuid_viridian_leaves(unsigned int leaf, unsigned int *eax,
     case 3:
         /* Which hypervisor MSRs are available to the guest */
         *eax = (CPUID3A_MSR_REF_COUNT   |
+                CPUID3A_MSR_SYNIC       |
+                CPUID3A_MSR_SYNTIMER    |
                 CPUID3A_MSR_APIC_ACCESS |
                 CPUID3A_MSR_HYPERCALL   |
                 CPUID3A_MSR_VP_INDEX    |
+                CPUID3A_MSR_REF_TSC     |
                 CPUID3A_MSR_FREQ);
         break;
     case 4:
@@ -99,7 +164,8 @@ int cpuid_viridian_leaves(unsigned int leaf, unsigned int *eax,
         if ( (d->arch.hvm_domain.viridian.guest_os_id.raw == 0) ||
              (d->arch.hvm_domain.viridian.guest_os_id.fields.os < 4) )
             break;
-        *eax = CPUID4A_RELAX_TIMER_INT;
+        /* SINT auto-EOI is not implemented. */
+        *eax = CPUID4A_RELAX_TIMER_INT | CPUID4A_DEPRECATE_AEOI;
         if ( !cpu_has_vmx_apic_reg_virt )
             *eax |= CPUID4A_MSR_BASED_APIC;
         *ebx = 2047; /* long spin count */
@@ -222,10 +288,247 @@ static void initialize_apic_assist(struct vcpu *v)
     put_page_and_type(page);
 }
 
+static uint64_t time_ref_count(struct vcpu *v)
+{
+    return hvm_get_guest_time(v) / 100;
+}
+
+static void update_reference_tsc(struct domain *d, bool_t initialize)
+{
+    unsigned long gmfn = d->arch.hvm_domain.viridian.reference_tsc.fields.pfn;
+    struct page_info *page = get_page_from_gfn(d, gmfn, NULL, P2M_ALLOC);
+    HV_REFERENCE_TSC_PAGE *p;
+    uint32_t seq;
+
+    if ( !page || !get_page_type(page, PGT_writable_page) )
+    {
+        if ( page )
+            put_page(page);
+        gdprintk(XENLOG_WARNING, "Bad GMFN %lx (MFN %lx)\n", gmfn,
+                 page ? page_to_mfn(page) : INVALID_MFN);
+        return;
+    }
+
+    p = __map_domain_page(page);
+
+    if ( initialize )
+        clear_page(p);
+
+    /*
+     * The page is only usable if guest TSC is a fixed multiple of guest
+     * time. If the host TSC is not invariant, or rdtsc is being emulated
+     * anyway, a sequence number of zero makes the guest fall back to the
+     * TIME_REF_COUNT MSR.
+     */
+    if ( !host_tsc_is_safe() || d->arch.vtsc )
+    {
+        p->TscSequence = 0;
+        goto out;
+    }
+
+    /*
+     * ReferenceTime = ((RDTSC() * TscScale) >> 64) + TscOffset, in 100ns
+     * units. Guest TSC and guest time both start from zero so no offset is
+     * needed for the page to agree with TIME_REF_COUNT.
+     */
+    p->TscScale = ((10000ul << 32) / d->arch.tsc_khz) << 32;
+    p->TscOffset = 0;
+
+    smp_wmb();
+
+    seq = p->TscSequence + 1;
+    if ( seq == 0xFFFFFFFF || seq == 0 ) /* Avoid both 'invalid' values */
+        seq = 1;
+    p->TscSequence = seq;
+
+ out:
+    unmap_domain_page(p);
+
+    put_page_and_type(page);
+}
+
+/*
+ * Post a timer expiry message to the SIM page slot of the timer's SINT
+ * and raise the SINT vector. If the slot is still occupied the message is
+ * left pending, the slot is flagged and delivery is retried on EOM.
+ * Called with the vcpu viridian lock held.
+ */
+static void stimer_deliver(struct vcpu *v, unsigned int i)
+{
+    struct viridian_synic *vv = v->arch.hvm_vcpu.viridian.synic;
+    struct viridian_stimer *vs = &vv->stimer[i];
+    unsigned int sintx = vs->config.fields.sintx;
+    union viridian_sint sint = vv->sint[sintx];
+    HV_TIMER_MESSAGE_PAYLOAD *payload;
+    HV_MESSAGE *msg;
+
+    if ( !test_bit(i, &vv->stimer_pending) )
+        return;
+
+    /* Messages which cannot be delivered at all are dropped. */
+    if ( !vv->scontrol.fields.enabled || vv->simp_va == NULL ||
+         sint.fields.mask || sint.fields.vector < 16 )
+    {
+        clear_bit(i, &vv->stimer_pending);
+        return;
+    }
+
+    msg = (HV_MESSAGE *)vv->simp_va + sintx;
+
+    if ( read_atomic(&msg->Header.MessageType) != HvMessageTypeNone )
+    {
+        msg->Header.MessageFlags |= HV_MESSAGE_FLAG_PENDING;
+        /* The guest may have drained the slot before seeing the flag. */
+        smp_mb();
+        if ( read_atomic(&msg->Header.MessageType) != HvMessageTypeNone )
+            return;
+    }
+
+    msg->Header.PayloadSize = sizeof(*payload);
+    msg->Header.MessageFlags = 0;
+    msg->Header.OriginationId = 0;
+
+    payload = (HV_TIMER_MESSAGE_PAYLOAD *)msg->Payload;
+    payload->TimerIndex = i;
+    payload->Reserved = 0;
+    payload->ExpirationTime = vs->msg_expiration;
+    payload->DeliveryTime = time_ref_count(v);
+
+    smp_wmb();
+    write_atomic(&msg->Header.MessageType, HvMessageTimerExpired);
+
+    clear_bit(i, &vv->stimer_pending);
+    perfc_incr(mshv_stimer_message);
+
+    vlapic_set_irq(vcpu_vlapic(v), sint.fields.vector, 0);
+}
+
+static void stimer_set_timer(struct viridian_stimer *vs, uint64_t now)
+{
+    int64_t delta = vs->expiration - now;
+
+    if ( delta < 0 )
+        delta = 0;
+    else if ( delta > STIMER_MAX_DELTA )
+        delta = STIMER_MAX_DELTA;
+
+    set_timer(&vs->timer, NOW() + delta * 100);
+}
+
+static uint64_t stimer_period(const struct viridian_stimer *vs)
+{
+    return max_t(uint64_t, vs->count, STIMER_MIN_PERIOD);
+}
+
+static void stimer_start(struct viridian_stimer *vs)
+{
+    uint64_t now = time_ref_count(vs->v);
+
+    /* Periodic timers count relative to now, one-shot ones are absolute. */
+    vs->expiration = vs->config.fields.periodic ? now + stimer_period(vs)
+                                                : vs->count;
+    stimer_set_timer(vs, now);
+}
+
+static void stimer_expire(void *data)
+{
+    struct viridian_stimer *vs = data;
+    struct vcpu *v = vs->v;
+    struct viridian_synic *vv = v->arch.hvm_vcpu.viridian.synic;
+    unsigned int i = vs - vv->stimer;
+    uint64_t now;
+
+    spin_lock(&vv->lock);
+
+    if ( !vs->config.fields.enabled )
+        goto out;
+
+    now = time_ref_count(v);
+    if ( (int64_t)(vs->expiration - now) > 0 )
+    {
+        /* Deadline was clamped by stimer_set_timer(); not yet due. */
+        stimer_set_timer(vs, now);
+        goto out;
+    }
+
+    vs->msg_expiration = vs->expiration;
+    set_bit(i, &vv->stimer_pending);
+
+    if ( vs->config.fields.periodic )
+    {
+        uint64_t period = stimer_period(vs);
+
+        /* Skip any periods missed while the vcpu was descheduled. */
+        vs->expiration += ((now - vs->expiration) / period + 1) * period;
+        stimer_set_timer(vs, now);
+    }
+    else
+        vs->config.fields.enabled = 0;
+
+    stimer_deliver(v, i);
+
+ out:
+    spin_unlock(&vv->lock);
+}
+
+static void update_simp(struct vcpu *v)
+{
+    struct viridian_synic *vv = v->arch.hvm_vcpu.viridian.synic;
+    struct page_info *page = NULL, *old_page;
+    void *va = NULL, *old_va;
+
+    if ( vv->simp.fields.enabled &&
+         prepare_ring_for_helper(v->domain, vv->simp.fields.pfn,
+                                 &page, &va) )
+        gdprintk(XENLOG_WARNING, "Bad SIMP GMFN %lx\n",
+                 (unsigned long)vv->simp.fields.pfn);
+
+    spin_lock(&vv->lock);
+    old_page = vv->simp_page;
+    old_va = vv->simp_va;
+    vv->simp_page = page;
+    vv->simp_va = va;
+    spin_unlock(&vv->lock);
+
+    destroy_ring_for_helper(&old_va, old_page);
+}
+
+static void wrmsr_stimer(struct vcpu *v, uint32_t idx, uint64_t val)
+{
+    struct viridian_synic *vv = v->arch.hvm_vcpu.viridian.synic;
+    struct viridian_stimer *vs =
+        &vv->stimer[(idx - VIRIDIAN_MSR_STIMER0_CONFIG) / 2];
+
+    spin_lock(&vv->lock);
+
+    stop_timer(&vs->timer);
+
+    if ( !(idx & 1) )
+        vs->config.raw = val;
+    else
+    {
+        vs->count = val;
+        if ( vs->count == 0 )
+            vs->config.fields.enabled = 0;
+        else if ( vs->config.fields.auto_enable )
+            vs->config.fields.enabled = 1;
+    }
+
+    /* A timer without a count or a SINT can never expire. */
+    if ( vs->count == 0 || vs->config.fields.sintx == 0 )
+        vs->config.fields.enabled = 0;
+
+    if ( vs->config.fields.enabled )
+        stimer_start(vs);
+
+    spin_unlock(&vv->lock);
+}
+
 int wrmsr_viridian_regs(uint32_t idx, uint64_t val)
 {
     struct vcpu *v = current;
     struct domain *d = v->domain;
+    struct viridian_synic *synic = v->arch.hvm_vcpu.viridian.synic;
 
     if ( !is_viridian_domain(d) )
         return 0;
@@ -280,6 +583,54 @@ int wrmsr_viridian_regs(uint32_t idx, uint64_t val)
             initialize_apic_assist(v);
         break;
 
+    case VIRIDIAN_MSR_REFERENCE_TSC:
+        perfc_incr(mshv_wrmsr_tsc_msr);
+        d->arch.hvm_domain.viridian.reference_tsc.raw = val;
+        if ( d->arch.hvm_domain.viridian.reference_tsc.fields.enabled )
+            update_reference_tsc(d, 1);
+        break;
+
+    case VIRIDIAN_MSR_SCONTROL:
+        perfc_incr(mshv_wrmsr_synic);
+        synic->scontrol.raw = val;
+        break;
+
+    case VIRIDIAN_MSR_SVERSION:
+        return 0;
+
+    case VIRIDIAN_MSR_SIEFP:
+        perfc_incr(mshv_wrmsr_synic);
+        /* No events are signalled, so the page is never written. */
+        synic->siefp.raw = val;
+        break;
+
+    case VIRIDIAN_MSR_SIMP:
+        perfc_incr(mshv_wrmsr_synic);
+        synic->simp.raw = val;
+        update_simp(v);
+        break;
+
+    case VIRIDIAN_MSR_EOM: {
+        unsigned int i;
+
+        perfc_incr(mshv_wrmsr_eom);
+        spin_lock(&synic->lock);
+        for ( i = 0; i < VIRIDIAN_STIMER_NR; i++ )
+            stimer_deliver(v, i);
+        spin_unlock(&synic->lock);
+        break;
+    }
+
+    case VIRIDIAN_MSR_SINT0 ... VIRIDIAN_MSR_SINT15:
+        perfc_incr(mshv_wrmsr_synic);
+        synic->sint[idx - VIRIDIAN_MSR_SINT0].raw = val;
+        break;
+
+    case VIRIDIAN_MSR_STIMER0_CONFIG ... VIRIDIAN_MSR_STIMER3_COUNT:
+        perfc_incr(mshv_wrmsr_stimer);
+        wrmsr_stimer(v, idx, val);
+        break;
+
     default:
         return 0;
     }
@@ -291,6 +642,7 @@ int rdmsr_viridian_regs(uint32_t idx, uint64_t *val)
 {
     struct vcpu *v = current;
     struct domain *d = v->domain;
+    struct viridian_synic *synic = v->arch.hvm_vcpu.viridian.synic;
     
     if ( !is_viridian_domain(d) )
         return 0;
@@ -314,7 +666,7 @@ int rdmsr_viridian_regs(uint32_t idx, uint64_t *val)
 
     case VIRIDIAN_MSR_TIME_REF_COUNT:
         perfc_incr(mshv_rdmsr_time_ref_count);
-        *val = hvm_get_guest_time(v) / 100;
+        *val = time_ref_count(v);
         break;
 
     case VIRIDIAN_MSR_TSC_FREQUENCY:
@@ -343,6 +695,50 @@ int rdmsr_viridian_regs(uint32_t idx, uint64_t *val)
         *val = v->arch.hvm_vcpu.viridian.apic_assist.raw;
         break;
 
+    case VIRIDIAN_MSR_REFERENCE_TSC:
+        perfc_incr(mshv_rdmsr_tsc_msr);
+        *val = d->arch.hvm_domain.viridian.reference_tsc.raw;
+        break;
+
+    case VIRIDIAN_MSR_SCONTROL:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = synic->scontrol.raw;
+        break;
+
+    case VIRIDIAN_MSR_SVERSION:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = 1;
+        break;
+
+    case VIRIDIAN_MSR_SIEFP:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = synic->siefp.raw;
+        break;
+
+    case VIRIDIAN_MSR_SIMP:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = synic->simp.raw;
+        break;
+
+    case VIRIDIAN_MSR_EOM:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = 0;
+        break;
+
+    case VIRIDIAN_MSR_SINT0 ... VIRIDIAN_MSR_SINT15:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = synic->sint[idx - VIRIDIAN_MSR_SINT0].raw;
+        break;
+
+    case VIRIDIAN_MSR_STIMER0_CONFIG ... VIRIDIAN_MSR_STIMER3_COUNT: {
+        struct viridian_stimer *vs =
+            &synic->stimer[(idx - VIRIDIAN_MSR_STIMER0_CONFIG) / 2];
+
+        perfc_incr(mshv_rdmsr_stimer);
+        *val = (idx & 1) ? vs->count : vs->config.raw;
+        break;
+    }
+
     default:
         return 0;
     }
@@ -350,6 +746,69 @@ int rdmsr_viridian_regs(uint32_t idx, uint64_t *val)
     return 1;
 }
 
+int viridian_vcpu_init(struct vcpu *v)
+{
+    struct viridian_synic *vv = xzalloc(struct viridian_synic);
+    unsigned int i;
+
+    if ( vv == NULL )
+        return -ENOMEM;
+
+    v->arch.hvm_vcpu.viridian.synic = vv;
+
+    spin_lock_init(&vv->lock);
+
+    for ( i = 0; i < VIRIDIAN_SINT_NR; i++ )
+        vv->sint[i].fields.mask = 1;
+
+    for ( i = 0; i < VIRIDIAN_STIMER_NR; i++ )
+    {
+        vv->stimer[i].v = v;
+        init_timer(&vv->stimer[i].timer, stimer_expire, &vv->stimer[i],
+                   v->processor);
+    }
+
+    return 0;
+}
+
+void viridian_vcpu_deinit(struct vcpu *v)
+{
+    struct viridian_synic *vv = v->arch.hvm_vcpu.viridian.synic;
+    unsigned int i;
+
+    if ( vv == NULL )
+        return;
+
+    for ( i = 0; i < VIRIDIAN_STIMER_NR; i++ )
+        kill_timer(&vv->stimer[i].timer);
+
+    destroy_ring_for_helper(&vv->simp_va, vv->simp_page);
+}
+
+void viridian_vcpu_destroy(struct vcpu *v)
+{
+    viridian_vcpu_deinit(v);
+    xfree(v->arch.hvm_vcpu.viridian.synic);
+    v->arch.hvm_vcpu.viridian.synic = NULL;
+}
+
+void viridian_domain_deinit(struct domain *d)
+{
+    struct vcpu *v;
+
+    for_each_vcpu ( d, v )
+        viridian_vcpu_deinit(v);
+}
+
+void viridian_migrate_timers(struct vcpu *v)
+{
+    unsigned int i;
+
+    for ( i = 0; i < VIRIDIAN_STIMER_NR; i++ )
+        migrate_timer(&v->arch.hvm_vcpu.viridian.synic->stimer[i].timer,
+                      v->processor);
+}
+
 int viridian_hypercall(struct cpu_user_regs *regs)
 {
     int mode = hvm_guest_x86_mode(current);
@@ -432,6 +891,7 @@ static int viridian_save_domain_ctxt(struct domain *d, hvm_domain_context_t *h)
 
     ctxt.hypercall_gpa = d->arch.hvm_domain.viridian.hypercall_gpa.raw;
     ctxt.guest_os_id   = d->arch.hvm_domain.viridian.guest_os_id.raw;
+    ctxt.reference_tsc = d->arch.hvm_domain.viridian.reference_tsc.raw;
 
     return (hvm_save_entry(VIRIDIAN_DOMAIN, 0, h, &ctxt) != 0);
 }
@@ -440,11 +900,16 @@ static int viridian_load_domain_ctxt(struct domain *d, hvm_domain_context_t *h)
 {
     struct hvm_viridian_domain_context ctxt;
 
-    if ( hvm_load_entry(VIRIDIAN_DOMAIN, h, &ctxt) != 0 )
+    if ( hvm_load_entry_zeroextend(VIRIDIAN_DOMAIN, h, &ctxt) != 0 )
         return -EINVAL;
 
     d->arch.hvm_domain.viridian.hypercall_gpa.raw = ctxt.hypercall_gpa;
     d->arch.hvm_domain.viridian.guest_os_id.raw   = ctxt.guest_os_id;
+    d->arch.hvm_domain.viridian.reference_tsc.raw = ctxt.reference_tsc;
+
+    /* The TSC frequency or mode may differ from the saving host. */
+    if ( d->arch.hvm_domain.viridian.reference_tsc.fields.enabled )
+        update_reference_tsc(d, 0);
 
     return 0;
 }
@@ -460,9 +925,21 @@ static int viridian_save_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
         return 0;
 
     for_each_vcpu( d, v ) {
+        struct viridian_synic *vv = v->arch.hvm_vcpu.viridian.synic;
         struct hvm_viridian_vcpu_context ctxt;
+        unsigned int i;
 
         ctxt.apic_assist = v->arch.hvm_vcpu.viridian.apic_assist.raw;
+        ctxt.scontrol = vv->scontrol.raw;
+        ctxt.siefp = vv->siefp.raw;
+        ctxt.simp = vv->simp.raw;
+        for ( i = 0; i < VIRIDIAN_SINT_NR; i++ )
+            ctxt.sint[i] = vv->sint[i].raw;
+        for ( i = 0; i < VIRIDIAN_STIMER_NR; i++ )
+        {
+            ctxt.stimer_config[i] = vv->stimer[i].config.raw;
+            ctxt.stimer_count[i] = vv->stimer[i].count;
+        }
 
         if ( hvm_save_entry(VIRIDIAN_VCPU, v->vcpu_id, h, &ctxt) != 0 )
             return 1;
@@ -475,7 +952,9 @@ static int viridian_load_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
 {
     int vcpuid;
     struct vcpu *v;
+    struct viridian_synic *vv;
     struct hvm_viridian_vcpu_context ctxt;
+    unsigned int i;
 
     vcpuid = hvm_load_instance(h);
     if ( vcpuid >= d->max_vcpus || (v = d->vcpu[vcpuid]) == NULL )
@@ -485,11 +964,32 @@ static int viridian_load_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
         return -EINVAL;
     }
 
-    if ( hvm_load_entry(VIRIDIAN_VCPU, h, &ctxt) != 0 )
+    if ( hvm_load_entry_zeroextend(VIRIDIAN_VCPU, h, &ctxt) != 0 )
         return -EINVAL;
 
     v->arch.hvm_vcpu.viridian.apic_assist.raw = ctxt.apic_assist;
 
+    vv = v->arch.hvm_vcpu.viridian.synic;
+    vv->scontrol.raw = ctxt.scontrol;
+    vv->siefp.raw = ctxt.siefp;
+    vv->simp.raw = ctxt.simp;
+    update_simp(v);
+
+    spin_lock(&vv->lock);
+    for ( i = 0; i < VIRIDIAN_SINT_NR; i++ )
+        vv->sint[i].raw = ctxt.sint[i];
+    for ( i = 0; i < VIRIDIAN_STIMER_NR; i++ )
+    {
+        struct viridian_stimer *vs = &vv->stimer[i];
+
+        stop_timer(&vs->timer);
+        vs->config.raw = ctxt.stimer_config[i];
+        vs->count = ctxt.stimer_count[i];
+        if ( vs->config.fields.enabled )
+            stimer_start(vs);
+    }
+    spin_unlock(&vv->lock);
+
     return 0;
 }
 
@@ -100,6 +100,74 @@ static int vlapic_find_highest_vector(const void *bitmap)
     return (fls(word[word_offset*4]) - 1) + (word_offset * 32);
 }
 
+int vlapic_virtual_intr_delivery_enabled(void)
+{
+    if ( hvm_funcs.virtual_intr_delivery_enabled )
+        return hvm_funcs.virtual_intr_delivery_enabled();
+    else
+        return 0;
+}
+
+/*
+ * Without virtual interrupt delivery only Xen updates IRR and ISR, and it
+ * tracks their possibly non-zero words in a summary so the highest vector
+ * takes a bit scan or two. With it the processor updates the registers
+ * behind our back, so the full scan above is used instead.
+ */
+static void vlapic_summary_set(unsigned long *summary, int vector)
+{
+    if ( !test_bit(vector / 32, summary) )
+        set_bit(vector / 32, summary);
+}
+
+static void vlapic_summary_clear(unsigned long *summary, const void *bitmap,
+                                 int vector)
+{
+    const uint32_t *word = bitmap + REG_POS(vector);
+
+    if ( *word != 0 )
+        return;
+
+    clear_bit(vector / 32, summary);
+
+    /* Re-check against a vector being set concurrently in the same word. */
+    smp_mb();
+    if ( *word != 0 )
+        set_bit(vector / 32, summary);
+}
+
+static void vlapic_summary_init(unsigned long *summary, const void *bitmap)
+{
+    const uint32_t *word = bitmap;
+    unsigned int i;
+
+    *summary = 0;
+    for ( i = 0; i < NR_VECTORS / 32; i++ )
+        if ( word[i * 4] != 0 )
+            __set_bit(i, summary);
+}
+
+static int vlapic_find_highest_summary(unsigned long summary,
+                                       const void *bitmap)
+{
+    const uint32_t *word = bitmap;
+    unsigned int i;
+
+    if ( vlapic_virtual_intr_delivery_enabled() )
+        return vlapic_find_highest_vector(bitmap);
+
+    /* A set summary bit may be stale while a clear races with us. */
+    while ( summary != 0 )
+    {
+        i = fls(summary) - 1;
+        if ( word[i * 4] != 0 )
+            return (fls(word[i * 4]) - 1) + (i * 32);
+        summary &= ~(1UL << i);
+    }
+
+    return -1;
+}
+
 
 /*
  * IRR-specific bitmap update & search routines.
@@ -107,12 +175,17 @@ static int vlapic_find_highest_vector(const void *bitmap)
 
 static int vlapic_test_and_set_irr(int vector, struct vlapic *vlapic)
 {
-    return vlapic_test_and_set_vector(vector, &vlapic->regs->data[APIC_IRR]);
+    if ( vlapic_test_and_set_vector(vector, &vlapic->regs->data[APIC_IRR]) )
+        return 1;
+    vlapic_summary_set(&vlapic->irr_summary, vector);
+    return 0;
 }
 
 static void vlapic_clear_irr(int vector, struct vlapic *vlapic)
 {
     vlapic_clear_vector(vector, &vlapic->regs->data[APIC_IRR]);
+    vlapic_summary_clear(&vlapic->irr_summary,
+                         &vlapic->regs->data[APIC_IRR], vector);
 }
 
 static int vlapic_find_highest_irr(struct vlapic *vlapic)
@@ -120,7 +193,8 @@ static int vlapic_find_highest_irr(struct vlapic *vlapic)
     if ( hvm_funcs.sync_pir_to_irr )
         hvm_funcs.sync_pir_to_irr(vlapic_vcpu(vlapic));
 
-    return vlapic_find_highest_vector(&vlapic->regs->data[APIC_IRR]);
+    return vlapic_find_highest_summary(vlapic->irr_summary,
+                                       &vlapic->regs->data[APIC_IRR]);
 }
 
 void vlapic_set_irq(struct vlapic *vlapic, uint8_t vec, uint8_t trig)
@@ -141,7 +215,8 @@ void vlapic_set_irq(struct vlapic *vlapic, uint8_t vec, uint8_t trig)
 
 static int vlapic_find_highest_isr(struct vlapic *vlapic)
 {
-    return vlapic_find_highest_vector(&vlapic->regs->data[APIC_ISR]);
+    return vlapic_find_highest_summary(vlapic->isr_summary,
+                                       &vlapic->regs->data[APIC_ISR]);
 }
 
 static uint32_t vlapic_get_ppr(struct vlapic *vlapic)
@@ -391,6 +466,8 @@ void vlapic_EOI_set(struct vlapic *vlapic)
         return;
 
     vlapic_clear_vector(vector, &vlapic->regs->data[APIC_ISR]);
+    vlapic_summary_clear(&vlapic->isr_summary,
+                         &vlapic->regs->data[APIC_ISR], vector);
 
     if ( hvm_funcs.handle_eoi )
         hvm_funcs.handle_eoi(vector);
@@ -1024,14 +1101,6 @@ void vlapic_adjust_i8259_target(struct domain *d)
     pt_adjust_global_vcpu_target(v);
 }
 
-int vlapic_virtual_intr_delivery_enabled(void)
-{
-    if ( hvm_funcs.virtual_intr_delivery_enabled )
-        return hvm_funcs.virtual_intr_delivery_enabled();
-    else
-        return 0;
-}
-
 int vlapic_has_pending_irq(struct vcpu *v)
 {
     struct vlapic *vlapic = vcpu_vlapic(v);
@@ -1063,6 +1132,7 @@ int vlapic_ack_pending_irq(struct vcpu *v, int vector, bool_t force_ack)
     if ( force_ack || !vlapic_virtual_intr_delivery_enabled() )
     {
         vlapic_set_vector(vector, &vlapic->regs->data[APIC_ISR]);
+        vlapic_summary_set(&vlapic->isr_summary, vector);
         vlapic_clear_irr(vector, vlapic);
     }
 
@@ -1090,6 +1160,7 @@ void vlapic_reset(struct vlapic *vlapic)
         vlapic_set_reg(vlapic, APIC_ISR + 0x10 * i, 0);
         vlapic_set_reg(vlapic, APIC_TMR + 0x10 * i, 0);
     }
+    vlapic->irr_summary = vlapic->isr_summary = 0;
     vlapic_set_reg(vlapic, APIC_ICR,     0);
     vlapic_set_reg(vlapic, APIC_ICR2,    0);
     vlapic_set_reg(vlapic, APIC_LDR,     0);
@@ -1212,6 +1283,9 @@ static int lapic_load_regs(struct domain *d, hvm_domain_context_t *h)
     if ( hvm_load_entry(LAPIC_REGS, h, s->regs) != 0 ) 
         return -EINVAL;
 
+    vlapic_summary_init(&s->irr_summary, &s->regs->data[APIC_IRR]);
+    vlapic_summary_init(&s->isr_summary, &s->regs->data[APIC_ISR]);
+
     if ( hvm_funcs.process_isr )
         hvm_funcs.process_isr(vlapic_find_highest_isr(s), v);
 
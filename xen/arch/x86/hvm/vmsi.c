@@ -154,6 +154,16 @@ int hvm_girq_dest_2_vcpu_id(struct domain *d, uint8_t dest, uint8_t dest_mode)
 }
 
 /* MSI-X mask bit hypervisor interception */
+struct msixtbl_entry;
+
+/* One guest page of an MSI-X table, hashed by gfn for lookup. */
+struct msixtbl_page
+{
+    struct hlist_node hash;
+    unsigned long gfn;
+    struct msixtbl_entry *entry;
+};
+
 struct msixtbl_entry
 {
     struct list_head list;
@@ -168,21 +178,33 @@ struct msixtbl_entry
     struct { 
         uint32_t msi_ad[3];	/* Shadow of address low, high and data */
     } gentries[MAX_MSIX_ACC_ENTRIES];
+    unsigned int nr_pages;
+    struct msixtbl_page pages[MAX_MSIX_TABLE_PAGES];
     struct rcu_head rcu;
 };
 
 static DEFINE_RCU_READ_LOCK(msixtbl_rcu_lock);
 
+#define msixtbl_bucket(d, gfn) \
+    (&(d)->arch.hvm_domain.msixtbl_hash[(gfn) & (MSIXTBL_HASH_SIZE - 1)])
+
 static struct msixtbl_entry *msixtbl_find_entry(
     struct vcpu *v, unsigned long addr)
 {
-    struct msixtbl_entry *entry;
+    struct msixtbl_page *page;
+    struct hlist_node *node;
     struct domain *d = v->domain;
+    unsigned long gfn = addr >> PAGE_SHIFT;
 
-    list_for_each_entry( entry, &d->arch.hvm_domain.msixtbl_list, list )
-        if ( addr >= entry->gtable &&
+    hlist_for_each_entry_rcu( page, node, msixtbl_bucket(d, gfn), hash )
+    {
+        struct msixtbl_entry *entry = page->entry;
+
+        if ( page->gfn == gfn &&
+             addr >= entry->gtable &&
              addr < entry->gtable + entry->table_len )
             return entry;
+    }
 
     return NULL;
 }
@@ -291,8 +313,13 @@ static int msixtbl_write(struct vcpu *v, unsigned long address,
         goto out;
     }
 
-    /* exit to device model if address/data has been modified */
-    if ( test_and_clear_bit(nr_entry, &entry->table_flags) )
+    /*
+     * Exit to device model when unmasking after address/data has been
+     * modified, so that it can update the binding. Masking does not
+     * depend on the new address/data and is handled here.
+     */
+    if ( !(val & PCI_MSIX_VECTOR_BITMASK) &&
+         test_and_clear_bit(nr_entry, &entry->table_flags) )
         goto out;
 
     virt = msixtbl_addr_to_virt(entry, address);
@@ -360,6 +387,10 @@ static int msixtbl_range(struct vcpu *v, unsigned long addr)
     struct msixtbl_entry *entry;
     void *virt;
 
+    /* Most domains have no pass-through MSI-X device at all. */
+    if ( list_empty(&v->domain->arch.hvm_domain.msixtbl_list) )
+        return 0;
+
     rcu_read_lock(&msixtbl_rcu_lock);
 
     entry = msixtbl_find_entry(v, addr);
@@ -382,6 +413,7 @@ static void add_msixtbl_entry(struct domain *d,
                               struct msixtbl_entry *entry)
 {
     u32 len;
+    unsigned int i;
 
     memset(entry, 0, sizeof(struct msixtbl_entry));
         
@@ -394,7 +426,21 @@ static void add_msixtbl_entry(struct domain *d,
     entry->pdev = pdev;
     entry->gtable = (unsigned long) gtable;
 
+    if ( len )
+        entry->nr_pages = min_t(unsigned int, MAX_MSIX_TABLE_PAGES,
+                                PFN_DOWN(entry->gtable + len - 1) -
+                                PFN_DOWN(entry->gtable) + 1);
+
     list_add_rcu(&entry->list, &d->arch.hvm_domain.msixtbl_list);
+
+    for ( i = 0; i < entry->nr_pages; i++ )
+    {
+        struct msixtbl_page *page = &entry->pages[i];
+
+        page->gfn = PFN_DOWN(entry->gtable) + i;
+        page->entry = entry;
+        hlist_add_head_rcu(&page->hash, msixtbl_bucket(d, page->gfn));
+    }
 }
 
 static void free_msixtbl_entry(struct rcu_head *rcu)
@@ -408,6 +454,10 @@ static void free_msixtbl_entry(struct rcu_head *rcu)
 
 static void del_msixtbl_entry(struct msixtbl_entry *entry)
 {
+    unsigned int i;
+
+    for ( i = 0; i < entry->nr_pages; i++ )
+        hlist_del_rcu(&entry->pages[i].hash);
     list_del_rcu(&entry->list);
     call_rcu(&entry->rcu, free_msixtbl_entry);
 }
@@ -465,6 +465,8 @@ int vmx_cpu_up_prepare(unsigned int cpu)
     if ( nvmx_cpu_up_prepare(cpu) != 0 )
         printk("CPU%d: Could not allocate virtual VMCS buffer.\n", cpu);
 
+    vmx_pi_per_cpu_init(cpu);
+
     if ( per_cpu(vmxon_region, cpu) != NULL )
         return 0;
 
@@ -482,6 +484,7 @@ void vmx_cpu_dead(unsigned int cpu)
     vmx_free_vmcs(per_cpu(vmxon_region, cpu));
     per_cpu(vmxon_region, cpu) = NULL;
     nvmx_cpu_dead(cpu);
+    vmx_pi_desc_fixup(cpu);
 }
 
 int vmx_cpu_up(void)
@@ -1181,16 +1184,22 @@ int vmx_add_host_load_msr(u32 msr)
     return 0;
 }
 
+/*
+ * Called for every injected interrupt: check before the locked update, as
+ * the bit is almost always in its wanted state already.
+ */
 void vmx_set_eoi_exit_bitmap(struct vcpu *v, u8 vector)
 {
-    if ( !test_and_set_bit(vector, v->arch.hvm_vmx.eoi_exit_bitmap) )
+    if ( !test_bit(vector, v->arch.hvm_vmx.eoi_exit_bitmap) &&
+         !test_and_set_bit(vector, v->arch.hvm_vmx.eoi_exit_bitmap) )
         set_bit(vector / BITS_PER_LONG,
                 &v->arch.hvm_vmx.eoi_exitmap_changed);
 }
 
 void vmx_clear_eoi_exit_bitmap(struct vcpu *v, u8 vector)
 {
-    if ( test_and_clear_bit(vector, v->arch.hvm_vmx.eoi_exit_bitmap) )
+    if ( test_bit(vector, v->arch.hvm_vmx.eoi_exit_bitmap) &&
+         test_and_clear_bit(vector, v->arch.hvm_vmx.eoi_exit_bitmap) )
         set_bit(vector / BITS_PER_LONG,
                 &v->arch.hvm_vmx.eoi_exitmap_changed);
 }
@@ -56,6 +56,7 @@
 #include <asm/apic.h>
 #include <asm/hvm/nestedhvm.h>
 #include <asm/event.h>
+#include <xen/iommu.h>
 
 enum handler_return { HNDL_done, HNDL_unhandled, HNDL_exception_raised };
 
@@ -77,6 +78,174 @@ static int vmx_msr_write_intercept(unsigned int msr, uint64_t msr_content);
 static void vmx_invlpg_intercept(unsigned long vaddr);
 
 uint8_t __read_mostly posted_intr_vector;
+static uint8_t __read_mostly pi_wakeup_vector;
+
+/*
+ * With VT-d interrupt posting, a blocked vCPU has its notifications
+ * redirected to pi_wakeup_vector on the pCPU it blocked on, and is
+ * queued there so the wakeup handler can find it.
+ */
+struct vmx_pi_blocking {
+    struct list_head list;
+    spinlock_t lock;
+};
+static DEFINE_PER_CPU(struct vmx_pi_blocking, vmx_pi_blocking);
+
+static u32 pi_ndst(unsigned int cpu)
+{
+    u32 dest = cpu_physical_id(cpu);
+
+    return x2apic_enabled ? dest : (dest << 8) & 0xff00;
+}
+
+void vmx_pi_per_cpu_init(unsigned int cpu)
+{
+    struct vmx_pi_blocking *pib = &per_cpu(vmx_pi_blocking, cpu);
+
+    /* Keep the queue across S3, when this is called again for CPU0. */
+    if ( pib->list.next )
+        return;
+
+    INIT_LIST_HEAD(&pib->list);
+    spin_lock_init(&pib->lock);
+}
+
+static void vmx_pi_vcpu_init(struct vcpu *v)
+{
+    struct pi_desc *pi_desc = &v->arch.hvm_vmx.pi_desc;
+
+    INIT_LIST_HEAD(&v->arch.hvm_vmx.pi_blocking.list);
+    v->arch.hvm_vmx.pi_blocking.lock = NULL;
+    pi_desc->nv = posted_intr_vector;
+    pi_desc->ndst = pi_ndst(v->processor);
+}
+
+static void vmx_pi_switch_from(struct vcpu *v)
+{
+    /*
+     * A preempted vCPU gets its pending interrupts synced on the next VM
+     * entry; notifying a pCPU that runs something else is wasted.  Blocked
+     * vCPUs must stay notifiable so that they get woken up.
+     */
+    if ( !test_bit(_VPF_blocked, &v->pause_flags) )
+        pi_set_sn(&v->arch.hvm_vmx.pi_desc);
+}
+
+static void vmx_pi_switch_to(struct vcpu *v)
+{
+    struct pi_desc *pi_desc = &v->arch.hvm_vmx.pi_desc;
+
+    write_atomic(&pi_desc->ndst, pi_ndst(smp_processor_id()));
+    pi_clear_sn(pi_desc);
+
+    /* Interrupts posted while SN was set did not raise ON. */
+    if ( !pi_test_on(pi_desc) && !bitmap_empty(pi_desc->pir, NR_VECTORS) )
+        pi_set_on(pi_desc);
+}
+
+static void vmx_vcpu_block(struct vcpu *v)
+{
+    struct vmx_pi_blocking *pib = &this_cpu(vmx_pi_blocking);
+    struct pi_desc *pi_desc = &v->arch.hvm_vmx.pi_desc;
+    unsigned long flags;
+
+    ASSERT(v == current);
+
+    spin_lock_irqsave(&pib->lock, flags);
+    if ( !v->arch.hvm_vmx.pi_blocking.lock )
+    {
+        v->arch.hvm_vmx.pi_blocking.lock = &pib->lock;
+        list_add_tail(&v->arch.hvm_vmx.pi_blocking.list, &pib->list);
+    }
+    spin_unlock_irqrestore(&pib->lock, flags);
+
+    ASSERT(!pi_desc->sn);
+    write_atomic(&pi_desc->nv, pi_wakeup_vector);
+}
+
+/* Undo vmx_vcpu_block(): the vCPU is about to run again. */
+static void vmx_pi_unblock_vcpu(struct vcpu *v)
+{
+    struct pi_desc *pi_desc = &v->arch.hvm_vmx.pi_desc;
+    spinlock_t *lock;
+    unsigned long flags;
+
+    write_atomic(&pi_desc->nv, posted_intr_vector);
+
+    for ( ; ; )
+    {
+        lock = *(spinlock_t *volatile *)&v->arch.hvm_vmx.pi_blocking.lock;
+        if ( !lock )
+            return;
+
+        spin_lock_irqsave(lock, flags);
+        /* The wakeup handler or a CPU-offline fixup may have moved us. */
+        if ( v->arch.hvm_vmx.pi_blocking.lock == lock )
+            break;
+        spin_unlock_irqrestore(lock, flags);
+    }
+
+    list_del(&v->arch.hvm_vmx.pi_blocking.list);
+    v->arch.hvm_vmx.pi_blocking.lock = NULL;
+    spin_unlock_irqrestore(lock, flags);
+}
+
+static void pi_wakeup_interrupt(struct cpu_user_regs *regs)
+{
+    struct vmx_pi_blocking *pib = &this_cpu(vmx_pi_blocking);
+    struct arch_vmx_struct *vmx, *tmp;
+
+    ack_APIC_irq();
+    this_cpu(irq_count)++;
+
+    spin_lock(&pib->lock);
+    list_for_each_entry_safe ( vmx, tmp, &pib->list, pi_blocking.list )
+    {
+        if ( !pi_test_on(&vmx->pi_desc) )
+            continue;
+
+        list_del(&vmx->pi_blocking.list);
+        vmx->pi_blocking.lock = NULL;
+        vcpu_unblock(container_of(vmx, struct vcpu, arch.hvm_vmx));
+    }
+    spin_unlock(&pib->lock);
+}
+
+/*
+ * Hand the blocked vCPUs of an offlined pCPU over to this one, so that
+ * their wakeup notifications keep reaching a live CPU.
+ */
+void vmx_pi_desc_fixup(unsigned int cpu)
+{
+    struct vmx_pi_blocking *old = &per_cpu(vmx_pi_blocking, cpu);
+    struct vmx_pi_blocking *new = &this_cpu(vmx_pi_blocking);
+    struct arch_vmx_struct *vmx, *tmp;
+    unsigned long flags;
+
+    if ( !iommu_intpost || !old->list.next )
+        return;
+
+    spin_lock_irqsave(&old->lock, flags);
+    spin_lock(&new->lock);
+
+    list_for_each_entry_safe ( vmx, tmp, &old->list, pi_blocking.list )
+    {
+        list_del(&vmx->pi_blocking.list);
+        if ( pi_test_on(&vmx->pi_desc) )
+        {
+            vmx->pi_blocking.lock = NULL;
+            vcpu_unblock(container_of(vmx, struct vcpu, arch.hvm_vmx));
+            continue;
+        }
+
+        write_atomic(&vmx->pi_desc.ndst, pi_ndst(smp_processor_id()));
+        list_add_tail(&vmx->pi_blocking.list, &new->list);
+        vmx->pi_blocking.lock = &new->lock;
+    }
+
+    spin_unlock(&new->lock);
+    spin_unlock_irqrestore(&old->lock, flags);
+}
 
 static int vmx_domain_initialise(struct domain *d)
 {
@@ -98,6 +267,7 @@ static int vmx_vcpu_initialise(struct vcpu *v)
     int rc;
 
     spin_lock_init(&v->arch.hvm_vmx.vmcs_lock);
+    vmx_pi_vcpu_init(v);
 
     v->arch.schedule_tail    = vmx_do_resume;
     v->arch.ctxt_switch_from = vmx_ctxt_switch_from;
@@ -124,6 +294,8 @@ static int vmx_vcpu_initialise(struct vcpu *v)
 
 static void vmx_vcpu_destroy(struct vcpu *v)
 {
+    if ( iommu_intpost )
+        vmx_pi_unblock_vcpu(v);
     vmx_destroy_vmcs(v);
     vpmu_destroy(v);
     passive_domain_destroy(v);
@@ -620,6 +792,9 @@ static void vmx_ctxt_switch_from(struct vcpu *v)
     vmx_save_guest_msrs(v);
     vmx_restore_host_msrs();
     vmx_save_dr(v);
+
+    if ( iommu_intpost )
+        vmx_pi_switch_from(v);
 }
 
 static void vmx_ctxt_switch_to(struct vcpu *v)
@@ -648,6 +823,9 @@ static void vmx_ctxt_switch_to(struct vcpu *v)
 
     vmx_restore_guest_msrs(v);
     vmx_restore_dr(v);
+
+    if ( iommu_intpost )
+        vmx_pi_switch_to(v);
 }
 
 
@@ -1540,6 +1718,16 @@ static void vmx_deliver_posted_intr(struct vcpu *v, u8 vector)
         __vmx_deliver_posted_interrupt(v);
         return;
     }
+    else
+    {
+        /*
+         * ON was already set: whoever set it has sent the notification or
+         * left the PIR to be synced on the next VM entry. Kicking again
+         * would only cost the running vCPU a VM exit.
+         */
+        vcpu_unblock(v);
+        return;
+    }
 
     vcpu_kick(v);
 }
@@ -1622,6 +1810,7 @@ static struct hvm_function_table __initdata vmx_function_table = {
     .process_isr          = vmx_process_isr,
     .deliver_posted_intr  = vmx_deliver_posted_intr,
     .sync_pir_to_irr      = vmx_sync_pir_to_irr,
+    .vcpu_block           = vmx_vcpu_block,
     .handle_eoi           = vmx_handle_eoi,
     .nhvm_hap_walk_L1_p2m = nvmx_hap_walk_L1_p2m,
 };
@@ -1667,8 +1856,15 @@ const struct hvm_function_table * __init start_vmx(void)
     {
         vmx_function_table.deliver_posted_intr = NULL;
         vmx_function_table.sync_pir_to_irr = NULL;
+        /* VT-d posting needs the CPU to process the PI descriptor. */
+        iommu_intpost = 0;
     }
 
+    if ( iommu_intpost )
+        alloc_direct_apic_vector(&pi_wakeup_vector, pi_wakeup_interrupt);
+    else
+        vmx_function_table.vcpu_block = NULL;
+
     setup_vmcs_dump();
 
     return &vmx_function_table;
@@ -1784,6 +1980,7 @@ static void vmx_invlpg_intercept(unsigned long vaddr)
 {
     struct vcpu *curr = current;
     HVMTRACE_LONG_2D(INVLPG, /*invlpga=*/ 0, TRC_PAR_LONG(vaddr));
+    hvmemul_insn_xlat_flush(curr);
     if ( paging_invlpg(curr, vaddr) && cpu_has_vmx_vpid )
         vpid_sync_vcpu_gva(curr, vaddr);
 }
@@ -2475,6 +2672,7 @@ void vmx_vmexit_handler(struct cpu_user_regs *regs)
                     0, 0, 0, 0);
 
     perfc_incra(vmexits, exit_reason);
+    vcpu_perf_incra(vmexits, (uint16_t)exit_reason);
 
     /* Handle the interrupt we missed before allowing any more in. */
     switch ( (uint16_t)exit_reason )
@@ -2923,6 +3121,16 @@ void vmx_vmexit_handler(struct cpu_user_regs *regs)
         break;
     }
 
+    case EXIT_REASON_EPT_MISCONFIG:
+    {
+        paddr_t gpa;
+
+        __vmread(GUEST_PHYSICAL_ADDRESS, &gpa);
+        if ( !ept_handle_misconfig(gpa) )
+            goto exit_and_crash;
+        break;
+    }
+
     case EXIT_REASON_MONITOR_TRAP_FLAG:
         v->arch.hvm_vmx.exec_control &= ~CPU_BASED_MONITOR_TRAP_FLAG;
         vmx_update_cpu_exec_control(v);
@@ -2974,6 +3182,11 @@ void vmx_vmenter_helper(const struct cpu_user_regs *regs)
     struct hvm_vcpu_asid *p_asid;
     bool_t need_flush;
 
+    /* Returning to the guest after vmx_vcpu_block(), blocked or not. */
+    if ( unlikely(curr->arch.hvm_vmx.pi_desc.nv != posted_intr_vector) &&
+         iommu_intpost )
+        vmx_pi_unblock_vcpu(curr);
+
     /* In case hypervisor access hvm memory when guest uc mode */
     if ( unlikely(curr->arch.hvm_vcpu.hypervisor_access_uc_hvm_memory) )
     {
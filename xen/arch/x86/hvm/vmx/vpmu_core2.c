@@ -737,12 +737,14 @@ static int core2_vpmu_do_interrupt(struct cpu_user_regs *regs)
         if ( is_pmc_quirk )
             handle_pmc_quirk(msr_content);
         core2_vpmu_cxt->global_ovf_status |= msr_content;
+        core2_vpmu_cxt->last_ovf_status = msr_content;
         msr_content = 0xC000000700000000 | ((1 << core2_get_pmc_count()) - 1);
         wrmsrl(MSR_CORE_PERF_GLOBAL_OVF_CTRL, msr_content);
     }
     else
     {
         /* No PMC overflow but perhaps a Trace Message interrupt. */
+        core2_vpmu_cxt->last_ovf_status = 0;
         __vmread(GUEST_IA32_DEBUGCTL, &msr_content);
         if ( !(msr_content & IA32_DEBUGCTLMSR_TR) )
             return 0;
@@ -755,6 +757,39 @@ static int core2_vpmu_do_interrupt(struct cpu_user_regs *regs)
     return 1;
 }
 
+static int core2_vpmu_sample(struct vcpu *v, const uint64_t *reload,
+                             uint64_t *sampled)
+{
+    struct vpmu_struct *vpmu = vcpu_vpmu(v);
+    struct core2_vpmu_context *core2_vpmu_cxt = vpmu->context;
+    u64 ovf, fixed_mask, done = 0;
+    unsigned int i;
+
+    if ( !vpmu_is_set(vpmu, VPMU_CONTEXT_LOADED) )
+        return 1;
+
+    ovf = core2_vpmu_cxt->last_ovf_status;
+
+    /* Counters are live while the context is loaded: reload them directly. */
+    for ( i = 0; i < core2_get_pmc_count(); i++ )
+        if ( (ovf & (1ULL << i)) && reload[i] &&
+             !wrmsr_safe(MSR_IA32_PERFCTR0 + i, reload[i]) )
+            done |= 1ULL << i;
+
+    fixed_mask = (1ULL << core2_get_bitwidth_fix_count()) - 1;
+    for ( i = 0; i < VPMU_CORE2_NUM_FIXED; i++ )
+        if ( (ovf & (1ULL << (32 + i))) && reload[32 + i] &&
+             !wrmsr_safe(MSR_CORE_PERF_FIXED_CTR0 + i,
+                         reload[32 + i] & fixed_mask) )
+            done |= 1ULL << (32 + i);
+
+    /* The guest never sees the overflows it asked Xen to handle. */
+    core2_vpmu_cxt->global_ovf_status &= ~done;
+    *sampled = done;
+
+    return !ovf || (ovf & ~done);
+}
+
 static int core2_vpmu_initialise(struct vcpu *v, unsigned int vpmu_flags)
 {
     struct vpmu_struct *vpmu = vcpu_vpmu(v);
@@ -827,7 +862,8 @@ struct arch_vpmu_ops core2_vpmu_ops = {
     .arch_vpmu_destroy = core2_vpmu_destroy,
     .arch_vpmu_save = core2_vpmu_save,
     .arch_vpmu_load = core2_vpmu_load,
-    .arch_vpmu_dump = core2_vpmu_dump
+    .arch_vpmu_dump = core2_vpmu_dump,
+    .arch_vpmu_sample = core2_vpmu_sample
 };
 
 static void core2_no_vpmu_do_cpuid(unsigned int input,
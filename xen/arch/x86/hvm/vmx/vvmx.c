@@ -1758,10 +1758,12 @@ int nvmx_handle_invept(struct cpu_user_regs *regs)
     {
     case INVEPT_SINGLE_CONTEXT:
     {
-        struct p2m_domain *p2m = p2m_get_nestedp2m(current, eptp);
+        /* Only drop the table cached for this EPTP; don't build one. */
+        struct p2m_domain *p2m = p2m_flush_nestedp2m_base(current->domain,
+                                                          eptp);
         if ( p2m )
         {
-            p2m_flush(current, p2m);
+            hvm_asid_flush_vcpu(current);
             ept_sync_domain(p2m);
         }
         break;
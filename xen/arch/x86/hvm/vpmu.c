@@ -21,9 +21,11 @@
 #include <xen/config.h>
 #include <xen/sched.h>
 #include <xen/xenoprof.h>
+#include <xen/domain_page.h>
 #include <asm/regs.h>
 #include <asm/types.h>
 #include <asm/msr.h>
+#include <asm/paging.h>
 #include <asm/hvm/support.h>
 #include <asm/hvm/vmx/vmx.h>
 #include <asm/hvm/vmx/vmcs.h>
@@ -31,6 +33,7 @@
 #include <asm/hvm/svm/svm.h>
 #include <asm/hvm/svm/vmcb.h>
 #include <asm/apic.h>
+#include <public/hvm/hvm_op.h>
 
 /*
  * "vpmu" :     vpmu generally enabled
@@ -82,6 +85,50 @@ int vpmu_do_rdmsr(unsigned int msr, uint64_t *msr_content)
     return 0;
 }
 
+/*
+ * Record a sample in the ring for the counters reloaded by the arch code.
+ * Returns whether the guest should get a PMI for this interrupt anyway.
+ */
+static int vpmu_sample(struct vcpu *v, struct xen_vpmu_sample_page *page)
+{
+    struct vpmu_struct *vpmu = vcpu_vpmu(v);
+    struct xen_vpmu_sample *s;
+    struct segment_register ss;
+    uint64_t sampled = 0;
+    uint32_t prod, used, watermark;
+    int inject;
+
+    inject = vpmu->arch_vpmu_ops->arch_vpmu_sample(v, page->reload, &sampled);
+    if ( !sampled )
+        return 1;
+
+    prod = page->prod;
+    used = prod - read_atomic(&page->cons);
+    if ( used >= XEN_VPMU_SAMPLE_NR )
+    {
+        page->lost++;
+        return 1;
+    }
+
+    hvm_get_segment_register(v, x86_seg_ss, &ss);
+
+    s = &page->ring[prod & (XEN_VPMU_SAMPLE_NR - 1)];
+    s->ip = guest_cpu_user_regs()->eip;
+    s->cr3 = v->arch.hvm_vcpu.guest_cr[3];
+    s->status = sampled;
+    s->cpl = ss.attr.fields.dpl;
+    s->pad = 0;
+
+    smp_wmb();
+    write_atomic(&page->prod, prod + 1);
+
+    watermark = page->watermark;
+    if ( watermark == 0 || watermark > XEN_VPMU_SAMPLE_NR )
+        watermark = XEN_VPMU_SAMPLE_NR;
+
+    return inject || (used + 1 == watermark);
+}
+
 int vpmu_do_interrupt(struct cpu_user_regs *regs)
 {
     struct vcpu *v = current;
@@ -93,9 +140,15 @@ int vpmu_do_interrupt(struct cpu_user_regs *regs)
         u32 vlapic_lvtpc;
         unsigned char int_vec;
 
+        struct xen_vpmu_sample_page *page = vpmu->sample_page;
+
         if ( !vpmu->arch_vpmu_ops->do_interrupt(regs) )
             return 0;
 
+        if ( page && vpmu->arch_vpmu_ops->arch_vpmu_sample &&
+             !vpmu_sample(v, page) )
+            return 1;
+
         if ( !is_vlapic_lvtpc_enabled(vlapic) )
             return 1;
 
@@ -255,6 +308,49 @@ void vpmu_destroy(struct vcpu *v)
         vpmu->arch_vpmu_ops->arch_vpmu_destroy(v);
 }
 
+static void destroy_sample_page(struct xen_vpmu_sample_page *page)
+{
+    if ( page == NULL )
+        return;
+
+    put_page_and_type(mfn_to_page(domain_page_map_to_mfn(page)));
+    unmap_domain_page_global(page);
+}
+
+/* Register (or, for INVALID_GFN, remove) the sample page of a vcpu. */
+int vpmu_set_sample_page(struct vcpu *v, unsigned long gfn)
+{
+    struct vpmu_struct *vpmu = vcpu_vpmu(v);
+    struct page_info *pg;
+    void *va = NULL;
+    int rc;
+
+    BUILD_BUG_ON(sizeof(struct xen_vpmu_sample_page) > PAGE_SIZE);
+
+    if ( !vpmu->arch_vpmu_ops || !vpmu->arch_vpmu_ops->arch_vpmu_sample )
+        return -EOPNOTSUPP;
+
+    if ( gfn != INVALID_GFN &&
+         (rc = prepare_ring_for_helper(v->domain, gfn, &pg, &va)) != 0 )
+        return rc;
+
+    /* The PMI handler only looks at the page of the vcpu it interrupted. */
+    if ( v != current )
+        vcpu_pause(v);
+    va = xchg(&vpmu->sample_page, va);
+    if ( v != current )
+        vcpu_unpause(v);
+
+    destroy_sample_page(va);
+
+    return 0;
+}
+
+void vpmu_release_sample_page(struct vcpu *v)
+{
+    destroy_sample_page(xchg(&vcpu_vpmu(v)->sample_page, NULL));
+}
+
 /* Dump some vpmu informations on console. Used in keyhandler dump_domains(). */
 void vpmu_dump(struct vcpu *v)
 {
@@ -131,6 +131,33 @@ static void pt_unlock(struct periodic_time *pt)
     spin_unlock(&pt->vcpu->arch.hvm_vcpu.tm_lock);
 }
 
+/*
+ * All platform timers of a vCPU share its tm_timer, programmed for the
+ * earliest 'scheduled' among the armed timers on tm_list (only those that
+ * need not freeze while the vCPU is descheduled). Callers hold tm_lock.
+ */
+static void pt_program_timer(struct vcpu *v)
+{
+    struct periodic_time *pt;
+    s_time_t next = STIME_MAX;
+
+    list_for_each_entry ( pt, &v->arch.hvm_vcpu.tm_list, list )
+        if ( pt->armed && (pt->scheduled < next) &&
+             (!v->arch.hvm_vcpu.tm_frozen || pt->do_not_freeze) )
+            next = pt->scheduled;
+
+    if ( next == STIME_MAX )
+        stop_timer(&v->arch.hvm_vcpu.tm_timer);
+    else
+        set_timer(&v->arch.hvm_vcpu.tm_timer, next);
+}
+
+static void pt_arm(struct periodic_time *pt)
+{
+    pt->armed = 1;
+    pt_program_timer(pt->vcpu);
+}
+
 static void pt_process_missed_ticks(struct periodic_time *pt)
 {
     s_time_t missed_ticks, now = NOW();
@@ -146,7 +173,10 @@ static void pt_process_missed_ticks(struct periodic_time *pt)
     if ( mode_is(pt->vcpu->domain, no_missed_ticks_pending) )
         pt->do_not_freeze = !pt->pending_intr_nr;
     else
+    {
         pt->pending_intr_nr += missed_ticks;
+        pt->vcpu->arch.hvm_vcpu.tm_pending = 1;
+    }
     pt->scheduled += missed_ticks * pt->period;
 }
 
@@ -170,19 +200,30 @@ static void pt_thaw_time(struct vcpu *v)
     v->arch.hvm_vcpu.guest_time = 0;
 }
 
-void pt_save_timer(struct vcpu *v)
+static void pt_vcpu_timer_fn(void *data);
+
+void pt_vcpu_init(struct vcpu *v)
 {
-    struct list_head *head = &v->arch.hvm_vcpu.tm_list;
-    struct periodic_time *pt;
+    spin_lock_init(&v->arch.hvm_vcpu.tm_lock);
+    INIT_LIST_HEAD(&v->arch.hvm_vcpu.tm_list);
+    init_timer(&v->arch.hvm_vcpu.tm_timer, pt_vcpu_timer_fn, v,
+               v->processor);
+}
+
+void pt_vcpu_destroy(struct vcpu *v)
+{
+    kill_timer(&v->arch.hvm_vcpu.tm_timer);
+}
 
+void pt_save_timer(struct vcpu *v)
+{
     if ( test_bit(_VPF_blocked, &v->pause_flags) )
         return;
 
     spin_lock(&v->arch.hvm_vcpu.tm_lock);
 
-    list_for_each_entry ( pt, head, list )
-        if ( !pt->do_not_freeze )
-            stop_timer(&pt->timer);
+    v->arch.hvm_vcpu.tm_frozen = 1;
+    pt_program_timer(v);
 
     pt_freeze_time(v);
 
@@ -201,28 +242,49 @@ void pt_restore_timer(struct vcpu *v)
         if ( pt->pending_intr_nr == 0 )
         {
             pt_process_missed_ticks(pt);
-            set_timer(&pt->timer, pt->scheduled);
+            pt->armed = 1;
         }
     }
 
+    v->arch.hvm_vcpu.tm_frozen = 0;
+    pt_program_timer(v);
+
     pt_thaw_time(v);
 
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
 
-static void pt_timer_fn(void *data)
+static void pt_vcpu_timer_fn(void *data)
 {
-    struct periodic_time *pt = data;
+    struct vcpu *v = data;
+    struct periodic_time *pt;
+    s_time_t now = NOW();
+    bool_t fired = 0;
 
-    pt_lock(pt);
+    spin_lock(&v->arch.hvm_vcpu.tm_lock);
 
-    pt->pending_intr_nr++;
-    pt->scheduled += pt->period;
-    pt->do_not_freeze = 0;
+    list_for_each_entry ( pt, &v->arch.hvm_vcpu.tm_list, list )
+    {
+        if ( !pt->armed || (pt->scheduled > now) ||
+             (v->arch.hvm_vcpu.tm_frozen && !pt->do_not_freeze) )
+            continue;
+
+        pt->armed = 0;
+        pt->pending_intr_nr++;
+        pt->scheduled += pt->period;
+        pt->do_not_freeze = 0;
+        fired = 1;
+    }
 
-    vcpu_kick(pt->vcpu);
+    if ( fired )
+    {
+        v->arch.hvm_vcpu.tm_pending = 1;
+        vcpu_kick(v);
+    }
 
-    pt_unlock(pt);
+    pt_program_timer(v);
+
+    spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
 
 int pt_update_irq(struct vcpu *v)
@@ -233,6 +295,14 @@ int pt_update_irq(struct vcpu *v)
     int irq, is_lapic;
     void *pt_priv;
 
+    /*
+     * Nothing can be due unless a tick was taken since the last scan found
+     * none. A tick racing with this check kicks the vCPU, so VM entry comes
+     * back here.
+     */
+    if ( !v->arch.hvm_vcpu.tm_pending )
+        return -1;
+
  rescan:
     spin_lock(&v->arch.hvm_vcpu.tm_lock);
 
@@ -263,6 +333,7 @@ int pt_update_irq(struct vcpu *v)
 
     if ( earliest_pt == NULL )
     {
+        v->arch.hvm_vcpu.tm_pending = 0;
         spin_unlock(&v->arch.hvm_vcpu.tm_lock);
         return -1;
     }
@@ -292,7 +363,7 @@ int pt_update_irq(struct vcpu *v)
              */
             earliest_pt->pending_intr_nr = 0;
             earliest_pt->irq_issued = 0;
-            set_timer(&earliest_pt->timer, earliest_pt->scheduled);
+            pt_arm(earliest_pt);
         }
         else if ( irq >= 0 && pt_irq_masked(earliest_pt) )
         {
@@ -380,7 +451,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
         pt->last_plt_gtime = hvm_get_guest_time(v);
         pt_process_missed_ticks(pt);
         pt->pending_intr_nr = 0; /* 'collapse' all missed ticks */
-        set_timer(&pt->timer, pt->scheduled);
+        pt_arm(pt);
     }
     else
     {
@@ -389,7 +460,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
         {
             pt_process_missed_ticks(pt);
             if ( pt->pending_intr_nr == 0 )
-                set_timer(&pt->timer, pt->scheduled);
+                pt_arm(pt);
         }
     }
 
@@ -408,15 +479,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
 
 void pt_migrate(struct vcpu *v)
 {
-    struct list_head *head = &v->arch.hvm_vcpu.tm_list;
-    struct periodic_time *pt;
-
-    spin_lock(&v->arch.hvm_vcpu.tm_lock);
-
-    list_for_each_entry ( pt, head, list )
-        migrate_timer(&pt->timer, v->processor);
-
-    spin_unlock(&v->arch.hvm_vcpu.tm_lock);
+    migrate_timer(&v->arch.hvm_vcpu.tm_timer, v->processor);
 }
 
 void create_periodic_time(
@@ -473,8 +536,7 @@ void create_periodic_time(
     pt->on_list = 1;
     list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
-    init_timer(&pt->timer, pt_timer_fn, pt, v->processor);
-    set_timer(&pt->timer, pt->scheduled);
+    pt_arm(pt);
 
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
@@ -490,13 +552,13 @@ void destroy_periodic_time(struct periodic_time *pt)
         list_del(&pt->list);
     pt->on_list = 0;
     pt->pending_intr_nr = 0;
+    if ( pt->armed )
+    {
+        /* The vCPU's timer only ever looks at listed timers. */
+        pt->armed = 0;
+        pt_program_timer(pt->vcpu);
+    }
     pt_unlock(pt);
-
-    /*
-     * pt_timer_fn() can run until this kill_timer() returns. We must do this
-     * outside pt_lock() otherwise we can deadlock with pt_timer_fn().
-     */
-    kill_timer(&pt->timer);
 }
 
 static void pt_adjust_vcpu(struct periodic_time *pt, struct vcpu *v)
@@ -513,6 +575,8 @@ static void pt_adjust_vcpu(struct periodic_time *pt, struct vcpu *v)
     if ( pt->on_list )
         list_del(&pt->list);
     pt->on_list = 0;
+    if ( pt->armed )
+        pt_program_timer(pt->vcpu);
     pt_unlock(pt);
 
     spin_lock(&v->arch.hvm_vcpu.tm_lock);
@@ -522,7 +586,10 @@ static void pt_adjust_vcpu(struct periodic_time *pt, struct vcpu *v)
         pt->on_list = 1;
         list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
-        migrate_timer(&pt->timer, v->processor);
+        if ( pt->pending_intr_nr )
+            v->arch.hvm_vcpu.tm_pending = 1;
+        if ( pt->armed )
+            pt_program_timer(v);
     }
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
@@ -565,6 +632,7 @@ static void pt_resume(struct periodic_time *pt)
     {
         pt->on_list = 1;
         list_add(&pt->list, &pt->vcpu->arch.hvm_vcpu.tm_list);
+        pt->vcpu->arch.hvm_vcpu.tm_pending = 1;
         vcpu_kick(pt->vcpu);
     }
     pt_unlock(pt);
@@ -580,6 +648,7 @@ void pt_may_unmask_irq(struct domain *d, struct periodic_time *vlapic_pt)
         pt_resume(&d->arch.hvm_domain.pl_time.vrtc.pt);
         for ( i = 0; i < HPET_TIMER_NUM; i++ )
             pt_resume(&d->arch.hvm_domain.pl_time.vhpet.pt[i]);
+        hpet_may_unmask_irq(d);
     }
 
     if ( vlapic_pt )
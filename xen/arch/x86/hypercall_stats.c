@@ -0,0 +1,217 @@
+/******************************************************************************
+ * arch/x86/hypercall_stats.c
+ *
+ * Latency histograms per hypercall number (XEN_SYSCTL_hypercall_stats).
+ *
+ * The PV entry paths time each hypercall when collection is enabled, as
+ * does hvm_do_hypercall().  The start time is kept in the vCPU, as the
+ * hypercall may wait (and move pCPU) before it returns; the result is
+ * accounted to the pCPU it returns on, so the counters need no locking.
+ */
+
+#include <xen/config.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/sched.h>
+#include <xen/time.h>
+#include <xen/xmalloc.h>
+#include <xen/guest_access.h>
+#include <xen/hypercall.h>
+#include <public/sysctl.h>
+
+bool_t __read_mostly hypercall_stats_enabled;
+boolean_param("hypercall_stats", hypercall_stats_enabled);
+
+struct hypercall_stats {
+    uint64_t count;
+    uint64_t continued;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t latency[XEN_SYSCTL_HYPERCALL_HIST_BUCKETS];
+};
+
+/*
+ * NR_hypercalls entries for each pCPU (up to nr_cpu_ids), allocated when
+ * collection is first enabled and kept across pCPUs going offline.
+ */
+static struct hypercall_stats *cpu_stats[NR_CPUS];
+
+/* log2 nanoseconds from 256ns, the last bucket open ended. */
+static inline unsigned int hypercall_hist_bucket(uint64_t ns)
+{
+    ns >>= 8;
+    if ( ns >> (XEN_SYSCTL_HYPERCALL_HIST_BUCKETS - 2) )
+        return XEN_SYSCTL_HYPERCALL_HIST_BUCKETS - 1;
+
+    return fls(ns);
+}
+
+void hypercall_stats_start(struct vcpu *v, unsigned int nr)
+{
+    v->arch.hcall_stats_nr = nr;
+    v->arch.hcall_stats_start = NOW();
+}
+
+void hypercall_stats_end(struct vcpu *v, bool_t continued)
+{
+    struct hypercall_stats *hs = cpu_stats[smp_processor_id()];
+    s_time_t start = v->arch.hcall_stats_start;
+    uint64_t ns;
+
+    /* Not timed, as collection was enabled while it was in progress. */
+    if ( !start || !hs )
+        return;
+    v->arch.hcall_stats_start = 0;
+
+    ns = NOW() - start;
+    hs += v->arch.hcall_stats_nr;
+    hs->count++;
+    if ( continued )
+        hs->continued++;
+    hs->total_ns += ns;
+    if ( ns > hs->max_ns )
+        hs->max_ns = ns;
+    hs->latency[hypercall_hist_bucket(ns)]++;
+}
+
+/* Called from the PV hypercall entry paths. */
+void __hypercall_stats_entry(void)
+{
+    struct vcpu *v = current;
+    struct cpu_user_regs *regs = guest_cpu_user_regs();
+
+    v->arch.hcall_stats_rip = regs->eip;
+    hypercall_stats_start(v, regs->eax);
+}
+
+/* A PV hypercall is continued by rewinding the guest to re-execute it. */
+void __hypercall_stats_exit(void)
+{
+    struct vcpu *v = current;
+
+    hypercall_stats_end(v, guest_cpu_user_regs()->eip !=
+                           v->arch.hcall_stats_rip);
+}
+
+static int hypercall_stats_enable(void)
+{
+    struct domain *d;
+    struct vcpu *v;
+    unsigned int cpu;
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        if ( cpu_stats[cpu] )
+            continue;
+        cpu_stats[cpu] = xzalloc_array(struct hypercall_stats,
+                                       NR_hypercalls);
+        if ( !cpu_stats[cpu] )
+            return -ENOMEM;
+    }
+
+    /* Forget start times left behind when collection was last disabled. */
+    rcu_read_lock(&domlist_read_lock);
+    for_each_domain ( d )
+        for_each_vcpu ( d, v )
+            v->arch.hcall_stats_start = 0;
+    rcu_read_unlock(&domlist_read_lock);
+
+    smp_wmb();
+    hypercall_stats_enabled = 1;
+
+    return 0;
+}
+
+static int __init hypercall_stats_init(void)
+{
+    if ( hypercall_stats_enabled && hypercall_stats_enable() )
+    {
+        printk(XENLOG_WARNING "Failed to allocate hypercall statistics\n");
+        hypercall_stats_enabled = 0;
+    }
+
+    return 0;
+}
+__initcall(hypercall_stats_init);
+
+/* Sum the pCPUs' counters.  Those being updated may be slightly off. */
+static int hypercall_stats_get(struct xen_sysctl_hypercall_stats *op)
+{
+    struct xen_sysctl_hypercall_stats_data data;
+    unsigned int nr, cpu, i;
+    const struct hypercall_stats *hs;
+
+    for ( nr = 0; nr < min_t(unsigned int, op->nr_hypercalls, NR_hypercalls);
+          nr++ )
+    {
+        memset(&data, 0, sizeof(data));
+
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            if ( !cpu_stats[cpu] )
+                continue;
+            hs = &cpu_stats[cpu][nr];
+
+            data.count += hs->count;
+            data.continued += hs->continued;
+            data.total_ns += hs->total_ns;
+            if ( hs->max_ns > data.max_ns )
+                data.max_ns = hs->max_ns;
+            for ( i = 0; i < XEN_SYSCTL_HYPERCALL_HIST_BUCKETS; i++ )
+                data.latency[i] += hs->latency[i];
+        }
+
+        if ( copy_to_guest_offset(op->buffer, nr, &data, 1) )
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
+int hypercall_stats_op(struct xen_sysctl_hypercall_stats *op)
+{
+    unsigned int cpu;
+    int rc = 0;
+
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_HYPERCALL_STATS_get:
+        rc = hypercall_stats_get(op);
+        break;
+
+    case XEN_SYSCTL_HYPERCALL_STATS_enable:
+        if ( !hypercall_stats_enabled )
+            rc = hypercall_stats_enable();
+        break;
+
+    case XEN_SYSCTL_HYPERCALL_STATS_disable:
+        hypercall_stats_enabled = 0;
+        break;
+
+    case XEN_SYSCTL_HYPERCALL_STATS_reset:
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+            if ( cpu_stats[cpu] )
+                memset(cpu_stats[cpu], 0,
+                       NR_hypercalls * sizeof(*cpu_stats[cpu]));
+        break;
+
+    default:
+        rc = -EINVAL;
+        break;
+    }
+
+    op->nr_hypercalls = NR_hypercalls;
+    op->enabled = hypercall_stats_enabled;
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
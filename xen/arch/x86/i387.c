@@ -45,6 +45,14 @@ static inline void fpu_xrstor(struct vcpu *v, uint64_t mask)
      */
     ok = set_xcr0(v->arch.xcr0_accum | XSTATE_FP_SSE);
     ASSERT(ok);
+    /*
+     * Components in their initial configuration both in the save image and
+     * live on this CPU need not be reloaded. FP/SSE are always loaded, as
+     * MXCSR does not take part in the SSE in-use tracking.
+     */
+    if ( cpu_has_xgetbv1 )
+        mask &= v->arch.xsave_area->xsave_hdr.xstate_bv | get_xinuse() |
+                XSTATE_FP_SSE;
     xrstor(v, mask);
     ok = set_xcr0(v->arch.xcr0 ?: XSTATE_FP_SSE);
     ASSERT(ok);
@@ -50,6 +50,16 @@ static DEFINE_SPINLOCK(vector_lock);
 
 DEFINE_PER_CPU(vector_irq_t, vector_irq);
 
+/*
+ * Per-CPU bitmap of vectors currently bound to an irq (mirrors
+ * vector_irq[] >= 0), so allocation can test a whole vector space with a
+ * few word operations, and the per-CPU position at which the next search
+ * for a free vector starts.
+ */
+static DEFINE_PER_CPU(vmask_t, vector_used);
+static DEFINE_PER_CPU(u8, vector_cursor);
+static DEFINE_PER_CPU(u8, vector_offset);
+
 DEFINE_PER_CPU(struct cpu_user_regs *, __irq_regs);
 
 static LIST_HEAD(irq_ratelimit_list);
@@ -94,6 +104,18 @@ void unlock_vector_lock(void)
     spin_unlock(&vector_lock);
 }
 
+static void bind_vector_irq(unsigned int cpu, unsigned int vector, int irq)
+{
+    per_cpu(vector_irq, cpu)[vector] = irq;
+    set_bit(vector, per_cpu(vector_used, cpu)._bits);
+}
+
+static void unbind_vector_irq(unsigned int cpu, unsigned int vector, int irq)
+{
+    per_cpu(vector_irq, cpu)[vector] = ~irq;
+    clear_bit(vector, per_cpu(vector_used, cpu)._bits);
+}
+
 static void trace_irq_mask(u32 event, int irq, int vector, cpumask_t *mask)
 {
     struct {
@@ -126,7 +148,7 @@ static int __init __bind_irq_vector(int irq, int vector, const cpumask_t *cpu_ma
         return -EBUSY;
     trace_irq_mask(TRC_HW_IRQ_BIND_VECTOR, irq, vector, &online_mask);
     for_each_cpu(cpu, &online_mask)
-        per_cpu(vector_irq, cpu)[vector] = irq;
+        bind_vector_irq(cpu, vector, irq);
     desc->arch.vector = vector;
     cpumask_copy(desc->arch.cpu_mask, &online_mask);
     if ( desc->arch.used_vectors )
@@ -251,7 +273,7 @@ static void __clear_irq_vector(int irq)
 
     for_each_cpu(cpu, &tmp_mask) {
         ASSERT( per_cpu(vector_irq, cpu)[vector] == irq );
-        per_cpu(vector_irq, cpu)[vector] = ~irq;
+        unbind_vector_irq(cpu, vector, irq);
     }
 
     desc->arch.vector = IRQ_VECTOR_UNASSIGNED;
@@ -277,7 +299,7 @@ static void __clear_irq_vector(int irq)
     for_each_cpu(cpu, &tmp_mask) {
         ASSERT( per_cpu(vector_irq, cpu)[old_vector] == irq );
         TRACE_3D(TRC_HW_IRQ_MOVE_FINISH, irq, old_vector, cpu);
-        per_cpu(vector_irq, cpu)[old_vector] = ~irq;
+        unbind_vector_irq(cpu, old_vector, irq);
     }
 
     desc->arch.old_vector = IRQ_VECTOR_UNASSIGNED;
@@ -432,8 +454,12 @@ static vmask_t *irq_get_used_vector_mask(int irq)
     return ret;
 }
 
-static int __assign_irq_vector(
-    int irq, struct irq_desc *desc, const cpumask_t *mask)
+/*
+ * Find a vector which is free on every CPU in @domain, starting the search
+ * at @cpu's cursor.  Returns the vector, or -ENOSPC.
+ */
+static int find_free_vector(unsigned int cpu, const cpumask_t *domain,
+                            const vmask_t *irq_used_vectors)
 {
     /*
      * NOTE! The local APIC isn't very good at handling
@@ -446,9 +472,51 @@ static int __assign_irq_vector(
      * Also, we've got to be careful not to trash gate
      * 0x80, because int 0x80 is hm, kind of importantish. ;)
      */
-    static int current_vector = FIRST_DYNAMIC_VECTOR, current_offset = 0;
-    int cpu, err, old_vector;
-    cpumask_t tmp_mask;
+    DECLARE_BITMAP(busy, NR_VECTORS);
+    unsigned int new_cpu;
+    int vector, offset, start;
+
+    bitmap_copy(busy, used_vectors, NR_VECTORS);
+    if ( irq_used_vectors )
+        bitmap_or(busy, busy, irq_used_vectors->_bits, NR_VECTORS);
+    for_each_cpu(new_cpu, domain)
+        bitmap_or(busy, busy, per_cpu(vector_used, new_cpu)._bits,
+                  NR_VECTORS);
+
+    if ( find_next_zero_bit(busy, LAST_DYNAMIC_VECTOR + 1,
+                            FIRST_DYNAMIC_VECTOR) > LAST_DYNAMIC_VECTOR )
+        return -ENOSPC;
+
+    start = vector = max_t(int, per_cpu(vector_cursor, cpu),
+                           FIRST_DYNAMIC_VECTOR);
+    offset = per_cpu(vector_offset, cpu);
+    for ( ; ; )
+    {
+        vector += 8;
+        if ( vector > LAST_DYNAMIC_VECTOR )
+        {
+            /* If out of vectors on large boxen, must share them. */
+            offset = (offset + 1) % 8;
+            vector = FIRST_DYNAMIC_VECTOR + offset;
+        }
+        if ( unlikely(vector == start) )
+            return -ENOSPC;
+        if ( !test_bit(vector, busy) )
+            break;
+    }
+
+    per_cpu(vector_cursor, cpu) = vector;
+    per_cpu(vector_offset, cpu) = offset;
+
+    return vector;
+}
+
+static int __assign_irq_vector(
+    int irq, struct irq_desc *desc, const cpumask_t *mask)
+{
+    int old_vector, vector = -ENOSPC;
+    unsigned int cpu, new_cpu, load, best_load = UINT_MAX;
+    cpumask_t tmp_mask, todo;
     vmask_t *irq_used_vectors = NULL;
 
     old_vector = irq_to_vector(irq);
@@ -463,8 +531,6 @@ static int __assign_irq_vector(
     if ( desc->arch.move_in_progress || desc->arch.move_cleanup_count )
         return -EAGAIN;
 
-    err = -ENOSPC;
-
     /* This is the only place normal IRQs are ever marked
      * as "in use".  If they're not in use yet, check to see
      * if we need to assign a global vector mask. */
@@ -475,69 +541,66 @@ static int __assign_irq_vector(
     else
         irq_used_vectors = irq_get_used_vector_mask(irq);
 
-    for_each_cpu(cpu, mask) {
-        int new_cpu;
-        int vector, offset;
-
-        /* Only try and allocate irqs on cpus that are present. */
-        if (!cpu_online(cpu))
-            continue;
+    /*
+     * Only try and allocate irqs on cpus that are present.  Try the least
+     * loaded CPU's allocation domain first, so that vectors get spread over
+     * all of @mask rather than piling up on its lowest numbered CPUs, and
+     * fall back to the remaining domains in order.
+     */
+    cpumask_and(&todo, mask, &cpu_online_map);
+    cpu = nr_cpu_ids;
+    for_each_cpu(new_cpu, &todo)
+    {
+        load = bitmap_weight(per_cpu(vector_used, new_cpu)._bits, NR_VECTORS);
+        if ( load < best_load )
+        {
+            best_load = load;
+            cpu = new_cpu;
+        }
+    }
 
+    while ( cpu < nr_cpu_ids )
+    {
         cpumask_and(&tmp_mask, vector_allocation_cpumask(cpu),
                     &cpu_online_map);
+        cpumask_clear_cpu(cpu, &todo);
+        cpumask_andnot(&todo, &todo, &tmp_mask);
 
-        vector = current_vector;
-        offset = current_offset;
-next:
-        vector += 8;
-        if (vector > LAST_DYNAMIC_VECTOR) {
-            /* If out of vectors on large boxen, must share them. */
-            offset = (offset + 1) % 8;
-            vector = FIRST_DYNAMIC_VECTOR + offset;
-        }
-        if (unlikely(current_vector == vector))
-            continue;
+        vector = find_free_vector(cpu, &tmp_mask, irq_used_vectors);
+        if ( vector >= 0 )
+            break;
 
-        if (test_bit(vector, used_vectors))
-            goto next;
-
-        if (irq_used_vectors
-            && test_bit(vector, irq_used_vectors) )
-            goto next;
-
-        for_each_cpu(new_cpu, &tmp_mask)
-            if (per_cpu(vector_irq, new_cpu)[vector] >= 0)
-                goto next;
-        /* Found one! */
-        current_vector = vector;
-        current_offset = offset;
-        if (old_vector > 0) {
-            desc->arch.move_in_progress = 1;
-            cpumask_copy(desc->arch.old_cpu_mask, desc->arch.cpu_mask);
-            desc->arch.old_vector = desc->arch.vector;
-        }
-        trace_irq_mask(TRC_HW_IRQ_ASSIGN_VECTOR, irq, vector, &tmp_mask);
-        for_each_cpu(new_cpu, &tmp_mask)
-            per_cpu(vector_irq, new_cpu)[vector] = irq;
-        desc->arch.vector = vector;
-        cpumask_copy(desc->arch.cpu_mask, &tmp_mask);
+        cpu = cpumask_first(&todo);
+    }
 
-        desc->arch.used = IRQ_USED;
-        ASSERT((desc->arch.used_vectors == NULL)
-               || (desc->arch.used_vectors == irq_used_vectors));
-        desc->arch.used_vectors = irq_used_vectors;
+    if ( vector < 0 )
+        return vector;
 
-        if ( desc->arch.used_vectors )
-        {
-            ASSERT(!test_bit(vector, desc->arch.used_vectors));
+    /* Found one! */
+    if (old_vector > 0) {
+        desc->arch.move_in_progress = 1;
+        cpumask_copy(desc->arch.old_cpu_mask, desc->arch.cpu_mask);
+        desc->arch.old_vector = desc->arch.vector;
+    }
+    trace_irq_mask(TRC_HW_IRQ_ASSIGN_VECTOR, irq, vector, &tmp_mask);
+    for_each_cpu(new_cpu, &tmp_mask)
+        bind_vector_irq(new_cpu, vector, irq);
+    desc->arch.vector = vector;
+    cpumask_copy(desc->arch.cpu_mask, &tmp_mask);
 
-            set_bit(vector, desc->arch.used_vectors);
-        }
+    desc->arch.used = IRQ_USED;
+    ASSERT((desc->arch.used_vectors == NULL)
+           || (desc->arch.used_vectors == irq_used_vectors));
+    desc->arch.used_vectors = irq_used_vectors;
 
-        err = 0;
-        break;
+    if ( desc->arch.used_vectors )
+    {
+        ASSERT(!test_bit(vector, desc->arch.used_vectors));
+
+        set_bit(vector, desc->arch.used_vectors);
     }
-    return err;
+
+    return 0;
 }
 
 int assign_irq_vector(int irq, const cpumask_t *mask)
@@ -569,6 +632,7 @@ void __setup_vector_irq(int cpu)
     /* Clear vector_irq */
     for (vector = 0; vector < NR_VECTORS; ++vector)
         per_cpu(vector_irq, cpu)[vector] = INT_MIN;
+    bitmap_zero(per_cpu(vector_used, cpu)._bits, NR_VECTORS);
     /* Mark the inuse vectors */
     for (irq = 0; irq < nr_irqs; ++irq) {
         struct irq_desc *desc = irq_to_desc(irq);
@@ -577,7 +641,7 @@ void __setup_vector_irq(int cpu)
             !cpumask_test_cpu(cpu, desc->arch.cpu_mask))
             continue;
         vector = irq_to_vector(irq);
-        per_cpu(vector_irq, cpu)[vector] = irq;
+        bind_vector_irq(cpu, vector, irq);
     }
 }
 
@@ -675,7 +739,7 @@ void irq_move_cleanup_interrupt(struct cpu_user_regs *regs)
         TRACE_3D(TRC_HW_IRQ_MOVE_CLEANUP,
                  irq, vector, smp_processor_id());
 
-        __get_cpu_var(vector_irq)[vector] = ~irq;
+        unbind_vector_irq(me, vector, irq);
         desc->arch.move_cleanup_count--;
 
         if ( desc->arch.move_cleanup_count == 0 )
@@ -1997,7 +2061,7 @@ int map_domain_pirq(
             spin_unlock_irqrestore(&desc->lock, flags);
 
             info = NULL;
-            irq = create_irq(NUMA_NO_NODE);
+            irq = create_irq(pdev->node);
             ret = irq >= 0 ? prepare_domain_irq_pirq(d, irq, pirq + nr, &info)
                            : irq;
             if ( ret )
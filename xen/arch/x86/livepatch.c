@@ -0,0 +1,181 @@
+/******************************************************************************
+ * arch/x86/livepatch.c
+ *
+ * x86 parts of replacing hypervisor functions at run time.
+ */
+
+#include <xen/config.h>
+#include <xen/types.h>
+#include <xen/lib.h>
+#include <xen/errno.h>
+#include <xen/mm.h>
+#include <xen/livepatch.h>
+#include <asm/page.h>
+#include <asm/processor.h>
+
+/* jmp rel32, written over the start of a replaced function. */
+#define PATCH_INSN_SIZE 5
+
+/*
+ * Payloads are reached from, and reach into, the hypervisor's text with
+ * 32-bit displacements, so they live in the unused part of its 1GB slot
+ * (just like the hypervisor, mapped read/write/execute).
+ */
+#define LIVEPATCH_VA_PAGES (MB(64) >> PAGE_SHIFT)
+static DECLARE_BITMAP(livepatch_va_map, LIVEPATCH_VA_PAGES);
+
+static void livepatch_unmap(unsigned long va, unsigned int nr_pages)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_pages; i++, va += PAGE_SIZE )
+    {
+        unsigned long mfn = l1e_get_pfn(*virt_to_xen_l1e(va));
+
+        destroy_xen_mappings(va, va + PAGE_SIZE);
+        free_domheap_page(mfn_to_page(mfn));
+    }
+}
+
+void *arch_livepatch_alloc(unsigned int nr_pages)
+{
+    unsigned int limit = min_t(unsigned long, LIVEPATCH_VA_PAGES,
+                               (XEN_VIRT_END - xen_virt_end) >> PAGE_SHIFT);
+    unsigned int start, end = 0, i;
+    unsigned long va;
+
+    for ( start = find_first_zero_bit(livepatch_va_map, limit);
+          start < limit;
+          start = find_next_zero_bit(livepatch_va_map, limit, end) )
+    {
+        end = find_next_bit(livepatch_va_map, limit, start);
+        if ( end - start >= nr_pages )
+            break;
+    }
+    if ( start >= limit )
+        return NULL;
+
+    va = xen_virt_end + ((unsigned long)start << PAGE_SHIFT);
+    for ( i = 0; i < nr_pages; i++ )
+    {
+        unsigned long v = va + ((unsigned long)i << PAGE_SHIFT);
+        struct page_info *pg = alloc_domheap_page(NULL, 0);
+
+        if ( !pg || map_pages_to_xen(v, page_to_mfn(pg), 1, PAGE_HYPERVISOR) )
+        {
+            if ( pg )
+                free_domheap_page(pg);
+            livepatch_unmap(va, i);
+            return NULL;
+        }
+        clear_page((void *)v);
+    }
+
+    for ( i = 0; i < nr_pages; i++ )
+        __set_bit(start + i, livepatch_va_map);
+
+    return (void *)va;
+}
+
+void arch_livepatch_free(void *va, unsigned int nr_pages)
+{
+    unsigned int start = ((unsigned long)va - xen_virt_end) >> PAGE_SHIFT;
+    unsigned int i;
+
+    livepatch_unmap((unsigned long)va, nr_pages);
+    for ( i = 0; i < nr_pages; i++ )
+        __clear_bit(start + i, livepatch_va_map);
+}
+
+int arch_livepatch_verify_elf(const Elf64_Ehdr *hdr)
+{
+    return hdr->e_machine == EM_X86_64 ? 0 : -EOPNOTSUPP;
+}
+
+int arch_livepatch_verify_func(const struct livepatch_func *func)
+{
+    long disp = (long)func->new_addr -
+                ((long)func->old_addr + PATCH_INSN_SIZE);
+
+    if ( func->old_size < PATCH_INSN_SIZE || disp != (int32_t)disp )
+        return -EINVAL;
+
+    return 0;
+}
+
+int arch_livepatch_relocate(unsigned int type, void *dest, unsigned long room,
+                            uint64_t val)
+{
+    switch ( type )
+    {
+    case R_X86_64_NONE:
+        break;
+
+    case R_X86_64_64:
+        if ( room < sizeof(uint64_t) )
+            return -EINVAL;
+        *(uint64_t *)dest = val;
+        break;
+
+    case R_X86_64_PC32:
+    case R_X86_64_PLT32:
+        val -= (uint64_t)dest;
+        /* fall through */
+    case R_X86_64_32S:
+        if ( room < sizeof(uint32_t) )
+            return -EINVAL;
+        if ( (int64_t)val != (int32_t)val )
+            return -EOVERFLOW;
+        *(uint32_t *)dest = val;
+        break;
+
+    case R_X86_64_32:
+        if ( room < sizeof(uint32_t) )
+            return -EINVAL;
+        if ( val != (uint32_t)val )
+            return -EOVERFLOW;
+        *(uint32_t *)dest = val;
+        break;
+
+    default:
+        return -EOPNOTSUPP;
+    }
+
+    return 0;
+}
+
+void arch_livepatch_apply(struct livepatch_func *func)
+{
+    uint8_t insn[PATCH_INSN_SIZE];
+    int32_t disp = (long)func->new_addr -
+                   ((long)func->old_addr + PATCH_INSN_SIZE);
+
+    BUILD_BUG_ON(PATCH_INSN_SIZE > sizeof(func->opaque));
+
+    insn[0] = 0xe9;
+    memcpy(&insn[1], &disp, sizeof(disp));
+
+    memcpy(func->opaque, func->old_addr, PATCH_INSN_SIZE);
+    memcpy(func->old_addr, insn, PATCH_INSN_SIZE);
+}
+
+void arch_livepatch_revert(struct livepatch_func *func)
+{
+    memcpy(func->old_addr, func->opaque, PATCH_INSN_SIZE);
+}
+
+void arch_livepatch_sync(void)
+{
+    /* Cross-modified code needs a serialising instruction. */
+    sync_core();
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
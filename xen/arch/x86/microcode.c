@@ -31,6 +31,7 @@
 #include <xen/smp.h>
 #include <xen/softirq.h>
 #include <xen/spinlock.h>
+#include <xen/stop_machine.h>
 #include <xen/tasklet.h>
 #include <xen/guest_access.h>
 #include <xen/earlycpio.h>
@@ -192,6 +193,8 @@ struct microcode_info {
     unsigned int cpu;
     uint32_t buffer_size;
     int error;
+    cpumask_t cores_ready;      /* Cores which have a patch to load. */
+    cpumask_t cores_done;
     char buffer[1];
 };
 
@@ -274,7 +277,13 @@ static int microcode_update_cpu(const void *buf, size_t size)
 
     err = microcode_ops->collect_cpu_info(cpu, &uci->cpu_sig);
     if ( likely(!err) )
+    {
         err = microcode_ops->cpu_request_microcode(cpu, buf, size);
+        if ( err > 0 )
+            err = microcode_ops->apply_microcode(cpu);
+        if ( microcode_ops->end_update_percpu )
+            microcode_ops->end_update_percpu();
+    }
     else
         __microcode_fini_cpu(cpu);
 
@@ -283,26 +292,123 @@ static int microcode_update_cpu(const void *buf, size_t size)
     return err;
 }
 
-static long do_microcode_update(void *_info)
+/*
+ * Run on all online cpus at once, with interrupts off, so nothing may be
+ * allocated here.  The lowest thread of each core loads the patch
+ * microcode_prepare_core() found for it, all cores in parallel; its
+ * siblings, which share the core's microcode, wait for it without
+ * executing anything else.
+ */
+static int microcode_update_core(void *_info)
 {
     struct microcode_info *info = _info;
+    unsigned int cpu = smp_processor_id();
+    unsigned int first = cpumask_first(per_cpu(cpu_sibling_mask, cpu));
     int error;
 
-    BUG_ON(info->cpu != smp_processor_id());
+    if ( first < cpu )
+    {
+        while ( !cpumask_test_cpu(first, &info->cores_done) )
+            cpu_relax();
+    }
+    else
+    {
+        if ( cpumask_test_cpu(cpu, &info->cores_ready) )
+        {
+            error = microcode_ops->apply_microcode(cpu);
+            if ( error < 0 )
+                cmpxchg(&info->error, 0, error);
+        }
 
-    error = microcode_update_cpu(info->buffer, info->buffer_size);
-    if ( error )
-        info->error = error;
+        smp_wmb();
+        cpumask_set_cpu(cpu, &info->cores_done);
+    }
 
-    info->cpu = cpumask_next(info->cpu, &cpu_online_map);
-    if ( info->cpu < nr_cpu_ids )
-        return continue_hypercall_on_cpu(info->cpu, do_microcode_update, info);
+    if ( microcode_ops->end_update_percpu )
+        microcode_ops->end_update_percpu();
+
+    return 0;
+}
+
+/* The first online cpu from @cpu on which is the lowest thread of its core. */
+static unsigned int next_core(unsigned int cpu)
+{
+    for ( ; cpu < nr_cpu_ids; cpu = cpumask_next(cpu, &cpu_online_map) )
+        if ( cpumask_first(per_cpu(cpu_sibling_mask, cpu)) >= cpu )
+            break;
+
+    return cpu;
+}
+
+/*
+ * Visit the cores one at a time, then load the update everywhere in a
+ * single rendezvous.
+ */
+static long microcode_prepare_core(void *_info)
+{
+    struct microcode_info *info = _info;
+    unsigned int cpu = smp_processor_id();
+    struct ucode_cpu_info *uci = &per_cpu(ucode_cpu_info, cpu);
+    int error;
+
+    /*
+     * Take this core's copy of the patch found on info->cpu.  Both steps
+     * have to run on the core itself, and the copy is allocated, so this
+     * can't be done in the rendezvous.
+     */
+    if ( cpu != info->cpu )
+    {
+        spin_lock(&microcode_mutex);
+        error = microcode_ops->collect_cpu_info(cpu, &uci->cpu_sig);
+        if ( !error )
+            error = microcode_ops->microcode_resume_match(
+                cpu, per_cpu(ucode_cpu_info, info->cpu).mc.mc_valid);
+        spin_unlock(&microcode_mutex);
+
+        if ( error > 0 )
+            cpumask_set_cpu(cpu, &info->cores_ready);
+        else if ( error < 0 )
+            cmpxchg(&info->error, 0, error);
+    }
+
+    cpu = next_core(cpumask_next(cpu, &cpu_online_map));
+    if ( cpu < nr_cpu_ids )
+        return continue_hypercall_on_cpu(cpu, microcode_prepare_core, info);
+
+    error = stop_machine_run(microcode_update_core, info, NR_CPUS) ?:
+            info->error;
 
-    error = info->error;
     xfree(info);
     return error;
 }
 
+/* Parse the update once, here; the other cores take their copy of it. */
+static long do_microcode_update(void *_info)
+{
+    struct microcode_info *info = _info;
+    struct ucode_cpu_info *uci = &per_cpu(ucode_cpu_info, info->cpu);
+    int error;
+
+    BUG_ON(info->cpu != smp_processor_id());
+
+    spin_lock(&microcode_mutex);
+    error = microcode_ops->collect_cpu_info(info->cpu, &uci->cpu_sig);
+    if ( likely(!error) )
+        error = microcode_ops->cpu_request_microcode(info->cpu, info->buffer,
+                                                     info->buffer_size);
+    spin_unlock(&microcode_mutex);
+
+    if ( error <= 0 )
+    {
+        xfree(info);
+        return error;
+    }
+
+    cpumask_set_cpu(info->cpu, &info->cores_ready);
+
+    return microcode_prepare_core(info);
+}
+
 int microcode_update(XEN_GUEST_HANDLE_PARAM(const_void) buf, unsigned long len)
 {
     int ret;
@@ -327,6 +433,8 @@ int microcode_update(XEN_GUEST_HANDLE_PARAM(const_void) buf, unsigned long len)
 
     info->buffer_size = len;
     info->error = 0;
+    cpumask_clear(&info->cores_ready);
+    cpumask_clear(&info->cores_done);
     info->cpu = cpumask_first(&cpu_online_map);
 
     if ( microcode_ops->start_update )
@@ -69,9 +69,6 @@ struct mpbhdr {
     uint8_t data[];
 };
 
-/* serialize access to the physical write */
-static DEFINE_SPINLOCK(microcode_update_lock);
-
 /* See comment in start_update() for cases when this routine fails */
 static int collect_cpu_info(int cpu, struct cpu_signature *csig)
 {
@@ -151,14 +148,15 @@ static int apply_microcode(int cpu)
     if ( hdr == NULL )
         return -EINVAL;
 
-    spin_lock_irqsave(&microcode_update_lock, flags);
+    /* Only one thread per core loads at a time (see microcode.c). */
+    local_irq_save(flags);
 
     wrmsrl(MSR_AMD_PATCHLOADER, (unsigned long)hdr);
 
     /* get patch id after patching */
     rdmsrl(MSR_AMD_PATCHLEVEL, rev);
 
-    spin_unlock_irqrestore(&microcode_update_lock, flags);
+    local_irq_restore(flags);
 
     /* check current patch id and patch's id for match */
     if ( rev != hdr->patch_id )
@@ -274,7 +272,8 @@ static int cpu_request_microcode(int cpu, const void *buf, size_t bufsize)
 {
     struct microcode_amd *mc_amd, *mc_old;
     size_t offset = bufsize;
-    size_t last_offset, applied_offset = 0;
+    size_t last_offset, found_offset = 0;
+    uint32_t found_id = 0;
     int error = 0;
     struct ucode_cpu_info *uci = &per_cpu(ucode_cpu_info, cpu);
 
@@ -319,12 +318,12 @@ static int cpu_request_microcode(int cpu, const void *buf, size_t bufsize)
     while ( (error = get_ucode_from_buffer_amd(mc_amd, buf, bufsize,
                                                &offset)) == 0 )
     {
-        if ( microcode_fits(mc_amd, cpu) )
+        const struct microcode_header_amd *hdr = mc_amd->mpb;
+
+        if ( microcode_fits(mc_amd, cpu) && hdr->patch_id > found_id )
         {
-            error = apply_microcode(cpu);
-            if ( error )
-                break;
-            applied_offset = last_offset;
+            found_id = hdr->patch_id;
+            found_offset = last_offset;
         }
 
         last_offset = offset;
@@ -333,35 +332,25 @@ static int cpu_request_microcode(int cpu, const void *buf, size_t bufsize)
             break;
     }
 
-    /* On success keep the microcode patch for
-     * re-apply on resume.
-     */
-    if ( applied_offset )
+    /* Keep the newest patch, for applying and re-applying on resume. */
+    if ( found_offset )
     {
         int ret = get_ucode_from_buffer_amd(mc_amd, buf, bufsize,
-                                            &applied_offset);
+                                            &found_offset);
         if ( ret == 0 )
             xfree(mc_old);
         else
             error = ret;
     }
 
-    if ( !applied_offset || error )
+    if ( !found_offset || error )
     {
         xfree(mc_amd);
         uci->mc.mc_amd = mc_old;
     }
 
   out:
-    svm_host_osvw_init();
-
-    /*
-     * In some cases we may return an error even if processor's microcode has
-     * been updated. For example, the first patch in a container file is loaded
-     * successfully but subsequent container file processing encounters a
-     * failure.
-     */
-    return error;
+    return error ?: (found_offset != 0);
 }
 
 static int microcode_resume_match(int cpu, const void *mc)
@@ -413,11 +402,11 @@ err1:
 static int start_update(void)
 {
     /*
-     * We assume here that svm_host_osvw_init() will be called on each cpu (from
-     * cpu_request_microcode()).
+     * We assume here that svm_host_osvw_init() will be called on each cpu (as
+     * end_update_percpu()).
      *
      * Note that if collect_cpu_info() returns an error then
-     * cpu_request_microcode() will not invoked thus leaving OSVW bits not
+     * end_update_percpu() will not invoked thus leaving OSVW bits not
      * updated. Currently though collect_cpu_info() will not fail on processors
      * supporting OSVW so we will not deal with this possibility.
      */
@@ -432,6 +421,7 @@ static const struct microcode_ops microcode_amd_ops = {
     .collect_cpu_info                 = collect_cpu_info,
     .apply_microcode                  = apply_microcode,
     .start_update                     = start_update,
+    .end_update_percpu                = svm_host_osvw_init,
 };
 
 static __init int microcode_init_amd(void)
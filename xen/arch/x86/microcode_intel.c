@@ -87,9 +87,6 @@ struct extended_sigtable {
 
 #define exttable_size(et) ((et)->count * EXT_SIGNATURE_SIZE + EXT_HEADER_SIZE)
 
-/* serialize access to the physical write to MSR 0x79 */
-static DEFINE_SPINLOCK(microcode_update_lock);
-
 static int collect_cpu_info(int cpu_num, struct cpu_signature *csig)
 {
     struct cpuinfo_x86 *c = &cpu_data[cpu_num];
@@ -291,8 +288,11 @@ static int apply_microcode(int cpu)
     if ( uci->mc.mc_intel == NULL )
         return -EINVAL;
 
-    /* serialize access to the physical write to MSR 0x79 */
-    spin_lock_irqsave(&microcode_update_lock, flags);
+    /*
+     * Only one thread per core loads at a time (see microcode.c), and cores
+     * don't share their microcode, so the write needs no serialising.
+     */
+    local_irq_save(flags);
 
     /* write microcode via MSR 0x79 */
     wrmsrl(MSR_IA32_UCODE_WRITE, (unsigned long)uci->mc.mc_intel->bits);
@@ -305,7 +305,7 @@ static int apply_microcode(int cpu)
     rdmsrl(MSR_IA32_UCODE_REV, msr_content);
     val[1] = (uint32_t)(msr_content >> 32);
 
-    spin_unlock_irqrestore(&microcode_update_lock, flags);
+    local_irq_restore(flags);
     if ( val[1] != uci->mc.mc_intel->hdr.rev )
     {
         printk(KERN_ERR "microcode: CPU%d update from revision "
@@ -385,10 +385,7 @@ static int cpu_request_microcode(int cpu, const void *buf, size_t size)
     if ( offset < 0 )
         error = offset;
 
-    if ( !error && matching_count )
-        apply_microcode(cpu);
-
-    return error;
+    return error ?: (matching_count != 0);
 }
 
 static int microcode_resume_match(int cpu, const void *mc)
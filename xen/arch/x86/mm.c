@@ -104,6 +104,7 @@
 #include <xen/xmalloc.h>
 #include <xen/efi.h>
 #include <xen/grant_table.h>
+#include <xen/multicall.h>
 #include <asm/paging.h>
 #include <asm/shadow.h>
 #include <asm/page.h>
@@ -2879,6 +2880,114 @@ static inline int vcpumask_to_pcpumask(
     }
 }
 
+/*
+ * Remote TLB flushes asked for by a batch of PV pagetable operations (an
+ * mmuext_op list, or a run of pagetable sub-calls in a multicall) are
+ * merged, and sent once when the batch ends.  The local TLB is still
+ * flushed at once, as Xen accesses guest memory through guest addresses.
+ * Xen's own safety doesn't rest on these flushes: freed and retyped pages
+ * are flushed as per their tlbflush_timestamp.
+ */
+struct tlb_flush_batch {
+    unsigned int active;
+    bool_t pending;
+    bool_t all;           /* Else just @va. */
+    unsigned long va;
+    cpumask_t mask;
+};
+static DEFINE_PER_CPU(struct tlb_flush_batch, tlb_flush_batch);
+
+static void flush_tlb_batched(const cpumask_t *mask, bool_t all,
+                              unsigned long va)
+{
+    struct tlb_flush_batch *b = &this_cpu(tlb_flush_batch);
+    unsigned int cpu = smp_processor_id();
+
+    if ( !b->active && !(current->mc_state.flags & MCSF_in_multicall) )
+    {
+        if ( all )
+            flush_tlb_mask(mask);
+        else
+            flush_tlb_one_mask(mask, va);
+        return;
+    }
+
+    if ( cpumask_test_cpu(cpu, mask) )
+    {
+        if ( all )
+            flush_tlb_local();
+        else
+            flush_tlb_one_local(va);
+    }
+
+    cpumask_or(&b->mask, &b->mask, mask);
+    cpumask_clear_cpu(cpu, &b->mask);
+    if ( cpumask_empty(&b->mask) )
+        return;
+
+    if ( !b->pending )
+    {
+        b->pending = 1;
+        b->all = all;
+        b->va = va;
+        return;
+    }
+
+    perfc_incr(tlb_flushes_coalesced);
+    if ( !all && va != b->va )
+        b->all = 1;
+    b->all |= all;
+}
+
+static void flush_tlb_batch(void)
+{
+    struct tlb_flush_batch *b = &this_cpu(tlb_flush_batch);
+
+    if ( !b->pending )
+        return;
+
+    if ( b->all )
+        flush_tlb_mask(&b->mask);
+    else
+        flush_tlb_one_mask(&b->mask, b->va);
+
+    cpumask_clear(&b->mask);
+    b->pending = 0;
+}
+
+static void start_tlb_flush_batch(void)
+{
+    this_cpu(tlb_flush_batch).active++;
+}
+
+static void end_tlb_flush_batch(void)
+{
+    if ( !--this_cpu(tlb_flush_batch).active &&
+         !(current->mc_state.flags & MCSF_in_multicall) )
+        flush_tlb_batch();
+}
+
+/* A multicall's run of pagetable sub-calls ends at any other sub-call. */
+void arch_multicall_prepare(unsigned long op)
+{
+    switch ( op )
+    {
+    case __HYPERVISOR_mmu_update:
+    case __HYPERVISOR_mmuext_op:
+    case __HYPERVISOR_update_va_mapping:
+    case __HYPERVISOR_update_va_mapping_otherdomain:
+        break;
+    default:
+        flush_tlb_batch();
+        break;
+    }
+}
+
+void arch_multicall_end(void)
+{
+    flush_tlb_batch();
+}
+
 long do_mmuext_op(
     XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops,
     unsigned int count,
@@ -2932,6 +3041,8 @@ long do_mmuext_op(
         return rc;
     }
 
+    start_tlb_flush_batch();
+
     for ( i = 0; i < count; i++ )
     {
         if ( curr->arch.old_guest_table || hypercall_preempt_check() )
@@ -3172,19 +3283,18 @@ long do_mmuext_op(
                 okay = 0;
                 break;
             }
-            if ( op.cmd == MMUEXT_TLB_FLUSH_MULTI )
-                flush_tlb_mask(&pmask);
-            else
-                flush_tlb_one_mask(&pmask, op.arg1.linear_addr);
+            flush_tlb_batched(&pmask, op.cmd == MMUEXT_TLB_FLUSH_MULTI,
+                              op.arg1.linear_addr);
             break;
         }
 
         case MMUEXT_TLB_FLUSH_ALL:
-            flush_tlb_mask(d->domain_dirty_cpumask);
+            flush_tlb_batched(d->domain_dirty_cpumask, 1, 0);
             break;
     
         case MMUEXT_INVLPG_ALL:
-            flush_tlb_one_mask(d->domain_dirty_cpumask, op.arg1.linear_addr);
+            flush_tlb_batched(d->domain_dirty_cpumask, 0,
+                              op.arg1.linear_addr);
             break;
 
         case MMUEXT_FLUSH_CACHE:
@@ -3372,6 +3482,8 @@ long do_mmuext_op(
         guest_handle_add_offset(uops, 1);
     }
 
+    end_tlb_flush_batch();
+
     if ( rc == -EAGAIN )
     {
         ASSERT(i < count);
@@ -4263,13 +4375,13 @@ static int __do_update_va_mapping(
             flush_tlb_local();
             break;
         case UVMF_ALL:
-            flush_tlb_mask(d->domain_dirty_cpumask);
+            flush_tlb_batched(d->domain_dirty_cpumask, 1, 0);
             break;
         default:
             rc = vcpumask_to_pcpumask(d, const_guest_handle_from_ptr(bmap_ptr,
                                                                      void),
                                       &pmask);
-            flush_tlb_mask(&pmask);
+            flush_tlb_batched(&pmask, 1, 0);
             break;
         }
         break;
@@ -4283,13 +4395,13 @@ static int __do_update_va_mapping(
                 flush_tlb_one_local(va);
             break;
         case UVMF_ALL:
-            flush_tlb_one_mask(d->domain_dirty_cpumask, va);
+            flush_tlb_batched(d->domain_dirty_cpumask, 0, va);
             break;
         default:
             rc = vcpumask_to_pcpumask(d, const_guest_handle_from_ptr(bmap_ptr,
                                                                      void),
                                       &pmask);
-            flush_tlb_one_mask(&pmask, va);
+            flush_tlb_batched(&pmask, 0, va);
             break;
         }
         break;
@@ -4537,7 +4649,7 @@ static int xenmem_add_to_physmap_once(
                 mfn = virt_to_mfn(d->shared_info);
             break;
         case XENMAPSPACE_grant_table:
-            spin_lock(&d->grant_table->lock);
+            grant_write_lock(d->grant_table);
 
             if ( d->grant_table->gt_version == 0 )
                 d->grant_table->gt_version = 1;
@@ -4560,7 +4672,7 @@ static int xenmem_add_to_physmap_once(
                     mfn = virt_to_mfn(d->grant_table->shared_raw[idx]);
             }
 
-            spin_unlock(&d->grant_table->lock);
+            grant_write_unlock(d->grant_table);
             break;
         case XENMAPSPACE_gmfn_range:
         case XENMAPSPACE_gmfn:
@@ -5193,6 +5305,7 @@ int ptwr_do_page_fault(struct vcpu *v, unsigned long addr,
     ptwr_ctxt.cr2 = addr;
     ptwr_ctxt.pte = pte;
 
+    vcpu_perf_incr(emulations);
     rc = x86_emulate(&ptwr_ctxt.ctxt, &ptwr_emulate_ops);
 
     page_unlock(page);
@@ -5292,6 +5405,7 @@ int mmio_ro_do_page_fault(struct vcpu *v, unsigned long addr,
     if ( !rangeset_contains_singleton(mmio_ro_ranges, mfn) )
         return 0;
 
+    vcpu_perf_incr(emulations);
     rc = x86_emulate(&mmio_ro_ctxt.ctxt, &mmio_ro_emulate_ops);
 
     return rc != X86EMUL_UNHANDLEABLE ? EXCRET_fault_fixed : 0;
@@ -5662,7 +5776,8 @@ int map_pages_to_xen(
             pl1e  = l2e_to_l1e(*pl2e) + l1_table_offset(virt);
             ol1e  = *pl1e;
             l1e_write_atomic(pl1e, l1e_from_pfn(mfn, flags));
-            if ( (l1e_get_flags(ol1e) & _PAGE_PRESENT) )
+            if ( (l1e_get_flags(ol1e) & _PAGE_PRESENT) &&
+                 !(flags & MAP_NO_FLUSH) )
             {
                 unsigned int flush_flags = FLUSH_TLB | FLUSH_ORDER(0);
 
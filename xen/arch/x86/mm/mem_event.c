@@ -50,6 +50,7 @@ static int mem_event_enable(
 {
     int rc;
     unsigned long ring_gfn = d->arch.hvm_domain.params[param];
+    unsigned int ring_pages = mec->ring_pages ?: 1;
 
     /* Only one helper at a time. If the helper crashed,
      * the ring is in an undefined state and so is the guest.
@@ -62,11 +63,20 @@ static int mem_event_enable(
     if ( ring_gfn == 0 )
         return -ENOSYS;
 
+    /* The ring only uses a power of two worth of entries */
+    if ( ring_pages > XEN_MEM_EVENT_RING_PAGES_MAX ||
+         (ring_pages & (ring_pages - 1)) )
+        return -EINVAL;
+
+    if ( mec->flags & ~XEN_MEM_EVENT_LAZY_KICK )
+        return -EINVAL;
+
     mem_event_ring_lock_init(med);
     mem_event_ring_lock(med);
 
-    rc = prepare_ring_for_helper(d, ring_gfn, &med->ring_pg_struct, 
-                                    &med->ring_page);
+    med->ring_pages = ring_pages;
+    rc = prepare_ring_pages_for_helper(d, ring_gfn, ring_pages,
+                                       med->ring_pg_struct, &med->ring_page);
     if ( rc < 0 )
         goto err;
 
@@ -85,11 +95,13 @@ static int mem_event_enable(
     /* Prepare ring buffer */
     FRONT_RING_INIT(&med->front_ring,
                     (mem_event_sring_t *)med->ring_page,
-                    PAGE_SIZE);
+                    ring_pages * PAGE_SIZE);
 
     /* Save the pause flag for this particular ring. */
     med->pause_flag = pause_flag;
 
+    med->lazy_kick = !!(mec->flags & XEN_MEM_EVENT_LAZY_KICK);
+
     /* Initialize the last-chance wait queue. */
     init_waitqueue_head(&med->wq);
 
@@ -97,8 +109,8 @@ static int mem_event_enable(
     return 0;
 
  err:
-    destroy_ring_for_helper(&med->ring_page, 
-                            med->ring_pg_struct);
+    destroy_ring_pages_for_helper(&med->ring_page, med->ring_pg_struct,
+                                  med->ring_pages);
     mem_event_ring_unlock(med);
 
     return rc;
@@ -226,8 +238,8 @@ static int mem_event_disable(struct domain *d, struct mem_event_domain *med)
             }
         }
 
-        destroy_ring_for_helper(&med->ring_page, 
-                                med->ring_pg_struct);
+        destroy_ring_pages_for_helper(&med->ring_page, med->ring_pg_struct,
+                                      med->ring_pages);
         mem_event_ring_unlock(med);
     }
 
@@ -271,7 +283,7 @@ void mem_event_put_request(struct domain *d,
                            mem_event_request_t *req)
 {
     mem_event_front_ring_t *front_ring;
-    int free_req;
+    int free_req, notify = 1;
     unsigned int avail_req;
     RING_IDX req_prod;
 
@@ -293,9 +305,14 @@ void mem_event_put_request(struct domain *d,
     memcpy(RING_GET_REQUEST(front_ring, req_prod), req, sizeof(*req));
     req_prod++;
 
-    /* Update ring */
+    /* Update ring.  A helper which asked for lazy kicks is only kicked
+     * once it has caught up with the requests already there: it sets
+     * req_event before it waits, and will otherwise pick this one up. */
     front_ring->req_prod_pvt = req_prod;
-    RING_PUSH_REQUESTS(front_ring);
+    if ( med->lazy_kick )
+        RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(front_ring, notify);
+    else
+        RING_PUSH_REQUESTS(front_ring);
 
     /* We've actually *used* our reservation, so release the slot. */
     mem_event_release_slot(d, med);
@@ -309,40 +326,58 @@ void mem_event_put_request(struct domain *d,
 
     mem_event_ring_unlock(med);
 
-    notify_via_xen_event_channel(d, med->xen_port);
+    if ( notify )
+        notify_via_xen_event_channel(d, med->xen_port);
 }
 
-int mem_event_get_response(struct domain *d, struct mem_event_domain *med, mem_event_response_t *rsp)
+/*
+ * Pull up to nr responses off the ring in one go, returning how many were
+ * copied to rsp[].  Waiters for ring space are woken once for the whole
+ * batch, rather than once per response.
+ */
+unsigned int mem_event_get_responses(struct domain *d,
+                                     struct mem_event_domain *med,
+                                     mem_event_response_t *rsp,
+                                     unsigned int nr)
 {
     mem_event_front_ring_t *front_ring;
     RING_IDX rsp_cons;
+    unsigned int i;
 
     mem_event_ring_lock(med);
 
     front_ring = &med->front_ring;
     rsp_cons = front_ring->rsp_cons;
 
-    if ( !RING_HAS_UNCONSUMED_RESPONSES(front_ring) )
+    for ( i = 0; i < nr && RING_HAS_UNCONSUMED_RESPONSES(front_ring); i++ )
+    {
+        /* Copy response */
+        memcpy(&rsp[i], RING_GET_RESPONSE(front_ring, rsp_cons),
+               sizeof(*rsp));
+        front_ring->rsp_cons = ++rsp_cons;
+    }
+
+    if ( i == 0 )
     {
         mem_event_ring_unlock(med);
         return 0;
     }
 
-    /* Copy response */
-    memcpy(rsp, RING_GET_RESPONSE(front_ring, rsp_cons), sizeof(*rsp));
-    rsp_cons++;
-
     /* Update ring */
-    front_ring->rsp_cons = rsp_cons;
     front_ring->sring->rsp_event = rsp_cons + 1;
 
-    /* Kick any waiters -- since we've just consumed an event,
+    /* Kick any waiters -- since we've just consumed events,
      * there may be additional space available in the ring. */
     mem_event_wake(d, med);
 
     mem_event_ring_unlock(med);
 
-    return 1;
+    return i;
+}
+
+int mem_event_get_response(struct domain *d, struct mem_event_domain *med, mem_event_response_t *rsp)
+{
+    return mem_event_get_responses(d, med, rsp, 1);
 }
 
 void mem_event_cancel_slot(struct domain *d, struct mem_event_domain *med)
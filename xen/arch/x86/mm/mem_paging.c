@@ -21,10 +21,37 @@
  */
 
 
+#include <xen/guest_access.h>
 #include <asm/p2m.h>
 #include <asm/mem_event.h>
 
 
+static int mem_paging_batch(struct domain *d, xen_mem_event_op_t *mec)
+{
+    xen_mem_paging_batch_t *list = (void *)(unsigned long)mec->buffer;
+    xen_mem_paging_batch_t e;
+    unsigned long i;
+
+    if ( mec->gfn > XENMEM_PAGING_BATCH_MAX )
+        return -EINVAL;
+
+    for ( i = 0; i < mec->gfn; i++ )
+    {
+        if ( copy_from_user(&e, list + i, sizeof(e)) )
+            return -EFAULT;
+
+        if ( mec->op == XENMEM_paging_op_nominate_batch )
+            e.status = p2m_mem_paging_nominate(d, e.gfn);
+        else
+            e.status = p2m_mem_paging_evict(d, e.gfn);
+
+        if ( copy_to_user(&list[i].status, &e.status, sizeof(e.status)) )
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
 int mem_paging_memop(struct domain *d, xen_mem_event_op_t *mec)
 {
     if ( unlikely(!d->mem_event->paging.ring_page) )
@@ -53,6 +80,10 @@ int mem_paging_memop(struct domain *d, xen_mem_event_op_t *mec)
     }
     break;
 
+    case XENMEM_paging_op_nominate_batch:
+    case XENMEM_paging_op_evict_batch:
+        return mem_paging_batch(d, mec);
+
     default:
         return -ENOSYS;
         break;
@@ -26,6 +26,7 @@
 #include <xen/spinlock.h>
 #include <xen/mm.h>
 #include <xen/grant_table.h>
+#include <xen/guest_access.h>
 #include <xen/sched.h>
 #include <asm/page.h>
 #include <asm/string.h>
@@ -33,6 +34,7 @@
 #include <asm/mem_event.h>
 #include <asm/atomic.h>
 #include <xen/rcupdate.h>
+#include <xen/sort.h>
 #include <asm/event.h>
 #include <xsm/xsm.h>
 
@@ -591,16 +593,21 @@ unsigned int mem_sharing_get_nr_shared_mfns(void)
 
 int mem_sharing_sharing_resume(struct domain *d)
 {
-    mem_event_response_t rsp;
+    mem_event_response_t rsp[MEM_EVENT_RESPONSE_BATCH];
+    unsigned int i, nr;
 
-    /* Get all requests off the ring */
-    while ( mem_event_get_response(d, &d->mem_event->share, &rsp) )
+    /* Get all requests off the ring, a batch at a time */
+    while ( (nr = mem_event_get_responses(d, &d->mem_event->share, rsp,
+                                          ARRAY_SIZE(rsp))) != 0 )
     {
-        if ( rsp.flags & MEM_EVENT_FLAG_DUMMY )
-            continue;
-        /* Unpause domain/vcpu */
-        if ( rsp.flags & MEM_EVENT_FLAG_VCPU_PAUSED )
-            vcpu_unpause(d->vcpu[rsp.vcpu_id]);
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( rsp[i].flags & MEM_EVENT_FLAG_DUMMY )
+                continue;
+            /* Unpause domain/vcpu */
+            if ( rsp[i].flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+                vcpu_unpause(d->vcpu[rsp[i].vcpu_id]);
+        }
     }
 
     return 0;
@@ -1293,6 +1300,212 @@ int relinquish_shared_pages(struct domain *d)
     return rc;
 }
 
+/* Records hashed per XENMEM_sharing_op_hash_range call, at most. */
+#define HASH_RANGE_BATCH    256
+
+#define HASH_PRIME1         0x9e3779b185ebca87ULL
+#define HASH_PRIME2         0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3         0x165667b19e3779f9ULL
+#define HASH_ROTL(x, r)     (((x) << (r)) | ((x) >> (64 - (r))))
+#define HASH_ROUND(acc, w)  \
+    ((acc) = HASH_ROTL((acc) + (w) * HASH_PRIME2, 31) * HASH_PRIME1)
+
+/*
+ * Fast non-cryptographic page hash (xxhash64-style). Four independent
+ * accumulators keep the multiplies pipelined; this only selects sharing
+ * candidates, so collisions cost a compare in the tool, not correctness.
+ */
+static uint64_t mem_sharing_hash_page(const void *page)
+{
+    const uint64_t *w = page;
+    uint64_t a = HASH_PRIME1 + HASH_PRIME2, b = HASH_PRIME2, c = 0;
+    uint64_t d = -HASH_PRIME1, h;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*w); i += 4 )
+    {
+        HASH_ROUND(a, w[i]);
+        HASH_ROUND(b, w[i + 1]);
+        HASH_ROUND(c, w[i + 2]);
+        HASH_ROUND(d, w[i + 3]);
+    }
+
+    h = HASH_ROTL(a, 1) + HASH_ROTL(b, 7) + HASH_ROTL(c, 12) +
+        HASH_ROTL(d, 18);
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static int hash_record_cmp(const void *a, const void *b)
+{
+    const xen_mem_sharing_hash_t *l = a, *r = b;
+
+    if ( l->hash != r->hash )
+        return l->hash < r->hash ? -1 : 1;
+    return l->gfn < r->gfn ? -1 : (l->gfn > r->gfn);
+}
+
+/*
+ * Hash the sharable pages of a gfn range so that a tool can find sharing
+ * candidates without mapping every page of the guest itself. Records are
+ * sorted by hash, so pages with equal contents come out adjacent.
+ */
+static int mem_sharing_hash_range(struct domain *d,
+                                  struct mem_sharing_op_hash_range *hr)
+{
+    xen_mem_sharing_hash_t *recs;
+    unsigned long gfn = hr->first_gfn, last;
+    unsigned int nr, max = min_t(uint32_t, hr->nr_hashes, HASH_RANGE_BATCH);
+    int rc = 0;
+
+    last = min_t(uint64_t, hr->last_gfn, domain_get_maximum_gpfn(d));
+    hr->last_gfn = last;
+    hr->nr_hashes = 0;
+
+    if ( gfn > last )
+        return 0;
+    if ( !max )
+        return -EINVAL;
+
+    recs = xmalloc_array(xen_mem_sharing_hash_t, max);
+    if ( !recs )
+        return -ENOMEM;
+
+    for ( nr = 0; gfn <= last && nr < max; )
+    {
+        p2m_type_t p2mt;
+        mfn_t mfn = get_gfn_query(d, gfn, &p2mt);
+
+        if ( mfn_valid(mfn) && (p2m_is_sharable(p2mt) || p2m_is_shared(p2mt)) )
+        {
+            const void *p = map_domain_page(mfn_x(mfn));
+
+            recs[nr].gfn = gfn;
+            recs[nr].hash = mem_sharing_hash_page(p);
+            recs[nr].handle = 0;
+            unmap_domain_page(p);
+
+            if ( p2m_is_shared(p2mt) )
+            {
+                struct page_info *pg = __grab_shared_page(mfn);
+
+                if ( pg )
+                {
+                    recs[nr].handle = pg->sharing->handle;
+                    mem_sharing_page_unlock(pg);
+                }
+            }
+            nr++;
+        }
+        put_gfn(d, gfn);
+
+        if ( !(++gfn & 0xff) && hypercall_preempt_check() )
+            break;
+    }
+
+    sort(recs, nr, sizeof(*recs), hash_record_cmp, NULL);
+
+    if ( copy_to_guest(hr->hashes, recs, nr) )
+        rc = -EFAULT;
+    else
+    {
+        hr->first_gfn = gfn;
+        hr->nr_hashes = nr;
+    }
+
+    xfree(recs);
+    return rc;
+}
+
+/*
+ * A page which cannot be shared, typically because the device model has
+ * it mapped, is copied into the client instead.  Where the source has its
+ * shared info page mapped, the client gets its own; other Xen pages, like
+ * grant table frames, are left out.
+ */
+static int mem_sharing_fork_copy(struct domain *d, struct domain *cd,
+                                 unsigned long gfn)
+{
+    p2m_type_t p2mt, cp2mt;
+    mfn_t mfn, cmfn;
+    struct page_info *page;
+    struct two_gfns tg;
+    int rc = 0;
+
+    get_two_gfns(d, gfn, &p2mt, NULL, &mfn,
+                 cd, gfn, &cp2mt, NULL, &cmfn,
+                 0, &tg);
+
+    if ( !mfn_valid(mfn) || !p2m_is_sharable(p2mt) || !p2m_is_hole(cp2mt) )
+        goto out;
+
+    if ( page_get_owner(mfn_to_page(mfn)) != d )
+    {
+        if ( mfn_x(mfn) == virt_to_mfn(d->shared_info) )
+            rc = guest_physmap_add_page(cd, gfn, virt_to_mfn(cd->shared_info),
+                                        0);
+        goto out;
+    }
+
+    rc = -ENOMEM;
+    page = alloc_domheap_page(cd, 0);
+    if ( page == NULL )
+        goto out;
+
+    copy_domain_page(mfn_x(page_to_mfn(page)), mfn_x(mfn));
+    rc = guest_physmap_add_page(cd, gfn, mfn_x(page_to_mfn(page)), 0);
+    if ( rc && test_and_clear_bit(_PGC_allocated, &page->count_info) )
+        put_page(page);
+
+ out:
+    put_two_gfns(&tg);
+    return rc;
+}
+
+/*
+ * Back each hole in a client domain with the source domain's page at the
+ * same gfn, copy-on-write, so that a paused domain can be forked without
+ * copying its memory.
+ */
+static int mem_sharing_fork_range(struct domain *d, struct domain *cd,
+                                  struct mem_sharing_op_fork_range *fr)
+{
+    unsigned long gfn = fr->first_gfn, last;
+    shr_handle_t sh;
+    int rc = 0;
+
+    last = min_t(uint64_t, fr->last_gfn, domain_get_maximum_gpfn(d));
+    fr->last_gfn = last;
+    fr->nr_shared = 0;
+
+    while ( gfn <= last )
+    {
+        rc = mem_sharing_nominate_page(d, gfn, 0, &sh);
+        if ( !rc )
+        {
+            rc = mem_sharing_add_to_physmap(d, gfn, sh, cd, gfn);
+            if ( !rc )
+                fr->nr_shared++;
+        }
+        else if ( rc != -ENOMEM )
+            rc = mem_sharing_fork_copy(d, cd, gfn);
+        if ( rc == -ENOMEM )
+            break;
+        rc = 0;
+
+        if ( !(++gfn & 0xff) && hypercall_preempt_check() )
+            break;
+    }
+
+    fr->first_gfn = gfn;
+    return rc;
+}
+
 int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
 {
     int rc = 0;
@@ -1459,6 +1672,45 @@ int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
         }
         break;
 
+        case XENMEM_sharing_op_hash_range:
+        {
+            if ( !mem_sharing_enabled(d) )
+                return -EINVAL;
+            rc = mem_sharing_hash_range(d, &mec->u.hash_range);
+        }
+        break;
+
+        case XENMEM_sharing_op_fork_range:
+        {
+            struct domain *cd;
+
+            if ( !mem_sharing_enabled(d) )
+                return -EINVAL;
+
+            rc = rcu_lock_live_remote_domain_by_id(
+                mec->u.fork_range.client_domain, &cd);
+            if ( rc )
+                return rc;
+
+            rc = xsm_mem_sharing_op(XSM_TARGET, d, cd, mec->op);
+            if ( rc )
+            {
+                rcu_unlock_domain(cd);
+                return rc;
+            }
+
+            if ( !mem_sharing_enabled(cd) )
+            {
+                rcu_unlock_domain(cd);
+                return -EINVAL;
+            }
+
+            rc = mem_sharing_fork_range(d, cd, &mec->u.fork_range);
+
+            rcu_unlock_domain(cd);
+        }
+        break;
+
         default:
             rc = -ENOSYS;
             break;
@@ -34,6 +34,15 @@
 
 #include "mm-locks.h"
 
+/*
+ * Have the hardware maintain accessed bits in the EPT, for harvesting
+ * with XEN_DOMCTL_harvest_accessed.  Off by default: with A/D bits
+ * enabled guest page table walks count as writes, so page tables in
+ * read-only (e.g. log-dirty or mem_access restricted) memory fault.
+ */
+static bool_t __read_mostly opt_ept_ad;
+boolean_param("ept_ad", opt_ept_ad);
+
 #define atomic_read_ept_entry(__pepte)                              \
     ( (ept_entry_t) { .epte = read_atomic(&(__pepte)->epte) } )
 #define atomic_write_ept_entry(__pepte, __epte)                     \
@@ -41,6 +50,8 @@
 
 #define is_epte_present(ept_entry)      ((ept_entry)->epte & 0x7)
 #define is_epte_superpage(ept_entry)    ((ept_entry)->sp)
+#define is_epte_recalc(ept_entry)       ((ept_entry)->recalc)
+#define EPTE_A_BIT                      8
 static inline bool_t is_epte_valid(ept_entry_t *e)
 {
     return (e->epte != 0 && e->sa_p2mt != p2m_invalid);
@@ -159,6 +170,94 @@ static void ept_free_entry(struct p2m_domain *p2m, ept_entry_t *ept_entry, int l
     p2m_free_ptp(p2m, mfn_to_page(ept_entry->mfn));
 }
 
+/*
+ * Global type changes are done lazily: rather than walking the whole
+ * table, ept_change_entry_type_global() marks the entries of the root
+ * table for recalculation.  A marked (always non-leaf) entry has its
+ * reserved memory type bits set, so the first guest access below it
+ * raises an EPT misconfiguration.  Resolving a mark applies the pending
+ * type map to the leaves of the table it points to, and passes the mark
+ * on to that table's sub-tables; the cost thus follows the guest's
+ * working set rather than its size.  Software walks resolve marks as they
+ * go (under the p2m lock) or, for lookups, apply the map on the fly.
+ */
+static void ept_mark_recalc(ept_entry_t *ept_entry)
+{
+    ept_entry_t e = atomic_read_ept_entry(ept_entry);
+
+    e.emt = MTRR_NUM_TYPES;
+    e.recalc = 1;
+    atomic_write_ept_entry(ept_entry, e);
+}
+
+static void ept_recalc_leaf(struct p2m_domain *p2m, ept_entry_t *ept_entry)
+{
+    ept_entry_t e = atomic_read_ept_entry(ept_entry);
+
+    if ( !is_epte_valid(&e) )
+        return;
+
+    e.sa_p2mt = p2m->ept.recalc_type[e.sa_p2mt];
+    ept_p2m_type_to_flags(&e, e.sa_p2mt, e.access);
+    atomic_write_ept_entry(ept_entry, e);
+}
+
+/* Resolve the mark on @ept_entry, a level @level non-leaf entry. */
+static void ept_resolve_recalc(struct p2m_domain *p2m, ept_entry_t *ept_entry,
+                               int level)
+{
+    ept_entry_t e, *table = map_domain_page(ept_entry->mfn);
+
+    ASSERT(is_epte_recalc(ept_entry) && !is_epte_superpage(ept_entry));
+
+    for ( int i = 0; i < EPT_PAGETABLE_ENTRIES; i++ )
+    {
+        if ( level > 1 && is_epte_present(table + i) &&
+             !is_epte_superpage(table + i) )
+            ept_mark_recalc(table + i);
+        else
+            ept_recalc_leaf(p2m, table + i);
+    }
+
+    unmap_domain_page(table);
+
+    e = atomic_read_ept_entry(ept_entry);
+    e.emt = 0;
+    e.recalc = 0;
+    atomic_write_ept_entry(ept_entry, e);
+}
+
+/*
+ * Fold the global change @ot -> @nt into the pending type map.  Entries
+ * still marked from earlier changes will get the composition, entries
+ * marked afresh only this change; folding is only possible if the two
+ * agree for every type.
+ */
+static bool_t ept_recalc_compose(struct ept_data *ept,
+                                 p2m_type_t ot, p2m_type_t nt)
+{
+    unsigned int t, mt;
+
+    for ( t = 0; t < ARRAY_SIZE(ept->recalc_type); t++ )
+    {
+        mt = ept->recalc_type[t];
+        if ( mt != t && (mt == ot ? nt : mt) != (t == ot ? nt : t) )
+            return 0;
+    }
+
+    for ( t = 0; t < ARRAY_SIZE(ept->recalc_type); t++ )
+        if ( ept->recalc_type[t] == ot )
+            ept->recalc_type[t] = nt;
+
+    return 1;
+}
+
+static void ept_recalc_reset(struct ept_data *ept)
+{
+    for ( unsigned int t = 0; t < ARRAY_SIZE(ept->recalc_type); t++ )
+        ept->recalc_type[t] = t;
+}
+
 static int ept_split_super_page(struct p2m_domain *p2m, ept_entry_t *ept_entry,
                                 int level, int target)
 {
@@ -210,6 +309,102 @@ static int ept_split_super_page(struct p2m_domain *p2m, ept_entry_t *ept_entry,
     return rv;
 }
 
+/*
+ * Can the table behind @ept_entry, a level @level entry, be replaced by a
+ * single superpage?  That needs all of its entries to be identical present
+ * leaves, bar the frame numbers which must be contiguous and aligned to the
+ * superpage size.  If so, return 1 with the superpage in @super.
+ */
+static int ept_can_merge(const ept_entry_t *ept_entry, int level,
+                         ept_entry_t *super)
+{
+    ept_entry_t *table, first, e;
+    unsigned long trunk = 1UL << ((level - 1) * EPT_TABLE_ORDER);
+    int i, rc = 0;
+
+    if ( !is_epte_present(ept_entry) || is_epte_superpage(ept_entry) )
+        return 0;
+    if ( !(level == 1 ? hvm_hap_has_2mb() && opt_hap_2mb
+                      : level == 2 && hvm_hap_has_1gb() && opt_hap_1gb) )
+        return 0;
+
+    table = map_domain_page(ept_entry->mfn);
+
+    first = atomic_read_ept_entry(&table[0]);
+    if ( !is_epte_present(&first) ||
+         (level > 1 && !is_epte_superpage(&first)) ||
+         !p2m_is_mergeable(first.sa_p2mt) ||
+         (first.mfn & ((1UL << (level * EPT_TABLE_ORDER)) - 1)) )
+        goto out;
+
+    for ( i = 1; i < EPT_PAGETABLE_ENTRIES; i++ )
+    {
+        e = atomic_read_ept_entry(&table[i]);
+        if ( e.mfn != first.mfn + i * trunk )
+            goto out;
+        e.mfn = first.mfn;
+        if ( e.epte != first.epte )
+            goto out;
+    }
+
+    *super = first;
+    super->sp = 1;
+    rc = 1;
+
+ out:
+    unmap_domain_page(table);
+    return rc;
+}
+
+/*
+ * Rebuild superpages covering @gfn, starting with the level @level entry
+ * and moving up as far as possible.  The replaced entries are returned in
+ * @old, for the caller to free after flushing.  Returns the number merged.
+ */
+static unsigned int ept_merge_super_page(struct p2m_domain *p2m,
+                                         unsigned long gfn, int level,
+                                         ept_entry_t old[])
+{
+    struct ept_data *ept = &p2m->ept;
+    ept_entry_t *table, *ept_entry, super;
+    unsigned long mfn;
+    unsigned int merged = 0;
+    int i;
+
+    for ( ; level <= 2; level++ )
+    {
+        table = map_domain_page(pagetable_get_pfn(p2m_get_pagetable(p2m)));
+
+        for ( i = ept_get_wl(ept); i > level; i-- )
+        {
+            ept_entry = table + ((gfn >> (i * EPT_TABLE_ORDER)) &
+                                 (EPT_PAGETABLE_ENTRIES - 1));
+            if ( !is_epte_present(ept_entry) || is_epte_superpage(ept_entry) )
+            {
+                unmap_domain_page(table);
+                return merged;
+            }
+            mfn = ept_entry->mfn;
+            unmap_domain_page(table);
+            table = map_domain_page(mfn);
+        }
+
+        ept_entry = table + ((gfn >> (level * EPT_TABLE_ORDER)) &
+                             (EPT_PAGETABLE_ENTRIES - 1));
+        if ( !ept_can_merge(ept_entry, level, &super) )
+        {
+            unmap_domain_page(table);
+            break;
+        }
+
+        old[merged++] = *ept_entry;
+        atomic_write_ept_entry(ept_entry, super);
+        unmap_domain_page(table);
+    }
+
+    return merged;
+}
+
 /* Take the currently mapped table, find the corresponding gfn entry,
  * and map the next table, if available.  If the entry is empty
  * and read_only is set, 
@@ -246,6 +441,13 @@ static int ept_next_level(struct p2m_domain *p2m, bool_t read_only,
      * avoid races. */
     e = atomic_read_ept_entry(ept_entry);
 
+    /* Writers hold the p2m lock: bring the sub-tree up to date first. */
+    if ( !read_only && is_epte_recalc(&e) )
+    {
+        ept_resolve_recalc(p2m, ept_entry, next_level);
+        e = atomic_read_ept_entry(ept_entry);
+    }
+
     if ( !is_epte_present(&e) )
     {
         if ( e.sa_p2mt == p2m_populate_on_demand )
@@ -292,6 +494,8 @@ ept_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
     int vtd_pte_present = 0;
     int needs_sync = 1;
     ept_entry_t old_entry = { .epte = 0 };
+    ept_entry_t merged_entry[2];
+    unsigned int merged = 0;
     struct ept_data *ept = &p2m->ept;
     struct domain *d = p2m->domain;
 
@@ -438,6 +642,14 @@ ept_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
     /* Success */
     rv = 1;
 
+    /* The change may have made a previously split superpage uniform again. */
+    if ( target < 2 && p2m_merge_allowed(p2m) )
+    {
+        merged = ept_merge_super_page(p2m, gfn, target + 1, merged_entry);
+        if ( merged )
+            needs_sync = 1;
+    }
+
 out:
     unmap_domain_page(table);
 
@@ -452,6 +664,9 @@ out:
             iommu_pte_flush(d, gfn, (u64*)ept_entry, order, vtd_pte_present);
         else
         {
+            struct iommu_flush_batch batch;
+
+            iommu_flush_batch_start(&batch, p2m->domain);
             if ( p2mt == p2m_ram_rw )
             {
                 if ( order > 0 )
@@ -475,6 +690,7 @@ out:
                 else if ( !order )
                     iommu_unmap_page(p2m->domain, gfn);
             }
+            iommu_flush_batch_end(&batch);
         }
     }
 
@@ -484,6 +700,8 @@ out:
        use-after-free. */
     if ( is_epte_present(&old_entry) )
         ept_free_entry(p2m, &old_entry, target);
+    while ( merged-- )
+        ept_free_entry(p2m, &merged_entry[merged], target + 1 + merged);
 
     return rv;
 }
@@ -499,6 +717,7 @@ static mfn_t ept_get_entry(struct p2m_domain *p2m,
     u32 index;
     int i;
     int ret = 0;
+    bool_t recalc = 0;
     mfn_t mfn = _mfn(INVALID_MFN);
     struct ept_data *ept = &p2m->ept;
 
@@ -514,6 +733,9 @@ static mfn_t ept_get_entry(struct p2m_domain *p2m,
     for ( i = ept_get_wl(ept); i > 0; i-- )
     {
     retry:
+        ept_entry = table + (gfn_remainder >> (i * EPT_TABLE_ORDER));
+        if ( is_epte_recalc(ept_entry) )
+            recalc = 1;
         ret = ept_next_level(p2m, 1, &table, &gfn_remainder, i);
         if ( !ret )
             goto out;
@@ -532,7 +754,11 @@ static mfn_t ept_get_entry(struct p2m_domain *p2m,
             ept_entry = table + index;
 
             if ( !p2m_pod_demand_populate(p2m, gfn, i * EPT_TABLE_ORDER, q) )
+            {
+                /* Populating brought the path above up to date. */
+                recalc = 0;
                 goto retry;
+            }
             else
                 goto out;
         }
@@ -562,7 +788,8 @@ static mfn_t ept_get_entry(struct p2m_domain *p2m,
      * entirely empty entry shouldn't have RAM type. */
     if ( ept_entry->epte != 0 && ept_entry->sa_p2mt != p2m_invalid )
     {
-        *t = ept_entry->sa_p2mt;
+        *t = recalc ? ept->recalc_type[ept_entry->sa_p2mt]
+                    : ept_entry->sa_p2mt;
         *a = ept_entry->access;
 
         mfn = _mfn(ept_entry->mfn);
@@ -640,10 +867,11 @@ out:
 
 /*
  * Walk the whole p2m table, changing any entries of the old type
- * to the new type.  This is used in hardware-assisted paging to
- * quickly enable or diable log-dirty tracking
+ * to the new type, and resolving any pending recalculation on the way.
+ * This is the eager fallback for ept_change_entry_type_global().
  */
-static void ept_change_entry_type_page(mfn_t ept_page_mfn, int ept_page_level,
+static void ept_change_entry_type_page(struct p2m_domain *p2m,
+                                       mfn_t ept_page_mfn, int ept_page_level,
                                        p2m_type_t ot, p2m_type_t nt)
 {
     ept_entry_t e, *epte = map_domain_page(mfn_x(ept_page_mfn));
@@ -654,8 +882,12 @@ static void ept_change_entry_type_page(mfn_t ept_page_mfn, int ept_page_level,
             continue;
 
         if ( (ept_page_level > 0) && !is_epte_superpage(epte + i) )
-            ept_change_entry_type_page(_mfn(epte[i].mfn),
+        {
+            if ( is_epte_recalc(epte + i) )
+                ept_resolve_recalc(p2m, epte + i, ept_page_level);
+            ept_change_entry_type_page(p2m, _mfn(epte[i].mfn),
                                        ept_page_level - 1, ot, nt);
+        }
         else
         {
             e = atomic_read_ept_entry(&epte[i]);
@@ -675,18 +907,122 @@ static void ept_change_entry_type_global(struct p2m_domain *p2m,
                                          p2m_type_t ot, p2m_type_t nt)
 {
     struct ept_data *ept = &p2m->ept;
+    struct domain *d = p2m->domain;
+    ept_entry_t *epte;
+
     if ( ept_get_asr(ept) == 0 )
         return;
 
     BUG_ON(p2m_is_grant(ot) || p2m_is_grant(nt));
     BUG_ON(ot != nt && (ot == p2m_mmio_direct || nt == p2m_mmio_direct));
 
-    ept_change_entry_type_page(_mfn(ept_get_asr(ept)),
-                               ept_get_wl(ept), ot, nt);
+    /*
+     * A table shared with the IOMMU must not carry marks the IOMMU knows
+     * nothing about; and a change which can't be folded into the pending
+     * one needs the latter applied first.  Do both the old way.
+     */
+    if ( (iommu_hap_pt_share && need_iommu(d)) ||
+         !ept_recalc_compose(ept, ot, nt) )
+    {
+        ept_change_entry_type_page(p2m, _mfn(ept_get_asr(ept)),
+                                   ept_get_wl(ept), ot, nt);
+        ept_recalc_reset(ept);
+    }
+    else
+    {
+        epte = map_domain_page(ept_get_asr(ept));
+        for ( int i = 0; i < EPT_PAGETABLE_ENTRIES; i++ )
+            if ( is_epte_present(epte + i) && !is_epte_superpage(epte + i) )
+                ept_mark_recalc(epte + i);
+        unmap_domain_page(epte);
+    }
 
     ept_sync_domain(p2m);
 }
 
+/* Can the hardware use this leaf without a misconfiguration exit? */
+static bool_t ept_leaf_valid(const ept_entry_t *e)
+{
+    if ( !is_epte_present(e) )
+        return 1;
+
+    return !(e->w && !e->r) && !is_epte_recalc(e) &&
+           e->emt != EPT_EMT_RSV0 && e->emt != EPT_EMT_RSV1 &&
+           e->emt != EPT_EMT_RSV2;
+}
+
+/*
+ * Resolve the marks on the path to @gpa that made the hardware take an
+ * EPT misconfiguration exit.  Superpages split by log-dirty tracking are
+ * put back together here too, once the changed types allow it.  Returns
+ * 0 if the misconfiguration was not one of ours.
+ */
+int ept_handle_misconfig(uint64_t gpa)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(current->domain);
+    struct ept_data *ept = &p2m->ept;
+    unsigned long gfn = gpa >> PAGE_SHIFT;
+    unsigned long gfn_remainder = gfn;
+    ept_entry_t *table, *ept_entry, leaf, merged_entry[2];
+    unsigned int merged = 0;
+    bool_t fixed = 0, okay = 1;
+    unsigned long mfn;
+    int i;
+
+    p2m_lock(p2m);
+
+    table = map_domain_page(pagetable_get_pfn(p2m_get_pagetable(p2m)));
+
+    for ( i = ept_get_wl(ept); i > 0; i-- )
+    {
+        ept_entry = table + (gfn_remainder >> (i * EPT_TABLE_ORDER));
+
+        if ( !is_epte_present(ept_entry) || is_epte_superpage(ept_entry) )
+            break;
+
+        if ( is_epte_recalc(ept_entry) )
+        {
+            ept_resolve_recalc(p2m, ept_entry, i);
+            fixed = 1;
+        }
+        else if ( ept_entry->emt )
+            okay = 0;
+
+        mfn = ept_entry->mfn;
+        unmap_domain_page(table);
+        table = map_domain_page(mfn);
+        gfn_remainder &= (1UL << (i * EPT_TABLE_ORDER)) - 1;
+    }
+
+    ept_entry = table + (gfn_remainder >> (i * EPT_TABLE_ORDER));
+    leaf = atomic_read_ept_entry(ept_entry);
+    unmap_domain_page(table);
+
+    /*
+     * With nothing to resolve, another vCPU may have got here first: then
+     * the path must now be one the hardware accepts.  Otherwise the fault
+     * isn't ours, and re-entering the guest would only take it again.
+     */
+    if ( !fixed && (!okay || !ept_leaf_valid(&leaf)) )
+    {
+        p2m_unlock(p2m);
+        return 0;
+    }
+
+    if ( fixed && p2m_merge_allowed(p2m) )
+        merged = ept_merge_super_page(p2m, gfn, 1, merged_entry);
+    if ( merged )
+    {
+        ept_sync_domain(p2m);
+        while ( merged-- )
+            ept_free_entry(p2m, &merged_entry[merged], 1 + merged);
+    }
+
+    p2m_unlock(p2m);
+
+    return 1;
+}
+
 static void __ept_sync_domain(void *info)
 {
     struct ept_data *ept = &((struct p2m_domain *)info)->ept;
@@ -717,6 +1053,79 @@ void ept_sync_domain(struct p2m_domain *p2m)
                      __ept_sync_domain, p2m, 1);
 }
 
+static bool_t ept_test_and_clear_accessed(ept_entry_t *e)
+{
+    /* The hardware may be setting bits in the entry: clear atomically. */
+    return is_epte_present(e) && e->a &&
+           test_and_clear_bit(EPTE_A_BIT, &e->epte);
+}
+
+/*
+ * Gather, and clear, the accessed bits of the leaf entries mapping
+ * [gfn, gfn + nr) into @bitmap, which the caller has zeroed.  A superpage
+ * has a single bit, which is reported for every gfn it maps.
+ */
+static void ept_harvest_accessed(struct p2m_domain *p2m, unsigned long gfn,
+                                 unsigned int nr, unsigned long *bitmap)
+{
+    struct ept_data *ept = &p2m->ept;
+    unsigned int done = 0;
+    bool_t flush = 0;
+
+    ASSERT(p2m_locked_by_me(p2m));
+
+    while ( done < nr && gfn + done <= p2m->max_mapped_pfn )
+    {
+        ept_entry_t *table =
+            map_domain_page(pagetable_get_pfn(p2m_get_pagetable(p2m)));
+        unsigned long gfn_remainder = gfn + done, span;
+        unsigned int index, j;
+        int i, ret = GUEST_TABLE_NORMAL_PAGE;
+
+        for ( i = ept_get_wl(ept); i > 0; i-- )
+        {
+            ret = ept_next_level(p2m, 1, &table, &gfn_remainder, i);
+            if ( ret != GUEST_TABLE_NORMAL_PAGE )
+                break;
+        }
+
+        index = gfn_remainder >> (i * EPT_TABLE_ORDER);
+        span = (1UL << (i * EPT_TABLE_ORDER)) -
+               (gfn_remainder & ((1UL << (i * EPT_TABLE_ORDER)) - 1));
+        span = min_t(unsigned long, span, nr - done);
+
+        if ( ret == GUEST_TABLE_SUPER_PAGE )
+        {
+            if ( ept_test_and_clear_accessed(table + index) )
+            {
+                for ( j = 0; j < span; j++ )
+                    __set_bit(done + j, bitmap);
+                flush = 1;
+            }
+        }
+        else if ( ret == GUEST_TABLE_NORMAL_PAGE )
+        {
+            /* At the leaf level: do the rest of this table in one go. */
+            span = min_t(unsigned long, EPT_PAGETABLE_ENTRIES - index,
+                         nr - done);
+            for ( j = 0; j < span; j++ )
+                if ( ept_test_and_clear_accessed(table + index + j) )
+                {
+                    __set_bit(done + j, bitmap);
+                    flush = 1;
+                }
+        }
+        /* Otherwise nothing is mapped: skip the whole of the entry. */
+
+        unmap_domain_page(table);
+        done += span;
+    }
+
+    /* Cached translations don't set the bits again: drop them. */
+    if ( flush )
+        ept_sync_domain(p2m);
+}
+
 int ept_p2m_init(struct p2m_domain *p2m)
 {
     struct ept_data *ept = &p2m->ept;
@@ -732,9 +1141,17 @@ int ept_p2m_init(struct p2m_domain *p2m)
     /* set EPT page-walk length, now it's actual walk length - 1, i.e. 3 */
     ept->ept_wl = 3;
 
+    if ( opt_ept_ad && cpu_has_vmx_ept_ad )
+    {
+        ept->ept_ad = 1;
+        p2m->harvest_accessed = ept_harvest_accessed;
+    }
+
     if ( !zalloc_cpumask_var(&ept->synced_mask) )
         return -ENOMEM;
 
+    ept_recalc_reset(ept);
+
     on_each_cpu(__ept_sync_domain, p2m, 1);
 
     return 0;
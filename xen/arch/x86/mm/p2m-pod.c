@@ -110,9 +110,10 @@ p2m_pod_cache_add(struct p2m_domain *p2m,
     for ( i = 0; i < (1 << order); i++ )
     {
         char *b = map_domain_page(mfn_x(page_to_mfn(page)) + i);
-        clear_page(b);
+        scrub_page(b);
         unmap_domain_page(b);
     }
+    scrub_page_fence();
 
     /* First, take all pages off the domain list */
     lock_page_alloc(p2m);
@@ -638,6 +639,28 @@ void p2m_pod_dump_data(struct domain *d)
 }
 
 
+/*
+ * Check @nr (a multiple of 8) words for zeroes, a cache line at a time
+ * with the next line prefetched.  Vector registers are out of bounds
+ * here (they hold guest state), so OR plain words together instead.
+ */
+static bool_t p2m_pod_words_zero(const unsigned long *p, unsigned int nr)
+{
+    const unsigned long *end = p + nr;
+
+    for ( ; p < end; p += 8 )
+    {
+        prefetch(p + 8);
+        if ( p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7] )
+            return 0;
+    }
+
+    return 1;
+}
+
+#define POD_QUICK_WORDS 16
+#define POD_PAGE_WORDS  (PAGE_SIZE / sizeof(unsigned long))
+
 /* Search for all-zero superpages to be reclaimed as superpages for the
  * PoD cache. Must be called w/ pod lock held, must lock the superpage
  * in the p2m */
@@ -705,16 +728,11 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     {
         /* Quick zero-check */
         map = map_domain_page(mfn_x(mfn0) + i);
-
-        for ( j=0; j<16; j++ )
-            if( *(map+j) != 0 )
-                break;
-
+        j = p2m_pod_words_zero(map, POD_QUICK_WORDS);
         unmap_domain_page(map);
 
-        if ( j < 16 )
+        if ( !j )
             goto out;
-
     }
 
     /* Try to remove the page, restoring old mapping if it fails. */
@@ -738,14 +756,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     for ( i=0; i < SUPERPAGE_PAGES; i++ )
     {
         map = map_domain_page(mfn_x(mfn0) + i);
-
-        for ( j=0; j<PAGE_SIZE/sizeof(*map); j++ )
-            if( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
-
+        reset = !p2m_pod_words_zero(map, POD_PAGE_WORDS);
         unmap_domain_page(map);
 
         if ( reset )
@@ -783,6 +794,31 @@ out:
     return ret;
 }
 
+/*
+ * Remember gfns found to hold data, so that the next few emergency sweeps
+ * don't spend time mapping and scanning them again.
+ */
+#define POD_NONZERO_AGE 4
+
+static void
+p2m_pod_note_nonzero(struct p2m_domain *p2m, unsigned long gfn)
+{
+    unsigned int idx = gfn % POD_NONZERO_MAX;
+
+    p2m->pod.nonzero[idx].gfn = gfn;
+    p2m->pod.nonzero[idx].sweep = p2m->pod.sweep;
+}
+
+static bool_t
+p2m_pod_recently_nonzero(const struct p2m_domain *p2m, unsigned long gfn)
+{
+    unsigned int idx = gfn % POD_NONZERO_MAX;
+
+    return p2m->pod.nonzero[idx].sweep &&
+           p2m->pod.nonzero[idx].gfn == gfn &&
+           p2m->pod.sweep - p2m->pod.nonzero[idx].sweep < POD_NONZERO_AGE;
+}
+
 static void
 p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
 {
@@ -809,7 +845,10 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
              && ( (mfn_to_page(mfns[i])->count_info & PGC_allocated) != 0 ) 
              && ( (mfn_to_page(mfns[i])->count_info & (PGC_page_table|PGC_xen_heap)) == 0 ) 
              && ( (mfn_to_page(mfns[i])->count_info & PGC_count_mask) <= max_ref ) )
+        {
             map[i] = map_domain_page(mfn_x(mfns[i]));
+            prefetch(map[i]);
+        }
         else
             map[i] = NULL;
     }
@@ -822,14 +861,11 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
             continue;
 
         /* Quick zero-check */
-        for ( j=0; j<16; j++ )
-            if( *(map[i]+j) != 0 )
-                break;
-
-        if ( j < 16 )
+        if ( !p2m_pod_words_zero(map[i], POD_QUICK_WORDS) )
         {
             unmap_domain_page(map[i]);
             map[i] = NULL;
+            p2m_pod_note_nonzero(p2m, gfns[i]);
             continue;
         }
 
@@ -857,18 +893,17 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
         if(!map[i])
             continue;
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map[i]); j++ )
-            if( *(map[i]+j) != 0 )
-                break;
+        j = p2m_pod_words_zero(map[i], POD_PAGE_WORDS);
 
         unmap_domain_page(map[i]);
 
         /* See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.  */
-        if ( j < PAGE_SIZE/sizeof(*map[i]) )
+        if ( !j )
         {
             set_p2m_entry(p2m, gfns[i], mfns[i], PAGE_ORDER_4K,
                 types[i], p2m->default_access);
+            p2m_pod_note_nonzero(p2m, gfns[i]);
         }
         else
         {
@@ -930,6 +965,13 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     if ( p2m->pod.reclaim_single == 0 )
         p2m->pod.reclaim_single = p2m->pod.max_guest;
 
+    /* Sweep numbers start at 1: 0 marks unused history entries. */
+    if ( ++p2m->pod.sweep == 0 )
+    {
+        memset(p2m->pod.nonzero, 0, sizeof(p2m->pod.nonzero));
+        p2m->pod.sweep = 1;
+    }
+
     start = p2m->pod.reclaim_single;
     limit = (start > POD_SWEEP_LIMIT) ? (start - POD_SWEEP_LIMIT) : 0;
 
@@ -941,7 +983,12 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     for ( i=p2m->pod.reclaim_single; i > 0 ; i-- )
     {
         p2m_access_t a;
-        (void)p2m->get_entry(p2m, i, &t, &a, 0, NULL);
+
+        /* Skip pages that held data when we last looked. */
+        if ( p2m_pod_recently_nonzero(p2m, i) )
+            t = p2m_invalid;
+        else
+            (void)p2m->get_entry(p2m, i, &t, &a, 0, NULL);
         if ( p2m_is_ram(t) )
         {
             gfns[j] = i;
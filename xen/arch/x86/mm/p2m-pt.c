@@ -146,6 +146,8 @@ p2m_free_entry(struct p2m_domain *p2m, l1_pgentry_t *p2m_entry, int page_order)
 
 /* AMD IOMMU: Convert next level bits and r/w bits into 24 bits p2m flags */
 #define iommu_nlevel_to_flags(nl, f) ((((nl) & 0x7) << 9 )|(((f) & 0x3) << 21))
+#define P2M_IOMMU_RW_FLAGS \
+    iommu_nlevel_to_flags(0, IOMMUF_readable|IOMMUF_writable)
 
 static void p2m_add_iommu_flags(l1_pgentry_t *p2m_entry,
                                 unsigned int nlevel, unsigned int flags)
@@ -275,6 +277,47 @@ p2m_next_level(struct p2m_domain *p2m, mfn_t *table_mfn, void **table,
     return 1;
 }
 
+/*
+ * Try to replace the L2 entry covering gfn, which must point at the
+ * (mapped) L1 table l1t, by a single 2M superpage.  This is possible when
+ * all 512 L1 entries carry the same flags and a mergeable type, and map
+ * a contiguous, 2M-aligned run of mfns.  On success the replaced L2
+ * entry is returned in *old_entry; the caller frees the L1 table once
+ * it no longer has it mapped.
+ */
+static int
+p2m_merge_l1(struct p2m_domain *p2m, unsigned long gfn, mfn_t l2_mfn,
+             const l1_pgentry_t *l1t, l1_pgentry_t *old_entry)
+{
+    unsigned long flags = l1e_get_flags(l1t[0]);
+    unsigned long first_mfn = l1e_get_pfn(l1t[0]);
+    l1_pgentry_t *l2t, *p2m_entry, new_entry;
+    unsigned int i;
+
+    if ( !(flags & _PAGE_PRESENT) ||
+         !p2m_is_mergeable(p2m_flags_to_type(flags)) ||
+         (first_mfn & ((1UL << PAGE_ORDER_2M) - 1)) )
+        return 0;
+
+    for ( i = 1; i < L1_PAGETABLE_ENTRIES; i++ )
+        if ( l1e_get_flags(l1t[i]) != flags ||
+             l1e_get_pfn(l1t[i]) != first_mfn + i )
+            return 0;
+
+    l2t = map_domain_page(mfn_x(l2_mfn));
+    p2m_entry = l2t + ((gfn >> PAGE_ORDER_2M) & (L2_PAGETABLE_ENTRIES - 1));
+    ASSERT((l1e_get_flags(*p2m_entry) & (_PAGE_PRESENT | _PAGE_PSE)) ==
+           _PAGE_PRESENT);
+    *old_entry = *p2m_entry;
+
+    new_entry.l1 = l2e_from_pfn(first_mfn, flags | _PAGE_PSE).l2;
+    p2m->write_p2m_entry(p2m, gfn, p2m_entry, l2_mfn, new_entry, 2);
+    /* NB: paging_write_p2m_entry() handles tlb flushes properly */
+    unmap_domain_page(l2t);
+
+    return 1;
+}
+
 // Returns 0 on error (out of memory)
 static int
 p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn, 
@@ -292,7 +335,8 @@ p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
     unsigned int iommu_pte_flags = (p2mt == p2m_ram_rw) ?
                                    IOMMUF_readable|IOMMUF_writable:
                                    0; 
-    unsigned long old_mfn = 0;
+    l1_pgentry_t old_leaf = l1e_empty();
+    l1_pgentry_t merged_entry = l1e_empty();
 
     if ( tb_init_done )
     {
@@ -342,10 +386,8 @@ p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
         entry_content.l1 = l3e_content.l3;
 
         if ( entry_content.l1 != 0 )
-        {
             p2m_add_iommu_flags(&entry_content, 0, iommu_pte_flags);
-            old_mfn = l1e_get_pfn(*p2m_entry);
-        }
+        old_leaf = *p2m_entry;
 
         p2m->write_p2m_entry(p2m, gfn, p2m_entry, table_mfn, entry_content, 3);
         /* NB: paging_write_p2m_entry() handles tlb flushes properly */
@@ -362,6 +404,8 @@ p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
 
     if ( page_order == PAGE_ORDER_4K )
     {
+        mfn_t l2_mfn = table_mfn;
+
         if ( !p2m_next_level(p2m, &table_mfn, &table, &gfn_remainder, gfn,
                              L2_PAGETABLE_SHIFT - PAGE_SHIFT,
                              L2_PAGETABLE_ENTRIES, PGT_l1_page_table) )
@@ -379,13 +423,17 @@ p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
             entry_content = l1e_empty();
 
         if ( entry_content.l1 != 0 )
-        {
             p2m_add_iommu_flags(&entry_content, 0, iommu_pte_flags);
-            old_mfn = l1e_get_pfn(*p2m_entry);
-        }
+        old_leaf = *p2m_entry;
         /* level 1 entry */
         p2m->write_p2m_entry(p2m, gfn, p2m_entry, table_mfn, entry_content, 1);
         /* NB: paging_write_p2m_entry() handles tlb flushes properly */
+
+        /* Re-coalesce the L1 table into a superpage if it has become one. */
+        if ( p2m_is_mergeable(p2mt) && hap_enabled(p2m->domain) &&
+             hvm_hap_has_2mb(p2m->domain) && opt_hap_2mb &&
+             p2m_merge_allowed(p2m) )
+            p2m_merge_l1(p2m, gfn, l2_mfn, table, &merged_entry);
     }
     else if ( page_order == PAGE_ORDER_2M )
     {
@@ -415,10 +463,8 @@ p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
         entry_content.l1 = l2e_content.l2;
 
         if ( entry_content.l1 != 0 )
-        {
             p2m_add_iommu_flags(&entry_content, 0, iommu_pte_flags);
-            old_mfn = l1e_get_pfn(*p2m_entry);
-        }
+        old_leaf = *p2m_entry;
 
         p2m->write_p2m_entry(p2m, gfn, p2m_entry, table_mfn, entry_content, 2);
         /* NB: paging_write_p2m_entry() handles tlb flushes properly */
@@ -437,11 +483,25 @@ p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
     {
         if ( iommu_hap_pt_share )
         {
-            if ( old_mfn && (old_mfn != mfn_x(mfn)) )
-                amd_iommu_flush_pages(p2m->domain, gfn, page_order);
+            /*
+             * The IOMMU walks this very table, so new mappings need no
+             * work, but translations it may have cached must be flushed
+             * when they go away, point elsewhere or lose access rights.
+             */
+            unsigned int old_flags = l1e_get_flags(old_leaf);
+
+            if ( (old_flags & _PAGE_PRESENT) &&
+                 (old_flags & P2M_IOMMU_RW_FLAGS) &&
+                 ((old_flags & ~l1e_get_flags(entry_content) &
+                   P2M_IOMMU_RW_FLAGS) ||
+                  l1e_get_pfn(old_leaf) != l1e_get_pfn(entry_content)) )
+                iommu_shared_pt_flush(p2m->domain, gfn, page_order);
         }
         else
         {
+            struct iommu_flush_batch batch;
+
+            iommu_flush_batch_start(&batch, p2m->domain);
             if ( p2mt == p2m_ram_rw )
                 for ( i = 0; i < (1UL << page_order); i++ )
                     iommu_map_page(p2m->domain, gfn+i, mfn_x(mfn)+i,
@@ -449,6 +509,7 @@ p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
             else
                 for ( int i = 0; i < (1UL << page_order); i++ )
                     iommu_unmap_page(p2m->domain, gfn+i);
+            iommu_flush_batch_end(&batch);
         }
     }
 
@@ -457,6 +518,11 @@ p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
 
 out:
     unmap_domain_page(table);
+
+    /* Free the L1 table replaced by a merged superpage */
+    if ( l1e_get_flags(merged_entry) & _PAGE_PRESENT )
+        p2m_free_entry(p2m, &merged_entry, PAGE_ORDER_2M);
+
     return rv;
 }
 
@@ -46,6 +46,10 @@ boolean_param("hap_1gb", opt_hap_1gb);
 bool_t __read_mostly opt_hap_2mb = 1;
 boolean_param("hap_2mb", opt_hap_2mb);
 
+/* re-coalesce split superpages once they are uniform again, default on */
+bool_t __read_mostly opt_p2m_merge = 1;
+boolean_param("p2m_merge", opt_p2m_merge);
+
 
 /* Override macros from asm/page.h to make them work with mfn_t */
 #undef mfn_to_page
@@ -200,6 +204,95 @@ void p2m_change_entry_type_global(struct domain *d,
     p2m_unlock(p2m);
 }
 
+int p2m_harvest_accessed(struct domain *d, unsigned long gfn,
+                         unsigned int nr, unsigned long *bitmap)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+
+    if ( !p2m->harvest_accessed )
+        return -EOPNOTSUPP;
+
+    p2m_lock(p2m);
+    p2m->harvest_accessed(p2m, gfn, nr, bitmap);
+    p2m_unlock(p2m);
+
+    return 0;
+}
+
+int p2m_migrate_page(struct domain *d, unsigned long gfn, unsigned int node)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct page_info *old, *new, *done;
+    p2m_type_t t;
+    p2m_access_t a;
+    mfn_t mfn;
+    int rc = 0;
+
+    gfn_lock(p2m, gfn, 0);
+
+    mfn = p2m->get_entry(p2m, gfn, &t, &a, 0, NULL);
+    if ( t != p2m_ram_rw || !mfn_valid(mfn) ||
+         phys_to_nid(pfn_to_paddr(mfn_x(mfn))) == node )
+        goto out;
+
+    /*
+     * Only a page referenced by nothing but its allocation can be moved:
+     * any other reference (a grant or foreign mapping, a pinned or typed
+     * use) could still be used to access the old copy.  With the gfn
+     * locked, no new one can be taken through the p2m meanwhile.
+     */
+    old = mfn_to_page(mfn);
+    if ( (old->count_info & (PGC_count_mask | PGC_allocated)) !=
+         (1 | PGC_allocated) )
+        goto out;
+
+    new = alloc_domheap_page(NULL, MEMF_node(node) | MEMF_exact_node);
+    if ( !new )
+    {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    /* Swap the pages' ownership, keeping the domain's page count. */
+    if ( steal_page(d, old, MEMF_no_refcount) )
+    {
+        free_domheap_page(new);
+        goto out;
+    }
+
+    copy_domain_page(mfn_x(page_to_mfn(new)), mfn_x(mfn));
+
+    if ( assign_pages(d, new, 0, MEMF_no_refcount) )
+        BUG();
+
+    if ( set_p2m_entry(p2m, gfn, page_to_mfn(new), PAGE_ORDER_4K,
+                       t, a) )
+    {
+        set_gpfn_from_mfn(mfn_x(page_to_mfn(new)), gfn);
+        set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
+        done = old;
+        rc = 1;
+    }
+    else
+    {
+        /* Splitting a superpage failed: put the old page back. */
+        if ( steal_page(d, new, MEMF_no_refcount) ||
+             assign_pages(d, old, 0, MEMF_no_refcount) )
+            BUG();
+        done = new;
+        rc = -ENOMEM;
+    }
+
+    if ( !test_and_clear_bit(_PGC_allocated, &done->count_info) )
+        BUG();
+    put_page(done);
+
+ out:
+    gfn_unlock(p2m, gfn, 0);
+
+    return rc;
+}
+
 mfn_t __get_gfn_type_access(struct p2m_domain *p2m, unsigned long gfn,
                     p2m_type_t *t, p2m_access_t *a, p2m_query_t q,
                     unsigned int *page_order, bool_t locked)
@@ -370,6 +463,20 @@ void p2m_free_ptp(struct p2m_domain *p2m, struct page_info *pg)
     return;
 }
 
+bool_t p2m_merge_allowed(const struct p2m_domain *p2m)
+{
+    struct domain *d = p2m->domain;
+
+    /*
+     * Nested p2ms are rebuilt from scratch anyway. While log-dirty is on,
+     * entries are split on purpose. A p2m shared with the IOMMU would
+     * additionally need the IOTLB flushed for the new superpage.
+     */
+    return opt_p2m_merge && !p2m_is_nestedp2m(p2m) &&
+           !paging_mode_log_dirty(d) &&
+           !(iommu_hap_pt_share && need_iommu(d));
+}
+
 // Allocate a new p2m table for a domain.
 //
 // The structure of the p2m table is that of a pagetable for xen (i.e. it is
@@ -512,8 +619,14 @@ p2m_remove_page(struct p2m_domain *p2m, unsigned long gfn, unsigned long mfn,
     if ( !paging_mode_translate(p2m->domain) )
     {
         if ( need_iommu(p2m->domain) )
+        {
+            struct iommu_flush_batch batch;
+
+            iommu_flush_batch_start(&batch, p2m->domain);
             for ( i = 0; i < (1 << page_order); i++ )
                 iommu_unmap_page(p2m->domain, mfn + i);
+            iommu_flush_batch_end(&batch);
+        }
         return;
     }
 
@@ -560,6 +673,9 @@ guest_physmap_add_entry(struct domain *d, unsigned long gfn,
     {
         if ( need_iommu(d) && t == p2m_ram_rw )
         {
+            struct iommu_flush_batch batch;
+
+            iommu_flush_batch_start(&batch, d);
             for ( i = 0; i < (1 << page_order); i++ )
             {
                 rc = iommu_map_page(
@@ -568,9 +684,11 @@ guest_physmap_add_entry(struct domain *d, unsigned long gfn,
                 {
                     while ( i-- > 0 )
                         iommu_unmap_page(d, mfn + i);
-                    return rc;
+                    break;
                 }
             }
+            iommu_flush_batch_end(&batch);
+            return rc;
         }
         return 0;
     }
@@ -1220,35 +1338,40 @@ int p2m_mem_paging_prep(struct domain *d, unsigned long gfn, uint64_t buffer)
 void p2m_mem_paging_resume(struct domain *d)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
-    mem_event_response_t rsp;
+    mem_event_response_t rsps[MEM_EVENT_RESPONSE_BATCH], *rsp;
+    unsigned int i, nr;
     p2m_type_t p2mt;
     p2m_access_t a;
     mfn_t mfn;
 
-    /* Pull all responses off the ring */
-    while( mem_event_get_response(d, &d->mem_event->paging, &rsp) )
+    /* Pull all responses off the ring, a batch at a time */
+    while ( (nr = mem_event_get_responses(d, &d->mem_event->paging, rsps,
+                                          ARRAY_SIZE(rsps))) != 0 )
     {
-        if ( rsp.flags & MEM_EVENT_FLAG_DUMMY )
-            continue;
-        /* Fix p2m entry if the page was not dropped */
-        if ( !(rsp.flags & MEM_EVENT_FLAG_DROP_PAGE) )
+        for ( i = 0, rsp = rsps; i < nr; i++, rsp++ )
         {
-            gfn_lock(p2m, rsp.gfn, 0);
-            mfn = p2m->get_entry(p2m, rsp.gfn, &p2mt, &a, 0, NULL);
-            /* Allow only pages which were prepared properly, or pages which
-             * were nominated but not evicted */
-            if ( mfn_valid(mfn) && (p2mt == p2m_ram_paging_in) )
+            if ( rsp->flags & MEM_EVENT_FLAG_DUMMY )
+                continue;
+            /* Fix p2m entry if the page was not dropped */
+            if ( !(rsp->flags & MEM_EVENT_FLAG_DROP_PAGE) )
             {
-                set_p2m_entry(p2m, rsp.gfn, mfn, PAGE_ORDER_4K, 
-                                paging_mode_log_dirty(d) ? p2m_ram_logdirty : 
-                                p2m_ram_rw, a);
-                set_gpfn_from_mfn(mfn_x(mfn), rsp.gfn);
+                gfn_lock(p2m, rsp->gfn, 0);
+                mfn = p2m->get_entry(p2m, rsp->gfn, &p2mt, &a, 0, NULL);
+                /* Allow only pages which were prepared properly, or pages
+                 * which were nominated but not evicted */
+                if ( mfn_valid(mfn) && (p2mt == p2m_ram_paging_in) )
+                {
+                    set_p2m_entry(p2m, rsp->gfn, mfn, PAGE_ORDER_4K,
+                                  paging_mode_log_dirty(d) ? p2m_ram_logdirty :
+                                  p2m_ram_rw, a);
+                    set_gpfn_from_mfn(mfn_x(mfn), rsp->gfn);
+                }
+                gfn_unlock(p2m, rsp->gfn, 0);
             }
-            gfn_unlock(p2m, rsp.gfn, 0);
+            /* Unpause domain */
+            if ( rsp->flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+                vcpu_unpause(d->vcpu[rsp->vcpu_id]);
         }
-        /* Unpause domain */
-        if ( rsp.flags & MEM_EVENT_FLAG_VCPU_PAUSED )
-            vcpu_unpause(d->vcpu[rsp.vcpu_id]);
     }
 }
 
@@ -1351,30 +1474,36 @@ bool_t p2m_mem_access_check(paddr_t gpa, bool_t gla_valid, unsigned long gla,
 
 void p2m_mem_access_resume(struct domain *d)
 {
-    mem_event_response_t rsp;
+    mem_event_response_t rsp[MEM_EVENT_RESPONSE_BATCH];
+    unsigned int i, nr;
 
-    /* Pull all responses off the ring */
-    while( mem_event_get_response(d, &d->mem_event->access, &rsp) )
+    /* Pull all responses off the ring, a batch at a time */
+    while ( (nr = mem_event_get_responses(d, &d->mem_event->access, rsp,
+                                          ARRAY_SIZE(rsp))) != 0 )
     {
-        if ( rsp.flags & MEM_EVENT_FLAG_DUMMY )
-            continue;
-        /* Unpause domain */
-        if ( rsp.flags & MEM_EVENT_FLAG_VCPU_PAUSED )
-            vcpu_unpause(d->vcpu[rsp.vcpu_id]);
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( rsp[i].flags & MEM_EVENT_FLAG_DUMMY )
+                continue;
+            /* Unpause domain */
+            if ( rsp[i].flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+                vcpu_unpause(d->vcpu[rsp[i].vcpu_id]);
+        }
     }
 }
 
 /* Set access type for a region of pfns.
  * If start_pfn == -1ul, sets the default access type */
-int p2m_set_mem_access(struct domain *d, unsigned long start_pfn, 
-                       uint32_t nr, hvmmem_access_t access) 
+long p2m_set_mem_access(struct domain *d, unsigned long start_pfn,
+                        uint32_t nr, hvmmem_access_t access)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
-    unsigned long pfn;
+    unsigned long pfn, end = start_pfn + nr;
+    unsigned int order, iter = 0;
     p2m_access_t a, _a;
     p2m_type_t t;
     mfn_t mfn;
-    int rc = 0;
+    long rc = 0;
 
     /* N.B. _not_ static: initializer depends on p2m->default_access */
     p2m_access_t memaccess[] = {
@@ -1403,17 +1532,47 @@ int p2m_set_mem_access(struct domain *d, unsigned long start_pfn,
         return 0;
     }
 
+#define covers(o) (!(pfn & ((1UL << (o)) - 1)) && pfn + (1UL << (o)) <= end)
+
     p2m_lock(p2m);
-    for ( pfn = start_pfn; pfn < start_pfn + nr; pfn++ )
+    for ( pfn = start_pfn; pfn < end; pfn += 1UL << order )
     {
-        mfn = p2m->get_entry(p2m, pfn, &t, &_a, 0, NULL);
-        if ( p2m->set_entry(p2m, pfn, mfn, PAGE_ORDER_4K, t, a) == 0 )
+        order = PAGE_ORDER_4K;
+        mfn = p2m->get_entry(p2m, pfn, &t, &_a, 0, &order);
+
+        /*
+         * Change a superpage in one go, rather than splitting it, if the
+         * range covers all of it (or an aligned 2M of a 1G one).  Holes
+         * are left to be dealt with a page at a time.
+         */
+        if ( !mfn_valid(mfn) )
+            order = PAGE_ORDER_4K;
+        else if ( order >= PAGE_ORDER_1G && covers(PAGE_ORDER_1G) )
+            order = PAGE_ORDER_1G;
+        else if ( order >= PAGE_ORDER_2M && covers(PAGE_ORDER_2M) )
+            order = PAGE_ORDER_2M;
+        else
+            order = PAGE_ORDER_4K;
+
+        if ( _a != a &&
+             p2m->set_entry(p2m, pfn, mfn, order, t, a) == 0 )
         {
             rc = -ENOMEM;
             break;
         }
+
+        /* Check for continuation if it's not the last iteration */
+        if ( !(++iter & 0xff) && pfn + (1UL << order) < end &&
+             hypercall_preempt_check() )
+        {
+            rc = pfn + (1UL << order) - start_pfn;
+            break;
+        }
     }
     p2m_unlock(p2m);
+
+#undef covers
+
     return rc;
 }
 
@@ -1530,6 +1689,36 @@ p2m_flush_nestedp2m(struct domain *d)
         p2m_flush_table(d->arch.nested_p2m[i]);
 }
 
+/* Find the cached nested p2m for an np2m base, if there is one.
+ * Called with the nestedp2m lock held. */
+static struct p2m_domain *
+p2m_find_nestedp2m(struct domain *d, uint64_t np2m_base)
+{
+    struct p2m_domain *p2m;
+
+    list_for_each_entry ( p2m, &p2m_get_hostp2m(d)->np2m_list, np2m_list )
+        if ( p2m->np2m_base == np2m_base )
+            return p2m;
+
+    return NULL;
+}
+
+struct p2m_domain *
+p2m_flush_nestedp2m_base(struct domain *d, uint64_t np2m_base)
+{
+    struct p2m_domain *p2m;
+
+    np2m_base &= ~(0xfffull);
+
+    nestedp2m_lock(d);
+    p2m = p2m_find_nestedp2m(d, np2m_base);
+    if ( p2m )
+        p2m_flush_table(p2m);
+    nestedp2m_unlock(d);
+
+    return p2m;
+}
+
 struct p2m_domain *
 p2m_get_nestedp2m(struct vcpu *v, uint64_t np2m_base)
 {
@@ -1543,33 +1732,34 @@ p2m_get_nestedp2m(struct vcpu *v, uint64_t np2m_base)
     /* Mask out low bits; this avoids collisions with P2M_BASE_EADDR */
     np2m_base &= ~(0xfffull);
 
-    if (nv->nv_flushp2m && nv->nv_p2m) {
-        nv->nv_p2m = NULL;
-    }
-
     d = v->domain;
     nestedp2m_lock(d);
-    p2m = nv->nv_p2m;
+
+    /* The np2ms form an LRU cache keyed by np2m base, so switching between
+     * L2 guests picks up the table built for the target one last time. A
+     * flush request from L1 only discards the table being switched to. */
+    p2m = p2m_find_nestedp2m(d, np2m_base);
+    if ( p2m && nv->nv_flushp2m )
+        p2m_flush_table(p2m);
+    else if ( !p2m && nv->nv_p2m && nv->nv_p2m->np2m_base == P2M_BASE_EADDR )
+        p2m = nv->nv_p2m;
+
     if ( p2m ) 
     {
         p2m_lock(p2m);
-        if ( p2m->np2m_base == np2m_base || p2m->np2m_base == P2M_BASE_EADDR )
-        {
-            nv->nv_flushp2m = 0;
-            p2m_getlru_nestedp2m(d, p2m);
-            nv->nv_p2m = p2m;
-            if ( p2m->np2m_base == P2M_BASE_EADDR )
-                hvm_asid_flush_vcpu(v);
-            p2m->np2m_base = np2m_base;
-            cpumask_set_cpu(v->processor, p2m->dirty_cpumask);
-            p2m_unlock(p2m);
-            nestedp2m_unlock(d);
-            return p2m;
-        }
+        nv->nv_flushp2m = 0;
+        p2m_getlru_nestedp2m(d, p2m);
+        if ( p2m != nv->nv_p2m || p2m->np2m_base == P2M_BASE_EADDR )
+            hvm_asid_flush_vcpu(v);
+        nv->nv_p2m = p2m;
+        p2m->np2m_base = np2m_base;
+        cpumask_set_cpu(v->processor, p2m->dirty_cpumask);
         p2m_unlock(p2m);
+        nestedp2m_unlock(d);
+        return p2m;
     }
 
-    /* All p2m's are or were in use. Take the least recent used one,
+    /* Nothing cached for this base. Take the least recent used one,
      * flush it and reuse. */
     p2m = p2m_getlru_nestedp2m(d, NULL);
     p2m_flush_table(p2m);
@@ -164,6 +164,163 @@ void paging_free_log_dirty_bitmap(struct domain *d)
     paging_unlock(d);
 }
 
+/*
+ * The optional dirty ring records each pfn as its bit gets set in the
+ * bitmap, so that the toolstack can fetch the pages dirtied since the
+ * last clean without scanning the whole bitmap.  Every set bit is either
+ * in the ring or the ring has overflowed; the ring may also hold stale or
+ * duplicate entries, which are harmless.
+ */
+static void paging_free_log_dirty_ring(struct domain *d)
+{
+    struct log_dirty_domain *ld = &d->arch.paging.log_dirty;
+
+    paging_lock(d);
+    xfree(ld->ring);
+    ld->ring = NULL;
+    ld->ring_size = ld->ring_count = 0;
+    ld->ring_overflow = 0;
+    paging_unlock(d);
+}
+
+/* Clear the dirty bit(s) of one pfn, or of all pfns (pfn == ~0UL). */
+static void paging_clear_log_dirty_bits(struct domain *d, unsigned long pfn)
+{
+    mfn_t *l4, *l3, *l2;
+    unsigned long *l1;
+    int i4, i3, i2;
+    bool_t all = (pfn == ~0UL);
+
+    ASSERT(paging_locked_by_me(d));
+
+    if ( !mfn_valid(d->arch.paging.log_dirty.top) )
+        return;
+
+    l4 = map_domain_page(mfn_x(d->arch.paging.log_dirty.top));
+    for ( i4 = all ? 0 : L4_LOGDIRTY_IDX(pfn); i4 < LOGDIRTY_NODE_ENTRIES;
+          i4++ )
+    {
+        if ( mfn_valid(l4[i4]) )
+        {
+            l3 = map_domain_page(mfn_x(l4[i4]));
+            for ( i3 = all ? 0 : L3_LOGDIRTY_IDX(pfn);
+                  i3 < LOGDIRTY_NODE_ENTRIES; i3++ )
+            {
+                if ( mfn_valid(l3[i3]) )
+                {
+                    l2 = map_domain_page(mfn_x(l3[i3]));
+                    for ( i2 = all ? 0 : L2_LOGDIRTY_IDX(pfn);
+                          i2 < LOGDIRTY_NODE_ENTRIES; i2++ )
+                    {
+                        if ( mfn_valid(l2[i2]) )
+                        {
+                            l1 = map_domain_page(mfn_x(l2[i2]));
+                            if ( all )
+                                clear_page(l1);
+                            else
+                                __clear_bit(L1_LOGDIRTY_IDX(pfn), l1);
+                            unmap_domain_page(l1);
+                        }
+                        if ( !all )
+                            break;
+                    }
+                    unmap_domain_page(l2);
+                }
+                if ( !all )
+                    break;
+            }
+            unmap_domain_page(l3);
+        }
+        if ( !all )
+            break;
+    }
+    unmap_domain_page(l4);
+}
+
+/* Set up (or, with zero entries, tear down) the dirty ring. */
+static int paging_log_dirty_ring_enable(struct domain *d, unsigned long entries)
+{
+    struct log_dirty_domain *ld = &d->arch.paging.log_dirty;
+    uint64_t *ring = NULL;
+
+    if ( !paging_mode_log_dirty(d) ||
+         entries > (UINT_MAX / sizeof(*ring)) )
+        return -EINVAL;
+
+    if ( entries && (ring = xmalloc_array(uint64_t, entries)) == NULL )
+        return -ENOMEM;
+
+    paging_free_log_dirty_ring(d);
+    if ( !ring )
+        return 0;
+
+    domain_pause(d);
+    paging_lock(d);
+
+    ld->ring = ring;
+    ld->ring_size = entries;
+
+    /* Bits set so far aren't in the ring: start from a clean bitmap. */
+    paging_clear_log_dirty_bits(d, ~0UL);
+    ld->fault_count = 0;
+    ld->dirty_count = 0;
+
+    paging_unlock(d);
+    d->arch.paging.log_dirty.clean_dirty_bitmap(d);
+    domain_unpause(d);
+
+    return 0;
+}
+
+/* Hand the pfns in the dirty ring to the toolstack, and clean them. */
+static int paging_log_dirty_ring_drain(struct domain *d,
+                                       struct xen_domctl_shadow_op *sc)
+{
+    struct log_dirty_domain *ld = &d->arch.paging.log_dirty;
+    unsigned int i, nr;
+    int rv = 0;
+
+    domain_pause(d);
+    paging_lock(d);
+
+    if ( !ld->ring )
+        rv = -EINVAL;
+    else if ( ld->ring_overflow || unlikely(ld->failed_allocs) )
+        /* The bitmap holds pages the ring doesn't: use OP_CLEAN. */
+        rv = -ENOBUFS;
+    if ( rv )
+        goto out;
+
+    nr = min_t(unsigned long, ld->ring_count, sc->pages);
+    if ( copy_to_guest(sc->dirty_ring, ld->ring, nr) )
+    {
+        rv = -EFAULT;
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        paging_clear_log_dirty_bits(d, ld->ring[i]);
+    ld->ring_count -= nr;
+    memmove(ld->ring, ld->ring + nr, ld->ring_count * sizeof(*ld->ring));
+
+    sc->pages = nr;
+    sc->stats.fault_count = ld->fault_count;
+    sc->stats.dirty_count = ld->dirty_count;
+    ld->fault_count = 0;
+    ld->dirty_count = 0;
+
+    paging_unlock(d);
+    /* Safe because the domain is paused. */
+    d->arch.paging.log_dirty.clean_dirty_bitmap(d);
+    domain_unpause(d);
+    return 0;
+
+ out:
+    paging_unlock(d);
+    domain_unpause(d);
+    return rv;
+}
+
 int paging_log_dirty_enable(struct domain *d)
 {
     int ret;
@@ -186,7 +343,10 @@ int paging_log_dirty_disable(struct domain *d)
     /* Safe because the domain is paused. */
     ret = d->arch.paging.log_dirty.disable_log_dirty(d);
     if ( !paging_mode_log_dirty(d) )
+    {
         paging_free_log_dirty_bitmap(d);
+        paging_free_log_dirty_ring(d);
+    }
     domain_unpause(d);
 
     return ret;
@@ -269,6 +429,16 @@ void paging_mark_dirty(struct domain *d, unsigned long guest_mfn)
                      "marked mfn %" PRI_mfn " (pfn=%lx), dom %d\n",
                      mfn_x(gmfn), pfn, d->domain_id);
         d->arch.paging.log_dirty.dirty_count++;
+
+        if ( d->arch.paging.log_dirty.ring )
+        {
+            struct log_dirty_domain *ld = &d->arch.paging.log_dirty;
+
+            if ( ld->ring_count < ld->ring_size )
+                ld->ring[ld->ring_count++] = pfn;
+            else
+                ld->ring_overflow = 1;
+        }
     }
 
 out:
@@ -420,6 +590,14 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
     if ( pages < sc->pages )
         sc->pages = pages;
 
+    /* A clean of all of the guest's pfns supersedes the ring. */
+    if ( clean && d->arch.paging.log_dirty.ring &&
+         pages > domain_get_maximum_gpfn(d) )
+    {
+        d->arch.paging.log_dirty.ring_count = 0;
+        d->arch.paging.log_dirty.ring_overflow = 0;
+    }
+
     paging_unlock(d);
 
     if ( clean )
@@ -492,6 +670,7 @@ void paging_log_dirty_init(struct domain *d,
 static void paging_log_dirty_teardown(struct domain*d)
 {
     paging_free_log_dirty_bitmap(d);
+    paging_free_log_dirty_ring(d);
 }
 
 /************************************************/
@@ -591,6 +770,12 @@ int paging_domctl(struct domain *d, xen_domctl_shadow_op_t *sc,
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
         return paging_log_dirty_op(d, sc);
+
+    case XEN_DOMCTL_SHADOW_OP_RING_ENABLE:
+        return paging_log_dirty_ring_enable(d, sc->pages);
+
+    case XEN_DOMCTL_SHADOW_OP_RING_DRAIN:
+        return paging_log_dirty_ring_drain(d, sc);
     }
 
     /* Here, dispatch domctl to the appropriate paging code */
@@ -1733,35 +1733,51 @@ static unsigned int shadow_get_allocation(struct domain *d)
 /**************************************************************************/
 /* Hash table for storing the guest->shadow mappings.
  * The table itself is an array of pointers to shadows; the shadows are then 
- * threaded on a singly-linked list of shadows with the same hash value */
+ * threaded on a singly-linked list of shadows with the same hash value.
+ *
+ * The table is resized to keep chains short as the number of live shadows
+ * changes (which in turn is bounded by the shadow pool).  Resizing is
+ * incremental: the old table is kept while its chains are moved over a few
+ * at a time by subsequent hash operations, with lookups and deletions
+ * consulting both tables meanwhile. */
+
+/* Bucket counts to choose from */
+static const unsigned int sh_hash_sizes[] = {
+    251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521, 131071
+};
 
-#define SHADOW_HASH_BUCKETS 251
-/* Other possibly useful primes are 509, 1021, 2039, 4093, 8191, 16381 */
+/* Grow above this many entries per bucket, shrink below 1/this. */
+#define SHADOW_HASH_LOAD        2
+#define SHADOW_HASH_UNLOAD      8
+/* Old-table chains moved over per hash operation while resizing */
+#define SHADOW_HASH_MIGRATE     8
 
 /* Hash function that takes a gfn or mfn, plus another byte of type info */
 typedef u32 key_t;
-static inline key_t sh_hash(unsigned long n, unsigned int t) 
+static inline key_t sh_hash(unsigned long n, unsigned int t,
+                            unsigned int buckets)
 {
     unsigned char *p = (unsigned char *)&n;
     key_t k = t;
     int i;
     for ( i = 0; i < sizeof(n) ; i++ ) k = (u32)p[i] + (k<<6) + (k<<16) - k;
-    return k % SHADOW_HASH_BUCKETS;
+    return k % buckets;
 }
 
 #if SHADOW_AUDIT & (SHADOW_AUDIT_HASH|SHADOW_AUDIT_HASH_FULL)
 
 /* Before we get to the mechanism, define a pair of audit functions
  * that sanity-check the contents of the hash table. */
-static void sh_hash_audit_bucket(struct domain *d, int bucket)
-/* Audit one bucket of the hash table */
+static void sh_hash_audit_chain(struct page_info **table, unsigned int buckets,
+                               int bucket)
+/* Audit one bucket of a hash table */
 {
     struct page_info *sp, *x;
 
     if ( !(SHADOW_AUDIT_ENABLE) )
         return;
 
-    sp = d->arch.paging.shadow.hash_table[bucket];
+    sp = table[bucket];
     while ( sp )
     {
         /* Not a shadow? */
@@ -1772,7 +1788,7 @@ static void sh_hash_audit_bucket(struct domain *d, int bucket)
         /* Wrong page of a multi-page shadow? */
         BUG_ON( !sp->u.sh.head );
         /* Wrong bucket? */
-        BUG_ON( sh_hash(__backpointer(sp), sp->u.sh.type) != bucket );
+        BUG_ON( sh_hash(__backpointer(sp), sp->u.sh.type, buckets) != bucket );
         /* Duplicate entry? */
         for ( x = next_shadow(sp); x; x = next_shadow(x) )
             BUG_ON( x->v.sh.back == sp->v.sh.back &&
@@ -1822,7 +1838,15 @@ static void sh_hash_audit_bucket(struct domain *d, int bucket)
     }
 }
 
+static void sh_hash_audit_bucket(struct domain *d, int bucket)
+/* Audit one bucket of the (current) hash table */
+{
+    sh_hash_audit_chain(d->arch.paging.shadow.hash_table,
+                        d->arch.paging.shadow.hash_buckets, bucket);
+}
+
 #else
+#define sh_hash_audit_chain(_t, _n, _b) do {} while(0)
 #define sh_hash_audit_bucket(_d, _b) do {} while(0)
 #endif /* Hashtable bucket audit */
 
@@ -1832,15 +1856,19 @@ static void sh_hash_audit_bucket(struct domain *d, int bucket)
 static void sh_hash_audit(struct domain *d)
 /* Full audit: audit every bucket in the table */
 {
+    struct shadow_domain *sd = &d->arch.paging.shadow;
     int i;
 
     if ( !(SHADOW_AUDIT_ENABLE) )
         return;
 
-    for ( i = 0; i < SHADOW_HASH_BUCKETS; i++ ) 
+    for ( i = 0; i < sd->hash_buckets; i++ ) 
     {
         sh_hash_audit_bucket(d, i);
     }
+    if ( sd->hash_old )
+        for ( i = sd->hash_migrate; i < sd->hash_old_buckets; i++ )
+            sh_hash_audit_chain(sd->hash_old, sd->hash_old_buckets, i);
 }
 
 #else
@@ -1851,14 +1879,17 @@ static void sh_hash_audit(struct domain *d)
  * Returns 0 for success, 1 for error. */
 static int shadow_hash_alloc(struct domain *d)
 {
+    struct shadow_domain *sd = &d->arch.paging.shadow;
     struct page_info **table;
 
     ASSERT(paging_locked_by_me(d));
-    ASSERT(!d->arch.paging.shadow.hash_table);
+    ASSERT(!sd->hash_table);
 
-    table = xzalloc_array(struct page_info *, SHADOW_HASH_BUCKETS);
+    table = xzalloc_array(struct page_info *, sh_hash_sizes[0]);
     if ( !table ) return 1;
-    d->arch.paging.shadow.hash_table = table;
+    sd->hash_table = table;
+    sd->hash_buckets = sh_hash_sizes[0];
+    sd->hash_entries = 0;
     return 0;
 }
 
@@ -1866,64 +1897,179 @@ static int shadow_hash_alloc(struct domain *d)
  * This function does not care whether the table is populated. */
 static void shadow_hash_teardown(struct domain *d)
 {
+    struct shadow_domain *sd = &d->arch.paging.shadow;
+
     ASSERT(paging_locked_by_me(d));
-    ASSERT(d->arch.paging.shadow.hash_table);
+    ASSERT(sd->hash_table);
 
-    xfree(d->arch.paging.shadow.hash_table);
-    d->arch.paging.shadow.hash_table = NULL;
+    xfree(sd->hash_table);
+    sd->hash_table = NULL;
+    xfree(sd->hash_old);
+    sd->hash_old = NULL;
+    sd->hash_buckets = sd->hash_old_buckets = 0;
 }
 
-
-mfn_t shadow_hash_lookup(struct vcpu *v, unsigned long n, unsigned int t)
-/* Find an entry in the hash table.  Returns the MFN of the shadow,
- * or INVALID_MFN if it doesn't exist */
+/* Move up to @nr chains of the old table over, if a resize is under way.
+ * Not while someone is walking the chains. */
+static void sh_hash_migrate(struct domain *d, unsigned int nr)
 {
-    struct domain *d = v->domain;
-    struct page_info *sp, *prev;
+    struct shadow_domain *sd = &d->arch.paging.shadow;
+    struct page_info *sp, *next;
     key_t key;
 
-    ASSERT(paging_locked_by_me(d));
-    ASSERT(d->arch.paging.shadow.hash_table);
-    ASSERT(t);
+    if ( likely(!sd->hash_old) || sd->hash_walking )
+        return;
 
-    sh_hash_audit(d);
+    for ( ; nr && sd->hash_migrate < sd->hash_old_buckets;
+          nr--, sd->hash_migrate++ )
+    {
+        for ( sp = sd->hash_old[sd->hash_migrate]; sp; sp = next )
+        {
+            next = next_shadow(sp);
+            key = sh_hash(__backpointer(sp), sp->u.sh.type, sd->hash_buckets);
+            set_next_shadow(sp, sd->hash_table[key]);
+            sd->hash_table[key] = sp;
+        }
+        sd->hash_old[sd->hash_migrate] = NULL;
+    }
 
-    perfc_incr(shadow_hash_lookups);
-    key = sh_hash(n, t);
-    sh_hash_audit_bucket(d, key);
+    if ( sd->hash_migrate == sd->hash_old_buckets )
+    {
+        xfree(sd->hash_old);
+        sd->hash_old = NULL;
+        sd->hash_old_buckets = 0;
+    }
+}
 
-    sp = d->arch.paging.shadow.hash_table[key];
+/* Start moving to a bigger or smaller table if the load calls for it. */
+static void sh_hash_maybe_resize(struct domain *d)
+{
+    struct shadow_domain *sd = &d->arch.paging.shadow;
+    struct page_info **table;
+    unsigned int i;
+
+    if ( sd->hash_old || sd->hash_walking )
+        return;
+
+    for ( i = 0; sh_hash_sizes[i] != sd->hash_buckets; i++ )
+        ASSERT(i + 1 < ARRAY_SIZE(sh_hash_sizes));
+
+    if ( sd->hash_entries > sd->hash_buckets * SHADOW_HASH_LOAD &&
+         i + 1 < ARRAY_SIZE(sh_hash_sizes) )
+        i++;
+    else if ( sd->hash_entries < sd->hash_buckets / SHADOW_HASH_UNLOAD &&
+              i > 0 )
+        i--;
+    else
+        return;
+
+    /* Failure is fine: we just carry on with longer chains for now. */
+    table = xzalloc_array(struct page_info *, sh_hash_sizes[i]);
+    if ( !table )
+        return;
+
+    perfc_incr(shadow_hash_resizes);
+    sd->hash_old = sd->hash_table;
+    sd->hash_old_buckets = sd->hash_buckets;
+    sd->hash_migrate = 0;
+    sd->hash_table = table;
+    sd->hash_buckets = sh_hash_sizes[i];
+}
+
+/* Look (n,t) up in one chain, pulling it to the front if possible */
+static struct page_info *sh_hash_chain_lookup(struct domain *d,
+                                              struct page_info **table,
+                                              key_t key,
+                                              unsigned long n, unsigned int t)
+{
+    struct page_info *sp, *prev;
+
+    sp = table[key];
     prev = NULL;
     while(sp)
     {
         if ( __backpointer(sp) == n && sp->u.sh.type == t )
         {
             /* Pull-to-front if 'sp' isn't already the head item */
-            if ( unlikely(sp != d->arch.paging.shadow.hash_table[key]) )
+            if ( unlikely(sp != table[key]) )
             {
                 if ( unlikely(d->arch.paging.shadow.hash_walking != 0) )
                     /* Can't reorder: someone is walking the hash chains */
-                    return page_to_mfn(sp);
+                    return sp;
                 else 
                 {
                     ASSERT(prev);
                     /* Delete sp from the list */
                     prev->next_shadow = sp->next_shadow;                    
                     /* Re-insert it at the head of the list */
-                    set_next_shadow(sp, d->arch.paging.shadow.hash_table[key]);
-                    d->arch.paging.shadow.hash_table[key] = sp;
+                    set_next_shadow(sp, table[key]);
+                    table[key] = sp;
                 }
             }
             else
             {
                 perfc_incr(shadow_hash_lookup_head);
             }
-            return page_to_mfn(sp);
+            return sp;
         }
         prev = sp;
         sp = next_shadow(sp);
     }
 
+    return NULL;
+}
+
+/* Unlink @sp from its chain; returns 0 if it isn't on it */
+static int sh_hash_chain_delete(struct page_info **table, key_t key,
+                                struct page_info *sp)
+{
+    struct page_info *x;
+
+    if ( table[key] == sp ) 
+    {
+        /* Easy case: we're deleting the head item. */
+        table[key] = next_shadow(sp);
+        return 1;
+    }
+
+    /* Need to search for the one we want */
+    for ( x = table[key]; x; x = next_shadow(x) )
+        if ( next_shadow(x) == sp )
+        {
+            x->next_shadow = sp->next_shadow;
+            return 1;
+        }
+
+    return 0;
+}
+
+mfn_t shadow_hash_lookup(struct vcpu *v, unsigned long n, unsigned int t)
+/* Find an entry in the hash table.  Returns the MFN of the shadow,
+ * or INVALID_MFN if it doesn't exist */
+{
+    struct domain *d = v->domain;
+    struct shadow_domain *sd = &d->arch.paging.shadow;
+    struct page_info *sp;
+    key_t key;
+
+    ASSERT(paging_locked_by_me(d));
+    ASSERT(sd->hash_table);
+    ASSERT(t);
+
+    sh_hash_migrate(d, SHADOW_HASH_MIGRATE);
+    sh_hash_audit(d);
+
+    perfc_incr(shadow_hash_lookups);
+    key = sh_hash(n, t, sd->hash_buckets);
+    sh_hash_audit_bucket(d, key);
+
+    sp = sh_hash_chain_lookup(d, sd->hash_table, key, n, t);
+    if ( !sp && sd->hash_old )
+        sp = sh_hash_chain_lookup(d, sd->hash_old,
+                                  sh_hash(n, t, sd->hash_old_buckets), n, t);
+    if ( sp )
+        return page_to_mfn(sp);
+
     perfc_incr(shadow_hash_lookup_miss);
     return _mfn(INVALID_MFN);
 }
@@ -1933,23 +2079,27 @@ void shadow_hash_insert(struct vcpu *v, unsigned long n, unsigned int t,
 /* Put a mapping (n,t)->smfn into the hash table */
 {
     struct domain *d = v->domain;
+    struct shadow_domain *sd = &d->arch.paging.shadow;
     struct page_info *sp;
     key_t key;
     
     ASSERT(paging_locked_by_me(d));
-    ASSERT(d->arch.paging.shadow.hash_table);
+    ASSERT(sd->hash_table);
     ASSERT(t);
 
+    sh_hash_maybe_resize(d);
+    sh_hash_migrate(d, SHADOW_HASH_MIGRATE);
     sh_hash_audit(d);
 
     perfc_incr(shadow_hash_inserts);
-    key = sh_hash(n, t);
+    key = sh_hash(n, t, sd->hash_buckets);
     sh_hash_audit_bucket(d, key);
     
     /* Insert this shadow at the top of the bucket */
     sp = mfn_to_page(smfn);
-    set_next_shadow(sp, d->arch.paging.shadow.hash_table[key]);
-    d->arch.paging.shadow.hash_table[key] = sp;
+    set_next_shadow(sp, sd->hash_table[key]);
+    sd->hash_table[key] = sp;
+    sd->hash_entries++;
     
     sh_hash_audit_bucket(d, key);
 }
@@ -1959,42 +2109,72 @@ void shadow_hash_delete(struct vcpu *v, unsigned long n, unsigned int t,
 /* Excise the mapping (n,t)->smfn from the hash table */
 {
     struct domain *d = v->domain;
-    struct page_info *sp, *x;
+    struct shadow_domain *sd = &d->arch.paging.shadow;
+    struct page_info *sp;
     key_t key;
 
     ASSERT(paging_locked_by_me(d));
-    ASSERT(d->arch.paging.shadow.hash_table);
+    ASSERT(sd->hash_table);
     ASSERT(t);
 
     sh_hash_audit(d);
 
     perfc_incr(shadow_hash_deletes);
-    key = sh_hash(n, t);
+    key = sh_hash(n, t, sd->hash_buckets);
     sh_hash_audit_bucket(d, key);
     
     sp = mfn_to_page(smfn);
-    if ( d->arch.paging.shadow.hash_table[key] == sp ) 
-        /* Easy case: we're deleting the head item. */
-        d->arch.paging.shadow.hash_table[key] = next_shadow(sp);
-    else 
+    if ( !sh_hash_chain_delete(sd->hash_table, key, sp) )
     {
-        /* Need to search for the one we want */
-        x = d->arch.paging.shadow.hash_table[key];
-        while ( 1 )
-        {
-            ASSERT(x); /* We can't have hit the end, since our target is
-                        * still in the chain somehwere... */
-            if ( next_shadow(x) == sp )
-            {
-                x->next_shadow = sp->next_shadow;
-                break;
-            }
-            x = next_shadow(x);
-        }
+        /* We can't have missed it, since our target is still in one of
+         * the chains somewhere... */
+        ASSERT(sd->hash_old);
+        if ( !sh_hash_chain_delete(sd->hash_old,
+                                   sh_hash(n, t, sd->hash_old_buckets), sp) )
+            BUG();
     }
     set_next_shadow(sp, NULL);
+    sd->hash_entries--;
 
     sh_hash_audit_bucket(d, key);
+
+    sh_hash_maybe_resize(d);
+    sh_hash_migrate(d, SHADOW_HASH_MIGRATE);
+}
+
+/* Gather statistics about the chains, for the toolstack */
+static void shadow_hash_stats(struct domain *d,
+                              struct xen_domctl_shadow_hash_stats *stats)
+{
+    struct shadow_domain *sd = &d->arch.paging.shadow;
+    struct page_info *sp, **chain;
+    unsigned int i, len;
+
+    ASSERT(paging_locked_by_me(d));
+
+    memset(stats, 0, sizeof(*stats));
+    if ( !sd->hash_table )
+        return;
+
+    stats->buckets = sd->hash_buckets;
+    stats->entries = sd->hash_entries;
+
+    for ( i = 0; i < sd->hash_buckets + sd->hash_old_buckets; i++ )
+    {
+        if ( i < sd->hash_buckets )
+            chain = &sd->hash_table[i];
+        else if ( i - sd->hash_buckets >= sd->hash_migrate )
+            chain = &sd->hash_old[i - sd->hash_buckets];
+        else
+            continue;
+
+        for ( len = 0, sp = *chain; sp; sp = next_shadow(sp) )
+            len++;
+        if ( len )
+            stats->used++;
+        if ( len > stats->max_chain )
+            stats->max_chain = len;
+    }
 }
 
 typedef int (*hash_callback_t)(struct vcpu *v, mfn_t smfn, mfn_t other_mfn);
@@ -2014,7 +2194,8 @@ static void hash_foreach(struct vcpu *v,
 {
     int i, done = 0;
     struct domain *d = v->domain;
-    struct page_info *x;
+    struct shadow_domain *sd = &d->arch.paging.shadow;
+    struct page_info *x, **chain;
 
     ASSERT(paging_locked_by_me(d));
 
@@ -2026,12 +2207,20 @@ static void hash_foreach(struct vcpu *v,
     ASSERT(d->arch.paging.shadow.hash_walking == 0);
     d->arch.paging.shadow.hash_walking = 1;
 
-    for ( i = 0; i < SHADOW_HASH_BUCKETS; i++ ) 
+    /* While resizing, walk the not yet moved chains of the old table too */
+    for ( i = 0; i < sd->hash_buckets + sd->hash_old_buckets; i++ ) 
     {
+        if ( i < sd->hash_buckets )
+            chain = &sd->hash_table[i];
+        else if ( i - sd->hash_buckets >= sd->hash_migrate )
+            chain = &sd->hash_old[i - sd->hash_buckets];
+        else
+            continue;
+
         /* WARNING: This is not safe against changes to the hash table.
          * The callback *must* return non-zero if it has inserted or
          * deleted anything from the hash (lookups are OK, though). */
-        for ( x = d->arch.paging.shadow.hash_table[i]; x; x = next_shadow(x) )
+        for ( x = *chain; x; x = next_shadow(x) )
         {
             if ( callback_mask & (1 << x->u.sh.type) )
             {
@@ -3691,6 +3880,12 @@ int shadow_domctl(struct domain *d,
         sc->mb = shadow_get_allocation(d);
         return 0;
 
+    case XEN_DOMCTL_SHADOW_OP_GET_HASH_STATS:
+        paging_lock(d);
+        shadow_hash_stats(d, &sc->hash_stats);
+        paging_unlock(d);
+        return 0;
+
     case XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION:
         paging_lock(d);
         if ( sc->mb == 0 && shadow_mode_enabled(d) )
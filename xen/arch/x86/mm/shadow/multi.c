@@ -3346,6 +3346,7 @@ static int sh_page_fault(struct vcpu *v,
 
     emul_ops = shadow_init_emulation(&emul_ctxt, regs);
 
+    vcpu_perf_incr(emulations);
     r = x86_emulate(&emul_ctxt.ctxt, emul_ops);
 
     /*
@@ -3407,6 +3408,7 @@ static int sh_page_fault(struct vcpu *v,
         {
             shadow_continue_emulation(&emul_ctxt, regs);
             v->arch.paging.last_write_was_pt = 0;
+            vcpu_perf_incr(emulations);
             r = x86_emulate(&emul_ctxt.ctxt, emul_ops);
             if ( r == X86EMUL_OKAY )
             { 
@@ -88,7 +88,8 @@ static int nmi_callback(struct cpu_user_regs *regs, int cpu)
 
 	ovf = model->check_ctrs(cpu, &cpu_msrs[cpu], regs);
 	xen_mode = ring_0(regs);
-	if ( ovf && is_active(current->domain) && !xen_mode )
+	if ( ovf && is_active(current->domain) && !xen_mode &&
+	     xenoprof_notify_needed(current) )
 		send_guest_vcpu_virq(current, VIRQ_XENOPROF);
 
 	if ( ovf == 2 )
@@ -10,6 +10,16 @@
 
 static DEFINE_SPINLOCK(pci_config_lock);
 
+/*
+ * A CF8 value MMCONFIG can stand in for: enabled, and with none of the
+ * reserved bits set (AMD uses bits 24-27 for extended register numbers).
+ */
+#define CF8_MMCFG_OK(cf8) (pci_mmcfg_lockless && \
+                           ((cf8) & 0xff000000) == 0x80000000)
+#define CF8_BUS(cf8)      (((cf8) >> 16) & 0xff)
+#define CF8_DEVFN(cf8)    (((cf8) >> 8) & 0xff)
+#define CF8_REG(cf8)      ((cf8) & 0xfc)
+
 uint32_t pci_conf_read(uint32_t cf8, uint8_t offset, uint8_t bytes)
 {
     unsigned long flags;
@@ -17,6 +27,12 @@ uint32_t pci_conf_read(uint32_t cf8, uint8_t offset, uint8_t bytes)
 
     BUG_ON((offset + bytes) > 4);
 
+    /* MMCONFIG accesses are self-contained, so need no lock. */
+    if ( CF8_MMCFG_OK(cf8) &&
+         !pci_mmcfg_read(0, CF8_BUS(cf8), CF8_DEVFN(cf8),
+                         CF8_REG(cf8) + offset, bytes, &value) )
+        return value;
+
     spin_lock_irqsave(&pci_config_lock, flags);
 
     outl(cf8, 0xcf8);
@@ -48,6 +64,11 @@ void pci_conf_write(uint32_t cf8, uint8_t offset, uint8_t bytes, uint32_t data)
 
     BUG_ON((offset + bytes) > 4);
 
+    if ( CF8_MMCFG_OK(cf8) &&
+         !pci_mmcfg_write(0, CF8_BUS(cf8), CF8_DEVFN(cf8),
+                          CF8_REG(cf8) + offset, bytes, data) )
+        return;
+
     spin_lock_irqsave(&pci_config_lock, flags);
 
     outl(cf8, 0xcf8);
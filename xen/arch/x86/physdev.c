@@ -145,7 +145,7 @@ int physdev_map_pirq(domid_t domid, int type, int *index, int *pirq_p,
         irq = *index;
         if ( irq == -1 )
     case MAP_PIRQ_TYPE_MULTI_MSI:
-            irq = create_irq(NUMA_NO_NODE);
+            irq = create_irq(pci_dev_node(msi->seg, msi->bus, msi->devfn));
 
         if ( irq < nr_irqs_gsi || irq >= nr_irqs )
         {
@@ -555,7 +555,8 @@ ret_t do_physdev_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         if ( copy_from_guest(&manage_pci, arg, 1) != 0 )
             break;
 
-        ret = pci_add_device(0, manage_pci.bus, manage_pci.devfn, NULL);
+        ret = pci_add_device(0, manage_pci.bus, manage_pci.devfn, NULL,
+                             NUMA_NO_NODE);
         break;
     }
 
@@ -587,18 +588,33 @@ ret_t do_physdev_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         pdev_info.physfn.devfn = manage_pci_ext.physfn.devfn;
         ret = pci_add_device(0, manage_pci_ext.bus,
                              manage_pci_ext.devfn,
-                             &pdev_info);
+                             &pdev_info, NUMA_NO_NODE);
         break;
     }
 
     case PHYSDEVOP_pci_device_add: {
         struct physdev_pci_device_add add;
         struct pci_dev_info pdev_info;
+        unsigned int node = NUMA_NO_NODE;
 
         ret = -EFAULT;
         if ( copy_from_guest(&add, arg, 1) != 0 )
             break;
 
+        /* The proximity domain follows the fixed part of the structure. */
+        if ( add.flags & XEN_PCI_DEV_PXM )
+        {
+            uint32_t pxm;
+            int pxm_node;
+
+            if ( copy_from_guest_offset(&pxm, arg,
+                                        sizeof(add) / sizeof(pxm), 1) )
+                break;
+            pxm_node = pxm_to_node(pxm);
+            if ( pxm_node >= 0 )
+                node = pxm_node;
+        }
+
         pdev_info.is_extfn = !!(add.flags & XEN_PCI_DEV_EXTFN);
         if ( add.flags & XEN_PCI_DEV_VIRTFN )
         {
@@ -608,7 +624,7 @@ ret_t do_physdev_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         }
         else
             pdev_info.is_virtfn = 0;
-        ret = pci_add_device(add.seg, add.bus, add.devfn, &pdev_info);
+        ret = pci_add_device(add.seg, add.bus, add.devfn, &pdev_info, node);
         break;
     }
 
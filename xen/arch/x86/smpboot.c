@@ -184,13 +184,16 @@ static void smp_callin(void)
     unsigned int cpu = smp_processor_id();
     int i, rc;
 
-    /* Wait 2s total for startup. */
+    /*
+     * Wait 2s total for startup.  The boot CPU normally calls out within
+     * microseconds of us starting: don't overshoot by polling coarsely.
+     */
     Dprintk("Waiting for CALLOUT.\n");
     for ( i = 0; cpu_state != CPU_STATE_CALLOUT; i++ )
     {
-        BUG_ON(i >= 200);
+        BUG_ON(i >= 20000);
         cpu_relax();
-        mdelay(10);
+        udelay(100);
     }
 
     /*
@@ -395,6 +398,32 @@ void start_secondary(void *unused)
 
 extern void *stack_start;
 
+/*
+ * Delay, in microseconds, between asserting and deasserting INIT.  The
+ * MP specification's 10ms is only needed by old processors, and costs
+ * that much per CPU brought up, so by default it is skipped, along with
+ * most of the delays around STARTUP, on processors known not to need it.
+ */
+#define INIT_UDELAY_DEFAULT (~0U)
+#define INIT_UDELAY_LEGACY  10000
+static unsigned int __read_mostly init_udelay = INIT_UDELAY_DEFAULT;
+integer_param("cpu_init_udelay", init_udelay);
+
+static void __init smp_quirk_init_udelay(void)
+{
+    /* Leave any setting from the command line alone. */
+    if ( init_udelay != INIT_UDELAY_DEFAULT )
+        return;
+
+    if ( (boot_cpu_data.x86_vendor == X86_VENDOR_INTEL &&
+          boot_cpu_data.x86 == 6) ||
+         (boot_cpu_data.x86_vendor == X86_VENDOR_AMD &&
+          boot_cpu_data.x86 >= 0xf) )
+        init_udelay = 0;
+    else
+        init_udelay = INIT_UDELAY_LEGACY;
+}
+
 static int wakeup_secondary_cpu(int phys_apicid, unsigned long start_eip)
 {
     unsigned long send_status = 0, accept_status = 0;
@@ -428,7 +457,7 @@ static int wakeup_secondary_cpu(int phys_apicid, unsigned long start_eip)
             send_status = apic_read(APIC_ICR) & APIC_ICR_BUSY;
         } while ( send_status && (timeout++ < 1000) );
 
-        mdelay(10);
+        udelay(init_udelay);
 
         Dprintk("Deasserting INIT.\n");
 
@@ -485,7 +514,7 @@ static int wakeup_secondary_cpu(int phys_apicid, unsigned long start_eip)
         if ( !x2apic_enabled )
         {
             /* Give the other CPU some time to accept the IPI. */
-            udelay(300);
+            udelay(init_udelay ? 300 : 10);
 
             Dprintk("Startup point 1.\n");
 
@@ -498,7 +527,7 @@ static int wakeup_secondary_cpu(int phys_apicid, unsigned long start_eip)
             } while ( send_status && (timeout++ < 1000) );
 
             /* Give the other CPU some time to accept the IPI. */
-            udelay(200);
+            udelay(init_udelay ? 200 : 10);
         }
 
         /* Due to the Pentium erratum 3AP. */
@@ -728,6 +757,8 @@ void __init smp_prepare_cpus(unsigned int max_cpus)
     smp_store_cpu_info(0); /* Final full version of the data */
     print_cpu_info(0);
 
+    smp_quirk_init_udelay();
+
     boot_cpu_physical_apicid = get_apic_id();
     x86_cpu_to_apicid[0] = boot_cpu_physical_apicid;
 
@@ -813,6 +844,7 @@ remove_siblinginfo(int cpu)
     c[cpu].phys_proc_id = BAD_APICID;
     c[cpu].cpu_core_id = BAD_APICID;
     c[cpu].compute_unit_id = BAD_APICID;
+    c[cpu].cpu_llc_id = BAD_APICID;
     cpumask_clear_cpu(cpu, &cpu_sibling_setup_map);
 }
 
@@ -101,6 +101,12 @@ long arch_do_sysctl(
     }
     break;
 
+    case XEN_SYSCTL_hypercall_stats:
+        ret = hypercall_stats_op(&sysctl->u.hypercall_stats);
+        if ( !ret && __copy_to_guest(u_sysctl, sysctl, 1) )
+            ret = -EFAULT;
+        break;
+
     default:
         ret = -ENOSYS;
         break;
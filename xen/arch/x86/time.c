@@ -935,6 +935,24 @@ struct cpu_calibration {
 };
 static DEFINE_PER_CPU(struct cpu_calibration, cpu_calibration);
 
+/*
+ * With reliable TSCs (constant rate, in sync across CPUs, and not stopping
+ * in deep C states) there is nothing for a rendezvous to measure: one TSC
+ * stamp, taken by CPU0 together with platform time, serves every CPU.  So
+ * CPU0 publishes the pair, and the other CPUs pick it up the next time they
+ * process softirqs, without being sent an IPI (and woken, if idle) for it.
+ */
+static bool_t __initdata opt_lazy_calibration = 1;
+boolean_param("lazy_calibration", opt_lazy_calibration);
+
+static bool_t __read_mostly lazy_calibration;
+
+static struct {
+    unsigned int version; /* Odd while being updated. */
+    u64 local_tsc_stamp;
+    s_time_t stime_master_stamp;
+} calibration_master;
+
 /* Softirq handler for per-CPU time calibration. */
 static void local_time_calibration(void)
 {
@@ -970,6 +988,25 @@ static void local_time_calibration(void)
     /* The overall calibration scale multiplier. */
     u32 calibration_mul_frac;
 
+    if ( lazy_calibration )
+    {
+        unsigned int version;
+
+        local_irq_disable();
+        do {
+            version = read_atomic(&calibration_master.version);
+            smp_rmb();
+            t->local_tsc_stamp    = calibration_master.local_tsc_stamp;
+            t->stime_master_stamp = calibration_master.stime_master_stamp;
+            t->stime_local_stamp  = t->stime_master_stamp;
+            smp_rmb();
+        } while ( (version & 1) ||
+                  version != read_atomic(&calibration_master.version) );
+        local_irq_enable();
+        update_vcpu_system_time(current);
+        goto out;
+    }
+
     if ( boot_cpu_has(X86_FEATURE_CONSTANT_TSC) )
     {
         /* Atomically read cpu_calibration struct and write cpu_time struct. */
@@ -1291,12 +1328,36 @@ static void time_calibration_std_rendezvous(void *_r)
 static void (*time_calibration_rendezvous_fn)(void *) =
     time_calibration_std_rendezvous;
 
+/* Publish a calibration point, for each CPU to pick up in its own time. */
+static void time_calibration_lazy(void)
+{
+    unsigned int cpu;
+
+    local_irq_disable();
+    calibration_master.version++;
+    smp_wmb();
+    calibration_master.stime_master_stamp = read_platform_stime();
+    rdtscll(calibration_master.local_tsc_stamp);
+    smp_wmb();
+    calibration_master.version++;
+    local_irq_enable();
+
+    for_each_online_cpu ( cpu )
+        set_bit(TIME_CALIBRATE_SOFTIRQ, &softirq_pending(cpu));
+}
+
 static void time_calibration(void *unused)
 {
     struct calibration_rendezvous r = {
         .semaphore = ATOMIC_INIT(0)
     };
 
+    if ( lazy_calibration )
+    {
+        time_calibration_lazy();
+        return;
+    }
+
     cpumask_copy(&r.cpu_calibration_map, &cpu_online_map);
 
     /* @wait=1 because we must wait for all cpus before freeing @r. */
@@ -1403,6 +1464,22 @@ static int __init verify_tsc_reliability(void)
         }
     }
 
+    /*
+     * Only now, with all CPUs up and checked, is it known whether a single
+     * TSC stamp can calibrate them all.
+     */
+    if ( opt_lazy_calibration &&
+         boot_cpu_has(X86_FEATURE_CONSTANT_TSC) &&
+         boot_cpu_has(X86_FEATURE_NONSTOP_TSC) &&
+         boot_cpu_has(X86_FEATURE_TSC_RELIABLE) )
+    {
+        printk(XENLOG_INFO "Time calibration without rendezvous\n");
+        /* CPUs may be about to calibrate: have a valid point for them. */
+        time_calibration_lazy();
+        smp_wmb();
+        lazy_calibration = 1;
+    }
+
     return 0;
 }
 __initcall(verify_tsc_reliability);
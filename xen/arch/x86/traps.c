@@ -835,6 +835,9 @@ static void pv_cpuid(struct cpu_user_regs *regs)
     case 0x0000000d: /* XSAVE */
         if ( !cpu_has_xsave )
             goto unsupported;
+        /* XSAVES/XRSTORS need supervisor state support we don't provide. */
+        if ( (uint32_t)regs->ecx == 1 )
+            a &= ~XSTATE_FEATURE_XSAVES;
         break;
 
     case 0x80000001:
@@ -1884,6 +1887,8 @@ static int emulate_privileged_op(struct cpu_user_regs *regs)
     void (*io_emul)(struct cpu_user_regs *) __attribute__((__regparm__(1)));
     uint64_t val, msr_content;
 
+    vcpu_perf_incr(emulations);
+
     if ( !read_descriptor(regs->cs, v, regs,
                           &code_base, &code_limit, &ar,
                           _SEGMENT_CODE|_SEGMENT_S|_SEGMENT_DPL|_SEGMENT_P) )
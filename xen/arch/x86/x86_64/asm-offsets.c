@@ -58,6 +58,7 @@ void __dummy__(void)
     OFFSET(next_in_list_offset, struct domain, next_in_list);
     OFFSET(VCPU_processor, struct vcpu, processor);
     OFFSET(VCPU_domain, struct vcpu, domain);
+    OFFSET(VCPU_perf, struct vcpu, perf);
     OFFSET(VCPU_vcpu_info, struct vcpu, vcpu_info);
     OFFSET(VCPU_trap_bounce, struct vcpu, arch.pv_vcpu.trap_bounce);
     OFFSET(VCPU_int80_bounce, struct vcpu, arch.pv_vcpu.int80_bounce);
@@ -155,6 +156,9 @@ void __dummy__(void)
     BLANK();
 #endif
 
+    OFFSET(VCPUPERF_hypercalls, struct xen_sysctl_domain_perf_data, hypercalls);
+    BLANK();
+
     DEFINE(IRQSTAT_shift, LOG_2(sizeof(irq_cpustat_t)));
     OFFSET(IRQSTAT_softirq_pending, irq_cpustat_t, __softirq_pending);
     BLANK();
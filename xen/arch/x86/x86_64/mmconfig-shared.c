@@ -28,6 +28,9 @@
 
 unsigned int pci_probe = PCI_PROBE_CONF1 | PCI_PROBE_MMCONF;
 
+/* Use MMCONFIG, where it is mapped, also for segment 0 legacy accesses. */
+bool_t __read_mostly pci_mmcfg_lockless;
+
 static void __init parse_mmcfg(char *s)
 {
     char *ss;
@@ -41,6 +44,8 @@ static void __init parse_mmcfg(char *s)
             pci_probe &= ~PCI_PROBE_MMCONF;
         else if ( !strcmp(s, "amd_fam10") || !strcmp(s, "amd-fam10") )
             pci_probe |= PCI_CHECK_ENABLE_AMD_MMCONF;
+        else if ( !strcmp(s, "lockless") )
+            pci_mmcfg_lockless = 1;
 
         s = ss + 1;
     } while ( ss );
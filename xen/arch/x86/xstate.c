@@ -15,6 +15,9 @@
 #include <asm/asm_defns.h>
 
 bool_t __read_mostly cpu_has_xsaveopt;
+bool_t __read_mostly cpu_has_xsavec;
+bool_t __read_mostly cpu_has_xgetbv1;
+bool_t __read_mostly cpu_has_xsaves;
 
 /*
  * Maximum size (in byte) of the XSAVE/XRSTOR save area required by all
@@ -26,6 +29,14 @@ static u32 __read_mostly xsave_cntxt_size;
 /* A 64-bit bitmask of the XSAVE/XRSTOR features supported by processor. */
 u64 xfeature_mask;
 
+/*
+ * Standard-format offset and size of each extended component, and which
+ * components start on a 64-byte boundary in the compacted format.
+ */
+static unsigned int __read_mostly xstate_offsets[63];
+static unsigned int __read_mostly xstate_sizes[63];
+static u64 __read_mostly xstate_align;
+
 /* Cached xcr0 for fast read */
 static DEFINE_PER_CPU(uint64_t, xcr0);
 
@@ -62,41 +73,68 @@ uint64_t get_xcr0(void)
     return this_cpu(xcr0);
 }
 
+/* Components enabled in XCR0 which are not in their initial configuration. */
+uint64_t get_xinuse(void)
+{
+    u32 lo, hi;
+
+    ASSERT(cpu_has_xgetbv1);
+    asm volatile ( ".byte 0x0f,0x01,0xd0" : "=a" (lo), "=d" (hi) : "c" (1) );
+
+    return lo | ((u64)hi << 32);
+}
+
+/*
+ * Save in the most efficient format available. XSAVES combines the modified
+ * optimization of XSAVEOPT, which skips state left untouched since the last
+ * XRSTOR from the same area, with the compacted layout of XSAVEC.
+ */
+#define XSAVE(pfx) do {                                                  \
+    if ( cpu_has_xsaves )                                                \
+        asm volatile ( ".byte " pfx "0x0f,0xc7,0x2f" /* xsaves */        \
+                       : "=m" (*ptr)                                     \
+                       : "a" (lmask), "d" (hmask), "D" (ptr) );          \
+    else if ( cpu_has_xsaveopt )                                         \
+        asm volatile ( ".byte " pfx "0x0f,0xae,0x37" /* xsaveopt */      \
+                       : "=m" (*ptr)                                     \
+                       : "a" (lmask), "d" (hmask), "D" (ptr) );          \
+    else if ( cpu_has_xsavec )                                           \
+        asm volatile ( ".byte " pfx "0x0f,0xc7,0x27" /* xsavec */        \
+                       : "=m" (*ptr)                                     \
+                       : "a" (lmask), "d" (hmask), "D" (ptr) );          \
+    else                                                                 \
+        asm volatile ( ".byte " pfx "0x0f,0xae,0x27" /* xsave */         \
+                       : "=m" (*ptr)                                     \
+                       : "a" (lmask), "d" (hmask), "D" (ptr) );          \
+} while ( 0 )
+
 void xsave(struct vcpu *v, uint64_t mask)
 {
     struct xsave_struct *ptr = v->arch.xsave_area;
     uint32_t hmask = mask >> 32;
     uint32_t lmask = mask;
     int word_size = mask & XSTATE_FP ? (cpu_has_fpu_sel ? 8 : 0) : -1;
+    bool_t modified_opt = cpu_has_xsaves || cpu_has_xsaveopt;
 
     if ( word_size <= 0 || !is_pv_32bit_vcpu(v) )
     {
         typeof(ptr->fpu_sse.fip.sel) fcs = ptr->fpu_sse.fip.sel;
         typeof(ptr->fpu_sse.fdp.sel) fds = ptr->fpu_sse.fdp.sel;
 
-        if ( cpu_has_xsaveopt )
+        /*
+         * xsaveopt and xsaves may not write the FPU portion even when the
+         * respective mask bit is set. For the check further down to work we
+         * hence need to put the save image back into the state that it was
+         * in right after the previous save.
+         */
+        if ( modified_opt && word_size > 0 &&
+             (ptr->fpu_sse.x[FPU_WORD_SIZE_OFFSET] == 4 ||
+              ptr->fpu_sse.x[FPU_WORD_SIZE_OFFSET] == 2) )
         {
-            /*
-             * xsaveopt may not write the FPU portion even when the respective
-             * mask bit is set. For the check further down to work we hence
-             * need to put the save image back into the state that it was in
-             * right after the previous xsaveopt.
-             */
-            if ( word_size > 0 &&
-                 (ptr->fpu_sse.x[FPU_WORD_SIZE_OFFSET] == 4 ||
-                  ptr->fpu_sse.x[FPU_WORD_SIZE_OFFSET] == 2) )
-            {
-                ptr->fpu_sse.fip.sel = 0;
-                ptr->fpu_sse.fdp.sel = 0;
-            }
-            asm volatile ( ".byte 0x48,0x0f,0xae,0x37"
-                           : "=m" (*ptr)
-                           : "a" (lmask), "d" (hmask), "D" (ptr) );
+            ptr->fpu_sse.fip.sel = 0;
+            ptr->fpu_sse.fdp.sel = 0;
         }
-        else
-            asm volatile ( ".byte 0x48,0x0f,0xae,0x27"
-                           : "=m" (*ptr)
-                           : "a" (lmask), "d" (hmask), "D" (ptr) );
+        XSAVE("0x48,");
 
         if ( !(mask & ptr->xsave_hdr.xstate_bv & XSTATE_FP) ||
              /*
@@ -106,7 +144,7 @@ void xsave(struct vcpu *v, uint64_t mask)
              (!(ptr->fpu_sse.fsw & 0x0080) &&
               boot_cpu_data.x86_vendor == X86_VENDOR_AMD) )
         {
-            if ( cpu_has_xsaveopt && word_size > 0 )
+            if ( modified_opt && word_size > 0 )
             {
                 ptr->fpu_sse.fip.sel = fcs;
                 ptr->fpu_sse.fdp.sel = fds;
@@ -127,25 +165,49 @@ void xsave(struct vcpu *v, uint64_t mask)
     }
     else
     {
-        if ( cpu_has_xsaveopt )
-            asm volatile ( ".byte 0x0f,0xae,0x37"
-                           : "=m" (*ptr)
-                           : "a" (lmask), "d" (hmask), "D" (ptr) );
-        else
-            asm volatile ( ".byte 0x0f,0xae,0x27"
-                           : "=m" (*ptr)
-                           : "a" (lmask), "d" (hmask), "D" (ptr) );
+        XSAVE("");
         word_size = 4;
     }
     if ( word_size >= 0 )
         ptr->fpu_sse.x[FPU_WORD_SIZE_OFFSET] = word_size;
 }
 
+#undef XSAVE
+
+/*
+ * XRSTOR understands both layouts; XRSTORS, which keeps the modified
+ * optimization tracking of XSAVES intact, only the compacted one. A fault
+ * bumps @faults and skips the instruction.
+ */
+#define XRSTOR(pfx) do {                                                 \
+    if ( compacted && cpu_has_xsaves )                                   \
+        asm volatile ( "1: .byte " pfx "0x0f,0xc7,0x1f\n" /* xrstors */  \
+                       "3:\n"                                            \
+                       ".section .fixup,\"ax\"\n"                         \
+                       "2: incl %0\n"                                    \
+                       "   jmp 3b\n"                                     \
+                       ".previous\n"                                     \
+                       _ASM_EXTABLE(1b, 2b)                              \
+                       : "+r" (faults)                                   \
+                       : "m" (*ptr), "a" (lmask), "d" (hmask), "D" (ptr) ); \
+    else                                                                 \
+        asm volatile ( "1: .byte " pfx "0x0f,0xae,0x2f\n" /* xrstor */   \
+                       "3:\n"                                            \
+                       ".section .fixup,\"ax\"\n"                         \
+                       "2: incl %0\n"                                    \
+                       "   jmp 3b\n"                                     \
+                       ".previous\n"                                     \
+                       _ASM_EXTABLE(1b, 2b)                              \
+                       : "+r" (faults)                                   \
+                       : "m" (*ptr), "a" (lmask), "d" (hmask), "D" (ptr) ); \
+} while ( 0 )
+
 void xrstor(struct vcpu *v, uint64_t mask)
 {
     uint32_t hmask = mask >> 32;
     uint32_t lmask = mask;
     struct xsave_struct *ptr = v->arch.xsave_area;
+    bool_t cleared;
 
     /*
      * AMD CPUs don't save/restore FDP/FIP/FOP unless an exception
@@ -166,41 +228,77 @@ void xrstor(struct vcpu *v, uint64_t mask)
      * XRSTOR can fault if passed a corrupted data block. We handle this
      * possibility, which may occur if the block was passed to us by control
      * tools or through VCPUOP_initialise, by silently clearing the block.
+     * A cleared block is in the standard format with all components in
+     * their initial state, which cannot fault again.
      */
-    switch ( __builtin_expect(ptr->fpu_sse.x[FPU_WORD_SIZE_OFFSET], 8) )
+    for ( cleared = 0; ; cleared = 1 )
     {
-    default:
-        asm volatile ( "1: .byte 0x48,0x0f,0xae,0x2f\n"
-                       ".section .fixup,\"ax\"      \n"
-                       "2: mov %5,%%ecx             \n"
-                       "   xor %1,%1                \n"
-                       "   rep stosb                \n"
-                       "   lea %2,%0                \n"
-                       "   mov %3,%1                \n"
-                       "   jmp 1b                   \n"
-                       ".previous                   \n"
-                       _ASM_EXTABLE(1b, 2b)
-                       : "+&D" (ptr), "+&a" (lmask)
-                       : "m" (*ptr), "g" (lmask), "d" (hmask),
-                         "m" (xsave_cntxt_size)
-                       : "ecx" );
-        break;
-    case 4: case 2:
-        asm volatile ( "1: .byte 0x0f,0xae,0x2f\n"
-                       ".section .fixup,\"ax\" \n"
-                       "2: mov %5,%%ecx        \n"
-                       "   xor %1,%1           \n"
-                       "   rep stosb           \n"
-                       "   lea %2,%0           \n"
-                       "   mov %3,%1           \n"
-                       "   jmp 1b              \n"
-                       ".previous              \n"
-                       _ASM_EXTABLE(1b, 2b)
-                       : "+&D" (ptr), "+&a" (lmask)
-                       : "m" (*ptr), "g" (lmask), "d" (hmask),
-                         "m" (xsave_cntxt_size)
-                       : "ecx" );
-        break;
+        bool_t compacted =
+            !!(ptr->xsave_hdr.xcomp_bv & XSTATE_COMPACTION_ENABLED);
+        unsigned int faults = 0;
+
+        switch ( __builtin_expect(ptr->fpu_sse.x[FPU_WORD_SIZE_OFFSET], 8) )
+        {
+        default:
+            XRSTOR("0x48,");
+            break;
+        case 4: case 2:
+            XRSTOR("");
+            break;
+        }
+
+        if ( likely(!faults) )
+            break;
+
+        BUG_ON(cleared);
+        memset(ptr, 0, xsave_cntxt_size);
+    }
+}
+
+#undef XRSTOR
+
+/*
+ * Copy @v's save area into @dest in the standard, uncompacted layout which
+ * the toolstack and migration streams expect. Components which do not fit
+ * in @size bytes are reported as being in their initial state.
+ */
+void expand_xsave_states(const struct vcpu *v, void *dest, unsigned int size)
+{
+    const struct xsave_struct *xsave = v->arch.xsave_area;
+    struct xsave_struct *std = dest;
+    u64 xcomp_bv = xsave->xsave_hdr.xcomp_bv;
+    unsigned int i, offset = XSTATE_AREA_MIN_SIZE;
+
+    if ( !(xcomp_bv & XSTATE_COMPACTION_ENABLED) )
+    {
+        memcpy(dest, xsave, size);
+        return;
+    }
+
+    ASSERT(size >= XSTATE_AREA_MIN_SIZE);
+    memset(dest, 0, size);
+    memcpy(dest, xsave, XSTATE_AREA_MIN_SIZE);
+    std->xsave_hdr.xcomp_bv = 0;
+
+    for ( i = 2; i < 63; i++ )
+    {
+        u64 bit = 1ULL << i;
+
+        if ( !(xcomp_bv & bit) )
+            continue;
+        if ( xstate_align & bit )
+            offset = ROUNDUP(offset, 64);
+
+        if ( std->xsave_hdr.xstate_bv & bit )
+        {
+            if ( xstate_offsets[i] + xstate_sizes[i] <= size )
+                memcpy(dest + xstate_offsets[i], (const void *)xsave + offset,
+                       xstate_sizes[i]);
+            else
+                std->xsave_hdr.xstate_bv &= ~bit;
+        }
+
+        offset += xstate_sizes[i];
     }
 }
 
@@ -284,7 +382,19 @@ void xstate_init(bool_t bsp)
 
     if ( bsp )
     {
+        unsigned int i;
+
         xfeature_mask = feature_mask;
+        for ( i = 2; i < 63; i++ )
+        {
+            if ( !(feature_mask & (1ULL << i)) )
+                continue;
+            cpuid_count(XSTATE_CPUID, i, &eax, &ebx, &ecx, &edx);
+            xstate_sizes[i] = eax;
+            xstate_offsets[i] = ebx;
+            if ( ecx & XSTATE_ALIGN64 )
+                xstate_align |= 1ULL << i;
+        }
         /*
          * xsave_cntxt_size is the max size required by enabled features.
          * We know FP/SSE and YMM about eax, and nothing about edx at present.
@@ -299,12 +409,33 @@ void xstate_init(bool_t bsp)
         BUG_ON(xsave_cntxt_size != xstate_ctxt_size(feature_mask));
     }
 
-    /* Check XSAVEOPT feature. */
+    /* Check XSAVEOPT, XSAVEC, XGETBV1 and XSAVES features. */
     cpuid_count(XSTATE_CPUID, 1, &eax, &ebx, &ecx, &edx);
     if ( bsp )
+    {
         cpu_has_xsaveopt = !!(eax & XSTATE_FEATURE_XSAVEOPT);
+        cpu_has_xsavec = !!(eax & XSTATE_FEATURE_XSAVEC);
+        cpu_has_xgetbv1 = !!(eax & XSTATE_FEATURE_XGETBV1);
+        cpu_has_xsaves = !!(eax & XSTATE_FEATURE_XSAVES);
+        if ( eax & (XSTATE_FEATURE_XSAVEOPT | XSTATE_FEATURE_XSAVEC |
+                    XSTATE_FEATURE_XGETBV1 | XSTATE_FEATURE_XSAVES) )
+            printk("%s: using%s%s%s%s\n", __func__,
+                   cpu_has_xsaveopt ? " XSAVEOPT" : "",
+                   cpu_has_xsavec ? " XSAVEC" : "",
+                   cpu_has_xgetbv1 ? " XGETBV1" : "",
+                   cpu_has_xsaves ? " XSAVES" : "");
+    }
     else
+    {
         BUG_ON(!cpu_has_xsaveopt != !(eax & XSTATE_FEATURE_XSAVEOPT));
+        BUG_ON(!cpu_has_xsavec != !(eax & XSTATE_FEATURE_XSAVEC));
+        BUG_ON(!cpu_has_xgetbv1 != !(eax & XSTATE_FEATURE_XGETBV1));
+        BUG_ON(!cpu_has_xsaves != !(eax & XSTATE_FEATURE_XSAVES));
+    }
+
+    /* No supervisor states are managed: XSAVES covers just XCR0. */
+    if ( cpu_has_xsaves )
+        wrmsrl(MSR_IA32_XSS, 0);
 }
 
 unsigned int xstate_ctxt_size(u64 xcr0)
@@ -334,6 +334,7 @@ int compat_grant_table_op(unsigned int cmd,
         }
     }
 
+    vcpu_perf_adda(grant_ops, cmd, i);
     if ( rc > 0 )
     {
         ASSERT(i < count);
@@ -19,6 +19,11 @@
 #include <xen/cpu.h>
 #include <xen/init.h>
 #include <xen/cpumask.h>
+#include <xen/sched.h>
+#include <xen/sched-if.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
+#include <xen/pmstat.h>
 #include <asm/percpu.h>
 #include <asm/smp.h>
 
@@ -27,6 +32,7 @@
 
 static unsigned int core_parking_power(unsigned int event);
 static unsigned int core_parking_performance(unsigned int event);
+static unsigned int core_parking_load(unsigned int event);
 
 static uint32_t cur_idle_nums;
 static unsigned int core_parking_cpunum[NR_CPUS] = {[0 ... NR_CPUS-1] = -1};
@@ -38,7 +44,8 @@ static struct core_parking_policy {
 
 static enum core_parking_controller {
     POWER_FIRST,
-    PERFORMANCE_FIRST
+    PERFORMANCE_FIRST,
+    LOAD_DRIVEN
 } core_parking_controller = POWER_FIRST;
 
 static void __init setup_core_parking_option(char *str)
@@ -47,11 +54,45 @@ static void __init setup_core_parking_option(char *str)
         core_parking_controller = POWER_FIRST;
     else if ( !strcmp(str, "performance") )
         core_parking_controller = PERFORMANCE_FIRST;
+    else if ( !strcmp(str, "load") )
+        core_parking_controller = LOAD_DRIVEN;
     else
         return;
 }
 custom_param("core_parking", setup_core_parking_option);
 
+/*
+ * The load driven policy parks and unparks cpus on its own.  Every
+ * core_parking_period ms it samples, for each cpu of Pool-0, how busy the
+ * cpu was (idle vcpu run time), how many vcpus were waiting in its
+ * runqueue and how long it sat in C2 or deeper.  One cpu gets unparked as
+ * soon as the pool is busy or vcpus queue up, and one gets parked when
+ * the remaining cpus could comfortably absorb its load.  Parking empties
+ * the least loaded package first, so that whole packages go idle.
+ */
+static unsigned int __read_mostly core_parking_period = 100;
+integer_param("core_parking_period", core_parking_period);
+
+#define CORE_PARKING_PARK_PCT     50   /* park below this average load */
+#define CORE_PARKING_UNPARK_PCT   80   /* unpark above this average load */
+#define CORE_PARKING_RUNQ_SHIFT   8
+#define CORE_PARKING_RUNQ_UNPARK  (1U << CORE_PARKING_RUNQ_SHIFT)
+
+struct core_parking_load {
+    s_time_t stamp;          /* when last sampled */
+    uint64_t idle, deep;     /* idle and C2+ time at last sample */
+    unsigned int busy;       /* % of last period spent not idle */
+    unsigned int deep_pct;   /* % of last period spent in C2+ */
+    unsigned int runq;       /* avg waiting vcpus, CORE_PARKING_RUNQ_SHIFT */
+};
+
+static DEFINE_PER_CPU(struct core_parking_load, core_parking_load);
+static s_time_t core_parking_last;
+static uint32_t core_parking_max_idle;
+static struct timer core_parking_timer;
+static void core_parking_tasklet_fn(unsigned long unused);
+static DECLARE_TASKLET(core_parking_tasklet, core_parking_tasklet_fn, 0);
+
 static unsigned int core_parking_performance(unsigned int event)
 {
     unsigned int cpu = -1;
@@ -172,6 +213,155 @@ static unsigned int core_parking_power(unsigned int event)
     return cpu;
 }
 
+static void core_parking_sample(void)
+{
+    s_time_t now = NOW(), period = now - core_parking_last;
+    unsigned int cpu;
+
+    for_each_cpu ( cpu, cpupool0->cpu_valid )
+    {
+        struct core_parking_load *l = &per_cpu(core_parking_load, cpu);
+        uint64_t idle = get_cpu_idle_time(cpu);
+        uint64_t deep = 0;
+        unsigned int nr = sched_cpu_nr_runnable(cpu) << CORE_PARKING_RUNQ_SHIFT;
+
+#ifdef HAS_ACPI
+        deep = pmstat_get_cx_deep_residency(cpu);
+#endif
+
+        /* Freshly (un)parked cpus only get a baseline this round. */
+        if ( l->stamp != core_parking_last || period <= 0 )
+        {
+            l->busy = l->deep_pct = 0;
+            l->runq = nr;
+        }
+        else
+        {
+            l->busy = 100 - min_t(uint64_t, 100, (idle - l->idle) * 100 / period);
+            l->deep_pct = min_t(uint64_t, 100, (deep - l->deep) * 100 / period);
+            l->runq = (l->runq * 3 + nr) / 4;
+        }
+
+        l->stamp = now;
+        l->idle = idle;
+        l->deep = deep;
+    }
+
+    core_parking_last = now;
+}
+
+static void core_parking_tasklet_fn(unsigned long unused)
+{
+    unsigned int cpu, online = 0, load = 0, max_runq = 0;
+
+    core_parking_sample();
+
+    for_each_cpu ( cpu, cpupool0->cpu_valid )
+    {
+        const struct core_parking_load *l = &per_cpu(core_parking_load, cpu);
+
+        online++;
+        load += l->busy + ((l->runq * 100) >> CORE_PARKING_RUNQ_SHIFT);
+        max_runq = max(max_runq, l->runq);
+    }
+
+    if ( cur_idle_nums &&
+         (load > online * CORE_PARKING_UNPARK_PCT ||
+          max_runq >= CORE_PARKING_RUNQ_UNPARK) )
+    {
+        cpu = core_parking_policy->next(CORE_PARKING_DECREMENT);
+        if ( !cpu_up(cpu) )
+            core_parking_cpunum[--cur_idle_nums] = -1;
+    }
+    else if ( cur_idle_nums < core_parking_max_idle && online > 1 &&
+              load < (online - 1) * CORE_PARKING_PARK_PCT &&
+              max_runq < CORE_PARKING_RUNQ_UNPARK / 2 )
+    {
+        cpu = core_parking_policy->next(CORE_PARKING_INCREMENT);
+        if ( cpu < nr_cpu_ids && !cpu_down(cpu) )
+            core_parking_cpunum[cur_idle_nums++] = cpu;
+    }
+
+    set_timer(&core_parking_timer, NOW() + MILLISECS(core_parking_period));
+}
+
+static void core_parking_timer_fn(void *unused)
+{
+    /* cpu_up()/cpu_down() can't be called from softirq context. */
+    tasklet_schedule_on_cpu(&core_parking_tasklet, 0);
+}
+
+/*
+ * Park out of the package with the lowest load (packages other than the
+ * boot cpu's first, as that one can never go fully idle), preferring the
+ * package with the fewest cpus still online.  Within it, pick the least
+ * busy cpu, and among equally busy ones the one sleeping deepest.
+ */
+static unsigned int core_parking_load(unsigned int event)
+{
+    unsigned int cpu = -1;
+
+    switch ( event )
+    {
+    case CORE_PARKING_INCREMENT:
+    {
+        unsigned int sibling, best_cpu = -1;
+        unsigned int pkg_load, pkg_online, boot_pkg;
+        unsigned int best_boot = 2, best_load = UINT_MAX, best_online = 0;
+        const struct core_parking_load *l, *best;
+        cpumask_t pkg;
+
+        for_each_cpu ( cpu, cpupool0->cpu_valid )
+        {
+            if ( cpu == 0 )
+                continue;
+
+            cpumask_and(&pkg, per_cpu(cpu_core_mask, cpu), cpupool0->cpu_valid);
+            boot_pkg = cpumask_test_cpu(0, &pkg);
+            pkg_online = cpumask_weight(&pkg);
+            pkg_load = 0;
+            for_each_cpu ( sibling, &pkg )
+                pkg_load += per_cpu(core_parking_load, sibling).busy;
+
+            if ( boot_pkg > best_boot ||
+                 (boot_pkg == best_boot &&
+                  (pkg_load > best_load ||
+                   (pkg_load == best_load && pkg_online >= best_online))) )
+            {
+                /* Same package as the best so far: compare the cpus. */
+                if ( best_cpu >= nr_cpu_ids ||
+                     !cpumask_test_cpu(best_cpu, &pkg) )
+                    continue;
+                l = &per_cpu(core_parking_load, cpu);
+                best = &per_cpu(core_parking_load, best_cpu);
+                if ( l->busy > best->busy ||
+                     (l->busy == best->busy && l->deep_pct <= best->deep_pct) )
+                    continue;
+            }
+
+            best_cpu = cpu;
+            best_boot = boot_pkg;
+            best_load = pkg_load;
+            best_online = pkg_online;
+        }
+
+        cpu = best_cpu;
+    }
+    break;
+
+    case CORE_PARKING_DECREMENT:
+    {
+        cpu = core_parking_cpunum[cur_idle_nums -1];
+    }
+    break;
+
+    default:
+        break;
+    }
+
+    return cpu;
+}
+
 long core_parking_helper(void *data)
 {
     uint32_t idle_nums = (unsigned long)data;
@@ -181,6 +371,13 @@ long core_parking_helper(void *data)
     if ( !core_parking_policy )
         return -EINVAL;
 
+    if ( core_parking_controller == LOAD_DRIVEN )
+    {
+        /* The load policy parks cpus itself: dom0 only caps how many. */
+        core_parking_max_idle = idle_nums;
+        idle_nums = min(idle_nums, cur_idle_nums);
+    }
+
     while ( cur_idle_nums < idle_nums )
     {
         cpu = core_parking_policy->next(CORE_PARKING_INCREMENT);
@@ -217,6 +414,11 @@ static struct core_parking_policy performance_first = {
     .next = core_parking_performance,
 };
 
+static struct core_parking_policy load_driven = {
+    .name = "load",
+    .next = core_parking_load,
+};
+
 static int register_core_parking_policy(struct core_parking_policy *policy)
 {
     if ( !policy || !policy->next )
@@ -232,9 +434,21 @@ static int __init core_parking_init(void)
 
     if ( core_parking_controller == PERFORMANCE_FIRST )
         ret = register_core_parking_policy(&performance_first);
+    else if ( core_parking_controller == LOAD_DRIVEN )
+        ret = register_core_parking_policy(&load_driven);
     else
         ret = register_core_parking_policy(&power_first);
 
+    if ( !ret && core_parking_controller == LOAD_DRIVEN )
+    {
+        if ( !core_parking_period )
+            core_parking_period = 1;
+        core_parking_max_idle = num_present_cpus() - 1;
+        init_timer(&core_parking_timer, core_parking_timer_fn, NULL, 0);
+        set_timer(&core_parking_timer,
+                  NOW() + MILLISECS(core_parking_period));
+    }
+
     return ret;
 }
 __initcall(core_parking_init);
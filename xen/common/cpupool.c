@@ -18,6 +18,9 @@
 #include <xen/sched.h>
 #include <xen/sched-if.h>
 #include <xen/cpu.h>
+#ifdef HAS_ACPI
+#include <acpi/cpufreq/cpufreq.h>
+#endif
 
 #define for_each_cpupool(ptr)    \
     for ((ptr) = &cpupool_list; *(ptr) != NULL; (ptr) = &((*(ptr))->next))
@@ -37,6 +40,17 @@ DEFINE_PER_CPU(struct cpupool *, cpupool);
 
 #define cpupool_dprintk(x...) ((void)0)
 
+/*
+ * cpupool_numa_split: at boot, give every NUMA node other than the boot
+ * cpu's one a cpupool of its own, so that Pool-0 (and dom0) is left with
+ * the first node only.  This is the boot time equivalent of
+ * "xl cpupool-numa-split".
+ */
+static bool_t __read_mostly opt_cpupool_numa_split;
+boolean_param("cpupool_numa_split", opt_cpupool_numa_split);
+
+static struct cpupool *cpupool_node_pool[MAX_NUMNODES];
+
 static struct cpupool *alloc_cpupool_struct(void)
 {
     struct cpupool *c = xzalloc(struct cpupool);
@@ -164,6 +178,9 @@ static struct cpupool *cpupool_create(
     }
 
     c->cpupool_id = (poolid == CPUPOOLID_NONE) ? (last + 1) : poolid;
+#ifdef HAS_ACPI
+    c->epp = HWP_EPP_DEFAULT;
+#endif
     if ( poolid == 0 )
     {
         c->sched = scheduler_get_default();
@@ -253,6 +270,9 @@ static int cpupool_assign_cpu_locked(struct cpupool *c, unsigned int cpu)
         cpupool_cpu_moving = NULL;
     }
     cpumask_set_cpu(cpu, c->cpu_valid);
+#ifdef HAS_ACPI
+    cpufreq_hwp_set_epp(cpu, c->epp);
+#endif
 
     rcu_read_lock(&domlist_read_lock);
     for_each_domain_in_cpupool(d, c)
@@ -433,6 +453,40 @@ void cpupool_rm_domain(struct domain *d)
     return;
 }
 
+/*
+ * Find (creating it if needed) the pool a cpu coming online during boot
+ * should go to when cpupool_numa_split is in effect.  NULL means Pool-0.
+ */
+static struct cpupool *cpupool_numa_pool(unsigned int cpu)
+{
+    unsigned int node = cpu_to_node(cpu);
+    struct cpupool *c;
+    int err;
+
+    if ( !opt_cpupool_numa_split || system_state != SYS_STATE_boot ||
+         node == NUMA_NO_NODE || node == cpu_to_node(0) )
+        return NULL;
+
+    if ( cpupool_node_pool[node] != NULL )
+        return cpupool_node_pool[node];
+
+    c = cpupool_create(CPUPOOLID_NONE, scheduler_get_default()->sched_id,
+                       &err);
+    if ( c == NULL )
+    {
+        printk(XENLOG_WARNING
+               "Failed to create cpupool for node %u (%d), using Pool-0\n",
+               node, err);
+        return NULL;
+    }
+    cpupool_put(c);
+
+    printk(XENLOG_INFO "Created cpupool %d for node %u\n",
+           c->cpupool_id, node);
+
+    return cpupool_node_pool[node] = c;
+}
+
 /*
  * called to add a new cpu to pool admin
  * we add a hotplugged cpu to the cpupool0 to be able to add it to dom0,
@@ -441,6 +495,8 @@ void cpupool_rm_domain(struct domain *d)
  */
 static void cpupool_cpu_add(unsigned int cpu)
 {
+    struct cpupool *node_pool = cpupool_numa_pool(cpu);
+
     spin_lock(&cpupool_lock);
     cpumask_clear_cpu(cpu, &cpupool_locked_cpus);
     cpumask_set_cpu(cpu, &cpupool_free_cpus);
@@ -460,7 +516,7 @@ static void cpupool_cpu_add(unsigned int cpu)
     }
 
     if ( cpumask_test_cpu(cpu, &cpupool_free_cpus) )
-        cpupool_assign_cpu_locked(cpupool0, cpu);
+        cpupool_assign_cpu_locked(node_pool ?: cpupool0, cpu);
     spin_unlock(&cpupool_lock);
 }
 
@@ -529,6 +585,7 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
         op->cpupool_id = c->cpupool_id;
         op->sched_id = c->sched->sched_id;
         op->n_dom = c->n_dom;
+        op->epp = c->epp;
         ret = cpumask_to_xenctl_bitmap(&op->cpumap, c->cpu_valid);
         cpupool_put(c);
     }
@@ -625,6 +682,34 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
     }
     break;
 
+    case XEN_SYSCTL_CPUPOOL_OP_SETEPP:
+    {
+#ifdef HAS_ACPI
+        unsigned int cpu;
+
+        ret = -EOPNOTSUPP;
+        if ( !cpufreq_hwp_enabled() )
+            break;
+        ret = -EINVAL;
+        if ( op->epp > HWP_EPP_POWERSAVE )
+            break;
+        spin_lock(&cpupool_lock);
+        c = cpupool_find_by_id(op->cpupool_id);
+        ret = -ENOENT;
+        if ( c != NULL )
+        {
+            c->epp = op->epp;
+            for_each_cpu ( cpu, c->cpu_valid )
+                cpufreq_hwp_set_epp(cpu, c->epp);
+            ret = 0;
+        }
+        spin_unlock(&cpupool_lock);
+#else
+        ret = -EOPNOTSUPP;
+#endif
+    }
+    break;
+
     default:
         ret = -ENOSYS;
         break;
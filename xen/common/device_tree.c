@@ -54,6 +54,35 @@ struct dt_alias_prop {
 
 static LIST_HEAD(aliases_lookup);
 
+/*
+ * Lookups of host device tree nodes by path, phandle and compatible
+ * string go through hash tables built once the tree is unflattened,
+ * rather than walking all nodes.  Each chain is kept in allnext order,
+ * so that the first match found is the one the walk would have found.
+ * Until the tables are built, or if they couldn't be, lookups walk.
+ */
+struct dt_compat_entry {
+    const char *compat;
+    struct dt_device_node *np;
+    struct dt_compat_entry *next;
+};
+
+static struct dt_device_node **dt_path_hash;
+static struct dt_device_node **dt_phandle_hash;
+static struct dt_compat_entry **dt_compat_hash;
+static unsigned int dt_hash_mask;
+
+/* Names and compatible strings compare case-insensitively; so must hash */
+static unsigned int dt_hash_string(const char *s)
+{
+    unsigned int hash = 0;
+
+    while ( *s )
+        hash = hash * 31 + tolower(*s++);
+
+    return hash;
+}
+
 /* Some device tree functions may be called both before and after the
    console is initialized. */
 #define dt_printk(fmt, ...)                         \
@@ -638,6 +667,16 @@ struct dt_device_node *dt_find_node_by_path(const char *path)
 {
     struct dt_device_node *np;
 
+    if ( dt_path_hash )
+    {
+        for ( np = dt_path_hash[dt_hash_string(path) & dt_hash_mask];
+              np != NULL; np = np->path_next )
+            if ( dt_node_cmp(np->full_name, path) == 0 )
+                break;
+
+        return np;
+    }
+
     dt_for_each_device_node(dt_host, np)
         if ( np->full_name && (dt_node_cmp(np->full_name, path) == 0) )
             break;
@@ -658,6 +697,22 @@ struct dt_device_node *dt_find_node_by_alias(const char *alias)
     return NULL;
 }
 
+static bool_t dt_match_one(const struct dt_device_match *match,
+                           const struct dt_device_node *node)
+{
+    if ( match->path && !dt_node_path_is_equal(node, match->path) )
+        return 0;
+
+    if ( match->type && !dt_device_type_is_equal(node, match->type) )
+        return 0;
+
+    if ( match->compatible &&
+         !dt_device_is_compatible(node, match->compatible) )
+        return 0;
+
+    return 1;
+}
+
 bool_t dt_match_node(const struct dt_device_match *matches,
                      const struct dt_device_node *node)
 {
@@ -666,19 +721,8 @@ bool_t dt_match_node(const struct dt_device_match *matches,
 
     while ( matches->path || matches->type || matches->compatible )
     {
-        bool_t match = 1;
-
-        if ( matches->path )
-            match &= dt_node_path_is_equal(node, matches->path);
-
-        if ( matches->type )
-            match &= dt_device_type_is_equal(node, matches->type);
-
-        if ( matches->compatible )
-            match &= dt_device_is_compatible(node, matches->compatible);
-
-        if ( match )
-            return match;
+        if ( dt_match_one(matches, node) )
+            return 1;
 
         matches++;
     }
@@ -694,6 +738,41 @@ const struct dt_device_node *dt_get_parent(const struct dt_device_node *node)
     return node->parent;
 }
 
+/*
+ * The first node after @from (or the first node, if NULL) matching @match,
+ * which has a path or a compatible string, looked up through the index.
+ */
+static struct dt_device_node *
+dt_index_find_match(const struct dt_device_node *from,
+                    const struct dt_device_match *match)
+{
+    const struct dt_compat_entry *ci;
+    struct dt_device_node *np;
+
+    if ( match->compatible )
+    {
+        for ( ci = dt_compat_hash[dt_hash_string(match->compatible) &
+                                  dt_hash_mask];
+              ci != NULL; ci = ci->next )
+        {
+            if ( from && ci->np->index <= from->index )
+                continue;
+            if ( dt_compat_cmp(ci->compat, match->compatible) == 0 &&
+                 dt_match_one(match, ci->np) )
+                return ci->np;
+        }
+
+        return NULL;
+    }
+
+    np = dt_find_node_by_path(match->path);
+    if ( !np || (from && np->index <= from->index) ||
+         !dt_match_one(match, np) )
+        return NULL;
+
+    return np;
+}
+
 struct dt_device_node *
 dt_find_compatible_node(struct dt_device_node *from,
                         const char *type,
@@ -702,6 +781,16 @@ dt_find_compatible_node(struct dt_device_node *from,
     struct dt_device_node *np;
     struct dt_device_node *dt;
 
+    if ( dt_compat_hash )
+    {
+        const struct dt_device_match match = {
+            .type = type,
+            .compatible = compatible,
+        };
+
+        return dt_index_find_match(from, &match);
+    }
+
     dt = from ? from->allnext : dt_host;
     dt_for_each_device_node(dt, np)
     {
@@ -721,6 +810,32 @@ dt_find_matching_node(struct dt_device_node *from,
 {
     struct dt_device_node *np;
     struct dt_device_node *dt;
+    const struct dt_device_match *m;
+
+    /*
+     * With the index, each entry of the table finds its own first match,
+     * and the earliest of those wins.  An entry matching by type alone
+     * can't be looked up, though, so then walk.
+     */
+    if ( dt_compat_hash && matches )
+    {
+        for ( m = matches; m->path || m->compatible; m++ )
+            continue;
+
+        if ( !m->type )
+        {
+            struct dt_device_node *best = NULL;
+
+            for ( m = matches; m->path || m->compatible; m++ )
+            {
+                np = dt_index_find_match(from, m);
+                if ( np && (!best || np->index < best->index) )
+                    best = np;
+            }
+
+            return best;
+        }
+    }
 
     dt = from ? from->allnext : dt_host;
     dt_for_each_device_node(dt, np)
@@ -1057,6 +1172,17 @@ static const struct dt_device_node *dt_find_node_by_phandle(dt_phandle handle)
 {
     const struct dt_device_node *np;
 
+    /* Nodes without a phandle have 0, and aren't indexed */
+    if ( dt_phandle_hash && handle )
+    {
+        for ( np = dt_phandle_hash[handle & dt_hash_mask];
+              np != NULL; np = np->phandle_next )
+            if ( np->phandle == handle )
+                break;
+
+        return np;
+    }
+
     dt_for_each_device_node(dt_host, np)
         if ( np->phandle == handle )
             break;
@@ -1726,6 +1852,95 @@ static void __init __unflatten_device_tree(const void *fdt,
     dt_dprintk(" <- unflatten_device_tree()\n");
 }
 
+/**
+ * dt_index_build - Build the lookup indexes of the host device tree
+ *
+ * Nodes are never added to the host device tree once it's unflattened,
+ * so the indexes stay valid for good.
+ */
+static void __init dt_index_build(void)
+{
+    struct dt_device_node **path_index, **phandle_index, *np, **pnp;
+    struct dt_compat_entry **compat_index, *entries, **pci;
+    unsigned int nr_nodes = 0, nr_compat = 0, buckets = 1, hash;
+    const char *cp;
+    u32 cplen, l;
+
+    dt_for_each_device_node(dt_host, np)
+    {
+        np->index = nr_nodes++;
+        cp = dt_get_property(np, "compatible", &cplen);
+        for ( ; cp && cplen > 0; cp += l, cplen -= l )
+        {
+            l = strlen(cp) + 1;
+            nr_compat++;
+        }
+    }
+
+    while ( buckets < nr_nodes )
+        buckets <<= 1;
+
+    path_index = xzalloc_array(struct dt_device_node *, buckets);
+    phandle_index = xzalloc_array(struct dt_device_node *, buckets);
+    compat_index = xzalloc_array(struct dt_compat_entry *, buckets);
+    entries = xmalloc_array(struct dt_compat_entry, nr_compat);
+    if ( !path_index || !phandle_index || !compat_index ||
+         (nr_compat && !entries) )
+    {
+        dt_printk(XENLOG_WARNING
+                  "Unable to index the device tree, lookups will walk it\n");
+        xfree(path_index);
+        xfree(phandle_index);
+        xfree(compat_index);
+        xfree(entries);
+        return;
+    }
+
+    /* Append at each chain's tail, to keep chains in allnext order */
+    dt_for_each_device_node(dt_host, np)
+    {
+        np->path_next = NULL;
+        if ( np->full_name )
+        {
+            hash = dt_hash_string(np->full_name) & (buckets - 1);
+            for ( pnp = &path_index[hash]; *pnp; pnp = &(*pnp)->path_next )
+                continue;
+            *pnp = np;
+        }
+
+        np->phandle_next = NULL;
+        if ( np->phandle )
+        {
+            hash = np->phandle & (buckets - 1);
+            for ( pnp = &phandle_index[hash]; *pnp;
+                  pnp = &(*pnp)->phandle_next )
+                continue;
+            *pnp = np;
+        }
+
+        cp = dt_get_property(np, "compatible", &cplen);
+        for ( ; cp && cplen > 0; cp += l, cplen -= l )
+        {
+            l = strlen(cp) + 1;
+            entries->compat = cp;
+            entries->np = np;
+            entries->next = NULL;
+            hash = dt_hash_string(cp) & (buckets - 1);
+            for ( pci = &compat_index[hash]; *pci; pci = &(*pci)->next )
+                continue;
+            *pci = entries++;
+        }
+    }
+
+    dt_hash_mask = buckets - 1;
+    dt_path_hash = path_index;
+    dt_phandle_hash = phandle_index;
+    dt_compat_hash = compat_index;
+
+    dt_dprintk("Indexed %u device tree nodes, %u compatible strings\n",
+               nr_nodes, nr_compat);
+}
+
 static void dt_alias_add(struct dt_alias_prop *ap,
                          struct dt_device_node *np,
                          int id, const char *stem, int stem_len)
@@ -1809,6 +2024,7 @@ dt_find_interrupt_controller(const struct dt_device_match *matches)
 void __init dt_unflatten_host_device_tree(void)
 {
     __unflatten_device_tree(device_tree_flattened, &dt_host);
+    dt_index_build();
     dt_alias_scan();
 }
 
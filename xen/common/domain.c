@@ -61,6 +61,24 @@ struct domain *domain_list;
 
 struct domain *dom0;
 
+/*
+ * The generation of the domain list is bumped whenever a domain is
+ * created or destroyed, or its state changes, and d->generation is that
+ * of the domain's last change.  The last few domains destroyed are
+ * remembered, so XEN_SYSCTL_domain_changes can say which domains have
+ * gone since a given generation, unless it is too old.
+ */
+#define DOMAIN_GONE_LOG 32
+static DEFINE_SPINLOCK(domain_generation_lock);
+static uint64_t domain_generation;
+static struct {
+    domid_t domid;
+    uint64_t generation;
+} domain_gone[DOMAIN_GONE_LOG];
+static unsigned int domain_gone_next;
+/* Domains destroyed up to this generation may be missing from the log. */
+static uint64_t domain_gone_forgotten;
+
 struct vcpu *idle_vcpu[NR_CPUS] __read_mostly;
 
 vcpu_info_t dummy_vcpu_info;
@@ -84,6 +102,7 @@ static void __domain_finalise_shutdown(struct domain *d)
             return;
 
     d->is_shut_down = 1;
+    domain_changed(d);
     if ( (d->shutdown_code == SHUTDOWN_suspend) && d->suspend_evtchn )
         evtchn_send(d, d->suspend_evtchn);
     else
@@ -125,7 +144,10 @@ struct vcpu *alloc_vcpu(
 
     tasklet_init(&v->continue_hypercall_tasklet, NULL, 0);
 
-    if ( !zalloc_cpumask_var(&v->cpu_affinity) ||
+    grant_table_init_vcpu(v);
+
+    if ( (v->perf = xzalloc(struct xen_sysctl_domain_perf_data)) == NULL ||
+         !zalloc_cpumask_var(&v->cpu_affinity) ||
          !zalloc_cpumask_var(&v->cpu_affinity_tmp) ||
          !zalloc_cpumask_var(&v->cpu_affinity_saved) ||
          !zalloc_cpumask_var(&v->vcpu_dirty_cpumask) )
@@ -160,6 +182,7 @@ struct vcpu *alloc_vcpu(
         free_cpumask_var(v->cpu_affinity_tmp);
         free_cpumask_var(v->cpu_affinity_saved);
         free_cpumask_var(v->vcpu_dirty_cpumask);
+        xfree(v->perf);
         free_vcpu_struct(v);
         return NULL;
     }
@@ -316,6 +339,7 @@ struct domain *domain_create(
         rcu_assign_pointer(*pd, d);
         rcu_assign_pointer(domain_hash[DOMAIN_HASH(domid)], d);
         spin_unlock(&domlist_update_lock);
+        domain_changed(d);
     }
 
     return d;
@@ -533,6 +557,7 @@ int domain_kill(struct domain *d)
     case DOMDYING_alive:
         domain_pause(d);
         d->is_dying = DOMDYING_dying;
+        domain_changed(d);
         spin_barrier(&d->domain_lock);
         evtchn_destroy(d);
         gnttab_release_mappings(d);
@@ -550,6 +575,7 @@ int domain_kill(struct domain *d)
         for_each_vcpu ( d, v )
             unmap_vcpu_info(v);
         d->is_dying = DOMDYING_dead;
+        domain_changed(d);
         /* Mem event cleanup has to go here because the rings 
          * have to be put before we call put_domain. */
         mem_event_cleanup(d);
@@ -649,6 +675,7 @@ void domain_resume(struct domain *d)
 
     d->is_shutting_down = d->is_shut_down = 0;
     d->shutdown_code = -1;
+    domain_changed(d);
 
     for_each_vcpu ( d, v )
     {
@@ -745,6 +772,7 @@ static void complete_domain_destroy(struct rcu_head *head)
             free_cpumask_var(v->cpu_affinity);
             free_cpumask_var(v->cpu_affinity_tmp);
             free_cpumask_var(v->vcpu_dirty_cpumask);
+            xfree(v->perf);
             free_vcpu_struct(v);
         }
 
@@ -767,6 +795,8 @@ void domain_destroy(struct domain *d)
 {
     struct domain **pd;
     atomic_t      old, new;
+    unsigned long flags;
+    unsigned int i;
 
     BUG_ON(!d->is_dying);
 
@@ -790,6 +820,14 @@ void domain_destroy(struct domain *d)
     rcu_assign_pointer(*pd, d->next_in_hashbucket);
     spin_unlock(&domlist_update_lock);
 
+    spin_lock_irqsave(&domain_generation_lock, flags);
+    i = domain_gone_next++ % DOMAIN_GONE_LOG;
+    if ( domain_gone[i].generation )
+        domain_gone_forgotten = domain_gone[i].generation;
+    domain_gone[i].domid = d->domain_id;
+    domain_gone[i].generation = ++domain_generation;
+    spin_unlock_irqrestore(&domain_generation_lock, flags);
+
     /* Schedule RCU asynchronous completion of domain destroy. */
     call_rcu(&d->rcu, complete_domain_destroy);
 }
@@ -849,12 +887,85 @@ void domain_pause_by_systemcontroller(struct domain *d)
     domain_pause(d);
     if ( test_and_set_bool(d->is_paused_by_controller) )
         domain_unpause(d);
+    else
+        domain_changed(d);
 }
 
 void domain_unpause_by_systemcontroller(struct domain *d)
 {
     if ( test_and_clear_bool(d->is_paused_by_controller) )
+    {
+        domain_changed(d);
         domain_unpause(d);
+    }
+}
+
+void domain_changed(struct domain *d)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&domain_generation_lock, flags);
+    d->generation = ++domain_generation;
+    spin_unlock_irqrestore(&domain_generation_lock, flags);
+}
+
+int domain_changes_op(struct xen_sysctl_domain_changes *op)
+{
+    struct xen_domctl_getdomaininfo info;
+    domid_t gone[DOMAIN_GONE_LOG];
+    unsigned int i, nr_gone = 0, num_domains = 0;
+    unsigned long flags;
+    uint64_t since = op->since, generation;
+    bool_t all;
+    struct domain *d;
+    int rc = 0;
+
+    /*
+     * Anything changing after we take the generation is reported (again)
+     * by the next call, which passes that generation.
+     */
+    spin_lock_irqsave(&domain_generation_lock, flags);
+    generation = domain_generation;
+    all = !since || since < domain_gone_forgotten || since > generation;
+    if ( !all )
+        for ( i = 0; i < DOMAIN_GONE_LOG; i++ )
+            if ( domain_gone[i].generation > since )
+                gone[nr_gone++] = domain_gone[i].domid;
+    spin_unlock_irqrestore(&domain_generation_lock, flags);
+
+    for ( i = 0; i < nr_gone && i < op->max_gone; i++ )
+        if ( copy_to_guest_offset(op->gone, i, &gone[i], 1) )
+            return -EFAULT;
+
+    rcu_read_lock(&domlist_read_lock);
+
+    for_each_domain ( d )
+    {
+        if ( !all && d->generation <= since )
+            continue;
+        if ( xsm_getdomaininfo(XSM_HOOK, d) )
+            continue;
+
+        if ( num_domains < op->max_domains )
+        {
+            getdomaininfo(d, &info);
+            if ( copy_to_guest_offset(op->buffer, num_domains, &info, 1) )
+            {
+                rc = -EFAULT;
+                break;
+            }
+        }
+        num_domains++;
+    }
+
+    rcu_read_unlock(&domlist_read_lock);
+
+    op->generation = generation;
+    op->num_domains = num_domains;
+    op->num_gone = nr_gone;
+    op->flags = all ? XEN_SYSCTL_DOMAIN_CHANGES_all : 0;
+
+    return rc;
 }
 
 int vcpu_reset(struct vcpu *v)
@@ -1297,6 +1408,62 @@ int continue_hypercall_on_cpu(
     return 0;
 }
 
+static void vcpu_perf_accumulate(struct xen_sysctl_domain_perf_data *sum,
+                                 struct vcpu *v, bool_t reset)
+{
+    struct xen_sysctl_domain_perf_data *perf = v->perf;
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(perf->hypercalls); i++ )
+        sum->hypercalls[i] += perf->hypercalls[i];
+    for ( i = 0; i < ARRAY_SIZE(perf->vmexits); i++ )
+        sum->vmexits[i] += perf->vmexits[i];
+    for ( i = 0; i < ARRAY_SIZE(perf->grant_ops); i++ )
+        sum->grant_ops[i] += perf->grant_ops[i];
+    sum->evtchn_sends += perf->evtchn_sends;
+    sum->emulations += perf->emulations;
+
+    /* Racy against a running vCPU: a few events may get lost. */
+    if ( reset )
+        memset(perf, 0, sizeof(*perf));
+}
+
+int domain_perf_op(struct xen_sysctl_domain_perf *op)
+{
+    struct xen_sysctl_domain_perf_data *sum;
+    struct domain *d;
+    struct vcpu *v;
+    int rc = 0;
+
+    if ( (d = rcu_lock_domain_by_id(op->domid)) == NULL )
+        return -ESRCH;
+
+    if ( (sum = xzalloc(struct xen_sysctl_domain_perf_data)) == NULL )
+    {
+        rcu_unlock_domain(d);
+        return -ENOMEM;
+    }
+
+    if ( op->vcpu == XEN_SYSCTL_DOMAIN_PERF_ALL_VCPUS )
+    {
+        for_each_vcpu ( d, v )
+            vcpu_perf_accumulate(sum, v, op->reset);
+    }
+    else if ( op->vcpu < d->max_vcpus && (v = d->vcpu[op->vcpu]) != NULL )
+        vcpu_perf_accumulate(sum, v, op->reset);
+    else
+        rc = -ENOENT;
+
+    rcu_unlock_domain(d);
+
+    if ( !rc && copy_to_guest(op->data, sum, 1) )
+        rc = -EFAULT;
+
+    xfree(sum);
+
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
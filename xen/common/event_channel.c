@@ -97,6 +97,28 @@ static uint8_t get_xen_consumer(xen_event_channel_notification_t fn)
 
 static void evtchn_set_pending(struct vcpu *v, int port);
 
+static void double_evtchn_lock(struct evtchn *lchn, struct evtchn *rchn)
+{
+    if ( lchn < rchn )
+    {
+        spin_lock(&lchn->lock);
+        spin_lock(&rchn->lock);
+    }
+    else
+    {
+        if ( lchn != rchn )
+            spin_lock(&rchn->lock);
+        spin_lock(&lchn->lock);
+    }
+}
+
+static void double_evtchn_unlock(struct evtchn *lchn, struct evtchn *rchn)
+{
+    spin_unlock(&lchn->lock);
+    if ( lchn != rchn )
+        spin_unlock(&rchn->lock);
+}
+
 static int virq_is_global(uint32_t virq)
 {
     int rc;
@@ -141,6 +163,7 @@ static struct evtchn *alloc_evtchn_bucket(struct domain *d, unsigned int port)
             return NULL;
         }
         chn[i].port = port + i;
+        spin_lock_init(&chn[i].lock);
     }
     return chn;
 }
@@ -183,12 +206,15 @@ static int get_free_port(struct domain *d)
         grp = xzalloc_array(struct evtchn *, BUCKETS_PER_GROUP);
         if ( !grp )
             return -ENOMEM;
+        /* port_is_valid() is used without event_lock. */
+        smp_wmb();
         group_from_port(d, port) = grp;
     }
 
     chn = alloc_evtchn_bucket(d, port);
     if ( !chn )
         return -ENOMEM;
+    smp_wmb();
     bucket_from_port(d, port) = chn;
 
     return port;
@@ -217,10 +243,14 @@ static long evtchn_alloc_unbound(evtchn_alloc_unbound_t *alloc)
     if ( rc )
         goto out;
 
+    spin_lock(&chn->lock);
+
     chn->state = ECS_UNBOUND;
     if ( (chn->u.unbound.remote_domid = alloc->remote_dom) == DOMID_SELF )
         chn->u.unbound.remote_domid = current->domain->domain_id;
 
+    spin_unlock(&chn->lock);
+
     alloc->port = port;
 
  out:
@@ -273,6 +303,8 @@ static long evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
     if ( rc )
         goto out;
 
+    double_evtchn_lock(lchn, rchn);
+
     lchn->u.interdomain.remote_dom  = rd;
     lchn->u.interdomain.remote_port = (u16)rport;
     lchn->state                     = ECS_INTERDOMAIN;
@@ -287,6 +319,8 @@ static long evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
      */
     evtchn_set_pending(ld->vcpu[lchn->notify_vcpu_id], lport);
 
+    double_evtchn_unlock(lchn, rchn);
+
     bind->local_port = lport;
 
  out:
@@ -327,10 +361,15 @@ static long evtchn_bind_virq(evtchn_bind_virq_t *bind)
         ERROR_EXIT(port);
 
     chn = evtchn_from_port(d, port);
+
+    spin_lock(&chn->lock);
+
     chn->state          = ECS_VIRQ;
     chn->notify_vcpu_id = vcpu;
     chn->u.virq         = virq;
 
+    spin_unlock(&chn->lock);
+
     v->virq_to_evtchn[virq] = bind->port = port;
 
  out:
@@ -357,9 +396,14 @@ static long evtchn_bind_ipi(evtchn_bind_ipi_t *bind)
         ERROR_EXIT(port);
 
     chn = evtchn_from_port(d, port);
+
+    spin_lock(&chn->lock);
+
     chn->state          = ECS_IPI;
     chn->notify_vcpu_id = vcpu;
 
+    spin_unlock(&chn->lock);
+
     bind->port = port;
 
  out:
@@ -434,10 +478,14 @@ static long evtchn_bind_pirq(evtchn_bind_pirq_t *bind)
         goto out;
     }
 
+    spin_lock(&chn->lock);
+
     chn->state  = ECS_PIRQ;
     chn->u.pirq.irq = pirq;
     link_pirq_port(port, chn, v);
 
+    spin_unlock(&chn->lock);
+
     bind->port = port;
 
 #ifdef CONFIG_X86
@@ -456,7 +504,7 @@ static long __evtchn_close(struct domain *d1, int port1)
 {
     struct domain *d2 = NULL;
     struct vcpu   *v;
-    struct evtchn *chn1, *chn2;
+    struct evtchn *chn1, *chn2 = NULL;
     int            port2;
     long           rc = 0;
 
@@ -557,9 +605,6 @@ static long __evtchn_close(struct domain *d1, int port1)
         chn2 = evtchn_from_port(d2, port2);
         BUG_ON(chn2->state != ECS_INTERDOMAIN);
         BUG_ON(chn2->u.interdomain.remote_dom != d1);
-
-        chn2->state = ECS_UNBOUND;
-        chn2->u.unbound.remote_domid = d1->domain_id;
         break;
 
     default:
@@ -569,10 +614,24 @@ static long __evtchn_close(struct domain *d1, int port1)
     /* Clear pending event to avoid unexpected behavior on re-bind. */
     evtchn_port_clear_pending(d1, chn1);
 
+    if ( chn2 )
+    {
+        double_evtchn_lock(chn1, chn2);
+        chn2->state = ECS_UNBOUND;
+        chn2->u.unbound.remote_domid = d1->domain_id;
+    }
+    else
+        spin_lock(&chn1->lock);
+
     /* Reset binding to vcpu0 when the channel is freed. */
     chn1->state          = ECS_FREE;
     chn1->notify_vcpu_id = 0;
 
+    if ( chn2 )
+        double_evtchn_unlock(chn1, chn2);
+    else
+        spin_unlock(&chn1->lock);
+
     xsm_evtchn_close_post(chn1);
 
  out:
@@ -601,20 +660,21 @@ int evtchn_send(struct domain *d, unsigned int lport)
     struct vcpu   *rvcpu;
     int            rport, ret = 0;
 
-    spin_lock(&ld->event_lock);
-
     if ( unlikely(!port_is_valid(ld, lport)) )
-    {
-        spin_unlock(&ld->event_lock);
         return -EINVAL;
-    }
 
     lchn = evtchn_from_port(ld, lport);
 
+    /*
+     * The channel lock keeps lchn (and hence, for an interdomain channel,
+     * the remote end) bound; event_lock isn't needed.
+     */
+    spin_lock(&lchn->lock);
+
     /* Guest cannot send via a Xen-attached event channel. */
     if ( unlikely(consumer_is_xen(lchn)) )
     {
-        spin_unlock(&ld->event_lock);
+        spin_unlock(&lchn->lock);
         return -EINVAL;
     }
 
@@ -645,7 +705,7 @@ int evtchn_send(struct domain *d, unsigned int lport)
     }
 
 out:
-    spin_unlock(&ld->event_lock);
+    spin_unlock(&lchn->lock);
 
     return ret;
 }
@@ -960,6 +1020,90 @@ out:
     return rc;
 }
 
+/*
+ * vCPUs to kick at the end of the EVTCHNOP_multi running on this CPU, so
+ * that a batch targeting several ports on one vCPU raises a single upcall.
+ */
+struct evtchn_kick_batch {
+    bool_t active;
+    unsigned int nr;
+    struct vcpu *vcpu[EVTCHN_MULTI_MAX_PORTS];
+};
+static DEFINE_PER_CPU(struct evtchn_kick_batch, evtchn_kick_batch);
+
+void evtchn_kick_vcpu(struct vcpu *v)
+{
+    struct evtchn_kick_batch *batch = &this_cpu(evtchn_kick_batch);
+    unsigned int i;
+
+    /* Deliveries from interrupt context aren't part of the batch. */
+    if ( !batch->active || in_irq() )
+    {
+        vcpu_mark_events_pending(v);
+        return;
+    }
+
+    for ( i = 0; i < batch->nr; i++ )
+        if ( batch->vcpu[i] == v )
+            return;
+
+    if ( batch->nr < ARRAY_SIZE(batch->vcpu) )
+        batch->vcpu[batch->nr++] = v;
+    else
+        vcpu_mark_events_pending(v);
+}
+
+static long evtchn_multi(struct evtchn_multi *multi)
+{
+    struct domain *d = current->domain;
+    struct evtchn_kick_batch *batch = &this_cpu(evtchn_kick_batch);
+    unsigned int i;
+    long rc = 0;
+
+    if ( multi->nr_ports > EVTCHN_MULTI_MAX_PORTS )
+        return -EINVAL;
+
+    switch ( multi->op )
+    {
+    case EVTCHN_MULTI_send:
+        break;
+    case EVTCHN_MULTI_unmask:
+        spin_lock(&d->event_lock);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    /* Keeps the deferred vCPUs' domains around until they are kicked. */
+    rcu_read_lock(&domlist_read_lock);
+
+    ASSERT(!batch->active);
+    batch->active = 1;
+    batch->nr = 0;
+
+    for ( i = 0; i < multi->nr_ports; i++ )
+    {
+        if ( multi->op == EVTCHN_MULTI_send )
+            rc = evtchn_send(d, multi->ports[i]);
+        else
+            rc = evtchn_unmask(multi->ports[i]);
+        if ( rc )
+            break;
+    }
+    multi->nr_done = i;
+
+    batch->active = 0;
+    for ( i = 0; i < batch->nr; i++ )
+        vcpu_mark_events_pending(batch->vcpu[i]);
+
+    rcu_read_unlock(&domlist_read_lock);
+
+    if ( multi->op == EVTCHN_MULTI_unmask )
+        spin_unlock(&d->event_lock);
+
+    return rc;
+}
+
 static long evtchn_set_priority(const struct evtchn_set_priority *set_priority)
 {
     struct domain *d = current->domain;
@@ -1050,6 +1194,7 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         struct evtchn_send send;
         if ( copy_from_guest(&send, arg, 1) != 0 )
             return -EFAULT;
+        vcpu_perf_incr(evtchn_sends);
         rc = evtchn_send(current->domain, send.port);
         break;
     }
@@ -1116,6 +1261,16 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_multi: {
+        struct evtchn_multi multi;
+        if ( copy_from_guest(&multi, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_multi(&multi);
+        if ( __copy_to_guest(arg, &multi, 1) )
+            rc = -EFAULT;
+        break;
+    }
+
     default:
         rc = -ENOSYS;
         break;
@@ -1141,11 +1296,15 @@ int alloc_unbound_xen_event_channel(
 
     rc = xsm_evtchn_unbound(XSM_TARGET, d, chn, remote_domid);
 
+    spin_lock(&chn->lock);
+
     chn->state = ECS_UNBOUND;
     chn->xen_consumer = get_xen_consumer(notification_fn);
     chn->notify_vcpu_id = local_vcpu->vcpu_id;
     chn->u.unbound.remote_domid = !rc ? remote_domid : DOMID_INVALID;
 
+    spin_unlock(&chn->lock);
+
  out:
     spin_unlock(&d->event_lock);
 
@@ -1184,16 +1343,15 @@ void notify_via_xen_event_channel(struct domain *ld, int lport)
     struct domain *rd;
     int            rport;
 
-    spin_lock(&ld->event_lock);
-
+    /* Buckets are only freed by evtchn_destroy_final(). */
     if ( unlikely(ld->is_dying) )
-    {
-        spin_unlock(&ld->event_lock);
         return;
-    }
 
     ASSERT(port_is_valid(ld, lport));
     lchn = evtchn_from_port(ld, lport);
+
+    spin_lock(&lchn->lock);
+
     ASSERT(consumer_is_xen(lchn));
 
     if ( likely(lchn->state == ECS_INTERDOMAIN) )
@@ -1204,7 +1362,7 @@ void notify_via_xen_event_channel(struct domain *ld, int lport)
         evtchn_set_pending(rd->vcpu[rchn->notify_vcpu_id], rport);
     }
 
-    spin_unlock(&ld->event_lock);
+    spin_unlock(&lchn->lock);
 }
 
 void evtchn_check_pollers(struct domain *d, unsigned int port)
@@ -1264,7 +1422,7 @@ int evtchn_init(struct domain *d)
 
 void evtchn_destroy(struct domain *d)
 {
-    unsigned int i, j;
+    unsigned int i;
 
     /* After this barrier no new event-channel allocations can occur. */
     BUG_ON(!d->is_dying);
@@ -1277,8 +1435,21 @@ void evtchn_destroy(struct domain *d)
         (void)__evtchn_close(d, i);
     }
 
-    /* Free all event-channel buckets. */
-    spin_lock(&d->event_lock);
+    clear_global_virq_handlers(d);
+
+    evtchn_fifo_destroy(d);
+}
+
+
+void evtchn_destroy_final(struct domain *d)
+{
+    unsigned int i, j;
+
+    /*
+     * Free all event-channel buckets.  This is deferred to here as senders
+     * holding just a channel lock may still be looking at them until the
+     * domain is finally destroyed.
+     */
     for ( i = 0; i < NR_EVTCHN_GROUPS; i++ )
     {
         if ( !d->evtchn_group[i] )
@@ -1290,16 +1461,7 @@ void evtchn_destroy(struct domain *d)
     }
     free_evtchn_bucket(d, d->evtchn);
     d->evtchn = NULL;
-    spin_unlock(&d->event_lock);
 
-    clear_global_virq_handlers(d);
-
-    evtchn_fifo_destroy(d);
-}
-
-
-void evtchn_destroy_final(struct domain *d)
-{
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     xfree(d->poll_mask);
     d->poll_mask = NULL;
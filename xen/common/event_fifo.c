@@ -115,7 +115,7 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
 
         if ( !test_and_set_bit(q->priority,
                                &v->evtchn_fifo->control_block->ready) )
-            vcpu_mark_events_pending(v);
+            evtchn_kick_vcpu(v);
     }
 
     if ( !was_pending )
@@ -50,7 +50,7 @@ void handle_keypress(unsigned char key, struct cpu_user_regs *regs)
     else
     {
         keypress_key = key;
-        tasklet_schedule(&keypress_tasklet);
+        tasklet_schedule_unbound(&keypress_tasklet);
     }
 }
 
@@ -492,7 +492,7 @@ static void run_all_keyhandlers(unsigned char key, struct cpu_user_regs *regs)
     watchdog_enable();
 
     /* Trigger the others from a tasklet in non-IRQ context */
-    tasklet_schedule(&run_all_keyhandlers_tasklet);
+    tasklet_schedule_unbound(&run_all_keyhandlers_tasklet);
 }
 
 static struct keyhandler run_all_keyhandlers_keyhandler = {
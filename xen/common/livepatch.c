@@ -0,0 +1,742 @@
+/******************************************************************************
+ * livepatch.c
+ *
+ * Replacing functions of the running hypervisor, without a reboot.
+ *
+ * A payload is an ELF relocatable object.  It is loaded into memory close
+ * to the hypervisor's text, linked against the hypervisor's symbol table,
+ * and lists in its .livepatch.funcs section the functions it replaces.
+ * Applying it writes a jump to the replacement over the start of each of
+ * them, with all CPUs stopped; reverting puts the original bytes back.
+ *
+ * The old code stays in place: a CPU returning into the middle of a patched
+ * function carries on in the old version, and only new calls are diverted.
+ */
+
+#include <xen/config.h>
+#include <xen/types.h>
+#include <xen/lib.h>
+#include <xen/errno.h>
+#include <xen/list.h>
+#include <xen/mm.h>
+#include <xen/sched.h>
+#include <xen/smp.h>
+#include <xen/stop_machine.h>
+#include <xen/symbols.h>
+#include <xen/version.h>
+#include <xen/xmalloc.h>
+#include <xen/guest_access.h>
+#include <xen/livepatch.h>
+
+/* Uploads must have debug information stripped. */
+#define LIVEPATCH_MAX_SIZE MB(2)
+
+#define LIVEPATCH_FUNCS_SECTION   ".livepatch.funcs"
+#define LIVEPATCH_DEPENDS_SECTION ".livepatch.depends"
+
+struct payload {
+    struct list_head list;
+    char name[XEN_LIVEPATCH_NAME_SIZE];
+    unsigned int state;             /* XEN_LIVEPATCH_STATE_* */
+    int rc;                         /* Of the last action. */
+    void *mem;                      /* The loaded sections. */
+    unsigned int pages;
+    struct livepatch_func *funcs;
+    unsigned int nfuncs;
+};
+
+/* Operations are serialised by do_sysctl()'s sysctl_lock. */
+static LIST_HEAD(payload_list);
+static unsigned int payload_cnt;
+
+/* An uploaded ELF object, while it is being loaded. */
+struct livepatch_elf {
+    const char *data;
+    size_t size;
+    const Elf64_Ehdr *hdr;
+    const Elf64_Shdr *sec;
+    unsigned int nsec;
+    const char *secstr;
+    size_t secstr_size;
+    unsigned int symtab_idx;
+    const Elf64_Sym *sym;
+    unsigned int nsym;
+    const char *symstr;
+    size_t symstr_size;
+    unsigned long *addr;            /* Of each section, 0 if not loaded. */
+    unsigned long *symval;          /* Of each symbol. */
+};
+
+static const char *elf_sec_name(const struct livepatch_elf *elf,
+                                const Elf64_Shdr *sec)
+{
+    return sec->sh_name < elf->secstr_size ? elf->secstr + sec->sh_name
+                                           : NULL;
+}
+
+static const Elf64_Shdr *elf_sec_by_name(const struct livepatch_elf *elf,
+                                         const char *name)
+{
+    unsigned int i;
+
+    for ( i = 1; i < elf->nsec; i++ )
+    {
+        const char *n = elf_sec_name(elf, &elf->sec[i]);
+
+        if ( n && !strcmp(n, name) )
+            return &elf->sec[i];
+    }
+
+    return NULL;
+}
+
+/* A section holding strings must end with the last one's NUL. */
+static int elf_strtab_ok(const struct livepatch_elf *elf,
+                         const Elf64_Shdr *sec)
+{
+    return sec->sh_type == SHT_STRTAB && sec->sh_size &&
+           elf->data[sec->sh_offset + sec->sh_size - 1] == '\0';
+}
+
+static int livepatch_elf_init(struct livepatch_elf *elf)
+{
+    const Elf64_Ehdr *hdr = (const Elf64_Ehdr *)elf->data;
+    const Elf64_Shdr *sec;
+    unsigned int i;
+    int rc;
+
+    if ( elf->size < sizeof(*hdr) || !IS_ELF(*hdr) ||
+         hdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+         hdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+         hdr->e_type != ET_REL )
+        return -EINVAL;
+
+    rc = arch_livepatch_verify_elf(hdr);
+    if ( rc )
+        return rc;
+
+    if ( hdr->e_shentsize != sizeof(*sec) || !hdr->e_shnum ||
+         hdr->e_shoff > elf->size ||
+         (elf->size - hdr->e_shoff) / sizeof(*sec) < hdr->e_shnum ||
+         hdr->e_shstrndx == SHN_UNDEF || hdr->e_shstrndx >= hdr->e_shnum )
+        return -EINVAL;
+
+    elf->hdr = hdr;
+    elf->sec = (const Elf64_Shdr *)(elf->data + hdr->e_shoff);
+    elf->nsec = hdr->e_shnum;
+
+    for ( i = 0; i < elf->nsec; i++ )
+    {
+        sec = &elf->sec[i];
+        if ( sec->sh_type != SHT_NOBITS &&
+             (sec->sh_offset > elf->size ||
+              sec->sh_size > elf->size - sec->sh_offset) )
+            return -EINVAL;
+    }
+
+    sec = &elf->sec[hdr->e_shstrndx];
+    if ( !elf_strtab_ok(elf, sec) )
+        return -EINVAL;
+    elf->secstr = elf->data + sec->sh_offset;
+    elf->secstr_size = sec->sh_size;
+
+    for ( i = 1; i < elf->nsec; i++ )
+    {
+        if ( elf->sec[i].sh_type != SHT_SYMTAB )
+            continue;
+        if ( elf->symtab_idx )
+            return -EINVAL;
+        elf->symtab_idx = i;
+    }
+    if ( !elf->symtab_idx )
+        return -EINVAL;
+
+    sec = &elf->sec[elf->symtab_idx];
+    if ( sec->sh_entsize != sizeof(*elf->sym) ||
+         sec->sh_size % sizeof(*elf->sym) ||
+         sec->sh_link == SHN_UNDEF || sec->sh_link >= elf->nsec ||
+         !elf_strtab_ok(elf, &elf->sec[sec->sh_link]) )
+        return -EINVAL;
+    elf->sym = (const Elf64_Sym *)(elf->data + sec->sh_offset);
+    elf->nsym = sec->sh_size / sizeof(*elf->sym);
+    elf->symstr = elf->data + elf->sec[sec->sh_link].sh_offset;
+    elf->symstr_size = elf->sec[sec->sh_link].sh_size;
+
+    elf->addr = xzalloc_array(unsigned long, elf->nsec);
+    elf->symval = xzalloc_array(unsigned long, elf->nsym);
+    if ( !elf->addr || !elf->symval )
+        return -ENOMEM;
+
+    return 0;
+}
+
+/* Lay out and copy in the allocated sections. */
+static int livepatch_elf_load(struct payload *payload,
+                              struct livepatch_elf *elf)
+{
+    unsigned long size = 0;
+    unsigned int i;
+
+    for ( i = 1; i < elf->nsec; i++ )
+    {
+        const Elf64_Shdr *sec = &elf->sec[i];
+        unsigned long align = sec->sh_addralign ?: 1;
+
+        if ( !(sec->sh_flags & SHF_ALLOC) || !sec->sh_size )
+            continue;
+        if ( align > PAGE_SIZE || (align & (align - 1)) ||
+             sec->sh_size > LIVEPATCH_MAX_SIZE )
+            return -EINVAL;
+
+        size = ROUNDUP(size, align);
+        elf->addr[i] = size;
+        size += sec->sh_size;
+        if ( size > LIVEPATCH_MAX_SIZE )
+            return -E2BIG;
+    }
+
+    if ( !size )
+        return -EINVAL;
+
+    payload->pages = PFN_UP(size);
+    payload->mem = arch_livepatch_alloc(payload->pages);
+    if ( !payload->mem )
+        return -ENOMEM;
+
+    for ( i = 1; i < elf->nsec; i++ )
+    {
+        const Elf64_Shdr *sec = &elf->sec[i];
+
+        if ( !(sec->sh_flags & SHF_ALLOC) || !sec->sh_size )
+            continue;
+
+        elf->addr[i] += (unsigned long)payload->mem;
+        if ( sec->sh_type != SHT_NOBITS )
+            memcpy((void *)elf->addr[i], elf->data + sec->sh_offset,
+                   sec->sh_size);
+    }
+
+    return 0;
+}
+
+/* Undefined symbols are looked up in the hypervisor. */
+static int livepatch_elf_resolve(const struct payload *payload,
+                                 struct livepatch_elf *elf)
+{
+    unsigned int i;
+    int rc;
+
+    for ( i = 1; i < elf->nsym; i++ )
+    {
+        const Elf64_Sym *sym = &elf->sym[i];
+        const char *name;
+
+        if ( sym->st_name >= elf->symstr_size )
+            return -EINVAL;
+        name = elf->symstr + sym->st_name;
+
+        switch ( sym->st_shndx )
+        {
+        case SHN_UNDEF:
+            rc = symbols_lookup_by_name(name, &elf->symval[i]);
+            if ( rc )
+            {
+                printk(XENLOG_ERR "livepatch: %s: %s symbol '%s'\n",
+                       payload->name, rc == -EEXIST ? "ambiguous" : "unknown",
+                       name);
+                return rc;
+            }
+            break;
+
+        case SHN_ABS:
+            elf->symval[i] = sym->st_value;
+            break;
+
+        case SHN_COMMON:
+            printk(XENLOG_ERR "livepatch: %s: common symbol '%s'\n",
+                   payload->name, name);
+            return -EOPNOTSUPP;
+
+        default:
+            if ( sym->st_shndx >= elf->nsec )
+                return -EINVAL;
+            /* Symbols in sections which aren't loaded are left as 0. */
+            if ( elf->addr[sym->st_shndx] )
+            {
+                if ( sym->st_value > elf->sec[sym->st_shndx].sh_size )
+                    return -EINVAL;
+                elf->symval[i] = elf->addr[sym->st_shndx] + sym->st_value;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int livepatch_elf_relocate(const struct payload *payload,
+                                  const struct livepatch_elf *elf)
+{
+    unsigned int i, j;
+    int rc;
+
+    for ( i = 1; i < elf->nsec; i++ )
+    {
+        const Elf64_Shdr *sec = &elf->sec[i];
+        const Elf64_Shdr *dst;
+        const Elf64_Rela *rela;
+
+        if ( sec->sh_type != SHT_RELA && sec->sh_type != SHT_REL )
+            continue;
+        if ( sec->sh_info >= elf->nsec )
+            return -EINVAL;
+        /* Relocations of debug information, say. */
+        if ( !elf->addr[sec->sh_info] )
+            continue;
+        if ( sec->sh_type == SHT_REL || sec->sh_link != elf->symtab_idx ||
+             sec->sh_entsize != sizeof(*rela) ||
+             sec->sh_size % sizeof(*rela) )
+            return -EOPNOTSUPP;
+
+        dst = &elf->sec[sec->sh_info];
+        rela = (const Elf64_Rela *)(elf->data + sec->sh_offset);
+        for ( j = 0; j < sec->sh_size / sizeof(*rela); j++, rela++ )
+        {
+            unsigned long symndx = ELF64_R_SYM(rela->r_info);
+            unsigned int shndx;
+
+            if ( symndx >= elf->nsym || rela->r_offset >= dst->sh_size )
+                return -EINVAL;
+            shndx = elf->sym[symndx].st_shndx;
+            if ( shndx != SHN_UNDEF && shndx < elf->nsec && !elf->addr[shndx] )
+                return -EINVAL;
+
+            rc = arch_livepatch_relocate(ELF64_R_TYPE(rela->r_info),
+                                         (void *)(elf->addr[sec->sh_info] +
+                                                  rela->r_offset),
+                                         dst->sh_size - rela->r_offset,
+                                         elf->symval[symndx] +
+                                         rela->r_addend);
+            if ( rc )
+            {
+                printk(XENLOG_ERR "livepatch: %s: relocation %u of %s: %d\n",
+                       payload->name, j, elf_sec_name(elf, dst) ?: "?", rc);
+                return rc;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * A payload is only good for the build it was made from, so must name it
+ * as "<changeset> <compile date>" in its .livepatch.depends section.
+ */
+static int livepatch_check_depends(const struct payload *payload,
+                                   const struct livepatch_elf *elf)
+{
+    const Elf64_Shdr *sec = elf_sec_by_name(elf, LIVEPATCH_DEPENDS_SECTION);
+    char build[128];
+
+    snprintf(build, sizeof(build), "%s %s",
+             xen_changeset(), xen_compile_date());
+
+    if ( !sec || sec->sh_type == SHT_NOBITS ||
+         strnlen(elf->data + sec->sh_offset, sec->sh_size) != strlen(build) ||
+         memcmp(elf->data + sec->sh_offset, build, strlen(build)) )
+    {
+        printk(XENLOG_ERR "livepatch: %s: not built for this hypervisor\n",
+               payload->name);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Bytes from @p to the end of the payload, or 0 if it's outside it. */
+static unsigned long payload_room(const struct payload *payload, const void *p)
+{
+    const char *start = payload->mem, *end = start + payload->pages * PAGE_SIZE;
+
+    return (const char *)p >= start && (const char *)p < end
+           ? end - (const char *)p : 0;
+}
+
+static int livepatch_find_funcs(struct payload *payload,
+                                const struct livepatch_elf *elf)
+{
+    const Elf64_Shdr *sec = elf_sec_by_name(elf, LIVEPATCH_FUNCS_SECTION);
+    char namebuf[KSYM_NAME_LEN + 1];
+    unsigned int i, j;
+    int rc;
+
+    BUILD_BUG_ON(sizeof(struct livepatch_func) != 64);
+
+    if ( !sec || !(sec->sh_flags & SHF_ALLOC) || !sec->sh_size ||
+         sec->sh_size % sizeof(*payload->funcs) )
+    {
+        printk(XENLOG_ERR "livepatch: %s: bad or no %s section\n",
+               payload->name, LIVEPATCH_FUNCS_SECTION);
+        return -EINVAL;
+    }
+
+    payload->funcs = (void *)elf->addr[sec - elf->sec];
+    payload->nfuncs = sec->sh_size / sizeof(*payload->funcs);
+
+    for ( i = 0; i < payload->nfuncs; i++ )
+    {
+        struct livepatch_func *f = &payload->funcs[i];
+        unsigned long addr, size, offset;
+        const char *name = f->name;
+
+        if ( f->version != LIVEPATCH_PAYLOAD_VERSION ||
+             !payload_room(payload, name) ||
+             strnlen(name, payload_room(payload, name)) ==
+             payload_room(payload, name) ||
+             !f->new_size || f->new_size > payload_room(payload, f->new_addr) )
+            return -EINVAL;
+
+        if ( !f->old_addr )
+        {
+            rc = symbols_lookup_by_name(name, &addr);
+            if ( rc )
+            {
+                printk(XENLOG_ERR "livepatch: %s: %s function '%s'\n",
+                       payload->name, rc == -EEXIST ? "ambiguous" : "unknown",
+                       name);
+                return rc;
+            }
+            f->old_addr = (void *)addr;
+        }
+
+        if ( !f->old_size )
+        {
+            if ( !symbols_lookup((unsigned long)f->old_addr, &size, &offset,
+                                 namebuf) || offset )
+                return -EINVAL;
+            f->old_size = size;
+        }
+
+        if ( !is_kernel_text(f->old_addr) ||
+             !is_kernel_text((char *)f->old_addr + f->old_size - 1) )
+        {
+            printk(XENLOG_ERR "livepatch: %s: '%s' is not in .text\n",
+                   payload->name, name);
+            return -EINVAL;
+        }
+
+        rc = arch_livepatch_verify_func(f);
+        if ( rc )
+            return rc;
+
+        for ( j = 0; j < i; j++ )
+            if ( payload->funcs[j].old_addr == f->old_addr )
+                return -EEXIST;
+    }
+
+    return 0;
+}
+
+static void free_payload(struct payload *payload)
+{
+    if ( payload->mem )
+        arch_livepatch_free(payload->mem, payload->pages);
+    xfree(payload);
+}
+
+static int load_payload(struct payload *payload, const char *data,
+                        size_t size)
+{
+    struct livepatch_elf elf = { .data = data, .size = size };
+    int rc;
+
+    rc = livepatch_elf_init(&elf);
+    if ( !rc )
+        rc = livepatch_elf_load(payload, &elf);
+    if ( !rc )
+        rc = livepatch_check_depends(payload, &elf);
+    if ( !rc )
+        rc = livepatch_elf_resolve(payload, &elf);
+    if ( !rc )
+        rc = livepatch_elf_relocate(payload, &elf);
+    if ( !rc )
+        rc = livepatch_find_funcs(payload, &elf);
+
+    xfree(elf.symval);
+    xfree(elf.addr);
+
+    return rc;
+}
+
+static struct payload *find_payload(const char *name)
+{
+    struct payload *payload;
+
+    list_for_each_entry ( payload, &payload_list, list )
+        if ( !strcmp(payload->name, name) )
+            return payload;
+
+    return NULL;
+}
+
+static int livepatch_upload(struct xen_sysctl_livepatch_op *op)
+{
+    struct payload *payload;
+    uint8_t *data;
+    int rc;
+
+    if ( find_payload(op->name) )
+        return -EEXIST;
+    if ( !op->u.upload.size || op->u.upload.size > LIVEPATCH_MAX_SIZE )
+        return -E2BIG;
+
+    payload = xzalloc(struct payload);
+    data = xmalloc_bytes(op->u.upload.size);
+    if ( !payload || !data )
+    {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    rc = -EFAULT;
+    if ( copy_from_guest(data, op->u.upload.payload, op->u.upload.size) )
+        goto out;
+
+    strlcpy(payload->name, op->name, sizeof(payload->name));
+    rc = load_payload(payload, (const char *)data, op->u.upload.size);
+    if ( rc )
+        goto out;
+
+    payload->state = XEN_LIVEPATCH_STATE_CHECKED;
+    list_add_tail(&payload->list, &payload_list);
+    payload_cnt++;
+    printk(XENLOG_INFO "livepatch: %s: loaded, %u function(s) at %p\n",
+           payload->name, payload->nfuncs, payload->mem);
+    payload = NULL;
+
+ out:
+    xfree(data);
+    if ( payload )
+        free_payload(payload);
+    return rc;
+}
+
+/* A switch in progress: set by livepatch_switch(), until it is done. */
+static struct {
+    struct payload *payload;
+    bool_t apply;
+    unsigned int cpu;
+    bool_t done;
+} livepatch_work;
+
+/* Run on every CPU, with interrupts off. */
+static int livepatch_quiesce_fn(void *unused)
+{
+    struct payload *payload = livepatch_work.payload;
+    unsigned int i;
+
+    if ( smp_processor_id() == livepatch_work.cpu )
+    {
+        for ( i = 0; i < payload->nfuncs; i++ )
+            if ( livepatch_work.apply )
+                arch_livepatch_apply(&payload->funcs[i]);
+            else
+                arch_livepatch_revert(&payload->funcs[i]);
+        smp_wmb();
+        livepatch_work.done = 1;
+    }
+    else
+        while ( !read_atomic(&livepatch_work.done) )
+            cpu_relax();
+
+    arch_livepatch_sync();
+
+    return 0;
+}
+
+static long livepatch_switch_helper(void *data)
+{
+    struct payload *payload = data;
+    bool_t apply = livepatch_work.apply;
+    int rc;
+
+    livepatch_work.cpu = smp_processor_id();
+    livepatch_work.done = 0;
+
+    rc = stop_machine_run(livepatch_quiesce_fn, NULL, NR_CPUS);
+    if ( !rc )
+        payload->state = apply ? XEN_LIVEPATCH_STATE_APPLIED
+                               : XEN_LIVEPATCH_STATE_CHECKED;
+    payload->rc = rc;
+    printk(XENLOG_INFO "livepatch: %s: %s: %d\n", payload->name,
+           apply ? "apply" : "revert", rc);
+
+    smp_wmb();
+    livepatch_work.payload = NULL;
+
+    return rc;
+}
+
+/*
+ * The machine mustn't be stopped with sysctl_lock held, so the switch is
+ * made once the sysctl has dropped it, with its result going to the caller.
+ * Until then, other operations which might change payloads fail.
+ */
+static int livepatch_switch(struct payload *payload, bool_t apply)
+{
+    int rc;
+
+    livepatch_work.payload = payload;
+    livepatch_work.apply = apply;
+
+    rc = continue_hypercall_on_cpu(smp_processor_id(),
+                                   livepatch_switch_helper, payload);
+    if ( rc )
+        livepatch_work.payload = NULL;
+
+    return rc;
+}
+
+static int livepatch_apply(struct payload *payload)
+{
+    const struct payload *other;
+    unsigned int i, j;
+
+    if ( payload->state != XEN_LIVEPATCH_STATE_CHECKED )
+        return -EINVAL;
+
+    list_for_each_entry ( other, &payload_list, list )
+    {
+        if ( other->state != XEN_LIVEPATCH_STATE_APPLIED )
+            continue;
+        for ( i = 0; i < payload->nfuncs; i++ )
+            for ( j = 0; j < other->nfuncs; j++ )
+                if ( payload->funcs[i].old_addr == other->funcs[j].old_addr )
+                {
+                    printk(XENLOG_ERR "livepatch: %s: '%s' is patched by %s\n",
+                           payload->name, payload->funcs[i].name, other->name);
+                    return -EBUSY;
+                }
+    }
+
+    return livepatch_switch(payload, 1);
+}
+
+static int livepatch_action(struct xen_sysctl_livepatch_op *op)
+{
+    struct payload *payload = find_payload(op->name);
+
+    if ( !payload )
+        return -ENOENT;
+
+    switch ( op->u.action.action )
+    {
+    case XEN_LIVEPATCH_ACTION_apply:
+        return livepatch_apply(payload);
+
+    case XEN_LIVEPATCH_ACTION_revert:
+        if ( payload->state != XEN_LIVEPATCH_STATE_APPLIED )
+            return -EINVAL;
+        return livepatch_switch(payload, 0);
+
+    case XEN_LIVEPATCH_ACTION_unload:
+        if ( payload->state != XEN_LIVEPATCH_STATE_CHECKED )
+            return -EBUSY;
+        list_del(&payload->list);
+        payload_cnt--;
+        printk(XENLOG_INFO "livepatch: %s: unloaded\n", payload->name);
+        free_payload(payload);
+        return 0;
+
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static int livepatch_list(struct xen_sysctl_livepatch_op *op)
+{
+    const struct payload *payload;
+    struct xen_livepatch_status status;
+    unsigned int idx = 0, nr = 0;
+
+    list_for_each_entry ( payload, &payload_list, list )
+    {
+        if ( nr == op->u.list.nr )
+            break;
+        if ( idx++ < op->u.list.idx )
+            continue;
+
+        memset(&status, 0, sizeof(status));
+        strlcpy(status.name, payload->name, sizeof(status.name));
+        status.state = payload->state;
+        status.rc = payload->rc;
+        if ( copy_to_guest_offset(op->u.list.status, nr, &status, 1) )
+            return -EFAULT;
+        nr++;
+    }
+
+    op->u.list.nr = nr;
+    op->u.list.total = payload_cnt;
+
+    return 0;
+}
+
+int livepatch_op(struct xen_sysctl_livepatch_op *op)
+{
+    const struct payload *payload;
+    int rc;
+
+    if ( op->cmd != XEN_SYSCTL_LIVEPATCH_list &&
+         (!op->name[0] ||
+          strnlen(op->name, sizeof(op->name)) == sizeof(op->name)) )
+        return -EINVAL;
+
+    /* Only look while a switch is in progress. */
+    if ( livepatch_work.payload &&
+         op->cmd != XEN_SYSCTL_LIVEPATCH_get &&
+         op->cmd != XEN_SYSCTL_LIVEPATCH_list )
+        return -EBUSY;
+
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_LIVEPATCH_upload:
+        rc = livepatch_upload(op);
+        break;
+
+    case XEN_SYSCTL_LIVEPATCH_get:
+        rc = -ENOENT;
+        payload = find_payload(op->name);
+        if ( payload )
+        {
+            op->u.get.state = payload->state;
+            op->u.get.rc = payload->rc;
+            rc = 0;
+        }
+        break;
+
+    case XEN_SYSCTL_LIVEPATCH_list:
+        rc = livepatch_list(op);
+        break;
+
+    case XEN_SYSCTL_LIVEPATCH_action:
+        rc = livepatch_action(op);
+        break;
+
+    default:
+        rc = -EOPNOTSUPP;
+        break;
+    }
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,229 @@
+/*
+ * lz4.c -- LZ4 compressor, and a bounds checked decompressor, for
+ * runtime (tmem) use.  The boot time image decompressor is unlz4.c.
+ *
+ * Based on the LZ4 implementation by Yann Collet.
+ *
+ * LZ4 - Fast LZ compression algorithm
+ * Copyright (C) 2011-2012, Yann Collet.
+ * BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <xen/config.h>
+#include <xen/types.h>
+#include <xen/string.h>
+#include <xen/lz4.h>
+
+#define INIT
+
+#ifndef CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+#define get_unaligned(p) ({                                   \
+	typeof(*(p)) v_;                                      \
+	__builtin_memcpy(&v_, p, sizeof(v_));                 \
+	v_;                                                   \
+})
+#define put_unaligned(v, p) do {                              \
+	typeof(*(p)) v_ = (v);                                \
+	__builtin_memcpy(p, &v_, sizeof(v_));                 \
+} while (0)
+#endif
+
+#define LZ4_DECOMPRESS_SAFE
+#include "lz4/decompress.c"
+
+static inline u32 lz4_read32(const u8 *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#define LZ4_HASH64K(p)	((lz4_read32(p) * 2654435761U) >> \
+			 ((MINMATCH * 8) - HASHLOG64K))
+
+/*
+ * Only the "64k" flavour of the compressor is provided: all positions fit
+ * in 16 bits, which keeps the hash table small.  That is plenty for the
+ * page sized buffers it is used on.
+ */
+static int lz4_compress64k(const u8 *src, size_t isize, u8 *dst,
+			   size_t osize, u16 *table)
+{
+	const u8 *ip = src, *anchor = src, *ref;
+	const u8 *const iend = src + isize;
+	const u8 *const mflimit = iend - MFLIMIT;
+	const u8 *const matchlimit = iend - LASTLITERALS;
+	u8 *op = dst, *token;
+	u8 *const oend = dst + osize;
+	size_t len, lastrun;
+	u32 forwardh;
+
+	if (isize < MINLENGTH)
+		goto last_literals;
+
+	memset(table, 0, HASH64KTABLESIZE * sizeof(*table));
+
+	/* first byte */
+	ip++;
+	forwardh = LZ4_HASH64K(ip);
+
+	for (;;) {
+		int findmatchattempts = (1U << SKIPSTRENGTH) + 3;
+		const u8 *forwardip = ip;
+		int step;
+
+		/* find a match */
+		do {
+			u32 h = forwardh;
+
+			step = findmatchattempts++ >> SKIPSTRENGTH;
+			ip = forwardip;
+			forwardip = ip + step;
+			if (unlikely(forwardip > mflimit))
+				goto last_literals;
+			forwardh = LZ4_HASH64K(forwardip);
+			ref = src + table[h];
+			table[h] = ip - src;
+		} while (lz4_read32(ref) != lz4_read32(ip));
+
+		/* catch up */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* encode literal length */
+		len = ip - anchor;
+		token = op++;
+		if (unlikely(op + len + (2 + 1 + LASTLITERALS) + (len >> 8) >
+			     oend))
+			return -1;
+		if (len >= RUN_MASK) {
+			size_t l = len - RUN_MASK;
+
+			*token = RUN_MASK << ML_BITS;
+			for (; l > 254; l -= 255)
+				*op++ = 255;
+			*op++ = l;
+		} else
+			*token = len << ML_BITS;
+
+		/* copy literals */
+		memcpy(op, anchor, len);
+		op += len;
+
+next_match:
+		/* encode offset */
+		*op++ = (u8)(ip - ref);
+		*op++ = (u8)((ip - ref) >> 8);
+
+		/* count the match, MINMATCH bytes are already verified */
+		ip += MINMATCH;
+		ref += MINMATCH;
+		anchor = ip;
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		/* encode match length */
+		len = ip - anchor;
+		if (unlikely(op + (1 + LASTLITERALS) + (len >> 8) > oend))
+			return -1;
+		if (len >= ML_MASK) {
+			*token += ML_MASK;
+			len -= ML_MASK;
+			for (; len > 509; len -= 510) {
+				*op++ = 255;
+				*op++ = 255;
+			}
+			if (len > 254) {
+				len -= 255;
+				*op++ = 255;
+			}
+			*op++ = len;
+		} else
+			*token += len;
+
+		/* test end of chunk */
+		if (ip > mflimit) {
+			anchor = ip;
+			break;
+		}
+
+		/* fill table */
+		table[LZ4_HASH64K(ip - 2)] = ip - 2 - src;
+
+		/* test next position */
+		ref = src + table[LZ4_HASH64K(ip)];
+		table[LZ4_HASH64K(ip)] = ip - src;
+		if (lz4_read32(ref) == lz4_read32(ip)) {
+			token = op++;
+			*token = 0;
+			goto next_match;
+		}
+
+		/* prepare next loop */
+		anchor = ip++;
+		forwardh = LZ4_HASH64K(ip);
+	}
+
+last_literals:
+	/* encode last literals */
+	lastrun = iend - anchor;
+	if (op + lastrun + 1 + ((lastrun + 255 - RUN_MASK) / 255) > oend)
+		return -1;
+	if (lastrun >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		lastrun -= RUN_MASK;
+		for (; lastrun > 254; lastrun -= 255)
+			*op++ = 255;
+		*op++ = lastrun;
+	} else
+		*op++ = lastrun << ML_BITS;
+	memcpy(op, anchor, iend - anchor);
+	op += iend - anchor;
+
+	return op - dst;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	int out_len;
+
+	if (src_len > (1U << 16))
+		return -1;
+
+	out_len = lz4_compress64k(src, src_len, dst,
+				  lz4_compressbound(src_len), wrkmem);
+	if (out_len < 0)
+		return -1;
+
+	*dst_len = out_len;
+	return 0;
+}
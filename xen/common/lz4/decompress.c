@@ -39,7 +39,15 @@
 
 #include "defs.h"
 
-#if defined(__XEN__) || defined(__MINIOS__)
+/*
+ * Boot time image decompression knows the output size; runtime users
+ * (LZ4_DECOMPRESS_SAFE, e.g. tmem) get the bounds checked variant.
+ */
+#if (defined(__XEN__) || defined(__MINIOS__)) && !defined(LZ4_DECOMPRESS_SAFE)
+#define LZ4_DECOMPRESS_KNOWN_SIZE
+#endif
+
+#ifdef LZ4_DECOMPRESS_KNOWN_SIZE
 
 static int INIT lz4_uncompress(const unsigned char *source, unsigned char *dest,
 			       int osize)
@@ -153,7 +161,7 @@ _output_error:
 	return (int) (-(ip - source));
 }
 
-#else /* defined(__XEN__) || defined(__MINIOS__) */
+#else /* LZ4_DECOMPRESS_KNOWN_SIZE */
 
 static int lz4_uncompress_unknownoutputsize(const unsigned char *source,
 				unsigned char *dest, int isize,
@@ -283,7 +291,7 @@ _output_error:
 
 #endif
 
-#if defined(__XEN__) || defined(__MINIOS__)
+#ifdef LZ4_DECOMPRESS_KNOWN_SIZE
 
 int INIT lz4_decompress(const unsigned char *src, size_t *src_len,
 		unsigned char *dest, size_t actual_dest_len)
@@ -301,7 +309,7 @@ exit_0:
 	return ret;
 }
 
-#else /* defined(__XEN__) || defined(__MINIOS__) */
+#else /* LZ4_DECOMPRESS_KNOWN_SIZE */
 
 int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
 		 unsigned char *dest, size_t *dest_len)
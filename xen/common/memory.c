@@ -18,6 +18,7 @@
 #include <xen/iocap.h>
 #include <xen/guest_access.h>
 #include <xen/hypercall.h>
+#include <xen/iommu.h>
 #include <xen/errno.h>
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
@@ -88,12 +89,67 @@ static void increase_reservation(struct memop_args *a)
     a->nr_done = i;
 }
 
+/* Superpage orders tried by bulk populate_physmap, largest first (1G, 2M). */
+static const unsigned int bulk_orders[] = { 18, 9 };
+
+/*
+ * Return the largest order no bigger than max_order by which extent i,
+ * based at gpfn, can be populated: the run of extents it starts must be
+ * aligned and contiguous in the guest physmap.
+ */
+static unsigned int populate_bulk_order(struct memop_args *a, unsigned long i,
+                                        xen_pfn_t gpfn, unsigned int max_order)
+{
+    xen_pfn_t buf[64];
+    unsigned long n, j, k;
+    unsigned int b, order;
+
+    for ( b = 0; b < ARRAY_SIZE(bulk_orders); b++ )
+    {
+        order = bulk_orders[b];
+        if ( order > max_order || order > MAX_ORDER ||
+             order <= a->extent_order || (gpfn & ((1UL << order) - 1)) ||
+             !multipage_allocation_permitted(current->domain, order) )
+            continue;
+
+        n = 1UL << (order - a->extent_order);
+        if ( n > a->nr_extents - i )
+            continue;
+
+        /* Cheap probe of the last extent before checking the whole run. */
+        if ( __copy_from_guest_offset(buf, a->extent_list, i + n - 1, 1) ||
+             buf[0] != gpfn + ((n - 1) << a->extent_order) )
+            continue;
+
+        for ( j = 0; j < n; j += k )
+        {
+            unsigned long nr = min_t(unsigned long, n - j, ARRAY_SIZE(buf));
+
+            if ( __copy_from_guest_offset(buf, a->extent_list, i + j, nr) )
+                break;
+            for ( k = 0; k < nr; k++ )
+                if ( buf[k] != gpfn + ((j + k) << a->extent_order) )
+                    break;
+            if ( k < nr )
+                break;
+        }
+        if ( j >= n )
+            return order;
+    }
+
+    return a->extent_order;
+}
+
 static void populate_physmap(struct memop_args *a)
 {
     struct page_info *page;
     unsigned long i, j;
+    unsigned int order;
     xen_pfn_t gpfn, mfn;
     struct domain *d = a->domain;
+    struct iommu_flush_batch batch;
+    bool_t bulk = (a->memflags & MEMF_populate_bulk) &&
+                  paging_mode_translate(d);
 
     if ( !guest_handle_subrange_okay(a->extent_list, a->nr_done,
                                      a->nr_extents-1) )
@@ -103,6 +159,8 @@ static void populate_physmap(struct memop_args *a)
          !multipage_allocation_permitted(current->domain, a->extent_order) )
         return;
 
+    iommu_flush_batch_start(&batch, d);
+
     for ( i = a->nr_done; i < a->nr_extents; i++ )
     {
         if ( hypercall_preempt_check() )
@@ -122,7 +180,23 @@ static void populate_physmap(struct memop_args *a)
         }
         else
         {
-            page = alloc_domheap_pages(d, a->extent_order, a->memflags);
+            order = a->extent_order;
+            page = NULL;
+
+            /* Try the largest order the run allows, then step down. */
+            if ( bulk )
+            {
+                unsigned int max_order = MAX_ORDER;
+
+                while ( (order = populate_bulk_order(a, i, gpfn, max_order)) >
+                        a->extent_order &&
+                        (page = alloc_domheap_pages(d, order,
+                                                    a->memflags)) == NULL )
+                    max_order = order - 1;
+            }
+
+            if ( page == NULL )
+                page = alloc_domheap_pages(d, order, a->memflags);
             if ( unlikely(page == NULL) ) 
             {
                 if ( !opt_tmem || (a->extent_order != 0) )
@@ -134,7 +208,10 @@ static void populate_physmap(struct memop_args *a)
             }
 
             mfn = page_to_mfn(page);
-            guest_physmap_add_page(d, gpfn, mfn, a->extent_order);
+            guest_physmap_add_page(d, gpfn, mfn, order);
+
+            /* A bulk run covers several extents of the list. */
+            i += (1UL << (order - a->extent_order)) - 1;
 
             if ( !paging_mode_translate(d) )
             {
@@ -149,6 +226,7 @@ static void populate_physmap(struct memop_args *a)
     }
 
 out:
+    iommu_flush_batch_end(&batch);
     a->nr_done = i;
 }
 
@@ -594,6 +672,10 @@ long do_memory_op(unsigned long cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
              && (reservation.mem_flags & XENMEMF_populate_on_demand) )
             args.memflags |= MEMF_populate_on_demand;
 
+        if ( op == XENMEM_populate_physmap
+             && (reservation.mem_flags & XENMEMF_populate_bulk) )
+            args.memflags |= MEMF_populate_bulk;
+
         d = rcu_lock_domain_by_any_id(reservation.domid);
         if ( d == NULL )
             return start_extent;
@@ -33,11 +33,18 @@ static void trace_multicall_call(multicall_entry_t *call)
     __trace_multicall_call(call);
 }
 
+/*
+ * Entries are read from, and written back to, the guest this many at a
+ * time, rather than with a copy in and a copy out per call.
+ */
+#define MULTICALL_BATCH 8
+
 ret_t
 do_multicall(
     XEN_GUEST_HANDLE_PARAM(multicall_entry_t) call_list, unsigned int nr_calls)
 {
     struct mc_state *mcs = &current->mc_state;
+    multicall_entry_t batch[MULTICALL_BATCH];
     unsigned int     i;
     int              rc = 0;
 
@@ -50,55 +57,72 @@ do_multicall(
     if ( unlikely(!guest_handle_okay(call_list, nr_calls)) )
         rc = -EFAULT;
 
-    for ( i = 0; !rc && i < nr_calls; i++ )
+    for ( i = 0; !rc && i < nr_calls; )
     {
-        if ( hypercall_preempt_check() )
-            goto preempted;
+        unsigned int j, done;
+        unsigned int nr = min_t(unsigned int, nr_calls - i, MULTICALL_BATCH);
 
-        if ( unlikely(__copy_from_guest(&mcs->call, call_list, 1)) )
+        if ( unlikely(__copy_from_guest(batch, call_list, nr)) )
         {
             rc = -EFAULT;
             break;
         }
 
-        trace_multicall_call(&mcs->call);
+        for ( j = 0; j < nr; j++ )
+        {
+            if ( hypercall_preempt_check() )
+                break;
 
-        do_multicall_call(&mcs->call);
+            mcs->call = batch[j];
+
+            trace_multicall_call(&mcs->call);
+
+            vcpu_perf_incra(hypercalls, mcs->call.op);
+            arch_multicall_prepare(mcs->call.op);
+            do_multicall_call(&mcs->call);
 
 #ifndef NDEBUG
-        {
             /*
              * Deliberately corrupt the contents of the multicall structure.
              * The caller must depend only on the 'result' field on return.
              */
-            struct multicall_entry corrupt;
-            memset(&corrupt, 0xAA, sizeof(corrupt));
-            (void)__copy_to_guest(call_list, &corrupt, 1);
-        }
+            memset(&batch[j], 0xAA, sizeof(batch[j]));
 #endif
+            batch[j].result = mcs->call.result;
 
-        if ( unlikely(__copy_field_to_guest(call_list, &mcs->call, result)) )
-            rc = -EFAULT;
-        else if ( test_bit(_MCSF_call_preempted, &mcs->flags) )
-        {
-            /* Translate sub-call continuation to guest layout */
-            xlat_multicall_entry(mcs);
+            if ( test_bit(_MCSF_call_preempted, &mcs->flags) )
+            {
+                /* Translate sub-call continuation to guest layout */
+                xlat_multicall_entry(mcs);
+
+                /* Copy the sub-call continuation, with the rest. */
+                batch[j] = mcs->call;
+                break;
+            }
+        }
 
-            /* Copy the sub-call continuation. */
-            if ( likely(!__copy_to_guest(call_list, &mcs->call, 1)) )
-                goto preempted;
+        /* The calls made, and a preempted one's continuation. */
+        done = j + (j < nr && test_bit(_MCSF_call_preempted, &mcs->flags));
+        if ( done && unlikely(__copy_to_guest(call_list, batch, done)) )
+        {
             rc = -EFAULT;
+            break;
         }
-        else
-            guest_handle_add_offset(call_list, 1);
+
+        guest_handle_add_offset(call_list, j);
+        i += j;
+        if ( j < nr )
+            goto preempted;
     }
 
+    arch_multicall_end();
     perfc_incr(calls_to_multicall);
     perfc_add(calls_from_multicall, i);
     mcs->flags = 0;
     return rc;
 
  preempted:
+    arch_multicall_end();
     perfc_add(calls_from_multicall, i);
     mcs->flags = 0;
     return hypercall_create_continuation(
@@ -23,6 +23,7 @@
 
 #include <xen/config.h>
 #include <xen/init.h>
+#include <xen/cpu.h>
 #include <xen/types.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
@@ -64,6 +65,13 @@ string_param("badpage", opt_badpage);
 static bool_t opt_bootscrub __initdata = 1;
 boolean_param("bootscrub", opt_bootscrub);
 
+/*
+ * bootscrub_chunk -> Amount of bytes to scrub lockstep on non-SMT CPUs
+ * on all NUMA nodes.
+ */
+static unsigned long __initdata opt_bootscrub_chunk = MB(128);
+size_param("bootscrub_chunk", opt_bootscrub_chunk);
+
 /*
  * Bit width of the DMA heap -- used to override NUMA-node-first.
  * allocation strategy, which can otherwise exhaust low memory.
@@ -277,6 +285,16 @@ static long midsize_alloc_zone_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+/*
+ * Freed pages of dying domains are put back on the heap unscrubbed and
+ * marked PGC_need_scrub.  They are cleaned in the background by idle CPUs
+ * (see scrub_free_pages()), or on demand when they get allocated.
+ */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+static nodemask_t node_scrubbing;
+
+static unsigned int page_cache_drain_all(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -315,6 +333,10 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
 
+    /* Claims only count memory in the heap, so give it all back there. */
+    if ( pages )
+        page_cache_drain_all();
+
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
@@ -557,15 +579,77 @@ static void check_low_mem_virq(void)
     }
 }
 
-/* Allocate 2^@order contiguous pages. */
-static struct page_info *alloc_heap_pages(
+/*
+ * Put a free chunk on its heap list.  Chunks needing scrubbing are queued
+ * at the tail, so that allocations prefer clean memory and the background
+ * scrubber finds dirty chunks quickly.
+ */
+static void page_list_add_scrub(struct page_info *pg, unsigned int node,
+                                unsigned int zone, unsigned int order,
+                                unsigned int first_dirty)
+{
+    PFN_ORDER(pg) = order;
+    pg->u.free.first_dirty = first_dirty;
+
+    if ( first_dirty != INVALID_DIRTY_IDX )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
+
+/* Find the first page of a 2^@order chunk still needing to be scrubbed. */
+static unsigned int find_first_dirty(const struct page_info *pg,
+                                     unsigned int order)
+{
+    unsigned int i;
+
+    for ( i = 0; i < (1U << order); i++ )
+        if ( test_bit(_PGC_need_scrub, &pg[i].count_info) )
+            return i;
+
+    return INVALID_DIRTY_IDX;
+}
+
+/*
+ * Scrub a page, leaving the stores to be ordered by scrub_page_fence():
+ * loops scrubbing many pages fence once, at the end.
+ */
+static void scrub_one_page_nofence(struct page_info *pg)
+{
+    void *p;
+
+    if ( unlikely(pg->count_info & PGC_broken) )
+        return;
+
+    p = __map_domain_page(pg);
+
+#ifndef NDEBUG
+    /* Avoid callers relying on allocations returning zeroed pages. */
+    memset(p, 0xc2, PAGE_SIZE);
+#else
+    /* A freed page won't be touched again soon: keep it out of the cache. */
+    scrub_page(p);
+#endif
+
+    unmap_domain_page(p);
+}
+
+void scrub_one_page(struct page_info *pg)
+{
+    scrub_one_page_nofence(pg);
+    scrub_page_fence();
+}
+
+/* Allocate 2^@order contiguous pages from the buddy heap. */
+static struct page_info *__alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
     struct domain *d)
 {
     unsigned int first_node, i, j, zone = 0, nodemask_retry = 0;
     unsigned int node = (uint8_t)((memflags >> _MEMF_node) - 1);
-    unsigned long request = 1UL << order;
+    unsigned int first_dirty;
+    unsigned long request = 1UL << order, dirty_pages = 0;
     struct page_info *pg;
     nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
     bool_t need_tlbflush = 0;
@@ -674,12 +758,25 @@ static struct page_info *alloc_heap_pages(
     return NULL;
 
  found: 
+    first_dirty = pg->u.free.first_dirty;
+
     /* We may have to halve the chunk a number of times. */
     while ( j != order )
     {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
+        --j;
+        page_list_add_scrub(pg, node, zone, j,
+                            (1U << j) > first_dirty ?
+                            first_dirty : INVALID_DIRTY_IDX);
         pg += 1 << j;
+
+        if ( first_dirty != INVALID_DIRTY_IDX )
+        {
+            /* The upper half may still contain dirty pages. */
+            if ( first_dirty >= (1U << j) )
+                first_dirty -= 1U << j;
+            else
+                first_dirty = 0;
+        }
     }
 
     ASSERT(avail[node][zone] >= request);
@@ -695,8 +792,17 @@ static struct page_info *alloc_heap_pages(
     for ( i = 0; i < (1 << order); i++ )
     {
         /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+
+        /*
+         * PGC_need_scrub is kept across the state change, so that the page
+         * can be scrubbed below without holding the heap lock.  Nobody else
+         * can see the page before we return it.
+         */
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty_pages++;
+        pg[i].count_info = PGC_state_inuse |
+                           (pg[i].count_info & PGC_need_scrub);
 
         if ( pg[i].u.free.need_tlbflush &&
              (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
@@ -712,8 +818,19 @@ static struct page_info *alloc_heap_pages(
         page_set_owner(&pg[i], NULL);
     }
 
+    ASSERT(node_need_scrub[node] >= dirty_pages);
+    node_need_scrub[node] -= dirty_pages;
+
     spin_unlock(&heap_lock);
 
+    if ( dirty_pages )
+    {
+        for ( i = 0; i < (1 << order); i++ )
+            if ( test_and_clear_bit(_PGC_need_scrub, &pg[i].count_info) )
+                scrub_one_page_nofence(&pg[i]);
+        scrub_page_fence();
+    }
+
     if ( need_tlbflush )
     {
         cpumask_t mask = cpu_online_map;
@@ -776,8 +893,8 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                page_list_add_scrub(cur_head, node, zone, cur_order,
+                                    find_first_dirty(cur_head, cur_order));
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -789,6 +906,10 @@ static int reserve_offlined_page(struct page_info *head)
         if ( !page_state_is(cur_head, offlined) )
             continue;
 
+        /* Offlined pages get scrubbed, if at all, when onlined again. */
+        if ( test_and_clear_bit(_PGC_need_scrub, &cur_head->count_info) )
+            node_need_scrub[node]--;
+
         avail[node][zone]--;
         total_avail_pages--;
         ASSERT(total_avail_pages >= 0);
@@ -803,13 +924,18 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+/*
+ * Free 2^@order set of pages to the buddy heap.  If @need_scrub is set, the
+ * pages' previous contents must not leak to their next user, and they get
+ * scrubbed either by an idle CPU or when they are next allocated.
+ */
+static void __free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
 {
     unsigned long mask, mfn = page_to_mfn(pg);
     unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
     unsigned int zone = page_to_zone(pg);
+    unsigned int first_dirty = need_scrub ? 0 : INVALID_DIRTY_IDX;
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
@@ -836,6 +962,11 @@ static void free_heap_pages(
               ? PGC_state_offlined : PGC_state_free));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
+        else if ( need_scrub )
+        {
+            pg[i].count_info |= PGC_need_scrub;
+            node_need_scrub[node]++;
+        }
 
         /* If a page has no owner it will need no safety TLB flush. */
         pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
@@ -869,6 +1000,10 @@ static void free_heap_pages(
                 break;
             pg -= mask;
             page_list_del(pg, &heap(node, zone, order));
+            if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = pg->u.free.first_dirty;
+            else if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty += mask;
         }
         else
         {
@@ -879,13 +1014,15 @@ static void free_heap_pages(
                  (phys_to_nid(page_to_maddr(pg+mask)) != node) )
                 break;
             page_list_del(pg + mask, &heap(node, zone, order));
+            if ( (first_dirty == INVALID_DIRTY_IDX) &&
+                 ((pg + mask)->u.free.first_dirty != INVALID_DIRTY_IDX) )
+                first_dirty = mask + (pg + mask)->u.free.first_dirty;
         }
 
         order++;
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    page_list_add_scrub(pg, node, zone, order, first_dirty);
 
     if ( tainted )
         reserve_offlined_page(pg);
@@ -894,6 +1031,332 @@ static void free_heap_pages(
 }
 
 
+/*
+ * Per-CPU caches of order-0 pages, one list per node, in front of the buddy
+ * heap.  Pages in a cache belong to the cache: they are PGC_state_inuse
+ * and are not accounted in avail[] or total_avail_pages, so that claims
+ * never count on them.  Caches are refilled from the heap one
+ * PAGE_CACHE_BATCH sized chunk at a time, and drained back to it in
+ * batches of the same size.
+ */
+#define PAGE_CACHE_BATCH_ORDER 5
+#define PAGE_CACHE_BATCH       (1U << PAGE_CACHE_BATCH_ORDER)
+#define PAGE_CACHE_HIGH        (4 * PAGE_CACHE_BATCH)
+
+struct page_cache {
+    spinlock_t lock;
+    unsigned int count[MAX_NUMNODES];
+    struct page_list_head list[MAX_NUMNODES];
+};
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+static bool_t __read_mostly page_cache_initialised;
+
+/* Return a list of cached pages to the buddy heap. */
+static void page_cache_release(struct page_list_head *list)
+{
+    struct page_info *pg;
+    uint32_t tlbflush_timestamp = 0;
+    bool_t need_tlbflush = 0;
+    cpumask_t mask;
+
+    /*
+     * The heap only tracks TLB flush requirements of pages with an owner,
+     * so flush here on behalf of all pages which still need it.
+     */
+    page_list_for_each ( pg, list )
+        if ( pg->u.free.need_tlbflush &&
+             (pg->tlbflush_timestamp <= tlbflush_current_time()) &&
+             (!need_tlbflush ||
+              (pg->tlbflush_timestamp > tlbflush_timestamp)) )
+        {
+            need_tlbflush = 1;
+            tlbflush_timestamp = pg->tlbflush_timestamp;
+        }
+
+    if ( need_tlbflush )
+    {
+        cpumask_copy(&mask, &cpu_online_map);
+        tlbflush_filter(mask, tlbflush_timestamp);
+        if ( !cpumask_empty(&mask) )
+        {
+            perfc_incr(need_flush_tlb_flush);
+            flush_tlb_mask(&mask);
+        }
+    }
+
+    while ( (pg = page_list_remove_head(list)) != NULL )
+        __free_heap_pages(pg, 0, 0);
+}
+
+/* Empty @cpu's page caches into the buddy heap.  Returns the page count. */
+static unsigned int page_cache_drain(unsigned int cpu)
+{
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    PAGE_LIST_HEAD(list);
+    unsigned int node, count = 0;
+
+    spin_lock(&pc->lock);
+    for ( node = 0; node < MAX_NUMNODES; node++ )
+    {
+        count += pc->count[node];
+        pc->count[node] = 0;
+        page_list_splice(&pc->list[node], &list);
+        INIT_PAGE_LIST_HEAD(&pc->list[node]);
+    }
+    spin_unlock(&pc->lock);
+
+    page_cache_release(&list);
+
+    return count;
+}
+
+static unsigned int page_cache_drain_all(void)
+{
+    unsigned int cpu, count = 0;
+
+    if ( !page_cache_initialised )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        count += page_cache_drain(cpu);
+
+    return count;
+}
+
+static unsigned long page_cache_pages(void)
+{
+    unsigned int cpu, node;
+    unsigned long count = 0;
+
+    if ( !page_cache_initialised )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        for ( node = 0; node < MAX_NUMNODES; node++ )
+            count += per_cpu(page_cache, cpu).count[node];
+
+    return count;
+}
+
+/* Take an order-0 page from the local cache of @node, refilling if empty. */
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int node)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    struct page_info *pg;
+    unsigned int i, zone;
+    cpumask_t mask;
+
+    spin_lock(&pc->lock);
+    while ( (pg = page_list_remove_head(&pc->list[node])) != NULL )
+    {
+        pc->count[node]--;
+
+        /* Has the page been marked for offlining while in the cache? */
+        if ( likely(page_state_is(pg, inuse)) )
+            break;
+
+        spin_unlock(&pc->lock);
+        __free_heap_pages(pg, 0, 0);
+        spin_lock(&pc->lock);
+    }
+
+    if ( pg != NULL )
+    {
+        zone = page_to_zone(pg);
+        if ( (zone < zone_lo) || (zone > zone_hi) )
+        {
+            page_list_add(pg, &pc->list[node]);
+            pc->count[node]++;
+            spin_unlock(&pc->lock);
+            return NULL;
+        }
+    }
+    spin_unlock(&pc->lock);
+
+    if ( pg == NULL )
+    {
+        /*
+         * Refill with a chunk from the node.  This is an anonymous
+         * allocation, so the cache never eats into claimed memory.
+         */
+        pg = __alloc_heap_pages(zone_lo, zone_hi, PAGE_CACHE_BATCH_ORDER,
+                                MEMF_node(node) | MEMF_exact_node, NULL);
+        if ( pg == NULL )
+            return NULL;
+
+        spin_lock(&pc->lock);
+        for ( i = 1; i < PAGE_CACHE_BATCH; i++ )
+        {
+            pg[i].u.free.need_tlbflush = 0;
+            page_list_add_tail(&pg[i], &pc->list[node]);
+        }
+        pc->count[node] += PAGE_CACHE_BATCH - 1;
+        spin_unlock(&pc->lock);
+
+        return pg;
+    }
+
+    if ( pg->u.free.need_tlbflush &&
+         (pg->tlbflush_timestamp <= tlbflush_current_time()) )
+    {
+        cpumask_copy(&mask, &cpu_online_map);
+        tlbflush_filter(mask, pg->tlbflush_timestamp);
+        if ( !cpumask_empty(&mask) )
+        {
+            perfc_incr(need_flush_tlb_flush);
+            flush_tlb_mask(&mask);
+        }
+    }
+
+    /* Initialise fields which have other uses for free pages. */
+    pg->u.inuse.type_info = 0;
+
+    return pg;
+}
+
+/* Try to put an order-0 page into the local cache.  Returns 0 on failure. */
+static bool_t page_cache_free(struct page_info *pg)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    unsigned int node = phys_to_nid(page_to_maddr(pg));
+    unsigned long x, y = pg->count_info;
+    PAGE_LIST_HEAD(list);
+    unsigned int i;
+
+    if ( page_to_zone(pg) <= MEMZONE_XEN )
+        return 0;
+
+    /* Pages being offlined or broken are left to the heap to deal with. */
+    do {
+        x = y;
+        if ( (x & PGC_broken) || ((x & PGC_state) != PGC_state_inuse) )
+            return 0;
+    } while ( (y = cmpxchg(&pg->count_info, x, PGC_state_inuse)) != x );
+
+    /* If a page has no owner it will need no safety TLB flush. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        pg->tlbflush_timestamp = tlbflush_current_time();
+
+    /* This page is not a guest frame any more. */
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(page_to_mfn(pg), INVALID_M2P_ENTRY);
+
+    spin_lock(&pc->lock);
+    page_list_add(pg, &pc->list[node]);
+    if ( ++pc->count[node] > PAGE_CACHE_HIGH )
+    {
+        /* Give the coldest pages back to the heap. */
+        for ( i = 0; i < PAGE_CACHE_BATCH; i++ )
+        {
+            struct page_info *tail = page_list_last(&pc->list[node]);
+
+            page_list_del(tail, &pc->list[node]);
+            page_list_add(tail, &list);
+        }
+        pc->count[node] -= PAGE_CACHE_BATCH;
+    }
+    spin_unlock(&pc->lock);
+
+    if ( !page_list_empty(&list) )
+        page_cache_release(&list);
+
+    return 1;
+}
+
+static struct page_info *alloc_heap_pages(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    unsigned int node = (uint8_t)((memflags >> _MEMF_node) - 1);
+    struct page_info *pg;
+
+    if ( (order == 0) && page_cache_initialised && !opt_tmem )
+    {
+        /*
+         * Without an explicit node, serve from the local node provided the
+         * domain's memory may live there.
+         */
+        if ( node == NUMA_NO_NODE )
+        {
+            node = cpu_to_node(smp_processor_id());
+            if ( (d != NULL) && !node_isset(node, d->node_affinity) )
+                node = NUMA_NO_NODE;
+        }
+
+        if ( (node < MAX_NUMNODES) &&
+             (pg = page_cache_alloc(zone_lo, zone_hi, node)) != NULL )
+        {
+            if ( d != NULL )
+                d->last_alloc_node = node;
+            return pg;
+        }
+    }
+
+    pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
+
+    /* Memory may be sitting in the page caches: reclaim and retry. */
+    if ( (pg == NULL) && page_cache_drain_all() )
+        pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
+
+    return pg;
+}
+
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    if ( (order == 0) && !need_scrub && page_cache_initialised &&
+         !opt_tmem && page_cache_free(pg) )
+        return;
+
+    __free_heap_pages(pg, order, need_scrub);
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu, node;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pc->lock);
+        for ( node = 0; node < MAX_NUMNODES; node++ )
+        {
+            pc->count[node] = 0;
+            INIT_PAGE_LIST_HEAD(&pc->list[node]);
+        }
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        page_cache_drain(cpu);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init page_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_nfb);
+    page_cache_initialised = 1;
+
+    return 0;
+}
+presmp_initcall(page_cache_init);
+
 /*
  * Following rules applied for page offline:
  * Once a page is broken, it can't be assigned anymore
@@ -1000,6 +1463,9 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         return 0;
     }
 
+    /* A free page may be sitting in a page cache rather than the heap. */
+    page_cache_drain_all();
+
     spin_lock(&heap_lock);
 
     old_info = mark_page_offline(pg, broken);
@@ -1113,7 +1579,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     spin_unlock(&heap_lock);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 1);
 
     return ret;
 }
@@ -1182,7 +1648,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, 0);
     }
 }
 
@@ -1254,42 +1720,219 @@ void __init end_boot_allocator(void)
     printk("\n");
 }
 
+struct scrub_region {
+    unsigned long offset;
+    unsigned long start;
+    unsigned long per_cpu_sz;
+    unsigned long rem;
+    cpumask_t cpus;
+};
+static struct scrub_region __initdata region[MAX_NUMNODES];
+static unsigned long __initdata chunk_size;
+
+static void __init smp_scrub_heap_pages(void *data)
+{
+    unsigned long mfn, start, end;
+    struct page_info *pg;
+    struct scrub_region *r;
+    unsigned int temp_cpu, node, cpu_idx = 0;
+    unsigned int cpu = smp_processor_id();
+
+    if ( data )
+        r = data;
+    else
+    {
+        node = cpu_to_node(cpu);
+        if ( node == NUMA_NO_NODE )
+            return;
+        r = &region[node];
+    }
+
+    /* Determine the current CPU's index into CPU's linked to this node. */
+    for_each_cpu ( temp_cpu, &r->cpus )
+    {
+        if ( cpu == temp_cpu )
+            break;
+        cpu_idx++;
+    }
+
+    /* Calculate the starting mfn for this CPU's memory block. */
+    start = r->start + (r->per_cpu_sz * cpu_idx) + r->offset;
+
+    /* Calculate the end mfn into this CPU's memory block for this iteration. */
+    if ( r->offset + chunk_size >= r->per_cpu_sz )
+    {
+        end = r->start + (r->per_cpu_sz * cpu_idx) + r->per_cpu_sz;
+
+        if ( r->rem && ((cpumask_weight(&r->cpus) - 1) == cpu_idx) )
+            end += r->rem;
+    }
+    else
+        end = start + chunk_size;
+
+    for ( mfn = start; mfn < end; mfn++ )
+    {
+        pg = mfn_to_page(mfn);
+
+        /* Check the mfn is valid and page is free. */
+        if ( !mfn_valid(mfn) || !page_state_is(pg, free) )
+            continue;
+
+        scrub_one_page_nofence(pg);
+    }
+
+    scrub_page_fence();
+}
+
+/* Pick one online CPU per core of @node, so SMT siblings don't compete. */
+static unsigned int __init find_non_smt(unsigned int node, cpumask_t *dest)
+{
+    cpumask_t node_cpus;
+    unsigned int i, cpu;
+
+    cpumask_and(&node_cpus, &node_to_cpumask(node), &cpu_online_map);
+    cpumask_clear(dest);
+    for_each_cpu ( i, &node_cpus )
+    {
+        if ( cpumask_intersects(dest, per_cpu(cpu_sibling_mask, i)) )
+            continue;
+        cpu = cpumask_first(per_cpu(cpu_sibling_mask, i));
+        cpumask_set_cpu(cpu, dest);
+    }
+
+    return cpumask_weight(dest);
+}
+
 /*
- * Scrub all unallocated pages in all heap zones. This function is more
- * convoluted than appears necessary because we do not want to continuously
- * hold the lock while scrubbing very large memory areas.
+ * Scrub all unallocated pages in all heap zones. This function uses all
+ * online cpu's to scrub the memory in parallel, each scrubbing the memory
+ * of its own node. The heap lock is held by the boot CPU across each round,
+ * so that no page can change state underneath the scrubbers, but it is
+ * dropped between rounds so we do not hold it while scrubbing all of RAM.
  */
 void __init scrub_heap_pages(void)
 {
-    unsigned long mfn;
-    struct page_info *pg;
+    cpumask_t node_cpus, all_worker_cpus;
+    unsigned int i, j, cpus;
+    unsigned long offset, max_per_cpu_sz = 0;
+    unsigned long start, end;
+    unsigned long rem = 0;
+    int last_distance, best_node;
 
     if ( !opt_bootscrub )
         return;
 
-    printk("Scrubbing Free RAM: ");
+    cpumask_clear(&all_worker_cpus);
+    /* Scrub block size. */
+    chunk_size = opt_bootscrub_chunk >> PAGE_SHIFT;
+    if ( chunk_size == 0 )
+        chunk_size = MB(128) >> PAGE_SHIFT;
 
-    for ( mfn = first_valid_mfn; mfn < max_page; mfn++ )
+    /* Round #0 - figure out amounts and which CPUs to use. */
+    for_each_online_node ( i )
     {
+        if ( !node_spanned_pages(i) )
+            continue;
+        /* Calculate Node memory start and end address. */
+        start = max(node_start_pfn(i), first_valid_mfn);
+        end = min(node_start_pfn(i) + node_spanned_pages(i), max_page);
+        /* Just in case NODE has 1 page and starts below first_valid_mfn. */
+        end = max(end, start);
+        /* CPUs that are online and on this node (if none, that it is OK). */
+        cpus = find_non_smt(i, &node_cpus);
+        cpumask_or(&all_worker_cpus, &all_worker_cpus, &node_cpus);
+        if ( cpus == 0 )
+        {
+            /* No CPUs on this node. Round #2 will take care of it. */
+            rem = 0;
+            region[i].per_cpu_sz = (end - start);
+        }
+        else
+        {
+            rem = (end - start) % cpus;
+            region[i].per_cpu_sz = (end - start) / cpus;
+            if ( region[i].per_cpu_sz > max_per_cpu_sz )
+                max_per_cpu_sz = region[i].per_cpu_sz;
+        }
+        region[i].start = start;
+        region[i].rem = rem;
+        cpumask_copy(&region[i].cpus, &node_cpus);
+    }
+
+    printk("Scrubbing Free RAM on %u nodes using %u CPUs\n",
+           num_online_nodes(), cpumask_weight(&all_worker_cpus));
+
+    /* Round #1 - do NUMA nodes with CPUs. */
+    for ( offset = 0; offset < max_per_cpu_sz; offset += chunk_size )
+    {
+        for_each_online_node ( i )
+            region[i].offset = offset;
+
         process_pending_softirqs();
 
-        pg = mfn_to_page(mfn);
+        spin_lock(&heap_lock);
+        on_selected_cpus(&all_worker_cpus, smp_scrub_heap_pages, NULL, 1);
+        spin_unlock(&heap_lock);
 
-        /* Quick lock-free check. */
-        if ( !mfn_valid(mfn) || !page_state_is(pg, free) )
+        printk(".");
+    }
+
+    /*
+     * Round #2 - NUMA nodes with no CPUs get scrubbed with CPUs on the node
+     * closest to us and with CPUs.
+     */
+    for_each_online_node ( i )
+    {
+        node_cpus = node_to_cpumask(i);
+
+        if ( !cpumask_empty(&node_cpus) )
             continue;
 
-        /* Every 100MB, print a progress dot. */
-        if ( (mfn % ((100*1024*1024)/PAGE_SIZE)) == 0 )
-            printk(".");
+        last_distance = INT_MAX;
+        best_node = first_node(node_online_map);
+        /* Figure out which NODE CPUs are close. */
+        for_each_online_node ( j )
+        {
+            int distance;
 
-        spin_lock(&heap_lock);
+            if ( cpumask_empty(&node_to_cpumask(j)) )
+                continue;
 
-        /* Re-check page status with lock held. */
-        if ( page_state_is(pg, free) )
-            scrub_one_page(pg);
+            distance = __node_distance(i, j);
+            if ( distance < last_distance )
+            {
+                last_distance = distance;
+                best_node = j;
+            }
+        }
+        /*
+         * Use CPUs from best node, and if there are no CPUs on the
+         * first node (the default) use the BSP.
+         */
+        cpus = find_non_smt(best_node, &node_cpus);
+        if ( cpus == 0 )
+        {
+            cpumask_set_cpu(smp_processor_id(), &node_cpus);
+            cpus = 1;
+        }
+        /* We already have the node information from round #0. */
+        region[i].rem = region[i].per_cpu_sz % cpus;
+        region[i].per_cpu_sz /= cpus;
+        max_per_cpu_sz = region[i].per_cpu_sz;
+        cpumask_copy(&region[i].cpus, &node_cpus);
 
-        spin_unlock(&heap_lock);
+        for ( offset = 0; offset < max_per_cpu_sz; offset += chunk_size )
+        {
+            region[i].offset = offset;
+
+            process_pending_softirqs();
+
+            spin_lock(&heap_lock);
+            on_selected_cpus(&node_cpus, smp_scrub_heap_pages, &region[i], 1);
+            spin_unlock(&heap_lock);
+
+            printk(".");
+        }
     }
 
     printk("done.\n");
@@ -1355,7 +1998,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1409,7 +2052,7 @@ void free_xenheap_pages(void *v, unsigned int order)
     for ( i = 0; i < (1u << order); i++ )
         pg[i].count_info &= ~PGC_xen_heap;
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 0);
 }
 
 #endif
@@ -1510,7 +2153,7 @@ struct page_info *alloc_domheap_pages(
 
     if ( (d != NULL) && assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1556,25 +2199,21 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
         /*
          * Normally we expect a domain to clear pages before freeing them, if 
          * it cares about the secrecy of their contents. However, after a 
-         * domain has died we assume responsibility for erasure.
+         * domain has died we assume responsibility for erasure.  This is
+         * done lazily, so that tearing down a large domain is quick.
          */
-        if ( unlikely(d->is_dying) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, d->is_dying);
     }
     else if ( unlikely(d == dom_cow) )
     {
         ASSERT(order == 0); 
-        scrub_one_page(pg);
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 1);
         drop_dom_ref = 0;
     }
     else
     {
         /* Freeing anonymous domain-heap pages. */
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         drop_dom_ref = 0;
     }
 
@@ -1600,7 +2239,7 @@ unsigned long avail_domheap_pages(void)
 {
     return avail_heap_pages(MEMZONE_XEN + 1,
                             NR_ZONES - 1,
-                            -1);
+                            -1) + page_cache_pages();
 }
 
 unsigned long avail_node_heap_pages(unsigned int nodeid)
@@ -1649,23 +2288,79 @@ static __init int pagealloc_keyhandler_init(void)
 }
 __initcall(pagealloc_keyhandler_init);
 
+/* Dirty pages scrubbed, and pages looked at, per heap_lock acquisition. */
+#define SCRUB_BATCH_PAGES 64
+#define SCRUB_BATCH_SCAN  (SCRUB_BATCH_PAGES * 16)
 
-void scrub_one_page(struct page_info *pg)
+/*
+ * Scrub a batch of free pages of the local node which still need it.
+ * Called from the idle loop.  Returns non-zero if any work was done, in
+ * which case the caller should check for pending work before idling.
+ */
+bool_t scrub_free_pages(void)
 {
-    void *p = __map_domain_page(pg);
+    unsigned int cpu = smp_processor_id(), node = cpu_to_node(cpu);
+    unsigned int zone, order, i, n, scrubbed = 0, scanned = 0;
+    struct page_info *head, *tmp;
 
-    if ( unlikely(pg->count_info & PGC_broken) )
-        return;
+    if ( node >= MAX_NUMNODES || !node_need_scrub[node] ||
+         softirq_pending(cpu) )
+        return 0;
 
-#ifndef NDEBUG
-    /* Avoid callers relying on allocations returning zeroed pages. */
-    memset(p, 0xc2, PAGE_SIZE);
-#else
-    /* For a production build, clear_page() is the fastest way to scrub. */
-    clear_page(p);
-#endif
+    /* One CPU per node at a time, to keep heap_lock contention down. */
+    if ( node_test_and_set(node, node_scrubbing) )
+        return 0;
 
-    unmap_domain_page(p);
+    spin_lock(&heap_lock);
+
+    for ( zone = 0; zone < NR_ZONES; zone++ )
+    {
+        for ( order = MAX_ORDER + 1; order-- > 0; )
+        {
+            /* Dirty chunks are at the tail of each list. */
+            page_list_for_each_safe_reverse ( head, tmp,
+                                              &heap(node, zone, order) )
+            {
+                if ( head->u.free.first_dirty == INVALID_DIRTY_IDX )
+                    break;
+
+                n = 1U << order;
+                for ( i = head->u.free.first_dirty; i < n; i++ )
+                {
+                    if ( (scrubbed >= SCRUB_BATCH_PAGES) ||
+                         (scanned++ >= SCRUB_BATCH_SCAN) )
+                        break;
+
+                    if ( test_bit(_PGC_need_scrub, &head[i].count_info) )
+                    {
+                        scrub_one_page_nofence(&head[i]);
+                        head[i].count_info &= ~PGC_need_scrub;
+                        node_need_scrub[node]--;
+                        scrubbed++;
+                    }
+                }
+
+                if ( i < n )
+                {
+                    head->u.free.first_dirty = i;
+                    goto out;
+                }
+
+                /* The whole chunk is clean now. */
+                page_list_del(head, &heap(node, zone, order));
+                page_list_add_scrub(head, node, zone, order,
+                                    INVALID_DIRTY_IDX);
+            }
+        }
+    }
+
+ out:
+    /* Order the scrubbing before the pages can be allocated again. */
+    scrub_page_fence();
+    spin_unlock(&heap_lock);
+    node_clear(node, node_scrubbing);
+
+    return scanned != 0;
 }
 
 static void dump_heap(unsigned char key)
@@ -1683,7 +2378,11 @@ static void dump_heap(unsigned char key)
         for ( j = 0; j < NR_ZONES; j++ )
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
+        printk("heap[node=%d] -> %lu pages need scrubbing\n",
+               i, node_need_scrub[i]);
     }
+
+    printk("per-CPU page caches -> %lu pages\n", page_cache_pages());
 }
 
 static struct keyhandler dump_heap_keyhandler = {
@@ -21,6 +21,7 @@
 
 #include <xen/config.h>
 #include <xen/init.h>
+#include <xen/bitops.h>
 #include <xen/radix-tree.h>
 #include <xen/errno.h>
 
@@ -49,14 +50,55 @@ static inline void *indirect_to_ptr(void *ptr)
 	return (void *)((unsigned long)ptr & ~RADIX_TREE_INDIRECT_PTR);
 }
 
+static inline void tag_set(struct radix_tree_node *node, unsigned int tag,
+		int offset)
+{
+	__set_bit(offset, node->tags[tag]);
+}
+
+static inline void tag_clear(struct radix_tree_node *node, unsigned int tag,
+		int offset)
+{
+	__clear_bit(offset, node->tags[tag]);
+}
+
+static inline int tag_get(struct radix_tree_node *node, unsigned int tag,
+		int offset)
+{
+	return test_bit(offset, node->tags[tag]);
+}
+
+static inline int any_tag_set(struct radix_tree_node *node, unsigned int tag)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < RADIX_TREE_TAG_LONGS; idx++)
+		if (node->tags[tag][idx])
+			return 1;
+	return 0;
+}
+
+static inline void root_tag_set(struct radix_tree_root *root, unsigned int tag)
+{
+	root->tags |= 1U << tag;
+}
+
+static inline void root_tag_clear(struct radix_tree_root *root,
+		unsigned int tag)
+{
+	root->tags &= ~(1U << tag);
+}
+
 struct rcu_node {
 	struct radix_tree_node node;
 	struct rcu_head rcu_head;
 };
 
+static struct xmem_cache *__read_mostly rcu_node_cache;
+
 static struct radix_tree_node *rcu_node_alloc(void *arg)
 {
-	struct rcu_node *rcu_node = xmalloc(struct rcu_node);
+	struct rcu_node *rcu_node = xmem_cache_alloc(rcu_node_cache);
 	return rcu_node ? &rcu_node->node : NULL;
 }
 
@@ -64,7 +106,7 @@ static void _rcu_node_free(struct rcu_head *head)
 {
 	struct rcu_node *rcu_node =
 		container_of(head, struct rcu_node, rcu_head);
-	xfree(rcu_node);
+	xmem_cache_free(rcu_node_cache, rcu_node);
 }
 
 static void rcu_node_free(struct radix_tree_node *node, void *arg)
@@ -89,6 +131,56 @@ static void radix_tree_node_free(
 	root->node_free(node, root->node_alloc_free_arg);
 }
 
+/* Nodes allocated in advance, chained through slots[0]. */
+struct radix_tree_preload {
+	struct radix_tree_node *nodes;
+	unsigned long nr;
+};
+
+static struct radix_tree_node *radix_tree_node_get(
+	struct radix_tree_root *root, struct radix_tree_preload *pl)
+{
+	struct radix_tree_node *node;
+
+	if (!pl)
+		return radix_tree_node_alloc(root);
+
+	node = pl->nodes;
+	BUG_ON(!node);
+	pl->nodes = node->slots[0];
+	pl->nr--;
+	memset(node, 0, sizeof(*node));
+	return node;
+}
+
+static int radix_tree_preload_fill(struct radix_tree_root *root,
+	struct radix_tree_preload *pl, unsigned long nr)
+{
+	while (pl->nr < nr) {
+		struct radix_tree_node *node = radix_tree_node_alloc(root);
+
+		if (!node)
+			return -ENOMEM;
+		node->slots[0] = pl->nodes;
+		pl->nodes = node;
+		pl->nr++;
+	}
+	return 0;
+}
+
+static void radix_tree_preload_drain(struct radix_tree_root *root,
+	struct radix_tree_preload *pl)
+{
+	while (pl->nodes) {
+		struct radix_tree_node *node = pl->nodes;
+
+		pl->nodes = node->slots[0];
+		node->slots[0] = NULL;
+		radix_tree_node_free(root, node);
+	}
+	pl->nr = 0;
+}
+
 /*
  *	Return the maximum key which can be store into a
  *	radix tree with height HEIGHT.
@@ -101,10 +193,11 @@ static inline unsigned long radix_tree_maxindex(unsigned int height)
 /*
  *	Extend a radix tree so it can store key @index.
  */
-static int radix_tree_extend(struct radix_tree_root *root, unsigned long index)
+static int radix_tree_extend(struct radix_tree_root *root, unsigned long index,
+			     struct radix_tree_preload *pl)
 {
 	struct radix_tree_node *node;
-	unsigned int height;
+	unsigned int height, tag;
 
 	/* Figure out what the height should be.  */
 	height = root->height + 1;
@@ -118,12 +211,17 @@ static int radix_tree_extend(struct radix_tree_root *root, unsigned long index)
 
 	do {
 		unsigned int newheight;
-		if (!(node = radix_tree_node_alloc(root)))
+		if (!(node = radix_tree_node_get(root, pl)))
 			return -ENOMEM;
 
 		/* Increase the height.  */
 		node->slots[0] = indirect_to_ptr(root->rnode);
 
+		/* Propagate the aggregated tag info into the new root */
+		for (tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++)
+			if (radix_tree_tagged(root, tag))
+				tag_set(node, tag, 0);
+
 		newheight = root->height+1;
 		node->height = newheight;
 		node->count = 1;
@@ -155,7 +253,7 @@ int radix_tree_insert(struct radix_tree_root *root,
 
 	/* Make sure the tree is high enough.  */
 	if (index > radix_tree_maxindex(root->height)) {
-		error = radix_tree_extend(root, index);
+		error = radix_tree_extend(root, index, NULL);
 		if (error)
 			return error;
 	}
@@ -533,11 +631,13 @@ EXPORT_SYMBOL(radix_tree_gang_lookup_slot);
 /**
  *	radix_tree_shrink    -    shrink height of a radix tree to minimal
  *	@root		radix tree root
+ *	@min_height	height not to shrink below
  */
-static inline void radix_tree_shrink(struct radix_tree_root *root)
+static inline void radix_tree_shrink(struct radix_tree_root *root,
+				     unsigned int min_height)
 {
 	/* try to shrink tree height */
-	while (root->height > 0) {
+	while (root->height > min_height) {
 		struct radix_tree_node *to_free = root->rnode;
 		void *newptr;
 
@@ -610,7 +710,7 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 	struct radix_tree_path path[RADIX_TREE_MAX_PATH + 1], *pathp = path;
 	struct radix_tree_node *slot = NULL;
 	struct radix_tree_node *to_free;
-	unsigned int height, shift;
+	unsigned int height, shift, tag;
 	int offset;
 
 	height = root->height;
@@ -620,6 +720,7 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 	slot = root->rnode;
 	if (height == 0) {
 		root->rnode = NULL;
+		root->tags = 0;
 		goto out;
 	}
 	slot = indirect_to_ptr(slot);
@@ -643,6 +744,10 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 	if (slot == NULL)
 		goto out;
 
+	for (tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++)
+		if (tag_get(pathp->node, tag, pathp->offset))
+			radix_tree_tag_clear(root, index, tag);
+
 	to_free = NULL;
 	/* Now free the nodes we do not need anymore */
 	while (pathp->node) {
@@ -657,7 +762,7 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 
 		if (pathp->node->count) {
 			if (pathp->node == indirect_to_ptr(root->rnode))
-				radix_tree_shrink(root);
+				radix_tree_shrink(root, 0);
 			goto out;
 		}
 
@@ -668,6 +773,7 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 	}
 	root->height = 0;
 	root->rnode = NULL;
+	root->tags = 0;
 	if (to_free)
 		radix_tree_node_free(root, to_free);
 
@@ -676,6 +782,481 @@ out:
 }
 EXPORT_SYMBOL(radix_tree_delete);
 
+/**
+ *	radix_tree_tag_set - set a tag on a radix tree item
+ *	@root:		radix tree root
+ *	@index:		index key
+ *	@tag:		tag index
+ *
+ *	Set the search tag (which must be < RADIX_TREE_MAX_TAGS) on the item
+ *	at @index, and on every node on the path to it.
+ *
+ *	Returns the address of the tagged item, or NULL if there is none.
+ */
+void *radix_tree_tag_set(struct radix_tree_root *root,
+			unsigned long index, unsigned int tag)
+{
+	unsigned int height, shift;
+	struct radix_tree_node *slot;
+
+	BUG_ON(tag >= RADIX_TREE_MAX_TAGS);
+
+	if (!radix_tree_lookup(root, index))
+		return NULL;
+
+	height = root->height;
+	slot = indirect_to_ptr(root->rnode);
+	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+
+	while (height > 0) {
+		int offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+
+		tag_set(slot, tag, offset);
+		slot = slot->slots[offset];
+		shift -= RADIX_TREE_MAP_SHIFT;
+		height--;
+	}
+
+	root_tag_set(root, tag);
+
+	return slot;
+}
+EXPORT_SYMBOL(radix_tree_tag_set);
+
+/**
+ *	radix_tree_tag_clear - clear a tag on a radix tree item
+ *	@root:		radix tree root
+ *	@index:		index key
+ *	@tag:		tag index
+ *
+ *	Clear the search tag on the item at @index, and on every node on the
+ *	path to it which has no other item carrying the tag below it.
+ *
+ *	Returns the address of the item, or NULL if there is none.
+ */
+void *radix_tree_tag_clear(struct radix_tree_root *root,
+			unsigned long index, unsigned int tag)
+{
+	/*
+	 * The radix tree path needs to be one longer than the maximum path
+	 * since the "list" is null terminated.
+	 */
+	struct radix_tree_path path[RADIX_TREE_MAX_PATH + 1], *pathp = path;
+	struct radix_tree_node *slot = NULL;
+	unsigned int height, shift;
+
+	BUG_ON(tag >= RADIX_TREE_MAX_TAGS);
+
+	height = root->height;
+	if (index > radix_tree_maxindex(height))
+		goto out;
+
+	slot = indirect_to_ptr(root->rnode);
+	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+	pathp->node = NULL;
+
+	while (height > 0) {
+		int offset;
+
+		if (slot == NULL)
+			goto out;
+
+		offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+		pathp[1].offset = offset;
+		pathp[1].node = slot;
+		slot = slot->slots[offset];
+		pathp++;
+		shift -= RADIX_TREE_MAP_SHIFT;
+		height--;
+	}
+
+	if (slot == NULL)
+		goto out;
+
+	while (pathp->node) {
+		if (!tag_get(pathp->node, tag, pathp->offset))
+			goto out;
+		tag_clear(pathp->node, tag, pathp->offset);
+		if (any_tag_set(pathp->node, tag))
+			goto out;
+		pathp--;
+	}
+
+	/* clear the root's tag bit */
+	root_tag_clear(root, tag);
+
+out:
+	return slot;
+}
+EXPORT_SYMBOL(radix_tree_tag_clear);
+
+/**
+ *	radix_tree_tag_get - get a tag on a radix tree item
+ *	@root:		radix tree root
+ *	@index:		index key
+ *	@tag:		tag index
+ *
+ *	Return 1 if the item at @index carries @tag, 0 otherwise (including
+ *	if there is no item).  May be called under rcu_read_lock, in which
+ *	case the result can be stale by the time it is returned.
+ */
+int radix_tree_tag_get(struct radix_tree_root *root,
+			unsigned long index, unsigned int tag)
+{
+	unsigned int height, shift;
+	struct radix_tree_node *node;
+
+	BUG_ON(tag >= RADIX_TREE_MAX_TAGS);
+
+	if (!radix_tree_tagged(root, tag))
+		return 0;
+
+	node = rcu_dereference(root->rnode);
+	if (node == NULL)
+		return 0;
+
+	if (!radix_tree_is_indirect_ptr(node))
+		return (index == 0);
+	node = indirect_to_ptr(node);
+
+	height = node->height;
+	if (index > radix_tree_maxindex(height))
+		return 0;
+
+	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+
+	for ( ; ; ) {
+		int offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+
+		if (!tag_get(node, tag, offset))
+			return 0;
+		if (height == 1)
+			return 1;
+		node = rcu_dereference(node->slots[offset]);
+		if (node == NULL)
+			return 0;
+		shift -= RADIX_TREE_MAP_SHIFT;
+		height--;
+	}
+}
+EXPORT_SYMBOL(radix_tree_tag_get);
+
+/*
+ * Find the first present (or, if @tag >= 0, tagged) slot at or after
+ * *@index.  Each level is scanned for the next candidate; when a level is
+ * exhausted the search restarts from the root at the start of the next
+ * subtree, so no path needs to be kept and concurrent (RCU) changes to
+ * the tree are simply picked up or missed.
+ */
+static void **radix_tree_find_next(struct radix_tree_root *root,
+				   unsigned long *index, int tag)
+{
+	struct radix_tree_node *node, *rnode;
+	unsigned long idx = *index, max_index;
+	unsigned int height, shift, offset;
+
+	if (tag >= 0 && !radix_tree_tagged(root, tag))
+		return NULL;
+
+	rnode = rcu_dereference(root->rnode);
+	if (rnode == NULL)
+		return NULL;
+
+	if (!radix_tree_is_indirect_ptr(rnode)) {
+		if (idx > 0)
+			return NULL;
+		return (void **)&root->rnode;
+	}
+	rnode = indirect_to_ptr(rnode);
+	max_index = radix_tree_maxindex(rnode->height);
+
+ restart:
+	if (idx > max_index)
+		return NULL;
+
+	node = rnode;
+	height = node->height;
+	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+
+	for ( ; ; ) {
+		unsigned long span = 1UL << shift;
+
+		offset = (idx >> shift) & RADIX_TREE_MAP_MASK;
+		while (tag >= 0 ? !tag_get(node, tag, offset)
+				: node->slots[offset] == NULL) {
+			/* Move on to the start of the next subtree. */
+			idx = (idx & ~(span - 1)) + span;
+			if (idx == 0)
+				return NULL;	/* wraparound */
+			if (++offset == RADIX_TREE_MAP_SIZE) {
+				/*
+				 * Level exhausted: idx now is the start of the
+				 * parent's next subtree.
+				 */
+				if (node == rnode)
+					return NULL;
+				goto restart;
+			}
+		}
+
+		if (height == 1) {
+			*index = idx;
+			return &node->slots[offset];
+		}
+
+		node = rcu_dereference(node->slots[offset]);
+		if (node == NULL) {
+			/* Raced with a deletion: skip this subtree. */
+			idx = (idx & ~(span - 1)) + span;
+			if (idx == 0)
+				return NULL;
+			goto restart;
+		}
+		height--;
+		shift -= RADIX_TREE_MAP_SHIFT;
+	}
+}
+
+/**
+ *	radix_tree_iter_next - advance a radix tree iterator
+ *	@root:		radix tree root
+ *	@iter:		iterator, set up with radix_tree_iter_init()
+ *
+ *	Returns the next present (or tagged) slot, with its index in
+ *	@iter->index, or NULL once there are no more.
+ */
+void **radix_tree_iter_next(struct radix_tree_root *root,
+			    struct radix_tree_iter *iter)
+{
+	unsigned long index = iter->next_index;
+	void **slot;
+
+	if (iter->done)
+		return NULL;
+
+	slot = radix_tree_find_next(root, &index, iter->tag);
+	if (!slot) {
+		iter->done = 1;
+		return NULL;
+	}
+
+	iter->index = index;
+	iter->next_index = index + 1;
+	if (iter->next_index == 0)
+		iter->done = 1;
+
+	return slot;
+}
+EXPORT_SYMBOL(radix_tree_iter_next);
+
+/**
+ *	radix_tree_gang_lookup_tag - perform multiple lookup on a radix tree
+ *				     based on a tag
+ *	@root:		radix tree root
+ *	@results:	where the results of the lookup are placed
+ *	@first_index:	start the lookup from this key
+ *	@max_items:	place up to this many items at *results
+ *	@tag:		the tag index (< RADIX_TREE_MAX_TAGS)
+ *
+ *	Performs an index-ascending scan of the tree for present items which
+ *	have the tag indexed by @tag set.  Places the items at *@results and
+ *	returns the number of items which were placed at *@results.
+ */
+unsigned int
+radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results,
+		unsigned long first_index, unsigned int max_items,
+		unsigned int tag)
+{
+	struct radix_tree_iter iter;
+	unsigned int ret = 0;
+	void **slot;
+
+	BUG_ON(tag >= RADIX_TREE_MAX_TAGS);
+
+	if (!max_items)
+		return 0;
+
+	radix_tree_for_each_tagged(slot, root, &iter, first_index, tag) {
+		void *item = rcu_dereference(*slot);
+
+		if (!item)
+			continue;
+		results[ret] = indirect_to_ptr(item);
+		if (++ret == max_items)
+			break;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL(radix_tree_gang_lookup_tag);
+
+/*
+ * Upper bound on the nodes an insertion of [first, last] may need, once
+ * the tree is @height high: the nodes covering the range at each level,
+ * plus those for growing the tree to that height.
+ */
+static unsigned long radix_tree_range_nodes(struct radix_tree_root *root,
+		unsigned long first, unsigned long last, unsigned int height)
+{
+	unsigned long nr = 0;
+	unsigned int level;
+
+	for (level = 1; level <= height; level++) {
+		unsigned int shift = level * RADIX_TREE_MAP_SHIFT;
+
+		if (shift >= BITS_PER_LONG)
+			nr++;
+		else
+			nr += (last >> shift) - (first >> shift) + 1;
+	}
+
+	if (root->rnode && height > root->height)
+		nr += height - root->height;
+
+	return nr;
+}
+
+/**
+ *	radix_tree_insert_range - insert a range of items
+ *	@root:		radix tree root
+ *	@first:		index of the first item
+ *	@nr:		number of items
+ *	@items:		the items, @items[i] going to index @first + i
+ *
+ *	All nodes which may be needed are allocated before the tree is
+ *	touched, and each bottom-level node is filled in one go rather than
+ *	descending the tree for every index.  On error the tree is left with
+ *	the items it had, and no taller than it was.
+ */
+int radix_tree_insert_range(struct radix_tree_root *root,
+			unsigned long first, unsigned long nr, void **items)
+{
+	struct radix_tree_preload pl = { NULL, 0 };
+	unsigned long last = first + nr - 1, index;
+	unsigned int height, old_height = root->height;
+	int error;
+
+	if (!nr)
+		return 0;
+	if (last < first)
+		return -EINVAL;
+	if (nr == 1)
+		return radix_tree_insert(root, first, items[0]);
+
+	/* More than one index: the tree will have at least one level. */
+	height = max(root->height, 1U);
+	while (last > radix_tree_maxindex(height))
+		height++;
+
+	error = radix_tree_preload_fill(root, &pl,
+			radix_tree_range_nodes(root, first, last, height));
+	if (error)
+		goto out;
+
+	if (last > radix_tree_maxindex(root->height)) {
+		error = radix_tree_extend(root, last, &pl);
+		BUG_ON(error);
+	}
+
+	for (index = first; ; ) {
+		struct radix_tree_node *node = NULL, *slot;
+		unsigned int shift;
+		int offset = 0;
+
+		/* Walk down to (and create) the bottom-level node. */
+		slot = indirect_to_ptr(root->rnode);
+		height = root->height;
+		shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+		while (height > 0) {
+			if (slot == NULL) {
+				slot = radix_tree_node_get(root, &pl);
+				slot->height = height;
+				if (node) {
+					rcu_assign_pointer(node->slots[offset],
+							   slot);
+					node->count++;
+				} else
+					rcu_assign_pointer(root->rnode,
+							   ptr_to_indirect(slot));
+			}
+			offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+			node = slot;
+			slot = height > 1 ? node->slots[offset] : NULL;
+			shift -= RADIX_TREE_MAP_SHIFT;
+			height--;
+		}
+
+		/* Fill it. */
+		for ( ; ; offset++, index++) {
+			if (node->slots[offset] != NULL) {
+				error = -EEXIST;
+				if (index != first)
+					radix_tree_delete_range(root, first,
+							index - first, NULL);
+				/*
+				 * The nodes added for the range went with its
+				 * items; drop the levels radix_tree_extend()
+				 * added on top, whose only child is slot 0.
+				 */
+				if (root->height > old_height)
+					radix_tree_shrink(root, old_height);
+				goto out;
+			}
+			node->count++;
+			rcu_assign_pointer(node->slots[offset],
+					   items[index - first]);
+			if (index == last)
+				goto out;
+			if (offset == RADIX_TREE_MAP_MASK)
+				break;
+		}
+		index++;
+	}
+
+out:
+	radix_tree_preload_drain(root, &pl);
+	return error;
+}
+EXPORT_SYMBOL(radix_tree_insert_range);
+
+/**
+ *	radix_tree_delete_range - delete a range of items
+ *	@root:		radix tree root
+ *	@first:		first index of the range
+ *	@nr:		length of the range
+ *	@slot_free:	called for each item removed, if non-NULL
+ *
+ *	Only present items are visited: empty parts of the range are skipped
+ *	a whole subtree at a time.
+ */
+unsigned long radix_tree_delete_range(struct radix_tree_root *root,
+			unsigned long first, unsigned long nr,
+			void (*slot_free)(void *))
+{
+	unsigned long last = first + nr - 1, deleted = 0;
+	struct radix_tree_iter iter;
+	void **slot;
+
+	if (!nr)
+		return 0;
+	if (last < first)
+		last = ~0UL;
+
+	radix_tree_for_each_slot(slot, root, &iter, first) {
+		void *item;
+
+		if (iter.index > last)
+			break;
+		item = radix_tree_delete(root, iter.index);
+		if (item && slot_free)
+			slot_free(item);
+		deleted++;
+	}
+
+	return deleted;
+}
+EXPORT_SYMBOL(radix_tree_delete_range);
+
 static void
 radix_tree_node_destroy(
 	struct radix_tree_root *root, struct radix_tree_node *node,
@@ -746,14 +1327,18 @@ static __init unsigned long __maxindex(unsigned int height)
 	return ~0UL >> shift;
 }
 
-static __init int radix_tree_init_maxindex(void)
+static __init int radix_tree_setup(void)
 {
 	unsigned int i;
 
 	for (i = 0; i < ARRAY_SIZE(height_to_maxindex); i++)
 		height_to_maxindex[i] = __maxindex(i);
 
+	rcu_node_cache = xmem_cache_create_type("radix-tree node",
+						struct rcu_node);
+	BUG_ON(!rcu_node_cache);
+
 	return 0;
 }
 /* pre-SMP just so it runs before 'normal' initcalls */
-presmp_initcall(radix_tree_init_maxindex);
+presmp_initcall(radix_tree_setup);
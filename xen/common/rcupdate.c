@@ -45,6 +45,7 @@
 #include <xen/softirq.h>
 #include <xen/cpu.h>
 #include <xen/stop_machine.h>
+#include <xen/timer.h>
 
 /* Global control variables for rcupdate callback mechanism. */
 static struct rcu_ctrlblk {
@@ -55,6 +56,8 @@ static struct rcu_ctrlblk {
     spinlock_t  lock __cacheline_aligned;
     cpumask_t   cpumask; /* CPUs that need to switch in order    */
     /* for current batch to proceed.        */
+    cpumask_t   idle_cpumask; /* CPUs in tickless idle, which are  */
+    /* in an extended quiescent state.          */
 } __cacheline_aligned rcu_ctrlblk = {
     .cur = -300,
     .completed = -300,
@@ -84,6 +87,17 @@ struct rcu_data {
     int cpu;
     struct rcu_head barrier;
     long            last_rs_qlen;     /* qlen during the last resched */
+
+    /* 3) callbacks handed over by idle cpus, see rcu_idle_enter() */
+    spinlock_t      offload_lock;
+    struct rcu_head *offlist;
+    struct rcu_head **offtail;
+    long            offqlen;
+
+    /* 4) wakeups of an idle cpu which kept its callbacks */
+    struct timer    idle_timer;
+    bool_t          idle_timer_active;
+    s_time_t        idle_timer_period;
 };
 
 static DEFINE_PER_CPU(struct rcu_data, rcu_data);
@@ -93,6 +107,35 @@ static int qhimark = 10000;
 static int qlowmark = 100;
 static int rsinterval = 1000;
 
+/*
+ * CPUs which take over the callbacks of other CPUs entering tickless idle
+ * ("rcu_housekeeping=<cpu list>"). Offloading is disabled if empty.
+ */
+static cpumask_t __read_mostly rcu_housekeeping;
+
+static void __init parse_rcu_housekeeping(const char *s)
+{
+    do {
+        unsigned long first = simple_strtoul(s, &s, 0), last = first;
+
+        if ( *s == '-' )
+            last = simple_strtoul(s + 1, &s, 0);
+        for ( ; first <= last && first < NR_CPUS; first++ )
+            cpumask_set_cpu(first, &rcu_housekeeping);
+    } while ( *s++ == ',' );
+}
+custom_param("rcu_housekeeping", parse_rcu_housekeeping);
+
+/*
+ * An idle CPU which keeps callbacks wakes up after this long to push them
+ * along. The period adapts between the bounds to how quickly grace periods
+ * complete, so that callbacks are batched over fewer wakeups.
+ */
+#define RCU_IDLE_TIMER_PERIOD_MIN  MICROSECS(500)
+#define RCU_IDLE_TIMER_PERIOD_MAX  MILLISECS(100)
+static unsigned int __read_mostly rcu_idle_timer_period_ms = 10;
+integer_param("rcu_idle_timer_period_ms", rcu_idle_timer_period_ms);
+
 struct rcu_barrier_data {
     struct rcu_head head;
     atomic_t *cpu_count;
@@ -255,7 +298,15 @@ static void rcu_start_batch(struct rcu_ctrlblk *rcp)
         smp_wmb();
         rcp->cur++;
 
-        cpumask_copy(&rcp->cpumask, &cpu_online_map);
+        /*
+         * CPUs in tickless idle don't hold any RCU read-side critical
+         * section, and can be left out. Pairs with the smp_mb() in
+         * rcu_idle_{enter,exit}().
+         */
+        smp_mb();
+        cpumask_andnot(&rcp->cpumask, &cpu_online_map, &rcp->idle_cpumask);
+        if (cpumask_empty(&rcp->cpumask))
+            rcp->completed = rcp->cur;
     }
 }
 
@@ -316,6 +367,19 @@ static void rcu_check_quiescent_state(struct rcu_ctrlblk *rcp,
 static void __rcu_process_callbacks(struct rcu_ctrlblk *rcp,
                                     struct rcu_data *rdp)
 {
+    if (rdp->offlist) {
+        local_irq_disable();
+        spin_lock(&rdp->offload_lock);
+        *rdp->nxttail = rdp->offlist;
+        rdp->nxttail = rdp->offtail;
+        rdp->qlen += rdp->offqlen;
+        rdp->offlist = NULL;
+        rdp->offtail = &rdp->offlist;
+        rdp->offqlen = 0;
+        spin_unlock(&rdp->offload_lock);
+        local_irq_enable();
+    }
+
     if (rdp->curlist && !rcu_batch_before(rcp->completed, rdp->batch)) {
         *rdp->donetail = rdp->curlist;
         rdp->donetail = rdp->curtail;
@@ -378,6 +442,10 @@ static int __rcu_pending(struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
     if (rdp->donelist)
         return 1;
 
+    /* Other cpus handed their callbacks over to this one */
+    if (rdp->offlist)
+        return 1;
+
     /* The rcu core waits for a quiescent state from the cpu */
     if (rdp->quiescbatch != rcp->cur || rdp->qs_pending)
         return 1;
@@ -404,6 +472,146 @@ int rcu_needs_cpu(int cpu)
     return (!!rdp->curlist || rcu_pending(cpu));
 }
 
+/* Pick a housekeeping cpu to take over @cpu's callbacks, if there is one. */
+static unsigned int rcu_offload_target(unsigned int cpu)
+{
+    unsigned int target, fallback = nr_cpu_ids;
+
+    if (cpumask_test_cpu(cpu, &rcu_housekeeping))
+        return nr_cpu_ids;
+
+    /* Prefer a cpu which is awake anyway. */
+    for_each_cpu(target, &rcu_housekeeping) {
+        if (!cpu_online(target))
+            continue;
+        if (!cpumask_test_cpu(target, &rcu_ctrlblk.idle_cpumask))
+            return target;
+        if (fallback >= nr_cpu_ids)
+            fallback = target;
+    }
+
+    return fallback;
+}
+
+static void rcu_offload_callbacks(struct rcu_data *rdp, unsigned int target)
+{
+    struct rcu_data *tdp = &per_cpu(rcu_data, target);
+    struct rcu_head *list = NULL, **tail = &list;
+    long qlen;
+
+    /*
+     * Grace periods only ever get longer by moving callbacks to a later
+     * batch, so all three lists can go on the target's nxtlist.
+     */
+    local_irq_disable();
+    if (rdp->donelist) {
+        *tail = rdp->donelist;
+        tail = rdp->donetail;
+    }
+    if (rdp->curlist) {
+        *tail = rdp->curlist;
+        tail = rdp->curtail;
+    }
+    if (rdp->nxtlist) {
+        *tail = rdp->nxtlist;
+        tail = rdp->nxttail;
+    }
+    rdp->donelist = rdp->curlist = rdp->nxtlist = NULL;
+    rdp->donetail = &rdp->donelist;
+    rdp->curtail = &rdp->curlist;
+    rdp->nxttail = &rdp->nxtlist;
+    qlen = rdp->qlen;
+    rdp->qlen = 0;
+    local_irq_enable();
+
+    if (!list)
+        return;
+
+    spin_lock_irq(&tdp->offload_lock);
+    *tdp->offtail = list;
+    tdp->offtail = tail;
+    tdp->offqlen += qlen;
+    spin_unlock_irq(&tdp->offload_lock);
+
+    cpu_raise_softirq(target, RCU_SOFTIRQ);
+}
+
+static void rcu_idle_timer_handler(void *data)
+{
+    struct rcu_data *rdp = data;
+
+    /*
+     * Nothing to do beyond having woken the cpu up. If the batch we were
+     * waiting for still hasn't completed, back off; otherwise wake up
+     * sooner next time.
+     */
+    rdp->idle_timer_active = 0;
+    if (rdp->curlist &&
+        rcu_batch_before(rcu_ctrlblk.completed, rdp->batch))
+        rdp->idle_timer_period = min_t(s_time_t, rdp->idle_timer_period * 2,
+                                       RCU_IDLE_TIMER_PERIOD_MAX);
+    else
+        rdp->idle_timer_period = max_t(s_time_t, rdp->idle_timer_period / 2,
+                                       RCU_IDLE_TIMER_PERIOD_MIN);
+}
+
+/*
+ * Called by a cpu about to enter tickless idle. From here on it is not
+ * waited for by new grace periods, and if housekeeping cpus are configured
+ * its callbacks are handed over to one of them, so it can sleep for as long
+ * as it likes.
+ */
+void rcu_idle_enter(unsigned int cpu)
+{
+    struct rcu_ctrlblk *rcp = &rcu_ctrlblk;
+    struct rcu_data *rdp = &per_cpu(rcu_data, cpu);
+    unsigned int target;
+
+    ASSERT(cpu == smp_processor_id());
+
+    cpumask_set_cpu(cpu, &rcp->idle_cpumask);
+    smp_mb();
+
+    /*
+     * Idle is a quiescent state, so don't hold up a grace period already
+     * waiting for us. Racing with the start of one just delays it until
+     * we next wake up.
+     */
+    if (cpumask_test_cpu(cpu, &rcp->cpumask)) {
+        spin_lock(&rcp->lock);
+        if (cpumask_test_cpu(cpu, &rcp->cpumask)) {
+            rdp->quiescbatch = rcp->cur;
+            rdp->qs_pending = 0;
+            cpu_quiet(cpu, rcp);
+        }
+        spin_unlock(&rcp->lock);
+    }
+
+    target = rcu_offload_target(cpu);
+    if (target < nr_cpu_ids)
+        rcu_offload_callbacks(rdp, target);
+    else if (rdp->curlist || rdp->nxtlist || rdp->donelist) {
+        rdp->idle_timer_active = 1;
+        set_timer(&rdp->idle_timer, NOW() + rdp->idle_timer_period);
+    }
+}
+
+void rcu_idle_exit(unsigned int cpu)
+{
+    struct rcu_data *rdp = &per_cpu(rcu_data, cpu);
+
+    ASSERT(cpu == smp_processor_id());
+
+    cpumask_clear_cpu(cpu, &rcu_ctrlblk.idle_cpumask);
+    /* Order the above against any subsequent RCU read-side accesses. */
+    smp_mb();
+
+    if (rdp->idle_timer_active) {
+        stop_timer(&rdp->idle_timer);
+        rdp->idle_timer_active = 0;
+    }
+}
+
 void rcu_check_callbacks(int cpu)
 {
     raise_softirq(RCU_SOFTIRQ);
@@ -422,6 +630,9 @@ static void rcu_move_batch(struct rcu_data *this_rdp, struct rcu_head *list,
 static void rcu_offline_cpu(struct rcu_data *this_rdp,
                             struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
 {
+    struct rcu_head *offlist, **offtail;
+    long offqlen;
+
     /* If the cpu going offline owns the grace period we can block
      * indefinitely waiting for it, so flush it here.
      */
@@ -434,9 +645,22 @@ static void rcu_offline_cpu(struct rcu_data *this_rdp,
     rcu_move_batch(this_rdp, rdp->curlist, rdp->curtail);
     rcu_move_batch(this_rdp, rdp->nxtlist, rdp->nxttail);
 
+    spin_lock_irq(&rdp->offload_lock);
+    offlist = rdp->offlist;
+    offtail = rdp->offtail;
+    offqlen = rdp->offqlen;
+    rdp->offlist = NULL;
+    rdp->offtail = &rdp->offlist;
+    rdp->offqlen = 0;
+    spin_unlock_irq(&rdp->offload_lock);
+    rcu_move_batch(this_rdp, offlist, offtail);
+
     local_irq_disable();
-    this_rdp->qlen += rdp->qlen;
+    this_rdp->qlen += rdp->qlen + offqlen;
     local_irq_enable();
+
+    cpumask_clear_cpu(rdp->cpu, &rcp->idle_cpumask);
+    kill_timer(&rdp->idle_timer);
 }
 
 static void rcu_init_percpu_data(int cpu, struct rcu_ctrlblk *rcp,
@@ -450,6 +674,12 @@ static void rcu_init_percpu_data(int cpu, struct rcu_ctrlblk *rcp,
     rdp->qs_pending = 0;
     rdp->cpu = cpu;
     rdp->blimit = blimit;
+    spin_lock_init(&rdp->offload_lock);
+    rdp->offtail = &rdp->offlist;
+    init_timer(&rdp->idle_timer, rcu_idle_timer_handler, rdp, cpu);
+    rdp->idle_timer_period = max_t(s_time_t, RCU_IDLE_TIMER_PERIOD_MIN,
+                                   min_t(s_time_t, RCU_IDLE_TIMER_PERIOD_MAX,
+                                         MILLISECS(rcu_idle_timer_period_ms)));
 }
 
 static int cpu_callback(
@@ -605,11 +605,53 @@ unsigned int get_vcpu_migration_delay(void)
     return vcpu_migration_delay;
 }
 
+/*
+ * Steal distance, as seen from the CPU doing the stealing.  Load balancing
+ * looks for work at each distance in turn, nearest first.
+ */
+#define CSCHED_STEAL_SIBLING    0   /* SMT thread of the same core */
+#define CSCHED_STEAL_LLC        1   /* shares the last level cache */
+#define CSCHED_STEAL_NODE       2   /* same NUMA node */
+#define CSCHED_STEAL_REMOTE     3
+#define CSCHED_STEAL_NR         4
+
+/*
+ * Runnable vCPUs that must be waiting on a peer's runq, at higher priority
+ * than what we would run otherwise, before we steal from it.  Moving work
+ * away from its cache or memory only pays when the peer is overloaded by
+ * more than one vCPU.
+ */
+static const unsigned int csched_steal_imbalance[CSCHED_STEAL_NR] = {
+    1, 1, 2, 2
+};
+
+/*
+ * vcpu_migration_delay multiplier: SMT siblings share every cache level,
+ * so there is nothing to keep warm.
+ */
+static const unsigned int csched_steal_delay_scale[CSCHED_STEAL_NR] = {
+    0, 1, 2, 4
+};
+
+static inline unsigned int
+csched_steal_distance(unsigned int cpu, unsigned int peer_cpu)
+{
+    if ( cpumask_test_cpu(peer_cpu, per_cpu(cpu_sibling_mask, cpu)) )
+        return CSCHED_STEAL_SIBLING;
+    if ( cpu_to_llc(peer_cpu) == cpu_to_llc(cpu) &&
+         cpumask_test_cpu(peer_cpu, per_cpu(cpu_core_mask, cpu)) )
+        return CSCHED_STEAL_LLC;
+    if ( cpu_to_node(peer_cpu) == cpu_to_node(cpu) )
+        return CSCHED_STEAL_NODE;
+    return CSCHED_STEAL_REMOTE;
+}
+
 static inline int
-__csched_vcpu_is_cache_hot(struct vcpu *v)
+__csched_vcpu_is_cache_hot(struct vcpu *v, unsigned int distance)
 {
     int hot = ((NOW() - v->last_run_time) <
-               ((uint64_t)vcpu_migration_delay * 1000u));
+               ((uint64_t)vcpu_migration_delay * 1000u *
+                csched_steal_delay_scale[distance]));
 
     if ( hot )
         SCHED_STAT_CRANK(vcpu_hot);
@@ -618,7 +660,8 @@ __csched_vcpu_is_cache_hot(struct vcpu *v)
 }
 
 static inline int
-__csched_vcpu_is_migrateable(struct vcpu *vc, int dest_cpu, cpumask_t *mask)
+__csched_vcpu_is_migrateable(struct vcpu *vc, int dest_cpu, cpumask_t *mask,
+                             unsigned int distance)
 {
     /*
      * Don't pick up work that's in the peer's scheduling tail or hot on
@@ -626,7 +669,7 @@ __csched_vcpu_is_migrateable(struct vcpu *vc, int dest_cpu, cpumask_t *mask)
      * on our CPU.
      */
     return !vc->is_running &&
-           !__csched_vcpu_is_cache_hot(vc) &&
+           !__csched_vcpu_is_cache_hot(vc, distance) &&
            cpumask_test_cpu(dest_cpu, mask);
 }
 
@@ -1445,7 +1488,8 @@ csched_tick(void *_cpu)
 }
 
 static struct csched_vcpu *
-csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step)
+csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step,
+                  unsigned int distance)
 {
     const struct csched_pcpu * const peer_pcpu = CSCHED_PCPU(peer_cpu);
     const struct vcpu * const peer_vcpu = curr_on_cpu(peer_cpu);
@@ -1459,6 +1503,21 @@ csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step)
      */
     if ( peer_pcpu != NULL && !is_idle_vcpu(peer_vcpu) )
     {
+        unsigned int waiting = 0;
+
+        /* Is the peer overloaded enough to be worth stealing from? */
+        list_for_each( iter, &peer_pcpu->runq )
+        {
+            if ( __runq_elem(iter)->pri <= pri ||
+                 ++waiting >= csched_steal_imbalance[distance] )
+                break;
+        }
+        if ( waiting < csched_steal_imbalance[distance] )
+        {
+            SCHED_STAT_CRANK(steal_too_balanced);
+            return NULL;
+        }
+
         list_for_each( iter, &peer_pcpu->runq )
         {
             speer = __runq_elem(iter);
@@ -1491,7 +1550,8 @@ csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step)
                 continue;
 
             csched_balance_cpumask(vc, balance_step, csched_balance_mask);
-            if ( __csched_vcpu_is_migrateable(vc, cpu, csched_balance_mask) )
+            if ( __csched_vcpu_is_migrateable(vc, cpu, csched_balance_mask,
+                                              distance) )
             {
                 /* We got a candidate. Grab it! */
                 TRACE_3D(TRC_CSCHED_STOLEN_VCPU, peer_cpu,
@@ -1517,8 +1577,8 @@ csched_load_balance(struct csched_private *prv, int cpu,
     struct csched_vcpu *speer;
     cpumask_t workers;
     cpumask_t *online;
-    int peer_cpu, peer_node, bstep;
-    int node = cpu_to_node(cpu);
+    int peer_cpu, bstep;
+    unsigned int distance;
 
     BUG_ON( cpu != snext->vcpu->processor );
     online = cpupool_scheduler_cpumask(per_cpu(cpupool, cpu));
@@ -1544,25 +1604,25 @@ csched_load_balance(struct csched_private *prv, int cpu,
     for_each_csched_balance_step( bstep )
     {
         /*
-         * We peek at the non-idling CPUs in a node-wise fashion. In fact,
-         * it is more likely that we find some node-affine work on our same
-         * node, not to mention that migrating vcpus within the same node
-         * could well expected to be cheaper than across-nodes (memory
-         * stays local, there might be some node-wide cache[s], etc.).
+         * Within each step, peers are visited by topological distance:
+         * SMT siblings, then CPUs sharing our LLC, then the rest of our
+         * node, then remote nodes. Taking work from nearby is cheaper
+         * (warm caches, local memory), and the farther peers also need a
+         * bigger imbalance before csched_runq_steal() will take from them.
          */
-        peer_node = node;
-        do
+        for ( distance = 0; distance < CSCHED_STEAL_NR; distance++ )
         {
-            /* Find out what the !idle are in this node */
+            /* Find out what the !idle are */
             cpumask_andnot(&workers, online, prv->idlers);
-            cpumask_and(&workers, &workers, &node_to_cpumask(peer_node));
             cpumask_clear_cpu(cpu, &workers);
 
-            peer_cpu = cpumask_first(&workers);
-            if ( peer_cpu >= nr_cpu_ids )
-                goto next_node;
-            do
+            for_each_cpu ( peer_cpu, &workers )
             {
+                spinlock_t *lock;
+
+                if ( csched_steal_distance(cpu, peer_cpu) != distance )
+                    continue;
+
                 /*
                  * Get ahold of the scheduler lock for this peer CPU.
                  *
@@ -1570,18 +1630,18 @@ csched_load_balance(struct csched_private *prv, int cpu,
                  * could cause a deadlock if the peer CPU is also load
                  * balancing and trying to lock this CPU.
                  */
-                spinlock_t *lock = pcpu_schedule_trylock(peer_cpu);
+                lock = pcpu_schedule_trylock(peer_cpu);
 
                 if ( !lock )
                 {
                     SCHED_STAT_CRANK(steal_trylock_failed);
-                    peer_cpu = cpumask_cycle(peer_cpu, &workers);
                     continue;
                 }
 
                 /* Any work over there to steal? */
                 speer = cpumask_test_cpu(peer_cpu, online) ?
-                    csched_runq_steal(peer_cpu, cpu, snext->pri, bstep) : NULL;
+                    csched_runq_steal(peer_cpu, cpu, snext->pri, bstep,
+                                      distance) : NULL;
                 pcpu_schedule_unlock(lock, peer_cpu);
 
                 /* As soon as one vcpu is found, balancing ends */
@@ -1590,14 +1650,8 @@ csched_load_balance(struct csched_private *prv, int cpu,
                     *stolen = 1;
                     return speer;
                 }
-
-                peer_cpu = cpumask_cycle(peer_cpu, &workers);
-
-            } while( peer_cpu != cpumask_first(&workers) );
-
- next_node:
-            peer_node = cycle_node(peer_node, node_online_map);
-        } while( peer_node != node );
+            }
+        }
     }
 
  out:
@@ -193,6 +193,39 @@ int opt_underload_balance_tolerance=0;
 integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 int opt_overload_balance_tolerance=-3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
+/*
+ * Cost charged for each level of topology distance a migration crosses,
+ * as a shift of the load of one fully busy vcpu (like the tolerances above).
+ */
+int opt_balance_distance_cost=-3;
+integer_param("credit2_balance_distance", opt_balance_distance_cost);
+
+/*
+ * Runqueue layout: CPUs no further apart than this (see cpu_distance())
+ * share a runqueue.
+ */
+static unsigned int __read_mostly opt_runqueue = XEN_SYSCTL_CSCHED2_RUNQ_SOCKET;
+static const char *const runqueue_names[] = {
+    [XEN_SYSCTL_CSCHED2_RUNQ_CORE]   = "core",
+    [XEN_SYSCTL_CSCHED2_RUNQ_LLC]    = "llc",
+    [XEN_SYSCTL_CSCHED2_RUNQ_SOCKET] = "socket",
+    [XEN_SYSCTL_CSCHED2_RUNQ_NODE]   = "node",
+};
+
+static void __init parse_credit2_runqueue(char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(runqueue_names); i++ )
+        if ( !strcmp(s, runqueue_names[i]) )
+        {
+            opt_runqueue = i;
+            return;
+        }
+
+    printk("WARNING, unrecognized value of credit2_runqueue option!\n");
+}
+custom_param("credit2_runqueue", parse_credit2_runqueue);
 
 /*
  * Per-runqueue data
@@ -229,6 +262,9 @@ struct csched_private {
     struct csched_runqueue_data rqd[NR_CPUS];
 
     int load_window_shift;
+    s_time_t distance_cost;  /* Balancing cost of one level of distance */
+    unsigned int runqueue;   /* XEN_SYSCTL_CSCHED2_RUNQ_* layout */
+    unsigned int nr_gang;    /* Domains in gang mode */
 };
 
 /*
@@ -267,6 +303,7 @@ struct csched_dom {
     struct domain *dom;
     uint16_t weight;
     uint16_t nr_vcpus;
+    bool_t gang;          /* Only share a core with our own vcpus */
 };
 
 
@@ -1152,6 +1189,35 @@ out_up:
     return new_cpu;
 }
 
+/*
+ * Topology distance between two cpus:
+ * 0 = same core, 1 = same LLC, 2 = same socket, 3 = same node, 4 = remote.
+ * The XEN_SYSCTL_CSCHED2_RUNQ_* layouts are the largest distance allowed
+ * between cpus sharing a runqueue.
+ */
+static unsigned int cpu_distance(unsigned int a, unsigned int b)
+{
+    if ( cpu_to_socket(a) == cpu_to_socket(b) )
+    {
+        if ( cpu_to_core(a) == cpu_to_core(b) )
+            return 0;
+        if ( cpu_to_llc(a) == cpu_to_llc(b) )
+            return 1;
+        return 2;
+    }
+
+    return cpu_to_node(a) == cpu_to_node(b) ? 3 : 4;
+}
+
+/* Load-balancing cost of moving a vcpu between two (locked) runqueues. */
+static s_time_t migrate_cost(const struct csched_private *prv,
+                             const struct csched_runqueue_data *a,
+                             const struct csched_runqueue_data *b)
+{
+    return cpu_distance(cpumask_first(&a->active),
+                        cpumask_first(&b->active)) * prv->distance_cost;
+}
+
 /* Working state of the load-balancing algorithm */
 typedef struct {
     /* NB: Modified by consider() */
@@ -1160,6 +1226,7 @@ typedef struct {
     /* NB: Read by consider() */
     struct csched_runqueue_data *lrqd;
     struct csched_runqueue_data *orqd;                  
+    s_time_t migrate_cost;  /* Charged for each vcpu moved */
 } balance_state_t;
 
 static void consider(balance_state_t *st, 
@@ -1187,6 +1254,12 @@ static void consider(balance_state_t *st,
     if ( delta < 0 )
         delta = -delta;
 
+    /* Moving vcpus further away costs more (cold caches, remote memory). */
+    if ( push_svc )
+        delta += st->migrate_cost;
+    if ( pull_svc )
+        delta += st->migrate_cost;
+
     if ( delta < st->load_delta )
     {
         st->load_delta = delta;
@@ -1239,6 +1312,7 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 {
     struct csched_private *prv = CSCHED_PRIV(ops);
     int i, max_delta_rqi = -1;
+    s_time_t max_gain;
     struct list_head *push_iter, *pull_iter;
 
     balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
@@ -1262,10 +1336,11 @@ retry:
         return;
 
     st.load_delta = 0;
+    max_gain = 0;
 
     for_each_cpu(i, &prv->active_queues)
     {
-        s_time_t delta;
+        s_time_t delta, cost;
         
         st.orqd = prv->rqd + i;
 
@@ -1279,9 +1354,13 @@ retry:
         if ( delta < 0 )
             delta = -delta;
 
-        if ( delta > st.load_delta )
+        /* Prefer closer runqueues: weigh the imbalance by the distance. */
+        cost = migrate_cost(prv, st.lrqd, st.orqd);
+        if ( delta - cost > max_gain )
         {
+            max_gain = delta - cost;
             st.load_delta = delta;
+            st.migrate_cost = cost;
             max_delta_rqi = i;
         }
 
@@ -1311,11 +1390,11 @@ retry:
          * is > 1.  otherwise, shift if under 12.5% */
         if ( load_max < (1ULL<<(prv->load_window_shift))*cpus_max )
         {
-            if ( st.load_delta < (1ULL<<(prv->load_window_shift+opt_underload_balance_tolerance) ) )
+            if ( max_gain < (1ULL<<(prv->load_window_shift+opt_underload_balance_tolerance) ) )
                  goto out;
         }
         else
-            if ( st.load_delta < (1ULL<<(prv->load_window_shift+opt_overload_balance_tolerance)) )
+            if ( max_gain < (1ULL<<(prv->load_window_shift+opt_overload_balance_tolerance)) )
                 goto out;
     }
              
@@ -1436,6 +1515,7 @@ csched_dom_cntl(
     if ( op->cmd == XEN_DOMCTL_SCHEDOP_getinfo )
     {
         op->u.credit2.weight = sdom->weight;
+        op->u.credit2.gang = sdom->gang;
     }
     else
     {
@@ -1469,6 +1549,15 @@ csched_dom_cntl(
                 vcpu_schedule_unlock(lock, svc->vcpu);
             }
         }
+
+        if ( !!op->u.credit2.gang != sdom->gang )
+        {
+            sdom->gang = !!op->u.credit2.gang;
+            if ( sdom->gang )
+                prv->nr_gang++;
+            else
+                prv->nr_gang--;
+        }
     }
 
     spin_unlock_irqrestore(&prv->lock, flags);
@@ -1530,6 +1619,8 @@ csched_free_domdata(const struct scheduler *ops, void *data)
     spin_lock_irqsave(&CSCHED_PRIV(ops)->lock, flags);
 
     list_del_init(&sdom->sdom_elem);
+    if ( sdom->gang )
+        CSCHED_PRIV(ops)->nr_gang--;
 
     spin_unlock_irqrestore(&CSCHED_PRIV(ops)->lock, flags);
 
@@ -1605,19 +1696,112 @@ csched_runtime(const struct scheduler *ops, int cpu, struct csched_vcpu *snext)
 
 void __dump_execstate(void *unused);
 
+/*
+ * Gang mode.
+ *
+ * A vcpu of a gang domain only shares a core with vcpus of its own
+ * domain (or with idle), so that all of a small domain's vcpus tend to
+ * run at the same time on sibling threads, and no other domain ever
+ * runs on the same core alongside it.  When two siblings want to run
+ * incompatible vcpus, the one with more credit wins and the other is
+ * made to reschedule.
+ *
+ * Threads of a core always share a runqueue, whose lock protects all the
+ * sibling state looked at here.  Still, there is a window, between a
+ * vcpu being picked and the IPI reaching its siblings, during which
+ * incompatible vcpus may overlap.
+ */
+static inline bool_t
+gang_compatible(const struct csched_vcpu *a, const struct csched_vcpu *b)
+{
+    return is_idle_vcpu(b->vcpu) || a->sdom == b->sdom ||
+           (!a->sdom->gang && !b->sdom->gang);
+}
+
+/* Can svc run on cpu, without displacing a sibling with more credit? */
+static bool_t
+gang_admit(const struct csched_runqueue_data *rqd,
+           const struct csched_vcpu *svc, int cpu)
+{
+    int s;
+
+    for_each_cpu ( s, per_cpu(cpu_sibling_mask, cpu) )
+    {
+        const struct csched_vcpu *cur;
+
+        if ( s == cpu || !cpumask_test_cpu(s, &rqd->active) )
+            continue;
+
+        cur = CSCHED_VCPU(curr_on_cpu(s));
+        if ( !gang_compatible(svc, cur) && cur->credit >= svc->credit )
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Is a vcpu of svc's (gang) domain already running on a sibling of cpu? */
+static bool_t
+gang_running(const struct csched_runqueue_data *rqd,
+             const struct csched_vcpu *svc, int cpu)
+{
+    int s;
+
+    if ( !svc->sdom->gang )
+        return 0;
+
+    for_each_cpu ( s, per_cpu(cpu_sibling_mask, cpu) )
+        if ( s != cpu && cpumask_test_cpu(s, &rqd->active) &&
+             CSCHED_VCPU(curr_on_cpu(s))->sdom == svc->sdom )
+            return 1;
+
+    return 0;
+}
+
+/*
+ * snext is about to run on cpu: kick the siblings that must make room
+ * for it and, for a gang domain, the idle ones, so they can pick up
+ * more of its vcpus.
+ */
+static void
+gang_tickle(struct csched_runqueue_data *rqd,
+            const struct csched_vcpu *snext, int cpu)
+{
+    int s;
+
+    for_each_cpu ( s, per_cpu(cpu_sibling_mask, cpu) )
+    {
+        const struct csched_vcpu *cur;
+
+        if ( s == cpu || !cpumask_test_cpu(s, &rqd->active) ||
+             cpumask_test_cpu(s, &rqd->tickled) )
+            continue;
+
+        cur = CSCHED_VCPU(curr_on_cpu(s));
+        if ( gang_compatible(snext, cur) &&
+             !(snext->sdom->gang && is_idle_vcpu(cur->vcpu) &&
+               !list_empty(&rqd->runq)) )
+            continue;
+
+        cpumask_set_cpu(s, &rqd->tickled);
+        cpu_raise_softirq(s, SCHEDULE_SOFTIRQ);
+    }
+}
+
 /*
  * Find a candidate.
  */
 static struct csched_vcpu *
 runq_candidate(struct csched_runqueue_data *rqd,
                struct csched_vcpu *scurr,
-               int cpu, s_time_t now)
+               int cpu, s_time_t now, bool_t gang)
 {
     struct list_head *iter;
     struct csched_vcpu *snext = NULL;
 
     /* Default to current if runnable, idle otherwise */
-    if ( vcpu_runnable(scurr->vcpu) )
+    if ( vcpu_runnable(scurr->vcpu)
+         && (!gang || is_idle_vcpu(scurr->vcpu) || gang_admit(rqd, scurr, cpu)) )
         snext = scurr;
     else
         snext = CSCHED_VCPU(idle_vcpu[cpu]);
@@ -1627,9 +1811,16 @@ runq_candidate(struct csched_runqueue_data *rqd,
         struct csched_vcpu * svc = list_entry(iter, struct csched_vcpu, runq_elem);
 
         /* If this is on a different processor, don't pull it unless
-         * its credit is at least CSCHED_MIGRATE_RESIST higher. */
+         * its credit is at least CSCHED_MIGRATE_RESIST higher (or it
+         * is joining its gang on this core). */
         if ( svc->vcpu->processor != cpu
-             && snext->credit + CSCHED_MIGRATE_RESIST > svc->credit )
+             && snext->credit + CSCHED_MIGRATE_RESIST > svc->credit
+             && !(gang && gang_running(rqd, svc, cpu)) )
+            continue;
+
+        /* In gang mode, skip what can't share the core right now. */
+        if ( gang && svc->credit > snext->credit
+             && !gang_admit(rqd, svc, cpu) )
             continue;
 
         /* If the next one on the list has more credit than current
@@ -1658,6 +1849,7 @@ csched_schedule(
     struct csched_vcpu * const scurr = CSCHED_VCPU(current);
     struct csched_vcpu *snext = NULL;
     struct task_slice ret;
+    bool_t gang = !!CSCHED_PRIV(ops)->nr_gang;
 
     SCHED_STAT_CRANK(schedule);
     CSCHED_VCPU_CHECK(current);
@@ -1733,7 +1925,7 @@ csched_schedule(
         snext = CSCHED_VCPU(idle_vcpu[cpu]);
     }
     else
-        snext=runq_candidate(rqd, scurr, cpu, now);
+        snext=runq_candidate(rqd, scurr, cpu, now, gang);
 
     /* If switching from a non-idle runnable vcpu, put it
      * back on the runqueue. */
@@ -1786,6 +1978,9 @@ csched_schedule(
             snext->vcpu->processor = cpu;
             ret.migrated = 1;
         }
+
+        if ( gang )
+            gang_tickle(rqd, snext, cpu);
     }
     else
     {
@@ -1866,9 +2061,13 @@ csched_dump(const struct scheduler *ops)
     int i, loop;
 
     printk("Active queues: %d\n"
-           "\tdefault-weight     = %d\n",
+           "\tdefault-weight     = %d\n"
+           "\trunqueue layout    = %s\n"
+           "\tgang domains       = %u\n",
            cpumask_weight(&prv->active_queues),
-           CSCHED_DEFAULT_WEIGHT);
+           CSCHED_DEFAULT_WEIGHT,
+           runqueue_names[prv->runqueue],
+           prv->nr_gang);
     for_each_cpu(i, &prv->active_queues)
     {
         s_time_t fraction;
@@ -1896,10 +2095,11 @@ csched_dump(const struct scheduler *ops)
         struct csched_dom *sdom;
         sdom = list_entry(iter_sdom, struct csched_dom, sdom_elem);
 
-       printk("\tDomain: %d w %d v %d\n\t", 
+       printk("\tDomain: %d w %d v %d%s\n\t", 
               sdom->dom->domain_id, 
               sdom->weight, 
-              sdom->nr_vcpus);
+              sdom->nr_vcpus,
+              sdom->gang ? " gang" : "");
 
         list_for_each( iter_svc, &sdom->vcpu )
         {
@@ -1942,6 +2142,34 @@ static void deactivate_runqueue(struct csched_private *prv, int rqi)
     cpumask_clear_cpu(rqi, &prv->active_queues);
 }
 
+/*
+ * Find the runqueue for cpu: the first active one whose cpus are close
+ * enough for the layout, or else the first unused one.  Caller must hold
+ * prv->lock.
+ */
+static int cpu_to_runqueue(struct csched_private *prv, unsigned int cpu)
+{
+    int rqi, free_rqi = -1;
+
+    for ( rqi = 0; rqi < nr_cpu_ids; rqi++ )
+    {
+        struct csched_runqueue_data *rqd = prv->rqd + rqi;
+
+        if ( rqd->id < 0 )
+        {
+            if ( free_rqi < 0 )
+                free_rqi = rqi;
+            continue;
+        }
+
+        BUG_ON(cpumask_empty(&rqd->active));
+        if ( cpu_distance(cpu, cpumask_first(&rqd->active)) <= prv->runqueue )
+            return rqi;
+    }
+
+    return free_rqi;
+}
+
 static void init_pcpu(const struct scheduler *ops, int cpu)
 {
     int rqi;
@@ -1960,19 +2188,11 @@ static void init_pcpu(const struct scheduler *ops, int cpu)
     }
 
     /* Figure out which runqueue to put it in */
-    rqi = 0;
-
-    /* Figure out which runqueue to put it in */
-    /* NB: cpu 0 doesn't get a STARTING callback, so we hard-code it to runqueue 0. */
-    if ( cpu == 0 )
-        rqi = 0;
-    else
-        rqi = cpu_to_socket(cpu);
+    rqi = cpu_to_runqueue(prv, cpu);
 
     if ( rqi < 0 )
     {
-        printk("%s: cpu_to_socket(%d) returned %d!\n",
-               __func__, cpu, rqi);
+        printk("%s: no runqueue available for cpu %d!\n", __func__, cpu);
         BUG();
     }
 
@@ -2055,10 +2275,15 @@ csched_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
         deactivate_runqueue(prv, rqi);
     }
 
-    /* Move spinlock to the original lock.  */
-    ASSERT(sd->schedule_lock == &rqd->lock);
-    ASSERT(!spin_is_locked(&sd->_lock));
-    sd->schedule_lock = &sd->_lock;
+    /*
+     * Move spinlock to the original lock, unless the cpu's new scheduler
+     * has already remapped it.
+     */
+    if ( sd->schedule_lock == &rqd->lock )
+    {
+        ASSERT(!spin_is_locked(&sd->_lock));
+        sd->schedule_lock = &sd->_lock;
+    }
 
     spin_unlock(&rqd->lock);
 
@@ -2105,6 +2330,41 @@ static struct notifier_block cpu_credit2_nfb = {
     .notifier_call = cpu_credit2_callback
 };
 
+static int
+csched_sys_cntl(const struct scheduler *ops,
+                struct xen_sysctl_scheduler_op *sc)
+{
+    int rc = -EINVAL;
+    xen_sysctl_credit2_schedule_t *params = &sc->u.sched_credit2;
+    struct csched_private *prv = CSCHED_PRIV(ops);
+    unsigned long flags;
+
+    switch ( sc->cmd )
+    {
+    case XEN_SYSCTL_SCHEDOP_putinfo:
+        if ( params->runqueue >= ARRAY_SIZE(runqueue_names) )
+            goto out;
+        spin_lock_irqsave(&prv->lock, flags);
+        /* Populated runqueues can't be rearranged. */
+        if ( params->runqueue != prv->runqueue &&
+             !cpumask_empty(&prv->initialized) )
+        {
+            spin_unlock_irqrestore(&prv->lock, flags);
+            rc = -EBUSY;
+            goto out;
+        }
+        prv->runqueue = params->runqueue;
+        spin_unlock_irqrestore(&prv->lock, flags);
+        /* FALLTHRU */
+    case XEN_SYSCTL_SCHEDOP_getinfo:
+        params->runqueue = prv->runqueue;
+        rc = 0;
+        break;
+    }
+ out:
+    return rc;
+}
+
 static int
 csched_global_init(void)
 {
@@ -2125,6 +2385,8 @@ csched_init(struct scheduler *ops)
     printk(" load_window_shift: %d\n", opt_load_window_shift);
     printk(" underload_balance_tolerance: %d\n", opt_underload_balance_tolerance);
     printk(" overload_balance_tolerance: %d\n", opt_overload_balance_tolerance);
+    printk(" balance_distance_cost: %d\n", opt_balance_distance_cost);
+    printk(" runqueue layout: %s\n", runqueue_names[opt_runqueue]);
 
     if ( opt_load_window_shift < LOADAVG_WINDOW_SHIFT_MIN )
     {
@@ -2152,6 +2414,9 @@ csched_init(struct scheduler *ops)
     }
 
     prv->load_window_shift = opt_load_window_shift;
+    i = prv->load_window_shift + opt_balance_distance_cost;
+    prv->distance_cost = i < 0 ? 0 : 1LL << i;
+    prv->runqueue = opt_runqueue;
 
     return 0;
 }
@@ -2185,6 +2450,7 @@ const struct scheduler sched_credit2_def = {
     .wake           = csched_vcpu_wake,
 
     .adjust         = csched_dom_cntl,
+    .adjust_global  = csched_sys_cntl,
 
     .pick_cpu       = csched_cpu_pick,
     .migrate        = csched_vcpu_migrate,
@@ -0,0 +1,1046 @@
+/******************************************************************************
+ * Real-time deadline scheduler (RTDS)
+ *
+ *        File: common/sched_rt.c
+ *
+ * Description: Global EDF scheduler.  Each vCPU is a periodic server with
+ * a budget and a period: at the start of each period it gets its budget
+ * back, and a deadline at the end of the period.  Runnable vCPUs with
+ * budget left are run in deadline order on any pCPU of the pool; vCPUs
+ * that used up their budget wait for the next period.
+ *
+ * Admission control keeps the pool's reserved utilisation (the sum of
+ * budget/period over all its vCPUs) within its number of pCPUs, which is
+ * what bounds tardiness under global EDF.
+ */
+
+#include <xen/config.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/sched.h>
+#include <xen/domain.h>
+#include <xen/time.h>
+#include <xen/timer.h>
+#include <xen/sched-if.h>
+#include <xen/softirq.h>
+#include <xen/rbtree.h>
+#include <xen/errno.h>
+#include <xen/trace.h>
+
+/*
+ * RTDS tracing events. Check include/public/trace.h for more details.
+ */
+#define TRC_RTDS_TICKLE         TRC_SCHED_CLASS_EVT(RTDS, 1)
+#define TRC_RTDS_REPLENISH      TRC_SCHED_CLASS_EVT(RTDS, 2)
+#define TRC_RTDS_BUDGET_BURN    TRC_SCHED_CLASS_EVT(RTDS, 3)
+
+/* Default parameters of a new vCPU, in microseconds. */
+#define RTDS_DEFAULT_PERIOD     10000
+#define RTDS_DEFAULT_BUDGET     4000
+/* Smaller budgets would just make the scheduler timer fire all the time. */
+#define RTDS_MIN_BUDGET         10
+
+/* Utilisation (budget/period) is kept as a fixed-point fraction. */
+#define RTDS_UTIL_SHIFT         20
+
+/*
+ * Flags
+ */
+/* The vCPU's context hasn't been saved yet since it last ran. */
+#define __RTDS_scheduled        1
+#define RTDS_scheduled (1<<__RTDS_scheduled)
+/* Put the vCPU back on a queue once its context is saved. */
+#define __RTDS_delayed_runq_add 2
+#define RTDS_delayed_runq_add (1<<__RTDS_delayed_runq_add)
+
+/*
+ * Locking:
+ * - The scheduler-wide lock protects everything here, and is also the
+ *   schedule lock of all the pool's pCPUs: with a single global run queue,
+ *   per-pCPU locks would buy nothing.
+ */
+
+/*
+ * System-wide private data
+ */
+struct rt_private {
+    spinlock_t lock;
+    struct list_head sdom;      /* all domains in this pool */
+    struct rb_root runq;        /* runnable with budget, by deadline */
+    struct list_head depletedq; /* runnable without budget */
+    struct rb_root replq;       /* awake vCPUs, by next replenishment */
+    struct timer repl_timer;    /* fires at the first replenishment */
+    bool_t repl_timer_init;
+    cpumask_t cpus;             /* pCPUs of this scheduler */
+    cpumask_t tickled;          /* pCPUs about to reschedule */
+    uint64_t util;              /* reserved utilisation, fixed point */
+};
+
+/*
+ * Virtual CPU
+ */
+struct rt_vcpu {
+    struct list_head sdom_elem; /* on the domain's vCPU list */
+    struct rb_node runq_elem;   /* on runq */
+    struct list_head depletedq_elem; /* on depletedq */
+    struct rb_node replq_elem;  /* on replq */
+
+    struct vcpu *vcpu;
+    struct rt_dom *sdom;
+
+    /* Parameters, in ns. */
+    s_time_t period;
+    s_time_t budget;
+    uint64_t util;
+
+    /* Current period. */
+    s_time_t cur_budget;
+    s_time_t cur_deadline;
+    s_time_t last_start;        /* when it was last put on a pCPU */
+
+    unsigned flags;
+};
+
+/*
+ * Domain
+ */
+struct rt_dom {
+    struct list_head vcpu;      /* vCPUs of this domain */
+    struct list_head sdom_elem; /* on the scheduler's domain list */
+    struct domain *dom;
+};
+
+static inline struct rt_private *RT_PRIV(const struct scheduler *ops)
+{
+    return ops->sched_data;
+}
+
+static inline struct rt_vcpu *RT_VCPU(const struct vcpu *v)
+{
+    return v->sched_priv;
+}
+
+static inline struct rt_dom *RT_DOM(const struct domain *d)
+{
+    return d->sched_priv;
+}
+
+static inline uint64_t rt_util(s_time_t budget, s_time_t period)
+{
+    return ((uint64_t)budget << RTDS_UTIL_SHIFT) / period;
+}
+
+static inline uint64_t rt_capacity(const struct rt_private *prv)
+{
+    return (uint64_t)cpumask_weight(&prv->cpus) << RTDS_UTIL_SHIFT;
+}
+
+/*
+ * pCPUs a vCPU may run on.  prv->cpus alone isn't enough: when this is the
+ * default scheduler it also covers the pCPUs outside of any pool.
+ */
+static inline void
+rt_vcpu_cpus(const struct rt_private *prv, const struct vcpu *vc,
+             cpumask_t *mask)
+{
+    cpumask_and(mask, &prv->cpus, vc->cpu_affinity);
+    cpumask_and(mask, mask, cpupool_scheduler_cpumask(vc->domain->cpupool));
+}
+
+/*
+ * Queue helpers
+ */
+static inline int __vcpu_on_runq(const struct rt_vcpu *svc)
+{
+    return !RB_EMPTY_NODE(&svc->runq_elem);
+}
+
+static inline int __vcpu_on_depletedq(const struct rt_vcpu *svc)
+{
+    return !list_empty(&svc->depletedq_elem);
+}
+
+static inline int __vcpu_on_replq(const struct rt_vcpu *svc)
+{
+    return !RB_EMPTY_NODE(&svc->replq_elem);
+}
+
+/* Insert into a deadline-ordered tree; equal deadlines are FIFO. */
+static void
+deadline_insert(struct rb_root *root, struct rt_vcpu *svc,
+                size_t offset)
+{
+    struct rb_node **new = &root->rb_node, *parent = NULL;
+    struct rb_node *node = (void *)svc + offset;
+
+    while ( *new )
+    {
+        struct rt_vcpu *entry = (void *)*new - offset;
+
+        parent = *new;
+        if ( svc->cur_deadline < entry->cur_deadline )
+            new = &(*new)->rb_left;
+        else
+            new = &(*new)->rb_right;
+    }
+
+    rb_link_node(node, parent, new);
+    rb_insert_color(node, root);
+}
+
+static inline struct rt_vcpu *
+deadline_first(struct rb_root *root, size_t offset)
+{
+    struct rb_node *node = rb_first(root);
+
+    return node ? (void *)node - offset : NULL;
+}
+
+#define RUNQ_OFFSET  offsetof(struct rt_vcpu, runq_elem)
+#define REPLQ_OFFSET offsetof(struct rt_vcpu, replq_elem)
+
+static void
+__q_remove(struct rt_private *prv, struct rt_vcpu *svc)
+{
+    if ( __vcpu_on_runq(svc) )
+    {
+        rb_erase(&svc->runq_elem, &prv->runq);
+        RB_CLEAR_NODE(&svc->runq_elem);
+    }
+    else if ( __vcpu_on_depletedq(svc) )
+        list_del_init(&svc->depletedq_elem);
+}
+
+/* Queue a runnable vCPU according to whether it has budget left. */
+static void
+__q_insert(struct rt_private *prv, struct rt_vcpu *svc)
+{
+    ASSERT(!__vcpu_on_runq(svc) && !__vcpu_on_depletedq(svc));
+    ASSERT(!is_idle_vcpu(svc->vcpu));
+
+    if ( svc->cur_budget > 0 )
+        deadline_insert(&prv->runq, svc, RUNQ_OFFSET);
+    else
+        list_add_tail(&svc->depletedq_elem, &prv->depletedq);
+}
+
+static void
+replq_remove(struct rt_private *prv, struct rt_vcpu *svc)
+{
+    if ( !__vcpu_on_replq(svc) )
+        return;
+
+    rb_erase(&svc->replq_elem, &prv->replq);
+    RB_CLEAR_NODE(&svc->replq_elem);
+}
+
+/* (Re)queue for replenishment, and keep the timer at the first one due. */
+static void
+replq_insert(struct rt_private *prv, struct rt_vcpu *svc)
+{
+    struct rt_vcpu *first;
+
+    replq_remove(prv, svc);
+    deadline_insert(&prv->replq, svc, REPLQ_OFFSET);
+
+    first = deadline_first(&prv->replq, REPLQ_OFFSET);
+    if ( first == svc && prv->repl_timer_init )
+        set_timer(&prv->repl_timer, svc->cur_deadline);
+}
+
+/*
+ * Budget and deadline accounting
+ */
+
+/* Start a new period if the current one is over. */
+static void
+rt_update_deadline(struct rt_vcpu *svc, s_time_t now)
+{
+    s_time_t periods;
+
+    if ( now < svc->cur_deadline )
+        return;
+
+    periods = (now - svc->cur_deadline) / svc->period + 1;
+    svc->cur_deadline += periods * svc->period;
+    svc->cur_budget = svc->budget;
+}
+
+static void
+burn_budget(struct rt_vcpu *svc, s_time_t now)
+{
+    s_time_t delta;
+
+    if ( is_idle_vcpu(svc->vcpu) )
+        return;
+
+    delta = now - svc->last_start;
+    if ( delta <= 0 )
+        return;
+
+    svc->cur_budget -= delta;
+    if ( svc->cur_budget < 0 )
+        svc->cur_budget = 0;
+    svc->last_start = now;
+
+    TRACE_3D(TRC_RTDS_BUDGET_BURN, svc->vcpu->domain->domain_id,
+             svc->vcpu->vcpu_id, (uint32_t)(delta >> 10));
+}
+
+/*
+ * Tickling: find a pCPU to run a newly queued vCPU on.  An idle pCPU is
+ * best; failing that, preempt the pCPU running the latest deadline, if that
+ * is later than the new vCPU's.  pCPUs already tickled are skipped, as they
+ * are going to pick from the run queue anyway.
+ */
+static void
+runq_tickle(const struct scheduler *ops, const struct rt_vcpu *svc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    const struct vcpu *vc = svc->vcpu;
+    cpumask_t mask;
+    unsigned int cpu, target = nr_cpu_ids;
+    s_time_t latest = svc->cur_deadline;
+
+    rt_vcpu_cpus(prv, vc, &mask);
+    cpumask_andnot(&mask, &mask, &prv->tickled);
+    if ( cpumask_empty(&mask) )
+        return;
+
+    /* Prefer where it last ran, for its cache. */
+    if ( cpumask_test_cpu(vc->processor, &mask) &&
+         is_idle_vcpu(curr_on_cpu(vc->processor)) )
+        target = vc->processor;
+    else
+    {
+        for_each_cpu ( cpu, &mask )
+        {
+            const struct vcpu *curr = curr_on_cpu(cpu);
+
+            if ( is_idle_vcpu(curr) )
+            {
+                target = cpu;
+                break;
+            }
+            if ( RT_VCPU(curr)->cur_deadline > latest )
+            {
+                latest = RT_VCPU(curr)->cur_deadline;
+                target = cpu;
+            }
+        }
+    }
+
+    if ( target >= nr_cpu_ids )
+        return;
+
+    TRACE_3D(TRC_RTDS_TICKLE, vc->domain->domain_id, vc->vcpu_id, target);
+    cpumask_set_cpu(target, &prv->tickled);
+    cpu_raise_softirq(target, SCHEDULE_SOFTIRQ);
+}
+
+/*
+ * Replenishment: give every vCPU whose period ended its budget back, and
+ * let the newly eligible ones preempt something.
+ */
+static void
+repl_timer_handler(void *data)
+{
+    const struct scheduler *ops = data;
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu *svc, *next;
+    s_time_t now;
+    LIST_HEAD(tickle);
+
+    spin_lock_irq(&prv->lock);
+
+    now = NOW();
+
+    while ( (svc = deadline_first(&prv->replq, REPLQ_OFFSET)) != NULL &&
+            svc->cur_deadline <= now )
+    {
+        struct vcpu *vc = svc->vcpu;
+        bool_t running = curr_on_cpu(vc->processor) == vc;
+
+        if ( running )
+            burn_budget(svc, now);
+
+        replq_remove(prv, svc);
+        rt_update_deadline(svc, now);
+        deadline_insert(&prv->replq, svc, REPLQ_OFFSET);
+
+        TRACE_2D(TRC_RTDS_REPLENISH, vc->domain->domain_id, vc->vcpu_id);
+
+        if ( running )
+        {
+            /* Budget and deadline changed: re-evaluate that pCPU. */
+            cpumask_set_cpu(vc->processor, &prv->tickled);
+            cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
+        }
+        else if ( __vcpu_on_runq(svc) || __vcpu_on_depletedq(svc) )
+        {
+            __q_remove(prv, svc);
+            __q_insert(prv, svc);
+            /*
+             * Tickle once everything due has been replenished.  With its
+             * budget back, svc is on the runq, so depletedq_elem is free
+             * to link it meanwhile.
+             */
+            list_add_tail(&svc->depletedq_elem, &tickle);
+        }
+    }
+
+    if ( svc != NULL )
+        set_timer(&prv->repl_timer, svc->cur_deadline);
+
+    while ( !list_empty(&tickle) )
+    {
+        next = list_entry(tickle.next, struct rt_vcpu, depletedq_elem);
+        list_del_init(&next->depletedq_elem);
+        runq_tickle(ops, next);
+    }
+
+    spin_unlock_irq(&prv->lock);
+}
+
+/*
+ * pCPUs
+ */
+static void *
+rt_alloc_pdata(const struct scheduler *ops, int cpu)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    unsigned long flags;
+    spinlock_t *old_lock;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    if ( !prv->repl_timer_init )
+    {
+        init_timer(&prv->repl_timer, repl_timer_handler, (void *)ops, cpu);
+        prv->repl_timer_init = 1;
+    }
+
+    /* Move the schedule lock over to the scheduler-wide one. */
+    old_lock = pcpu_schedule_lock(cpu);
+    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+    /* _Not_ pcpu_schedule_unlock(): per_cpu().schedule_lock changed! */
+    spin_unlock(old_lock);
+
+    cpumask_set_cpu(cpu, &prv->cpus);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    /* Non-NULL, as schedule.c takes NULL for failure. */
+    return (void *)1;
+}
+
+static void
+rt_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+    unsigned long flags;
+    unsigned int new_cpu;
+    bool_t overcommitted;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    cpumask_clear_cpu(cpu, &prv->cpus);
+    cpumask_clear_cpu(cpu, &prv->tickled);
+    new_cpu = cpumask_first(&prv->cpus);
+    overcommitted = prv->util > rt_capacity(prv) && new_cpu < nr_cpu_ids;
+
+    /*
+     * Move spinlock back to the per-pCPU one, unless the pCPU's new
+     * scheduler has already remapped it.
+     */
+    if ( sd->schedule_lock == &prv->lock )
+    {
+        ASSERT(!spin_is_locked(&sd->_lock));
+        sd->schedule_lock = &sd->_lock;
+    }
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    /* The timer handler takes prv->lock: don't hold it here. */
+    if ( prv->repl_timer_init && prv->repl_timer.cpu == cpu )
+    {
+        if ( new_cpu < nr_cpu_ids )
+            migrate_timer(&prv->repl_timer, new_cpu);
+        else
+        {
+            kill_timer(&prv->repl_timer);
+            prv->repl_timer_init = 0;
+        }
+    }
+
+    if ( overcommitted )
+        printk(XENLOG_WARNING
+               "RTDS: removing CPU%d leaves the pool overcommitted\n", cpu);
+}
+
+/*
+ * vCPUs
+ */
+static void *
+rt_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu *svc;
+    unsigned long flags;
+
+    svc = xzalloc(struct rt_vcpu);
+    if ( svc == NULL )
+        return NULL;
+
+    INIT_LIST_HEAD(&svc->sdom_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
+    INIT_LIST_HEAD(&svc->depletedq_elem);
+    RB_CLEAR_NODE(&svc->replq_elem);
+    svc->sdom = dd;
+    svc->vcpu = vc;
+
+    if ( is_idle_vcpu(vc) )
+    {
+        svc->cur_deadline = STIME_MAX;
+        return svc;
+    }
+
+    svc->period = MICROSECS(RTDS_DEFAULT_PERIOD);
+    svc->budget = MICROSECS(RTDS_DEFAULT_BUDGET);
+    svc->util = rt_util(svc->budget, svc->period);
+
+    /* Admission control: the reservation is taken here. */
+    spin_lock_irqsave(&prv->lock, flags);
+    if ( prv->util + svc->util > rt_capacity(prv) )
+    {
+        spin_unlock_irqrestore(&prv->lock, flags);
+        printk(XENLOG_G_WARNING
+               "RTDS: no capacity left for d%dv%d\n",
+               vc->domain->domain_id, vc->vcpu_id);
+        xfree(svc);
+        return NULL;
+    }
+    prv->util += svc->util;
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return svc;
+}
+
+static void
+rt_free_vdata(const struct scheduler *ops, void *priv)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu *svc = priv;
+    unsigned long flags;
+
+    if ( svc == NULL )
+        return;
+
+    spin_lock_irqsave(&prv->lock, flags);
+    prv->util -= svc->util;
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    xfree(svc);
+}
+
+static void
+rt_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu *svc = RT_VCPU(vc);
+    spinlock_t *lock;
+    s_time_t now;
+
+    /* Idle vCPUs are not queued. */
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    lock = vcpu_schedule_lock_irq(vc);
+
+    now = NOW();
+    rt_update_deadline(svc, now);
+
+    if ( vcpu_runnable(vc) && !vc->is_running )
+    {
+        __q_insert(prv, svc);
+        replq_insert(prv, svc);
+        runq_tickle(ops, svc);
+    }
+
+    list_add_tail(&svc->sdom_elem, &svc->sdom->vcpu);
+
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static void
+rt_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu *svc = RT_VCPU(vc);
+    spinlock_t *lock;
+
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    lock = vcpu_schedule_lock_irq(vc);
+
+    __q_remove(prv, svc);
+    replq_remove(prv, svc);
+    list_del_init(&svc->sdom_elem);
+
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static void
+rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    if ( curr_on_cpu(vc->processor) == vc )
+        cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
+    else if ( __vcpu_on_runq(svc) || __vcpu_on_depletedq(svc) )
+    {
+        __q_remove(prv, svc);
+        replq_remove(prv, svc);
+    }
+    else if ( svc->flags & RTDS_delayed_runq_add )
+        svc->flags &= ~RTDS_delayed_runq_add;
+}
+
+static void
+rt_vcpu_wake(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    if ( unlikely(curr_on_cpu(vc->processor) == vc) )
+        return;
+
+    if ( unlikely(__vcpu_on_runq(svc) || __vcpu_on_depletedq(svc)) )
+        return;
+
+    /* A vCPU waking after its deadline starts a fresh period. */
+    rt_update_deadline(svc, NOW());
+
+    /*
+     * If the context hasn't been saved yet, it can't go on the run queue
+     * (another pCPU might pick it up): rt_context_saved() will do that.
+     */
+    if ( unlikely(svc->flags & RTDS_scheduled) )
+    {
+        svc->flags |= RTDS_delayed_runq_add;
+        if ( __vcpu_on_replq(svc) )
+            replq_insert(prv, svc);
+        return;
+    }
+
+    __q_insert(prv, svc);
+    replq_insert(prv, svc);
+    runq_tickle(ops, svc);
+}
+
+static void
+rt_context_saved(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+    spinlock_t *lock = vcpu_schedule_lock_irq(vc);
+
+    svc->flags &= ~RTDS_scheduled;
+
+    if ( is_idle_vcpu(vc) )
+        goto out;
+
+    if ( (svc->flags & RTDS_delayed_runq_add) && likely(vcpu_runnable(vc)) )
+    {
+        svc->flags &= ~RTDS_delayed_runq_add;
+        __q_insert(prv, svc);
+        replq_insert(prv, svc);
+        runq_tickle(ops, svc);
+    }
+    else
+    {
+        svc->flags &= ~RTDS_delayed_runq_add;
+        /* Blocked: replenish lazily, on wakeup. */
+        if ( !vcpu_runnable(vc) )
+            replq_remove(prv, svc);
+    }
+
+ out:
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static int
+rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    cpumask_t cpus;
+
+    rt_vcpu_cpus(prv, vc, &cpus);
+    if ( cpumask_empty(&cpus) )
+        cpumask_and(&cpus, &prv->cpus,
+                    cpupool_scheduler_cpumask(vc->domain->cpupool));
+
+    return cpumask_test_cpu(vc->processor, &cpus)
+           ? vc->processor : cpumask_cycle(vc->processor, &cpus);
+}
+
+/*
+ * Domains
+ */
+static void *
+rt_alloc_domdata(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_dom *sdom;
+    unsigned long flags;
+
+    sdom = xzalloc(struct rt_dom);
+    if ( sdom == NULL )
+        return NULL;
+
+    INIT_LIST_HEAD(&sdom->vcpu);
+    INIT_LIST_HEAD(&sdom->sdom_elem);
+    sdom->dom = dom;
+
+    spin_lock_irqsave(&prv->lock, flags);
+    list_add_tail(&sdom->sdom_elem, &prv->sdom);
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return sdom;
+}
+
+static void
+rt_free_domdata(const struct scheduler *ops, void *data)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_dom *sdom = data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+    list_del_init(&sdom->sdom_elem);
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    xfree(data);
+}
+
+static int
+rt_dom_init(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_dom *sdom;
+
+    if ( is_idle_domain(dom) )
+        return 0;
+
+    sdom = rt_alloc_domdata(ops, dom);
+    if ( sdom == NULL )
+        return -ENOMEM;
+
+    dom->sched_priv = sdom;
+
+    return 0;
+}
+
+static void
+rt_dom_destroy(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_dom *sdom = RT_DOM(dom);
+
+    BUG_ON(!list_empty(&sdom->vcpu));
+
+    rt_free_domdata(ops, sdom);
+}
+
+/*
+ * Parameters are per domain: putinfo applies them to all the domain's
+ * vCPUs, provided the pool can take the resulting utilisation.
+ */
+static int
+rt_dom_cntl(
+    const struct scheduler *ops,
+    struct domain *d,
+    struct xen_domctl_scheduler_op *op)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_dom * const sdom = RT_DOM(d);
+    struct xen_domctl_sched_rtds *params = &op->u.rtds;
+    struct list_head *iter;
+    struct rt_vcpu *svc;
+    unsigned long flags;
+    s_time_t period, budget;
+    uint64_t util, old_util = 0, new_util = 0;
+    int rc = 0;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    switch ( op->cmd )
+    {
+    case XEN_DOMCTL_SCHEDOP_getinfo:
+        if ( list_empty(&sdom->vcpu) )
+        {
+            params->period = RTDS_DEFAULT_PERIOD;
+            params->budget = RTDS_DEFAULT_BUDGET;
+            break;
+        }
+        svc = list_entry(sdom->vcpu.next, struct rt_vcpu, sdom_elem);
+        params->period = svc->period / MICROSECS(1);
+        params->budget = svc->budget / MICROSECS(1);
+        break;
+
+    case XEN_DOMCTL_SCHEDOP_putinfo:
+        if ( params->budget < RTDS_MIN_BUDGET ||
+             params->budget > params->period )
+        {
+            rc = -EINVAL;
+            break;
+        }
+
+        period = MICROSECS(params->period);
+        budget = MICROSECS(params->budget);
+        util = rt_util(budget, period);
+
+        list_for_each( iter, &sdom->vcpu )
+        {
+            svc = list_entry(iter, struct rt_vcpu, sdom_elem);
+            old_util += svc->util;
+            new_util += util;
+        }
+
+        if ( new_util > old_util &&
+             prv->util - old_util + new_util > rt_capacity(prv) )
+        {
+            rc = -ENOSPC;
+            break;
+        }
+
+        prv->util = prv->util - old_util + new_util;
+
+        list_for_each( iter, &sdom->vcpu )
+        {
+            svc = list_entry(iter, struct rt_vcpu, sdom_elem);
+            svc->period = period;
+            svc->budget = budget;
+            svc->util = util;
+            if ( svc->cur_budget > budget )
+                svc->cur_budget = budget;
+        }
+        break;
+
+    default:
+        rc = -EINVAL;
+        break;
+    }
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return rc;
+}
+
+/*
+ * Scheduling
+ */
+
+/* Earliest deadline runnable on this pCPU, or NULL. */
+static struct rt_vcpu *
+runq_pick(struct rt_private *prv, unsigned int cpu)
+{
+    struct rb_node *node;
+
+    for ( node = rb_first(&prv->runq); node; node = rb_next(node) )
+    {
+        struct rt_vcpu *svc = rb_entry(node, struct rt_vcpu, runq_elem);
+        const struct vcpu *vc = svc->vcpu;
+
+        if ( cpumask_test_cpu(cpu, vc->cpu_affinity) &&
+             cpumask_test_cpu(cpu,
+                              cpupool_scheduler_cpumask(vc->domain->cpupool)) )
+            return svc;
+    }
+
+    return NULL;
+}
+
+static struct task_slice
+rt_schedule(const struct scheduler *ops, s_time_t now,
+            bool_t tasklet_work_scheduled)
+{
+    const unsigned int cpu = smp_processor_id();
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu * const scurr = RT_VCPU(current);
+    struct rt_vcpu *snext;
+    struct task_slice ret = { .migrated = 0 };
+
+    cpumask_clear_cpu(cpu, &prv->tickled);
+
+    burn_budget(scurr, now);
+
+    if ( tasklet_work_scheduled )
+        snext = RT_VCPU(idle_vcpu[cpu]);
+    else
+    {
+        snext = runq_pick(prv, cpu);
+
+        /* Keep the current vCPU unless something is more urgent. */
+        if ( !is_idle_vcpu(current) && vcpu_runnable(current) &&
+             scurr->cur_budget > 0 &&
+             (snext == NULL || scurr->cur_deadline <= snext->cur_deadline) )
+            snext = scurr;
+        else if ( snext == NULL )
+            snext = RT_VCPU(idle_vcpu[cpu]);
+    }
+
+    if ( snext != scurr && !is_idle_vcpu(current) && vcpu_runnable(current) )
+        scurr->flags |= RTDS_delayed_runq_add;
+
+    if ( snext != scurr && !is_idle_vcpu(snext->vcpu) )
+    {
+        __q_remove(prv, snext);
+        if ( snext->vcpu->processor != cpu )
+        {
+            snext->vcpu->processor = cpu;
+            ret.migrated = 1;
+        }
+    }
+
+    snext->last_start = now;
+    if ( !is_idle_vcpu(snext->vcpu) )
+        snext->flags |= RTDS_scheduled;
+
+    ret.task = snext->vcpu;
+    /* Run until the budget is gone; idle waits for a tickle. */
+    ret.time = is_idle_vcpu(snext->vcpu) ? -1 : snext->cur_budget;
+
+    return ret;
+}
+
+/*
+ * Debug
+ */
+static void
+rt_dump_vcpu(const struct rt_vcpu *svc)
+{
+    printk("[%5d.%-2u] cpu %u, (%"PRI_stime", %"PRI_stime"),"
+           " cur_b=%"PRI_stime" cur_d=%"PRI_stime" flags=%x\n",
+           svc->vcpu->domain->domain_id, svc->vcpu->vcpu_id,
+           svc->vcpu->processor, svc->period, svc->budget,
+           svc->cur_budget, svc->cur_deadline, svc->flags);
+}
+
+static void
+rt_dump_pcpu(const struct scheduler *ops, int cpu)
+{
+    const struct vcpu *curr = curr_on_cpu(cpu);
+
+    printk("CPU[%02d] tickled=%d current=",
+           cpu, cpumask_test_cpu(cpu, &RT_PRIV(ops)->tickled));
+    if ( is_idle_vcpu(curr) )
+        printk("idle\n");
+    else
+        rt_dump_vcpu(RT_VCPU(curr));
+}
+
+static void
+rt_dump(const struct scheduler *ops)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct list_head *iter_sdom, *iter_svc;
+    struct rb_node *node;
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    printk("Reserved utilisation: %"PRIu64"/%"PRIu64" (1/%u)\n",
+           prv->util, rt_capacity(prv), 1u << RTDS_UTIL_SHIFT);
+
+    printk("Runqueue:\n");
+    for ( node = rb_first(&prv->runq); node; node = rb_next(node) )
+        rt_dump_vcpu(rb_entry(node, struct rt_vcpu, runq_elem));
+
+    printk("Depleted:\n");
+    list_for_each( iter_svc, &prv->depletedq )
+        rt_dump_vcpu(list_entry(iter_svc, struct rt_vcpu, depletedq_elem));
+
+    printk("Domain info:\n");
+    list_for_each( iter_sdom, &prv->sdom )
+    {
+        struct rt_dom *sdom = list_entry(iter_sdom, struct rt_dom,
+                                         sdom_elem);
+
+        printk("\tdomain: %d\n", sdom->dom->domain_id);
+        list_for_each( iter_svc, &sdom->vcpu )
+        {
+            printk("\t");
+            rt_dump_vcpu(list_entry(iter_svc, struct rt_vcpu, sdom_elem));
+        }
+    }
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+static int
+rt_init(struct scheduler *ops)
+{
+    struct rt_private *prv;
+
+    prv = xzalloc(struct rt_private);
+    if ( prv == NULL )
+        return -ENOMEM;
+
+    spin_lock_init(&prv->lock);
+    INIT_LIST_HEAD(&prv->sdom);
+    prv->runq = RB_ROOT;
+    INIT_LIST_HEAD(&prv->depletedq);
+    prv->replq = RB_ROOT;
+
+    ops->sched_data = prv;
+
+    return 0;
+}
+
+static void
+rt_deinit(const struct scheduler *ops)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+
+    if ( prv->repl_timer_init )
+        kill_timer(&prv->repl_timer);
+    xfree(prv);
+}
+
+static struct rt_private _rt_priv;
+
+const struct scheduler sched_rtds_def = {
+    .name           = "SMP RTDS Scheduler (global EDF)",
+    .opt_name       = "rtds",
+    .sched_id       = XEN_SCHEDULER_RTDS,
+    .sched_data     = &_rt_priv,
+
+    .dump_cpu_state = rt_dump_pcpu,
+    .dump_settings  = rt_dump,
+    .init           = rt_init,
+    .deinit         = rt_deinit,
+    .alloc_pdata    = rt_alloc_pdata,
+    .free_pdata     = rt_free_pdata,
+    .alloc_domdata  = rt_alloc_domdata,
+    .free_domdata   = rt_free_domdata,
+    .init_domain    = rt_dom_init,
+    .destroy_domain = rt_dom_destroy,
+    .alloc_vdata    = rt_alloc_vdata,
+    .free_vdata     = rt_free_vdata,
+    .insert_vcpu    = rt_vcpu_insert,
+    .remove_vcpu    = rt_vcpu_remove,
+
+    .adjust         = rt_dom_cntl,
+
+    .pick_cpu       = rt_cpu_pick,
+    .do_schedule    = rt_schedule,
+    .sleep          = rt_vcpu_sleep,
+    .wake           = rt_vcpu_wake,
+    .context_saved  = rt_context_saved,
+};
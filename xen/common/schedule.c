@@ -64,11 +64,20 @@ static void poll_timer_fn(void *data);
 DEFINE_PER_CPU(struct schedule_data, schedule_data);
 DEFINE_PER_CPU(struct scheduler *, scheduler);
 
+/* Per-pCPU scheduling latency histograms (XEN_SYSCTL_sched_hist). */
+struct sched_pcpu_hist {
+    struct sched_hist hist;
+    uint64_t runq_depth[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+    atomic_t nr_runnable;       /* runnable vCPUs on this pCPU */
+};
+static DEFINE_PER_CPU(struct sched_pcpu_hist, sched_pcpu_hist);
+
 static const struct scheduler *schedulers[] = {
     &sched_sedf_def,
     &sched_credit_def,
     &sched_credit2_def,
     &sched_arinc653_def,
+    &sched_rtds_def,
 };
 
 static struct scheduler __read_mostly ops;
@@ -137,6 +146,68 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+/* log2 microseconds, the last bucket open ended. */
+static inline unsigned int sched_hist_bucket(s_time_t delta)
+{
+    uint64_t us = delta > 0 ? delta / MICROSECS(1) : 0;
+
+    if ( us >> (XEN_SYSCTL_SCHED_HIST_BUCKETS - 2) )
+        return XEN_SYSCTL_SCHED_HIST_BUCKETS - 1;
+
+    return fls(us);
+}
+
+/*
+ * Account the time spent in the state v is leaving.  Called with v's
+ * schedule lock held.  Transitions into and out of running happen on
+ * v->processor itself, so the pCPU histograms need no further locking.
+ */
+static inline void sched_hist_update(
+    struct vcpu *v, int new_state, s_time_t delta)
+{
+    struct sched_pcpu_hist *ph;
+    unsigned int b;
+
+    if ( is_idle_vcpu(v) )
+        return;
+
+    ph = &per_cpu(sched_pcpu_hist, v->processor);
+    b = sched_hist_bucket(delta);
+
+    switch ( v->runstate.state )
+    {
+    case RUNSTATE_running:
+        v->sched_hist.timeslice[b]++;
+        ph->hist.timeslice[b]++;
+        break;
+
+    case RUNSTATE_runnable:
+        atomic_dec(&per_cpu(sched_pcpu_hist, v->sched_runq_cpu).nr_runnable);
+        if ( new_state == RUNSTATE_running )
+        {
+            v->sched_hist.runnable_wait[b]++;
+            ph->hist.runnable_wait[b]++;
+            if ( v->sched_woken )
+            {
+                v->sched_hist.wake_latency[b]++;
+                ph->hist.wake_latency[b]++;
+            }
+        }
+        v->sched_woken = 0;
+        break;
+
+    default:
+        v->sched_woken = (new_state == RUNSTATE_runnable);
+        break;
+    }
+
+    if ( new_state == RUNSTATE_runnable )
+    {
+        v->sched_runq_cpu = v->processor;
+        atomic_inc(&ph->nr_runnable);
+    }
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
@@ -150,6 +221,7 @@ static inline void vcpu_runstate_change(
     trace_runstate_change(v, new_state);
 
     delta = new_entry_time - v->runstate.state_entry_time;
+    sched_hist_update(v, new_state, delta);
     if ( delta > 0 )
     {
         v->runstate.time[v->runstate.state] += delta;
@@ -184,6 +256,12 @@ uint64_t get_cpu_idle_time(unsigned int cpu)
     return state.time[RUNSTATE_running];
 }
 
+/* Number of vCPUs waiting in @cpu's runqueue (not counting the running one). */
+unsigned int sched_cpu_nr_runnable(unsigned int cpu)
+{
+    return atomic_read(&per_cpu(sched_pcpu_hist, cpu).nr_runnable);
+}
+
 int sched_init_vcpu(struct vcpu *v, unsigned int processor) 
 {
     struct domain *d = v->domain;
@@ -253,7 +331,7 @@ int sched_move_domain(struct domain *d, struct cpupool *c)
             for_each_vcpu ( d, v )
             {
                 if ( vcpu_priv[v->vcpu_id] != NULL )
-                    xfree(vcpu_priv[v->vcpu_id]);
+                    SCHED_OP(c->sched, free_vdata, vcpu_priv[v->vcpu_id]);
             }
             xfree(vcpu_priv);
             SCHED_OP(c->sched, free_domdata, domdata);
@@ -691,6 +769,8 @@ void vcpu_block(void)
 
     set_bit(_VPF_blocked, &v->pause_flags);
 
+    arch_vcpu_block(v);
+
     /* Check for events /after/ blocking: avoids wakeup waiting race. */
     if ( local_events_need_delivery() )
     {
@@ -728,6 +808,8 @@ static long do_poll(struct sched_poll *sched_poll)
     v->poll_evtchn = -1;
     set_bit(v->vcpu_id, d->poll_mask);
 
+    arch_vcpu_block(v);
+
 #ifndef CONFIG_X86 /* set_bit() implies mb() on x86 */
     /* Check for events /after/ setting flags: avoids wakeup waiting race. */
     smp_mb();
@@ -1068,6 +1150,148 @@ int sched_id(void)
     return ops.sched_id;
 }
 
+int sched_hist_op(struct xen_sysctl_sched_hist *op)
+{
+    struct xen_sysctl_sched_hist_data data = { };
+    struct sched_hist *hist;
+    struct domain *d = NULL;
+    struct vcpu *v = NULL;
+    spinlock_t *lock;
+    unsigned int i;
+    int rc = 0;
+
+    switch ( op->type )
+    {
+    case XEN_SYSCTL_SCHED_HIST_pcpu:
+    {
+        struct sched_pcpu_hist *ph;
+
+        if ( op->id >= nr_cpu_ids || !cpu_online(op->id) )
+            return -EINVAL;
+
+        ph = &per_cpu(sched_pcpu_hist, op->id);
+        hist = &ph->hist;
+
+        lock = pcpu_schedule_lock_irq(op->id);
+        memcpy(data.runq_depth, ph->runq_depth, sizeof(data.runq_depth));
+        if ( op->reset )
+            memset(ph->runq_depth, 0, sizeof(ph->runq_depth));
+        break;
+    }
+
+    case XEN_SYSCTL_SCHED_HIST_vcpu:
+        d = rcu_lock_domain_by_id(op->domid);
+        if ( d == NULL )
+            return -ESRCH;
+        if ( op->id >= d->max_vcpus || (v = d->vcpu[op->id]) == NULL )
+        {
+            rcu_unlock_domain(d);
+            return -ENOENT;
+        }
+        hist = &v->sched_hist;
+        lock = vcpu_schedule_lock_irq(v);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    for ( i = 0; i < XEN_SYSCTL_SCHED_HIST_BUCKETS; i++ )
+    {
+        data.wake_latency[i] = hist->wake_latency[i];
+        data.runnable_wait[i] = hist->runnable_wait[i];
+        data.timeslice[i] = hist->timeslice[i];
+    }
+    if ( op->reset )
+        memset(hist, 0, sizeof(*hist));
+
+    if ( d )
+    {
+        vcpu_schedule_unlock_irq(lock, v);
+        rcu_unlock_domain(d);
+    }
+    else
+        pcpu_schedule_unlock_irq(lock, op->id);
+
+    if ( copy_to_guest(op->data, &data, 1) )
+        rc = -EFAULT;
+
+    return rc;
+}
+
+int vcpu_sched_stats_op(struct xen_sysctl_vcpu_sched_stats *op)
+{
+    struct xen_sysctl_vcpu_sched_stats_data data;
+    struct domain *d;
+    struct vcpu *v;
+    spinlock_t *lock;
+    unsigned int num = 0, nr, i;
+    s_time_t delta;
+    int rc = 0;
+
+    op->next_domain = DOMID_INVALID;
+
+    rcu_read_lock(&domlist_read_lock);
+
+    for_each_domain ( d )
+    {
+        if ( d->domain_id < op->first_domain )
+            continue;
+        if ( xsm_getdomaininfo(XSM_HOOK, d) )
+            continue;
+
+        nr = 0;
+        for_each_vcpu ( d, v )
+            nr++;
+        if ( num + nr > op->max_vcpus )
+        {
+            if ( num == 0 )
+                rc = -ENOBUFS;
+            else
+                op->next_domain = d->domain_id;
+            break;
+        }
+
+        for_each_vcpu ( d, v )
+        {
+            memset(&data, 0, sizeof(data));
+            data.domid = d->domain_id;
+            data.vcpu = v->vcpu_id;
+            if ( !test_bit(_VPF_down, &v->pause_flags) )
+                data.flags |= XEN_SYSCTL_VCPU_SCHED_online;
+
+            lock = vcpu_schedule_lock_irq(v);
+            data.state = v->runstate.state;
+            for ( i = 0; i < ARRAY_SIZE(data.time); i++ )
+                data.time[i] = v->runstate.time[i];
+            delta = NOW() - v->runstate.state_entry_time;
+            if ( delta > 0 )
+                data.time[v->runstate.state] += delta;
+            for ( i = 0; i < XEN_SYSCTL_SCHED_HIST_BUCKETS; i++ )
+            {
+                data.wake_latency[i] = v->sched_hist.wake_latency[i];
+                data.runnable_wait[i] = v->sched_hist.runnable_wait[i];
+            }
+            vcpu_schedule_unlock_irq(lock, v);
+
+            if ( copy_to_guest_offset(op->buffer, num, &data, 1) )
+            {
+                rc = -EFAULT;
+                break;
+            }
+            num++;
+        }
+        if ( rc )
+            break;
+    }
+
+    rcu_read_unlock(&domlist_read_lock);
+
+    op->num_vcpus = num;
+
+    return rc;
+}
+
 /* Adjust scheduling parameter for a given domain. */
 long sched_adjust(struct domain *d, struct xen_domctl_scheduler_op *op)
 {
@@ -1178,6 +1402,10 @@ static void schedule(void)
 
     lock = pcpu_schedule_lock_irq(cpu);
 
+    this_cpu(sched_pcpu_hist).runq_depth[
+        min_t(unsigned int, atomic_read(&this_cpu(sched_pcpu_hist).nr_runnable),
+              XEN_SYSCTL_SCHED_HIST_BUCKETS - 1)]++;
+
     stop_timer(&sd->s_timer);
     
     /* get policy-specific decision on scheduling... */
@@ -1521,6 +1749,7 @@ void sched_tick_suspend(void)
 
     sched = per_cpu(scheduler, cpu);
     SCHED_OP(sched, tick_suspend, cpu);
+    rcu_idle_enter(cpu);
 }
 
 void sched_tick_resume(void)
@@ -1528,6 +1757,7 @@ void sched_tick_resume(void)
     struct scheduler *sched;
     unsigned int cpu = smp_processor_id();
 
+    rcu_idle_exit(cpu);
     sched = per_cpu(scheduler, cpu);
     SCHED_OP(sched, tick_resume, cpu);
 }
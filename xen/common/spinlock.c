@@ -6,6 +6,9 @@
 #include <xen/spinlock.h>
 #include <xen/guest_access.h>
 #include <xen/preempt.h>
+#include <xen/init.h>
+#include <xen/percpu.h>
+#include <xen/symbols.h>
 #include <public/sysctl.h>
 #include <asm/processor.h>
 #include <asm/atomic.h>
@@ -87,147 +90,261 @@ void spin_debug_disable(void)
 
 #ifdef LOCK_PROFILE
 
-#define LOCK_PROFILE_REL                                                     \
-    if (lock->profile)                                                       \
-    {                                                                        \
-        lock->profile->time_hold += NOW() - lock->profile->time_locked;      \
-        lock->profile->lock_cnt++;                                           \
+/*
+ * Only one in lock_profile_sample acquisitions of a profiled lock is
+ * timed, which makes profiling cheap enough to leave on with a large
+ * enough rate.
+ */
+static unsigned int __read_mostly lock_profile_sample = 1;
+integer_param("lock_profile_sample", lock_profile_sample);
+
+static DEFINE_PER_CPU(unsigned int, lock_profile_skip);
+static DEFINE_PER_CPU(struct xen_sysctl_lockprof_cpu, lock_profile_cpu);
+
+static inline bool_t lock_profile_sampled(const spinlock_t *lock)
+{
+    unsigned int *skip;
+
+    if ( !lock->profile )
+        return 0;
+
+    skip = &this_cpu(lock_profile_skip);
+    if ( *skip )
+    {
+        --*skip;
+        return 0;
     }
-#define LOCK_PROFILE_VAR    s_time_t block = 0
-#define LOCK_PROFILE_BLOCK  block = block ? : NOW();
-#define LOCK_PROFILE_GOT                                                     \
-    if (lock->profile)                                                       \
-    {                                                                        \
-        lock->profile->time_locked = NOW();                                  \
-        if (block)                                                           \
-        {                                                                    \
-            lock->profile->time_block += lock->profile->time_locked - block; \
-            lock->profile->block_cnt++;                                      \
-        }                                                                    \
+    *skip = lock_profile_sample ? lock_profile_sample - 1 : 0;
+
+    return 1;
+}
+
+static inline unsigned int lock_profile_bucket(s_time_t t)
+{
+    unsigned int b;
+
+    if ( t <= 0 )
+        return 0;
+    b = fls(min_t(s_time_t, t >> LOCKPROF_HIST_SHIFT, 1 << 30));
+
+    return min(b, LOCKPROF_HIST_BUCKETS - 1u);
+}
+
+/* Called with the lock just taken. */
+static void lock_profile_got(spinlock_t *lock, bool_t sampled,
+                             s_time_t block, void *caller)
+{
+    struct lock_profile *prof = lock->profile;
+    struct xen_sysctl_lockprof_cpu *pcpu;
+    s_time_t t;
+
+    if ( !sampled )
+    {
+        if ( prof )
+            prof->time_locked = 0;
+        return;
     }
 
+    prof->time_locked = NOW();
+    prof->holder = caller;
+    if ( !block )
+        return;
+
+    t = prof->time_locked - block;
+    prof->time_block += t;
+    prof->block_cnt++;
+    prof->block_hist[lock_profile_bucket(t)]++;
+
+    pcpu = &this_cpu(lock_profile_cpu);
+    pcpu->block_time += t;
+    pcpu->block_cnt++;
+}
+
+/* Called with the lock still held. */
+static void lock_profile_rel(spinlock_t *lock)
+{
+    struct lock_profile *prof = lock->profile;
+    struct xen_sysctl_lockprof_cpu *pcpu;
+    s_time_t t;
+
+    if ( !prof || !prof->time_locked )
+        return;
+
+    t = NOW() - prof->time_locked;
+    prof->time_hold += t;
+    prof->lock_cnt++;
+    prof->hold_hist[lock_profile_bucket(t)]++;
+    if ( t > prof->max_hold )
+    {
+        prof->max_hold = t;
+        prof->max_holder = prof->holder;
+    }
+
+    pcpu = &this_cpu(lock_profile_cpu);
+    pcpu->lock_time += t;
+    pcpu->lock_cnt++;
+}
+
+#define LOCK_PROFILE_REL    lock_profile_rel(lock)
+#define LOCK_PROFILE_VAR    s_time_t block = 0;                              \
+                            bool_t sampled = lock_profile_sampled(lock)
+#define LOCK_PROFILE_BLOCK  if ( sampled ) block = block ? : NOW()
+#define LOCK_PROFILE_GOT(c) lock_profile_got(lock, sampled, block, c)
+
 #else
 
 #define LOCK_PROFILE_REL
 #define LOCK_PROFILE_VAR
 #define LOCK_PROFILE_BLOCK
-#define LOCK_PROFILE_GOT
+#define LOCK_PROFILE_GOT(c)
 
 #endif
 
-void _spin_lock(spinlock_t *lock)
+static always_inline spinlock_tickets_t observe_lock(spinlock_tickets_t *t)
+{
+    spinlock_tickets_t v;
+
+    smp_rmb();
+    v.head_tail = read_atomic(&t->head_tail);
+    return v;
+}
+
+static always_inline u16 observe_head(spinlock_tickets_t *t)
+{
+    smp_rmb();
+    return read_atomic(&t->head);
+}
+
+static always_inline int tickets_locked(spinlock_tickets_t *t)
+{
+    spinlock_tickets_t v = observe_lock(t);
+
+    return v.head != v.tail;
+}
+
+static always_inline void spin_lock_common(spinlock_t *lock, void *caller)
 {
+    spinlock_tickets_t tickets = SPINLOCK_TICKET_INC;
     LOCK_PROFILE_VAR;
 
     check_lock(&lock->debug);
-    while ( unlikely(!_raw_spin_trylock(&lock->raw)) )
+    tickets.head_tail = arch_fetch_and_add(&lock->tickets.head_tail,
+                                           tickets.head_tail);
+    while ( tickets.tail != observe_head(&lock->tickets) )
     {
         LOCK_PROFILE_BLOCK;
-        while ( likely(_raw_spin_is_locked(&lock->raw)) )
-            cpu_relax();
+        arch_lock_relax();
     }
-    LOCK_PROFILE_GOT;
+    LOCK_PROFILE_GOT(caller);
     preempt_disable();
+    arch_lock_acquire_barrier();
 }
 
-void _spin_lock_irq(spinlock_t *lock)
+void _spin_lock(spinlock_t *lock)
 {
-    LOCK_PROFILE_VAR;
+    spin_lock_common(lock, __builtin_return_address(0));
+}
 
+/*
+ * Unlike with a test-and-set lock, interrupts can't be re-enabled while
+ * waiting: once a ticket is taken, an interrupt handler on this cpu
+ * wanting the same lock would queue behind our own ticket and deadlock.
+ */
+void _spin_lock_irq(spinlock_t *lock)
+{
     ASSERT(local_irq_is_enabled());
     local_irq_disable();
-    check_lock(&lock->debug);
-    while ( unlikely(!_raw_spin_trylock(&lock->raw)) )
-    {
-        LOCK_PROFILE_BLOCK;
-        local_irq_enable();
-        while ( likely(_raw_spin_is_locked(&lock->raw)) )
-            cpu_relax();
-        local_irq_disable();
-    }
-    LOCK_PROFILE_GOT;
-    preempt_disable();
+    spin_lock_common(lock, __builtin_return_address(0));
 }
 
 unsigned long _spin_lock_irqsave(spinlock_t *lock)
 {
     unsigned long flags;
-    LOCK_PROFILE_VAR;
 
     local_irq_save(flags);
-    check_lock(&lock->debug);
-    while ( unlikely(!_raw_spin_trylock(&lock->raw)) )
-    {
-        LOCK_PROFILE_BLOCK;
-        local_irq_restore(flags);
-        while ( likely(_raw_spin_is_locked(&lock->raw)) )
-            cpu_relax();
-        local_irq_save(flags);
-    }
-    LOCK_PROFILE_GOT;
-    preempt_disable();
+    spin_lock_common(lock, __builtin_return_address(0));
     return flags;
 }
 
 void _spin_unlock(spinlock_t *lock)
 {
+    ASSERT(tickets_locked(&lock->tickets));
+    arch_lock_release_barrier();
     preempt_enable();
     LOCK_PROFILE_REL;
-    _raw_spin_unlock(&lock->raw);
+    /* Only the owner ever writes head. */
+    write_atomic(&lock->tickets.head, lock->tickets.head + 1);
+    arch_lock_signal();
 }
 
 void _spin_unlock_irq(spinlock_t *lock)
 {
-    preempt_enable();
-    LOCK_PROFILE_REL;
-    _raw_spin_unlock(&lock->raw);
+    _spin_unlock(lock);
     local_irq_enable();
 }
 
 void _spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
 {
-    preempt_enable();
-    LOCK_PROFILE_REL;
-    _raw_spin_unlock(&lock->raw);
+    _spin_unlock(lock);
     local_irq_restore(flags);
 }
 
 int _spin_is_locked(spinlock_t *lock)
 {
     check_lock(&lock->debug);
-    return _raw_spin_is_locked(&lock->raw);
+    return tickets_locked(&lock->tickets);
 }
 
 int _spin_trylock(spinlock_t *lock)
 {
+    spinlock_tickets_t old, new;
+    LOCK_PROFILE_VAR;
+
     check_lock(&lock->debug);
-    if ( !_raw_spin_trylock(&lock->raw) )
+    old = observe_lock(&lock->tickets);
+    if ( old.head != old.tail )
         return 0;
-#ifdef LOCK_PROFILE
-    if (lock->profile)
-        lock->profile->time_locked = NOW();
-#endif
+    new = old;
+    new.tail++;
+    if ( cmpxchg(&lock->tickets.head_tail,
+                 old.head_tail, new.head_tail) != old.head_tail )
+        return 0;
+    LOCK_PROFILE_GOT(__builtin_return_address(0));
     preempt_disable();
+    /*
+     * cmpxchg() is a full barrier so no need for an
+     * arch_lock_acquire_barrier().
+     */
     return 1;
 }
 
+/*
+ * Wait for whoever holds the lock right now to drop it.  Watching head
+ * move is enough: there is no need to wait for the cpus queued behind
+ * the current holder.
+ */
 void _spin_barrier(spinlock_t *lock)
 {
+    spinlock_tickets_t sample;
 #ifdef LOCK_PROFILE
     s_time_t block = NOW();
-    u64      loop = 0;
+#endif
 
     check_barrier(&lock->debug);
-    do { smp_mb(); loop++;} while ( _raw_spin_is_locked(&lock->raw) );
-    if ((loop > 1) && lock->profile)
+    smp_mb();
+    sample = observe_lock(&lock->tickets);
+    if ( sample.head != sample.tail )
     {
-        lock->profile->time_block += NOW() - block;
-        lock->profile->block_cnt++;
-    }
-#else
-    check_barrier(&lock->debug);
-    do { smp_mb(); } while ( _raw_spin_is_locked(&lock->raw) );
+        while ( observe_head(&lock->tickets) == sample.head )
+            arch_lock_relax();
+#ifdef LOCK_PROFILE
+        if ( lock->profile )
+        {
+            lock->profile->time_block += NOW() - block;
+            lock->profile->block_cnt++;
+        }
 #endif
+    }
     smp_mb();
 }
 
@@ -256,8 +373,18 @@ int _spin_trylock_recursive(spinlock_t *lock)
 
 void _spin_lock_recursive(spinlock_t *lock)
 {
-    while ( !spin_trylock_recursive(lock) )
-        cpu_relax();
+    int cpu = smp_processor_id();
+
+    /* Queue for the lock rather than spinning on trylock: stay fair. */
+    if ( likely(lock->recurse_cpu != cpu) )
+    {
+        spin_lock_common(lock, __builtin_return_address(0));
+        lock->recurse_cpu = cpu;
+    }
+
+    /* We support only fairly shallow recursion, else the counter overflows. */
+    ASSERT(lock->recurse_cnt < 0xfu);
+    lock->recurse_cnt++;
 }
 
 void _spin_unlock_recursive(spinlock_t *lock)
@@ -423,6 +550,36 @@ int _rw_is_write_locked(rwlock_t *lock)
     return _raw_rw_is_write_locked(&lock->raw);
 }
 
+static DEFINE_PER_CPU(cpumask_t, percpu_rwlock_readers);
+
+void _percpu_write_lock(percpu_rwlock_t **per_cpudata,
+                        percpu_rwlock_t *percpu_rwlock)
+{
+    unsigned int cpu;
+    cpumask_t *rwlock_readers = &this_cpu(percpu_rwlock_readers);
+
+    _percpu_rwlock_owner_check(per_cpudata, percpu_rwlock);
+
+    /* First serialise against other writers and queued readers. */
+    write_lock(&percpu_rwlock->rwlock);
+
+    /* Stop new readers from taking the fast path... */
+    percpu_rwlock->writer_activating = 1;
+    smp_mb();
+
+    /* ... and wait for the ones already in to leave. */
+    cpumask_copy(rwlock_readers, &cpu_online_map);
+    while ( !cpumask_empty(rwlock_readers) )
+    {
+        for_each_cpu ( cpu, rwlock_readers )
+        {
+            if ( per_cpu_ptr(per_cpudata, cpu) != percpu_rwlock )
+                cpumask_clear_cpu(cpu, rwlock_readers);
+        }
+        cpu_relax();
+    }
+}
+
 #ifdef LOCK_PROFILE
 
 struct lock_profile_anc {
@@ -455,6 +612,16 @@ static void spinlock_profile_iterate(lock_profile_subfunc *sub, void *par)
     spin_unlock(&lock_profile_lock);
 }
 
+static void spinlock_profile_print_hist(const char *what, const u32 *hist)
+{
+    unsigned int i;
+
+    printk("  %s hist:", what);
+    for ( i = 0; i < LOCKPROF_HIST_BUCKETS; i++ )
+        printk(" %u", hist[i]);
+    printk("\n");
+}
+
 static void spinlock_profile_print_elem(struct lock_profile *data,
     int32_t type, int32_t idx, void *par)
 {
@@ -466,18 +633,39 @@ static void spinlock_profile_print_elem(struct lock_profile *data,
            data->lock_cnt, (u32)(data->time_hold >> 32), (u32)data->time_hold,
            data->block_cnt, (u32)(data->time_block >> 32),
            (u32)data->time_block);
+    if ( !data->lock_cnt )
+        return;
+    printk("  max hold:%"PRId64"ns by", data->max_hold);
+    print_symbol(" %s\n", (unsigned long)data->max_holder);
+    spinlock_profile_print_hist("hold ", data->hold_hist);
+    if ( data->block_cnt )
+        spinlock_profile_print_hist("block", data->block_hist);
 }
 
 void spinlock_profile_printall(unsigned char key)
 {
     s_time_t now = NOW();
     s_time_t diff;
+    unsigned int cpu;
 
     diff = now - lock_profile_start;
     printk("Xen lock profile info SHOW  (now = %08X:%08X, "
-        "total = %08X:%08X)\n", (u32)(now>>32), (u32)now,
-        (u32)(diff>>32), (u32)diff);
+        "total = %08X:%08X, sampling 1/%u)\n", (u32)(now>>32), (u32)now,
+        (u32)(diff>>32), (u32)diff, lock_profile_sample);
+    printk("Histogram buckets: <%uns, then doubling\n",
+           1u << LOCKPROF_HIST_SHIFT);
     spinlock_profile_iterate(spinlock_profile_print_elem, NULL);
+
+    for_each_online_cpu ( cpu )
+    {
+        const struct xen_sysctl_lockprof_cpu *pcpu =
+            &per_cpu(lock_profile_cpu, cpu);
+
+        printk("CPU%u: lock:%12"PRId64"(%"PRId64"ns), "
+               "block:%12"PRId64"(%"PRId64"ns)\n", cpu,
+               pcpu->lock_cnt, pcpu->lock_time,
+               pcpu->block_cnt, pcpu->block_time);
+    }
 }
 
 static void spinlock_profile_reset_elem(struct lock_profile *data,
@@ -487,17 +675,25 @@ static void spinlock_profile_reset_elem(struct lock_profile *data,
     data->block_cnt = 0;
     data->time_hold = 0;
     data->time_block = 0;
+    data->max_hold = 0;
+    data->max_holder = NULL;
+    memset(data->hold_hist, 0, sizeof(data->hold_hist));
+    memset(data->block_hist, 0, sizeof(data->block_hist));
 }
 
 void spinlock_profile_reset(unsigned char key)
 {
     s_time_t now = NOW();
+    unsigned int cpu;
 
     if ( key != '\0' )
         printk("Xen lock profile info RESET (now = %08X:%08X)\n",
             (u32)(now>>32), (u32)now);
     lock_profile_start = now;
     spinlock_profile_iterate(spinlock_profile_reset_elem, NULL);
+    for_each_online_cpu ( cpu )
+        memset(&per_cpu(lock_profile_cpu, cpu), 0,
+               sizeof(struct xen_sysctl_lockprof_cpu));
 }
 
 typedef struct {
@@ -523,6 +719,10 @@ static void spinlock_profile_ucopy_elem(struct lock_profile *data,
         elem.block_cnt = data->block_cnt;
         elem.lock_time = data->time_hold;
         elem.block_time = data->time_block;
+        elem.max_hold = data->max_hold;
+        elem.max_holder = (unsigned long)data->max_holder;
+        memcpy(elem.hold_hist, data->hold_hist, sizeof(elem.hold_hist));
+        memcpy(elem.block_hist, data->block_hist, sizeof(elem.block_hist));
         if ( copy_to_guest_offset(p->pc->data, p->pc->nr_elem, &elem, 1) )
             p->rc = -EFAULT;
     }
@@ -548,7 +748,27 @@ int spinlock_profile_control(xen_sysctl_lockprof_op_t *pc)
         par.pc = pc;
         spinlock_profile_iterate(spinlock_profile_ucopy_elem, &par);
         pc->time = NOW() - lock_profile_start;
+        pc->sample = lock_profile_sample;
         rc = par.rc;
+        if ( !rc && !guest_handle_is_null(pc->cpu_data) )
+        {
+            static const struct xen_sysctl_lockprof_cpu offline;
+            unsigned int cpu;
+
+            for ( cpu = 0; !rc && cpu < min(pc->max_cpu, nr_cpu_ids); cpu++ )
+                if ( copy_to_guest_offset(pc->cpu_data, cpu,
+                                          cpu_online(cpu)
+                                          ? &per_cpu(lock_profile_cpu, cpu)
+                                          : &offline, 1) )
+                    rc = -EFAULT;
+        }
+        pc->max_cpu = nr_cpu_ids;
+        break;
+    case XEN_SYSCTL_LOCKPROF_sample:
+        if ( !pc->sample )
+            rc = -EINVAL;
+        else
+            lock_profile_sample = pc->sample;
         break;
     default:
         rc = -EINVAL;
@@ -29,6 +29,8 @@
 #include <xen/errno.h>
 #include <xen/smp.h>
 #include <xen/cpu.h>
+#include <xen/keyhandler.h>
+#include <xen/time.h>
 #include <asm/current.h>
 #include <asm/processor.h>
 
@@ -40,6 +42,22 @@ enum stopmachine_state {
     STOPMACHINE_EXIT
 };
 
+/* Phases timed by the initiator, see dump_stopmachine_stats(). */
+enum stopmachine_phase {
+    STOPMACHINE_PHASE_GATHER,      /* until every cpu runs the tasklet */
+    STOPMACHINE_PHASE_DISABLE_IRQ, /* until every cpu has IRQs off */
+    STOPMACHINE_PHASE_INVOKE,      /* fn() */
+    STOPMACHINE_PHASE_EXIT,        /* until every cpu is released */
+    STOPMACHINE_NR_PHASES
+};
+
+static const char *const stopmachine_phase_names[STOPMACHINE_NR_PHASES] = {
+    [STOPMACHINE_PHASE_GATHER]      = "gather",
+    [STOPMACHINE_PHASE_DISABLE_IRQ] = "irq-off",
+    [STOPMACHINE_PHASE_INVOKE]      = "invoke",
+    [STOPMACHINE_PHASE_EXIT]        = "exit",
+};
+
 struct stopmachine_data {
     unsigned int nr_cpus;
 
@@ -56,6 +74,14 @@ static DEFINE_PER_CPU(struct tasklet, stopmachine_tasklet);
 static struct stopmachine_data stopmachine_data;
 static DEFINE_SPINLOCK(stopmachine_lock);
 
+/* Protected by stopmachine_lock. */
+static struct {
+    unsigned long runs;
+    unsigned int last_cpus;
+    s_time_t last[STOPMACHINE_NR_PHASES];
+    s_time_t max[STOPMACHINE_NR_PHASES];
+} stopmachine_stats;
+
 static void stopmachine_set_state(enum stopmachine_state state)
 {
     atomic_set(&stopmachine_data.done, 0);
@@ -73,6 +99,7 @@ int stop_machine_run(int (*fn)(void *), void *data, unsigned int cpu)
 {
     cpumask_t allbutself;
     unsigned int i, nr_cpus;
+    s_time_t t[STOPMACHINE_NR_PHASES + 1];
     int ret;
 
     BUG_ON(!local_irq_is_enabled());
@@ -101,32 +128,55 @@ int stop_machine_run(int (*fn)(void *), void *data, unsigned int cpu)
 
     smp_wmb();
 
+    t[STOPMACHINE_PHASE_GATHER] = NOW();
+
     for_each_cpu ( i, &allbutself )
         tasklet_schedule_on_cpu(&per_cpu(stopmachine_tasklet, i), i);
 
     stopmachine_set_state(STOPMACHINE_PREPARE);
     stopmachine_wait_state();
+    t[STOPMACHINE_PHASE_DISABLE_IRQ] = NOW();
 
     local_irq_disable();
     stopmachine_set_state(STOPMACHINE_DISABLE_IRQ);
     stopmachine_wait_state();
     spin_debug_disable();
+    t[STOPMACHINE_PHASE_INVOKE] = NOW();
 
     stopmachine_set_state(STOPMACHINE_INVOKE);
     if ( (cpu == smp_processor_id()) || (cpu == NR_CPUS) )
         stopmachine_data.fn_result = (*fn)(data);
     stopmachine_wait_state();
     ret = stopmachine_data.fn_result;
+    t[STOPMACHINE_PHASE_EXIT] = NOW();
 
     spin_debug_enable();
     stopmachine_set_state(STOPMACHINE_EXIT);
     stopmachine_wait_state();
     local_irq_enable();
+    t[STOPMACHINE_NR_PHASES] = NOW();
+
+    stopmachine_stats.runs++;
+    stopmachine_stats.last_cpus = nr_cpus + 1;
+    for ( i = 0; i < STOPMACHINE_NR_PHASES; i++ )
+    {
+        s_time_t d = t[i + 1] - t[i];
+
+        stopmachine_stats.last[i] = d;
+        if ( d > stopmachine_stats.max[i] )
+            stopmachine_stats.max[i] = d;
+    }
 
     spin_unlock(&stopmachine_lock);
 
     put_cpu_maps();
 
+    printk(XENLOG_DEBUG "stop_machine: %u cpus, %"PRI_stime"ns "
+           "(gather %"PRI_stime", irq-off %"PRI_stime", invoke %"PRI_stime
+           ", exit %"PRI_stime")\n", nr_cpus + 1,
+           t[STOPMACHINE_NR_PHASES] - t[0],
+           t[1] - t[0], t[2] - t[1], t[3] - t[2], t[4] - t[3]);
+
     return ret;
 }
 
@@ -182,6 +232,24 @@ static struct notifier_block cpu_nfb = {
     .notifier_call = cpu_callback
 };
 
+static void dump_stopmachine_stats(unsigned char key)
+{
+    unsigned int i;
+
+    printk("stop_machine: %lu runs, last on %u cpus\n",
+           stopmachine_stats.runs, stopmachine_stats.last_cpus);
+    for ( i = 0; i < STOPMACHINE_NR_PHASES; i++ )
+        printk("  %-8s last %"PRI_stime"ns max %"PRI_stime"ns\n",
+               stopmachine_phase_names[i], stopmachine_stats.last[i],
+               stopmachine_stats.max[i]);
+}
+
+static struct keyhandler dump_stopmachine_keyhandler = {
+    .diagnostic = 1,
+    .u.fn = dump_stopmachine_stats,
+    .desc = "dump stop_machine phase timings"
+};
+
 static int __init cpu_stopmachine_init(void)
 {
     unsigned int cpu;
@@ -191,6 +259,7 @@ static int __init cpu_stopmachine_init(void)
         cpu_callback(&cpu_nfb, CPU_UP_PREPARE, hcpu);
     }
     register_cpu_notifier(&cpu_nfb);
+    register_keyhandler('Z', &dump_stopmachine_keyhandler);
     return 0;
 }
 __initcall(cpu_stopmachine_init);
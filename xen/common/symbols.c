@@ -17,6 +17,7 @@
 #include <xen/lib.h>
 #include <xen/string.h>
 #include <xen/spinlock.h>
+#include <xen/errno.h>
 
 #ifdef SYMBOLS_ORIGIN
 extern const unsigned int symbols_offsets[1];
@@ -149,6 +150,26 @@ const char *symbols_lookup(unsigned long addr,
     return namebuf;
 }
 
+int symbols_lookup_by_name(const char *symname, unsigned long *addr)
+{
+    char name[KSYM_NAME_LEN + 1];
+    unsigned int i, off = 0;
+    int rc = -ENOENT;
+
+    /* Names aren't sorted, so have to be expanded one by one. */
+    for (i = 0; i < symbols_num_syms; i++) {
+        off = symbols_expand_symbol(off, name);
+        if (strcmp(name, symname))
+            continue;
+        if (!rc && *addr != symbols_address(i))
+            return -EEXIST;
+        *addr = symbols_address(i);
+        rc = 0;
+    }
+
+    return rc;
+}
+
 /* Replace "%s" in format with address, or returns -errno. */
 void __print_symbol(const char *fmt, unsigned long address)
 {
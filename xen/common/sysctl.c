@@ -27,6 +27,7 @@
 #include <xsm/xsm.h>
 #include <xen/pmstat.h>
 #include <xen/gcov.h>
+#include <xen/livepatch.h>
 
 long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
 {
@@ -359,12 +360,34 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
     }
     break;
 
+    case XEN_SYSCTL_sched_hist:
+        ret = sched_hist_op(&op->u.sched_hist);
+        break;
+
+    case XEN_SYSCTL_domain_perf:
+        ret = domain_perf_op(&op->u.domain_perf);
+        break;
+
+    case XEN_SYSCTL_domain_changes:
+        ret = domain_changes_op(&op->u.domain_changes);
+        break;
+
+    case XEN_SYSCTL_vcpu_sched_stats:
+        ret = vcpu_sched_stats_op(&op->u.vcpu_sched_stats);
+        break;
+
 #ifdef TEST_COVERAGE
     case XEN_SYSCTL_coverage_op:
         ret = sysctl_coverage_op(&op->u.coverage_op);
         break;
 #endif
 
+#ifdef HAS_LIVEPATCH
+    case XEN_SYSCTL_livepatch_op:
+        ret = livepatch_op(&op->u.livepatch_op);
+        break;
+#endif
+
     default:
         ret = arch_do_sysctl(op, u_sysctl);
         copyback = 0;
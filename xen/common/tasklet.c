@@ -16,6 +16,7 @@
 #include <xen/config.h>
 #include <xen/init.h>
 #include <xen/sched.h>
+#include <xen/sched-if.h>
 #include <xen/softirq.h>
 #include <xen/tasklet.h>
 #include <xen/cpu.h>
@@ -25,50 +26,131 @@ static bool_t tasklets_initialised;
 
 DEFINE_PER_CPU(unsigned long, tasklet_work_to_do);
 
-static DEFINE_PER_CPU(struct list_head, tasklet_list);
-static DEFINE_PER_CPU(struct list_head, softirq_tasklet_list);
+/*
+ * Locking: a tasklet's state (scheduled_on, is_running, is_dead, ...) is
+ * protected by its own lock, and each per-CPU queue by the queue's lock.
+ * Moving a tasklet on or off a queue needs both.  The tasklet lock nests
+ * outside the queue lock; code starting from a queue (i.e. running, stealing
+ * or migrating work) can only trylock the tasklet, and backs off on failure.
+ * All of these locks are taken with IRQs disabled.
+ */
+struct tasklet_queue {
+    spinlock_t lock;
+    struct list_head list;
+};
+
+static DEFINE_PER_CPU(struct tasklet_queue, tasklet_queue);
+static DEFINE_PER_CPU(struct tasklet_queue, softirq_tasklet_queue);
+
+/* Number of queued unbound tasklets, i.e. work idle CPUs may steal. */
+static atomic_t nr_unbound_tasklets = ATOMIC_INIT(0);
 
-/* Protects all lists and tasklet structures. */
-static DEFINE_SPINLOCK(tasklet_lock);
+static struct tasklet_queue *tasklet_queue_of(
+    const struct tasklet *t, unsigned int cpu)
+{
+    return t->is_softirq ? &per_cpu(softirq_tasklet_queue, cpu)
+                         : &per_cpu(tasklet_queue, cpu);
+}
 
+/* Queue @t on t->scheduled_on. Caller holds t->lock. */
 static void tasklet_enqueue(struct tasklet *t)
 {
     unsigned int cpu = t->scheduled_on;
+    struct tasklet_queue *q = tasklet_queue_of(t, cpu);
+    bool_t was_empty;
+
+    spin_lock(&q->lock);
+    was_empty = list_empty(&q->list);
+    list_add_tail(&t->list, &q->list);
+    if ( t->is_unbound )
+        atomic_inc(&nr_unbound_tasklets);
+    spin_unlock(&q->lock);
 
     if ( t->is_softirq )
     {
-        struct list_head *list = &per_cpu(softirq_tasklet_list, cpu);
-        bool_t was_empty = list_empty(list);
-        list_add_tail(&t->list, list);
         if ( was_empty )
             cpu_raise_softirq(cpu, TASKLET_SOFTIRQ);
     }
     else
     {
         unsigned long *work_to_do = &per_cpu(tasklet_work_to_do, cpu);
-        list_add_tail(&t->list, &per_cpu(tasklet_list, cpu));
         if ( !test_and_set_bit(_TASKLET_enqueued, work_to_do) )
             cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
     }
 }
 
-void tasklet_schedule_on_cpu(struct tasklet *t, unsigned int cpu)
+/* Take @t off queue @q. Caller holds t->lock and q->lock. */
+static void __tasklet_dequeue(struct tasklet *t)
+{
+    list_del_init(&t->list);
+    if ( t->is_unbound )
+        atomic_dec(&nr_unbound_tasklets);
+}
+
+/* Take @t off the queue it is on. Caller holds t->lock. */
+static void tasklet_dequeue(struct tasklet *t)
+{
+    struct tasklet_queue *q = tasklet_queue_of(t, t->scheduled_on);
+
+    spin_lock(&q->lock);
+    __tasklet_dequeue(t);
+    spin_unlock(&q->lock);
+}
+
+/*
+ * Lock the first tasklet on @q (the first unbound one if @unbound_only),
+ * and return it with both q->lock and its own lock held.  NULL, with no
+ * lock held, if there is none.
+ */
+static struct tasklet *tasklet_lock_first(
+    struct tasklet_queue *q, bool_t unbound_only)
+{
+    struct tasklet *t;
+
+    for ( ; ; )
+    {
+        spin_lock(&q->lock);
+        list_for_each_entry ( t, &q->list, list )
+        {
+            if ( unbound_only && !t->is_unbound )
+                continue;
+            if ( spin_trylock(&t->lock) )
+                return t;
+            if ( !unbound_only )
+                break;
+        }
+        spin_unlock(&q->lock);
+
+        /* Stealing is opportunistic: only the owner waits for a tasklet. */
+        if ( unbound_only || list_empty(&q->list) )
+            return NULL;
+        cpu_relax();
+    }
+}
+
+static void __tasklet_schedule(
+    struct tasklet *t, unsigned int cpu, bool_t unbound)
 {
     unsigned long flags;
 
-    spin_lock_irqsave(&tasklet_lock, flags);
+    spin_lock_irqsave(&t->lock, flags);
 
     if ( tasklets_initialised && !t->is_dead )
     {
+        if ( !list_empty(&t->list) )
+            tasklet_dequeue(t);
         t->scheduled_on = cpu;
+        t->is_unbound = unbound && !t->is_softirq;
         if ( !t->is_running )
-        {
-            list_del(&t->list);
             tasklet_enqueue(t);
-        }
     }
 
-    spin_unlock_irqrestore(&tasklet_lock, flags);
+    spin_unlock_irqrestore(&t->lock, flags);
+}
+
+void tasklet_schedule_on_cpu(struct tasklet *t, unsigned int cpu)
+{
+    __tasklet_schedule(t, cpu, 0);
 }
 
 void tasklet_schedule(struct tasklet *t)
@@ -76,24 +158,88 @@ void tasklet_schedule(struct tasklet *t)
     tasklet_schedule_on_cpu(t, smp_processor_id());
 }
 
-static void do_tasklet_work(unsigned int cpu, struct list_head *list)
+void tasklet_schedule_unbound(struct tasklet *t)
+{
+    unsigned int cpu = smp_processor_id(), idle;
+
+    __tasklet_schedule(t, cpu, 1);
+
+    if ( is_idle_vcpu(current) )
+        return;
+
+    /* Poke an idle CPU, which will steal the work from us. */
+    for ( idle = cpumask_cycle(cpu, &cpu_online_map); idle != cpu;
+          idle = cpumask_cycle(idle, &cpu_online_map) )
+    {
+        if ( is_idle_vcpu(curr_on_cpu(idle)) &&
+             !per_cpu(tasklet_work_to_do, idle) )
+        {
+            cpu_raise_softirq(idle, SCHEDULE_SOFTIRQ);
+            break;
+        }
+    }
+}
+
+/* Move an unbound tasklet queued on another CPU onto our own queue. */
+static void tasklet_steal(unsigned int cpu)
+{
+    unsigned int victim;
+    struct tasklet_queue *q;
+    struct tasklet *t = NULL;
+
+    if ( likely(!atomic_read(&nr_unbound_tasklets)) )
+        return;
+
+    local_irq_disable();
+
+    for_each_online_cpu ( victim )
+    {
+        q = &per_cpu(tasklet_queue, victim);
+        if ( victim == cpu || list_empty(&q->list) )
+            continue;
+        if ( (t = tasklet_lock_first(q, 1)) != NULL )
+            break;
+    }
+
+    if ( t != NULL )
+    {
+        BUG_ON(t->is_dead || t->is_running || (t->scheduled_on != victim));
+        __tasklet_dequeue(t);
+        spin_unlock(&q->lock);
+        t->scheduled_on = cpu;
+        tasklet_enqueue(t);
+        spin_unlock(&t->lock);
+    }
+
+    local_irq_enable();
+}
+
+static void do_tasklet_work(unsigned int cpu, struct tasklet_queue *q)
 {
     struct tasklet *t;
 
-    if ( unlikely(list_empty(list) || cpu_is_offline(cpu)) )
+    if ( unlikely(list_empty(&q->list) || cpu_is_offline(cpu)) )
         return;
 
-    t = list_entry(list->next, struct tasklet, list);
-    list_del_init(&t->list);
+    local_irq_disable();
+
+    if ( (t = tasklet_lock_first(q, 0)) == NULL )
+    {
+        local_irq_enable();
+        return;
+    }
+
+    __tasklet_dequeue(t);
+    spin_unlock(&q->lock);
 
     BUG_ON(t->is_dead || t->is_running || (t->scheduled_on != cpu));
     t->scheduled_on = -1;
     t->is_running = 1;
 
-    spin_unlock_irq(&tasklet_lock);
+    spin_unlock_irq(&t->lock);
     sync_local_execstate();
     t->func(t->data);
-    spin_lock_irq(&tasklet_lock);
+    spin_lock_irq(&t->lock);
 
     t->is_running = 0;
 
@@ -102,6 +248,8 @@ static void do_tasklet_work(unsigned int cpu, struct list_head *list)
         BUG_ON(t->is_dead || !list_empty(&t->list));
         tasklet_enqueue(t);
     }
+
+    spin_unlock_irq(&t->lock);
 }
 
 /* VCPU context work */
@@ -109,54 +257,54 @@ void do_tasklet(void)
 {
     unsigned int cpu = smp_processor_id();
     unsigned long *work_to_do = &per_cpu(tasklet_work_to_do, cpu);
-    struct list_head *list = &per_cpu(tasklet_list, cpu);
+    struct tasklet_queue *q = &per_cpu(tasklet_queue, cpu);
 
     /*
      * Work must be enqueued *and* scheduled. Otherwise there is no work to
      * do, and/or scheduler needs to run to update idle vcpu priority.
      */
     if ( likely(*work_to_do != (TASKLET_enqueued|TASKLET_scheduled)) )
+    {
+        if ( !*work_to_do )
+            tasklet_steal(cpu);
         return;
+    }
 
-    spin_lock_irq(&tasklet_lock);
-
-    do_tasklet_work(cpu, list);
+    do_tasklet_work(cpu, q);
 
-    if ( list_empty(list) )
+    spin_lock_irq(&q->lock);
+    if ( list_empty(&q->list) )
     {
         clear_bit(_TASKLET_enqueued, work_to_do);        
         raise_softirq(SCHEDULE_SOFTIRQ);
     }
-
-    spin_unlock_irq(&tasklet_lock);
+    spin_unlock_irq(&q->lock);
 }
 
 /* Softirq context work */
 static void tasklet_softirq_action(void)
 {
     unsigned int cpu = smp_processor_id();
-    struct list_head *list = &per_cpu(softirq_tasklet_list, cpu);
+    struct tasklet_queue *q = &per_cpu(softirq_tasklet_queue, cpu);
 
-    spin_lock_irq(&tasklet_lock);
+    do_tasklet_work(cpu, q);
 
-    do_tasklet_work(cpu, list);
-
-    if ( !list_empty(list) && !cpu_is_offline(cpu) )
+    spin_lock_irq(&q->lock);
+    if ( !list_empty(&q->list) && !cpu_is_offline(cpu) )
         raise_softirq(TASKLET_SOFTIRQ);
-
-    spin_unlock_irq(&tasklet_lock);
+    spin_unlock_irq(&q->lock);
 }
 
 void tasklet_kill(struct tasklet *t)
 {
     unsigned long flags;
 
-    spin_lock_irqsave(&tasklet_lock, flags);
+    spin_lock_irqsave(&t->lock, flags);
 
     if ( !list_empty(&t->list) )
     {
         BUG_ON(t->is_dead || t->is_running || (t->scheduled_on < 0));
-        list_del_init(&t->list);
+        tasklet_dequeue(t);
     }
 
     t->scheduled_on = -1;
@@ -164,31 +312,32 @@ void tasklet_kill(struct tasklet *t)
 
     while ( t->is_running )
     {
-        spin_unlock_irqrestore(&tasklet_lock, flags);
+        spin_unlock_irqrestore(&t->lock, flags);
         cpu_relax();
-        spin_lock_irqsave(&tasklet_lock, flags);
+        spin_lock_irqsave(&t->lock, flags);
     }
 
-    spin_unlock_irqrestore(&tasklet_lock, flags);
+    spin_unlock_irqrestore(&t->lock, flags);
 }
 
-static void migrate_tasklets_from_cpu(unsigned int cpu, struct list_head *list)
+static void migrate_tasklets_from_cpu(unsigned int cpu, struct tasklet_queue *q)
 {
     unsigned long flags;
     struct tasklet *t;
 
-    spin_lock_irqsave(&tasklet_lock, flags);
+    local_irq_save(flags);
 
-    while ( !list_empty(list) )
+    while ( (t = tasklet_lock_first(q, 0)) != NULL )
     {
-        t = list_entry(list->next, struct tasklet, list);
         BUG_ON(t->scheduled_on != cpu);
+        __tasklet_dequeue(t);
+        spin_unlock(&q->lock);
         t->scheduled_on = smp_processor_id();
-        list_del(&t->list);
         tasklet_enqueue(t);
+        spin_unlock(&t->lock);
     }
 
-    spin_unlock_irqrestore(&tasklet_lock, flags);
+    local_irq_restore(flags);
 }
 
 void tasklet_init(
@@ -196,6 +345,7 @@ void tasklet_init(
 {
     memset(t, 0, sizeof(*t));
     INIT_LIST_HEAD(&t->list);
+    spin_lock_init(&t->lock);
     t->scheduled_on = -1;
     t->func = func;
     t->data = data;
@@ -216,13 +366,15 @@ static int cpu_callback(
     switch ( action )
     {
     case CPU_UP_PREPARE:
-        INIT_LIST_HEAD(&per_cpu(tasklet_list, cpu));
-        INIT_LIST_HEAD(&per_cpu(softirq_tasklet_list, cpu));
+        spin_lock_init(&per_cpu(tasklet_queue, cpu).lock);
+        INIT_LIST_HEAD(&per_cpu(tasklet_queue, cpu).list);
+        spin_lock_init(&per_cpu(softirq_tasklet_queue, cpu).lock);
+        INIT_LIST_HEAD(&per_cpu(softirq_tasklet_queue, cpu).list);
         break;
     case CPU_UP_CANCELED:
     case CPU_DEAD:
-        migrate_tasklets_from_cpu(cpu, &per_cpu(tasklet_list, cpu));
-        migrate_tasklets_from_cpu(cpu, &per_cpu(softirq_tasklet_list, cpu));
+        migrate_tasklets_from_cpu(cpu, &per_cpu(tasklet_queue, cpu));
+        migrate_tasklets_from_cpu(cpu, &per_cpu(softirq_tasklet_queue, cpu));
         break;
     default:
         break;
@@ -29,9 +29,38 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/* Use a hierarchical timer wheel rather than a heap for near-term timers. */
+static bool_t __read_mostly opt_timer_wheel;
+boolean_param("timer_wheel", opt_timer_wheel);
+
+/*
+ * Level 0 of the wheel has one slot per tick; each slot of level N+1 covers
+ * a full revolution of level N. Five levels of 64 slots span 2^46ns (about
+ * 19.5 hours); anything further out goes on the overflow linked list.
+ */
+#define WHEEL_TICK_SHIFT 16             /* ~65us per tick */
+#define WHEEL_BITS       6
+#define WHEEL_SIZE       (1u << WHEEL_BITS)
+#define WHEEL_MASK       (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS     5
+#define LEVEL_SHIFT(l)   ((l) * WHEEL_BITS)
+
+struct timer_wheel {
+    /*
+     * Next tick to process. Slots of higher levels starting before this tick
+     * have already been cascaded down; those starting at it have not.
+     */
+    uint64_t         base;
+    /* Lower bound on the earliest deadline in the wheel. */
+    s_time_t         deadline;
+    unsigned long    pending[WHEEL_LEVELS][BITS_TO_LONGS(WHEEL_SIZE)];
+    struct list_head slot[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
+    struct timer_wheel *wheel;
     struct timer  *list;
     struct timer  *running;
     struct list_head inactive;
@@ -167,6 +196,229 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * TIMER WHEEL OPERATIONS.
+ */
+
+static uint64_t wheel_tick(const struct timer_wheel *w, s_time_t expires)
+{
+    uint64_t tick = (expires > 0) ? (uint64_t)expires >> WHEEL_TICK_SHIFT : 0;
+
+    /* Timers already in the past go in the slot currently due. */
+    return (tick < w->base) ? w->base : tick;
+}
+
+static bool_t wheel_in_range(const struct timer_wheel *w, const struct timer *t)
+{
+    return !((wheel_tick(w, t->expires) - w->base) >>
+             LEVEL_SHIFT(WHEEL_LEVELS));
+}
+
+/* Delete @t from @w. Never reports a new earliest deadline. */
+static int remove_from_wheel(struct timer_wheel *w, struct timer *t)
+{
+    unsigned int l = t->wheel_slot / WHEEL_SIZE, s = t->wheel_slot % WHEEL_SIZE;
+
+    list_del(&t->wheel);
+    if ( list_empty(&w->slot[l][s]) )
+        __clear_bit(s, w->pending[l]);
+
+    return 0;
+}
+
+/* Add new entry @t to @w, which must be in range. Return TRUE if earliest. */
+static int add_to_wheel(struct timer_wheel *w, struct timer *t)
+{
+    uint64_t tick = wheel_tick(w, t->expires), delta = tick - w->base;
+    unsigned int l, s;
+
+    for ( l = 0; (l < WHEEL_LEVELS - 1) && (delta >> LEVEL_SHIFT(l + 1)); l++ )
+        continue;
+
+    s = (tick >> LEVEL_SHIFT(l)) & WHEEL_MASK;
+    list_add_tail(&t->wheel, &w->slot[l][s]);
+    __set_bit(s, w->pending[l]);
+    t->wheel_slot = l * WHEEL_SIZE + s;
+
+    if ( t->expires >= w->deadline )
+        return 0;
+    w->deadline = t->expires;
+    return 1;
+}
+
+/*
+ * Find the next pending slot of level @l, and the tick at which it is due
+ * (run for level 0, cascaded for higher levels). Return -1 if none pending.
+ */
+static int wheel_next_slot(const struct timer_wheel *w, unsigned int l,
+                           uint64_t *tick)
+{
+    uint64_t start = (w->base >> LEVEL_SHIFT(l)) << LEVEL_SHIFT(l);
+    unsigned int idx = (w->base >> LEVEL_SHIFT(l)) & WHEEL_MASK;
+    unsigned int from = idx, s, off;
+
+    /* A higher level's current slot is only due if we are at its start. */
+    if ( (l != 0) && (start != w->base) )
+        from++;
+
+    s = find_next_bit(w->pending[l], WHEEL_SIZE, from);
+    if ( s >= WHEEL_SIZE )
+        s = find_first_bit(w->pending[l], WHEEL_SIZE);
+    if ( s >= WHEEL_SIZE )
+        return -1;
+
+    off = (s - idx) & WHEEL_MASK;
+    if ( s < from )
+        off += WHEEL_SIZE * (off == 0);
+    *tick = start + ((uint64_t)off << LEVEL_SHIFT(l));
+
+    return s;
+}
+
+static uint64_t wheel_next_event(const struct timer_wheel *w)
+{
+    uint64_t next = ~0ULL, tick;
+    unsigned int l;
+
+    for ( l = 0; l < WHEEL_LEVELS; l++ )
+        if ( (wheel_next_slot(w, l, &tick) >= 0) && (tick < next) )
+            next = tick;
+
+    return next;
+}
+
+/* Earliest time at which the softirq has work to do on @w. */
+static s_time_t wheel_deadline(const struct timer_wheel *w)
+{
+    s_time_t deadline = STIME_MAX;
+    const struct timer *t;
+    uint64_t tick;
+    unsigned int l;
+    int s;
+
+    if ( (s = wheel_next_slot(w, 0, &tick)) >= 0 )
+        list_for_each_entry ( t, &w->slot[0][s], wheel )
+            if ( t->expires < deadline )
+                deadline = t->expires;
+
+    for ( l = 1; l < WHEEL_LEVELS; l++ )
+        if ( (wheel_next_slot(w, l, &tick) >= 0) &&
+             ((s_time_t)(tick << WHEEL_TICK_SHIFT) < deadline) )
+            deadline = tick << WHEEL_TICK_SHIFT;
+
+    return deadline;
+}
+
+/* Redistribute higher-level slots which start at w->base. */
+static void wheel_cascade(struct timer_wheel *w)
+{
+    struct list_head *head;
+    struct timer *t;
+    unsigned int l, s;
+    LIST_HEAD(list);
+
+    for ( l = WHEEL_LEVELS - 1; l > 0; l-- )
+    {
+        if ( w->base & ((1ULL << LEVEL_SHIFT(l)) - 1) )
+            continue;
+
+        s = (w->base >> LEVEL_SHIFT(l)) & WHEEL_MASK;
+        head = &w->slot[l][s];
+        if ( list_empty(head) )
+            continue;
+
+        list_splice_init(head, &list);
+        __clear_bit(s, w->pending[l]);
+
+        while ( !list_empty(&list) )
+        {
+            t = list_entry(list.next, struct timer, wheel);
+            list_del(&t->wheel);
+            add_to_wheel(w, t);
+        }
+    }
+}
+
+static void execute_timer(struct timers *ts, struct timer *t);
+
+/* Execute ready wheel timers. Called, and returns, with ts->lock held. */
+static void run_wheel(struct timers *ts, s_time_t now)
+{
+    struct timer_wheel *w = ts->wheel;
+    uint64_t now_tick = (now > 0) ? (uint64_t)now >> WHEEL_TICK_SHIFT : 0;
+    uint64_t next;
+    struct list_head *head;
+    struct timer *t;
+    unsigned int s;
+    LIST_HEAD(later);
+
+    while ( (next = wheel_next_event(w)) <= now_tick )
+    {
+        w->base = next;
+        wheel_cascade(w);
+
+        s = next & WHEEL_MASK;
+        head = &w->slot[0][s];
+
+        /*
+         * The lock is dropped around each handler, so entries may come and go
+         * from this slot meanwhile. Set aside those not yet due and put them
+         * back, and fix up the pending bit, once the slot is drained.
+         */
+        while ( !list_empty(head) )
+        {
+            t = list_entry(head->next, struct timer, wheel);
+            list_del(&t->wheel);
+            if ( t->expires >= now )
+                list_add_tail(&t->wheel, &later);
+            else
+                execute_timer(ts, t);
+        }
+
+        list_splice_init(&later, head);
+        if ( list_empty(head) )
+            __clear_bit(s, w->pending[0]);
+        else
+            __set_bit(s, w->pending[0]);
+
+        if ( next == now_tick )
+            break;
+        w->base = next + 1;
+    }
+
+    if ( w->base < now_tick )
+        w->base = now_tick;
+}
+
+static struct timer *wheel_first(const struct timer_wheel *w)
+{
+    unsigned int l, s;
+
+    for ( l = 0; l < WHEEL_LEVELS; l++ )
+        if ( (s = find_first_bit(w->pending[l], WHEEL_SIZE)) < WHEEL_SIZE )
+            return list_entry(w->slot[l][s].next, struct timer, wheel);
+
+    return NULL;
+}
+
+static struct timer_wheel *alloc_wheel(void)
+{
+    struct timer_wheel *w = xzalloc(struct timer_wheel);
+    unsigned int l, s;
+
+    if ( w == NULL )
+        return NULL;
+
+    for ( l = 0; l < WHEEL_LEVELS; l++ )
+        for ( s = 0; s < WHEEL_SIZE; s++ )
+            INIT_LIST_HEAD(&w->slot[l][s]);
+    w->base = (uint64_t)NOW() >> WHEEL_TICK_SHIFT;
+    w->deadline = STIME_MAX;
+
+    return w;
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -184,6 +436,9 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        rc = remove_from_wheel(timers->wheel, t);
+        break;
     default:
         rc = 0;
         BUG();
@@ -200,6 +455,16 @@ static int add_entry(struct timer *t)
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    if ( timers->wheel != NULL )
+    {
+        if ( wheel_in_range(timers->wheel, t) )
+        {
+            t->status = TIMER_STATUS_in_wheel;
+            return add_to_wheel(timers->wheel, t);
+        }
+        goto list;
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -207,6 +472,7 @@ static int add_entry(struct timer *t)
     if ( t->heap_offset != 0 )
         return rc;
 
+ list:
     /* Fall back to adding to the slower linked list. */
     t->status = TIMER_STATUS_in_list;
     return add_to_list(&timers->list, t);
@@ -277,7 +543,7 @@ static inline void timer_unlock(struct timer *timer)
 static bool_t active_timer(struct timer *timer)
 {
     ASSERT(timer->status >= TIMER_STATUS_inactive);
-    ASSERT(timer->status <= TIMER_STATUS_in_list);
+    ASSERT(timer->status <= TIMER_STATUS_in_wheel);
     return (timer->status >= TIMER_STATUS_in_heap);
 }
 
@@ -438,7 +704,7 @@ static void timer_softirq_action(void)
     heap = ts->heap;
 
     /* If we overflowed the heap, try to allocate a larger heap. */
-    if ( unlikely(ts->list != NULL) )
+    if ( unlikely(ts->list != NULL) && (ts->wheel == NULL) )
     {
         /* old_limit == (2^n)-1; new_limit == (2^(n+4))-1 */
         int old_limit = GET_HEAP_LIMIT(heap);
@@ -461,6 +727,10 @@ static void timer_softirq_action(void)
 
     now = NOW();
 
+    /* Execute ready wheel timers. */
+    if ( ts->wheel != NULL )
+        run_wheel(ts, now);
+
     /* Execute ready heap timers. */
     while ( (GET_HEAP_SIZE(heap) != 0) &&
             ((t = heap[1])->expires < now) )
@@ -476,20 +746,36 @@ static void timer_softirq_action(void)
         execute_timer(ts, t);
     }
 
-    /* Try to move timers from linked list to more efficient heap. */
-    next = ts->list;
-    ts->list = NULL;
-    while ( unlikely((t = next) != NULL) )
+    if ( ts->wheel != NULL )
     {
-        next = t->list_next;
-        t->status = TIMER_STATUS_invalid;
-        add_entry(t);
+        /* The list is sorted: move timers now within range onto the wheel. */
+        while ( unlikely((t = ts->list) != NULL) &&
+                wheel_in_range(ts->wheel, t) )
+        {
+            ts->list = t->list_next;
+            t->status = TIMER_STATUS_invalid;
+            add_entry(t);
+        }
+    }
+    else
+    {
+        /* Try to move timers from linked list to more efficient heap. */
+        next = ts->list;
+        ts->list = NULL;
+        while ( unlikely((t = next) != NULL) )
+        {
+            next = t->list_next;
+            t->status = TIMER_STATUS_invalid;
+            add_entry(t);
+        }
     }
 
     /* Find earliest deadline from head of linked list and top of heap. */
     deadline = STIME_MAX;
     if ( GET_HEAP_SIZE(heap) != 0 )
         deadline = heap[1]->expires;
+    if ( ts->wheel != NULL )
+        deadline = ts->wheel->deadline = wheel_deadline(ts->wheel);
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
     this_cpu(timer_deadline) =
@@ -522,7 +808,7 @@ static void dump_timerq(unsigned char key)
     struct timers *ts;
     unsigned long  flags;
     s_time_t       now = NOW();
-    int            i, j;
+    int            i, j, l;
 
     printk("Dumping timer queues:\n");
 
@@ -534,6 +820,11 @@ static void dump_timerq(unsigned char key)
         spin_lock_irqsave(&ts->lock, flags);
         for ( j = 1; j <= GET_HEAP_SIZE(ts->heap); j++ )
             dump_timer(ts->heap[j], now);
+        if ( ts->wheel != NULL )
+            for ( l = 0; l < WHEEL_LEVELS; l++ )
+                for ( j = 0; j < WHEEL_SIZE; j++ )
+                    list_for_each_entry ( t, &ts->wheel->slot[l][j], wheel )
+                        dump_timer(t, now);
         for ( t = ts->list, j = 0; t != NULL; t = t->list_next, j++ )
             dump_timer(t, now);
         spin_unlock_irqrestore(&ts->lock, flags);
@@ -546,6 +837,17 @@ static struct keyhandler dump_timerq_keyhandler = {
     .desc = "dump timer queues"
 };
 
+static struct timer *first_timer(struct timers *ts)
+{
+    struct timer *t;
+
+    if ( GET_HEAP_SIZE(ts->heap) )
+        return ts->heap[1];
+    if ( (ts->wheel != NULL) && ((t = wheel_first(ts->wheel)) != NULL) )
+        return t;
+    return ts->list;
+}
+
 static void migrate_timers_from_cpu(unsigned int old_cpu)
 {
     unsigned int new_cpu = cpumask_any(&cpu_online_map);
@@ -569,8 +871,7 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         spin_lock(&old_ts->lock);
     }
 
-    while ( (t = GET_HEAP_SIZE(old_ts->heap)
-             ? old_ts->heap[1] : old_ts->list) != NULL )
+    while ( (t = first_timer(old_ts)) != NULL )
     {
         remove_entry(t);
         write_atomic(&t->cpu, new_cpu);
@@ -606,6 +907,16 @@ static int cpu_callback(
         INIT_LIST_HEAD(&ts->inactive);
         spin_lock_init(&ts->lock);
         ts->heap = &dummy_heap;
+        /* A wheel is kept across offline, as it is left empty. */
+        if ( ts->wheel != NULL )
+            ts->wheel->base = (uint64_t)NOW() >> WHEEL_TICK_SHIFT;
+        else if ( opt_timer_wheel )
+        {
+            ts->wheel = alloc_wheel();
+            if ( ts->wheel == NULL )
+                printk(XENLOG_WARNING
+                       "CPU%u: no memory for timer wheel, using heap\n", cpu);
+        }
         break;
     case CPU_UP_CANCELED:
     case CPU_DEAD:
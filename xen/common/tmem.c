@@ -118,7 +118,8 @@ struct client {
     struct list_head client_list;
     struct tm_pool *pools[MAX_POOLS_PER_DOMAIN];
     tmh_client_t *tmh;
-    struct list_head ephemeral_page_list;
+    spinlock_t eph_lists_lock; /* protects ephemeral_page_list, eph_count */
+    struct list_head ephemeral_page_list; /* oldest (LRU) first */
     long eph_count, eph_count_max;
     cli_id_t cli_id;
     uint32_t weight;
@@ -167,6 +168,9 @@ struct tm_pool {
     /* for save/restore/migration */
     struct list_head persistent_page_list;
     struct tmem_page_descriptor *cur_pgp;
+    /* adaptive compression, see do_tmem_put_compress() */
+    unsigned int comp_ratio; /* recent compressed size, 1/256ths of a page */
+    unsigned int comp_skip;  /* puts to store raw before trying again */
     /* statistics collection */
     atomic_t pgp_count;
     int pgp_count_max;
@@ -218,7 +222,7 @@ typedef struct tmem_object_node objnode_t;
 
 struct tmem_page_descriptor {
     union {
-        struct list_head global_eph_pages;
+        uint64_t eph_stamp; /* ephemeral: eviction clock at last put/get */
         struct list_head client_inv_pages;
     };
     union {
@@ -234,8 +238,8 @@ struct tmem_page_descriptor {
     pagesize_t size; /* 0 == PAGE_SIZE (pfp), -1 == data invalid,
                     else compressed data (cdata) */
     uint32_t index;
-    /* must hold pcd_tree_rwlocks[firstbyte] to use pcd pointer/siblings */
-    uint16_t firstbyte; /* NON_SHAREABLE->pfp  otherwise->pcd */
+    /* must hold pcd_tree_rwlocks[bucket] to use pcd pointer/siblings */
+    uint16_t bucket; /* NOT_SHAREABLE->pfp  otherwise->pcd */
     bool_t eviction_attempted;  /* CHANGE TO lifetimes? (settable) */
     struct list_head pcd_siblings;
     union {
@@ -261,16 +265,22 @@ struct tmem_page_content_descriptor {
     };
     struct list_head pgp_list;
     struct rb_node pcd_rb_tree_node;
+    uint64_t hash; /* tmh_content_hash() of the page, or of cdata */
     uint32_t pgp_ref_count;
     pagesize_t size; /* if compression_enabled -> 0<size<PAGE_SIZE (*cdata)
                      * else if tze, 0<=size<PAGE_SIZE, rounded up to mult of 8
                      * else PAGE_SIZE -> *pfp */
 };
 typedef struct tmem_page_content_descriptor pcd_t;
-struct rb_root pcd_tree_roots[256]; /* choose based on first byte of page */
-rwlock_t pcd_tree_rwlocks[256]; /* poor man's concurrency for now */
-
-static LIST_HEAD(global_ephemeral_page_list); /* all pages in ephemeral pools */
+/*
+ * pcds are hashed into PCD_BUCKETS buckets by content hash, and each bucket
+ * keeps them in a tree ordered by that hash, so contents are only compared
+ * when the hashes match.
+ */
+#define PCD_BUCKETS 256
+#define pcd_bucket(_hash) ((_hash) >> 56)
+struct rb_root pcd_tree_roots[PCD_BUCKETS];
+rwlock_t pcd_tree_rwlocks[PCD_BUCKETS];
 
 static LIST_HEAD(global_client_list);
 static LIST_HEAD(global_pool_list);
@@ -284,7 +294,17 @@ static int tmem_initialized = 0;
 
 EXPORT DEFINE_SPINLOCK(tmem_spinlock);  /* used iff tmh_lock_all */
 EXPORT DEFINE_RWLOCK(tmem_rwlock);      /* used iff !tmh_lock_all */
-static DEFINE_SPINLOCK(eph_lists_spinlock); /* protects global AND clients */
+/*
+ * Each client keeps its ephemeral pages on its own LRU list, under its own
+ * lock, so puts and gets from different clients don't contend.  Global
+ * eviction order comes from stamping every page with the eviction clock
+ * (the cycle counter) when it is put or got: the evictor picks the client
+ * whose least recently used page is oldest.  eph_clock_lock serialises
+ * evictors and guards their walk of global_client_list, which may happen
+ * without tmem_rwlock held (tmem_relinquish_pages()).
+ */
+static DEFINE_SPINLOCK(eph_clock_lock);
+#define eph_clock() get_cycles()
 static DEFINE_SPINLOCK(pers_lists_spinlock);
 
 #define tmem_spin_lock(_l)  do {if (!tmh_lock_all) spin_lock(_l);}while(0)
@@ -300,7 +320,7 @@ static DEFINE_SPINLOCK(pers_lists_spinlock);
 #define ASSERT_WRITELOCK(_l) ASSERT(tmh_lock_all || rw_is_write_locked(_l))
 
 /* global counters (should use long_atomic_t access) */
-static long global_eph_count = 0; /* atomicity depends on eph_lists_spinlock */
+static atomic_t global_eph_count = ATOMIC_INIT(0);
 static atomic_t global_obj_count = ATOMIC_INIT(0);
 static atomic_t global_pgp_count = ATOMIC_INIT(0);
 static atomic_t global_pcd_count = ATOMIC_INIT(0);
@@ -379,12 +399,12 @@ static NOINLINE void tmem_page_free(pool_t *pool, pfp_t *pfp)
 
 static NOINLINE int pcd_copy_to_client(tmem_cli_mfn_t cmfn, pgp_t *pgp)
 {
-    uint8_t firstbyte = pgp->firstbyte;
+    uint8_t bucket = pgp->bucket;
     pcd_t *pcd;
     int ret;
 
     ASSERT(tmh_dedup_enabled());
-    tmem_read_lock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_read_lock(&pcd_tree_rwlocks[bucket]);
     pcd = pgp->pcd;
     if ( pgp->size < PAGE_SIZE && pgp->size != 0 &&
          pcd->size < PAGE_SIZE && pcd->size != 0 )
@@ -395,7 +415,7 @@ static NOINLINE int pcd_copy_to_client(tmem_cli_mfn_t cmfn, pgp_t *pgp)
     else
         ret = tmh_copy_to_client(cmfn, pcd->pfp, 0, 0, PAGE_SIZE,
                                  tmh_cli_buf_null);
-    tmem_read_unlock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_read_unlock(&pcd_tree_rwlocks[bucket]);
     return ret;
 }
 
@@ -405,7 +425,7 @@ static NOINLINE void pcd_disassociate(pgp_t *pgp, pool_t *pool, bool_t have_pcd_
 {
     pcd_t *pcd = pgp->pcd;
     pfp_t *pfp = pgp->pcd->pfp;
-    uint16_t firstbyte = pgp->firstbyte;
+    uint16_t bucket = pgp->bucket;
     char *pcd_tze = pgp->pcd->tze;
     pagesize_t pcd_size = pcd->size;
     pagesize_t pgp_size = pgp->size;
@@ -413,20 +433,20 @@ static NOINLINE void pcd_disassociate(pgp_t *pgp, pool_t *pool, bool_t have_pcd_
     pagesize_t pcd_csize = pgp->pcd->size;
 
     ASSERT(tmh_dedup_enabled());
-    ASSERT(firstbyte != NOT_SHAREABLE);
-    ASSERT(firstbyte < 256);
+    ASSERT(bucket != NOT_SHAREABLE);
+    ASSERT(bucket < PCD_BUCKETS);
 
     if ( have_pcd_rwlock )
-        ASSERT_WRITELOCK(&pcd_tree_rwlocks[firstbyte]);
+        ASSERT_WRITELOCK(&pcd_tree_rwlocks[bucket]);
     else
-        tmem_write_lock(&pcd_tree_rwlocks[firstbyte]);
+        tmem_write_lock(&pcd_tree_rwlocks[bucket]);
     list_del_init(&pgp->pcd_siblings);
     pgp->pcd = NULL;
-    pgp->firstbyte = NOT_SHAREABLE;
+    pgp->bucket = NOT_SHAREABLE;
     pgp->size = -1;
     if ( --pcd->pgp_ref_count )
     {
-        tmem_write_unlock(&pcd_tree_rwlocks[firstbyte]);
+        tmem_write_unlock(&pcd_tree_rwlocks[bucket]);
         return;
     }
 
@@ -434,7 +454,7 @@ static NOINLINE void pcd_disassociate(pgp_t *pgp, pool_t *pool, bool_t have_pcd_
     ASSERT(list_empty(&pcd->pgp_list));
     pcd->pfp = NULL;
     /* remove pcd from rbtree */
-    rb_erase(&pcd->pcd_rb_tree_node,&pcd_tree_roots[firstbyte]);
+    rb_erase(&pcd->pcd_rb_tree_node,&pcd_tree_roots[bucket]);
     /* reinit the struct for safety for now */
     RB_CLEAR_NODE(&pcd->pcd_rb_tree_node);
     /* now free up the pcd memory */
@@ -460,22 +480,27 @@ static NOINLINE void pcd_disassociate(pgp_t *pgp, pool_t *pool, bool_t have_pcd_
             pcd_tot_csize -= PAGE_SIZE;
         tmem_page_free(pool,pfp);
     }
-    tmem_write_unlock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_write_unlock(&pcd_tree_rwlocks[bucket]);
 }
 
 
-static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize)
+/* hash is that of the page in pgp->pfp; it is not used if cdata is given */
+static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize,
+                                  uint64_t hash)
 {
     struct rb_node **new, *parent = NULL;
     struct rb_root *root;
     pcd_t *pcd;
     int cmp;
     pagesize_t pfp_size = 0;
-    uint8_t firstbyte = (cdata == NULL) ? tmh_get_first_byte(pgp->pfp) : *cdata;
+    uint8_t bucket;
     int ret = 0;
 
     if ( !tmh_dedup_enabled() )
         return 0;
+    if ( cdata != NULL )
+        hash = tmh_content_hash(cdata, csize);
+    bucket = pcd_bucket(hash);
     ASSERT(pgp->us.obj != NULL);
     ASSERT(pgp->us.obj->pool != NULL);
     ASSERT(!pgp->us.obj->pool->persistent);
@@ -492,17 +517,19 @@ static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize)
         ASSERT(pfp_size <= PAGE_SIZE);
         ASSERT(!(pfp_size & (sizeof(uint64_t)-1)));
     }
-    tmem_write_lock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_write_lock(&pcd_tree_rwlocks[bucket]);
 
     /* look for page match */
-    root = &pcd_tree_roots[firstbyte];
+    root = &pcd_tree_roots[bucket];
     new = &(root->rb_node);
     while ( *new )
     {
         pcd = container_of(*new, pcd_t, pcd_rb_tree_node);
         parent = *new;
         /* compare new entry and rbtree entry, set cmp accordingly */
-        if ( cdata != NULL )
+        if ( hash != pcd->hash )
+            cmp = hash < pcd->hash ? -1 : 1;
+        else if ( cdata != NULL )
         {
             if ( pcd->size < PAGE_SIZE )
                 /* both new entry and rbtree entry are compressed */
@@ -560,6 +587,7 @@ static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize)
     RB_CLEAR_NODE(&pcd->pcd_rb_tree_node);  /* is this necessary */
     INIT_LIST_HEAD(&pcd->pgp_list);  /* is this necessary */
     pcd->pgp_ref_count = 0;
+    pcd->hash = hash;
     if ( cdata != NULL )
     {
         memcpy(pcd->cdata,cdata,csize);
@@ -589,12 +617,12 @@ static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize)
 match:
     pcd->pgp_ref_count++;
     list_add(&pgp->pcd_siblings,&pcd->pgp_list);
-    pgp->firstbyte = firstbyte;
+    pgp->bucket = bucket;
     pgp->eviction_attempted = 0;
     pgp->pcd = pcd;
 
 unlock:
-    tmem_write_unlock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_write_unlock(&pcd_tree_rwlocks[bucket]);
     return ret;
 }
 
@@ -612,12 +640,11 @@ static NOINLINE pgp_t *pgp_alloc(obj_t *obj)
     if ( (pgp = tmem_malloc(pgp_t, pool)) == NULL )
         return NULL;
     pgp->us.obj = obj;
-    INIT_LIST_HEAD(&pgp->global_eph_pages);
     INIT_LIST_HEAD(&pgp->us.client_eph_pages);
     pgp->pfp = NULL;
     if ( tmh_dedup_enabled() )
     {
-        pgp->firstbyte = NOT_SHAREABLE;
+        pgp->bucket = NOT_SHAREABLE;
         pgp->eviction_attempted = 0;
         INIT_LIST_HEAD(&pgp->pcd_siblings);
     }
@@ -646,7 +673,7 @@ static NOINLINE void pgp_free_data(pgp_t *pgp, pool_t *pool)
 
     if ( pgp->pfp == NULL )
         return;
-    if ( tmh_dedup_enabled() && pgp->firstbyte != NOT_SHAREABLE )
+    if ( tmh_dedup_enabled() && pgp->bucket != NOT_SHAREABLE )
         pcd_disassociate(pgp,pool,0); /* pgp->size lost */
     else if ( pgp_size )
         tmem_free(pgp->cdata,pgp_size,pool);
@@ -675,10 +702,7 @@ static NOINLINE void pgp_free(pgp_t *pgp, int from_delete)
     ASSERT(pgp->us.obj->pool != NULL);
     pool = pgp->us.obj->pool;
     if ( is_ephemeral(pool) )
-    {
-        ASSERT(list_empty(&pgp->global_eph_pages));
         ASSERT(list_empty(&pgp->us.client_eph_pages));
-    }
     pgp_free_data(pgp, pool);
     atomic_dec_and_assert(global_pgp_count);
     atomic_dec_and_assert(pool->pgp_count);
@@ -720,17 +744,16 @@ static void pgp_delist(pgp_t *pgp, bool_t no_eph_lock)
     if ( is_ephemeral(pgp->us.obj->pool) )
     {
         if ( !no_eph_lock )
-            tmem_spin_lock(&eph_lists_spinlock);
+            tmem_spin_lock(&client->eph_lists_lock);
         if ( !list_empty(&pgp->us.client_eph_pages) )
+        {
             client->eph_count--;
+            atomic_dec_and_assert(global_eph_count);
+        }
         ASSERT(client->eph_count >= 0);
         list_del_init(&pgp->us.client_eph_pages);
-        if ( !list_empty(&pgp->global_eph_pages) )
-            global_eph_count--;
-        ASSERT(global_eph_count >= 0);
-        list_del_init(&pgp->global_eph_pages);
         if ( !no_eph_lock )
-            tmem_spin_unlock(&eph_lists_spinlock);
+            tmem_spin_unlock(&client->eph_lists_lock);
     } else {
         if ( client->live_migrating )
         {
@@ -1078,6 +1101,7 @@ static pool_t * pool_alloc(void)
     pool->pageshift = PAGE_SHIFT - 12;
     pool->good_puts = pool->puts = pool->dup_puts_flushed = 0;
     pool->dup_puts_replaced = pool->no_mem_puts = 0;
+    pool->comp_ratio = pool->comp_skip = 0;
     pool->found_gets = pool->gets = 0;
     pool->flushs_found = pool->flushs = 0;
     pool->flush_objs_found = pool->flush_objs = 0;
@@ -1118,6 +1142,7 @@ static NOINLINE void shared_pool_reassign(pool_t *pool)
     sharelist_t *sl;
     int poolid;
     client_t *old_client = pool->client, *new_client;
+    pgp_t *pgp, *pgp2;
 
     ASSERT(is_shared(pool));
     if ( list_empty(&pool->share_list) )
@@ -1128,15 +1153,27 @@ static NOINLINE void shared_pool_reassign(pool_t *pool)
     old_client->pools[pool->pool_id] = NULL;
     sl = list_entry(pool->share_list.next, sharelist_t, share_list);
     ASSERT(sl->client != old_client);
-    pool->client = new_client = sl->client;
+    new_client = sl->client;
     for (poolid = 0; poolid < MAX_POOLS_PER_DOMAIN; poolid++)
         if (new_client->pools[poolid] == pool)
             break;
     ASSERT(poolid != MAX_POOLS_PER_DOMAIN);
-    new_client->eph_count += _atomic_read(pool->pgp_count);
-    old_client->eph_count -= _atomic_read(pool->pgp_count);
-    list_splice_init(&old_client->ephemeral_page_list,
-                     &new_client->ephemeral_page_list);
+    /* move this pool's ephemeral pages over, keeping them in LRU order */
+    tmem_spin_lock(&old_client->eph_lists_lock);
+    tmem_spin_lock(&new_client->eph_lists_lock);
+    pool->client = new_client;
+    list_for_each_entry_safe(pgp,pgp2,&old_client->ephemeral_page_list,
+                             us.client_eph_pages)
+    {
+        if ( pgp->us.obj->pool != pool )
+            continue;
+        list_move_tail(&pgp->us.client_eph_pages,
+                       &new_client->ephemeral_page_list);
+        old_client->eph_count--;
+        new_client->eph_count++;
+    }
+    tmem_spin_unlock(&new_client->eph_lists_lock);
+    tmem_spin_unlock(&old_client->eph_lists_lock);
     tmh_client_info("reassigned shared pool from %s=%d to %s=%d pool_id=%d\n",
         cli_id_str, old_client->cli_id, cli_id_str, new_client->cli_id, poolid);
     pool->pool_id = poolid;
@@ -1240,13 +1277,16 @@ static client_t *client_create(cli_id_t cli_id)
             client->shared_auth_uuid[i][1] = -1L;
     client->frozen = 0; client->live_migrating = 0;
     client->weight = 0; client->cap = 0;
-    list_add_tail(&client->client_list, &global_client_list);
+    spin_lock_init(&client->eph_lists_lock);
     INIT_LIST_HEAD(&client->ephemeral_page_list);
     INIT_LIST_HEAD(&client->persistent_invalidated_list);
     client->cur_pgp = NULL;
     client->eph_count = client->eph_count_max = 0;
     client->total_cycles = 0; client->succ_pers_puts = 0;
     client->succ_eph_gets = 0; client->succ_pers_gets = 0;
+    tmem_spin_lock(&eph_clock_lock);
+    list_add_tail(&client->client_list, &global_client_list);
+    tmem_spin_unlock(&eph_clock_lock);
     tmh_client_info("ok\n");
     return client;
 
@@ -1257,7 +1297,9 @@ static client_t *client_create(cli_id_t cli_id)
 
 static void client_free(client_t *client)
 {
+    tmem_spin_lock(&eph_clock_lock);
     list_del(&client->client_list);
+    tmem_spin_unlock(&eph_clock_lock);
     tmh_client_destroy(client->tmh);
     tmh_free_infra(client);
 }
@@ -1288,7 +1330,7 @@ static bool_t client_over_quota(client_t *client)
     if ( (total == 0) || (client->weight == 0) || 
           (client->eph_count == 0) )
         return 0;
-    return ( ((global_eph_count*100L) / client->eph_count ) >
+    return ( ((_atomic_read(global_eph_count)*100L) / client->eph_count ) >
              ((total*100L) / client->weight) );
 }
 
@@ -1304,7 +1346,7 @@ static bool_t tmem_try_to_evict_pgp(pgp_t *pgp, bool_t *hold_pool_rwlock)
     obj_t *obj = pgp->us.obj;
     pool_t *pool = obj->pool;
     client_t *client = pool->client;
-    uint16_t firstbyte = pgp->firstbyte;
+    uint16_t bucket = pgp->bucket;
 
     if ( pool->is_dying )
         return 0;
@@ -1314,17 +1356,16 @@ static bool_t tmem_try_to_evict_pgp(pgp_t *pgp, bool_t *hold_pool_rwlock)
     {
         if ( tmh_dedup_enabled() )
         {
-            firstbyte = pgp->firstbyte;
-            if ( firstbyte ==  NOT_SHAREABLE )
+            bucket = pgp->bucket;
+            if ( bucket ==  NOT_SHAREABLE )
                 goto obj_unlock;
-            ASSERT(firstbyte < 256);
-            if ( !tmem_write_trylock(&pcd_tree_rwlocks[firstbyte]) )
+            ASSERT(bucket < PCD_BUCKETS);
+            if ( !tmem_write_trylock(&pcd_tree_rwlocks[bucket]) )
                 goto obj_unlock;
             if ( pgp->pcd->pgp_ref_count > 1 && !pgp->eviction_attempted )
             {
                 pgp->eviction_attempted++;
-                list_del(&pgp->global_eph_pages);
-                list_add_tail(&pgp->global_eph_pages,&global_ephemeral_page_list);
+                pgp->eph_stamp = eph_clock();
                 list_del(&pgp->us.client_eph_pages);
                 list_add_tail(&pgp->us.client_eph_pages,&client->ephemeral_page_list);
                 goto pcd_unlock;
@@ -1338,40 +1379,27 @@ static bool_t tmem_try_to_evict_pgp(pgp_t *pgp, bool_t *hold_pool_rwlock)
             return 1;
         }
 pcd_unlock:
-        tmem_write_unlock(&pcd_tree_rwlocks[firstbyte]);
+        tmem_write_unlock(&pcd_tree_rwlocks[bucket]);
 obj_unlock:
         tmem_spin_unlock(&obj->obj_spinlock);
     }
     return 0;
 }
 
-static int tmem_evict(void)
+/* evict one page from client's LRU list, called with eph_clock_lock held */
+static int tmem_evict_from(client_t *client)
 {
-    client_t *client = tmh_client_from_current();
-    pgp_t *pgp = NULL, *pgp2, *pgp_del;
+    pgp_t *pgp, *pgp2, *pgp_del;
     obj_t *obj;
     pool_t *pool;
-    int ret = 0;
     bool_t hold_pool_rwlock = 0;
 
-    evict_attempts++;
-    tmem_spin_lock(&eph_lists_spinlock);
-    if ( (client != NULL) && client_over_quota(client) &&
-         !list_empty(&client->ephemeral_page_list) )
-    {
-        list_for_each_entry_safe(pgp,pgp2,&client->ephemeral_page_list,us.client_eph_pages)
-            if ( tmem_try_to_evict_pgp(pgp,&hold_pool_rwlock) )
-                goto found;
-    } else if ( list_empty(&global_ephemeral_page_list) ) {
-        goto out;
-    } else {
-        list_for_each_entry_safe(pgp,pgp2,&global_ephemeral_page_list,global_eph_pages)
-            if ( tmem_try_to_evict_pgp(pgp,&hold_pool_rwlock) )
-                goto found;
-    }
-
-    ret = 0;
-    goto out;
+    tmem_spin_lock(&client->eph_lists_lock);
+    list_for_each_entry_safe(pgp,pgp2,&client->ephemeral_page_list,us.client_eph_pages)
+        if ( tmem_try_to_evict_pgp(pgp,&hold_pool_rwlock) )
+            goto found;
+    tmem_spin_unlock(&client->eph_lists_lock);
+    return 0;
 
 found:
     ASSERT(pgp != NULL);
@@ -1382,11 +1410,12 @@ found:
     ASSERT(obj->pool != NULL);
     ASSERT_SENTINEL(obj,OBJ);
     pool = obj->pool;
+    ASSERT(pool->client == client);
 
     ASSERT_SPINLOCK(&obj->obj_spinlock);
     pgp_del = pgp_delete_from_obj(obj, pgp->index);
     ASSERT(pgp_del == pgp);
-    if ( tmh_dedup_enabled() && pgp->firstbyte != NOT_SHAREABLE )
+    if ( tmh_dedup_enabled() && pgp->bucket != NOT_SHAREABLE )
     {
         ASSERT(pgp->pcd->pgp_ref_count == 1 || pgp->eviction_attempted);
         pcd_disassociate(pgp,pool,1);
@@ -1401,11 +1430,57 @@ found:
         tmem_spin_unlock(&obj->obj_spinlock);
     if ( hold_pool_rwlock )
         tmem_write_unlock(&pool->pool_rwlock);
+    tmem_spin_unlock(&client->eph_lists_lock);
     evicted_pgs++;
-    ret = 1;
+    return 1;
+}
+
+static int tmem_evict(void)
+{
+    client_t *client = tmh_client_from_current();
+    client_t *c, *victim = NULL;
+    uint64_t oldest = 0;
+    int ret = 0;
+
+    evict_attempts++;
+    tmem_spin_lock(&eph_clock_lock);
+    if ( (client != NULL) && client_over_quota(client) &&
+         !list_empty(&client->ephemeral_page_list) )
+    {
+        ret = tmem_evict_from(client);
+        goto out;
+    }
+
+    /* find the client holding the globally least recently used page */
+    list_for_each_entry(c,&global_client_list,client_list)
+    {
+        pgp_t *pgp;
+
+        tmem_spin_lock(&c->eph_lists_lock);
+        if ( !list_empty(&c->ephemeral_page_list) )
+        {
+            pgp = list_entry(c->ephemeral_page_list.next, pgp_t,
+                             us.client_eph_pages);
+            if ( victim == NULL || (int64_t)(pgp->eph_stamp - oldest) < 0 )
+            {
+                victim = c;
+                oldest = pgp->eph_stamp;
+            }
+        }
+        tmem_spin_unlock(&c->eph_lists_lock);
+    }
+    if ( victim == NULL )
+        goto out;
+    if ( (ret = tmem_evict_from(victim)) )
+        goto out;
+
+    /* nothing evictable there right now: take whatever we can get */
+    list_for_each_entry(c,&global_client_list,client_list)
+        if ( c != victim && (ret = tmem_evict_from(c)) )
+            break;
 
 out:
-    tmem_spin_unlock(&eph_lists_spinlock);
+    tmem_spin_unlock(&eph_clock_lock);
     return ret;
 }
 
@@ -1443,12 +1518,35 @@ static inline void tmem_ensure_avail_pages(void)
 
 /************ TMEM CORE OPERATIONS ************************************/
 
+/*
+ * Compression costs far more CPU than a page copy, and a pool whose pages
+ * don't compress (media, encrypted or already compressed data) pays it for
+ * nothing.  So each pool keeps a moving average of how well its recent
+ * pages compressed; while that is above COMP_RATIO_MAX the next
+ * COMP_BACKOFF puts store their pages raw, after which one put probes
+ * whether compression has become worthwhile again.  The pool fields are
+ * only updated under an object lock, so concurrent puts to different
+ * objects may race on them; being a heuristic, that doesn't matter.
+ */
+#define COMP_RATIO_MAX 224   /* in 1/256ths of a page: saving < 1/8 */
+#define COMP_BACKOFF   64
+
+static void pool_comp_account(pool_t *pool, size_t size)
+{
+    unsigned int sample = min_t(size_t, size, PAGE_SIZE) * 256 / PAGE_SIZE;
+
+    pool->comp_ratio = (pool->comp_ratio * 7 + sample) / 8;
+    if ( pool->comp_ratio > COMP_RATIO_MAX )
+        pool->comp_skip = COMP_BACKOFF;
+}
+
 static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
                                          tmem_cli_va_param_t clibuf)
 {
     void *dst, *p;
     size_t size;
     int ret = 0;
+    pool_t *pool;
     DECL_LOCAL_CYC_COUNTER(compress);
     
     ASSERT(pgp != NULL);
@@ -1456,18 +1554,30 @@ static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
     ASSERT_SPINLOCK(&pgp->us.obj->obj_spinlock);
     ASSERT(pgp->us.obj->pool != NULL);
     ASSERT(pgp->us.obj->pool->client != NULL);
+    pool = pgp->us.obj->pool;
+
+    if ( pool->comp_skip )
+    {
+        pool->comp_skip--;
+        return 0;
+    }
 
     if ( pgp->pfp != NULL )
         pgp_free_data(pgp, pgp->us.obj->pool);
     START_CYC_COUNTER(compress);
     ret = tmh_compress_from_client(cmfn, &dst, &size, clibuf);
-    if ( ret <= 0 )
+    if ( ret < 0 )
+        goto out;
+    if ( ret == 0 )
+        size = PAGE_SIZE;
+    pool_comp_account(pool, size);
+    if ( ret == 0 )
         goto out;
     else if ( (size == 0) || (size >= tmem_subpage_maxsize()) ) {
         ret = 0;
         goto out;
     } else if ( tmh_dedup_enabled() && !is_persistent(pgp->us.obj->pool) ) {
-        if ( (ret = pcd_associate(pgp,dst,size)) == -ENOMEM )
+        if ( (ret = pcd_associate(pgp,dst,size,0)) == -ENOMEM )
             goto out;
     } else if ( (p = tmem_malloc_bytes(size,pgp->us.obj->pool)) == NULL ) {
         ret = -ENOMEM;
@@ -1495,6 +1605,8 @@ static NOINLINE int do_tmem_dup_put(pgp_t *pgp, tmem_cli_mfn_t cmfn,
     client_t *client;
     pgp_t *pgpfound = NULL;
     int ret;
+    bool_t dedup;
+    uint64_t hash = 0;
 
     ASSERT(pgp != NULL);
     ASSERT(pgp->pfp != NULL);
@@ -1504,6 +1616,7 @@ static NOINLINE int do_tmem_dup_put(pgp_t *pgp, tmem_cli_mfn_t cmfn,
     ASSERT(obj != NULL);
     pool = obj->pool;
     ASSERT(pool != NULL);
+    dedup = tmh_dedup_enabled() && !is_persistent(pool);
     client = pool->client;
     if ( client->live_migrating )
         goto failed_dup; /* no dups allowed when migrating */
@@ -1529,12 +1642,12 @@ copy_uncompressed:
     pgp->size = 0;
     /* tmh_copy_from_client properly handles len==0 and offsets != 0 */
     ret = tmh_copy_from_client(pgp->pfp, cmfn, tmem_offset, pfn_offset, len,
-                               tmh_cli_buf_null);
+                               tmh_cli_buf_null, dedup ? &hash : NULL);
     if ( ret < 0 )
         goto bad_copy;
-    if ( tmh_dedup_enabled() && !is_persistent(pool) )
+    if ( dedup )
     {
-        if ( pcd_associate(pgp,NULL,0) == -ENOMEM )
+        if ( pcd_associate(pgp,NULL,0,hash) == -ENOMEM )
             goto failed_dup;
     }
 
@@ -1585,6 +1698,8 @@ static NOINLINE int do_tmem_put(pool_t *pool,
     pgp_t *pgp = NULL, *pgpdel = NULL;
     client_t *client = pool->client;
     int ret = client->frozen ? -EFROZEN : -ENOMEM;
+    bool_t dedup = tmh_dedup_enabled() && !is_persistent(pool);
+    uint64_t hash = 0;
 
     ASSERT(pool != NULL);
     pool->puts++;
@@ -1654,28 +1769,26 @@ copy_uncompressed:
     }
     /* tmh_copy_from_client properly handles len==0 (TMEM_NEW_PAGE) */
     ret = tmh_copy_from_client(pgp->pfp, cmfn, tmem_offset, pfn_offset, len,
-                               clibuf);
+                               clibuf, dedup ? &hash : NULL);
     if ( ret < 0 )
         goto bad_copy;
-    if ( tmh_dedup_enabled() && !is_persistent(pool) )
+    if ( dedup )
     {
-        if ( pcd_associate(pgp,NULL,0) == -ENOMEM )
+        if ( pcd_associate(pgp,NULL,0,hash) == -ENOMEM )
             goto delete_and_free;
     }
 
 insert_page:
     if ( is_ephemeral(pool) )
     {
-        tmem_spin_lock(&eph_lists_spinlock);
-        list_add_tail(&pgp->global_eph_pages,
-            &global_ephemeral_page_list);
-        if (++global_eph_count > global_eph_count_max)
-            global_eph_count_max = global_eph_count;
+        tmem_spin_lock(&client->eph_lists_lock);
+        pgp->eph_stamp = eph_clock();
         list_add_tail(&pgp->us.client_eph_pages,
             &client->ephemeral_page_list);
         if (++client->eph_count > client->eph_count_max)
             client->eph_count_max = client->eph_count;
-        tmem_spin_unlock(&eph_lists_spinlock);
+        atomic_inc_and_max(global_eph_count);
+        tmem_spin_unlock(&client->eph_lists_lock);
     } else { /* is_persistent */
         tmem_spin_lock(&pers_lists_spinlock);
         list_add_tail(&pgp->us.pool_pers_pages,
@@ -1751,7 +1864,7 @@ static NOINLINE int do_tmem_get(pool_t *pool, OID *oidp, uint32_t index,
     }
     ASSERT(pgp->size != -1);
     if ( tmh_dedup_enabled() && !is_persistent(pool) &&
-              pgp->firstbyte != NOT_SHAREABLE )
+              pgp->bucket != NOT_SHAREABLE )
         rc = pcd_copy_to_client(cmfn, pgp);
     else if ( pgp->size != 0 )
     {
@@ -1779,12 +1892,11 @@ static NOINLINE int do_tmem_get(pool_t *pool, OID *oidp, uint32_t index,
                 tmem_write_unlock(&pool->pool_rwlock);
             }
         } else {
-            tmem_spin_lock(&eph_lists_spinlock);
-            list_del(&pgp->global_eph_pages);
-            list_add_tail(&pgp->global_eph_pages,&global_ephemeral_page_list);
+            tmem_spin_lock(&client->eph_lists_lock);
+            pgp->eph_stamp = eph_clock();
             list_del(&pgp->us.client_eph_pages);
             list_add_tail(&pgp->us.client_eph_pages,&client->ephemeral_page_list);
-            tmem_spin_unlock(&eph_lists_spinlock);
+            tmem_spin_unlock(&client->eph_lists_lock);
             obj->last_client = tmh_get_cli_id_from_current();
         }
     }
@@ -2210,9 +2322,9 @@ static int tmemc_list_global(tmem_cli_va_param_t buf, int off, uint32_t len,
       total_flush_pool, use_long ? ',' : '\n');
     if (use_long)
         n += scnprintf(info+n,BSIZE-n,
-          "Ec:%ld,Em:%ld,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
+          "Ec:%d,Em:%ld,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
           "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu\n",
-          global_eph_count, global_eph_count_max,
+          _atomic_read(global_eph_count), global_eph_count_max,
           _atomic_read(global_obj_count), global_obj_count_max,
           _atomic_read(global_rtree_node_count), global_rtree_node_count_max,
           _atomic_read(global_pgp_count), global_pgp_count_max,
@@ -2947,7 +3059,7 @@ static int __init init_tmem(void)
         return 0;
 
     if ( tmh_dedup_enabled() )
-        for (i = 0; i < 256; i++ )
+        for (i = 0; i < PCD_BUCKETS; i++ )
         {
             pcd_tree_roots[i] = RB_ROOT;
             rwlock_init(&pcd_tree_rwlocks[i]);
@@ -9,6 +9,7 @@
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
 #include <xen/lzo.h> /* compression code */
+#include <xen/lz4.h>
 #include <xen/paging.h>
 #include <xen/domain_page.h>
 #include <xen/cpu.h>
@@ -22,7 +23,20 @@ boolean_param("tmem", opt_tmem);
 EXPORT bool_t __read_mostly opt_tmem_compress = 0;
 boolean_param("tmem_compress", opt_tmem_compress);
 
-EXPORT bool_t __read_mostly opt_tmem_dedup = 0;
+/* which compressor to use if tmem_compress is on: "lzo" or "lz4" */
+static bool_t __read_mostly tmh_use_lz4 = 0;
+static void __init parse_tmem_compressor(const char *s)
+{
+    if ( !strcmp(s, "lz4") )
+        tmh_use_lz4 = 1;
+    else if ( !strcmp(s, "lzo") )
+        tmh_use_lz4 = 0;
+    else
+        printk("tmem: unknown compressor '%s', using lzo\n", s);
+}
+custom_param("tmem_compressor", parse_tmem_compressor);
+
+EXPORT bool_t __read_mostly opt_tmem_dedup = 1;
 boolean_param("tmem_dedup", opt_tmem_dedup);
 
 EXPORT bool_t __read_mostly opt_tmem_tze = 0;
@@ -47,8 +61,8 @@ DECL_CYC_COUNTER(pg_copy);
 
 /* these are a concurrency bottleneck, could be percpu and dynamically
  * allocated iff opt_tmem_compress */
-#define LZO_WORKMEM_BYTES LZO1X_1_MEM_COMPRESS
-#define LZO_DSTMEM_PAGES 2
+#define WORKMEM_BYTES max_t(size_t, LZO1X_1_MEM_COMPRESS, LZ4_MEM_COMPRESS)
+#define DSTMEM_PAGES 2
 static DEFINE_PER_CPU_READ_MOSTLY(unsigned char *, workmem);
 static DEFINE_PER_CPU_READ_MOSTLY(unsigned char *, dstmem);
 static DEFINE_PER_CPU_READ_MOSTLY(void *, scratch_page);
@@ -144,9 +158,88 @@ static inline void cli_put_page(void *cli_va, pfp_t *cli_pfp,
 }
 #endif
 
+/*
+ * Content hash used to index dedup candidates.  This is the xxHash64 round
+ * function on four independent lanes, so the page is hashed at close to
+ * memory speed, and can be hashed while it is being copied anyway.
+ */
+#define HASH_P1 0x9E3779B185EBCA87ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH_P3 0x165667B19E3779F9ULL
+#define HASH_LANES 4
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t w)
+{
+    acc += w * HASH_P2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * HASH_P1;
+}
+
+static inline void hash_init(uint64_t v[HASH_LANES])
+{
+    v[0] = HASH_P1 + HASH_P2;
+    v[1] = HASH_P2;
+    v[2] = 0;
+    v[3] = -HASH_P1;
+}
+
+static uint64_t hash_final(const uint64_t v[HASH_LANES], size_t len)
+{
+    uint64_t h = ((v[0] << 1) | (v[0] >> 63)) + ((v[1] << 7) | (v[1] >> 57)) +
+                 ((v[2] << 12) | (v[2] >> 52)) + ((v[3] << 18) | (v[3] >> 46));
+
+    h ^= len;
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+EXPORT uint64_t tmh_content_hash(const void *va, size_t len)
+{
+    const uint64_t *p = va;
+    uint64_t v[HASH_LANES], tail[HASH_LANES] = { 0 };
+    size_t i, n = len / sizeof(tail);
+    unsigned int j;
+
+    hash_init(v);
+    for ( i = 0; i < n; i++, p += HASH_LANES )
+        for ( j = 0; j < HASH_LANES; j++ )
+            v[j] = hash_round(v[j], p[j]);
+    if ( len % sizeof(tail) )
+    {
+        memcpy(tail, p, len % sizeof(tail));
+        for ( j = 0; j < HASH_LANES; j++ )
+            v[j] = hash_round(v[j], tail[j]);
+    }
+    return hash_final(v, len);
+}
+
+/* tmh_copy_page(), also returning tmh_content_hash() of the page */
+static uint64_t tmh_copy_page_hash(void *to, const void *from)
+{
+    uint64_t *d = to;
+    const uint64_t *s = from;
+    uint64_t v[HASH_LANES];
+    unsigned int i, j;
+
+    hash_init(v);
+    for ( i = 0; i < PAGE_SIZE / sizeof(*s); i += HASH_LANES )
+        for ( j = 0; j < HASH_LANES; j++ )
+        {
+            d[i + j] = s[i + j];
+            v[j] = hash_round(v[j], s[i + j]);
+        }
+    return hash_final(v, PAGE_SIZE);
+}
+
+/* if hash is non-NULL, the content hash of the whole page is returned */
 EXPORT int tmh_copy_from_client(pfp_t *pfp,
     tmem_cli_mfn_t cmfn, pagesize_t tmem_offset,
-    pagesize_t pfn_offset, pagesize_t len, tmem_cli_va_param_t clibuf)
+    pagesize_t pfn_offset, pagesize_t len, tmem_cli_va_param_t clibuf,
+    uint64_t *hash)
 {
     unsigned long tmem_mfn, cli_mfn = 0;
     char *tmem_va, *cli_va = NULL;
@@ -161,6 +254,8 @@ EXPORT int tmh_copy_from_client(pfp_t *pfp,
     if ( tmem_offset == 0 && pfn_offset == 0 && len == 0 )
     {
         memset(tmem_va, 0, PAGE_SIZE);
+        if ( hash )
+            *hash = tmh_content_hash(tmem_va, PAGE_SIZE);
         unmap_domain_page(tmem_va);
         return 1;
     }
@@ -175,7 +270,15 @@ EXPORT int tmh_copy_from_client(pfp_t *pfp,
     }
     smp_mb();
     if ( len == PAGE_SIZE && !tmem_offset && !pfn_offset && cli_va )
-        tmh_copy_page(tmem_va, cli_va);
+    {
+        if ( hash )
+        {
+            *hash = tmh_copy_page_hash(tmem_va, cli_va);
+            hash = NULL;
+        }
+        else
+            tmh_copy_page(tmem_va, cli_va);
+    }
     else if ( (tmem_offset+len <= PAGE_SIZE) &&
               (pfn_offset+len <= PAGE_SIZE) )
     {
@@ -187,12 +290,51 @@ EXPORT int tmh_copy_from_client(pfp_t *pfp,
     }
     else if ( len )
         rc = -EINVAL;
+    if ( hash && rc > 0 )
+        *hash = tmh_content_hash(tmem_va, PAGE_SIZE);
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 0);
     unmap_domain_page(tmem_va);
     return rc;
 }
 
+/*
+ * Guess from a sample of the page whether compressing it is worthwhile:
+ * an (almost) all-zero sample says yes for certain, and a sample in which
+ * nearly every byte is different says the page is likely random or
+ * already compressed.  Reading 64 scattered words costs far less than a
+ * failed compression of the whole page.
+ */
+#define SAMPLE_WORDS 64
+static bool_t page_looks_incompressible(const void *va)
+{
+    const uint32_t *p = va;
+    unsigned long seen[256 / BITS_PER_LONG] = { 0 };
+    unsigned int i, zero = 0, distinct = 0;
+
+    for ( i = 0; i < SAMPLE_WORDS; i++ )
+    {
+        uint32_t w = p[i * (PAGE_SIZE / sizeof(*p) / SAMPLE_WORDS) +
+                       (i % (PAGE_SIZE / sizeof(*p) / SAMPLE_WORDS))];
+        unsigned int b;
+
+        if ( !w )
+        {
+            zero++;
+            continue;
+        }
+        for ( b = 0; b < 4; b++, w >>= 8 )
+            if ( !__test_and_set_bit(w & 0xff, seen) )
+                distinct++;
+    }
+
+    if ( zero >= SAMPLE_WORDS / 2 )
+        return 0;
+
+    /* 256 random bytes cover ~160 of the 256 values; text only ~40. */
+    return distinct > 128;
+}
+
 EXPORT int tmh_compress_from_client(tmem_cli_mfn_t cmfn,
     void **out_va, size_t *out_len, tmem_cli_va_param_t clibuf)
 {
@@ -217,12 +359,22 @@ EXPORT int tmh_compress_from_client(tmem_cli_mfn_t cmfn,
     else if ( copy_from_guest(scratch, clibuf, PAGE_SIZE) )
         return -EFAULT;
     smp_mb();
-    ret = lzo1x_1_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len, wmem);
-    ASSERT(ret == LZO_E_OK);
+    if ( page_looks_incompressible(cli_va ?: scratch) )
+        ret = 0;
+    else if ( tmh_use_lz4 )
+        ret = lz4_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len,
+                           wmem) == 0;
+    else
+    {
+        ret = lzo1x_1_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len,
+                               wmem);
+        ASSERT(ret == LZO_E_OK);
+        ret = 1;
+    }
     *out_va = dmem;
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 0);
-    return 1;
+    return ret;
 }
 
 EXPORT int tmh_copy_to_client(tmem_cli_mfn_t cmfn, pfp_t *pfp,
@@ -282,8 +434,18 @@ EXPORT int tmh_decompress_to_client(tmem_cli_mfn_t cmfn, void *tmem_va,
     }
     else if ( !scratch )
         return 0;
-    ret = lzo1x_decompress_safe(tmem_va, size, cli_va ?: scratch, &out_len);
-    ASSERT(ret == LZO_E_OK);
+    if ( tmh_use_lz4 )
+    {
+        ret = lz4_decompress_unknownoutputsize(tmem_va, size,
+                                               cli_va ?: scratch, &out_len);
+        ASSERT(ret == 0);
+    }
+    else
+    {
+        ret = lzo1x_decompress_safe(tmem_va, size, cli_va ?: scratch,
+                                    &out_len);
+        ASSERT(ret == LZO_E_OK);
+    }
     ASSERT(out_len == PAGE_SIZE);
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 1);
@@ -485,8 +647,8 @@ EXPORT int __init tmh_init(void)
     if ( !tmh_mempool_init() )
         return 0;
 
-    dstmem_order = get_order_from_pages(LZO_DSTMEM_PAGES);
-    workmem_order = get_order_from_bytes(LZO1X_1_MEM_COMPRESS);
+    dstmem_order = get_order_from_pages(DSTMEM_PAGES);
+    workmem_order = get_order_from_bytes(WORKMEM_BYTES);
 
     for_each_online_cpu ( cpu )
     {
@@ -30,7 +30,6 @@
 #include <xen/mm.h>
 #include <xen/percpu.h>
 #include <xen/pfn.h>
-#include <xen/cpu.h>
 #include <asm/atomic.h>
 #include <public/sysctl.h>
 
@@ -54,7 +53,6 @@ static struct t_info *t_info;
 static unsigned int t_info_pages;
 
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
 /* High water mark for trace buffers; */
@@ -65,6 +63,11 @@ static u32 t_buf_highwater;
 static DEFINE_PER_CPU(unsigned long, lost_records);
 static DEFINE_PER_CPU(unsigned long, lost_records_first_tsc);
 
+/* End of the space reserved in this cpu's buffer, in prod's encoding. */
+static DEFINE_PER_CPU(u32, t_reserve);
+/* Number of __trace_var() invocations active on this cpu. */
+static DEFINE_PER_CPU(unsigned int, t_nest);
+
 /* a flag recording whether initialization has been done */
 /* or more properly, if the tbuf subsystem is enabled right now */
 int tb_init_done __read_mostly;
@@ -73,27 +76,12 @@ int tb_init_done __read_mostly;
 static cpumask_t tb_cpu_mask;
 
 /* which tracing events are enabled */
-static u32 tb_event_mask = TRC_ALL;
+u32 tb_event_mask __read_mostly = TRC_ALL;
 
 /* Return the number of elements _type necessary to store at least _x bytes of data
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
 
-static int cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     int offset_in_bytes = offsetof(struct t_info, mfn_offset[NR_CPUS]);
@@ -226,13 +214,12 @@ static int alloc_trace_bufs(unsigned int pages)
         struct t_buf *buf;
         struct page_info *pg;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
         per_cpu(t_bufs, cpu) = buf = mfn_to_virt(t_info_mfn_list[offset]);
         buf->cons = buf->prod = 0;
+        per_cpu(t_reserve, cpu) = 0;
 
         printk(XENLOG_INFO "xentrace: p%d mfn %x offset %u\n",
                    cpu, t_info_mfn_list[offset], offset);
@@ -308,22 +295,7 @@ static int tb_set_size(unsigned int pages)
 
 int trace_will_trace_event(u32 event)
 {
-    if ( !tb_init_done )
-        return 0;
-
-    /*
-     * Copied from __trace_var()
-     */
-    if ( (tb_event_mask & event) == 0 )
-        return 0;
-
-    /* match class */
-    if ( ((tb_event_mask >> TRC_CLS_SHIFT) & (event >> TRC_CLS_SHIFT)) == 0 )
-        return 0;
-
-    /* then match subclass */
-    if ( (((tb_event_mask >> TRC_SUBCLS_SHIFT) & 0xf )
-                & ((event >> TRC_SUBCLS_SHIFT) & 0xf )) == 0 )
+    if ( !tb_init_done || !tb_event_enabled(event) )
         return 0;
 
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
@@ -342,7 +314,6 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -414,16 +385,16 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
         int i;
 
         tb_init_done = 0;
-        smp_wmb();
+        smp_mb();
         /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
-         * hypercall returns, no more records should be placed into the buffers. */
+         * start tracing.  Wait for writers already past their tb_init_done check
+         * to make sure we're not racing them: after this hypercall returns, no
+         * more records should be placed into the buffers. */
         for_each_online_cpu(i)
         {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
+            while ( read_atomic(&per_cpu(t_nest, i)) )
+                cpu_relax();
             per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
         }
     }
         break;
@@ -460,12 +431,10 @@ static inline bool_t bogus(u32 prod, u32 cons)
     return 0;
 }
 
-static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
+static inline u32 calc_unconsumed_bytes(u32 prod, u32 cons)
 {
-    u32 prod = buf->prod, cons = buf->cons;
     s32 x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
     if ( bogus(prod, cons) )
         return data_size;
 
@@ -479,16 +448,10 @@ static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
+static inline u32 calc_bytes_to_wrap(u32 prod)
 {
-    u32 prod = buf->prod, cons = buf->cons;
-    s32 x;
-
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return 0;
+    s32 x = data_size - prod;
 
-    x = data_size - prod;
     if ( x <= 0 )
         x += data_size;
 
@@ -498,27 +461,15 @@ static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_avail(const struct t_buf *buf)
-{
-    return data_size - calc_unconsumed_bytes(buf);
-}
-
-static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
-                                 unsigned char **next_page,
-                                 uint32_t *offset_in_page)
+static unsigned char *next_record(u32 x, unsigned char **next_page,
+                                  uint32_t *offset_in_page)
 {
-    u32 x = buf->prod, cons = buf->cons;
     uint16_t per_cpu_mfn_offset;
     uint32_t per_cpu_mfn_nr;
     uint32_t *mfn_list;
     uint32_t mfn;
     unsigned char *this_page;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    *next = x;
-    if ( !tb_init_done || bogus(x, cons) )
-        return NULL;
-
     if ( x >= data_size )
         x -= data_size;
 
@@ -547,7 +498,9 @@ static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
     return this_page;
 }
 
+/* Write a record at *@pos, in space reserved by __trace_var(). */
 static inline void __insert_record(struct t_buf *buf,
+                                   u32 *pos,
                                    unsigned long event,
                                    unsigned int extra,
                                    bool_t cycles,
@@ -559,16 +512,14 @@ static inline void __insert_record(struct t_buf *buf,
     unsigned char *this_page, *next_page;
     unsigned int extra_word = extra / sizeof(u32);
     unsigned int local_rec_size = calc_rec_size(cycles, extra);
-    uint32_t next;
+    uint32_t next = *pos;
     uint32_t offset;
     uint32_t remaining;
 
     BUG_ON(local_rec_size != rec_size);
     BUG_ON(extra & 3);
 
-    this_page = next_record(buf, &next, &next_page, &offset);
-    if ( !this_page )
-        return;
+    this_page = next_record(next, &next_page, &offset);
 
     remaining = PAGE_SIZE - offset;
 
@@ -576,10 +527,11 @@ static inline void __insert_record(struct t_buf *buf,
     {
         if ( next_page == NULL )
         {
-            /* access beyond end of buffer */
+            /* access beyond end of buffer: the reservation is broken */
             printk(XENLOG_WARNING
                    "%s: size=%08x prod=%08x cons=%08x rec=%u remaining=%u\n",
                    __func__, data_size, next, buf->cons, rec_size, remaining);
+            tb_init_done = 0;
             return;
         }
         rec = &split_rec;
@@ -607,19 +559,17 @@ static inline void __insert_record(struct t_buf *buf,
         memcpy(next_page, (char *)rec + remaining, rec_size - remaining);
     }
 
-    smp_wmb();
-
     next += rec_size;
     if ( next >= 2*data_size )
         next -= 2*data_size;
     ASSERT(next < 2*data_size);
-    buf->prod = next;
+    *pos = next;
 }
 
-static inline void insert_wrap_record(struct t_buf *buf,
+static inline void insert_wrap_record(struct t_buf *buf, u32 *pos,
                                       unsigned int size)
 {
-    u32 space_left = calc_bytes_to_wrap(buf);
+    u32 space_left = calc_bytes_to_wrap(*pos);
     unsigned int extra_space = space_left - sizeof(u32);
     bool_t cycles = 0;
 
@@ -633,13 +583,13 @@ static inline void insert_wrap_record(struct t_buf *buf,
         ASSERT((extra_space/sizeof(u32)) <= TRACE_EXTRA_MAX);
     }
 
-    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
+    __insert_record(buf, pos, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
                     space_left, NULL);
 }
 
 #define LOST_REC_SIZE (4 + 8 + 16) /* header + tsc + sizeof(struct ed) */
 
-static inline void insert_lost_records(struct t_buf *buf)
+static inline void insert_lost_records(struct t_buf *buf, u32 *pos)
 {
     struct {
         u32 lost_records;
@@ -649,12 +599,11 @@ static inline void insert_lost_records(struct t_buf *buf)
 
     ed.vid = current->vcpu_id;
     ed.did = current->domain->domain_id;
-    ed.lost_records = this_cpu(lost_records);
     ed.first_tsc = this_cpu(lost_records_first_tsc);
+    /* An interrupt may have logged them already, leaving us a zero count. */
+    ed.lost_records = xchg(&this_cpu(lost_records), 0);
 
-    this_cpu(lost_records) = 0;
-
-    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
+    __insert_record(buf, pos, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
                     LOST_REC_SIZE, &ed);
 }
 
@@ -677,16 +626,24 @@ static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
  * @extra_data: pointer to additional trace data
  *
  * Logs a trace record into the appropriate buffer.
+ *
+ * Each buffer has a single writer, its cpu, but interrupt handlers may
+ * trace on top of a record being written.  Instead of disabling them, a
+ * writer reserves its slice of the buffer by advancing t_reserve with a
+ * cpu-local cmpxchg, and then fills it in at leisure.  Interrupted
+ * writers complete before the writer they interrupted resumes, so only
+ * the outermost one publishes the reserved space to the consumer by
+ * updating buf->prod.
  */
 void __trace_var(u32 event, bool_t cycles, unsigned int extra,
                  const void *extra_data)
 {
     struct t_buf *buf;
-    unsigned long flags;
     u32 bytes_to_tail, bytes_to_wrap;
+    u32 start, end, pos, cons;
     unsigned int rec_size, total_size;
     unsigned int extra_word;
-    bool_t started_below_highwater;
+    bool_t lost, started_below_highwater;
 
     if( !tb_init_done )
         return;
@@ -702,16 +659,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Round size up to nearest word */
     extra = extra_word * sizeof(u32);
 
-    if ( (tb_event_mask & event) == 0 )
-        return;
-
-    /* match class */
-    if ( ((tb_event_mask >> TRC_CLS_SHIFT) & (event >> TRC_CLS_SHIFT)) == 0 )
-        return;
-
-    /* then match subclass */
-    if ( (((tb_event_mask >> TRC_SUBCLS_SHIFT) & 0xf )
-                & ((event >> TRC_SUBCLS_SHIFT) & 0xf )) == 0 )
+    if ( !tb_event_enabled(event) )
         return;
 
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
@@ -720,79 +668,93 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
-
     buf = this_cpu(t_bufs);
 
     if ( unlikely(!buf) )
-    {
-        /* Make gcc happy */
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        return;
 
-    started_below_highwater = (calc_unconsumed_bytes(buf) < t_buf_highwater);
+    this_cpu(t_nest)++;
+    barrier();
+
+    started_below_highwater =
+        (calc_unconsumed_bytes(read_atomic(&buf->prod),
+                               read_atomic(&buf->cons)) < t_buf_highwater);
 
     /* Calculate the record size */
     rec_size = calc_rec_size(cycles, extra);
- 
-    /* How many bytes are available in the buffer? */
-    bytes_to_tail = calc_bytes_avail(buf);
-    
-    /* How many bytes until the next wrap-around? */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
-    
-    /* 
-     * Calculate expected total size to commit this record by
-     * doing a dry-run.
-     */
-    total_size = 0;
 
-    /* First, check to see if we need to include a lost_record.
-     */
-    if ( this_cpu(lost_records) )
-    {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
+    do {
+        start = read_atomic(&this_cpu(t_reserve));
+        cons = read_atomic(&buf->cons);
+        if ( bogus(start, cons) )
+            goto out;
+
+        /* How many bytes are available in the buffer? */
+        bytes_to_tail = data_size - calc_unconsumed_bytes(start, cons);
+
+        /* How many bytes until the next wrap-around? */
+        bytes_to_wrap = calc_bytes_to_wrap(start);
+
+        /*
+         * Calculate expected total size to commit this record by
+         * doing a dry-run.
+         */
+        total_size = 0;
+
+        /* First, check to see if we need to include a lost_record.
+         */
+        lost = !!this_cpu(lost_records);
+        if ( lost )
+        {
+            if ( LOST_REC_SIZE > bytes_to_wrap )
+            {
+                total_size += bytes_to_wrap;
+                bytes_to_wrap = data_size;
+            } 
+            total_size += LOST_REC_SIZE;
+            bytes_to_wrap -= LOST_REC_SIZE;
+
+            /* LOST_REC might line up perfectly with the buffer wrap */
+            if ( bytes_to_wrap == 0 )
+                bytes_to_wrap = data_size;
+        }
+
+        if ( rec_size > bytes_to_wrap )
         {
             total_size += bytes_to_wrap;
-            bytes_to_wrap = data_size;
         } 
-        total_size += LOST_REC_SIZE;
-        bytes_to_wrap -= LOST_REC_SIZE;
+        total_size += rec_size;
 
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
-    }
+        /* Do we have enough space for everything? */
+        if ( total_size > bytes_to_tail )
+        {
+            if ( arch_fetch_and_add(&this_cpu(lost_records), 1) == 0 )
+                this_cpu(lost_records_first_tsc) = (u64)get_cycles();
+            started_below_highwater = 0;
+            goto out;
+        }
 
-    if ( rec_size > bytes_to_wrap )
-    {
-        total_size += bytes_to_wrap;
-    } 
-    total_size += rec_size;
+        end = start + total_size;
+        if ( end >= 2*data_size )
+            end -= 2*data_size;
 
-    /* Do we have enough space for everything? */
-    if ( total_size > bytes_to_tail )
-    {
-        if ( ++this_cpu(lost_records) == 1 )
-            this_cpu(lost_records_first_tsc)=(u64)get_cycles();
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        /* Lost the race with an interrupt handler?  Try again. */
+    } while ( cmpxchg_local(&this_cpu(t_reserve), start, end) != start );
 
     /*
-     * Now, actually write information 
+     * Now, actually write information into [start, end)
      */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
+    pos = start;
+    bytes_to_wrap = calc_bytes_to_wrap(pos);
 
-    if ( this_cpu(lost_records) )
+    if ( lost )
     {
         if ( LOST_REC_SIZE > bytes_to_wrap )
         {
-            insert_wrap_record(buf, LOST_REC_SIZE);
+            insert_wrap_record(buf, &pos, LOST_REC_SIZE);
             bytes_to_wrap = data_size;
         } 
-        insert_lost_records(buf);
+        insert_lost_records(buf, &pos);
         bytes_to_wrap -= LOST_REC_SIZE;
 
         /* LOST_REC might line up perfectly with the buffer wrap */
@@ -801,18 +763,35 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     }
 
     if ( rec_size > bytes_to_wrap )
-        insert_wrap_record(buf, rec_size);
+        insert_wrap_record(buf, &pos, rec_size);
 
     /* Write the original record */
-    __insert_record(buf, event, extra, cycles, rec_size, extra_data);
+    __insert_record(buf, &pos, event, extra, cycles, rec_size, extra_data);
+    ASSERT(pos == end || !tb_init_done);
+
+out:
+    /*
+     * The outermost writer publishes everything reserved so far, including
+     * records of handlers which interrupted it, and keeps doing so until
+     * no handler sneaks in between reading t_reserve and updating prod.
+     */
+    if ( this_cpu(t_nest) == 1 )
+    {
+        do {
+            end = read_atomic(&this_cpu(t_reserve));
+            smp_wmb(); /* records before prod */
+            write_atomic(&buf->prod, end);
+            barrier();
+        } while ( unlikely(read_atomic(&this_cpu(t_reserve)) != end) );
+    }
 
-unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    barrier();
+    this_cpu(t_nest)--;
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
-    if ( likely(buf!=NULL)
-         && started_below_highwater
-         && (calc_unconsumed_bytes(buf) >= t_buf_highwater) )
+    if ( started_below_highwater &&
+         (calc_unconsumed_bytes(read_atomic(&buf->prod),
+                                read_atomic(&buf->cons)) >= t_buf_highwater) )
         tasklet_schedule(&trace_notify_dom0_tasklet);
 }
 
@@ -22,6 +22,149 @@
 #define LZ4_DEFAULT_UNCOMPRESSED_CHUNK_SIZE (8 << 20)
 #define ARCHIVE_MAGICNUMBER 0x184C2102
 
+#ifdef __XEN__
+#include <xen/sched.h>
+#include <xen/softirq.h>
+#include <xen/tasklet.h>
+
+/*
+ * The chunks of the legacy LZ4 format are compressed independently, and
+ * all but the last decompress to exactly the chunk size, so with the whole
+ * image in memory they can be decompressed in parallel, by idle cpus.
+ */
+struct unlz4_chunk {
+	const u8 *in;
+	size_t in_len;
+	u8 *out;
+	size_t out_len;
+};
+
+static struct {
+	struct unlz4_chunk *chunks;
+	unsigned int nr;
+	unsigned int next;
+	atomic_t busy;
+	bool_t failed;
+} unlz4_work INITDATA;
+
+static void INIT unlz4_worker(unsigned long unused)
+{
+	unsigned int i;
+
+	while ((i = arch_fetch_and_add(&unlz4_work.next, 1)) <
+	       unlz4_work.nr) {
+		const struct unlz4_chunk *c = &unlz4_work.chunks[i];
+		size_t len = c->in_len;
+
+		if (lz4_decompress(c->in, &len, c->out, c->out_len) < 0 ||
+		    len != c->in_len)
+			unlz4_work.failed = 1;
+	}
+
+	smp_mb();
+	atomic_dec(&unlz4_work.busy);
+}
+
+static int INIT unlz4_parallel(const u8 *inp, int size, u8 *outp,
+			       size_t out_len, void (*error)(const char *x))
+{
+	struct unlz4_chunk *chunks;
+	struct tasklet *tasklets = NULL;
+	unsigned int nr = 0, pass, cpu;
+	int ret = -1;
+
+	/* Count the chunks, then note where each one goes. */
+	for (pass = 0, chunks = NULL; pass < 2; pass++) {
+		const u8 *p = inp;
+		int left = size;
+		size_t out_left = out_len;
+
+		for (nr = 0; left > 0; ) {
+			size_t chunksize;
+
+			if (left < 4) {
+				error("data corrupted");
+				goto exit;
+			}
+			chunksize = get_unaligned_le32(p);
+			p += 4;
+			left -= 4;
+			if (chunksize == ARCHIVE_MAGICNUMBER)
+				continue;
+			if (chunksize > left) {
+				error("data corrupted");
+				goto exit;
+			}
+			if (chunks) {
+				chunks[nr].in = p;
+				chunks[nr].in_len = chunksize;
+				chunks[nr].out = outp + (out_len - out_left);
+				chunks[nr].out_len =
+					min_t(size_t, out_left,
+					      LZ4_DEFAULT_UNCOMPRESSED_CHUNK_SIZE);
+			}
+			out_left -= min_t(size_t, out_left,
+					  LZ4_DEFAULT_UNCOMPRESSED_CHUNK_SIZE);
+			p += chunksize;
+			left -= chunksize;
+			nr++;
+		}
+
+		if (!pass) {
+			chunks = xmalloc_array(struct unlz4_chunk, nr);
+			if (!chunks) {
+				error("Could not allocate chunk list");
+				return -1;
+			}
+		}
+	}
+
+	unlz4_work.chunks = chunks;
+	unlz4_work.nr = nr;
+	unlz4_work.next = 0;
+	unlz4_work.failed = 0;
+	atomic_set(&unlz4_work.busy, 1);
+
+	if (nr > 1 && num_online_cpus() > 1)
+		tasklets = xzalloc_array(struct tasklet, nr_cpu_ids);
+	if (tasklets) {
+		unsigned int helpers = 0;
+
+		smp_wmb();
+		for_each_online_cpu(cpu) {
+			if (cpu == smp_processor_id())
+				continue;
+			if (++helpers >= nr)
+				break;
+			atomic_inc(&unlz4_work.busy);
+			tasklet_init(&tasklets[cpu], unlz4_worker, 0);
+			tasklet_schedule_on_cpu(&tasklets[cpu], cpu);
+		}
+	}
+
+	unlz4_worker(0);
+	while (atomic_read(&unlz4_work.busy))
+		process_pending_softirqs();
+	smp_rmb();
+
+	if (tasklets) {
+		for_each_online_cpu(cpu)
+			if (tasklets[cpu].func)
+				tasklet_kill(&tasklets[cpu]);
+		xfree(tasklets);
+	}
+
+	if (unlz4_work.failed)
+		error("Decoding failed");
+	else
+		ret = 0;
+
+ exit:
+	xfree(chunks);
+	return ret;
+}
+#endif
+
 STATIC int INIT unlz4(unsigned char *input, unsigned int in_len,
 		      int (*fill)(void *, unsigned int),
 		      int (*flush)(void *, unsigned int),
@@ -90,6 +233,13 @@ STATIC int INIT unlz4(unsigned char *input, unsigned int in_len,
 	if (posp)
 		*posp += 4;
 
+#ifdef __XEN__
+	if (input && output && !posp) {
+		ret = unlz4_parallel(inp, size, outp, out_len, error);
+		goto exit_2;
+	}
+#endif
+
 	for (;;) {
 
 		if (fill)
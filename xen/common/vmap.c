@@ -1,12 +1,19 @@
 #ifdef VMAP_VIRT_START
 #include <xen/bitmap.h>
 #include <xen/cache.h>
+#include <xen/cpu.h>
 #include <xen/init.h>
 #include <xen/mm.h>
 #include <xen/pfn.h>
+#include <xen/percpu.h>
+#include <xen/radix-tree.h>
+#include <xen/rcupdate.h>
 #include <xen/spinlock.h>
 #include <xen/types.h>
 #include <xen/vmap.h>
+#include <xen/xmalloc.h>
+#include <asm/atomic.h>
+#include <asm/flushtlb.h>
 #include <asm/page.h>
 
 static DEFINE_SPINLOCK(vm_lock);
@@ -181,13 +188,262 @@ void vm_free(const void *va)
     spin_unlock(&vm_lock);
 }
 
+#ifdef MAP_NO_FLUSH
+/*
+ * Lazy TLB flushing: vunmap() only clears the PTEs and queues the range
+ * here.  The ranges are handed back to the allocator in bulk by
+ * vm_purge(), after a single global TLB flush, so no stale translation
+ * survives into a new mapping while unmaps cost no IPIs.
+ */
+#define VM_LAZY_MAX 256
+
+static DEFINE_SPINLOCK(vm_lazy_lock);
+static const void *vm_lazy[VM_LAZY_MAX];
+static unsigned int vm_lazy_nr;
+static unsigned int vm_lazy_pages;
+
+/* Pages allowed to await a flush: 32Mb, scaled with log2 of the cpus. */
+static unsigned int vm_lazy_max_pages(void)
+{
+    return (MB(32) >> PAGE_SHIFT) * fls(num_online_cpus());
+}
+
+static unsigned int __vm_purge(void)
+{
+    unsigned int i, nr = vm_lazy_nr;
+
+    ASSERT(spin_is_locked(&vm_lazy_lock));
+
+    if ( !nr )
+        return 0;
+
+    /* See flush_area() in map_pages_to_xen(). */
+    if ( local_irq_is_enabled() )
+        flush_all(FLUSH_TLB_GLOBAL);
+    else
+        flush_local(FLUSH_TLB_GLOBAL);
+
+    for ( i = 0; i < nr; i++ )
+        vm_free(vm_lazy[i]);
+    vm_lazy_nr = 0;
+    vm_lazy_pages = 0;
+
+    return nr;
+}
+
+static unsigned int vm_purge(void)
+{
+    unsigned int nr;
+
+    spin_lock(&vm_lazy_lock);
+    nr = __vm_purge();
+    spin_unlock(&vm_lazy_lock);
+
+    return nr;
+}
+
+/* Free an (unmapped, but not yet flushed) range. */
+static void vm_free_lazy(const void *va, unsigned int nr)
+{
+    spin_lock(&vm_lazy_lock);
+    if ( vm_lazy_nr == VM_LAZY_MAX ||
+         vm_lazy_pages + nr > vm_lazy_max_pages() )
+        __vm_purge();
+    vm_lazy[vm_lazy_nr++] = va;
+    vm_lazy_pages += nr;
+    spin_unlock(&vm_lazy_lock);
+}
+
+static void vm_unmap(const void *va, unsigned int nr)
+{
+    map_pages_to_xen((unsigned long)va, 0, nr, _PAGE_NONE | MAP_NO_FLUSH);
+}
+#else
+static unsigned int vm_purge(void)
+{
+    return 0;
+}
+
+static void vm_free_lazy(const void *va, unsigned int nr)
+{
+    vm_free(va);
+}
+
+static void vm_unmap(const void *va, unsigned int nr)
+{
+#ifndef _PAGE_NONE
+    unsigned long addr = (unsigned long)va;
+
+    destroy_xen_mappings(addr, addr + PAGE_SIZE * nr);
+#else /* Avoid tearing down intermediate page tables. */
+    map_pages_to_xen((unsigned long)va, 0, nr, _PAGE_NONE);
+#endif
+}
+#endif
+
+/*
+ * Per-cpu blocks: small vmap()s are carved out of a block of address
+ * space owned by the local cpu, so they don't need vm_lock at all.  A
+ * block's space is never reused piecemeal: once its owner has moved on
+ * and the last allocation in it is gone, the whole block is freed.
+ */
+#define VMAP_BLOCK_PAGES 64
+#define VMAP_BLOCK_MAX   8  /* largest allocation served from a block */
+
+struct vmap_block {
+    void *va;
+    unsigned int next;      /* first unused page; owner cpu only */
+    atomic_t refcnt;        /* live allocations, +1 while owned */
+    uint8_t size[VMAP_BLOCK_PAGES];
+};
+
+static DEFINE_PER_CPU(struct vmap_block *, vmap_block);
+static bool_t __read_mostly vmap_blocks_ready;
+static struct radix_tree_root vmap_blocks;
+static DEFINE_SPINLOCK(vmap_blocks_lock);
+static DEFINE_RCU_READ_LOCK(vmap_blocks_rcu_lock);
+
+static unsigned long vmap_block_key(const void *va)
+{
+    return PFN_DOWN(va - vm_base) / VMAP_BLOCK_PAGES;
+}
+
+static struct vmap_block *vmap_block_new(void)
+{
+    struct vmap_block *vb = xmalloc(struct vmap_block);
+    int rc;
+
+    if ( !vb )
+        return NULL;
+
+    vb->va = vm_alloc(VMAP_BLOCK_PAGES, VMAP_BLOCK_PAGES);
+    if ( !vb->va && vm_purge() )
+        vb->va = vm_alloc(VMAP_BLOCK_PAGES, VMAP_BLOCK_PAGES);
+    if ( !vb->va )
+    {
+        xfree(vb);
+        return NULL;
+    }
+    vb->next = 0;
+    atomic_set(&vb->refcnt, 1);
+
+    spin_lock(&vmap_blocks_lock);
+    rc = radix_tree_insert(&vmap_blocks, vmap_block_key(vb->va), vb);
+    spin_unlock(&vmap_blocks_lock);
+
+    if ( rc )
+    {
+        vm_free(vb->va);
+        xfree(vb);
+        return NULL;
+    }
+
+    return vb;
+}
+
+static void vmap_block_put(struct vmap_block *vb)
+{
+    if ( !atomic_dec_and_test(&vb->refcnt) )
+        return;
+
+    spin_lock(&vmap_blocks_lock);
+    radix_tree_delete(&vmap_blocks, vmap_block_key(vb->va));
+    spin_unlock(&vmap_blocks_lock);
+
+    vm_free_lazy(vb->va, VMAP_BLOCK_PAGES);
+    xfree(vb);
+}
+
+static void *vmap_block_alloc(unsigned int nr)
+{
+    struct vmap_block *vb = this_cpu(vmap_block);
+    unsigned int idx;
+
+    /* Leave a guard page in front of each allocation. */
+    if ( vb && vb->next + 1 + nr > VMAP_BLOCK_PAGES )
+    {
+        this_cpu(vmap_block) = NULL;
+        vmap_block_put(vb);
+        vb = NULL;
+    }
+
+    if ( !vb )
+    {
+        vb = vmap_block_new();
+        if ( !vb )
+            return NULL;
+        this_cpu(vmap_block) = vb;
+    }
+
+    idx = vb->next + 1;
+    vb->next = idx + nr;
+    vb->size[idx] = nr;
+    atomic_inc(&vb->refcnt);
+
+    return vb->va + idx * PAGE_SIZE;
+}
+
+static struct vmap_block *vmap_block_find(const void *va)
+{
+    struct vmap_block *vb;
+
+    if ( !vmap_blocks_ready )
+        return NULL;
+
+    rcu_read_lock(&vmap_blocks_rcu_lock);
+    vb = radix_tree_lookup(&vmap_blocks, vmap_block_key(va));
+    rcu_read_unlock(&vmap_blocks_rcu_lock);
+
+    return vb;
+}
+
+/* A dead cpu's block would otherwise stay owned, and never be freed. */
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct vmap_block *vb;
+
+    if ( action == CPU_DEAD )
+    {
+        vb = per_cpu(vmap_block, cpu);
+        per_cpu(vmap_block, cpu) = NULL;
+        if ( vb )
+            vmap_block_put(vb);
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init vmap_blocks_init(void)
+{
+    radix_tree_init(&vmap_blocks);
+    register_cpu_notifier(&cpu_nfb);
+    vmap_blocks_ready = 1;
+    return 0;
+}
+__initcall(vmap_blocks_init);
+
 void *__vmap(const unsigned long *mfn, unsigned int granularity,
              unsigned int nr, unsigned int align, unsigned int flags)
 {
-    void *va = vm_alloc(nr * granularity, align);
-    unsigned long cur = (unsigned long)va;
-
-    for ( ; va && nr--; ++mfn, cur += PAGE_SIZE * granularity )
+    unsigned int pages = nr * granularity;
+    void *va = NULL;
+    unsigned long cur;
+
+    if ( vmap_blocks_ready && align <= 1 && pages <= VMAP_BLOCK_MAX )
+        va = vmap_block_alloc(pages);
+    if ( !va )
+        va = vm_alloc(pages, align);
+    if ( !va && vm_purge() )
+        va = vm_alloc(pages, align);
+
+    for ( cur = (unsigned long)va; va && nr--;
+          ++mfn, cur += PAGE_SIZE * granularity )
     {
         if ( map_pages_to_xen(cur, *mfn, granularity, flags) )
         {
@@ -206,13 +462,27 @@ void *vmap(const unsigned long *mfn, unsigned int nr)
 
 void vunmap(const void *va)
 {
-#ifndef _PAGE_NONE
-    unsigned long addr = (unsigned long)va;
+    struct vmap_block *vb;
+    unsigned int nr;
 
-    destroy_xen_mappings(addr, addr + PAGE_SIZE * vm_size(va));
-#else /* Avoid tearing down intermediate page tables. */
-    map_pages_to_xen((unsigned long)va, 0, vm_size(va), _PAGE_NONE);
-#endif
-    vm_free(va);
+    if ( !va )
+        return;
+
+    vb = vmap_block_find(va);
+    if ( vb )
+    {
+        nr = vb->size[PFN_DOWN(va - vb->va)];
+        ASSERT(nr);
+        vm_unmap(va, nr);
+        vmap_block_put(vb);
+        return;
+    }
+
+    nr = vm_size(va);
+    vm_unmap(va, nr);
+    if ( nr )
+        vm_free_lazy(va, nr);
+    else
+        vm_free(va);
 }
 #endif
@@ -41,6 +41,14 @@ static struct domain *xenoprof_primary_profiler;
 static int xenoprof_state = XENOPROF_IDLE;
 static unsigned long backtrace_depth;
 
+/*
+ * Number of samples an active domain's buffer must hold before it is sent
+ * VIRQ_XENOPROF, so that profilers can take samples in batches rather than
+ * being interrupted for each of them. 1 (the default) notifies per sample.
+ */
+static unsigned int __read_mostly opt_xenoprof_batch = 1;
+integer_param("xenoprof_batch", opt_xenoprof_batch);
+
 static u64 total_samples;
 static u64 invalid_buffer_samples;
 static u64 corrupted_buffer_samples;
@@ -586,6 +594,26 @@ void xenoprof_log_event(struct vcpu *vcpu, const struct cpu_user_regs *regs,
         xenoprof_backtrace(vcpu, regs, backtrace_depth, mode);
 }
 
+int xenoprof_notify_needed(struct vcpu *vcpu)
+{
+    struct domain *d = vcpu->domain;
+    struct xenoprof_vcpu *v;
+    int size, batch;
+
+    if ( opt_xenoprof_batch <= 1 || d->xenoprof == NULL )
+        return 1;
+
+    v = &d->xenoprof->vcpu[vcpu->vcpu_id];
+    if ( v->buffer == NULL )
+        return 1;
+
+    /* Never hold back more than half a buffer, to leave room for bursts. */
+    size = v->event_size;
+    batch = min_t(int, opt_xenoprof_batch, size / 2);
+
+    return size - 1 - xenoprof_buf_space(d, v->buffer, size) >= batch;
+}
+
 
 
 static int xenoprof_op_init(XEN_GUEST_HANDLE_PARAM(void) arg)
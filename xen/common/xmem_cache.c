@@ -0,0 +1,374 @@
+/******************************************************************************
+ * xmem_cache.c
+ *
+ * Caches of fixed-size objects, layered over xmalloc().
+ *
+ * Every cpu keeps two magazines (small stacks of free objects) per cache,
+ * so most allocations and frees are satisfied without taking any lock at
+ * all.  When both are empty (on alloc) or full (on free), the cpu swaps
+ * a magazine with the cache's depot under the cache lock, and only when
+ * the depot can't help either does the object come from, or go back to,
+ * the xmalloc pool.  This follows Bonwick & Adams, "Magazines and Vmem",
+ * USENIX 2001.
+ *
+ * Objects are ordinary xmalloc() blocks.  Like xmalloc(), caches may not
+ * be used in IRQ context; everything else runs to completion on a cpu,
+ * so the per-cpu magazines need no protection of their own.
+ */
+
+#include <xen/config.h>
+#include <xen/cpu.h>
+#include <xen/init.h>
+#include <xen/keyhandler.h>
+#include <xen/lib.h>
+#include <xen/list.h>
+#include <xen/spinlock.h>
+#include <xen/smp.h>
+#include <xen/irq.h>
+#include <xen/xmalloc.h>
+
+#define MAGAZINE_SIZE 14
+
+struct xmem_magazine {
+    struct xmem_magazine *next;
+    unsigned int nr;
+    void *objs[MAGAZINE_SIZE];
+};
+
+struct xmem_cache_cpu {
+    struct xmem_magazine *loaded, *prev;
+    unsigned long alloc_hits;   /* served from a magazine */
+    unsigned long alloc_misses; /* went to the xmalloc pool */
+    unsigned long free_hits;
+    unsigned long free_misses;
+} __cacheline_aligned;
+
+struct xmem_cache {
+    char name[16];
+    unsigned long size, align;
+    struct xmem_cache_cpu *cpu;     /* nr_cpu_ids entries */
+
+    /* The depot. */
+    spinlock_t lock;
+    struct xmem_magazine *full, *empty;
+    unsigned int nr_full, nr_empty;
+    unsigned long depot_hits, depot_misses;
+
+    struct list_head list;
+};
+
+static LIST_HEAD(cache_list);
+static DEFINE_SPINLOCK(cache_list_lock);
+
+/* Full magazines beyond this are given back to the pool. */
+#define DEPOT_MAX_FULL() (2 * num_online_cpus())
+
+static void magazine_drain(struct xmem_cache *cache, struct xmem_magazine *m)
+{
+    while ( m->nr )
+        xfree(m->objs[--m->nr]);
+}
+
+struct xmem_cache *xmem_cache_create(const char *name, unsigned long size,
+                                     unsigned long align)
+{
+    struct xmem_cache *cache = xzalloc(struct xmem_cache);
+
+    if ( !cache )
+        return NULL;
+
+    cache->cpu = xzalloc_array(struct xmem_cache_cpu, nr_cpu_ids);
+    if ( !cache->cpu )
+    {
+        xfree(cache);
+        return NULL;
+    }
+
+    strlcpy(cache->name, name, sizeof(cache->name));
+    cache->size = size;
+    cache->align = align;
+    spin_lock_init(&cache->lock);
+
+    spin_lock(&cache_list_lock);
+    list_add_tail(&cache->list, &cache_list);
+    spin_unlock(&cache_list_lock);
+
+    return cache;
+}
+
+static void free_magazine(struct xmem_cache *cache, struct xmem_magazine *m)
+{
+    if ( !m )
+        return;
+    magazine_drain(cache, m);
+    xfree(m);
+}
+
+static void free_magazine_list(struct xmem_cache *cache,
+                               struct xmem_magazine *m)
+{
+    while ( m )
+    {
+        struct xmem_magazine *next = m->next;
+
+        free_magazine(cache, m);
+        m = next;
+    }
+}
+
+void xmem_cache_destroy(struct xmem_cache *cache)
+{
+    unsigned int cpu;
+
+    if ( !cache )
+        return;
+
+    spin_lock(&cache_list_lock);
+    list_del(&cache->list);
+    spin_unlock(&cache_list_lock);
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        /* A cpu's magazines aren't on any list. */
+        free_magazine(cache, cache->cpu[cpu].loaded);
+        free_magazine(cache, cache->cpu[cpu].prev);
+    }
+    free_magazine_list(cache, cache->full);
+    free_magazine_list(cache, cache->empty);
+
+    xfree(cache->cpu);
+    xfree(cache);
+}
+
+void *xmem_cache_alloc(struct xmem_cache *cache)
+{
+    struct xmem_cache_cpu *cc = &cache->cpu[smp_processor_id()];
+    struct xmem_magazine *m;
+
+    ASSERT(!in_irq());
+
+    if ( cc->loaded && cc->loaded->nr )
+        goto hit;
+
+    if ( cc->prev && cc->prev->nr )
+    {
+        m = cc->loaded;
+        cc->loaded = cc->prev;
+        cc->prev = m;
+        goto hit;
+    }
+
+    /* Both magazines are empty: swap one for a full one from the depot. */
+    spin_lock(&cache->lock);
+    m = cache->full;
+    if ( m )
+    {
+        cache->full = m->next;
+        m->next = NULL;
+        cache->nr_full--;
+        if ( cc->prev )
+        {
+            cc->prev->next = cache->empty;
+            cache->empty = cc->prev;
+            cache->nr_empty++;
+        }
+        cache->depot_hits++;
+    }
+    else
+        cache->depot_misses++;
+    spin_unlock(&cache->lock);
+
+    if ( !m )
+    {
+        cc->alloc_misses++;
+        return _xmalloc(cache->size, cache->align);
+    }
+
+    cc->prev = cc->loaded;
+    cc->loaded = m;
+
+ hit:
+    cc->alloc_hits++;
+    return cc->loaded->objs[--cc->loaded->nr];
+}
+
+void *xmem_cache_zalloc(struct xmem_cache *cache)
+{
+    void *p = xmem_cache_alloc(cache);
+
+    return p ? memset(p, 0, cache->size) : p;
+}
+
+void xmem_cache_free(struct xmem_cache *cache, void *obj)
+{
+    struct xmem_cache_cpu *cc = &cache->cpu[smp_processor_id()];
+    struct xmem_magazine *m;
+
+    if ( !obj )
+        return;
+
+    ASSERT(!in_irq());
+
+    if ( cc->loaded && cc->loaded->nr < MAGAZINE_SIZE )
+        goto hit;
+
+    if ( cc->prev && cc->prev->nr < MAGAZINE_SIZE )
+    {
+        m = cc->loaded;
+        cc->loaded = cc->prev;
+        cc->prev = m;
+        goto hit;
+    }
+
+    /*
+     * Both magazines are full (or missing): hand the previous one to the
+     * depot and load an empty one.
+     */
+    spin_lock(&cache->lock);
+    m = cache->empty;
+    if ( m )
+    {
+        cache->empty = m->next;
+        m->next = NULL;
+        cache->nr_empty--;
+    }
+    if ( cc->prev && cache->nr_full < DEPOT_MAX_FULL() )
+    {
+        cc->prev->next = cache->full;
+        cache->full = cc->prev;
+        cache->nr_full++;
+        cc->prev = NULL;
+    }
+    spin_unlock(&cache->lock);
+
+    /* An overflowing depot gets the previous magazine's objects freed. */
+    if ( cc->prev )
+    {
+        magazine_drain(cache, cc->prev);
+        if ( !m )
+            m = cc->prev;
+        else
+            xfree(cc->prev);
+        cc->prev = NULL;
+    }
+
+    if ( !m )
+        m = xmalloc(struct xmem_magazine);
+    if ( !m )
+    {
+        cc->free_misses++;
+        xfree(obj);
+        return;
+    }
+
+    m->nr = 0;
+    cc->prev = cc->loaded;
+    cc->loaded = m;
+
+ hit:
+    cc->free_hits++;
+    cc->loaded->objs[cc->loaded->nr++] = obj;
+}
+
+/* Hand a dead cpu's magazines back to the depots. */
+static void xmem_cache_flush_cpu(unsigned int cpu)
+{
+    struct xmem_cache *cache;
+
+    spin_lock(&cache_list_lock);
+    list_for_each_entry ( cache, &cache_list, list )
+    {
+        struct xmem_cache_cpu *cc = &cache->cpu[cpu];
+        struct xmem_magazine *m[2] = { cc->loaded, cc->prev };
+        unsigned int i;
+
+        cc->loaded = cc->prev = NULL;
+        for ( i = 0; i < ARRAY_SIZE(m); i++ )
+        {
+            if ( !m[i] )
+                continue;
+            magazine_drain(cache, m[i]);
+            spin_lock(&cache->lock);
+            m[i]->next = cache->empty;
+            cache->empty = m[i];
+            cache->nr_empty++;
+            spin_unlock(&cache->lock);
+        }
+    }
+    spin_unlock(&cache_list_lock);
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+
+    if ( action == CPU_DEAD )
+        xmem_cache_flush_cpu(cpu);
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static void dump_xmem_caches(unsigned char key)
+{
+    struct xmem_cache *cache;
+    unsigned int cpu;
+
+    printk("xmem caches:\n");
+
+    spin_lock(&cache_list_lock);
+    list_for_each_entry ( cache, &cache_list, list )
+    {
+        unsigned long ah = 0, am = 0, fh = 0, fm = 0, cached = 0;
+
+        for_each_online_cpu ( cpu )
+        {
+            const struct xmem_cache_cpu *cc = &cache->cpu[cpu];
+
+            ah += cc->alloc_hits;
+            am += cc->alloc_misses;
+            fh += cc->free_hits;
+            fm += cc->free_misses;
+            if ( cc->loaded )
+                cached += cc->loaded->nr;
+            if ( cc->prev )
+                cached += cc->prev->nr;
+        }
+
+        printk("  %-16s size %4lu: alloc %lu (%lu from pool), "
+               "free %lu (%lu to pool), cpu cached %lu\n",
+               cache->name, cache->size, ah + am, am, fh + fm, fm, cached);
+        printk("  %16s depot: %u full, %u empty magazines, %lu hits, "
+               "%lu misses\n", "", cache->nr_full, cache->nr_empty,
+               cache->depot_hits, cache->depot_misses);
+    }
+    spin_unlock(&cache_list_lock);
+}
+
+static struct keyhandler dump_xmem_caches_keyhandler = {
+    .diagnostic = 1,
+    .u.fn = dump_xmem_caches,
+    .desc = "dump xmem cache stats"
+};
+
+static int __init xmem_cache_init(void)
+{
+    register_cpu_notifier(&cpu_nfb);
+    register_keyhandler('k', &dump_xmem_caches_keyhandler);
+    return 0;
+}
+__initcall(xmem_cache_init);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
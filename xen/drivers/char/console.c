@@ -25,6 +25,7 @@
 #include <xen/video.h>
 #include <xen/kexec.h>
 #include <xen/ctype.h>
+#include <xen/cpu.h>
 #include <asm/debugger.h>
 #include <asm/div64.h>
 #include <xen/hypercall.h> /* for do_console_io */
@@ -513,6 +514,224 @@ static void __putstr(const char *str)
         tasklet_schedule(&notify_dom0_con_ring_tasklet);
 }
 
+/*
+ * *****************************************************
+ * *************** PER-CPU PRINTK BUFFERS **************
+ * *****************************************************
+ *
+ * Once booted, printk() formats each message into a ring belonging to the
+ * local CPU without taking console_lock, and a tasklet writes the rings
+ * out, in the order the messages were logged, some time later.  Output is
+ * written directly under console_lock (having first written out whatever
+ * is buffered) during boot, with sync_console, while print_everything is
+ * raised (console_start_sync(), keyhandler dumps), once the locks have
+ * been busted, and for printk() nested within another on the same CPU.
+ */
+
+#define PERCPU_RING_SIZE 8192   /* Must be a power of two. */
+#define PERCPU_RING_IDX(i) ((i) & (PERCPU_RING_SIZE - 1))
+#define PERCPU_MSG_MAX   2048
+
+struct console_rec {
+    uint32_t seq;
+    uint32_t len;               /* Text follows, not NUL terminated. */
+};
+
+struct console_cpu {
+    /* Free running.  Only the owning CPU moves prod, only the flusher cons. */
+    uint32_t prod, cons;
+    unsigned int dropped;       /* Messages lost to a full ring. */
+    bool_t busy;
+    int start_of_line, do_print;
+    unsigned int len;           /* Bytes of the message in msg[]. */
+    char buf[1024];
+    char msg[PERCPU_MSG_MAX];
+    char ring[PERCPU_RING_SIZE];
+};
+
+/* Kept across CPUs going offline, so nothing buffered is lost. */
+static struct console_cpu *console_cpus[NR_CPUS];
+static bool_t __read_mostly console_buffered;
+static uint32_t console_seq;
+static bool_t console_flush_pending, console_draining;
+
+/* Buffer of the message this CPU is formatting, if not written directly. */
+static DEFINE_PER_CPU(struct console_cpu *, printk_cur);
+
+static void printk_put(const char *str)
+{
+    struct console_cpu *cc = this_cpu(printk_cur);
+    unsigned int len;
+
+    if ( !cc )
+    {
+        __putstr(str);
+        return;
+    }
+
+    len = min_t(unsigned int, strlen(str), PERCPU_MSG_MAX - cc->len);
+    memcpy(cc->msg + cc->len, str, len);
+    cc->len += len;
+}
+
+static void percpu_ring_write(struct console_cpu *cc, uint32_t idx,
+                              const void *src, unsigned int len)
+{
+    unsigned int part = min(len, PERCPU_RING_SIZE - PERCPU_RING_IDX(idx));
+
+    memcpy(cc->ring + PERCPU_RING_IDX(idx), src, part);
+    memcpy(cc->ring, src + part, len - part);
+}
+
+static void percpu_ring_read(const struct console_cpu *cc, uint32_t idx,
+                             void *dst, unsigned int len)
+{
+    unsigned int part = min(len, PERCPU_RING_SIZE - PERCPU_RING_IDX(idx));
+
+    memcpy(dst, cc->ring + PERCPU_RING_IDX(idx), part);
+    memcpy(dst + part, cc->ring, len - part);
+}
+
+static bool_t percpu_ring_put(struct console_cpu *cc, const char *str,
+                              unsigned int len)
+{
+    struct console_rec rec;
+    uint32_t prod = cc->prod;
+
+    if ( PERCPU_RING_SIZE - (prod - read_atomic(&cc->cons)) <
+         sizeof(rec) + len )
+        return 0;
+
+    rec.seq = arch_fetch_and_add(&console_seq, 1);
+    rec.len = len;
+    percpu_ring_write(cc, prod, &rec, sizeof(rec));
+    percpu_ring_write(cc, prod + sizeof(rec), str, len);
+
+    smp_wmb(); /* Record before producer index. */
+    write_atomic(&cc->prod, prod + sizeof(rec) + len);
+
+    return 1;
+}
+
+/* Write out all the CPUs' buffered messages, oldest first. */
+static void console_drain(void)
+{
+    static char text[PERCPU_MSG_MAX + 1];
+    struct console_rec rec, oldest_rec;
+    struct console_cpu *cc, *oldest;
+    unsigned int cpu;
+
+    ASSERT(spin_is_locked(&console_lock));
+
+    /* Don't interleave with a drain this one interrupted (an NMI, say). */
+    if ( !console_buffered || console_draining )
+        return;
+    console_draining = 1;
+
+    for ( ; ; )
+    {
+        oldest = NULL;
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            cc = console_cpus[cpu];
+            if ( !cc || cc->cons == read_atomic(&cc->prod) )
+                continue;
+            smp_rmb(); /* Producer index before record. */
+            percpu_ring_read(cc, cc->cons, &rec, sizeof(rec));
+            if ( !oldest || (int32_t)(rec.seq - oldest_rec.seq) < 0 )
+            {
+                oldest = cc;
+                oldest_rec = rec;
+            }
+        }
+        if ( !oldest )
+            break;
+
+        percpu_ring_read(oldest, oldest->cons + sizeof(rec), text,
+                         oldest_rec.len);
+        text[oldest_rec.len] = '\0';
+        smp_mb(); /* Record read before the space is given back. */
+        write_atomic(&oldest->cons,
+                     oldest->cons + sizeof(rec) + oldest_rec.len);
+
+        __putstr(text);
+    }
+
+    console_draining = 0;
+}
+
+static void console_flush(unsigned long unused)
+{
+    unsigned long flags;
+
+    console_flush_pending = 0;
+    smp_mb(); /* Clear before looking at the rings. */
+
+    local_irq_save(flags);
+    spin_lock_recursive(&console_lock);
+    console_drain();
+    spin_unlock_recursive(&console_lock);
+    local_irq_restore(flags);
+}
+static DECLARE_SOFTIRQ_TASKLET(console_flush_tasklet, console_flush, 0);
+
+/* Queue the message just formatted, for the tasklet to write out. */
+static void percpu_commit(struct console_cpu *cc)
+{
+    char str[48];
+    bool_t queued;
+
+    if ( !cc->len )
+        return;
+
+    if ( cc->dropped )
+    {
+        snprintf(str, sizeof(str), "(XEN) printk: %u messages dropped.\n",
+                 cc->dropped);
+        if ( percpu_ring_put(cc, str, strlen(str)) )
+            cc->dropped = 0;
+    }
+
+    queued = percpu_ring_put(cc, cc->msg, cc->len);
+
+    /* Ring full: write everything out here, unless that means waiting. */
+    if ( !queued && spin_trylock_recursive(&console_lock) )
+    {
+        console_drain();
+        spin_unlock_recursive(&console_lock);
+        queued = percpu_ring_put(cc, cc->msg, cc->len);
+    }
+    if ( !queued )
+        cc->dropped++;
+
+    if ( !test_and_set_bool(console_flush_pending) )
+        tasklet_schedule(&console_flush_tasklet);
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+
+    /* Without a buffer the CPU writes its messages directly. */
+    if ( action == CPU_UP_PREPARE && !console_cpus[cpu] )
+    {
+        struct console_cpu *cc = xzalloc(struct console_cpu);
+
+        if ( cc )
+        {
+            cc->start_of_line = 1;
+            console_cpus[cpu] = cc;
+        }
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
 static int printk_prefix_check(char *p, char **pp)
 {
     int loglvl = -1;
@@ -551,7 +770,7 @@ static void printk_start_of_line(const char *prefix)
     struct tm tm;
     char tstr[32];
 
-    __putstr(prefix);
+    printk_put(prefix);
 
     if ( !opt_console_timestamps )
         return;
@@ -563,55 +782,87 @@ static void printk_start_of_line(const char *prefix)
     snprintf(tstr, sizeof(tstr), "[%04u-%02u-%02u %02u:%02u:%02u] ",
              1900 + tm.tm_year, tm.tm_mon + 1, tm.tm_mday,
              tm.tm_hour, tm.tm_min, tm.tm_sec);
-    __putstr(tstr);
+    printk_put(tstr);
 }
 
-static void vprintk_common(const char *prefix, const char *fmt, va_list args)
+static void vprintk_format(char *buf, size_t size, int *start_of_line,
+                           int *do_print, const char *prefix,
+                           const char *fmt, va_list args)
 {
-    static char   buf[1024];
-    static int    start_of_line = 1, do_print;
-
-    char         *p, *q;
-    unsigned long flags;
-
-    /* console_lock can be acquired recursively from __printk_ratelimit(). */
-    local_irq_save(flags);
-    spin_lock_recursive(&console_lock);
+    char *p, *q;
 
-    (void)vsnprintf(buf, sizeof(buf), fmt, args);
+    (void)vsnprintf(buf, size, fmt, args);
 
     p = buf;
 
     while ( (q = strchr(p, '\n')) != NULL )
     {
         *q = '\0';
-        if ( start_of_line )
-            do_print = printk_prefix_check(p, &p);
-        if ( do_print )
+        if ( *start_of_line )
+            *do_print = printk_prefix_check(p, &p);
+        if ( *do_print )
         {
-            if ( start_of_line )
+            if ( *start_of_line )
                 printk_start_of_line(prefix);
-            __putstr(p);
-            __putstr("\n");
+            printk_put(p);
+            printk_put("\n");
         }
-        start_of_line = 1;
+        *start_of_line = 1;
         p = q + 1;
     }
 
     if ( *p != '\0' )
     {
-        if ( start_of_line )
-            do_print = printk_prefix_check(p, &p);
-        if ( do_print )
+        if ( *start_of_line )
+            *do_print = printk_prefix_check(p, &p);
+        if ( *do_print )
         {
-            if ( start_of_line )
+            if ( *start_of_line )
                 printk_start_of_line(prefix);
-            __putstr(p);
+            printk_put(p);
         }
-        start_of_line = 0;
+        *start_of_line = 0;
+    }
+}
+
+static void vprintk_common(const char *prefix, const char *fmt, va_list args)
+{
+    static char   buf[1024];
+    static int    start_of_line = 1, do_print;
+
+    struct console_cpu *cc, *cur;
+    unsigned long flags;
+
+    local_irq_save(flags);
+
+    cc = console_cpus[smp_processor_id()];
+    if ( cc && !cc->busy && console_buffered && !console_locks_busted &&
+         !atomic_read(&print_everything) )
+    {
+        cc->busy = 1;
+        cc->len = 0;
+        this_cpu(printk_cur) = cc;
+        vprintk_format(cc->buf, sizeof(cc->buf), &cc->start_of_line,
+                       &cc->do_print, prefix, fmt, args);
+        this_cpu(printk_cur) = NULL;
+        percpu_commit(cc);
+        cc->busy = 0;
+    }
+    else
+    {
+        cur = this_cpu(printk_cur);
+        this_cpu(printk_cur) = NULL;
+
+        /* console_lock can be acquired recursively from __printk_ratelimit(). */
+        spin_lock_recursive(&console_lock);
+        console_drain();
+        vprintk_format(buf, sizeof(buf), &start_of_line, &do_print,
+                       prefix, fmt, args);
+        spin_unlock_recursive(&console_lock);
+
+        this_cpu(printk_cur) = cur;
     }
 
-    spin_unlock_recursive(&console_lock);
     local_irq_restore(flags);
 }
 
@@ -763,6 +1014,14 @@ void __init console_endboot(void)
 
     register_keyhandler('w', &dump_console_ring_keyhandler);
 
+    if ( !opt_sync_console )
+    {
+        for_each_online_cpu ( i )
+            cpu_callback(&cpu_nfb, CPU_UP_PREPARE, (void *)(long)i);
+        register_cpu_notifier(&cpu_nfb);
+        console_buffered = 1;
+    }
+
     /* Serial input is directed to DOM0 by default. */
     switch_serial_input();
 }
@@ -800,6 +1059,7 @@ void console_force_unlock(void)
     spin_lock_init(&console_lock);
     serial_force_unlock(sercon_handle);
     console_locks_busted = 1;
+    console_draining = 0;
     console_start_sync();
 }
 
@@ -848,14 +1108,21 @@ int __printk_ratelimit(int ratelimit_ms, int ratelimit_burst)
         if ( lost )
         {
             char lost_str[8];
+            /*
+             * Part of the message printk() is buffering, if any.  Otherwise
+             * console_lock may already be acquired by printk().
+             */
+            bool_t direct = !this_cpu(printk_cur);
+
             snprintf(lost_str, sizeof(lost_str), "%d", lost);
-            /* console_lock may already be acquired by printk(). */
-            spin_lock_recursive(&console_lock);
+            if ( direct )
+                spin_lock_recursive(&console_lock);
             printk_start_of_line("(XEN) ");
-            __putstr("printk: ");
-            __putstr(lost_str);
-            __putstr(" messages suppressed.\n");
-            spin_unlock_recursive(&console_lock);
+            printk_put("printk: ");
+            printk_put(lost_str);
+            printk_put(" messages suppressed.\n");
+            if ( direct )
+                spin_unlock_recursive(&console_lock);
         }
         local_irq_restore(flags);
         return 1;
@@ -62,6 +62,8 @@ LIST_HEAD_READ_MOSTLY(cpufreq_governor_list);
 
 /* set xen as default cpufreq */
 enum cpufreq_controller cpufreq_controller = FREQCTL_xen;
+/* cpufreq=hwp: let the hardware manage P-states, if it can */
+bool_t __read_mostly opt_cpufreq_hwp;
 
 static void __init setup_cpufreq_option(char *str)
 {
@@ -85,7 +87,10 @@ static void __init setup_cpufreq_option(char *str)
     if ( (arg = strpbrk(str, ",:")) != NULL )
         *arg++ = '\0';
 
-    if ( !strcmp(str, "xen") )
+    if ( !strcmp(str, "hwp") )
+        opt_cpufreq_hwp = 1;
+
+    if ( !strcmp(str, "xen") || opt_cpufreq_hwp )
         if ( arg && *arg )
             cpufreq_cmdline_parse(arg);
 }
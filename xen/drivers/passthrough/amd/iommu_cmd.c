@@ -61,13 +61,62 @@ static void commit_iommu_command_buffer(struct amd_iommu *iommu)
 
 int send_iommu_command(struct amd_iommu *iommu, u32 cmd[])
 {
-    if ( queue_iommu_command(iommu, cmd) )
+    int loop_count;
+
+    if ( !queue_iommu_command(iommu, cmd) )
     {
+        if ( !iommu->cmd_batch )
+            return 0;
+
+        /* The ring is full of our own commands: let the IOMMU catch up. */
         commit_iommu_command_buffer(iommu);
-        return 1;
+        loop_count = 1000;
+        while ( !queue_iommu_command(iommu, cmd) )
+        {
+            if ( !--loop_count )
+            {
+                AMD_IOMMU_DEBUG("Warning: command buffer did not drain!\n");
+                return 0;
+            }
+            cpu_relax();
+        }
     }
 
-    return 0;
+    if ( !iommu->cmd_batch )
+        commit_iommu_command_buffer(iommu);
+
+    return 1;
+}
+
+/*
+ * Command batches: between amd_iommu_cmd_batch_start() and
+ * amd_iommu_cmd_batch_end(), with iommu->lock held throughout, commands are
+ * only queued.  The end of the batch commits the tail once and, if any of
+ * the batched operations asked for it, issues a single COMPLETION_WAIT.
+ */
+void amd_iommu_cmd_batch_start(struct amd_iommu *iommu)
+{
+    ASSERT( spin_is_locked(&iommu->lock) );
+
+    iommu->cmd_batch++;
+}
+
+static void flush_command_buffer(struct amd_iommu *iommu);
+
+void amd_iommu_cmd_batch_end(struct amd_iommu *iommu)
+{
+    ASSERT( spin_is_locked(&iommu->lock) && iommu->cmd_batch );
+
+    if ( --iommu->cmd_batch )
+        return;
+
+    commit_iommu_command_buffer(iommu);
+
+    if ( iommu->cmd_wait_pending )
+    {
+        iommu->cmd_wait_pending = 0;
+        flush_command_buffer(iommu);
+    }
 }
 
 static void flush_command_buffer(struct amd_iommu *iommu)
@@ -75,6 +124,13 @@ static void flush_command_buffer(struct amd_iommu *iommu)
     u32 cmd[4], status;
     int loop_count, comp_wait;
 
+    /* Within a batch, a single wait is issued at its end */
+    if ( iommu->cmd_batch )
+    {
+        iommu->cmd_wait_pending = 1;
+        return;
+    }
+
     /* RW1C 'ComWaitInt' in status register */
     writel(IOMMU_STATUS_COMP_WAIT_INT_MASK,
            iommu->mmio_base + IOMMU_STATUS_MMIO_OFFSET);
@@ -117,7 +173,7 @@ static void invalidate_iommu_pages(struct amd_iommu *iommu,
     u32 cmd[4], entry;
     int sflag = 0, pde = 0;
 
-    ASSERT ( order == 0 || order == 9 || order == 18 );
+    ASSERT ( order + PAGE_SHIFT < 64 );
 
     /* All pages associated with the domainID are invalidated */
     if ( order || (io_addr == INV_IOMMU_ALL_PAGES_ADDRESS ) )
@@ -174,7 +230,7 @@ static void invalidate_iotlb_pages(struct amd_iommu *iommu,
     u32 cmd[4], entry;
     int sflag = 0;
 
-    ASSERT ( order == 0 || order == 9 || order == 18 );
+    ASSERT ( order + PAGE_SHIFT < 64 );
 
     if ( order || (io_addr == INV_IOMMU_ALL_PAGES_ADDRESS ) )
         sflag = 1;
@@ -285,23 +341,78 @@ void invalidate_iommu_all(struct amd_iommu *iommu)
     send_iommu_command(iommu, cmd);
 }
 
-void amd_iommu_flush_iotlb(u8 devfn, const struct pci_dev *pdev,
-                           uint64_t gaddr, unsigned int order)
+/* A naturally aligned block of I/O addresses to invalidate. */
+struct flush_range {
+    uint64_t gaddr;
+    unsigned int order;
+};
+
+#define FLUSH_RANGES_MAX 8
+
+/*
+ * Split [gfn, gfn + count) into naturally aligned blocks, one command each.
+ * A range needing more than FLUSH_RANGES_MAX commands is covered by the
+ * smallest aligned block containing it instead.
+ */
+static unsigned int split_flush_range(unsigned long gfn, unsigned long count,
+                                      struct flush_range r[])
+{
+    unsigned long start = gfn, end = gfn + count;
+    unsigned int nr = 0, order;
+
+    while ( gfn < end )
+    {
+        if ( nr == FLUSH_RANGES_MAX )
+            goto cover;
+
+        for ( order = 0; !(gfn & ((2UL << order) - 1)) &&
+                         (gfn + (2UL << order)) <= end; order++ )
+            ;
+
+        r[nr].gaddr = (uint64_t)gfn << PAGE_SHIFT;
+        r[nr++].order = order;
+        gfn += 1UL << order;
+    }
+
+    return nr;
+
+ cover:
+    for ( order = 0; (start >> order) != ((end - 1) >> order); order++ )
+        ;
+
+    if ( order + PAGE_SHIFT >= PADDR_BITS )
+    {
+        r[0].gaddr = INV_IOMMU_ALL_PAGES_ADDRESS;
+        r[0].order = 0;
+    }
+    else
+    {
+        r[0].gaddr = (uint64_t)(start & ~((1UL << order) - 1)) << PAGE_SHIFT;
+        r[0].order = order;
+    }
+
+    return 1;
+}
+
+/*
+ * Return the IOMMU through which @pdev's device IOTLB is invalidated, or
+ * NULL if it has none enabled.
+ */
+static struct amd_iommu *find_ats_iommu(const struct pci_dev *pdev,
+                                        struct pci_ats_dev **pats)
 {
-    unsigned long flags;
     struct amd_iommu *iommu;
-    unsigned int req_id, queueid, maxpend;
     struct pci_ats_dev *ats_pdev;
 
     if ( !ats_enabled )
-        return;
+        return NULL;
 
     ats_pdev = get_ats_device(pdev->seg, pdev->bus, pdev->devfn);
     if ( ats_pdev == NULL )
-        return;
+        return NULL;
 
-    if ( !pci_ats_enabled(ats_pdev->seg, ats_pdev->bus, ats_pdev->devfn) )
-        return;
+    if ( !pci_ats_dev_enabled(ats_pdev) )
+        return NULL;
 
     iommu = find_iommu_for_device(ats_pdev->seg,
                                   PCI_BDF2(ats_pdev->bus, ats_pdev->devfn));
@@ -311,74 +422,124 @@ void amd_iommu_flush_iotlb(u8 devfn, const struct pci_dev *pdev,
         AMD_IOMMU_DEBUG("%s: Can't find iommu for %04x:%02x:%02x.%u\n",
                         __func__, ats_pdev->seg, ats_pdev->bus,
                         PCI_SLOT(ats_pdev->devfn), PCI_FUNC(ats_pdev->devfn));
-        return;
+        return NULL;
     }
 
     if ( !iommu_has_cap(iommu, PCI_CAP_IOTLB_SHIFT) )
-        return;
+        return NULL;
+
+    *pats = ats_pdev;
+
+    return iommu;
+}
+
+/* Queue INVALIDATE_IOTLB_PAGES commands; iommu->lock must be held. */
+static void queue_iotlb_ranges(struct amd_iommu *iommu, u8 devfn,
+                               const struct pci_ats_dev *ats_pdev,
+                               const struct flush_range r[], unsigned int nr)
+{
+    unsigned int req_id, queueid, maxpend, i;
 
     req_id = get_dma_requestor_id(iommu->seg, PCI_BDF2(ats_pdev->bus, devfn));
     queueid = req_id;
     maxpend = ats_pdev->ats_queue_depth & 0xff;
 
-    /* send INVALIDATE_IOTLB_PAGES command */
-    spin_lock_irqsave(&iommu->lock, flags);
-    invalidate_iotlb_pages(iommu, maxpend, 0, queueid, gaddr, req_id, order);
-    flush_command_buffer(iommu);
-    spin_unlock_irqrestore(&iommu->lock, flags);
+    for ( i = 0; i < nr; i++ )
+        invalidate_iotlb_pages(iommu, maxpend, 0, queueid, r[i].gaddr,
+                               req_id, r[i].order);
 }
 
-static void amd_iommu_flush_all_iotlbs(struct domain *d, uint64_t gaddr,
-                                       unsigned int order)
+void amd_iommu_flush_iotlb(u8 devfn, const struct pci_dev *pdev,
+                           uint64_t gaddr, unsigned int order)
 {
-    struct pci_dev *pdev;
+    unsigned long flags;
+    struct amd_iommu *iommu;
+    struct pci_ats_dev *ats_pdev;
+    struct flush_range r = { .gaddr = gaddr, .order = order };
 
-    if ( !ats_enabled )
+    iommu = find_ats_iommu(pdev, &ats_pdev);
+    if ( !iommu )
         return;
 
-    for_each_pdev( d, pdev )
-    {
-        u8 devfn = pdev->devfn;
-
-        do {
-            amd_iommu_flush_iotlb(devfn, pdev, gaddr, order);
-            devfn += pdev->phantom_stride;
-        } while ( devfn != pdev->devfn &&
-                  PCI_SLOT(devfn) == PCI_SLOT(pdev->devfn) );
-    }
+    spin_lock_irqsave(&iommu->lock, flags);
+    amd_iommu_cmd_batch_start(iommu);
+    queue_iotlb_ranges(iommu, devfn, ats_pdev, &r, 1);
+    flush_command_buffer(iommu);
+    amd_iommu_cmd_batch_end(iommu);
+    spin_unlock_irqrestore(&iommu->lock, flags);
 }
 
-/* Flush iommu cache after p2m changes. */
+/*
+ * Flush iommu cache after p2m changes.  The device IOTLB invalidations of
+ * all ATS devices behind an IOMMU are queued right behind its own page
+ * invalidations, and a single COMPLETION_WAIT covers both.
+ */
 static void _amd_iommu_flush_pages(struct domain *d,
-                                   uint64_t gaddr, unsigned int order)
+                                   const struct flush_range r[],
+                                   unsigned int nr)
 {
     unsigned long flags;
     struct amd_iommu *iommu;
+    struct pci_dev *pdev;
+    struct pci_ats_dev *ats_pdev;
     struct hvm_iommu *hd = domain_hvm_iommu(d);
-    unsigned int dom_id = hd->domain_id;
+    unsigned int dom_id = hd->domain_id, i;
 
-    /* send INVALIDATE_IOMMU_PAGES command */
+    /* send INVALIDATE_IOMMU_PAGES commands */
     for_each_amd_iommu ( iommu )
     {
         spin_lock_irqsave(&iommu->lock, flags);
-        invalidate_iommu_pages(iommu, gaddr, dom_id, order);
+        amd_iommu_cmd_batch_start(iommu);
+        for ( i = 0; i < nr; i++ )
+            invalidate_iommu_pages(iommu, r[i].gaddr, dom_id, r[i].order);
+
+        /* send INVALIDATE_IOTLB_PAGES commands */
+        if ( ats_enabled )
+        {
+            for_each_pdev( d, pdev )
+            {
+                u8 devfn = pdev->devfn;
+
+                if ( find_ats_iommu(pdev, &ats_pdev) != iommu )
+                    continue;
+
+                do {
+                    queue_iotlb_ranges(iommu, devfn, ats_pdev, r, nr);
+                    devfn += pdev->phantom_stride;
+                } while ( devfn != pdev->devfn &&
+                          PCI_SLOT(devfn) == PCI_SLOT(pdev->devfn) );
+            }
+        }
+
         flush_command_buffer(iommu);
+        amd_iommu_cmd_batch_end(iommu);
         spin_unlock_irqrestore(&iommu->lock, flags);
     }
-
-    if ( ats_enabled )
-        amd_iommu_flush_all_iotlbs(d, gaddr, order);
 }
 
 void amd_iommu_flush_all_pages(struct domain *d)
 {
-    _amd_iommu_flush_pages(d, INV_IOMMU_ALL_PAGES_ADDRESS, 0);
+    struct flush_range r = { .gaddr = INV_IOMMU_ALL_PAGES_ADDRESS };
+
+    _amd_iommu_flush_pages(d, &r, 1);
 }
 
 void amd_iommu_flush_pages(struct domain *d,
                            unsigned long gfn, unsigned int order)
 {
-    _amd_iommu_flush_pages(d, (uint64_t) gfn << PAGE_SHIFT, order);
+    struct flush_range r = { .gaddr = (uint64_t)gfn << PAGE_SHIFT,
+                             .order = order };
+
+    _amd_iommu_flush_pages(d, &r, 1);
+}
+
+void amd_iommu_flush_range(struct domain *d,
+                           unsigned long gfn, unsigned long count)
+{
+    struct flush_range r[FLUSH_RANGES_MAX];
+
+    if ( count )
+        _amd_iommu_flush_pages(d, r, split_flush_range(gfn, count, r));
 }
 
 void amd_iommu_flush_device(struct amd_iommu *iommu, uint16_t bdf)
@@ -1317,8 +1317,10 @@ static int _invalidate_all_devices(
         if ( iommu )
         {
             spin_lock_irqsave(&iommu->lock, flags);
+            amd_iommu_cmd_batch_start(iommu);
             amd_iommu_flush_device(iommu, req_id);
             amd_iommu_flush_intremap(iommu, req_id);
+            amd_iommu_cmd_batch_end(iommu);
             spin_unlock_irqrestore(&iommu->lock, flags);
         }
     }
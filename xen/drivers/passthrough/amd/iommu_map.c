@@ -606,6 +606,7 @@ static int update_paging_mode(struct domain *d, unsigned long gfn)
             }
 
             spin_lock_irqsave(&iommu->lock, flags);
+            amd_iommu_cmd_batch_start(iommu);
             do {
                 req_id = get_dma_requestor_id(pdev->seg, bdf);
                 device_entry = iommu->dev_table.buffer +
@@ -621,6 +622,7 @@ static int update_paging_mode(struct domain *d, unsigned long gfn)
                 bdf += pdev->phantom_stride;
             } while ( PCI_DEVFN2(bdf) != pdev->devfn &&
                       PCI_SLOT(bdf) == PCI_SLOT(pdev->devfn) );
+            amd_iommu_cmd_batch_end(iommu);
             spin_unlock_irqrestore(&iommu->lock, flags);
         }
 
@@ -680,7 +682,7 @@ int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
 
     /* 4K mapping for PV guests never changes, 
      * no need to flush if we trust non-present bits */
-    if ( is_hvm_domain(d) )
+    if ( is_hvm_domain(d) && !this_cpu(iommu_dont_flush_iotlb) )
         amd_iommu_flush_pages(d, gfn, 0);
 
     for ( merge_level = IOMMU_PAGING_MODE_LEVEL_2;
@@ -749,7 +751,8 @@ int amd_iommu_unmap_page(struct domain *d, unsigned long gfn)
     clear_iommu_pte_present(pt_mfn[1], gfn);
     spin_unlock(&hd->mapping_lock);
 
-    amd_iommu_flush_pages(d, gfn, 0);
+    if ( !this_cpu(iommu_dont_flush_iotlb) )
+        amd_iommu_flush_pages(d, gfn, 0);
 
     return 0;
 }
@@ -199,6 +199,9 @@ int __init amd_iov_detect(void)
 {
     INIT_LIST_HEAD(&amd_iommu_head);
 
+    /* AMD-Vi has no posted interrupt support. */
+    iommu_intpost = 0;
+
     if ( !iommu_enable && !iommu_intremap )
         return 0;
 
@@ -590,6 +593,17 @@ static void amd_dump_p2m_table(struct domain *d)
     amd_dump_p2m_table_level(hd->root_table, hd->paging_mode, 0, 0);
 }
 
+static void amd_iommu_iotlb_flush(struct domain *d, unsigned long gfn,
+                                  unsigned int page_count)
+{
+    amd_iommu_flush_range(d, gfn, page_count);
+}
+
+static void amd_iommu_iotlb_flush_all(struct domain *d)
+{
+    amd_iommu_flush_all_pages(d);
+}
+
 const struct iommu_ops amd_iommu_ops = {
     .init = amd_iommu_domain_init,
     .dom0_init = amd_iommu_dom0_init,
@@ -609,6 +623,8 @@ const struct iommu_ops amd_iommu_ops = {
     .suspend = amd_iommu_suspend,
     .resume = amd_iommu_resume,
     .share_p2m = amd_iommu_share_p2m,
+    .iotlb_flush = amd_iommu_iotlb_flush,
+    .iotlb_flush_all = amd_iommu_iotlb_flush_all,
     .crash_shutdown = amd_iommu_suspend,
     .dump_p2m_table = amd_dump_p2m_table,
 };
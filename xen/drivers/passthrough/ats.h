@@ -24,6 +24,7 @@ struct pci_ats_dev {
     u8 bus;
     u8 devfn;
     u16 ats_queue_depth;    /* ATS device invalidation queue depth */
+    u16 ats_pos;            /* ATS capability offset */
 };
 
 #define ATS_REG_CAP    4
@@ -51,6 +52,13 @@ static inline int pci_ats_enabled(int seg, int bus, int devfn)
     return value & ATS_ENABLE;
 }
 
+static inline int pci_ats_dev_enabled(const struct pci_ats_dev *pdev)
+{
+    return pci_conf_read16(pdev->seg, pdev->bus, PCI_SLOT(pdev->devfn),
+                           PCI_FUNC(pdev->devfn),
+                           pdev->ats_pos + ATS_REG_CTL) & ATS_ENABLE;
+}
+
 static inline int pci_ats_device(int seg, int bus, int devfn)
 {
     if ( !ats_enabled )
@@ -24,6 +24,7 @@
 #include <asm/hvm/irq.h>
 #include <asm/hvm/iommu.h>
 #include <asm/hvm/support.h>
+#include <asm/io_apic.h>
 #include <xen/hvm/irq.h>
 #include <xen/tasklet.h>
 
@@ -93,6 +94,66 @@ void free_hvm_irq_dpci(struct hvm_irq_dpci *dpci)
     xfree(dpci);
 }
 
+/* called with d->event_lock held */
+static void pt_gmsi_link(struct hvm_irq_dpci *dpci,
+                         struct hvm_pirq_dpci *pirq_dpci)
+{
+    unsigned int gvec = pirq_dpci->gmsi.gvec;
+
+    list_add_tail(&pirq_dpci->gmsi_list, &dpci->gmsi[gvec]);
+    set_bit(gvec, dpci->gmsi_map);
+}
+
+/* called with d->event_lock held */
+static void pt_gmsi_unlink(struct hvm_irq_dpci *dpci,
+                           struct hvm_pirq_dpci *pirq_dpci)
+{
+    unsigned int gvec = pirq_dpci->gmsi.gvec;
+
+    list_del_init(&pirq_dpci->gmsi_list);
+    if ( list_empty(&dpci->gmsi[gvec]) )
+        clear_bit(gvec, dpci->gmsi_map);
+}
+
+/*
+ * Find the vCPU a guest MSI can be posted to.  Lowest priority delivery
+ * to several vCPUs is steered to one of them by hashing the vector.
+ */
+static struct vcpu *pi_find_dest_vcpu(struct domain *d,
+                                      const struct hvm_pirq_dpci *pirq_dpci)
+{
+    uint32_t flags = pirq_dpci->gmsi.gflags;
+    uint8_t dest = flags & VMSI_DEST_ID_MASK;
+    uint8_t dest_mode = !!(flags & VMSI_DM_MASK);
+    uint8_t delivery_mode = (flags & VMSI_DELIV_MASK)
+        >> GFLAGS_SHIFT_DELIV_MODE;
+    unsigned int dest_vcpus = 0, idx;
+    struct vcpu *v;
+
+    if ( flags & VMSI_TRIG_MODE )
+        return NULL;
+
+    if ( pirq_dpci->gmsi.dest_vcpu_id >= 0 )
+        return d->vcpu[pirq_dpci->gmsi.dest_vcpu_id];
+
+    if ( delivery_mode != dest_LowestPrio )
+        return NULL;
+
+    for_each_vcpu ( d, v )
+        if ( vlapic_match_dest(vcpu_vlapic(v), NULL, 0, dest, dest_mode) )
+            dest_vcpus++;
+    if ( !dest_vcpus )
+        return NULL;
+
+    idx = pirq_dpci->gmsi.gvec % dest_vcpus;
+    for_each_vcpu ( d, v )
+        if ( vlapic_match_dest(vcpu_vlapic(v), NULL, 0, dest, dest_mode) &&
+             !idx-- )
+            return v;
+
+    return NULL;
+}
+
 int pt_irq_create_bind(
     struct domain *d, xen_domctl_bind_pt_irq_t *pt_irq_bind)
 {
@@ -124,6 +185,8 @@ int pt_irq_create_bind(
             hvm_dirq_assist, (unsigned long)d);
         for ( int i = 0; i < NR_HVM_IRQS; i++ )
             INIT_LIST_HEAD(&hvm_irq_dpci->girq[i]);
+        for ( int i = 0; i < NR_HVM_MSI_VECTORS; i++ )
+            INIT_LIST_HEAD(&hvm_irq_dpci->gmsi[i]);
 
         d->arch.hvm_domain.irq.dpci = hvm_irq_dpci;
     }
@@ -147,6 +210,7 @@ int pt_irq_create_bind(
                                HVM_IRQ_DPCI_GUEST_MSI;
             pirq_dpci->gmsi.gvec = pt_irq_bind->u.msi.gvec;
             pirq_dpci->gmsi.gflags = pt_irq_bind->u.msi.gflags;
+            pt_gmsi_link(hvm_irq_dpci, pirq_dpci);
             /* bind after hvm_irq_dpci is setup to avoid race with irq handler*/
             rc = pirq_guest_bind(d->vcpu[0], info, 0);
             if ( rc == 0 && pt_irq_bind->u.msi.gtable )
@@ -157,6 +221,7 @@ int pt_irq_create_bind(
             }
             if ( unlikely(rc) )
             {
+                pt_gmsi_unlink(hvm_irq_dpci, pirq_dpci);
                 pirq_dpci->gmsi.gflags = 0;
                 pirq_dpci->gmsi.gvec = 0;
                 pirq_dpci->flags = 0;
@@ -181,8 +246,10 @@ int pt_irq_create_bind(
                 /* Directly clear pending EOIs before enabling new MSI info. */
                 pirq_guest_eoi(info);
 
+                pt_gmsi_unlink(hvm_irq_dpci, pirq_dpci);
                 pirq_dpci->gmsi.gvec = pt_irq_bind->u.msi.gvec;
                 pirq_dpci->gmsi.gflags = pt_irq_bind->u.msi.gflags;
+                pt_gmsi_link(hvm_irq_dpci, pirq_dpci);
             }
         }
         /* Caculate dest_vcpu_id for MSI-type pirq migration */
@@ -190,6 +257,19 @@ int pt_irq_create_bind(
         dest_mode = !!(pirq_dpci->gmsi.gflags & VMSI_DM_MASK);
         dest_vcpu_id = hvm_girq_dest_2_vcpu_id(d, dest, dest_mode);
         pirq_dpci->gmsi.dest_vcpu_id = dest_vcpu_id;
+
+        /*
+         * Have the IOMMU post the interrupt straight to the vCPU when it
+         * has a single target, and fall back to remapping otherwise.
+         */
+        if ( iommu_intpost )
+        {
+            const struct vcpu *vcpu = pi_find_dest_vcpu(d, pirq_dpci);
+
+            rc = pi_update_irte(vcpu, info, pirq_dpci->gmsi.gvec);
+            if ( rc && vcpu )
+                pi_update_irte(NULL, info, 0);
+        }
         spin_unlock(&d->event_lock);
         if ( dest_vcpu_id >= 0 )
             hvm_migrate_pirqs(d->vcpu[dest_vcpu_id]);
@@ -227,6 +307,7 @@ int pt_irq_create_bind(
         girq->intx = intx;
         girq->machine_gsi = pirq;
         list_add_tail(&girq->list, &hvm_irq_dpci->girq[guest_gsi]);
+        set_bit(guest_gsi, hvm_irq_dpci->girq_map);
 
         /* Bind the same mirq once in the same domain */
         if ( !(pirq_dpci->flags & HVM_IRQ_DPCI_MAPPED) )
@@ -261,6 +342,8 @@ int pt_irq_create_bind(
                     kill_timer(&pirq_dpci->timer);
                 pirq_dpci->dom = NULL;
                 list_del(&girq->list);
+                if ( list_empty(&hvm_irq_dpci->girq[guest_gsi]) )
+                    clear_bit(guest_gsi, hvm_irq_dpci->girq_map);
                 xfree(girq);
                 list_del(&digl->list);
                 hvm_irq_dpci->link_cnt[link]--;
@@ -325,6 +408,8 @@ int pt_irq_destroy_bind(
                 break;
         }
     }
+    if ( list_empty(&hvm_irq_dpci->girq[guest_gsi]) )
+        clear_bit(guest_gsi, hvm_irq_dpci->girq_map);
 
     pirq = pirq_info(d, machine_gsi);
     pirq_dpci = pirq_dpci(pirq);
@@ -346,6 +431,12 @@ int pt_irq_destroy_bind(
 
         if ( list_empty(&pirq_dpci->digl_list) )
         {
+            if ( pirq_dpci->flags & HVM_IRQ_DPCI_GUEST_MSI )
+            {
+                if ( iommu_intpost )
+                    pi_update_irte(NULL, pirq, 0);
+                pt_gmsi_unlink(hvm_irq_dpci, pirq_dpci);
+            }
             pirq_guest_unbind(d, pirq);
             msixtbl_pt_unregister(d, pirq);
             if ( pt_irq_need_timer(pirq_dpci->flags) )
@@ -368,6 +459,7 @@ int pt_irq_destroy_bind(
 void pt_pirq_init(struct domain *d, struct hvm_pirq_dpci *dpci)
 {
     INIT_LIST_HEAD(&dpci->digl_list);
+    INIT_LIST_HEAD(&dpci->gmsi_list);
     dpci->gmsi.dest_vcpu_id = -1;
 }
 
@@ -459,11 +551,19 @@ static int _hvm_dpci_msi_eoi(struct domain *d,
 
 void hvm_dpci_msi_eoi(struct domain *d, int vector)
 {
-    if ( !iommu_enabled || !d->arch.hvm_domain.irq.dpci )
+    struct hvm_irq_dpci *dpci = d->arch.hvm_domain.irq.dpci;
+    struct hvm_pirq_dpci *pirq_dpci;
+
+    /* Most EOIs are for vectors that no passthrough MSI is bound to. */
+    if ( !iommu_enabled || !dpci || !test_bit(vector, dpci->gmsi_map) )
        return;
 
     spin_lock(&d->event_lock);
-    pt_pirq_iterate(d, _hvm_dpci_msi_eoi, (void *)(long)vector);
+    dpci = d->arch.hvm_domain.irq.dpci;
+    if ( dpci )
+        list_for_each_entry ( pirq_dpci, &dpci->gmsi[vector], gmsi_list )
+            if ( _hvm_dpci_msi_eoi(d, pirq_dpci, (void *)(long)vector) )
+                break;
     spin_unlock(&d->event_lock);
 }
 
@@ -579,6 +679,10 @@ void hvm_dpci_eoi(struct domain *d, unsigned int guest_gsi,
         return;
     }
 
+    hvm_irq_dpci = domain_get_irq_dpci(d);
+    if ( !hvm_irq_dpci || !test_bit(guest_gsi, hvm_irq_dpci->girq_map) )
+        return;
+
     spin_lock(&d->event_lock);
     hvm_irq_dpci = domain_get_irq_dpci(d);
 
@@ -39,6 +39,8 @@ static void iommu_dump_p2m_table(unsigned char key);
  *   no-snoop                   Disable VT-d Snoop Control
  *   no-qinval                  Disable VT-d Queued Invalidation
  *   no-intremap                Disable VT-d Interrupt Remapping
+ *   no-intpost                 Disable VT-d Interrupt Posting
+ *   no-superpages              Only use 4k VT-d I/O page table entries
  */
 custom_param("iommu", parse_iommu_param);
 bool_t __initdata iommu_enable = 1;
@@ -51,12 +53,16 @@ bool_t __read_mostly iommu_passthrough;
 bool_t __read_mostly iommu_snoop = 1;
 bool_t __read_mostly iommu_qinval = 1;
 bool_t __read_mostly iommu_intremap = 1;
+bool_t __read_mostly iommu_intpost = 1;
 bool_t __read_mostly iommu_hap_pt_share = 1;
+bool_t __read_mostly iommu_superpages = 1;
 bool_t __read_mostly iommu_debug;
 bool_t __read_mostly amd_iommu_perdev_intremap = 1;
 
 DEFINE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 
+static DEFINE_PER_CPU(struct iommu_flush_batch *, iommu_flush_batch);
+
 static struct keyhandler iommu_p2m_table = {
     .diagnostic = 0,
     .u.fn = iommu_dump_p2m_table,
@@ -91,6 +97,8 @@ static void __init parse_iommu_param(char *s)
             iommu_qinval = val;
         else if ( !strcmp(s, "intremap") )
             iommu_intremap = val;
+        else if ( !strcmp(s, "intpost") )
+            iommu_intpost = val;
         else if ( !strcmp(s, "debug") )
         {
             iommu_debug = val;
@@ -105,6 +113,8 @@ static void __init parse_iommu_param(char *s)
             iommu_dom0_strict = val;
         else if ( !strcmp(s, "sharept") )
             iommu_hap_pt_share = val;
+        else if ( !strcmp(s, "superpages") )
+            iommu_superpages = val;
 
         s = ss + 1;
     } while ( ss );
@@ -366,25 +376,107 @@ void iommu_domain_destroy(struct domain *d)
     }
 }
 
+void iommu_flush_batch_start(struct iommu_flush_batch *batch,
+                             struct domain *d)
+{
+    batch->domain = d;
+    batch->start = ~0UL;
+    batch->end = 0;
+    batch->active = (this_cpu(iommu_flush_batch) == NULL);
+    if ( batch->active )
+        this_cpu(iommu_flush_batch) = batch;
+}
+
+void iommu_flush_batch_end(struct iommu_flush_batch *batch)
+{
+    if ( !batch->active )
+        return;
+
+    ASSERT(this_cpu(iommu_flush_batch) == batch);
+    this_cpu(iommu_flush_batch) = NULL;
+    batch->active = 0;
+
+    if ( batch->start >= batch->end )
+        return;
+
+    if ( batch->end - batch->start > UINT_MAX )
+        iommu_iotlb_flush_all(batch->domain);
+    else
+        iommu_iotlb_flush(batch->domain, batch->start,
+                          batch->end - batch->start);
+}
+
+/*
+ * If a flush batch for @d is open on this CPU, account [@gfn, @gfn + @nr)
+ * to it and return true: the caller then suppresses the per-page flush.
+ */
+static bool_t iommu_flush_batch_add(struct domain *d, unsigned long gfn,
+                                    unsigned long nr)
+{
+    struct iommu_flush_batch *batch = this_cpu(iommu_flush_batch);
+
+    if ( batch == NULL || batch->domain != d )
+        return 0;
+
+    if ( gfn < batch->start )
+        batch->start = gfn;
+    if ( gfn + nr > batch->end )
+        batch->end = gfn + nr;
+
+    return 1;
+}
+
+/*
+ * With page tables shared with the p2m, the p2m code writes the entries
+ * itself and reports here each range whose translations went away, moved
+ * or lost access rights; the flush joins an open batch if there is one.
+ */
+void iommu_shared_pt_flush(struct domain *d, unsigned long gfn,
+                           unsigned int order)
+{
+    if ( !iommu_flush_batch_add(d, gfn, 1UL << order) )
+        iommu_iotlb_flush(d, gfn, 1U << order);
+}
+
 int iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
                    unsigned int flags)
 {
     struct hvm_iommu *hd = domain_hvm_iommu(d);
+    bool_t dont_flush;
+    int rc;
 
     if ( !iommu_enabled || !hd->platform_ops )
         return 0;
 
-    return hd->platform_ops->map_page(d, gfn, mfn, flags);
+    if ( !iommu_flush_batch_add(d, gfn, 1) )
+        return hd->platform_ops->map_page(d, gfn, mfn, flags);
+
+    dont_flush = this_cpu(iommu_dont_flush_iotlb);
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+    rc = hd->platform_ops->map_page(d, gfn, mfn, flags);
+    this_cpu(iommu_dont_flush_iotlb) = dont_flush;
+
+    return rc;
 }
 
 int iommu_unmap_page(struct domain *d, unsigned long gfn)
 {
     struct hvm_iommu *hd = domain_hvm_iommu(d);
+    bool_t dont_flush;
+    int rc;
 
     if ( !iommu_enabled || !hd->platform_ops )
         return 0;
 
-    return hd->platform_ops->unmap_page(d, gfn);
+    if ( !iommu_flush_batch_add(d, gfn, 1) )
+        return hd->platform_ops->unmap_page(d, gfn);
+
+    dont_flush = this_cpu(iommu_dont_flush_iotlb);
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+    rc = hd->platform_ops->unmap_page(d, gfn);
+    this_cpu(iommu_dont_flush_iotlb) = dont_flush;
+
+    return rc;
 }
 
 void iommu_iotlb_flush(struct domain *d, unsigned long gfn, unsigned int page_count)
@@ -472,6 +564,8 @@ int __init iommu_setup(void)
     }
     if ( !iommu_enabled )
         iommu_intremap = 0;
+    if ( !iommu_intremap )
+        iommu_intpost = 0;
 
     if ( (force_iommu && !iommu_enabled) ||
          (force_intremap && !iommu_intremap) )
@@ -491,6 +585,8 @@ int __init iommu_setup(void)
                iommu_passthrough ? "Passthrough" :
                iommu_dom0_strict ? "Strict" : "Relaxed");
         printk("Interrupt remapping %sabled\n", iommu_intremap ? "en" : "dis");
+        if ( iommu_intremap )
+            printk("Interrupt posting %sabled\n", iommu_intpost ? "en" : "dis");
     }
 
     return rc;
@@ -603,7 +699,7 @@ void iommu_crash_shutdown(void)
     const struct iommu_ops *ops = iommu_get_ops();
     if ( iommu_enabled )
         ops->crash_shutdown();
-    iommu_enabled = iommu_intremap = 0;
+    iommu_enabled = iommu_intremap = iommu_intpost = 0;
 }
 
 int iommu_do_domctl(
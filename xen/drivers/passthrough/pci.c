@@ -169,10 +169,11 @@ static struct pci_dev *alloc_pdev(struct pci_seg *pseg, u8 bus, u8 devfn)
     *((u8*) &pdev->bus) = bus;
     *((u8*) &pdev->devfn) = devfn;
     pdev->domain = NULL;
+    pdev->node = NUMA_NO_NODE;
     INIT_LIST_HEAD(&pdev->msi_list);
+    pci_dev_cache_caps(pdev);
 
-    if ( pci_find_cap_offset(pseg->nr, bus, PCI_SLOT(devfn), PCI_FUNC(devfn),
-                             PCI_CAP_ID_MSIX) )
+    if ( pci_dev_find_cap(pdev, PCI_CAP_ID_MSIX) )
     {
         struct arch_msix *msix = xzalloc(struct arch_msix);
 
@@ -212,8 +213,7 @@ static struct pci_dev *alloc_pdev(struct pci_seg *pseg, u8 bus, u8 devfn)
             break;
 
         case DEV_TYPE_PCIe_ENDPOINT:
-            pos = pci_find_cap_offset(pseg->nr, bus, PCI_SLOT(devfn),
-                                      PCI_FUNC(devfn), PCI_CAP_ID_EXP);
+            pos = pci_dev_find_cap(pdev, PCI_CAP_ID_EXP);
             BUG_ON(!pos);
             cap = pci_conf_read16(pseg->nr, bus, PCI_SLOT(devfn),
                                   PCI_FUNC(devfn), pos + PCI_EXP_DEVCAP);
@@ -366,6 +366,21 @@ struct pci_dev *pci_get_pdev(int seg, int bus, int devfn)
     return NULL;
 }
 
+/* NUMA node of a device, for placing its interrupts. */
+unsigned int pci_dev_node(int seg, int bus, int devfn)
+{
+    const struct pci_dev *pdev;
+    unsigned int node = NUMA_NO_NODE;
+
+    spin_lock(&pcidevs_lock);
+    pdev = pci_get_pdev(seg, bus, devfn);
+    if ( pdev )
+        node = pdev->node;
+    spin_unlock(&pcidevs_lock);
+
+    return node;
+}
+
 struct pci_dev *pci_get_real_pdev(int seg, int bus, int devfn)
 {
     struct pci_dev *pdev;
@@ -431,7 +446,7 @@ static void pci_enable_acs(struct pci_dev *pdev)
     if ( !iommu_enabled )
         return;
 
-    pos = pci_find_ext_capability(seg, bus, pdev->devfn, PCI_EXT_CAP_ID_ACS);
+    pos = pci_dev_find_ext_cap(pdev, PCI_EXT_CAP_ID_ACS);
     if (!pos)
         return;
 
@@ -453,7 +468,8 @@ static void pci_enable_acs(struct pci_dev *pdev)
     pci_conf_write16(seg, bus, dev, func, pos + PCI_ACS_CTRL, ctrl);
 }
 
-int pci_add_device(u16 seg, u8 bus, u8 devfn, const struct pci_dev_info *info)
+int pci_add_device(u16 seg, u8 bus, u8 devfn,
+                   const struct pci_dev_info *info, unsigned int node)
 {
     struct pci_seg *pseg;
     struct pci_dev *pdev;
@@ -471,7 +487,8 @@ int pci_add_device(u16 seg, u8 bus, u8 devfn, const struct pci_dev_info *info)
         pdev = pci_get_pdev(seg, info->physfn.bus, info->physfn.devfn);
         spin_unlock(&pcidevs_lock);
         if ( !pdev )
-            pci_add_device(seg, info->physfn.bus, info->physfn.devfn, NULL);
+            pci_add_device(seg, info->physfn.bus, info->physfn.devfn, NULL,
+                           node);
         pdev_type = "virtual function";
     }
     else
@@ -494,12 +511,18 @@ int pci_add_device(u16 seg, u8 bus, u8 devfn, const struct pci_dev_info *info)
     if ( !pdev )
         goto out;
 
+    if ( node != NUMA_NO_NODE )
+        pdev->node = node;
+
+    /* Extended config space may have become accessible since the scan. */
+    if ( !pdev->ext_caps_cached )
+        pci_dev_cache_caps(pdev);
+
     if ( info )
         pdev->info = *info;
     else if ( !pdev->vf_rlen[0] )
     {
-        unsigned int pos = pci_find_ext_capability(seg, bus, devfn,
-                                                   PCI_EXT_CAP_ID_SRIOV);
+        unsigned int pos = pci_dev_find_ext_cap(pdev, PCI_EXT_CAP_ID_SRIOV);
         u16 ctrl = pci_conf_read16(seg, bus, slot, func, pos + PCI_SRIOV_CTRL);
 
         if ( !pos )
@@ -639,6 +662,8 @@ static int pci_clean_dpci_irq(struct domain *d,
 {
     struct dev_intx_gsi_link *digl, *tmp;
 
+    if ( iommu_intpost && (pirq_dpci->flags & HVM_IRQ_DPCI_GUEST_MSI) )
+        pi_update_irte(NULL, dpci_pirq(pirq_dpci), 0);
     pirq_guest_unbind(d, dpci_pirq(pirq_dpci));
 
     if ( pt_irq_need_timer(pirq_dpci->flags) )
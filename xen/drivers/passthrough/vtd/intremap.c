@@ -33,6 +33,7 @@
 
 #include <asm/apic.h>
 #include <asm/io_apic.h>
+#include <asm/hvm/vmx/vmcs.h>
 #define nr_ioapic_entries(i)  nr_ioapic_entries[i]
 
 /*
@@ -193,6 +194,24 @@ static void free_remap_entry(struct iommu *iommu, int index)
     ir_ctrl->iremap_num--;
 }
 
+/*
+ * Posted and remapped IRTEs differ in both halves, so an entry the IOMMU
+ * may be using has to be replaced in a single 128-bit store.
+ */
+static void update_irte(struct iremap_entry *entry,
+                        const struct iremap_entry *new_ire)
+{
+    u64 lo = entry->lo_val, hi = entry->hi_val;
+    bool_t done;
+
+    do {
+        asm volatile ( "lock; cmpxchg16b %1; sete %0"
+                       : "=q" (done), "+m" (*entry), "+a" (lo), "+d" (hi)
+                       : "b" (new_ire->lo_val), "c" (new_ire->hi_val)
+                       : "memory" );
+    } while ( !done );
+}
+
 /*
  * Look for a free intr remap entry (or a contiguous set thereof).
  * Need hold iremap_lock, and setup returned entry before releasing lock.
@@ -601,29 +620,44 @@ static int msi_msg_to_remap_entry(
 
     memcpy(&new_ire, iremap_entry, sizeof(struct iremap_entry));
 
-    /* Set interrupt remapping table entry */
-    new_ire.lo.fpd = 0;
-    new_ire.lo.dm = (msg->address_lo >> MSI_ADDR_DESTMODE_SHIFT) & 0x1;
-    new_ire.lo.tm = (msg->data >> MSI_DATA_TRIGGER_SHIFT) & 0x1;
-    new_ire.lo.dlm = (msg->data >> MSI_DATA_DELIVERY_MODE_SHIFT) & 0x1;
-    /* Hardware require RH = 1 for LPR delivery mode */
-    new_ire.lo.rh = (new_ire.lo.dlm == dest_LowestPrio);
-    new_ire.lo.avail = 0;
-    new_ire.lo.res_1 = 0;
-    new_ire.lo.vector = (msg->data >> MSI_DATA_VECTOR_SHIFT) &
-                        MSI_DATA_VECTOR_MASK;
-    new_ire.lo.res_2 = 0;
-    if ( x2apic_enabled )
-        new_ire.lo.dst = msg->dest32;
+    if ( !msi_desc->pi_desc )
+    {
+        /* Set interrupt remapping table entry */
+        new_ire.lo.fpd = 0;
+        new_ire.lo.dm = (msg->address_lo >> MSI_ADDR_DESTMODE_SHIFT) & 0x1;
+        new_ire.lo.tm = (msg->data >> MSI_DATA_TRIGGER_SHIFT) & 0x1;
+        new_ire.lo.dlm = (msg->data >> MSI_DATA_DELIVERY_MODE_SHIFT) & 0x1;
+        /* Hardware require RH = 1 for LPR delivery mode */
+        new_ire.lo.rh = (new_ire.lo.dlm == dest_LowestPrio);
+        new_ire.lo.avail = 0;
+        new_ire.lo.res_1 = 0;
+        new_ire.lo.vector = (msg->data >> MSI_DATA_VECTOR_SHIFT) &
+                            MSI_DATA_VECTOR_MASK;
+        new_ire.lo.res_2 = 0;
+        if ( x2apic_enabled )
+            new_ire.lo.dst = msg->dest32;
+        else
+            new_ire.lo.dst = ((msg->address_lo >> MSI_ADDR_DEST_ID_SHIFT)
+                              & 0xff) << 8;
+    }
     else
-        new_ire.lo.dst = ((msg->address_lo >> MSI_ADDR_DEST_ID_SHIFT)
-                          & 0xff) << 8;
+    {
+        /* Posted format: the guest vector goes into the PI descriptor. */
+        paddr_t pda = virt_to_maddr(msi_desc->pi_desc);
+
+        new_ire.lo_val = 0;
+        new_ire.lo_post.im = 1;
+        new_ire.lo_post.vector = msi_desc->gvec;
+        new_ire.lo_post.pda_l = (u32)pda >> 6;
+    }
 
     if ( pdev )
         set_msi_source_id(pdev, &new_ire);
     else
         set_hpet_source_id(msi_desc->hpet_id, &new_ire);
     new_ire.hi.res_1 = 0;
+    if ( msi_desc->pi_desc )
+        new_ire.hi_post.pda_h = virt_to_maddr(msi_desc->pi_desc) >> 32;
     new_ire.lo.p = 1;    /* finally, set present bit */
 
     /* now construct new MSI/MSI-X rte entry */
@@ -640,7 +674,10 @@ static int msi_msg_to_remap_entry(
     remap_rte->address_hi = 0;
     remap_rte->data = index - i;
 
-    memcpy(iremap_entry, &new_ire, sizeof(struct iremap_entry));
+    if ( iommu_intpost )
+        update_irte(iremap_entry, &new_ire);
+    else
+        memcpy(iremap_entry, &new_ire, sizeof(struct iremap_entry));
     iommu_flush_cache_entry(iremap_entry, sizeof(struct iremap_entry));
     iommu_flush_iec_index(iommu, 0, index);
     invalidate_sync(iommu);
@@ -656,6 +693,13 @@ void msi_msg_read_remap_rte(
     struct pci_dev *pdev = msi_desc->dev;
     struct acpi_drhd_unit *drhd = NULL;
 
+    /* A posted IRTE holds no host routing; hand back what was last set. */
+    if ( msi_desc->pi_desc )
+    {
+        *msg = msi_desc->msg;
+        return;
+    }
+
     drhd = pdev ? acpi_find_matched_drhd_unit(pdev)
                 : hpet_to_drhd(msi_desc->hpet_id);
     if ( drhd )
@@ -676,6 +720,42 @@ int msi_msg_write_remap_rte(
                 : -EINVAL;
 }
 
+/*
+ * Switch the IRTE of a guest MSI between remapped format (v == NULL) and
+ * posted format, which makes the IOMMU set @gvec in @v's PI descriptor
+ * instead of interrupting the host.
+ */
+int pi_update_irte(const struct vcpu *v, const struct pirq *pirq,
+                   uint8_t gvec)
+{
+    const struct pi_desc *pi_desc = v ? &v->arch.hvm_vmx.pi_desc : NULL;
+    struct irq_desc *desc;
+    struct msi_desc *msi_desc;
+    struct msi_msg msg;
+    int rc = 0;
+
+    desc = pirq_spin_lock_irq_desc(pirq, NULL);
+    if ( !desc )
+        return -EINVAL;
+
+    msi_desc = desc->msi_desc;
+    if ( !msi_desc )
+        rc = -ENODEV;
+    else if ( msi_desc->pi_desc != pi_desc || msi_desc->gvec != gvec )
+    {
+        msi_desc->pi_desc = pi_desc;
+        msi_desc->gvec = pi_desc ? gvec : 0;
+
+        /* The device keeps its remappable message; only the IRTE changes. */
+        msg = msi_desc->msg;
+        rc = iommu_update_ire_from_msi(msi_desc, &msg);
+    }
+
+    spin_unlock_irq(&desc->lock);
+
+    return rc;
+}
+
 int __init intel_setup_hpet_msi(struct msi_desc *msi_desc)
 {
     struct iommu *iommu = hpet_to_iommu(msi_desc->hpet_id);
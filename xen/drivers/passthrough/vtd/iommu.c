@@ -48,6 +48,9 @@ bool_t __read_mostly untrusted_msi;
 
 int nr_iommus;
 
+/* Highest page table level whose entries may map superpages (1: none). */
+static int __read_mostly vtd_sp_level = 1;
+
 static struct tasklet vtd_fault_tasklet;
 
 static int setup_dom0_device(u8 devfn, struct pci_dev *);
@@ -244,6 +247,44 @@ static u64 bus_to_context_maddr(struct iommu *iommu, u8 bus)
     return maddr;
 }
 
+/*
+ * Replace the superpage entry @pte at @level by a table of next level
+ * entries mapping the same range.  The translation does not change, so no
+ * IOTLB flush is needed here: flushing the subsequent leaf update also
+ * drops the cached superpage.
+ */
+static u64 dma_pte_split_superpage(struct acpi_drhd_unit *drhd,
+                                   struct dma_pte *pte, int level)
+{
+    struct dma_pte *table, e = *pte, new = { 0 };
+    u64 maddr, step = (u64)1 << level_to_offset_bits(level - 1);
+    int i;
+
+    maddr = alloc_pgtable_maddr(drhd, 1);
+    if ( maddr == 0 )
+        return 0;
+
+    if ( level == 2 )
+        e.val &= ~DMA_PTE_SP;
+
+    table = (struct dma_pte *)map_vtd_domain_page(maddr);
+    for ( i = 0; i < PTE_NUM; i++ )
+    {
+        table[i] = e;
+        e.val += step;
+    }
+    iommu_flush_cache_page(table, 1);
+    unmap_vtd_domain_page(table);
+
+    dma_set_pte_addr(new, maddr);
+    dma_set_pte_readable(new);
+    dma_set_pte_writable(new);
+    *pte = new;
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+
+    return maddr;
+}
+
 static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
 {
     struct acpi_drhd_unit *drhd;
@@ -276,7 +317,26 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
         offset = address_level_offset(addr, level);
         pte = &parent[offset];
 
-        if ( dma_pte_addr(*pte) == 0 )
+        if ( dma_pte_superpage(*pte) )
+        {
+            /*
+             * Split even when not asked to allocate: unmapping a page
+             * within a superpage needs the 4k leaf.
+             */
+            pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
+            drhd = acpi_find_matched_drhd_unit(pdev);
+            maddr = dma_pte_split_superpage(drhd, pte, level);
+            if ( !maddr )
+            {
+                dprintk(XENLOG_ERR VTDPREFIX,
+                        "Cannot split I/O superpage: dom%d addr=%"PRIx64"\n",
+                        domain->domain_id, addr);
+                domain_crash(domain);
+                break;
+            }
+            vaddr = map_vtd_domain_page(maddr);
+        }
+        else if ( dma_pte_addr(*pte) == 0 )
         {
             if ( !alloc )
                 break;
@@ -520,25 +580,28 @@ static int iommu_flush_iotlb_psi(
     int flush_non_present_entry, int flush_dev_iotlb)
 {
     struct iommu_flush *flush = iommu_get_flush(iommu);
+    u64 type = DMA_TLB_PSI_FLUSH;
     int status;
 
     ASSERT(!(addr & (~PAGE_MASK_4K)));
 
-    /* Fallback to domain selective flush if no PSI support */
-    if ( !cap_pgsel_inv(iommu->cap) )
-        return iommu_flush_iotlb_dsi(iommu, did, flush_non_present_entry, flush_dev_iotlb);
-
-    /* Fallback to domain selective flush if size is too big */
-    if ( order > cap_max_amask_val(iommu->cap) )
-        return iommu_flush_iotlb_dsi(iommu, did, flush_non_present_entry, flush_dev_iotlb);
-
-    addr >>= PAGE_SHIFT_4K + order;
-    addr <<= PAGE_SHIFT_4K + order;
+    /*
+     * Fallback to domain selective flush if no PSI support or if size is
+     * too big.  The range is still passed down, for device IOTLBs.
+     */
+    if ( !cap_pgsel_inv(iommu->cap) ||
+         order > cap_max_amask_val(iommu->cap) )
+        type = DMA_TLB_DSI_FLUSH;
+    else
+    {
+        addr >>= PAGE_SHIFT_4K + order;
+        addr <<= PAGE_SHIFT_4K + order;
+    }
 
     /* apply platform specific errata workarounds */
     vtd_ops_preamble_quirk(iommu);
 
-    status = flush->iotlb(iommu, did, addr, order, DMA_TLB_PSI_FLUSH,
+    status = flush->iotlb(iommu, did, addr, order, type,
                         flush_non_present_entry, flush_dev_iotlb);
 
     /* undo platform specific errata workarounds */
@@ -588,12 +651,28 @@ static void __intel_iommu_iotlb_flush(struct domain *d, unsigned long gfn,
         if ( iommu_domid == -1 )
             continue;
 
-        if ( page_count > 1 || gfn == -1 )
+        if ( gfn == -1 )
         {
             if ( iommu_flush_iotlb_dsi(iommu, iommu_domid,
                         0, flush_dev_iotlb) )
                 iommu_flush_write_buffer(iommu);
         }
+        else if ( page_count > 1 )
+        {
+            unsigned int order = 0;
+
+            /*
+             * Flush the smallest aligned block covering the range; this
+             * falls back to a domain selective flush if it is too large.
+             */
+            while ( (gfn >> order) != ((gfn + page_count - 1) >> order) )
+                order++;
+
+            if ( iommu_flush_iotlb_psi(iommu, iommu_domid,
+                        (paddr_t)(gfn & ~((1UL << order) - 1)) << PAGE_SHIFT_4K,
+                        order, 0, flush_dev_iotlb) )
+                iommu_flush_write_buffer(iommu);
+        }
         else
         {
             if ( iommu_flush_iotlb_psi(iommu, iommu_domid,
@@ -683,7 +762,7 @@ static void iommu_free_pagetable(u64 pt_maddr, int level)
         if ( !dma_pte_present(*pte) )
             continue;
 
-        if ( next_level >= 1 )
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             iommu_free_pagetable(dma_pte_addr(*pte), next_level);
 
         dma_clear_pte(*pte);
@@ -1706,13 +1785,91 @@ void iommu_domain_teardown(struct domain *d)
     spin_unlock(&hd->mapping_lock);
 }
 
+/*
+ * Can the table @pt of @level entries be replaced by one superpage entry a
+ * level up?  All entries must be leaves with identical attributes mapping
+ * a contiguous, suitably aligned range.  The first and last entries are
+ * checked first so that partially populated tables are rejected cheaply.
+ */
+static bool_t dma_pte_table_mergeable(const struct dma_pte *pt, int level)
+{
+    u64 step = (u64)1 << level_to_offset_bits(level);
+    u64 base = pt[0].val;
+    int i;
+
+    if ( !dma_pte_present(pt[0]) ||
+         (level > 1 && !dma_pte_superpage(pt[0])) ||
+         (dma_pte_addr(pt[0]) & ((step << LEVEL_STRIDE) - 1)) ||
+         pt[PTE_NUM - 1].val != base + (PTE_NUM - 1) * step )
+        return 0;
+
+    for ( i = 1; i < PTE_NUM - 1; i++ )
+        if ( pt[i].val != base + i * step )
+            return 0;
+
+    return 1;
+}
+
+/*
+ * Coalesce the complete tables covering @addr into superpages, as far up
+ * as all IOMMUs allow.  The replaced tables are returned in @freed and must
+ * only be freed once the IOTLB has been flushed.  Returns the number of
+ * levels merged.
+ */
+static unsigned int dma_pte_merge(struct hvm_iommu *hd, u64 addr,
+                                  u64 freed[])
+{
+    u64 pt_maddr[7];
+    struct dma_pte *parent, *pt, *pte, new;
+    int level, top = agaw_to_level(hd->agaw);
+    unsigned int merged = 0;
+
+    ASSERT(spin_is_locked(&hd->mapping_lock));
+    ASSERT(top < ARRAY_SIZE(pt_maddr));
+
+    pt_maddr[top] = hd->pgd_maddr;
+    for ( level = top; level > 1; level-- )
+    {
+        parent = (struct dma_pte *)map_vtd_domain_page(pt_maddr[level]);
+        pte = &parent[address_level_offset(addr, level)];
+        pt_maddr[level - 1] = dma_pte_superpage(*pte) ? 0 : dma_pte_addr(*pte);
+        unmap_vtd_domain_page(parent);
+        if ( pt_maddr[level - 1] == 0 )
+            return 0;
+    }
+
+    for ( level = 2; level <= vtd_sp_level && level <= top; level++ )
+    {
+        pt = (struct dma_pte *)map_vtd_domain_page(pt_maddr[level - 1]);
+        if ( !dma_pte_table_mergeable(pt, level - 1) )
+        {
+            unmap_vtd_domain_page(pt);
+            break;
+        }
+        new = pt[0];
+        dma_set_pte_superpage(new);
+        unmap_vtd_domain_page(pt);
+
+        parent = (struct dma_pte *)map_vtd_domain_page(pt_maddr[level]);
+        pte = &parent[address_level_offset(addr, level)];
+        *pte = new;
+        iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+        unmap_vtd_domain_page(parent);
+
+        freed[merged++] = pt_maddr[level - 1];
+    }
+
+    return merged;
+}
+
 static int intel_iommu_map_page(
     struct domain *d, unsigned long gfn, unsigned long mfn,
     unsigned int flags)
 {
     struct hvm_iommu *hd = domain_hvm_iommu(d);
     struct dma_pte *page = NULL, *pte = NULL, old, new = { 0 };
-    u64 pg_maddr;
+    u64 pg_maddr, freed[2];
+    unsigned int merged = 0;
 
     /* Do nothing if VT-d shares EPT page table */
     if ( iommu_use_hap_pt(d) )
@@ -1751,10 +1908,22 @@ static int intel_iommu_map_page(
     *pte = new;
 
     iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+    if ( vtd_sp_level > 1 && dma_pte_table_mergeable(page, 1) )
+        merged = dma_pte_merge(hd, (paddr_t)gfn << PAGE_SHIFT_4K, freed);
     spin_unlock(&hd->mapping_lock);
     unmap_vtd_domain_page(page);
 
-    if ( !this_cpu(iommu_dont_flush_iotlb) )
+    if ( merged )
+    {
+        unsigned int order = merged * LEVEL_STRIDE;
+
+        /* The old tables may still be cached, so flush even if deferred. */
+        __intel_iommu_iotlb_flush(d, gfn & ~((1UL << order) - 1), 1,
+                                  1U << order);
+        while ( merged-- )
+            free_pgtable_maddr(freed[merged]);
+    }
+    else if ( !this_cpu(iommu_dont_flush_iotlb) )
         __intel_iommu_iotlb_flush(d, gfn, dma_pte_present(old), 1);
 
     return 0;
@@ -1876,6 +2045,26 @@ static int rmrr_identity_mapping(struct domain *d,
     return 0;
 }
 
+/*
+ * Without a proximity domain from Dom0, take the one the RHSA reports for
+ * the remapping unit the device sits behind.
+ */
+static void set_pdev_node(struct pci_dev *pdev)
+{
+    struct acpi_drhd_unit *drhd;
+    struct acpi_rhsa_unit *rhsa;
+    int node;
+
+    if ( pdev->node != NUMA_NO_NODE )
+        return;
+
+    drhd = acpi_find_matched_drhd_unit(pdev);
+    rhsa = drhd ? drhd_to_rhsa(drhd) : NULL;
+    node = rhsa ? pxm_to_node(rhsa->proximity_domain) : -1;
+    if ( node >= 0 )
+        pdev->node = node;
+}
+
 static int intel_iommu_add_device(u8 devfn, struct pci_dev *pdev)
 {
     struct acpi_rmrr_unit *rmrr;
@@ -1887,6 +2076,8 @@ static int intel_iommu_add_device(u8 devfn, struct pci_dev *pdev)
     if ( !pdev->domain )
         return -EINVAL;
 
+    set_pdev_node(pdev);
+
     ret = domain_context_mapping(pdev->domain, devfn, pdev);
     if ( ret )
     {
@@ -1954,6 +2145,8 @@ static int __init setup_dom0_device(u8 devfn, struct pci_dev *pdev)
 {
     int err;
 
+    set_pdev_node(pdev);
+
     err = domain_context_mapping(pdev->domain, devfn, pdev);
     if ( !err && devfn == pdev->devfn )
         pci_vtd_quirk(pdev);
@@ -2144,10 +2337,17 @@ int __init intel_vtd_setup(void)
      * engines: Snoop Control, DMA passthrough, Queued Invalidation and
      * Interrupt Remapping.
      */
+    vtd_sp_level = iommu_superpages ? 3 : 1;
+
     for_each_drhd_unit ( drhd )
     {
         iommu = drhd->iommu;
 
+        if ( !cap_sps_2mb(iommu->cap) )
+            vtd_sp_level = 1;
+        else if ( !cap_sps_1gb(iommu->cap) && vtd_sp_level > 2 )
+            vtd_sp_level = 2;
+
         printk("Intel VT-d iommu %"PRIu32" supported page sizes: 4kB",
                iommu->index);
         if (cap_sps_2mb(iommu->cap))
@@ -2170,6 +2370,9 @@ int __init intel_vtd_setup(void)
         if ( iommu_intremap && !ecap_intr_remap(iommu->ecap) )
             iommu_intremap = 0;
 
+        if ( iommu_intpost && !cap_intr_post(iommu->cap) )
+            iommu_intpost = 0;
+
         if ( !vtd_ept_page_compatible(iommu) )
             iommu_hap_pt_share = 0;
 
@@ -2183,6 +2386,10 @@ int __init intel_vtd_setup(void)
 
     softirq_tasklet_init(&vtd_fault_tasklet, do_iommu_page_fault, 0);
 
+    /* Posted IRTEs are switched in with a 128-bit atomic update. */
+    if ( iommu_intpost && !cpu_has(&boot_cpu_data, X86_FEATURE_CX16) )
+        iommu_intpost = 0;
+
     if ( !iommu_qinval && iommu_intremap )
     {
         iommu_intremap = 0;
@@ -2195,7 +2402,9 @@ int __init intel_vtd_setup(void)
     P(iommu_passthrough, "Dom0 DMA Passthrough");
     P(iommu_qinval, "Queued Invalidation");
     P(iommu_intremap, "Interrupt Remapping");
+    P(iommu_intremap && iommu_intpost, "Posted Interrupts");
     P(iommu_hap_pt_share, "Shared EPT tables");
+    P(vtd_sp_level > 1, "I/O superpages");
 #undef P
 
     scan_pci_devices();
@@ -2214,6 +2423,8 @@ int __init intel_vtd_setup(void)
     iommu_passthrough = 0;
     iommu_qinval = 0;
     iommu_intremap = 0;
+    iommu_intpost = 0;
+    vtd_sp_level = 1;
     return ret;
 }
 
@@ -2395,7 +2606,13 @@ static void vtd_dump_p2m_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && dma_pte_superpage(*pte) )
+            printk("%*sgfn: %08lx mfn: %08lx order: %d\n",
+                   indent, "",
+                   (unsigned long)(address >> PAGE_SHIFT_4K),
+                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
+                   next_level * LEVEL_STRIDE);
+        else if ( next_level >= 1 ) 
             vtd_dump_p2m_table_level(dma_pte_addr(*pte), next_level, 
                                      address, indent + 1);
         else
@@ -69,6 +69,7 @@
 /*
  * Decoding Capability Register
  */
+#define cap_intr_post(c)       (((c) >> 59) & 1)
 #define cap_read_drain(c)      (((c) >> 55) & 1)
 #define cap_write_drain(c)     (((c) >> 54) & 1)
 #define cap_max_amask_val(c)   (((c) >> 48) & 0x3f)
@@ -272,7 +273,9 @@ struct dma_pte {
 #define dma_clear_pte(p)    do {(p).val = 0;} while(0)
 #define dma_set_pte_readable(p) do {(p).val |= DMA_PTE_READ;} while(0)
 #define dma_set_pte_writable(p) do {(p).val |= DMA_PTE_WRITE;} while(0)
-#define dma_set_pte_superpage(p) do {(p).val |= (1 << 7);} while(0)
+#define DMA_PTE_SP   (1 << 7)
+#define dma_set_pte_superpage(p) do {(p).val |= DMA_PTE_SP;} while(0)
+#define dma_pte_superpage(p) (((p).val & DMA_PTE_SP) != 0)
 #define dma_set_pte_snp(p)  do {(p).val |= DMA_PTE_SNP;} while(0)
 #define dma_set_pte_prot(p, prot) \
             do {(p).val = ((p).val & ~3) | ((prot) & 3); } while (0)
@@ -298,6 +301,17 @@ struct iremap_entry {
             res_2   : 8,
             dst     : 32;
     }lo;
+    /* Posted format (lo_post.im set): interrupts go to a PI descriptor. */
+    struct {
+        u64 p       : 1,
+            fpd     : 1,
+            res_1   : 12,
+            urg     : 1,
+            im      : 1,
+            vector  : 8,
+            res_2   : 14,
+            pda_l   : 26;
+    }lo_post;
   };
   union {
     u64 hi_val;
@@ -307,6 +321,13 @@ struct iremap_entry {
             svt     : 2,
             res_1   : 44;
     }hi;
+    struct {
+        u64 sid     : 16,
+            sq      : 2,
+            svt     : 2,
+            res_1   : 12,
+            pda_h   : 32;
+    }hi_post;
   };
 };
 
@@ -422,8 +422,17 @@ static int flush_iotlb_qi(
         ret = queue_invalidate_iotlb(iommu,
                   (type >> DMA_TLB_FLUSH_GRANU_OFFSET), dr,
                   dw, did, (u8)size_order, 0, addr);
+        /*
+         * A PSI flush which had to fall back to DSI still carries its
+         * range: device IOTLBs have no address mask limit, so keep their
+         * invalidation ranged.  Either way it is queued ahead of the one
+         * wait descriptor below.
+         */
         if ( flush_dev_iotlb )
-            ret |= dev_invalidate_iotlb(iommu, did, addr, size_order, type);
+            ret |= dev_invalidate_iotlb(iommu, did, addr, size_order,
+                                        (type == DMA_TLB_DSI_FLUSH &&
+                                         (addr || size_order)) ?
+                                        DMA_TLB_PSI_FLUSH : type);
         ret |= invalidate_sync(iommu);
     }
     return ret;
@@ -136,17 +136,28 @@ int dev_invalidate_iotlb(struct iommu *iommu, u16 did,
             if ( !device_in_domain(iommu, pdev, did) )
                 break;
 
-            addr &= ~0 << (PAGE_SHIFT + size_order);
+            /* Too large a range for the address field: flush everything. */
+            if ( PAGE_SHIFT_4K + size_order >= 63 )
+            {
+                sbit = 1;
+                addr = (~0ULL << PAGE_SHIFT_4K) & 0x7FFFFFFFFFFFFFFFULL;
+                ret |= qinval_device_iotlb(iommu, pdev->ats_queue_depth,
+                                           sid, sbit, addr);
+                break;
+            }
 
             /* if size <= 4K, set sbit = 0, else set sbit = 1 */
             sbit = size_order ? 1 : 0;
 
             /* clear lower bits */
-            addr &= (~0 << (PAGE_SHIFT + size_order));
+            addr &= ~0ULL << (PAGE_SHIFT_4K + size_order);
 
-            /* if sbit == 1, zero out size_order bit and set lower bits to 1 */
+            /*
+             * if sbit == 1, the size is given by the lowest clear bit from
+             * bit 12 up: set the bits below PAGE_SHIFT_4K + size_order - 1.
+             */
             if ( sbit )
-                addr &= (~0  & ~(1 << (PAGE_SHIFT + size_order)));
+                addr |= (1ULL << (PAGE_SHIFT_4K + size_order - 1)) - 1;
 
             ret |= qinval_device_iotlb(iommu, pdev->ats_queue_depth,
                                        sid, sbit, addr);
@@ -95,6 +95,10 @@ void hvm_dpci_isairq_eoi(struct domain *d, unsigned int isairq)
     if ( !iommu_enabled)
         return;
 
+    dpci = domain_get_irq_dpci(d);
+    if ( !dpci || !test_bit(isairq, dpci->isairq_map) )
+        return;
+
     spin_lock(&d->event_lock);
 
     dpci = domain_get_irq_dpci(d);
@@ -66,6 +66,7 @@ int enable_ats_device(int seg, int bus, int devfn)
         pdev->seg = seg;
         pdev->bus = bus;
         pdev->devfn = devfn;
+        pdev->ats_pos = pos;
         value = pci_conf_read16(seg, bus, PCI_SLOT(devfn),
                                 PCI_FUNC(devfn), pos + ATS_REG_CAP);
         pdev->ats_queue_depth = value & ATS_QUEUE_DEPTH_MASK ?:
@@ -115,7 +116,8 @@ struct pci_ats_dev *get_ats_device(int seg, int bus, int devfn)
 {
     struct pci_ats_dev *pdev;
 
-    if ( !pci_ats_device(seg, bus, devfn) )
+    /* Only devices with an ATS capability are ever put on the list. */
+    if ( !ats_enabled )
         return NULL;
 
     list_for_each_entry ( pdev, &ats_devices, list )
@@ -104,6 +104,77 @@ int pci_find_ext_capability(int seg, int bus, int devfn, int cap)
     return 0;
 }
 
+/*
+ * Capability lists are read-only, so look them up once when the device is
+ * added rather than walking them on each use.
+ */
+void pci_dev_cache_caps(struct pci_dev *pdev)
+{
+    u8 slot = PCI_SLOT(pdev->devfn), func = PCI_FUNC(pdev->devfn);
+    u8 id, pos = PCI_CAPABILITY_LIST;
+    int ttl = 48, epos = 0x100;
+    u32 header;
+
+    memset(pdev->cap_pos, 0, sizeof(pdev->cap_pos));
+    if ( pci_conf_read16(pdev->seg, pdev->bus, slot, func, PCI_STATUS) &
+         PCI_STATUS_CAP_LIST )
+    {
+        while ( ttl-- )
+        {
+            pos = pci_conf_read8(pdev->seg, pdev->bus, slot, func, pos);
+            if ( pos < 0x40 )
+                break;
+
+            pos &= ~3;
+            id = pci_conf_read8(pdev->seg, pdev->bus, slot, func,
+                                pos + PCI_CAP_LIST_ID);
+
+            if ( id == 0xff )
+                break;
+            if ( id < PCI_DEV_NR_CAPS && !pdev->cap_pos[id] )
+                pdev->cap_pos[id] = pos;
+
+            pos += PCI_CAP_LIST_NEXT;
+        }
+    }
+
+    memset(pdev->ext_cap_pos, 0, sizeof(pdev->ext_cap_pos));
+    header = pci_conf_read32(pdev->seg, pdev->bus, slot, func, epos);
+
+    /* All ones: extended config space isn't accessible (yet). */
+    pdev->ext_caps_cached = (header != ~0U);
+    if ( !pdev->ext_caps_cached || !header )
+        return;
+
+    for ( ttl = 480; ttl-- > 0; )
+    {
+        id = PCI_EXT_CAP_ID(header);
+        if ( id < PCI_DEV_NR_EXT_CAPS && !pdev->ext_cap_pos[id] )
+            pdev->ext_cap_pos[id] = epos;
+        epos = PCI_EXT_CAP_NEXT(header);
+        if ( epos < 0x100 )
+            break;
+        header = pci_conf_read32(pdev->seg, pdev->bus, slot, func, epos);
+    }
+}
+
+int pci_dev_find_cap(const struct pci_dev *pdev, u8 cap)
+{
+    if ( cap < PCI_DEV_NR_CAPS )
+        return pdev->cap_pos[cap];
+
+    return pci_find_cap_offset(pdev->seg, pdev->bus, PCI_SLOT(pdev->devfn),
+                               PCI_FUNC(pdev->devfn), cap);
+}
+
+int pci_dev_find_ext_cap(const struct pci_dev *pdev, int cap)
+{
+    if ( pdev->ext_caps_cached && cap >= 0 && cap < PCI_DEV_NR_EXT_CAPS )
+        return pdev->ext_cap_pos[cap];
+
+    return pci_find_ext_capability(pdev->seg, pdev->bus, pdev->devfn, cap);
+}
+
 const char *__init parse_pci(const char *s, unsigned int *seg_p,
                              unsigned int *bus_p, unsigned int *dev_p,
                              unsigned int *func_p)
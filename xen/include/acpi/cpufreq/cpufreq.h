@@ -23,6 +23,15 @@
 DECLARE_PER_CPU(spinlock_t, cpufreq_statistic_lock);
 
 extern bool_t cpufreq_verbose;
+extern bool_t opt_cpufreq_hwp;
+
+/* Hardware managed P-states: energy/performance preference range. */
+#define HWP_EPP_PERFORMANCE     0
+#define HWP_EPP_DEFAULT         128
+#define HWP_EPP_POWERSAVE       255
+
+bool_t cpufreq_hwp_enabled(void);
+int cpufreq_hwp_set_epp(unsigned int cpu, unsigned int epp);
 
 struct cpufreq_governor;
 
@@ -132,6 +132,7 @@ static always_inline unsigned long __cmpxchg(
 #define cmpxchg(ptr,o,n)                                                \
     ((__typeof__(*(ptr)))__cmpxchg((ptr),(unsigned long)(o),            \
                                    (unsigned long)(n),sizeof(*(ptr))))
+#define cmpxchg_local(ptr,o,n) cmpxchg(ptr,o,n)
 
 #define local_irq_disable() asm volatile ( "cpsid i @ local_irq_disable\n" : : : "cc" )
 #define local_irq_enable()  asm volatile ( "cpsie i @ local_irq_enable\n" : : : "cc" )
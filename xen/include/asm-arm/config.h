@@ -45,7 +45,12 @@
 #define NR_CPUS 128
 #endif
 
+/* A GICv2 addresses 8 CPUs, a (virtual) GICv3 more */
+#ifdef CONFIG_ARM_64
+#define MAX_VIRT_CPUS 64
+#else
 #define MAX_VIRT_CPUS 8
+#endif
 #define MAX_HVM_VCPUS MAX_VIRT_CPUS
 
 #define asmlinkage /* Nothing needed */
@@ -17,6 +17,7 @@ struct vgic_irq_rank {
     uint32_t icfg[2];
     uint32_t ipriority[8];
     uint32_t itargets[8];
+    uint64_t irouter[32]; /* GICv3 only, unused in the private rank */
 };
 
 struct pending_irq
@@ -30,6 +31,9 @@ struct pending_irq
     /* lr_queue is used to append instances of pending_irq to
      * gic.lr_pending */
     struct list_head lr_queue;
+    /* injected again while in a list register: queue it again once the
+     * guest has EOIed it */
+    bool_t requeue;
 };
 
 struct hvm_domain
@@ -55,6 +59,10 @@ struct vtimer {
         struct timer timer;
         uint32_t ctl;
         uint64_t cval;
+        /* Virtual timer only: queued on a pCPU while the vCPU is out */
+        struct list_head queue;
+        s_time_t deadline;
+        unsigned int queue_cpu;
 };
 
 struct arch_domain
@@ -99,9 +107,12 @@ struct arch_domain
          * struct arch_vcpu.
          */
         struct pending_irq *pending_irqs;
+        int version; /* enum gic_version */
         /* Base address for guest GIC */
         paddr_t dbase; /* Distributor base address */
-        paddr_t cbase; /* CPU base address */
+        paddr_t cbase; /* CPU base address (GICv2) */
+        paddr_t rbase; /* Redistributors base address (GICv3) */
+        paddr_t rbase_size; /* ... and size, one per vCPU */
     } vgic;
 
     struct vuart {
@@ -200,8 +211,20 @@ struct arch_vcpu
     uint32_t csselr;
     register_t vmpidr;
 
-    uint32_t gic_hcr, gic_vmcr, gic_apr;
-    uint32_t gic_lr[64];
+    /* Virtual CPU interface, as the GIC version defines it */
+    union gic_state_data {
+        struct {
+            uint32_t hcr, vmcr, apr;
+            uint32_t lr[64];
+        } v2;
+#ifdef CONFIG_ARM_64
+        struct {
+            uint32_t hcr, vmcr, sre_el1;
+            uint32_t apr0[4], apr1[4];
+            uint64_t lr[16];
+        } v3;
+#endif
+    } gic;
     uint64_t event_mask;
     uint64_t lr_mask;
 
@@ -218,8 +241,8 @@ struct arch_vcpu
          * Depending on the availability of LR registers, the IRQs might
          * actually be in an LR, and therefore injected into the guest,
          * or queued in gic.lr_pending.
-         * As soon as an IRQ is EOI'd by the guest and removed from the
-         * corresponding LR it is also removed from this list. */
+         * Once an IRQ has been EOI'd by the guest and Xen has reclaimed
+         * the corresponding LR it is also removed from this list. */
         struct list_head inflight_irqs;
         /* lr_pending is used to queue IRQs (struct pending_irq) that the
          * vgic tried to inject in the guest (calling gic_set_guest_irq) but
@@ -229,12 +252,44 @@ struct arch_vcpu
          * lr_pending is a subset of vgic.inflight_irqs. */
         struct list_head lr_pending;
         spinlock_t lock;
+        /* Virtual SGIs and PPIs other pCPUs injected, not yet queued
+         * above: see vgic_vcpu_inject_irq(). */
+        unsigned long deferred_irqs;
     } vgic;
 
     struct vtimer phys_timer;
     struct vtimer virt_timer;
+
+    /*
+     * Guest virtual to machine page translations made by the guest copy
+     * functions, valid until the vCPU returns to the guest or the p2m
+     * changes.  See guestcopy.c.
+     */
+    struct {
+#define GVA_CACHE_ENTRIES 4
+        vaddr_t va[GVA_CACHE_ENTRIES];
+        paddr_t ma[GVA_CACHE_ENTRIES];
+        unsigned int nr, next;
+        unsigned long p2m_generation;
+    } gva_cache;
 }  __cacheline_aligned;
 
+/*
+ * The MPIDR affinity of a vCPU: vCPUs come in clusters of 16, as many as
+ * a GICv3 SGI can target at once.
+ */
+static inline register_t vcpuid_to_vaffinity(unsigned int vcpuid)
+{
+    return ((vcpuid >> 4) << MPIDR_AFF1_SHIFT) |
+           ((vcpuid & 0xf) << MPIDR_AFF0_SHIFT);
+}
+
+static inline unsigned int vaffinity_to_vcpuid(register_t vaffinity)
+{
+    return (MPIDR_AFFINITY_LEVEL(vaffinity, 1) << 4) |
+           (MPIDR_AFFINITY_LEVEL(vaffinity, 0) & 0xf);
+}
+
 void vcpu_show_execution_state(struct vcpu *);
 void vcpu_show_registers(const struct vcpu *);
 
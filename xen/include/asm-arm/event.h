@@ -28,6 +28,10 @@ static inline int local_events_need_delivery_nomask(void)
     if ( gic_events_need_delivery() )
         return 1;
 
+    /* Injected from another pCPU, and not yet queued */
+    if ( current->arch.vgic.deferred_irqs )
+        return 1;
+
     if ( vcpu_info(current, evtchn_upcall_pending) &&
         list_empty(&p->inflight) )
         return 1;
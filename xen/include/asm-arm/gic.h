@@ -121,6 +121,7 @@
 #define GICH_LR_STATE_MASK      0x3
 #define GICH_LR_STATE_SHIFT     28
 #define GICH_LR_PRIORITY_SHIFT  23
+#define GICH_LR_PRIORITY_MASK   0x1f
 #define GICH_LR_MAINTENANCE_IRQ (1<<19)
 #define GICH_LR_PENDING         (1<<28)
 #define GICH_LR_ACTIVE          (1<<29)
@@ -134,9 +135,97 @@
 
 #ifndef __ASSEMBLY__
 #include <xen/device_tree.h>
+#include <xen/irq.h>
+
+/* SGI (AKA IPIs) */
+enum gic_sgi {
+    GIC_SGI_EVENT_CHECK = 0,
+    GIC_SGI_DUMP_STATE  = 1,
+    GIC_SGI_CALL_FUNCTION = 2,
+};
 
 #define DT_MATCH_GIC    DT_MATCH_COMPATIBLE("arm,cortex-a15-gic"), \
                         DT_MATCH_COMPATIBLE("arm,cortex-a7-gic")
+#define DT_MATCH_GIC_V3 DT_MATCH_COMPATIBLE("arm,gic-v3")
+
+enum gic_version {
+    GIC_V2,
+    GIC_V3,
+};
+
+/* List register state, as struct gic_lr and gic_set_guest_irq() know it */
+#define GIC_LR_PENDING  (1 << 0)
+#define GIC_LR_ACTIVE   (1 << 1)
+
+/* A list register, independently of the GIC version's layout */
+struct gic_lr {
+    uint32_t virq;
+    uint8_t priority;
+    uint8_t state;              /* GIC_LR_{PENDING,ACTIVE} */
+    bool_t maintenance;         /* Maintenance interrupt when EOIed */
+};
+
+/* Which CPUs an SGI goes to */
+enum gic_sgi_mode {
+    SGI_TARGET_LIST,
+    SGI_TARGET_OTHERS,
+    SGI_TARGET_SELF,
+};
+
+struct gic_info {
+    enum gic_version hw_version;
+    unsigned int nr_lines;      /* SPIs + PPIs + SGIs */
+    unsigned int nr_lrs;
+    struct dt_irq maintenance;
+};
+
+/*
+ * Version specific parts of the GIC driver.  Unless said otherwise, the
+ * hooks are called with interrupts disabled, and those which change the
+ * distributor or list registers with the GIC lock held.
+ */
+struct gic_hw_operations {
+    const struct gic_info *info;
+    /* IRQ controllers for interrupts handled by Xen and by guests */
+    hw_irq_controller *gic_host_irq_type;
+    hw_irq_controller *gic_guest_irq_type;
+    /* Bring up this (secondary) CPU's interfaces, and take them down */
+    void (*secondary_init)(void);
+    void (*disable_interface)(void);
+    /* Save and restore a vCPU's virtual CPU interface */
+    void (*save_state)(struct vcpu *v);
+    void (*restore_state)(const struct vcpu *v);
+    void (*dump_state)(const struct vcpu *v);
+    /* Map the virtual CPU interface, if any, in the domain */
+    int (*gicv_setup)(struct domain *d);
+    /* Acknowledge an interrupt, returning its ID */
+    unsigned int (*read_irq)(void);
+    /* Drop the priority of, and deactivate, an acknowledged interrupt */
+    void (*eoi_irq)(unsigned int irq);
+    void (*deactivate_irq)(unsigned int irq);
+    void (*set_irq_properties)(unsigned int irq, bool_t level,
+                               const cpumask_t *cpu_mask,
+                               unsigned int priority);
+    void (*send_SGI)(enum gic_sgi sgi, enum gic_sgi_mode mode,
+                     const cpumask_t *cpu_mask);
+    /* List registers */
+    void (*read_lr)(unsigned int lr, struct gic_lr *lr_reg);
+    void (*write_lr)(unsigned int lr, const struct gic_lr *lr_reg);
+    void (*clear_lr)(unsigned int lr);
+    /* List registers with an EOI to signal, and empty ones */
+    uint64_t (*read_eisr)(void);
+    uint64_t (*read_elsr)(void);
+};
+
+extern void register_gic_ops(const struct gic_hw_operations *ops);
+extern enum gic_version gic_hw_version(void);
+/* Number of vCPUs the virtual GIC of a domain can address */
+extern unsigned int gic_max_vcpus(void);
+
+extern int gicv2_init(struct dt_device_node *node);
+#ifdef CONFIG_ARM_64
+extern int gicv3_init(struct dt_device_node *node);
+#endif
 
 extern int domain_vgic_init(struct domain *d);
 extern void domain_vgic_free(struct domain *d);
@@ -145,7 +234,12 @@ extern int vcpu_vgic_init(struct vcpu *v);
 
 extern void vgic_vcpu_inject_irq(struct vcpu *v, unsigned int irq,int virtual);
 extern void vgic_clear_pending_irqs(struct vcpu *v);
+extern void vgic_inject_deferred_irqs(struct vcpu *v);
 extern struct pending_irq *irq_to_pending(struct vcpu *v, unsigned int irq);
+extern struct vgic_irq_rank *vgic_rank_irq(struct vcpu *v, unsigned int irq);
+#ifdef CONFIG_ARM_64
+extern void vcpu_vgic_v3_init(struct vcpu *v);
+#endif
 
 /* Program the GIC to route an interrupt with a dt_irq */
 extern void gic_route_dt_irq(const struct dt_irq *irq,
@@ -181,11 +275,6 @@ extern void gic_save_state(struct vcpu *v);
 extern void gic_restore_state(struct vcpu *v);
 
 /* SGI (AKA IPIs) */
-enum gic_sgi {
-    GIC_SGI_EVENT_CHECK = 0,
-    GIC_SGI_DUMP_STATE  = 1,
-    GIC_SGI_CALL_FUNCTION = 2,
-};
 extern void send_SGI_mask(const cpumask_t *cpumask, enum gic_sgi sgi);
 extern void send_SGI_one(unsigned int cpu, enum gic_sgi sgi);
 extern void send_SGI_self(enum gic_sgi sgi);
@@ -0,0 +1,179 @@
+/*
+ * ARM Generic Interrupt Controller version 3 definitions
+ *
+ * The distributor registers GICv3 shares with GICv2 are in asm/gic.h,
+ * and, like those, these are offsets in 32-bit words.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __ASM_ARM_GIC_V3_DEFS_H__
+#define __ASM_ARM_GIC_V3_DEFS_H__
+
+/* Distributor */
+#define GICD_STATUSR    (0x010/4)
+#define GICD_SETSPI_NSR (0x040/4)
+#define GICD_IGRPMODR   (0xD00/4)
+#define GICD_IGRPMODRN  (0xD7C/4)
+#define GICD_IROUTER    (0x6000/4) /* 64-bit, IROUTER<n> at 0x6000 + 8n */
+#define GICD_IROUTER32  (0x6100/4)
+#define GICD_IROUTERN   (0x7FD8/4)
+#define GICD_PIDR2      (0xFFE8/4)
+
+#define GICD_CTLR_RWP           (1U << 31)
+#define GICD_CTLR_ARE_NS        (1U << 4)
+#define GICD_CTLR_ENABLE_G1A    (1U << 1)
+#define GICD_CTLR_ENABLE_G1     (1U << 0)
+
+#define GICD_TYPE_ID_BITS_SHIFT 19
+
+#define GICD_IROUTER_SPI_MODE_ANY   (1UL << 31)
+
+/* Architecture revision, in GICD_PIDR2 and GICR_PIDR2 */
+#define GIC_PIDR2_ARCH_MASK     0xf0
+#define GIC_PIDR2_ARCH_GICv3    0x30
+#define GIC_PIDR2_ARCH_GICv4    0x40
+
+/* Redistributor: RD_base frame */
+#define GICR_CTLR       (0x0000/4)
+#define GICR_IIDR       (0x0004/4)
+#define GICR_TYPER      (0x0008/4) /* 64-bit */
+#define GICR_STATUSR    (0x0010/4)
+#define GICR_WAKER      (0x0014/4)
+#define GICR_PIDR2      GICD_PIDR2
+
+#define GICR_CTLR_RWP           (1U << 3)
+
+#define GICR_WAKER_ProcessorSleep   (1U << 1)
+#define GICR_WAKER_ChildrenAsleep   (1U << 2)
+
+#define GICR_TYPER_VLPIS        (1U << 1)
+#define GICR_TYPER_LAST         (1U << 4)
+#define GICR_TYPER_PROC_NUM_SHIFT 8
+#define GICR_TYPER_AFF_SHIFT    32
+
+/* Redistributor: SGI_base frame, 64K after RD_base */
+#define GICR_SGI_BASE   (0x10000/4)
+#define GICR_IGROUPR0   (GICR_SGI_BASE + GICD_IGROUPR)
+#define GICR_ISENABLER0 (GICR_SGI_BASE + GICD_ISENABLER)
+#define GICR_ICENABLER0 (GICR_SGI_BASE + GICD_ICENABLER)
+#define GICR_ISPENDR0   (GICR_SGI_BASE + GICD_ISPENDR)
+#define GICR_ICPENDR0   (GICR_SGI_BASE + GICD_ICPENDR)
+#define GICR_ISACTIVER0 (GICR_SGI_BASE + GICD_ISACTIVER)
+#define GICR_ICACTIVER0 (GICR_SGI_BASE + GICD_ICACTIVER)
+#define GICR_IPRIORITYR0 (GICR_SGI_BASE + GICD_IPRIORITYR)
+#define GICR_ICFGR0     (GICR_SGI_BASE + GICD_ICFGR)
+#define GICR_ICFGR1     (GICR_SGI_BASE + GICD_ICFGR + 1)
+
+/* A GICv3 redistributor: RD_base and SGI_base, 64K each */
+#define GICR_RD_FRAMES_SIZE     (2 * 0x10000)
+/* ... and a GICv4 one, with VLPI_base and a reserved frame on top */
+#define GICR_RD_FRAMES_SIZE_V4  (4 * 0x10000)
+
+/*
+ * CPU interface system registers.  Given by their encodings, as not all
+ * assemblers know them by name.
+ */
+#define ICC_PMR_EL1             S3_0_C4_C6_0
+#define ICC_DIR_EL1             S3_0_C12_C11_1
+#define ICC_SGI1R_EL1           S3_0_C12_C11_5
+#define ICC_IAR1_EL1            S3_0_C12_C12_0
+#define ICC_EOIR1_EL1           S3_0_C12_C12_1
+#define ICC_BPR1_EL1            S3_0_C12_C12_3
+#define ICC_CTLR_EL1            S3_0_C12_C12_4
+#define ICC_SRE_EL1             S3_0_C12_C12_5
+#define ICC_IGRPEN1_EL1         S3_0_C12_C12_7
+#define ICC_SRE_EL2             S3_4_C12_C9_5
+
+#define ICC_CTLR_EL1_EOImode_drop   (1U << 1)
+
+#define ICC_SRE_EL2_SRE         (1U << 0)
+#define ICC_SRE_EL2_DFB         (1U << 1)
+#define ICC_SRE_EL2_DIB         (1U << 2)
+#define ICC_SRE_EL2_ENEL1       (1U << 3)
+
+#define ICC_SRE_EL1_SRE         (1U << 0)
+
+#define ICC_IA_IRQ              0xffffff
+
+/* ICC_SGI1R_EL1 */
+#define ICC_SGI1R_TARGET_LIST_MASK  0xffffUL
+#define ICC_SGI1R_AFF1_SHIFT        16
+#define ICC_SGI1R_INTID_SHIFT       24
+#define ICC_SGI1R_INTID_MASK        0xfUL
+#define ICC_SGI1R_AFF2_SHIFT        32
+#define ICC_SGI1R_IRM               (1UL << 40)
+#define ICC_SGI1R_AFF3_SHIFT        48
+#define ICC_SGI1R_AFF_MASK          0xffUL
+
+/* Virtualisation control system registers */
+#define ICH_AP0R0_EL2           S3_4_C12_C8_0
+#define ICH_AP0R1_EL2           S3_4_C12_C8_1
+#define ICH_AP0R2_EL2           S3_4_C12_C8_2
+#define ICH_AP0R3_EL2           S3_4_C12_C8_3
+#define ICH_AP1R0_EL2           S3_4_C12_C9_0
+#define ICH_AP1R1_EL2           S3_4_C12_C9_1
+#define ICH_AP1R2_EL2           S3_4_C12_C9_2
+#define ICH_AP1R3_EL2           S3_4_C12_C9_3
+#define ICH_HCR_EL2             S3_4_C12_C11_0
+#define ICH_VTR_EL2             S3_4_C12_C11_1
+#define ICH_MISR_EL2            S3_4_C12_C11_2
+#define ICH_EISR_EL2            S3_4_C12_C11_3
+#define ICH_ELRSR_EL2           S3_4_C12_C11_5
+#define ICH_VMCR_EL2            S3_4_C12_C11_7
+
+#define __ICH_LR_EL2(crm, op2)  S3_4_C12_ ## crm ## _ ## op2
+#define ICH_LR0_EL2             __ICH_LR_EL2(C12, 0)
+#define ICH_LR1_EL2             __ICH_LR_EL2(C12, 1)
+#define ICH_LR2_EL2             __ICH_LR_EL2(C12, 2)
+#define ICH_LR3_EL2             __ICH_LR_EL2(C12, 3)
+#define ICH_LR4_EL2             __ICH_LR_EL2(C12, 4)
+#define ICH_LR5_EL2             __ICH_LR_EL2(C12, 5)
+#define ICH_LR6_EL2             __ICH_LR_EL2(C12, 6)
+#define ICH_LR7_EL2             __ICH_LR_EL2(C12, 7)
+#define ICH_LR8_EL2             __ICH_LR_EL2(C13, 0)
+#define ICH_LR9_EL2             __ICH_LR_EL2(C13, 1)
+#define ICH_LR10_EL2            __ICH_LR_EL2(C13, 2)
+#define ICH_LR11_EL2            __ICH_LR_EL2(C13, 3)
+#define ICH_LR12_EL2            __ICH_LR_EL2(C13, 4)
+#define ICH_LR13_EL2            __ICH_LR_EL2(C13, 5)
+#define ICH_LR14_EL2            __ICH_LR_EL2(C13, 6)
+#define ICH_LR15_EL2            __ICH_LR_EL2(C13, 7)
+
+#define ICH_HCR_EN              (1U << 0)
+
+#define ICH_VTR_NRLRGS          0x1f
+#define ICH_VTR_PRIBITS_SHIFT   29
+#define ICH_VTR_PRIBITS_MASK    0x7
+
+#define ICH_LR_VIRTUAL_MASK     0xffffffffULL
+#define ICH_LR_MAINTENANCE_IRQ  (1ULL << 41)
+#define ICH_LR_PRIORITY_SHIFT   48
+#define ICH_LR_PRIORITY_MASK    0xffULL
+#define ICH_LR_GRP1             (1ULL << 60)
+#define ICH_LR_HW               (1ULL << 61)
+#define ICH_LR_STATE_SHIFT      62
+#define ICH_LR_STATE_MASK       0x3ULL
+#define ICH_LR_PENDING          (1ULL << 62)
+#define ICH_LR_ACTIVE           (1ULL << 63)
+
+#define GICV3_NR_LRS            16
+
+#endif /* __ASM_ARM_GIC_V3_DEFS_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
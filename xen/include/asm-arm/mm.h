@@ -36,7 +36,13 @@ struct page_info
         /* Page is on a free list: ((count_info & PGC_count_mask) == 0). */
         struct {
             /* Do TLBs need flushing for safety before next page use? */
-            bool_t need_tlbflush;
+            unsigned long need_tlbflush:1;
+            /*
+             * Index of the first page in the chunk (valid for the chunk's
+             * head page only) which may need scrubbing, or
+             * INVALID_DIRTY_IDX if the whole chunk is clean.
+             */
+            unsigned long first_dirty:MAX_ORDER + 1;
         } free;
 
     } u;
@@ -95,6 +101,9 @@ struct page_info
 /* Page is broken? */
 #define _PGC_broken       PG_shift(7)
 #define PGC_broken        PG_mask(1, 7)
+ /* Free page needing a scrub? Only valid in PGC_state_free, so alias. */
+#define _PGC_need_scrub   _PGC_allocated
+#define PGC_need_scrub    PGC_allocated
  /* Mutually-exclusive page states: { inuse, offlining, offlined, free }. */
 #define PGC_state         PG_mask(3, 9)
 #define PGC_state_inuse   PG_mask(0, 9)
@@ -3,6 +3,9 @@
 
 extern void do_multicall_call(struct multicall_entry *call);
 
+static inline void arch_multicall_prepare(unsigned long op) {}
+static inline void arch_multicall_end(void) {}
+
 #endif /* __ASM_ARM_MULTICALL_H__ */
 /*
  * Local variables:
@@ -18,6 +18,9 @@ struct p2m_domain {
 
     /* Current VMID in use */
     uint8_t vmid;
+
+    /* Bumped when a valid entry is changed, see gva_cache in arch_vcpu */
+    unsigned long generation;
 };
 
 /* Initialise vmid allocator */
@@ -349,6 +349,8 @@ static inline int gva_to_ipa(vaddr_t va, paddr_t *paddr)
 #define zeroeth_table_offset(va)  TABLE_OFFSET(zeroeth_linear_offset(va))
 
 #define clear_page(page) memset((void *)(page), 0, PAGE_SIZE)
+#define scrub_page(page) clear_page(page)
+#define scrub_page_fence() ((void)0)
 
 #define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & PAGE_MASK)
 
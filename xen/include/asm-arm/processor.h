@@ -14,6 +14,10 @@
 #define MPIDR_SMP           (_AC(1,U) << _MPIDR_SMP)
 #define MPIDR_AFF0_SHIFT    (0)
 #define MPIDR_AFF0_MASK     (_AC(0xff,U) << MPIDR_AFF0_SHIFT)
+#define MPIDR_AFF1_SHIFT    (8)
+#define MPIDR_AFF2_SHIFT    (16)
+#define MPIDR_AFFINITY_LEVEL(mpidr, level) \
+    (((mpidr) >> (8 * (level))) & 0xff)
 #define MPIDR_HWID_MASK     _AC(0xffffff,U)
 #define MPIDR_INVALID       (~MPIDR_HWID_MASK)
 
@@ -451,6 +455,7 @@ void show_registers(struct cpu_user_regs *regs);
 /* All a bit UP for the moment */
 #define cpu_to_core(_cpu)   (0)
 #define cpu_to_socket(_cpu) (0)
+#define cpu_to_llc(_cpu)    (0)
 
 void do_unexpected_trap(const char *msg, struct cpu_user_regs *regs);
 
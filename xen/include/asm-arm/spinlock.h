@@ -12,6 +12,15 @@
 # error "unknown ARM variant"
 #endif
 
+/*
+ * Ticket lock primitives (see xen/spinlock.h).  Waiters sleep in WFE
+ * until the unlocking cpu's SEV (arch_lock_signal()).
+ */
+#define arch_fetch_and_add(x, v)    __sync_fetch_and_add(x, v)
+#define arch_lock_acquire_barrier() smp_mb()
+#define arch_lock_release_barrier() smp_mb()
+#define arch_lock_relax()           wfe()
+
 #endif /* __ASM_SPINLOCK_H */
 /*
  * Local variables:
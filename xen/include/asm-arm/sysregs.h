@@ -42,6 +42,9 @@
 
 #define CNTP_CTL_EL0  HSR_SYSREG(3,3,c14,c2,1)
 #define CNTP_TVAL_EL0 HSR_SYSREG(3,3,c14,c2,0)
+
+/* Not CNTP_* style: ICC_SGI1R_EL1 itself is the register's encoding */
+#define HSR_SYSREG_ICC_SGI1R_EL1 HSR_SYSREG(3,0,c12,c11,5)
 #endif
 
 #endif
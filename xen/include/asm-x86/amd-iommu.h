@@ -96,6 +96,8 @@ struct amd_iommu {
 
     struct table_struct dev_table;
     struct ring_buffer cmd_buffer;
+    unsigned int cmd_batch;      /* command batch nesting, under lock */
+    bool_t cmd_wait_pending;     /* COMPLETION_WAIT due at batch end */
     struct ring_buffer event_log;
     struct ring_buffer ppr_log;
 
@@ -41,8 +41,8 @@ struct trap_bounce {
 #define MAPHASH_HASHFN(pfn) ((pfn) & (MAPHASH_ENTRIES-1))
 #define MAPHASHENT_NOTINUSE ((u32)~0U)
 struct mapcache_vcpu {
-    /* Shadow of mapcache_domain.epoch. */
-    unsigned int shadow_epoch;
+    /* Last slot allocated from this vCPU's range of the mapcache. */
+    unsigned int cursor;
 
     /* Lock-free per-VCPU hash of recently-used mappings. */
     struct vcpu_maphash_entry {
@@ -53,18 +53,10 @@ struct mapcache_vcpu {
 };
 
 struct mapcache_domain {
-    /* The number of array entries, and a cursor into the array. */
+    /* The number of array entries (MAPCACHE_VCPU_ENTRIES per vCPU). */
     unsigned int entries;
-    unsigned int cursor;
-
-    /* Protects map_domain_page(). */
-    spinlock_t lock;
 
-    /* Garbage mappings are flushed from TLBs in batches called 'epochs'. */
-    unsigned int epoch;
-    u32 tlbflush_timestamp;
-
-    /* Which mappings are in use, and which are garbage to reap next epoch? */
+    /* Which mappings are in use, and which are garbage to reap next? */
     unsigned long *inuse;
     unsigned long *garbage;
 };
@@ -104,7 +96,13 @@ struct shadow_domain {
 
     /* Shadow hashtable */
     struct page_info **hash_table;
+    unsigned int hash_buckets;
+    unsigned int hash_entries;  /* # of shadows in the table(s) */
     bool_t hash_walking;  /* Some function is walking the hash table */
+    /* Previous table while resizing, and its next chain to move over */
+    struct page_info **hash_old;
+    unsigned int hash_old_buckets;
+    unsigned int hash_migrate;
 
     /* Fast MMIO path heuristic */
     bool_t has_fast_mmio_entries;
@@ -168,6 +166,12 @@ struct log_dirty_domain {
     unsigned int   fault_count;
     unsigned int   dirty_count;
 
+    /* optional ring of newly dirtied pfns, drained by the toolstack */
+    uint64_t      *ring;
+    unsigned int   ring_size;
+    unsigned int   ring_count;
+    bool_t         ring_overflow;
+
     /* functions which are paging mode specific */
     int            (*enable_log_dirty   )(struct domain *d);
     int            (*disable_log_dirty  )(struct domain *d);
@@ -440,6 +444,11 @@ struct arch_vcpu
 
     /* A secondary copy of the vcpu time info. */
     XEN_GUEST_HANDLE(vcpu_time_info_t) time_info_guest;
+
+    /* The hypercall being timed for XEN_SYSCTL_hypercall_stats, if any. */
+    s_time_t      hcall_stats_start;
+    unsigned long hcall_stats_rip;
+    unsigned int  hcall_stats_nr;
 } __cacheline_aligned;
 
 /* Shorthands to improve code legibility. */
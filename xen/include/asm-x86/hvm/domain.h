@@ -41,13 +41,37 @@ struct hvm_ioreq_page {
     void *va;
 };
 
+#define MAX_NR_IOREQ_SERVERS 8
+#define NR_IO_RANGE_TYPES (HVMOP_IO_RANGE_PCI + 1)
+
+/* A device model besides the default one (HVMOP_create_ioreq_server). */
+struct hvm_ioreq_server {
+    struct list_head       list_entry;
+    ioservid_t             id;
+    domid_t                domid;       /* domain running the emulator */
+    struct hvm_ioreq_page  ioreq;
+    int                   *ports;       /* per-vcpu event channels */
+    struct rangeset       *range[NR_IO_RANGE_TYPES];
+};
+
 struct hvm_domain {
     struct hvm_ioreq_page  ioreq;
     struct hvm_ioreq_page  buf_ioreq;
 
+    /* Additional ioreq servers, with emulation dispatched by range. */
+    spinlock_t             ioreq_server_lock;
+    struct list_head       ioreq_server_list;
+    unsigned int           nr_ioreq_servers;
+    ioservid_t             ioreq_server_id;
+    uint8_t                buf_ioreq_nr_pages; /* frames of buf_ioreq ring */
+    uint32_t               pci_cf8;     /* last write to port 0xcf8 */
+    /* write_pointer at the last buffered ioreq notification. */
+    uint32_t               buf_ioreq_kick;
+
     struct pl_time         pl_time;
 
     struct hvm_io_handler *io_handler;
+    struct hvm_fast_io     fast_io;
 
     /* Lock protects access to irq, vpic and vioapic. */
     spinlock_t             irq_lock;
@@ -82,6 +106,8 @@ struct hvm_domain {
     /* hypervisor intercepted msix table */
     struct list_head       msixtbl_list;
     spinlock_t             msixtbl_list_lock;
+#define MSIXTBL_HASH_SIZE 16     /* buckets of msixtbl_hash */
+    struct hlist_head     *msixtbl_hash; /* MSI-X table pages, by gfn */
 
     struct viridian_domain viridian;
 
@@ -45,6 +45,7 @@ void hvm_emulate_writeback(
 struct segment_register *hvmemul_get_seg_reg(
     enum x86_segment seg,
     struct hvm_emulate_ctxt *hvmemul_ctxt);
+void hvmemul_insn_xlat_flush(struct vcpu *v);
 
 int hvmemul_do_pio(
     unsigned long port, unsigned long *reps, int size,
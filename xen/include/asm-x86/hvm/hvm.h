@@ -187,6 +187,8 @@ struct hvm_function_table {
     void (*deliver_posted_intr)(struct vcpu *v, u8 vector);
     void (*sync_pir_to_irr)(struct vcpu *v);
     void (*handle_eoi)(u8 vector);
+    /* Make posted interrupts wake up the blocking current vCPU. */
+    void (*vcpu_block)(struct vcpu *v);
 
     /*Walk nested p2m  */
     int (*nhvm_hap_walk_L1_p2m)(struct vcpu *v, paddr_t L2_gpa,
@@ -219,6 +221,12 @@ void hvm_vcpu_reset_state(struct vcpu *v, uint16_t cs, uint16_t ip);
 int prepare_ring_for_helper(struct domain *d, unsigned long gmfn, 
                             struct page_info **_page, void **_va);
 void destroy_ring_for_helper(void **_va, struct page_info *page);
+/* As above, for a ring of nr pages held in contiguous gmfns */
+int prepare_ring_pages_for_helper(struct domain *d, unsigned long gmfn,
+                                  unsigned int nr, struct page_info **pages,
+                                  void **_va);
+void destroy_ring_pages_for_helper(void **_va, struct page_info **pages,
+                                   unsigned int nr);
 
 bool_t hvm_send_assist_req(struct vcpu *v);
 
@@ -23,6 +23,7 @@
 #include <asm/hvm/vpic.h>
 #include <asm/hvm/vioapic.h>
 #include <public/hvm/ioreq.h>
+#include <public/hvm/hvm_op.h>
 #include <public/event_channel.h>
 
 #define MAX_IO_HANDLER             16
@@ -94,6 +95,28 @@ static inline int hvm_buffered_io_intercept(ioreq_t *p)
 int hvm_mmio_intercept(ioreq_t *p);
 int hvm_buffered_io_send(ioreq_t *p);
 
+/* Device model registered ranges completed in Xen (HVMOP_set_fast_io). */
+#define HVM_FAST_IO_NR             16
+
+struct hvm_fast_io_range {
+    uint8_t             space;
+    uint8_t             mode;
+    int                 port;
+    unsigned long       start;
+    unsigned long       size;
+    uint64_t            value;
+};
+
+struct hvm_fast_io {
+    spinlock_t          lock;
+    unsigned int        nr;
+    struct hvm_fast_io_range range[HVM_FAST_IO_NR];
+};
+
+int hvm_fast_io_intercept(ioreq_t *p);
+int hvm_set_fast_io(struct domain *d, struct xen_hvm_fast_io *op);
+int hvm_get_fast_io(struct domain *d, struct xen_hvm_fast_io *op);
+
 static inline void register_portio_handler(
     struct domain *d, unsigned long addr,
     unsigned long size, portio_action_t action)
@@ -9,6 +9,11 @@ extern const struct iommu_ops amd_iommu_ops;
 extern int intel_vtd_setup(void);
 extern int amd_iov_detect(void);
 
+struct vcpu;
+struct pirq;
+int pi_update_irte(const struct vcpu *v, const struct pirq *pirq,
+                   uint8_t gvec);
+
 static inline const struct iommu_ops *iommu_get_ops(void)
 {
     switch ( boot_cpu_data.x86_vendor )
@@ -69,6 +69,17 @@ struct hvm_vcpu_io {
     /* For retries we shouldn't re-fetch the instruction. */
     unsigned int mmio_insn_bytes;
     unsigned char mmio_insn[16];
+    /*
+     * Recent instruction fetch translations: under @cr3, the code page at
+     * linear address @va is guest frame @gfn. Only the first @insn_xlat_nr
+     * entries are valid; see hvmemul_insn_xlat_flush().
+     */
+    struct hvm_insn_xlat {
+        unsigned long cr3;
+        unsigned long va;
+        unsigned long gfn;
+    } insn_xlat[4];
+    unsigned int insn_xlat_nr, insn_xlat_next;
     /*
      * For string instruction emulation we need to be able to signal a
      * necessary retry through other than function return codes.
@@ -132,8 +143,14 @@ struct hvm_vcpu {
     /* Lock and list for virtual platform timers. */
     spinlock_t          tm_lock;
     struct list_head    tm_list;
+    /* One Xen timer for the earliest armed platform timer on tm_list. */
+    struct timer        tm_timer;
+    bool_t              tm_frozen;  /* descheduled: only do_not_freeze run */
+    bool_t              tm_pending; /* some listed timer may have ticks due */
 
     int                 xen_port;
+    /* Non-default ioreq server the pending ioreq was sent to, if any. */
+    struct hvm_ioreq_server *ioreq_server;
 
     bool_t              flag_dr_dirty;
     bool_t              debug_state_latch;
@@ -9,6 +9,8 @@
 #ifndef __ASM_X86_HVM_VIRIDIAN_H__
 #define __ASM_X86_HVM_VIRIDIAN_H__
 
+#include <xen/timer.h>
+
 union viridian_apic_assist
 {   uint64_t raw;
     struct
@@ -19,9 +21,84 @@ union viridian_apic_assist
     } fields;
 };
 
+/* SIEFP and SIMP: guest pages holding SynIC event flags and messages. */
+union viridian_synic_page
+{   uint64_t raw;
+    struct
+    {
+        uint64_t enabled:1;
+        uint64_t reserved_preserved:11;
+        uint64_t pfn:48;
+    } fields;
+};
+
+union viridian_scontrol
+{   uint64_t raw;
+    struct
+    {
+        uint64_t enabled:1;
+        uint64_t reserved_preserved:63;
+    } fields;
+};
+
+union viridian_sint
+{   uint64_t raw;
+    struct
+    {
+        uint64_t vector:8;
+        uint64_t reserved_preserved1:8;
+        uint64_t mask:1;
+        uint64_t auto_eoi:1;
+        uint64_t polling:1;
+        uint64_t reserved_preserved2:45;
+    } fields;
+};
+
+union viridian_stimer_config
+{   uint64_t raw;
+    struct
+    {
+        uint64_t enabled:1;
+        uint64_t periodic:1;
+        uint64_t lazy:1;
+        uint64_t auto_enable:1;
+        uint64_t reserved_preserved1:12;
+        uint64_t sintx:4;
+        uint64_t reserved_preserved2:44;
+    } fields;
+};
+
+#define VIRIDIAN_SINT_NR   16
+#define VIRIDIAN_STIMER_NR 4
+
+struct viridian_stimer
+{
+    struct timer timer;
+    struct vcpu *v;
+    union viridian_stimer_config config;
+    uint64_t count;
+    uint64_t expiration;     /* Next expiry, in 100ns reference time units. */
+    uint64_t msg_expiration; /* Expiry reported by the pending message. */
+};
+
+/* Synthetic interrupt controller and timers; protected by @lock. */
+struct viridian_synic
+{
+    spinlock_t lock;
+    union viridian_scontrol scontrol;
+    union viridian_synic_page siefp;
+    union viridian_synic_page simp;
+    union viridian_sint sint[VIRIDIAN_SINT_NR];
+    struct page_info *simp_page;
+    void *simp_va;
+    unsigned long stimer_pending;
+    struct viridian_stimer stimer[VIRIDIAN_STIMER_NR];
+};
+
 struct viridian_vcpu
 {
     union viridian_apic_assist apic_assist;
+    struct viridian_synic *synic;
 };
 
 union viridian_guest_os_id
@@ -48,10 +125,21 @@ union viridian_hypercall_gpa
     } fields;
 };
 
+union viridian_reference_tsc
+{   uint64_t raw;
+    struct
+    {
+        uint64_t enabled:1;
+        uint64_t reserved_preserved:11;
+        uint64_t pfn:48;
+    } fields;
+};
+
 struct viridian_domain
 {
     union viridian_guest_os_id guest_os_id;
     union viridian_hypercall_gpa hypercall_gpa;
+    union viridian_reference_tsc reference_tsc;
 };
 
 int
@@ -75,4 +163,10 @@ rdmsr_viridian_regs(
 int
 viridian_hypercall(struct cpu_user_regs *regs);
 
+int viridian_vcpu_init(struct vcpu *v);
+void viridian_vcpu_deinit(struct vcpu *v);
+void viridian_vcpu_destroy(struct vcpu *v);
+void viridian_domain_deinit(struct domain *d);
+void viridian_migrate_timers(struct vcpu *v);
+
 #endif /* __ASM_X86_HVM_VIRIDIAN_H__ */
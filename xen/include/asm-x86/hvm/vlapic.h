@@ -73,6 +73,8 @@ struct vlapic {
     struct periodic_time     pt;
     s_time_t                 timer_last_update;
     struct page_info         *regs_page;
+    /* 32-bit IRR/ISR words that may be non-zero (bit n: vectors 32n-32n+31). */
+    unsigned long            irr_summary, isr_summary;
     /* INIT-SIPI-SIPI work gets deferred to a tasklet. */
     struct {
         uint32_t             icr, dest;
@@ -62,12 +62,15 @@ struct ept_data {
     struct {
             u64 ept_mt :3,
                 ept_wl :3,
-                rsvd   :6,
+                ept_ad :1,  /* Enable EPT accessed/dirty bits */
+                rsvd   :5,
                 asr    :52;
         };
         u64 eptp;
     };
     cpumask_var_t synced_mask;
+    /* Type map still to be applied below entries marked for recalc. */
+    u8 recalc_type[64];
 };
 
 struct vmx_domain {
@@ -76,10 +79,26 @@ struct vmx_domain {
 
 struct pi_desc {
     DECLARE_BITMAP(pir, NR_VECTORS);
-    u32 control;
-    u32 rsvd[7];
+    union {
+        struct {
+            u16 on     : 1,  /* bit 256 - Outstanding Notification */
+                sn     : 1,  /* bit 257 - Suppress Notification */
+                rsvd_1 : 14; /* bit 271:258 - Reserved */
+            u8  nv;          /* bit 279:272 - Notification Vector */
+            u8  rsvd_2;      /* bit 287:280 - Reserved */
+            u32 ndst;        /* bit 319:288 - Notification Destination */
+        };
+        u64 control;
+    };
+    u32 rsvd[6];
 } __attribute__ ((aligned (64)));
 
+/* vCPUs blocked with posted interrupts routed to the wakeup vector. */
+struct pi_blocking_vcpu {
+    struct list_head     list;
+    spinlock_t           *lock;
+};
+
 #define ept_get_wl(ept)   ((ept)->ept_wl)
 #define ept_get_asr(ept)  ((ept)->asr)
 #define ept_get_eptp(ept) ((ept)->eptp)
@@ -121,6 +140,7 @@ struct arch_vmx_struct {
     unsigned long        eoi_exitmap_changed;
     DECLARE_BITMAP(eoi_exit_bitmap, NR_VECTORS);
     struct pi_desc       pi_desc;
+    struct pi_blocking_vcpu pi_blocking;
 
     unsigned long        host_cr0;
 
@@ -217,6 +237,7 @@ extern u32 vmx_secondary_exec_control;
 #define VMX_EPT_SUPERPAGE_2MB                   0x00010000
 #define VMX_EPT_SUPERPAGE_1GB                   0x00020000
 #define VMX_EPT_INVEPT_INSTRUCTION              0x00100000
+#define VMX_EPT_AD_BIT                          0x00200000
 #define VMX_EPT_INVEPT_SINGLE_CONTEXT           0x02000000
 #define VMX_EPT_INVEPT_ALL_CONTEXT              0x04000000
 
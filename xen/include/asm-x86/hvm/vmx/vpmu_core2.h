@@ -44,6 +44,7 @@ struct core2_vpmu_context {
     u64 fix_counters[VPMU_CORE2_NUM_FIXED];
     u64 ctrls[VPMU_CORE2_NUM_CTRLS];
     u64 global_ovf_status;
+    u64 last_ovf_status;    /* Overflows signalled by the last PMI */
     struct arch_msr_pair arch_msr_pair[1];
 };
 
@@ -55,6 +55,13 @@ struct arch_vpmu_ops {
     int (*arch_vpmu_save)(struct vcpu *v);
     void (*arch_vpmu_load)(struct vcpu *v);
     void (*arch_vpmu_dump)(const struct vcpu *);
+    /*
+     * Reload the counters which overflowed by the last PMI and have a
+     * non-zero reload value, returning them in *sampled. Returns whether
+     * the guest still needs a PMI for this interrupt.
+     */
+    int (*arch_vpmu_sample)(struct vcpu *v, const uint64_t *reload,
+                            uint64_t *sampled);
 };
 
 int vmx_vpmu_initialise(struct vcpu *, unsigned int flags);
@@ -66,6 +73,7 @@ struct vpmu_struct {
     u32 hw_lapic_lvtpc;
     void *context;
     struct arch_vpmu_ops *arch_vpmu_ops;
+    struct xen_vpmu_sample_page *sample_page; /* Batched sampling ring */
 };
 
 /* VPMU states */
@@ -96,6 +104,8 @@ void vpmu_destroy(struct vcpu *v);
 void vpmu_save(struct vcpu *v);
 void vpmu_load(struct vcpu *v);
 void vpmu_dump(struct vcpu *v);
+int vpmu_set_sample_page(struct vcpu *v, unsigned long gfn);
+void vpmu_release_sample_page(struct vcpu *v);
 
 extern int acquire_pmu_ownership(int pmu_ownership);
 extern void release_pmu_ownership(int pmu_ownership);
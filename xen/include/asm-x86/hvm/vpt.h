@@ -44,6 +44,7 @@ struct periodic_time {
     bool_t do_not_freeze;
     bool_t irq_issued;
     bool_t warned_timeout_too_short;
+    bool_t armed;               /* due to tick at 'scheduled' */
 #define PTSRC_isa    1 /* ISA time source */
 #define PTSRC_lapic  2 /* LAPIC time source */
     u8 source;                  /* PTSRC_ */
@@ -53,7 +54,6 @@ struct periodic_time {
     u64 period;                 /* frequency in ns */
     s_time_t scheduled;         /* scheduled timer interrupt */
     u64 last_plt_gtime;         /* platform time when last IRQ is injected */
-    struct timer timer;         /* ac_timer */
     time_cb *cb;
     void *priv;                 /* point back to platform time source */
 };
@@ -96,6 +96,7 @@ typedef struct HPETState {
     uint64_t hpet_to_ns_limit; /* max hpet ticks convertable to ns      */
     uint64_t mc_offset;
     struct periodic_time pt[HPET_TIMER_NUM];
+    unsigned long masked_timers; /* enabled, but not armed while masked */
     spinlock_t lock;
 } HPETState;
 
@@ -141,6 +142,8 @@ struct pl_time {    /* platform time */
     spinlock_t pl_time_lock;
 };
 
+void pt_vcpu_init(struct vcpu *v);
+void pt_vcpu_destroy(struct vcpu *v);
 void pt_save_timer(struct vcpu *v);
 void pt_restore_timer(struct vcpu *v);
 int pt_update_irq(struct vcpu *v);
@@ -193,5 +196,6 @@ int pmtimer_change_ioport(struct domain *d, unsigned int version);
 void hpet_init(struct vcpu *v);
 void hpet_deinit(struct domain *d);
 void hpet_reset(struct domain *d);
+void hpet_may_unmask_irq(struct domain *d);
 
 #endif /* __ASM_X86_HVM_VPT_H__ */
@@ -16,6 +16,14 @@
  */
 #define MMU_UPDATE_PREEMPTED          (~(~0U>>1))
 
+/* Per hypercall number latency histograms (XEN_SYSCTL_hypercall_stats). */
+struct vcpu;
+struct xen_sysctl_hypercall_stats;
+extern bool_t hypercall_stats_enabled;
+void hypercall_stats_start(struct vcpu *v, unsigned int nr);
+void hypercall_stats_end(struct vcpu *v, bool_t continued);
+int hypercall_stats_op(struct xen_sysctl_hypercall_stats *op);
+
 extern long
 do_event_channel_op_compat(
     XEN_GUEST_HANDLE_PARAM(evtchn_op_t) uop);
@@ -62,6 +62,14 @@ void mem_event_put_request(struct domain *d, struct mem_event_domain *med,
 int mem_event_get_response(struct domain *d, struct mem_event_domain *med,
                            mem_event_response_t *rsp);
 
+/* Responses pulled off the ring at a time by the resume handlers */
+#define MEM_EVENT_RESPONSE_BATCH 16
+
+unsigned int mem_event_get_responses(struct domain *d,
+                                     struct mem_event_domain *med,
+                                     mem_event_response_t *rsp,
+                                     unsigned int nr);
+
 int do_mem_event_op(int op, uint32_t domain, void *arg);
 int mem_event_domctl(struct domain *d, xen_domctl_mem_event_op_t *mec,
                      XEN_GUEST_HANDLE_PARAM(void) u_domctl);
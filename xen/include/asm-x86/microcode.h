@@ -8,10 +8,15 @@ struct ucode_cpu_info;
 
 struct microcode_ops {
     int (*microcode_resume_match)(int cpu, const void *mc);
+    /*
+     * Find the newest update in @buf for @cpu and keep it in @cpu's
+     * ucode_cpu_info, without loading it: returns 1 if found, 0 if not.
+     */
     int (*cpu_request_microcode)(int cpu, const void *buf, size_t size);
     int (*collect_cpu_info)(int cpu, struct cpu_signature *csig);
     int (*apply_microcode)(int cpu);
     int (*start_update)(void);
+    void (*end_update_percpu)(void);
 };
 
 struct cpu_signature {
@@ -114,6 +114,9 @@ struct msi_desc {
 	struct msi_msg msg;		/* Last set MSI message */
 
 	int remap_index;		/* index in interrupt remapping table */
+
+	const struct pi_desc *pi_desc;	/* PI descriptor for posted IRTE */
+	uint8_t gvec;			/* guest vector, valid with pi_desc */
 };
 
 /*
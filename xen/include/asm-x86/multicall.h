@@ -7,6 +7,10 @@
 
 #include <xen/errno.h>
 
+/* Bracket sub-calls, so pagetable ones can batch their TLB flushes. */
+void arch_multicall_prepare(unsigned long op);
+void arch_multicall_end(void);
+
 #define do_multicall_call(_call)                             \
     do {                                                     \
         __asm__ __volatile__ (                               \
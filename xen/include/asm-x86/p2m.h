@@ -32,7 +32,7 @@
 #include <asm/mem_sharing.h>
 #include <asm/page.h>    /* for pagetable_t */
 
-extern bool_t opt_hap_1gb, opt_hap_2mb;
+extern bool_t opt_hap_1gb, opt_hap_2mb, opt_p2m_merge;
 
 /*
  * The upper levels of the p2m pagetable always contain full rights; all 
@@ -162,6 +162,11 @@ typedef unsigned int p2m_query_t;
  * and must not be touched. */
 #define P2M_BROKEN_TYPES (p2m_to_mask(p2m_ram_broken))
 
+/* Types for which split superpages may be put back together.  Log-dirty
+ * entries are left alone, as merging them would only undo the splits. */
+#define P2M_MERGEABLE_TYPES (p2m_to_mask(p2m_ram_rw)        \
+                             | p2m_to_mask(p2m_ram_ro))
+
 /* Useful predicates */
 #define p2m_is_ram(_t) (p2m_to_mask(_t) & P2M_RAM_TYPES)
 #define p2m_is_hole(_t) (p2m_to_mask(_t) & P2M_HOLE_TYPES)
@@ -180,6 +185,7 @@ typedef unsigned int p2m_query_t;
 #define p2m_is_sharable(_t) (p2m_to_mask(_t) & P2M_SHARABLE_TYPES)
 #define p2m_is_shared(_t)   (p2m_to_mask(_t) & P2M_SHARED_TYPES)
 #define p2m_is_broken(_t)   (p2m_to_mask(_t) & P2M_BROKEN_TYPES)
+#define p2m_is_mergeable(_t) (p2m_to_mask(_t) & P2M_MERGEABLE_TYPES)
 
 /* Per-p2m-table state */
 struct p2m_domain {
@@ -239,6 +245,10 @@ struct p2m_domain {
                                           mfn_t table_mfn, l1_pgentry_t new,
                                           unsigned int level);
     long               (*audit_p2m)(struct p2m_domain *p2m);
+    void               (*harvest_accessed)(struct p2m_domain *p2m,
+                                           unsigned long gfn,
+                                           unsigned int nr,
+                                           unsigned long *bitmap);
 
     /* Default P2M access type for each page in the the domain: new pages,
      * swapped in pages, cleared pages, and pages that are ambiquously
@@ -274,6 +284,13 @@ struct p2m_domain {
         /* gpfn of last guest superpage demand-populated */
         unsigned long    last_populated[POD_HISTORY_MAX]; 
         unsigned int     last_populated_index;
+#define POD_NONZERO_MAX 128
+        /* gpfns recently found non-zero by sweeps, hashed by gpfn */
+        struct {
+            unsigned long gfn;
+            unsigned int  sweep;       /* sweep # when found, 0 if unused */
+        }                nonzero[POD_NONZERO_MAX];
+        unsigned int     sweep;        /* # of emergency sweeps done */
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
     } pod;
@@ -287,7 +304,8 @@ struct p2m_domain {
 #define p2m_get_hostp2m(d)      ((d)->arch.p2m)
 
 /* Get p2m table (re)usable for specified np2m base.
- * Automatically destroys and re-initializes a p2m if none found.
+ * A table cached for the same base is reused as is; otherwise the least
+ * recently used one is destroyed and re-initialized.
  * If np2m_base == 0 then v->arch.hvm_vcpu.guest_cr[3] is used.
  */
 struct p2m_domain *p2m_get_nestedp2m(struct vcpu *v, uint64_t np2m_base);
@@ -497,6 +515,21 @@ int guest_physmap_mark_populate_on_demand(struct domain *d, unsigned long gfn,
 void p2m_change_entry_type_global(struct domain *d, 
                                   p2m_type_t ot, p2m_type_t nt);
 
+/*
+ * Collect, and clear, the accessed bits for gfns [gfn, gfn + nr) into the
+ * zeroed @bitmap.  -EOPNOTSUPP if the p2m doesn't track them.
+ */
+int p2m_harvest_accessed(struct domain *d, unsigned long gfn,
+                         unsigned int nr, unsigned long *bitmap);
+
+/*
+ * Move the page backing @gfn of a paused guest to NUMA node @node: copy
+ * it to a new page there and switch the p2m entry over.  Returns 1 if it
+ * was moved, 0 if it needn't or can't be (not plain RAM, already on the
+ * node, or referenced other than by the p2m), -ENOMEM if @node is full.
+ */
+int p2m_migrate_page(struct domain *d, unsigned long gfn, unsigned int node);
+
 /* Change types across a range of p2m entries (start ... end-1) */
 void p2m_change_type_range(struct domain *d, 
                            unsigned long start, unsigned long end,
@@ -575,9 +608,11 @@ bool_t p2m_mem_access_check(paddr_t gpa, bool_t gla_valid, unsigned long gla,
 void p2m_mem_access_resume(struct domain *d);
 
 /* Set access type for a region of pfns.
- * If start_pfn == -1ul, sets the default access type */
-int p2m_set_mem_access(struct domain *d, unsigned long start_pfn, 
-                       uint32_t nr, hvmmem_access_t access);
+ * If start_pfn == -1ul, sets the default access type.
+ * Returns 0 when done, -errno on error, or, if preempted, the (positive)
+ * number of pfns dealt with so far. */
+long p2m_set_mem_access(struct domain *d, unsigned long start_pfn,
+                        uint32_t nr, hvmmem_access_t access);
 
 /* Get access type for a pfn
  * If pfn == -1ul, gets the default access type */
@@ -591,6 +626,9 @@ int p2m_get_mem_access(struct domain *d, unsigned long pfn,
 struct page_info *p2m_alloc_ptp(struct p2m_domain *p2m, unsigned long type);
 void p2m_free_ptp(struct p2m_domain *p2m, struct page_info *pg);
 
+/* May the p2m code rebuild previously split superpages of @p2m? */
+bool_t p2m_merge_allowed(const struct p2m_domain *p2m);
+
 /* Directly set a p2m entry: only for use by p2m code. Does not need
  * a call to put_gfn afterwards/ */
 int set_p2m_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn, 
@@ -652,6 +690,9 @@ static inline p2m_type_t p2m_flags_to_type(unsigned long flags)
 void p2m_flush(struct vcpu *v, struct p2m_domain *p2m);
 /* Flushes all nested p2m tables */
 void p2m_flush_nestedp2m(struct domain *d);
+/* Flushes the nested p2m table cached for np2m_base, if any, and returns it */
+struct p2m_domain *p2m_flush_nestedp2m_base(struct domain *d,
+                                            uint64_t np2m_base);
 
 void nestedp2m_write_p2m_entry(struct p2m_domain *p2m, unsigned long gfn,
     l1_pgentry_t *p, mfn_t table_mfn, l1_pgentry_t new, unsigned int level);
@@ -206,13 +206,23 @@ typedef struct { u64 pfn; } pagetable_t;
 #define pagetable_null()        pagetable_from_pfn(0)
 
 void clear_page_sse2(void *);
-#define clear_page(_p)      (cpu_has_xmm2 ?                             \
-                             clear_page_sse2((void *)(_p)) :            \
-                             (void)memset((void *)(_p), 0, PAGE_SIZE))
+void clear_page_erms(void *);
+#define clear_page(_p)      (cpu_has_erms ?                             \
+                             clear_page_erms((void *)(_p)) :            \
+                             clear_page_sse2((void *)(_p)))
 void copy_page_sse2(void *, const void *);
-#define copy_page(_t,_f)    (cpu_has_xmm2 ?                             \
-                             copy_page_sse2(_t, _f) :                   \
-                             (void)memcpy(_t, _f, PAGE_SIZE))
+void copy_page_erms(void *, const void *);
+#define copy_page(_t,_f)    (cpu_has_erms ?                             \
+                             copy_page_erms(_t, _f) :                   \
+                             copy_page_sse2(_t, _f))
+
+/*
+ * Clearing pages nobody is about to use (free pages, PoD cache) goes
+ * around the caches, and a batch of them needs fencing only once.
+ */
+void clear_page_nt(void *);
+#define scrub_page(_p)      clear_page_nt((void *)(_p))
+#define scrub_page_fence()  asm volatile ( "sfence" ::: "memory" )
 
 /* Convert between Xen-heap virtual addresses and machine addresses. */
 #define __pa(x)             (virt_to_maddr(x))
@@ -326,6 +336,7 @@ void paging_init(void);
     (_PAGE_PRESENT | _PAGE_RW | _PAGE_DIRTY | _PAGE_PCD | _PAGE_ACCESSED)
 
 #define MAP_SMALL_PAGES _PAGE_AVAIL0 /* don't use superpages mappings */
+#define MAP_NO_FLUSH    _PAGE_AVAIL1 /* caller flushes replaced 4k PTEs */
 
 #ifndef __ASSEMBLY__
 
@@ -6,6 +6,8 @@
                         || id == 0x01128086 || id == 0x01228086 \
                         || id == 0x010A8086 )
 
+extern bool_t pci_mmcfg_lockless;
+
 struct arch_pci_dev {
     vmask_t used_vectors;
 };
@@ -18,6 +18,7 @@ PERFCOUNTER(seg_fixups,             "segmentation fixups")
 PERFCOUNTER(apic_timer,             "apic timer interrupts")
 
 PERFCOUNTER(domain_page_tlb_flush,  "domain page tlb flushes")
+PERFCOUNTER(domain_page_borrow,     "domain page slots borrowed")
 
 PERFCOUNTER(calls_to_mmuext_op,         "calls to mmuext_op")
 PERFCOUNTER(num_mmuext_ops,             "mmuext ops")
@@ -25,6 +26,7 @@ PERFCOUNTER(calls_to_mmu_update,        "calls to mmu_update")
 PERFCOUNTER(num_page_updates,           "page updates")
 PERFCOUNTER(writable_mmu_updates,       "mmu_updates of writable pages")
 PERFCOUNTER(calls_to_update_va,         "calls to update_va_map")
+PERFCOUNTER(tlb_flushes_coalesced,      "remote tlb flushes coalesced")
 PERFCOUNTER(page_faults,            "page faults")
 PERFCOUNTER(copy_user_faults,       "copy_user faults")
 
@@ -75,6 +77,7 @@ PERFCOUNTER(shadow_hash_lookup_miss, "shadow hash misses")
 PERFCOUNTER(shadow_get_shadow_status, "calls to get_shadow_status")
 PERFCOUNTER(shadow_hash_inserts,   "calls to shadow_hash_insert")
 PERFCOUNTER(shadow_hash_deletes,   "calls to shadow_hash_delete")
+PERFCOUNTER(shadow_hash_resizes,   "shadow hash table resizes")
 PERFCOUNTER(shadow_writeable,      "shadow removes write access")
 PERFCOUNTER(shadow_writeable_h_1,  "shadow writeable: 32b w2k3")
 PERFCOUNTER(shadow_writeable_h_2,  "shadow writeable: 32pae w2k3")
@@ -125,6 +128,9 @@ PERFCOUNTER(mshv_rdmsr_icr,             "MS Hv rdmsr icr")
 PERFCOUNTER(mshv_rdmsr_tpr,             "MS Hv rdmsr tpr")
 PERFCOUNTER(mshv_rdmsr_apic_assist,     "MS Hv rdmsr APIC assist")
 PERFCOUNTER(mshv_rdmsr_apic_msr,        "MS Hv rdmsr APIC msr")
+PERFCOUNTER(mshv_rdmsr_tsc_msr,         "MS Hv rdmsr TSC msr")
+PERFCOUNTER(mshv_rdmsr_synic,           "MS Hv rdmsr SynIC")
+PERFCOUNTER(mshv_rdmsr_stimer,          "MS Hv rdmsr synthetic timer")
 PERFCOUNTER(mshv_wrmsr_osid,            "MS Hv wrmsr Guest OS ID")
 PERFCOUNTER(mshv_wrmsr_hc_page,         "MS Hv wrmsr hypercall page")
 PERFCOUNTER(mshv_wrmsr_vp_index,        "MS Hv wrmsr vp index")
@@ -133,6 +139,11 @@ PERFCOUNTER(mshv_wrmsr_tpr,             "MS Hv wrmsr tpr")
 PERFCOUNTER(mshv_wrmsr_eoi,             "MS Hv wrmsr eoi")
 PERFCOUNTER(mshv_wrmsr_apic_assist,     "MS Hv wrmsr APIC assist")
 PERFCOUNTER(mshv_wrmsr_apic_msr,        "MS Hv wrmsr APIC msr")
+PERFCOUNTER(mshv_wrmsr_tsc_msr,         "MS Hv wrmsr TSC msr")
+PERFCOUNTER(mshv_wrmsr_synic,           "MS Hv wrmsr SynIC")
+PERFCOUNTER(mshv_wrmsr_eom,             "MS Hv wrmsr EOM")
+PERFCOUNTER(mshv_wrmsr_stimer,          "MS Hv wrmsr synthetic timer")
+PERFCOUNTER(mshv_stimer_message,        "MS Hv synthetic timer message")
 
 PERFCOUNTER(realmode_emulations, "realmode instructions emulated")
 PERFCOUNTER(realmode_exits,      "vmexits from realmode")
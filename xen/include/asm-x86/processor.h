@@ -174,6 +174,7 @@ struct cpuinfo_x86 {
     int   phys_proc_id; /* package ID of each logical CPU */
     int   cpu_core_id; /* core ID of each logical CPU*/
     int   compute_unit_id; /* AMD compute unit ID of each logical CPU */
+    int   cpu_llc_id; /* ID of the last level cache of each logical CPU */
     unsigned short x86_clflush_size;
 } __cacheline_aligned;
 
@@ -210,6 +211,9 @@ static always_inline void detect_ht(struct cpuinfo_x86 *c) {}
 
 #define cpu_to_core(_cpu)   (cpu_data[_cpu].cpu_core_id)
 #define cpu_to_socket(_cpu) (cpu_data[_cpu].phys_proc_id)
+/* Without cache topology information, assume one LLC per socket. */
+#define cpu_to_llc(_cpu)    (cpu_data[_cpu].cpu_llc_id != BAD_APICID ? \
+                             cpu_data[_cpu].cpu_llc_id : cpu_to_socket(_cpu))
 
 /*
  * Generic CPUID function
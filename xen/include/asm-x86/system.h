@@ -110,6 +110,52 @@ static always_inline unsigned long __cmpxchg(
     return old;
 }
 
+/*
+ * As __cmpxchg(), but only atomic with respect to the local CPU, e.g. for
+ * per-cpu data also updated by interrupt handlers: no LOCK prefix.
+ */
+static always_inline unsigned long __cmpxchg_local(
+    volatile void *ptr, unsigned long old, unsigned long new, int size)
+{
+    unsigned long prev;
+    switch ( size )
+    {
+    case 1:
+        asm volatile ( "cmpxchgb %b1,%2"
+                       : "=a" (prev)
+                       : "q" (new), "m" (*__xg((volatile void *)ptr)),
+                       "0" (old)
+                       : "memory" );
+        return prev;
+    case 2:
+        asm volatile ( "cmpxchgw %w1,%2"
+                       : "=a" (prev)
+                       : "r" (new), "m" (*__xg((volatile void *)ptr)),
+                       "0" (old)
+                       : "memory" );
+        return prev;
+    case 4:
+        asm volatile ( "cmpxchgl %k1,%2"
+                       : "=a" (prev)
+                       : "r" (new), "m" (*__xg((volatile void *)ptr)),
+                       "0" (old)
+                       : "memory" );
+        return prev;
+    case 8:
+        asm volatile ( "cmpxchgq %1,%2"
+                       : "=a" (prev)
+                       : "r" (new), "m" (*__xg((volatile void *)ptr)),
+                       "0" (old)
+                       : "memory" );
+        return prev;
+    }
+    return old;
+}
+
+#define cmpxchg_local(ptr,o,n)                                          \
+    ((__typeof__(*(ptr)))__cmpxchg_local((ptr),(unsigned long)(o),      \
+                                         (unsigned long)(n),sizeof(*(ptr))))
+
 #define cmpxchgptr(ptr,o,n) ({                                          \
     const __typeof__(**(ptr)) *__o = (o);                               \
     __typeof__(**(ptr)) *__n = (n);                                     \
@@ -196,6 +196,11 @@
 #define PERFC_INCR(_name,_idx,_cur)
 #endif
 
+/* Count hypercall _idx (< NR_hypercalls) in _cur's activity counters. */
+#define VCPU_PERF_HYPERCALL(_idx,_cur,_tmp)     \
+        movq VCPU_perf(_cur),_tmp;              \
+        incq VCPUPERF_hypercalls(_tmp,_idx,8)
+
 /* Work around AMD erratum #88 */
 #define safe_swapgs                             \
         "mfence; swapgs;"
@@ -36,7 +36,7 @@
 #include "grant_table.h"
 #include "hvm/save.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x00000009
+#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000a
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -186,11 +186,27 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /*
+  * Set up a ring of 'pages' entries recording pfns as they are dirtied,
+  * alongside the bitmap (0 tears it down).  Requires log-dirty mode, and
+  * cleans the bitmap.
+  */
+#define XEN_DOMCTL_SHADOW_OP_RING_ENABLE 13
+ /*
+  * Return up to 'pages' pfns from the ring in 'dirty_ring' and clean
+  * them, leaving in 'pages' the number returned.  Entries may repeat.
+  * Fails with -ENOBUFS once the ring has overflowed: use OP_CLEAN over
+  * all pfns instead, which also resets the ring.
+  */
+#define XEN_DOMCTL_SHADOW_OP_RING_DRAIN  14
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
 #define XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION   31
 
+/* Shadow hash table statistics (into hash_stats). */
+#define XEN_DOMCTL_SHADOW_OP_GET_HASH_STATS   33
+
 /* Legacy enable operations. */
  /* Equiv. to ENABLE with no mode flags. */
 #define XEN_DOMCTL_SHADOW_OP_ENABLE_TEST       1
@@ -227,6 +243,14 @@ struct xen_domctl_shadow_op_stats {
 typedef struct xen_domctl_shadow_op_stats xen_domctl_shadow_op_stats_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_op_stats_t);
 
+struct xen_domctl_shadow_hash_stats {
+    uint32_t buckets;       /* Buckets in the hash table */
+    uint32_t entries;       /* Shadows in the hash table */
+    uint32_t used;          /* Non-empty buckets */
+    uint32_t max_chain;     /* Length of the longest chain */
+};
+typedef struct xen_domctl_shadow_hash_stats xen_domctl_shadow_hash_stats_t;
+
 struct xen_domctl_shadow_op {
     /* IN variables. */
     uint32_t       op;       /* XEN_DOMCTL_SHADOW_OP_* */
@@ -241,6 +265,12 @@ struct xen_domctl_shadow_op {
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
+
+    /* OP_RING_DRAIN */
+    XEN_GUEST_HANDLE_64(uint64) dirty_ring;
+
+    /* OP_GET_HASH_STATS */
+    struct xen_domctl_shadow_hash_stats hash_stats;
 };
 typedef struct xen_domctl_shadow_op xen_domctl_shadow_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_op_t);
@@ -315,6 +345,7 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_max_vcpus_t);
 #define XEN_SCHEDULER_CREDIT   5
 #define XEN_SCHEDULER_CREDIT2  6
 #define XEN_SCHEDULER_ARINC653 7
+#define XEN_SCHEDULER_RTDS     8
 /* Set or get info? */
 #define XEN_DOMCTL_SCHEDOP_putinfo 0
 #define XEN_DOMCTL_SCHEDOP_getinfo 1
@@ -335,7 +366,20 @@ struct xen_domctl_scheduler_op {
         } credit;
         struct xen_domctl_sched_credit2 {
             uint16_t weight;
+            /*
+             * Non-zero: only share a core with the domain's own vcpus.
+             * Unlike weight, always applied by putinfo.
+             */
+            uint16_t gang;
         } credit2;
+        /*
+         * Applies to all the domain's vCPUs, in microseconds.  putinfo
+         * fails with -ENOSPC if the pool can't take the utilisation.
+         */
+        struct xen_domctl_sched_rtds {
+            uint32_t period;
+            uint32_t budget;
+        } rtds;
     } u;
 };
 typedef struct xen_domctl_scheduler_op xen_domctl_scheduler_op_t;
@@ -611,6 +655,19 @@ struct xen_domctl_cpuid {
 };
 typedef struct xen_domctl_cpuid xen_domctl_cpuid_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_cpuid_t);
+
+/*
+ * XEN_DOMCTL_set_cpuid_policy: replace all of a domain's cpuid leaves with
+ * nr_leaves leaves, each as for XEN_DOMCTL_set_cpuid.  Fails with -E2BIG,
+ * leaving the policy as it was, if there are more than Xen keeps.
+ */
+struct xen_domctl_cpuid_policy {
+    uint32_t nr_leaves;                         /* IN */
+    uint32_t pad;
+    XEN_GUEST_HANDLE_64(xen_domctl_cpuid_t) leaves; /* IN */
+};
+typedef struct xen_domctl_cpuid_policy xen_domctl_cpuid_policy_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_cpuid_policy_t);
 #endif
 
 /* XEN_DOMCTL_subscribe */
@@ -775,7 +832,23 @@ struct xen_domctl_mem_event_op {
     uint32_t       mode;         /* XEN_DOMCTL_MEM_EVENT_OP_* */
 
     uint32_t port;              /* OUT: event channel for ring */
+    /*
+     * IN: size of the ring, for the *_ENABLE ops. The ring is held in this
+     * many contiguous gfns, starting at the one in the ring's HVM param.
+     * Must be a power of two no larger than XEN_MEM_EVENT_RING_PAGES_MAX;
+     * 0 means 1.
+     */
+    uint32_t ring_pages;
+    uint32_t flags;             /* IN: XEN_MEM_EVENT_*, for *_ENABLE */
 };
+#define XEN_MEM_EVENT_RING_PAGES_MAX 16
+/*
+ * Only notify the helper of a request when the ring's req_event says it is
+ * waiting for one, rather than for every request.  The helper must then
+ * only wait for notification once RING_FINAL_CHECK_FOR_REQUESTS() finds
+ * the ring empty.
+ */
+#define XEN_MEM_EVENT_LAZY_KICK      (1u << 0)
 typedef struct xen_domctl_mem_event_op xen_domctl_mem_event_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_mem_event_op_t);
 
@@ -863,6 +936,46 @@ struct xen_domctl_set_max_evtchn {
 typedef struct xen_domctl_set_max_evtchn xen_domctl_set_max_evtchn_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_set_max_evtchn_t);
 
+/*
+ * XEN_DOMCTL_harvest_accessed: report, and clear, the hardware maintained
+ * accessed bits of the p2m entries for pfns [start_pfn, start_pfn +
+ * nr_pfns).  Bit i of the bitmap is set if pfn start_pfn + i has been
+ * accessed since the previous harvest; all pfns mapped by a superpage are
+ * reported as accessed if any of them was.  The hypervisor may stop
+ * early, in which case nr_pfns is updated to the number of pfns done (a
+ * multiple of 8).  Fails with -EOPNOTSUPP if the domain's p2m doesn't
+ * track accessed bits (see the "ept_ad" boot option).
+ */
+struct xen_domctl_harvest_accessed {
+    uint64_aligned_t start_pfn;          /* IN */
+    uint64_aligned_t nr_pfns;            /* IN/OUT */
+    XEN_GUEST_HANDLE_64(uint8) bitmap;   /* OUT */
+};
+typedef struct xen_domctl_harvest_accessed xen_domctl_harvest_accessed_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_harvest_accessed_t);
+
+/*
+ * XEN_DOMCTL_migrate_memory: move the RAM behind pfns [start_pfn,
+ * start_pfn + nr_pfns) of an HVM domain to NUMA node @node, a page at a
+ * time, copying each and switching its p2m entry over.  The domain is
+ * paused meanwhile.  Pages already on the node, or referenced by anything
+ * other than the p2m (grant or foreign mappings, for instance), are left
+ * alone.  The hypervisor stops early once max_migrate pages (if non-zero)
+ * have been moved, or to preempt itself; nr_pfns is updated to the number
+ * of pfns done, and nr_migrated to the number of pages moved.  Fails with
+ * -EOPNOTSUPP for domains with passed through devices.
+ */
+struct xen_domctl_migrate_memory {
+    uint32_t node;                       /* IN */
+    uint32_t pad;
+    uint64_aligned_t start_pfn;          /* IN */
+    uint64_aligned_t nr_pfns;            /* IN/OUT */
+    uint64_aligned_t max_migrate;        /* IN */
+    uint64_aligned_t nr_migrated;        /* OUT */
+};
+typedef struct xen_domctl_migrate_memory xen_domctl_migrate_memory_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_migrate_memory_t);
+
 struct xen_domctl {
     uint32_t cmd;
 #define XEN_DOMCTL_createdomain                   1
@@ -932,6 +1045,9 @@ struct xen_domctl {
 #define XEN_DOMCTL_setnodeaffinity               68
 #define XEN_DOMCTL_getnodeaffinity               69
 #define XEN_DOMCTL_set_max_evtchn                70
+#define XEN_DOMCTL_harvest_accessed              71
+#define XEN_DOMCTL_set_cpuid_policy              72
+#define XEN_DOMCTL_migrate_memory                73
 #define XEN_DOMCTL_gdbsx_guestmemio            1000
 #define XEN_DOMCTL_gdbsx_pausevcpu             1001
 #define XEN_DOMCTL_gdbsx_unpausevcpu           1002
@@ -982,12 +1098,15 @@ struct xen_domctl {
         struct xen_domctl_mem_sharing_op    mem_sharing_op;
 #if defined(__i386__) || defined(__x86_64__)
         struct xen_domctl_cpuid             cpuid;
+        struct xen_domctl_cpuid_policy      cpuid_policy;
         struct xen_domctl_vcpuextstate      vcpuextstate;
 #endif
         struct xen_domctl_set_access_required access_required;
         struct xen_domctl_audit_p2m         audit_p2m;
         struct xen_domctl_set_virq_handler  set_virq_handler;
         struct xen_domctl_set_max_evtchn    set_max_evtchn;
+        struct xen_domctl_harvest_accessed  harvest_accessed;
+        struct xen_domctl_migrate_memory    migrate_memory;
         struct xen_domctl_gdbsx_memio       gdbsx_guest_memio;
         struct xen_domctl_set_broken_page_p2m set_broken_page_p2m;
         struct xen_domctl_gdbsx_pauseunp_vcpu gdbsx_pauseunp_vcpu;
@@ -74,6 +74,7 @@
 #define EVTCHNOP_init_control    11
 #define EVTCHNOP_expand_array    12
 #define EVTCHNOP_set_priority    13
+#define EVTCHNOP_multi           14
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -297,6 +298,27 @@ struct evtchn_set_priority {
 };
 typedef struct evtchn_set_priority evtchn_set_priority_t;
 
+/*
+ * EVTCHNOP_multi: send to, or unmask, each of an array of local ports.
+ * NOTES:
+ *  1. Ports are processed in array order.  Processing stops at the first
+ *     port that fails, and that port's error is returned.
+ *  2. <nr_done> is the number of ports successfully processed.
+ *  3. Each vCPU notified by the call gets at most one upcall.
+ */
+#define EVTCHN_MULTI_send       0
+#define EVTCHN_MULTI_unmask     1
+#define EVTCHN_MULTI_MAX_PORTS 32
+struct evtchn_multi {
+    /* IN parameters. */
+    uint32_t op;              /* EVTCHN_MULTI_* */
+    uint32_t nr_ports;        /* <= EVTCHN_MULTI_MAX_PORTS */
+    evtchn_port_t ports[EVTCHN_MULTI_MAX_PORTS];
+    /* OUT parameters. */
+    uint32_t nr_done;
+};
+typedef struct evtchn_multi evtchn_multi_t;
+
 /*
  * ` enum neg_errnoval
  * ` HYPERVISOR_event_channel_op_compat(struct evtchn_op *op)
@@ -270,6 +270,148 @@ struct xen_hvm_inject_msi {
 typedef struct xen_hvm_inject_msi xen_hvm_inject_msi_t;
 DEFINE_XEN_GUEST_HANDLE(xen_hvm_inject_msi_t);
 
+/*
+ * Fast-path I/O ranges: accesses with trivial semantics that Xen completes
+ * itself instead of forwarding them to the device model. Only single,
+ * non-string accesses that fall entirely within a range are handled; all
+ * others still go to the device model.
+ *
+ * HVMOP_set_fast_io adds or replaces the range [start, start + size) of the
+ * given space, or removes it with HVMOP_FAST_IO_remove. For the notifying
+ * modes, port is set to an event channel of the guest domain which the
+ * caller binds to (as for the ioreq event channels) to be notified.
+ * HVMOP_get_fast_io returns the latched value of a range in value.
+ */
+#define HVMOP_set_fast_io        17
+#define HVMOP_get_fast_io        18
+struct xen_hvm_fast_io {
+    /* Domain to be updated. */
+    domid_t   domid;
+    /* HVMOP_FAST_IO_{PORT,MMIO}. */
+    uint8_t   space;
+    /* HVMOP_FAST_IO_* access semantics (set only). */
+    uint8_t   mode;
+    /* OUT: event channel to bind to for notifications. */
+    uint32_t  port;
+    /* The range, in bytes. */
+    uint64_aligned_t start;
+    uint64_aligned_t size;
+    /* IN: read-as value, data to match or initial latch; OUT: latch. */
+    uint64_aligned_t value;
+};
+typedef struct xen_hvm_fast_io xen_hvm_fast_io_t;
+DEFINE_XEN_GUEST_HANDLE(xen_hvm_fast_io_t);
+
+#define HVMOP_FAST_IO_PORT       0
+#define HVMOP_FAST_IO_MMIO       1
+
+/* Remove the range. */
+#define HVMOP_FAST_IO_remove     0
+/* Reads return value, writes are ignored. */
+#define HVMOP_FAST_IO_const      1
+/* Writes are latched and notify; reads return the latched value. */
+#define HVMOP_FAST_IO_latch      2
+/* Writes notify and are discarded; reads go to the device model. */
+#define HVMOP_FAST_IO_doorbell   3
+/* As doorbell, but only for writes of value; others go to the device model. */
+#define HVMOP_FAST_IO_doorbell_match 4
+
+/*
+ * IOREQ servers: device models besides the default one, each with its own
+ * ioreq page and per-vCPU event channels, that emulate the port, MMIO and
+ * PCI config space ranges mapped to them. Accesses outside all mapped
+ * ranges still go to the default device model (HVM_PARAM_IOREQ_PFN).
+ *
+ * The server's ioreq page is a guest frame provided by the device model,
+ * laid out as the default one; the event channel port of each vCPU is in
+ * its vp_eport field. The calling domain becomes the remote end of these
+ * channels. PCI config space accesses through ports 0xcf8/0xcfc reach
+ * the server as IOREQ_TYPE_PCI_CONFIG requests whose addr is the
+ * HVMOP_PCI_SBDF() of the device in the upper 32 bits over the register.
+ */
+typedef uint16_t ioservid_t;
+
+#define HVMOP_create_ioreq_server 19
+struct xen_hvm_create_ioreq_server {
+    domid_t domid;               /* IN - domain to be serviced */
+    ioservid_t id;               /* OUT - server id */
+    uint64_aligned_t ioreq_pfn;  /* IN - guest frame for the ioreq page */
+};
+typedef struct xen_hvm_create_ioreq_server xen_hvm_create_ioreq_server_t;
+DEFINE_XEN_GUEST_HANDLE(xen_hvm_create_ioreq_server_t);
+
+#define HVMOP_map_io_range_to_ioreq_server     20
+#define HVMOP_unmap_io_range_from_ioreq_server 21
+struct xen_hvm_io_range {
+    domid_t domid;               /* IN - domain to be serviced */
+    ioservid_t id;               /* IN - server id */
+    uint32_t type;               /* IN - type of range */
+# define HVMOP_IO_RANGE_PORT   0 /* I/O port range */
+# define HVMOP_IO_RANGE_MEMORY 1 /* MMIO range */
+# define HVMOP_IO_RANGE_PCI    2 /* PCI segment/bus/dev/func range */
+    uint64_aligned_t start, end; /* IN - inclusive start and end of range */
+};
+typedef struct xen_hvm_io_range xen_hvm_io_range_t;
+DEFINE_XEN_GUEST_HANDLE(xen_hvm_io_range_t);
+
+#define HVMOP_PCI_SBDF(s,b,d,f)                 \
+    ((((s) & 0xffff) << 16) |                   \
+     (((b) & 0xff) << 8) |                      \
+     (((d) & 0x1f) << 3) |                      \
+     ((f) & 0x07))
+
+#define HVMOP_destroy_ioreq_server 22
+struct xen_hvm_destroy_ioreq_server {
+    domid_t domid;               /* IN - domain to be serviced */
+    ioservid_t id;               /* IN - server id */
+};
+typedef struct xen_hvm_destroy_ioreq_server xen_hvm_destroy_ioreq_server_t;
+DEFINE_XEN_GUEST_HANDLE(xen_hvm_destroy_ioreq_server_t);
+
 #endif /* defined(__XEN__) || defined(__XEN_TOOLS__) */
 
+/*
+ * Batched vPMU sampling.
+ *
+ * When a counter with a non-zero reload value in the sample page of a vcpu
+ * overflows, Xen reloads the counter itself, appends a sample to the ring
+ * and hides the overflow from the guest. A PMI is only injected once the
+ * ring holds 'watermark' samples (0 meaning a full ring), or for overflows
+ * of counters without a reload value. The guest zeroes the page before
+ * registering it and consumes samples by advancing 'cons'.
+ *
+ * Reload values are indexed by overflow status bit: on Intel bit N < 32 is
+ * general purpose counter N and bit 32 + N is fixed counter N, on AMD bit N
+ * is counter N.
+ */
+#define HVMOP_vpmu_sampling          23
+struct xen_hvm_vpmu_sampling {
+    domid_t  domid;     /* IN - domain to be serviced */
+    uint16_t vcpu;      /* IN - vcpu to be serviced */
+    uint32_t pad;
+    uint64_t gfn;       /* IN - sample page, or ~0 to stop sampling */
+};
+typedef struct xen_hvm_vpmu_sampling xen_hvm_vpmu_sampling_t;
+DEFINE_XEN_GUEST_HANDLE(xen_hvm_vpmu_sampling_t);
+
+struct xen_vpmu_sample {
+    uint64_t ip;        /* Guest instruction pointer */
+    uint64_t cr3;       /* Guest page table base */
+    uint64_t status;    /* Counters which overflowed, as status bits */
+    uint32_t cpl;       /* Guest privilege level */
+    uint32_t pad;
+};
+
+#define XEN_VPMU_RELOAD_NR  64
+#define XEN_VPMU_SAMPLE_NR  64  /* Power of two */
+
+struct xen_vpmu_sample_page {
+    uint32_t prod;      /* Written by Xen */
+    uint32_t cons;      /* Written by the guest */
+    uint32_t watermark; /* Written by the guest */
+    uint32_t lost;      /* Samples dropped because the ring was full */
+    uint64_t reload[XEN_VPMU_RELOAD_NR];
+    struct xen_vpmu_sample ring[XEN_VPMU_SAMPLE_NR];
+};
+
 #endif /* __XEN_PUBLIC_HVM_HVM_OP_H__ */
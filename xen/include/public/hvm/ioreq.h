@@ -34,6 +34,7 @@
 
 #define IOREQ_TYPE_PIO          0 /* pio */
 #define IOREQ_TYPE_COPY         1 /* mmio ops */
+#define IOREQ_TYPE_PCI_CONFIG   2 /* pci config space ops, to ioreq servers */
 #define IOREQ_TYPE_TIMEOFFSET   7
 #define IOREQ_TYPE_INVALIDATE   8 /* mapcache */
 
@@ -82,6 +83,19 @@ struct buffered_iopage {
 }; /* NB. Size of this structure must be no greater than one page. */
 typedef struct buffered_iopage buffered_iopage_t;
 
+/*
+ * A ring of several pages (HVM_PARAM_BUFIOREQ_NR_PAGES) keeps the layout
+ * above, with buf_ioreq[] running on into the following pages.
+ *
+ * With HVM_PARAM_BUFIOREQ_LAZY_KICK set, Xen only signals
+ * HVM_PARAM_BUFIOREQ_EVTCHN when read_pointer has caught up with the
+ * write_pointer of its previous notification. The consumer must then
+ * re-read write_pointer after publishing read_pointer, with a full barrier
+ * between the two, before waiting for the next event.
+ */
+#define IOREQ_BUFFER_MAX_PAGES    8
+#define IOREQ_BUFFER_SLOTS(nr_pages) ((nr_pages) * 512 - 1)
+
 /*
  * ACPI Control/Event register locations. Location is controlled by a 
  * version number in HVM_PARAM_ACPI_IOPORTS_LOCATION.
@@ -145,6 +145,21 @@
 /* SHUTDOWN_* action in case of a triple fault */
 #define HVM_PARAM_TRIPLE_FAULT_REASON 31
 
-#define HVM_NR_PARAMS          32
+/*
+ * Number of consecutive guest frames, starting at HVM_PARAM_BUFIOREQ_PFN,
+ * that hold the buffered ioreq ring (default 1, at most
+ * IOREQ_BUFFER_MAX_PAGES). Must be set before HVM_PARAM_BUFIOREQ_PFN.
+ */
+#define HVM_PARAM_BUFIOREQ_NR_PAGES 32
+
+/*
+ * If 1, the device model follows the protocol in ioreq.h that lets Xen
+ * skip signalling HVM_PARAM_BUFIOREQ_EVTCHN while it is still draining
+ * the buffered ioreq ring.  By default (0) every buffered ioreq is
+ * signalled.
+ */
+#define HVM_PARAM_BUFIOREQ_LAZY_KICK 33
+
+#define HVM_NR_PARAMS          34
 
 #endif /* __XEN_PUBLIC_HVM_PARAMS_H__ */
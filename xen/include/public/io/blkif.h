@@ -173,6 +173,15 @@
  *      The maximum supported size of the request ring buffer in units of
  *      machine pages.  The value must be a power of 2.
  *
+ * multi-queue-max-queues
+ *      Values:         <uint32_t>
+ *      Default Value:  1
+ *
+ *      The maximum number of request rings ("queues") the backend will
+ *      service for this device.  Each queue is serviced independently,
+ *      so a frontend may use one per vCPU to avoid sharing a ring
+ *      between them.
+ *
  *------------------------- Backend Device Properties -------------------------
  *
  * discard-aligment
@@ -240,6 +249,19 @@
  *      The Xen grant reference granting permission for the backend to map
  *      the sole page in a single page sized ring buffer.
  *
+ * multi-queue-num-queues
+ *      Values:         <uint32_t>
+ *      Default Value:  1
+ *      Maximum Value:  multi-queue-max-queues
+ *
+ *      The number of request rings the frontend has set up.  If greater
+ *      than 1, "event-channel" and "ring-ref" (or "ring-ref%u") are not
+ *      written at this level.  Instead each queue %u, zero based, has its
+ *      own "queue-%u/event-channel" and "queue-%u/ring-ref" (or
+ *      "queue-%u/ring-ref%u") nodes, all of the size given by
+ *      "ring-page-order".  Responses are always written to the ring, and
+ *      signalled on the event channel, of the queue the request arrived on.
+ *
  * ring-ref%u
  *      Values:         <uint32_t>
  *      Notes:          6
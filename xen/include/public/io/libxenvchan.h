@@ -67,7 +67,9 @@ struct vchan_interface {
 	 * size of the rings, which determines their location
 	 * 10   - at offset 1024 in ring's page
 	 * 11   - at offset 2048 in ring's page
-	 * 12+  - uses 2^(N-12) grants to describe the multi-page ring
+	 * 12-20 - uses 2^(N-12) grants to describe the multi-page ring
+	 * 21+  - uses 2^(N-22), rounded up, grants of read-only pages that
+	 *        hold the 2^(N-12) grants of the multi-page ring
 	 * These should remain constant once the page is shared.
 	 * Only one of the two orders can be 10 (or 11).
 	 */
@@ -49,7 +49,9 @@ enum xsd_sockmsg_type
     XS_RESUME,
     XS_SET_TARGET,
     XS_RESTRICT,
-    XS_RESET_WATCHES
+    XS_RESET_WATCHES,
+    XS_MULTI,
+    XS_READ_SUBTREE
 };
 
 #define XS_WRITE_NONE "NONE"
@@ -98,6 +100,43 @@ struct xsd_sockmsg
     /* Generally followed by nul-terminated string(s). */
 };
 
+/*
+ * The payload of an XS_MULTI request is a sequence of operations, each a
+ * struct xsd_multi_op followed by len bytes of the payload that operation
+ * would carry as a message of its own.  Only XS_READ, XS_DIRECTORY,
+ * XS_GET_PERMS, XS_WRITE, XS_MKDIR, XS_RM and XS_SET_PERMS may be given.
+ *
+ * The operations are carried out in order and atomically: the daemon
+ * stops at the first to fail and, outside a transaction, undoes those
+ * before it.  The reply is laid out the same way, with one entry per
+ * operation carried out, the last of them an XS_ERROR if one failed.
+ */
+struct xsd_multi_op
+{
+    uint32_t type;  /* XS_??? */
+    uint32_t len;   /* Length of data following this. */
+};
+
+/*
+ * The reply to an XS_READ_SUBTREE is a sequence of nodes, depth first,
+ * each a struct xsd_subtree_node followed by pathlen bytes of its path
+ * relative to the node asked for (empty for that node itself, with no
+ * leading '/') and datalen bytes of its value.  A value too long to fit
+ * in a reply has datalen XS_SUBTREE_TOOBIG and is left out.
+ *
+ * If all of the subtree fit, the last entry has pathlen XS_SUBTREE_END
+ * and nothing following.  If not, the request should be repeated with
+ * the relative path of the last node given, to carry on after it.
+ */
+struct xsd_subtree_node
+{
+    uint32_t pathlen;
+    uint32_t datalen;
+};
+
+#define XS_SUBTREE_END    0xffffffffU
+#define XS_SUBTREE_TOOBIG 0xffffffffU
+
 enum xs_watch_type
 {
     XS_WATCH_PATH = 0,
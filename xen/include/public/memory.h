@@ -55,6 +55,13 @@
 /* Flag to request allocation only from the node specified */
 #define XENMEMF_exact_node_request  (1<<17)
 #define XENMEMF_exact_node(n) (XENMEMF_node(n) | XENMEMF_exact_node_request)
+/*
+ * Flag for XENMEM_populate_physmap on translated guests: back runs of
+ * contiguous, suitably aligned extents with 1GB or 2MB allocations where
+ * possible (falling back to smaller orders, then to extent_order), and
+ * insert each such run into the physmap as a single entry.
+ */
+#define XENMEMF_populate_bulk (1<<18)
 #endif
 
 struct xen_memory_reservation {
@@ -356,6 +363,8 @@ typedef struct xen_pod_target xen_pod_target_t;
 #define XENMEM_paging_op_nominate           0
 #define XENMEM_paging_op_evict              1
 #define XENMEM_paging_op_prep               2
+#define XENMEM_paging_op_nominate_batch     3
+#define XENMEM_paging_op_evict_batch        4
 
 #define XENMEM_access_op                    21
 #define XENMEM_access_op_resume             0
@@ -373,6 +382,20 @@ struct xen_mem_event_op {
 typedef struct xen_mem_event_op xen_mem_event_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_mem_event_op_t);
 
+/*
+ * XENMEM_paging_op_{nominate,evict}_batch: the nominate or evict operation
+ * for each of the 'gfn' (at most XENMEM_PAGING_BATCH_MAX) entries of the
+ * array at 'buffer'.  Each entry's status is set to the result for its
+ * gfn; the operation as a whole only fails if the array can't be accessed.
+ */
+#define XENMEM_PAGING_BATCH_MAX             512
+struct xen_mem_paging_batch {
+    uint64_aligned_t    gfn;        /* IN */
+    int32_t             status;     /* OUT: 0 or -errno */
+    uint32_t            pad;
+};
+typedef struct xen_mem_paging_batch xen_mem_paging_batch_t;
+
 #define XENMEM_sharing_op                   22
 #define XENMEM_sharing_op_nominate_gfn      0
 #define XENMEM_sharing_op_nominate_gref     1
@@ -383,6 +406,8 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_event_op_t);
 #define XENMEM_sharing_op_debug_gref        6
 #define XENMEM_sharing_op_add_physmap       7
 #define XENMEM_sharing_op_audit             8
+#define XENMEM_sharing_op_hash_range        9
+#define XENMEM_sharing_op_fork_range        10
 
 #define XENMEM_SHARING_OP_S_HANDLE_INVALID  (-10)
 #define XENMEM_SHARING_OP_C_HANDLE_INVALID  (-9)
@@ -400,6 +425,21 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_event_op_t);
 #define XENMEM_SHARING_OP_FIELD_GET_GREF(field)        \
     ((field) & (~XENMEM_SHARING_OP_FIELD_IS_GREF_FLAG))
 
+/*
+ * Record returned by XENMEM_sharing_op_hash_range for each RAM page that
+ * could take part in sharing. The hash is a fast non-cryptographic digest
+ * of the page contents: equal hashes only make pages candidates, so the
+ * tool must compare the contents before sharing them.
+ */
+struct xen_mem_sharing_hash {
+    uint64_aligned_t gfn;     /* gfn of the page                        */
+    uint64_aligned_t hash;    /* hash of the page contents               */
+    uint64_aligned_t handle;  /* handle if the page is already shared,
+                                 otherwise 0                             */
+};
+typedef struct xen_mem_sharing_hash xen_mem_sharing_hash_t;
+DEFINE_XEN_GUEST_HANDLE(xen_mem_sharing_hash_t);
+
 struct xen_mem_sharing_op {
     uint8_t     op;     /* XENMEM_sharing_op_* */
     domid_t     domain;
@@ -426,6 +466,39 @@ struct xen_mem_sharing_op {
                 uint32_t gref;     /* IN: gref to debug         */
             } u;
         } debug;
+        /*
+         * OP_HASH_RANGE: hash the pages in [first_gfn, last_gfn]. Records
+         * are returned sorted by hash, so candidates for sharing within a
+         * batch are adjacent. The scan stops early when the buffer is full
+         * or the hypercall needs to be preempted; first_gfn is then the
+         * next gfn to scan and the call should be repeated until it
+         * exceeds last_gfn.
+         */
+        struct mem_sharing_op_hash_range {
+            uint64_aligned_t first_gfn; /* IN/OUT: next gfn to scan     */
+            uint64_aligned_t last_gfn;  /* IN: last gfn to scan;
+                                           OUT: clipped to the domain's
+                                           maximum gfn                  */
+            XEN_GUEST_HANDLE_64(xen_mem_sharing_hash_t) hashes; /* OUT  */
+            uint32_t nr_hashes;         /* IN: size of hashes[];
+                                           OUT: records written         */
+        } hash_range;
+        /*
+         * OP_FORK_RANGE: share each RAM page in [first_gfn, last_gfn] with
+         * client_domain at the same gfn, nominating pages as needed. Gfns
+         * which are not sharable in the source, or not a hole in the
+         * client, are skipped. The call stops early when it needs to be
+         * preempted; first_gfn is then the next gfn to fork and the call
+         * should be repeated until it exceeds last_gfn.
+         */
+        struct mem_sharing_op_fork_range {
+            uint64_aligned_t first_gfn; /* IN/OUT: next gfn to fork     */
+            uint64_aligned_t last_gfn;  /* IN: last gfn to fork;
+                                           OUT: clipped to the domain's
+                                           maximum gfn                  */
+            uint64_aligned_t nr_shared; /* OUT: pages added to client   */
+            domid_t client_domain;      /* IN: the client domain id     */
+        } fork_range;
     } u;
 };
 typedef struct xen_mem_sharing_op xen_mem_sharing_op_t;
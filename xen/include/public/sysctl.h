@@ -34,7 +34,7 @@
 #include "xen.h"
 #include "domctl.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000A
+#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000B
 
 /*
  * Read console content from Xen buffer ring.
@@ -430,10 +430,18 @@ struct xen_sysctl_page_offline_op {
 /* Sub-operations: */
 #define XEN_SYSCTL_LOCKPROF_reset 1   /* Reset all profile data to zero. */
 #define XEN_SYSCTL_LOCKPROF_query 2   /* Get lock profile information. */
+#define XEN_SYSCTL_LOCKPROF_sample 3  /* Set the sampling rate. */
 /* Record-type: */
 #define LOCKPROF_TYPE_GLOBAL      0   /* global lock, idx meaningless */
 #define LOCKPROF_TYPE_PERDOM      1   /* per-domain lock, idx is domid */
 #define LOCKPROF_TYPE_N           2   /* number of types */
+/*
+ * Latency histograms: bucket 0 counts times below 256ns, bucket i (i > 0)
+ * times in [256ns << (i - 1), 256ns << i), the last bucket everything
+ * above.
+ */
+#define LOCKPROF_HIST_BUCKETS     16
+#define LOCKPROF_HIST_SHIFT       8
 struct xen_sysctl_lockprof_data {
     char     name[40];     /* lock name (may include up to 2 %d specifiers) */
     int32_t  type;         /* LOCKPROF_TYPE_??? */
@@ -442,9 +450,22 @@ struct xen_sysctl_lockprof_data {
     uint64_aligned_t block_cnt;    /* # of wait for lock */
     uint64_aligned_t lock_time;    /* nsecs lock held */
     uint64_aligned_t block_time;   /* nsecs waited for lock */
+    uint64_aligned_t max_hold;     /* nsecs of the longest hold */
+    uint64_aligned_t max_holder;   /* address the longest hold began from */
+    uint32_t hold_hist[LOCKPROF_HIST_BUCKETS];  /* hold times */
+    uint32_t block_hist[LOCKPROF_HIST_BUCKETS]; /* wait times */
 };
 typedef struct xen_sysctl_lockprof_data xen_sysctl_lockprof_data_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_data_t);
+/* Per-cpu totals, over all the profiled locks. */
+struct xen_sysctl_lockprof_cpu {
+    uint64_aligned_t lock_cnt;     /* # of locking succeeded */
+    uint64_aligned_t block_cnt;    /* # of wait for lock */
+    uint64_aligned_t lock_time;    /* nsecs locks held */
+    uint64_aligned_t block_time;   /* nsecs waited for locks */
+};
+typedef struct xen_sysctl_lockprof_cpu xen_sysctl_lockprof_cpu_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_cpu_t);
 struct xen_sysctl_lockprof_op {
     /* IN variables. */
     uint32_t       cmd;               /* XEN_SYSCTL_LOCKPROF_??? */
@@ -454,6 +475,16 @@ struct xen_sysctl_lockprof_op {
     uint64_aligned_t time;            /* nsecs of profile measurement */
     /* profile information (or NULL) */
     XEN_GUEST_HANDLE_64(xen_sysctl_lockprof_data_t) data;
+    /*
+     * IN (sample): profile one in @sample lock acquisitions (1: all).
+     * OUT (query): the current sampling rate; counts and times only
+     * cover the sampled acquisitions.
+     */
+    uint32_t       sample;
+    /* IN: size of @cpu_data.  OUT (query): number of cpus available. */
+    uint32_t       max_cpu;
+    /* per-cpu information (or NULL) */
+    XEN_GUEST_HANDLE_64(xen_sysctl_lockprof_cpu_t) cpu_data;
 };
 typedef struct xen_sysctl_lockprof_op xen_sysctl_lockprof_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_op_t);
@@ -525,15 +556,22 @@ DEFINE_XEN_GUEST_HANDLE(xen_sysctl_numainfo_t);
 #define XEN_SYSCTL_CPUPOOL_OP_RMCPU                 5  /* R */
 #define XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAIN            6  /* M */
 #define XEN_SYSCTL_CPUPOOL_OP_FREEINFO              7  /* F */
+#define XEN_SYSCTL_CPUPOOL_OP_SETEPP                8  /* E */
 #define XEN_SYSCTL_CPUPOOL_PAR_ANY     0xFFFFFFFF
 struct xen_sysctl_cpupool_op {
     uint32_t op;          /* IN */
-    uint32_t cpupool_id;  /* IN: CDIARM OUT: CI */
-    uint32_t sched_id;    /* IN: C      OUT: I  */
-    uint32_t domid;       /* IN: M              */
-    uint32_t cpu;         /* IN: AR             */
-    uint32_t n_dom;       /*            OUT: I  */
-    struct xenctl_bitmap cpumap; /*     OUT: IF */
+    uint32_t cpupool_id;  /* IN: CDIARME OUT: CI */
+    uint32_t sched_id;    /* IN: C       OUT: I  */
+    uint32_t domid;       /* IN: M               */
+    uint32_t cpu;         /* IN: AR              */
+    uint32_t n_dom;       /*             OUT: I  */
+    struct xenctl_bitmap cpumap; /*      OUT: IF */
+    /*
+     * Energy/performance preference of the pool's cpus, from 0 (maximum
+     * performance) to 255 (maximum power saving).  Only effective with
+     * hardware managed P-states (cpufreq=hwp).
+     */
+    uint32_t epp;         /* IN: E       OUT: I  */
 };
 typedef struct xen_sysctl_cpupool_op xen_sysctl_cpupool_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_cpupool_op_t);
@@ -579,6 +617,20 @@ struct xen_sysctl_credit_schedule {
 typedef struct xen_sysctl_credit_schedule xen_sysctl_credit_schedule_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_credit_schedule_t);
 
+struct xen_sysctl_credit2_schedule {
+    /*
+     * Which CPUs share a runqueue.  Can only be changed while no CPUs are
+     * assigned to the cpupool.
+     */
+#define XEN_SYSCTL_CSCHED2_RUNQ_CORE   0
+#define XEN_SYSCTL_CSCHED2_RUNQ_LLC    1
+#define XEN_SYSCTL_CSCHED2_RUNQ_SOCKET 2
+#define XEN_SYSCTL_CSCHED2_RUNQ_NODE   3
+    uint32_t runqueue;
+};
+typedef struct xen_sysctl_credit2_schedule xen_sysctl_credit2_schedule_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_credit2_schedule_t);
+
 /* XEN_SYSCTL_scheduler_op */
 /* Set or get info? */
 #define XEN_SYSCTL_SCHEDOP_putinfo 0
@@ -592,6 +644,7 @@ struct xen_sysctl_scheduler_op {
             XEN_GUEST_HANDLE_64(xen_sysctl_arinc653_schedule_t) schedule;
         } sched_arinc653;
         struct xen_sysctl_credit_schedule sched_credit;
+        struct xen_sysctl_credit2_schedule sched_credit2;
     } u;
 };
 typedef struct xen_sysctl_scheduler_op xen_sysctl_scheduler_op_t;
@@ -632,6 +685,254 @@ struct xen_sysctl_coverage_op {
 typedef struct xen_sysctl_coverage_op xen_sysctl_coverage_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_coverage_op_t);
 
+/* XEN_SYSCTL_sched_hist */
+/*
+ * Always-on scheduling latency histograms, per pCPU or per vCPU.
+ *
+ * Time buckets are log2 in microseconds: bucket 0 counts samples under
+ * 1us, bucket i counts [2^(i-1), 2^i) us, and the last bucket is open
+ * ended.  runq_depth (pCPU only) is linear: bucket i counts schedule()
+ * calls that found i vCPUs runnable on the pCPU, the last one open ended.
+ */
+#define XEN_SYSCTL_SCHED_HIST_BUCKETS 16
+struct xen_sysctl_sched_hist_data {
+    /* Blocked/offline to running. */
+    uint64_aligned_t wake_latency[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+    /* Any runnable to running, including after preemption. */
+    uint64_aligned_t runnable_wait[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+    /* Length of each stint on a pCPU. */
+    uint64_aligned_t timeslice[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+    uint64_aligned_t runq_depth[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+};
+typedef struct xen_sysctl_sched_hist_data xen_sysctl_sched_hist_data_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_sched_hist_data_t);
+
+#define XEN_SYSCTL_SCHED_HIST_pcpu 0
+#define XEN_SYSCTL_SCHED_HIST_vcpu 1
+struct xen_sysctl_sched_hist {
+    uint32_t type;       /* IN: XEN_SYSCTL_SCHED_HIST_* */
+    uint32_t id;         /* IN: pCPU, or vCPU of <domid> */
+    domid_t  domid;      /* IN: XEN_SYSCTL_SCHED_HIST_vcpu only */
+    uint8_t  reset;      /* IN: clear the histograms once read */
+    uint8_t  pad;
+    XEN_GUEST_HANDLE_64(xen_sysctl_sched_hist_data_t) data; /* OUT */
+};
+typedef struct xen_sysctl_sched_hist xen_sysctl_sched_hist_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_sched_hist_t);
+
+/* XEN_SYSCTL_domain_perf */
+/*
+ * Always-on activity counters of a domain's vCPUs, cumulative since the
+ * vCPU was created or the counters were last reset.  The last bucket of
+ * each array also counts any index beyond it.
+ */
+#define XEN_SYSCTL_DOMAIN_PERF_HYPERCALLS 64
+#define XEN_SYSCTL_DOMAIN_PERF_VMEXITS    160
+#define XEN_SYSCTL_DOMAIN_PERF_GRANT_OPS  16
+struct xen_sysctl_domain_perf_data {
+    /* Hypercalls by number, including each entry of a multicall. */
+    uint64_aligned_t hypercalls[XEN_SYSCTL_DOMAIN_PERF_HYPERCALLS];
+    /* HVM VM exits, by VMX basic exit reason or SVM exit code. */
+    uint64_aligned_t vmexits[XEN_SYSCTL_DOMAIN_PERF_VMEXITS];
+    /* Grant table operations by GNTTABOP_* command, per batch element. */
+    uint64_aligned_t grant_ops[XEN_SYSCTL_DOMAIN_PERF_GRANT_OPS];
+    /* Event channel notifications sent (EVTCHNOP_send). */
+    uint64_aligned_t evtchn_sends;
+    /* Instructions emulated on the vCPU's behalf. */
+    uint64_aligned_t emulations;
+};
+typedef struct xen_sysctl_domain_perf_data xen_sysctl_domain_perf_data_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_domain_perf_data_t);
+
+#define XEN_SYSCTL_DOMAIN_PERF_ALL_VCPUS (~0U)
+struct xen_sysctl_domain_perf {
+    domid_t  domid;      /* IN */
+    uint8_t  reset;      /* IN: clear the counters once read */
+    uint8_t  pad;
+    uint32_t vcpu;       /* IN: vCPU, or XEN_SYSCTL_DOMAIN_PERF_ALL_VCPUS */
+    XEN_GUEST_HANDLE_64(xen_sysctl_domain_perf_data_t) data; /* OUT */
+};
+typedef struct xen_sysctl_domain_perf xen_sysctl_domain_perf_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_domain_perf_t);
+
+/* XEN_SYSCTL_domain_changes */
+/*
+ * The domain list has a generation count, bumped whenever a domain is
+ * created or destroyed, or is paused or unpaused by its controller, shut
+ * down, resumed or killed.  This returns the domains which changed after
+ * generation <since>, as XEN_SYSCTL_getdomaininfolist would, and the
+ * domains destroyed since then.  Pass the <generation> returned as
+ * <since> next time; a domain may be reported again.
+ *
+ * If <since> is 0, or so old that Xen no longer knows what was destroyed
+ * since, all domains are returned and XEN_SYSCTL_DOMAIN_CHANGES_all is
+ * set: the caller should replace its list with them.
+ *
+ * num_domains and num_gone may exceed max_domains and max_gone, in which
+ * case only that many were copied: try again with larger buffers.
+ */
+#define XEN_SYSCTL_DOMAIN_CHANGES_all (1U << 0)
+struct xen_sysctl_domain_changes {
+    /* IN variables. */
+    uint64_aligned_t      since;
+    uint32_t              max_domains;
+    uint32_t              max_gone;
+    XEN_GUEST_HANDLE_64(xen_domctl_getdomaininfo_t) buffer;
+    XEN_GUEST_HANDLE_64(uint16) gone;    /* domid_t */
+    /* OUT variables. */
+    uint64_aligned_t      generation;
+    uint32_t              num_domains;
+    uint32_t              num_gone;
+    uint32_t              flags;   /* XEN_SYSCTL_DOMAIN_CHANGES_* */
+    uint32_t              pad;
+};
+typedef struct xen_sysctl_domain_changes xen_sysctl_domain_changes_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_domain_changes_t);
+
+
+/* XEN_SYSCTL_vcpu_sched_stats */
+/*
+ * Runstate times and scheduling latency histograms (as returned by
+ * XEN_SYSCTL_sched_hist) of every vCPU of the domains from <first_domain>
+ * on, in domain then vCPU order, so a monitor needs a single call to
+ * sample the whole host.  Only whole domains are returned: <next_domain>
+ * is where to carry on from, or DOMID_INVALID once all were.  A domain
+ * with more vCPUs than fit in an empty buffer fails with -ENOBUFS.
+ */
+#define XEN_SYSCTL_VCPU_SCHED_online (1U << 0)  /* not _VPF_down */
+struct xen_sysctl_vcpu_sched_stats_data {
+    domid_t  domid;
+    uint16_t flags;      /* XEN_SYSCTL_VCPU_SCHED_* */
+    uint32_t vcpu;
+    uint32_t state;      /* RUNSTATE_* */
+    uint32_t pad;
+    uint64_aligned_t time[4]; /* ns in each RUNSTATE_*, up to now */
+    uint64_aligned_t wake_latency[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+    uint64_aligned_t runnable_wait[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+};
+typedef struct xen_sysctl_vcpu_sched_stats_data xen_sysctl_vcpu_sched_stats_data_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_vcpu_sched_stats_data_t);
+
+struct xen_sysctl_vcpu_sched_stats {
+    /* IN variables. */
+    domid_t               first_domain;
+    uint16_t              pad;
+    uint32_t              max_vcpus;    /* entries in buffer */
+    XEN_GUEST_HANDLE_64(xen_sysctl_vcpu_sched_stats_data_t) buffer;
+    /* OUT variables. */
+    uint32_t              num_vcpus;
+    domid_t               next_domain;
+    uint16_t              pad2;
+};
+typedef struct xen_sysctl_vcpu_sched_stats xen_sysctl_vcpu_sched_stats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_vcpu_sched_stats_t);
+
+/* XEN_SYSCTL_hypercall_stats */
+/*
+ * Latency histograms per hypercall number (x86 only), summed over all
+ * pCPUs.  Collection costs two reads of system time per hypercall, so is
+ * off unless enabled here or with the "hypercall_stats" boot option.
+ *
+ * Every invocation counts separately: one which is preempted, to be
+ * continued when the guest re-executes it, counts in <continued> as well as
+ * in <count>.  The calls a multicall makes count only as the multicall.
+ *
+ * Buckets are log2 in nanoseconds: bucket 0 counts invocations under
+ * 256ns, bucket i counts [2^(i+7), 2^(i+8)) ns, and the last bucket is
+ * open ended.
+ */
+#define XEN_SYSCTL_HYPERCALL_STATS_get     0
+#define XEN_SYSCTL_HYPERCALL_STATS_enable  1
+#define XEN_SYSCTL_HYPERCALL_STATS_disable 2
+#define XEN_SYSCTL_HYPERCALL_STATS_reset   3
+#define XEN_SYSCTL_HYPERCALL_HIST_BUCKETS 16
+struct xen_sysctl_hypercall_stats_data {
+    uint64_aligned_t count;
+    uint64_aligned_t continued;
+    uint64_aligned_t total_ns;
+    uint64_aligned_t max_ns;
+    uint64_aligned_t latency[XEN_SYSCTL_HYPERCALL_HIST_BUCKETS];
+};
+typedef struct xen_sysctl_hypercall_stats_data xen_sysctl_hypercall_stats_data_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_hypercall_stats_data_t);
+
+struct xen_sysctl_hypercall_stats {
+    uint32_t cmd;           /* IN: XEN_SYSCTL_HYPERCALL_STATS_* */
+    /*
+     * IN: entries in buffer (get only), indexed by hypercall number.
+     * OUT: number of hypercalls.
+     */
+    uint32_t nr_hypercalls;
+    uint8_t  enabled;       /* OUT: whether collection is on */
+    uint8_t  pad[7];
+    XEN_GUEST_HANDLE_64(xen_sysctl_hypercall_stats_data_t) buffer; /* OUT */
+};
+typedef struct xen_sysctl_hypercall_stats xen_sysctl_hypercall_stats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_hypercall_stats_t);
+
+/* XEN_SYSCTL_livepatch_op */
+/*
+ * Replace functions of the running hypervisor (x86 only).  A payload is an
+ * x86-64 ELF relocatable object built against this very hypervisor build;
+ * see docs/misc/livepatch.markdown for its format.  Payloads are named by
+ * the toolstack when uploaded, and go through these states:
+ *
+ *  UPLOAD -> CHECKED <-> APPLIED (actions APPLY and REVERT)
+ *            CHECKED -> gone     (action UNLOAD)
+ *
+ * Upload loads, links and checks the payload, and only APPLY changes the
+ * running code.  Only one payload may replace a given function at once.
+ */
+#define XEN_SYSCTL_LIVEPATCH_upload  0
+#define XEN_SYSCTL_LIVEPATCH_get     1
+#define XEN_SYSCTL_LIVEPATCH_list    2
+#define XEN_SYSCTL_LIVEPATCH_action  3
+
+#define XEN_LIVEPATCH_NAME_SIZE      64  /* Including the terminating NUL. */
+
+#define XEN_LIVEPATCH_STATE_CHECKED  1
+#define XEN_LIVEPATCH_STATE_APPLIED  2
+
+#define XEN_LIVEPATCH_ACTION_apply   1
+#define XEN_LIVEPATCH_ACTION_revert  2
+#define XEN_LIVEPATCH_ACTION_unload  3
+
+struct xen_livepatch_status {
+    char name[XEN_LIVEPATCH_NAME_SIZE];
+    uint32_t state;         /* XEN_LIVEPATCH_STATE_* */
+    int32_t rc;             /* Result of the last action, 0 or -errno. */
+};
+typedef struct xen_livepatch_status xen_livepatch_status_t;
+DEFINE_XEN_GUEST_HANDLE(xen_livepatch_status_t);
+
+struct xen_sysctl_livepatch_op {
+    uint32_t cmd;           /* IN: XEN_SYSCTL_LIVEPATCH_* */
+    uint32_t pad;
+    char name[XEN_LIVEPATCH_NAME_SIZE]; /* IN: all but list */
+    union {
+        struct {
+            uint64_aligned_t size;              /* IN */
+            XEN_GUEST_HANDLE_64(uint8) payload; /* IN: the ELF object */
+        } upload;
+        struct {
+            uint32_t state;                     /* OUT */
+            int32_t rc;                         /* OUT */
+        } get;
+        struct {
+            uint32_t idx;     /* IN: first payload to return */
+            uint32_t nr;      /* IN: entries in buffer; OUT: entries used */
+            uint32_t total;   /* OUT: number of payloads */
+            uint32_t pad;
+            XEN_GUEST_HANDLE_64(xen_livepatch_status_t) status; /* OUT */
+        } list;
+        struct {
+            uint32_t action;                    /* IN: XEN_LIVEPATCH_ACTION_* */
+        } action;
+    } u;
+};
+typedef struct xen_sysctl_livepatch_op xen_sysctl_livepatch_op_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_livepatch_op_t);
+
 
 struct xen_sysctl {
     uint32_t cmd;
@@ -654,6 +955,12 @@ struct xen_sysctl {
 #define XEN_SYSCTL_cpupool_op                    18
 #define XEN_SYSCTL_scheduler_op                  19
 #define XEN_SYSCTL_coverage_op                   20
+#define XEN_SYSCTL_sched_hist                    21
+#define XEN_SYSCTL_domain_perf                   22
+#define XEN_SYSCTL_domain_changes                23
+#define XEN_SYSCTL_vcpu_sched_stats              24
+#define XEN_SYSCTL_hypercall_stats               25
+#define XEN_SYSCTL_livepatch_op                  26
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -675,6 +982,12 @@ struct xen_sysctl {
         struct xen_sysctl_cpupool_op        cpupool_op;
         struct xen_sysctl_scheduler_op      scheduler_op;
         struct xen_sysctl_coverage_op       coverage_op;
+        struct xen_sysctl_sched_hist        sched_hist;
+        struct xen_sysctl_domain_perf       domain_perf;
+        struct xen_sysctl_domain_changes    domain_changes;
+        struct xen_sysctl_vcpu_sched_stats  vcpu_sched_stats;
+        struct xen_sysctl_hypercall_stats   hypercall_stats;
+        struct xen_sysctl_livepatch_op      livepatch_op;
         uint8_t                             pad[128];
     } u;
 };
@@ -109,6 +109,10 @@ struct dt_device_node {
     struct dt_device_node *next; /* TODO: Remove it. Only use to know the last children */
     struct dt_device_node *allnext;
 
+    /* Host device tree index, built once unflattened */
+    unsigned int index; /* Position in the allnext list */
+    struct dt_device_node *path_next;
+    struct dt_device_node *phandle_next;
 };
 
 /**
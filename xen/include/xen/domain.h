@@ -72,6 +72,9 @@ void arch_dump_domain_info(struct domain *d);
 
 int arch_vcpu_reset(struct vcpu *);
 
+/* Called on the current vCPU once it is marked blocked. */
+void arch_vcpu_block(struct vcpu *v);
+
 extern spinlock_t vcpu_alloc_lock;
 bool_t domctl_lock_acquire(void);
 void domctl_lock_release(void);
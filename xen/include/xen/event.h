@@ -51,6 +51,12 @@ long evtchn_bind_vcpu(unsigned int port, unsigned int vcpu_id);
 /* Unmask a local event-channel port. */
 int evtchn_unmask(unsigned int port);
 
+/*
+ * Mark events pending for a vCPU, deferring the upcall to the end of an
+ * EVTCHNOP_multi if one is in progress on this CPU.
+ */
+void evtchn_kick_vcpu(struct vcpu *v);
+
 /* Move all PIRQs after a vCPU was moved to another pCPU. */
 void evtchn_move_pirqs(struct vcpu *v);
 
@@ -24,6 +24,7 @@
 #ifndef __XEN_GRANT_TABLE_H__
 #define __XEN_GRANT_TABLE_H__
 
+#include <xen/spinlock.h>
 #include <public/grant_table.h>
 #include <asm/page.h>
 #include <asm/grant_table.h>
@@ -84,18 +85,57 @@ struct grant_table {
     struct grant_mapping **maptrack;
     unsigned int          maptrack_head;
     unsigned int          maptrack_limit;
-    /* Lock protecting updates to active and shared grant tables. */
-    spinlock_t            lock;
+    /* Handles taken from other vcpus' free lists (see gnttab_usage_print). */
+    unsigned int          maptrack_steals;
+    /*
+     * Lock protecting the shared maptrack free list (maptrack_head above)
+     * and maptrack growth.  Only taken when the current vcpu's own free
+     * list is empty.
+     */
+    spinlock_t            maptrack_lock;
+    /*
+     * Lock protecting the grant table state (version, size, frame lists).
+     * Taken for reading by map/unmap/copy, which then serialise on the
+     * per-entry lock of each active grant entry they touch.  Taken for
+     * writing to grow the table, change its version, or to exclude all
+     * active entry updates at once.  Use the grant_*_lock() helpers below:
+     * read locking only touches per-cpu state.
+     */
+    percpu_rwlock_t       lock;
     /* The defined versions are 1 and 2.  Set to 0 if we don't know
        what version to use yet. */
     unsigned              gt_version;
 };
 
+DECLARE_PERCPU_RWLOCK_GLOBAL(grant_rwlock);
+
+/* A cpu may only hold one grant table lock for reading at a time. */
+static inline void grant_read_lock(struct grant_table *gt)
+{
+    percpu_read_lock(grant_rwlock, &gt->lock);
+}
+
+static inline void grant_read_unlock(struct grant_table *gt)
+{
+    percpu_read_unlock(grant_rwlock, &gt->lock);
+}
+
+static inline void grant_write_lock(struct grant_table *gt)
+{
+    percpu_write_lock(grant_rwlock, &gt->lock);
+}
+
+static inline void grant_write_unlock(struct grant_table *gt)
+{
+    percpu_write_unlock(grant_rwlock, &gt->lock);
+}
+
 /* Create/destroy per-domain grant table context. */
 int grant_table_create(
     struct domain *d);
 void grant_table_destroy(
     struct domain *d);
+void grant_table_init_vcpu(struct vcpu *v);
 
 /* Domain death release of granted mappings of other domains' memory. */
 void
@@ -103,7 +143,7 @@ gnttab_release_mappings(
     struct domain *d);
 
 /* Increase the size of a domain's grant table.
- * Caller must hold d's grant table lock.
+ * Caller must hold d's grant table lock for writing.
  */
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames);
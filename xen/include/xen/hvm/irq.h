@@ -79,11 +79,21 @@ struct hvm_girq_dpci_mapping {
 #if defined(CONFIG_X86)
 # define NR_HVM_IRQS VIOAPIC_NUM_PINS
 #endif
+#define NR_HVM_MSI_VECTORS 256
 
-/* Protected by domain's event_lock */
+/*
+ * Protected by domain's event_lock.  The maps are also read without the
+ * lock, to filter out EOIs of interrupts that no device is bound to.
+ */
 struct hvm_irq_dpci {
     /* Guest IRQ to guest device/intx mapping. */
     struct list_head girq[NR_HVM_IRQS];
+    /* Record of guest IRQs with a non-empty girq list */
+    DECLARE_BITMAP(girq_map, NR_HVM_IRQS);
+    /* Guest MSI vector to bound hvm_pirq_dpci mapping. */
+    struct list_head gmsi[NR_HVM_MSI_VECTORS];
+    /* Record of guest MSI vectors with a non-empty gmsi list */
+    DECLARE_BITMAP(gmsi_map, NR_HVM_MSI_VECTORS);
     /* Record of mapped ISA IRQs */
     DECLARE_BITMAP(isairq_map, NR_ISAIRQS);
     /* Record of mapped Links */
@@ -99,6 +109,8 @@ struct hvm_pirq_dpci {
     struct list_head digl_list;
     struct domain *dom;
     struct hvm_gmsi_info gmsi;
+    struct list_head gmsi_list;
+    s_time_t migrated;          /* last affinity change by vCPU migration */
     struct timer timer;
 };
 
@@ -29,8 +29,9 @@
 extern bool_t iommu_enable, iommu_enabled;
 extern bool_t force_iommu, iommu_verbose;
 extern bool_t iommu_workaround_bios_bug, iommu_passthrough;
-extern bool_t iommu_snoop, iommu_qinval, iommu_intremap;
+extern bool_t iommu_snoop, iommu_qinval, iommu_intremap, iommu_intpost;
 extern bool_t iommu_hap_pt_share;
+extern bool_t iommu_superpages;
 extern bool_t iommu_debug;
 extern bool_t amd_iommu_perdev_intremap;
 
@@ -151,4 +152,26 @@ int adjust_vtd_irq_affinities(void);
  */
 DECLARE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 
+/*
+ * IOTLB flush batching.
+ *
+ * Between iommu_flush_batch_start() and iommu_flush_batch_end() on the same
+ * CPU, iommu_map_page()/iommu_unmap_page() for the batch's domain skip their
+ * per-page flush; the gfn range touched is flushed once, at the end of the
+ * batch. A batch nested in another one for the same domain is merged into
+ * it. Pages unmapped in a batch must not be freed before the batch ends,
+ * and a batch must not span a hypercall continuation.
+ */
+struct iommu_flush_batch {
+    struct domain *domain;
+    unsigned long start, end;   /* gfn range touched, end exclusive */
+    bool_t active;
+};
+
+void iommu_flush_batch_start(struct iommu_flush_batch *batch,
+                             struct domain *d);
+void iommu_flush_batch_end(struct iommu_flush_batch *batch);
+void iommu_shared_pt_flush(struct domain *d, unsigned long gfn,
+                           unsigned int order);
+
 #endif /* _IOMMU_H_ */
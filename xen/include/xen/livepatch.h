@@ -0,0 +1,46 @@
+/******************************************************************************
+ * livepatch.h
+ *
+ * Replacing functions of the running hypervisor.
+ */
+
+#ifndef __XEN_LIVEPATCH_H__
+#define __XEN_LIVEPATCH_H__
+
+#include <xen/types.h>
+#include <xen/elfstructs.h>
+#include <public/sysctl.h>
+
+/*
+ * A payload's functions to replace, as an array in its .livepatch.funcs
+ * section.  This is built into payloads, so its layout is ABI.
+ */
+#define LIVEPATCH_PAYLOAD_VERSION 1
+
+struct livepatch_func {
+    const char *name;       /* The function to replace. */
+    void *new_addr;         /* Its replacement, in the payload. */
+    void *old_addr;         /* Where it is: if NULL, looked up by @name. */
+    uint32_t new_size;
+    uint32_t old_size;      /* If 0, the size of the symbol at @old_addr. */
+    uint8_t version;        /* LIVEPATCH_PAYLOAD_VERSION */
+    uint8_t opaque[31];     /* Used by the hypervisor, zero in the payload. */
+};
+
+int livepatch_op(struct xen_sysctl_livepatch_op *op);
+
+/* Arch hooks. */
+int arch_livepatch_verify_elf(const Elf64_Ehdr *hdr);
+int arch_livepatch_verify_func(const struct livepatch_func *func);
+int arch_livepatch_relocate(unsigned int type, void *dest, unsigned long room,
+                            uint64_t val);
+/* Returns zeroed, writable and executable memory; or NULL. */
+void *arch_livepatch_alloc(unsigned int nr_pages);
+void arch_livepatch_free(void *va, unsigned int nr_pages);
+/* Called with all other CPUs stopped. */
+void arch_livepatch_apply(struct livepatch_func *func);
+void arch_livepatch_revert(struct livepatch_func *func);
+/* Called on each CPU once code has been patched. */
+void arch_livepatch_sync(void);
+
+#endif /* __XEN_LIVEPATCH_H__ */
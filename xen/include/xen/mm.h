@@ -99,6 +99,8 @@ void arch_dump_shared_mem_info(void);
 #define  MEMF_no_dma      (1U<<_MEMF_no_dma)
 #define _MEMF_exact_node  4
 #define  MEMF_exact_node  (1U<<_MEMF_exact_node)
+#define _MEMF_populate_bulk 5
+#define  MEMF_populate_bulk (1U<<_MEMF_populate_bulk)
 #define _MEMF_node        8
 #define  MEMF_node(n)     ((((n)+1)&0xff)<<_MEMF_node)
 #define _MEMF_bits        24
@@ -110,6 +112,9 @@ void arch_dump_shared_mem_info(void);
 #define MAX_ORDER 20 /* 2^20 contiguous pages */
 #endif
 
+/* Marks a free chunk none of whose pages need scrubbing. */
+#define INVALID_DIRTY_IDX ((1U << (MAX_ORDER + 1)) - 1)
+
 #define page_list_entry list_head
 
 #include <asm/mm.h>
@@ -151,6 +156,11 @@ page_list_first(const struct page_list_head *head)
     return head->next;
 }
 static inline struct page_info *
+page_list_last(const struct page_list_head *head)
+{
+    return head->tail;
+}
+static inline struct page_info *
 page_list_next(const struct page_info *page,
                const struct page_list_head *head)
 {
@@ -310,6 +320,8 @@ page_list_splice(struct page_list_head *list, struct page_list_head *head)
 # define page_list_empty                 list_empty
 # define page_list_first(hd)             list_entry((hd)->next, \
                                                     struct page_info, list)
+# define page_list_last(hd)              list_entry((hd)->prev, \
+                                                    struct page_info, list)
 # define page_list_next(pg, hd)          list_entry((pg)->list.next, \
                                                     struct page_info, list)
 # define page_list_add(pg, hd)           list_add(&(pg)->list, hd)
@@ -355,6 +367,7 @@ static inline unsigned int get_order_from_pages(unsigned long nr_pages)
 }
 
 void scrub_one_page(struct page_info *);
+bool_t scrub_free_pages(void);
 
 /* Returns 1 on success, 0 on error, negative if the ring
  * for event propagation is full in the presence of paging */
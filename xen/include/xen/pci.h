@@ -56,6 +56,9 @@ struct pci_dev {
 
     u8 phantom_stride;
 
+    /* NUMA node the device is attached to, or NUMA_NO_NODE. */
+    u8 node;
+
     enum pdev_type {
         DEV_TYPE_PCI_UNKNOWN,
         DEV_TYPE_PCIe_ENDPOINT,
@@ -69,6 +72,18 @@ struct pci_dev {
 
     struct pci_dev_info info;
     struct arch_pci_dev arch;
+
+    /*
+     * Offsets of the first instance of each (extended) capability, or 0,
+     * filled by pci_dev_cache_caps().  The extended capabilities can only
+     * be cached once extended config space is accessible.
+     */
+#define PCI_DEV_NR_CAPS     0x14
+#define PCI_DEV_NR_EXT_CAPS 0x20
+    u8 cap_pos[PCI_DEV_NR_CAPS];
+    bool_t ext_caps_cached;
+    u16 ext_cap_pos[PCI_DEV_NR_EXT_CAPS];
+
     struct {
         s_time_t time;
         unsigned int count;
@@ -102,13 +117,15 @@ void setup_dom0_pci_devices(struct domain *,
 void pci_release_devices(struct domain *d);
 int pci_add_segment(u16 seg);
 const unsigned long *pci_get_ro_map(u16 seg);
-int pci_add_device(u16 seg, u8 bus, u8 devfn, const struct pci_dev_info *);
+int pci_add_device(u16 seg, u8 bus, u8 devfn,
+                   const struct pci_dev_info *, unsigned int node);
 int pci_remove_device(u16 seg, u8 bus, u8 devfn);
 int pci_ro_device(int seg, int bus, int devfn);
 void arch_pci_ro_device(int seg, int bdf);
 int pci_hide_device(int bus, int devfn);
 struct pci_dev *pci_get_pdev(int seg, int bus, int devfn);
 struct pci_dev *pci_get_real_pdev(int seg, int bus, int devfn);
+unsigned int pci_dev_node(int seg, int bus, int devfn);
 struct pci_dev *pci_get_pdev_by_domain(
     struct domain *, int seg, int bus, int devfn);
 void pci_check_disable_device(u16 seg, u8 bus, u8 devfn);
@@ -140,6 +157,9 @@ int pci_mmcfg_write(unsigned int seg, unsigned int bus,
 int pci_find_cap_offset(u16 seg, u8 bus, u8 dev, u8 func, u8 cap);
 int pci_find_next_cap(u16 seg, u8 bus, unsigned int devfn, u8 pos, int cap);
 int pci_find_ext_capability(int seg, int bus, int devfn, int cap);
+void pci_dev_cache_caps(struct pci_dev *pdev);
+int pci_dev_find_cap(const struct pci_dev *pdev, u8 cap);
+int pci_dev_find_ext_cap(const struct pci_dev *pdev, int cap);
 const char *parse_pci(const char *, unsigned int *seg, unsigned int *bus,
                       unsigned int *dev, unsigned int *func);
 
@@ -55,10 +55,14 @@ static inline int radix_tree_is_indirect_ptr(void *ptr)
 #define RADIX_TREE_MAP_SIZE	(1UL << RADIX_TREE_MAP_SHIFT)
 #define RADIX_TREE_MAP_MASK	(RADIX_TREE_MAP_SIZE-1)
 
+#define RADIX_TREE_MAX_TAGS	2
+#define RADIX_TREE_TAG_LONGS	BITS_TO_LONGS(RADIX_TREE_MAP_SIZE)
+
 struct radix_tree_node {
 	unsigned int	height;		/* Height from the bottom */
 	unsigned int	count;
 	void __rcu	*slots[RADIX_TREE_MAP_SIZE];
+	unsigned long	tags[RADIX_TREE_MAX_TAGS][RADIX_TREE_TAG_LONGS];
 };
 
 typedef struct radix_tree_node *radix_tree_alloc_fn_t(void *);
@@ -66,6 +70,7 @@ typedef void radix_tree_free_fn_t(struct radix_tree_node *, void *);
 
 struct radix_tree_root {
 	unsigned int		height;
+	unsigned int		tags;	/* bit N: something carries tag N */
 	struct radix_tree_node	__rcu *rnode;
 
 	/* Allow to specify custom node alloc/dealloc routines. */
@@ -107,10 +112,13 @@ void radix_tree_destroy(
  * The notable exceptions to this rule are the following functions:
  * radix_tree_lookup
  * radix_tree_lookup_slot
+ * radix_tree_tag_get
  * radix_tree_gang_lookup
  * radix_tree_gang_lookup_slot
+ * radix_tree_gang_lookup_tag
+ * radix_tree_iter_next (and the radix_tree_for_each_* iterators)
  *
- * The first 7 functions are able to be called locklessly, using RCU. The
+ * These functions are able to be called locklessly, using RCU. The
  * caller must ensure calls to these functions are made within rcu_read_lock()
  * regions. Other readers (lock-free or otherwise) and modifications may be
  * running concurrently.
@@ -206,4 +214,75 @@ unsigned long radix_tree_next_hole(struct radix_tree_root *root,
 unsigned long radix_tree_prev_hole(struct radix_tree_root *root,
 				unsigned long index, unsigned long max_scan);
 
+/*
+ * Range operations.  radix_tree_insert_range() stores @items[i] at
+ * @first + i, allocating all the nodes it may need up front: it either
+ * inserts the whole range or nothing (-ENOMEM, or -EEXIST if any index is
+ * in use).  radix_tree_delete_range() removes whatever is present in the
+ * range, passing each item to @slot_free (if non-NULL), and returns the
+ * number of items removed.
+ */
+int radix_tree_insert_range(struct radix_tree_root *root,
+			unsigned long first, unsigned long nr, void **items);
+unsigned long radix_tree_delete_range(struct radix_tree_root *root,
+			unsigned long first, unsigned long nr,
+			void (*slot_free)(void *));
+
+/*
+ * Tags: each present item can carry up to RADIX_TREE_MAX_TAGS marks (e.g.
+ * dirty/accessed).  Tags are summarised up the tree, so tagged items are
+ * found without visiting untagged parts of it.  Setting or clearing a tag
+ * is a modification of the tree; deleting an item clears its tags.
+ * radix_tree_tag_set/clear return the item, or NULL if there is none.
+ */
+void *radix_tree_tag_set(struct radix_tree_root *root,
+			unsigned long index, unsigned int tag);
+void *radix_tree_tag_clear(struct radix_tree_root *root,
+			unsigned long index, unsigned int tag);
+int radix_tree_tag_get(struct radix_tree_root *root,
+			unsigned long index, unsigned int tag);
+static inline int radix_tree_tagged(struct radix_tree_root *root,
+			unsigned int tag)
+{
+	return (root->tags >> tag) & 1;
+}
+unsigned int
+radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results,
+		unsigned long first_index, unsigned int max_items,
+		unsigned int tag);
+
+/*
+ * Cursor based iteration, in ascending index order.  Each step is a fresh
+ * descent from the root, skipping empty (or untagged) subtrees, so under
+ * rcu_read_lock() the tree may change between steps; as for
+ * radix_tree_gang_lookup_slot(), slots must then be read with
+ * radix_tree_deref_slot() and checked with radix_tree_deref_retry().
+ * Under the tree's write lock, the current item may be deleted.
+ */
+struct radix_tree_iter {
+	unsigned long index;		/* index of the current slot */
+	unsigned long next_index;	/* where the next step starts */
+	int tag;			/* tag to look for, or -1 */
+	bool_t done;
+};
+
+static inline void radix_tree_iter_init(struct radix_tree_iter *iter,
+			unsigned long start, int tag)
+{
+	iter->index = iter->next_index = start;
+	iter->tag = tag;
+	iter->done = 0;
+}
+
+void **radix_tree_iter_next(struct radix_tree_root *root,
+			struct radix_tree_iter *iter);
+
+#define radix_tree_for_each_slot(slot, root, iter, start)		\
+	for (radix_tree_iter_init(iter, start, -1);			\
+	     ((slot) = radix_tree_iter_next(root, iter)) != NULL; )
+
+#define radix_tree_for_each_tagged(slot, root, iter, start, tag)	\
+	for (radix_tree_iter_init(iter, start, tag);			\
+	     ((slot) = radix_tree_iter_next(root, iter)) != NULL; )
+
 #endif /* _XEN_RADIX_TREE_H */
@@ -171,6 +171,7 @@ extern const struct scheduler sched_sedf_def;
 extern const struct scheduler sched_credit_def;
 extern const struct scheduler sched_credit2_def;
 extern const struct scheduler sched_arinc653_def;
+extern const struct scheduler sched_rtds_def;
 
 
 struct cpupool
@@ -182,6 +183,7 @@ struct cpupool
     unsigned int     n_dom;
     struct scheduler *sched;
     atomic_t         refcnt;
+    unsigned int     epp;            /* energy/performance preference */
 };
 
 #define cpupool_scheduler_cpumask(_pool) \
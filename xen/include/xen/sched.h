@@ -98,6 +98,12 @@ struct evtchn
     } u;
     u8 priority;
     u8 pending:1;
+    /*
+     * Protects state and binding against evtchn_send(), which doesn't take
+     * the domain's event_lock.  Nests inside event_lock; take two channel
+     * locks in address order.
+     */
+    spinlock_t lock;
 #ifdef FLASK_ENABLE
     void *ssid;
 #endif
@@ -109,6 +115,13 @@ void evtchn_destroy_final(struct domain *d); /* from complete_domain_destroy */
 
 struct waitqueue_vcpu;
 
+/* Scheduling latency histograms, in XEN_SYSCTL_sched_hist's buckets. */
+struct sched_hist {
+    uint64_t wake_latency[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+    uint64_t runnable_wait[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+    uint64_t timeslice[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+};
+
 struct vcpu 
 {
     int              vcpu_id;
@@ -145,6 +158,13 @@ struct vcpu
     /* last time when vCPU is scheduled out */
     uint64_t last_run_time;
 
+    /* Scheduling latency histograms; see XEN_SYSCTL_sched_hist. */
+    struct sched_hist sched_hist;
+    /* Activity counters; see XEN_SYSCTL_domain_perf and vcpu_perf_*(). */
+    struct xen_sysctl_domain_perf_data *perf;
+    bool_t           sched_woken;   /* runnable since a wakeup */
+    unsigned int     sched_runq_cpu; /* pCPU counting us as runnable */
+
     /* Has the FPU been initialised? */
     bool_t           fpu_initialised;
     /* Has the FPU been used since it was last saved? */
@@ -214,6 +234,11 @@ struct vcpu
 
     struct evtchn_fifo_vcpu *evtchn_fifo;
 
+    /* Grant maptrack handles freed by this VCPU, for reuse by it. */
+    spinlock_t       maptrack_freelist_lock;
+    unsigned int     maptrack_head;
+    unsigned int     maptrack_free;
+
     struct arch_vcpu arch;
 };
 
@@ -227,16 +252,19 @@ struct mem_event_domain
 {
     /* ring lock */
     spinlock_t ring_lock;
-    /* The ring has 64 entries */
-    unsigned char foreign_producers;
-    unsigned char target_producers;
-    /* shared ring page */
+    /* slots claimed but not yet filled */
+    unsigned int foreign_producers;
+    unsigned int target_producers;
+    /* shared ring pages, mapped contiguously */
     void *ring_page;
-    struct page_info *ring_pg_struct;
+    unsigned int ring_pages;
+    struct page_info *ring_pg_struct[XEN_MEM_EVENT_RING_PAGES_MAX];
     /* front-end ring */
     mem_event_front_ring_t front_ring;
     /* event channel port (vcpu0 only) */
     int xen_port;
+    /* only notify when req_event asks for it (XEN_MEM_EVENT_LAZY_KICK) */
+    bool_t lazy_kick;
     /* mem_event bit for vcpu->pause_flags */
     int pause_flag;
     /* list of vcpus waiting for room in the ring */
@@ -329,6 +357,8 @@ struct domain
     enum { DOMDYING_alive, DOMDYING_dying, DOMDYING_dead } is_dying;
     /* Domain is paused by controller software? */
     bool_t           is_paused_by_controller;
+    /* Domain list generation of the last change; see domain_changed(). */
+    uint64_t         generation;
     /* Domain's VCPUs are pinned 1:1 to physical CPUs? */
     bool_t           is_pinned;
 
@@ -589,6 +619,30 @@ void sched_destroy_domain(struct domain *d);
 int sched_move_domain(struct domain *d, struct cpupool *c);
 long sched_adjust(struct domain *, struct xen_domctl_scheduler_op *);
 long sched_adjust_global(struct xen_sysctl_scheduler_op *);
+int  sched_hist_op(struct xen_sysctl_sched_hist *);
+int  vcpu_sched_stats_op(struct xen_sysctl_vcpu_sched_stats *);
+int  domain_perf_op(struct xen_sysctl_domain_perf *);
+int  domain_changes_op(struct xen_sysctl_domain_changes *);
+
+/*
+ * Records that a domain was created or that its state as reported by
+ * getdomaininfo (dying, shut down, paused by the controller) changed.
+ */
+void domain_changed(struct domain *d);
+
+/*
+ * Always-on activity counters of the current vCPU.  Nothing but the vCPU
+ * itself updates them, so plain increments suffice; out of range indexes
+ * go to the last bucket.
+ */
+#define vcpu_perf_incr(ctr)  (current->perf->ctr++)
+#define vcpu_perf_adda(ctr, idx, n) do {                                   \
+    uint64_t *ctr_ = current->perf->ctr;                                   \
+    unsigned long idx_ = (idx);                                            \
+    ctr_[min_t(unsigned long, idx_,                                        \
+               ARRAY_SIZE(current->perf->ctr) - 1)] += (n);                \
+} while ( 0 )
+#define vcpu_perf_incra(ctr, idx) vcpu_perf_adda(ctr, idx, 1)
 void sched_set_node_affinity(struct domain *, nodemask_t *);
 int  sched_id(void);
 void sched_tick_suspend(void);
@@ -746,6 +800,7 @@ void restore_vcpu_affinity(struct domain *d);
 
 void vcpu_runstate_get(struct vcpu *v, struct vcpu_runstate_info *runstate);
 uint64_t get_cpu_idle_time(unsigned int cpu);
+unsigned int sched_cpu_nr_runnable(unsigned int cpu);
 
 /*
  * Used by idle loop to decide whether there is work to do:
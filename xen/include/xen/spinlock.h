@@ -3,10 +3,12 @@
 
 #include <asm/system.h>
 #include <asm/spinlock.h>
+#include <xen/percpu.h>
+#include <xen/preempt.h>
 
 #ifndef NDEBUG
 struct lock_debug {
-    int irq_safe; /* +1: IRQ-safe; 0: not IRQ-safe; -1: don't know yet */
+    s16 irq_safe; /* +1: IRQ-safe; 0: not IRQ-safe; -1: don't know yet */
 };
 #define _LOCK_DEBUG { -1 }
 void spin_debug_enable(void);
@@ -67,6 +69,12 @@ struct lock_profile {
     s64                 time_hold;   /* cumulated lock time */
     s64                 time_block;  /* cumulated wait time */
     s64                 time_locked; /* system time of last locking */
+                                     /* (0: current hold isn't sampled) */
+    s64                 max_hold;    /* longest hold */
+    void                *holder;     /* caller of the current hold */
+    void                *max_holder; /* caller of the longest hold */
+    u32                 hold_hist[LOCKPROF_HIST_BUCKETS];
+    u32                 block_hist[LOCKPROF_HIST_BUCKETS];
 };
 
 struct lock_profile_qhead {
@@ -75,13 +83,12 @@ struct lock_profile_qhead {
     int32_t                   idx;     /* index for printout */
 };
 
-#define _LOCK_PROFILE(name) { 0, #name, &name, 0, 0, 0, 0, 0 }
+#define _LOCK_PROFILE(lockname) { .name = #lockname, .lock = &lockname }
 #define _LOCK_PROFILE_PTR(name)                                               \
     static struct lock_profile *__lock_profile_##name                         \
     __used_section(".lockprofile.data") =                                     \
     &__lock_profile_data_##name
-#define _SPIN_LOCK_UNLOCKED(x) { _RAW_SPIN_LOCK_UNLOCKED, 0xfffu, 0,          \
-                                 _LOCK_DEBUG, x }
+#define _SPIN_LOCK_UNLOCKED(x) { { 0 }, 0xfffu, 0, _LOCK_DEBUG, x }
 #define SPIN_LOCK_UNLOCKED _SPIN_LOCK_UNLOCKED(NULL)
 #define DEFINE_SPINLOCK(l)                                                    \
     spinlock_t l = _SPIN_LOCK_UNLOCKED(NULL);                                 \
@@ -117,8 +124,7 @@ extern void spinlock_profile_reset(unsigned char key);
 
 struct lock_profile_qhead { };
 
-#define SPIN_LOCK_UNLOCKED                                                    \
-    { _RAW_SPIN_LOCK_UNLOCKED, 0xfffu, 0, _LOCK_DEBUG }
+#define SPIN_LOCK_UNLOCKED { { 0 }, 0xfffu, 0, _LOCK_DEBUG }
 #define DEFINE_SPINLOCK(l) spinlock_t l = SPIN_LOCK_UNLOCKED
 
 #define spin_lock_init_prof(s, l) spin_lock_init(&((s)->l))
@@ -127,8 +133,23 @@ struct lock_profile_qhead { };
 
 #endif
 
+/*
+ * Ticket lock: a cpu takes the next ticket (tail) and waits for head to
+ * reach it, so contending cpus get the lock in FIFO order, and waiters
+ * only read the lock's cache line until their turn comes.
+ */
+typedef union {
+    u32 head_tail;
+    struct {
+        u16 head;  /* Ticket being served */
+        u16 tail;  /* Next ticket to hand out */
+    };
+} spinlock_tickets_t;
+
+#define SPINLOCK_TICKET_INC { .head_tail = 0x10000, }
+
 typedef struct spinlock {
-    raw_spinlock_t raw;
+    spinlock_tickets_t tickets;
     u16 recurse_cpu:12;
     u16 recurse_cnt:4;
     struct lock_debug debug;
@@ -251,4 +272,110 @@ int _rw_is_write_locked(rwlock_t *lock);
 #define rw_is_locked(l)               _rw_is_locked(l)
 #define rw_is_write_locked(l)         _rw_is_write_locked(l)
 
+/*
+ * Per-cpu read-mostly rwlock.
+ *
+ * Readers only write a per-cpu slot (pointing at the lock they hold) and
+ * read the lock's writer_activating flag, which stays in their cache for
+ * as long as no writer comes along: no cache line is shared between
+ * readers.  A writer takes the underlying rwlock for writing, raises
+ * writer_activating, and then waits for every cpu's slot to stop
+ * pointing at the lock, which makes writes O(nr_cpus).  Readers arriving
+ * while a writer is active queue on the underlying rwlock.
+ *
+ * Every class of such locks (e.g. all grant tables) has its own per-cpu
+ * slot, defined with DEFINE_PERCPU_RWLOCK_GLOBAL().  Hence a cpu can only
+ * hold one lock of a class for reading at a time: read locks of a class
+ * neither recurse nor nest.
+ */
+typedef struct percpu_rwlock percpu_rwlock_t;
+
+struct percpu_rwlock {
+    rwlock_t            rwlock;
+    bool_t              writer_activating;
+#ifndef NDEBUG
+    percpu_rwlock_t     **percpu_owner;
+#endif
+};
+
+#ifndef NDEBUG
+#define PERCPU_RW_LOCK_UNLOCKED(owner) { RW_LOCK_UNLOCKED, 0, owner }
+static inline void _percpu_rwlock_owner_check(percpu_rwlock_t **per_cpudata,
+                                              percpu_rwlock_t *percpu_rwlock)
+{
+    ASSERT(per_cpudata == percpu_rwlock->percpu_owner);
+}
+#else
+#define PERCPU_RW_LOCK_UNLOCKED(owner) { RW_LOCK_UNLOCKED, 0 }
+#define _percpu_rwlock_owner_check(data, lock) ((void)0)
+#endif
+
+#define DEFINE_PERCPU_RWLOCK_GLOBAL(name) DEFINE_PER_CPU(percpu_rwlock_t *, name)
+#define DECLARE_PERCPU_RWLOCK_GLOBAL(name) \
+    DECLARE_PER_CPU(percpu_rwlock_t *, name)
+#define DEFINE_PERCPU_RWLOCK_RESOURCE(l, owner) \
+    percpu_rwlock_t l = PERCPU_RW_LOCK_UNLOCKED(&get_per_cpu_var(owner))
+#define percpu_rwlock_resource_init(l, owner) \
+    (*(l) = (percpu_rwlock_t)PERCPU_RW_LOCK_UNLOCKED(&get_per_cpu_var(owner)))
+
+static inline void _percpu_read_lock(percpu_rwlock_t **per_cpudata,
+                                     percpu_rwlock_t *percpu_rwlock)
+{
+    _percpu_rwlock_owner_check(per_cpudata, percpu_rwlock);
+    /* No recursion, and only one lock of the class per cpu. */
+    ASSERT(this_cpu_ptr(per_cpudata) == NULL);
+
+    preempt_disable();
+    this_cpu_ptr(per_cpudata) = percpu_rwlock;
+    smp_mb();
+    if ( unlikely(percpu_rwlock->writer_activating) )
+    {
+        /* Let the writer go on, and wait for it on the fair rwlock. */
+        this_cpu_ptr(per_cpudata) = NULL;
+        read_lock(&percpu_rwlock->rwlock);
+        this_cpu_ptr(per_cpudata) = percpu_rwlock;
+        /* Any later writer will now wait for our slot to clear. */
+        read_unlock(&percpu_rwlock->rwlock);
+    }
+}
+
+static inline void _percpu_read_unlock(percpu_rwlock_t **per_cpudata,
+                                       percpu_rwlock_t *percpu_rwlock)
+{
+    _percpu_rwlock_owner_check(per_cpudata, percpu_rwlock);
+    ASSERT(this_cpu_ptr(per_cpudata) == percpu_rwlock);
+
+    smp_mb();
+    this_cpu_ptr(per_cpudata) = NULL;
+    smp_wmb();
+    preempt_enable();
+}
+
+void _percpu_write_lock(percpu_rwlock_t **per_cpudata,
+                        percpu_rwlock_t *percpu_rwlock);
+
+static inline void _percpu_write_unlock(percpu_rwlock_t **per_cpudata,
+                                        percpu_rwlock_t *percpu_rwlock)
+{
+    _percpu_rwlock_owner_check(per_cpudata, percpu_rwlock);
+    ASSERT(percpu_rwlock->writer_activating);
+
+    percpu_rwlock->writer_activating = 0;
+    write_unlock(&percpu_rwlock->rwlock);
+}
+
+#define percpu_read_lock(percpu, lock) \
+    _percpu_read_lock(&get_per_cpu_var(percpu), lock)
+#define percpu_read_unlock(percpu, lock) \
+    _percpu_read_unlock(&get_per_cpu_var(percpu), lock)
+#define percpu_write_lock(percpu, lock) \
+    _percpu_write_lock(&get_per_cpu_var(percpu), lock)
+#define percpu_write_unlock(percpu, lock) \
+    _percpu_write_unlock(&get_per_cpu_var(percpu), lock)
+
+#define percpu_rw_is_write_locked(l)  _rw_is_write_locked(&(l)->rwlock)
+/* Held by this cpu for reading, or by anyone for writing. */
+#define percpu_rw_is_locked(percpu, l)                                \
+    (this_cpu(percpu) == (l) || percpu_rw_is_write_locked(l))
+
 #endif /* __SPINLOCK_H__ */
@@ -11,6 +11,9 @@ const char *symbols_lookup(unsigned long addr,
                            unsigned long *offset,
                            char *namebuf);
 
+/* Lookup a name: 0, -ENOENT, or -EEXIST if more than one symbol has it. */
+int symbols_lookup_by_name(const char *symname, unsigned long *addr);
+
 /* Replace "%s" in format with address, if found */
 void __print_symbol(const char *fmt, unsigned long address);
 
@@ -13,21 +13,26 @@
 #include <xen/types.h>
 #include <xen/list.h>
 #include <xen/percpu.h>
+#include <xen/spinlock.h>
 
 struct tasklet
 {
     struct list_head list;
+    spinlock_t lock;
     int scheduled_on;
     bool_t is_softirq;
     bool_t is_running;
     bool_t is_dead;
+    bool_t is_unbound;   /* may be stolen by an idle CPU */
     void (*func)(unsigned long);
     unsigned long data;
 };
 
-#define _DECLARE_TASKLET(name, func, data, softirq)                     \
+#define _DECLARE_TASKLET(name, fn, arg, softirq)                        \
     struct tasklet name = {                                             \
-        LIST_HEAD_INIT(name.list), -1, softirq, 0, 0, func, data }
+        .list = LIST_HEAD_INIT(name.list), .lock = SPIN_LOCK_UNLOCKED,  \
+        .scheduled_on = -1, .is_softirq = softirq,                      \
+        .func = fn, .data = arg }
 #define DECLARE_TASKLET(name, func, data)               \
     _DECLARE_TASKLET(name, func, data, 0)
 #define DECLARE_SOFTIRQ_TASKLET(name, func, data)       \
@@ -42,6 +47,11 @@ DECLARE_PER_CPU(unsigned long, tasklet_work_to_do);
 
 void tasklet_schedule_on_cpu(struct tasklet *t, unsigned int cpu);
 void tasklet_schedule(struct tasklet *t);
+/*
+ * Schedule a non-softirq tasklet which doesn't care which CPU it runs on:
+ * it is queued locally, but an idle CPU may steal it.
+ */
+void tasklet_schedule_unbound(struct tasklet *t);
 void do_tasklet(void);
 void tasklet_kill(struct tasklet *t);
 void tasklet_init(
@@ -337,28 +337,33 @@ static inline bool_t tmh_current_is_privileged(void)
     return !xsm_tmem_control(XSM_PRIV);
 }
 
-static inline uint8_t tmh_get_first_byte(pfp_t *pfp)
+/*
+ * Compare nwords 64-bit words, returning <0, 0 or >0 like memcmp (but on
+ * words, which is all the dedup tree needs).  Blocks of four words are
+ * checked with a single branch, and only a block which differs is looked
+ * at word by word.
+ */
+static inline int tmh_words_cmp(const uint64_t *p1, const uint64_t *p2,
+                                pagesize_t nwords)
 {
-    void *p = __map_domain_page(pfp);
+    pagesize_t i = 0;
 
-    return (uint8_t)(*(char *)p);
+    for ( ; i + 4 <= nwords; i += 4 )
+        if ( (p1[i] ^ p2[i]) | (p1[i+1] ^ p2[i+1]) |
+             (p1[i+2] ^ p2[i+2]) | (p1[i+3] ^ p2[i+3]) )
+            break;
+    for ( ; i < nwords; i++ )
+        if ( p1[i] != p2[i] )
+            return p1[i] < p2[i] ? -1 : 1;
+    return 0;
 }
 
 static inline int tmh_page_cmp(pfp_t *pfp1, pfp_t *pfp2)
 {
     const uint64_t *p1 = (uint64_t *)__map_domain_page(pfp1);
     const uint64_t *p2 = (uint64_t *)__map_domain_page(pfp2);
-    int i;
 
-    // FIXME: code in assembly?
-ASSERT(p1 != NULL);
-ASSERT(p2 != NULL);
-    for ( i = PAGE_SIZE/sizeof(uint64_t); i && *p1 == *p2; i--, p1++, p2++ );
-    if ( !i )
-        return 0;
-    if ( *p1 < *p2 )
-        return -1;
-    return 1;
+    return tmh_words_cmp(p1, p2, PAGE_SIZE/sizeof(uint64_t));
 }
 
 static inline int tmh_pcd_cmp(void *va1, pagesize_t len1, void *va2, pagesize_t len2)
@@ -386,7 +391,6 @@ static inline int tmh_tze_pfp_cmp(pfp_t *pfp1, pagesize_t pfp_len, void *tva, pa
 {
     const uint64_t *p1 = (uint64_t *)__map_domain_page(pfp1);
     const uint64_t *p2;
-    pagesize_t i;
 
     if ( tze_len == PAGE_SIZE )
        p2 = (uint64_t *)__map_domain_page((pfp_t *)tva);
@@ -401,12 +405,7 @@ static inline int tmh_tze_pfp_cmp(pfp_t *pfp1, pagesize_t pfp_len, void *tva, pa
     if ( pfp_len > tze_len )
         return 1;
     ASSERT(pfp_len == tze_len);
-    for ( i = tze_len/sizeof(uint64_t); i && *p1 == *p2; i--, p1++, p2++ );
-    if ( !i )
-        return 0;
-    if ( *p1 < *p2 )
-        return -1;
-    return 1;
+    return tmh_words_cmp(p1, p2, tze_len/sizeof(uint64_t));
 }
 
 /* return the size of the data in the pfp, ignoring trailing zeroes and
@@ -497,7 +496,10 @@ int tmh_compress_from_client(tmem_cli_mfn_t, void **, size_t *,
 			     tmem_cli_va_param_t);
 
 int tmh_copy_from_client(pfp_t *, tmem_cli_mfn_t, pagesize_t tmem_offset,
-    pagesize_t pfn_offset, pagesize_t len, tmem_cli_va_param_t);
+    pagesize_t pfn_offset, pagesize_t len, tmem_cli_va_param_t,
+    uint64_t *hash);
+
+uint64_t tmh_content_hash(const void *, size_t);
 
 int tmh_copy_to_client(tmem_cli_mfn_t, pfp_t *, pagesize_t tmem_offset,
     pagesize_t pfn_offset, pagesize_t len, tmem_cli_va_param_t);
@@ -22,11 +22,25 @@
 #define __XEN_TRACE_H__
 
 extern int tb_init_done;
+extern u32 tb_event_mask;
 
 #include <public/sysctl.h>
 #include <public/trace.h>
 #include <asm/trace.h>
 
+/*
+ * Does the event mask let @event through?  Inline so that callers can
+ * skip formatting records which would get filtered out anyway.
+ */
+static inline bool_t tb_event_enabled(u32 event)
+{
+    /* Any of the event's flag bits, class and subclass must be enabled. */
+    return (tb_event_mask & event) &&
+           ((tb_event_mask >> TRC_CLS_SHIFT) & (event >> TRC_CLS_SHIFT)) &&
+           ((tb_event_mask >> TRC_SUBCLS_SHIFT) &
+            (event >> TRC_SUBCLS_SHIFT) & 0xf);
+}
+
 /* Used to initialise trace buffer functionality */
 void init_trace_bufs(void);
 
@@ -40,7 +54,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra, const void *);
 static inline void trace_var(u32 event, int cycles, int extra,
                              const void *extra_data)
 {
-    if ( unlikely(tb_init_done) )
+    if ( unlikely(tb_init_done) && tb_event_enabled(event) )
         __trace_var(event, cycles, extra, extra_data);
 }
 
@@ -55,7 +69,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
   
 #define TRACE_1D(_e,d1)                                         \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( unlikely(tb_init_done) && tb_event_enabled(_e) )   \
         {                                                       \
             u32 _d[1];                                          \
             _d[0] = d1;                                         \
@@ -65,7 +79,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
  
 #define TRACE_2D(_e,d1,d2)                                      \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( unlikely(tb_init_done) && tb_event_enabled(_e) )   \
         {                                                       \
             u32 _d[2];                                          \
             _d[0] = d1;                                         \
@@ -76,7 +90,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
  
 #define TRACE_3D(_e,d1,d2,d3)                                   \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( unlikely(tb_init_done) && tb_event_enabled(_e) )   \
         {                                                       \
             u32 _d[3];                                          \
             _d[0] = d1;                                         \
@@ -88,7 +102,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
  
 #define TRACE_4D(_e,d1,d2,d3,d4)                                \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( unlikely(tb_init_done) && tb_event_enabled(_e) )   \
         {                                                       \
             u32 _d[4];                                          \
             _d[0] = d1;                                         \
@@ -101,7 +115,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
  
 #define TRACE_5D(_e,d1,d2,d3,d4,d5)                             \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( unlikely(tb_init_done) && tb_event_enabled(_e) )   \
         {                                                       \
             u32 _d[5];                                          \
             _d[0] = d1;                                         \
@@ -115,7 +129,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
 
 #define TRACE_6D(_e,d1,d2,d3,d4,d5,d6)                             \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( unlikely(tb_init_done) && tb_event_enabled(_e) )   \
         {                                                       \
             u32 _d[6];                                          \
             _d[0] = d1;                                         \
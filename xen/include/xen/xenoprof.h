@@ -78,5 +78,6 @@ void release_pmu_ownship(int pmu_ownership);
 
 void xenoprof_log_event(struct vcpu *, const struct cpu_user_regs *,
                         uint64_t pc, int mode, int event);
+int xenoprof_notify_needed(struct vcpu *);
 
 #endif  /* __XEN__XENOPROF_H__ */
@@ -48,6 +48,40 @@ static inline void *_xzalloc_array(
     return _xzalloc(size * num, align);
 }
 
+/*
+ * Object caches: fixed-size objects served from per-cpu magazines in front
+ * of the xmalloc pool.  Not for use in IRQ context.
+ */
+
+struct xmem_cache;
+
+/**
+ * xmem_cache_create - create a cache of objects
+ * @name: name of the cache, shown in the statistics (key 'k')
+ * @size: size of each object
+ * @align: alignment of each object
+ *
+ * Requires nr_cpu_ids to be final.
+ */
+struct xmem_cache *xmem_cache_create(
+    const char *name, unsigned long size, unsigned long align);
+#define xmem_cache_create_type(_name, _type) \
+    xmem_cache_create(_name, sizeof(_type), __alignof__(_type))
+
+/**
+ * xmem_cache_destroy - free a cache and every object cached in it
+ *
+ * All objects allocated from the cache must have been freed before.
+ */
+void xmem_cache_destroy(struct xmem_cache *cache);
+
+/* Allocate an object (xmem_cache_zalloc: and clear it). */
+void *xmem_cache_alloc(struct xmem_cache *cache);
+void *xmem_cache_zalloc(struct xmem_cache *cache);
+
+/* Return an object to the cache it was allocated from. */
+void xmem_cache_free(struct xmem_cache *cache, void *obj);
+
 /*
  * Pooled allocator interface.
  */
@@ -55,6 +55,7 @@ const struct selinux_class_perm selinux_class_perm = {
 #define AVC_CACHE_SLOTS            512
 #define AVC_DEF_CACHE_THRESHOLD        512
 #define AVC_CACHE_RECLAIM        16
+#define AVC_PCPU_SLOTS            64
 
 #ifdef FLASK_AVC_STATS
 #define avc_cache_stats_incr(field)                 \
@@ -79,11 +80,28 @@ struct avc_node {
 };
 
 struct avc_cache {
-    struct hlist_head    slots[AVC_CACHE_SLOTS]; /* head for avc_node->list */
-    spinlock_t        slots_lock[AVC_CACHE_SLOTS]; /* lock for writes */
+    struct hlist_head    *slots; /* head for avc_node->list */
+    spinlock_t        *slots_lock; /* lock for writes */
+    unsigned int        nr_slots;    /* a power of 2 */
     atomic_t        lru_hint;    /* LRU hint for reclaim scan */
     atomic_t        active_nodes;
     u32            latest_notif;    /* latest revocation notification */
+    atomic_t        generation;    /* bumped when any entry changes */
+};
+
+/*
+ * Each CPU keeps the decisions it made last in a small direct-mapped
+ * cache in front of the AVC, to be looked up without hashing into the
+ * AVC's chains or taking the RCU read lock.  An entry is valid as long
+ * as the AVC's generation hasn't moved since it was filled, that is
+ * until a policy load or any other change to a decision.
+ */
+struct avc_pcpu_entry {
+    u32            ssid;
+    u32            tsid;
+    u16            tclass;
+    int            generation;
+    struct av_decision    avd;
 };
 
 struct avc_callback_node {
@@ -106,13 +124,25 @@ DEFINE_PER_CPU(struct avc_cache_stats, avc_cache_stats);
 #endif
 
 static struct avc_cache avc_cache;
+static DEFINE_PER_CPU(struct avc_pcpu_entry [AVC_PCPU_SLOTS], avc_pcpu_cache);
+
+static unsigned int __initdata opt_avc_slots = AVC_CACHE_SLOTS;
+integer_param("flask_avc_slots", opt_avc_slots);
+static struct xmem_cache *avc_node_cachep;
 static struct avc_callback_node *avc_callbacks;
 
 static DEFINE_RCU_READ_LOCK(avc_rcu_lock);
 
 static inline int avc_hash(u32 ssid, u32 tsid, u16 tclass)
 {
-    return (ssid ^ (tsid<<2) ^ (tclass<<4)) & (AVC_CACHE_SLOTS - 1);
+    return (ssid ^ (tsid<<2) ^ (tclass<<4)) & (avc_cache.nr_slots - 1);
+}
+
+static inline struct avc_pcpu_entry *avc_pcpu_slot(u32 ssid, u32 tsid,
+                                                   u16 tclass)
+{
+    return &this_cpu(avc_pcpu_cache)[(ssid ^ (tsid<<2) ^ (tclass<<4)) &
+                                     (AVC_PCPU_SLOTS - 1)];
 }
 
 /* no use making this larger than the printk buffer */
@@ -244,13 +274,24 @@ void __init avc_init(void)
 {
     int i;
 
-    for ( i = 0; i < AVC_CACHE_SLOTS; i++ )
+    /* Many domains and types want more slots than the default */
+    avc_cache.nr_slots = 1U << (fls(max(opt_avc_slots, 16U) - 1));
+    avc_cache.slots = xmalloc_array(struct hlist_head, avc_cache.nr_slots);
+    avc_cache.slots_lock = xmalloc_array(spinlock_t, avc_cache.nr_slots);
+    BUG_ON(!avc_cache.slots || !avc_cache.slots_lock);
+
+    for ( i = 0; i < avc_cache.nr_slots; i++ )
     {
         INIT_HLIST_HEAD(&avc_cache.slots[i]);
         spin_lock_init(&avc_cache.slots_lock[i]);
     }
     atomic_set(&avc_cache.active_nodes, 0);
     atomic_set(&avc_cache.lru_hint, 0);
+    /* Unused per-CPU entries, all zeroes, must not look valid */
+    atomic_set(&avc_cache.generation, 1);
+
+    avc_node_cachep = xmem_cache_create_type("avc_node", struct avc_node);
+    BUG_ON(!avc_node_cachep);
 
     printk("AVC INITIALIZED\n");
 }
@@ -265,7 +306,7 @@ int avc_get_hash_stats(struct xen_flask_hash_stats *arg)
 
     slots_used = 0;
     max_chain_len = 0;
-    for ( i = 0; i < AVC_CACHE_SLOTS; i++ )
+    for ( i = 0; i < avc_cache.nr_slots; i++ )
     {
         head = &avc_cache.slots[i];
         if ( !hlist_empty(head) )
@@ -285,7 +326,7 @@ int avc_get_hash_stats(struct xen_flask_hash_stats *arg)
     
     arg->entries = atomic_read(&avc_cache.active_nodes);
     arg->buckets_used = slots_used;
-    arg->buckets_total = AVC_CACHE_SLOTS;
+    arg->buckets_total = avc_cache.nr_slots;
     arg->max_chain_len = max_chain_len;
 
     return 0;
@@ -294,7 +335,7 @@ int avc_get_hash_stats(struct xen_flask_hash_stats *arg)
 static void avc_node_free(struct rcu_head *rhead)
 {
     struct avc_node *node = container_of(rhead, struct avc_node, rhead);
-    xfree(node);
+    xmem_cache_free(avc_node_cachep, node);
     avc_cache_stats_incr(frees);
 }
 
@@ -307,7 +348,7 @@ static void avc_node_delete(struct avc_node *node)
 
 static void avc_node_kill(struct avc_node *node)
 {
-    xfree(node);
+    xmem_cache_free(avc_node_cachep, node);
     avc_cache_stats_incr(frees);
     atomic_dec(&avc_cache.active_nodes);
 }
@@ -328,10 +369,10 @@ static inline int avc_reclaim_node(void)
     struct hlist_node *next;
     spinlock_t *lock;
 
-    for ( try = 0, ecx = 0; try < AVC_CACHE_SLOTS; try++ )
+    for ( try = 0, ecx = 0; try < avc_cache.nr_slots; try++ )
     {
         atomic_inc(&avc_cache.lru_hint);
-        hvalue =  atomic_read(&avc_cache.lru_hint) & (AVC_CACHE_SLOTS - 1);
+        hvalue =  atomic_read(&avc_cache.lru_hint) & (avc_cache.nr_slots - 1);
         head = &avc_cache.slots[hvalue];
         lock = &avc_cache.slots_lock[hvalue];
 
@@ -360,7 +401,7 @@ static struct avc_node *avc_alloc_node(void)
 {
     struct avc_node *node;
 
-    node = xmalloc(struct avc_node);
+    node = xmem_cache_alloc(avc_node_cachep);
     if (!node)
         goto out;
 
@@ -743,6 +784,7 @@ static int avc_update_node(u32 event, u32 perms, u32 ssid, u32 tsid, u16 tclass,
         break;
     }
     avc_node_replace(node, orig);
+    atomic_inc(&avc_cache.generation);
  out_unlock:
     spin_unlock_irqrestore(lock, flag);
  out:
@@ -763,7 +805,7 @@ int avc_ss_reset(u32 seqno)
     struct hlist_node *next;
     spinlock_t *lock;
 
-    for ( i = 0; i < AVC_CACHE_SLOTS; i++ )
+    for ( i = 0; i < avc_cache.nr_slots; i++ )
     {
         head = &avc_cache.slots[i];
         lock = &avc_cache.slots_lock[i];
@@ -775,6 +817,7 @@ int avc_ss_reset(u32 seqno)
         rcu_read_unlock(&avc_rcu_lock);
         spin_unlock_irqrestore(lock, flag);
     }
+    atomic_inc(&avc_cache.generation);
     
     for ( c = avc_callbacks; c; c = c->next )
     {
@@ -817,11 +860,25 @@ int avc_has_perm_noaudit(u32 ssid, u32 tsid, u16 tclass, u32 requested,
 {
     struct avc_node *node;
     struct av_decision avd_entry, *avd;
-    int rc = 0;
+    struct avc_pcpu_entry *pe = avc_pcpu_slot(ssid, tsid, tclass);
+    int rc = 0, generation = atomic_read(&avc_cache.generation);
     u32 denied;
 
     BUG_ON(!requested);
 
+    /* The common case: a decision this CPU made, granting all requested */
+    if ( pe->generation == generation && pe->ssid == ssid &&
+         pe->tsid == tsid && pe->tclass == tclass &&
+         !(requested & ~pe->avd.allowed) )
+    {
+        avc_cache_stats_incr(lookups);
+        avc_cache_stats_incr(hits);
+        if ( in_avd )
+            memcpy(in_avd, &pe->avd, sizeof(*in_avd));
+        return 0;
+    }
+
+    smp_rmb();
     rcu_read_lock(&avc_rcu_lock);
 
     node = avc_lookup(ssid, tsid, tclass);
@@ -845,6 +902,20 @@ int avc_has_perm_noaudit(u32 ssid, u32 tsid, u16 tclass, u32 requested,
         avd = &node->ae.avd;
     }
 
+    /*
+     * Only a decision the AVC holds, as of the generation read before
+     * looking it up, is cached: one made against a policy being replaced
+     * isn't inserted, and a change since will have moved the generation.
+     */
+    if ( node )
+    {
+        pe->ssid = ssid;
+        pe->tsid = tsid;
+        pe->tclass = tclass;
+        memcpy(&pe->avd, &node->ae.avd, sizeof(pe->avd));
+        pe->generation = generation;
+    }
+
     denied = requested & ~(avd->allowed);
 
     if ( denied )
@@ -861,6 +932,18 @@ int avc_has_perm_noaudit(u32 ssid, u32 tsid, u16 tclass, u32 requested,
     return rc;
 }
 
+/**
+ * avc_generation - Return the AVC's generation.
+ *
+ * The generation moves whenever any decision may have changed, as on a
+ * policy load.  Callers caching decisions of their own read it before
+ * asking for a decision, and tag what they cache with it.
+ */
+int avc_generation(void)
+{
+    return atomic_read(&avc_cache.generation);
+}
+
 /**
  * avc_has_perm - Check permissions and perform any appropriate auditing.
  * @ssid: source security identifier
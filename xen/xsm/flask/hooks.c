@@ -56,6 +56,117 @@ static u32 evtchn_sid(const struct evtchn *chn)
     return esec->sid;
 }
 
+/*
+ * The grant, event channel and MMU hooks sit in fast paths, and ask about
+ * the same few (source, target) pairs over and over.  So each domain keeps
+ * the access vectors it was last granted in those classes, per target SID,
+ * and a check that hits is a bit test.  Entries are tagged with the SID of
+ * the domain when they were filled, so a relabel makes them miss, and with
+ * the AVC's generation, so a policy load or any other change to a decision
+ * does.
+ *
+ * Lookups are lockless: writers, serialised by perm_lock, make an entry's
+ * seq odd for the duration of an update, and a reader only trusts what it
+ * read if seq was even and unchanged throughout.
+ */
+static int perm_cache_class(u16 class)
+{
+    switch ( class )
+    {
+    case SECCLASS_GRANT:
+        return DSEC_PERM_GRANT;
+    case SECCLASS_EVENT:
+        return DSEC_PERM_EVENT;
+    case SECCLASS_MMU:
+        return DSEC_PERM_MMU;
+    }
+    return -1;
+}
+
+static struct domain_perm_cache *perm_cache_slot(
+    struct domain_security_struct *dsec, u32 tsid)
+{
+    return &dsec->perm_cache[tsid & (DSEC_PERM_SLOTS - 1)];
+}
+
+static bool_t perm_cache_allows(struct domain_security_struct *dsec,
+                                u32 ssid, u32 tsid, int idx, u32 perms)
+{
+    struct domain_perm_cache *pc = perm_cache_slot(dsec, tsid);
+    unsigned int seq = read_atomic(&pc->seq);
+    bool_t hit;
+
+    if ( seq & 1 )
+        return 0;
+    smp_rmb();
+
+    hit = pc->generation == avc_generation() &&
+          pc->ssid == ssid && pc->tsid == tsid &&
+          (pc->valid & (1U << idx)) && !(perms & ~pc->allowed[idx]);
+
+    smp_rmb();
+    return hit && read_atomic(&pc->seq) == seq;
+}
+
+static void perm_cache_fill(struct domain_security_struct *dsec,
+                            u32 ssid, u32 tsid, int idx, int generation,
+                            u32 allowed)
+{
+    struct domain_perm_cache *pc = perm_cache_slot(dsec, tsid);
+
+    spin_lock(&dsec->perm_lock);
+
+    pc->seq++;
+    smp_wmb();
+
+    if ( pc->generation != generation || pc->ssid != ssid ||
+         pc->tsid != tsid )
+    {
+        pc->generation = generation;
+        pc->ssid = ssid;
+        pc->tsid = tsid;
+        pc->valid = 0;
+    }
+    pc->allowed[idx] = allowed;
+    pc->valid |= 1U << idx;
+
+    smp_wmb();
+    pc->seq++;
+
+    spin_unlock(&dsec->perm_lock);
+}
+
+static int domain_cached_perm(struct domain *d, u32 ssid, u32 tsid,
+                              u16 class, u32 perms,
+                              struct avc_audit_data *ad)
+{
+    struct domain_security_struct *dsec = d->ssid;
+    struct av_decision avd;
+    int idx = perm_cache_class(class);
+    int generation, rc;
+
+    if ( idx < 0 )
+        return avc_has_perm(ssid, tsid, class, perms, ad);
+
+    if ( perm_cache_allows(dsec, ssid, tsid, idx, perms) )
+        return 0;
+
+    generation = avc_generation();
+    rc = avc_has_perm_noaudit(ssid, tsid, class, perms, &avd);
+    avc_audit(ssid, tsid, class, perms, &avd, rc, ad);
+
+    /*
+     * Permissions the policy wants audited when granted mustn't be
+     * answered from the cache, and neither may anything for a permissive
+     * domain, whose denials are granted, and audited, one at a time.
+     */
+    if ( !rc && !(avd.flags & AVD_FLAGS_PERMISSIVE) )
+        perm_cache_fill(dsec, ssid, tsid, idx, generation,
+                        avd.allowed & ~avd.auditallow);
+
+    return rc;
+}
+
 static int domain_has_perm(struct domain *dom1, struct domain *dom2, 
                            u16 class, u32 perms)
 {
@@ -68,7 +179,7 @@ static int domain_has_perm(struct domain *dom1, struct domain *dom2,
     ssid = domain_sid(dom1);
     tsid = domain_target_sid(dom1, dom2);
 
-    return avc_has_perm(ssid, tsid, class, perms, &ad);
+    return domain_cached_perm(dom1, ssid, tsid, class, perms, &ad);
 }
 
 static int avc_current_has_perm(u32 tsid, u16 class, u32 perm,
@@ -88,7 +199,7 @@ static int domain_has_evtchn(struct domain *d, struct evtchn *chn, u32 perms)
     u32 dsid = domain_sid(d);
     u32 esid = evtchn_sid(chn);
 
-    return avc_has_perm(dsid, esid, SECCLASS_EVENT, perms, NULL);
+    return domain_cached_perm(d, dsid, esid, SECCLASS_EVENT, perms, NULL);
 }
 
 static int domain_has_xen(struct domain *d, u32 perms)
@@ -138,6 +249,7 @@ static int flask_domain_alloc_security(struct domain *d)
         return -ENOMEM;
 
     memset(dsec, 0, sizeof(struct domain_security_struct));
+    spin_lock_init(&dsec->perm_lock);
 
     switch ( d->domain_id )
     {
@@ -698,6 +810,8 @@ static int flask_domctl(struct domain *d, int cmd)
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__TRIGGER);
 
     case XEN_DOMCTL_set_access_required:
+    case XEN_DOMCTL_harvest_accessed:
+    case XEN_DOMCTL_migrate_memory:
         return current_has_perm(d, SECCLASS_HVM, HVM__MEM_EVENT);
 
     case XEN_DOMCTL_debug_op:
@@ -716,6 +830,7 @@ static int flask_domctl(struct domain *d, int cmd)
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__SET_VIRQ_HANDLER);
 
     case XEN_DOMCTL_set_cpuid:
+    case XEN_DOMCTL_set_cpuid_policy:
         return current_has_perm(d, SECCLASS_DOMAIN2, DOMAIN2__SET_CPUID);
 
     case XEN_DOMCTL_gettscinfo:
@@ -743,6 +858,7 @@ static int flask_sysctl(int cmd)
     /* These have individual XSM hooks */
     case XEN_SYSCTL_readconsole:
     case XEN_SYSCTL_getdomaininfolist:
+    case XEN_SYSCTL_domain_changes:
     case XEN_SYSCTL_page_offline_op:
     case XEN_SYSCTL_scheduler_op:
 #ifdef CONFIG_X86
@@ -757,11 +873,21 @@ static int flask_sysctl(int cmd)
         return domain_has_xen(current->domain, XEN__GETSCHEDULER);
 
     case XEN_SYSCTL_perfc_op:
+    case XEN_SYSCTL_sched_hist:
+    case XEN_SYSCTL_domain_perf:
+    case XEN_SYSCTL_vcpu_sched_stats:
+#ifdef CONFIG_X86
+    case XEN_SYSCTL_hypercall_stats:
+#endif
         return domain_has_xen(current->domain, XEN__PERFCONTROL);
 
     case XEN_SYSCTL_debug_keys:
         return domain_has_xen(current->domain, XEN__DEBUG);
 
+    case XEN_SYSCTL_livepatch_op:
+        return avc_current_has_perm(SECINITSID_XEN, SECCLASS_XEN2,
+                                    XEN2__LIVEPATCH, NULL);
+
     case XEN_SYSCTL_getcpuinfo:
         return domain_has_xen(current->domain, XEN__GETCPUINFO);
 
@@ -1120,11 +1246,14 @@ static int flask_shadow_control(struct domain *d, uint32_t op)
     case XEN_DOMCTL_SHADOW_OP_ENABLE_TRANSLATE:
     case XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION:
     case XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION:
+    case XEN_DOMCTL_SHADOW_OP_GET_HASH_STATS:
         perm = SHADOW__ENABLE;
         break;
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_RING_ENABLE:
+    case XEN_DOMCTL_SHADOW_OP_RING_DRAIN:
         perm = SHADOW__LOGDIRTY;
         break;
     default:
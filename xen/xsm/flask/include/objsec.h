@@ -17,10 +17,31 @@
 #include "flask.h"
 #include "avc.h"
 
+/* Classes whose access vectors are cached per domain, see hooks.c */
+enum {
+    DSEC_PERM_GRANT,
+    DSEC_PERM_EVENT,
+    DSEC_PERM_MMU,
+    DSEC_PERM_CLASSES
+};
+
+#define DSEC_PERM_SLOTS 8   /* a power of 2 */
+
+struct domain_perm_cache {
+    unsigned int seq;      /* odd while being written */
+    int generation;        /* AVC generation the vectors were read at */
+    u32 ssid;
+    u32 tsid;
+    u32 valid;             /* bitmap of DSEC_PERM_* in allowed[] */
+    u32 allowed[DSEC_PERM_CLASSES];
+};
+
 struct domain_security_struct {
     u32 sid;               /* current SID */
     u32 self_sid;          /* SID for target when operating on DOMID_SELF */
     u32 target_sid;        /* SID for device model target domain */
+    spinlock_t perm_lock;  /* serialises writers of perm_cache[] */
+    struct domain_perm_cache perm_cache[DSEC_PERM_SLOTS];
 };
 
 struct evtchn_security_struct {